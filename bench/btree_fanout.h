@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __BENCH_BTREE_FANOUT_H__
+#define __BENCH_BTREE_FANOUT_H__
+
+struct btree_root;
+
+/* One build of repair's btree, for comparing node sizes. */
+struct bench_btree_ops {
+	unsigned int	key_max;
+	void		(*init)(struct btree_root **root);
+	void		(*destroy)(struct btree_root *root);
+	int		(*insert)(struct btree_root *root, unsigned long key,
+				void *value);
+	void		*(*lookup)(struct btree_root *root, unsigned long key);
+	void		*(*find)(struct btree_root *root, unsigned long key,
+				unsigned long *actual_key);
+	void		*(*lookup_next)(struct btree_root *root,
+				unsigned long *key);
+	void		*(*delete)(struct btree_root *root, unsigned long key);
+};
+
+extern const struct bench_btree_ops btree_fanout2_ops;
+extern const struct bench_btree_ops btree_fanout4_ops;
+extern const struct bench_btree_ops btree_fanout8_ops;
+
+/*
+ * Build repair's btree with BTREE_NODE_LINES cache line nodes and every
+ * public function renamed by BTREE_VARIANT(), then export them as
+ * BTREE_VARIANT(ops).  Each variant gets its own file that defines both
+ * and includes this with BTREE_FANOUT_BUILD set.
+ */
+#ifdef BTREE_FANOUT_BUILD
+#define btree_init		BTREE_VARIANT(init)
+#define btree_destroy		BTREE_VARIANT(destroy)
+#define btree_clear		BTREE_VARIANT(clear)
+#define btree_is_empty		BTREE_VARIANT(is_empty)
+#define btree_lookup		BTREE_VARIANT(lookup)
+#define btree_find		BTREE_VARIANT(find)
+#define btree_peek_prev		BTREE_VARIANT(peek_prev)
+#define btree_peek_next		BTREE_VARIANT(peek_next)
+#define btree_lookup_next	BTREE_VARIANT(lookup_next)
+#define btree_lookup_prev	BTREE_VARIANT(lookup_prev)
+#define btree_insert		BTREE_VARIANT(insert)
+#define btree_delete		BTREE_VARIANT(delete)
+#define btree_update_key	BTREE_VARIANT(update_key)
+#define btree_update_value	BTREE_VARIANT(update_value)
+
+#include "../repair/btree.c"
+
+const struct bench_btree_ops BTREE_VARIANT(ops) = {
+	.key_max	= BTREE_KEY_MAX,
+	.init		= btree_init,
+	.destroy	= btree_destroy,
+	.insert		= btree_insert,
+	.lookup		= btree_lookup,
+	.find		= btree_find,
+	.lookup_next	= btree_lookup_next,
+	.delete		= btree_delete,
+};
+#endif /* BTREE_FANOUT_BUILD */
+
+#endif /* __BENCH_BTREE_FANOUT_H__ */
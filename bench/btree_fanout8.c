@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#define BTREE_NODE_LINES	8
+#define BTREE_VARIANT(name)	btree_fanout8_##name
+#define BTREE_FANOUT_BUILD
+#include "btree_fanout.h"
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+/*
+ * Build repair's incore btree, range map and slab into the benchmark.  The
+ * slab only needs a few of repair's workqueue helpers and do_log, so provide
+ * those here rather than dragging in the rest of repair.
+ */
+#include "../repair/btree.c"
+#include "../repair/rangemap.c"
+#include "../repair/slab.c"
+
+void
+do_log(
+	char const		*msg,
+	...)
+{
+	va_list			args;
+
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+}
+
+static void
+bench_wq_error(
+	const char		*what,
+	int			err)
+{
+	fprintf(stderr, "xfs_bench: %s: %s\n", what, strerror(err));
+	exit(1);
+}
+
+void
+create_work_queue(
+	struct workqueue	*wq,
+	struct xfs_mount	*mp,
+	unsigned int		nworkers)
+{
+	int			err;
+
+	err = -workqueue_create(wq, mp, nworkers);
+	if (err)
+		bench_wq_error("creating workqueue", err);
+}
+
+void
+queue_work(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	int			err;
+
+	err = -workqueue_add(wq, func, agno, arg);
+	if (err)
+		bench_wq_error("queueing work", err);
+}
+
+void
+destroy_work_queue(
+	struct workqueue	*wq)
+{
+	int			err;
+
+	err = -workqueue_terminate(wq);
+	if (err)
+		bench_wq_error("terminating workqueue", err);
+	workqueue_destroy(wq);
+}
@@ -0,0 +1,772 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "xfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "platform_defs.h"
+#include "list.h"
+#include "libfrog/avl64.h"
+#include "libfrog/bitmap.h"
+#include "libfrog/radix-tree.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
+#include "btree.h"
+#include "slab.h"
+#include "rangemap.h"
+#include "btree_fanout.h"
+
+/*
+ * Data Structure Microbenchmarks
+ *
+ * Each benchmark builds one of the incore structures that repair and scrub
+ * lean on, about as big as the ones a large repair or scrub run builds,
+ * and times a few typical operations on it.  Every operation gets a line
+ * with the number of operations, the time per operation, the throughput,
+ * and how much the resident set size had grown since the benchmark
+ * started.  The workloads come from a fixed seed, so runs can be compared.
+ */
+
+static unsigned long long	nr_items = 1000000;
+static unsigned int		nr_threads;
+static uint64_t			seed = 1;
+static long			rss_base;
+static volatile uint64_t	sink;
+
+static uint64_t
+xorshift(
+	uint64_t		*state)
+{
+	uint64_t		x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Resident set size, in KiB. */
+static long
+rss_kib(void)
+{
+	FILE			*fp;
+	long			pages = 0;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%*s %ld", &pages) != 1)
+		pages = 0;
+	fclose(fp);
+	return pages * (getpagesize() / 1024);
+}
+
+static void
+report(
+	const char		*name,
+	uint64_t		ops,
+	uint64_t		start_ns)
+{
+	uint64_t		ns = max(now_ns() - start_ns, 1ULL);
+
+	ops = max(ops, 1ULL);
+	printf("%-22s %12llu %10.1f %14.0f %10ld\n", name,
+			(unsigned long long)ops, (double)ns / ops,
+			ops * 1e9 / ns, rss_kib() - rss_base);
+}
+
+static void
+alloc_fail(void)
+{
+	perror("xfs_bench");
+	exit(1);
+}
+
+/* The numbers 0 to nr_items - 1 in random order. */
+static uint64_t *
+shuffled(void)
+{
+	uint64_t		*order;
+	uint64_t		state = seed;
+	uint64_t		i, j, t;
+
+	order = malloc(nr_items * sizeof(uint64_t));
+	if (!order)
+		alloc_fail();
+	for (i = 0; i < nr_items; i++)
+		order[i] = i;
+	for (i = nr_items - 1; i > 0; i--) {
+		j = xorshift(&state) % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	return order;
+}
+
+/* Run @fn in every thread at once and wait for them all. */
+struct bench_thread {
+	pthread_t		thread;
+	pthread_barrier_t	*barrier;
+	void			(*fn)(unsigned int id, void *arg);
+	void			*arg;
+	unsigned int		id;
+};
+
+static void *
+bench_thread(
+	void			*arg)
+{
+	struct bench_thread	*bt = arg;
+
+	rcu_register_thread();
+	pthread_barrier_wait(bt->barrier);
+	bt->fn(bt->id, bt->arg);
+	rcu_unregister_thread();
+	return NULL;
+}
+
+static uint64_t
+run_threads(
+	void			(*fn)(unsigned int id, void *arg),
+	void			*arg)
+{
+	struct bench_thread	*bt;
+	pthread_barrier_t	barrier;
+	uint64_t		start;
+	unsigned int		i;
+
+	bt = calloc(nr_threads, sizeof(struct bench_thread));
+	if (!bt)
+		alloc_fail();
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (i = 0; i < nr_threads; i++) {
+		bt[i].barrier = &barrier;
+		bt[i].fn = fn;
+		bt[i].arg = arg;
+		bt[i].id = i;
+		if (pthread_create(&bt[i].thread, NULL, bench_thread, &bt[i])) {
+			perror("xfs_bench: pthread_create");
+			exit(1);
+		}
+	}
+
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(bt[i].thread, NULL);
+	pthread_barrier_destroy(&barrier);
+	free(bt);
+	return start;
+}
+
+/* Extent records, like repair's incore extent trees. */
+struct bench_extent {
+	avl64node_t		node;
+	uint64_t		start;
+	uint64_t		len;
+};
+
+static uint64_t
+bench_extent_start(
+	avl64node_t		*node)
+{
+	return container_of(node, struct bench_extent, node)->start;
+}
+
+static uint64_t
+bench_extent_end(
+	avl64node_t		*node)
+{
+	struct bench_extent	*ext;
+
+	ext = container_of(node, struct bench_extent, node);
+	return ext->start + ext->len;
+}
+
+static avl64ops_t bench_extent_ops = {
+	bench_extent_start,
+	bench_extent_end,
+};
+
+static void
+bench_avl64(void)
+{
+	avl64tree_desc_t	tree;
+	struct bench_extent	*ext;
+	avl64node_t		*node;
+	uint64_t		*order = shuffled();
+	uint64_t		start;
+	uint64_t		i, nr = 0;
+
+	ext = calloc(nr_items, sizeof(struct bench_extent));
+	if (!ext)
+		alloc_fail();
+	avl64_init_tree(&tree, &bench_extent_ops);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++) {
+		ext[i].start = order[i] * 32;
+		ext[i].len = 1 + order[i] % 16;
+		avl64_insert(&tree, &ext[i].node);
+	}
+	report("avl64.insert", nr_items, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (avl64_findrange(&tree, order[nr_items - 1 - i] * 32))
+			nr++;
+	sink = nr;
+	report("avl64.lookup", nr_items, start);
+
+	start = now_ns();
+	nr = 0;
+	for (node = tree.avl_firstino; node; node = node->avl_nextino)
+		nr++;
+	sink = nr;
+	report("avl64.iterate", nr, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		avl64_delete(&tree, &ext[i].node);
+	report("avl64.delete", nr_items, start);
+
+	free(ext);
+	free(order);
+}
+
+static int
+bench_count_range(
+	uint64_t		start,
+	uint64_t		len,
+	void			*arg)
+{
+	(*(uint64_t *)arg)++;
+	return 0;
+}
+
+static int
+bench_count_rangemap(
+	uint64_t		start,
+	uint64_t		end,
+	void			*value,
+	void			*arg)
+{
+	(*(uint64_t *)arg)++;
+	return 0;
+}
+
+/* The same extents and operations as the avl64 benchmark. */
+static void
+bench_rangemap(void)
+{
+	struct rangemap		map;
+	struct bench_extent	*ext;
+	uint64_t		*order = shuffled();
+	uint64_t		start;
+	uint64_t		i, nr = 0;
+
+	ext = calloc(nr_items, sizeof(struct bench_extent));
+	if (!ext)
+		alloc_fail();
+	rangemap_init(&map);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++) {
+		ext[i].start = order[i] * 32;
+		ext[i].len = 1 + order[i] % 16;
+		if (rangemap_insert(&map, ext[i].start,
+				ext[i].start + ext[i].len, &ext[i]))
+			alloc_fail();
+	}
+	report("rangemap.insert", nr_items, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (rangemap_find(&map, order[nr_items - 1 - i] * 32))
+			nr++;
+	sink = nr;
+	report("rangemap.lookup", nr_items, start);
+
+	start = now_ns();
+	nr = 0;
+	rangemap_walk(&map, bench_count_rangemap, &nr);
+	sink = nr;
+	report("rangemap.iterate", nr, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		rangemap_delete(&map, ext[i].start);
+	report("rangemap.delete", nr_items, start);
+
+	rangemap_destroy(&map);
+	free(ext);
+	free(order);
+}
+
+static void
+bench_bitmap(void)
+{
+	struct bitmap		*bmap;
+	uint64_t		state = seed;
+	uint64_t		start;
+	uint64_t		i, nr = 0;
+	int			ret;
+
+	/* Scattered bad byte ranges on a 1TiB disk, as in scrub phase 6. */
+	ret = bitmap_alloc(&bmap);
+	if (ret)
+		alloc_fail();
+	start = now_ns();
+	for (i = 0; i < nr_items; i++) {
+		uint64_t	r = xorshift(&state);
+
+		ret = bitmap_set(bmap, (r % (1ULL << 40)) & ~4095ULL,
+				4096ULL << (r >> 61));
+		if (ret)
+			alloc_fail();
+	}
+	report("bitmap.set_ranges", nr_items, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (bitmap_test(bmap, xorshift(&state) % (1ULL << 40), 4096))
+			nr++;
+	sink = nr;
+	report("bitmap.test", nr_items, start);
+
+	start = now_ns();
+	nr = 0;
+	bitmap_iterate(bmap, bench_count_range, &nr);
+	report("bitmap.iterate", nr, start);
+	bitmap_free(&bmap);
+
+	/* Changed inode numbers in bulkstat order, as in incremental scrub. */
+	ret = bitmap_alloc(&bmap);
+	if (ret)
+		alloc_fail();
+	start = now_ns();
+	for (i = 0; i < nr_items; i++) {
+		ret = bitmap_set(bmap, i * 3 + (xorshift(&state) & 1), 1);
+		if (ret)
+			alloc_fail();
+	}
+	report("bitmap.set_bits", nr_items, start);
+	bitmap_free(&bmap);
+}
+
+struct bench_radix {
+	struct radix_tree_root	root;
+	uint64_t		*order;
+};
+
+static void
+bench_radix_lookup_fn(
+	unsigned int		id,
+	void			*arg)
+{
+	struct bench_radix	*br = arg;
+	uint64_t		i, nr = 0;
+
+	for (i = id; i < nr_items; i += nr_threads) {
+		rcu_read_lock();
+		if (radix_tree_lookup(&br->root, br->order[i] * 2))
+			nr++;
+		rcu_read_unlock();
+	}
+	sink = nr;
+}
+
+static void
+bench_radix(void)
+{
+	struct bench_radix	br = { .order = shuffled() };
+	void			*batch[64];
+	uint64_t		start;
+	uint64_t		i, nr = 0;
+	unsigned long		next = 0;
+	unsigned int		found;
+
+	INIT_RADIX_TREE(&br.root, 0);
+
+	/* Inode chunk numbers, as in repair's uncertain inode index. */
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (radix_tree_insert(&br.root, br.order[i] * 2,
+				(void *)(uintptr_t)(br.order[i] * 8 + 8)))
+			alloc_fail();
+	report("radix.insert", nr_items, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (radix_tree_lookup(&br.root, br.order[nr_items - 1 - i] * 2))
+			nr++;
+	sink = nr;
+	report("radix.lookup", nr_items, start);
+
+	start = run_threads(bench_radix_lookup_fn, &br);
+	report("radix.lookup_mt", nr_items, start);
+
+	start = now_ns();
+	nr = 0;
+	while ((found = radix_tree_gang_lookup(&br.root, batch, next,
+			ARRAY_SIZE(batch))) > 0) {
+		nr += found;
+		next = ((uintptr_t)batch[found - 1] - 8) / 4 + 1;
+	}
+	report("radix.gang_lookup", nr, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		radix_tree_delete(&br.root, br.order[i] * 2);
+	report("radix.delete", nr_items, start);
+
+	free(br.order);
+}
+
+static void
+bench_wq_fn(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	sink = index;
+}
+
+static void
+bench_workqueue(void)
+{
+	struct workqueue	wq;
+	struct workqueue_work	work[64];
+	uint64_t		start;
+	uint64_t		i;
+	unsigned int		j;
+
+	if (workqueue_create(&wq, NULL, nr_threads))
+		alloc_fail();
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (workqueue_add(&wq, bench_wq_fn, i, NULL))
+			alloc_fail();
+	workqueue_terminate(&wq);
+	report("workqueue.add", nr_items, start);
+	workqueue_destroy(&wq);
+
+	if (workqueue_create(&wq, NULL, nr_threads))
+		alloc_fail();
+	start = now_ns();
+	for (i = 0; i < nr_items; i += j) {
+		for (j = 0; j < ARRAY_SIZE(work) && i + j < nr_items; j++) {
+			work[j].function = bench_wq_fn;
+			work[j].index = i + j;
+			work[j].arg = NULL;
+		}
+		if (workqueue_add_batch(&wq, work, j))
+			alloc_fail();
+	}
+	workqueue_terminate(&wq);
+	report("workqueue.add_batch", nr_items, start);
+	workqueue_destroy(&wq);
+}
+
+static void
+bench_ptvar_fn(
+	unsigned int		id,
+	void			*arg)
+{
+	struct ptvar		*ptv = arg;
+	uint64_t		*counter;
+	uint64_t		i;
+	int			ret;
+
+	for (i = id; i < nr_items; i += nr_threads) {
+		counter = ptvar_get(ptv, &ret);
+		if (ret)
+			return;
+		(*counter)++;
+	}
+}
+
+static void
+bench_ptvar(void)
+{
+	struct ptvar		*ptv;
+	uint64_t		start;
+
+	if (ptvar_alloc(nr_threads + 1, sizeof(uint64_t), &ptv))
+		alloc_fail();
+	start = run_threads(bench_ptvar_fn, ptv);
+	report("ptvar.get_mt", nr_items, start);
+	ptvar_free(ptv);
+}
+
+static void
+bench_btree(void)
+{
+	struct btree_root	*root;
+	uint64_t		*order = shuffled();
+	unsigned long		key;
+	uint64_t		start;
+	uint64_t		i, nr = 0;
+	void			*v;
+
+	btree_init(&root);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (btree_insert(root, order[i] * 2,
+				(void *)(uintptr_t)(order[i] * 8 + 8)))
+			alloc_fail();
+	report("btree.insert", nr_items, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (btree_lookup(root, order[nr_items - 1 - i] * 2))
+			nr++;
+	sink = nr;
+	report("btree.lookup", nr_items, start);
+
+	start = now_ns();
+	nr = 0;
+	for (v = btree_find(root, 0, &key); v; v = btree_lookup_next(root, &key))
+		nr++;
+	report("btree.iterate", nr, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		btree_delete(root, order[i] * 2);
+	report("btree.delete", nr_items, start);
+
+	btree_destroy(root);
+	free(order);
+}
+
+/*
+ * The same workload as above, plus searches for keys that aren't in the
+ * tree, run against builds of the btree with different node sizes.
+ */
+static void
+bench_btree_variant(
+	const struct bench_btree_ops	*ops,
+	const uint64_t			*order)
+{
+	struct btree_root		*root;
+	char				name[32];
+	unsigned long			key;
+	uint64_t			start;
+	uint64_t			i, nr = 0;
+	void				*v;
+
+	ops->init(&root);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (ops->insert(root, order[i] * 2,
+				(void *)(uintptr_t)(order[i] * 8 + 8)))
+			alloc_fail();
+	snprintf(name, sizeof(name), "btree%u.insert", ops->key_max);
+	report(name, nr_items, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (ops->lookup(root, order[nr_items - 1 - i] * 2))
+			nr++;
+	snprintf(name, sizeof(name), "btree%u.lookup", ops->key_max);
+	report(name, nr_items, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		if (ops->find(root, order[i] * 2 + 1, &key))
+			nr++;
+	sink = nr;
+	snprintf(name, sizeof(name), "btree%u.find", ops->key_max);
+	report(name, nr_items, start);
+
+	start = now_ns();
+	nr = 0;
+	for (v = ops->find(root, 0, &key); v; v = ops->lookup_next(root, &key))
+		nr++;
+	snprintf(name, sizeof(name), "btree%u.iterate", ops->key_max);
+	report(name, nr, start);
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++)
+		ops->delete(root, order[i] * 2);
+	snprintf(name, sizeof(name), "btree%u.delete", ops->key_max);
+	report(name, nr_items, start);
+
+	ops->destroy(root);
+}
+
+static void
+bench_btree_fanout(void)
+{
+	static const struct bench_btree_ops	*variants[] = {
+		&btree_fanout2_ops,
+		&btree_fanout4_ops,
+		&btree_fanout8_ops,
+	};
+	uint64_t		*order = shuffled();
+	unsigned int		i;
+
+	for (i = 0; i < ARRAY_SIZE(variants); i++) {
+		rss_base = rss_kib();
+		bench_btree_variant(variants[i], order);
+	}
+	free(order);
+}
+
+/* Records about the size of repair's reverse mapping records. */
+struct bench_rec {
+	uint64_t		key;
+	uint64_t		pad[2];
+};
+
+static int
+bench_rec_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct bench_rec	*ra = a;
+	const struct bench_rec	*rb = b;
+
+	if (ra->key < rb->key)
+		return -1;
+	return ra->key > rb->key;
+}
+
+static void
+bench_slab(void)
+{
+	struct xfs_slab		*slab;
+	struct xfs_slab_cursor	*cur;
+	struct bench_rec	rec = { 0 };
+	uint64_t		state = seed;
+	uint64_t		start;
+	uint64_t		i, nr = 0;
+
+	if (init_slab(&slab, sizeof(struct bench_rec)))
+		alloc_fail();
+
+	start = now_ns();
+	for (i = 0; i < nr_items; i++) {
+		rec.key = xorshift(&state);
+		if (slab_add(slab, &rec))
+			alloc_fail();
+	}
+	report("slab.add", nr_items, start);
+
+	start = now_ns();
+	qsort_slab(slab, bench_rec_cmp);
+	report("slab.sort", nr_items, start);
+
+	start = now_ns();
+	if (init_slab_cursor(slab, bench_rec_cmp, &cur))
+		alloc_fail();
+	while (pop_slab_cursor(cur))
+		nr++;
+	free_slab_cursor(&cur);
+	report("slab.walk", nr, start);
+
+	free_slab(&slab);
+}
+
+static const struct {
+	const char		*name;
+	void			(*fn)(void);
+} benches[] = {
+	{ "avl64",	bench_avl64 },
+	{ "rangemap",	bench_rangemap },
+	{ "bitmap",	bench_bitmap },
+	{ "radix",	bench_radix },
+	{ "workqueue",	bench_workqueue },
+	{ "ptvar",	bench_ptvar },
+	{ "btree",	bench_btree },
+	{ "btree_fanout", bench_btree_fanout },
+	{ "slab",	bench_slab },
+};
+
+static void __attribute__((noreturn))
+usage(void)
+{
+	unsigned int		i;
+
+	fprintf(stderr,
+"Usage: xfs_bench [-n items] [-s seed] [-t threads] [benchmark...]\n"
+"\n"
+"Benchmarks:");
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int
+main(
+	int			argc,
+	char			**argv)
+{
+	unsigned int		i;
+	int			c, a;
+	bool			run;
+
+	nr_threads = platform_nproc();
+	while ((c = getopt(argc, argv, "n:s:t:")) != EOF) {
+		switch (c) {
+		case 'n':
+			nr_items = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nr_items < 1 || nr_threads < 1 || seed == 0)
+		usage();
+	for (a = optind; a < argc; a++) {
+		for (i = 0; i < ARRAY_SIZE(benches); i++)
+			if (!strcmp(argv[a], benches[i].name))
+				break;
+		if (i == ARRAY_SIZE(benches))
+			usage();
+	}
+
+	rcu_init();
+	rcu_register_thread();
+	radix_tree_init();
+
+	printf("%llu items, %u threads, seed %llu\n", nr_items, nr_threads,
+			(unsigned long long)seed);
+	printf("%-22s %12s %10s %14s %10s\n", "operation", "ops", "ns/op",
+			"ops/s", "RSS KiB");
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		run = optind == argc;
+		for (a = optind; a < argc && !run; a++)
+			run = !strcmp(argv[a], benches[i].name);
+		if (!run)
+			continue;
+
+		rss_base = rss_kib();
+		benches[i].fn();
+	}
+
+	rcu_unregister_thread();
+	return 0;
+}
@@ -7,12 +7,14 @@
 #include "libxfs.h"
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include "xfs_copy.h"
 #include "libxlog.h"
 #include "libfrog/platform.h"
+#include "libfrog/ioring.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 #define uuid_equal(s,d) (platform_uuid_compare((s),(d)) == 0)
@@ -28,6 +30,10 @@ static int		source_fd;
 
 static unsigned int	source_blocksize;	/* source filesystem blocksize */
 static unsigned int	source_sectorsize;	/* source disk sectorsize */
+static bool		range_copy;	/* targets copy extents from the source */
+static int		resync;		/* rewrite only what differs */
+static xfs_daddr_t	log_begin;	/* resync: skip the log, it's reformatted */
+static xfs_daddr_t	log_end;
 
 static xfs_agblock_t	first_agbno;
 
@@ -37,15 +43,17 @@ static unsigned int	num_targets;
 static target_control	*target;
 
 static wbuf		w_buf;
-static wbuf		btree_buf;
+
+static pthread_mutex_t	reader_lock = PTHREAD_MUTEX_INITIALIZER;
+static xfs_agnumber_t	next_agno;	/* next AG for a reader to copy */
+static uint64_t		numblocks;	/* copied so far, for the bar */
+static int		howfar;
 
 static unsigned int	kids;
 
 static thread_control	glob_masks;
 static thread_args	*targ;
 
-static pthread_mutex_t	mainwait;
-
 #define ACTIVE		1
 #define INACTIVE	2
 
@@ -183,6 +191,88 @@ check_errors(void)
 	}
 }
 
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+ * Copy the range described by @buf straight from the source file.  Share
+ * the blocks if the target file is on the same filesystem and that can
+ * reflink, otherwise let copy_file_range copy them in the kernel.
+ */
+static int
+do_range_write(
+	thread_args		*args,
+	wbuf			*buf)
+{
+	struct xfs_clone_args	clone;
+	loff_t			src_off = buf->position;
+	loff_t			dst_off = buf->position;
+	size_t			len = buf->length;
+	ssize_t			res;
+
+	if (!args->no_clone) {
+		clone.src_fd = source_fd;
+		clone.src_offset = buf->position;
+		clone.src_length = buf->length;
+		clone.dest_offset = buf->position;
+		if (ioctl(args->fd, XFS_IOC_CLONE_RANGE, &clone) == 0) {
+			target[args->id].position = buf->position + buf->length;
+			return 0;
+		}
+		/* an unaligned range can't be shared, but the next one may be */
+		if (errno != EINVAL)
+			args->no_clone = true;
+	}
+
+	while (len > 0) {
+		res = syscall(__NR_copy_file_range, source_fd, &src_off,
+				args->fd, &dst_off, len, 0);
+		if (res < 0) {
+			target[args->id].error = errno;
+			target[args->id].position = dst_off;
+			return 2;
+		}
+		if (res == 0)		/* end of the source file */
+			break;
+		len -= res;
+	}
+	target[args->id].position = dst_off;
+	return 0;
+}
+
+/*
+ * Can used extents go straight from the source file to target @fd?  Try
+ * copying the first sector, which the AG 0 header overwrites later.
+ */
+static bool
+range_copy_ok(
+	int		fd)
+{
+	struct stat	st;
+	loff_t		src_off = 0;
+	loff_t		dst_off = 0;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return false;
+	return syscall(__NR_copy_file_range, source_fd, &src_off, fd,
+			&dst_off, source_sectorsize, 0) == source_sectorsize;
+}
+#else
+static int
+do_range_write(
+	thread_args	*args,
+	wbuf		*buf)
+{
+	ASSERT(0);
+	return 2;
+}
+
+static bool
+range_copy_ok(
+	int		fd)
+{
+	return false;
+}
+#endif
+
 /*
  * don't have to worry about alignment and mins because those
  * are taken care of when the buffer's read in
@@ -193,57 +283,276 @@ do_write(
 	wbuf		*buf)
 {
 	int		res;
-	int		error = 0;
 
 	if (!buf)
 		buf = &w_buf;
+	if (buf->range)
+		return do_range_write(args, buf);
 
-	if (target[args->id].position != buf->position)  {
-		if (lseek(args->fd, buf->position, SEEK_SET) < 0)  {
-			error = target[args->id].err_type = 1;
-		} else  {
-			target[args->id].position = buf->position;
-		}
+	/*
+	 * Use positional writes so that the file offset doesn't need to be
+	 * tracked across the writes that the target threads submit through
+	 * io_uring.
+	 */
+	res = pwrite(args->fd, buf->data, buf->length, buf->position);
+	if (res != buf->length) {
+		target[args->id].error = res < 0 ? errno : EIO;
+		target[args->id].position = buf->position;
+		return 2;
 	}
+	target[args->id].position = buf->position + res;
+	return 0;
+}
 
-	if ((res = write(target[args->id].fd, buf->data,
-				buf->length)) == buf->length)  {
-		target[args->id].position += res;
-	} else  {
-		error = 2;
-	}
+/* Drop a target's hold on a ring buffer.  Call with glob_masks locked. */
+static void
+wbuf_slot_put(
+	unsigned long	seq)
+{
+	wbuf_slot	*slot = &glob_masks.ring[seq % WBUF_RING_SIZE];
 
-	if (error) {
+	if (--slot->refs == 0)
+		pthread_cond_broadcast(&glob_masks.written_cond);
+}
+
+/*
+ * Return the first buffer from @seq on that a reader hasn't queued yet.
+ * Call with glob_masks locked.
+ */
+static unsigned long
+wbuf_ring_ready(
+	unsigned long	seq)
+{
+	while (glob_masks.ring[seq % WBUF_RING_SIZE].seq == seq + 1)
+		seq++;
+	return seq;
+}
+
+/* Wait until a reader has queued buffer @seq and return it. */
+static wbuf *
+wbuf_ring_wait(
+	unsigned long	seq)
+{
+	pthread_mutex_lock(&glob_masks.mutex);
+	while (wbuf_ring_ready(seq) == seq)
+		pthread_cond_wait(&glob_masks.queued_cond, &glob_masks.mutex);
+	pthread_mutex_unlock(&glob_masks.mutex);
+
+	return &glob_masks.ring[seq % WBUF_RING_SIZE].buf;
+}
+
+/*
+ * Resync: read what the target already has where @buf goes and write only
+ * the runs of I/O units that differ, so an up to date target is only read.
+ */
+static int
+do_resync_write(
+	thread_args	*args,
+	wbuf		*buf)
+{
+	size_t		unit = buf->min_io_size;
+	size_t		start, end;
+	ssize_t		res;
+
+	res = pread(args->fd, args->cmp_buf, buf->length, buf->position);
+	if (res < 0) {
 		target[args->id].error = errno;
 		target[args->id].position = buf->position;
+		return 2;
+	}
+	if (res < buf->length)
+		memset(args->cmp_buf + res, 0, buf->length - res);
+	args->cmp_bytes += buf->length;
+
+	for (start = 0; start < buf->length; start = end) {
+		if (memcmp(buf->data + start, args->cmp_buf + start,
+				min(unit, buf->length - start)) == 0) {
+			end = start + unit;
+			continue;
+		}
+		for (end = start + unit; end < buf->length; end += unit)
+			if (memcmp(buf->data + end, args->cmp_buf + end,
+					min(unit, buf->length - end)) == 0)
+				break;
+		end = min(end, (size_t)buf->length);
+
+		res = pwrite(args->fd, buf->data + start, end - start,
+				buf->position + start);
+		if (res != end - start) {
+			target[args->id].error = res < 0 ? errno : EIO;
+			target[args->id].position = buf->position + start;
+			return 2;
+		}
+		args->diff_bytes += end - start;
+	}
+	target[args->id].position = buf->position + buf->length;
+	return 0;
+}
+
+/* One write at a time, for when io_uring isn't available. */
+static int
+write_ring_sync(
+	thread_args	*args)
+{
+	wbuf		*buf;
+	int		error;
+
+	for (;;) {
+		buf = wbuf_ring_wait(args->next);
+		if (buf->length) {
+			if (resync)
+				error = do_resync_write(args, buf);
+			else
+				error = do_write(args, buf);
+			if (error)
+				return error;
+		}
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		wbuf_slot_put(args->next++);
+		pthread_mutex_unlock(&glob_masks.mutex);
+	}
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Keep every buffer the reader has queued in flight until the ring is full.
+ * Writes can complete out of order, but buffers are handed back to the
+ * reader in order so that args->next always says which ones we still hold.
+ * Returns 0 if the kernel can't do io_uring writes and we should fall back
+ * to write_ring_sync.
+ */
+static int
+write_ring_async(
+	thread_args		*args,
+	struct ioring		*ring)
+{
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	wbuf			*buf;
+	bool			written[WBUF_RING_SIZE] = { false };
+	unsigned long		submit = args->next;
+	unsigned long		queued;
+	unsigned long		seq;
+	unsigned int		inflight = 0;
+	bool			sync_only = false;
+	int			res;
+	int			error = 0;
+
+	while (!error) {
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (!inflight && !sync_only &&
+		       wbuf_ring_ready(submit) == submit)
+			pthread_cond_wait(&glob_masks.queued_cond,
+					&glob_masks.mutex);
+		queued = wbuf_ring_ready(submit);
+		pthread_mutex_unlock(&glob_masks.mutex);
+
+		if (sync_only && !inflight)
+			return 0;
+
+		for (; !sync_only && submit < queued; submit++) {
+			buf = &glob_masks.ring[submit % WBUF_RING_SIZE].buf;
+			if (!buf->length) {
+				/* a reader had nothing more to copy */
+				written[submit % WBUF_RING_SIZE] = true;
+				continue;
+			}
+			if (buf->range) {
+				/* not an I/O, the kernel copies it for us */
+				error = do_write(args, buf);
+				if (error)
+					break;
+				written[submit % WBUF_RING_SIZE] = true;
+				continue;
+			}
+			sqe = ioring_get_sqe(ring);
+			if (!sqe)
+				break;
+			ioring_prep_rw(sqe, IORING_OP_WRITE, args->fd,
+					buf->data, buf->length, buf->position,
+					submit);
+			inflight++;
+		}
+
+		res = ioring_submit(ring, inflight ? 1 : 0);
+		if (res < 0) {
+			target[args->id].error = -res;
+			error = 2;
+			break;
+		}
+
+		while ((cqe = ioring_peek_cqe(ring)) != NULL) {
+			seq = cqe->user_data;
+			res = cqe->res;
+			ioring_cqe_seen(ring);
+			inflight--;
+
+			buf = &glob_masks.ring[seq % WBUF_RING_SIZE].buf;
+			if (res == -EINVAL && !error) {
+				/* kernel too old for IORING_OP_WRITE? */
+				sync_only = true;
+				error = do_write(args, buf);
+			} else if (res != buf->length && !error) {
+				target[args->id].error = res < 0 ? -res : EIO;
+				target[args->id].position = buf->position;
+				error = 2;
+			}
+			written[seq % WBUF_RING_SIZE] = true;
+		}
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (args->next < submit &&
+		       written[args->next % WBUF_RING_SIZE]) {
+			written[args->next % WBUF_RING_SIZE] = false;
+			wbuf_slot_put(args->next++);
+		}
+		pthread_mutex_unlock(&glob_masks.mutex);
+	}
+
+	/*
+	 * The buffers still in flight can't be reused until they're done.
+	 * Whatever the kernel never took won't complete.
+	 */
+	inflight -= ioring_sq_pending(ring);
+	while (inflight && ioring_wait_cqe(ring, &cqe) == 0) {
+		ioring_cqe_seen(ring);
+		inflight--;
 	}
 	return error;
 }
+#endif
 
 static void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	int		error = 0;
+#ifdef HAVE_IO_URING
+	struct ioring	ring;
+#endif
 
 	rcu_register_thread();
-	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args, NULL))
-			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
-		pthread_mutex_unlock(&glob_masks.mutex);
+#ifdef HAVE_IO_URING
+	/* resync has to read the target before it knows what to write */
+	if (!resync && ioring_init(&ring, WBUF_RING_SIZE, 0) == 0) {
+		error = write_ring_async(args, &ring);
+		ioring_free(&ring);
 	}
-	/* NOTREACHED */
-
-handle_error:
-	/* error will be logged by primary thread */
+#endif
+	if (!error)
+		error = write_ring_sync(args);
 
+	/*
+	 * Error will be logged by primary thread.  Give back the buffers we
+	 * hold so that the reader doesn't wait for us.
+	 */
 	pthread_mutex_lock(&glob_masks.mutex);
 	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
+	for (; args->next < glob_masks.reserved; args->next++)
+		if (glob_masks.ring[args->next % WBUF_RING_SIZE].seq ==
+				args->next + 1)
+			wbuf_slot_put(args->next);
 	pthread_mutex_unlock(&glob_masks.mutex);
 	rcu_unregister_thread();
 	pthread_exit(NULL);
@@ -316,7 +625,7 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-		_("Usage: %s [-bdV] [-L logfile] source target [target ...]\n"),
+		_("Usage: %s [-bdrV] [-L logfile] source target [target ...]\n"),
 		progname);
 	exit(1);
 }
@@ -360,8 +669,6 @@ bump_bar(int tenths, uint64_t numblocks)
 	return tenths;
 }
 
-static xfs_off_t source_position = -1;
-
 static wbuf *
 wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 {
@@ -376,6 +683,7 @@ wbuf_init(wbuf *buf, int data_size, int data_align, int min_io_size, int id)
 	buf->min_io_size = min_io_size;
 	buf->size = data_size;
 	buf->id = id;
+	buf->range = false;
 	return buf;
 }
 
@@ -383,7 +691,6 @@ static void
 read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 {
 	int		res = 0;
-	xfs_off_t	lres = 0;
 	xfs_off_t	newpos;
 	size_t		diff;
 
@@ -396,17 +703,7 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		buf->length += diff;
 	}
 
-	if (source_position != buf->position)  {
-		lres = lseek(fd, buf->position, SEEK_SET);
-		if (lres < 0LL)  {
-			do_warn(_("%s:  lseek failure at offset %lld\n"),
-				progname, source_position);
-			die_perror();
-		}
-		source_position = buf->position;
-	}
-
-	ASSERT(source_position % source_sectorsize == 0);
+	ASSERT(buf->position % source_sectorsize == 0);
 
 	/* round up length for direct I/O if necessary */
 
@@ -419,18 +716,18 @@ read_wbuf(int fd, wbuf *buf, xfs_mount_t *mp)
 		exit(1);
 	}
 
-	if ((res = read(fd, buf->data, buf->length)) < 0)  {
+	/* positional reads, as several AG readers share the source */
+	if ((res = pread(fd, buf->data, buf->length, buf->position)) < 0)  {
 		do_warn(_("%s:  read failure at offset %lld\n"),
-				progname, source_position);
+				progname, buf->position);
 		die_perror();
 	}
 
 	if (res < buf->length &&
-	    source_position + res == mp->m_sb.sb_dblocks * source_blocksize)
+	    buf->position + res == mp->m_sb.sb_dblocks * source_blocksize)
 		res = buf->length;
 	else
 		ASSERT(res == buf->length);
-	source_position += res;
 	buf->length = res;
 }
 
@@ -481,36 +778,372 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
+/* Point @buf at the next buffer of the ring once the targets are done with it. */
 static void
-write_wbuf(void)
+wbuf_ring_get(
+	wbuf		*buf)
 {
-	int		i;
-	int		badness = 0;
+	wbuf_slot	*slot;
+	unsigned long	prev;
 
-	/* verify target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+	pthread_mutex_lock(&glob_masks.mutex);
+	buf->seq = glob_masks.reserved++;
+	slot = &glob_masks.ring[buf->seq % WBUF_RING_SIZE];
+
+	/*
+	 * Another reader may be waiting for this slot with an earlier buffer,
+	 * and the targets need that one first, so wait for our turn.
+	 */
+	prev = buf->seq < WBUF_RING_SIZE ? 0 : buf->seq - WBUF_RING_SIZE + 1;
+	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
+	while (slot->refs > 0 || slot->busy || slot->seq != prev)
+		pthread_cond_wait(&glob_masks.written_cond, &glob_masks.mutex);
+	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	slot->busy = true;
+	pthread_mutex_unlock(&glob_masks.mutex);
+
+	buf->data = slot->buf.data;
+}
+
+/*
+ * Hand a filled ring buffer to the active targets.  Returns the number of
+ * targets that will write it.
+ */
+static int
+wbuf_ring_queue(
+	wbuf		*buf)
+{
+	wbuf_slot	*slot = &glob_masks.ring[buf->seq % WBUF_RING_SIZE];
+	int		i;
+	int		active = 0;
 
-	/* release target threads */
+	pthread_mutex_lock(&glob_masks.mutex);
 	for (i = 0; i < num_targets; i++)
 		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
-		else
-			badness++;
+			active++;
+
+	ASSERT(slot->busy && slot->buf.data == buf->data);
+	slot->buf = *buf;
+	slot->busy = false;
+	slot->refs = active;
+	slot->seq = buf->seq + 1;
+	pthread_cond_broadcast(&glob_masks.queued_cond);
+	if (!active)
+		pthread_cond_broadcast(&glob_masks.written_cond);
+	pthread_mutex_unlock(&glob_masks.mutex);
+	return active;
+}
 
+/* Queue @buf for the target threads and point it at a fresh buffer. */
+static void
+write_wbuf(
+	wbuf		*buf)
+{
 	/*
 	 * If all the targets are inactive then there won't be any io
-	 * threads left to release mainwait.  We're screwed, so bail out.
+	 * threads left to write the buffer.  We're screwed, so bail out.
 	 */
-	if (badness == num_targets) {
+	if (wbuf_ring_queue(buf) == 0) {
 		check_errors();
 		exit(1);
 	}
+	wbuf_ring_get(buf);
+}
 
+/* A reader is done; queue its last buffer empty so the targets skip it. */
+static void
+wbuf_ring_put(
+	wbuf		*buf)
+{
+	buf->length = 0;
+	wbuf_ring_queue(buf);
+}
+
+/* Wait for the target threads to write everything queued so far. */
+static void
+wait_for_writes(void)
+{
+	int		i;
+
+	pthread_mutex_lock(&glob_masks.mutex);
 	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
-	pthread_mutex_lock(&mainwait);
+	for (i = 0; i < WBUF_RING_SIZE; i++)
+		while (glob_masks.ring[i].refs > 0 || glob_masks.ring[i].busy)
+			pthread_cond_wait(&glob_masks.written_cond,
+					&glob_masks.mutex);
 	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	pthread_mutex_unlock(&glob_masks.mutex);
+}
+
+static void
+copy_progress(
+	uint64_t	blocks)
+{
+	pthread_mutex_lock(&reader_lock);
+	numblocks += blocks;
+	howfar = bump_bar(howfar, numblocks);
+	pthread_mutex_unlock(&reader_lock);
+}
+
+/*
+ * Copy @sizeb sectors from @begin, rounded up to the I/O size.
+ * Let the lower layer do the alignment.
+ */
+static void
+copy_extent(
+	ag_reader	*rd,
+	xfs_daddr_t	begin,
+	uint64_t	sizeb)
+{
+	wbuf		*w = &rd->w_buf;
+	uint64_t	size;
+	uint64_t	blocks;
+	int		wblocks = w->size / BBSIZE;
+
+	/* the log is formatted afresh on the targets, don't resync it */
+	if (begin < log_end && begin + (xfs_daddr_t)sizeb > log_begin) {
+		if (begin < log_begin)
+			copy_extent(rd, begin, log_begin - begin);
+		if (begin + (xfs_daddr_t)sizeb > log_end)
+			copy_extent(rd, log_end, begin + sizeb - log_end);
+		copy_progress(min(begin + (xfs_daddr_t)sizeb, log_end) -
+				max(begin, log_begin));
+		return;
+	}
+
+	size = roundup(sizeb << BBSHIFT, w->min_io_size);
+	if (size == 0)
+		return;
+
+	w->position = (xfs_off_t) begin << BBSHIFT;
+
+	if (range_copy)  {
+		/* the targets copy the whole extent from the source */
+		w->length = min(size, rd->mp->m_sb.sb_dblocks *
+				source_blocksize - w->position);
+		w->range = true;
+		write_wbuf(w);
+		w->range = false;
+		copy_progress(sizeb);
+		return;
+	}
+
+	while (size > 0)  {
+		if (size > w->size)  {
+			w->length = w->size;
+			size -= w->size;
+			sizeb -= wblocks;
+			blocks = wblocks;
+		} else  {
+			w->length = size;
+			blocks = sizeb;
+			size = 0;
+		}
+
+		read_wbuf(source_fd, w, rd->mp);
+		write_wbuf(w);
+
+		w->position += w->length;
+
+		copy_progress(blocks);
+	}
+}
+
+/*
+ * Copy the AG headers and everything in the AG that the by-block free
+ * space btree doesn't say is free.
+ */
+static void
+copy_ag(
+	ag_reader		*rd,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_mount	*mp = rd->mp;
+	wbuf			*w = &rd->w_buf;
+	wbuf			*btree_buf = &rd->btree_buf;
+	ag_header_t		ag_hdr;
+	xfs_off_t		pos;
+	size_t			length;
+	uint			btree_levels, current_level;
+	xfs_agblock_t		bno;
+	xfs_daddr_t		begin, next_begin, ag_begin, new_begin, ag_end;
+	struct xfs_btree_block	*block;
+	xfs_alloc_ptr_t		*ptr;
+	xfs_alloc_rec_t		*rec_ptr;
+	int			i;
+
+	/* read in first blocks of the ag */
+
+	read_ag_header(source_fd, agno, w, &ag_hdr, mp,
+		source_blocksize, source_sectorsize);
+
+	/* set the in_progress bit for the first AG */
+
+	if (agno == 0)
+		ag_hdr.xfs_sb->sb_inprogress = 1;
+
+	/* save what we need (agf) in the btree buffer */
+
+	memmove(btree_buf->data, ag_hdr.xfs_agf, source_sectorsize);
+	ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf->data;
+	btree_buf->length = source_blocksize;
+
+	/* write the ag header out */
+
+	write_wbuf(w);
+
+	/* traverse btree until we get to the leftmost leaf node */
+
+	bno = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
+	current_level = 0;
+	btree_levels = be32_to_cpu(ag_hdr.xfs_agf->
+					agf_levels[XFS_BTNUM_BNOi]);
+
+	ag_end = XFS_AGB_TO_DADDR(mp, agno,
+			be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
+			+ source_blocksize / BBSIZE;
+
+	for (;;) {
+		/* none of this touches the w_buf buffer */
+
+		if (current_level >= btree_levels) {
+			do_log(
+		_("Error: current level %d >= btree levels %d\n"),
+				current_level, btree_levels);
+			exit(1);
+		}
+
+		current_level++;
+
+		btree_buf->position = pos = (xfs_off_t)
+			XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
+		btree_buf->length = source_blocksize;
+
+		read_wbuf(source_fd, btree_buf, mp);
+		block = (struct xfs_btree_block *)
+			 ((char *)btree_buf->data +
+			  pos - btree_buf->position);
+
+		if (be32_to_cpu(block->bb_magic) !=
+		    (xfs_has_crc(mp) ?
+		     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
+			do_log(_("Bad btree magic 0x%x\n"),
+			        be32_to_cpu(block->bb_magic));
+			exit(1);
+		}
+
+		if (be16_to_cpu(block->bb_level) == 0)
+			break;
+
+		ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1,
+						mp->m_alloc_mxr[1]);
+		bno = be32_to_cpu(ptr[0]);
+	}
+
+	/* align first data copy but don't overwrite ag header */
+
+	pos = w->position >> BBSHIFT;
+	length = w->length >> BBSHIFT;
+	next_begin = pos + length;
+	ag_begin = next_begin;
+
+	ASSERT(w->position % source_sectorsize == 0);
+
+	/* handle the rest of the ag */
+
+	for (;;) {
+		if (be16_to_cpu(block->bb_level) != 0)  {
+			do_log(
+		_("WARNING:  source filesystem inconsistent.\n"));
+			do_log(
+		_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
+			exit(1);
+		}
+
+		rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
+		for (i = 0; i < be16_to_cpu(block->bb_numrecs);
+						i++, rec_ptr++)  {
+			/* calculate in daddr's */
+
+			begin = next_begin;
+
+			/*
+			 * protect against pathological case of a
+			 * hole right after the ag header in a
+			 * mis-aligned case
+			 */
+
+			if (begin < ag_begin)
+				begin = ag_begin;
+
+			/*
+			 * round size up to ensure we copy a
+			 * range bigger than required
+			 */
+
+			copy_extent(rd, begin, XFS_AGB_TO_DADDR(mp, agno,
+				be32_to_cpu(rec_ptr->ar_startblock)) - begin);
+
+			/* round next starting point down */
+
+			new_begin = XFS_AGB_TO_DADDR(mp, agno,
+					be32_to_cpu(rec_ptr->ar_startblock) +
+				 	be32_to_cpu(rec_ptr->ar_blockcount));
+			next_begin = rounddown(new_begin,
+					w->min_io_size >> BBSHIFT);
+		}
+
+		if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
+			break;
+
+		/* read in next btree record block */
+
+		btree_buf->position = pos = (xfs_off_t)
+			XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
+					block->bb_u.s.bb_rightsib)) << BBSHIFT;
+		btree_buf->length = source_blocksize;
+
+		/* let read_wbuf handle alignment */
+
+		read_wbuf(source_fd, btree_buf, mp);
+
+		block = (struct xfs_btree_block *)
+			 ((char *) btree_buf->data +
+			  pos - btree_buf->position);
+
+		ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC ||
+		       be32_to_cpu(block->bb_magic) == XFS_ABTB_CRC_MAGIC);
+	}
+
+	/*
+	 * write out range of used blocks after last range
+	 * of free blocks in AG
+	 */
+	if (next_begin < ag_end)
+		copy_extent(rd, next_begin, ag_end - next_begin);
+}
+
+/* Copy AGs until there are none left. */
+static void *
+begin_ag_reader(
+	void		*arg)
+{
+	ag_reader	*rd = arg;
+	xfs_agnumber_t	agno;
+
+	rcu_register_thread();
+	wbuf_ring_get(&rd->w_buf);
+	for (;;) {
+		pthread_mutex_lock(&reader_lock);
+		agno = next_agno++;
+		pthread_mutex_unlock(&reader_lock);
+		if (agno >= rd->mp->m_sb.sb_agcount)
+			break;
+		copy_ag(rd, agno);
+	}
+	wbuf_ring_put(&rd->w_buf);
+	rcu_unregister_thread();
+	return NULL;
 }
 
 static void
@@ -546,20 +1179,52 @@ sb_update_uuid(
 				XFS_SB_CRC_OFF);
 }
 
+/*
+ * Resync only makes sense onto an earlier copy of this filesystem.  A copy
+ * keeps the source's metadata UUID whatever its own UUID became, so check
+ * that and the geometry, and hand back the UUID the target already has.
+ */
+static bool
+resync_target_ok(
+	struct xfs_mount	*mp,
+	int			fd,
+	uuid_t			*uuid)
+{
+	struct xfs_sb		sb;
+	char			*buf;
+	bool			ok = false;
+
+	buf = memalign(getpagesize(), XFS_MAX_SECTORSIZE);
+	if (!buf)
+		return false;
+	if (pread(fd, buf, XFS_MAX_SECTORSIZE, 0) != XFS_MAX_SECTORSIZE)
+		goto out;
+
+	libxfs_sb_from_disk(&sb, (struct xfs_dsb *)buf);
+	if (sb.sb_magicnum != XFS_SB_MAGIC ||
+	    sb.sb_blocksize != mp->m_sb.sb_blocksize ||
+	    sb.sb_dblocks != mp->m_sb.sb_dblocks ||
+	    sb.sb_agcount != mp->m_sb.sb_agcount ||
+	    !uuid_equal(&sb.sb_meta_uuid, &mp->m_sb.sb_meta_uuid))
+		goto out;
+
+	platform_uuid_copy(uuid, &sb.sb_uuid);
+	ok = true;
+out:
+	free(buf);
+	return ok;
+}
+
 int
 main(int argc, char **argv)
 {
 	int		i, j;
 	int		logfd;
-	int		howfar = 0;
 	int		open_flags;
-	xfs_off_t	pos;
-	size_t		length;
 	int		c;
-	uint64_t	size, sizeb;
-	uint64_t	numblocks = 0;
-	int		wblocks = 0;
 	int		num_threads = 0;
+	int		nr_readers;
+	ag_reader	*readers;
 	struct dioattr	d;
 	int		wbuf_size;
 	int		wbuf_align;
@@ -567,19 +1232,13 @@ main(int argc, char **argv)
 	int		source_is_file = 0;
 	int		buffered_output = 0;
 	int		duplicate = 0;
-	uint		btree_levels, current_level;
 	ag_header_t	ag_hdr;
 	xfs_mount_t	*mp;
 	xfs_mount_t	mbuf;
 	struct xlog	xlog;
 	struct xfs_buf	*sbp;
 	xfs_sb_t	*sb;
-	xfs_agnumber_t	num_ags, agno;
-	xfs_agblock_t	bno;
-	xfs_daddr_t	begin, next_begin, ag_begin, new_begin, ag_end;
-	struct xfs_btree_block *block;
-	xfs_alloc_ptr_t	*ptr;
-	xfs_alloc_rec_t	*rec_ptr;
+	xfs_agnumber_t	num_ags;
 	extern char	*optarg;
 	extern int	optind;
 	libxfs_init_t	xargs;
@@ -593,7 +1252,7 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "bdL:V")) != EOF)  {
+	while ((c = getopt(argc, argv, "bdL:rV")) != EOF)  {
 		switch (c) {
 		case 'b':
 			buffered_output = 1;
@@ -604,6 +1263,9 @@ main(int argc, char **argv)
 		case 'L':
 			logfile_name = optarg;
 			break;
+		case 'r':
+			resync = 1;
+			break;
 		case 'V':
 			printf(_("%s version %s\n"), progname, VERSION);
 			exit(0);
@@ -827,6 +1489,12 @@ main(int argc, char **argv)
 		int	write_last_block = 0;
 
 		if (stat(target[i].name, &statbuf) < 0)  {
+			if (resync)  {
+				do_log(_("%s:  resync target \"%s\" does not "
+					"exist\n"), progname, target[i].name);
+				exit(1);
+			}
+
 			/* ok, assume it's a file and create it */
 
 			do_out(_("Creating file %s\n"), target[i].name);
@@ -836,7 +1504,8 @@ main(int argc, char **argv)
 				open_flags |= O_DIRECT;
 			write_last_block = 1;
 		} else if (S_ISREG(statbuf.st_mode))  {
-			open_flags |= O_TRUNC;
+			if (!resync)
+				open_flags |= O_TRUNC;
 			if (!buffered_output)
 				open_flags |= O_DIRECT;
 			write_last_block = 1;
@@ -863,11 +1532,19 @@ main(int argc, char **argv)
 			die_perror();
 		}
 
+		if (resync && !resync_target_ok(mp, target[i].fd,
+						&target[i].uuid))  {
+			do_log(_("%s:  \"%s\" is not a copy of \"%s\", "
+				"cannot resync it.\n"),
+				progname, target[i].name, source_name);
+			exit(1);
+		}
+
 		if (write_last_block)  {
 			/* ensure regular files are correctly sized */
 
-			if (ftruncate(target[i].fd, mp->m_sb.sb_dblocks *
-						source_blocksize))  {
+			if (!resync && ftruncate(target[i].fd,
+					mp->m_sb.sb_dblocks * source_blocksize))  {
 				do_log(_("%s:  cannot grow data section.\n"),
 					progname);
 				die_perror();
@@ -886,7 +1563,7 @@ main(int argc, char **argv)
 								wbuf_miniosize);
 				}
 			}
-		} else  {
+		} else if (!resync)  {
 			char	*lb[XFS_MAX_SECTORSIZE] = { NULL };
 			off64_t	off;
 
@@ -904,35 +1581,79 @@ main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * If the source and every target are regular files that
+	 * copy_file_range works between, the targets copy the used extents
+	 * themselves and share the blocks where they can.  Only the AG
+	 * headers are read and written through the ring then.
+	 */
+	range_copy = source_is_file && !resync;
+	for (i = 0; i < num_targets && range_copy; i++)
+		range_copy = range_copy_ok(target[i].fd);
+
 	/* initialize locks and bufs */
 
-	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0)  {
+	if (pthread_mutex_init(&glob_masks.mutex, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.queued_cond, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.written_cond, NULL) != 0)  {
 		do_log(_("Couldn't initialize global thread mask\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
+	glob_masks.reserved = 0;
+
+	for (i = 0; i < WBUF_RING_SIZE; i++)  {
+		wbuf	*buf = &glob_masks.ring[i].buf;
+
+		/* every buffer of the ring must be the size of the first */
+		if (wbuf_init(buf, i ? glob_masks.ring[0].buf.size : wbuf_size,
+				wbuf_align, wbuf_miniosize, 0) == NULL ||
+		    buf->size != glob_masks.ring[0].buf.size)  {
+			do_log(_("Error initializing wbuf %d\n"), i);
+			die_perror();
+		}
+		glob_masks.ring[i].seq = 0;
+		glob_masks.ring[i].busy = false;
+		glob_masks.ring[i].refs = 0;
+	}
 
-	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
+	/* the main thread's own buffer, for the final superblock writes */
+	if (wbuf_init(&w_buf, glob_masks.ring[0].buf.size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
 		do_log(_("Error initializing wbuf 0\n"));
 		die_perror();
 	}
 
-	wblocks = wbuf_size / BBSIZE;
-
-	if (wbuf_init(&btree_buf, max(source_blocksize, wbuf_miniosize),
-				wbuf_align, wbuf_miniosize, 1) == NULL)  {
-		do_log(_("Error initializing btree buf 1\n"));
+	nr_readers = min(NR_AG_READERS, mp->m_sb.sb_agcount);
+	if ((readers = calloc(nr_readers, sizeof(ag_reader))) == NULL)  {
+		do_log(_("Couldn't malloc space for AG readers\n"));
 		die_perror();
 	}
+	for (i = 0; i < nr_readers; i++)  {
+		readers[i].mp = mp;
+		readers[i].w_buf = glob_masks.ring[0].buf;
+		if (wbuf_init(&readers[i].btree_buf,
+				max(source_blocksize, wbuf_miniosize),
+				wbuf_align, wbuf_miniosize, 1) == NULL)  {
+			do_log(_("Error initializing btree buf %d\n"), i);
+			die_perror();
+		}
+	}
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
-		die_perror();
-		exit(1);
+	/*
+	 * The log is rewritten by format_logs afterwards unless this is a
+	 * duplicate, so resync leaves the part of it that fits the I/O size.
+	 */
+	if (resync && !duplicate)  {
+		int	unit = wbuf_miniosize >> BBSHIFT;
+
+		log_begin = roundup(XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
+				unit);
+		log_end = rounddown(XFS_FSB_TO_DADDR(mp,
+				mp->m_sb.sb_logstart + mp->m_sb.sb_logblocks),
+				unit);
+		if (log_end <= log_begin)
+			log_begin = log_end = 0;
 	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
 
 	/* set up sigchild signal handler */
 
@@ -948,18 +1669,22 @@ main(int argc, char **argv)
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
-		if (!duplicate)
-			platform_uuid_generate(&tcarg->uuid);
-		else
+		if (duplicate)
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
-
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
+		else if (resync)
+			platform_uuid_copy(&tcarg->uuid, &target[i].uuid);
+		else
+			platform_uuid_generate(&tcarg->uuid);
+		tcarg->next = 0;
+		tcarg->no_clone = false;
+		tcarg->cmp_buf = NULL;
+		tcarg->cmp_bytes = 0;
+		tcarg->diff_bytes = 0;
+		if (resync && (tcarg->cmp_buf = memalign(wbuf_align,
+					glob_masks.ring[0].buf.size)) == NULL)  {
+			do_log(_("Couldn't malloc space for resync buffer\n"));
 			die_perror();
-			exit(1);
 		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
 	}
 
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
@@ -988,222 +1713,20 @@ main(int argc, char **argv)
 
 	kids = num_targets;
 
-	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
-		/* read in first blocks of the ag */
-
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
-			source_blocksize, source_sectorsize);
-
-		/* set the in_progress bit for the first AG */
-
-		if (agno == 0)
-			ag_hdr.xfs_sb->sb_inprogress = 1;
-
-		/* save what we need (agf) in the btree buffer */
-
-		memmove(btree_buf.data, ag_hdr.xfs_agf, source_sectorsize);
-		ag_hdr.xfs_agf = (xfs_agf_t *) btree_buf.data;
-		btree_buf.length = source_blocksize;
-
-		/* write the ag header out */
-
-		write_wbuf();
-
-		/* traverse btree until we get to the leftmost leaf node */
-
-		bno = be32_to_cpu(ag_hdr.xfs_agf->agf_roots[XFS_BTNUM_BNOi]);
-		current_level = 0;
-		btree_levels = be32_to_cpu(ag_hdr.xfs_agf->
-						agf_levels[XFS_BTNUM_BNOi]);
-
-		ag_end = XFS_AGB_TO_DADDR(mp, agno,
-				be32_to_cpu(ag_hdr.xfs_agf->agf_length) - 1)
-				+ source_blocksize / BBSIZE;
-
-		for (;;) {
-			/* none of this touches the w_buf buffer */
-
-			if (current_level >= btree_levels) {
-				do_log(
-			_("Error: current level %d >= btree levels %d\n"),
-					current_level, btree_levels);
-				exit(1);
-			}
-
-			current_level++;
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp,agno,bno) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			read_wbuf(source_fd, &btree_buf, mp);
-			block = (struct xfs_btree_block *)
-				 ((char *)btree_buf.data +
-				  pos - btree_buf.position);
+	/* copy the AGs, as many at a time as we have readers */
 
-			if (be32_to_cpu(block->bb_magic) !=
-			    (xfs_has_crc(mp) ?
-			     XFS_ABTB_CRC_MAGIC : XFS_ABTB_MAGIC)) {
-				do_log(_("Bad btree magic 0x%x\n"),
-				        be32_to_cpu(block->bb_magic));
-				exit(1);
-			}
-
-			if (be16_to_cpu(block->bb_level) == 0)
-				break;
-
-			ptr = XFS_ALLOC_PTR_ADDR(mp, block, 1,
-							mp->m_alloc_mxr[1]);
-			bno = be32_to_cpu(ptr[0]);
-		}
-
-		/* align first data copy but don't overwrite ag header */
-
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-		next_begin = pos + length;
-		ag_begin = next_begin;
-
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
-		/* handle the rest of the ag */
-
-		for (;;) {
-			if (be16_to_cpu(block->bb_level) != 0)  {
-				do_log(
-			_("WARNING:  source filesystem inconsistent.\n"));
-				do_log(
-			_("  A leaf btree rec isn't a leaf.  Aborting now.\n"));
-				exit(1);
-			}
-
-			rec_ptr = XFS_ALLOC_REC_ADDR(mp, block, 1);
-			for (i = 0; i < be16_to_cpu(block->bb_numrecs);
-							i++, rec_ptr++)  {
-				/* calculate in daddr's */
-
-				begin = next_begin;
-
-				/*
-				 * protect against pathological case of a
-				 * hole right after the ag header in a
-				 * mis-aligned case
-				 */
-
-				if (begin < ag_begin)
-					begin = ag_begin;
-
-				/*
-				 * round size up to ensure we copy a
-				 * range bigger than required
-				 */
-
-				sizeb = XFS_AGB_TO_DADDR(mp, agno,
-					be32_to_cpu(rec_ptr->ar_startblock)) -
-						begin;
-				size = roundup(sizeb <<BBSHIFT, wbuf_miniosize);
-				if (size > 0)  {
-					/* copy extent */
-
-					w_buf.position = (xfs_off_t)
-						begin << BBSHIFT;
-
-					while (size > 0)  {
-						/*
-						 * let lower layer do alignment
-						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
-							sizeb -= wblocks;
-							numblocks += wblocks;
-						} else  {
-							w_buf.length = size;
-							numblocks += sizeb;
-							size = 0;
-						}
-
-						read_wbuf(source_fd, &w_buf, mp);
-						write_wbuf();
-
-						w_buf.position += w_buf.length;
-
-						howfar = bump_bar(
-							howfar, numblocks);
-					}
-				}
-
-				/* round next starting point down */
-
-				new_begin = XFS_AGB_TO_DADDR(mp, agno,
-						be32_to_cpu(rec_ptr->ar_startblock) +
-					 	be32_to_cpu(rec_ptr->ar_blockcount));
-				next_begin = rounddown(new_begin,
-						w_buf.min_io_size >> BBSHIFT);
-			}
-
-			if (be32_to_cpu(block->bb_u.s.bb_rightsib) == NULLAGBLOCK)
-				break;
-
-			/* read in next btree record block */
-
-			btree_buf.position = pos = (xfs_off_t)
-				XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(
-						block->bb_u.s.bb_rightsib)) << BBSHIFT;
-			btree_buf.length = source_blocksize;
-
-			/* let read_wbuf handle alignment */
-
-			read_wbuf(source_fd, &btree_buf, mp);
-
-			block = (struct xfs_btree_block *)
-				 ((char *) btree_buf.data +
-				  pos - btree_buf.position);
-
-			ASSERT(be32_to_cpu(block->bb_magic) == XFS_ABTB_MAGIC ||
-			       be32_to_cpu(block->bb_magic) == XFS_ABTB_CRC_MAGIC);
-		}
-
-		/*
-		 * write out range of used blocks after last range
-		 * of free blocks in AG
-		 */
-		if (next_begin < ag_end)  {
-			begin = next_begin;
-
-			sizeb = ag_end - begin;
-			size = roundup(sizeb << BBSHIFT, wbuf_miniosize);
-
-			if (size > 0)  {
-				/* copy extent */
-
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
-
-				while (size > 0)  {
-					/*
-					 * let lower layer do alignment
-					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
-						sizeb -= wblocks;
-						numblocks += wblocks;
-					} else  {
-						w_buf.length = size;
-						numblocks += sizeb;
-						size = 0;
-					}
-
-					read_wbuf(source_fd, &w_buf, mp);
-					write_wbuf();
-
-					w_buf.position += w_buf.length;
-
-					howfar = bump_bar(howfar, numblocks);
-				}
-			}
+	for (i = 0; i < nr_readers; i++)  {
+		if (pthread_create(&readers[i].pid, NULL, begin_ag_reader,
+					&readers[i]))  {
+			do_log(_("Error creating AG reader thread %d\n"), i);
+			die_perror();
 		}
 	}
+	for (i = 0; i < nr_readers; i++)
+		pthread_join(readers[i].pid, NULL);
+
+	/* the rest is written synchronously from here */
+	wait_for_writes();
 
 	if (kids > 0)  {
 		if (!duplicate)
@@ -1233,6 +1756,12 @@ main(int argc, char **argv)
 		bump_bar(100, 0);
 	}
 
+	for (i = 0, tcarg = targ; resync && i < num_targets; i++, tcarg++)
+		do_out(_("%s: compared %llu bytes, rewrote %llu bytes\n"),
+			target[i].name,
+			(unsigned long long)tcarg->cmp_bytes,
+			(unsigned long long)tcarg->diff_bytes);
+
 	check_errors();
 	libxfs_umount(mp);
 	libxfs_destroy(&xargs);
@@ -47,21 +47,58 @@ typedef struct {
 	size_t		length;		/* requested length (bytes) */
 	char		*data;		/* pointer to data buffer */
 	struct t_args	*owner;		/* for non-parallel writes */
+	unsigned long	seq;		/* position in the ring, if from it */
+	bool		range;		/* no data, copy from the source file */
 } wbuf;
 
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
 	int		fd;
+	unsigned long	next;		/* next ring buffer to finish */
+	bool		no_clone;	/* target can't share source blocks */
+	char		*cmp_buf;	/* resync: what the target has now */
+	uint64_t	cmp_bytes;	/* resync: bytes compared */
+	uint64_t	diff_bytes;	/* resync: bytes rewritten */
 } thread_args;
 
+/*
+ * The readers take the buffers of a ring in turn and every active target
+ * thread writes them in the same order, keeping several writes in flight
+ * when it can.  A buffer can be refilled once all the targets have written
+ * it, so the readers can get WBUF_RING_SIZE buffers ahead of the slowest
+ * target before they have to wait, and a fast target isn't held up by a
+ * slow one until then.  Each reader copies whole AGs, so the buffers of
+ * different readers are filled concurrently and queued in whatever order
+ * their reads finish; a target only stops at a buffer that hasn't been
+ * filled yet.
+ */
+#define WBUF_RING_SIZE	16
+#define NR_AG_READERS	4
+
+typedef struct {
+	wbuf		buf;
+	unsigned long	seq;		/* one past the last buffer queued */
+	bool		busy;		/* a reader is filling it */
+	int		refs;		/* targets yet to write it */
+} wbuf_slot;
+
 typedef struct {
 	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
+	pthread_cond_t	queued_cond;	/* a reader queued a buffer */
+	pthread_cond_t	written_cond;	/* a buffer was freed */
+	unsigned long	reserved;	/* buffers handed to readers so far */
+	wbuf_slot	ring[WBUF_RING_SIZE];
 } thread_control;
 
+/* A thread copying AGs from the source into the ring. */
+typedef struct {
+	struct xfs_mount *mp;
+	wbuf		w_buf;		/* ring buffer being filled */
+	wbuf		btree_buf;	/* free space btree blocks */
+	pthread_t	pid;
+} ag_reader;
+
 typedef int thread_id;
 typedef int tm_index;			/* index into thread mask array */
 typedef uint32_t thread_mask;		/* a thread mask */
@@ -74,4 +111,5 @@ typedef struct {
 	int		state;
 	int		error;
 	int		err_type;
+	uuid_t		uuid;		/* resync: the UUID it already has */
 } target_control;
@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include "libxfs.h"
+#include "command.h"
+#include "type.h"
+#include "faddr.h"
+#include "fprint.h"
+#include "field.h"
+#include "flist.h"
+#include "io.h"
+#include "inode.h"
+#include "output.h"
+#include "init.h"
+#include "malloc.h"
+#include "sig.h"
+#include "batch.h"
+
+/*
+ * Batch Field Dumps
+ *
+ * Scripts that want a few fields out of thousands of inodes used to run
+ * "inode N" and "print field" once per inode, waiting for each inode to
+ * be read and parsing the output meant for people.  The batch command
+ * takes the whole list at once, reads the blocks ahead of time, and
+ * prints one JSON object per inode or block.
+ *
+ * Values come from the same print functions as the print command.  Ones
+ * that print as a single integer (in any base) become JSON numbers, "null"
+ * becomes null, and everything else is passed along as a string.  Any
+ * messages printed while getting there end up in an "error" member.
+ */
+
+/* Inodes or blocks to read ahead of the one we're printing. */
+#define BATCH_RA	128
+
+#define BATCH_KEY_MAX	256
+
+struct batch {
+	uint64_t	*targets;
+	uint64_t	nr;
+	uint64_t	max;
+	char		**fields;
+	int		nr_fields;
+	const typ_t	*type;		/* NULL for inodes */
+};
+
+static void
+batch_add(
+	struct batch	*b,
+	uint64_t	target)
+{
+	if (b->nr == b->max) {
+		b->max = max(b->max * 2, 64ULL);
+		b->targets = xrealloc(b->targets, b->max * sizeof(*b->targets));
+	}
+	b->targets[b->nr++] = target;
+}
+
+static int
+batch_parse(
+	struct batch	*b,
+	const char	*s)
+{
+	char		*p;
+	uint64_t	target;
+
+	errno = 0;
+	target = strtoull(s, &p, 0);
+	if (errno || p == s || *p != '\0') {
+		dbprintf(_("bad inode or block number %s\n"), s);
+		return 0;
+	}
+	batch_add(b, target);
+	return 1;
+}
+
+/* Read numbers from a file, one per line; blank lines and # are ignored. */
+static int
+batch_read_file(
+	struct batch	*b,
+	const char	*path)
+{
+	FILE		*fp;
+	char		*line = NULL;
+	size_t		len = 0;
+	ssize_t		n;
+	int		ret = 1;
+
+	fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!fp) {
+		dbprintf(_("can't open %s: %s\n"), path, strerror(errno));
+		return 0;
+	}
+	while ((n = getline(&line, &len, fp)) >= 0) {
+		while (n > 0 && isspace((unsigned char)line[n - 1]))
+			line[--n] = '\0';
+		if (n == 0 || line[0] == '#')
+			continue;
+		ret = batch_parse(b, line);
+		if (!ret)
+			break;
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
+static void
+batch_readahead(
+	struct batch	*b,
+	uint64_t	target)
+{
+	if (!b->type)
+		readahead_inode(target);
+	else if (libxfs_verify_fsbno(mp, target))
+		readahead_cur(b->type, XFS_FSB_TO_DADDR(mp, target), blkbb);
+}
+
+static void
+batch_json_string(
+	FILE		*out,
+	const char	*s,
+	size_t		len)
+{
+	size_t		i;
+
+	fputc('"', out);
+	for (i = 0; i < len; i++) {
+		unsigned char	c = s[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20 || c == 0x7f)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+/* Print what a print function printed as the best JSON value we can. */
+static void
+batch_json_value(
+	FILE		*out,
+	char		*text,
+	size_t		len)
+{
+	char		*end;
+	long long	sval;
+	unsigned long long uval;
+
+	while (len > 0 && isspace((unsigned char)text[len - 1]))
+		text[--len] = '\0';
+	while (len > 0 && isspace((unsigned char)*text)) {
+		text++;
+		len--;
+	}
+
+	if (!strcmp(text, "null")) {
+		fputs("null", out);
+		return;
+	}
+	if (len > 0 && (isdigit((unsigned char)text[0]) ||
+			(text[0] == '-' && isdigit((unsigned char)text[1])))) {
+		errno = 0;
+		if (text[0] == '-') {
+			sval = strtoll(text, &end, 0);
+			if (!errno && *end == '\0') {
+				fprintf(out, "%lld", sval);
+				return;
+			}
+		} else {
+			uval = strtoull(text, &end, 0);
+			if (!errno && *end == '\0') {
+				fprintf(out, "%llu", uval);
+				return;
+			}
+		}
+	}
+	batch_json_string(out, text, len);
+}
+
+/* Print every field in an flist as "name":value, like print_flist_1. */
+static void
+batch_emit_flist(
+	FILE		*out,
+	FILE		*err,
+	flist_t		*flist,
+	char		*key,
+	int		keylen,
+	int		parentoff)
+{
+	const field_t	*f;
+	const ftattr_t	*fa;
+	flist_t		*fl;
+	FILE		*vfp;
+	char		*val;
+	size_t		vallen;
+	int		len;
+	int		low;
+	int		count;
+	int		fsz;
+	int		bitlen;
+
+	for (fl = flist; fl && !seenint(); fl = fl->sibling) {
+		len = keylen;
+		if (fl->name[0])
+			len += snprintf(key + len, BATCH_KEY_MAX - len, "%s%s",
+					len ? "." : "", fl->name);
+		if ((fl->flags & FL_OKLOW) && len < BATCH_KEY_MAX) {
+			if (fl->low != fl->high)
+				len += snprintf(key + len, BATCH_KEY_MAX - len,
+						"[%d-%d]", fl->low, fl->high);
+			else
+				len += snprintf(key + len, BATCH_KEY_MAX - len,
+						"[%d]", fl->low);
+		}
+		len = min(len, BATCH_KEY_MAX - 1);
+
+		if (fl->child) {
+			batch_emit_flist(out, err, fl->child, key, len,
+					fl->offset);
+			continue;
+		}
+
+		f = fl->fld;
+		fa = &ftattrtab[f->ftyp];
+		if (!fa->prfunc)
+			continue;
+		low = (fl->flags & FL_OKLOW) ? fl->low : 0;
+		count = fcount(f, iocur_top->data, parentoff);
+		if (fl->flags & FL_OKHIGH)
+			count = min(count, fl->high - low + 1);
+
+		/* Don't read an array off the end of the buffer */
+		fsz = fsize(f, iocur_top->data, parentoff, 0);
+		bitlen = iocur_top->len * NBBY;
+		if ((f->flags & FLD_ARRAY) &&
+		    fl->offset + (count * fsz) > bitlen)
+			count = (bitlen - fl->offset) / fsz;
+
+		val = NULL;
+		vallen = 0;
+		vfp = open_memstream(&val, &vallen);
+		if (!vfp)
+			continue;
+		dbprintf_capture(vfp);
+		fa->prfunc(iocur_top->data, fl->offset, count, fa->fmtstr, fsz,
+				fa->arg, low, (f->flags & FLD_ARRAY) != 0);
+		dbprintf_capture(err);
+		fclose(vfp);
+
+		fputc(',', out);
+		batch_json_string(out, key, len);
+		fputc(':', out);
+		batch_json_value(out, val, vallen);
+		free(val);
+	}
+}
+
+/* Build the list of fields to print for the current object. */
+static flist_t *
+batch_flist(
+	struct batch	*b)
+{
+	const field_t	*fields = cur_typ->fields;
+	flist_t		*fl = NULL;
+	flist_t		*lfl = NULL;
+	flist_t		*nfl;
+	int		i;
+
+	if (cur_typ->pfunc != handle_struct) {
+		dbprintf(_("type %s has no fields\n"), cur_typ->name);
+		return NULL;
+	}
+
+	if (b->nr_fields == 0) {
+		fl = flist_make("");
+		fl->fld = fields;
+	} else {
+		for (i = 0; i < b->nr_fields; i++) {
+			nfl = flist_scan(b->fields[i]);
+			if (!nfl)
+				goto bad;
+			if (lfl)
+				lfl->sibling = nfl;
+			else
+				fl = nfl;
+			lfl = nfl;
+		}
+		if (fields->name[0] == '\0')
+			fields = ftattrtab[fields->ftyp].subfld;
+	}
+	if (flist_parse(fields, fl, iocur_top->data, 0))
+		return fl;
+bad:
+	if (fl)
+		flist_free(fl);
+	return NULL;
+}
+
+/* Print one inode or block as a line of JSON. */
+static void
+batch_emit(
+	struct batch	*b,
+	uint64_t	target)
+{
+	char		key[BATCH_KEY_MAX];
+	char		*line = NULL;
+	char		*msg = NULL;
+	size_t		linelen = 0;
+	size_t		msglen = 0;
+	FILE		*out;
+	FILE		*err;
+	flist_t		*fl;
+
+	out = open_memstream(&line, &linelen);
+	if (!out)
+		return;
+	err = open_memstream(&msg, &msglen);
+	if (!err) {
+		fclose(out);
+		free(line);
+		return;
+	}
+
+	fprintf(out, "{\"%s\":%llu", b->type ? "fsblock" : "ino",
+			(unsigned long long)target);
+
+	push_cur();
+	dbprintf_capture(err);
+	if (!b->type)
+		set_cur_inode(target);
+	else if (libxfs_verify_fsbno(mp, target))
+		set_cur(b->type, XFS_FSB_TO_DADDR(mp, target), blkbb,
+				DB_RING_IGN, NULL);
+	else
+		dbprintf(_("bad block number %llu\n"),
+				(unsigned long long)target);
+
+	if (iocur_top->data) {
+		fl = batch_flist(b);
+		if (fl) {
+			batch_emit_flist(out, err, fl, key, 0, 0);
+			flist_free(fl);
+		}
+	} else if (ftell(err) == 0) {
+		dbprintf(_("cannot read %s %llu\n"),
+				b->type ? _("block") : _("inode"),
+				(unsigned long long)target);
+	}
+	dbprintf_capture(NULL);
+	pop_cur();
+
+	fclose(err);
+	if (msglen) {
+		fputs(",\"error\":", out);
+		batch_json_string(out, msg, msglen);
+	}
+	fputc('}', out);
+	fclose(out);
+
+	dbprintf("%s\n", line);
+	free(line);
+	free(msg);
+}
+
+static int
+batch_f(
+	int		argc,
+	char		**argv)
+{
+	struct batch	b = { NULL };
+	uint64_t	i;
+	int		c;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "F:f:t:")) != EOF) {
+		switch (c) {
+		case 'F':
+			if (!batch_read_file(&b, optarg))
+				goto out;
+			break;
+		case 'f':
+			b.fields = xrealloc(b.fields,
+					(b.nr_fields + 1) * sizeof(char *));
+			b.fields[b.nr_fields++] = optarg;
+			break;
+		case 't':
+			b.type = findtyp(optarg);
+			if (!b.type) {
+				dbprintf(_("no such type %s\n"), optarg);
+				goto out;
+			}
+			break;
+		default:
+			dbprintf(_("bad option for batch command\n"));
+			goto out;
+		}
+	}
+	for (; optind < argc; optind++)
+		if (!batch_parse(&b, argv[optind]))
+			goto out;
+
+	for (i = 0; i < min(b.nr, (uint64_t)BATCH_RA); i++)
+		batch_readahead(&b, b.targets[i]);
+	for (i = 0; i < b.nr && !seenint(); i++) {
+		if (i + BATCH_RA < b.nr)
+			batch_readahead(&b, b.targets[i + BATCH_RA]);
+		batch_emit(&b, b.targets[i]);
+	}
+out:
+	xfree(b.targets);
+	xfree(b.fields);
+	return 0;
+}
+
+static void
+batch_help(void)
+{
+	dbprintf(_(
+"\n"
+" Print fields of many inodes or blocks as JSON, one object per line.\n"
+"\n"
+" Example:\n"
+"\n"
+" 'batch -f core.mode -f core.size 128 131 132'\n"
+"\n"
+" {\"ino\":128,\"core.mode\":16877,\"core.size\":6}\n"
+"\n"
+" The arguments are inode numbers, or filesystem block numbers if a type\n"
+" is given with -t.  The blocks are read ahead while earlier ones are\n"
+" printed.\n"
+"\n"
+" Options:\n"
+"   -F file  -- Also read inode or block numbers from a file, one per line\n"
+"               ('-' is standard input).\n"
+"   -f field -- Print this field (as for the print command); may be given\n"
+"               more than once.  The default is all of them.\n"
+"   -t type  -- The numbers are filesystem blocks of this type.\n"
+"\n"
+	));
+}
+
+static const cmdinfo_t	batch_cmd =
+	{ "batch", NULL, batch_f, 0, -1, 0,
+	  N_("[-F file] [-f field]... [-t type] [number]..."),
+	  N_("print fields of many inodes or blocks as JSON"), batch_help };
+
+void
+batch_init(void)
+{
+	add_command(&batch_cmd);
+}
@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_DB_BATCH_H__
+#define __XFS_DB_BATCH_H__
+
+extern void	batch_init(void);
+
+#endif /* __XFS_DB_BATCH_H__ */
@@ -10,6 +10,12 @@
 #include "io.h"
 #include "type.h"
 #include "input.h"
+#include "faddr.h"
+#include "fprint.h"
+#include "field.h"
+#include "bit.h"
+#include "malloc.h"
+#include "sig.h"
 
 static void
 btdump_help(void)
@@ -60,10 +66,88 @@ btblock_has_rightsib(
 	return block->bb_u.s.bb_rightsib != cpu_to_be32(NULLAGBLOCK);
 }
 
+/*
+ * Blocks of one btree level, collected from the pointers in the level above
+ * so that they can be read ahead of the rightsib walk.
+ */
+struct btdump_ra {
+	xfs_daddr_t		*daddrs;
+	unsigned int		nr;
+	unsigned int		max;
+};
+
+/* How many blocks to keep in flight ahead of the one we're printing. */
+#define BTDUMP_RA		64
+
+static void
+btdump_ra_start(
+	struct btdump_ra	*ra,
+	unsigned int		nr)
+{
+	if (nr < ra->nr)
+		readahead_cur(iocur_top->typ, ra->daddrs[nr], blkbb);
+}
+
+/* Remember the children of the current node block. */
+static void
+btdump_ra_add(
+	struct btdump_ra	*ra,
+	bool			long_format)
+{
+	const field_t		*f = iocur_top->typ->fields;
+	xfs_agblock_t		agbno;
+	xfs_fsblock_t		fsbno;
+	int			count;
+	int			i;
+
+	if (!f)
+		return;
+	if (f->name[0] == '\0')
+		f = ftattrtab[f->ftyp].subfld;
+	for (; f && f->name; f++)
+		if (!strcmp(f->name, "ptrs"))
+			break;
+	if (!f || !f->name)
+		return;
+
+	count = fcount(f, iocur_top->data, 0);
+	for (i = 1; i <= count; i++) {
+		if (ra->nr == ra->max) {
+			ra->max = max(ra->max * 2, 256U);
+			ra->daddrs = xrealloc(ra->daddrs,
+					ra->max * sizeof(xfs_daddr_t));
+		}
+		if (long_format) {
+			fsbno = getbitval(iocur_top->data,
+					bitoffset(f, iocur_top->data, 0, i),
+					64, BVUNSIGNED);
+			if (!libxfs_verify_fsbno(mp, fsbno))
+				continue;
+			ra->daddrs[ra->nr++] = XFS_FSB_TO_DADDR(mp, fsbno);
+		} else {
+			agbno = getbitval(iocur_top->data,
+					bitoffset(f, iocur_top->data, 0, i),
+					32, BVUNSIGNED);
+			if (!libxfs_verify_agbno(mp, cur_agno, agbno))
+				continue;
+			ra->daddrs[ra->nr++] = XFS_AGB_TO_DADDR(mp, cur_agno,
+					agbno);
+		}
+	}
+}
+
+/*
+ * Walk one level of the btree along the rightsib pointers, printing each
+ * block if asked to.  Blocks in ra are read ahead of the walk, and the
+ * children of node blocks are added to next_ra for the level below.
+ */
 static int
 dump_btlevel(
 	int			level,
-	bool			long_format)
+	bool			long_format,
+	bool			print,
+	struct btdump_ra	*ra,
+	struct btdump_ra	*next_ra)
 {
 	xfs_daddr_t		orig_daddr = iocur_top->bb;
 	xfs_daddr_t		last_daddr;
@@ -72,28 +156,37 @@ dump_btlevel(
 
 	push_cur_and_set_type();
 
+	for (nr = 0; nr < BTDUMP_RA; nr++)
+		btdump_ra_start(ra, nr);
+
 	nr = 1;
 	do {
+		btdump_ra_start(ra, nr - 1 + BTDUMP_RA);
 		last_daddr = iocur_top->bb;
-		dbprintf(_("%s level %u block %u daddr %llu\n"),
-			 iocur_top->typ->name, level, nr, last_daddr);
-		if (level > 0) {
-			ret = eval("print keys");
+		if (print) {
+			dbprintf(_("%s level %u block %u daddr %llu\n"),
+				 iocur_top->typ->name, level, nr, last_daddr);
+			if (level > 0) {
+				ret = eval("print keys");
+				if (ret)
+					goto err;
+				ret = eval("print ptrs");
+			} else {
+				ret = eval("print recs");
+			}
 			if (ret)
 				goto err;
-			ret = eval("print ptrs");
-		} else {
-			ret = eval("print recs");
 		}
-		if (ret)
-			goto err;
+		if (next_ra)
+			btdump_ra_add(next_ra, long_format);
 		if (btblock_has_rightsib(iocur_top->data, long_format)) {
 			ret = eval("addr rightsib");
 			if (ret)
 				goto err;
 		}
 		nr++;
-	} while (iocur_top->bb != orig_daddr && iocur_top->bb != last_daddr);
+	} while (iocur_top->bb != orig_daddr && iocur_top->bb != last_daddr &&
+		 !seenint());
 
 err:
 	pop_cur();
@@ -107,6 +200,9 @@ dump_btree(
 {
 	xfs_daddr_t	orig_daddr = iocur_top->bb;
 	xfs_daddr_t	last_daddr;
+	struct btdump_ra ra = { NULL };
+	struct btdump_ra next_ra = { NULL };
+	struct btdump_ra tmp;
 	int		level;
 	int		ret = 0;
 
@@ -117,14 +213,19 @@ dump_btree(
 	do {
 		last_daddr = iocur_top->bb;
 		if (level > 0) {
-			if (dump_node_blocks) {
-				ret = dump_btlevel(level, long_format);
-				if (ret)
-					goto err;
-			}
+			/* Walk the nodes anyway to find the next level. */
+			ret = dump_btlevel(level, long_format,
+					dump_node_blocks, &ra, &next_ra);
+			if (ret)
+				goto err;
 			ret = eval("addr ptrs[1]");
+			tmp = ra;
+			ra = next_ra;
+			next_ra = tmp;
+			next_ra.nr = 0;
 		} else {
-			ret = dump_btlevel(level, long_format);
+			ret = dump_btlevel(level, long_format, true, &ra,
+					NULL);
 		}
 		if (ret)
 			goto err;
@@ -134,6 +235,8 @@ dump_btree(
 		 iocur_top->bb != last_daddr);
 
 err:
+	xfree(ra.daddrs);
+	xfree(next_ra.daddrs);
 	pop_cur();
 	return ret;
 }
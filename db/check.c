@@ -20,6 +20,11 @@
 #include "init.h"
 #include "malloc.h"
 #include "dir2.h"
+#include "sig.h"
+#include "dbmap.h"
+#include "ncheck.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
 
 typedef enum {
 	IS_USER_QUOTA, IS_PROJECT_QUOTA, IS_GROUP_QUOTA,
@@ -100,40 +105,69 @@ typedef struct dirhash {
 #define	DIR_HASH_SIZE	1024
 #define	DIR_HASH_FUNC(h,a)	(((h) ^ (a)) % DIR_HASH_SIZE)
 
-static xfs_extlen_t	agffreeblks;
-static xfs_extlen_t	agflongest;
-static uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
-static uint32_t	agfbtreeblks;
-static int		lazycount;
-static xfs_agino_t	agicount;
-static xfs_agino_t	agifreecount;
+/*
+ * blockget scans the AGs in parallel.  The per-AG scan state and the
+ * counters (error, fdblocks, sbversion...) are thread-local; each scanner
+ * adds its counts into a scan_totals when it finishes an AG, and blockget
+ * folds them into the main thread's copies once all the AGs are done.
+ * The block map, inode map and inode table of each AG (and of the
+ * realtime volume) are shared, so they're only touched under that AG's
+ * lock in ag_locks.
+ */
+static __thread xfs_extlen_t	agffreeblks;
+static __thread xfs_extlen_t	agflongest;
+static __thread uint64_t	agf_aggr_freeblks;	/* aggregate count over all */
+static __thread uint32_t	agfbtreeblks;
+static __thread int		lazycount;
+static __thread xfs_agino_t	agicount;
+static __thread xfs_agino_t	agifreecount;
+static pthread_mutex_t	*ag_locks;
 static xfs_fsblock_t	*blist;
 static int		blist_size;
-static char		**dbmap;	/* really dbm_t:8 */
-static dirhash_t	**dirhash;
-static int		error;
-static uint64_t	fdblocks;
-static uint64_t	frextents;
-static uint64_t	icount;
-static uint64_t	ifree;
+static struct dbmap	**dbmap;
+static __thread dirhash_t	**dirhash;
+static __thread int	error;
+static __thread uint64_t	fdblocks;
+static __thread uint64_t	frextents;
+static __thread uint64_t	icount;
+static __thread uint64_t	ifree;
 static inodata_t	***inodata;
 static int		inodata_hash_size;
 static inodata_t	***inomap;
 static int		nflag;
+static int		nr_threads;
 static int		pflag;
 static int		tflag;
+static pthread_mutex_t	qdata_lock = PTHREAD_MUTEX_INITIALIZER;
 static qdata_t		**qpdata;
 static int		qpdo;
 static qdata_t		**qudata;
 static int		qudo;
 static qdata_t		**qgdata;
 static int		qgdo;
-static unsigned		sbversion;
-static int		sbver_err;
-static int		serious_error;
+static __thread unsigned	sbversion;
+static __thread int	sbver_err;
+static __thread int	serious_error;
 static int		sflag;
 static xfs_suminfo_t	*sumcompute;
 static xfs_suminfo_t	*sumfile;
+
+struct scan_totals {
+	pthread_mutex_t		lock;
+	int			error;
+	int			serious_error;
+	int			sbver_err;
+	int			lazycount;
+	unsigned		sbversion;	/* before the scan */
+	unsigned		sbversion_set;
+	unsigned		sbversion_clear;
+	uint64_t		agf_aggr_freeblks;
+	uint64_t		fdblocks;
+	uint64_t		frextents;
+	uint64_t		icount;
+	uint64_t		ifree;
+};
+
 static const char	*typename[] = {
 	"unknown",
 	"agf",
@@ -204,7 +238,8 @@ typedef void	(*scan_sbtree_f_t)(struct xfs_btree_block *block,
 static void		add_blist(xfs_fsblock_t	bno);
 static void		add_ilist(xfs_ino_t ino);
 static void		addlink_inode(inodata_t *id);
-static void		addname_inode(inodata_t *id, char *name, int namelen);
+static void		addname_inode(inodata_t *id, inodata_t *dir, char *name,
+				      int namelen);
 static void		addparent_inode(inodata_t *id, xfs_ino_t parent);
 static void		blkent_append(blkent_t **entp, xfs_fsblock_t b,
 				      xfs_extlen_t c);
@@ -377,7 +412,7 @@ static const cmdinfo_t	blockfree_cmd =
 	  NULL, N_("free block usage information"), NULL };
 static const cmdinfo_t	blockget_cmd =
 	{ "blockget", "check", blockget_f, 0, -1, 0,
-	  N_("[-s|-v] [-n] [-t] [-b bno]... [-i ino] ..."),
+	  N_("[-s|-v] [-n] [-t] [-j threads] [-b bno]... [-i ino] ..."),
 	  N_("get block usage and check consistency"), NULL };
 static const cmdinfo_t	blocktrash_cmd =
 	{ "blocktrash", NULL, blocktrash_f, 0, -1, 0,
@@ -393,6 +428,45 @@ static const cmdinfo_t	ncheck_cmd =
 	  N_("print inode-name pairs"), NULL };
 
 
+/* Lock the maps of an AG, or of the realtime volume if agno == agcount. */
+static inline void
+lock_ag(
+	xfs_agnumber_t	agno)
+{
+	if (agno <= mp->m_sb.sb_agcount)
+		pthread_mutex_lock(&ag_locks[agno]);
+}
+
+static inline void
+unlock_ag(
+	xfs_agnumber_t	agno)
+{
+	if (agno <= mp->m_sb.sb_agcount)
+		pthread_mutex_unlock(&ag_locks[agno]);
+}
+
+/*
+ * Find the type of block bno of an AG (or of the realtime volume if
+ * agno == agcount), and how many blocks from there, up to len, share it.
+ */
+static xfs_extlen_t
+get_dbmap_run(
+	xfs_agnumber_t	agno,
+	uint64_t	bno,
+	xfs_extlen_t	len,
+	dbm_t		*type)
+{
+	uint64_t	limit = mp->m_sb.sb_agblocks;
+	unsigned int	t;
+	uint64_t	n;
+
+	if (agno == mp->m_sb.sb_agcount)
+		limit = mp->m_sb.sb_rblocks;
+	n = dbmap_extent(dbmap[agno], bno, &t);
+	*type = t;
+	return min(n, min((uint64_t)len, limit - bno));
+}
+
 static void
 add_blist(
 	xfs_fsblock_t	bno)
@@ -420,23 +494,35 @@ static void
 addlink_inode(
 	inodata_t	*id)
 {
+	xfs_agnumber_t	agno = XFS_INO_TO_AGNO(mp, id->ino);
+
+	lock_ag(agno);
 	id->link_add++;
 	if (verbose || id->ilist)
 		dbprintf(_("inode %lld add link, now %u\n"), id->ino,
 			id->link_add);
+	unlock_ag(agno);
 }
 
+/* Remember the first directory entry that we find for an inode. */
 static void
 addname_inode(
 	inodata_t	*id,
+	inodata_t	*dir,
 	char		*name,
 	int		namelen)
 {
-	if (!nflag || id->name)
-		return;
-	id->name = xmalloc(namelen + 1);
-	memcpy(id->name, name, namelen);
-	id->name[namelen] = '\0';
+	xfs_agnumber_t	agno = XFS_INO_TO_AGNO(mp, id->ino);
+
+	lock_ag(agno);
+	if (!id->parent)
+		id->parent = dir;
+	if (nflag && !id->name) {
+		id->name = xmalloc(namelen + 1);
+		memcpy(id->name, name, namelen);
+		id->name[namelen] = '\0';
+	}
+	unlock_ag(agno);
 }
 
 static void
@@ -444,10 +530,13 @@ addparent_inode(
 	inodata_t	*id,
 	xfs_ino_t	parent)
 {
+	xfs_agnumber_t	agno = XFS_INO_TO_AGNO(mp, id->ino);
 	inodata_t	*pid;
 
 	pid = find_inode(parent, 1);
+	lock_ag(agno);
 	id->parent = pid;
+	unlock_ag(agno);
 	if (verbose || id->ilist || (pid && pid->ilist))
 		dbprintf(_("inode %lld parent %lld\n"), id->ino, parent);
 }
@@ -767,26 +856,166 @@ blockfree_f(
 	}
 	rt = mp->m_sb.sb_rextents != 0;
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		xfree(dbmap[c]);
+		dbmap_free(dbmap[c]);
 		xfree(inomap[c]);
 		free_inodata(c);
 	}
 	if (rt) {
-		xfree(dbmap[c]);
+		dbmap_free(dbmap[c]);
 		xfree(inomap[c]);
 		xfree(sumcompute);
 		xfree(sumfile);
 		sumcompute = sumfile = NULL;
 	}
+	for (c = 0; c <= mp->m_sb.sb_agcount; c++)
+		pthread_mutex_destroy(&ag_locks[c]);
+	xfree(ag_locks);
 	xfree(dbmap);
 	xfree(inomap);
 	xfree(inodata);
+	ag_locks = NULL;
 	dbmap = NULL;
 	inomap = NULL;
 	inodata = NULL;
 	return 0;
 }
 
+/* Scan one AG and add what we counted to the totals. */
+static void
+scan_ag_work(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct scan_totals	*t = wq->wq_ctx;
+
+	if (seenint())
+		return;
+
+	error = serious_error = sbver_err = lazycount = 0;
+	agf_aggr_freeblks = fdblocks = frextents = icount = ifree = 0;
+	sbversion = t->sbversion;
+
+	scan_ag(agno);
+
+	pthread_mutex_lock(&t->lock);
+	t->error += error;
+	t->serious_error += serious_error;
+	t->sbver_err += sbver_err;
+	t->lazycount |= lazycount;
+	t->sbversion_set |= sbversion & ~t->sbversion;
+	t->sbversion_clear |= t->sbversion & ~sbversion;
+	t->agf_aggr_freeblks += agf_aggr_freeblks;
+	t->fdblocks += fdblocks;
+	t->frextents += frextents;
+	t->icount += icount;
+	t->ifree += ifree;
+	pthread_mutex_unlock(&t->lock);
+
+	free(dirhash);
+	dirhash = NULL;
+	free_cur_stack();
+}
+
+/*
+ * Scan all the AGs, several at a time.  Blocks, inodes and directory
+ * entries are recorded in the maps and inode table of whichever AG they
+ * belong to, so the checks that need the whole filesystem (link counts,
+ * unclaimed blocks, the root directory) run afterwards on the merged maps.
+ */
+static void
+scan_ags(void)
+{
+	struct scan_totals	t = {
+		.sbversion	= sbversion,
+	};
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	int			threads = nr_threads;
+	int			ret;
+
+	if (threads == 0)
+		threads = platform_nproc();
+	threads = min(threads, (int)mp->m_sb.sb_agcount);
+
+	pthread_mutex_init(&t.lock, NULL);
+	ret = -workqueue_create(&wq, &t, threads);
+	if (ret) {
+		dbprintf(_("cannot create AG threads: %s\n"), strerror(ret));
+		serious_error++;
+		goto out;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ret = -workqueue_add(&wq, scan_ag_work, agno, NULL);
+		if (ret) {
+			dbprintf(_("cannot queue AG %u: %s\n"), agno,
+					strerror(ret));
+			serious_error++;
+			break;
+		}
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret) {
+		dbprintf(_("cannot finish AG threads: %s\n"), strerror(ret));
+		serious_error++;
+	}
+	workqueue_destroy(&wq);
+
+	error += t.error;
+	serious_error += t.serious_error;
+	sbver_err += t.sbver_err;
+	lazycount |= t.lazycount;
+	sbversion = (sbversion | t.sbversion_set) & ~t.sbversion_clear;
+	agf_aggr_freeblks += t.agf_aggr_freeblks;
+	fdblocks += t.fdblocks;
+	frextents += t.frextents;
+	icount += t.icount;
+	ifree += t.ifree;
+out:
+	pthread_mutex_destroy(&t.lock);
+}
+
+/*
+ * Estimate how much memory blockget needs, so that nobody finds out that
+ * it won't fit hours into the scan.  How big the block type maps get
+ * depends on how fragmented the filesystem is, so this is a range.
+ */
+static void
+estimate_memory(void)
+{
+	uint64_t	nblocks;
+	uint64_t	lo, hi;
+	uint64_t	fixed;
+	uint64_t	physmem = platform_physmem() / 1024;
+
+	nblocks = (uint64_t)mp->m_sb.sb_agcount * mp->m_sb.sb_agblocks;
+	lo = mp->m_sb.sb_agcount * dbmap_min_bytes(mp->m_sb.sb_agblocks);
+	hi = mp->m_sb.sb_agcount * dbmap_max_bytes(mp->m_sb.sb_agblocks);
+	if (mp->m_sb.sb_rextents) {
+		nblocks += mp->m_sb.sb_rblocks;
+		lo += dbmap_min_bytes(mp->m_sb.sb_rblocks);
+		hi += dbmap_max_bytes(mp->m_sb.sb_rblocks);
+	}
+
+	/* inomap, inodata and its hash tables, and a guess at the names */
+	fixed = nblocks * sizeof(inodata_t *);
+	fixed += mp->m_sb.sb_icount * sizeof(inodata_t);
+	fixed += (uint64_t)mp->m_sb.sb_agcount * inodata_hash_size *
+			sizeof(inodata_t *);
+	if (nflag)
+		fixed += mp->m_sb.sb_icount * 32;
+	lo = (lo + fixed) >> 20;
+	hi = (hi + fixed) >> 20;
+
+	if (verbose)
+		dbprintf(_("blockget needs %llu-%llu MiB of memory\n"),
+			(unsigned long long)lo, (unsigned long long)hi);
+	else if (lo > physmem)
+		dbprintf(_("WARNING: blockget needs at least %llu MiB of memory, "
+			 "but there is only %llu MiB\n"),
+			(unsigned long long)lo, (unsigned long long)physmem);
+}
+
 /*
  * Check consistency of xfs filesystem contents.
  */
@@ -797,13 +1026,13 @@ blockget_f(
 {
 	xfs_agnumber_t	agno;
 	int		oldprefix;
-	int		sbyell;
 
 	if (dbmap) {
 		dbprintf(_("already have block usage information\n"));
 		return 0;
 	}
 
+	init_perag_data();
 	if (!init(argc, argv)) {
 		if (serious_error)
 			exitcode = 3;
@@ -813,14 +1042,8 @@ blockget_f(
 	}
 	oldprefix = dbprefix;
 	dbprefix |= pflag;
-	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		scan_ag(agno);
-		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
-			sbyell = 1;
-			dbprintf(_("WARNING: this may be a newer XFS "
-				 "filesystem.\n"));
-		}
-	}
+	estimate_memory();
+	scan_ags();
 	if (blist_size) {
 		xfree(blist);
 		blist = NULL;
@@ -1021,6 +1244,7 @@ blocktrash_f(
 	int		done;
 	int		goodmask;
 	int		i;
+	xfs_extlen_t	len;
 	ltab_t		*lentab;
 	int		lentablen;
 	int		max;
@@ -1032,6 +1256,7 @@ blocktrash_f(
 	uint		seed;
 	int		sopt;
 	int		tmask;
+	dbm_t		type;
 	bool		this_block = false;
 	int		bit_offset = -1;
 
@@ -1174,11 +1399,11 @@ blocktrash_f(
 		goto out;
 	}
 	for (blocks = 0, agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		for (agbno = 0, p = dbmap[agno];
-		     agbno < mp->m_sb.sb_agblocks;
-		     agbno++, p++) {
-			if ((1 << *p) & tmask)
-				blocks++;
+		for (agbno = 0; agbno < mp->m_sb.sb_agblocks; agbno += len) {
+			len = get_dbmap_run(agno, agbno,
+					mp->m_sb.sb_agblocks - agbno, &type);
+			if ((1 << type) & tmask)
+				blocks += len;
 		}
 	}
 	if (blocks == 0) {
@@ -1191,18 +1416,23 @@ blocktrash_f(
 		for (bi = 0, agno = 0, done = 0;
 		     !done && agno < mp->m_sb.sb_agcount;
 		     agno++) {
-			for (agbno = 0, p = dbmap[agno];
+			for (agbno = 0;
 			     agbno < mp->m_sb.sb_agblocks;
-			     agbno++, p++) {
-				if (!((1 << *p) & tmask))
+			     agbno += len) {
+				len = get_dbmap_run(agno, agbno,
+					mp->m_sb.sb_agblocks - agbno, &type);
+				if (!((1 << type) & tmask))
 					continue;
-				if (bi++ < randb)
+				if (bi + len <= randb) {
+					bi += len;
 					continue;
+				}
+				agbno += randb - bi;
 				push_cur();
 				set_cur(NULL,
 					XFS_AGB_TO_DADDR(mp, agno, agbno),
 					blkbb, DB_RING_IGN, NULL);
-				blocktrash_b(bit_offset, (dbm_t)*p,
+				blocktrash_b(bit_offset, type,
 					&lentab[random() % lentablen], mode);
 				pop_cur();
 				done = 1;
@@ -1263,11 +1493,10 @@ blockuse_f(
 		}
 	}
 	while (agbno <= end) {
-		p = &dbmap[agno][agbno];
 		i = inomap[agno][agbno];
 		dbprintf(_("block %llu (%u/%u) type %s"),
 			(xfs_fsblock_t)XFS_AGB_TO_FSB(mp, agno, agbno),
-			agno, agbno, typename[(dbm_t)*p]);
+			agno, agbno, typename[dbmap_get(dbmap[agno], agbno)]);
 		if (i) {
 			dbprintf(_(" inode %lld"), i->ino);
 			if (shownames && (p = inode_name(i->ino, NULL))) {
@@ -1314,27 +1543,29 @@ check_dbmap(
 	dbm_t		type,
 	int		ignore_reflink)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	xfs_extlen_t	n;
 	dbm_t		d;
 
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
+	for (i = 0; i < len; i += n) {
 		if (!dbmap_boundscheck(agno, agbno + i)) {
 			dbprintf(_("block %u/%u beyond end of expected area\n"),
 				agno, agbno + i);
 			error++;
 			break;
 		}
-		d = (dbm_t)*p;
+		n = get_dbmap_run(agno, agbno + i, len - i, &d);
 		if (ignore_reflink && (d == DBM_UNKNOWN || d == DBM_DATA ||
 				       d == DBM_RLDATA))
 			continue;
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLISTA(agno, agbno + i)) {
+		if (d == type)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLISTA(agno, agbno + j)) {
 				dbprintf(_("block %u/%u expected type %s got "
 					 "%s\n"),
-					agno, agbno + i, typename[type],
-					typename[(dbm_t)*p]);
+					agno, agbno + j, typename[type],
+					typename[d]);
 			}
 			error++;
 		}
@@ -1499,22 +1730,26 @@ check_rdbmap(
 	xfs_extlen_t	len,
 	dbm_t		type)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	xfs_extlen_t	n;
+	dbm_t		d;
 
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
+	for (i = 0; i < len; i += n) {
 		if (!rdbmap_boundscheck(bno + i)) {
 			dbprintf(_("rtblock %llu beyond end of expected area\n"),
 				bno + i);
 			error++;
 			break;
 		}
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLIST(bno + i))
+		n = get_dbmap_run(mp->m_sb.sb_agcount, bno + i, len - i, &d);
+		if (d == type)
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu expected type %s got "
 					 "%s\n"),
-					bno + i, typename[type],
-					typename[(dbm_t)*p]);
+					bno + j, typename[type],
+					typename[d]);
 			error++;
 		}
 	}
@@ -1645,34 +1880,41 @@ check_set_dbmap(
 	xfs_agnumber_t	c_agno,
 	xfs_agblock_t	c_agbno)
 {
-	xfs_extlen_t	i;
+	xfs_extlen_t	i, j;
+	xfs_extlen_t	n;
 	int		mayprint;
-	char		*p;
+	dbm_t		d;
 
 	if (!check_range(agno, agbno, len))  {
 		dbprintf(_("blocks %u/%u..%u claimed by block %u/%u\n"), agno,
 			agbno, agbno + len - 1, c_agno, c_agbno);
 		return;
 	}
+	lock_ag(agno);
 	check_dbmap(agno, agbno, len, type1, is_reflink(type2));
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
+	for (i = 0; i < len; i += n) {
 		if (!dbmap_boundscheck(agno, agbno + i)) {
 			dbprintf(_("block %u/%u beyond end of expected area\n"),
 				agno, agbno + i);
 			error++;
 			break;
 		}
-		if (*p == DBM_RLDATA && type2 == DBM_DATA)
+		n = get_dbmap_run(agno, agbno + i, len - i, &d);
+		if (d == DBM_RLDATA && type2 == DBM_DATA)
 			;	/* do nothing */
-		else if (*p == DBM_DATA && type2 == DBM_DATA)
-			*p = (char)DBM_RLDATA;
+		else if (d == DBM_DATA && type2 == DBM_DATA)
+			dbmap_set(dbmap[agno], agbno + i, n, DBM_RLDATA);
 		else
-			*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLISTA(agno, agbno + i)))
-			dbprintf(_("setting block %u/%u to %s\n"), agno, agbno + i,
-				typename[type2]);
+			dbmap_set(dbmap[agno], agbno + i, n, type2);
+		if (!mayprint)
+			continue;
+		for (j = i; j < i + n; j++)
+			if (verbose || CHECK_BLISTA(agno, agbno + j))
+				dbprintf(_("setting block %u/%u to %s\n"),
+					agno, agbno + j, typename[type2]);
 	}
+	unlock_ag(agno);
 }
 
 static void
@@ -1684,24 +1926,25 @@ check_set_rdbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_rrange(bno, len))
 		return;
+	lock_ag(mp->m_sb.sb_agcount);
 	check_rdbmap(bno, len, type1);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
+	for (i = 0; i < len; i++) {
 		if (!rdbmap_boundscheck(bno + i)) {
 			dbprintf(_("rtblock %llu beyond end of expected area\n"),
 				bno + i);
 			error++;
 			break;
 		}
-		*p = (char)type2;
 		if (mayprint && (verbose || CHECK_BLIST(bno + i)))
 			dbprintf(_("setting rtblock %llu to %s\n"),
 				bno + i, typename[type2]);
 	}
+	dbmap_set(dbmap[mp->m_sb.sb_agcount], bno, i, type2);
+	unlock_ag(mp->m_sb.sb_agcount);
 }
 
 static void
@@ -1737,16 +1980,20 @@ checknot_dbmap(
 	xfs_extlen_t	len,
 	int		typemask)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	xfs_extlen_t	n;
+	dbm_t		d;
 
 	if (!check_range(agno, agbno, len))
 		return;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
-			if (!sflag || CHECK_BLISTA(agno, agbno + i))
+	for (i = 0; i < len; i += n) {
+		n = get_dbmap_run(agno, agbno + i, len - i, &d);
+		if (!((1 << d) & typemask))
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLISTA(agno, agbno + j))
 				dbprintf(_("block %u/%u type %s not expected\n"),
-					agno, agbno + i, typename[(dbm_t)*p]);
+					agno, agbno + j, typename[d]);
 			error++;
 		}
 	}
@@ -1758,16 +2005,20 @@ checknot_rdbmap(
 	xfs_extlen_t	len,
 	int		typemask)
 {
-	xfs_extlen_t	i;
-	char		*p;
+	xfs_extlen_t	i, j;
+	xfs_extlen_t	n;
+	dbm_t		d;
 
 	if (!check_rrange(bno, len))
 		return;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
-		if ((1 << *p) & typemask) {
-			if (!sflag || CHECK_BLIST(bno + i))
+	for (i = 0; i < len; i += n) {
+		n = get_dbmap_run(mp->m_sb.sb_agcount, bno + i, len - i, &d);
+		if (!((1 << d) & typemask))
+			continue;
+		for (j = i; j < i + n; j++) {
+			if (!sflag || CHECK_BLIST(bno + j))
 				dbprintf(_("rtblock %llu type %s not expected\n"),
-					bno + i, typename[(dbm_t)*p]);
+					bno + j, typename[d]);
 			error++;
 		}
 	}
@@ -1872,18 +2123,21 @@ find_inode(
 		return NULL;
 	htab = inodata[agno];
 	ih = agino % inodata_hash_size;
+	lock_ag(agno);
 	ent = htab[ih];
 	while (ent) {
 		if (ent->ino == ino)
-			return ent;
+			goto out_unlock;
 		ent = ent->next;
 	}
 	if (!add)
-		return NULL;
+		goto out_unlock;
 	ent = xcalloc(1, sizeof(*ent));
 	ent->ino = ino;
 	ent->next = htab[ih];
 	htab[ih] = ent;
+out_unlock:
+	unlock_ag(agno);
 	return ent;
 }
 
@@ -1933,24 +2187,28 @@ init(
 	dbmap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*dbmap));
 	inomap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*inomap));
 	inodata = xmalloc(mp->m_sb.sb_agcount * sizeof(*inodata));
+	ag_locks = xmalloc((mp->m_sb.sb_agcount + 1) * sizeof(*ag_locks));
+	for (c = 0; c <= mp->m_sb.sb_agcount; c++)
+		pthread_mutex_init(&ag_locks[c], NULL);
 	inodata_hash_size =
 		(int)max(min(mp->m_sb.sb_icount /
 				(INODATA_AVG_HASH_LENGTH * mp->m_sb.sb_agcount),
 			     MAX_INODATA_HASH_SIZE),
 			 MIN_INODATA_HASH_SIZE);
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**dbmap));
+		dbmap[c] = dbmap_alloc(mp->m_sb.sb_agblocks);
 		inomap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**inomap));
 		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
 	}
 	if (rt) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**dbmap));
+		dbmap[c] = dbmap_alloc(mp->m_sb.sb_rblocks);
 		inomap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**inomap));
 		sumfile = xcalloc(mp->m_rsumsize, 1);
 		sumcompute = xcalloc(mp->m_rsumsize, 1);
 	}
 	nflag = sflag = tflag = verbose = optind = 0;
-	while ((c = getopt(argc, argv, "b:i:npstv")) != EOF) {
+	nr_threads = 0;
+	while ((c = getopt(argc, argv, "b:i:j:npstv")) != EOF) {
 		switch (c) {
 		case 'b':
 			bno = strtoll(optarg, NULL, 10);
@@ -1960,6 +2218,13 @@ init(
 			ino = strtoll(optarg, NULL, 10);
 			add_ilist(ino);
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads <= 0) {
+				dbprintf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			break;
 		case 'n':
 			nflag = 1;
 			break;
@@ -2045,10 +2310,6 @@ ncheck_f(
 	char		*p;
 	int		security;
 
-	if (!inodata || !nflag) {
-		dbprintf(_("must run blockget -n first\n"));
-		return 0;
-	}
 	security = optind = ilist_size = 0;
 	ilist = NULL;
 	while ((c = getopt(argc, argv, "i:s")) != EOF) {
@@ -2068,6 +2329,12 @@ ncheck_f(
 			return 0;
 		}
 	}
+	/* Without blockget -n, index the names ourselves. */
+	if (!inodata || !nflag) {
+		nindex_ncheck(ilist, ilist_size, security);
+		xfree(ilist);
+		return 0;
+	}
 	if (ilist) {
 		for (ilp = ilist; ilp < &ilist[ilist_size]; ilp++) {
 			ino = *ilp;
@@ -2517,12 +2784,9 @@ process_data_dir_v2(
 				parent = cid ? lino : NULLFSINO;
 			(*dotdot)++;
 		} else if (dep->namelen != 1 || dep->name[0] != '.') {
-			if (cid != NULL) {
-				if (!cid->parent)
-					cid->parent = id;
-				addname_inode(cid, (char *)dep->name,
+			if (cid != NULL)
+				addname_inode(cid, id, (char *)dep->name,
 					dep->namelen);
-			}
 		} else {
 			if (lino != id->ino) {
 				if (!sflag || v)
@@ -3743,9 +4007,8 @@ process_sf_dir_v2(
 			error++;
 		} else {
 			addlink_inode(cid);
-			if (!cid->parent)
-				cid->parent = id;
-			addname_inode(cid, (char *)sfe->name, sfe->namelen);
+			addname_inode(cid, id, (char *)sfe->name,
+					sfe->namelen);
 		}
 		if (v)
 			dbprintf(_("dir %lld entry %*.*s offset %d %lld\n"),
@@ -3813,12 +4076,14 @@ quota_add(
 	xfs_qcnt_t	ic,
 	xfs_qcnt_t	rc)
 {
+	pthread_mutex_lock(&qdata_lock);
 	if (qudo && usrid != NULL)
 		quota_add1(qudata, *usrid, dq, bc, ic, rc);
 	if (qgdo && grpid != NULL)
 		quota_add1(qgdata, *grpid, dq, bc, ic, rc);
 	if (qpdo && prjid != NULL)
 		quota_add1(qpdata, *prjid, dq, bc, ic, rc);
+	pthread_mutex_unlock(&qdata_lock);
 }
 
 static void
@@ -4221,6 +4486,26 @@ scan_lbtree(
 	pop_cur();
 }
 
+/* Start reading the children of an interior btree block. */
+static void
+scan_sbtree_readahead(
+	xfs_agf_t	*agf,
+	__be32		*pp,
+	int		nrecs,
+	typnm_t		btype)
+{
+	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
+	int		i;
+
+	for (i = 0; i < nrecs; i++) {
+		xfs_agblock_t	bno = be32_to_cpu(pp[i]);
+
+		if (libxfs_verify_agbno(mp, seqno, bno))
+			readahead_cur(&typtab[btype],
+				XFS_AGB_TO_DADDR(mp, seqno, bno), blkbb);
+	}
+}
+
 static void
 scan_sbtree(
 	xfs_agf_t	*agf,
@@ -4315,6 +4600,12 @@ scanfunc_bmap(
 		return;
 	}
 	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[0]);
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
+		if (libxfs_verify_fsbno(mp, be64_to_cpu(pp[i])))
+			readahead_cur(&typtab[btype],
+				XFS_FSB_TO_DADDR(mp, be64_to_cpu(pp[i])),
+				blkbb);
+	}
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_lbtree(be64_to_cpu(pp[i]), level, scanfunc_bmap, type, id,
 					totd, toti, nex, blkmapp, 0, btype);
@@ -4390,6 +4681,8 @@ scanfunc_bno(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs),
+			TYP_BNOBT);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_bno, TYP_BNOBT);
 }
@@ -4467,6 +4760,8 @@ scanfunc_cnt(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs),
+			TYP_CNTBT);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_cnt, TYP_CNTBT);
 }
@@ -4616,6 +4911,8 @@ next_buf:
 		return;
 	}
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs),
+			TYP_INOBT);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_ino, TYP_INOBT);
 }
@@ -4717,6 +5014,8 @@ next_buf:
 		return;
 	}
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs),
+			TYP_FINOBT);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_fino, TYP_FINOBT);
 }
@@ -4788,6 +5087,8 @@ scanfunc_rmap(
 		return;
 	}
 	pp = XFS_RMAP_PTR_ADDR(block, 1, mp->m_rmap_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs),
+			TYP_RMAPBT);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_rmap,
 				TYP_RMAPBT);
@@ -4884,6 +5185,8 @@ scanfunc_refcnt(
 		return;
 	}
 	pp = XFS_REFCOUNT_PTR_ADDR(block, 1, mp->m_refc_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs),
+			TYP_REFCBT);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, 0, scanfunc_refcnt,
 				TYP_REFCBT);
@@ -4912,8 +5215,9 @@ set_inomap(
 	inodata_t	**idp;
 	int		mayprint;
 
+	lock_ag(agno);
 	if (!check_inomap(agno, agbno, len, id->ino))
-		return;
+		goto out_unlock;
 	mayprint = verbose | id->ilist | blist_size;
 	for (i = 0, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
 		*idp = id;
@@ -4922,6 +5226,8 @@ set_inomap(
 			dbprintf(_("setting inode to %lld for block %u/%u\n"),
 				id->ino, agno, agbno + i);
 	}
+out_unlock:
+	unlock_ag(agno);
 }
 
 static void
@@ -4943,8 +5249,9 @@ set_rinomap(
 	inodata_t	**idp;
 	int		mayprint;
 
+	lock_ag(mp->m_sb.sb_agcount);
 	if (!check_rinomap(bno, len, id->ino))
-		return;
+		goto out_unlock;
 	mayprint = verbose | id->ilist | blist_size;
 	for (i = 0, idp = &inomap[mp->m_sb.sb_agcount][bno];
 	     i < len;
@@ -4954,6 +5261,8 @@ set_rinomap(
 			dbprintf(_("setting inode to %lld for rtblock %llu\n"),
 				id->ino, bno + i);
 	}
+out_unlock:
+	unlock_ag(mp->m_sb.sb_agcount);
 }
 
 static void
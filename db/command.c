@@ -7,6 +7,7 @@
 #include "libxfs.h"
 #include "addr.h"
 #include "attrset.h"
+#include "batch.h"
 #include "block.h"
 #include "bmap.h"
 #include "check.h"
@@ -110,6 +111,7 @@ init_commands(void)
 	agfl_init();
 	agi_init();
 	attrset_init();
+	batch_init();
 	block_init();
 	bmap_init();
 	btdump_init();
@@ -0,0 +1,315 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include "libxfs.h"
+#include "malloc.h"
+#include "dbmap.h"
+
+/*
+ * Block Type Map
+ *
+ * blockget records what every block is used for.  Most of a filesystem is
+ * long stretches of blocks of the same type, so instead of a byte per
+ * block we cut the map into chunks of 65536 blocks and keep each chunk in
+ * whichever form is smallest:
+ *
+ * - a single type, for a chunk that is all one thing;
+ * - a sorted list of runs, each starting where the type changes;
+ * - a byte per block, once the run list would be bigger than that.
+ *
+ * Memory use therefore grows with the number of places where the block
+ * type changes and never exceeds a byte per block plus the chunk headers.
+ * The caller does its own locking.
+ */
+
+#define DBMAP_CHUNK_SHIFT	16
+#define DBMAP_CHUNK_BLOCKS	(1U << DBMAP_CHUNK_SHIFT)
+#define DBMAP_CHUNK_MASK	(DBMAP_CHUNK_BLOCKS - 1)
+
+struct dbmap_run {
+	uint16_t		start;		/* first block in the chunk */
+	uint8_t			type;
+};
+
+/* Beyond this many runs a byte per block is smaller. */
+#define DBMAP_RUNS_MAX		(DBMAP_CHUNK_BLOCKS / sizeof(struct dbmap_run))
+
+struct dbmap_chunk {
+	struct dbmap_run	*runs;		/* NULL if not a run list */
+	uint8_t			*types;		/* NULL if not a byte map */
+	uint32_t		nr;		/* runs in use */
+	uint32_t		alloc;		/* runs allocated */
+	uint8_t			type;		/* if neither of the above */
+};
+
+struct dbmap {
+	uint64_t		nchunks;
+	struct dbmap_chunk	chunks[];
+};
+
+static inline uint64_t
+dbmap_nchunks(
+	uint64_t		nblocks)
+{
+	return (nblocks + DBMAP_CHUNK_MASK) >> DBMAP_CHUNK_SHIFT;
+}
+
+/* Create a map of nblocks blocks, all of type 0. */
+struct dbmap *
+dbmap_alloc(
+	uint64_t		nblocks)
+{
+	struct dbmap		*map;
+	uint64_t		nchunks = dbmap_nchunks(nblocks);
+
+	map = xcalloc(1, sizeof(struct dbmap) +
+			nchunks * sizeof(struct dbmap_chunk));
+	map->nchunks = nchunks;
+	return map;
+}
+
+void
+dbmap_free(
+	struct dbmap		*map)
+{
+	uint64_t		c;
+
+	if (!map)
+		return;
+	for (c = 0; c < map->nchunks; c++) {
+		xfree(map->chunks[c].runs);
+		xfree(map->chunks[c].types);
+	}
+	xfree(map);
+}
+
+/* Memory needed for a map of nblocks blocks before anything is set... */
+uint64_t
+dbmap_min_bytes(
+	uint64_t		nblocks)
+{
+	return sizeof(struct dbmap) +
+	       dbmap_nchunks(nblocks) * sizeof(struct dbmap_chunk);
+}
+
+/* ...and at worst, if every chunk is fragmented. */
+uint64_t
+dbmap_max_bytes(
+	uint64_t		nblocks)
+{
+	return dbmap_min_bytes(nblocks) +
+	       dbmap_nchunks(nblocks) * DBMAP_CHUNK_BLOCKS;
+}
+
+/* Find the run containing block @off of a chunk. */
+static uint32_t
+dbmap_run_find(
+	struct dbmap_chunk	*ch,
+	uint32_t		off)
+{
+	uint32_t		lo = 0;
+	uint32_t		hi = ch->nr;
+	uint32_t		mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (ch->runs[mid].start <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline uint32_t
+dbmap_run_end(
+	struct dbmap_chunk	*ch,
+	uint32_t		i)
+{
+	return i + 1 < ch->nr ? ch->runs[i + 1].start : DBMAP_CHUNK_BLOCKS;
+}
+
+unsigned int
+dbmap_get(
+	struct dbmap		*map,
+	uint64_t		bno)
+{
+	struct dbmap_chunk	*ch = &map->chunks[bno >> DBMAP_CHUNK_SHIFT];
+	uint32_t		off = bno & DBMAP_CHUNK_MASK;
+
+	if (ch->types)
+		return ch->types[off];
+	if (ch->runs)
+		return ch->runs[dbmap_run_find(ch, off)].type;
+	return ch->type;
+}
+
+/*
+ * Return the type of block bno and the number of blocks from there that
+ * have the same type.  The count stops at the end of a chunk, so callers
+ * walking a range should just call this again.
+ */
+uint64_t
+dbmap_extent(
+	struct dbmap		*map,
+	uint64_t		bno,
+	unsigned int		*type)
+{
+	struct dbmap_chunk	*ch = &map->chunks[bno >> DBMAP_CHUNK_SHIFT];
+	uint32_t		off = bno & DBMAP_CHUNK_MASK;
+	uint32_t		end;
+	uint32_t		i;
+
+	if (ch->types) {
+		*type = ch->types[off];
+		for (end = off + 1; end < DBMAP_CHUNK_BLOCKS; end++)
+			if (ch->types[end] != *type)
+				break;
+		return end - off;
+	}
+	if (ch->runs) {
+		i = dbmap_run_find(ch, off);
+		*type = ch->runs[i].type;
+		return dbmap_run_end(ch, i) - off;
+	}
+	*type = ch->type;
+	return DBMAP_CHUNK_BLOCKS - off;
+}
+
+/* Switch a chunk over to a byte per block. */
+static void
+dbmap_chunk_to_types(
+	struct dbmap_chunk	*ch)
+{
+	uint32_t		i;
+
+	ch->types = xmalloc(DBMAP_CHUNK_BLOCKS);
+	for (i = 0; i < ch->nr; i++)
+		memset(ch->types + ch->runs[i].start, ch->runs[i].type,
+				dbmap_run_end(ch, i) - ch->runs[i].start);
+	xfree(ch->runs);
+	ch->runs = NULL;
+	ch->nr = ch->alloc = 0;
+}
+
+/* Merge run i into run i - 1 if they have the same type. */
+static void
+dbmap_run_merge(
+	struct dbmap_chunk	*ch,
+	uint32_t		i)
+{
+	if (i == 0 || i >= ch->nr || ch->runs[i].type != ch->runs[i - 1].type)
+		return;
+	memmove(&ch->runs[i], &ch->runs[i + 1],
+			(ch->nr - i - 1) * sizeof(struct dbmap_run));
+	ch->nr--;
+}
+
+/* Set blocks [lo, hi) of a run list chunk to type. */
+static void
+dbmap_runs_set(
+	struct dbmap_chunk	*ch,
+	uint32_t		lo,
+	uint32_t		hi,
+	uint8_t			type)
+{
+	struct dbmap_run	new[3];
+	uint32_t		i, j, n = 0;
+	uint32_t		nr;
+
+	/*
+	 * Runs i to j cover the range.  They get replaced by whatever of
+	 * run i comes before lo, the new run, and whatever of run j comes
+	 * after hi.
+	 */
+	i = dbmap_run_find(ch, lo);
+	j = dbmap_run_find(ch, hi - 1);
+	if (ch->runs[i].start < lo)
+		new[n++] = ch->runs[i];
+	new[n].start = lo;
+	new[n++].type = type;
+	if (hi < dbmap_run_end(ch, j)) {
+		new[n].start = hi;
+		new[n++].type = ch->runs[j].type;
+	}
+
+	nr = ch->nr - (j - i + 1) + n;
+	if (nr > DBMAP_RUNS_MAX) {
+		dbmap_chunk_to_types(ch);
+		memset(ch->types + lo, type, hi - lo);
+		return;
+	}
+	if (nr > ch->alloc) {
+		ch->alloc = min(max(ch->alloc * 2, nr),
+				(uint32_t)DBMAP_RUNS_MAX);
+		ch->runs = xrealloc(ch->runs,
+				ch->alloc * sizeof(struct dbmap_run));
+	}
+	memmove(&ch->runs[i + n], &ch->runs[j + 1],
+			(ch->nr - j - 1) * sizeof(struct dbmap_run));
+	memcpy(&ch->runs[i], new, n * sizeof(struct dbmap_run));
+	ch->nr = nr;
+
+	/* Merge with the neighbors, back to front so the indices hold. */
+	dbmap_run_merge(ch, i + n);
+	for (j = n; j > 0; j--)
+		dbmap_run_merge(ch, i + j - 1);
+
+	if (ch->nr == 1) {
+		ch->type = ch->runs[0].type;
+		xfree(ch->runs);
+		ch->runs = NULL;
+		ch->nr = ch->alloc = 0;
+	}
+}
+
+/* Set blocks [lo, hi) of a chunk to type. */
+static void
+dbmap_chunk_set(
+	struct dbmap_chunk	*ch,
+	uint32_t		lo,
+	uint32_t		hi,
+	uint8_t			type)
+{
+	if (ch->types) {
+		memset(ch->types + lo, type, hi - lo);
+		return;
+	}
+	if (!ch->runs) {
+		if (ch->type == type)
+			return;
+		if (lo == 0 && hi == DBMAP_CHUNK_BLOCKS) {
+			ch->type = type;
+			return;
+		}
+		ch->alloc = 4;
+		ch->runs = xmalloc(ch->alloc * sizeof(struct dbmap_run));
+		ch->runs[0].start = 0;
+		ch->runs[0].type = ch->type;
+		ch->nr = 1;
+	}
+	dbmap_runs_set(ch, lo, hi, type);
+}
+
+/* Set blocks [bno, bno + len) to type. */
+void
+dbmap_set(
+	struct dbmap		*map,
+	uint64_t		bno,
+	uint64_t		len,
+	unsigned int		type)
+{
+	uint64_t		end = bno + len;
+	uint64_t		next;
+
+	while (bno < end) {
+		next = min((bno | DBMAP_CHUNK_MASK) + 1, end);
+		dbmap_chunk_set(&map->chunks[bno >> DBMAP_CHUNK_SHIFT],
+				bno & DBMAP_CHUNK_MASK,
+				next - (bno & ~(uint64_t)DBMAP_CHUNK_MASK),
+				type);
+		bno = next;
+	}
+}
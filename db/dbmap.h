@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_DB_DBMAP_H__
+#define __XFS_DB_DBMAP_H__
+
+/* Block type map used by blockget; see dbmap.c. */
+struct dbmap;
+
+struct dbmap *dbmap_alloc(uint64_t nblocks);
+void dbmap_free(struct dbmap *map);
+unsigned int dbmap_get(struct dbmap *map, uint64_t bno);
+uint64_t dbmap_extent(struct dbmap *map, uint64_t bno, unsigned int *type);
+void dbmap_set(struct dbmap *map, uint64_t bno, uint64_t len,
+		unsigned int type);
+uint64_t dbmap_min_bytes(uint64_t nblocks);
+uint64_t dbmap_max_bytes(uint64_t nblocks);
+
+#endif /* __XFS_DB_DBMAP_H__ */
@@ -14,6 +14,9 @@
 #include "type.h"
 #include "init.h"
 #include "malloc.h"
+#include "sig.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
 
 typedef struct extent {
 	xfs_fileoff_t	startoff;
@@ -28,10 +31,15 @@ typedef	struct extmap {
 #define	EXTMAP_SIZE(n)	\
 	(offsetof(extmap_t, ents) + (sizeof(extent_t) * (n)))
 
+/*
+ * The AGs are scanned in parallel.  Each scanner counts extents in its own
+ * copies of extcount_actual and extcount_ideal and adds them to the totals
+ * in a frag_totals when it finishes an AG.
+ */
 static int		aflag;
 static int		dflag;
-static uint64_t	extcount_actual;
-static uint64_t	extcount_ideal;
+static __thread uint64_t	extcount_actual;
+static __thread uint64_t	extcount_ideal;
 static int		fflag;
 static int		lflag;
 static int		qflag;
@@ -64,6 +72,7 @@ static void		process_fork(struct xfs_dinode *dip, int whichfork);
 static void		process_inode(xfs_agf_t *agf, xfs_agino_t agino,
 				      struct xfs_dinode *dip);
 static void		scan_ag(xfs_agnumber_t agno);
+static void		scan_ags(void);
 static void		scan_lbtree(xfs_fsblock_t root, int nlevels,
 				    scan_lbtree_f_t func, extmap_t **extmapp,
 				    typnm_t btype);
@@ -75,6 +84,12 @@ static void		scanfunc_bmap(struct xfs_btree_block *block, int level,
 static void		scanfunc_ino(struct xfs_btree_block *block, int level,
 				     xfs_agf_t *agf);
 
+struct frag_totals {
+	pthread_mutex_t		lock;
+	uint64_t		extcount_actual;
+	uint64_t		extcount_ideal;
+};
+
 static const cmdinfo_t	frag_cmd =
 	{ "frag", NULL, frag_f, 0, -1, 0,
 	  "[-a] [-d] [-f] [-l] [-q] [-R] [-r] [-v]",
@@ -146,13 +161,11 @@ frag_f(
 	int		argc,
 	char		**argv)
 {
-	xfs_agnumber_t	agno;
 	double		answer;
 
 	if (!init(argc, argv))
 		return 0;
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		scan_ag(agno);
+	scan_ags();
 	if (extcount_actual)
 		answer = (double)(extcount_actual - extcount_ideal) * 100.0 /
 			 (double)extcount_actual;
@@ -375,6 +388,70 @@ scan_ag(
 	pop_cur();
 }
 
+/* Scan one AG and add what we counted to the totals. */
+static void
+scan_ag_work(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct frag_totals	*t = wq->wq_ctx;
+
+	if (seenint())
+		return;
+
+	extcount_actual = extcount_ideal = 0;
+	scan_ag(agno);
+
+	pthread_mutex_lock(&t->lock);
+	t->extcount_actual += extcount_actual;
+	t->extcount_ideal += extcount_ideal;
+	pthread_mutex_unlock(&t->lock);
+
+	free_cur_stack();
+}
+
+/*
+ * Scan all the AGs, several at a time.  With -v we print a line per inode,
+ * so scan one AG at a time to keep those in inode order.
+ */
+static void
+scan_ags(void)
+{
+	struct frag_totals	t = { };
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	int			threads = 1;
+	int			ret;
+
+	if (!vflag)
+		threads = min(platform_nproc(), (int)mp->m_sb.sb_agcount);
+
+	pthread_mutex_init(&t.lock, NULL);
+	ret = -workqueue_create(&wq, &t, threads);
+	if (ret) {
+		dbprintf(_("cannot create AG threads: %s\n"), strerror(ret));
+		goto out;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ret = -workqueue_add(&wq, scan_ag_work, agno, NULL);
+		if (ret) {
+			dbprintf(_("cannot queue AG %u: %s\n"), agno,
+					strerror(ret));
+			break;
+		}
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		dbprintf(_("cannot finish AG threads: %s\n"), strerror(ret));
+	workqueue_destroy(&wq);
+
+	extcount_actual += t.extcount_actual;
+	extcount_ideal += t.extcount_ideal;
+out:
+	pthread_mutex_destroy(&t.lock);
+}
+
 static void
 scan_lbtree(
 	xfs_fsblock_t	root,
@@ -390,6 +467,7 @@ scan_lbtree(
 		dbprintf(_("can't read btree block %u/%u\n"),
 			XFS_FSB_TO_AGNO(mp, root),
 			XFS_FSB_TO_AGBNO(mp, root));
+		pop_cur();
 		return;
 	}
 	(*func)(iocur_top->data, nlevels - 1, extmapp, btype);
@@ -411,6 +489,7 @@ scan_sbtree(
 		blkbb, DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		dbprintf(_("can't read btree block %u/%u\n"), seqno, root);
+		pop_cur();
 		return;
 	}
 	(*func)(iocur_top->data, nlevels - 1, agf);
@@ -448,11 +527,47 @@ scanfunc_bmap(
 		return;
 	}
 	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[0]);
+	for (i = 0; i < nrecs; i++) {
+		if (libxfs_verify_fsbno(mp, be64_to_cpu(pp[i])))
+			readahead_cur(&typtab[btype],
+				XFS_FSB_TO_DADDR(mp, be64_to_cpu(pp[i])),
+				blkbb);
+	}
 	for (i = 0; i < nrecs; i++)
 		scan_lbtree(be64_to_cpu(pp[i]), level, scanfunc_bmap, extmapp,
 									btype);
 }
 
+/* Start reading the inode clusters of a leaf full of inobt records. */
+static void
+scanfunc_ino_readahead(
+	xfs_inobt_rec_t		*rp,
+	int			nrecs,
+	xfs_agnumber_t		seqno,
+	int			blks_per_buf,
+	int			inodes_per_buf)
+{
+	xfs_agblock_t		agbno;
+	xfs_agblock_t		end_agbno;
+	int			ioff;
+	int			i;
+
+	for (i = 0; i < nrecs; i++) {
+		agbno = XFS_AGINO_TO_AGBNO(mp, be32_to_cpu(rp[i].ir_startino));
+		end_agbno = agbno + M_IGEO(mp)->ialloc_blks;
+		for (ioff = 0;
+		     agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK;
+		     agbno += blks_per_buf, ioff += inodes_per_buf) {
+			if (xfs_inobt_is_sparse_disk(&rp[i], ioff) ||
+			    !libxfs_verify_agbno(mp, seqno, agbno))
+				continue;
+			readahead_cur(&typtab[TYP_INODE],
+				XFS_AGB_TO_DADDR(mp, seqno, agbno),
+				XFS_FSB_TO_BB(mp, blks_per_buf));
+		}
+	}
+}
+
 static void
 scanfunc_ino(
 	struct xfs_btree_block	*block,
@@ -483,6 +598,8 @@ scanfunc_ino(
 
 	if (level == 0) {
 		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		scanfunc_ino_readahead(rp, be16_to_cpu(block->bb_numrecs),
+				seqno, blks_per_buf, inodes_per_buf);
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
 			agino = be32_to_cpu(rp[i].ir_startino);
 			agbno = XFS_AGINO_TO_AGBNO(mp, agino);
@@ -523,6 +640,12 @@ next_buf:
 		return;
 	}
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
+		agbno = be32_to_cpu(pp[i]);
+		if (libxfs_verify_agbno(mp, seqno, agbno))
+			readahead_cur(&typtab[TYP_INOBT],
+				XFS_AGB_TO_DADDR(mp, seqno, agbno), blkbb);
+	}
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), level, scanfunc_ino,
 								TYP_INOBT);
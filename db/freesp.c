@@ -12,6 +12,9 @@
 #include "output.h"
 #include "init.h"
 #include "malloc.h"
+#include "sig.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
 
 typedef struct histent
 {
@@ -21,6 +24,12 @@ typedef struct histent
 	long long	blocks;
 } histent_t;
 
+struct freesp_totals {
+	pthread_mutex_t	lock;
+	long long	totblocks;
+	long long	totexts;
+};
+
 static void	addhistent(int h);
 static void	addtohist(xfs_agnumber_t agno, xfs_agblock_t agbno,
 			  xfs_extlen_t len);
@@ -29,6 +38,7 @@ static void	histinit(int maxlen);
 static int	init(int argc, char **argv);
 static void	printhist(void);
 static void	scan_ag(xfs_agnumber_t agno);
+static void	scan_ags(void);
 static void	scanfunc_bno(struct xfs_btree_block *block, typnm_t typ, int level,
 			     xfs_agf_t *agf);
 static void	scanfunc_cnt(struct xfs_btree_block *block, typnm_t typ, int level,
@@ -40,6 +50,11 @@ static void	scan_sbtree(xfs_agf_t *agf, xfs_agblock_t root, typnm_t typ,
 					 int level, xfs_agf_t *agf));
 static int	usage(void);
 
+/*
+ * The AGs are scanned in parallel.  Each scanner counts free extents into
+ * its own copy of the histogram (aghist) and of totblocks and totexts, and
+ * adds them into hist and the totals when it finishes an AG.
+ */
 static int		agcount;
 static xfs_agnumber_t	*aglist;
 static int		alignment;
@@ -47,12 +62,13 @@ static int		countflag;
 static int		dumpflag;
 static int		equalsize;
 static histent_t	*hist;
+static __thread histent_t	*aghist;
 static int		histcount;
 static int		multsize;
 static int		seen1;
 static int		summaryflag;
-static long long	totblocks;
-static long long	totexts;
+static __thread long long	totblocks;
+static __thread long long	totexts;
 
 static const cmdinfo_t	freesp_cmd =
 	{ "freesp", NULL, freesp_f, 0, -1, 0,
@@ -81,18 +97,13 @@ freesp_f(
 	int		argc,
 	char		**argv)
 {
-	xfs_agnumber_t	agno;
-
 	if (!init(argc, argv))
 		return 0;
 
 	if (dumpflag)
 		dbprintf("%8s %8s %8s\n", "agno", "agbno", "len");
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
-		if (inaglist(agno))
-			scan_ag(agno);
-	}
+	scan_ags();
 	if (histcount)
 		printhist();
 	if (summaryflag) {
@@ -219,6 +230,85 @@ scan_ag(
 	pop_cur();
 }
 
+/* Scan one AG and add its histogram to the totals. */
+static void
+scan_ag_work(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct freesp_totals	*t = wq->wq_ctx;
+	int			i;
+
+	if (seenint())
+		return;
+
+	aghist = xcalloc(histcount, sizeof(*aghist));
+	for (i = 0; i < histcount; i++) {
+		aghist[i].low = hist[i].low;
+		aghist[i].high = hist[i].high;
+	}
+	totblocks = totexts = 0;
+
+	scan_ag(agno);
+
+	pthread_mutex_lock(&t->lock);
+	for (i = 0; i < histcount; i++) {
+		hist[i].count += aghist[i].count;
+		hist[i].blocks += aghist[i].blocks;
+	}
+	t->totblocks += totblocks;
+	t->totexts += totexts;
+	pthread_mutex_unlock(&t->lock);
+
+	xfree(aghist);
+	aghist = NULL;
+	free_cur_stack();
+}
+
+/*
+ * Scan the AGs we were asked about, several at a time.  With -d we print
+ * every free extent, so scan one AG at a time to keep them in order.
+ */
+static void
+scan_ags(void)
+{
+	struct freesp_totals	t = { };
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	int			threads = 1;
+	int			ret;
+
+	if (!dumpflag)
+		threads = min(platform_nproc(), (int)mp->m_sb.sb_agcount);
+
+	pthread_mutex_init(&t.lock, NULL);
+	ret = -workqueue_create(&wq, &t, threads);
+	if (ret) {
+		dbprintf(_("cannot create AG threads: %s\n"), strerror(ret));
+		goto out;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		if (!inaglist(agno))
+			continue;
+		ret = -workqueue_add(&wq, scan_ag_work, agno, NULL);
+		if (ret) {
+			dbprintf(_("cannot queue AG %u: %s\n"), agno,
+					strerror(ret));
+			break;
+		}
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		dbprintf(_("cannot finish AG threads: %s\n"), strerror(ret));
+	workqueue_destroy(&wq);
+
+	totblocks += t.totblocks;
+	totexts += t.totexts;
+out:
+	pthread_mutex_destroy(&t.lock);
+}
+
 static int
 scan_agfl(
 	struct xfs_mount	*mp,
@@ -254,6 +344,26 @@ scan_freelist(
 	pop_cur();
 }
 
+/* Start reading the children of an interior btree block. */
+static void
+scan_sbtree_readahead(
+	xfs_agf_t	*agf,
+	__be32		*pp,
+	int		nrecs,
+	typnm_t		typ)
+{
+	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
+	int		i;
+
+	for (i = 0; i < nrecs; i++) {
+		xfs_agblock_t	bno = be32_to_cpu(pp[i]);
+
+		if (libxfs_verify_agbno(mp, seqno, bno))
+			readahead_cur(&typtab[typ],
+				XFS_AGB_TO_DADDR(mp, seqno, bno), blkbb);
+	}
+}
+
 static void
 scan_sbtree(
 	xfs_agf_t	*agf,
@@ -272,6 +382,7 @@ scan_sbtree(
 		blkbb, DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		dbprintf(_("can't read btree block %u/%u\n"), seqno, root);
+		pop_cur();
 		return;
 	}
 	(*func)(iocur_top->data, typ, nlevels - 1, agf);
@@ -303,6 +414,7 @@ scanfunc_bno(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs), typ);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_bno);
 }
@@ -331,6 +443,7 @@ scanfunc_cnt(
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	scan_sbtree_readahead(agf, pp, be16_to_cpu(block->bb_numrecs), typ);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
 		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_cnt);
 }
@@ -365,9 +478,9 @@ addtohist(
 	totexts++;
 	totblocks += len;
 	for (i = 0; i < histcount; i++) {
-		if (hist[i].high >= len) {
-			hist[i].count++;
-			hist[i].blocks += len;
+		if (aghist[i].high >= len) {
+			aghist[i].count++;
+			aghist[i].blocks += len;
 			break;
 		}
 	}
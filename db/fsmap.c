@@ -8,12 +8,75 @@
 #include "fsmap.h"
 #include "output.h"
 #include "init.h"
+#include "io.h"
+#include "type.h"
+#include "malloc.h"
+#include "sig.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
+
+/*
+ * Each AG is queried by its own thread, which writes its mappings to a
+ * temporary file.  The files are then read back and printed in AG order,
+ * numbering the mappings as we go, so the output is the same as a serial
+ * walk.
+ */
+struct fsmap_ag {
+	FILE			*fp;
+	int			error;
+	const char		*what;
+};
+
+struct fsmap_ctx {
+	xfs_fsblock_t		start_fsb;
+	xfs_fsblock_t		end_fsb;
+	xfs_agnumber_t		start_ag;
+	struct fsmap_ag		*ags;
+};
 
 struct fsmap_info {
 	unsigned long long	nr;
+	struct fsmap_ag		*ag;
 	xfs_agnumber_t		agno;
+	xfs_daddr_t		ra_node;	/* level 1 block last read ahead */
 };
 
+/*
+ * When the query moves into a new level 1 node, read ahead all the leaves
+ * under it that we haven't gotten to yet.  libxfs only reads ahead one
+ * sibling at a time, which is no help on a big rmapbt.
+ */
+static void
+fsmap_readahead(
+	struct xfs_btree_cur	*cur,
+	struct fsmap_info	*info)
+{
+	struct xfs_btree_block	*block;
+	struct xfs_buf		*bp;
+	xfs_agblock_t		agbno;
+	__be32			*pp;
+	int			i;
+
+	if (cur->bc_nlevels < 2)
+		return;
+	bp = cur->bc_levels[1].bp;
+	if (!bp || xfs_buf_daddr(bp) == info->ra_node)
+		return;
+	info->ra_node = xfs_buf_daddr(bp);
+
+	block = XFS_BUF_TO_BLOCK(bp);
+	for (i = cur->bc_levels[1].ptr + 1;
+	     i <= be16_to_cpu(block->bb_numrecs);
+	     i++) {
+		pp = XFS_RMAP_PTR_ADDR(block, i, mp->m_rmap_mxr[1]);
+		agbno = be32_to_cpu(*pp);
+		if (!libxfs_verify_agbno(mp, info->agno, agbno))
+			continue;
+		readahead_cur(&typtab[TYP_RMAPBT],
+				XFS_AGB_TO_DADDR(mp, info->agno, agbno), blkbb);
+	}
+}
+
 static int
 fsmap_fn(
 	struct xfs_btree_cur		*cur,
@@ -22,26 +85,44 @@ fsmap_fn(
 {
 	struct fsmap_info		*info = priv;
 
+	if (seenint())
+		return -ECANCELED;
+
+	fsmap_readahead(cur, info);
+	if (fwrite(rec, sizeof(*rec), 1, info->ag->fp) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+static void
+fsmap_print(
+	struct fsmap_info		*info,
+	const struct xfs_rmap_irec	*rec)
+{
 	dbprintf(_("%llu: %u/%u len %u owner %lld offset %llu bmbt %d attrfork %d extflag %d\n"),
 		info->nr, info->agno, rec->rm_startblock,
-		rec->rm_blockcount, rec->rm_owner, rec->rm_offset,
+		rec->rm_blockcount, (long long)rec->rm_owner,
+		(unsigned long long)rec->rm_offset,
 		!!(rec->rm_flags & XFS_RMAP_BMBT_BLOCK),
 		!!(rec->rm_flags & XFS_RMAP_ATTR_FORK),
 		!!(rec->rm_flags & XFS_RMAP_UNWRITTEN));
 	info->nr++;
-
-	return 0;
 }
 
 static void
-fsmap(
-	xfs_fsblock_t		start_fsb,
-	xfs_fsblock_t		end_fsb)
+fsmap_ag_work(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
 {
-	struct fsmap_info	info;
-	xfs_agnumber_t		start_ag;
-	xfs_agnumber_t		end_ag;
-	xfs_daddr_t		eofs;
+	struct fsmap_ctx	*ctx = wq->wq_ctx;
+	struct fsmap_ag		*ag = &ctx->ags[agno - ctx->start_ag];
+	struct fsmap_info	info = {
+		.ag		= ag,
+		.agno		= agno,
+		.ra_node	= XFS_BUF_DADDR_NULL,
+	};
 	struct xfs_rmap_irec	low = {0};
 	struct xfs_rmap_irec	high = {0};
 	struct xfs_btree_cur	*bt_cur;
@@ -49,57 +130,123 @@ fsmap(
 	struct xfs_perag	*pag;
 	int			error;
 
-	eofs = XFS_FSB_TO_BB(mp, mp->m_sb.sb_dblocks);
-	if (XFS_FSB_TO_DADDR(mp, end_fsb) >= eofs)
-		end_fsb = XFS_DADDR_TO_FSB(mp, eofs - 1);
+	if (seenint())
+		return;
 
-	low.rm_startblock = XFS_FSB_TO_AGBNO(mp, start_fsb);
-	high.rm_startblock = -1U;
+	if (agno == XFS_FSB_TO_AGNO(mp, ctx->start_fsb))
+		low.rm_startblock = XFS_FSB_TO_AGBNO(mp, ctx->start_fsb);
+	if (agno == XFS_FSB_TO_AGNO(mp, ctx->end_fsb))
+		high.rm_startblock = XFS_FSB_TO_AGBNO(mp, ctx->end_fsb);
+	else
+		high.rm_startblock = -1U;
 	high.rm_owner = ULLONG_MAX;
 	high.rm_offset = ULLONG_MAX;
 	high.rm_flags = XFS_RMAP_ATTR_FORK | XFS_RMAP_BMBT_BLOCK | XFS_RMAP_UNWRITTEN;
 
+	ag->fp = tmpfile();
+	if (!ag->fp) {
+		ag->error = errno;
+		ag->what = _("creating a temporary file");
+		return;
+	}
+
+	pag = libxfs_perag_get(mp, agno);
+	error = -libxfs_alloc_read_agf(mp, NULL, agno, 0, &agbp);
+	if (error) {
+		ag->error = error;
+		ag->what = _("reading AGF");
+		goto out_pag;
+	}
+
+	bt_cur = libxfs_rmapbt_init_cursor(mp, NULL, agbp, pag);
+	if (!bt_cur) {
+		ag->error = ENOMEM;
+		ag->what = _("creating a cursor");
+		goto out_agbp;
+	}
+
+	error = -libxfs_rmap_query_range(bt_cur, &low, &high, fsmap_fn, &info);
+	if (error && error != ECANCELED) {
+		ag->error = error;
+		ag->what = _("querying fsmap btree");
+	}
+	libxfs_btree_del_cursor(bt_cur, error ? XFS_BTREE_ERROR :
+						XFS_BTREE_NOERROR);
+out_agbp:
+	libxfs_buf_relse(agbp);
+out_pag:
+	libxfs_perag_put(pag);
+}
+
+static void
+fsmap(
+	xfs_fsblock_t		start_fsb,
+	xfs_fsblock_t		end_fsb)
+{
+	struct fsmap_ctx	ctx;
+	struct workqueue	wq;
+	xfs_agnumber_t		start_ag;
+	xfs_agnumber_t		end_ag;
+	xfs_agnumber_t		agno;
+	xfs_daddr_t		eofs;
+	struct fsmap_info	info = { 0 };
+	struct xfs_rmap_irec	rec;
+	struct fsmap_ag		*ag;
+	int			ret;
+
+	eofs = XFS_FSB_TO_BB(mp, mp->m_sb.sb_dblocks);
+	if (XFS_FSB_TO_DADDR(mp, end_fsb) >= eofs)
+		end_fsb = XFS_DADDR_TO_FSB(mp, eofs - 1);
+
 	start_ag = XFS_FSB_TO_AGNO(mp, start_fsb);
 	end_ag = XFS_FSB_TO_AGNO(mp, end_fsb);
 
-	info.nr = 0;
-	for_each_perag_range(mp, start_ag, end_ag, pag) {
-		if (pag->pag_agno == end_ag)
-			high.rm_startblock = XFS_FSB_TO_AGBNO(mp, end_fsb);
+	ctx.start_fsb = start_fsb;
+	ctx.end_fsb = end_fsb;
+	ctx.start_ag = start_ag;
+	ctx.ags = xcalloc(end_ag - start_ag + 1, sizeof(struct fsmap_ag));
 
-		error = -libxfs_alloc_read_agf(mp, NULL, pag->pag_agno, 0, &agbp);
-		if (error) {
-			libxfs_perag_put(pag);
-			dbprintf(_("Error %d while reading AGF.\n"), error);
-			return;
+	ret = -workqueue_create(&wq, &ctx,
+			min(platform_nproc(), (int)(end_ag - start_ag + 1)));
+	if (ret) {
+		dbprintf(_("cannot create AG threads: %s\n"), strerror(ret));
+		goto out;
+	}
+	for (agno = start_ag; agno <= end_ag; agno++) {
+		ret = -workqueue_add(&wq, fsmap_ag_work, agno, NULL);
+		if (ret) {
+			dbprintf(_("cannot queue AG %u: %s\n"), agno,
+					strerror(ret));
+			break;
 		}
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret)
+		dbprintf(_("cannot finish AG threads: %s\n"), strerror(ret));
+	workqueue_destroy(&wq);
 
-		bt_cur = libxfs_rmapbt_init_cursor(mp, NULL, agbp, pag);
-		if (!bt_cur) {
-			libxfs_buf_relse(agbp);
-			libxfs_perag_put(pag);
-			dbprintf(_("Not enough memory.\n"));
-			return;
+	for (agno = start_ag; agno <= end_ag && !seenint(); agno++) {
+		ag = &ctx.ags[agno - start_ag];
+		if (ag->fp) {
+			info.agno = agno;
+			rewind(ag->fp);
+			while (fread(&rec, sizeof(rec), 1, ag->fp) == 1 &&
+			       !seenint())
+				fsmap_print(&info, &rec);
 		}
-
-		info.agno = pag->pag_agno;
-		error = -libxfs_rmap_query_range(bt_cur, &low, &high,
-				fsmap_fn, &info);
-		if (error) {
-			libxfs_btree_del_cursor(bt_cur, XFS_BTREE_ERROR);
-			libxfs_buf_relse(agbp);
-			libxfs_perag_put(pag);
-			dbprintf(_("Error %d while querying fsmap btree.\n"),
-				error);
-			return;
+		if (ag->error) {
+			dbprintf(_("Error %d while %s.\n"), ag->error,
+					ag->what);
+			break;
 		}
-
-		libxfs_btree_del_cursor(bt_cur, XFS_BTREE_NOERROR);
-		libxfs_buf_relse(agbp);
-
-		if (pag->pag_agno == start_ag)
-			low.rm_startblock = 0;
 	}
+out:
+	for (agno = start_ag; agno <= end_ag; agno++) {
+		ag = &ctx.ags[agno - start_ag];
+		if (ag->fp)
+			fclose(ag->fp);
+	}
+	xfree(ctx.ags);
 }
 
 static int
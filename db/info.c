@@ -152,9 +152,69 @@ static const struct cmdinfo agresv_cmd = {
 	.help =		agresv_help,
 };
 
+static void
+cachestat_help(void)
+{
+	dbprintf(_(
+"\n"
+" Print buffer cache statistics: hits, misses, evictions and readahead\n"
+" broken down by the type of metadata in each buffer, and how many blocks\n"
+" have been read from each allocation group.\n"
+"\n"
+" -a   Also print the overall cache summary and hash chain lengths.\n"
+" -z   Reset the counters after printing them.\n"
+"\n"
+));
+
+}
+
+static int
+cachestat_f(
+	int			argc,
+	char			**argv)
+{
+	bool			all = false;
+	bool			reset = false;
+	int			c;
+
+	while ((c = getopt(argc, argv, "az")) != -1) {
+		switch (c) {
+		case 'a':
+			all = true;
+			break;
+		case 'z':
+			reset = true;
+			break;
+		default:
+			cachestat_help();
+			return 0;
+		}
+	}
+
+	if (all)
+		cache_report(stdout, "libxfs_bcache", libxfs_bcache);
+	libxfs_bcache_stats_report(stdout);
+	if (reset)
+		libxfs_bcache_stats_reset();
+	return 0;
+}
+
+static const struct cmdinfo cachestat_cmd = {
+	.name =		"cachestat",
+	.altname =	NULL,
+	.cfunc =	cachestat_f,
+	.argmin =	0,
+	.argmax =	2,
+	.canpush =	0,
+	.args =		"[-a] [-z]",
+	.oneline =	N_("print buffer cache stats by metadata type"),
+	.help =		cachestat_help,
+};
+
 void
 info_init(void)
 {
 	add_command(&info_cmd);
 	add_command(&agresv_cmd);
+	add_command(&cachestat_cmd);
 }
@@ -16,6 +16,7 @@
 #include "output.h"
 #include "malloc.h"
 #include "type.h"
+#include "mcache.h"
 
 static char		**cmdline;
 static int		ncmdline;
@@ -24,6 +25,7 @@ int			blkbb;
 int			exitcode;
 int			expert_mode;
 static int		force;
+static char		*mcache_file;
 static struct xfs_mount	xmount;
 struct xfs_mount	*mp;
 static struct xlog	xlog;
@@ -33,7 +35,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, _(
-		"Usage: %s [-ifFrxV] [-p prog] [-l logdev] [-c cmd]... device\n"
+		"Usage: %s [-ifFrxV] [-p prog] [-l logdev] [-C cachefile] [-c cmd]... device\n"
 		), progname);
 	exit(1);
 }
@@ -54,12 +56,15 @@ init(
 	textdomain(PACKAGE);
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "c:fFip:rxVl:")) != EOF) {
+	while ((c = getopt(argc, argv, "c:C:fFip:rxVl:")) != EOF) {
 		switch (c) {
 		case 'c':
 			cmdline = xrealloc(cmdline, (ncmdline+1)*sizeof(char*));
 			cmdline[ncmdline++] = optarg;
 			break;
+		case 'C':
+			mcache_file = optarg;
+			break;
 		case 'f':
 			x.disfile = 1;
 			break;
@@ -148,29 +153,43 @@ init(
 	if (sbp->sb_agcount != agcount)
 		exitcode = 1;
 
-	/*
-	 * xfs_check needs corrected incore superblock values
-	 */
-	if (sbp->sb_rootino != NULLFSINO &&
-	    xfs_has_lazysbcount(mp)) {
-		int error = -libxfs_initialize_perag_data(mp, sbp->sb_agcount);
-		if (error) {
-			fprintf(stderr,
-	_("%s: cannot init perag data (%d). Continuing anyway.\n"),
-				progname, error);
-		}
-	}
-
 	if (xfs_has_sparseinodes(mp))
 		type_set_tab_spcrc();
 	else if (xfs_has_crc(mp))
 		type_set_tab_crc();
 
+	if (mcache_file)
+		mcache_open(mcache_file);
+
 	push_cur();
 	init_commands();
 	init_sig();
 }
 
+/*
+ * blockget and metadump need corrected incore superblock counters.  That
+ * means reading every AGF and AGI, which takes a long while when there are
+ * many AGs, so it's left until the first command that needs it.
+ */
+void
+init_perag_data(void)
+{
+	static bool	done;
+	int		error;
+
+	if (done)
+		return;
+	done = true;
+
+	if (mp->m_sb.sb_rootino == NULLFSINO || !xfs_has_lazysbcount(mp))
+		return;
+	error = -libxfs_initialize_perag_data(mp, mp->m_sb.sb_agcount);
+	if (error)
+		fprintf(stderr,
+	_("%s: cannot init perag data (%d). Continuing anyway.\n"),
+			progname, error);
+}
+
 int
 main(
 	int	argc,
@@ -212,6 +231,7 @@ close_devices:
 	 */
 	while (iocur_sp > start_iocur_sp)
 		pop_cur();
+	mcache_close();
 	libxfs_umount(mp);
 	libxfs_destroy(&x);
 
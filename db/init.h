@@ -11,3 +11,5 @@ extern int		expert_mode;
 extern xfs_mount_t	*mp;
 extern libxfs_init_t	x;
 extern xfs_agnumber_t	cur_agno;
+
+extern void		init_perag_data(void);
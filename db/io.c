@@ -18,6 +18,7 @@
 #include "malloc.h"
 #include "crc.h"
 #include "bit.h"
+#include "mcache.h"
 
 static int	pop_f(int argc, char **argv);
 static void     pop_help(void);
@@ -51,10 +52,10 @@ static const cmdinfo_t  ring_cmd =
 	{ "ring", NULL, ring_f, 0, 1, 0, NULL,
 	  N_("show position ring or move to a specific entry"), ring_help };
 
-iocur_t	*iocur_base;
-iocur_t	*iocur_top;
-int	iocur_sp = -1;
-int	iocur_len;
+__thread iocur_t	*iocur_base;
+__thread iocur_t	*iocur_top;
+__thread int		iocur_sp = -1;
+__thread int		iocur_len;
 
 #define RING_ENTRIES 20
 static iocur_t iocur_ring[RING_ENTRIES];
@@ -112,6 +113,20 @@ pop_cur(void)
 	}
 }
 
+/* Pop everything and free the stack of a thread that is done with it. */
+void
+free_cur_stack(void)
+{
+	while (iocur_sp > 0)
+		pop_cur();
+	if (iocur_sp == 0)
+		pop_cur();
+	free(iocur_base);
+	iocur_base = iocur_top = NULL;
+	iocur_sp = -1;
+	iocur_len = 0;
+}
+
 /*ARGSUSED*/
 static int
 pop_f(
@@ -503,6 +518,19 @@ write_cur(void)
 
 }
 
+/* Start reading a block into the buffer cache ahead of a set_cur call. */
+void
+readahead_cur(
+	const typ_t	*type,
+	xfs_daddr_t	blknum,
+	int		len)
+{
+	if (mcache_prime(blknum, len))
+		return;
+	libxfs_buf_readahead(mp->m_ddev_targp, blknum, len,
+			type ? type->bops : NULL);
+}
+
 void
 set_cur(
 	const typ_t	*type,
@@ -547,9 +575,12 @@ set_cur(
 				bbmap->nmaps, LIBXFS_READBUF_SALVAGE, &bp,
 				ops);
 	} else {
+		mcache_prime(blknum, len);
 		error = -libxfs_buf_read(mp->m_ddev_targp, blknum, len,
 				LIBXFS_READBUF_SALVAGE, &bp, ops);
 		iocur_top->bbmap = NULL;
+		if (!error)
+			mcache_note(blknum, len, bp->b_addr);
 	}
 
 	/*
@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include "libxfs.h"
+#include <sys/mman.h>
+#include "init.h"
+#include "malloc.h"
+#include "mcache.h"
+#include "libfrog/bitmap.h"
+
+/*
+ * Metadata Cache File
+ *
+ * People often run many short xfs_db -r sessions against the same device
+ * or metadump, and each one reads the same superblock, AG headers and
+ * btree blocks all over again.  With -C, we save the metadata blocks that
+ * a session reads in a file, and the next session maps that file and
+ * fills the buffer cache from it instead of reading the device.
+ *
+ * The file is only trusted if it was written for the same device (and,
+ * for an image file, the same size and modification time) and if the
+ * primary superblock hasn't changed.  The superblock is rewritten when a
+ * filesystem is unmounted, which on a v5 filesystem also stamps a new LSN
+ * into it, so any change made through a mount throws the cache away.
+ * Each block also carries a CRC of its contents in case the cache file
+ * itself gets damaged, and the usual verifiers run on every block that
+ * comes out of it.
+ *
+ * Since nothing we do could update the cache, it is only used with -r.
+ * The file is in host byte order; it's not meant to be moved around.
+ */
+
+#define MCACHE_MAGIC		"XFSDBMC1"
+
+/* Don't save more than this much metadata. */
+#define MCACHE_MAX_BYTES	(128ULL << 20)
+
+struct mcache_hdr {
+	char			magic[8];
+	uint64_t		nr;		/* entries */
+	uint64_t		dev;
+	uint64_t		ino;
+	uint64_t		size;
+	int64_t			mtime_sec;
+	int64_t			mtime_nsec;
+	uint8_t			sb[BBSIZE];	/* primary superblock sector */
+};
+
+/* Sorted by daddr after the header, followed by the contents. */
+struct mcache_ent {
+	uint64_t		daddr;
+	uint32_t		len;		/* basic blocks */
+	uint32_t		crc;		/* crc32c of the contents */
+	uint64_t		offset;		/* of the contents in the file */
+};
+
+/* A block read in this session, to be saved at the end. */
+struct mcache_new {
+	uint64_t		daddr;
+	uint32_t		len;
+	void			*data;
+};
+
+static char			*mcache_path;
+static struct mcache_hdr	mcache_id;	/* what we are now */
+static pthread_mutex_t		mcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The file from the last session, if it's any good. */
+static void			*old_map;
+static size_t			old_len;
+static struct mcache_ent	*old_ents;
+static uint64_t			old_nr;
+
+/* Blocks read in this session. */
+static struct mcache_new	*new_ents;
+static uint64_t			new_nr;
+static uint64_t			new_max;
+static uint64_t			new_bytes;
+static struct bitmap		*new_seen;
+
+/* Work out who we are, so that we can tell if the old cache is ours. */
+static int
+mcache_identify(
+	struct mcache_hdr	*id)
+{
+	struct xfs_buf		*bp;
+	struct stat		st;
+	int			error;
+
+	if (stat(fsdevice, &st))
+		return errno;
+
+	memset(id, 0, sizeof(*id));
+	memcpy(id->magic, MCACHE_MAGIC, sizeof(id->magic));
+	if (S_ISBLK(st.st_mode)) {
+		id->dev = st.st_rdev;
+	} else {
+		id->dev = st.st_dev;
+		id->ino = st.st_ino;
+		id->size = st.st_size;
+		id->mtime_sec = st.st_mtim.tv_sec;
+		id->mtime_nsec = st.st_mtim.tv_nsec;
+	}
+
+	error = -libxfs_buf_read_uncached(mp->m_ddev_targp, XFS_SB_DADDR, 1,
+			0, &bp, NULL);
+	if (error)
+		return error;
+	memcpy(id->sb, bp->b_addr, BBSIZE);
+	libxfs_buf_relse(bp);
+	return 0;
+}
+
+/* Map the old cache file and check that it belongs to this filesystem. */
+static void
+mcache_load(void)
+{
+	struct mcache_hdr	*hdr;
+	struct stat		st;
+	int			fd;
+
+	fd = open(mcache_path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) || st.st_size < sizeof(struct mcache_hdr))
+		goto out_close;
+
+	old_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (old_map == MAP_FAILED) {
+		old_map = NULL;
+		goto out_close;
+	}
+	old_len = st.st_size;
+
+	hdr = old_map;
+	if (memcmp(hdr->magic, mcache_id.magic, sizeof(hdr->magic)) ||
+	    hdr->dev != mcache_id.dev || hdr->ino != mcache_id.ino ||
+	    hdr->size != mcache_id.size ||
+	    hdr->mtime_sec != mcache_id.mtime_sec ||
+	    hdr->mtime_nsec != mcache_id.mtime_nsec ||
+	    memcmp(hdr->sb, mcache_id.sb, BBSIZE) ||
+	    hdr->nr > (old_len - sizeof(*hdr)) / sizeof(struct mcache_ent)) {
+		munmap(old_map, old_len);
+		old_map = NULL;
+		old_len = 0;
+		goto out_close;
+	}
+	old_ents = (struct mcache_ent *)(hdr + 1);
+	old_nr = hdr->nr;
+out_close:
+	close(fd);
+}
+
+/* Start using the cache file at path, if we can. */
+void
+mcache_open(
+	const char		*path)
+{
+	int			error;
+
+	if (!(x.isreadonly & LIBXFS_ISREADONLY)) {
+		fprintf(stderr,
+_("%s: the metadata cache can only be used with -r; ignoring it\n"),
+			progname);
+		return;
+	}
+
+	error = mcache_identify(&mcache_id);
+	if (!error)
+		error = -bitmap_alloc(&new_seen);
+	if (error) {
+		fprintf(stderr, _("%s: cannot set up metadata cache: %s\n"),
+			progname, strerror(error));
+		return;
+	}
+
+	mcache_path = strdup(path);
+	mcache_load();
+}
+
+static struct mcache_ent *
+mcache_find(
+	xfs_daddr_t		daddr)
+{
+	uint64_t		lo = 0;
+	uint64_t		hi = old_nr;
+	uint64_t		mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (old_ents[mid].daddr == daddr)
+			return &old_ents[mid];
+		if (old_ents[mid].daddr < daddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/*
+ * Fill the buffer cache with a block from the old cache file.  Returns
+ * true if the buffer cache has the block now, so there's no need to read
+ * it ahead.
+ */
+bool
+mcache_prime(
+	xfs_daddr_t		daddr,
+	int			len)
+{
+	struct mcache_ent	*ent;
+	void			*data;
+
+	if (!old_map)
+		return false;
+	ent = mcache_find(daddr);
+	if (!ent || ent->len != len || ent->offset > old_len ||
+	    BBTOB(len) > old_len - ent->offset)
+		return false;
+
+	data = (char *)old_map + ent->offset;
+	if (crc32c(~0U, data, BBTOB(len)) != ent->crc)
+		return false;
+	return libxfs_buf_prime(mp->m_ddev_targp, daddr, len, data);
+}
+
+/* Remember a block that we read so that we can save it at the end. */
+void
+mcache_note(
+	xfs_daddr_t		daddr,
+	int			len,
+	const void		*data)
+{
+	struct mcache_new	*n;
+
+	if (!mcache_path)
+		return;
+
+	pthread_mutex_lock(&mcache_lock);
+	if (new_bytes + BBTOB(len) > MCACHE_MAX_BYTES ||
+	    bitmap_test(new_seen, daddr, 1))
+		goto out_unlock;
+	if (bitmap_set(new_seen, daddr, 1))
+		goto out_unlock;
+
+	if (new_nr == new_max) {
+		new_max = max(new_max * 2, 256ULL);
+		new_ents = xrealloc(new_ents, new_max * sizeof(*new_ents));
+	}
+	n = &new_ents[new_nr++];
+	n->daddr = daddr;
+	n->len = len;
+	n->data = xmalloc(BBTOB(len));
+	memcpy(n->data, data, BBTOB(len));
+	new_bytes += BBTOB(len);
+out_unlock:
+	pthread_mutex_unlock(&mcache_lock);
+}
+
+static int
+mcache_new_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct mcache_new	*na = a;
+	const struct mcache_new	*nb = b;
+
+	if (na->daddr != nb->daddr)
+		return na->daddr < nb->daddr ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write out what this session read, plus whatever the old cache had that
+ * we didn't get to, and swap it in for the old file.
+ */
+static int
+mcache_save(void)
+{
+	struct mcache_hdr	hdr = mcache_id;
+	struct mcache_new	*ents;
+	struct mcache_ent	ent;
+	uint64_t		nr = new_nr;
+	uint64_t		bytes = new_bytes;
+	uint64_t		offset;
+	uint64_t		i;
+	char			*tmp;
+	FILE			*fp;
+	int			error = 0;
+
+	/* Keep the old blocks we didn't read again, if there's room. */
+	ents = xmalloc((new_nr + old_nr + 1) * sizeof(*ents));
+	memcpy(ents, new_ents, new_nr * sizeof(*ents));
+	for (i = 0; i < old_nr; i++) {
+		struct mcache_ent	*o = &old_ents[i];
+
+		if (bytes + BBTOB(o->len) > MCACHE_MAX_BYTES ||
+		    bitmap_test(new_seen, o->daddr, 1) ||
+		    o->offset > old_len ||
+		    BBTOB(o->len) > old_len - o->offset)
+			continue;
+		ents[nr].daddr = o->daddr;
+		ents[nr].len = o->len;
+		ents[nr].data = (char *)old_map + o->offset;
+		nr++;
+		bytes += BBTOB(o->len);
+	}
+	qsort(ents, nr, sizeof(*ents), mcache_new_cmp);
+
+	if (asprintf(&tmp, "%s.tmp", mcache_path) < 0) {
+		error = errno;
+		goto out_ents;
+	}
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		error = errno;
+		goto out_tmp;
+	}
+
+	hdr.nr = nr;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	offset = sizeof(hdr) + nr * sizeof(struct mcache_ent);
+	for (i = 0; i < nr; i++) {
+		ent.daddr = ents[i].daddr;
+		ent.len = ents[i].len;
+		ent.crc = crc32c(~0U, ents[i].data, BBTOB(ents[i].len));
+		ent.offset = offset;
+		fwrite(&ent, sizeof(ent), 1, fp);
+		offset += BBTOB(ents[i].len);
+	}
+	for (i = 0; i < nr; i++)
+		fwrite(ents[i].data, BBTOB(ents[i].len), 1, fp);
+
+	if (ferror(fp))
+		error = EIO;
+	if (fclose(fp) && !error)
+		error = errno;
+	if (!error && rename(tmp, mcache_path))
+		error = errno;
+	if (error)
+		unlink(tmp);
+out_tmp:
+	free(tmp);
+out_ents:
+	xfree(ents);
+	return error;
+}
+
+/* Save the cache for next time and let go of everything. */
+void
+mcache_close(void)
+{
+	uint64_t		i;
+	int			error;
+
+	if (!mcache_path)
+		return;
+
+	error = mcache_save();
+	if (error)
+		fprintf(stderr, _("%s: cannot save metadata cache %s: %s\n"),
+			progname, mcache_path, strerror(error));
+
+	if (old_map)
+		munmap(old_map, old_len);
+	old_map = NULL;
+	old_ents = NULL;
+	old_len = old_nr = 0;
+	for (i = 0; i < new_nr; i++)
+		xfree(new_ents[i].data);
+	xfree(new_ents);
+	new_ents = NULL;
+	new_nr = new_max = new_bytes = 0;
+	bitmap_free(&new_seen);
+	free(mcache_path);
+	mcache_path = NULL;
+}
@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_DB_MCACHE_H__
+#define __XFS_DB_MCACHE_H__
+
+/* Metadata cache file that persists between sessions; see mcache.c. */
+void mcache_open(const char *path);
+void mcache_close(void);
+bool mcache_prime(xfs_daddr_t daddr, int len);
+void mcache_note(xfs_daddr_t daddr, int len, const void *data);
+
+#endif /* __XFS_DB_MCACHE_H__ */
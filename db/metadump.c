@@ -19,9 +19,18 @@
 #include "faddr.h"
 #include "field.h"
 #include "dir2.h"
+#include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 
 #define DEFAULT_MAX_EXT_SIZE	MAXEXTLEN
 
+/* How far ahead of processing to start reading metadata blocks. */
+#define RA_INODE_RECS		8	/* inobt records */
+#define RA_BMAP_READS		64	/* reads per extent list */
+
 /* copy all metadata structures to/from a file */
 
 static int	metadump_f(int argc, char **argv);
@@ -37,19 +46,63 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] filename"),
+		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] [-z] [-B base] "
+		   "[-D percent] [-S statsfile] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
 static FILE		*outf;		/* metadump file */
 
-static xfs_metablock_t 	*metablock;	/* header + index + buffers */
-static __be64		*block_index;
-static char		*block_buffer;
+/*
+ * Blocks are gathered into a metablock, and for chunked dumps metablocks are
+ * gathered into a chunk, in a segment.  The main thread fills main_seg;
+ * each thread dumping AGs in parallel fills its own and only takes
+ * out_lock to write out a finished chunk.
+ *
+ * For chunked dumps the metablock being filled sits in chunk_buf right after
+ * the ones already finished, so blocks are copied once, straight into the
+ * chunk, rather than into the metablock and then again into the chunk.
+ */
+struct metadump_seg {
+	xfs_metablock_t	*metablock;	/* header + index + buffers */
+	__be64		*block_index;
+	char		*block_buffer;
+	int		cur_index;
+
+	char		*chunk_buf;	/* metablocks of the current chunk */
+	char		*chunk_zbuf;	/* compressed chunk */
+	size_t		chunk_len;
+	int64_t		chunk_low, chunk_high;
+};
+
+static struct metadump_seg	main_seg;
+static __thread struct metadump_seg *seg;
 
 static int		num_indices;
-static int		cur_index;
+static uint8_t		metadump_info;	/* XFS_METADUMP_* flags */
+
+/* chunked metadumps */
+static bool		metadump_chunked;
+static uint8_t		chunk_compress;
+static size_t		chunk_zbuf_size;
+static struct xfs_metadump_index_ent *chunk_index;
+static uint64_t		nr_chunks;
+static uint64_t		max_chunks;
+static uint64_t		out_offset;	/* bytes written to outf */
+static pthread_mutex_t	out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* delta dumps: the sectors of the base dump, sorted by daddr */
+struct base_sect {
+	int64_t			daddr;
+	uint32_t		crc;
+	uint8_t			seen;	/* this dump wanted it too */
+};
+static struct base_sect	*base_sects;
+static uint64_t		nr_base_sects;
+static uint64_t		max_base_sects;
+static int64_t		base_keep_daddr; /* always dump sectors below this */
 
-static xfs_ino_t	cur_ino;
+static __thread xfs_ino_t cur_ino;
+static xfs_ino_t	orphanage_ino;
 
 static int		show_progress = 0;
 static int		stop_on_read_error = 0;
@@ -60,6 +113,29 @@ static int		show_warnings = 0;
 static int		progress_since_warning = 0;
 static bool		stdout_metadump;
 
+/* throughput for -g and -S; times are summed over the dumping threads */
+static char		*stats_path;
+static uint64_t		start_ns;
+static atomic_t		inodes_copied;
+static atomic64_t	bytes_dumped;
+static atomic64_t	read_ns;	/* waiting for metadata reads */
+static atomic64_t	obfuscate_ns;	/* obfuscating names */
+static atomic64_t	output_ns;	/* compressing and writing the dump */
+
+/*
+ * Regular file data layout.  With -D, the data blocks of a sample of the
+ * regular files are dumped too, as filler, so that a restored image reads
+ * like the original.
+ */
+#define EXTENT_HIST		32	/* files by log2 of their extent count */
+static int		data_sample_pct;
+static __thread bool	dump_file_data;	/* of the current inode */
+static atomic64_t	data_files;
+static atomic64_t	data_extents;
+static atomic64_t	data_blocks;
+static atomic64_t	data_sampled;	/* filler blocks dumped */
+static atomic64_t	extent_hist[EXTENT_HIST];
+
 void
 metadump_init(void)
 {
@@ -81,6 +157,11 @@ metadump_help(void)
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
 "   -w -- Show warnings of bad metadata information\n"
+"   -z -- Write a compressed, seekable (chunked) dump\n"
+"   -B base -- With -z, only write what changed since the chunked dump 'base'\n"
+"   -D percent -- Dump the data blocks of this percentage of regular files\n"
+"                 as filler, to keep their layout in the restored image\n"
+"   -S statsfile -- Write throughput and time spent to 'statsfile'\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
 
@@ -106,7 +187,7 @@ print_warning(const char *fmt, ...)
 static void
 print_progress(const char *fmt, ...)
 {
-	char		buf[60];
+	char		buf[80];
 	va_list		ap;
 	FILE		*f;
 
@@ -119,34 +200,621 @@ print_progress(const char *fmt, ...)
 	buf[sizeof(buf)-1] = '\0';
 
 	f = stdout_metadump ? stderr : stdout;
-	fprintf(f, "\r%-59s", buf);
+	fprintf(f, "\r%-79s", buf);
 	fflush(f);
 	progress_since_warning = 1;
 }
 
+static uint64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* set_cur(), but account for the time spent waiting for the read */
+static void
+md_set_cur(
+	const typ_t	*type,
+	xfs_daddr_t	blknum,
+	int		len,
+	int		ring_flag,
+	bbmap_t		*bbmap)
+{
+	uint64_t	start = now_ns();
+
+	set_cur(type, blknum, len, ring_flag, bbmap);
+	atomic64_add(now_ns() - start, &read_ns);
+}
+
+/*
+ * Format the dump rate and, from how many of the inodes in the superblock
+ * have been copied so far, when it should be done.
+ */
+static void
+format_rates(
+	char		*buf,
+	size_t		len)
+{
+	uint64_t	elapsed = now_ns() - start_ns;
+	uint64_t	copied = atomic_read(&inodes_copied);
+	uint64_t	left;
+	double		secs = elapsed / 1e9;
+
+	if (secs <= 0 || !copied) {
+		buf[0] = '\0';
+		return;
+	}
+	left = mp->m_sb.sb_icount > copied ?
+			(mp->m_sb.sb_icount - copied) * secs / copied : 0;
+	snprintf(buf, len, ", %.1f MB/s, %.0f inodes/s, ETA %llu:%02llu",
+			atomic64_read(&bytes_dumped) / secs / 1048576,
+			copied / secs,
+			(unsigned long long)left / 60,
+			(unsigned long long)left % 60);
+}
+
+/*
+ * Print the totals after a dump for -g, and write them to the -S file.
+ * The read, obfuscation and output times are summed over the threads
+ * dumping AGs in parallel, so their shares can add up to more than 100%.
+ */
+static void
+report_stats(void)
+{
+	double		secs = (now_ns() - start_ns) / 1e9;
+	uint64_t	bytes = atomic64_read(&bytes_dumped);
+	uint64_t	inodes = atomic_read(&inodes_copied);
+	double		rd = atomic64_read(&read_ns) / 1e9;
+	double		ob = atomic64_read(&obfuscate_ns) / 1e9;
+	double		wr = atomic64_read(&output_ns) / 1e9;
+	FILE		*f;
+	int		i;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	if (show_progress) {
+		f = stdout_metadump ? stderr : stdout;
+		fprintf(f,
+_("Dumped %llu MB and %llu inodes in %.1fs (%.1f MB/s, %.0f inodes/s)\n"),
+			(unsigned long long)bytes >> 20,
+			(unsigned long long)inodes, secs,
+			bytes / secs / 1048576, inodes / secs);
+		fprintf(f,
+_("Time reading %.1fs (%.0f%%), obfuscating %.1fs (%.0f%%), writing %.1fs (%.0f%%)\n"),
+			rd, rd * 100 / secs, ob, ob * 100 / secs,
+			wr, wr * 100 / secs);
+		fprintf(f,
+_("Regular files %llu, data extents %llu, data blocks %llu, filler blocks %llu\n"),
+			(unsigned long long)atomic64_read(&data_files),
+			(unsigned long long)atomic64_read(&data_extents),
+			(unsigned long long)atomic64_read(&data_blocks),
+			(unsigned long long)atomic64_read(&data_sampled));
+	}
+
+	if (!stats_path)
+		return;
+	f = fopen(stats_path, "w");
+	if (!f) {
+		print_warning("cannot open stats file %s: %s", stats_path,
+				strerror(errno));
+		return;
+	}
+	fprintf(f, "elapsed_sec %.3f\n", secs);
+	fprintf(f, "bytes %llu\n", (unsigned long long)bytes);
+	fprintf(f, "inodes %llu\n", (unsigned long long)inodes);
+	fprintf(f, "mb_per_sec %.3f\n", bytes / secs / 1048576);
+	fprintf(f, "inodes_per_sec %.3f\n", inodes / secs);
+	fprintf(f, "read_sec %.3f\n", rd);
+	fprintf(f, "obfuscate_sec %.3f\n", ob);
+	fprintf(f, "output_sec %.3f\n", wr);
+	fprintf(f, "data_files %llu\n",
+			(unsigned long long)atomic64_read(&data_files));
+	fprintf(f, "data_extents %llu\n",
+			(unsigned long long)atomic64_read(&data_extents));
+	fprintf(f, "data_blocks %llu\n",
+			(unsigned long long)atomic64_read(&data_blocks));
+	fprintf(f, "data_filler_blocks %llu\n",
+			(unsigned long long)atomic64_read(&data_sampled));
+	/* files with up to 2^i extents (and more than 2^(i-1)) */
+	for (i = 0; i < EXTENT_HIST; i++)
+		if (atomic64_read(&extent_hist[i]))
+			fprintf(f, "files_extents_le_%llu %llu\n",
+				1ULL << i, (unsigned long long)
+				atomic64_read(&extent_hist[i]));
+	if (fclose(f))
+		print_warning("error writing stats file %s", stats_path);
+}
+
+/*
+ * Return 0 for success, -1 for failure.
+ */
+static int
+write_out(
+	const void	*data,
+	size_t		len)
+{
+	uint64_t	start = now_ns();
+
+	if (fwrite(data, len, 1, outf) != 1) {
+		print_warning("error writing to target file");
+		return -1;
+	}
+	atomic64_add(now_ns() - start, &output_ns);
+	out_offset += len;
+	return 0;
+}
+
+static int
+base_sect_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct base_sect	*sa = a;
+	const struct base_sect	*sb = b;
+
+	if (sa->daddr != sb->daddr)
+		return sa->daddr < sb->daddr ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Remember a checksum of each sector of the metablocks in a chunk payload
+ * of the base dump.
+ *
+ * Return 0 for success, -1 for failure.
+ */
+static int
+base_add_payload(
+	char			*p,
+	size_t			len)
+{
+	char			*end = p + len;
+	struct xfs_metablock	*mb;
+	__be64			*block_index;
+	int			count;
+	int			i;
+
+	while (p < end) {
+		mb = (struct xfs_metablock *)p;
+		if (end - p < BBSIZE || mb->mb_blocklog != BBSHIFT)
+			return -1;
+		count = be16_to_cpu(mb->mb_count);
+		if (count == 0 || count > num_indices ||
+		    end - p < (count + 1) << BBSHIFT)
+			return -1;
+
+		if (nr_base_sects + count > max_base_sects) {
+			struct base_sect	*bs;
+
+			max_base_sects = max(max_base_sects * 2,
+					nr_base_sects + count);
+			bs = realloc(base_sects,
+					max_base_sects * sizeof(*bs));
+			if (!bs)
+				return -1;
+			base_sects = bs;
+		}
+
+		block_index = (__be64 *)(p + sizeof(xfs_metablock_t));
+		for (i = 0; i < count; i++) {
+			struct base_sect *bs = &base_sects[nr_base_sects++];
+
+			bs->daddr = be64_to_cpu(block_index[i]);
+			bs->crc = crc32c(~0U, p + ((i + 1) << BBSHIFT), BBSIZE);
+			bs->seen = 0;
+		}
+		p += (count + 1) << BBSHIFT;
+	}
+	return 0;
+}
+
+/*
+ * Read in the sectors of the full chunked dump a delta dump is taken against.
+ *
+ * Return 0 for success, -1 for failure.
+ */
+static int
+load_base(
+	const char			*path)
+{
+	struct xfs_metadump_chunked_header	hdr;
+	struct xfs_metadump_chunk	chdr;
+	uint32_t			chunk_size;
+	char				*buf = NULL;
+	char				*raw = NULL;
+	FILE				*fp;
+	int				error = -1;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		print_warning("cannot open base dump %s: %s", path,
+				strerror(errno));
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    be32_to_cpu(hdr.xmh_magic) != XFS_MD_MAGIC_CHUNKED) {
+		print_warning("base dump %s is not a chunked metadump", path);
+		goto out;
+	}
+	if (hdr.xmh_info & XFS_METADUMP_DELTA) {
+		print_warning("base dump %s is itself a delta", path);
+		goto out;
+	}
+
+	chunk_size = be32_to_cpu(hdr.xmh_chunk_size);
+	buf = malloc(chunk_size);
+	raw = malloc(chunk_size);
+	if (!buf || !raw) {
+		print_warning("memory allocation failure");
+		goto out;
+	}
+
+	for (;;) {
+		uint32_t	len, raw_len;
+		char		*payload = buf;
+
+		if (fread(&chdr, sizeof(chdr), 1, fp) != 1)
+			goto bad;
+		if (be32_to_cpu(chdr.xmc_magic) == XFS_MD_INDEX_MAGIC)
+			break;
+		len = be32_to_cpu(chdr.xmc_len);
+		raw_len = be32_to_cpu(chdr.xmc_raw_len);
+		if (be32_to_cpu(chdr.xmc_magic) != XFS_MD_CHUNK_MAGIC ||
+		    raw_len > chunk_size || len > raw_len)
+			goto bad;
+		if (len && fread(buf, len, 1, fp) != 1)
+			goto bad;
+
+		if (len != raw_len) {
+#ifdef HAVE_LIBZSTD
+			size_t	res = 0;
+
+			if (hdr.xmh_compress == XFS_MD_COMPRESS_ZSTD)
+				res = ZSTD_decompress(raw, raw_len, buf, len);
+			if (hdr.xmh_compress != XFS_MD_COMPRESS_ZSTD ||
+			    ZSTD_isError(res) || res != raw_len)
+				goto bad;
+			payload = raw;
+#else
+			print_warning("built without zstd, cannot read %s",
+					path);
+			goto out;
+#endif
+		}
+		if (base_add_payload(payload, raw_len))
+			goto bad;
+	}
+
+	qsort(base_sects, nr_base_sects, sizeof(struct base_sect),
+			base_sect_cmp);
+	error = 0;
+	goto out;
+bad:
+	print_warning("base dump %s is corrupt or truncated", path);
+out:
+	free(raw);
+	free(buf);
+	fclose(fp);
+	return error;
+}
+
+static void
+free_base(void)
+{
+	free(base_sects);
+	base_sects = NULL;
+	nr_base_sects = max_base_sects = 0;
+}
+
+/* Is this sector the same as in the base dump, so it needn't be written? */
+static bool
+base_unchanged(
+	int64_t			daddr,
+	char			*data)
+{
+	struct base_sect	key = { .daddr = daddr };
+	struct base_sect	*bs;
+
+	if (!base_sects)
+		return false;
+	bs = bsearch(&key, base_sects, nr_base_sects,
+			sizeof(struct base_sect), base_sect_cmp);
+	if (!bs)
+		return false;
+
+	/* cross-linked sectors can be seen by several threads; that's ok */
+	bs->seen = 1;
+	return daddr >= base_keep_daddr &&
+		bs->crc == crc32c(~0U, data, BBSIZE);
+}
+
+/*
+ * Write out the sectors that the base dump has but this one never got
+ * to, so that a restore can clear them.
+ *
+ * Return 0 for success, -1 for failure.
+ */
+static int
+write_tombstones(void)
+{
+	struct xfs_metadump_chunk	hdr;
+	__be64				*tombs;
+	uint64_t			i, nr = 0;
+	size_t				len;
+	int				error;
+
+	tombs = malloc((nr_base_sects + 1) * sizeof(__be64));
+	if (!tombs) {
+		print_warning("memory allocation failure");
+		return -1;
+	}
+	for (i = 0; i < nr_base_sects; i++)
+		if (!base_sects[i].seen)
+			tombs[nr++] = cpu_to_be64(base_sects[i].daddr);
+
+	len = nr * sizeof(__be64);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.xmc_magic = cpu_to_be32(XFS_MD_TOMB_MAGIC);
+	hdr.xmc_len = cpu_to_be32(len);
+	hdr.xmc_raw_len = cpu_to_be32(len);
+	error = write_out(&hdr, sizeof(hdr));
+	if (!error && len)
+		error = write_out(tombs, len);
+	free(tombs);
+	return error;
+}
+
+/* Size of a full metablock, its index sector and all its blocks. */
+#define METABLOCK_SIZE	((num_indices + 1) << BBSHIFT)
+
+/*
+ * Point a chunked segment's metablock at the end of its chunk, carrying over
+ * whatever has been put in the metablock so far.
+ */
+static void
+seg_place_metablock(
+	struct metadump_seg	*s)
+{
+	char			*mb = s->chunk_buf + s->chunk_len;
+
+	if (!metadump_chunked || (char *)s->metablock == mb)
+		return;
+	if (s->metablock)
+		memmove(mb, s->metablock, (s->cur_index + 1) << BBSHIFT);
+	else
+		memset(mb, 0, BBSIZE);
+	s->metablock = (xfs_metablock_t *)mb;
+	s->metablock->mb_blocklog = BBSHIFT;
+	s->metablock->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
+	s->metablock->mb_info = metadump_info;
+	s->block_index = (__be64 *)(mb + sizeof(xfs_metablock_t));
+	s->block_buffer = mb + BBSIZE;
+}
+
+/*
+ * Compress the metablocks gathered for a chunked dump and write them out as one
+ * chunk, remembering where it went and which blocks it holds for the index.
+ *
+ * Return 0 for success, -1 for failure.
+ */
+static int
+write_chunk(void)
+{
+	struct xfs_metadump_chunk	hdr;
+	struct xfs_metadump_index_ent	*ent;
+	char				*payload = seg->chunk_buf;
+	size_t				len = seg->chunk_len;
+	int				error = -1;
+
+	if (seg->chunk_len == 0)
+		return 0;
+
+#ifdef HAVE_LIBZSTD
+	if (chunk_compress == XFS_MD_COMPRESS_ZSTD) {
+		uint64_t start = now_ns();
+		size_t	zlen;
+
+		zlen = ZSTD_compress(seg->chunk_zbuf, chunk_zbuf_size,
+				seg->chunk_buf, seg->chunk_len,
+				ZSTD_CLEVEL_DEFAULT);
+		atomic64_add(now_ns() - start, &output_ns);
+		if (ZSTD_isError(zlen)) {
+			print_warning("error compressing chunk: %s",
+					ZSTD_getErrorName(zlen));
+			return -1;
+		}
+		if (zlen < seg->chunk_len) {
+			payload = seg->chunk_zbuf;
+			len = zlen;
+		}
+	}
+#endif
+
+	pthread_mutex_lock(&out_lock);
+	if (nr_chunks == max_chunks) {
+		max_chunks = max_chunks ? max_chunks * 2 : 64;
+		ent = realloc(chunk_index, max_chunks * sizeof(*ent));
+		if (!ent) {
+			print_warning("memory allocation failure");
+			goto out_unlock;
+		}
+		chunk_index = ent;
+	}
+	ent = &chunk_index[nr_chunks++];
+	ent->xmi_offset = cpu_to_be64(out_offset);
+	ent->xmi_low = cpu_to_be64(seg->chunk_low);
+	ent->xmi_high = cpu_to_be64(seg->chunk_high);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.xmc_magic = cpu_to_be32(XFS_MD_CHUNK_MAGIC);
+	hdr.xmc_len = cpu_to_be32(len);
+	hdr.xmc_raw_len = cpu_to_be32(seg->chunk_len);
+	if (write_out(&hdr, sizeof(hdr)) || write_out(payload, len))
+		goto out_unlock;
+
+	seg->chunk_len = 0;
+	seg_place_metablock(seg);
+	error = 0;
+out_unlock:
+	pthread_mutex_unlock(&out_lock);
+	return error;
+}
+
+/*
+ * Finish a chunked dump with the index of its chunks and the footer that says
+ * where to find it.
+ *
+ * Return 0 for success, -1 for failure.
+ */
+static int
+write_chunk_index(void)
+{
+	struct xfs_metadump_chunk	hdr;
+	struct xfs_metadump_footer	footer;
+	size_t				len;
+
+	if (write_chunk())
+		return -1;
+	if ((metadump_info & XFS_METADUMP_DELTA) && write_tombstones())
+		return -1;
+
+	memset(&footer, 0, sizeof(footer));
+	footer.xmf_magic = cpu_to_be32(XFS_MD_MAGIC_CHUNKED);
+	footer.xmf_nr_chunks = cpu_to_be64(nr_chunks);
+	footer.xmf_index_offset = cpu_to_be64(out_offset);
+
+	len = nr_chunks * sizeof(struct xfs_metadump_index_ent);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.xmc_magic = cpu_to_be32(XFS_MD_INDEX_MAGIC);
+	hdr.xmc_len = cpu_to_be32(len);
+	hdr.xmc_raw_len = cpu_to_be32(len);
+	if (write_out(&hdr, sizeof(hdr)) ||
+	    (len && write_out(chunk_index, len)) ||
+	    write_out(&footer, sizeof(footer)))
+		return -1;
+	return 0;
+}
+
+/*
+ * Write the header of a chunked dump.
+ */
+static int
+init_metadump_chunked(void)
+{
+	struct xfs_metadump_chunked_header	hdr;
+
+	nr_chunks = 0;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.xmh_magic = cpu_to_be32(XFS_MD_MAGIC_CHUNKED);
+	hdr.xmh_info = metadump_info;
+	hdr.xmh_compress = chunk_compress;
+	hdr.xmh_chunk_size = cpu_to_be32(XFS_MD_CHUNK_SIZE);
+	return write_out(&hdr, sizeof(hdr)) == 0;
+}
+
+static void
+free_seg(
+	struct metadump_seg	*s)
+{
+	if (!metadump_chunked)
+		free(s->metablock);
+	free(s->chunk_buf);
+	free(s->chunk_zbuf);
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Allocate the buffers of a segment.
+ *
+ * Return 0 for success, -1 for failure.
+ */
+static int
+init_seg(
+	struct metadump_seg	*s)
+{
+	memset(s, 0, sizeof(*s));
+	if (metadump_chunked) {
+		s->chunk_buf = malloc(XFS_MD_CHUNK_SIZE);
+		if (!s->chunk_buf)
+			goto out_nomem;
+		if (chunk_compress != XFS_MD_COMPRESS_NONE) {
+			s->chunk_zbuf = malloc(chunk_zbuf_size);
+			if (!s->chunk_zbuf)
+				goto out_nomem;
+		}
+		seg_place_metablock(s);
+		return 0;
+	}
+
+	s->metablock = calloc(BBSIZE + 1, BBSIZE);
+	if (!s->metablock)
+		goto out_nomem;
+	s->metablock->mb_blocklog = BBSHIFT;
+	s->metablock->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
+	s->metablock->mb_info = metadump_info;
+	s->block_index = (__be64 *)((char *)s->metablock +
+					sizeof(xfs_metablock_t));
+	s->block_buffer = (char *)s->metablock + BBSIZE;
+	return 0;
+
+out_nomem:
+	print_warning("memory allocation failure");
+	free_seg(s);
+	return -1;
+}
+
 /*
  * A complete dump file will have a "zero" entry in the last index block,
  * even if the dump is exactly aligned, the last index will be full of
  * zeros. If the last index entry is non-zero, the dump is incomplete.
  * Correspondingly, the last chunk will have a count < num_indices.
  *
+ * Chunked dumps don't need the empty metablock; the footer marks the end.
+ *
  * Return 0 for success, -1 for failure.
  */
 
 static int
 write_index(void)
 {
-	/*
-	 * write index block and following data blocks (streaming)
-	 */
-	metablock->mb_count = cpu_to_be16(cur_index);
-	if (fwrite(metablock, (cur_index + 1) << BBSHIFT, 1, outf) != 1) {
-		print_warning("error writing to target file");
-		return -1;
+	size_t		len = (seg->cur_index + 1) << BBSHIFT;
+	int		i;
+
+	seg->metablock->mb_count = cpu_to_be16(seg->cur_index);
+	if (!metadump_chunked) {
+		/*
+		 * write index block and following data blocks (streaming)
+		 */
+		if (write_out(seg->metablock, len))
+			return -1;
+	} else if (seg->cur_index > 0) {
+		/* the metablock is already in place at the end of the chunk */
+		if (seg->chunk_len == 0) {
+			seg->chunk_low = INT64_MAX;
+			seg->chunk_high = 0;
+		}
+		for (i = 0; i < seg->cur_index; i++) {
+			int64_t	daddr = be64_to_cpu(seg->block_index[i]);
+
+			seg->chunk_low = min(seg->chunk_low, daddr);
+			seg->chunk_high = max(seg->chunk_high, daddr);
+		}
+		seg->chunk_len += len;
+		seg->cur_index = 0;
+		if (seg->chunk_len + METABLOCK_SIZE > XFS_MD_CHUNK_SIZE) {
+			if (write_chunk())
+				return -1;
+		} else {
+			seg_place_metablock(seg);
+		}
 	}
 
-	memset(block_index, 0, num_indices * sizeof(__be64));
-	cur_index = 0;
+	memset(seg->block_index, 0, num_indices * sizeof(__be64));
+	seg->cur_index = 0;
 	return 0;
 }
 
@@ -161,16 +829,22 @@ write_buf_segment(
 {
 	int		i;
 	int		ret;
+	int		written = 0;
 
 	for (i = 0; i < len; i++, off++, data += BBSIZE) {
-		block_index[cur_index] = cpu_to_be64(off);
-		memcpy(&block_buffer[cur_index << BBSHIFT], data, BBSIZE);
-		if (++cur_index == num_indices) {
+		if (base_unchanged(off, data))
+			continue;
+		written++;
+		seg->block_index[seg->cur_index] = cpu_to_be64(off);
+		memcpy(&seg->block_buffer[seg->cur_index << BBSHIFT], data,
+				BBSIZE);
+		if (++seg->cur_index == num_indices) {
 			ret = write_index();
 			if (ret)
 				return -EIO;
 		}
 	}
+	atomic64_add(BBTOB(written), &bytes_dumped);
 	return 0;
 }
 
@@ -383,7 +1057,7 @@ scan_btree(
 	int		rval = 0;
 
 	push_cur();
-	set_cur(&typtab[btype], XFS_AGB_TO_DADDR(mp, agno, agbno), blkbb,
+	md_set_cur(&typtab[btype], XFS_AGB_TO_DADDR(mp, agno, agbno), blkbb,
 			DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		print_warning("cannot read %s block %u/%u", typtab[btype].name,
@@ -428,6 +1102,24 @@ valid_bno(
 }
 
 
+/* Start reading the children of an interior btree block. */
+static void
+scan_btree_readahead(
+	xfs_agnumber_t	agno,
+	__be32		*pp,
+	int		numrecs,
+	typnm_t		btype)
+{
+	int		i;
+
+	for (i = 0; i < numrecs; i++) {
+		if (!valid_bno(agno, be32_to_cpu(pp[i])))
+			continue;
+		readahead_cur(&typtab[btype],
+			XFS_AGB_TO_DADDR(mp, agno, be32_to_cpu(pp[i])), blkbb);
+	}
+}
+
 static int
 scanfunc_freesp(
 	struct xfs_btree_block	*block,
@@ -453,6 +1145,7 @@ scanfunc_freesp(
 	}
 
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
+	scan_btree_readahead(agno, pp, numrecs, btype);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -550,6 +1243,7 @@ scanfunc_rmapbt(
 	}
 
 	pp = XFS_RMAP_PTR_ADDR(block, 1, mp->m_rmap_mxr[1]);
+	scan_btree_readahead(agno, pp, numrecs, btype);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -622,6 +1316,7 @@ scanfunc_refcntbt(
 	}
 
 	pp = XFS_REFCOUNT_PTR_ADDR(block, 1, mp->m_refc_mxr[1]);
+	scan_btree_readahead(agno, pp, numrecs, btype);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -674,26 +1369,81 @@ copy_refcount_btree(
 struct name_ent {
 	struct name_ent		*next;
 	xfs_dahash_t		hash;
+	unsigned int		key;		/* bucket key, see name_key() */
+	uint32_t		next_alt;	/* see handle_duplicate_name() */
 	int			namelen;
 	unsigned char		name[1];
 };
 
+/*
+ * The table starts at NAME_TABLE_SIZE buckets and grows as a directory's
+ * names are added, so that huge directories don't end up with every
+ * lookup walking a long chain.  Names are bucketed on their bytes as well
+ * as their dahash, since every alternate of an obfuscated name has the
+ * same dahash and pathological directories are full of them.
+ */
 #define NAME_TABLE_SIZE		4096
 
-static struct name_ent		*nametable[NAME_TABLE_SIZE];
+static __thread struct name_ent	**nametable;
+static __thread unsigned int	nametable_size;
+static __thread unsigned int	nametable_count;
+
+static unsigned int
+name_key(
+	xfs_dahash_t	hash,
+	int		namelen,
+	unsigned char	*name)
+{
+	unsigned int	key = 2166136261u;
+
+	while (namelen-- > 0)
+		key = (key ^ *name++) * 16777619u;
+	return key ^ hash;
+}
 
 static void
 nametable_clear(void)
 {
-	int		i;
+	unsigned int	i;
 	struct name_ent	*ent;
 
-	for (i = 0; i < NAME_TABLE_SIZE; i++) {
+	for (i = 0; i < nametable_size; i++) {
 		while ((ent = nametable[i])) {
 			nametable[i] = ent->next;
 			free(ent);
 		}
 	}
+	nametable_count = 0;
+
+	/* don't hang on to a big table after a big directory */
+	if (nametable_size > NAME_TABLE_SIZE) {
+		free(nametable);
+		nametable = NULL;
+		nametable_size = 0;
+	}
+}
+
+static int
+nametable_resize(
+	unsigned int	new_size)
+{
+	struct name_ent	**new, *ent;
+	unsigned int	i;
+
+	new = calloc(new_size, sizeof(*new));
+	if (!new)
+		return -1;
+	for (i = 0; i < nametable_size; i++) {
+		while ((ent = nametable[i])) {
+			nametable[i] = ent->next;
+			ent->next = new[ent->key % new_size];
+			new[ent->key % new_size] = ent;
+		}
+	}
+	free(nametable);
+	nametable = new;
+	nametable_size = new_size;
+	return 0;
 }
 
 /*
@@ -704,8 +1454,12 @@ static struct name_ent *
 nametable_find(xfs_dahash_t hash, int namelen, unsigned char *name)
 {
 	struct name_ent	*ent;
+	unsigned int	key;
 
-	for (ent = nametable[hash % NAME_TABLE_SIZE]; ent; ent = ent->next) {
+	if (!nametable)
+		return NULL;
+	key = name_key(hash, namelen, name);
+	for (ent = nametable[key % nametable_size]; ent; ent = ent->next) {
 		if (ent->hash == hash && ent->namelen == namelen &&
 				!memcmp(ent->name, name, namelen))
 			return ent;
@@ -722,6 +1476,12 @@ nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 {
 	struct name_ent	*ent;
 
+	if (!nametable && nametable_resize(NAME_TABLE_SIZE))
+		return NULL;
+	/* a failed grow just leaves the chains longer */
+	if (nametable_count >= 2 * nametable_size)
+		nametable_resize(4 * nametable_size);
+
 	ent = malloc(sizeof *ent + namelen);
 	if (!ent)
 		return NULL;
@@ -729,9 +1489,12 @@ nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 	ent->namelen = namelen;
 	memcpy(ent->name, name, namelen);
 	ent->hash = hash;
-	ent->next = nametable[hash % NAME_TABLE_SIZE];
+	ent->key = name_key(hash, namelen, name);
+	ent->next_alt = 0;
+	ent->next = nametable[ent->key % nametable_size];
 
-	nametable[hash % NAME_TABLE_SIZE] = ent;
+	nametable[ent->key % nametable_size] = ent;
+	nametable_count++;
 
 	return ent;
 }
@@ -778,7 +1541,6 @@ in_lost_found(
 	int			namelen,
 	unsigned char		*name)
 {
-	static xfs_ino_t	orphanage_ino = 0;
 	char			s[24];	/* 21 is enough (64 bits in decimal) */
 	int			slen;
 
@@ -1145,18 +1907,26 @@ find_alternate(
  * Returns 1 if the (possibly modified) name is not present in the
  * name table.  Returns 0 if the name and all possible alternates
  * are already in the table.
+ *
+ * Names are only ever added to the table, so alternates that were taken
+ * or invalid the last time we started from this name still are.  The
+ * entry remembers where that search stopped; otherwise directories full
+ * of short names that obfuscate to the same thing would walk the same
+ * alternates over and over.
  */
 static int
 handle_duplicate_name(xfs_dahash_t hash, size_t name_len, unsigned char *name)
 {
 	unsigned char	new_name[name_len + 1];
-	uint32_t	seq = 1;
+	struct name_ent	*ent;
+	uint32_t	seq;
 
-	if (!nametable_find(hash, name_len, name))
+	ent = nametable_find(hash, name_len, name);
+	if (!ent)
 		return 1;	/* No duplicate */
 
 	/* Name is already in use.  Need to find an alternate. */
-
+	seq = ent->next_alt ? ent->next_alt : 1;
 	do {
 		int	found;
 
@@ -1164,10 +1934,13 @@ handle_duplicate_name(xfs_dahash_t hash, size_t name_len, unsigned char *name)
 		do {
 			memcpy(new_name, name, name_len);
 			found = find_alternate(name_len, new_name, seq++);
-			if (found < 0)
+			if (found < 0) {
+				ent->next_alt = seq - 1;
 				return 0;	/* No more to check */
+			}
 		} while (!found);
 	} while (nametable_find(hash, name_len, new_name));
+	ent->next_alt = seq;
 
 	/*
 	 * The alternate wasn't in the table already.  Pass it back
@@ -1178,35 +1951,17 @@ handle_duplicate_name(xfs_dahash_t hash, size_t name_len, unsigned char *name)
 	return 1;
 }
 
+/*
+ * Obfuscate a name whose hash has already been computed.  The name must
+ * already have been checked with skip_obfuscated_name().
+ */
 static void
-generate_obfuscated_name(
+obfuscate_hashed_name(
 	xfs_ino_t		ino,
 	int			namelen,
-	unsigned char		*name)
+	unsigned char		*name,
+	xfs_dahash_t		hash)
 {
-	xfs_dahash_t		hash;
-
-	/*
-	 * We don't obfuscate "lost+found" or any orphan files
-	 * therein.  When the name table is used for extended
-	 * attributes, the inode number provided is 0, in which
-	 * case we don't need to make this check.
-	 */
-	if (ino && in_lost_found(ino, namelen, name))
-		return;
-
-	/*
-	 * If the name starts with a slash, just skip over it.  It
-	 * isn't included in the hash and we don't record it in the
-	 * name table.  Note that the namelen value passed in does
-	 * not count the leading slash (if one is present).
-	 */
-	if (*name == '/')
-		name++;
-
-	/* Obfuscate the name (if possible) */
-
-	hash = libxfs_da_hashname(name, namelen);
 	obfuscate_name(hash, namelen, name);
 
 	/*
@@ -1232,6 +1987,95 @@ generate_obfuscated_name(
 			(unsigned long long) cur_ino);
 }
 
+/*
+ * Returns NULL if the name must be left alone, otherwise the start of the
+ * part of the name that gets hashed and obfuscated.
+ */
+static unsigned char *
+skip_obfuscated_name(
+	xfs_ino_t		ino,
+	int			namelen,
+	unsigned char		*name)
+{
+	/*
+	 * We don't obfuscate "lost+found" or any orphan files
+	 * therein.  When the name table is used for extended
+	 * attributes, the inode number provided is 0, in which
+	 * case we don't need to make this check.
+	 */
+	if (ino && in_lost_found(ino, namelen, name))
+		return NULL;
+
+	/*
+	 * If the name starts with a slash, just skip over it.  It
+	 * isn't included in the hash and we don't record it in the
+	 * name table.  Note that the namelen value passed in does
+	 * not count the leading slash (if one is present).
+	 */
+	if (*name == '/')
+		name++;
+	return name;
+}
+
+static void
+generate_obfuscated_name(
+	xfs_ino_t		ino,
+	int			namelen,
+	unsigned char		*name)
+{
+	uint64_t		start;
+
+	name = skip_obfuscated_name(ino, namelen, name);
+	if (!name)
+		return;
+	start = now_ns();
+	obfuscate_hashed_name(ino, namelen, name,
+			libxfs_da_hashname(name, namelen));
+	atomic64_add(now_ns() - start, &obfuscate_ns);
+}
+
+/*
+ * The names of a directory data block, gathered so that they can all be
+ * hashed in one batch before being obfuscated in their original order.
+ */
+struct dir_block_names {
+	int			nr;
+	xfs_ino_t		*inos;
+	unsigned char		**names;
+	int			*lens;
+	xfs_dahash_t		*hashes;
+};
+
+static void
+dir_block_names_flush(
+	struct dir_block_names	*dn)
+{
+	uint64_t		start;
+	int			i, n = 0;
+
+	/* lost+found checks have to see the names in directory order */
+	for (i = 0; i < dn->nr; i++) {
+		unsigned char	*name;
+
+		name = skip_obfuscated_name(dn->inos[i], dn->lens[i],
+				dn->names[i]);
+		if (!name)
+			continue;
+		dn->inos[n] = dn->inos[i];
+		dn->names[n] = name;
+		dn->lens[n++] = dn->lens[i];
+	}
+
+	start = now_ns();
+	libxfs_da_hashname_batch((const uint8_t * const *)dn->names, dn->lens,
+			dn->hashes, n);
+	for (i = 0; i < n; i++)
+		obfuscate_hashed_name(dn->inos[i], dn->lens[i], dn->names[i],
+				dn->hashes[i]);
+	atomic64_add(now_ns() - start, &obfuscate_ns);
+	dn->nr = 0;
+}
+
 static void
 process_sf_dir(
 	struct xfs_dinode	*dip)
@@ -1308,6 +2152,7 @@ obfuscate_path_components(
 {
 	unsigned char		*comp = (unsigned char *)buf;
 	unsigned char		*end = comp + len;
+	uint64_t		start = now_ns();
 	xfs_dahash_t		hash;
 
 	while (comp < end) {
@@ -1335,6 +2180,7 @@ obfuscate_path_components(
 		comp += namelen + 1;
 		len -= namelen + 1;
 	}
+	atomic64_add(now_ns() - start, &obfuscate_ns);
 }
 
 static void
@@ -1523,6 +2369,8 @@ process_dir_data_block(
 	int		end_of_data;
 	int		wantmagic;
 	struct xfs_dir2_data_hdr *datahdr;
+	struct dir_block_names dn = { 0 };
+	int		max_names = 0;
 
 	datahdr = (struct xfs_dir2_data_hdr *)block;
 
@@ -1560,6 +2408,17 @@ process_dir_data_block(
 	ptr = block + dir_offset;
 	endptr = block + mp->m_dir_geo->blksize;
 
+	if (obfuscate) {
+		max_names = mp->m_dir_geo->blksize /
+				libxfs_dir2_data_entsize(mp, 1) + 1;
+		dn.inos = malloc(max_names * sizeof(*dn.inos));
+		dn.names = malloc(max_names * sizeof(*dn.names));
+		dn.lens = malloc(max_names * sizeof(*dn.lens));
+		dn.hashes = malloc(max_names * sizeof(*dn.hashes));
+		if (!dn.inos || !dn.names || !dn.lens || !dn.hashes)
+			max_names = 0;	/* obfuscate one at a time */
+	}
+
 	while (ptr < endptr && dir_offset < end_of_data) {
 		xfs_dir2_data_entry_t	*dep;
 		xfs_dir2_data_unused_t	*dup;
@@ -1576,11 +2435,11 @@ process_dir_data_block(
 					print_warning(
 			"invalid length for dir free space in inode %llu",
 						(long long)cur_ino);
-				return;
+				goto out;
 			}
 			if (be16_to_cpu(*xfs_dir2_data_unused_tag_p(dup)) !=
 					dir_offset)
-				return;
+				goto out;
 			dir_offset += free_length;
 			ptr += free_length;
 			/*
@@ -1598,7 +2457,7 @@ process_dir_data_block(
 				}
 			}
 			if (dir_offset >= end_of_data || ptr >= endptr)
-				return;
+				goto out;
 		}
 
 		dep = (xfs_dir2_data_entry_t *)ptr;
@@ -1610,15 +2469,20 @@ process_dir_data_block(
 				print_warning(
 			"invalid length for dir entry name in inode %llu",
 					(long long)cur_ino);
-			return;
+			goto out;
 		}
 		if (be16_to_cpu(*libxfs_dir2_data_entry_tag_p(mp, dep)) !=
 				dir_offset)
-			return;
+			goto out;
 
-		if (obfuscate)
+		if (obfuscate && dn.nr < max_names) {
+			dn.inos[dn.nr] = be64_to_cpu(dep->inumber);
+			dn.names[dn.nr] = &dep->name[0];
+			dn.lens[dn.nr++] = dep->namelen;
+		} else if (obfuscate) {
 			generate_obfuscated_name(be64_to_cpu(dep->inumber),
 					 dep->namelen, &dep->name[0]);
+		}
 		dir_offset += length;
 		ptr += length;
 		/* Zero the unused space after name, up to the tag */
@@ -1633,6 +2497,13 @@ process_dir_data_block(
 			}
 		}
 	}
+out:
+	if (dn.nr)
+		dir_block_names_flush(&dn);
+	free(dn.inos);
+	free(dn.names);
+	free(dn.lens);
+	free(dn.hashes);
 }
 
 static int
@@ -1651,7 +2522,7 @@ process_symlink_block(
 	map.nmaps = 1;
 	map.b[0].bm_bn = XFS_FSB_TO_DADDR(mp, s);
 	map.b[0].bm_len = XFS_FSB_TO_BB(mp, c);
-	set_cur(&typtab[btype], 0, 0, DB_RING_IGN, &map);
+	md_set_cur(&typtab[btype], 0, 0, DB_RING_IGN, &map);
 	if (!iocur_top->data) {
 		xfs_agnumber_t	agno = XFS_FSB_TO_AGNO(mp, s);
 		xfs_agblock_t	agbno = XFS_FSB_TO_AGBNO(mp, s);
@@ -1690,7 +2561,7 @@ out_pop:
 
 #define MAX_REMOTE_VALS		4095
 
-static struct attr_data_s {
+static __thread struct attr_data_s {
 	int			remote_val_count;
 	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
 } attr_data;
@@ -1849,7 +2720,7 @@ process_single_fsb_objects(
 
 	for (i = 0; i < c; i++) {
 		push_cur();
-		set_cur(&typtab[btype], XFS_FSB_TO_DADDR(mp, s), blkbb,
+		md_set_cur(&typtab[btype], XFS_FSB_TO_DADDR(mp, s), blkbb,
 				DB_RING_IGN, NULL);
 
 		if (!iocur_top->data) {
@@ -1940,8 +2811,8 @@ out_pop:
 /*
  * Static map to aggregate multiple extents into a single directory block.
  */
-static struct bbmap mfsb_map;
-static int mfsb_length;
+static __thread struct bbmap mfsb_map;
+static __thread int mfsb_length;
 
 static int
 process_multi_fsb_dir(
@@ -1971,7 +2842,8 @@ process_multi_fsb_dir(
 
 		if (mfsb_length == 0) {
 			push_cur();
-			set_cur(&typtab[btype], 0, 0, DB_RING_IGN, &mfsb_map);
+			md_set_cur(&typtab[btype], 0, 0, DB_RING_IGN,
+					&mfsb_map);
 			if (!iocur_top->data) {
 				xfs_agnumber_t	agno = XFS_FSB_TO_AGNO(mp, s);
 				xfs_agblock_t	agbno = XFS_FSB_TO_AGBNO(mp, s);
@@ -2044,6 +2916,111 @@ process_multi_fsb_objects(
 }
 
 /* inode copy routines */
+/*
+ * Start reading the blocks mapped by an extent list before processing them
+ * one set_cur at a time.  Multi-block directory blocks are only read ahead
+ * when they sit inside one extent, because only then will
+ * process_multi_fsb_dir read them with the same length.
+ */
+static void
+bmbt_reclist_readahead(
+	xfs_bmbt_rec_t		*rp,
+	int			numrecs,
+	typnm_t			btype)
+{
+	xfs_fileoff_t		o, b;
+	xfs_fsblock_t		s;
+	xfs_filblks_t		c;
+	int			f;
+	int			i;
+	int			nr = 0;
+	unsigned int		step = 1;
+
+	if (btype == TYP_SYMLINK)
+		return;
+	if (is_multi_fsb_object(mp, btype))
+		step = mp->m_dir_geo->fsbcount;
+
+	for (i = 0; i < numrecs && nr < RA_BMAP_READS; i++, rp++) {
+		convert_extent(rp, &o, &s, &c, &f);
+		if (c > max_extent_size ||
+		    !libxfs_verify_fsbno(mp, s) ||
+		    !libxfs_verify_fsbno(mp, s + c - 1))
+			break;
+
+		for (b = roundup(o, step);
+		     b + step <= o + c && nr < RA_BMAP_READS;
+		     b += step, nr++)
+			readahead_cur(&typtab[btype],
+					XFS_FSB_TO_DADDR(mp, s + (b - o)),
+					XFS_FSB_TO_BB(mp, step));
+	}
+}
+
+/*
+ * Account for the data extents of a regular file and, if its data is being
+ * sampled for -D, dump its blocks.  The data is never read: each sector is
+ * filled with its own disk address instead, which is enough for a restore
+ * to allocate the block and compresses to next to nothing.
+ */
+static int
+process_data_reclist(
+	xfs_bmbt_rec_t		*rp,
+	int			numrecs)
+{
+	xfs_fileoff_t		o;
+	xfs_fsblock_t		s;
+	xfs_filblks_t		c, b;
+	xfs_daddr_t		daddr;
+	__be64			*fill = NULL;
+	int			f;
+	int			i, j;
+	int			ret = 1;
+
+	if (dump_file_data) {
+		fill = malloc(mp->m_sb.sb_blocksize);
+		if (!fill) {
+			print_warning("memory allocation failure");
+			return 0;
+		}
+	}
+
+	for (i = 0; i < numrecs; i++, rp++) {
+		convert_extent(rp, &o, &s, &c, &f);
+		if (c == 0 || !libxfs_verify_fsbno(mp, s) ||
+		    !libxfs_verify_fsbno(mp, s + c - 1) ||
+		    XFS_FSB_TO_AGNO(mp, s) != XFS_FSB_TO_AGNO(mp, s + c - 1)) {
+			if (show_warnings)
+				print_warning("invalid data extent %d in ino "
+					"%llu", i, (long long)cur_ino);
+			break;
+		}
+		atomic64_inc(&data_extents);
+		atomic64_add(c, &data_blocks);
+		if (!fill)
+			continue;
+
+		for (b = 0; b < c; b++) {
+			daddr = XFS_FSB_TO_DADDR(mp, s + b);
+			for (j = 0; j < BBTOB(blkbb) / sizeof(*fill); j++)
+				fill[j] = cpu_to_be64(daddr +
+						BTOBBT(j * sizeof(*fill)));
+			if (write_buf_segment((char *)fill, daddr, blkbb)) {
+				ret = 0;
+				goto out;
+			}
+		}
+		atomic64_add(c, &data_sampled);
+		if (seenint()) {
+			ret = 0;
+			break;
+		}
+	}
+out:
+	free(fill);
+	return ret;
+}
+
 static int
 process_bmbt_reclist(
 	xfs_bmbt_rec_t 		*rp,
@@ -2062,7 +3039,9 @@ process_bmbt_reclist(
 	int			error;
 
 	if (btype == TYP_DATA)
-		return 1;
+		return process_data_reclist(rp, numrecs);
+
+	bmbt_reclist_readahead(rp, numrecs, btype);
 
 	convert_extent(&rp[numrecs - 1], &o, &s, &c, &f);
 	last = o + c;
@@ -2169,6 +3148,13 @@ scanfunc_bmap(
 		return 1;
 	}
 	pp = XFS_BMBT_PTR_ADDR(mp, block, 1, mp->m_bmap_dmxr[1]);
+	for (i = 0; i < nrecs; i++) {
+		xfs_fsblock_t	fsbno = get_unaligned_be64(&pp[i]);
+
+		if (libxfs_verify_fsbno(mp, fsbno))
+			readahead_cur(&typtab[btype],
+				XFS_FSB_TO_DADDR(mp, fsbno), blkbb);
+	}
 	for (i = 0; i < nrecs; i++) {
 		xfs_agnumber_t	ag;
 		xfs_agblock_t	bno;
@@ -2351,6 +3337,31 @@ process_dev_inode(
 	}
 }
 
+/*
+ * Count a regular file by how many extents it has, and decide whether -D
+ * samples its data.  The choice is made from the inode number so that the
+ * same files are picked every time.
+ */
+static bool
+account_file_data(
+	struct xfs_dinode	*dip)
+{
+	xfs_extnum_t		nex = XFS_DFORK_NEXTENTS(dip, XFS_DATA_FORK);
+	int			bucket = 0;
+
+	while (bucket < EXTENT_HIST - 1 && (1ULL << bucket) < nex)
+		bucket++;
+	atomic64_inc(&data_files);
+	atomic64_inc(&extent_hist[bucket]);
+
+	/* realtime data isn't on the data device */
+	if (!data_sample_pct ||
+	    (dip->di_flags & cpu_to_be16(XFS_DIFLAG_REALTIME)))
+		return false;
+	return ((cur_ino * 0x9E3779B97F4A7C15ULL) >> 32) % 100 <
+			data_sample_pct;
+}
+
 /*
  * when we process the inode, we may change the data in the data and/or
  * attribute fork if they are in short form and we are obfuscating names.
@@ -2400,7 +3411,9 @@ process_inode(
 				need_new_crc = 1;
 			break;
 		case S_IFREG:
+			dump_file_data = account_file_data(dip);
 			success = process_inode_data(dip, TYP_DATA);
+			dump_file_data = false;
 			break;
 		case S_IFIFO:
 		case S_IFCHR:
@@ -2445,7 +3458,58 @@ done:
 	return success;
 }
 
-static uint32_t	inodes_copied;
+/*
+ * If the fs supports sparse inode records, we must process inodes a
+ * cluster at a time because that is the sparse allocation granularity.
+ * Otherwise, we risk CRC corruption errors on reads of inode chunks.
+ *
+ * Also make sure that that we don't process more than the single record
+ * we've been passed (large block sizes can hold multiple inode chunks).
+ */
+static void
+inode_chunk_bufs(
+	int			*blks_per_buf,
+	int			*inodes_per_buf)
+{
+	struct xfs_ino_geometry *igeo = M_IGEO(mp);
+
+	if (xfs_has_sparseinodes(mp))
+		*blks_per_buf = igeo->blocks_per_cluster;
+	else
+		*blks_per_buf = igeo->ialloc_blks;
+	*inodes_per_buf = min(XFS_FSB_TO_INO(mp, *blks_per_buf),
+			      XFS_INODES_PER_CHUNK);
+}
+
+/* Start reading the buffers that copy_inode_chunk will want. */
+static void
+inode_chunk_readahead(
+	xfs_agnumber_t		agno,
+	xfs_inobt_rec_t		*rp)
+{
+	xfs_agino_t		agino = be32_to_cpu(rp->ir_startino);
+	xfs_agblock_t		agbno = XFS_AGINO_TO_AGBNO(mp, agino);
+	xfs_agblock_t		end_agbno;
+	int			blks_per_buf;
+	int			inodes_per_buf;
+	int			ioff = 0;
+
+	if (agino == 0 || agino == NULLAGINO || !valid_bno(agno, agbno))
+		return;
+
+	inode_chunk_bufs(&blks_per_buf, &inodes_per_buf);
+	end_agbno = agbno + M_IGEO(mp)->ialloc_blks;
+	while (agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK) {
+		if (!valid_bno(agno, agbno + blks_per_buf - 1))
+			break;
+		if (!xfs_inobt_is_sparse_disk(rp, ioff))
+			readahead_cur(&typtab[TYP_INODE],
+					XFS_AGB_TO_DADDR(mp, agno, agbno),
+					XFS_FSB_TO_BB(mp, blks_per_buf));
+		agbno += blks_per_buf;
+		ioff += inodes_per_buf;
+	}
+}
 
 static int
 copy_inode_chunk(
@@ -2468,20 +3532,7 @@ copy_inode_chunk(
 	end_agbno = agbno + igeo->ialloc_blks;
 	off = XFS_INO_TO_OFFSET(mp, agino);
 
-	/*
-	 * If the fs supports sparse inode records, we must process inodes a
-	 * cluster at a time because that is the sparse allocation granularity.
-	 * Otherwise, we risk CRC corruption errors on reads of inode chunks.
-	 *
-	 * Also make sure that that we don't process more than the single record
-	 * we've been passed (large block sizes can hold multiple inode chunks).
-	 */
-	if (xfs_has_sparseinodes(mp))
-		blks_per_buf = igeo->blocks_per_cluster;
-	else
-		blks_per_buf = igeo->ialloc_blks;
-	inodes_per_buf = min(XFS_FSB_TO_INO(mp, blks_per_buf),
-			     XFS_INODES_PER_CHUNK);
+	inode_chunk_bufs(&blks_per_buf, &inodes_per_buf);
 
 	/*
 	 * Sanity check that we only process a single buffer if ir_startino has
@@ -2524,7 +3575,7 @@ copy_inode_chunk(
 		if (xfs_inobt_is_sparse_disk(rp, ioff))
 			goto next_bp;
 
-		set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
+		md_set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
 			XFS_FSB_TO_BB(mp, blks_per_buf), DB_RING_IGN, NULL);
 		if (iocur_top->data == NULL) {
 			print_warning("cannot read inode block %u/%u",
@@ -2544,7 +3595,7 @@ copy_inode_chunk(
 			    XFS_INOBT_IS_FREE_DISK(rp, ioff + i)))
 				goto pop_out;
 
-			inodes_copied++;
+			atomic_inc(&inodes_copied);
 		}
 
 		if (write_buf(iocur_top))
@@ -2555,10 +3606,15 @@ next_bp:
 		ioff += inodes_per_buf;
 	}
 
-	if (show_progress)
-		print_progress("Copied %u of %u inodes (%u of %u AGs)",
-				inodes_copied, mp->m_sb.sb_icount, agno,
-				mp->m_sb.sb_agcount);
+	if (show_progress) {
+		char	rates[48];
+
+		format_rates(rates, sizeof(rates));
+		print_progress("Copied %u of %llu inodes, AG %u of %u%s",
+				atomic_read(&inodes_copied),
+				(unsigned long long)mp->m_sb.sb_icount, agno,
+				mp->m_sb.sb_agcount, rates);
+	}
 	rval = 1;
 pop_out:
 	pop_cur();
@@ -2600,7 +3656,11 @@ scanfunc_ino(
 			return 1;
 
 		rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+		for (i = 0; i < numrecs && i < RA_INODE_RECS; i++)
+			inode_chunk_readahead(agno, &rp[i]);
 		for (i = 0; i < numrecs; i++, rp++) {
+			if (i + RA_INODE_RECS < numrecs)
+				inode_chunk_readahead(agno, rp + RA_INODE_RECS);
 			if (!copy_inode_chunk(agno, rp))
 				return 0;
 		}
@@ -2615,6 +3675,7 @@ scanfunc_ino(
 	}
 
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	scan_btree_readahead(agno, pp, numrecs, btype);
 	for (i = 0; i < numrecs; i++) {
 		if (!valid_bno(agno, be32_to_cpu(pp[i]))) {
 			if (show_warnings)
@@ -2673,40 +3734,52 @@ copy_inodes(
 	return 1;
 }
 
+/* copy the superblock of the AG */
 static int
-scan_ag(
+copy_sb(
 	xfs_agnumber_t	agno)
 {
-	xfs_agf_t	*agf;
-	xfs_agi_t	*agi;
-	int		stack_count = 0;
 	int		rval = 0;
 
-	/* copy the superblock of the AG */
 	push_cur();
-	stack_count++;
-	set_cur(&typtab[TYP_SB], XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+	md_set_cur(&typtab[TYP_SB], XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	if (!iocur_top->data) {
 		print_warning("cannot read superblock for ag %u", agno);
-		if (stop_on_read_error)
-			goto pop_out;
-	} else {
-		/* Replace any filesystem label with "L's" */
-		if (obfuscate) {
-			struct xfs_sb *sb = iocur_top->data;
-			memset(sb->sb_fname, 'L',
-			       min(strlen(sb->sb_fname), sizeof(sb->sb_fname)));
-			iocur_top->need_crc = 1;
-		}
-		if (write_buf(iocur_top))
-			goto pop_out;
+		rval = !stop_on_read_error;
+		goto pop_out;
+	}
+
+	/* Replace any filesystem label with "L's" */
+	if (obfuscate) {
+		struct xfs_sb *sb = iocur_top->data;
+		memset(sb->sb_fname, 'L',
+		       min(strlen(sb->sb_fname), sizeof(sb->sb_fname)));
+		iocur_top->need_crc = 1;
 	}
+	rval = !write_buf(iocur_top);
+pop_out:
+	pop_cur();
+	return rval;
+}
+
+static int
+scan_ag(
+	xfs_agnumber_t	agno,
+	bool		copy_super)
+{
+	xfs_agf_t	*agf;
+	xfs_agi_t	*agi;
+	int		stack_count = 0;
+	int		rval = 0;
+
+	if (copy_super && !copy_sb(agno))
+		return 0;
 
 	/* copy the AG free space btree root */
 	push_cur();
 	stack_count++;
-	set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+	md_set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	agf = iocur_top->data;
 	if (iocur_top->data == NULL) {
@@ -2721,7 +3794,7 @@ scan_ag(
 	/* copy the AG inode btree root */
 	push_cur();
 	stack_count++;
-	set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+	md_set_cur(&typtab[TYP_AGI], XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	agi = iocur_top->data;
 	if (iocur_top->data == NULL) {
@@ -2736,7 +3809,8 @@ scan_ag(
 	/* copy the AG free list header */
 	push_cur();
 	stack_count++;
-	set_cur(&typtab[TYP_AGFL], XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
+	md_set_cur(&typtab[TYP_AGFL],
+			XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
 			XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		print_warning("cannot read agfl block for ag %u", agno);
@@ -2819,7 +3893,7 @@ copy_ino(
 	}
 
 	push_cur();
-	set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
+	md_set_cur(&typtab[TYP_INODE], XFS_AGB_TO_DADDR(mp, agno, agbno),
 			blkbb, DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		print_warning("cannot read %s inode %lld",
@@ -2869,7 +3943,7 @@ copy_log(void)
 		print_progress("Copying log");
 
 	push_cur();
-	set_cur(&typtab[TYP_LOG], XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
+	md_set_cur(&typtab[TYP_LOG], XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
 			mp->m_sb.sb_logblocks * blkbb, DB_RING_IGN, NULL);
 	if (iocur_top->data == NULL) {
 		pop_cur();
@@ -2919,6 +3993,99 @@ done:
 	return !write_buf(iocur_top);
 }
 
+/*
+ * Directories are dumped in whatever order the AG threads get to them, so
+ * look up "lost+found" up front rather than waiting to see the root
+ * directory go by.
+ */
+static void
+find_orphanage(void)
+{
+	struct xfs_name		xname = {
+		.name		= (unsigned char *)ORPHANAGE,
+		.len		= ORPHANAGE_LEN,
+	};
+	struct xfs_inode	*dp;
+	xfs_ino_t		ino;
+
+	if (libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &dp))
+		return;
+	if (S_ISDIR(VFS_I(dp)->i_mode) &&
+	    !libxfs_dir_lookup(NULL, dp, &xname, &ino, NULL) &&
+	    libxfs_verify_ino(mp, ino))
+		orphanage_ino = ino;
+	libxfs_irele(dp);
+}
+
+static void
+scan_ag_work(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	bool			*failed = wq->wq_ctx;
+	struct metadump_seg	ag_seg;
+
+	if (*failed || seenint())
+		return;
+	if (init_seg(&ag_seg)) {
+		*failed = true;
+		return;
+	}
+
+	seg = &ag_seg;
+	if (!scan_ag(agno, agno != 0) || write_index() || write_chunk())
+		*failed = true;
+	seg = NULL;
+
+	free_seg(&ag_seg);
+	free_cur_stack();
+}
+
+/*
+ * Dump the AGs of a chunked dump in parallel, each into a segment of its own
+ * that goes out as whole chunks.  The primary superblock is written first,
+ * in a chunk by itself, since restore expects to find it there.
+ *
+ * Return 1 for success, 0 for failure.
+ */
+static int
+scan_ags(void)
+{
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	bool			failed = false;
+	int			error;
+
+	if (!copy_sb(0) || write_index() || write_chunk())
+		return 0;
+
+	if (obfuscate)
+		find_orphanage();
+
+	error = -workqueue_create(&wq, &failed,
+			min(platform_nproc(), (int)mp->m_sb.sb_agcount));
+	if (error) {
+		print_warning("cannot create AG threads: %s", strerror(error));
+		return 0;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount && !failed; agno++) {
+		error = -workqueue_add(&wq, scan_ag_work, agno, NULL);
+		if (error) {
+			print_warning("cannot queue AG %u: %s", agno,
+					strerror(error));
+			failed = true;
+		}
+	}
+	error = -workqueue_terminate(&wq);
+	if (error) {
+		print_warning("cannot finish AG threads: %s", strerror(error));
+		failed = true;
+	}
+	workqueue_destroy(&wq);
+	return !failed;
+}
+
 static int
 metadump_f(
 	int 		argc,
@@ -2930,6 +4097,7 @@ metadump_f(
 	int		outfd = -1;
 	int		ret;
 	char		*p;
+	char		*base_path = NULL;
 
 	exitcode = 1;
 	show_progress = 0;
@@ -2952,11 +4120,28 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "aegm:ow")) != EOF) {
+	metadump_chunked = false;
+	chunk_compress = XFS_MD_COMPRESS_NONE;
+
+	stats_path = NULL;
+	data_sample_pct = 0;
+	while ((c = getopt(argc, argv, "aB:D:egm:oS:wz")) != EOF) {
 		switch (c) {
 			case 'a':
 				zero_stale_data = 0;
 				break;
+			case 'B':
+				base_path = optarg;
+				break;
+			case 'D':
+				data_sample_pct = (int)strtol(optarg, &p, 0);
+				if (*p != '\0' || data_sample_pct <= 0 ||
+				    data_sample_pct > 100) {
+					print_warning("bad data percentage %s",
+							optarg);
+					return 0;
+				}
+				break;
 			case 'e':
 				stop_on_read_error = 1;
 				break;
@@ -2974,9 +4159,21 @@ metadump_f(
 			case 'o':
 				obfuscate = 0;
 				break;
+			case 'S':
+				stats_path = optarg;
+				break;
 			case 'w':
 				show_warnings = 1;
 				break;
+			case 'z':
+				metadump_chunked = true;
+#ifdef HAVE_LIBZSTD
+				chunk_compress = XFS_MD_COMPRESS_ZSTD;
+#else
+				print_warning(
+		"built without zstd, writing an uncompressed chunked dump");
+#endif
+				break;
 			default:
 				print_warning("bad option for metadump command");
 				return 0;
@@ -2987,39 +4184,39 @@ metadump_f(
 		print_warning("too few options for metadump (no filename given)");
 		return 0;
 	}
-
-	metablock = (xfs_metablock_t *)calloc(BBSIZE + 1, BBSIZE);
-	if (metablock == NULL) {
-		print_warning("memory allocation failure");
+	if (base_path && !metadump_chunked) {
+		print_warning("-B needs a chunked dump (-z)");
 		return 0;
 	}
-	metablock->mb_blocklog = BBSHIFT;
-	metablock->mb_magic = cpu_to_be32(XFS_MD_MAGIC);
+
+	/* progress is estimated from the incore inode count */
+	if (show_progress)
+		init_perag_data();
 
 	/* Set flags about state of metadump */
-	metablock->mb_info = XFS_METADUMP_INFO_FLAGS;
+	metadump_info = XFS_METADUMP_INFO_FLAGS;
 	if (obfuscate)
-		metablock->mb_info |= XFS_METADUMP_OBFUSCATED;
+		metadump_info |= XFS_METADUMP_OBFUSCATED;
 	if (!zero_stale_data)
-		metablock->mb_info |= XFS_METADUMP_FULLBLOCKS;
+		metadump_info |= XFS_METADUMP_FULLBLOCKS;
+	if (base_path)
+		metadump_info |= XFS_METADUMP_DELTA;
 
 	/* If we'll copy the log, see if the log is dirty */
 	if (mp->m_sb.sb_logstart) {
 		push_cur();
-		set_cur(&typtab[TYP_LOG],
+		md_set_cur(&typtab[TYP_LOG],
 			XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
 			mp->m_sb.sb_logblocks * blkbb, DB_RING_IGN, NULL);
 		if (iocur_top->data) {	/* best effort */
 			struct xlog	log;
 
 			if (xlog_is_dirty(mp, &log, &x, 0))
-				metablock->mb_info |= XFS_METADUMP_DIRTYLOG;
+				metadump_info |= XFS_METADUMP_DIRTYLOG;
 		}
 		pop_cur();
 	}
 
-	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
-	block_buffer = (char *)metablock + BBSIZE;
 	num_indices = (BBSIZE - sizeof(xfs_metablock_t)) / sizeof(__be64);
 
 	/*
@@ -3030,18 +4227,40 @@ metadump_f(
 	if (mp->m_sb.sb_sectsize > num_indices * BBSIZE) {
 		print_warning("Cannot dump filesystem with sector size %u",
 			      mp->m_sb.sb_sectsize);
-		free(metablock);
 		return 0;
 	}
 
-	cur_index = 0;
+#ifdef HAVE_LIBZSTD
+	chunk_zbuf_size = ZSTD_compressBound(XFS_MD_CHUNK_SIZE);
+#endif
+	/* the primary superblock always goes in, restore starts from it */
+	base_keep_daddr = BTOBB(mp->m_sb.sb_sectsize);
+	if (base_path && load_base(base_path)) {
+		free_base();
+		return 0;
+	}
+	if (init_seg(&main_seg))
+		return 0;
+	seg = &main_seg;
+	orphanage_ino = 0;
+	atomic_set(&inodes_copied, 0);
+	atomic64_set(&bytes_dumped, 0);
+	atomic64_set(&read_ns, 0);
+	atomic64_set(&obfuscate_ns, 0);
+	atomic64_set(&output_ns, 0);
+	atomic64_set(&data_files, 0);
+	atomic64_set(&data_extents, 0);
+	atomic64_set(&data_blocks, 0);
+	atomic64_set(&data_sampled, 0);
+	for (c = 0; c < EXTENT_HIST; c++)
+		atomic64_set(&extent_hist[c], 0);
+	start_ns = now_ns();
 	start_iocur_sp = iocur_sp;
 
 	if (strcmp(argv[optind], "-") == 0) {
 		if (isatty(fileno(stdout))) {
 			print_warning("cannot write to a terminal");
-			free(metablock);
-			return 0;
+			goto out;
 		}
 		/*
 		 * Redirect stdout to stderr for the duration of the
@@ -3080,12 +4299,17 @@ metadump_f(
 		}
 	}
 
-	exitcode = 0;
+	out_offset = 0;
+	exitcode = metadump_chunked && !init_metadump_chunked();
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
-			exitcode = 1;
-			break;
+	if (metadump_chunked && !exitcode) {
+		exitcode = !scan_ags();
+	} else {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			if (!scan_ag(agno, true)) {
+				exitcode = 1;
+				break;
+			}
 		}
 	}
 
@@ -3100,9 +4324,13 @@ metadump_f(
 	/* write the remaining index */
 	if (!exitcode)
 		exitcode = write_index() < 0;
+	if (!exitcode && metadump_chunked)
+		exitcode = write_chunk_index() < 0;
 
 	if (progress_since_warning)
 		fputc('\n', stdout_metadump ? stderr : stdout);
+	if (!exitcode)
+		report_stats();
 
 	if (stdout_metadump) {
 		fflush(outf);
@@ -3118,7 +4346,12 @@ metadump_f(
 	while (iocur_sp > start_iocur_sp)
 		pop_cur();
 out:
-	free(metablock);
+	free_seg(&main_seg);
+	seg = NULL;
+	free_base();
+	free(chunk_index);
+	chunk_index = NULL;
+	max_chunks = 0;
 
 	return 0;
 }
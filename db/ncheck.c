@@ -0,0 +1,747 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include "libxfs.h"
+#include "io.h"
+#include "type.h"
+#include "output.h"
+#include "init.h"
+#include "malloc.h"
+#include "sig.h"
+#include "ncheck.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
+
+/*
+ * Name Index
+ *
+ * ncheck used to need a full blockget -n, which checks everything and
+ * keeps a big inodata_t for every inode just so that it can print names.
+ * Instead we can walk each AG's inode btree, read every directory we find
+ * along the way, and write down one entry per name: the child inode, its
+ * parent, and where the name starts in a shared arena of name bytes.  The
+ * AGs are scanned in parallel, each into its own arrays, and merged and
+ * sorted by inode number at the end.
+ *
+ * Turning an inode number into a path is then a binary search per path
+ * component, so any number of inodes can be looked up once it's built.
+ *
+ * Like blockget -n, we remember one name per inode.  For hard links we
+ * keep the name in the lowest numbered parent, and the first name in that
+ * directory if there are several, so the answer doesn't depend on which
+ * thread got there first.
+ */
+
+/* Inode flags that ncheck prints or filters on. */
+#define NINDEX_DIR		(1U << 0)
+#define NINDEX_SECURITY		(1U << 1)	/* setuid/setgid or special */
+
+/* Directory blocks to read ahead of the one we're parsing. */
+#define NINDEX_DIR_RA		16
+
+/*
+ * Stop walking up the tree at a depth that no sane tree reaches, so that
+ * a directory loop can't run us out of memory.
+ */
+#define NINDEX_MAX_DEPTH	65536
+
+struct nindex_name {
+	xfs_ino_t		ino;
+	xfs_ino_t		parent;
+	uint64_t		name;		/* offset into the arena */
+	uint8_t			namelen;
+};
+
+struct nindex_inode {
+	xfs_ino_t		ino;
+	unsigned int		flags;
+};
+
+/* What one AG's scan found; only its scanner touches it. */
+struct nindex_ag {
+	struct nindex_name	*names;
+	uint64_t		nr_names;
+	uint64_t		max_names;
+	struct nindex_inode	*inodes;
+	uint64_t		nr_inodes;
+	uint64_t		max_inodes;
+	char			*arena;
+	uint64_t		arena_len;
+	uint64_t		arena_max;
+};
+
+struct nindex {
+	struct nindex_name	*names;
+	uint64_t		nr_names;
+	struct nindex_inode	*inodes;
+	uint64_t		nr_inodes;
+	char			*arena;
+};
+
+static void
+nindex_add_inode(
+	struct nindex_ag	*ag,
+	xfs_ino_t		ino,
+	unsigned int		flags)
+{
+	if (ag->nr_inodes == ag->max_inodes) {
+		ag->max_inodes = max(ag->max_inodes * 2, 64ULL);
+		ag->inodes = xrealloc(ag->inodes,
+				ag->max_inodes * sizeof(*ag->inodes));
+	}
+	ag->inodes[ag->nr_inodes].ino = ino;
+	ag->inodes[ag->nr_inodes].flags = flags;
+	ag->nr_inodes++;
+}
+
+static void
+nindex_add_name(
+	struct nindex_ag	*ag,
+	xfs_ino_t		ino,
+	xfs_ino_t		parent,
+	const unsigned char	*name,
+	unsigned int		namelen)
+{
+	struct nindex_name	*n;
+
+	if (!libxfs_verify_dir_ino(mp, ino) || namelen == 0)
+		return;
+
+	if (ag->arena_len + namelen > ag->arena_max) {
+		ag->arena_max = max(ag->arena_max * 2, 4096ULL);
+		ag->arena = xrealloc(ag->arena, ag->arena_max);
+	}
+	if (ag->nr_names == ag->max_names) {
+		ag->max_names = max(ag->max_names * 2, 64ULL);
+		ag->names = xrealloc(ag->names,
+				ag->max_names * sizeof(*ag->names));
+	}
+
+	n = &ag->names[ag->nr_names++];
+	n->ino = ino;
+	n->parent = parent;
+	n->name = ag->arena_len;
+	n->namelen = namelen;
+	memcpy(ag->arena + ag->arena_len, name, namelen);
+	ag->arena_len += namelen;
+}
+
+/* Record the names in a directory data block. */
+static void
+nindex_scan_dir_data(
+	struct nindex_ag	*ag,
+	struct xfs_inode	*dp,
+	struct xfs_buf		*bp)
+{
+	struct xfs_da_geometry	*geo = mp->m_dir_geo;
+	unsigned int		offset;
+	unsigned int		end;
+
+	end = xfs_dir3_data_end_offset(geo, bp->b_addr);
+	for (offset = geo->data_entry_offset; offset < end;) {
+		struct xfs_dir2_data_unused	*dup = bp->b_addr + offset;
+		struct xfs_dir2_data_entry	*dep = bp->b_addr + offset;
+		unsigned int			len;
+
+		if (be16_to_cpu(dup->freetag) == XFS_DIR2_DATA_FREE_TAG) {
+			len = be16_to_cpu(dup->length);
+			if (len == 0)
+				break;
+			offset += len;
+			continue;
+		}
+
+		len = libxfs_dir2_data_entsize(mp, dep->namelen);
+		if (dep->namelen == 0 || offset + len > end)
+			break;
+		offset += len;
+
+		if (dep->name[0] == '.' &&
+		    (dep->namelen == 1 ||
+		     (dep->namelen == 2 && dep->name[1] == '.')))
+			continue;
+		nindex_add_name(ag, be64_to_cpu(dep->inumber), dp->i_ino,
+				dep->name, dep->namelen);
+	}
+}
+
+/* Record the names in a shortform directory. */
+static void
+nindex_scan_sfdir(
+	struct nindex_ag		*ag,
+	struct xfs_inode		*dp)
+{
+	struct xfs_dir2_sf_hdr		*sfp;
+	struct xfs_dir2_sf_entry	*sfep;
+	char				*end;
+	unsigned int			i;
+
+	sfp = (struct xfs_dir2_sf_hdr *)dp->i_df.if_u1.if_data;
+	end = (char *)sfp + dp->i_df.if_bytes;
+	sfep = xfs_dir2_sf_firstentry(sfp);
+	for (i = 0; i < sfp->count; i++) {
+		if ((char *)sfep + libxfs_dir2_sf_entsize(mp, sfp, 0) > end ||
+		    (char *)sfep + libxfs_dir2_sf_entsize(mp, sfp,
+				sfep->namelen) > end)
+			break;
+		nindex_add_name(ag, libxfs_dir2_sf_get_ino(mp, sfp, sfep),
+				dp->i_ino, sfep->name, sfep->namelen);
+		sfep = libxfs_dir2_sf_nextentry(mp, sfp, sfep);
+	}
+}
+
+/*
+ * Record the names in a leaf or node directory, reading a few directory
+ * blocks ahead of the one we're looking at.
+ */
+static void
+nindex_scan_leafdir(
+	struct nindex_ag	*ag,
+	struct xfs_inode	*dp)
+{
+	struct xfs_da_geometry	*geo = mp->m_dir_geo;
+	struct xfs_ifork	*ifp = XFS_IFORK_PTR(dp, XFS_DATA_FORK);
+	struct xfs_iext_cursor	icur;
+	struct xfs_bmbt_irec	map;
+	struct xfs_buf		*bp;
+	xfs_dablk_t		*dablks = NULL;
+	xfs_dablk_t		dabno;
+	xfs_dablk_t		next = 0;
+	xfs_fileoff_t		end;
+	uint64_t		nr = 0;
+	uint64_t		max_nr = 0;
+	uint64_t		i;
+
+	if (libxfs_iread_extents(NULL, dp, XFS_DATA_FORK))
+		return;
+
+	/* Find the start of every directory data block. */
+	for_each_xfs_iext(ifp, &icur, &map) {
+		if (map.br_startoff >= geo->leafblk)
+			break;
+		end = min(map.br_startoff + map.br_blockcount,
+				(xfs_fileoff_t)geo->leafblk);
+		dabno = xfs_dir2_db_to_da(geo, xfs_dir2_da_to_db(geo,
+				map.br_startoff + geo->fsbcount - 1));
+		for (dabno = max(dabno, next); dabno < end;
+		     dabno += geo->fsbcount) {
+			if (nr == max_nr) {
+				max_nr = max(max_nr * 2, 16ULL);
+				dablks = xrealloc(dablks,
+						max_nr * sizeof(*dablks));
+			}
+			dablks[nr++] = dabno;
+			next = dabno + geo->fsbcount;
+		}
+	}
+
+	for (i = 0; i < min(nr, (uint64_t)NINDEX_DIR_RA); i++)
+		xfs_dir3_data_readahead(dp, dablks[i], 0);
+	for (i = 0; i < nr; i++) {
+		if (i + NINDEX_DIR_RA < nr)
+			xfs_dir3_data_readahead(dp, dablks[i + NINDEX_DIR_RA],
+					0);
+		if (xfs_dir3_data_read(NULL, dp, dablks[i], 0, &bp))
+			continue;
+		nindex_scan_dir_data(ag, dp, bp);
+		libxfs_buf_relse(bp);
+	}
+	xfree(dablks);
+}
+
+static void
+nindex_scan_dir(
+	struct nindex_ag	*ag,
+	xfs_ino_t		ino)
+{
+	struct xfs_da_args	args = {
+		.geo		= mp->m_dir_geo,
+	};
+	struct xfs_inode	*dp;
+	struct xfs_buf		*bp;
+	int			isblock;
+
+	if (libxfs_iget(mp, NULL, ino, 0, &dp))
+		return;
+	args.dp = dp;
+
+	switch (dp->i_df.if_format) {
+	case XFS_DINODE_FMT_LOCAL:
+		nindex_scan_sfdir(ag, dp);
+		break;
+	case XFS_DINODE_FMT_EXTENTS:
+	case XFS_DINODE_FMT_BTREE:
+		if (libxfs_dir2_isblock(&args, &isblock))
+			break;
+		if (!isblock) {
+			nindex_scan_leafdir(ag, dp);
+			break;
+		}
+		if (xfs_dir3_block_read(NULL, dp, &bp))
+			break;
+		nindex_scan_dir_data(ag, dp, bp);
+		libxfs_buf_relse(bp);
+		break;
+	}
+	libxfs_irele(dp);
+}
+
+static void
+nindex_scan_inode(
+	struct nindex_ag	*ag,
+	xfs_ino_t		ino,
+	struct xfs_dinode	*dip)
+{
+	unsigned int		flags;
+	uint16_t		mode;
+
+	if (be16_to_cpu(dip->di_magic) != XFS_DINODE_MAGIC)
+		return;
+	mode = be16_to_cpu(dip->di_mode);
+	switch (mode & S_IFMT) {
+	case 0:
+		return;
+	case S_IFDIR:
+		flags = NINDEX_DIR;
+		break;
+	case S_IFREG:
+		flags = (mode & (S_ISUID | S_ISGID)) ? NINDEX_SECURITY : 0;
+		break;
+	case S_IFLNK:
+		flags = 0;
+		break;
+	default:
+		flags = NINDEX_SECURITY;
+		break;
+	}
+	if (flags)
+		nindex_add_inode(ag, ino, flags);
+	if (flags & NINDEX_DIR)
+		nindex_scan_dir(ag, ino);
+}
+
+/* Read every inode in a leaf's worth of inobt records. */
+static void
+nindex_scan_inodes(
+	struct nindex_ag	*ag,
+	xfs_agnumber_t		agno,
+	xfs_inobt_rec_t		*rp,
+	int			nrecs)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	struct xfs_dinode	*dip;
+	xfs_agino_t		agino;
+	xfs_agblock_t		agbno;
+	xfs_agblock_t		end_agbno;
+	int			blks_per_buf;
+	int			inodes_per_buf;
+	int			off;
+	int			ioff;
+	int			i, j;
+
+	if (xfs_has_sparseinodes(mp))
+		blks_per_buf = igeo->blocks_per_cluster;
+	else
+		blks_per_buf = igeo->ialloc_blks;
+	inodes_per_buf = min(XFS_FSB_TO_INO(mp, blks_per_buf),
+			     XFS_INODES_PER_CHUNK);
+
+	for (i = 0; i < nrecs; i++) {
+		agbno = XFS_AGINO_TO_AGBNO(mp, be32_to_cpu(rp[i].ir_startino));
+		end_agbno = agbno + igeo->ialloc_blks;
+		for (ioff = 0;
+		     agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK;
+		     agbno += blks_per_buf, ioff += inodes_per_buf) {
+			if (xfs_inobt_is_sparse_disk(&rp[i], ioff) ||
+			    !libxfs_verify_agbno(mp, agno, agbno))
+				continue;
+			readahead_cur(&typtab[TYP_INODE],
+				XFS_AGB_TO_DADDR(mp, agno, agbno),
+				XFS_FSB_TO_BB(mp, blks_per_buf));
+		}
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		agino = be32_to_cpu(rp[i].ir_startino);
+		agbno = XFS_AGINO_TO_AGBNO(mp, agino);
+		off = XFS_AGINO_TO_OFFSET(mp, agino);
+		end_agbno = agbno + igeo->ialloc_blks;
+
+		push_cur();
+		for (ioff = 0;
+		     agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK;
+		     agbno += blks_per_buf, ioff += inodes_per_buf) {
+			if (xfs_inobt_is_sparse_disk(&rp[i], ioff) ||
+			    !libxfs_verify_agbno(mp, agno, agbno))
+				continue;
+			set_cur(&typtab[TYP_INODE],
+				XFS_AGB_TO_DADDR(mp, agno, agbno),
+				XFS_FSB_TO_BB(mp, blks_per_buf),
+				DB_RING_IGN, NULL);
+			if (iocur_top->data == NULL)
+				continue;
+			for (j = 0; j < inodes_per_buf; j++) {
+				if (XFS_INOBT_IS_FREE_DISK(&rp[i], ioff + j))
+					continue;
+				dip = (struct xfs_dinode *)((char *)iocur_top->data +
+					((off + j) << mp->m_sb.sb_inodelog));
+				nindex_scan_inode(ag,
+					XFS_AGINO_TO_INO(mp, agno,
+							agino + ioff + j),
+					dip);
+			}
+		}
+		pop_cur();
+	}
+}
+
+static void
+nindex_scan_inobt(
+	struct nindex_ag	*ag,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	int			level)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	struct xfs_btree_block	*block;
+	xfs_inobt_ptr_t		*pp;
+	xfs_agblock_t		cbno;
+	int			nrecs;
+	int			i;
+
+	if (level <= 0 || level > igeo->inobt_maxlevels ||
+	    !libxfs_verify_agbno(mp, agno, bno))
+		return;
+
+	push_cur();
+	set_cur(&typtab[TYP_INOBT], XFS_AGB_TO_DADDR(mp, agno, bno), blkbb,
+		DB_RING_IGN, NULL);
+	block = iocur_top->data;
+	if (block == NULL ||
+	    (be32_to_cpu(block->bb_magic) != XFS_IBT_MAGIC &&
+	     be32_to_cpu(block->bb_magic) != XFS_IBT_CRC_MAGIC)) {
+		dbprintf(_("can't read btree block %u/%u\n"), agno, bno);
+		pop_cur();
+		return;
+	}
+
+	nrecs = be16_to_cpu(block->bb_numrecs);
+	if (level == 1) {
+		if (nrecs <= igeo->inobt_mxr[0])
+			nindex_scan_inodes(ag, agno,
+					XFS_INOBT_REC_ADDR(mp, block, 1), nrecs);
+		pop_cur();
+		return;
+	}
+
+	if (nrecs > igeo->inobt_mxr[1]) {
+		pop_cur();
+		return;
+	}
+	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
+	for (i = 0; i < nrecs; i++) {
+		cbno = be32_to_cpu(pp[i]);
+		if (libxfs_verify_agbno(mp, agno, cbno))
+			readahead_cur(&typtab[TYP_INOBT],
+				XFS_AGB_TO_DADDR(mp, agno, cbno), blkbb);
+	}
+	for (i = 0; i < nrecs; i++)
+		nindex_scan_inobt(ag, agno, be32_to_cpu(pp[i]), level - 1);
+	pop_cur();
+}
+
+static void
+nindex_scan_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct nindex_ag	*ags = wq->wq_ctx;
+	struct xfs_agi		*agi;
+
+	if (seenint())
+		return;
+
+	push_cur();
+	set_cur(&typtab[TYP_AGI],
+		XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	agi = iocur_top->data;
+	if (agi == NULL || be32_to_cpu(agi->agi_magicnum) != XFS_AGI_MAGIC)
+		dbprintf(_("can't read agi block for ag %u\n"), agno);
+	else
+		nindex_scan_inobt(&ags[agno], agno, be32_to_cpu(agi->agi_root),
+				be32_to_cpu(agi->agi_level));
+	pop_cur();
+	free_cur_stack();
+}
+
+static int
+nindex_name_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct nindex_name *na = a;
+	const struct nindex_name *nb = b;
+
+	if (na->ino != nb->ino)
+		return na->ino < nb->ino ? -1 : 1;
+	if (na->parent != nb->parent)
+		return na->parent < nb->parent ? -1 : 1;
+	/* Same parent means same AG, where the arena grows in dir order. */
+	if (na->name != nb->name)
+		return na->name < nb->name ? -1 : 1;
+	return 0;
+}
+
+static int
+nindex_name_ino_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct nindex_name *na = a;
+	const struct nindex_name *nb = b;
+
+	if (na->ino != nb->ino)
+		return na->ino < nb->ino ? -1 : 1;
+	return 0;
+}
+
+static int
+nindex_inode_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct nindex_inode *ia = a;
+	const struct nindex_inode *ib = b;
+
+	if (ia->ino != ib->ino)
+		return ia->ino < ib->ino ? -1 : 1;
+	return 0;
+}
+
+/* Merge the per-AG results into one index, keeping one name per inode. */
+static struct nindex *
+nindex_merge(
+	struct nindex_ag	*ags)
+{
+	struct nindex		*ni;
+	struct nindex_ag	*ag;
+	xfs_agnumber_t		agno;
+	uint64_t		arena_len = 0;
+	uint64_t		i, j;
+
+	ni = xcalloc(1, sizeof(struct nindex));
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ni->nr_names += ags[agno].nr_names;
+		ni->nr_inodes += ags[agno].nr_inodes;
+		arena_len += ags[agno].arena_len;
+	}
+	ni->names = xmalloc(max(ni->nr_names, 1ULL) * sizeof(*ni->names));
+	ni->inodes = xmalloc(max(ni->nr_inodes, 1ULL) * sizeof(*ni->inodes));
+	ni->arena = xmalloc(max(arena_len, 1ULL));
+
+	ni->nr_names = ni->nr_inodes = arena_len = 0;
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ag = &ags[agno];
+		for (i = 0; i < ag->nr_names; i++) {
+			ni->names[ni->nr_names] = ag->names[i];
+			ni->names[ni->nr_names++].name += arena_len;
+		}
+		memcpy(ni->inodes + ni->nr_inodes, ag->inodes,
+				ag->nr_inodes * sizeof(*ag->inodes));
+		ni->nr_inodes += ag->nr_inodes;
+		memcpy(ni->arena + arena_len, ag->arena, ag->arena_len);
+		arena_len += ag->arena_len;
+
+		xfree(ag->names);
+		xfree(ag->inodes);
+		xfree(ag->arena);
+	}
+
+	qsort(ni->names, ni->nr_names, sizeof(*ni->names), nindex_name_cmp);
+	qsort(ni->inodes, ni->nr_inodes, sizeof(*ni->inodes),
+			nindex_inode_cmp);
+
+	for (i = 0, j = 0; i < ni->nr_names; i++) {
+		if (j > 0 && ni->names[j - 1].ino == ni->names[i].ino)
+			continue;
+		ni->names[j++] = ni->names[i];
+	}
+	ni->nr_names = j;
+	return ni;
+}
+
+/* Scan the whole filesystem, several AGs at a time, and build the index. */
+struct nindex *
+nindex_build(void)
+{
+	struct nindex_ag	*ags;
+	struct nindex		*ni = NULL;
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	int			ret;
+
+	ags = xcalloc(mp->m_sb.sb_agcount, sizeof(*ags));
+	ret = -workqueue_create(&wq, ags,
+			min(platform_nproc(), (int)mp->m_sb.sb_agcount));
+	if (ret) {
+		dbprintf(_("cannot create AG threads: %s\n"), strerror(ret));
+		goto out;
+	}
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		ret = -workqueue_add(&wq, nindex_scan_ag, agno, NULL);
+		if (ret) {
+			dbprintf(_("cannot queue AG %u: %s\n"), agno,
+					strerror(ret));
+			break;
+		}
+	}
+	if (workqueue_terminate(&wq) && !ret) {
+		dbprintf(_("cannot finish AG threads\n"));
+		ret = EIO;
+	}
+	workqueue_destroy(&wq);
+
+	/* A partial index would print wrong paths, so don't return one. */
+	if (!ret && !seenint())
+		ni = nindex_merge(ags);
+out:
+	if (!ni) {
+		for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+			xfree(ags[agno].names);
+			xfree(ags[agno].inodes);
+			xfree(ags[agno].arena);
+		}
+	}
+	xfree(ags);
+	return ni;
+}
+
+void
+nindex_free(
+	struct nindex		*ni)
+{
+	if (!ni)
+		return;
+	xfree(ni->names);
+	xfree(ni->inodes);
+	xfree(ni->arena);
+	xfree(ni);
+}
+
+static struct nindex_name *
+nindex_find(
+	struct nindex		*ni,
+	xfs_ino_t		ino)
+{
+	struct nindex_name	key = { .ino = ino };
+
+	return bsearch(&key, ni->names, ni->nr_names, sizeof(*ni->names),
+			nindex_name_ino_cmp);
+}
+
+static unsigned int
+nindex_flags(
+	struct nindex		*ni,
+	xfs_ino_t		ino)
+{
+	struct nindex_inode	key = { .ino = ino };
+	struct nindex_inode	*i;
+
+	i = bsearch(&key, ni->inodes, ni->nr_inodes, sizeof(*ni->inodes),
+			nindex_inode_cmp);
+	return i ? i->flags : 0;
+}
+
+/*
+ * Build the path of an inode from the root, or as far up as we can get if
+ * it's disconnected.  Returns NULL if the inode has no name at all; the
+ * caller frees the path.
+ */
+char *
+nindex_path(
+	struct nindex		*ni,
+	xfs_ino_t		ino)
+{
+	struct nindex_name	*n;
+	struct nindex_name	*p;
+	unsigned int		depth = 0;
+	size_t			len = 0;
+	char			*path;
+
+	n = nindex_find(ni, ino);
+	if (!n)
+		return NULL;
+	for (p = n; p && depth < NINDEX_MAX_DEPTH;
+	     p = nindex_find(ni, p->parent), depth++)
+		len += p->namelen + 1;
+
+	/* The last component's slash is room for the null. */
+	path = xmalloc(len);
+	path[--len] = 0;
+	for (p = n; depth > 0; p = nindex_find(ni, p->parent), depth--) {
+		len -= p->namelen;
+		memcpy(path + len, ni->arena + p->name, p->namelen);
+		if (len > 0)
+			path[--len] = '/';
+	}
+	return path;
+}
+
+static void
+nindex_print(
+	struct nindex		*ni,
+	xfs_ino_t		ino,
+	char			*path)
+{
+	dbprintf("%11llu %s", ino, path);
+	if (nindex_flags(ni, ino) & NINDEX_DIR)
+		dbprintf("/.");
+	dbprintf("\n");
+}
+
+/*
+ * Print name-inode pairs for ncheck without needing blockget -n: the ones
+ * in ilist if there are any, otherwise all of them (or only the setuid,
+ * setgid and special files if security is set).
+ */
+void
+nindex_ncheck(
+	xfs_ino_t		*ilist,
+	int			ilist_size,
+	int			security)
+{
+	struct nindex		*ni;
+	xfs_ino_t		ino;
+	uint64_t		i;
+	char			*path;
+
+	ni = nindex_build();
+	if (!ni)
+		return;
+
+	if (ilist) {
+		for (i = 0; i < ilist_size; i++) {
+			path = nindex_path(ni, ilist[i]);
+			if (!path)
+				continue;
+			nindex_print(ni, ilist[i], path);
+			xfree(path);
+		}
+		goto out;
+	}
+
+	for (i = 0; i < ni->nr_names && !seenint(); i++) {
+		ino = ni->names[i].ino;
+		if (security && !(nindex_flags(ni, ino) & NINDEX_SECURITY))
+			continue;
+		path = nindex_path(ni, ino);
+		nindex_print(ni, ino, path);
+		xfree(path);
+	}
+out:
+	nindex_free(ni);
+}
@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_DB_NCHECK_H__
+#define __XFS_DB_NCHECK_H__
+
+/* Name index used by ncheck when blockget -n hasn't been run; see ncheck.c. */
+struct nindex;
+
+struct nindex *nindex_build(void);
+void nindex_free(struct nindex *ni);
+char *nindex_path(struct nindex *ni, xfs_ino_t ino);
+void nindex_ncheck(xfs_ino_t *ilist, int ilist_size, int security);
+
+#endif /* __XFS_DB_NCHECK_H__ */
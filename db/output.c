@@ -21,6 +21,19 @@ static const cmdinfo_t	log_cmd =
 int		dbprefix;
 static FILE	*log_file;
 static char	*log_file_name;
+static pthread_mutex_t	output_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread FILE	*capture_fp;
+
+/*
+ * Send this thread's dbprintf output to fp instead of the terminal and the
+ * log, until it's called again with NULL.
+ */
+void
+dbprintf_capture(
+	FILE	*fp)
+{
+	capture_fp = fp;
+}
 
 int
 dbprintf(const char *fmt, ...)
@@ -30,6 +43,14 @@ dbprintf(const char *fmt, ...)
 
 	if (seenint())
 		return 0;
+	if (capture_fp) {
+		va_start(ap, fmt);
+		i = vfprintf(capture_fp, fmt, ap);
+		va_end(ap);
+		return i;
+	}
+	/* Keep the prefix and the message together if several threads print. */
+	pthread_mutex_lock(&output_lock);
 	va_start(ap, fmt);
 	blockint();
 	i = 0;
@@ -43,6 +64,7 @@ dbprintf(const char *fmt, ...)
 		vfprintf(log_file, fmt, ap);
 		va_end(ap);
 	}
+	pthread_mutex_unlock(&output_lock);
 	return i;
 }
 
@@ -7,5 +7,6 @@
 extern int	dbprefix;
 
 extern int	dbprintf(const char *, ...);
+extern void	dbprintf_capture(FILE *fp);
 extern void	logprintf(const char *, ...);
 extern void	output_init(void);
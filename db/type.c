@@ -29,10 +29,9 @@
 #include "symlink.h"
 #include "fuzz.h"
 
-static const typ_t	*findtyp(char *name);
 static int		type_f(int argc, char **argv);
 
-const typ_t	*cur_typ;
+__thread const typ_t	*cur_typ;
 
 static const cmdinfo_t	type_cmd =
 	{ "type", NULL, type_f, 0, 1, 1, N_("[newtype]"),
@@ -170,7 +169,7 @@ type_set_tab_spcrc(void)
 	typtab = __typtab_spcrc;
 }
 
-static const typ_t *
+const typ_t *
 findtyp(
 	char		*name)
 {
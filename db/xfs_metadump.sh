@@ -6,17 +6,21 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-l logdev] source target"
+USAGE="Usage: xfs_metadump [-aefFogwVz] [-m max_extents] [-l logdev] [-B base] [-D percent] [-S statsfile] source target"
 
-while getopts "aefgl:m:owFV" c
+while getopts "aB:D:efgl:m:oS:wzFV" c
 do
 	case $c in
 	a)	OPTS=$OPTS"-a ";;
+	B)	OPTS=$OPTS"-B "$OPTARG" ";;
+	D)	OPTS=$OPTS"-D "$OPTARG" ";;
 	e)	OPTS=$OPTS"-e ";;
 	g)	OPTS=$OPTS"-g ";;
 	m)	OPTS=$OPTS"-m "$OPTARG" ";;
 	o)	OPTS=$OPTS"-o ";;
+	S)	OPTS=$OPTS"-S "$OPTARG" ";;
 	w)	OPTS=$OPTS"-w ";;
+	z)	OPTS=$OPTS"-z ";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
 	F)	DBOPTS=$DBOPTS" -F";;
@@ -29,7 +29,7 @@ done
 set -- extra $@
 shift $OPTIND
 case $# in
-	1)	xfs_db$DBOPTS -r -p xfs_ncheck -c "blockget -ns" -c "ncheck$OPTS" $1
+	1)	xfs_db$DBOPTS -r -p xfs_ncheck -c "ncheck$OPTS" $1
 		status=$?
 		;;
 	*)	echo $USAGE 1>&2
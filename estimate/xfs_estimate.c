@@ -12,6 +12,14 @@
 #include "libxfs.h"
 #include <sys/stat.h>
 #include <ftw.h>
+#include <dirent.h>
+#include "libfrog/dirwalk.h"
+#include "libfrog/ptvar.h"
+#include "libfrog/platform.h"
+
+#ifndef AT_NO_AUTOMOUNT
+# define AT_NO_AUTOMOUNT	0x800
+#endif
 
 static unsigned long long
 cvtnum(char *s)
@@ -43,16 +51,21 @@ int ffn(const char *, const struct stat *, int, struct FTW *);
 
 #define FBLOCKS(n)	((n)/blocksize)
 
-static unsigned long long dirsize=0;		/* bytes */
+struct est_counts {
+	unsigned long long dirsize;	/* bytes */
+	unsigned long long fullblocks;	/* FS blocks */
+	unsigned long long isize;	/* inodes bytes */
+	unsigned long long nslinks;	/* number of symbolic links */
+	unsigned long long nfiles;	/* number of regular files */
+	unsigned long long ndirs;	/* number of directories */
+	unsigned long long nspecial;	/* number of special files */
+};
+
+static struct est_counts totals;
 static unsigned long long logsize=LOGSIZE*BLOCKSIZE;	/* bytes */
-static unsigned long long fullblocks=0;	/* FS blocks */
-static unsigned long long isize=0;		/* inodes bytes */
 static unsigned long long blocksize=BLOCKSIZE;
-static unsigned long long nslinks=0;		/* number of symbolic links */
-static unsigned long long nfiles=0;		/* number of regular files */
-static unsigned long long ndirs=0;		/* number of directories */
-static unsigned long long nspecial=0;		/* number of special files */
 static unsigned long long verbose=0;		/* verbose mode TRUE/FALSE */
+static unsigned int nr_threads;
 
 static int __debug = 0;
 static int ilog = 0;
@@ -66,6 +79,7 @@ usage(char *progname)
 		"\t-b blocksize (fundamental filesystem blocksize)\n"
 		"\t-i logsize (internal log size)\n"
 		"\t-e logsize (external log size)\n"
+		"\t-j threads (walk the tree with this many threads)\n"
 		"\t-v prints more verbose messages\n"
 		"\t-V prints version and exits\n"
 		"\t-h prints this usage message\n\n"
@@ -75,6 +89,176 @@ usage(char *progname)
 	exit(1);
 }
 
+/* Add one inode's worth of space to the estimate. */
+static void
+est_account(
+	struct est_counts	*c,
+	const char		*path,
+	mode_t			mode,
+	unsigned long long	size,
+	unsigned long long	blocks)
+{
+	/* cases are in most-encountered to least-encountered order */
+	c->dirsize += PERDIRENTRY + strlen(path);
+	c->isize += INODESIZE;
+	switch (S_IFMT & mode) {
+	case S_IFREG:			/* regular files */
+		c->fullblocks += FBLOCKS(blocks * 512 + blocksize - 1);
+		if (blocks * 512 < size)
+			c->fullblocks++;	/* add one bmap block here */
+		c->nfiles++;
+		break;
+	case S_IFLNK:			/* symbolic links */
+		if (size >= (INODESIZE - (sizeof(struct xfs_dinode) + 4)))
+			c->fullblocks += FBLOCKS(size + blocksize - 1);
+		c->nslinks++;
+		break;
+	case S_IFDIR:			/* directories */
+		c->dirsize += blocksize;	/* fudge upwards */
+		if (size >= blocksize)
+			c->dirsize += blocksize;
+		c->ndirs++;
+		break;
+	case S_IFIFO:			/* named pipes */
+	case S_IFCHR:			/* Character Special device */
+	case S_IFBLK:			/* Block Special device */
+	case S_IFSOCK:			/* socket */
+		c->nspecial++;
+		break;
+	}
+}
+
+/*
+ * Parallel tree walk.  Every thread adds up what it sees in its own
+ * est_counts and they're summed when the walk is done.
+ */
+struct est_walk {
+	struct ptvar		*counts;
+	dev_t			dev;		/* stay on this fs */
+};
+
+struct est_stat {
+	mode_t			mode;
+	dev_t			dev;
+	unsigned long long	size;
+	unsigned long long	blocks;
+};
+
+/*
+ * Stat just what the estimate needs.  statx lets us leave out the
+ * timestamps and ids, and lets network filesystems answer from cache.
+ */
+static int
+est_stat(
+	int			dirfd,
+	const char		*name,
+	struct est_stat		*st)
+{
+#ifdef STATX_TYPE
+	struct statx		stx;
+
+	if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT |
+				AT_STATX_DONT_SYNC,
+			STATX_TYPE | STATX_SIZE | STATX_BLOCKS, &stx))
+		return -1;
+	st->mode = stx.stx_mode;
+	st->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st->size = stx.stx_size;
+	st->blocks = stx.stx_blocks;
+#else
+	struct stat		sb;
+
+	if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT))
+		return -1;
+	st->mode = sb.st_mode;
+	st->dev = sb.st_dev;
+	st->size = sb.st_size;
+	st->blocks = sb.st_blocks;
+#endif
+	return 0;
+}
+
+static int
+est_walk_visit(
+	const char		*path,
+	int			dirfd,
+	const char		*name,
+	unsigned char		d_type,
+	int			depth,
+	void			*arg)
+{
+	struct est_walk		*ew = arg;
+	struct est_counts	*c;
+	struct est_stat		st;
+	int			error;
+
+	c = ptvar_get(ew->counts, &error);
+	if (error)
+		return -error;
+
+	/* special files only need their type, and readdir has it */
+	switch (d_type) {
+	case DT_FIFO:
+	case DT_CHR:
+	case DT_BLK:
+	case DT_SOCK:
+		est_account(c, path, DTTOIF(d_type), 0, 0);
+		return 0;
+	}
+
+	if (est_stat(dirfd, name, &st))
+		return depth ? 0 : -errno;
+	if (depth == 0)
+		ew->dev = st.dev;
+	else if (st.dev != ew->dev)
+		return 0;
+
+	/* nftw would have counted an unreadable directory; so do we */
+	est_account(c, path, st.mode, st.size, st.blocks);
+	return S_ISDIR(st.mode) ? DIRWALK_DESCEND : 0;
+}
+
+static int
+est_walk_sum(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*foreach_arg)
+{
+	struct est_counts	*c = data;
+
+	totals.dirsize += c->dirsize;
+	totals.fullblocks += c->fullblocks;
+	totals.isize += c->isize;
+	totals.nslinks += c->nslinks;
+	totals.nfiles += c->nfiles;
+	totals.ndirs += c->ndirs;
+	totals.nspecial += c->nspecial;
+	return 0;
+}
+
+/* Walk the tree at @root with nr_threads threads and add it to totals. */
+static int
+est_walk(
+	const char		*root)
+{
+	struct est_walk		ew = { };
+	int			error;
+
+	/* one more for the main thread, which visits the root */
+	error = -ptvar_alloc(nr_threads + 1, sizeof(struct est_counts),
+			&ew.counts);
+	if (error)
+		goto out;
+	error = -dirwalk(root, nr_threads, est_walk_visit, NULL, &ew);
+	if (!error)
+		error = ptvar_foreach(ew.counts, est_walk_sum, NULL);
+	ptvar_free(ew.counts);
+out:
+	if (error)
+		fprintf(stderr, _("%s: %s\n"), root, strerror(error));
+	return error;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -88,7 +272,8 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt (argc, argv, "b:hdve:i:V")) != EOF) {
+	nr_threads = platform_nproc();
+	while ((c = getopt (argc, argv, "b:hdve:i:j:V")) != EOF) {
 		switch (c) {
 		case 'b':
 			blocksize=cvtnum(optarg);
@@ -121,6 +306,14 @@ main(int argc, char **argv)
 			logsize=cvtnum(optarg);
 			elog++;
 			break;
+		case 'j':
+			nr_threads = cvtnum(optarg);
+			if (nr_threads == 0) {
+				fprintf(stderr, _("bad thread count %s\n"),
+					optarg);
+				usage(argv[0]);
+			}
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -147,32 +340,29 @@ main(int argc, char **argv)
 		printf(_("directory                               bsize   blocks    megabytes    logsize\n"));
 
 	for ( ; optind < argc; optind++) {
-		dirsize=0LL;		/* bytes */
-		fullblocks=0LL;		/* FS blocks */
-		isize=0LL;		/* inodes bytes */
-		nslinks=0LL;		/* number of symbolic links */
-		nfiles=0LL;		/* number of regular files */
-		ndirs=0LL;		/* number of directories */
-		nspecial=0LL;		/* number of special files */
+		memset(&totals, 0, sizeof(totals));
 
-		nftw(argv[optind], ffn, 40, FTW_PHYS | FTW_MOUNT);
+		if (nr_threads > 1)
+			est_walk(argv[optind]);
+		else
+			nftw(argv[optind], ffn, 40, FTW_PHYS | FTW_MOUNT);
 
 		if (__debug) {
-			printf(_("dirsize=%llu\n"), dirsize);
-			printf(_("fullblocks=%llu\n"), fullblocks);
-			printf(_("isize=%llu\n"), isize);
-
-			printf(_("%llu regular files\n"), nfiles);
-			printf(_("%llu symbolic links\n"), nslinks);
-			printf(_("%llu directories\n"), ndirs);
-			printf(_("%llu special files\n"), nspecial);
+			printf(_("dirsize=%llu\n"), totals.dirsize);
+			printf(_("fullblocks=%llu\n"), totals.fullblocks);
+			printf(_("isize=%llu\n"), totals.isize);
+
+			printf(_("%llu regular files\n"), totals.nfiles);
+			printf(_("%llu symbolic links\n"), totals.nslinks);
+			printf(_("%llu directories\n"), totals.ndirs);
+			printf(_("%llu special files\n"), totals.nspecial);
 		}
 
-		est = FBLOCKS(isize) + 8	/* blocks for inodes */
-			+ FBLOCKS(dirsize) + 1	/* blocks for directories */
-			+ fullblocks  		/* blocks for file contents */
+		est = FBLOCKS(totals.isize) + 8	/* blocks for inodes */
+			+ FBLOCKS(totals.dirsize) + 1	/* dir blocks */
+			+ totals.fullblocks	/* file contents */
 			+ (8 * 16)	/* fudge for overhead blks (per ag) */
-			+ FBLOCKS(isize / INODESIZE); /* 1 byte/inode for map */
+			+ FBLOCKS(totals.isize / INODESIZE); /* 1 byte/inode */
 
 		if (ilog)
 			est += (logsize / blocksize);
@@ -203,33 +393,6 @@ main(int argc, char **argv)
 int
 ffn(const char *path, const struct stat *stb, int flags, struct FTW *f)
 {
-	/* cases are in most-encountered to least-encountered order */
-	dirsize+=PERDIRENTRY+strlen(path);
-	isize+=INODESIZE;
-	switch (S_IFMT & stb->st_mode) {
-	case S_IFREG:			/* regular files */
-		fullblocks+=FBLOCKS(stb->st_blocks * 512 + blocksize-1);
-		if (stb->st_blocks * 512 < stb->st_size)
-			fullblocks++;	/* add one bmap block here */
-		nfiles++;
-		break;
-	case S_IFLNK:			/* symbolic links */
-		if (stb->st_size >= (INODESIZE - (sizeof(struct xfs_dinode)+4)))
-			fullblocks+=FBLOCKS(stb->st_size + blocksize-1);
-		nslinks++;
-		break;
-	case S_IFDIR:			/* directories */
-		dirsize+=blocksize;	/* fudge upwards */
-		if (stb->st_size >= blocksize)
-			dirsize+=blocksize;
-		ndirs++;
-		break;
-	case S_IFIFO:			/* named pipes */
-	case S_IFCHR:			/* Character Special device */
-	case S_IFBLK:			/* Block Special device */
-	case S_IFSOCK:			/* socket */
-		nspecial++;
-		break;
-	}
+	est_account(&totals, path, stb->st_mode, stb->st_size, stb->st_blocks);
 	return 0;
 }
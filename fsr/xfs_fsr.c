@@ -13,6 +13,7 @@
 #include "libfrog/paths.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
 
 #include <fcntl.h>
 #include <errno.h>
@@ -22,7 +23,9 @@
 #include <sys/wait.h>
 #include <sys/statvfs.h>
 #include <sys/xattr.h>
+#include <sys/syscall.h>
 #include <paths.h>
+#include <linux/fsmap.h>
 
 #define _PATH_FSRLAST		"/var/tmp/.fsrlast_xfs"
 #define _PATH_PROC_MOUNTS	"/proc/mounts"
@@ -40,9 +43,13 @@ static int argv_blksz_dio;
 extern int max_ext_size;
 static int npasses = 10;
 static int startpass = 0;
+static int Pflag;			/* defragment best scoring files first */
+static int atime_days;			/* favour files read this recently */
+static int njobs = 1;			/* files to defragment at once */
+static unsigned long long io_budget;	/* bytes per second, 0 = no limit */
 
-static struct getbmap  *outmap = NULL;
-static int		outmap_size = 0;
+static __thread struct getbmap	*outmap = NULL;
+static __thread int		outmap_size = 0;
 static int		RealUid;
 static int		tmp_agi;
 static int64_t		minimumfree = 2048;
@@ -82,7 +89,7 @@ char * getparent(char *fname);
 int fsrprintf(const char *fmt, ...);
 int read_fd_bmap(int, struct xfs_bstat *, int *);
 static void tmp_init(char *mnt);
-static char * tmp_next(char *mnt);
+static void tmp_name(char *buf, char *mnt, int agno);
 static void tmp_close(char *mnt);
 
 static struct xfs_fsop_geom fsgeom;	/* geometry of active mounted system */
@@ -139,7 +146,7 @@ main(int argc, char **argv)
 
 	gflag = ! isatty(0);
 
-	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FV")) != -1) {
+	while ((c = getopt(argc, argv, "C:p:e:MgsdnvTt:f:m:b:N:FVj:L:Pa:")) != -1) {
 		switch (c) {
 		case 'M':
 			Mflag = 1;
@@ -178,6 +185,20 @@ main(int argc, char **argv)
 		case 'p':
 			npasses = atoi(optarg);
 			break;
+		case 'j':
+			njobs = atoi(optarg);
+			if (njobs < 1)
+				usage(1);
+			break;
+		case 'L':
+			io_budget = strtoull(optarg, NULL, 0) << 20;
+			break;
+		case 'P':
+			Pflag = 1;
+			break;
+		case 'a':
+			atime_days = atoi(optarg);
+			break;
 		case 'C':
 			/* Testing opt: coerses frag count in result */
 			if (getenv("FSRXFSTEST") != NULL) {
@@ -207,6 +228,10 @@ main(int argc, char **argv)
 			mtab = _PATH_MOUNTED;
 	}
 
+	/* The fragment count test hook can't be shared between files. */
+	if (nfrags)
+		njobs = 1;
+
 	if (vflag)
 		setbuf(stdout, NULL);
 
@@ -216,7 +241,6 @@ main(int argc, char **argv)
 	RealUid = getuid();
 
 	pagesize = getpagesize();
-	fs_table_initialise(0, NULL, 0, NULL);
 	if (optind < argc) {
 		for (; optind < argc; optind++) {
 			argname = argv[optind];
@@ -237,6 +261,7 @@ main(int argc, char **argv)
 				sb = sb2;
 			}
 
+			fs_table_initialise_path(argname);
 			fsp = fs_table_lookup_mount(argname);
 			if (!fsp)
 				fsp = fs_table_lookup_blkdev(argname);
@@ -275,14 +300,20 @@ void
 usage(int ret)
 {
 	fprintf(stderr, _(
-"Usage: %s [-d] [-v] [-g] [-t time] [-p passes] [-f leftf] [-m mtab]\n"
-"       %s [-d] [-v] [-g] xfsdev | dir | file ...\n"
+"Usage: %s [-d] [-v] [-g] [-P] [-a days] [-j jobs] [-L MiB/s] [-t time]\n"
+"          [-p passes] [-f leftf] [-m mtab]\n"
+"       %s [-d] [-v] [-g] [-P] [-a days] [-j jobs] [-L MiB/s]\n"
+"          xfsdev | dir | file ...\n"
 "       %s -V\n\n"
 "Options:\n"
 "       -g              Print to syslog (default if stdout not a tty).\n"
 "       -t time         How long to run in seconds.\n"
 "       -p passes       Number of passes before terminating global re-org.\n"
 "       -f leftoff      Use this instead of %s.\n"
+"       -P              Score the whole filesystem, do the best files first.\n"
+"       -a days         Favour files read in the last so many days.\n"
+"       -j jobs         Defragment this many files at once.\n"
+"       -L MiB/s        Copy no more than this much data per second.\n"
 "       -m mtab         Use something other than /etc/mtab.\n"
 "       -d              Debug, print even more.\n"
 "       -v              Verbose, more -v's more verbose.\n"
@@ -577,22 +608,557 @@ fsrall_cleanup(int timeout)
 }
 
 /*
- * To compare bstat structs for qsort.
+ * How much do we expect to gain from defragmenting this file?  Count the
+ * extents beyond the fewest the file could have (an extent can't span an
+ * AG), and weight that by extents per MiB so that a file in many small
+ * pieces beats a huge file in a few big ones.  With -a, files read in the
+ * last so many days count double.  The bulkstat extent count is the same
+ * number getnextents() would give us, without opening every file.
+ */
+static double
+fsr_score(
+	const struct xfs_bulkstat	*bs)
+{
+	uint64_t			bytes = bs->bs_blocks * bs->bs_blksize;
+	uint64_t			agbytes;
+	uint64_t			ideal;
+	double				score;
+
+	if ((bs->bs_mode & S_IFMT) != S_IFREG || bs->bs_extents < 2)
+		return 0;
+
+	agbytes = (uint64_t)fsgeom.agblocks * fsgeom.blocksize;
+	ideal = max(1ULL, (unsigned long long)(bytes + agbytes - 1) / agbytes);
+	if (bs->bs_extents <= ideal)
+		return 0;
+
+	score = (bs->bs_extents - ideal) *
+		(bs->bs_extents / max((double)bytes / 1048576, 1.0));
+	if (atime_days && bs->bs_atime > starttime - atime_days * 86400)
+		score *= 2;
+	return score;
+}
+
+/*
+ * To compare bstat structs for qsort, highest score first.
  */
 static int
 cmp(const void *s1, const void *s2)
 {
 	const struct xfs_bulkstat	*bs1 = s1;
 	const struct xfs_bulkstat	*bs2 = s2;
+	double				sc1, sc2;
 
 	ASSERT((bs1->bs_version == XFS_BULKSTAT_VERSION_V1 &&
 		bs2->bs_version == XFS_BULKSTAT_VERSION_V1) ||
 		(bs1->bs_version == XFS_BULKSTAT_VERSION_V5 &&
 		bs2->bs_version == XFS_BULKSTAT_VERSION_V5));
 
+	sc1 = fsr_score(bs1);
+	sc2 = fsr_score(bs2);
+	if (sc1 != sc2)
+		return sc1 < sc2 ? 1 : -1;
 	return (bs2->bs_extents - bs1->bs_extents);
 }
 
+/* A file found by the -P scoring pass. */
+struct fsr_rank {
+	uint64_t		ino;
+	double			score;
+};
+
+static int
+fsr_rank_cmp(const void *a, const void *b)
+{
+	const struct fsr_rank	*r1 = a;
+	const struct fsr_rank	*r2 = b;
+
+	if (r1->score != r2->score)
+		return r1->score < r2->score ? 1 : -1;
+	return r1->ino < r2->ino ? -1 : r1->ino > r2->ino;
+}
+
+/*
+ * Score every file in the filesystem from startino on, so that we can
+ * spend the time budget on the files that gain the most rather than on
+ * whichever ones come first in inode order.
+ */
+static int
+fsr_rank_files(
+	struct xfs_fd		*fsxfd,
+	struct xfs_bulkstat_req	*breq,
+	struct fsr_rank		**ranksp,
+	size_t			*nrp)
+{
+	struct fsr_rank		*ranks = NULL;
+	struct fsr_rank		*r;
+	size_t			nr = 0;
+	size_t			max_nr = 0;
+	uint32_t		i;
+	double			score;
+	int			ret;
+
+	while ((ret = -xfrog_bulkstat(fsxfd, breq)) == 0) {
+		if (breq->hdr.ocount == 0)
+			break;
+		for (i = 0; i < breq->hdr.ocount; i++) {
+			score = fsr_score(&breq->bulkstat[i]);
+			if (score <= 0)
+				continue;
+			if (nr == max_nr) {
+				max_nr = max(max_nr * 2, (size_t)1024);
+				r = realloc(ranks, max_nr * sizeof(*ranks));
+				if (!r) {
+					free(ranks);
+					return ENOMEM;
+				}
+				ranks = r;
+			}
+			ranks[nr].ino = breq->bulkstat[i].bs_ino;
+			ranks[nr].score = score;
+			nr++;
+		}
+	}
+	if (ret) {
+		free(ranks);
+		return ret;
+	}
+
+	qsort(ranks, nr, sizeof(*ranks), fsr_rank_cmp);
+	*ranksp = ranks;
+	*nrp = nr;
+	return 0;
+}
+
+/*
+ * Files picked out of each bulkstat batch are handed to a pool of -j
+ * workers.  Each worker puts its temp file in an AG directory that no
+ * other worker is using, so that they aren't all allocating their new
+ * extents from the same AG, and they all share the -L copy budget.
+ *
+ * If GETFSMAP works, we also keep track of the longest few free extents
+ * in every AG, and prefer a directory in an AG that can hold the whole
+ * file in one extent.  The tmp dirs are only named after AGs, so we look
+ * at their inode numbers to see where they really ended up.
+ */
+#define FSR_FREESP_NR		4	/* free extents remembered per AG */
+#define FSR_FREESP_REFRESH	60	/* seconds between GETFSMAP scans */
+#define FSR_FSMAP_NR		1024
+
+struct fsr_freesp {
+	uint64_t		longest[FSR_FREESP_NR];	/* fsblocks, desc */
+};
+
+struct fsr_ctx {
+	char			*mntdir;
+	jdm_fshandle_t		*fshandlep;
+	struct xfs_fd		*xfd;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	bool			*ag_busy;	/* tmp dir in use by a worker */
+	xfs_agnumber_t		*tmp_ag;	/* AG each tmp dir is in */
+	struct fsr_freesp	*freesp;	/* NULL if we can't tell */
+	time_t			freesp_time;	/* last GETFSMAP scan */
+	bool			ranked;		/* -P order, not inode order */
+	int			count;		/* files left to do this batch */
+	unsigned int		pending;	/* files queued this batch */
+};
+
+static pthread_mutex_t	io_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t		io_budget_next;	/* ns when the next copy may go */
+
+static uint64_t
+fsr_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait until we're allowed to copy another len bytes. */
+static void
+fsr_throttle(
+	size_t		len)
+{
+	struct timespec	ts;
+	uint64_t	now;
+	uint64_t	when;
+
+	if (!io_budget)
+		return;
+
+	pthread_mutex_lock(&io_budget_lock);
+	now = fsr_now();
+	if (io_budget_next < now)
+		io_budget_next = now;
+	when = io_budget_next;
+	io_budget_next += len * 1000000000ULL / io_budget;
+	pthread_mutex_unlock(&io_budget_lock);
+
+	if (when > now) {
+		ts.tv_sec = (when - now) / 1000000000ULL;
+		ts.tv_nsec = (when - now) % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Remember a free extent if it's one of the longest in its AG. */
+static void
+fsr_freesp_add(
+	struct fsr_freesp	*fsp,
+	uint64_t		len)
+{
+	int			i;
+
+	if (len <= fsp->longest[FSR_FREESP_NR - 1])
+		return;
+	for (i = FSR_FREESP_NR - 1; i > 0 && fsp->longest[i - 1] < len; i--)
+		fsp->longest[i] = fsp->longest[i - 1];
+	fsp->longest[i] = len;
+}
+
+/*
+ * Assume the new file takes the shortest free extent that it fits in, and
+ * put back what it leaves over.  Returns false if nothing is long enough.
+ */
+static bool
+fsr_freesp_take(
+	struct fsr_freesp	*fsp,
+	uint64_t		len)
+{
+	uint64_t		left;
+	int			i;
+
+	for (i = FSR_FREESP_NR - 1; i >= 0; i--)
+		if (fsp->longest[i] >= len)
+			break;
+	if (i < 0)
+		return false;
+
+	left = fsp->longest[i] - len;
+	for (; i < FSR_FREESP_NR - 1; i++)
+		fsp->longest[i] = fsp->longest[i + 1];
+	fsp->longest[FSR_FREESP_NR - 1] = 0;
+	fsr_freesp_add(fsp, left);
+	return true;
+}
+
+/*
+ * Find the longest free extents in each AG of the data device.  Copying
+ * files around frees up their old extents, so this gets done again every
+ * now and then; in between we just account for what we've taken.
+ */
+static void
+fsr_freesp_scan(
+	struct fsr_ctx		*ctx)
+{
+	struct xfs_fd		*xfd = ctx->xfd;
+	struct fsr_freesp	*freesp;
+	struct fsmap_head	*head;
+	struct fsmap		*l, *h, *p;
+	struct stat		st;
+	xfs_agnumber_t		agno;
+	unsigned int		i;
+
+	if (ctx->freesp_time &&
+	    time(NULL) < ctx->freesp_time + FSR_FREESP_REFRESH)
+		return;
+
+	freesp = calloc(fsgeom.agcount, sizeof(struct fsr_freesp));
+	head = calloc(1, fsmap_sizeof(FSR_FSMAP_NR));
+	if (!freesp || !head || stat(ctx->mntdir, &st) < 0)
+		goto fail;
+
+	head->fmh_count = FSR_FSMAP_NR;
+	l = head->fmh_keys;
+	h = head->fmh_keys + 1;
+	l->fmr_device = h->fmr_device = st.st_dev;
+	h->fmr_physical = ULLONG_MAX;
+	h->fmr_owner = ULLONG_MAX;
+	h->fmr_flags = UINT_MAX;
+	h->fmr_offset = ULLONG_MAX;
+
+	for (;;) {
+		if (ioctl(xfd->fd, FS_IOC_GETFSMAP, head) < 0) {
+			if (dflag)
+				fsrprintf(_("%s: GETFSMAP: %s\n"),
+						ctx->mntdir, strerror(errno));
+			goto fail;
+		}
+		if (!head->fmh_entries)
+			break;
+
+		for (i = 0, p = head->fmh_recs; i < head->fmh_entries;
+		     i++, p++) {
+			if (!(p->fmr_flags & FMR_OF_SPECIAL_OWNER) ||
+			    p->fmr_owner != XFS_FMR_OWN_FREE)
+				continue;
+			agno = cvt_daddr_to_agno(xfd,
+					cvt_btobbt(p->fmr_physical));
+			if (agno >= fsgeom.agcount)
+				continue;
+			fsr_freesp_add(&freesp[agno],
+					cvt_b_to_off_fsbt(xfd, p->fmr_length));
+		}
+
+		p = &head->fmh_recs[head->fmh_entries - 1];
+		if (p->fmr_flags & FMR_OF_LAST)
+			break;
+		fsmap_advance(head);
+	}
+	free(head);
+
+	pthread_mutex_lock(&ctx->lock);
+	free(ctx->freesp);
+	ctx->freesp = freesp;
+	ctx->freesp_time = time(NULL);
+	pthread_mutex_unlock(&ctx->lock);
+	return;
+fail:
+	/* Don't try again, just hand out the tmp dirs round robin. */
+	free(head);
+	free(freesp);
+	pthread_mutex_lock(&ctx->lock);
+	free(ctx->freesp);
+	ctx->freesp = NULL;
+	ctx->freesp_time = time(NULL) + 365 * 24 * 3600;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Look up which AG each tmp dir's inode (and so its files' data) is in. */
+static void
+fsr_find_tmp_ags(
+	struct fsr_ctx		*ctx)
+{
+	char			buf[SMBUFSZ];
+	struct stat		st;
+	int			i;
+
+	for (i = 0; i < fsgeom.agcount; i++) {
+		sprintf(buf, "%s/.fsr/ag%d", ctx->mntdir, i);
+		if (stat(buf, &st) < 0)
+			ctx->tmp_ag[i] = NULLAGNUMBER;
+		else
+			ctx->tmp_ag[i] = cvt_ino_to_agno(ctx->xfd, st.st_ino);
+	}
+}
+
+/*
+ * Claim a tmp dir AG that nobody else is allocating from, preferably one
+ * with a free extent that can hold all @blocks of the file.
+ */
+static int
+fsr_get_ag(
+	struct fsr_ctx		*ctx,
+	uint64_t		blocks)
+{
+	struct fsr_freesp	*fsp;
+	int			agno;
+	int			first;
+	int			i;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		first = -1;
+		for (i = 0; i < fsgeom.agcount; i++) {
+			agno = (tmp_agi + i) % fsgeom.agcount;
+			if (ctx->ag_busy[agno])
+				continue;
+			if (!ctx->freesp)
+				goto found;
+			if (first < 0)
+				first = agno;
+			if (ctx->tmp_ag[agno] >= fsgeom.agcount)
+				continue;
+			fsp = &ctx->freesp[ctx->tmp_ag[agno]];
+			if (fsr_freesp_take(fsp, blocks))
+				goto found;
+		}
+		/* Nothing big enough; take the next free one anyway. */
+		if (first >= 0) {
+			agno = first;
+			goto found;
+		}
+		pthread_cond_wait(&ctx->wait, &ctx->lock);
+	}
+found:
+	ctx->ag_busy[agno] = true;
+	tmp_agi = (agno + 1) % fsgeom.agcount;
+	pthread_mutex_unlock(&ctx->lock);
+	return agno;
+}
+
+static void
+fsr_put_ag(
+	struct fsr_ctx	*ctx,
+	int		agno)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->ag_busy[agno] = false;
+	pthread_cond_broadcast(&ctx->wait);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void
+fsrfs_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct fsr_ctx		*ctx = wq->wq_ctx;
+	struct xfs_bstat	*bs = arg;
+	char			fname[64];
+	char			tname[SMBUFSZ];
+	int			agno;
+	int			fd;
+	int			ret;
+
+	/* Skip the rest of the batch once enough files have been done. */
+	pthread_mutex_lock(&ctx->lock);
+	ret = ctx->count;
+	pthread_mutex_unlock(&ctx->lock);
+	if (ret <= 0)
+		goto out;
+
+	fd = jdm_open(ctx->fshandlep, bs, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		/* This probably means the file was
+		 * removed while in progress of handling
+		 * it.  Just quietly ignore this file.
+		 */
+		if (dflag)
+			fsrprintf(_("could not open: "
+				"inode %llu\n"), bs->bs_ino);
+		goto out;
+	}
+
+	/* Don't know the pathname, so make up something */
+	sprintf(fname, "ino=%lld", (long long)bs->bs_ino);
+
+	/* Get a tmp file name */
+	agno = fsr_get_ag(ctx, bs->bs_blocks);
+	tmp_name(tname, ctx->mntdir, agno);
+
+	ret = fsrfile_common(fname, tname, ctx->mntdir, fd, bs);
+
+	fsr_put_ag(ctx, agno);
+	close(fd);
+
+	pthread_mutex_lock(&ctx->lock);
+	if (!ctx->ranked)
+		leftoffino = bs->bs_ino;
+	if (ret == 0)
+		ctx->count--;
+	pthread_mutex_unlock(&ctx->lock);
+out:
+	pthread_mutex_lock(&ctx->lock);
+	if (--ctx->pending == 0)
+		pthread_cond_broadcast(&ctx->wait);
+	pthread_mutex_unlock(&ctx->lock);
+	free(bs);
+}
+
+/* Hand a file to the workers; it's theirs to free. */
+static int
+fsrfs_queue(
+	struct fsr_ctx		*ctx,
+	struct workqueue	*wq,
+	struct xfs_bstat	*bs)
+{
+	int			ret;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->pending++;
+	pthread_mutex_unlock(&ctx->lock);
+	ret = -workqueue_add(wq, fsrfs_work, 0, bs);
+	if (ret) {
+		fsrprintf(_("%s: %s\n"), progname, strerror(ret));
+		pthread_mutex_lock(&ctx->lock);
+		ctx->pending--;
+		pthread_mutex_unlock(&ctx->lock);
+		free(bs);
+	}
+	return ret;
+}
+
+/* Let the batch finish before looking at the next one. */
+static void
+fsrfs_drain(
+	struct fsr_ctx		*ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->pending > 0)
+		pthread_cond_wait(&ctx->wait, &ctx->lock);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * -P: score the whole filesystem first and then work down the list, in
+ * batches so that the time limit is still checked as often.
+ */
+static int
+fsrfs_ranked(
+	struct fsr_ctx		*ctx,
+	struct workqueue	*wq,
+	struct xfs_fd		*fsxfd,
+	struct xfs_bulkstat_req	*breq,
+	int			targetrange)
+{
+	struct xfs_bulkstat	bulkstat;
+	struct xfs_bstat	*bs;
+	struct fsr_rank		*ranks;
+	size_t			nr;
+	size_t			i;
+	int			ret;
+
+	ret = fsr_rank_files(fsxfd, breq, &ranks, &nr);
+	if (ret) {
+		fsrprintf(_("%s: bulkstat: %s\n"), progname, strerror(ret));
+		return ret;
+	}
+	if (vflag)
+		fsrprintf(_("%s: %zu files worth defragmenting\n"),
+				ctx->mntdir, nr);
+
+	/* Work through targetrange percent of the files, best first. */
+	ctx->count = max((nr * targetrange) / 100, (size_t)1);
+	for (i = 0; i < nr && ctx->count > 0; i++) {
+		if (i % GRABSZ == 0)
+			fsr_freesp_scan(ctx);
+
+		ret = -xfrog_bulkstat_single(fsxfd, ranks[i].ino, 0,
+				&bulkstat);
+		if (ret)
+			continue;	/* probably gone since we looked */
+
+		bs = malloc(sizeof(*bs));
+		if (!bs) {
+			ret = errno;
+			break;
+		}
+		ret = -xfrog_bulkstat_v5_to_v1(fsxfd, bs, &bulkstat);
+		if (ret) {
+			fsrprintf(_("bstat conversion error: %s\n"),
+					strerror(ret));
+			free(bs);
+			continue;
+		}
+		ret = fsrfs_queue(ctx, wq, bs);
+		if (ret)
+			break;
+
+		if ((i + 1) % GRABSZ == 0) {
+			fsrfs_drain(ctx);
+			if (endtime && endtime < time(NULL))
+				break;
+		}
+	}
+	fsrfs_drain(ctx);
+	free(ranks);
+	return ret;
+}
+
 /*
  * fsrfs -- reorganize a file system
  */
@@ -600,11 +1166,14 @@ static int
 fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 {
 	struct xfs_fd	fsxfd = XFS_FD_INIT_EMPTY;
-	int	fd;
-	int	count = 0;
+	struct fsr_ctx	ctx = {
+		.mntdir	= mntdir,
+		.ranked	= Pflag,
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.wait	= PTHREAD_COND_INITIALIZER,
+	};
+	struct workqueue wq;
 	int	ret;
-	char	fname[64];
-	char	*tname;
 	jdm_fshandle_t	*fshandlep;
 	struct xfs_bulkstat_req	*breq;
 
@@ -617,6 +1186,7 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 		          mntdir, strerror( errno ));
 		return -1;
 	}
+	ctx.fshandlep = fshandlep;
 
 	ret = -xfd_open(&fsxfd, mntdir, O_RDONLY);
 	if (ret) {
@@ -637,64 +1207,82 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 		return -1;
 	}
 
+	ctx.xfd = &fsxfd;
+	ctx.ag_busy = calloc(fsgeom.agcount, sizeof(bool));
+	ctx.tmp_ag = calloc(fsgeom.agcount, sizeof(xfs_agnumber_t));
+	if (!ctx.ag_busy || !ctx.tmp_ag) {
+		fsrprintf(_("Skipping %s: %s\n"), mntdir, strerror(errno));
+		free(ctx.tmp_ag);
+		free(ctx.ag_busy);
+		free(breq);
+		xfd_close(&fsxfd);
+		free(fshandlep);
+		return -1;
+	}
+
+	/* No point in more workers than there are AGs to put tmp files in. */
+	ret = -workqueue_create_bound(&wq, &ctx,
+			min(njobs, (int)fsgeom.agcount), GRABSZ);
+	if (ret) {
+		fsrprintf(_("Skipping %s: %s\n"), mntdir, strerror(ret));
+		free(ctx.tmp_ag);
+		free(ctx.ag_busy);
+		free(breq);
+		xfd_close(&fsxfd);
+		free(fshandlep);
+		return -1;
+	}
+
+	fsr_find_tmp_ags(&ctx);
+
+	if (ctx.ranked) {
+		fsrfs_ranked(&ctx, &wq, &fsxfd, breq, targetrange);
+		ret = 0;
+		goto out0;
+	}
+
 	while ((ret = -xfrog_bulkstat(&fsxfd, breq) == 0)) {
-		struct xfs_bstat	bs1;
 		struct xfs_bulkstat	*buf = breq->bulkstat;
 		struct xfs_bulkstat	*p;
 		struct xfs_bulkstat	*endp;
+		struct xfs_bstat	*bs;
 		uint32_t		buflenout = breq->hdr.ocount;
 
 		if (buflenout == 0)
 			goto out0;
 
 		/* Each loop through, defrag targetrange percent of the files */
-		count = (buflenout * targetrange) / 100;
+		ctx.count = (buflenout * targetrange) / 100;
 
 		qsort((char *)buf, buflenout, sizeof(struct xfs_bulkstat), cmp);
+		fsr_freesp_scan(&ctx);
 
 		for (p = buf, endp = (buf + buflenout); p < endp ; p++) {
 			/* Do some obvious checks now */
-			if (((p->bs_mode & S_IFMT) != S_IFREG) ||
-			     (p->bs_extents < 2))
+			if (fsr_score(p) <= 0)
 				continue;
 
-			ret = -xfrog_bulkstat_v5_to_v1(&fsxfd, &bs1, p);
+			bs = malloc(sizeof(*bs));
+			if (!bs) {
+				fsrprintf(_("%s: %s\n"), progname,
+						strerror(errno));
+				break;
+			}
+			ret = -xfrog_bulkstat_v5_to_v1(&fsxfd, bs, p);
 			if (ret) {
 				fsrprintf(_("bstat conversion error: %s\n"),
 						strerror(ret));
+				free(bs);
 				continue;
 			}
-
-			fd = jdm_open(fshandlep, &bs1, O_RDWR | O_DIRECT);
-			if (fd < 0) {
-				/* This probably means the file was
-				 * removed while in progress of handling
-				 * it.  Just quietly ignore this file.
-				 */
-				if (dflag)
-					fsrprintf(_("could not open: "
-						"inode %llu\n"), p->bs_ino);
-				continue;
-			}
-
-			/* Don't know the pathname, so make up something */
-			sprintf(fname, "ino=%lld", (long long)p->bs_ino);
-
-			/* Get a tmp file name */
-			tname = tmp_next(mntdir);
-
-			ret = fsrfile_common(fname, tname, mntdir, fd, &bs1);
-
-			leftoffino = p->bs_ino;
-
-			close(fd);
-
-			if (ret == 0) {
-				if (--count <= 0)
-					break;
-			}
+			if (fsrfs_queue(&ctx, &wq, bs))
+				break;
 		}
+		fsrfs_drain(&ctx);
+
 		if (endtime && endtime < time(NULL)) {
+			workqueue_terminate(&wq);
+			workqueue_destroy(&wq);
 			free(breq);
 			tmp_close(mntdir);
 			xfd_close(&fsxfd);
@@ -705,6 +1293,11 @@ fsrfs(char *mntdir, xfs_ino_t startino, int targetrange)
 	if (ret)
 		fsrprintf(_("%s: bulkstat: %s\n"), progname, strerror(ret));
 out0:
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+	free(ctx.freesp);
+	free(ctx.tmp_ag);
+	free(ctx.ag_busy);
 	free(breq);
 	tmp_close(mntdir);
 	xfd_close(&fsxfd);
@@ -1123,6 +1716,109 @@ out:
 	return 0;
 }
 
+/*
+ * Copy the data extents in outmap from fd to tfd without bouncing them
+ * through a userspace buffer.  copy_file_range would share the blocks on
+ * a reflink filesystem, which defeats the point of copying them, so only
+ * use it when reflink is off and splice through a pipe otherwise.
+ *
+ * Returns 0 if the data was copied, 1 if the kernel can't do it this way
+ * (and nothing has been written yet), or -1 on error.
+ */
+static int	zerocopy_off;		/* kernel can't, don't keep trying */
+
+static int
+fsr_copy_kernel(
+	int		fd,
+	int		tfd,
+	int		nextents,
+	char		*fname,
+	char		*tname)
+{
+	bool		cfr = false;
+	bool		copied = false;
+	int		pfd[2];
+	int		extent;
+	int		flags;
+	int		ret = -1;
+	loff_t		spos, tpos;
+	off64_t		len;
+	ssize_t		n, w, s;
+	size_t		ct;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	cfr = !(fsgeom.flags & XFS_FSOP_GEOM_FLAGS_REFLINK);
+#endif
+	if (zerocopy_off)
+		return 1;
+	if (!cfr && pipe(pfd) < 0)
+		return 1;
+
+	/* A short write at EOF can't be done with O_DIRECT. */
+	flags = fcntl(tfd, F_GETFL);
+	if (flags < 0 || fcntl(tfd, F_SETFL, flags & ~O_DIRECT) < 0) {
+		ret = 1;
+		goto out_pipe;
+	}
+
+	for (extent = 0; extent < nextents; extent++) {
+		if (outmap[extent].bmv_block == -1 ||
+		    outmap[extent].bmv_length == 0)
+			continue;
+		spos = tpos = outmap[extent].bmv_offset;
+		for (len = outmap[extent].bmv_length; len > 0; len -= n) {
+			ct = min(len, (off64_t)BUFFER_MAX);
+			fsr_throttle(ct);
+#ifdef HAVE_COPY_FILE_RANGE
+			if (cfr) {
+				n = syscall(__NR_copy_file_range, fd, &spos,
+						tfd, &tpos, ct, 0);
+			} else
+#endif
+			{
+				n = splice(fd, &spos, pfd[1], NULL, ct,
+						SPLICE_F_MOVE);
+				for (w = n; w > 0; w -= s) {
+					s = splice(pfd[0], NULL, tfd, &tpos,
+							w, SPLICE_F_MOVE);
+					if (s <= 0) {
+						n = -1;
+						break;
+					}
+				}
+			}
+			if (n == 0)		/* EOF */
+				break;
+			if (n > 0) {
+				copied = true;
+				continue;
+			}
+
+			/* Nothing written yet?  Then it's just not supported. */
+			if (!copied &&
+			    (errno == EINVAL || errno == ENOSYS ||
+			     errno == EXDEV || errno == EOPNOTSUPP)) {
+				zerocopy_off = 1;
+				ret = 1;
+			} else {
+				fsrprintf(_("bad copy to %s from %s: %s\n"),
+						tname, fname, strerror(errno));
+			}
+			goto out_flags;
+		}
+	}
+	ret = 0;
+out_flags:
+	if (ret == 1)
+		fcntl(tfd, F_SETFL, flags);
+out_pipe:
+	if (!cfr) {
+		close(pfd[0]);
+		close(pfd[1]);
+	}
+	return ret;
+}
+
 /*
  * Do the defragmentation of a single file.
  * We already are pretty sure we can and want to
@@ -1146,7 +1842,7 @@ packfile(char *fname, char *tname, int fd,
 	unsigned	blksz_dio;
 	unsigned	dio_min;
 	struct dioattr	dio;
-	static xfs_swapext_t   sx;
+	xfs_swapext_t	sx;
 	struct xfs_flock64  space;
 	off64_t 	cnt, pos;
 	void 		*fbuf = NULL;
@@ -1292,6 +1988,15 @@ packfile(char *fname, char *tname, int fd,
 		goto out;
 	}
 
+	/* Let the kernel move the data if it can. */
+	if (!nfrags) {
+		srval = fsr_copy_kernel(fd, tfd, nextents, fname, tname);
+		if (srval < 0)
+			goto out;
+		if (srval == 0)
+			goto copied;
+	}
+
 	/* Loop through block map copying the file. */
 	for (extent = 0; extent < nextents; extent++) {
 		pos = outmap[extent].bmv_offset;
@@ -1321,6 +2026,7 @@ packfile(char *fname, char *tname, int fd,
 				ct = min(cnt + dio_min - (cnt % dio_min),
 					blksz_dio);
 			}
+			fsr_throttle(ct);
 			ct = read(fd, fbuf, ct);
 			if (ct == 0) {
 				/* EOF, stop trying to read */
@@ -1381,6 +2087,7 @@ packfile(char *fname, char *tname, int fd,
 			}
 		}
 	}
+copied:
 	if (ftruncate(tfd, statp->bs_size) < 0) {
 		fsrprintf(_("could not truncate tmpfile: %s : %s\n"),
 				fname, strerror(errno));
@@ -1710,20 +2417,13 @@ tmp_init(char *mnt)
 	return;
 }
 
-static char *
-tmp_next(char *mnt)
+static void
+tmp_name(char *buf, char *mnt, int agno)
 {
-	static char	buf[SMBUFSZ];
-
 	sprintf(buf, "%s/.fsr/ag%d/tmp%d",
 	        ( (strcmp(mnt, "/") == 0) ? "" : mnt),
-	        tmp_agi,
+	        agno,
 	        getpid());
-
-	if (++tmp_agi == fsgeom.agcount)
-		tmp_agi = 0;
-
-	return(buf);
 }
 
 static void
@@ -26,11 +26,58 @@ Options:\n\
 	-R size     grow realtime section to size blks\n\
 	-e size     set realtime extent size to size blks\n\
 	-m imaxpct  set inode max percent to imaxpct\n\
+	-S agcount  grow the data section by at most agcount AGs at a time\n\
 	-V          print version information\n"),
 		progname);
 	exit(2);
 }
 
+/*
+ * Grow the data section to dsize blocks.  The kernel sets up all the new AGs
+ * and holds off other growfs work until it's done, so a big grow can stall
+ * for a long time.  If step is set, add at most that many AGs per call so
+ * that each stall is short; every call leaves a fully grown filesystem
+ * behind, so stopping part way is harmless.
+ */
+static int
+grow_data(
+	char			*fname,
+	int			ffd,
+	struct xfs_fsop_geom	*geo,
+	long long		dsize,
+	int			maxpct,
+	long long		step)
+{
+	xfs_growfs_data_t	in;
+	long long		cur = geo->datablocks;
+
+	do {
+		in.newblocks = (__u64)dsize;
+		if (step && dsize > cur) {
+			long long	next;
+
+			next = (cur / geo->agblocks + step) * geo->agblocks;
+			if (next < dsize)
+				in.newblocks = (__u64)next;
+		}
+		in.imaxpct = (__u32)maxpct;
+		if (xfsctl(fname, ffd, XFS_IOC_FSGROWFSDATA, &in) < 0) {
+			if (errno == EWOULDBLOCK)
+				fprintf(stderr, _(
+			 "%s: growfs operation in progress already\n"),
+					progname);
+			else
+				fprintf(stderr, _(
+			"%s: XFS_IOC_FSGROWFSDATA xfsctl failed: %s\n"),
+					progname, strerror(errno));
+			return 1;
+		}
+		cur = in.newblocks;
+	} while (cur < dsize);
+
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -55,6 +102,7 @@ main(int argc, char **argv)
 	struct xfs_fsop_geom	ngeo;	/* new fs geometry */
 	int			rflag;	/* -r flag */
 	long long		rsize;	/* new rt size in fs blocks */
+	long long		step;	/* -S flag value */
 	int			xflag;	/* -x flag */
 	char			*fname;	/* mount point name */
 	char			*datadev; /* data device name */
@@ -71,10 +119,10 @@ main(int argc, char **argv)
 	textdomain(PACKAGE);
 
 	maxpct = esize = 0;
-	dsize = lsize = rsize = 0LL;
+	dsize = lsize = rsize = step = 0LL;
 	aflag = dflag = iflag = lflag = mflag = nflag = rflag = xflag = 0;
 
-	while ((c = getopt(argc, argv, "dD:e:ilL:m:np:rR:t:xV")) != EOF) {
+	while ((c = getopt(argc, argv, "dD:e:ilL:m:np:rR:S:t:xV")) != EOF) {
 		switch (c) {
 		case 'D':
 			dsize = strtoll(optarg, NULL, 10);
@@ -111,6 +159,11 @@ main(int argc, char **argv)
 		case 'r':
 			rflag = 1;
 			break;
+		case 'S':
+			step = strtoll(optarg, NULL, 10);
+			if (step <= 0)
+				usage();
+			break;
 		case 't':
 			mtab_file = optarg;
 			break;
@@ -131,14 +184,14 @@ main(int argc, char **argv)
 	if (dflag + lflag + rflag + mflag == 0)
 		aflag = 1;
 
-	fs_table_initialise(0, NULL, 0, NULL);
-
 	if (!realpath(argv[optind], rpath)) {
 		fprintf(stderr, _("%s: path resolution failed for %s: %s\n"),
 			progname, argv[optind], strerror(errno));
 		return 1;
 	}
 
+	fs_table_initialise_path(rpath);
+
 	fs = fs_table_lookup_mount(rpath);
 	if (!fs)
 		fs = fs_table_lookup_blkdev(rpath);
@@ -230,8 +283,6 @@ main(int argc, char **argv)
 	error = 0;
 
 	if (dflag | mflag | aflag) {
-		xfs_growfs_data_t	in;
-
 		if (!mflag)
 			maxpct = geo.imaxpct;
 		if (!dflag && !aflag)	/* Only mflag, no data size change */
@@ -259,19 +310,8 @@ _("[EXPERIMENTAL] try to shrink unused space %lld, old size is %lld\n"),
 				fprintf(stderr, _(
 					"inode max pct unchanged, skipping\n"));
 		} else if (!error && !nflag) {
-			in.newblocks = (__u64)dsize;
-			in.imaxpct = (__u32)maxpct;
-			if (xfsctl(fname, ffd, XFS_IOC_FSGROWFSDATA, &in) < 0) {
-				if (errno == EWOULDBLOCK)
-					fprintf(stderr, _(
-				 "%s: growfs operation in progress already\n"),
-						progname);
-				else
-					fprintf(stderr, _(
-				"%s: XFS_IOC_FSGROWFSDATA xfsctl failed: %s\n"),
-						progname, strerror(errno));
-				error = 1;
-			}
+			error = grow_data(fname, ffd, &geo, dsize, maxpct,
+					step);
 		}
 	}
 
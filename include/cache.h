@@ -16,6 +16,12 @@
  */
 #define CACHE_MISCOMPARE_PURGE	(1 << 0)
 
+/*
+ * Use the scan resistant CLOCK replacement policy instead of plain LRU if the
+ * cache operations don't supply their own policy.
+ */
+#define CACHE_SCAN_RESISTANT	(1 << 1)
+
 /*
  * cache object campare return values
  */
@@ -53,6 +59,7 @@ enum {
 
 struct cache;
 struct cache_node;
+struct cache_mru;
 
 typedef void *cache_key_t;
 
@@ -64,6 +71,27 @@ typedef unsigned int (*cache_node_hash_t)(cache_key_t, unsigned int,
 					  unsigned int);
 typedef int (*cache_node_compare_t)(struct cache_node *, cache_key_t);
 typedef unsigned int (*cache_bulk_relse_t)(struct cache *, struct list_head *);
+typedef bool (*cache_node_dirty_t)(struct cache_node *);
+typedef void (*cache_bulk_flush_t)(struct cache *, struct cache_node **,
+				   unsigned int);
+typedef uint64_t (*cache_key_fingerprint_t)(cache_key_t);
+
+/*
+ * Replacement policy.  ->insert is called with the MRU lock held to park a
+ * node whose last reference has just been dropped; nodes at the tail of the
+ * MRU are reclaimed first.  ->reclaim is called by the shaker with the node
+ * lock held and returns false if the node should be given another trip
+ * around the MRU instead of being reclaimed.
+ */
+struct cache_policy {
+	const char		*name;
+	void			(*insert)(struct cache_mru *,
+					  struct cache_node *);
+	bool			(*reclaim)(struct cache_node *);
+};
+
+extern const struct cache_policy cache_lru_policy;
+extern const struct cache_policy cache_clock_policy;
 
 struct cache_operations {
 	cache_node_hash_t	hash;
@@ -72,12 +100,48 @@ struct cache_operations {
 	cache_node_relse_t	relse;
 	cache_node_compare_t	compare;
 	cache_bulk_relse_t	bulkrelse;	/* optional */
+	const struct cache_policy *policy;	/* optional */
+	cache_node_dirty_t	dirty;		/* optional, needs bulkflush */
+	cache_bulk_flush_t	bulkflush;	/* optional, needs dirty */
+	cache_key_fingerprint_t	fingerprint;	/* optional */
 };
 
+/*
+ * Each hash bucket is protected by a reader/writer lock so that concurrent
+ * lookups of the same metadata only contend on the node they hit, not on the
+ * chain walk.  The chain may only be modified with the lock held for write.
+ * Hit and miss statistics are kept per bucket so that the lookup fast path
+ * never touches cache-wide state.
+ *
+ * If the cache can fingerprint its keys, each bucket also has a small bloom
+ * filter of the keys on its chain, so that lookups for keys that are
+ * definitely not there go straight to allocating a new node without taking
+ * the lock or walking the chain.  Removing a node leaves its bits behind
+ * until enough removals pile up to make rebuilding the filter worthwhile.
+ */
 struct cache_hash {
 	struct list_head	ch_list;	/* hash chain head */
 	unsigned int		ch_count;	/* hash chain length */
-	pthread_mutex_t		ch_mutex;	/* hash chain mutex */
+	unsigned int		ch_stale;	/* removals since filter rebuild */
+	uint64_t		ch_bloom;	/* filter of keys on chain */
+	pthread_rwlock_t	ch_lock;	/* hash chain lock */
+	unsigned long		ch_hits;	/* bucket hits (atomic) */
+	unsigned long		ch_misses;	/* bucket misses (atomic) */
+	unsigned long		ch_skips;	/* misses found by filter (atomic) */
+};
+
+/*
+ * The node count is split into shards, one for each group of hash buckets with
+ * the same low index bits, so that threads allocating and reclaiming nodes in
+ * different buckets don't all bounce the same counter between CPUs.  The
+ * shards are summed when the count is read.  Each shard is padded out to its
+ * own cache line.
+ */
+#define CACHE_COUNT_SHARDS	16
+
+struct cache_count {
+	unsigned int		cc_count;	/* nodes in shard (atomic) */
+	char			cc_pad[64 - sizeof(unsigned int)];
 };
 
 struct cache_mru {
@@ -93,27 +157,34 @@ struct cache_node {
 	unsigned int		cn_hashidx;	/* hash chain index */
 	int			cn_priority;	/* priority, -1 = free list */
 	int			cn_old_priority;/* saved pre-dirty prio */
+	unsigned int		cn_reuse;	/* lookups since node created */
+	uint64_t		cn_bloom;	/* key's bits in bucket filter */
+	bool			cn_referenced;	/* hit since last shake */
 	pthread_mutex_t		cn_mutex;	/* node mutex */
 };
 
 struct cache {
 	int			c_flags;	/* behavioural flags */
 	unsigned int		c_maxcount;	/* max cache nodes */
-	unsigned int		c_count;	/* count of nodes */
-	pthread_mutex_t		c_mutex;	/* node count mutex */
 	cache_node_hash_t	hash;		/* node hash function */
 	cache_node_alloc_t	alloc;		/* allocation function */
 	cache_node_flush_t	flush;		/* flush dirty data function */
 	cache_node_relse_t	relse;		/* memory free function */
 	cache_node_compare_t	compare;	/* comparison routine */
 	cache_bulk_relse_t	bulkrelse;	/* bulk release routine */
+	cache_node_dirty_t	dirty;		/* dirty node check */
+	cache_bulk_flush_t	bulkflush;	/* bulk flush routine */
+	cache_key_fingerprint_t	fingerprint;	/* key fingerprint */
+	const struct cache_policy *c_policy;	/* replacement policy */
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
 	struct cache_mru	c_mrus[CACHE_DIRTY_PRIORITY + 1];
-	unsigned long long	c_misses;	/* cache misses */
-	unsigned long long	c_hits;		/* cache hits */
-	unsigned int 		c_max;		/* max nodes ever used */
+	unsigned int 		c_max;		/* max nodes ever used (atomic) */
+	unsigned long		c_oneshot;	/* unreused nodes reclaimed */
+	unsigned long		c_reused;	/* reused nodes reclaimed */
+	unsigned long		c_reprieves;	/* reclaims refused by policy */
+	struct cache_count	c_count[CACHE_COUNT_SHARDS];
 };
 
 struct cache *cache_init(int, unsigned int, struct cache_operations *);
@@ -128,6 +199,10 @@ void cache_node_set_priority(struct cache *, struct cache_node *, int);
 int cache_node_get_priority(struct cache_node *);
 int cache_node_purge(struct cache *, cache_key_t, struct cache_node *);
 void cache_report(FILE *fp, const char *, struct cache *);
+void cache_hit_stats(struct cache *, unsigned long long *hits,
+		unsigned long long *misses);
 int cache_overflowed(struct cache *);
+unsigned int cache_node_count(struct cache *);
+void cache_shrink(struct cache *, unsigned int);
 
 #endif	/* __CACHE_H__ */
@@ -29,6 +29,15 @@ extern int  attr_multi_by_handle (void *__hanp, size_t __hlen, void *__buf,
 extern int  attr_list_by_handle (void *__hanp, size_t __hlen, void *__buf,
 				 size_t __bufsize, int __flags,
 				 struct attrlist_cursor *__cursor);
+extern int  open_by_handles (void **__hanps, size_t *__hlens, int __count,
+			     int __rw, int *__results);
+extern int  readlink_by_handles (void **__hanps, size_t *__hlens, int __count,
+				 void **__bufs, size_t __bs, int *__results);
+extern int  attr_list_by_handles (void **__hanps, size_t *__hlens,
+				  int __count, void **__bufs,
+				  size_t __bufsize, int __flags,
+				  struct attrlist_cursor **__cursors,
+				  int *__results);
 extern int  parents_by_handle(void *__hanp, size_t __hlen,
 			      struct parent *__buf, size_t __bufsize,
 			      unsigned int *__count);
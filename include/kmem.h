@@ -17,6 +17,18 @@ struct kmem_cache {
 	unsigned int	align;
 	const char	*cache_name;	/* tag name */
 	void		(*ctor)(void *);
+	unsigned int	gen;		/* names this cache to thread pools */
+
+	/* free units shared between the threads' pools */
+	pthread_mutex_t	depot_lock;
+	void		*depot;
+	unsigned int	depot_nr;
+
+	/* statistics, reported at destroy time if LIBXFS_KMEM_STATS is set */
+	uint64_t	nr_allocs;
+	uint64_t	nr_mallocs;
+	uint64_t	nr_depot_gets;
+	uint64_t	nr_depot_puts;
 };
 
 typedef unsigned int __bitwise gfp_t;
@@ -41,13 +53,7 @@ kmem_cache_init(unsigned int size, const char *name)
 extern void	*kmem_cache_alloc(struct kmem_cache *, gfp_t);
 extern void	*kmem_cache_zalloc(struct kmem_cache *, gfp_t);
 extern int	kmem_cache_destroy(struct kmem_cache *);
-
-static inline void
-kmem_cache_free(struct kmem_cache *cache, void *ptr)
-{
-	cache->allocated--;
-	free(ptr);
-}
+extern void	kmem_cache_free(struct kmem_cache *, void *);
 
 extern void	*kmem_alloc(size_t, int);
 extern void	*kvmalloc(size_t, gfp_t);
@@ -135,6 +135,7 @@ typedef struct libxfs_xinit {
 
 extern char	*progname;
 extern xfs_lsn_t libxfs_max_lsn;
+extern int	use_xfs_buf_lock;	/* buffers are locked for threading */
 extern int	libxfs_init (libxfs_init_t *);
 void		libxfs_destroy(struct libxfs_xinit *li);
 extern int	libxfs_device_to_fd (dev_t);
@@ -30,6 +30,7 @@ struct xlog {
 	uint		l_sectbb_mask;  /* sector size (in BBs)
 					 * alignment mask */
 	int		l_sectBBsize;   /* size of log sector in 512 byte chunks */
+	bool		l_crc_fatal;	/* CRC mismatches stop recovery */
 };
 
 #include "xfs_log_recover.h"
@@ -79,6 +80,8 @@ extern int	xlog_bread(struct xlog *log, xfs_daddr_t blk_no, int nbblks,
 				struct xfs_buf *bp, char **offset);
 extern int	xlog_bread_noalign(struct xlog *log, xfs_daddr_t blk_no,
 				int nbblks, struct xfs_buf *bp);
+extern bool	xlog_bcache_start(struct xlog *log);
+extern void	xlog_bcache_stop(void);
 
 extern int	xlog_find_zeroed(struct xlog *log, xfs_daddr_t *blk_no);
 extern int	xlog_find_cycle_start(struct xlog *log, struct xfs_buf *bp,
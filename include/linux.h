@@ -188,6 +188,20 @@ platform_zero_range(
 	ret = fallocate(fd, FALLOC_FL_ZERO_RANGE, start, len);
 	if (!ret)
 		return 0;
+#ifdef BLKZEROOUT
+	/*
+	 * Block devices didn't support zeroing fallocate before 4.9, but they
+	 * can still be asked to zero the range themselves.
+	 */
+	{
+		uint64_t	range[2] = { start, len };
+		struct stat	st;
+
+		if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+		    ioctl(fd, BLKZEROOUT, &range) == 0)
+			return 0;
+	}
+#endif
 	return -errno;
 }
 #else
@@ -69,7 +69,9 @@ static inline void ihold(struct inode *inode)
 }
 
 typedef struct xfs_inode {
-	struct cache_node	i_node;
+	struct list_head	i_hash;		/* inode cache hash chain */
+	struct list_head	i_lru;		/* inode cache lru */
+	void			*i_dcopy;	/* dinode as last seen on disk */
 	struct xfs_mount	*i_mount;	/* fs mount struct ptr */
 	xfs_ino_t		i_ino;		/* inode number (agno/agino) */
 	struct xfs_imap		i_imap;		/* location for xfs_imap() */
@@ -185,5 +187,7 @@ extern struct timespec64 current_time(struct inode *inode);
 extern int	libxfs_iget(struct xfs_mount *, struct xfs_trans *, xfs_ino_t,
 				uint, struct xfs_inode **);
 extern void	libxfs_irele(struct xfs_inode *ip);
+extern void	libxfs_icache_sync(struct xfs_inode *ip, struct xfs_buf *bp);
+extern void	libxfs_icache_purge(struct xfs_mount *mp);
 
 #endif /* __XFS_INODE_H__ */
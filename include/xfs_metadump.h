@@ -22,5 +22,67 @@ typedef struct xfs_metablock {
 #define XFS_METADUMP_OBFUSCATED	(1 << 1)
 #define XFS_METADUMP_FULLBLOCKS	(1 << 2)
 #define XFS_METADUMP_DIRTYLOG	(1 << 3)
+#define XFS_METADUMP_DELTA	(1 << 4) /* v2 delta against a base dump */
+
+/*
+ * A chunked metadump groups the v1 metablocks into chunks that are each
+ * compressed on their own, and ends with an index of the chunks so that
+ * a reader can find a block without restoring the whole dump:
+ *
+ *	header
+ *	chunk header, payload	(one for each chunk)
+ *	chunk header, index	(XFS_MD_INDEX_MAGIC, never compressed)
+ *	footer
+ *
+ * Uncompressed, the payload of a chunk is a run of complete v1 metablocks,
+ * each followed by the BBSIZE blocks it lists.  The first block of the
+ * first chunk is the primary superblock.  A payload that doesn't get any
+ * smaller compressed is stored as is, with xmc_len == xmc_raw_len.
+ *
+ * A delta dump (XFS_METADUMP_DELTA) only holds the sectors that differ
+ * from a full base dump, plus the primary superblock.  Just before the
+ * index it has a tombstone chunk (XFS_MD_TOMB_MAGIC, never compressed,
+ * not in the index) listing as __be64s the sectors the base has but the
+ * filesystem no longer uses as metadata.  It is restored by restoring the
+ * base, writing the delta's blocks over it and zeroing the tombstones.
+ */
+#define XFS_MD_MAGIC_CHUNKED	0x584d445a	/* 'XMDZ' */
+#define XFS_MD_CHUNK_MAGIC	0x584d4443	/* 'XMDC' */
+#define XFS_MD_INDEX_MAGIC	0x584d4449	/* 'XMDI' */
+#define XFS_MD_TOMB_MAGIC	0x584d4454	/* 'XMDT' */
+
+#define XFS_MD_COMPRESS_NONE	0
+#define XFS_MD_COMPRESS_ZSTD	1
+
+#define XFS_MD_CHUNK_SIZE	(1U << 20)	/* max uncompressed payload */
+
+struct xfs_metadump_chunked_header {
+	__be32		xmh_magic;
+	uint8_t		xmh_info;	/* XFS_METADUMP_* flags */
+	uint8_t		xmh_compress;	/* XFS_MD_COMPRESS_* */
+	__be16		xmh_pad;
+	__be32		xmh_chunk_size;	/* max uncompressed payload */
+	__be32		xmh_pad2;
+};
+
+struct xfs_metadump_chunk {
+	__be32		xmc_magic;
+	__be32		xmc_len;	/* payload bytes in the file */
+	__be32		xmc_raw_len;	/* payload bytes uncompressed */
+	__be32		xmc_pad;
+};
+
+struct xfs_metadump_index_ent {
+	__be64		xmi_offset;	/* file offset of the chunk header */
+	__be64		xmi_low;	/* lowest daddr in the chunk */
+	__be64		xmi_high;	/* highest daddr in the chunk */
+};
+
+struct xfs_metadump_footer {
+	__be32		xmf_magic;	/* XFS_MD_MAGIC_CHUNKED */
+	__be32		xmf_pad;
+	__be64		xmf_nr_chunks;
+	__be64		xmf_index_offset; /* file offset of the index chunk */
+};
 
 #endif /* _XFS_METADUMP_H_ */
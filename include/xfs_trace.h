@@ -6,318 +6,347 @@
 #ifndef __TRACE_H__
 #define __TRACE_H__
 
-#define trace_xfs_agfl_reset(a,b,c,d)		((void) 0)
-#define trace_xfs_agfl_free_defer(a,b,c,d,e)	((void) 0)
-#define trace_xfs_alloc_cur_check(a,b,c,d,e,f)	((void) 0)
-#define trace_xfs_alloc_cur(a)			((void) 0)
-#define trace_xfs_alloc_cur_left(a)		((void) 0)
-#define trace_xfs_alloc_cur_lookup(a)		((void) 0)
-#define trace_xfs_alloc_cur_lookup_done(a)	((void) 0)
-#define trace_xfs_alloc_cur_right(a)		((void) 0)
-#define trace_xfs_alloc_exact_done(a)		((void) 0)
-#define trace_xfs_alloc_exact_notfound(a)	((void) 0)
-#define trace_xfs_alloc_exact_error(a)		((void) 0)
-#define trace_xfs_alloc_near_first(a)		((void) 0)
-#define trace_xfs_alloc_near_greater(a)		((void) 0)
-#define trace_xfs_alloc_near_lesser(a)		((void) 0)
-#define trace_xfs_alloc_near_error(a)		((void) 0)
-#define trace_xfs_alloc_near_noentry(a)		((void) 0)
-#define trace_xfs_alloc_near_busy(a)		((void) 0)
-#define trace_xfs_alloc_size_neither(a)		((void) 0)
-#define trace_xfs_alloc_size_noentry(a)		((void) 0)
-#define trace_xfs_alloc_size_nominleft(a)	((void) 0)
-#define trace_xfs_alloc_size_done(a)		((void) 0)
-#define trace_xfs_alloc_size_error(a)		((void) 0)
-#define trace_xfs_alloc_size_busy(a)		((void) 0)
-#define trace_xfs_alloc_small_freelist(a)	((void) 0)
-#define trace_xfs_alloc_small_notenough(a)	((void) 0)
-#define trace_xfs_alloc_small_done(a)		((void) 0)
-#define trace_xfs_alloc_small_error(a)		((void) 0)
-#define trace_xfs_alloc_vextent_badargs(a)	((void) 0)
-#define trace_xfs_alloc_vextent_nofix(a)	((void) 0)
-#define trace_xfs_alloc_vextent_noagbp(a)	((void) 0)
-#define trace_xfs_alloc_vextent_loopfailed(a)	((void) 0)
-#define trace_xfs_alloc_vextent_allfailed(a)	((void) 0)
-
-#define trace_xfs_attr_sf_addname_return(...)	((void) 0)
-#define trace_xfs_attr_set_iter_return(...)	((void) 0)
-#define trace_xfs_attr_node_addname_return(...)	((void) 0)
-#define trace_xfs_attr_remove_iter_return(...)	((void) 0)
-#define trace_xfs_attr_rmtval_remove_return(...) ((void) 0)
-
-#define trace_xfs_log_recover_item_add_cont(a,b,c,d)	((void) 0)
-#define trace_xfs_log_recover_item_add(a,b,c,d)	((void) 0)
-
-#define trace_xfs_da_btree_corrupt(a,b)		((void) 0)
-#define trace_xfs_btree_corrupt(a,b)		((void) 0)
-#define trace_xfs_btree_updkeys(a,b,c)		((void) 0)
-#define trace_xfs_btree_overlapped_query_range(a,b,c)	((void) 0)
-#define trace_xfs_btree_commit_afakeroot(a)	((void) 0)
-#define trace_xfs_btree_commit_ifakeroot(a)	((void) 0)
-#define trace_xfs_btree_bload_level_geometry(a,b,c,d,e,f,g) ((void) 0)
-#define trace_xfs_btree_bload_block(a,b,c,d,e,f) ((void) 0)
-
-#define trace_xfs_free_extent(a,b,c,d,e,f,g)	((void) 0)
-#define trace_xfs_agf(a,b,c,d)			((void) 0)
-#define trace_xfs_read_agf(a,b)			((void) 0)
-#define trace_xfs_alloc_read_agf(a,b)		((void) 0)
-#define trace_xfs_read_agi(a,b)			((void) 0)
-#define trace_xfs_ialloc_read_agi(a,b)		((void) 0)
-#define trace_xfs_irec_merge_pre(a,b,c,d,e,f)	((void) 0)
-#define trace_xfs_irec_merge_post(a,b,c,d)	((void) 0)
-
-#define trace_xfs_iext_insert(a,b,c,d)		((void) 0)
-#define trace_xfs_iext_remove(a,b,c,d)		((void) 0)
-
-#define trace_xfs_defer_relog_intent(a,b)	((void) 0)
-
-#define trace_xfs_dir2_grow_inode(a,b)		((void) 0)
-#define trace_xfs_dir2_shrink_inode(a,b)	((void) 0)
-
-#define trace_xfs_dir2_leaf_to_node(a)	((void) 0)
-#define trace_xfs_dir2_leaf_to_block(a)	((void) 0)
-#define trace_xfs_dir2_leaf_addname(a)	((void) 0)
-#define trace_xfs_dir2_leaf_lookup(a)	((void) 0)
-#define trace_xfs_dir2_leaf_removename(a)	((void) 0)
-#define trace_xfs_dir2_leaf_replace(a)	((void) 0)
-
-#define trace_xfs_dir2_block_addname(a)	((void) 0)
-#define trace_xfs_dir2_block_to_leaf(a)	((void) 0)
-#define trace_xfs_dir2_block_to_sf(a)	((void) 0)
-#define trace_xfs_dir2_block_lookup(a)	((void) 0)
-#define trace_xfs_dir2_block_removename(a)	((void) 0)
-#define trace_xfs_dir2_block_replace(a)	((void) 0)
-
-#define trace_xfs_dir2_leafn_add(a,b)	((void) 0)
-#define trace_xfs_dir2_leafn_remove(a,b)	((void) 0)
-#define trace_xfs_dir2_leafn_moveents(a,b,c,d)	((void) 0)
-
-#define trace_xfs_dir2_node_to_leaf(a)	((void) 0)
-#define trace_xfs_dir2_node_addname(a)	((void) 0)
-#define trace_xfs_dir2_node_lookup(a)	((void) 0)
-#define trace_xfs_dir2_node_removename(a)	((void) 0)
-#define trace_xfs_dir2_node_replace(a)	((void) 0)
-
-#define trace_xfs_dir2_sf_to_block(a)	((void) 0)
-#define trace_xfs_dir2_sf_addname(a)	((void) 0)
-#define trace_xfs_dir2_sf_create(a)	((void) 0)
-#define trace_xfs_dir2_sf_lookup(a)	((void) 0)
-#define trace_xfs_dir2_sf_removename(a)	((void) 0)
-#define trace_xfs_dir2_sf_replace(a)	((void) 0)
-#define trace_xfs_dir2_sf_toino4(a)	((void) 0)
-#define trace_xfs_dir2_sf_toino8(a)	((void) 0)
-
-#define trace_xfs_da_node_create(a)		((void) 0)
-#define trace_xfs_da_split(a)			((void) 0)
-#define trace_xfs_attr_leaf_split_before(a)	((void) 0)
-#define trace_xfs_attr_leaf_split_after(a)	((void) 0)
-#define trace_xfs_da_root_split(a)		((void) 0)
-#define trace_xfs_da_node_split(a)		((void) 0)
-#define trace_xfs_da_node_rebalance(a)		((void) 0)
-#define trace_xfs_da_node_add(a)		((void) 0)
-#define trace_xfs_da_join(a)			((void) 0)
-#define trace_xfs_da_root_join(a)		((void) 0)
-#define trace_xfs_da_node_toosmall(a)		((void) 0)
-#define trace_xfs_da_fixhashpath(a)		((void) 0)
-#define trace_xfs_da_node_remove(a)		((void) 0)
-#define trace_xfs_da_node_unbalance(a)		((void) 0)
-#define trace_xfs_da_link_before(a)		((void) 0)
-#define trace_xfs_da_link_after(a)		((void) 0)
-#define trace_xfs_da_unlink_back(a)		((void) 0)
-#define trace_xfs_da_unlink_forward(a)		((void) 0)
-#define trace_xfs_da_path_shift(a)		((void) 0)
-#define trace_xfs_da_grow_inode(a)		((void) 0)
-#define trace_xfs_da_swap_lastblock(a)		((void) 0)
-#define trace_xfs_da_shrink_inode(a)		((void) 0)
-
-#define trace_xfs_attr_sf_create(a)		((void) 0)
-#define trace_xfs_attr_sf_add(a)		((void) 0)
-#define trace_xfs_attr_sf_remove(a)		((void) 0)
-#define trace_xfs_attr_sf_lookup(a)		((void) 0)
-#define trace_xfs_attr_sf_to_leaf(a)		((void) 0)
-#define trace_xfs_attr_leaf_to_sf(a)		((void) 0)
-#define trace_xfs_attr_leaf_to_node(a)		((void) 0)
-#define trace_xfs_attr_leaf_create(a)		((void) 0)
-#define trace_xfs_attr_leaf_split(a)		((void) 0)
-#define trace_xfs_attr_leaf_add_old(a)		((void) 0)
-#define trace_xfs_attr_leaf_add_new(a)		((void) 0)
-#define trace_xfs_attr_leaf_add(a)		((void) 0)
-#define trace_xfs_attr_leaf_add_work(a)		((void) 0)
-#define trace_xfs_attr_leaf_compact(a)		((void) 0)
-#define trace_xfs_attr_leaf_rebalance(a)	((void) 0)
-#define trace_xfs_attr_leaf_toosmall(a)		((void) 0)
-#define trace_xfs_attr_leaf_remove(a)		((void) 0)
-#define trace_xfs_attr_leaf_unbalance(a)	((void) 0)
-#define trace_xfs_attr_leaf_lookup(a)		((void) 0)
-#define trace_xfs_attr_leaf_clearflag(a)	((void) 0)
-#define trace_xfs_attr_leaf_setflag(a)		((void) 0)
-#define trace_xfs_attr_leaf_flipflags(a)	((void) 0)
-
-#define trace_xfs_attr_sf_addname(a)		((void) 0)
-#define trace_xfs_attr_leaf_addname(a)		((void) 0)
-#define trace_xfs_attr_leaf_replace(a)		((void) 0)
-#define trace_xfs_attr_leaf_removename(a)	((void) 0)
-#define trace_xfs_attr_leaf_get(a)		((void) 0)
-#define trace_xfs_attr_node_addname(a)		((void) 0)
-#define trace_xfs_attr_node_replace(a)		((void) 0)
-#define trace_xfs_attr_node_removename(a)	((void) 0)
-#define trace_xfs_attr_fillstate(a)		((void) 0)
-#define trace_xfs_attr_refillstate(a)		((void) 0)
-#define trace_xfs_attr_node_get(a)		((void) 0)
-#define trace_xfs_attr_rmtval_get(a)		((void) 0)
-#define trace_xfs_attr_rmtval_set(a)		((void) 0)
-#define trace_xfs_attr_rmtval_remove(a)		((void) 0)
-
-#define trace_xfs_bmap_pre_update(a,b,c,d)	((void) 0)
-#define trace_xfs_bmap_post_update(a,b,c,d)	((void) 0)
-#define trace_xfs_bunmap(a,b,c,d,e)		((void) 0)
-#define trace_xfs_read_extent(a,b,c,d)		((void) 0)
+/*
+ * The kernel's tracepoints become USDT probes in the "xfs" provider when
+ * sys/sdt.h is available, with the same names and arguments as in the
+ * kernel, e.g. usdt:/usr/sbin/xfs_repair:xfs:xfs_alloc_size_done in
+ * bpftrace.  A probe that nothing is attached to is a single nop.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define xfs_probe(name, ...)	STAP_PROBEV(xfs, name, ##__VA_ARGS__)
+#ifndef _RET_IP_
+#define _RET_IP_		((unsigned long)__builtin_return_address(0))
+#endif
+#ifndef _THIS_IP_
+#define _THIS_IP_		({ __label__ __here; __here: (unsigned long)&&__here; })
+#endif
+#else
+#define xfs_probe(name, ...)	((void) 0)
+#endif
+
+#define trace_xfs_agfl_reset(a,b,c,d)		xfs_probe(xfs_agfl_reset, a,b,c,d)
+#define trace_xfs_agfl_free_defer(a,b,c,d,e)	xfs_probe(xfs_agfl_free_defer, a,b,c,d,e)
+#define trace_xfs_alloc_cur_check(a,b,c,d,e,f)	xfs_probe(xfs_alloc_cur_check, a,b,c,d,e,f)
+#define trace_xfs_alloc_cur(a)			xfs_probe(xfs_alloc_cur, a)
+#define trace_xfs_alloc_cur_left(a)		xfs_probe(xfs_alloc_cur_left, a)
+#define trace_xfs_alloc_cur_lookup(a)		xfs_probe(xfs_alloc_cur_lookup, a)
+#define trace_xfs_alloc_cur_lookup_done(a)	xfs_probe(xfs_alloc_cur_lookup_done, a)
+#define trace_xfs_alloc_cur_right(a)		xfs_probe(xfs_alloc_cur_right, a)
+#define trace_xfs_alloc_exact_done(a)		xfs_probe(xfs_alloc_exact_done, a)
+#define trace_xfs_alloc_exact_notfound(a)	xfs_probe(xfs_alloc_exact_notfound, a)
+#define trace_xfs_alloc_exact_error(a)		xfs_probe(xfs_alloc_exact_error, a)
+#define trace_xfs_alloc_near_first(a)		xfs_probe(xfs_alloc_near_first, a)
+#define trace_xfs_alloc_near_greater(a)		xfs_probe(xfs_alloc_near_greater, a)
+#define trace_xfs_alloc_near_lesser(a)		xfs_probe(xfs_alloc_near_lesser, a)
+#define trace_xfs_alloc_near_error(a)		xfs_probe(xfs_alloc_near_error, a)
+#define trace_xfs_alloc_near_noentry(a)		xfs_probe(xfs_alloc_near_noentry, a)
+#define trace_xfs_alloc_near_busy(a)		xfs_probe(xfs_alloc_near_busy, a)
+#define trace_xfs_alloc_size_neither(a)		xfs_probe(xfs_alloc_size_neither, a)
+#define trace_xfs_alloc_size_noentry(a)		xfs_probe(xfs_alloc_size_noentry, a)
+#define trace_xfs_alloc_size_nominleft(a)	xfs_probe(xfs_alloc_size_nominleft, a)
+#define trace_xfs_alloc_size_done(a)		xfs_probe(xfs_alloc_size_done, a)
+#define trace_xfs_alloc_size_error(a)		xfs_probe(xfs_alloc_size_error, a)
+#define trace_xfs_alloc_size_busy(a)		xfs_probe(xfs_alloc_size_busy, a)
+#define trace_xfs_alloc_small_freelist(a)	xfs_probe(xfs_alloc_small_freelist, a)
+#define trace_xfs_alloc_small_notenough(a)	xfs_probe(xfs_alloc_small_notenough, a)
+#define trace_xfs_alloc_small_done(a)		xfs_probe(xfs_alloc_small_done, a)
+#define trace_xfs_alloc_small_error(a)		xfs_probe(xfs_alloc_small_error, a)
+#define trace_xfs_alloc_vextent_badargs(a)	xfs_probe(xfs_alloc_vextent_badargs, a)
+#define trace_xfs_alloc_vextent_nofix(a)	xfs_probe(xfs_alloc_vextent_nofix, a)
+#define trace_xfs_alloc_vextent_noagbp(a)	xfs_probe(xfs_alloc_vextent_noagbp, a)
+#define trace_xfs_alloc_vextent_loopfailed(a)	xfs_probe(xfs_alloc_vextent_loopfailed, a)
+#define trace_xfs_alloc_vextent_allfailed(a)	xfs_probe(xfs_alloc_vextent_allfailed, a)
+
+#define trace_xfs_attr_sf_addname_return(...)	xfs_probe(xfs_attr_sf_addname_return, __VA_ARGS__)
+#define trace_xfs_attr_set_iter_return(...)	xfs_probe(xfs_attr_set_iter_return, __VA_ARGS__)
+#define trace_xfs_attr_node_addname_return(...)	xfs_probe(xfs_attr_node_addname_return, __VA_ARGS__)
+#define trace_xfs_attr_remove_iter_return(...)	xfs_probe(xfs_attr_remove_iter_return, __VA_ARGS__)
+#define trace_xfs_attr_rmtval_remove_return(...) xfs_probe(xfs_attr_rmtval_remove_return, __VA_ARGS__)
+
+#define trace_xfs_log_recover_item_add_cont(a,b,c,d)	xfs_probe(xfs_log_recover_item_add_cont, a,b,c,d)
+#define trace_xfs_log_recover_item_add(a,b,c,d)	xfs_probe(xfs_log_recover_item_add, a,b,c,d)
+
+#define trace_xfs_da_btree_corrupt(a,b)		xfs_probe(xfs_da_btree_corrupt, a,b)
+#define trace_xfs_btree_corrupt(a,b)		xfs_probe(xfs_btree_corrupt, a,b)
+#define trace_xfs_btree_updkeys(a,b,c)		xfs_probe(xfs_btree_updkeys, a,b,c)
+#define trace_xfs_btree_overlapped_query_range(a,b,c)	xfs_probe(xfs_btree_overlapped_query_range, a,b,c)
+#define trace_xfs_btree_commit_afakeroot(a)	xfs_probe(xfs_btree_commit_afakeroot, a)
+#define trace_xfs_btree_commit_ifakeroot(a)	xfs_probe(xfs_btree_commit_ifakeroot, a)
+#define trace_xfs_btree_bload_level_geometry(a,b,c,d,e,f,g) xfs_probe(xfs_btree_bload_level_geometry, a,b,c,d,e,f,g)
+#define trace_xfs_btree_bload_block(a,b,c,d,e,f) xfs_probe(xfs_btree_bload_block, a,b,c,d,e,f)
+
+#define trace_xfs_free_extent(a,b,c,d,e,f,g)	xfs_probe(xfs_free_extent, a,b,c,d,e,f,g)
+#define trace_xfs_agf(a,b,c,d)			xfs_probe(xfs_agf, a,b,c,d)
+#define trace_xfs_read_agf(a,b)			xfs_probe(xfs_read_agf, a,b)
+#define trace_xfs_alloc_read_agf(a,b)		xfs_probe(xfs_alloc_read_agf, a,b)
+#define trace_xfs_read_agi(a,b)			xfs_probe(xfs_read_agi, a,b)
+#define trace_xfs_ialloc_read_agi(a,b)		xfs_probe(xfs_ialloc_read_agi, a,b)
+#define trace_xfs_irec_merge_pre(a,b,c,d,e,f)	xfs_probe(xfs_irec_merge_pre, a,b,c,d,e,f)
+#define trace_xfs_irec_merge_post(a,b,c,d)	xfs_probe(xfs_irec_merge_post, a,b,c,d)
+
+#define trace_xfs_iext_insert(a,b,c,d)		xfs_probe(xfs_iext_insert, a,b,c,d)
+#define trace_xfs_iext_remove(a,b,c,d)		xfs_probe(xfs_iext_remove, a,b,c,d)
+
+#define trace_xfs_defer_relog_intent(a,b)	xfs_probe(xfs_defer_relog_intent, a,b)
+
+#define trace_xfs_dir2_grow_inode(a,b)		xfs_probe(xfs_dir2_grow_inode, a,b)
+#define trace_xfs_dir2_shrink_inode(a,b)	xfs_probe(xfs_dir2_shrink_inode, a,b)
+
+#define trace_xfs_dir2_leaf_to_node(a)	xfs_probe(xfs_dir2_leaf_to_node, a)
+#define trace_xfs_dir2_leaf_to_block(a)	xfs_probe(xfs_dir2_leaf_to_block, a)
+#define trace_xfs_dir2_leaf_addname(a)	xfs_probe(xfs_dir2_leaf_addname, a)
+#define trace_xfs_dir2_leaf_lookup(a)	xfs_probe(xfs_dir2_leaf_lookup, a)
+#define trace_xfs_dir2_leaf_removename(a)	xfs_probe(xfs_dir2_leaf_removename, a)
+#define trace_xfs_dir2_leaf_replace(a)	xfs_probe(xfs_dir2_leaf_replace, a)
+
+#define trace_xfs_dir2_block_addname(a)	xfs_probe(xfs_dir2_block_addname, a)
+#define trace_xfs_dir2_block_to_leaf(a)	xfs_probe(xfs_dir2_block_to_leaf, a)
+#define trace_xfs_dir2_block_to_sf(a)	xfs_probe(xfs_dir2_block_to_sf, a)
+#define trace_xfs_dir2_block_lookup(a)	xfs_probe(xfs_dir2_block_lookup, a)
+#define trace_xfs_dir2_block_removename(a)	xfs_probe(xfs_dir2_block_removename, a)
+#define trace_xfs_dir2_block_replace(a)	xfs_probe(xfs_dir2_block_replace, a)
+
+#define trace_xfs_dir2_leafn_add(a,b)	xfs_probe(xfs_dir2_leafn_add, a,b)
+#define trace_xfs_dir2_leafn_remove(a,b)	xfs_probe(xfs_dir2_leafn_remove, a,b)
+#define trace_xfs_dir2_leafn_moveents(a,b,c,d)	xfs_probe(xfs_dir2_leafn_moveents, a,b,c,d)
+
+#define trace_xfs_dir2_node_to_leaf(a)	xfs_probe(xfs_dir2_node_to_leaf, a)
+#define trace_xfs_dir2_node_addname(a)	xfs_probe(xfs_dir2_node_addname, a)
+#define trace_xfs_dir2_node_lookup(a)	xfs_probe(xfs_dir2_node_lookup, a)
+#define trace_xfs_dir2_node_removename(a)	xfs_probe(xfs_dir2_node_removename, a)
+#define trace_xfs_dir2_node_replace(a)	xfs_probe(xfs_dir2_node_replace, a)
+
+#define trace_xfs_dir2_sf_to_block(a)	xfs_probe(xfs_dir2_sf_to_block, a)
+#define trace_xfs_dir2_sf_addname(a)	xfs_probe(xfs_dir2_sf_addname, a)
+#define trace_xfs_dir2_sf_create(a)	xfs_probe(xfs_dir2_sf_create, a)
+#define trace_xfs_dir2_sf_lookup(a)	xfs_probe(xfs_dir2_sf_lookup, a)
+#define trace_xfs_dir2_sf_removename(a)	xfs_probe(xfs_dir2_sf_removename, a)
+#define trace_xfs_dir2_sf_replace(a)	xfs_probe(xfs_dir2_sf_replace, a)
+#define trace_xfs_dir2_sf_toino4(a)	xfs_probe(xfs_dir2_sf_toino4, a)
+#define trace_xfs_dir2_sf_toino8(a)	xfs_probe(xfs_dir2_sf_toino8, a)
+
+#define trace_xfs_da_node_create(a)		xfs_probe(xfs_da_node_create, a)
+#define trace_xfs_da_split(a)			xfs_probe(xfs_da_split, a)
+#define trace_xfs_attr_leaf_split_before(a)	xfs_probe(xfs_attr_leaf_split_before, a)
+#define trace_xfs_attr_leaf_split_after(a)	xfs_probe(xfs_attr_leaf_split_after, a)
+#define trace_xfs_da_root_split(a)		xfs_probe(xfs_da_root_split, a)
+#define trace_xfs_da_node_split(a)		xfs_probe(xfs_da_node_split, a)
+#define trace_xfs_da_node_rebalance(a)		xfs_probe(xfs_da_node_rebalance, a)
+#define trace_xfs_da_node_add(a)		xfs_probe(xfs_da_node_add, a)
+#define trace_xfs_da_join(a)			xfs_probe(xfs_da_join, a)
+#define trace_xfs_da_root_join(a)		xfs_probe(xfs_da_root_join, a)
+#define trace_xfs_da_node_toosmall(a)		xfs_probe(xfs_da_node_toosmall, a)
+#define trace_xfs_da_fixhashpath(a)		xfs_probe(xfs_da_fixhashpath, a)
+#define trace_xfs_da_node_remove(a)		xfs_probe(xfs_da_node_remove, a)
+#define trace_xfs_da_node_unbalance(a)		xfs_probe(xfs_da_node_unbalance, a)
+#define trace_xfs_da_link_before(a)		xfs_probe(xfs_da_link_before, a)
+#define trace_xfs_da_link_after(a)		xfs_probe(xfs_da_link_after, a)
+#define trace_xfs_da_unlink_back(a)		xfs_probe(xfs_da_unlink_back, a)
+#define trace_xfs_da_unlink_forward(a)		xfs_probe(xfs_da_unlink_forward, a)
+#define trace_xfs_da_path_shift(a)		xfs_probe(xfs_da_path_shift, a)
+#define trace_xfs_da_grow_inode(a)		xfs_probe(xfs_da_grow_inode, a)
+#define trace_xfs_da_swap_lastblock(a)		xfs_probe(xfs_da_swap_lastblock, a)
+#define trace_xfs_da_shrink_inode(a)		xfs_probe(xfs_da_shrink_inode, a)
+
+#define trace_xfs_attr_sf_create(a)		xfs_probe(xfs_attr_sf_create, a)
+#define trace_xfs_attr_sf_add(a)		xfs_probe(xfs_attr_sf_add, a)
+#define trace_xfs_attr_sf_remove(a)		xfs_probe(xfs_attr_sf_remove, a)
+#define trace_xfs_attr_sf_lookup(a)		xfs_probe(xfs_attr_sf_lookup, a)
+#define trace_xfs_attr_sf_to_leaf(a)		xfs_probe(xfs_attr_sf_to_leaf, a)
+#define trace_xfs_attr_leaf_to_sf(a)		xfs_probe(xfs_attr_leaf_to_sf, a)
+#define trace_xfs_attr_leaf_to_node(a)		xfs_probe(xfs_attr_leaf_to_node, a)
+#define trace_xfs_attr_leaf_create(a)		xfs_probe(xfs_attr_leaf_create, a)
+#define trace_xfs_attr_leaf_split(a)		xfs_probe(xfs_attr_leaf_split, a)
+#define trace_xfs_attr_leaf_add_old(a)		xfs_probe(xfs_attr_leaf_add_old, a)
+#define trace_xfs_attr_leaf_add_new(a)		xfs_probe(xfs_attr_leaf_add_new, a)
+#define trace_xfs_attr_leaf_add(a)		xfs_probe(xfs_attr_leaf_add, a)
+#define trace_xfs_attr_leaf_add_work(a)		xfs_probe(xfs_attr_leaf_add_work, a)
+#define trace_xfs_attr_leaf_compact(a)		xfs_probe(xfs_attr_leaf_compact, a)
+#define trace_xfs_attr_leaf_rebalance(a)	xfs_probe(xfs_attr_leaf_rebalance, a)
+#define trace_xfs_attr_leaf_toosmall(a)		xfs_probe(xfs_attr_leaf_toosmall, a)
+#define trace_xfs_attr_leaf_remove(a)		xfs_probe(xfs_attr_leaf_remove, a)
+#define trace_xfs_attr_leaf_unbalance(a)	xfs_probe(xfs_attr_leaf_unbalance, a)
+#define trace_xfs_attr_leaf_lookup(a)		xfs_probe(xfs_attr_leaf_lookup, a)
+#define trace_xfs_attr_leaf_clearflag(a)	xfs_probe(xfs_attr_leaf_clearflag, a)
+#define trace_xfs_attr_leaf_setflag(a)		xfs_probe(xfs_attr_leaf_setflag, a)
+#define trace_xfs_attr_leaf_flipflags(a)	xfs_probe(xfs_attr_leaf_flipflags, a)
+
+#define trace_xfs_attr_sf_addname(a)		xfs_probe(xfs_attr_sf_addname, a)
+#define trace_xfs_attr_leaf_addname(a)		xfs_probe(xfs_attr_leaf_addname, a)
+#define trace_xfs_attr_leaf_replace(a)		xfs_probe(xfs_attr_leaf_replace, a)
+#define trace_xfs_attr_leaf_removename(a)	xfs_probe(xfs_attr_leaf_removename, a)
+#define trace_xfs_attr_leaf_get(a)		xfs_probe(xfs_attr_leaf_get, a)
+#define trace_xfs_attr_node_addname(a)		xfs_probe(xfs_attr_node_addname, a)
+#define trace_xfs_attr_node_replace(a)		xfs_probe(xfs_attr_node_replace, a)
+#define trace_xfs_attr_node_removename(a)	xfs_probe(xfs_attr_node_removename, a)
+#define trace_xfs_attr_fillstate(a)		xfs_probe(xfs_attr_fillstate, a)
+#define trace_xfs_attr_refillstate(a)		xfs_probe(xfs_attr_refillstate, a)
+#define trace_xfs_attr_node_get(a)		xfs_probe(xfs_attr_node_get, a)
+#define trace_xfs_attr_rmtval_get(a)		xfs_probe(xfs_attr_rmtval_get, a)
+#define trace_xfs_attr_rmtval_set(a)		xfs_probe(xfs_attr_rmtval_set, a)
+#define trace_xfs_attr_rmtval_remove(a)		xfs_probe(xfs_attr_rmtval_remove, a)
+
+#define trace_xfs_bmap_pre_update(a,b,c,d)	xfs_probe(xfs_bmap_pre_update, a,b,c,d)
+#define trace_xfs_bmap_post_update(a,b,c,d)	xfs_probe(xfs_bmap_post_update, a,b,c,d)
+#define trace_xfs_bunmap(a,b,c,d,e)		xfs_probe(xfs_bunmap, a,b,c,d,e)
+#define trace_xfs_read_extent(a,b,c,d)		xfs_probe(xfs_read_extent, a,b,c,d)
 
 /* set c = c to avoid unused var warnings */
-#define trace_xfs_write_extent(a,b,c,d)	((c) = (c))
-#define trace_xfs_perag_get(a,b,c,d)	((c) = (c))
-#define trace_xfs_perag_get_tag(a,b,c,d) ((c) = (c))
-#define trace_xfs_perag_put(a,b,c,d)	((c) = (c))
-
-#define trace_xfs_trans_alloc(a,b)		((void) 0)
-#define trace_xfs_trans_cancel(a,b)		((void) 0)
-#define trace_xfs_trans_brelse(a)		((void) 0)
-#define trace_xfs_trans_binval(a)		((void) 0)
-#define trace_xfs_trans_bjoin(a)		((void) 0)
-#define trace_xfs_trans_bhold(a)		((void) 0)
-#define trace_xfs_trans_bhold_release(a)	((void) 0)
-#define trace_xfs_trans_get_buf(a)		((void) 0)
-#define trace_xfs_trans_get_buf_recur(a)	((void) 0)
-#define trace_xfs_trans_log_buf(a)		((void) 0)
-#define trace_xfs_trans_getsb_recur(a)		((void) 0)
-#define trace_xfs_trans_getsb(a)		((void) 0)
-#define trace_xfs_trans_read_buf_recur(a)	((void) 0)
-#define trace_xfs_trans_read_buf(a)		((void) 0)
-#define trace_xfs_trans_commit(a,b)		((void) 0)
-
-#define trace_xfs_defer_cancel(a,b)		((void) 0)
-#define trace_xfs_defer_pending_commit(a,b)	((void) 0)
-#define trace_xfs_defer_pending_abort(a,b)	((void) 0)
-#define trace_xfs_defer_pending_finish(a,b)	((void) 0)
-#define trace_xfs_defer_trans_abort(a,b)	((void) 0)
-#define trace_xfs_defer_trans_roll(a,b)		((void) 0)
-#define trace_xfs_defer_trans_roll_error(a,b)	((void) 0)
-#define trace_xfs_defer_finish(a,b)		((void) 0)
-#define trace_xfs_defer_finish_error(a,b)	((void) 0)
-#define trace_xfs_defer_finish_done(a,b)	((void) 0)
-#define trace_xfs_defer_cancel_list(a,b)	((void) 0)
-#define trace_xfs_defer_create_intent(a,b)	((void) 0)
-
-#define trace_xfs_bmap_free_defer(...)		((void) 0)
-#define trace_xfs_bmap_free_deferred(...)	((void) 0)
-
-#define trace_xfs_rmap_map(...)			((void) 0)
-#define trace_xfs_rmap_map_error(...)		((void) 0)
-#define trace_xfs_rmap_map_done(...)		((void) 0)
-#define trace_xfs_rmap_unmap(...)		((void) 0)
-#define trace_xfs_rmap_unmap_error(...)		((void) 0)
-#define trace_xfs_rmap_unmap_done(...)		((void) 0)
-#define trace_xfs_rmap_insert(...)		((void) 0)
-#define trace_xfs_rmap_insert_error(...)	((void) 0)
-#define trace_xfs_rmap_delete(...)		((void) 0)
-#define trace_xfs_rmap_convert(...)		((void) 0)
-#define trace_xfs_rmap_convert_state(...)	((void) 0)
-#define trace_xfs_rmap_convert_done(...)	((void) 0)
-#define trace_xfs_rmap_convert_error(...)	((void) 0)
-#define trace_xfs_rmap_update(...)		((void) 0)
-#define trace_xfs_rmap_update_error(...)	((void) 0)
-#define trace_xfs_rmap_defer(...)		((void) 0)
-#define trace_xfs_rmap_deferred(...)		((void) 0)
-#define trace_xfs_rmap_find_right_neighbor_result(...)	((void) 0)
-#define trace_xfs_rmap_find_left_neighbor_result(...)	((void) 0)
-#define trace_xfs_rmap_lookup_le_range_result(...)	((void) 0)
-
-#define trace_xfs_rmapbt_free_block(...)	((void) 0)
-#define trace_xfs_rmapbt_alloc_block(...)	((void) 0)
-
-#define trace_xfs_ag_resv_critical(...)		((void) 0)
-#define trace_xfs_ag_resv_needed(...)		((void) 0)
-#define trace_xfs_ag_resv_free(...)		((void) 0)
-#define trace_xfs_ag_resv_free_error(...)	((void) 0)
-#define trace_xfs_ag_resv_init(...)		((void) 0)
-#define trace_xfs_ag_resv_init_error(...)	((void) 0)
-#define trace_xfs_ag_resv_alloc_extent(...)	((void) 0)
-#define trace_xfs_ag_resv_free_extent(...)	((void) 0)
-
-#define trace_xfs_refcount_lookup(...)		((void) 0)
-#define trace_xfs_refcount_get(...)		((void) 0)
-#define trace_xfs_refcount_update(...)		((void) 0)
-#define trace_xfs_refcount_update_error(...)	((void) 0)
-#define trace_xfs_refcount_insert(...)		((void) 0)
-#define trace_xfs_refcount_insert_error(...)	((void) 0)
-#define trace_xfs_refcount_delete(...)		((void) 0)
-#define trace_xfs_refcount_delete_error(...)	((void) 0)
-#define trace_xfs_refcountbt_free_block(...)	((void) 0)
-#define trace_xfs_refcountbt_alloc_block(...)	((void) 0)
-#define trace_xfs_refcount_rec_order_error(...)	((void) 0)
-
-#define trace_xfs_refcount_lookup(...)		((void) 0)
-#define trace_xfs_refcount_get(...)		((void) 0)
-#define trace_xfs_refcount_update(...)		((void) 0)
-#define trace_xfs_refcount_update_error(...)	((void) 0)
-#define trace_xfs_refcount_insert(...)		((void) 0)
-#define trace_xfs_refcount_insert_error(...)	((void) 0)
-#define trace_xfs_refcount_delete(...)		((void) 0)
-#define trace_xfs_refcount_delete_error(...)	((void) 0)
-#define trace_xfs_refcountbt_free_block(...)	((void) 0)
-#define trace_xfs_refcountbt_alloc_block(...)	((void) 0)
-#define trace_xfs_refcount_rec_order_error(...)	((void) 0)
-#define trace_xfs_refcount_split_extent(...)	((void) 0)
-#define trace_xfs_refcount_split_extent_error(...)		((void) 0)
-#define trace_xfs_refcount_merge_center_extents_error(...)	((void) 0)
-#define trace_xfs_refcount_merge_left_extent_error(...)		((void) 0)
-#define trace_xfs_refcount_merge_right_extent_error(...)	((void) 0)
-#define trace_xfs_refcount_find_left_extent(...)	((void) 0)
-#define trace_xfs_refcount_find_left_extent_error(...)	((void) 0)
-#define trace_xfs_refcount_find_right_extent(...)	((void) 0)
-#define trace_xfs_refcount_find_right_extent_error(...)	((void) 0)
-#define trace_xfs_refcount_merge_center_extents(...)	((void) 0)
-#define trace_xfs_refcount_merge_left_extent(...)	((void) 0)
-#define trace_xfs_refcount_merge_right_extent(...)	((void) 0)
-#define trace_xfs_refcount_modify_extent(...)		((void) 0)
-#define trace_xfs_refcount_modify_extent_error(...)	((void) 0)
-#define trace_xfs_refcount_adjust_error(...)		((void) 0)
-#define trace_xfs_refcount_increase(...)		((void) 0)
-#define trace_xfs_refcount_decrease(...)		((void) 0)
-#define trace_xfs_refcount_deferred(...)		((void) 0)
-#define trace_xfs_refcount_defer(...)			((void) 0)
-#define trace_xfs_refcount_finish_one_leftover(...)	((void) 0)
-#define trace_xfs_refcount_find_shared(...)		((void) 0)
-#define trace_xfs_refcount_find_shared_result(...)	((void) 0)
-#define trace_xfs_refcount_find_shared_error(...)	((void) 0)
-
-#define trace_xfs_bmap_remap_alloc(...)		((void) 0)
-#define trace_xfs_bmap_deferred(...)		((void) 0)
-#define trace_xfs_bmap_defer(...)		((void) 0)
-
-#define trace_xfs_refcount_adjust_cow_error(...)	((void) 0)
-#define trace_xfs_refcount_cow_increase(...)	((void) 0)
-#define trace_xfs_refcount_cow_decrease(...)	((void) 0)
-#define trace_xfs_refcount_recover_extent(...)	((void) 0)
-
-#define trace_xfs_rmap_find_left_neighbor_candidate(...)	((void) 0)
-#define trace_xfs_rmap_find_left_neighbor_query(...)	((void) 0)
-#define trace_xfs_rmap_find_left_neighbor_result(...)	((void) 0)
-#define trace_xfs_rmap_lookup_le_range_candidate(...)	((void) 0)
-#define trace_xfs_rmap_lookup_le_range(...)	((void) 0)
-#define trace_xfs_rmap_unmap(...)		((void) 0)
-#define trace_xfs_rmap_unmap_done(...)		((void) 0)
-#define trace_xfs_rmap_unmap_error(...)		((void) 0)
-#define trace_xfs_rmap_map(...)			((void) 0)
-#define trace_xfs_rmap_map_done(...)		((void) 0)
-#define trace_xfs_rmap_map_error(...)		((void) 0)
-#define trace_xfs_rmap_delete_error(...)	((void) 0)
-
-#define trace_xfs_fs_mark_healthy(a,b)		((void) 0)
+#define trace_xfs_write_extent(a,b,c,d)	do { (c) = (c); xfs_probe(xfs_write_extent, a,b,c,d); } while (0)
+#define trace_xfs_perag_get(a,b,c,d)	do { (c) = (c); xfs_probe(xfs_perag_get, a,b,c,d); } while (0)
+#define trace_xfs_perag_get_tag(a,b,c,d) do { (c) = (c); xfs_probe(xfs_perag_get_tag, a,b,c,d); } while (0)
+#define trace_xfs_perag_put(a,b,c,d)	do { (c) = (c); xfs_probe(xfs_perag_put, a,b,c,d); } while (0)
+
+#define trace_xfs_trans_alloc(a,b)		xfs_probe(xfs_trans_alloc, a,b)
+#define trace_xfs_trans_cancel(a,b)		xfs_probe(xfs_trans_cancel, a,b)
+#define trace_xfs_trans_brelse(a)		xfs_probe(xfs_trans_brelse, a)
+#define trace_xfs_trans_binval(a)		xfs_probe(xfs_trans_binval, a)
+#define trace_xfs_trans_bjoin(a)		xfs_probe(xfs_trans_bjoin, a)
+#define trace_xfs_trans_bhold(a)		xfs_probe(xfs_trans_bhold, a)
+#define trace_xfs_trans_bhold_release(a)	xfs_probe(xfs_trans_bhold_release, a)
+#define trace_xfs_trans_get_buf(a)		xfs_probe(xfs_trans_get_buf, a)
+#define trace_xfs_trans_get_buf_recur(a)	xfs_probe(xfs_trans_get_buf_recur, a)
+#define trace_xfs_trans_log_buf(a)		xfs_probe(xfs_trans_log_buf, a)
+#define trace_xfs_trans_getsb_recur(a)		xfs_probe(xfs_trans_getsb_recur, a)
+#define trace_xfs_trans_getsb(a)		xfs_probe(xfs_trans_getsb, a)
+#define trace_xfs_trans_read_buf_recur(a)	xfs_probe(xfs_trans_read_buf_recur, a)
+#define trace_xfs_trans_read_buf(a)		xfs_probe(xfs_trans_read_buf, a)
+#define trace_xfs_trans_commit(a,b)		xfs_probe(xfs_trans_commit, a,b)
+
+#define trace_xfs_defer_cancel(a,b)		xfs_probe(xfs_defer_cancel, a,b)
+#define trace_xfs_defer_pending_commit(a,b)	xfs_probe(xfs_defer_pending_commit, a,b)
+#define trace_xfs_defer_pending_abort(a,b)	xfs_probe(xfs_defer_pending_abort, a,b)
+#define trace_xfs_defer_pending_finish(a,b)	xfs_probe(xfs_defer_pending_finish, a,b)
+#define trace_xfs_defer_trans_abort(a,b)	xfs_probe(xfs_defer_trans_abort, a,b)
+#define trace_xfs_defer_trans_roll(a,b)		xfs_probe(xfs_defer_trans_roll, a,b)
+#define trace_xfs_defer_trans_roll_error(a,b)	xfs_probe(xfs_defer_trans_roll_error, a,b)
+#define trace_xfs_defer_finish(a,b)		xfs_probe(xfs_defer_finish, a,b)
+#define trace_xfs_defer_finish_error(a,b)	xfs_probe(xfs_defer_finish_error, a,b)
+#define trace_xfs_defer_finish_done(a,b)	xfs_probe(xfs_defer_finish_done, a,b)
+#define trace_xfs_defer_cancel_list(a,b)	xfs_probe(xfs_defer_cancel_list, a,b)
+#define trace_xfs_defer_create_intent(a,b)	xfs_probe(xfs_defer_create_intent, a,b)
+
+#define trace_xfs_bmap_free_defer(...)		xfs_probe(xfs_bmap_free_defer, __VA_ARGS__)
+#define trace_xfs_bmap_free_deferred(...)	xfs_probe(xfs_bmap_free_deferred, __VA_ARGS__)
+
+#define trace_xfs_rmap_map(...)			xfs_probe(xfs_rmap_map, __VA_ARGS__)
+#define trace_xfs_rmap_map_error(...)		xfs_probe(xfs_rmap_map_error, __VA_ARGS__)
+#define trace_xfs_rmap_map_done(...)		xfs_probe(xfs_rmap_map_done, __VA_ARGS__)
+#define trace_xfs_rmap_unmap(...)		xfs_probe(xfs_rmap_unmap, __VA_ARGS__)
+#define trace_xfs_rmap_unmap_error(...)		xfs_probe(xfs_rmap_unmap_error, __VA_ARGS__)
+#define trace_xfs_rmap_unmap_done(...)		xfs_probe(xfs_rmap_unmap_done, __VA_ARGS__)
+#define trace_xfs_rmap_insert(...)		xfs_probe(xfs_rmap_insert, __VA_ARGS__)
+#define trace_xfs_rmap_insert_error(...)	xfs_probe(xfs_rmap_insert_error, __VA_ARGS__)
+#define trace_xfs_rmap_delete(...)		xfs_probe(xfs_rmap_delete, __VA_ARGS__)
+#define trace_xfs_rmap_convert(...)		xfs_probe(xfs_rmap_convert, __VA_ARGS__)
+#define trace_xfs_rmap_convert_state(...)	xfs_probe(xfs_rmap_convert_state, __VA_ARGS__)
+#define trace_xfs_rmap_convert_done(...)	xfs_probe(xfs_rmap_convert_done, __VA_ARGS__)
+#define trace_xfs_rmap_convert_error(...)	xfs_probe(xfs_rmap_convert_error, __VA_ARGS__)
+#define trace_xfs_rmap_update(...)		xfs_probe(xfs_rmap_update, __VA_ARGS__)
+#define trace_xfs_rmap_update_error(...)	xfs_probe(xfs_rmap_update_error, __VA_ARGS__)
+#define trace_xfs_rmap_defer(...)		xfs_probe(xfs_rmap_defer, __VA_ARGS__)
+#define trace_xfs_rmap_deferred(...)		xfs_probe(xfs_rmap_deferred, __VA_ARGS__)
+#define trace_xfs_rmap_find_right_neighbor_result(...)	xfs_probe(xfs_rmap_find_right_neighbor_result, __VA_ARGS__)
+#define trace_xfs_rmap_find_left_neighbor_result(...)	xfs_probe(xfs_rmap_find_left_neighbor_result, __VA_ARGS__)
+#define trace_xfs_rmap_lookup_le_range_result(...)	xfs_probe(xfs_rmap_lookup_le_range_result, __VA_ARGS__)
+
+#define trace_xfs_rmapbt_free_block(...)	xfs_probe(xfs_rmapbt_free_block, __VA_ARGS__)
+#define trace_xfs_rmapbt_alloc_block(...)	xfs_probe(xfs_rmapbt_alloc_block, __VA_ARGS__)
+
+#define trace_xfs_ag_resv_critical(...)		xfs_probe(xfs_ag_resv_critical, __VA_ARGS__)
+#define trace_xfs_ag_resv_needed(...)		xfs_probe(xfs_ag_resv_needed, __VA_ARGS__)
+#define trace_xfs_ag_resv_free(...)		xfs_probe(xfs_ag_resv_free, __VA_ARGS__)
+#define trace_xfs_ag_resv_free_error(...)	xfs_probe(xfs_ag_resv_free_error, __VA_ARGS__)
+#define trace_xfs_ag_resv_init(...)		xfs_probe(xfs_ag_resv_init, __VA_ARGS__)
+#define trace_xfs_ag_resv_init_error(...)	xfs_probe(xfs_ag_resv_init_error, __VA_ARGS__)
+#define trace_xfs_ag_resv_alloc_extent(...)	xfs_probe(xfs_ag_resv_alloc_extent, __VA_ARGS__)
+#define trace_xfs_ag_resv_free_extent(...)	xfs_probe(xfs_ag_resv_free_extent, __VA_ARGS__)
+
+#define trace_xfs_refcount_lookup(...)		xfs_probe(xfs_refcount_lookup, __VA_ARGS__)
+#define trace_xfs_refcount_get(...)		xfs_probe(xfs_refcount_get, __VA_ARGS__)
+#define trace_xfs_refcount_update(...)		xfs_probe(xfs_refcount_update, __VA_ARGS__)
+#define trace_xfs_refcount_update_error(...)	xfs_probe(xfs_refcount_update_error, __VA_ARGS__)
+#define trace_xfs_refcount_insert(...)		xfs_probe(xfs_refcount_insert, __VA_ARGS__)
+#define trace_xfs_refcount_insert_error(...)	xfs_probe(xfs_refcount_insert_error, __VA_ARGS__)
+#define trace_xfs_refcount_delete(...)		xfs_probe(xfs_refcount_delete, __VA_ARGS__)
+#define trace_xfs_refcount_delete_error(...)	xfs_probe(xfs_refcount_delete_error, __VA_ARGS__)
+#define trace_xfs_refcountbt_free_block(...)	xfs_probe(xfs_refcountbt_free_block, __VA_ARGS__)
+#define trace_xfs_refcountbt_alloc_block(...)	xfs_probe(xfs_refcountbt_alloc_block, __VA_ARGS__)
+#define trace_xfs_refcount_rec_order_error(...)	xfs_probe(xfs_refcount_rec_order_error, __VA_ARGS__)
+
+#define trace_xfs_refcount_lookup(...)		xfs_probe(xfs_refcount_lookup, __VA_ARGS__)
+#define trace_xfs_refcount_get(...)		xfs_probe(xfs_refcount_get, __VA_ARGS__)
+#define trace_xfs_refcount_update(...)		xfs_probe(xfs_refcount_update, __VA_ARGS__)
+#define trace_xfs_refcount_update_error(...)	xfs_probe(xfs_refcount_update_error, __VA_ARGS__)
+#define trace_xfs_refcount_insert(...)		xfs_probe(xfs_refcount_insert, __VA_ARGS__)
+#define trace_xfs_refcount_insert_error(...)	xfs_probe(xfs_refcount_insert_error, __VA_ARGS__)
+#define trace_xfs_refcount_delete(...)		xfs_probe(xfs_refcount_delete, __VA_ARGS__)
+#define trace_xfs_refcount_delete_error(...)	xfs_probe(xfs_refcount_delete_error, __VA_ARGS__)
+#define trace_xfs_refcountbt_free_block(...)	xfs_probe(xfs_refcountbt_free_block, __VA_ARGS__)
+#define trace_xfs_refcountbt_alloc_block(...)	xfs_probe(xfs_refcountbt_alloc_block, __VA_ARGS__)
+#define trace_xfs_refcount_rec_order_error(...)	xfs_probe(xfs_refcount_rec_order_error, __VA_ARGS__)
+#define trace_xfs_refcount_split_extent(...)	xfs_probe(xfs_refcount_split_extent, __VA_ARGS__)
+#define trace_xfs_refcount_split_extent_error(...)		xfs_probe(xfs_refcount_split_extent_error, __VA_ARGS__)
+#define trace_xfs_refcount_merge_center_extents_error(...)	xfs_probe(xfs_refcount_merge_center_extents_error, __VA_ARGS__)
+#define trace_xfs_refcount_merge_left_extent_error(...)		xfs_probe(xfs_refcount_merge_left_extent_error, __VA_ARGS__)
+#define trace_xfs_refcount_merge_right_extent_error(...)	xfs_probe(xfs_refcount_merge_right_extent_error, __VA_ARGS__)
+#define trace_xfs_refcount_find_left_extent(...)	xfs_probe(xfs_refcount_find_left_extent, __VA_ARGS__)
+#define trace_xfs_refcount_find_left_extent_error(...)	xfs_probe(xfs_refcount_find_left_extent_error, __VA_ARGS__)
+#define trace_xfs_refcount_find_right_extent(...)	xfs_probe(xfs_refcount_find_right_extent, __VA_ARGS__)
+#define trace_xfs_refcount_find_right_extent_error(...)	xfs_probe(xfs_refcount_find_right_extent_error, __VA_ARGS__)
+#define trace_xfs_refcount_merge_center_extents(...)	xfs_probe(xfs_refcount_merge_center_extents, __VA_ARGS__)
+#define trace_xfs_refcount_merge_left_extent(...)	xfs_probe(xfs_refcount_merge_left_extent, __VA_ARGS__)
+#define trace_xfs_refcount_merge_right_extent(...)	xfs_probe(xfs_refcount_merge_right_extent, __VA_ARGS__)
+#define trace_xfs_refcount_modify_extent(...)		xfs_probe(xfs_refcount_modify_extent, __VA_ARGS__)
+#define trace_xfs_refcount_modify_extent_error(...)	xfs_probe(xfs_refcount_modify_extent_error, __VA_ARGS__)
+#define trace_xfs_refcount_adjust_error(...)		xfs_probe(xfs_refcount_adjust_error, __VA_ARGS__)
+#define trace_xfs_refcount_increase(...)		xfs_probe(xfs_refcount_increase, __VA_ARGS__)
+#define trace_xfs_refcount_decrease(...)		xfs_probe(xfs_refcount_decrease, __VA_ARGS__)
+#define trace_xfs_refcount_deferred(...)		xfs_probe(xfs_refcount_deferred, __VA_ARGS__)
+#define trace_xfs_refcount_defer(...)			xfs_probe(xfs_refcount_defer, __VA_ARGS__)
+#define trace_xfs_refcount_finish_one_leftover(...)	xfs_probe(xfs_refcount_finish_one_leftover, __VA_ARGS__)
+#define trace_xfs_refcount_find_shared(...)		xfs_probe(xfs_refcount_find_shared, __VA_ARGS__)
+#define trace_xfs_refcount_find_shared_result(...)	xfs_probe(xfs_refcount_find_shared_result, __VA_ARGS__)
+#define trace_xfs_refcount_find_shared_error(...)	xfs_probe(xfs_refcount_find_shared_error, __VA_ARGS__)
+
+#define trace_xfs_bmap_remap_alloc(...)		xfs_probe(xfs_bmap_remap_alloc, __VA_ARGS__)
+#define trace_xfs_bmap_deferred(...)		xfs_probe(xfs_bmap_deferred, __VA_ARGS__)
+#define trace_xfs_bmap_defer(...)		xfs_probe(xfs_bmap_defer, __VA_ARGS__)
+
+#define trace_xfs_refcount_adjust_cow_error(...)	xfs_probe(xfs_refcount_adjust_cow_error, __VA_ARGS__)
+#define trace_xfs_refcount_cow_increase(...)	xfs_probe(xfs_refcount_cow_increase, __VA_ARGS__)
+#define trace_xfs_refcount_cow_decrease(...)	xfs_probe(xfs_refcount_cow_decrease, __VA_ARGS__)
+#define trace_xfs_refcount_recover_extent(...)	xfs_probe(xfs_refcount_recover_extent, __VA_ARGS__)
+
+#define trace_xfs_rmap_find_left_neighbor_candidate(...)	xfs_probe(xfs_rmap_find_left_neighbor_candidate, __VA_ARGS__)
+#define trace_xfs_rmap_find_left_neighbor_query(...)	xfs_probe(xfs_rmap_find_left_neighbor_query, __VA_ARGS__)
+#define trace_xfs_rmap_find_left_neighbor_result(...)	xfs_probe(xfs_rmap_find_left_neighbor_result, __VA_ARGS__)
+#define trace_xfs_rmap_lookup_le_range_candidate(...)	xfs_probe(xfs_rmap_lookup_le_range_candidate, __VA_ARGS__)
+#define trace_xfs_rmap_lookup_le_range(...)	xfs_probe(xfs_rmap_lookup_le_range, __VA_ARGS__)
+#define trace_xfs_rmap_unmap(...)		xfs_probe(xfs_rmap_unmap, __VA_ARGS__)
+#define trace_xfs_rmap_unmap_done(...)		xfs_probe(xfs_rmap_unmap_done, __VA_ARGS__)
+#define trace_xfs_rmap_unmap_error(...)		xfs_probe(xfs_rmap_unmap_error, __VA_ARGS__)
+#define trace_xfs_rmap_map(...)			xfs_probe(xfs_rmap_map, __VA_ARGS__)
+#define trace_xfs_rmap_map_done(...)		xfs_probe(xfs_rmap_map_done, __VA_ARGS__)
+#define trace_xfs_rmap_map_error(...)		xfs_probe(xfs_rmap_map_error, __VA_ARGS__)
+#define trace_xfs_rmap_delete_error(...)	xfs_probe(xfs_rmap_delete_error, __VA_ARGS__)
+
+#define trace_xfs_fs_mark_healthy(a,b)		xfs_probe(xfs_fs_mark_healthy, a,b)
 
 /* set c = c to avoid unused var warnings */
-#define trace_xfs_perag_get(a,b,c,d)		((c) = (c))
-#define trace_xfs_perag_get_tag(a,b,c,d)	((c) = (c))
-#define trace_xfs_perag_put(a,b,c,d)		((c) = (c))
+#define trace_xfs_perag_get(a,b,c,d)		do { (c) = (c); xfs_probe(xfs_perag_get, a,b,c,d); } while (0)
+#define trace_xfs_perag_get_tag(a,b,c,d)	do { (c) = (c); xfs_probe(xfs_perag_get_tag, a,b,c,d); } while (0)
+#define trace_xfs_perag_put(a,b,c,d)		do { (c) = (c); xfs_probe(xfs_perag_put, a,b,c,d); } while (0)
+
+/* libxfs's buffer cache and I/O, which the kernel doesn't share */
+#define trace_libxfs_cache_hit(a,b,c)		xfs_probe(libxfs_cache_hit, a,b,c)
+#define trace_libxfs_cache_miss(a,b,c)		xfs_probe(libxfs_cache_miss, a,b,c)
+#define trace_libxfs_cache_shake(a,b,c,d,e)	xfs_probe(libxfs_cache_shake, a,b,c,d,e)
+#define trace_libxfs_cache_expand(a,b)		xfs_probe(libxfs_cache_expand, a,b)
+#define trace_libxfs_buf_hit(a,b,c,d)		xfs_probe(libxfs_buf_hit, a,b,c,d)
+#define trace_libxfs_buf_miss(a,b,c)		xfs_probe(libxfs_buf_miss, a,b,c)
+#define trace_libxfs_buf_evict(a,b,c,d)		xfs_probe(libxfs_buf_evict, a,b,c,d)
+#define trace_libxfs_buftarg_io(a,b,c,d,e)	xfs_probe(libxfs_buftarg_io, a,b,c,d,e)
 
 #endif /* __TRACE_H__ */
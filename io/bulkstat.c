@@ -3,6 +3,7 @@
  * Copyright (C) 2019 Oracle.  All Rights Reserved.
  * Author: Darrick J. Wong <darrick.wong@oracle.com>
  */
+#include <pthread.h>
 #include "xfs.h"
 #include "platform_defs.h"
 #include "command.h"
@@ -68,6 +69,7 @@ bulkstat_help(void)
 "   -a <agno>  Only iterate this AG.\n"
 "   -d         Print debugging output.\n"
 "   -e <ino>   Stop after this inode.\n"
+"   -j <nr>    Scan AGs with this many threads and report the scan rate.\n"
 "   -n <nr>    Ask for this many results at once.\n"
 "   -s <ino>   Inode to start with.\n"
 "   -v <ver>   Use this version of the ioctl (1 or 5).\n"));
@@ -90,6 +92,223 @@ set_xfd_flags(
 	}
 }
 
+/*
+ * Benchmark mode for bulkstat -j and inumbers -j.
+ *
+ * Each thread claims the next unscanned AG and walks it with AG-limited
+ * requests until the kernel runs out of results, then goes back for
+ * another.  Nothing is printed per inode; instead we count what came back
+ * and time every call, and report the totals at the end.
+ */
+struct bulk_bench {
+	bool			inumbers;
+	uint32_t		batch_size;
+	pthread_mutex_t		lock;
+	uint32_t		next_ag;
+	uint32_t		end_ag;
+};
+
+struct bulk_bench_thread {
+	struct bulk_bench	*bb;
+	pthread_t		tid;
+	struct xfs_fd		xfd;
+	struct io_latency	*lat;
+	uint64_t		inodes;
+	uint64_t		records;
+	int			error;
+	const char		*what;
+};
+
+static bool
+bulk_bench_next_ag(
+	struct bulk_bench	*bb,
+	uint32_t		*agno)
+{
+	bool			ret = false;
+
+	pthread_mutex_lock(&bb->lock);
+	if (bb->next_ag <= bb->end_ag) {
+		*agno = bb->next_ag++;
+		ret = true;
+	}
+	pthread_mutex_unlock(&bb->lock);
+	return ret;
+}
+
+/* Make one call and return the number of records that came back. */
+static int
+bulk_bench_call(
+	struct bulk_bench_thread *t,
+	void			*req)
+{
+	struct xfs_bulkstat_req	*breq = req;
+	struct xfs_inumbers_req	*ireq = req;
+	uint64_t		start;
+	unsigned int		i;
+	int			ret;
+
+	start = lat_now();
+	if (t->bb->inumbers)
+		ret = -xfrog_inumbers(&t->xfd, ireq);
+	else
+		ret = -xfrog_bulkstat(&t->xfd, breq);
+	lat_record(t->lat, lat_now() - start);
+	if (ret) {
+		t->error = ret;
+		t->what = t->bb->inumbers ? "xfrog_inumbers" : "xfrog_bulkstat";
+		return 0;
+	}
+
+	if (!t->bb->inumbers) {
+		t->records += breq->hdr.ocount;
+		t->inodes += breq->hdr.ocount;
+		return breq->hdr.ocount;
+	}
+
+	t->records += ireq->hdr.ocount;
+	for (i = 0; i < ireq->hdr.ocount; i++)
+		t->inodes += ireq->inumbers[i].xi_alloccount;
+	return ireq->hdr.ocount;
+}
+
+static void *
+bulk_bench_worker(
+	void			*arg)
+{
+	struct bulk_bench_thread *t = arg;
+	struct bulk_bench	*bb = t->bb;
+	struct xfs_bulkstat_req	*breq = NULL;
+	struct xfs_inumbers_req	*ireq = NULL;
+	uint32_t		agno;
+	int			ret;
+
+	if (bb->inumbers)
+		ret = -xfrog_inumbers_alloc_req(bb->batch_size, 0, &ireq);
+	else
+		ret = -xfrog_bulkstat_alloc_req(bb->batch_size, 0, &breq);
+	if (ret) {
+		t->error = ret;
+		t->what = "alloc bulk request";
+		return NULL;
+	}
+
+	while (!t->error && bulk_bench_next_ag(bb, &agno)) {
+		if (bb->inumbers) {
+			memset(&ireq->hdr, 0, sizeof(ireq->hdr));
+			ireq->hdr.icount = bb->batch_size;
+			xfrog_inumbers_set_ag(ireq, agno);
+			while (bulk_bench_call(t, ireq) > 0)
+				;
+		} else {
+			memset(&breq->hdr, 0, sizeof(breq->hdr));
+			breq->hdr.icount = bb->batch_size;
+			xfrog_bulkstat_set_ag(breq, agno);
+			while (bulk_bench_call(t, breq) > 0)
+				;
+		}
+	}
+
+	free(ireq);
+	free(breq);
+	return NULL;
+}
+
+static void
+bulk_bench(
+	struct xfs_fd		*xfd,
+	bool			inumbers,
+	uint32_t		batch_size,
+	uint32_t		nr_threads,
+	uint32_t		start_ag,
+	uint32_t		end_ag)
+{
+	struct bulk_bench	bb = {
+		.inumbers	= inumbers,
+		.batch_size	= batch_size,
+		.next_ag	= start_ag,
+		.end_ag		= end_ag,
+	};
+	const char		*verb = inumbers ? "inumbers" : "bulkstat";
+	struct bulk_bench_thread *threads;
+	struct io_latency	*lat;
+	uint64_t		inodes = 0;
+	uint64_t		records = 0;
+	uint64_t		start;
+	double			secs;
+	uint32_t		i;
+	int			error = 0;
+
+	nr_threads = min(nr_threads, end_ag - start_ag + 1);
+	threads = calloc(nr_threads, sizeof(*threads));
+	lat = calloc(1, sizeof(*lat));
+	if (!threads || !lat) {
+		perror("calloc");
+		exitcode = 1;
+		goto out;
+	}
+	pthread_mutex_init(&bb.lock, NULL);
+
+	start = lat_now();
+	for (i = 0; i < nr_threads; i++) {
+		struct bulk_bench_thread *t = &threads[i];
+
+		/* xfrog may flip the fd to the v1 ioctls, so each gets a copy */
+		t->bb = &bb;
+		t->xfd = *xfd;
+		t->lat = calloc(1, sizeof(*t->lat));
+		if (!t->lat) {
+			error = ENOMEM;
+			break;
+		}
+		error = pthread_create(&t->tid, NULL, bulk_bench_worker, t);
+		if (error) {
+			free(t->lat);
+			t->lat = NULL;
+			break;
+		}
+	}
+	if (error) {
+		/* stop handing out AGs; the threads we have will finish up */
+		pthread_mutex_lock(&bb.lock);
+		bb.next_ag = end_ag + 1;
+		pthread_mutex_unlock(&bb.lock);
+		xfrog_perror(-error, "pthread_create");
+		exitcode = 1;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		struct bulk_bench_thread *t = &threads[i];
+
+		if (!t->lat)
+			break;
+		pthread_join(t->tid, NULL);
+		inodes += t->inodes;
+		records += t->records;
+		lat_merge(lat, t->lat);
+		free(t->lat);
+		if (t->error) {
+			xfrog_perror(t->error, t->what);
+			exitcode = 1;
+		}
+	}
+	secs = (lat_now() - start) / 1000000000.0;
+	pthread_mutex_destroy(&bb.lock);
+
+	if (inumbers)
+		printf(
+_("%s: %"PRIu64" inodes in %"PRIu64" groups, %"PRIu64" calls, %u threads\n"),
+			verb, inodes, records, lat->count, i);
+	else
+		printf(_("%s: %"PRIu64" inodes, %"PRIu64" calls, %u threads\n"),
+			verb, inodes, lat->count, i);
+	printf(_("%s: %.3f sec, %.1f inodes/sec\n"), verb, secs,
+			secs > 0 ? inodes / secs : 0.0);
+	lat_report(verb, lat, 0);
+out:
+	free(lat);
+	free(threads);
+}
+
 static int
 bulkstat_f(
 	int			argc,
@@ -102,13 +321,14 @@ bulkstat_f(
 	uint32_t		batch_size = 4096;
 	uint32_t		agno = 0;
 	uint32_t		ver = 0;
+	uint32_t		nr_threads = 0;
 	bool			has_agno = false;
 	bool			debug = false;
 	unsigned int		i;
 	int			c;
 	int			ret;
 
-	while ((c = getopt(argc, argv, "a:de:n:s:v:")) != -1) {
+	while ((c = getopt(argc, argv, "a:de:j:n:s:v:")) != -1) {
 		switch (c) {
 		case 'a':
 			agno = cvt_u32(optarg, 10);
@@ -128,6 +348,14 @@ bulkstat_f(
 				return 1;
 			}
 			break;
+		case 'j':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || nr_threads == 0) {
+				fprintf(stderr, "%s: bad thread count.\n",
+						optarg);
+				return 1;
+			}
+			break;
 		case 'n':
 			batch_size = cvt_u32(optarg, 10);
 			if (errno) {
@@ -162,6 +390,10 @@ bulkstat_f(
 		bulkstat_help();
 		return 0;
 	}
+	if (nr_threads && (startino || endino != -1ULL || debug)) {
+		fprintf(stderr, "-j cannot be used with -d, -e, or -s.\n");
+		return 1;
+	}
 
 	ret = -xfd_prepare_geometry(&xfd);
 	if (ret) {
@@ -170,6 +402,19 @@ bulkstat_f(
 		return 0;
 	}
 
+	if (nr_threads) {
+		if (has_agno && agno >= xfd.fsgeom.agcount) {
+			fprintf(stderr, "%u: no such AG.\n", agno);
+			exitcode = 1;
+			return 0;
+		}
+		set_xfd_flags(&xfd, ver);
+		bulk_bench(&xfd, false, batch_size, nr_threads,
+				has_agno ? agno : 0,
+				has_agno ? agno : xfd.fsgeom.agcount - 1);
+		return 0;
+	}
+
 	ret = -xfrog_bulkstat_alloc_req(batch_size, startino, &breq);
 	if (ret) {
 		xfrog_perror(ret, "alloc bulkreq");
@@ -341,6 +586,7 @@ inumbers_help(void)
 "   -a <agno>  Only iterate this AG.\n"
 "   -d         Print debugging output.\n"
 "   -e <ino>   Stop after this inode.\n"
+"   -j <nr>    Scan AGs with this many threads and report the scan rate.\n"
 "   -n <nr>    Ask for this many results at once.\n"
 "   -s <ino>   Inode to start with.\n"
 "   -v <ver>   Use this version of the ioctl (1 or 5).\n"));
@@ -358,13 +604,14 @@ inumbers_f(
 	uint32_t		batch_size = 4096;
 	uint32_t		agno = 0;
 	uint32_t		ver = 0;
+	uint32_t		nr_threads = 0;
 	bool			has_agno = false;
 	bool			debug = false;
 	unsigned int		i;
 	int			c;
 	int			ret;
 
-	while ((c = getopt(argc, argv, "a:de:n:s:v:")) != -1) {
+	while ((c = getopt(argc, argv, "a:de:j:n:s:v:")) != -1) {
 		switch (c) {
 		case 'a':
 			agno = cvt_u32(optarg, 10);
@@ -384,6 +631,14 @@ inumbers_f(
 				return 1;
 			}
 			break;
+		case 'j':
+			nr_threads = cvt_u32(optarg, 10);
+			if (errno || nr_threads == 0) {
+				fprintf(stderr, "%s: bad thread count.\n",
+						optarg);
+				return 1;
+			}
+			break;
 		case 'n':
 			batch_size = cvt_u32(optarg, 10);
 			if (errno) {
@@ -418,6 +673,10 @@ inumbers_f(
 		bulkstat_help();
 		return 0;
 	}
+	if (nr_threads && (startino || endino != -1ULL || debug)) {
+		fprintf(stderr, "-j cannot be used with -d, -e, or -s.\n");
+		return 1;
+	}
 
 	ret = -xfd_prepare_geometry(&xfd);
 	if (ret) {
@@ -426,6 +685,19 @@ inumbers_f(
 		return 0;
 	}
 
+	if (nr_threads) {
+		if (has_agno && agno >= xfd.fsgeom.agcount) {
+			fprintf(stderr, "%u: no such AG.\n", agno);
+			exitcode = 1;
+			return 0;
+		}
+		set_xfd_flags(&xfd, ver);
+		bulk_bench(&xfd, true, batch_size, nr_threads,
+				has_agno ? agno : 0,
+				has_agno ? agno : xfd.fsgeom.agcount - 1);
+		return 0;
+	}
+
 	ret = -xfrog_inumbers_alloc_req(batch_size, startino, &ireq);
 	if (ret) {
 		xfrog_perror(ret, "alloc inumbersreq");
@@ -497,14 +769,14 @@ void
 bulkstat_init(void)
 {
 	bulkstat_cmd.args =
-_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version]");
+_("[-a agno] [-d] [-e endino] [-j threads] [-n batchsize] [-s startino] [-v version]");
 	bulkstat_cmd.oneline = _("Bulk stat of inodes in a filesystem");
 
 	bulkstat_single_cmd.args = _("[-d] [-v version] inum...");
 	bulkstat_single_cmd.oneline = _("Stat one inode in a filesystem");
 
 	inumbers_cmd.args =
-_("[-a agno] [-d] [-e endino] [-n batchsize] [-s startino] [-v version]");
+_("[-a agno] [-d] [-e endino] [-j threads] [-n batchsize] [-s startino] [-v version]");
 	inumbers_cmd.oneline = _("Query inode groups in a filesystem");
 
 	add_command(&bulkstat_cmd);
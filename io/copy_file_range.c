@@ -3,6 +3,7 @@
  *  Copyright (c) 2016 Netapp, Inc. All rights reserved.
  */
 
+#include <pthread.h>
 #include <sys/syscall.h>
 #include <sys/uio.h>
 #include <xfs/xfs.h>
@@ -28,6 +29,9 @@ copy_range_help(void)
                           at position 0\n\
  'copy_range -f 2' - copies all bytes from open file 2 into the current open file\n\
                           at position 0\n\
+ 'copy_range -j 8 some_file' - copies all of some_file with 8 threads, each\n\
+                               doing its own block aligned piece, and\n\
+                               reports the throughput\n\
 "));
 }
 
@@ -54,6 +58,97 @@ copy_file_range_cmd(int fd, long long *src_off, long long *dst_off, size_t len)
 	return 0;
 }
 
+struct copy_piece {
+	pthread_t	tid;
+	int		fd;
+	long long	src_off;
+	long long	dst_off;
+	size_t		len;
+	long long	copied;
+	int		error;
+};
+
+static void *
+copy_piece_worker(void *arg)
+{
+	struct copy_piece *p = arg;
+	loff_t ret;
+
+	while (p->len > 0) {
+		ret = syscall(__NR_copy_file_range, p->fd, &p->src_off,
+				file->fd, &p->dst_off, p->len, 0);
+		if (ret == -1) {
+			p->error = errno;
+			break;
+		} else if (ret == 0)
+			break;
+		p->len -= ret;
+		p->copied += ret;
+	}
+	return NULL;
+}
+
+/*
+ * Split the range into nr_threads block aligned pieces and copy them all at
+ * once, then report how fast that went.  Each piece is its own stream of
+ * copy_file_range calls, so this shows how well the filesystem (or the
+ * server, for a network filesystem) copes with concurrent offloaded copies.
+ */
+static int
+copy_file_range_parallel(int fd, long long src_off, long long dst_off,
+		size_t len, int nr_threads, size_t align, int condensed)
+{
+	struct copy_piece *pieces;
+	struct timeval t1, t2;
+	long long total = 0;
+	size_t piece_len;
+	int started, i;
+	int ret = 0;
+
+	pieces = calloc(nr_threads, sizeof(*pieces));
+	if (!pieces) {
+		perror("calloc");
+		return ENOMEM;
+	}
+
+	piece_len = roundup((len + nr_threads - 1) / nr_threads, align);
+	gettimeofday(&t1, NULL);
+	for (started = 0; started < nr_threads; started++) {
+		struct copy_piece *p = &pieces[started];
+		size_t done = started * piece_len;
+
+		if (done >= len)
+			break;
+		p->fd = fd;
+		p->src_off = src_off + done;
+		p->dst_off = dst_off + done;
+		p->len = min(piece_len, len - done);
+		ret = pthread_create(&p->tid, NULL, copy_piece_worker, p);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(pieces[i].tid, NULL);
+		total += pieces[i].copied;
+		if (pieces[i].error && !ret) {
+			ret = pieces[i].error;
+			errno = ret;
+			perror("copy_range");
+		}
+	}
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+	free(pieces);
+
+	if (!ret)
+		report_io_times("copied", &t2, dst_off, len, total, started,
+				condensed);
+	return ret;
+}
+
 static off64_t
 copy_src_filesize(int fd)
 {
@@ -74,6 +169,8 @@ copy_range_f(int argc, char **argv)
 	long long llen;
 	size_t len = 0;
 	bool len_specified = false;
+	int nr_threads = 0;
+	int condensed = 0;
 	int opt;
 	int ret;
 	int fd;
@@ -83,7 +180,7 @@ copy_range_f(int argc, char **argv)
 
 	init_cvtnum(&fsblocksize, &fssectsize);
 
-	while ((opt = getopt(argc, argv, "s:d:l:f:")) != -1) {
+	while ((opt = getopt(argc, argv, "Cs:d:j:l:f:")) != -1) {
 		switch (opt) {
 		case 's':
 			src_off = cvtnum(fsblocksize, fssectsize, optarg);
@@ -101,6 +198,17 @@ copy_range_f(int argc, char **argv)
 				return 0;
 			}
 			break;
+		case 'C':
+			condensed = 1;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads <= 0) {
+				printf(_("invalid thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'l':
 			llen = cvtnum(fsblocksize, fssectsize, optarg);
 			if (llen == -1LL) {
@@ -165,7 +273,11 @@ copy_range_f(int argc, char **argv)
 			len = sz - src_off;
 	}
 
-	ret = copy_file_range_cmd(fd, &src_off, &dst_off, len);
+	if (nr_threads)
+		ret = copy_file_range_parallel(fd, src_off, dst_off, len,
+				nr_threads, fsblocksize, condensed);
+	else
+		ret = copy_file_range_cmd(fd, &src_off, &dst_off, len);
 out:
 	close(fd);
 	if (ret < 0)
@@ -179,9 +291,10 @@ copy_range_init(void)
 	copy_range_cmd.name = "copy_range";
 	copy_range_cmd.cfunc = copy_range_f;
 	copy_range_cmd.argmin = 1;
-	copy_range_cmd.argmax = 8;
+	copy_range_cmd.argmax = 11;
 	copy_range_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	copy_range_cmd.args = _("[-s src_off] [-d dst_off] [-l len] src_file | -f N");
+	copy_range_cmd.args =
+_("[-C] [-j threads] [-s src_off] [-d dst_off] [-l len] src_file | -f N");
 	copy_range_cmd.oneline = _("Copy a range of data between two files");
 	copy_range_cmd.help = copy_range_help;
 
@@ -10,6 +10,8 @@
 #include "io.h"
 #include "libfrog/crc32c.h"
 #include "libfrog/crc32cselftest.h"
+#include "libfrog/convert.h"
+#include <time.h>
 
 static int
 crc32cselftest_f(
@@ -19,6 +21,183 @@ crc32cselftest_f(
 	return crc32c_test(0) != 0;
 }
 
+static cmdinfo_t crc32cbench_cmd;
+
+static void
+crc32cbench_help(void)
+{
+	printf(_(
+"\n"
+" benchmark the crc32c implementations\n"
+"\n"
+" Measures the throughput of every crc32c implementation that this machine\n"
+" can run, for block sizes from 512 bytes to 64KiB.  Each size is measured\n"
+" once checksumming the same block over and over, and once checksumming a\n"
+" batch of separately allocated blocks with the multi-buffer interface,\n"
+" which is what writing back a run of metadata buffers looks like.\n"
+"\n"
+" -n nr    -- number of blocks in a batch (default 16)\n"
+" -t msec  -- how long to run each measurement (default 100)\n"
+"\n"));
+}
+
+static inline double
+crc32cbench_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Checksum @nr buffers of @len bytes until @secs have gone by and return the
+ * throughput in GB/s.  A batch of more than one buffer is checksummed with
+ * a single multi-buffer call.
+ */
+static double
+crc32cbench_run(
+	const struct crc32c_impl	*impl,
+	unsigned char			**bufs,
+	uint32_t			*crcs,
+	size_t				*lens,
+	unsigned int			nr,
+	size_t				len,
+	double				secs)
+{
+	static uint32_t			crc;	/* don't let it be optimized out */
+	unsigned long long		bytes = 0;
+	double				start, elapsed;
+	unsigned int			i;
+
+	for (i = 0; i < nr; i++)
+		lens[i] = len;
+
+	start = crc32cbench_now();
+	do {
+		if (nr == 1) {
+			crc ^= impl->fn(~0U, bufs[0], len);
+		} else {
+			for (i = 0; i < nr; i++)
+				crcs[i] = ~0U;
+			impl->multi(crcs, (unsigned char const * const *)bufs,
+					lens, nr);
+			crc ^= crcs[0];
+		}
+		bytes += (unsigned long long)nr * len;
+		elapsed = crc32cbench_now() - start;
+	} while (elapsed < secs);
+
+	return bytes / elapsed / 1000000000.0;
+}
+
+#define CRC32CBENCH_MIN_SHIFT	9
+#define CRC32CBENCH_MAX_SHIFT	16
+
+static int
+crc32cbench_f(
+	int				argc,
+	char				**argv)
+{
+	const struct crc32c_impl	*impl;
+	unsigned char			**bufs;
+	uint32_t			*crcs = NULL;
+	size_t				*lens = NULL;
+	uint32_t			nr = 16;
+	uint32_t			msec = 100;
+	unsigned int			idx, i;
+	int				shift;
+	int				c;
+
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			nr = cvt_u32(optarg, 10);
+			if (errno) {
+				perror(optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 't':
+			msec = cvt_u32(optarg, 10);
+			if (errno) {
+				perror(optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		default:
+			return command_usage(&crc32cbench_cmd);
+		}
+	}
+	if (optind != argc || nr == 0 || msec == 0)
+		return command_usage(&crc32cbench_cmd);
+
+	bufs = calloc(nr, sizeof(unsigned char *));
+	if (!bufs) {
+		perror("calloc");
+		exitcode = 1;
+		return 0;
+	}
+	crcs = calloc(nr, sizeof(uint32_t));
+	lens = calloc(nr, sizeof(size_t));
+	if (!crcs || !lens) {
+		perror("calloc");
+		exitcode = 1;
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		bufs[i] = memalign(getpagesize(),
+				1U << CRC32CBENCH_MAX_SHIFT);
+		if (!bufs[i]) {
+			perror("memalign");
+			exitcode = 1;
+			goto out;
+		}
+		memset(bufs[i], i + 1, 1U << CRC32CBENCH_MAX_SHIFT);
+	}
+
+	printf("%-16s %8s %12s %12s\n", _("implementation"), _("size"),
+			_("GB/s"), _("batch GB/s"));
+	for (idx = 0; (impl = crc32c_impl(idx)) != NULL; idx++) {
+		for (shift = CRC32CBENCH_MIN_SHIFT;
+		     shift <= CRC32CBENCH_MAX_SHIFT;
+		     shift++) {
+			size_t	len = 1U << shift;
+			double	single, batch;
+
+			single = crc32cbench_run(impl, bufs, crcs, lens, 1,
+					len, msec / 1000.0);
+			batch = crc32cbench_run(impl, bufs, crcs, lens, nr,
+					len, msec / 1000.0);
+			printf("%-16s %8zu %12.2f %12.2f\n", impl->name, len,
+					single, batch);
+		}
+	}
+
+out:
+	for (i = 0; i < nr; i++)
+		free(bufs[i]);
+	free(lens);
+	free(crcs);
+	free(bufs);
+	return 0;
+}
+
+static cmdinfo_t	crc32cbench_cmd = {
+	.name		= "crc32cbench",
+	.cfunc		= crc32cbench_f,
+	.argmin		= 0,
+	.argmax		= -1,
+	.canpush	= 0,
+	.args		= "[-n nr] [-t msec]",
+	.flags		= CMD_FLAG_ONESHOT | CMD_FLAG_FOREIGN_OK |
+			  CMD_NOFILE_OK | CMD_NOMAP_OK,
+	.help		= crc32cbench_help,
+	.oneline	= N_("benchmark the crc32c implementations"),
+};
+
 static const cmdinfo_t	crc32cselftest_cmd = {
 	.name		= "crc32cselftest",
 	.cfunc		= crc32cselftest_f,
@@ -34,4 +213,5 @@ void
 crc32cselftest_init(void)
 {
 	add_command(&crc32cselftest_cmd);
+	add_command(&crc32cbench_cmd);
 }
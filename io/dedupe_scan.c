@@ -0,0 +1,473 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ */
+
+#include <xfs/xfs.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
+
+/*
+ * Find and share duplicate data across a set of files.
+ *
+ * Every file is read in parallel and cut into chunks of whole blocks.  A
+ * chunk ends after a block whose hash hits a fixed bit pattern, so the
+ * boundaries follow the content and data that moved by a whole number of
+ * blocks still chunks the same way, but every chunk stays block aligned as
+ * the dedupe ioctl wants.  The chunks of all the files are then sorted by
+ * hash, and each run of equal chunks is handed to the kernel as one source
+ * with a batch of destinations.  The kernel compares the data before it
+ * shares anything, so a hash collision only costs a wasted call.
+ */
+static cmdinfo_t dedupe_scan_cmd;
+
+#define DS_BUFSIZE	(1U << 20)	/* read this much at a time */
+#define DS_MIN_BLOCKS	4		/* chunk sizes, in blocks */
+#define DS_AVG_BITS	4		/* 1 << this = average chunk */
+#define DS_MAX_BLOCKS	64
+#define DS_MAX_DESTS	64		/* destinations per ioctl */
+
+#define DS_PRIME1	0x9e3779b185ebca87ULL
+#define DS_PRIME2	0xc2b2ae3d27d4eb4fULL
+
+struct ds_chunk {
+	uint64_t	hash;
+	uint64_t	offset;
+	uint32_t	len;
+	uint32_t	file;
+};
+
+struct ds_file {
+	char		*name;
+	int		fd;
+	int		error;
+	struct ds_chunk	*chunks;
+	size_t		nr_chunks;
+	size_t		max_chunks;
+	uint64_t	bytes;
+};
+
+struct ds_ctx {
+	struct ds_file	*files;
+	unsigned int	nr_files;
+	size_t		bsize;
+};
+
+static void
+dedupe_scan_help(void)
+{
+	printf(_(
+"\n"
+" Finds duplicate data in the given files and shares it with dedupe.\n"
+"\n"
+" The files are read in parallel and split into content defined chunks of\n"
+" whole blocks, which are then matched by hash.  Every group of matching\n"
+" chunks is passed to the kernel, which checks that the contents really\n"
+" are the same before it shares the blocks.  The open file is scanned too.\n"
+"\n"
+" Example:\n"
+" 'dedupe_scan -j 8 /images/*.img'\n"
+"\n"
+" -b N -- hash in blocks of N bytes, default the filesystem block size\n"
+" -j N -- read and hash with N threads\n"
+" -n   -- only report the duplicates, don't share anything\n"
+" -q   -- don't print the summary\n"
+"\n"));
+}
+
+static inline uint64_t
+ds_rotl(
+	uint64_t	x,
+	int		r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* Fast non-cryptographic 64-bit hash of a block. */
+static uint64_t
+ds_hash_block(
+	const void	*buf,
+	size_t		len)
+{
+	const uint64_t	*p = buf;
+	const uint8_t	*tail;
+	uint64_t	h = len * DS_PRIME1;
+	size_t		i;
+
+	for (i = 0; i < len / 8; i++)
+		h = ds_rotl(h ^ (p[i] * DS_PRIME2), 31) * DS_PRIME1;
+	tail = (const uint8_t *)(p + i);
+	for (i = 0; i < len % 8; i++)
+		h = ds_rotl(h ^ (tail[i] * DS_PRIME2), 11) * DS_PRIME1;
+
+	h ^= h >> 33;
+	h *= DS_PRIME2;
+	h ^= h >> 29;
+	return h;
+}
+
+static int
+ds_add_chunk(
+	struct ds_file	*f,
+	uint32_t	file,
+	uint64_t	hash,
+	uint64_t	offset,
+	uint32_t	len)
+{
+	struct ds_chunk	*c;
+
+	if (f->nr_chunks == f->max_chunks) {
+		size_t	new_max = max(f->max_chunks * 2, (size_t)1024);
+
+		c = realloc(f->chunks, new_max * sizeof(*c));
+		if (!c)
+			return ENOMEM;
+		f->chunks = c;
+		f->max_chunks = new_max;
+	}
+	c = &f->chunks[f->nr_chunks++];
+	c->hash = hash;
+	c->offset = offset;
+	c->len = len;
+	c->file = file;
+	return 0;
+}
+
+static void
+ds_scan_file(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct ds_ctx		*ctx = wq->wq_ctx;
+	struct ds_file		*f = &ctx->files[index];
+	size_t			bsize = ctx->bsize;
+	size_t			bufsize = roundup(DS_BUFSIZE, bsize);
+	uint64_t		chunk_start = 0;
+	uint64_t		chunk_hash = 0;
+	uint64_t		off = 0;
+	unsigned int		nblocks = 0;
+	char			*buf;
+	ssize_t			ret;
+	size_t			i;
+
+	buf = memalign(pagesize, bufsize);
+	if (!buf) {
+		f->error = ENOMEM;
+		return;
+	}
+
+	while ((ret = pread(f->fd, buf, bufsize, off)) > 0) {
+		for (i = 0; i < ret; i += bsize) {
+			size_t		len = min(bsize, (size_t)ret - i);
+			uint64_t	h = ds_hash_block(buf + i, len);
+
+			chunk_hash = ds_rotl(chunk_hash, 27) ^ h;
+			chunk_hash *= DS_PRIME1;
+			nblocks++;
+
+			/* cut where the content says, or when we must */
+			if ((nblocks >= DS_MIN_BLOCKS &&
+			     (h >> 40) % (1U << DS_AVG_BITS) == 0) ||
+			    nblocks == DS_MAX_BLOCKS || len < bsize) {
+				f->error = ds_add_chunk(f, index, chunk_hash,
+						chunk_start,
+						off + i + len - chunk_start);
+				if (f->error)
+					goto out;
+				chunk_start = off + i + len;
+				chunk_hash = 0;
+				nblocks = 0;
+			}
+		}
+		off += ret;
+		/* a short read means we hit EOF */
+		if (ret < bufsize)
+			break;
+	}
+	if (ret < 0) {
+		f->error = errno;
+		goto out;
+	}
+	if (nblocks)
+		f->error = ds_add_chunk(f, index, chunk_hash, chunk_start,
+				off - chunk_start);
+	f->bytes = off;
+out:
+	free(buf);
+}
+
+static int
+ds_chunk_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct ds_chunk	*ca = a;
+	const struct ds_chunk	*cb = b;
+
+	if (ca->hash != cb->hash)
+		return ca->hash < cb->hash ? -1 : 1;
+	if (ca->len != cb->len)
+		return ca->len < cb->len ? -1 : 1;
+	if (ca->file != cb->file)
+		return ca->file < cb->file ? -1 : 1;
+	if (ca->offset != cb->offset)
+		return ca->offset < cb->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Share src with each of the dests in one call.  Returns the number of
+ * bytes deduped, and bumps *ops for every call made.
+ */
+static uint64_t
+ds_dedupe(
+	struct ds_ctx			*ctx,
+	struct xfs_extent_data		*args,
+	struct ds_chunk			*src,
+	struct ds_chunk			*dests,
+	unsigned int			nr,
+	unsigned long long		*ops)
+{
+	struct xfs_extent_data_info	*info;
+	uint64_t			deduped = 0;
+	unsigned int			i;
+
+	memset(args, 0, sizeof(*args) + nr * sizeof(*info));
+	info = (struct xfs_extent_data_info *)(args + 1);
+	args->logical_offset = src->offset;
+	args->length = src->len;
+	args->dest_count = nr;
+	for (i = 0; i < nr; i++) {
+		info[i].fd = ctx->files[dests[i].file].fd;
+		info[i].logical_offset = dests[i].offset;
+	}
+
+	(*ops)++;
+	if (ioctl(ctx->files[src->file].fd, XFS_IOC_FILE_EXTENT_SAME, args)) {
+		perror("XFS_IOC_FILE_EXTENT_SAME");
+		exitcode = 1;
+		return 0;
+	}
+	for (i = 0; i < nr; i++)
+		if (info[i].status == XFS_EXTENT_DATA_SAME)
+			deduped += info[i].bytes_deduped;
+	return deduped;
+}
+
+static void
+ds_report(
+	struct ds_ctx		*ctx,
+	uint64_t		scanned,
+	size_t			nr_chunks,
+	unsigned long long	dups,
+	uint64_t		dup_bytes,
+	uint64_t		deduped,
+	unsigned long long	ops,
+	struct timeval		*tv,
+	bool			dry_run)
+{
+	char			s1[64], s2[64], s3[64], ts[64];
+
+	timestr(tv, ts, sizeof(ts), 0);
+	cvtstr((double)scanned, s1, sizeof(s1));
+	printf(_("scanned %s in %u files, %zu chunks, %s\n"), s1,
+			ctx->nr_files, nr_chunks, ts);
+	cvtstr((double)dup_bytes, s2, sizeof(s2));
+	printf(_("found %llu duplicate chunks, %s\n"), dups, s2);
+	if (dry_run)
+		return;
+	cvtstr((double)deduped, s3, sizeof(s3));
+	printf(_("deduped %s in %llu calls\n"), s3, ops);
+}
+
+static int
+dedupe_scan_f(
+	int			argc,
+	char			**argv)
+{
+	struct ds_ctx		ctx = { 0 };
+	struct workqueue	wq;
+	struct xfs_extent_data	*args = NULL;
+	struct ds_chunk		*all = NULL;
+	struct ds_chunk		*dests = NULL;
+	struct timeval		t1, t2;
+	size_t			fsblocksize, fssectsize;
+	size_t			nr_chunks = 0;
+	size_t			i, j, k;
+	uint64_t		scanned = 0, dup_bytes = 0, deduped = 0;
+	unsigned long long	dups = 0, ops = 0;
+	long long		tmp;
+	int			nr_threads = platform_nproc();
+	bool			dry_run = false;
+	bool			quiet = false;
+	int			c, ret;
+
+	init_cvtnum(&fsblocksize, &fssectsize);
+	ctx.bsize = fsblocksize;
+	while ((c = getopt(argc, argv, "b:j:nq")) != EOF) {
+		switch (c) {
+		case 'b':
+			tmp = cvtnum(fsblocksize, fssectsize, optarg);
+			if (tmp <= 0 || tmp % fsblocksize) {
+				printf(
+		_("block size must be a multiple of %zu -- %s\n"),
+						fsblocksize, optarg);
+				exitcode = 1;
+				return 0;
+			}
+			ctx.bsize = tmp;
+			break;
+		case 'j':
+			nr_threads = cvtnum(0, 0, optarg);
+			if (nr_threads <= 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&dedupe_scan_cmd);
+		}
+	}
+
+	ctx.files = calloc(argc - optind + 1, sizeof(struct ds_file));
+	if (!ctx.files) {
+		perror("calloc");
+		exitcode = 1;
+		return 0;
+	}
+	ctx.files[0].name = file->name;
+	ctx.files[0].fd = file->fd;
+	ctx.nr_files = 1;
+	for (i = optind; i < argc; i++) {
+		struct ds_file	*f = &ctx.files[ctx.nr_files];
+
+		f->name = argv[i];
+		f->fd = openfile(argv[i], NULL, IO_READONLY, 0, NULL);
+		if (f->fd < 0) {
+			exitcode = 1;
+			goto out;
+		}
+		ctx.nr_files++;
+	}
+
+	gettimeofday(&t1, NULL);
+	ret = -workqueue_create(&wq, &ctx,
+			min(nr_threads, (int)ctx.nr_files));
+	if (ret) {
+		fprintf(stderr, _("cannot create scan threads: %s\n"),
+				strerror(ret));
+		exitcode = 1;
+		goto out;
+	}
+	for (i = 0; i < ctx.nr_files; i++) {
+		ret = -workqueue_add(&wq, ds_scan_file, i, NULL);
+		if (ret) {
+			fprintf(stderr, _("cannot queue %s: %s\n"),
+					ctx.files[i].name, strerror(ret));
+			exitcode = 1;
+			break;
+		}
+	}
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+	if (exitcode)
+		goto out;
+
+	for (i = 0; i < ctx.nr_files; i++) {
+		if (ctx.files[i].error) {
+			errno = ctx.files[i].error;
+			perror(ctx.files[i].name);
+			exitcode = 1;
+			goto out;
+		}
+		nr_chunks += ctx.files[i].nr_chunks;
+		scanned += ctx.files[i].bytes;
+	}
+
+	/* index every chunk so that the duplicates end up side by side */
+	all = malloc(max(nr_chunks, (size_t)1) * sizeof(*all));
+	dests = calloc(DS_MAX_DESTS, sizeof(*dests));
+	args = calloc(1, sizeof(struct xfs_extent_data) +
+			DS_MAX_DESTS * sizeof(struct xfs_extent_data_info));
+	if (!all || !dests || !args) {
+		perror("malloc");
+		exitcode = 1;
+		goto out;
+	}
+	for (i = 0, k = 0; i < ctx.nr_files; i++) {
+		memcpy(&all[k], ctx.files[i].chunks,
+				ctx.files[i].nr_chunks * sizeof(*all));
+		k += ctx.files[i].nr_chunks;
+		free(ctx.files[i].chunks);
+		ctx.files[i].chunks = NULL;
+	}
+	qsort(all, nr_chunks, sizeof(*all), ds_chunk_cmp);
+
+	for (i = 0; i < nr_chunks; i = j) {
+		unsigned int	nr = 0;
+
+		for (j = i + 1; j < nr_chunks &&
+				all[j].hash == all[i].hash &&
+				all[j].len == all[i].len; j++) {
+			dups++;
+			dup_bytes += all[j].len;
+			if (dry_run)
+				continue;
+			dests[nr++] = all[j];
+			if (nr == DS_MAX_DESTS) {
+				deduped += ds_dedupe(&ctx, args, &all[i],
+						dests, nr, &ops);
+				nr = 0;
+			}
+		}
+		if (nr)
+			deduped += ds_dedupe(&ctx, args, &all[i], dests, nr,
+					&ops);
+	}
+
+	gettimeofday(&t2, NULL);
+	t2 = tsub(t2, t1);
+	if (!quiet)
+		ds_report(&ctx, scanned, nr_chunks, dups, dup_bytes, deduped,
+				ops, &t2, dry_run);
+out:
+	free(args);
+	free(dests);
+	free(all);
+	for (i = 1; i < ctx.nr_files; i++)
+		close(ctx.files[i].fd);
+	for (i = 0; i < ctx.nr_files; i++)
+		free(ctx.files[i].chunks);
+	free(ctx.files);
+	return 0;
+}
+
+void
+dedupe_scan_init(void)
+{
+	dedupe_scan_cmd.name = "dedupe_scan";
+	dedupe_scan_cmd.cfunc = dedupe_scan_f;
+	dedupe_scan_cmd.argmin = 0;
+	dedupe_scan_cmd.argmax = -1;
+	dedupe_scan_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK |
+				CMD_FLAG_ONESHOT;
+	dedupe_scan_cmd.args = _("[-b bsize] [-j threads] [-nq] [file...]");
+	dedupe_scan_cmd.oneline =
+		_("finds duplicate data in files and dedupes it");
+	dedupe_scan_cmd.help = dedupe_scan_help;
+
+	add_command(&dedupe_scan_cmd);
+}
@@ -12,6 +12,7 @@
 #include "io.h"
 
 #define EXTENT_BATCH 32
+#define EXTENT_BATCH_MAX 16384
 
 static cmdinfo_t fiemap_cmd;
 static int max_extents = -1;
@@ -34,8 +35,10 @@ fiemap_help(void)
 " Holes are marked by replacing the startblock..endblock with 'hole'.\n"
 " All the file offsets and disk blocks are in units of 512-byte blocks.\n"
 " -a -- prints the attribute fork map instead of the data fork.\n"
+" -c -- prints one comma separated line per extent, in bytes, for scripts.\n"
 " -l -- also displays the length of each extent in 512-byte blocks.\n"
 " -n -- query n extents.\n"
+" -s -- prints only a summary: extent count, mean length, and holes.\n"
 " -v -- Verbose information\n"
 " offset is the starting offset to map, and is optional.  If offset is\n"
 " specified, mapping length may (optionally) be specified as well."
@@ -214,15 +217,73 @@ calc_print_format(
 	}
 }
 
+struct fiemap_summary {
+	unsigned long long	extents;
+	unsigned long long	bytes;
+	unsigned long long	holes;
+	unsigned long long	hole_bytes;
+	unsigned long long	unwritten;
+	unsigned long long	shared;
+};
+
+/*
+ * -c and -s: account for or print one extent without going through the
+ * formatted output, which is what makes big maps slow.
+ */
+static void
+fiemap_account(
+	struct fiemap_extent	*extent,
+	struct fiemap_summary	*sum,
+	bool			csv,
+	__u64			last_logical)
+{
+	if (csv) {
+		printf("%llu,%llu,%llu,0x%x\n",
+			(unsigned long long)extent->fe_logical,
+			(unsigned long long)extent->fe_physical,
+			(unsigned long long)extent->fe_length,
+			extent->fe_flags);
+		return;
+	}
+
+	if (extent->fe_logical > last_logical) {
+		sum->holes++;
+		sum->hole_bytes += extent->fe_logical - last_logical;
+	}
+	sum->extents++;
+	sum->bytes += extent->fe_length;
+	if (extent->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+		sum->unwritten++;
+	if (extent->fe_flags & FIEMAP_EXTENT_SHARED)
+		sum->shared++;
+}
+
+static void
+fiemap_print_summary(
+	struct fiemap_summary	*sum)
+{
+	printf(_("extents: %llu\n"), sum->extents);
+	printf(_("mapped: %llu bytes\n"), sum->bytes);
+	printf(_("mean extent: %llu bytes\n"),
+			sum->extents ? sum->bytes / sum->extents : 0);
+	printf(_("holes: %llu, %llu bytes\n"), sum->holes, sum->hole_bytes);
+	printf(_("unwritten: %llu\n"), sum->unwritten);
+	printf(_("shared: %llu\n"), sum->shared);
+}
+
 static int
 fiemap_f(
 	int		argc,
 	char		**argv)
 {
 	struct fiemap	*fiemap;
+	struct fiemap_summary sum = { 0 };
 	int		done = 0;
 	int		lflag = 0;
 	int		vflag = 0;
+	bool		csv = false;
+	bool		summary = false;
+	int		batch = EXTENT_BATCH;
 	int		fiemap_flags = FIEMAP_FLAG_SYNC;
 	int		c;
 	int		i;
@@ -242,14 +303,20 @@ fiemap_f(
 
 	init_cvtnum(&fsblocksize, &fssectsize);
 
-	while ((c = getopt(argc, argv, "aln:v")) != EOF) {
+	while ((c = getopt(argc, argv, "acln:sv")) != EOF) {
 		switch (c) {
 		case 'a':
 			fiemap_flags |= FIEMAP_FLAG_XATTR;
 			break;
+		case 'c':
+			csv = true;
+			break;
 		case 'l':
 			lflag = 1;
 			break;
+		case 's':
+			summary = true;
+			break;
 		case 'n':
 			max_extents = atoi(optarg);
 			break;
@@ -285,8 +352,13 @@ fiemap_f(
 		range_end = start_offset + length;
 	}
 
+	if (csv && summary) {
+		exitcode = 1;
+		return command_usage(&fiemap_cmd);
+	}
+
 	map_size = sizeof(struct fiemap) +
-		(EXTENT_BATCH * sizeof(struct fiemap_extent));
+		(batch * sizeof(struct fiemap_extent));
 	fiemap = malloc(map_size);
 	if (!fiemap) {
 		fprintf(stderr, _("%s: malloc of %d bytes failed.\n"),
@@ -295,14 +367,18 @@ fiemap_f(
 		return 0;
 	}
 
-	printf("%s:\n", file->name);
+	if (csv)
+		printf("offset,physical,length,flags\n");
+	else
+		printf("%s:\n", file->name);
 
 	while (!done) {
-		memset(fiemap, 0, map_size);
+		/* the kernel only fills in as many extents as it maps */
+		memset(fiemap, 0, sizeof(struct fiemap));
 		fiemap->fm_flags = fiemap_flags;
 		fiemap->fm_start = last_logical;
 		fiemap->fm_length = range_end - last_logical;
-		fiemap->fm_extent_count = EXTENT_BATCH;
+		fiemap->fm_extent_count = batch;
 
 		ret = ioctl(file->fd, FS_IOC_FIEMAP, (unsigned long)fiemap);
 		if (ret < 0) {
@@ -322,7 +398,11 @@ fiemap_f(
 			int num_printed = 0;
 
 			extent = &fiemap->fm_extents[i];
-			if (vflag) {
+			if (csv || summary) {
+				fiemap_account(extent, &sum, csv,
+					       last_logical);
+				num_printed = 1;
+			} else if (vflag) {
 				if (cur_extent == 0) {
 					calc_print_format(fiemap, &foff_w,
 							  &boff_w, &tot_w,
@@ -359,10 +439,35 @@ fiemap_f(
 				break;
 			}
 		}
+
+		/*
+		 * A full batch means there are likely many more extents, so
+		 * ask for twice as many next time.  Not getting the memory
+		 * just means we carry on with what we have.
+		 */
+		if (!done && fiemap->fm_mapped_extents == batch &&
+		    batch < EXTENT_BATCH_MAX) {
+			struct fiemap	*bigger;
+			int		new_size;
+
+			new_size = sizeof(struct fiemap) +
+				(2 * batch * sizeof(struct fiemap_extent));
+			bigger = realloc(fiemap, new_size);
+			if (bigger) {
+				fiemap = bigger;
+				map_size = new_size;
+				batch *= 2;
+			}
+		}
 	}
 
-	if (cur_extent  == max_extents)
+	if (csv)
+		goto out;
+	if (cur_extent  == max_extents) {
+		if (summary)
+			fiemap_print_summary(&sum);
 		goto out;
+	}
 
 	memset(&st, 0, sizeof(st));
 	if (fstat(file->fd, &st)) {
@@ -376,6 +481,15 @@ fiemap_f(
 	/* Print last hole to EOF or to end of requested range */
 	range_end = min((uint64_t)range_end, st.st_size);
 
+	if (summary) {
+		if (last_logical < range_end) {
+			sum.holes++;
+			sum.hole_bytes += range_end - last_logical;
+		}
+		fiemap_print_summary(&sum);
+		goto out;
+	}
+
 	if (cur_extent && last_logical < range_end)
 		print_hole(foff_w, boff_w, tot_w, cur_extent, lflag, !vflag,
 			   BTOBBT(last_logical), BTOBBT(range_end));
@@ -393,7 +507,7 @@ fiemap_init(void)
 	fiemap_cmd.argmin = 0;
 	fiemap_cmd.argmax = -1;
 	fiemap_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	fiemap_cmd.args = _("[-alv] [-n nx] [offset [len]]");
+	fiemap_cmd.args = _("[-acslv] [-n nx] [offset [len]]");
 	fiemap_cmd.oneline = _("print block mapping for a file");
 	fiemap_cmd.help = fiemap_help;
 
@@ -387,7 +387,6 @@ fsmap_f(
 	unsigned long long	nr = 0;
 	size_t			fsblocksize, fssectsize;
 	struct fs_path		*fs;
-	static bool		tab_init;
 	bool			dumped_flags = false;
 	int			dflag, lflag, rflag;
 
@@ -495,10 +494,7 @@ fsmap_f(
 	 * If this is an XFS filesystem, remember the data device.
 	 * (We report AG number/block for data device extents on XFS).
 	 */
-	if (!tab_init) {
-		fs_table_initialise(0, NULL, 0, NULL);
-		tab_init = true;
-	}
+	fs_table_initialise_path(file->name);
 	fs = fs_table_lookup(file->name, FS_MOUNT_POINT);
 	xfs_data_dev = fs ? fs->fs_datadev : 0;
 
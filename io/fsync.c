@@ -4,38 +4,377 @@
  * All Rights Reserved.
  */
 
+#include <pthread.h>
+#include <sys/sysmacros.h>
 #include "platform_defs.h"
 #include "command.h"
+#include "input.h"
 #include "init.h"
 #include "io.h"
 
 static cmdinfo_t fsync_cmd;
 static cmdinfo_t fdatasync_cmd;
 
+/*
+ * Group commit benchmark.
+ *
+ * Each thread appends a block and flushes it in a loop, to the open file or
+ * to a file of its own next to it, until the time runs out.  Flushes that
+ * arrive while a log force is in progress can share the next one, so the
+ * number of log forces and log writes per flush says how well the log is
+ * batching them.  XFS counts those per filesystem in sysfs.
+ */
+struct fsync_bench {
+	bool		datasync;
+	size_t		bsize;
+	uint64_t	append_off;	/* shared file only */
+	uint64_t	deadline;
+};
+
+struct fsync_thread {
+	struct fsync_bench *fb;
+	pthread_t	tid;
+	int		fd;
+	bool		own_file;
+	void		*buf;
+	uint64_t	ops;
+	struct io_latency lat;
+	int		error;
+	const char	*what;
+};
+
+/* The log counters of the xfs stats, see xfs_stats_format() in the kernel. */
+struct fsync_log_stats {
+	unsigned long long	writes;
+	unsigned long long	blocks;
+	unsigned long long	noiclogs;
+	unsigned long long	forces;
+	unsigned long long	force_sleeps;
+};
+
+static void
+fsync_help(void)
+{
+	printf(_(
+"\n"
+" flushes the open file, or with options, measures how concurrent flushes\n"
+" are batched into log forces\n"
+"\n"
+" In the benchmark each thread appends a block to the file and flushes it,\n"
+" over and over, until the time runs out.  At the end the number of flushes\n"
+" per second and their latency are shown, with the log writes and forces of\n"
+" the filesystem over the run if the kernel exports XFS stats in sysfs.\n"
+"\n"
+" Example:\n"
+" 'fsync -j 16 -T 30' - 16 threads appending and flushing the open file\n"
+"\n"
+" -b N -- append N bytes before each flush, default 4k\n"
+" -f   -- give each thread a file of its own, next to the open file\n"
+" -j N -- run N threads, default 1\n"
+" -T N -- run for N seconds, default 10\n"
+"\n"));
+}
+
+/*
+ * Per filesystem stats live under the kernel's name for the data device,
+ * which is what /sys/dev/block links to.  Fall back to the global stats.
+ */
+static bool
+fsync_read_log_stats(
+	dev_t			dev,
+	struct fsync_log_stats	*ls)
+{
+	char			path[PATH_MAX];
+	char			link[PATH_MAX];
+	char			line[256];
+	char			*name;
+	ssize_t			len;
+	FILE			*fp = NULL;
+	bool			found = false;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+			major(dev), minor(dev));
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = 0;
+		name = strrchr(link, '/');
+		snprintf(path, sizeof(path), "/sys/fs/xfs/%s/stats/stats",
+				name ? name + 1 : link);
+		fp = fopen(path, "r");
+	}
+	if (!fp)
+		fp = fopen("/sys/fs/xfs/stats/stats", "r");
+	if (!fp)
+		return false;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "log %llu %llu %llu %llu %llu", &ls->writes,
+				&ls->blocks, &ls->noiclogs, &ls->forces,
+				&ls->force_sleeps) == 5) {
+			found = true;
+			break;
+		}
+	}
+	fclose(fp);
+	return found;
+}
+
+static void *
+fsync_worker(
+	void			*arg)
+{
+	struct fsync_thread	*t = arg;
+	struct fsync_bench	*fb = t->fb;
+	uint64_t		own_off = 0;
+	uint64_t		start;
+	off64_t			off;
+	ssize_t			ret;
+
+	while (lat_now() < __atomic_load_n(&fb->deadline, __ATOMIC_RELAXED)) {
+		if (t->own_file) {
+			off = own_off;
+			own_off += fb->bsize;
+		} else {
+			off = __atomic_fetch_add(&fb->append_off, fb->bsize,
+					__ATOMIC_RELAXED);
+		}
+		ret = pwrite(t->fd, t->buf, fb->bsize, off);
+		if (ret != fb->bsize) {
+			t->error = ret < 0 ? errno : EIO;
+			t->what = "pwrite";
+			break;
+		}
+
+		start = lat_now();
+		ret = fb->datasync ? fdatasync(t->fd) : fsync(t->fd);
+		lat_record(&t->lat, lat_now() - start);
+		if (ret < 0) {
+			t->error = errno;
+			t->what = fb->datasync ? "fdatasync" : "fsync";
+			break;
+		}
+		t->ops++;
+	}
+	return NULL;
+}
+
+static void
+fsync_report(
+	struct fsync_bench	*fb,
+	uint64_t		ops,
+	struct io_latency	*lat,
+	struct fsync_log_stats	*before,
+	struct fsync_log_stats	*after,
+	double			secs)
+{
+	const char		*verb = fb->datasync ? "fdatasync" : "fsync";
+	unsigned long long	writes, forces, sleeps;
+
+	printf(_("%s: %llu ops, %.1f ops/sec\n"), verb,
+			(unsigned long long)ops, ops / secs);
+	lat_report(verb, lat, 0);
+	if (!before || !after || !ops)
+		return;
+
+	writes = after->writes - before->writes;
+	forces = after->forces - before->forces;
+	sleeps = after->force_sleeps - before->force_sleeps;
+	printf(_("log: %llu writes, %llu forces, %llu forces waited\n"),
+			writes, forces, sleeps);
+	printf(_("log: %.2f writes and %.2f forces per %s\n"),
+			(double)writes / ops, (double)forces / ops, verb);
+}
+
 static int
-fsync_f(
-	int			argc,
-	char			**argv)
+fsync_run(
+	struct fsync_bench	*fb,
+	unsigned int		nr_threads,
+	bool			own_files,
+	long long		secs)
 {
-	if (fsync(file->fd) < 0) {
-		perror("fsync");
+	struct fsync_thread	*threads;
+	struct io_latency	*lat;
+	struct fsync_log_stats	before, after;
+	struct stat		st;
+	char			name[PATH_MAX];
+	bool			have_stats;
+	uint64_t		start, ops = 0;
+	unsigned int		i, started;
+	int			error = 0;
+
+	if (fstat(file->fd, &st) < 0) {
+		perror("fstat");
 		exitcode = 1;
 		return 0;
 	}
+	fb->append_off = roundup(st.st_size, fb->bsize);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	lat = calloc(1, sizeof(*lat));
+	if (!threads || !lat) {
+		perror("calloc");
+		exitcode = 1;
+		goto out;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		struct fsync_thread	*t = &threads[i];
+
+		t->fb = fb;
+		t->fd = file->fd;
+		t->buf = memalign(pagesize, fb->bsize);
+		if (!t->buf) {
+			perror("memalign");
+			exitcode = 1;
+			goto out;
+		}
+		memset(t->buf, 0xcd, fb->bsize);
+		if (!own_files)
+			continue;
+
+		snprintf(name, sizeof(name), "%s.fsync.%u", file->name, i);
+		t->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (t->fd < 0) {
+			perror(name);
+			exitcode = 1;
+			goto out;
+		}
+		t->own_file = true;
+	}
+
+	have_stats = fsync_read_log_stats(st.st_dev, &before);
+	start = lat_now();
+	fb->deadline = start + secs * 1000000000ULL;
+	for (i = 0; i < nr_threads; i++) {
+		error = pthread_create(&threads[i].tid, NULL, fsync_worker,
+				&threads[i]);
+		if (error)
+			break;
+	}
+	if (error) {
+		/* let the ones we started stop right away */
+		__atomic_store_n(&fb->deadline, 0, __ATOMIC_RELAXED);
+		errno = error;
+		perror("pthread_create");
+		exitcode = 1;
+	}
+	started = i;
+	for (i = 0; i < started; i++) {
+		struct fsync_thread	*t = &threads[i];
+
+		pthread_join(t->tid, NULL);
+		ops += t->ops;
+		lat_merge(lat, &t->lat);
+		if (t->error) {
+			errno = t->error;
+			perror(t->what);
+			exitcode = 1;
+		}
+	}
+	if (have_stats)
+		have_stats = fsync_read_log_stats(st.st_dev, &after);
+	if (!error)
+		fsync_report(fb, ops, lat, have_stats ? &before : NULL,
+				have_stats ? &after : NULL,
+				(lat_now() - start) / 1000000000.0);
+
+out:
+	for (i = 0; threads && i < nr_threads; i++) {
+		struct fsync_thread	*t = &threads[i];
+
+		if (t->own_file) {
+			close(t->fd);
+			snprintf(name, sizeof(name), "%s.fsync.%u",
+					file->name, i);
+			unlink(name);
+		}
+		free(t->buf);
+	}
+	free(threads);
+	free(lat);
 	return 0;
 }
 
 static int
-fdatasync_f(
+fsync_common(
 	int			argc,
-	char			**argv)
+	char			**argv,
+	bool			datasync)
 {
-	if (fdatasync(file->fd) < 0) {
-		perror("fdatasync");
-		exitcode = 1;
+	struct fsync_bench	fb = {
+		.datasync	= datasync,
+		.bsize		= 4096,
+	};
+	size_t			fsblocksize, fssectsize;
+	long long		secs = 10, tmp;
+	unsigned int		nr_threads = 1;
+	bool			own_files = false;
+	int			c;
+
+	if (argc == 1) {
+		if ((datasync ? fdatasync(file->fd) : fsync(file->fd)) < 0) {
+			perror(datasync ? "fdatasync" : "fsync");
+			exitcode = 1;
+		}
 		return 0;
 	}
-	return 0;
+
+	init_cvtnum(&fsblocksize, &fssectsize);
+	while ((c = getopt(argc, argv, "b:fj:T:")) != EOF) {
+		switch (c) {
+		case 'b':
+			tmp = cvtnum(fsblocksize, fssectsize, optarg);
+			if (tmp <= 0 || tmp > INT_MAX) {
+				printf(_("non-numeric bsize -- %s\n"), optarg);
+				return 0;
+			}
+			fb.bsize = tmp;
+			break;
+		case 'f':
+			own_files = true;
+			break;
+		case 'j':
+			tmp = cvtnum(0, 0, optarg);
+			if (tmp <= 0 || tmp > 1024) {
+				printf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			nr_threads = tmp;
+			break;
+		case 'T':
+			secs = cvtnum(0, 0, optarg);
+			if (secs <= 0) {
+				printf(_("bad run time %s\n"), optarg);
+				return 0;
+			}
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(datasync ? &fdatasync_cmd :
+						&fsync_cmd);
+		}
+	}
+	if (optind != argc) {
+		exitcode = 1;
+		return command_usage(datasync ? &fdatasync_cmd : &fsync_cmd);
+	}
+
+	return fsync_run(&fb, nr_threads, own_files, secs);
+}
+
+static int
+fsync_f(
+	int			argc,
+	char			**argv)
+{
+	return fsync_common(argc, argv, false);
+}
+
+static int
+fdatasync_f(
+	int			argc,
+	char			**argv)
+{
+	return fsync_common(argc, argv, true);
 }
 
 void
@@ -44,16 +383,22 @@ fsync_init(void)
 	fsync_cmd.name = "fsync";
 	fsync_cmd.altname = "s";
 	fsync_cmd.cfunc = fsync_f;
+	fsync_cmd.argmax = -1;
 	fsync_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	fsync_cmd.args = _("[-f] [-b bsize] [-j threads] [-T secs]");
 	fsync_cmd.oneline =
 		_("calls fsync(2) to flush all in-core file state to disk");
+	fsync_cmd.help = fsync_help;
 
 	fdatasync_cmd.name = "fdatasync";
 	fdatasync_cmd.altname = "ds";
 	fdatasync_cmd.cfunc = fdatasync_f;
+	fdatasync_cmd.argmax = -1;
 	fdatasync_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	fdatasync_cmd.args = _("[-f] [-b bsize] [-j threads] [-T secs]");
 	fdatasync_cmd.oneline =
 		_("calls fdatasync(2) to flush the files in-core data to disk");
+	fdatasync_cmd.help = fsync_help;
 
 	add_command(&fsync_cmd);
 	add_command(&fdatasync_cmd);
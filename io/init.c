@@ -22,7 +22,7 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-_("Usage: %s [-adfinrRstVx] [-m mode] [-p prog] [[-c|-C] cmd]... file\n"),
+_("Usage: %s [-adfinrRstVx] [-m mode] [-p prog] [[-c|-C] cmd]... [-S script]... file\n"),
 		progname);
 	exit(1);
 }
@@ -49,6 +49,7 @@ init_commands(void)
 	bulkstat_init();
 	copy_range_init();
 	cowextsize_init();
+	dedupe_scan_init();
 	encrypt_init();
 	fadvise_init();
 	fiemap_init();
@@ -64,6 +65,7 @@ init_commands(void)
 	label_init();
 	log_writes_init();
 	madvise_init();
+	mdbench_init();
 	mincore_init();
 	mmap_init();
 	open_init();
@@ -86,6 +88,7 @@ init_commands(void)
 	sync_range_init();
 	truncate_init();
 	utimes_init();
+	workload_init();
 	crc32cselftest_init();
 }
 
@@ -145,8 +148,7 @@ init(
 	pagesize = getpagesize();
 	gettimeofday(&stopwatch, NULL);
 
-	fs_table_initialise(0, NULL, 0, NULL);
-	while ((c = getopt(argc, argv, "ac:C:dFfiLm:p:PnrRstTVx")) != EOF) {
+	while ((c = getopt(argc, argv, "ac:C:dFfiLm:p:PnrRsS:tTVx")) != EOF) {
 		switch (c) {
 		case 'a':
 			flags |= IO_APPEND;
@@ -189,6 +191,9 @@ init(
 		case 's':
 			flags |= IO_OSYNC;
 			break;
+		case 'S':
+			add_user_script(optarg);
+			break;
 		case 't':
 			flags |= IO_TRUNC;
 			break;
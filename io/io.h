@@ -88,6 +88,43 @@ extern int		read_buffer(int, off64_t, long long, long long *,
 					int, int);
 extern void		dump_buffer(off64_t, ssize_t);
 
+/* pread/pwrite -L latency histogram */
+#define LAT_SUB_BITS	6
+#define LAT_SUB		(1U << LAT_SUB_BITS)
+#define LAT_MAX_BITS	40		/* about 18 minutes in ns */
+#define LAT_BUCKETS	(LAT_SUB + (LAT_MAX_BITS - LAT_SUB_BITS) * LAT_SUB)
+
+struct io_latency {
+	uint64_t	count;
+	uint64_t	min_ns;
+	uint64_t	max_ns;
+	uint64_t	buckets[LAT_BUCKETS];
+};
+extern struct io_latency *io_lat;
+extern uint64_t		lat_now(void);
+extern void		lat_record(struct io_latency *, uint64_t);
+extern void		lat_merge(struct io_latency *,
+					const struct io_latency *);
+extern void		lat_report(const char *, const struct io_latency *,
+					int);
+
+/* pread/pwrite -j threads -Q depth */
+struct ioengine {
+	int		fd;
+	bool		write;
+	int		direction;	/* IO_FORWARD, IO_BACKWARD, IO_RANDOM */
+	off64_t		offset;
+	long long	count;
+	size_t		bsize;
+	unsigned int	threads;
+	unsigned int	depth;		/* I/Os in flight per thread */
+	unsigned int	seed;		/* IO_RANDOM */
+	unsigned int	pattern;	/* write buffer fill */
+	int		rw_flags;	/* RWF_* for writes */
+	struct io_latency *lat;		/* -L: per-op latencies go here */
+};
+extern int		ioengine_run(struct ioengine *, long long *);
+
 extern void		attr_init(void);
 extern void		bmap_init(void);
 extern void		encrypt_init(void);
@@ -100,6 +137,7 @@ extern void		help_init(void);
 extern void		imap_init(void);
 extern void		inject_init(void);
 extern void		label_init(void);
+extern void		mdbench_init(void);
 extern void		mmap_init(void);
 extern void		open_init(void);
 extern void		parent_init(void);
@@ -115,6 +153,7 @@ extern void		swapext_init(void);
 extern void		sync_init(void);
 extern void		truncate_init(void);
 extern void		utimes_init(void);
+extern void		workload_init(void);
 
 #ifdef HAVE_FADVISE
 extern void		fadvise_init(void);
@@ -167,6 +206,7 @@ extern void		readdir_init(void);
 extern void		reflink_init(void);
 
 extern void		cowextsize_init(void);
+extern void		dedupe_scan_init(void);
 
 #ifdef HAVE_GETFSMAP
 extern void		fsmap_init(void);
@@ -0,0 +1,331 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ */
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "libfrog/ioring.h"
+
+/*
+ * Parallel I/O engine behind pread -j/-Q and pwrite -j/-Q.
+ *
+ * The range is cut into one contiguous slice per thread.  Each thread walks
+ * its own slice forwards or backwards, or does as many reads or writes at
+ * random offsets across the whole range, keeping up to depth I/Os in flight
+ * through an io_uring of its own.  Without io_uring each thread does
+ * synchronous I/O, so -j still works but -Q makes no difference.
+ */
+struct ioengine_thread {
+	struct ioengine		*eng;
+	pthread_t		tid;
+	off64_t			start;		/* this thread's slice */
+	long long		len;
+	unsigned int		seed;
+	void			**bufs;
+	struct io_latency	*lat;
+	long long		total;
+	int			ops;
+	int			error;
+};
+
+/* Where does the i'th I/O of this thread go, and how big is it? */
+static off64_t
+ioengine_next(
+	struct ioengine_thread	*t,
+	long long		i,
+	size_t			*lenp)
+{
+	struct ioengine		*eng = t->eng;
+	long long		nblocks;
+	off64_t			off;
+
+	switch (eng->direction) {
+	case IO_RANDOM:
+		nblocks = max(eng->count / (long long)eng->bsize, 1LL);
+		off = eng->offset +
+			((((uint64_t)rand_r(&t->seed) << 31) |
+			  rand_r(&t->seed)) % nblocks) * eng->bsize;
+		*lenp = eng->bsize;
+		return off;
+	case IO_BACKWARD:
+		off = t->start + t->len - (i + 1) * (long long)eng->bsize;
+		if (off < t->start) {
+			*lenp = eng->bsize - (t->start - off);
+			return t->start;
+		}
+		*lenp = eng->bsize;
+		return off;
+	default:
+		off = t->start + i * (long long)eng->bsize;
+		*lenp = min((long long)eng->bsize, t->start + t->len - off);
+		return off;
+	}
+}
+
+static ssize_t
+ioengine_sync_rw(
+	struct ioengine		*eng,
+	void			*buf,
+	size_t			len,
+	off64_t			off)
+{
+	if (!eng->write)
+		return pread(eng->fd, buf, len, off);
+#ifdef HAVE_PWRITEV2
+	if (eng->rw_flags) {
+		struct iovec	iov = { .iov_base = buf, .iov_len = len };
+
+		return pwritev2(eng->fd, &iov, 1, off, eng->rw_flags);
+	}
+#endif
+	return pwrite(eng->fd, buf, len, off);
+}
+
+static void
+ioengine_sync(
+	struct ioengine_thread	*t,
+	long long		nops)
+{
+	ssize_t			bytes;
+	size_t			len;
+	off64_t			off;
+	uint64_t		start = 0;
+	long long		i;
+
+	for (i = 0; i < nops; i++) {
+		off = ioengine_next(t, i, &len);
+		if (t->lat)
+			start = lat_now();
+		bytes = ioengine_sync_rw(t->eng, t->bufs[0], len, off);
+		if (t->lat)
+			lat_record(t->lat, lat_now() - start);
+		if (bytes < 0) {
+			t->error = errno;
+			return;
+		}
+		if (bytes == 0)
+			return;
+		t->ops++;
+		t->total += bytes;
+		if (bytes < len)
+			return;
+	}
+}
+
+#ifdef HAVE_IO_URING
+/* Returns false if the ring can't be used at all, so do it synchronously. */
+static bool
+ioengine_ring(
+	struct ioengine_thread	*t,
+	long long		nops)
+{
+	struct ioengine		*eng = t->eng;
+	struct ioring		ring;
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	unsigned int		*free_slots;
+	size_t			*lens;
+	uint64_t		*issued;
+	unsigned int		nr_free = eng->depth;
+	unsigned int		inflight = 0;
+	unsigned int		slot;
+	long long		next = 0;
+	bool			done = false;
+	int			error;
+
+	if (ioring_init(&ring, eng->depth, 0))
+		return false;
+
+	free_slots = calloc(eng->depth, sizeof(*free_slots));
+	lens = calloc(eng->depth, sizeof(*lens));
+	issued = calloc(eng->depth, sizeof(*issued));
+	if (!free_slots || !lens || !issued) {
+		t->error = ENOMEM;
+		goto out;
+	}
+	for (slot = 0; slot < eng->depth; slot++)
+		free_slots[slot] = slot;
+
+	while ((!done && next < nops) || inflight) {
+		while (!done && next < nops && nr_free &&
+		       (sqe = ioring_get_sqe(&ring)) != NULL) {
+			off64_t		off;
+
+			slot = free_slots[--nr_free];
+			off = ioengine_next(t, next++, &lens[slot]);
+			ioring_prep_rw(sqe, eng->write ? IORING_OP_WRITE :
+							 IORING_OP_READ,
+					eng->fd, t->bufs[slot], lens[slot],
+					off, slot);
+			if (eng->write)
+				sqe->rw_flags = eng->rw_flags;
+			if (t->lat)
+				issued[slot] = lat_now();
+			inflight++;
+		}
+
+		error = ioring_submit(&ring, 1);
+		if (error < 0) {
+			t->error = -error;
+			done = true;
+			/* reap what's out there before giving up the ring */
+			inflight -= ioring_sq_pending(&ring);
+			while (inflight && !ioring_wait_cqe(&ring, &cqe)) {
+				ioring_cqe_seen(&ring);
+				inflight--;
+			}
+			break;
+		}
+
+		while ((cqe = ioring_peek_cqe(&ring)) != NULL) {
+			slot = cqe->user_data;
+			if (t->lat)
+				lat_record(t->lat, lat_now() - issued[slot]);
+			if (cqe->res < 0) {
+				if (!t->error)
+					t->error = -cqe->res;
+				done = true;
+			} else {
+				if (cqe->res > 0)
+					t->ops++;
+				t->total += cqe->res;
+				/* short I/O means we ran off the end */
+				if (cqe->res < lens[slot])
+					done = true;
+			}
+			free_slots[nr_free++] = slot;
+			ioring_cqe_seen(&ring);
+			inflight--;
+		}
+	}
+out:
+	free(issued);
+	free(lens);
+	free(free_slots);
+	ioring_free(&ring);
+	return true;
+}
+#else
+static inline bool
+ioengine_ring(
+	struct ioengine_thread	*t,
+	long long		nops)
+{
+	return false;
+}
+#endif /* HAVE_IO_URING */
+
+static void *
+ioengine_worker(
+	void			*arg)
+{
+	struct ioengine_thread	*t = arg;
+	struct ioengine		*eng = t->eng;
+	long long		nops;
+	unsigned int		i;
+
+	t->bufs = calloc(eng->depth, sizeof(void *));
+	if (!t->bufs) {
+		t->error = ENOMEM;
+		return NULL;
+	}
+	if (eng->lat) {
+		t->lat = calloc(1, sizeof(*t->lat));
+		if (!t->lat) {
+			t->error = ENOMEM;
+			goto out;
+		}
+	}
+	for (i = 0; i < eng->depth; i++) {
+		t->bufs[i] = memalign(pagesize, eng->bsize);
+		if (!t->bufs[i]) {
+			t->error = ENOMEM;
+			goto out;
+		}
+		if (eng->write)
+			memset(t->bufs[i], eng->pattern, eng->bsize);
+	}
+
+	nops = (t->len + eng->bsize - 1) / eng->bsize;
+	if (eng->depth == 1 || !ioengine_ring(t, nops))
+		ioengine_sync(t, nops);
+out:
+	for (i = 0; i < eng->depth; i++)
+		free(t->bufs[i]);
+	free(t->bufs);
+	return NULL;
+}
+
+/*
+ * Run the I/O described by eng and return the number of I/Os done, or -1
+ * if something went wrong.
+ */
+int
+ioengine_run(
+	struct ioengine		*eng,
+	long long		*total)
+{
+	struct ioengine_thread	*threads;
+	long long		slice;
+	unsigned int		i;
+	int			ops = 0;
+	int			error = 0;
+
+	*total = 0;
+	if (eng->count <= 0)
+		return 0;
+
+	threads = calloc(eng->threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		return -1;
+	}
+
+	/* Slices are whole blocks so that threads don't share any. */
+	slice = (eng->count + eng->threads - 1) / eng->threads;
+	slice = roundup(slice, (long long)eng->bsize);
+	for (i = 0; i < eng->threads; i++) {
+		struct ioengine_thread	*t = &threads[i];
+
+		t->eng = eng;
+		t->seed = eng->seed + i;
+		t->start = eng->offset + i * slice;
+		t->len = min(slice, eng->offset + eng->count - t->start);
+		if (t->len <= 0)
+			break;
+		error = pthread_create(&t->tid, NULL, ioengine_worker, t);
+		if (error) {
+			t->len = 0;
+			break;
+		}
+	}
+
+	for (i = 0; i < eng->threads; i++) {
+		struct ioengine_thread	*t = &threads[i];
+
+		if (t->len <= 0)
+			break;
+		pthread_join(t->tid, NULL);
+		*total += t->total;
+		ops += t->ops;
+		if (t->lat) {
+			lat_merge(eng->lat, t->lat);
+			free(t->lat);
+		}
+		if (t->error && !error)
+			error = t->error;
+	}
+	free(threads);
+
+	if (error) {
+		errno = error;
+		perror(eng->write ? "pwrite" : "pread");
+		return -1;
+	}
+	return ops;
+}
@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ */
+
+#include <time.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+/*
+ * Per-op latency histogram for pread -L, pwrite -L, and bulkstat -j.
+ *
+ * Buckets are laid out like an HDR histogram: latencies below 2^LAT_SUB_BITS
+ * nanoseconds get a bucket each, and every power of two above that is split
+ * into 2^LAT_SUB_BITS equal buckets, so any recorded value is within about
+ * 1.5% of the truth no matter how big it is.
+ */
+
+/* Set while a command wants the single threaded paths timed. */
+struct io_latency	*io_lat;
+
+static unsigned int
+lat_bucket(
+	uint64_t		ns)
+{
+	unsigned int		msb;
+
+	if (ns < LAT_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	if (msb >= LAT_MAX_BITS)
+		return LAT_BUCKETS - 1;
+	return LAT_SUB + (msb - LAT_SUB_BITS) * LAT_SUB +
+		((ns >> (msb - LAT_SUB_BITS)) - LAT_SUB);
+}
+
+/* Highest latency that lands in bucket i. */
+static uint64_t
+lat_bucket_top(
+	unsigned int		i)
+{
+	unsigned int		shift;
+
+	if (i < LAT_SUB)
+		return i;
+	shift = (i - LAT_SUB) / LAT_SUB;
+	return ((uint64_t)(LAT_SUB + (i - LAT_SUB) % LAT_SUB + 1) << shift) - 1;
+}
+
+uint64_t
+lat_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+lat_record(
+	struct io_latency	*lat,
+	uint64_t		ns)
+{
+	lat->buckets[lat_bucket(ns)]++;
+	lat->count++;
+	lat->min_ns = lat->count == 1 ? ns : min(lat->min_ns, ns);
+	lat->max_ns = max(lat->max_ns, ns);
+}
+
+void
+lat_merge(
+	struct io_latency	*dst,
+	const struct io_latency	*src)
+{
+	unsigned int		i;
+
+	if (!src->count)
+		return;
+	for (i = 0; i < LAT_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->min_ns = dst->count ? min(dst->min_ns, src->min_ns) : src->min_ns;
+	dst->max_ns = max(dst->max_ns, src->max_ns);
+	dst->count += src->count;
+}
+
+/* Latency that pct percent of the ops came in at or under. */
+static uint64_t
+lat_percentile(
+	const struct io_latency	*lat,
+	double			pct)
+{
+	uint64_t		want;
+	uint64_t		seen = 0;
+	unsigned int		i;
+
+	want = (uint64_t)((lat->count * pct + 99.999) / 100);
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += lat->buckets[i];
+		if (seen >= want)
+			return min(lat_bucket_top(i), lat->max_ns);
+	}
+	return lat->max_ns;
+}
+
+static void
+lat_str(
+	uint64_t		ns,
+	char			*buf,
+	size_t			len)
+{
+	if (ns < 10000)
+		snprintf(buf, len, "%lluns", (unsigned long long)ns);
+	else if (ns < 10000000)
+		snprintf(buf, len, "%.1fus", ns / 1000.0);
+	else if (ns < 10000000000ULL)
+		snprintf(buf, len, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buf, len, "%.1fs", ns / 1000000000.0);
+}
+
+void
+lat_report(
+	const char		*verb,
+	const struct io_latency	*lat,
+	int			compact)
+{
+	static const double	pcts[] = { 50, 90, 99, 99.9, 99.99 };
+	const unsigned int	nr_pcts = sizeof(pcts) / sizeof(pcts[0]);
+	char			s[32];
+	unsigned int		i;
+
+	if (!lat->count)
+		return;
+
+	if (compact) {	/* min,p50,p90,p99,p99.9,p99.99,max in usec */
+		printf("%.3f", lat->min_ns / 1000.0);
+		for (i = 0; i < nr_pcts; i++)
+			printf(",%.3f", lat_percentile(lat, pcts[i]) / 1000.0);
+		printf(",%.3f\n", lat->max_ns / 1000.0);
+		return;
+	}
+
+	lat_str(lat->min_ns, s, sizeof(s));
+	printf(_("%s latency: min %s"), verb, s);
+	for (i = 0; i < nr_pcts; i++) {
+		lat_str(lat_percentile(lat, pcts[i]), s, sizeof(s));
+		printf(" p%g %s", pcts[i], s);
+	}
+	lat_str(lat->max_ns, s, sizeof(s));
+	printf(_(" max %s\n"), s);
+}
@@ -0,0 +1,620 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ */
+
+#include <pthread.h>
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "libfrog/logging.h"
+#include "libfrog/fsgeom.h"
+
+/*
+ * Metadata operation benchmark, in the style of mdtest.
+ *
+ * A directory tree of the given fan-out and depth is made under a new
+ * directory, shared by all threads or one per thread.  Each thread then
+ * creates its files across the leaf directories of the tree, stats them,
+ * renames each into the next leaf over, and unlinks them.  The threads wait
+ * for each other between phases, so every phase is timed on its own.
+ */
+static cmdinfo_t mdbench_cmd;
+
+enum md_phase {
+	MD_CREATE,
+	MD_STAT,
+	MD_RENAME,
+	MD_UNLINK,
+	MD_NR_PHASES,
+};
+
+static const char *md_phase_names[] = {
+	[MD_CREATE]	= "create",
+	[MD_STAT]	= "stat",
+	[MD_RENAME]	= "rename",
+	[MD_UNLINK]	= "unlink",
+};
+
+/* The directories of one tree, parents before children, leaves last. */
+struct md_tree {
+	char		**dirs;
+	unsigned int	nr_dirs;
+	unsigned int	first_leaf;
+	uint64_t	*leaf_ino;	/* -a */
+};
+
+struct mdbench {
+	int		root_fd;
+	unsigned int	threads;
+	unsigned int	files;		/* per thread */
+	unsigned int	branch;
+	unsigned int	depth;
+	bool		unique;		/* a tree per thread */
+	bool		ag_spread;
+	struct md_tree	*trees;
+	unsigned int	nr_trees;
+	pthread_mutex_t	lock;
+	pthread_cond_t	start_cond;
+	int		start;		/* 1: go, -1: give up */
+	pthread_barrier_t barrier;
+	uint64_t	phase_ns[MD_NR_PHASES];
+};
+
+struct md_thread {
+	struct mdbench	*mb;
+	pthread_t	tid;
+	unsigned int	id;
+	struct md_tree	*tree;
+	uint64_t	*ino;		/* -a: of each file */
+	struct io_latency *lat[MD_NR_PHASES];
+	int		error;
+	const char	*what;
+};
+
+static void
+mdbench_help(void)
+{
+	printf(_(
+"\n"
+" measures create, stat, rename and unlink rates across a directory tree\n"
+"\n"
+" A new directory dir is made and a tree of subdirectories under it.  Each\n"
+" thread creates its files across the leaf directories of the tree, then\n"
+" stats them, renames each into the next leaf directory, and unlinks them.\n"
+" Every phase is timed on its own, and the rate and latency of each is\n"
+" shown at the end.  Everything is removed again afterwards.\n"
+"\n"
+" Example:\n"
+" 'mdbench -j 8 -n 10000 -b 16 -z 2 /mnt/scratch/md' - 8 threads, 10000\n"
+"  files each, over 256 leaf directories\n"
+"\n"
+" -a   -- show how the directories and files were spread over the AGs\n"
+" -b N -- subdirectories per directory, default 1\n"
+" -j N -- run N threads, default 1\n"
+" -n N -- files per thread, default 1000\n"
+" -u   -- give each thread a tree of its own instead of sharing one\n"
+" -z N -- depth of the tree, default 0 (all files in dir itself)\n"
+"\n"));
+}
+
+static void
+md_free_tree(
+	struct md_tree	*tree)
+{
+	unsigned int	i;
+
+	for (i = 0; i < tree->nr_dirs; i++)
+		free(tree->dirs[i]);
+	free(tree->dirs);
+	free(tree->leaf_ino);
+}
+
+/* Lay out a tree under @top, breadth first.  Nothing is made on disk yet. */
+static int
+md_build_tree(
+	struct mdbench	*mb,
+	struct md_tree	*tree,
+	const char	*top)
+{
+	unsigned int	nr = 1, level = 1;
+	unsigned int	parent, i, d;
+
+	for (d = 0; d < mb->depth; d++) {
+		level *= mb->branch;
+		nr += level;
+	}
+
+	tree->dirs = calloc(nr, sizeof(char *));
+	if (!tree->dirs)
+		return ENOMEM;
+	tree->dirs[0] = strdup(top);
+	if (!tree->dirs[0])
+		return ENOMEM;
+	tree->nr_dirs = 1;
+	tree->first_leaf = nr - level;
+
+	for (parent = 0; tree->nr_dirs < nr; parent++) {
+		for (i = 0; i < mb->branch; i++) {
+			char	*p;
+
+			if (asprintf(&p, "%s/d%u", tree->dirs[parent], i) < 0)
+				return ENOMEM;
+			tree->dirs[tree->nr_dirs++] = p;
+		}
+	}
+
+	if (mb->ag_spread) {
+		tree->leaf_ino = calloc(level, sizeof(uint64_t));
+		if (!tree->leaf_ino)
+			return ENOMEM;
+	}
+	return 0;
+}
+
+/* Make the directories of a tree; the top one may already be there. */
+static int
+md_make_tree(
+	struct mdbench	*mb,
+	struct md_tree	*tree,
+	const char	**what)
+{
+	struct stat	st;
+	unsigned int	i;
+
+	for (i = 0; i < tree->nr_dirs; i++) {
+		if (mkdirat(mb->root_fd, tree->dirs[i], 0755) < 0 &&
+		    !(i == 0 && errno == EEXIST)) {
+			*what = "mkdir";
+			return errno;
+		}
+		if (!tree->leaf_ino || i < tree->first_leaf)
+			continue;
+		if (fstatat(mb->root_fd, tree->dirs[i], &st, 0) < 0) {
+			*what = "stat";
+			return errno;
+		}
+		tree->leaf_ino[i - tree->first_leaf] = st.st_ino;
+	}
+	return 0;
+}
+
+static void
+md_remove_tree(
+	struct mdbench	*mb,
+	struct md_tree	*tree)
+{
+	unsigned int	i;
+
+	for (i = tree->nr_dirs; i > 0; i--)
+		if (strcmp(tree->dirs[i - 1], "."))
+			unlinkat(mb->root_fd, tree->dirs[i - 1], AT_REMOVEDIR);
+}
+
+/* Name of file @i of thread @t in its leaf, or in the next leaf if renamed. */
+static void
+md_path(
+	struct md_thread *t,
+	unsigned int	i,
+	bool		renamed,
+	char		*buf,
+	size_t		len)
+{
+	struct md_tree	*tree = t->tree;
+	unsigned int	nr_leaves = tree->nr_dirs - tree->first_leaf;
+	unsigned int	leaf = (t->id + i + renamed) % nr_leaves;
+
+	snprintf(buf, len, "%s/%c%u.%u", tree->dirs[tree->first_leaf + leaf],
+			renamed ? 'r' : 'f', t->id, i);
+}
+
+static int
+md_do_op(
+	struct md_thread *t,
+	enum md_phase	phase,
+	unsigned int	i)
+{
+	int		root_fd = t->mb->root_fd;
+	char		path[PATH_MAX];
+	char		path2[PATH_MAX];
+	struct stat	st;
+	int		fd;
+
+	md_path(t, i, phase == MD_UNLINK, path, sizeof(path));
+	switch (phase) {
+	case MD_CREATE:
+		fd = openat(root_fd, path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd < 0)
+			return -1;
+		close(fd);
+		return 0;
+	case MD_STAT:
+		if (fstatat(root_fd, path, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			return -1;
+		if (t->ino)
+			t->ino[i] = st.st_ino;
+		return 0;
+	case MD_RENAME:
+		md_path(t, i, true, path2, sizeof(path2));
+		return renameat(root_fd, path, root_fd, path2);
+	case MD_UNLINK:
+		return unlinkat(root_fd, path, 0);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static void *
+md_worker(
+	void			*arg)
+{
+	struct md_thread	*t = arg;
+	struct mdbench		*mb = t->mb;
+	enum md_phase		phase;
+	uint64_t		start;
+	unsigned int		i;
+	bool			failed = false;
+
+	/* the barrier needs all of us, so wait until all of us exist */
+	pthread_mutex_lock(&mb->lock);
+	while (!mb->start)
+		pthread_cond_wait(&mb->start_cond, &mb->lock);
+	pthread_mutex_unlock(&mb->lock);
+	if (mb->start < 0)
+		return NULL;
+
+	/* -u: each thread makes its own tree, which takes part in no phase */
+	if (mb->unique) {
+		t->error = md_make_tree(mb, t->tree, &t->what);
+		failed = t->error != 0;
+	}
+
+	for (phase = 0; phase < MD_NR_PHASES; phase++) {
+		/* one thread stamps the start of each phase, and the end */
+		if (pthread_barrier_wait(&mb->barrier) ==
+				PTHREAD_BARRIER_SERIAL_THREAD) {
+			if (phase > 0)
+				mb->phase_ns[phase - 1] = lat_now() -
+						mb->phase_ns[phase - 1];
+			mb->phase_ns[phase] = lat_now();
+		}
+		for (i = 0; !failed && i < mb->files; i++) {
+			start = lat_now();
+			if (md_do_op(t, phase, i) < 0) {
+				t->error = errno;
+				t->what = md_phase_names[phase];
+				failed = true;
+				break;
+			}
+			lat_record(t->lat[phase], lat_now() - start);
+		}
+	}
+	if (pthread_barrier_wait(&mb->barrier) ==
+			PTHREAD_BARRIER_SERIAL_THREAD)
+		mb->phase_ns[MD_NR_PHASES - 1] = lat_now() -
+				mb->phase_ns[MD_NR_PHASES - 1];
+	return NULL;
+}
+
+/*
+ * Where did the leaf directories and the files go?  The inode numbers say
+ * which AG, and a file is local if it landed in the AG of its directory.
+ */
+static void
+md_report_ags(
+	struct mdbench		*mb,
+	struct md_thread	*threads)
+{
+	struct xfs_fd		xfd = XFS_FD_INIT(mb->root_fd);
+	uint64_t		*dirs, *files;
+	uint64_t		local = 0, total = 0;
+	unsigned int		i, j, nr_leaves;
+	uint32_t		agno;
+	int			ret;
+
+	ret = -xfd_prepare_geometry(&xfd);
+	if (ret) {
+		xfrog_perror(ret, "xfd_prepare_geometry");
+		exitcode = 1;
+		return;
+	}
+
+	dirs = calloc(xfd.fsgeom.agcount, sizeof(uint64_t));
+	files = calloc(xfd.fsgeom.agcount, sizeof(uint64_t));
+	if (!dirs || !files) {
+		perror("calloc");
+		exitcode = 1;
+		goto out;
+	}
+
+	for (i = 0; i < mb->nr_trees; i++) {
+		struct md_tree	*tree = &mb->trees[i];
+
+		nr_leaves = tree->nr_dirs - tree->first_leaf;
+		for (j = 0; j < nr_leaves; j++)
+			dirs[cvt_ino_to_agno(&xfd, tree->leaf_ino[j])]++;
+	}
+	for (i = 0; i < mb->threads; i++) {
+		struct md_thread *t = &threads[i];
+		struct md_tree	*tree = t->tree;
+
+		nr_leaves = tree->nr_dirs - tree->first_leaf;
+		for (j = 0; j < mb->files && t->ino[j]; j++) {
+			agno = cvt_ino_to_agno(&xfd, t->ino[j]);
+			files[agno]++;
+			total++;
+			if (agno == cvt_ino_to_agno(&xfd,
+					tree->leaf_ino[(i + j) % nr_leaves]))
+				local++;
+		}
+	}
+
+	printf(_("AG      dirs     files\n"));
+	for (agno = 0; agno < xfd.fsgeom.agcount; agno++)
+		if (dirs[agno] || files[agno])
+			printf("%-6u %5llu %9llu\n", agno,
+					(unsigned long long)dirs[agno],
+					(unsigned long long)files[agno]);
+	if (total)
+		printf(_("%.1f%% of files in the AG of their directory\n"),
+				100.0 * local / total);
+out:
+	free(files);
+	free(dirs);
+}
+
+static void
+md_report(
+	struct mdbench		*mb,
+	struct md_thread	*threads)
+{
+	struct io_latency	*lat;
+	enum md_phase		phase;
+	double			secs;
+	unsigned int		i;
+
+	lat = calloc(1, sizeof(*lat));
+	if (!lat) {
+		perror("calloc");
+		exitcode = 1;
+		return;
+	}
+	for (phase = 0; phase < MD_NR_PHASES; phase++) {
+		memset(lat, 0, sizeof(*lat));
+		for (i = 0; i < mb->threads; i++)
+			lat_merge(lat, threads[i].lat[phase]);
+		secs = mb->phase_ns[phase] / 1000000000.0;
+		printf(_("%s: %llu ops, %.3f sec, %.1f ops/sec\n"),
+				md_phase_names[phase],
+				(unsigned long long)lat->count, secs,
+				secs > 0 ? lat->count / secs : 0.0);
+		lat_report(md_phase_names[phase], lat, 0);
+	}
+	free(lat);
+}
+
+static int
+mdbench_f(
+	int			argc,
+	char			**argv)
+{
+	struct mdbench		mb = {
+		.root_fd	= -1,
+		.threads	= 1,
+		.files		= 1000,
+		.branch		= 1,
+	};
+	struct md_thread	*threads = NULL;
+	const char		*what = NULL;
+	char			top[32];
+	unsigned int		i, started = 0;
+	enum md_phase		phase;
+	long long		tmp;
+	int			c, error = 0;
+
+	while ((c = getopt(argc, argv, "ab:j:n:uz:")) != EOF) {
+		switch (c) {
+		case 'a':
+			mb.ag_spread = true;
+			break;
+		case 'b':
+			tmp = cvtnum(0, 0, optarg);
+			if (tmp <= 0 || tmp > 65536) {
+				printf(_("bad fan-out %s\n"), optarg);
+				return 0;
+			}
+			mb.branch = tmp;
+			break;
+		case 'j':
+			tmp = cvtnum(0, 0, optarg);
+			if (tmp <= 0 || tmp > 1024) {
+				printf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			mb.threads = tmp;
+			break;
+		case 'n':
+			tmp = cvtnum(0, 0, optarg);
+			if (tmp <= 0 || tmp > UINT_MAX) {
+				printf(_("bad file count %s\n"), optarg);
+				return 0;
+			}
+			mb.files = tmp;
+			break;
+		case 'u':
+			mb.unique = true;
+			break;
+		case 'z':
+			tmp = cvtnum(0, 0, optarg);
+			if (tmp < 0 || tmp > 16) {
+				printf(_("bad depth %s\n"), optarg);
+				return 0;
+			}
+			mb.depth = tmp;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&mdbench_cmd);
+		}
+	}
+	if (argc - optind != 1) {
+		exitcode = 1;
+		return command_usage(&mdbench_cmd);
+	}
+	for (i = 0, tmp = 1; i < mb.depth && tmp <= 1000000; i++)
+		tmp *= mb.branch;
+	if (tmp > 1000000) {
+		printf(_("a tree of more than 1000000 leaves is too big\n"));
+		exitcode = 1;
+		return 0;
+	}
+
+	if (mkdir(argv[optind], 0755) < 0) {
+		perror(argv[optind]);
+		exitcode = 1;
+		return 0;
+	}
+	mb.root_fd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+	if (mb.root_fd < 0) {
+		perror(argv[optind]);
+		exitcode = 1;
+		goto out_rmdir;
+	}
+
+	mb.nr_trees = mb.unique ? mb.threads : 1;
+	mb.trees = calloc(mb.nr_trees, sizeof(struct md_tree));
+	threads = calloc(mb.threads, sizeof(*threads));
+	if (!mb.trees || !threads) {
+		error = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < mb.nr_trees; i++) {
+		if (mb.unique)
+			snprintf(top, sizeof(top), "t%u", i);
+		else
+			strcpy(top, ".");
+		error = md_build_tree(&mb, &mb.trees[i], top);
+		if (error)
+			goto out;
+	}
+	if (!mb.unique) {
+		error = md_make_tree(&mb, &mb.trees[0], &what);
+		if (error)
+			goto out;
+	}
+
+	for (i = 0; i < mb.threads; i++) {
+		struct md_thread *t = &threads[i];
+
+		t->mb = &mb;
+		t->id = i;
+		t->tree = &mb.trees[mb.unique ? i : 0];
+		if (mb.ag_spread) {
+			t->ino = calloc(mb.files, sizeof(uint64_t));
+			if (!t->ino) {
+				error = ENOMEM;
+				goto out;
+			}
+		}
+		for (phase = 0; phase < MD_NR_PHASES; phase++) {
+			t->lat[phase] = calloc(1, sizeof(struct io_latency));
+			if (!t->lat[phase]) {
+				error = ENOMEM;
+				goto out;
+			}
+		}
+	}
+
+	/* every thread has to turn up at the barrier, so start all or none */
+	pthread_mutex_init(&mb.lock, NULL);
+	pthread_cond_init(&mb.start_cond, NULL);
+	pthread_barrier_init(&mb.barrier, NULL, mb.threads);
+	for (i = 0; i < mb.threads; i++) {
+		error = pthread_create(&threads[i].tid, NULL, md_worker,
+				&threads[i]);
+		if (error) {
+			what = "pthread_create";
+			break;
+		}
+	}
+	started = i;
+	pthread_mutex_lock(&mb.lock);
+	mb.start = error ? -1 : 1;
+	pthread_cond_broadcast(&mb.start_cond);
+	pthread_mutex_unlock(&mb.lock);
+	for (i = 0; i < started; i++) {
+		struct md_thread *t = &threads[i];
+
+		pthread_join(t->tid, NULL);
+		if (t->error) {
+			errno = t->error;
+			perror(t->what);
+			exitcode = 1;
+		}
+	}
+	pthread_barrier_destroy(&mb.barrier);
+	pthread_cond_destroy(&mb.start_cond);
+	pthread_mutex_destroy(&mb.lock);
+
+	if (!error) {
+		md_report(&mb, threads);
+		if (mb.ag_spread)
+			md_report_ags(&mb, threads);
+	}
+
+	/* clear out whatever a failed phase left behind */
+	for (i = 0; i < started; i++) {
+		char	path[PATH_MAX];
+		unsigned int j;
+
+		if (!threads[i].error)
+			continue;
+		for (j = 0; j < mb.files; j++) {
+			md_path(&threads[i], j, false, path, sizeof(path));
+			unlinkat(mb.root_fd, path, 0);
+			md_path(&threads[i], j, true, path, sizeof(path));
+			unlinkat(mb.root_fd, path, 0);
+		}
+	}
+
+out:
+	if (error) {
+		errno = error;
+		perror(what ? what : "mdbench");
+		exitcode = 1;
+	}
+	for (i = 0; threads && i < mb.threads; i++) {
+		free(threads[i].ino);
+		for (phase = 0; phase < MD_NR_PHASES; phase++)
+			free(threads[i].lat[phase]);
+	}
+	free(threads);
+	for (i = 0; mb.trees && i < mb.nr_trees; i++) {
+		md_remove_tree(&mb, &mb.trees[i]);
+		md_free_tree(&mb.trees[i]);
+	}
+	free(mb.trees);
+	close(mb.root_fd);
+out_rmdir:
+	rmdir(argv[optind]);
+	return 0;
+}
+
+void
+mdbench_init(void)
+{
+	mdbench_cmd.name = "mdbench";
+	mdbench_cmd.cfunc = mdbench_f;
+	mdbench_cmd.argmin = 1;
+	mdbench_cmd.argmax = -1;
+	mdbench_cmd.flags = CMD_NOMAP_OK | CMD_NOFILE_OK | CMD_FOREIGN_OK;
+	mdbench_cmd.args =
+_("[-au] [-b fanout] [-j threads] [-n files] [-z depth] dir");
+	mdbench_cmd.oneline =
+		_("measure create, stat, rename and unlink rates");
+	mdbench_cmd.help = mdbench_help;
+
+	add_command(&mdbench_cmd);
+}
@@ -7,10 +7,20 @@
 #include "command.h"
 #include "input.h"
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dirent.h>
 #include "init.h"
 #include "io.h"
+#include "libfrog/dirwalk.h"
+#include "libfrog/ptvar.h"
+#include "libfrog/platform.h"
+
+#if !defined(__NR_cachestat) && !defined(__alpha__)
+# define __NR_cachestat		451
+#endif
 
 static cmdinfo_t mincore_cmd;
+static cmdinfo_t residency_cmd;
 
 static int
 mincore_f(
@@ -105,6 +115,304 @@ mincore_f(
 	return 0;
 }
 
+/*
+ * Page cache residency of every regular file under a set of trees.  The
+ * trees are walked in parallel, and each file is asked how much of it is
+ * cached with cachestat(2), which also counts dirty pages and costs one
+ * call per file.  On kernels without it, the file is mapped a window at a
+ * time and asked with mincore(2) instead.
+ */
+#define RES_WINDOW	(1ULL << 30)	/* mincore: bytes mapped at once */
+
+struct res_counts {
+	unsigned long long	files;
+	unsigned long long	resident_files;	/* at least one page cached */
+	unsigned long long	bytes;		/* file sizes */
+	unsigned long long	resident;	/* cached bytes */
+	unsigned long long	dirty;		/* cachestat only */
+	unsigned long long	errors;
+};
+
+struct res_walk {
+	struct ptvar		*counts;
+	bool			quiet;		/* no per-file lines */
+	bool			all;		/* lines for uncached files too */
+	bool			no_cachestat;
+	dev_t			dev;		/* of the tree being walked */
+};
+
+struct res_cachestat_range {
+	uint64_t		off;
+	uint64_t		len;
+};
+
+struct res_cachestat {
+	uint64_t		nr_cache;
+	uint64_t		nr_dirty;
+	uint64_t		nr_writeback;
+	uint64_t		nr_evicted;
+	uint64_t		nr_recently_evicted;
+};
+
+static void
+residency_help(void)
+{
+	printf(_(
+"\n"
+" reports how much of each regular file under the given paths is in the\n"
+" page cache, and the totals\n"
+"\n"
+" Directories are walked in parallel, without crossing into other\n"
+" filesystems.  cachestat(2) is used where the kernel has it, which also\n"
+" reports dirty pages; otherwise each file is mapped and mincore(2) used.\n"
+"\n"
+" Example:\n"
+" 'residency -j 16 -s /data' - totals only for everything under /data\n"
+"\n"
+" -a   -- list files with nothing cached too\n"
+" -j N -- walk with N threads, default the number of CPUs\n"
+" -s   -- only show the totals\n"
+"\n"));
+}
+
+/* Returns 0 and fills in the counts, or -1 with errno set. */
+static int
+res_cachestat(
+	struct res_walk		*rw,
+	int			fd,
+	unsigned long long	*resident,
+	unsigned long long	*dirty)
+{
+#ifdef __NR_cachestat
+	struct res_cachestat_range range = { 0, 0 };	/* the whole file */
+	struct res_cachestat	cs;
+
+	if (!__atomic_load_n(&rw->no_cachestat, __ATOMIC_RELAXED)) {
+		if (syscall(__NR_cachestat, fd, &range, &cs, 0) == 0) {
+			*resident = cs.nr_cache * pagesize;
+			*dirty = cs.nr_dirty * pagesize;
+			return 0;
+		}
+		if (errno != ENOSYS)
+			return -1;
+		__atomic_store_n(&rw->no_cachestat, true, __ATOMIC_RELAXED);
+	}
+#endif
+	errno = ENOSYS;
+	return -1;
+}
+
+static int
+res_mincore(
+	int			fd,
+	unsigned long long	size,
+	unsigned long long	*resident)
+{
+	unsigned char		*vec;
+	unsigned long long	off, len, i;
+	void			*addr;
+
+	vec = malloc(min(size, RES_WINDOW) / pagesize + 1);
+	if (!vec)
+		return -1;
+
+	*resident = 0;
+	for (off = 0; off < size; off += len) {
+		len = min(size - off, RES_WINDOW);
+		addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+		if (addr == MAP_FAILED)
+			goto fail;
+		if (mincore(addr, len, vec) < 0) {
+			munmap(addr, len);
+			goto fail;
+		}
+		for (i = 0; i < (len + pagesize - 1) / pagesize; i++)
+			if (vec[i] & 1)
+				*resident += pagesize;
+		munmap(addr, len);
+	}
+	free(vec);
+	return 0;
+fail:
+	free(vec);
+	return -1;
+}
+
+static int
+res_visit(
+	const char		*path,
+	int			dirfd,
+	const char		*name,
+	unsigned char		d_type,
+	int			depth,
+	void			*arg)
+{
+	struct res_walk		*rw = arg;
+	struct res_counts	*c;
+	unsigned long long	resident = 0, dirty = 0;
+	struct stat		st;
+	int			error;
+	int			fd;
+
+	c = ptvar_get(rw->counts, &error);
+	if (error)
+		return -error;
+
+	if (d_type == DT_DIR) {
+		if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			goto fail;
+		return st.st_dev == rw->dev ? DIRWALK_DESCEND : 0;
+	}
+	if (d_type != DT_REG && d_type != DT_UNKNOWN)
+		return 0;
+
+	fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK |
+			(depth ? O_NOFOLLOW : 0));
+	if (fd < 0) {
+		/* a symlink, or something we may not read */
+		if (depth && errno == ELOOP)
+			return 0;
+		goto fail;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		goto fail;
+	}
+	if (depth == 0)
+		rw->dev = st.st_dev;
+	if (S_ISDIR(st.st_mode)) {
+		close(fd);
+		return st.st_dev == rw->dev ? DIRWALK_DESCEND : 0;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		return 0;
+	}
+
+	if (st.st_size &&
+	    res_cachestat(rw, fd, &resident, &dirty) < 0 &&
+	    (errno != ENOSYS || res_mincore(fd, st.st_size, &resident) < 0)) {
+		close(fd);
+		goto fail;
+	}
+	close(fd);
+
+	/* the last page is only partly the file's */
+	resident = min(resident, (unsigned long long)st.st_size);
+	dirty = min(dirty, (unsigned long long)st.st_size);
+
+	c->files++;
+	c->bytes += st.st_size;
+	c->resident += resident;
+	c->dirty += dirty;
+	if (resident)
+		c->resident_files++;
+	if (!rw->quiet && (resident || rw->all))
+		printf("%12llu %12llu %5.1f%% %s\n", resident,
+				(unsigned long long)st.st_size,
+				st.st_size ? 100.0 * resident / st.st_size : 0.0,
+				path);
+	return 0;
+fail:
+	c->errors++;
+	fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return 0;
+}
+
+static int
+res_sum(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*foreach_arg)
+{
+	struct res_counts	*c = data;
+	struct res_counts	*total = foreach_arg;
+
+	total->files += c->files;
+	total->resident_files += c->resident_files;
+	total->bytes += c->bytes;
+	total->resident += c->resident;
+	total->dirty += c->dirty;
+	total->errors += c->errors;
+	return 0;
+}
+
+static int
+residency_f(
+	int			argc,
+	char			**argv)
+{
+	struct res_walk		rw = { };
+	struct res_counts	total = { };
+	unsigned int		nr_threads = platform_nproc();
+	char			s1[32], s2[32];
+	long long		tmp;
+	int			c, i, error;
+
+	while ((c = getopt(argc, argv, "aj:s")) != EOF) {
+		switch (c) {
+		case 'a':
+			rw.all = true;
+			break;
+		case 'j':
+			tmp = cvtnum(0, 0, optarg);
+			if (tmp <= 0 || tmp > 1024) {
+				printf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			nr_threads = tmp;
+			break;
+		case 's':
+			rw.quiet = true;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&residency_cmd);
+		}
+	}
+	if (optind == argc) {
+		exitcode = 1;
+		return command_usage(&residency_cmd);
+	}
+
+	/* one more for the main thread, which visits the roots */
+	error = -ptvar_alloc(nr_threads + 1, sizeof(struct res_counts),
+			&rw.counts);
+	if (error) {
+		errno = error;
+		perror("ptvar_alloc");
+		exitcode = 1;
+		return 0;
+	}
+
+	if (!rw.quiet)
+		printf(_("    resident         size cached path\n"));
+	for (i = optind; i < argc; i++) {
+		error = -dirwalk(argv[i], nr_threads, res_visit, NULL, &rw);
+		if (error) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(error));
+			exitcode = 1;
+		}
+	}
+	ptvar_foreach(rw.counts, res_sum, &total);
+	ptvar_free(rw.counts);
+
+	cvtstr(total.resident, s1, sizeof(s1));
+	cvtstr(total.bytes, s2, sizeof(s2));
+	printf(_("%llu files, %llu with pages cached, %s of %s cached (%.1f%%)\n"),
+			total.files, total.resident_files, s1, s2,
+			total.bytes ? 100.0 * total.resident / total.bytes : 0.0);
+	if (!rw.no_cachestat) {
+		cvtstr(total.dirty, s1, sizeof(s1));
+		printf(_("%s dirty\n"), s1);
+	}
+	if (total.errors) {
+		printf(_("%llu files could not be checked\n"), total.errors);
+		exitcode = 1;
+	}
+	return 0;
+}
+
 void
 mincore_init(void)
 {
@@ -117,5 +425,16 @@ mincore_init(void)
 	mincore_cmd.args = _("[off len]");
 	mincore_cmd.oneline = _("find mapping pages that are memory resident");
 
+	residency_cmd.name = "residency";
+	residency_cmd.cfunc = residency_f;
+	residency_cmd.argmin = 1;
+	residency_cmd.argmax = -1;
+	residency_cmd.flags = CMD_NOMAP_OK | CMD_NOFILE_OK | CMD_FOREIGN_OK;
+	residency_cmd.args = _("[-as] [-j threads] path...");
+	residency_cmd.oneline =
+		_("report how much of the files in a tree are in the page cache");
+	residency_cmd.help = residency_help;
+
 	add_command(&mincore_cmd);
+	add_command(&residency_cmd);
 }
@@ -6,7 +6,9 @@
 
 #include "command.h"
 #include "input.h"
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include "init.h"
 #include "io.h"
@@ -16,6 +18,7 @@ static cmdinfo_t mread_cmd;
 static cmdinfo_t msync_cmd;
 static cmdinfo_t munmap_cmd;
 static cmdinfo_t mwrite_cmd;
+static cmdinfo_t mtouch_cmd;
 #ifdef HAVE_MREMAP
 static cmdinfo_t mremap_cmd;
 #endif /* HAVE_MREMAP */
@@ -140,6 +143,8 @@ mmap_help(void)
 " -w -- map with PROT_WRITE protection\n"
 " -x -- map with PROT_EXEC protection\n"
 " -S -- map with MAP_SYNC and MAP_SHARED_VALIDATE flags\n"
+" -P -- map with MAP_POPULATE to fault in the whole range up front\n"
+" -H -- ask for transparent huge pages with madvise(MADV_HUGEPAGE)\n"
 " -s <size> -- first do mmap(size)/munmap(size), try to reserve some free space\n"
 " If no protection mode is specified, all are used by default.\n"
 "\n"));
@@ -156,6 +161,7 @@ mmap_f(
 	char		*filename;
 	size_t		blocksize, sectsize;
 	int		c, prot = 0, flags = MAP_SHARED;
+	int		populate = 0, hugepage = 0;
 
 	if (argc == 1) {
 		if (mapping)
@@ -181,7 +187,7 @@ mmap_f(
 
 	init_cvtnum(&blocksize, &sectsize);
 
-	while ((c = getopt(argc, argv, "rwxSs:")) != EOF) {
+	while ((c = getopt(argc, argv, "rwxSs:HP")) != EOF) {
 		switch (c) {
 		case 'r':
 			prot |= PROT_READ;
@@ -208,6 +214,17 @@ mmap_f(
 		case 's':
 			length2 = cvtnum(blocksize, sectsize, optarg);
 			break;
+		case 'H':
+#ifdef MADV_HUGEPAGE
+			hugepage = 1;
+#else
+			printf("MADV_HUGEPAGE not supported\n");
+			return 0;
+#endif
+			break;
+		case 'P':
+			populate = MAP_POPULATE;
+			break;
 		default:
 			exitcode = 1;
 			return command_usage(&mmap_cmd);
@@ -254,13 +271,19 @@ mmap_f(
 		               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 		munmap(address, length2);
 	}
-	address = mmap(address, length, prot, flags, file->fd, offset);
+	address = mmap(address, length, prot, flags | populate, file->fd,
+			offset);
 	if (address == MAP_FAILED) {
 		perror("mmap");
 		free(filename);
 		exitcode = 1;
 		return 0;
 	}
+#ifdef MADV_HUGEPAGE
+	/* only a hint; not every filesystem or kernel can do it */
+	if (hugepage && madvise(address, length, MADV_HUGEPAGE) < 0)
+		perror("madvise(MADV_HUGEPAGE)");
+#endif
 
 	/* Extend the control array of mmap'd regions */
 	maptable = (mmap_region_t *)realloc(maptable,		/* growing */
@@ -635,6 +658,296 @@ mwrite_f(
 	return 0;
 }
 
+/*
+ * mtouch: fault in the current mapping one page at a time, from several
+ * threads if asked, and see how fast that goes.
+ */
+struct mtouch {
+	char		*addr;		/* start of the range */
+	size_t		length;
+	size_t		stride;		/* or 0 for every page in turn */
+	bool		random;
+	bool		write;
+	int		seed;
+	struct io_latency *lat;
+};
+
+struct mtouch_thread {
+	struct mtouch	*mt;
+	pthread_t	tid;
+	size_t		start;		/* this thread's slice */
+	size_t		len;
+	unsigned int	seed;
+	unsigned long long touched;
+	struct io_latency *lat;
+};
+
+static inline void
+mtouch_page(
+	struct mtouch_thread	*t,
+	size_t			off)
+{
+	volatile char		*p = t->mt->addr + off;
+	uint64_t		start = 0;
+
+	if (t->lat)
+		start = lat_now();
+	if (t->mt->write)
+		*p = t->mt->seed;
+	else
+		(void)*p;
+	if (t->lat)
+		lat_record(t->lat, lat_now() - start);
+	t->touched++;
+}
+
+static void *
+mtouch_worker(
+	void			*arg)
+{
+	struct mtouch_thread	*t = arg;
+	struct mtouch		*mt = t->mt;
+	size_t			npages = t->len / pagesize;
+	size_t			i, off, phase;
+
+	if (mt->random) {
+		size_t	total = mt->length / pagesize;
+
+		for (i = 0; i < npages; i++) {
+			off = ((((uint64_t)rand_r(&t->seed) << 31) |
+				rand_r(&t->seed)) % total) * pagesize;
+			mtouch_page(t, off);
+		}
+	} else if (mt->stride) {
+		/* every stride'th page, then again one page further on... */
+		for (phase = 0; phase < mt->stride; phase += pagesize)
+			for (off = phase; off < t->len; off += mt->stride)
+				mtouch_page(t, t->start + off);
+	} else {
+		for (off = 0; off < t->len; off += pagesize)
+			mtouch_page(t, t->start + off);
+	}
+	return NULL;
+}
+
+static void
+mtouch_help(void)
+{
+	printf(_(
+"\n"
+" touches every page in a range of the current memory mapping\n"
+"\n"
+" Example:\n"
+" 'mtouch -j 8 -R -L' - read one byte from random pages of the whole mapping\n"
+"                       with eight threads, and report page fault latency\n"
+"\n"
+" Reads (or writes) one byte in each page, splitting the range evenly over\n"
+" the threads, and reports how many pages per second were touched and how\n"
+" many page faults that took.  Useful for comparing page cache, large folio\n"
+" and DAX fault performance.\n"
+" -C -- print the results in a condensed format\n"
+" -j N -- touch pages from N threads\n"
+" -L -- report the latency distribution of each touch\n"
+" -R -- touch pages in random order, as many touches as there are pages\n"
+" -s N -- touch every Nth byte, then go around again one page further on\n"
+" -w -- write a byte instead of reading one\n"
+" -S N -- with -w, the byte to store (default 'X'); with -R, the seed\n"
+"\n"));
+}
+
+static int
+mtouch_f(
+	int			argc,
+	char			**argv)
+{
+	struct mtouch		mt = { .seed = 'X' };
+	struct mtouch_thread	*threads;
+	struct rusage		ru1, ru2;
+	struct timeval		t1, t2;
+	off64_t			offset;
+	ssize_t			length;
+	size_t			blocksize, sectsize;
+	size_t			slice;
+	long long		stride = 0;
+	unsigned long long	touched = 0;
+	char			ts[64];
+	char			*sp;
+	int			nr_threads = 1;
+	int			condensed = 0;
+	int			lflag = 0;
+	int			c, i, started;
+	int			error = 0;
+
+	init_cvtnum(&blocksize, &sectsize);
+	while ((c = getopt(argc, argv, "Cj:LRs:S:w")) != EOF) {
+		switch (c) {
+		case 'C':
+			condensed = 1;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads <= 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'L':
+			lflag = 1;
+			break;
+		case 'R':
+			mt.random = true;
+			break;
+		case 's':
+			stride = cvtnum(blocksize, sectsize, optarg);
+			if (stride <= 0 || stride % pagesize) {
+				printf(
+			_("stride must be a multiple of the page size -- %s\n"),
+					optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'S':
+			mt.seed = (int)strtol(optarg, &sp, 0);
+			if (!sp || sp == optarg) {
+				printf(_("non-numeric seed -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'w':
+			mt.write = true;
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&mtouch_cmd);
+		}
+	}
+	if (mt.random && stride) {
+		exitcode = 1;
+		return command_usage(&mtouch_cmd);
+	}
+	mt.stride = stride;
+
+	if (optind == argc) {
+		offset = mapping->offset;
+		length = mapping->length;
+	} else if (optind == argc - 2) {
+		offset = cvtnum(blocksize, sectsize, argv[optind]);
+		if (offset < 0) {
+			printf(_("non-numeric offset argument -- %s\n"),
+				argv[optind]);
+			exitcode = 1;
+			return 0;
+		}
+		optind++;
+		length = cvtnum(blocksize, sectsize, argv[optind]);
+		if (length < 0) {
+			printf(_("non-numeric length argument -- %s\n"),
+				argv[optind]);
+			exitcode = 1;
+			return 0;
+		}
+	} else {
+		exitcode = 1;
+		return command_usage(&mtouch_cmd);
+	}
+
+	mt.addr = check_mapping_range(mapping, offset, length, 1);
+	if (!mt.addr) {
+		exitcode = 1;
+		return 0;
+	}
+	mt.length = length - length % pagesize;
+	if (!mt.length)
+		return 0;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		exitcode = 1;
+		return 0;
+	}
+	if (lflag) {
+		mt.lat = calloc(1, sizeof(*mt.lat));
+		if (!mt.lat) {
+			perror("calloc");
+			exitcode = 1;
+			goto out;
+		}
+	}
+
+	slice = roundup((mt.length + nr_threads - 1) / nr_threads, pagesize);
+	for (i = 0; i < nr_threads; i++) {
+		struct mtouch_thread	*t = &threads[i];
+
+		t->mt = &mt;
+		t->seed = mt.seed + i;
+		t->start = min(i * slice, mt.length);
+		t->len = min(slice, mt.length - t->start);
+		if (lflag) {
+			t->lat = calloc(1, sizeof(*t->lat));
+			if (!t->lat) {
+				perror("calloc");
+				exitcode = 1;
+				goto out;
+			}
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &ru1);
+	gettimeofday(&t1, NULL);
+	for (started = 0; started < nr_threads; started++) {
+		if (!threads[started].len)
+			break;
+		error = pthread_create(&threads[started].tid, NULL,
+				mtouch_worker, &threads[started]);
+		if (error)
+			break;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].tid, NULL);
+		touched += threads[i].touched;
+		if (mt.lat)
+			lat_merge(mt.lat, threads[i].lat);
+	}
+	gettimeofday(&t2, NULL);
+	getrusage(RUSAGE_SELF, &ru2);
+	if (error) {
+		errno = error;
+		perror("pthread_create");
+		exitcode = 1;
+		goto out;
+	}
+
+	t2 = tsub(t2, t1);
+	if (condensed) {
+		/* pages,faults,major faults,secs,pages/sec */
+		printf("%llu,%ld,%ld,%.6f,%.1f\n", touched,
+			ru2.ru_minflt - ru1.ru_minflt,
+			ru2.ru_majflt - ru1.ru_majflt,
+			t2.tv_sec + t2.tv_usec / 1000000.0,
+			tdiv((double)touched, t2));
+	} else {
+		timestr(&t2, ts, sizeof(ts), 0);
+		printf(_("touched %llu pages with %d threads in %s "
+			 "(%.1f pages/sec)\n"),
+			touched, started, ts, tdiv((double)touched, t2));
+		printf(_("%ld minor faults, %ld major faults\n"),
+			ru2.ru_minflt - ru1.ru_minflt,
+			ru2.ru_majflt - ru1.ru_majflt);
+	}
+	if (mt.lat)
+		lat_report("touch", mt.lat, condensed);
+out:
+	for (i = 0; i < nr_threads; i++)
+		free(threads[i].lat);
+	free(mt.lat);
+	free(threads);
+	return 0;
+}
+
 #ifdef HAVE_MREMAP
 static void
 mremap_help(void)
@@ -723,7 +1036,7 @@ mmap_init(void)
 	mmap_cmd.argmax = -1;
 	mmap_cmd.flags = CMD_NOMAP_OK | CMD_NOFILE_OK |
 			 CMD_FOREIGN_OK | CMD_FLAG_ONESHOT;
-	mmap_cmd.args = _("[N] | [-rwxS] [-s size] [off len]");
+	mmap_cmd.args = _("[N] | [-rwxSHP] [-s size] [off len]");
 	mmap_cmd.oneline =
 		_("mmap a range in the current file, show mappings");
 	mmap_cmd.help = mmap_help;
@@ -768,6 +1081,17 @@ mmap_init(void)
 		_("writes data into a region in the current memory mapping");
 	mwrite_cmd.help = mwrite_help;
 
+	mtouch_cmd.name = "mtouch";
+	mtouch_cmd.cfunc = mtouch_f;
+	mtouch_cmd.argmin = 0;
+	mtouch_cmd.argmax = -1;
+	mtouch_cmd.flags = CMD_NOFILE_OK | CMD_FOREIGN_OK;
+	mtouch_cmd.args =
+		_("[-CLRw] [-j threads] [-s stride] [-S seed] [off len]");
+	mtouch_cmd.oneline =
+		_("times page faults in the current memory mapping");
+	mtouch_cmd.help = mtouch_help;
+
 #ifdef HAVE_MREMAP
 	mremap_cmd.name = "mremap";
 	mremap_cmd.altname = "mrm";
@@ -786,6 +1110,7 @@ mmap_init(void)
 	add_command(&msync_cmd);
 	add_command(&munmap_cmd);
 	add_command(&mwrite_cmd);
+	add_command(&mtouch_cmd);
 #ifdef HAVE_MREMAP
 	add_command(&mremap_cmd);
 #endif /* HAVE_MREMAP */
@@ -151,6 +151,7 @@ openfile(
 	}
 
 	if (fs_path) {
+		fs_table_initialise_path(path);
 		fsp = fs_table_lookup(path, FS_MOUNT_POINT);
 		if (!fsp)
 			memset(fs_path, 0, sizeof(*fs_path));
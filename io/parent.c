@@ -365,12 +365,8 @@ parent_f(int argc, char **argv)
 	int listpath_flag = 0;
 	int check_flag = 0;
 	fs_path_t *fs;
-	static int tab_init;
 
-	if (!tab_init) {
-		tab_init = 1;
-		fs_table_initialise(0, NULL, 0, NULL);
-	}
+	fs_table_initialise_path(file->name);
 	fs = fs_table_lookup(file->name, FS_MOUNT_POINT);
 	if (!fs) {
 		fprintf(stderr, _("file argument, \"%s\", is not in a mounted XFS filesystem\n"),
@@ -37,6 +37,10 @@ pread_help(void)
 " -R   -- read at random offsets in the range of bytes\n"
 " -Z N -- zeed the random number generator (used when reading randomly)\n"
 "         (heh, zorry, the -s/-S arguments were already in use in pwrite)\n"
+" -j N -- split the range between N threads, each reading its own part\n"
+" -Q N -- keep up to N reads in flight per thread (needs io_uring)\n"
+" -L   -- report the latency of the reads at various percentiles\n"
+"         (with -C, as min,p50,p90,p99,p99.9,p99.99,max in microseconds)\n"
 #ifdef HAVE_PREADV
 " -V N -- use vectored IO with N iovecs of blocksize each (preadv)\n"
 #endif
@@ -45,6 +49,8 @@ pread_help(void)
 " number required to do a complete forward/backward scan of the range.\n"
 " Note that the offset within the range is chosen at random each time\n"
 " (an offset may be read more than once when operating in this mode).\n"
+" With -j or -Q, each thread does its share of the reads; -v and -V can't\n"
+" be used with them.\n"
 "\n"));
 }
 
@@ -197,7 +203,7 @@ do_preadv(
 #endif
 
 static ssize_t
-do_pread(
+__do_pread(
 	int		fd,
 	off64_t		offset,
 	long long	count,
@@ -209,6 +215,25 @@ do_pread(
 	return do_preadv(fd, offset, count);
 }
 
+static ssize_t
+do_pread(
+	int		fd,
+	off64_t		offset,
+	long long	count,
+	size_t		buffer_size)
+{
+	uint64_t	start;
+	ssize_t		ret;
+
+	if (!io_lat)
+		return __do_pread(fd, offset, count, buffer_size);
+
+	start = lat_now();
+	ret = __do_pread(fd, offset, count, buffer_size);
+	lat_record(io_lat, lat_now() - start);
+	return ret;
+}
+
 static int
 read_random(
 	int		fd,
@@ -374,15 +399,17 @@ pread_f(
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
 	char		*sp;
-	int		Cflag, qflag, uflag, vflag;
+	int		Cflag, Lflag, qflag, uflag, vflag;
 	int		eof = 0, direction = IO_FORWARD;
+	unsigned int	threads = 1, depth = 1;
+	struct io_latency *lat = NULL;
 	int		c;
 
-	Cflag = qflag = uflag = vflag = 0;
+	Cflag = Lflag = qflag = uflag = vflag = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCFRquvV:Z:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:BCFj:LQ:RquvV:Z:")) != EOF) {
 		switch (c) {
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
@@ -405,6 +432,25 @@ pread_f(
 		case 'R':
 			direction = IO_RANDOM;
 			break;
+		case 'j':
+			threads = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || threads == 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'L':
+			Lflag = 1;
+			break;
+		case 'Q':
+			depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || depth == 0) {
+				printf(_("bad queue depth -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 		case 'q':
 			qflag = 1;
 			break;
@@ -438,7 +484,8 @@ pread_f(
 			return command_usage(&pread_cmd);
 		}
 	}
-	if (optind != argc - 2) {
+	if (optind != argc - 2 ||
+	    ((threads > 1 || depth > 1) && (vflag || vectors))) {
 		exitcode = 1;
 		return command_usage(&pread_cmd);
 	}
@@ -465,7 +512,40 @@ pread_f(
 		exitcode = 1;
 		return 0;
 	}
+	if (Lflag && !(lat = calloc(1, sizeof(*lat)))) {
+		perror("calloc");
+		exitcode = 1;
+		goto out;
+	}
+
+	if (threads > 1 || depth > 1) {
+		struct ioengine	eng = {
+			.fd		= file->fd,
+			.direction	= direction,
+			.bsize		= bsize,
+			.threads	= threads,
+			.depth		= depth,
+			.seed		= zeed ? zeed : time(NULL),
+			.lat		= lat,
+		};
+
+		if (eof && direction == IO_FORWARD)
+			count = max(filesize() - offset, 0LL);
+		else if (eof)
+			offset = filesize();
+		if (direction == IO_BACKWARD) {
+			count = min(count, (long long)offset);
+			offset -= count;
+		}
+		eng.offset = offset;
+		eng.count = count;
 
+		gettimeofday(&t1, NULL);
+		c = ioengine_run(&eng, &total);
+		goto done;
+	}
+
+	io_lat = lat;
 	gettimeofday(&t1, NULL);
 	switch (direction) {
 	case IO_RANDOM:
@@ -484,17 +564,23 @@ pread_f(
 	default:
 		ASSERT(0);
 	}
+done:
+	io_lat = NULL;
 	if (c < 0) {
 		exitcode = 1;
-		return 0;
+		goto out;
 	}
 
 	if (qflag)
-		return 0;
+		goto out;
 	gettimeofday(&t2, NULL);
 	t2 = tsub(t2, t1);
 
 	report_io_times("read", &t2, (long long)offset, count, total, c, Cflag);
+	if (lat)
+		lat_report("read", lat, Cflag);
+out:
+	free(lat);
 	return 0;
 }
 
@@ -507,7 +593,8 @@ pread_init(void)
 	pread_cmd.argmin = 2;
 	pread_cmd.argmax = -1;
 	pread_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
-	pread_cmd.args = _("[-b bs] [-qv] [-i N] [-FBR [-Z N]] off len");
+	pread_cmd.args =
+		_("[-b bs] [-qvL] [-i N] [-j N] [-Q N] [-FBR [-Z N]] off len");
 	pread_cmd.oneline = _("reads a number of bytes at a specified offset");
 	pread_cmd.help = pread_help;
 
@@ -40,6 +40,11 @@ pwrite_help(void)
 " -R   -- write at random offsets in the specified range of bytes\n"
 " -Z N -- zeed the random number generator (used when writing randomly)\n"
 "         (heh, zorry, the -s/-S arguments were already in use in pwrite)\n"
+" -j N -- split the range between N threads, each writing its own part\n"
+" -Q N -- keep up to N writes in flight per thread (needs io_uring)\n"
+"         (-j and -Q can't be used with -i, -O or -V)\n"
+" -L   -- report the latency of the writes at various percentiles\n"
+"         (with -C, as min,p50,p90,p99,p99.9,p99.99,max in microseconds)\n"
 #ifdef HAVE_PWRITEV
 " -V N -- use vectored IO with N iovecs of blocksize each (pwritev)\n"
 #endif
@@ -95,7 +100,7 @@ do_pwritev(
 #endif
 
 static ssize_t
-do_pwrite(
+__do_pwrite(
 	int		fd,
 	off64_t		offset,
 	long long	count,
@@ -108,6 +113,27 @@ do_pwrite(
 	return do_pwritev(fd, offset, count, pwritev2_flags);
 }
 
+static ssize_t
+do_pwrite(
+	int		fd,
+	off64_t		offset,
+	long long	count,
+	size_t		buffer_size,
+	int		pwritev2_flags)
+{
+	uint64_t	start;
+	ssize_t		ret;
+
+	if (!io_lat)
+		return __do_pwrite(fd, offset, count, buffer_size,
+				pwritev2_flags);
+
+	start = lat_now();
+	ret = __do_pwrite(fd, offset, count, buffer_size, pwritev2_flags);
+	lat_record(io_lat, lat_now() - start);
+	return ret;
+}
+
 static int
 write_random(
 	off64_t		offset,
@@ -281,16 +307,18 @@ pwrite_f(
 	size_t		fsblocksize, fssectsize;
 	struct timeval	t1, t2;
 	char		*sp, *infile = NULL;
-	int		Cflag, qflag, uflag, dflag, wflag, Wflag;
+	int		Cflag, Lflag, qflag, uflag, dflag, wflag, Wflag;
 	int		direction = IO_FORWARD;
 	int		c, fd = -1;
 	int		pwritev2_flags = 0;
+	unsigned int	threads = 1, depth = 1;
+	struct io_latency *lat = NULL;
 
-	Cflag = qflag = uflag = dflag = wflag = Wflag = 0;
+	Cflag = Lflag = qflag = uflag = dflag = wflag = Wflag = 0;
 	init_cvtnum(&fsblocksize, &fssectsize);
 	bsize = fsblocksize;
 
-	while ((c = getopt(argc, argv, "b:BCdDf:Fi:NqRs:OS:uV:wWZ:")) != EOF) {
+	while ((c = getopt(argc, argv, "b:BCdDf:Fi:j:LNqQ:Rs:OS:uV:wWZ:")) != EOF) {
 		switch (c) {
 		case 'b':
 			tmp = cvtnum(fsblocksize, fssectsize, optarg);
@@ -323,6 +351,25 @@ pwrite_f(
 		case 'i':
 			infile = optarg;
 			break;
+		case 'j':
+			threads = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || threads == 0) {
+				printf(_("bad thread count -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
+		case 'L':
+			Lflag = 1;
+			break;
+		case 'Q':
+			depth = strtoul(optarg, &sp, 0);
+			if (!sp || sp == optarg || depth == 0) {
+				printf(_("bad queue depth -- %s\n"), optarg);
+				exitcode = 1;
+				return 0;
+			}
+			break;
 #ifdef HAVE_PWRITEV2
 		case 'N':
 			pwritev2_flags |= RWF_NOWAIT;
@@ -396,6 +443,11 @@ pwrite_f(
 		exitcode = 1;
 		return command_usage(&pwrite_cmd);
 	}
+	if ((threads > 1 || depth > 1) &&
+	    (infile || vectors || direction == IO_ONCE)) {
+		exitcode = 1;
+		return command_usage(&pwrite_cmd);
+	}
 	offset = cvtnum(fsblocksize, fssectsize, argv[optind]);
 	if (offset < 0) {
 		printf(_("non-numeric offset argument -- %s\n"), argv[optind]);
@@ -420,7 +472,39 @@ pwrite_f(
 		exitcode = 1;
 		return 0;
 	}
+	if (Lflag && !(lat = calloc(1, sizeof(*lat)))) {
+		perror("calloc");
+		exitcode = 1;
+		goto done;
+	}
+
+	if (threads > 1 || depth > 1) {
+		struct ioengine	eng = {
+			.fd		= file->fd,
+			.write		= true,
+			.direction	= direction,
+			.bsize		= bsize,
+			.threads	= threads,
+			.depth		= depth,
+			.seed		= zeed ? zeed : time(NULL),
+			.pattern	= seed,
+			.rw_flags	= pwritev2_flags,
+			.lat		= lat,
+		};
+
+		if (direction == IO_BACKWARD) {
+			count = min(count, (long long)offset);
+			offset -= count;
+		}
+		eng.offset = offset;
+		eng.count = count;
+
+		gettimeofday(&t1, NULL);
+		c = ioengine_run(&eng, &total);
+		goto sync;
+	}
 
+	io_lat = lat;
 	gettimeofday(&t1, NULL);
 	switch (direction) {
 	case IO_RANDOM:
@@ -442,6 +526,8 @@ pwrite_f(
 		total = 0;
 		ASSERT(0);
 	}
+sync:
+	io_lat = NULL;
 	if (c < 0) {
 		exitcode = 1;
 		goto done;
@@ -468,9 +554,12 @@ pwrite_f(
 
 	report_io_times("wrote", &t2, (long long)offset, count, total, c,
 			Cflag);
+	if (lat)
+		lat_report("write", lat, Cflag);
 done:
 	if (infile)
 		close(fd);
+	free(lat);
 	return 0;
 }
 
@@ -484,7 +573,7 @@ pwrite_init(void)
 	pwrite_cmd.argmax = -1;
 	pwrite_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
 	pwrite_cmd.args =
-_("[-i infile [-qdDwNOW] [-s skip]] [-b bs] [-S seed] [-FBR [-Z N]] [-V N] off len");
+_("[-i infile [-qdDwNOW] [-s skip]] [-L] [-b bs] [-S seed] [-j N] [-Q N] [-FBR [-Z N]] [-V N] off len");
 	pwrite_cmd.oneline =
 		_("writes a number of bytes at a specified offset");
 	pwrite_cmd.help = pwrite_help;
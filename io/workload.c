@@ -0,0 +1,557 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ */
+
+#include <pthread.h>
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
+/*
+ * Mixed workload generator.
+ *
+ * The workload is a list of weighted ops.  Each thread picks its next op at
+ * random in proportion to the weights, runs it against the open file, and
+ * records how long it took, until the time runs out.  With a rate limit the
+ * ops are issued on a fixed schedule, so a slow op shows up as latency and
+ * not as a lower offered load.
+ */
+static cmdinfo_t workload_cmd;
+
+enum wl_op {
+	WL_READ,
+	WL_WRITE,
+	WL_APPEND,
+	WL_FSYNC,
+	WL_FDATASYNC,
+	WL_FALLOC,
+	WL_PUNCH,
+	WL_REFLINK,
+};
+
+static const char *wl_op_names[] = {
+	[WL_READ]	= "read",
+	[WL_WRITE]	= "write",
+	[WL_APPEND]	= "append",
+	[WL_FSYNC]	= "fsync",
+	[WL_FDATASYNC]	= "fdatasync",
+	[WL_FALLOC]	= "falloc",
+	[WL_PUNCH]	= "punch",
+	[WL_REFLINK]	= "reflink",
+};
+
+#define WL_MAX_SPECS	16
+
+struct wl_spec {
+	char		text[64];	/* as given on the command line */
+	enum wl_op	op;
+	unsigned int	weight;
+	size_t		bsize;
+	bool		seq;		/* walk the range instead of hopping */
+	enum wl_op	sync;		/* WL_FSYNC/WL_FDATASYNC after, or 0 */
+};
+
+struct wl_stat {
+	uint64_t		ops;
+	uint64_t		bytes;
+	struct io_latency	*lat;
+};
+
+struct workload {
+	int		fd;
+	struct wl_spec	specs[WL_MAX_SPECS];
+	unsigned int	nr_specs;
+	unsigned int	total_weight;
+	unsigned int	threads;
+	long long	size;		/* range for read/write/falloc/... */
+	uint64_t	append_off;
+	uint64_t	deadline;
+	uint64_t	interval;	/* ns between ops per thread, or 0 */
+	unsigned int	seed;
+	size_t		max_bsize;
+};
+
+struct wl_thread {
+	struct workload	*wl;
+	pthread_t	tid;
+	unsigned int	seed;
+	long long	*cursor;	/* per spec, for seq */
+	struct wl_stat	*stats;		/* per spec */
+	void		*buf;
+	int		error;
+	const char	*what;
+};
+
+static void
+workload_help(void)
+{
+	printf(_(
+"\n"
+" runs a weighted mix of I/O operations against the open file\n"
+"\n"
+" Each op is given as weight:op[,modifier...], where op is one of read,\n"
+" write, append, fsync, fdatasync, falloc, punch, or reflink, and the\n"
+" modifiers are bs=N (size of each op, default 4k), seq (walk the range in\n"
+" order instead of picking offsets at random), and fsync or fdatasync (flush\n"
+" after each op, counted in its latency).  Reflink clones one bs sized block\n"
+" of the file onto another, so bs must be a multiple of the block size.\n"
+" Appends go past the end of the range and are not read back.\n"
+"\n"
+" Example:\n"
+" 'workload -j 4 -T 60 70:read,bs=4k 20:append,bs=64k,fdatasync 10:reflink,bs=1m'\n"
+"\n"
+" -j N -- run N threads\n"
+" -r N -- issue at most N ops per second across all threads\n"
+" -s N -- range for the non-append ops, default the file's size\n"
+" -S N -- seed for the random number generators\n"
+" -T N -- run for N seconds, default 10\n"
+" At the end the number of ops, throughput, and latency of each op is shown.\n"
+"\n"));
+}
+
+static int
+workload_parse_spec(
+	struct wl_spec	*spec,
+	char		*arg,
+	size_t		fsblocksize,
+	size_t		fssectsize)
+{
+	unsigned int	nr_ops = sizeof(wl_op_names) / sizeof(wl_op_names[0]);
+	char		*p, *tok;
+	long long	tmp;
+	unsigned int	i;
+
+	snprintf(spec->text, sizeof(spec->text), "%s", arg);
+	spec->bsize = 4096;
+
+	p = strchr(arg, ':');
+	if (!p)
+		return -1;
+	*p++ = 0;
+	tmp = cvtnum(0, 0, arg);
+	if (tmp <= 0 || tmp > 1000000)
+		return -1;
+	spec->weight = tmp;
+
+	tok = strsep(&p, ",");
+	for (i = 0; i < nr_ops; i++)
+		if (!strcmp(tok, wl_op_names[i]))
+			break;
+	if (i == nr_ops)
+		return -1;
+	spec->op = i;
+
+	while ((tok = strsep(&p, ",")) != NULL) {
+		if (!strncmp(tok, "bs=", 3)) {
+			tmp = cvtnum(fsblocksize, fssectsize, tok + 3);
+			if (tmp <= 0 || tmp > INT_MAX)
+				return -1;
+			spec->bsize = tmp;
+		} else if (!strcmp(tok, "seq")) {
+			spec->seq = true;
+		} else if (!strcmp(tok, "rand")) {
+			spec->seq = false;
+		} else if (!strcmp(tok, "fsync")) {
+			spec->sync = WL_FSYNC;
+		} else if (!strcmp(tok, "fdatasync")) {
+			spec->sync = WL_FDATASYNC;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static struct wl_spec *
+workload_pick(
+	struct wl_thread	*t)
+{
+	struct workload		*wl = t->wl;
+	unsigned int		r = rand_r(&t->seed) % wl->total_weight;
+	unsigned int		i;
+
+	for (i = 0; i < wl->nr_specs - 1; i++) {
+		if (r < wl->specs[i].weight)
+			break;
+		r -= wl->specs[i].weight;
+	}
+	return &wl->specs[i];
+}
+
+/* Next offset for a non-append op, in whole bs sized blocks of the range. */
+static off64_t
+workload_offset(
+	struct wl_thread	*t,
+	struct wl_spec		*spec)
+{
+	long long		nblocks = t->wl->size / spec->bsize;
+	long long		*cursor = &t->cursor[spec - t->wl->specs];
+	off64_t			off;
+
+	if (!spec->seq)
+		return ((((uint64_t)rand_r(&t->seed) << 31) |
+			 rand_r(&t->seed)) % nblocks) * spec->bsize;
+
+	off = *cursor;
+	*cursor += spec->bsize;
+	if (*cursor + spec->bsize > t->wl->size)
+		*cursor = 0;
+	return off;
+}
+
+/* Returns bytes moved, or -1 with errno set. */
+static ssize_t
+workload_do_op(
+	struct wl_thread	*t,
+	struct wl_spec		*spec)
+{
+	struct workload		*wl = t->wl;
+	struct xfs_clone_args	args;
+	off64_t			off, doff;
+	long long		nblocks;
+	ssize_t			ret = 0;
+
+	switch (spec->op) {
+	case WL_READ:
+		ret = pread(wl->fd, t->buf, spec->bsize,
+				workload_offset(t, spec));
+		break;
+	case WL_WRITE:
+		ret = pwrite(wl->fd, t->buf, spec->bsize,
+				workload_offset(t, spec));
+		break;
+	case WL_APPEND:
+		off = __atomic_fetch_add(&wl->append_off, spec->bsize,
+				__ATOMIC_RELAXED);
+		ret = pwrite(wl->fd, t->buf, spec->bsize, off);
+		break;
+	case WL_FSYNC:
+		ret = fsync(wl->fd);
+		break;
+	case WL_FDATASYNC:
+		ret = fdatasync(wl->fd);
+		break;
+	case WL_FALLOC:
+	case WL_PUNCH:
+#if defined(HAVE_FALLOCATE)
+		off = workload_offset(t, spec);
+		ret = fallocate(wl->fd, spec->op == WL_PUNCH ?
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : 0,
+				off, spec->bsize);
+		if (!ret)
+			ret = spec->bsize;
+#else
+		errno = EOPNOTSUPP;
+		ret = -1;
+#endif
+		break;
+	case WL_REFLINK:
+		/* two different blocks never overlap, as the ioctl requires */
+		nblocks = wl->size / spec->bsize;
+		off = workload_offset(t, spec);
+		doff = ((rand_r(&t->seed) % (nblocks - 1)) + 1) * spec->bsize;
+		doff = (off + doff) % (nblocks * spec->bsize);
+		args.src_fd = wl->fd;
+		args.src_offset = off;
+		args.src_length = spec->bsize;
+		args.dest_offset = doff;
+		ret = ioctl(wl->fd, XFS_IOC_CLONE_RANGE, &args);
+		if (!ret)
+			ret = spec->bsize;
+		break;
+	}
+	if (ret < 0)
+		return ret;
+
+	if (spec->sync == WL_FSYNC && fsync(wl->fd) < 0)
+		return -1;
+	if (spec->sync == WL_FDATASYNC && fdatasync(wl->fd) < 0)
+		return -1;
+	return ret;
+}
+
+static void *
+workload_worker(
+	void			*arg)
+{
+	struct wl_thread	*t = arg;
+	struct workload		*wl = t->wl;
+	struct wl_spec		*spec;
+	struct wl_stat		*st;
+	struct timespec		ts;
+	uint64_t		next = lat_now();
+	uint64_t		start, now;
+	ssize_t			ret;
+
+	while ((now = lat_now()) <
+	       __atomic_load_n(&wl->deadline, __ATOMIC_RELAXED)) {
+		if (wl->interval) {
+			if (now < next) {
+				ts.tv_sec = (next - now) / 1000000000ULL;
+				ts.tv_nsec = (next - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+				if (next >= wl->deadline)
+					break;
+			}
+			start = next;
+			next += wl->interval;
+		} else {
+			start = now;
+		}
+
+		spec = workload_pick(t);
+		st = &t->stats[spec - wl->specs];
+		ret = workload_do_op(t, spec);
+		lat_record(st->lat, lat_now() - start);
+		if (ret < 0) {
+			t->error = errno;
+			t->what = spec->text;
+			break;
+		}
+		st->ops++;
+		st->bytes += ret;
+	}
+	return NULL;
+}
+
+static void
+workload_report(
+	struct workload		*wl,
+	struct wl_stat		*stats,
+	double			secs)
+{
+	struct wl_spec		*spec;
+	struct wl_stat		*st;
+	char			s[32];
+	unsigned int		i;
+
+	for (i = 0; i < wl->nr_specs; i++) {
+		spec = &wl->specs[i];
+		st = &stats[i];
+		printf(_("%s: %llu ops, %.1f ops/sec"), spec->text,
+				(unsigned long long)st->ops, st->ops / secs);
+		if (st->bytes) {
+			cvtstr(st->bytes / secs, s, sizeof(s));
+			printf(_(", %s/sec"), s);
+		}
+		printf("\n");
+		lat_report(spec->text, st->lat, 0);
+	}
+}
+
+static int
+workload_f(
+	int			argc,
+	char			**argv)
+{
+	struct workload		wl = {
+		.fd		= file->fd,
+		.threads	= 1,
+		.size		= -1,
+		.seed		= 1,
+	};
+	struct wl_thread	*threads = NULL;
+	struct wl_stat		*stats = NULL;
+	struct wl_spec		*spec;
+	struct stat		st;
+	size_t			fsblocksize, fssectsize;
+	long long		secs = 10, rate = 0, tmp;
+	uint64_t		start;
+	unsigned int		i, j, started;
+	int			c, error = 0;
+
+	init_cvtnum(&fsblocksize, &fssectsize);
+	while ((c = getopt(argc, argv, "j:r:s:S:T:")) != EOF) {
+		switch (c) {
+		case 'j':
+			tmp = cvtnum(0, 0, optarg);
+			if (tmp <= 0 || tmp > 1024) {
+				printf(_("bad thread count %s\n"), optarg);
+				return 0;
+			}
+			wl.threads = tmp;
+			break;
+		case 'r':
+			rate = cvtnum(0, 0, optarg);
+			if (rate <= 0) {
+				printf(_("bad op rate %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 's':
+			wl.size = cvtnum(fsblocksize, fssectsize, optarg);
+			if (wl.size <= 0) {
+				printf(_("non-numeric size -- %s\n"), optarg);
+				return 0;
+			}
+			break;
+		case 'S':
+			wl.seed = cvtnum(0, 0, optarg);
+			break;
+		case 'T':
+			secs = cvtnum(0, 0, optarg);
+			if (secs <= 0) {
+				printf(_("bad run time %s\n"), optarg);
+				return 0;
+			}
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&workload_cmd);
+		}
+	}
+	if (optind == argc || argc - optind > WL_MAX_SPECS) {
+		exitcode = 1;
+		return command_usage(&workload_cmd);
+	}
+
+	if (fstat(wl.fd, &st) < 0) {
+		perror("fstat");
+		exitcode = 1;
+		return 0;
+	}
+	if (wl.size < 0)
+		wl.size = st.st_size;
+
+	for (i = optind; i < argc; i++) {
+		spec = &wl.specs[wl.nr_specs];
+		if (workload_parse_spec(spec, argv[i], fsblocksize,
+					fssectsize)) {
+			printf(_("bad op %s\n"), argv[i]);
+			exitcode = 1;
+			return 0;
+		}
+		if (spec->op != WL_APPEND && spec->op != WL_FSYNC &&
+		    spec->op != WL_FDATASYNC &&
+		    wl.size < (long long)spec->bsize *
+				(spec->op == WL_REFLINK ? 2 : 1)) {
+			printf(_("%s: range of %lld bytes is too small, see -s\n"),
+					spec->text, wl.size);
+			exitcode = 1;
+			return 0;
+		}
+		wl.max_bsize = max(wl.max_bsize, spec->bsize);
+		wl.total_weight += spec->weight;
+		wl.nr_specs++;
+	}
+	wl.append_off = roundup(max((long long)st.st_size, wl.size),
+			(long long)wl.max_bsize);
+	if (rate)
+		wl.interval = 1000000000ULL * wl.threads / rate;
+
+	threads = calloc(wl.threads, sizeof(*threads));
+	stats = calloc(wl.nr_specs, sizeof(*stats));
+	if (!threads || !stats)
+		goto out_nomem;
+	for (j = 0; j < wl.nr_specs; j++) {
+		stats[j].lat = calloc(1, sizeof(struct io_latency));
+		if (!stats[j].lat)
+			goto out_nomem;
+	}
+	for (i = 0; i < wl.threads; i++) {
+		struct wl_thread	*t = &threads[i];
+
+		t->wl = &wl;
+		t->seed = wl.seed + i;
+		t->cursor = calloc(wl.nr_specs, sizeof(*t->cursor));
+		t->stats = calloc(wl.nr_specs, sizeof(*t->stats));
+		t->buf = memalign(pagesize, wl.max_bsize);
+		if (!t->cursor || !t->stats || !t->buf)
+			goto out_nomem;
+		memset(t->buf, 0xcd, wl.max_bsize);
+		for (j = 0; j < wl.nr_specs; j++) {
+			spec = &wl.specs[j];
+			/* spread the sequential walkers out over the range */
+			t->cursor[j] = wl.size / wl.threads * i;
+			t->cursor[j] -= t->cursor[j] % spec->bsize;
+			if (t->cursor[j] + spec->bsize > wl.size)
+				t->cursor[j] = 0;
+			t->stats[j].lat = calloc(1, sizeof(struct io_latency));
+			if (!t->stats[j].lat)
+				goto out_nomem;
+		}
+	}
+
+	start = lat_now();
+	wl.deadline = start + secs * 1000000000ULL;
+	for (i = 0; i < wl.threads; i++) {
+		error = pthread_create(&threads[i].tid, NULL, workload_worker,
+				&threads[i]);
+		if (error)
+			break;
+	}
+	if (error) {
+		/* let the ones we started stop right away */
+		__atomic_store_n(&wl.deadline, 0, __ATOMIC_RELAXED);
+		errno = error;
+		perror("pthread_create");
+		exitcode = 1;
+	}
+	started = i;
+	for (i = 0; i < started; i++) {
+		struct wl_thread	*t = &threads[i];
+
+		pthread_join(t->tid, NULL);
+		for (j = 0; j < wl.nr_specs; j++) {
+			stats[j].ops += t->stats[j].ops;
+			stats[j].bytes += t->stats[j].bytes;
+			lat_merge(stats[j].lat, t->stats[j].lat);
+		}
+		if (t->error) {
+			errno = t->error;
+			perror(t->what);
+			exitcode = 1;
+		}
+	}
+	if (!error)
+		workload_report(&wl, stats, (lat_now() - start) / 1000000000.0);
+	goto out;
+
+out_nomem:
+	perror("calloc");
+	exitcode = 1;
+out:
+	if (threads) {
+		for (i = 0; i < wl.threads; i++) {
+			struct wl_thread	*t = &threads[i];
+
+			if (t->stats)
+				for (j = 0; j < wl.nr_specs; j++)
+					free(t->stats[j].lat);
+			free(t->stats);
+			free(t->cursor);
+			free(t->buf);
+		}
+	}
+	if (stats)
+		for (j = 0; j < wl.nr_specs; j++)
+			free(stats[j].lat);
+	free(stats);
+	free(threads);
+	return 0;
+}
+
+void
+workload_init(void)
+{
+	workload_cmd.name = "workload";
+	workload_cmd.cfunc = workload_f;
+	workload_cmd.argmin = 1;
+	workload_cmd.argmax = -1;
+	workload_cmd.flags = CMD_NOMAP_OK | CMD_FOREIGN_OK;
+	workload_cmd.args =
+_("[-j threads] [-r ops/sec] [-s size] [-S seed] [-T secs] weight:op[,mod...]...");
+	workload_cmd.oneline = _("run a weighted mix of I/O operations");
+	workload_cmd.help = workload_help;
+
+	add_command(&workload_cmd);
+}
@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "aioq.h"
+
+/* Don't start more threads than this for the thread pool engine. */
+#define AIOQ_MAX_THREADS	64
+
+/* The kernel won't register a buffer larger than this. */
+#define AIOQ_MAX_FIXED		(1ULL << 30)
+
+static uint64_t
+aioq_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Account for a finished request and hand it back to its owner. */
+static void
+aioq_complete(
+	struct aioq		*q,
+	struct aioq_req		*req,
+	ssize_t			res)
+{
+	struct aioq_stats	*st = &q->stats;
+
+	q->inflight--;
+	if (req->op == AIOQ_READ) {
+		st->reads++;
+		if (res > 0)
+			st->read_bytes += res;
+	} else {
+		st->writes++;
+		if (res > 0)
+			st->write_bytes += res;
+	}
+	if (res < 0)
+		st->errors++;
+	else if (res < req->len)
+		st->short_ios++;
+	st->total_ns += aioq_now() - req->start;
+
+	req->done(q, req, res);
+}
+
+/* Take the next request off the batch, or NULL if we're at full depth. */
+static struct aioq_req *
+aioq_next(
+	struct aioq		*q)
+{
+	struct aioq_req		*req = q->batch;
+
+	if (!req || q->inflight + q->unsubmitted >= q->depth)
+		return NULL;
+
+	q->batch = req->next;
+	if (!q->batch)
+		q->batch_tail = &q->batch;
+	q->nr_batch--;
+	req->next = NULL;
+	req->start = aioq_now();
+	return req;
+}
+
+/* The engine has accepted @nr more requests. */
+static void
+aioq_started(
+	struct aioq		*q,
+	unsigned int		nr)
+{
+	q->inflight += nr;
+	if (q->inflight > q->stats.max_inflight)
+		q->stats.max_inflight = q->inflight;
+}
+
+#ifdef HAVE_IO_URING
+static int
+aioq_submit_ring(
+	struct aioq		*q)
+{
+	struct io_uring_sqe	*sqe;
+	struct aioq_req		*req;
+	char			*buf;
+	int			op;
+	int			ret;
+
+	while (ioring_sq_space(&q->ring) && (req = aioq_next(q)) != NULL) {
+		sqe = ioring_get_sqe(&q->ring);
+		buf = req->buf;
+		if (buf >= q->fixed_base &&
+		    buf + req->len <= q->fixed_base + q->fixed_len)
+			op = req->op == AIOQ_READ ? IORING_OP_READ_FIXED :
+						    IORING_OP_WRITE_FIXED;
+		else
+			op = req->op == AIOQ_READ ? IORING_OP_READ :
+						    IORING_OP_WRITE;
+		ioring_prep_rw(sqe, op, req->fd, req->buf, req->len,
+				req->off, (uintptr_t)req);
+		q->unsubmitted++;
+	}
+
+	/*
+	 * The kernel may not take everything; the rest stays in the ring and
+	 * is offered again next time.
+	 */
+	ret = ioring_submit(&q->ring, 0);
+	if (ret < 0)
+		return ret;
+	q->unsubmitted -= ret;
+	aioq_started(q, ret);
+	return 0;
+}
+
+static int
+aioq_reap_ring(
+	struct aioq		*q,
+	unsigned int		min)
+{
+	struct io_uring_cqe	*cqe;
+	struct aioq_req		*req;
+	unsigned int		reaped = 0;
+	ssize_t			res;
+	int			error;
+
+	while (q->inflight) {
+		cqe = ioring_peek_cqe(&q->ring);
+		if (!cqe) {
+			if (reaped >= min)
+				break;
+			error = ioring_wait_cqe(&q->ring, &cqe);
+			if (error)
+				return error;
+		}
+
+		req = (struct aioq_req *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		ioring_cqe_seen(&q->ring);
+		aioq_complete(q, req, res);
+		reaped++;
+	}
+	return 0;
+}
+
+/*
+ * Register the whole pool as one fixed buffer so the kernel doesn't have to
+ * pin the pages for every I/O.
+ */
+int
+aioq_register_bufpool(
+	struct aioq		*q,
+	struct aioq_bufpool	*bp)
+{
+	struct iovec		iov = {
+		.iov_base	= bp->mem,
+		.iov_len	= bp->size * bp->nr,
+	};
+	int			error;
+
+	if (!q->uring || q->fixed_base)
+		return 0;
+	if (iov.iov_len > AIOQ_MAX_FIXED)
+		return -E2BIG;
+
+	error = ioring_register_buffers(&q->ring, &iov, 1);
+	if (error)
+		return error;
+	q->fixed_base = bp->mem;
+	q->fixed_len = iov.iov_len;
+	return 0;
+}
+
+/* Wait for everything the kernel has, so it's done with the buffers. */
+static void
+aioq_quiesce_ring(
+	struct aioq		*q)
+{
+	struct io_uring_cqe	*cqe;
+
+	while (q->inflight && !ioring_wait_cqe(&q->ring, &cqe)) {
+		ioring_cqe_seen(&q->ring);
+		q->inflight--;
+	}
+}
+#else
+static inline int aioq_submit_ring(struct aioq *q) { return -EOPNOTSUPP; }
+static inline void aioq_quiesce_ring(struct aioq *q) { }
+static inline int aioq_reap_ring(struct aioq *q, unsigned int min)
+{
+	return -EOPNOTSUPP;
+}
+
+int
+aioq_register_bufpool(
+	struct aioq		*q,
+	struct aioq_bufpool	*bp)
+{
+	return 0;
+}
+#endif /* HAVE_IO_URING */
+
+static void
+aioq_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct aioq		*q = wq->wq_ctx;
+	struct aioq_req		*req = arg;
+	ssize_t			ret;
+
+	do {
+		if (req->op == AIOQ_READ)
+			ret = pread(req->fd, req->buf, req->len, req->off);
+		else
+			ret = pwrite(req->fd, req->buf, req->len, req->off);
+	} while (ret < 0 && errno == EINTR);
+	req->res = ret < 0 ? -errno : ret;
+
+	pthread_mutex_lock(&q->lock);
+	req->next = q->done;
+	q->done = req;
+	pthread_cond_signal(&q->wait);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static int
+aioq_submit_threads(
+	struct aioq		*q)
+{
+	struct aioq_req		*req;
+	int			error;
+
+	while ((req = aioq_next(q)) != NULL) {
+		error = -workqueue_add(&q->wq, aioq_worker, 0, req);
+		if (error) {
+			/* put it back for the next try */
+			req->next = q->batch;
+			q->batch = req;
+			if (!req->next)
+				q->batch_tail = &req->next;
+			q->nr_batch++;
+			return error;
+		}
+		aioq_started(q, 1);
+	}
+	return 0;
+}
+
+static int
+aioq_reap_threads(
+	struct aioq		*q,
+	unsigned int		min)
+{
+	struct aioq_req		*list;
+	struct aioq_req		*req;
+	unsigned int		reaped = 0;
+
+	while (q->inflight) {
+		pthread_mutex_lock(&q->lock);
+		while (!q->done && reaped < min)
+			pthread_cond_wait(&q->wait, &q->lock);
+		list = q->done;
+		q->done = NULL;
+		pthread_mutex_unlock(&q->lock);
+		if (!list)
+			break;
+
+		while ((req = list) != NULL) {
+			list = req->next;
+			req->next = NULL;
+			aioq_complete(q, req, req->res);
+			reaped++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Set up a queue that keeps up to @depth requests in flight.  Returns 0 or
+ * a negative errno.
+ */
+int
+aioq_init(
+	struct aioq		*q,
+	unsigned int		depth,
+	unsigned int		flags)
+{
+	int			error;
+
+	memset(q, 0, sizeof(*q));
+	q->depth = depth ? depth : 1;
+	q->batch_tail = &q->batch;
+	q->ring.fd = -1;
+
+	if (!(flags & AIOQ_THREADS) && !ioring_init(&q->ring, q->depth, 0)) {
+		q->uring = true;
+		return 0;
+	}
+
+	error = -pthread_mutex_init(&q->lock, NULL);
+	if (error)
+		return error;
+	error = -pthread_cond_init(&q->wait, NULL);
+	if (error)
+		goto out_lock;
+	error = -workqueue_create(&q->wq, q, q->depth < AIOQ_MAX_THREADS ?
+			q->depth : AIOQ_MAX_THREADS);
+	if (error)
+		goto out_cond;
+	return 0;
+
+out_cond:
+	pthread_cond_destroy(&q->wait);
+out_lock:
+	pthread_mutex_destroy(&q->lock);
+	return error;
+}
+
+/*
+ * Tear down a queue.  Callers should drain it first; anything still in
+ * flight is waited for but its completion function isn't called.
+ */
+void
+aioq_free(
+	struct aioq		*q)
+{
+	if (q->uring) {
+		aioq_quiesce_ring(q);
+		ioring_free(&q->ring);
+		return;
+	}
+
+	workqueue_terminate(&q->wq);
+	workqueue_destroy(&q->wq);
+	pthread_cond_destroy(&q->wait);
+	pthread_mutex_destroy(&q->lock);
+}
+
+/* Add a request to the next batch.  Nothing is sent until aioq_submit. */
+void
+aioq_queue(
+	struct aioq		*q,
+	struct aioq_req		*req)
+{
+	req->next = NULL;
+	*q->batch_tail = req;
+	q->batch_tail = &req->next;
+	q->nr_batch++;
+}
+
+/*
+ * Send as much of the batch as fits in the queue depth to the engine in one
+ * go.  Whatever doesn't fit goes out as earlier requests complete.
+ */
+int
+aioq_submit(
+	struct aioq		*q)
+{
+	unsigned int		before = q->nr_batch;
+	int			error;
+
+	if (!q->unsubmitted &&
+	    (!q->nr_batch || q->inflight >= q->depth))
+		return 0;
+
+	if (q->uring)
+		error = aioq_submit_ring(q);
+	else
+		error = aioq_submit_threads(q);
+	if (q->nr_batch != before)
+		q->stats.batches++;
+	return error;
+}
+
+/*
+ * Submit what's queued and reap at least @min completions, running their
+ * completion functions.  Returns 0 or a negative errno if the engine failed;
+ * errors of individual requests go to their completion functions.
+ */
+int
+aioq_reap(
+	struct aioq		*q,
+	unsigned int		min)
+{
+	int			error;
+
+	error = aioq_submit(q);
+	if (error)
+		return error;
+	if (min > q->inflight)
+		min = q->inflight;
+
+	if (q->uring)
+		return aioq_reap_ring(q, min);
+	return aioq_reap_threads(q, min);
+}
+
+/* Run everything queued, and whatever the completions queue, to the end. */
+int
+aioq_drain(
+	struct aioq		*q)
+{
+	int			error;
+
+	while (aioq_busy(q)) {
+		error = aioq_reap(q, 1);
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+/*
+ * Carve @nr buffers of @size bytes out of one allocation, each aligned to
+ * @align, or to the page size if that's zero.
+ */
+int
+aioq_bufpool_init(
+	struct aioq_bufpool	*bp,
+	unsigned int		nr,
+	size_t			size,
+	size_t			align)
+{
+	unsigned int		i;
+	int			error;
+
+	memset(bp, 0, sizeof(*bp));
+	if (!align)
+		align = sysconf(_SC_PAGESIZE);
+	bp->size = (size + align - 1) & ~(align - 1);
+	bp->nr = nr;
+
+	bp->free = calloc(nr, sizeof(void *));
+	if (!bp->free)
+		return -ENOMEM;
+	error = -posix_memalign((void **)&bp->mem, align, bp->size * nr);
+	if (error) {
+		free(bp->free);
+		bp->free = NULL;
+		return error;
+	}
+
+	for (i = 0; i < nr; i++)
+		bp->free[i] = bp->mem + (size_t)(nr - i - 1) * bp->size;
+	bp->nr_free = nr;
+	return 0;
+}
+
+void
+aioq_bufpool_free(
+	struct aioq_bufpool	*bp)
+{
+	free(bp->mem);
+	free(bp->free);
+	bp->mem = NULL;
+	bp->free = NULL;
+	bp->nr_free = 0;
+}
+
+/* Grab a buffer, or NULL if they're all in use. */
+void *
+aioq_buf_get(
+	struct aioq_bufpool	*bp)
+{
+	if (!bp->nr_free)
+		return NULL;
+	return bp->free[--bp->nr_free];
+}
+
+void
+aioq_buf_put(
+	struct aioq_bufpool	*bp,
+	void			*buf)
+{
+	bp->free[bp->nr_free++] = buf;
+}
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __LIBFROG_AIOQ_H__
+#define __LIBFROG_AIOQ_H__
+
+#include <pthread.h>
+#include "ioring.h"
+#include "workqueue.h"
+
+/*
+ * Asynchronous I/O queue.  Callers queue reads and writes, submit them in
+ * batches and reap them later; each request's completion function runs in
+ * the thread that reaps it, and may queue more I/O.  The I/O goes through
+ * io_uring if the kernel has it, or else through a pool of threads doing
+ * pread and pwrite, so callers don't need a fallback path of their own.
+ *
+ * A queue belongs to one thread.  Threads that want to do I/O in parallel
+ * should each set up their own queue.
+ */
+
+struct aioq;
+struct aioq_req;
+
+typedef void aioq_done_fn(struct aioq *q, struct aioq_req *req, ssize_t res);
+
+enum aioq_op {
+	AIOQ_READ,
+	AIOQ_WRITE,
+};
+
+struct aioq_req {
+	struct aioq_req		*next;
+	aioq_done_fn		*done;	/* res is bytes done or -errno */
+	void			*priv;
+	void			*buf;
+	size_t			len;
+	off_t			off;
+	int			fd;
+	enum aioq_op		op;
+
+	/* private to aioq */
+	ssize_t			res;
+	uint64_t		start;
+};
+
+struct aioq_stats {
+	unsigned long long	reads;
+	unsigned long long	writes;
+	unsigned long long	read_bytes;
+	unsigned long long	write_bytes;
+	unsigned long long	errors;
+	unsigned long long	short_ios;
+	unsigned long long	batches;	/* submissions to the engine */
+	unsigned long long	total_ns;	/* summed queue to completion */
+	unsigned int		max_inflight;
+};
+
+/* Don't try io_uring, use the thread pool. */
+#define AIOQ_THREADS		(1U << 0)
+
+struct aioq {
+	unsigned int		depth;
+	unsigned int		inflight;	/* submitted, not yet reaped */
+	unsigned int		unsubmitted;	/* in the ring, not yet taken */
+	bool			uring;
+
+	/* queued by the caller, not yet submitted */
+	struct aioq_req		*batch;
+	struct aioq_req		**batch_tail;
+	unsigned int		nr_batch;
+
+	/* io_uring engine; I/O to the registered range uses fixed buffers */
+	struct ioring		ring;
+	char			*fixed_base;
+	size_t			fixed_len;
+
+	/* thread pool engine; workers hand completions back on done */
+	struct workqueue	wq;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct aioq_req		*done;
+
+	struct aioq_stats	stats;
+};
+
+int aioq_init(struct aioq *q, unsigned int depth, unsigned int flags);
+void aioq_free(struct aioq *q);
+
+void aioq_queue(struct aioq *q, struct aioq_req *req);
+int aioq_submit(struct aioq *q);
+int aioq_reap(struct aioq *q, unsigned int min);
+int aioq_drain(struct aioq *q);
+
+static inline void
+aioq_prep(
+	struct aioq_req		*req,
+	enum aioq_op		op,
+	int			fd,
+	void			*buf,
+	size_t			len,
+	off_t			off,
+	aioq_done_fn		*done,
+	void			*priv)
+{
+	req->op = op;
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->off = off;
+	req->done = done;
+	req->priv = priv;
+}
+
+/* Is there I/O queued or in flight? */
+static inline bool
+aioq_busy(
+	struct aioq		*q)
+{
+	return q->inflight || q->unsubmitted || q->nr_batch;
+}
+
+/*
+ * A set of equally sized buffers carved out of one aligned allocation, so
+ * that direct I/O callers get the alignment right once and the whole set
+ * can be registered with the ring.  Like the queue, it is not thread safe.
+ */
+struct aioq_bufpool {
+	char			*mem;
+	void			**free;
+	unsigned int		nr_free;
+	unsigned int		nr;
+	size_t			size;
+};
+
+int aioq_bufpool_init(struct aioq_bufpool *bp, unsigned int nr, size_t size,
+		size_t align);
+void aioq_bufpool_free(struct aioq_bufpool *bp);
+void *aioq_buf_get(struct aioq_bufpool *bp);
+void aioq_buf_put(struct aioq_bufpool *bp, void *buf);
+int aioq_register_bufpool(struct aioq *q, struct aioq_bufpool *bp);
+
+#endif /* __LIBFROG_AIOQ_H__ */
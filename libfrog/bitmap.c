@@ -16,12 +16,44 @@
 /*
  * Space Efficient Bitmap
  *
- * Implements a space-efficient bitmap.  We use an AVL tree to manage
- * extent records that tell us which ranges are set; the bitmap key is
- * an arbitrary uint64_t.  The usual bitmap operations (set, clear,
- * test, test and set) are supported, plus we can iterate set ranges.
+ * Implements a space-efficient bitmap; the bitmap key is an arbitrary
+ * uint64_t.  The key space is cut into chunks of 65536 bits, and we keep
+ * an AVL tree of records for the chunks that have any bits set.  Each
+ * record stores the low 16 bits of the keys in its chunk in whichever
+ * container suits the way the chunk has been filled in:
+ *
+ * - an array of set bits, for chunks that are set one bit at a time;
+ * - a list of runs of set bits, for chunks that are set a range at a time;
+ * - a plain bitset, once either of the above would be bigger than that.
+ *
+ * A chunk that is completely set becomes a "full" record that needs no
+ * container at all, and adjacent full records are merged, so setting a
+ * huge range costs no more than setting a small one.  The usual bitmap
+ * operations (set, test) are supported, plus we can iterate set ranges.
  */
 
+#define BMC_SHIFT		16
+#define BMC_BITS		(1U << BMC_SHIFT)
+#define BMC_MASK		(BMC_BITS - 1)
+#define BMC_WORDS		(BMC_BITS / 64)
+
+/* Arrays and run lists are converted to bitsets before they outgrow one. */
+#define BMC_ARRAY_MAX		(BMC_WORDS * sizeof(uint64_t) / sizeof(uint16_t))
+#define BMC_RUN_MAX		(BMC_WORDS * sizeof(uint64_t) / \
+				 sizeof(struct bmc_run))
+
+enum bmc_type {
+	BMC_ARRAY,
+	BMC_RUN,
+	BMC_BITSET,
+	BMC_FULL,
+};
+
+struct bmc_run {
+	uint16_t		start;
+	uint16_t		last;		/* inclusive */
+};
+
 #define avl_for_each_range_safe(pos, n, l, first, last) \
 	for (pos = (first), n = pos->avl_nextino, l = (last)->avl_nextino; \
 			pos != (l); \
@@ -32,38 +64,50 @@
 			pos != NULL; \
 			pos = n, n = pos ? pos->avl_nextino : NULL)
 
-#define avl_for_each(tree, pos) \
-	for (pos = (tree)->avl_firstino; pos != NULL; pos = pos->avl_nextino)
-
-struct bitmap_node {
-	struct avl64node	btn_node;
-	uint64_t		btn_start;
-	uint64_t		btn_length;
+struct bitmap_chunk {
+	struct avl64node	bc_node;
+	uint64_t		bc_key;		/* first chunk number */
+	uint64_t		bc_count;	/* chunks; only > 1 if full */
+	enum bmc_type		bc_type;
+	uint32_t		bc_nr;		/* array entries/runs/bits set */
+	uint32_t		bc_alloc;	/* array entries/runs allocated */
+	union {
+		uint16_t	*bc_array;
+		struct bmc_run	*bc_runs;
+		uint64_t	*bc_bits;
+	};
 };
 
+static inline uint64_t
+bmc_end(
+	struct bitmap_chunk	*bc)
+{
+	return bc->bc_key + bc->bc_count;
+}
+
 static uint64_t
-extent_start(
+chunk_start(
 	struct avl64node	*node)
 {
-	struct bitmap_node	*btn;
+	struct bitmap_chunk	*bc;
 
-	btn = container_of(node, struct bitmap_node, btn_node);
-	return btn->btn_start;
+	bc = container_of(node, struct bitmap_chunk, bc_node);
+	return bc->bc_key;
 }
 
 static uint64_t
-extent_end(
+chunk_end(
 	struct avl64node	*node)
 {
-	struct bitmap_node	*btn;
+	struct bitmap_chunk	*bc;
 
-	btn = container_of(node, struct bitmap_node, btn_node);
-	return btn->btn_start + btn->btn_length;
+	bc = container_of(node, struct bitmap_chunk, bc_node);
+	return bmc_end(bc);
 }
 
 static struct avl64ops bitmap_ops = {
-	extent_start,
-	extent_end,
+	chunk_start,
+	chunk_end,
 };
 
 /* Initialize a bitmap. */
@@ -89,7 +133,6 @@ bitmap_alloc(
 
 	avl64_init_tree(bmap->bt_tree, &bitmap_ops);
 	*bmapp = bmap;
-
 	return 0;
 out_tree:
 	free(bmap->bt_tree);
@@ -98,6 +141,34 @@ out:
 	return ret;
 }
 
+/* Create a new chunk record. */
+static struct bitmap_chunk *
+bitmap_chunk_init(
+	uint64_t		key,
+	uint64_t		count,
+	enum bmc_type		type)
+{
+	struct bitmap_chunk	*bc;
+
+	bc = calloc(1, sizeof(struct bitmap_chunk));
+	if (!bc)
+		return NULL;
+
+	bc->bc_key = key;
+	bc->bc_count = count;
+	bc->bc_type = type;
+	return bc;
+}
+
+/* Free a chunk record and its container. */
+static void
+bitmap_chunk_free(
+	struct bitmap_chunk	*bc)
+{
+	free(bc->bc_array);
+	free(bc);
+}
+
 /* Free a bitmap. */
 void
 bitmap_free(
@@ -106,115 +177,475 @@ bitmap_free(
 	struct bitmap		*bmap;
 	struct avl64node	*node;
 	struct avl64node	*n;
-	struct bitmap_node	*ext;
 
 	bmap = *bmapp;
-	avl_for_each_safe(bmap->bt_tree, node, n) {
-		ext = container_of(node, struct bitmap_node, btn_node);
-		free(ext);
-	}
+	avl_for_each_safe(bmap->bt_tree, node, n)
+		bitmap_chunk_free(container_of(node, struct bitmap_chunk,
+				bc_node));
 	free(bmap->bt_tree);
+	pthread_mutex_destroy(&bmap->bt_lock);
 	free(bmap);
 	*bmapp = NULL;
 }
 
-/* Create a new bitmap extent node. */
-static struct bitmap_node *
-bitmap_node_init(
-	uint64_t		start,
-	uint64_t		len)
+/* Set bits lo to hi (inclusive) of a bitset and keep count of them. */
+static void
+bmc_bitset_set(
+	struct bitmap_chunk	*bc,
+	uint32_t		lo,
+	uint32_t		hi)
 {
-	struct bitmap_node	*ext;
+	uint64_t		mask;
+	uint32_t		w;
+
+	for (w = lo / 64; w <= hi / 64; w++) {
+		mask = ~0ULL;
+		if (w == lo / 64)
+			mask &= ~0ULL << (lo % 64);
+		if (w == hi / 64)
+			mask &= ~0ULL >> (63 - hi % 64);
+		bc->bc_nr += __builtin_popcountll(mask & ~bc->bc_bits[w]);
+		bc->bc_bits[w] |= mask;
+	}
+}
 
-	ext = malloc(sizeof(struct bitmap_node));
-	if (!ext)
-		return NULL;
+/* Find the next bit at or after @bit that is set (or clear). */
+static uint32_t
+bmc_bitset_next(
+	const uint64_t		*bits,
+	uint32_t		bit,
+	bool			set)
+{
+	uint32_t		w = bit / 64;
+	uint64_t		word;
 
-	ext->btn_node.avl_nextino = NULL;
-	ext->btn_start = start;
-	ext->btn_length = len;
+	if (bit >= BMC_BITS)
+		return BMC_BITS;
 
-	return ext;
+	word = (set ? bits[w] : ~bits[w]) & (~0ULL << (bit % 64));
+	while (!word) {
+		if (++w == BMC_WORDS)
+			return BMC_BITS;
+		word = set ? bits[w] : ~bits[w];
+	}
+	return w * 64 + __builtin_ctzll(word);
 }
 
-/* Create a new bitmap node and insert it. */
-static inline int
-__bitmap_insert(
-	struct bitmap		*bmap,
-	uint64_t		start,
-	uint64_t		length)
+/* Convert an array or run list container into a bitset. */
+static int
+bmc_to_bitset(
+	struct bitmap_chunk	*bc)
 {
-	struct bitmap_node	*ext;
-	struct avl64node	*node;
+	struct bitmap_chunk	new = {
+		.bc_type	= BMC_BITSET,
+	};
+	uint32_t		i;
 
-	ext = bitmap_node_init(start, length);
-	if (!ext)
+	new.bc_bits = calloc(BMC_WORDS, sizeof(uint64_t));
+	if (!new.bc_bits)
 		return -errno;
 
-	node = avl64_insert(bmap->bt_tree, &ext->btn_node);
-	if (node == NULL) {
-		free(ext);
-		return -EEXIST;
+	if (bc->bc_type == BMC_ARRAY) {
+		for (i = 0; i < bc->bc_nr; i++)
+			bmc_bitset_set(&new, bc->bc_array[i],
+					bc->bc_array[i]);
+	} else {
+		for (i = 0; i < bc->bc_nr; i++)
+			bmc_bitset_set(&new, bc->bc_runs[i].start,
+					bc->bc_runs[i].last);
 	}
 
+	free(bc->bc_array);
+	bc->bc_type = BMC_BITSET;
+	bc->bc_bits = new.bc_bits;
+	bc->bc_nr = new.bc_nr;
+	bc->bc_alloc = 0;
 	return 0;
 }
 
-/* Set a region of bits (locked). */
+/*
+ * Convert an array container into a run list, or into a bitset if there
+ * would be too many runs.
+ */
 static int
-__bitmap_set(
+bmc_array_to_runs(
+	struct bitmap_chunk	*bc)
+{
+	struct bmc_run		*runs;
+	uint32_t		nr = 0;
+	uint32_t		i;
+
+	for (i = 0; i < bc->bc_nr; i++)
+		if (i == 0 || bc->bc_array[i] != bc->bc_array[i - 1] + 1)
+			nr++;
+	if (nr > BMC_RUN_MAX)
+		return bmc_to_bitset(bc);
+
+	runs = malloc(max(nr, 1U) * sizeof(struct bmc_run));
+	if (!runs)
+		return -errno;
+
+	nr = 0;
+	for (i = 0; i < bc->bc_nr; i++) {
+		if (i > 0 && bc->bc_array[i] == bc->bc_array[i - 1] + 1) {
+			runs[nr - 1].last = bc->bc_array[i];
+			continue;
+		}
+		runs[nr].start = runs[nr].last = bc->bc_array[i];
+		nr++;
+	}
+
+	free(bc->bc_array);
+	bc->bc_type = BMC_RUN;
+	bc->bc_runs = runs;
+	bc->bc_nr = nr;
+	bc->bc_alloc = max(nr, 1U);
+	return 0;
+}
+
+/* Make room for one more array entry or run. */
+static int
+bmc_grow(
+	struct bitmap_chunk	*bc,
+	size_t			elemsize)
+{
+	uint32_t		alloc;
+	void			*p;
+
+	if (bc->bc_nr < bc->bc_alloc)
+		return 0;
+
+	alloc = bc->bc_alloc ? bc->bc_alloc * 2 : 4;
+	p = realloc(bc->bc_array, alloc * elemsize);
+	if (!p)
+		return -errno;
+	bc->bc_array = p;
+	bc->bc_alloc = alloc;
+	return 0;
+}
+
+/* Set one bit in an array container. */
+static int
+bmc_array_set(
+	struct bitmap_chunk	*bc,
+	uint16_t		val)
+{
+	uint32_t		lo = 0;
+	uint32_t		hi = bc->bc_nr;
+	uint32_t		mid;
+	int			ret;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (bc->bc_array[mid] < val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < bc->bc_nr && bc->bc_array[lo] == val)
+		return 0;
+
+	if (bc->bc_nr == BMC_ARRAY_MAX) {
+		ret = bmc_to_bitset(bc);
+		if (ret)
+			return ret;
+		bmc_bitset_set(bc, val, val);
+		return 0;
+	}
+
+	ret = bmc_grow(bc, sizeof(uint16_t));
+	if (ret)
+		return ret;
+	memmove(&bc->bc_array[lo + 1], &bc->bc_array[lo],
+			(bc->bc_nr - lo) * sizeof(uint16_t));
+	bc->bc_array[lo] = val;
+	bc->bc_nr++;
+	return 0;
+}
+
+/* Set bits lo to hi (inclusive) in a run list container. */
+static int
+bmc_run_set(
+	struct bitmap_chunk	*bc,
+	uint32_t		lo,
+	uint32_t		hi)
+{
+	struct bmc_run		*runs = bc->bc_runs;
+	uint32_t		i = 0;
+	uint32_t		j = bc->bc_nr;
+	uint32_t		mid;
+	int			ret;
+
+	/* Find the first run that overlaps or touches the new one... */
+	while (i < j) {
+		mid = (i + j) / 2;
+		if ((uint32_t)runs[mid].last + 1 < lo)
+			i = mid + 1;
+		else
+			j = mid;
+	}
+
+	/* ...and the first run past it. */
+	for (j = i; j < bc->bc_nr && runs[j].start <= hi + 1; j++)
+		;
+
+	/* Merge everything in between with the new run. */
+	if (j > i) {
+		runs[i].start = min((uint32_t)runs[i].start, lo);
+		runs[i].last = max((uint32_t)runs[j - 1].last, hi);
+		memmove(&runs[i + 1], &runs[j],
+				(bc->bc_nr - j) * sizeof(struct bmc_run));
+		bc->bc_nr -= j - i - 1;
+		return 0;
+	}
+
+	if (bc->bc_nr == BMC_RUN_MAX) {
+		ret = bmc_to_bitset(bc);
+		if (ret)
+			return ret;
+		bmc_bitset_set(bc, lo, hi);
+		return 0;
+	}
+
+	ret = bmc_grow(bc, sizeof(struct bmc_run));
+	if (ret)
+		return ret;
+	runs = bc->bc_runs;
+	memmove(&runs[i + 1], &runs[i],
+			(bc->bc_nr - i) * sizeof(struct bmc_run));
+	runs[i].start = lo;
+	runs[i].last = hi;
+	bc->bc_nr++;
+	return 0;
+}
+
+/* Set bits lo to hi (inclusive) in a chunk. */
+static int
+bmc_set(
+	struct bitmap_chunk	*bc,
+	uint32_t		lo,
+	uint32_t		hi)
+{
+	int			ret;
+
+	switch (bc->bc_type) {
+	case BMC_ARRAY:
+		if (lo == hi)
+			return bmc_array_set(bc, lo);
+		ret = bmc_array_to_runs(bc);
+		if (ret)
+			return ret;
+		return bmc_set(bc, lo, hi);
+	case BMC_RUN:
+		return bmc_run_set(bc, lo, hi);
+	case BMC_BITSET:
+		bmc_bitset_set(bc, lo, hi);
+		return 0;
+	case BMC_FULL:
+		return 0;
+	}
+
+	assert(0);
+	return -EINVAL;
+}
+
+/* Is every bit in this chunk set? */
+static bool
+bmc_is_full(
+	struct bitmap_chunk	*bc)
+{
+	switch (bc->bc_type) {
+	case BMC_RUN:
+		return bc->bc_nr == 1 && bc->bc_runs[0].start == 0 &&
+		       bc->bc_runs[0].last == BMC_MASK;
+	case BMC_BITSET:
+		return bc->bc_nr == BMC_BITS;
+	case BMC_FULL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Are any of bits lo to hi (inclusive) set in this chunk? */
+static bool
+bmc_test(
+	struct bitmap_chunk	*bc,
+	uint32_t		lo,
+	uint32_t		hi)
+{
+	uint32_t		i = 0;
+	uint32_t		j = bc->bc_nr;
+	uint32_t		mid;
+
+	switch (bc->bc_type) {
+	case BMC_ARRAY:
+		while (i < j) {
+			mid = (i + j) / 2;
+			if (bc->bc_array[mid] < lo)
+				i = mid + 1;
+			else
+				j = mid;
+		}
+		return i < bc->bc_nr && bc->bc_array[i] <= hi;
+	case BMC_RUN:
+		while (i < j) {
+			mid = (i + j) / 2;
+			if (bc->bc_runs[mid].last < lo)
+				i = mid + 1;
+			else
+				j = mid;
+		}
+		return i < bc->bc_nr && bc->bc_runs[i].start <= hi;
+	case BMC_BITSET:
+		return bmc_bitset_next(bc->bc_bits, lo, true) <= hi;
+	case BMC_FULL:
+		return true;
+	}
+
+	return false;
+}
+
+/* Insert a new chunk record. */
+static int
+bitmap_insert(
 	struct bitmap		*bmap,
-	uint64_t		start,
-	uint64_t		length)
+	struct bitmap_chunk	*bc)
 {
-	struct avl64node	*firstn;
-	struct avl64node	*lastn;
+	if (avl64_insert(bmap->bt_tree, &bc->bc_node) == NULL) {
+		bitmap_chunk_free(bc);
+		return -EEXIST;
+	}
+	return 0;
+}
+
+/*
+ * Mark chunks [key, key + count) completely set, absorbing every record
+ * inside that range and merging with any full records next to it.
+ */
+static int
+bitmap_set_full(
+	struct bitmap		*bmap,
+	uint64_t		key,
+	uint64_t		count)
+{
+	struct bitmap_chunk	*bc;
+	struct bitmap_chunk	*new;
+	struct avl64node	*first;
+	struct avl64node	*last;
 	struct avl64node	*pos;
 	struct avl64node	*n;
 	struct avl64node	*l;
-	struct bitmap_node	*ext;
-	uint64_t		new_start;
-	uint64_t		new_length;
-
-	/* Find any existing nodes adjacent or within that range. */
-	avl64_findranges(bmap->bt_tree, start - 1, start + length + 1,
-			&firstn, &lastn);
-
-	/* Nothing, just insert a new extent. */
-	if (firstn == NULL && lastn == NULL)
-		return __bitmap_insert(bmap, start, length);
-
-	assert(firstn != NULL && lastn != NULL);
-	new_start = start;
-	new_length = length;
-
-	avl_for_each_range_safe(pos, n, l, firstn, lastn) {
-		ext = container_of(pos, struct bitmap_node, btn_node);
-
-		/* Bail if the new extent is contained within an old one. */
-		if (ext->btn_start <= start &&
-		    ext->btn_start + ext->btn_length >= start + length)
-			return 0;
-
-		/* Check for overlapping and adjacent extents. */
-		if (ext->btn_start + ext->btn_length >= start ||
-		    ext->btn_start <= start + length) {
-			if (ext->btn_start < start) {
-				new_start = ext->btn_start;
-				new_length += ext->btn_length;
+	uint64_t		end = key + count;
+	uint64_t		new_key = key;
+	uint64_t		new_end = end;
+
+	/* Look one chunk past either end so that we find full neighbors. */
+	avl64_findranges(bmap->bt_tree, key ? key - 1 : 0, end + 1,
+			&first, &last);
+	if (first) {
+		avl_for_each_range_safe(pos, n, l, first, last) {
+			bc = container_of(pos, struct bitmap_chunk, bc_node);
+			if (bc->bc_type == BMC_FULL) {
+				new_key = min(new_key, bc->bc_key);
+				new_end = max(new_end, bmc_end(bc));
 			}
+		}
+	}
 
-			if (ext->btn_start + ext->btn_length >
-			    new_start + new_length)
-				new_length = ext->btn_start + ext->btn_length -
-						new_start;
+	new = bitmap_chunk_init(new_key, new_end - new_key, BMC_FULL);
+	if (!new)
+		return -errno;
 
+	if (first) {
+		avl_for_each_range_safe(pos, n, l, first, last) {
+			bc = container_of(pos, struct bitmap_chunk, bc_node);
+			if (bc->bc_type != BMC_FULL &&
+			    (bc->bc_key < key || bc->bc_key >= end))
+				continue;
 			avl64_delete(bmap->bt_tree, pos);
-			free(ext);
+			bitmap_chunk_free(bc);
+		}
+	}
+
+	return bitmap_insert(bmap, new);
+}
+
+/* Set bits lo to hi (inclusive) of chunk @key. */
+static int
+bitmap_set_chunk(
+	struct bitmap		*bmap,
+	uint64_t		key,
+	uint32_t		lo,
+	uint32_t		hi)
+{
+	struct bitmap_chunk	*bc;
+	struct avl64node	*node;
+	int			ret;
+
+	node = avl64_findrange(bmap->bt_tree, key);
+	if (node) {
+		bc = container_of(node, struct bitmap_chunk, bc_node);
+	} else {
+		bc = bitmap_chunk_init(key, 1, BMC_ARRAY);
+		if (!bc)
+			return -errno;
+		ret = bitmap_insert(bmap, bc);
+		if (ret)
+			return ret;
+	}
+
+	ret = bmc_set(bc, lo, hi);
+	if (ret) {
+		/* Don't leave an empty record behind. */
+		if (bc->bc_nr == 0) {
+			avl64_delete(bmap->bt_tree, &bc->bc_node);
+			bitmap_chunk_free(bc);
 		}
+		return ret;
 	}
 
-	return __bitmap_insert(bmap, new_start, new_length);
+	if (bc->bc_type == BMC_FULL || !bmc_is_full(bc))
+		return 0;
+
+	return bitmap_set_full(bmap, key, 1);
+}
+
+/* Set a region of bits (locked). */
+static int
+__bitmap_set(
+	struct bitmap		*bmap,
+	uint64_t		start,
+	uint64_t		length)
+{
+	uint64_t		end = start + length;
+	uint64_t		key;
+	uint64_t		last;
+	uint64_t		count;
+	int			ret;
+
+	while (start < end) {
+		key = start >> BMC_SHIFT;
+
+		/* Whole chunks don't need a container. */
+		if ((start & BMC_MASK) == 0 && end - start >= BMC_BITS) {
+			count = (end - start) >> BMC_SHIFT;
+			ret = bitmap_set_full(bmap, key, count);
+			if (ret)
+				return ret;
+			start += count << BMC_SHIFT;
+			continue;
+		}
+
+		last = min(end - 1, start | BMC_MASK);
+		ret = bitmap_set_chunk(bmap, key, start & BMC_MASK,
+				last & BMC_MASK);
+		if (ret)
+			return ret;
+		start = last + 1;
+	}
+
+	return 0;
 }
 
 /* Set a region of bits. */
@@ -233,89 +664,128 @@ bitmap_set(
 	return res;
 }
 
-#if 0	/* Unused, provided for completeness. */
-/* Clear a region of bits. */
-int
-bitmap_clear(
-	struct bitmap		*bmap,
+/*
+ * Collects the set ranges of each chunk into maximal ranges, clipped to
+ * [start, end), and hands them to the iterator function.
+ */
+struct bitmap_walk {
+	uint64_t		start;
+	uint64_t		end;
+	uint64_t		run_start;
+	uint64_t		run_len;
+	int			(*fn)(uint64_t, uint64_t, void *);
+	void			*arg;
+};
+
+/* Add the set range [start, end) to the walk. */
+static int
+bitmap_walk_add(
+	struct bitmap_walk	*bw,
 	uint64_t		start,
-	uint64_t		len)
+	uint64_t		end)
 {
-	struct avl64node	*firstn;
-	struct avl64node	*lastn;
-	struct avl64node	*pos;
-	struct avl64node	*n;
-	struct avl64node	*l;
-	struct bitmap_node	*ext;
-	uint64_t		new_start;
-	uint64_t		new_length;
-	struct avl64node	*node;
-	int			stat;
+	int			ret;
 
-	pthread_mutex_lock(&bmap->bt_lock);
-	/* Find any existing nodes over that range. */
-	avl64_findranges(bmap->bt_tree, start, start + len, &firstn, &lastn);
+	start = max(start, bw->start);
+	end = min(end, bw->end);
+	if (start >= end)
+		return 0;
 
-	/* Nothing, we're done. */
-	if (firstn == NULL && lastn == NULL) {
-		pthread_mutex_unlock(&bmap->bt_lock);
+	if (bw->run_len && bw->run_start + bw->run_len == start) {
+		bw->run_len += end - start;
 		return 0;
 	}
 
-	assert(firstn != NULL && lastn != NULL);
+	if (bw->run_len) {
+		ret = bw->fn(bw->run_start, bw->run_len, bw->arg);
+		if (ret)
+			return ret;
+	}
 
-	/* Delete or truncate everything in sight. */
-	avl_for_each_range_safe(pos, n, l, firstn, lastn) {
-		ext = container_of(pos, struct bitmap_node, btn_node);
+	bw->run_start = start;
+	bw->run_len = end - start;
+	return 0;
+}
 
-		stat = 0;
-		if (ext->btn_start < start)
-			stat |= 1;
-		if (ext->btn_start + ext->btn_length > start + len)
-			stat |= 2;
-		switch (stat) {
-		case 0:
-			/* Extent totally within range; delete. */
-			avl64_delete(bmap->bt_tree, pos);
-			free(ext);
-			break;
-		case 1:
-			/* Extent is left-adjacent; truncate. */
-			ext->btn_length = start - ext->btn_start;
-			break;
-		case 2:
-			/* Extent is right-adjacent; move it. */
-			ext->btn_length = ext->btn_start + ext->btn_length -
-					(start + len);
-			ext->btn_start = start + len;
-			break;
-		case 3:
-			/* Extent overlaps both ends. */
-			ext->btn_length = start - ext->btn_start;
-			new_start = start + len;
-			new_length = ext->btn_start + ext->btn_length -
-					new_start;
-
-			ext = bitmap_node_init(new_start, new_length);
-			if (!ext) {
-				ret = -errno;
-				goto out;
-			}
+/* Add the set ranges of a chunk record to the walk. */
+static int
+bitmap_walk_chunk(
+	struct bitmap_walk	*bw,
+	struct bitmap_chunk	*bc)
+{
+	uint64_t		base = bc->bc_key << BMC_SHIFT;
+	uint32_t		i, j;
+	int			ret = 0;
 
-			node = avl64_insert(bmap->bt_tree, &ext->btn_node);
-			if (node == NULL) {
-				ret = -EEXIST;
-				goto out;
-			}
-			break;
+	switch (bc->bc_type) {
+	case BMC_ARRAY:
+		for (i = 0; i < bc->bc_nr && !ret; i = j + 1) {
+			for (j = i; j + 1 < bc->bc_nr &&
+			     bc->bc_array[j + 1] == bc->bc_array[j] + 1; j++)
+				;
+			ret = bitmap_walk_add(bw, base + bc->bc_array[i],
+					base + bc->bc_array[j] + 1);
 		}
+		break;
+	case BMC_RUN:
+		for (i = 0; i < bc->bc_nr && !ret; i++)
+			ret = bitmap_walk_add(bw, base + bc->bc_runs[i].start,
+					base + bc->bc_runs[i].last + 1);
+		break;
+	case BMC_BITSET:
+		i = bmc_bitset_next(bc->bc_bits, 0, true);
+		while (i < BMC_BITS && !ret) {
+			j = bmc_bitset_next(bc->bc_bits, i, false);
+			ret = bitmap_walk_add(bw, base + i, base + j);
+			i = bmc_bitset_next(bc->bc_bits, j, true);
+		}
+		break;
+	case BMC_FULL:
+		ret = bitmap_walk_add(bw, base, bmc_end(bc) << BMC_SHIFT);
+		break;
 	}
 
-out:
-	pthread_mutex_unlock(&bmap->bt_lock);
 	return ret;
 }
-#endif
+
+/* Iterate the set regions of [start, end) (locked). */
+static int
+__bitmap_iterate(
+	struct bitmap		*bmap,
+	uint64_t		start,
+	uint64_t		end,
+	int			(*fn)(uint64_t, uint64_t, void *),
+	void			*arg)
+{
+	struct bitmap_walk	bw = {
+		.start		= start,
+		.end		= end,
+		.fn		= fn,
+		.arg		= arg,
+	};
+	struct avl64node	*first;
+	struct avl64node	*last;
+	struct avl64node	*node;
+	int			ret;
+
+	if (start >= end)
+		return 0;
+
+	avl64_findranges(bmap->bt_tree, start >> BMC_SHIFT,
+			((end - 1) >> BMC_SHIFT) + 1, &first, &last);
+	for (node = first; node; node = node->avl_nextino) {
+		ret = bitmap_walk_chunk(&bw, container_of(node,
+				struct bitmap_chunk, bc_node));
+		if (ret)
+			return ret;
+		if (node == last)
+			break;
+	}
+
+	if (bw.run_len)
+		return fn(bw.run_start, bw.run_len, arg);
+	return 0;
+}
 
 /* Iterate the set regions of this bitmap. */
 int
@@ -324,23 +794,19 @@ bitmap_iterate(
 	int			(*fn)(uint64_t, uint64_t, void *),
 	void			*arg)
 {
-	struct avl64node	*node;
-	struct bitmap_node	*ext;
-	int			error = 0;
+	int			error;
 
 	pthread_mutex_lock(&bmap->bt_lock);
-	avl_for_each(bmap->bt_tree, node) {
-		ext = container_of(node, struct bitmap_node, btn_node);
-		error = fn(ext->btn_start, ext->btn_length, arg);
-		if (error)
-			break;
-	}
+	error = __bitmap_iterate(bmap, 0, UINT64_MAX, fn, arg);
 	pthread_mutex_unlock(&bmap->bt_lock);
 
 	return error;
 }
 
-/* Iterate the set regions of part of this bitmap. */
+/*
+ * Iterate the set regions of part of this bitmap.  Regions that extend
+ * past either end of the range are clipped to it.
+ */
 int
 bitmap_iterate_range(
 	struct bitmap		*bmap,
@@ -349,48 +815,52 @@ bitmap_iterate_range(
 	int			(*fn)(uint64_t, uint64_t, void *),
 	void			*arg)
 {
-	struct avl64node	*firstn;
-	struct avl64node	*lastn;
-	struct avl64node	*pos;
-	struct avl64node	*n;
-	struct avl64node	*l;
-	struct bitmap_node	*ext;
-	int			ret = 0;
-
-	pthread_mutex_lock(&bmap->bt_lock);
-
-	avl64_findranges(bmap->bt_tree, start, start + length, &firstn,
-			&lastn);
-
-	if (firstn == NULL && lastn == NULL)
-		goto out;
+	uint64_t		end = start + length;
+	int			ret;
 
-	avl_for_each_range_safe(pos, n, l, firstn, lastn) {
-		ext = container_of(pos, struct bitmap_node, btn_node);
-		ret = fn(ext->btn_start, ext->btn_length, arg);
-		if (ret)
-			break;
-	}
+	if (end < start)
+		end = UINT64_MAX;
 
-out:
+	pthread_mutex_lock(&bmap->bt_lock);
+	ret = __bitmap_iterate(bmap, start, end, fn, arg);
 	pthread_mutex_unlock(&bmap->bt_lock);
+
 	return ret;
 }
 
-/* Do any bitmap extents overlap the given one?  (locked) */
+/* Are any bits in the given range set?  (locked) */
 static bool
 __bitmap_test(
 	struct bitmap		*bmap,
 	uint64_t		start,
 	uint64_t		len)
 {
-	struct avl64node	*firstn;
-	struct avl64node	*lastn;
-
-	/* Find any existing nodes over that range. */
-	avl64_findranges(bmap->bt_tree, start, start + len, &firstn, &lastn);
+	struct bitmap_chunk	*bc;
+	struct avl64node	*first;
+	struct avl64node	*last;
+	struct avl64node	*node;
+	uint64_t		end = start + len;
+	uint64_t		base;
+
+	if (end < start)
+		end = UINT64_MAX;
+	if (start >= end)
+		return false;
+
+	avl64_findranges(bmap->bt_tree, start >> BMC_SHIFT,
+			((end - 1) >> BMC_SHIFT) + 1, &first, &last);
+	for (node = first; node; node = node->avl_nextino) {
+		bc = container_of(node, struct bitmap_chunk, bc_node);
+		base = bc->bc_key << BMC_SHIFT;
+		if (bmc_test(bc, start > base ? start - base : 0,
+				end - base > BMC_BITS ? BMC_MASK :
+							end - base - 1))
+			return true;
+		if (node == last)
+			break;
+	}
 
-	return firstn != NULL && lastn != NULL;
+	return false;
 }
 
 /* Is any part of this range set? */
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include "cpumap.h"
+
+#define SYSFS_NODE_DIR		"/sys/devices/system/node"
+
+/* Parse a sysfs cpu list ("0-3,8,10-11") into @set. */
+static int
+cpumap_parse_cpulist(
+	const char		*path,
+	cpu_set_t		*set)
+{
+	FILE			*fp;
+	int			first, last;
+	int			ret = 0;
+
+	CPU_ZERO(set);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (fscanf(fp, "%d", &first) == 1) {
+		last = first;
+		if (fscanf(fp, "-%d", &last) < 0)
+			break;
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (fgetc(fp) != ',')
+			break;
+	}
+	if (ferror(fp))
+		ret = -EIO;
+	fclose(fp);
+	return ret;
+}
+
+/* Find the NUMA nodes that have CPUs we can run on. */
+static int
+cpumap_read_nodes(
+	const cpu_set_t		*allowed,
+	cpu_set_t		**nodesp,
+	unsigned int		*nr_nodesp)
+{
+	DIR			*dir;
+	struct dirent		*de;
+	cpu_set_t		*nodes = NULL;
+	unsigned int		nr_nodes = 0;
+	int			ret = 0;
+
+	dir = opendir(SYSFS_NODE_DIR);
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir)) != NULL) {
+		char		path[PATH_MAX];
+		cpu_set_t	set, *n;
+		unsigned int	id;
+
+		if (sscanf(de->d_name, "node%u", &id) != 1)
+			continue;
+		snprintf(path, sizeof(path), SYSFS_NODE_DIR "/%s/cpulist",
+				de->d_name);
+		if (cpumap_parse_cpulist(path, &set))
+			continue;
+		CPU_AND(&set, &set, allowed);
+		if (CPU_COUNT(&set) == 0)
+			continue;
+
+		n = realloc(nodes, (nr_nodes + 1) * sizeof(cpu_set_t));
+		if (!n) {
+			ret = -ENOMEM;
+			break;
+		}
+		nodes = n;
+		nodes[nr_nodes++] = set;
+	}
+	closedir(dir);
+
+	if (ret || nr_nodes == 0) {
+		free(nodes);
+		return ret ? ret : -ENOENT;
+	}
+	*nodesp = nodes;
+	*nr_nodesp = nr_nodes;
+	return 0;
+}
+
+/*
+ * Build a map of the CPUs and NUMA nodes that this process can use.  If the
+ * system doesn't tell us about NUMA nodes, everything is on node zero.
+ * Returns zero or a negative error code.
+ */
+int
+cpumap_init(
+	struct cpumap		*map)
+{
+	cpu_set_t		allowed;
+	cpu_set_t		*nodes = NULL;
+	unsigned int		nr_nodes;
+	unsigned int		node;
+	int			cpu, nr, i;
+
+	memset(map, 0, sizeof(*map));
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return -errno;
+
+	if (cpumap_read_nodes(&allowed, &nodes, &nr_nodes)) {
+		nodes = malloc(sizeof(cpu_set_t));
+		if (!nodes)
+			return -ENOMEM;
+		nodes[0] = allowed;
+		nr_nodes = 1;
+	}
+
+	nr = 0;
+	for (node = 0; node < nr_nodes; node++)
+		nr += CPU_COUNT(&nodes[node]);
+
+	map->cpus = calloc(nr, sizeof(int));
+	map->cpu_node = calloc(nr, sizeof(unsigned int));
+	if (!map->cpus || !map->cpu_node) {
+		free(nodes);
+		cpumap_free(map);
+		return -ENOMEM;
+	}
+	map->nr_nodes = nr_nodes;
+
+	/* Deal out the CPUs one node at a time. */
+	for (i = 0; i < nr; ) {
+		for (node = 0; node < nr_nodes; node++) {
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (!CPU_ISSET(cpu, &nodes[node]))
+					continue;
+				CPU_CLR(cpu, &nodes[node]);
+				map->cpus[i] = cpu;
+				map->cpu_node[i] = node;
+				i++;
+				break;
+			}
+		}
+	}
+	map->nr_cpus = nr;
+
+	free(nodes);
+	return 0;
+}
+
+void
+cpumap_free(
+	struct cpumap		*map)
+{
+	free(map->cpus);
+	free(map->cpu_node);
+	memset(map, 0, sizeof(*map));
+}
+
+/* Fill out @set with the CPUs of a node. */
+void
+cpumap_node_cpuset(
+	const struct cpumap	*map,
+	unsigned int		node,
+	cpu_set_t		*set)
+{
+	unsigned int		i;
+
+	CPU_ZERO(set);
+	for (i = 0; i < map->nr_cpus; i++)
+		if (map->cpu_node[i] == node)
+			CPU_SET(map->cpus[i], set);
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __LIBFROG_CPUMAP_H__
+#define __LIBFROG_CPUMAP_H__
+
+#include <sched.h>
+
+/*
+ * The CPUs we're allowed to run on and the NUMA nodes they belong to.  Nodes
+ * are renumbered densely from zero.  The CPU list is interleaved across the
+ * nodes, so that the first nr_nodes entries are on different nodes.
+ */
+struct cpumap {
+	unsigned int		nr_nodes;
+	unsigned int		nr_cpus;
+	int			*cpus;
+	unsigned int		*cpu_node;	/* node of each cpus[] entry */
+};
+
+int cpumap_init(struct cpumap *map);
+void cpumap_free(struct cpumap *map);
+void cpumap_node_cpuset(const struct cpumap *map, unsigned int node,
+		cpu_set_t *set);
+
+#endif /* __LIBFROG_CPUMAP_H__ */
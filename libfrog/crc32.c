@@ -175,18 +175,432 @@ static inline u32 __pure crc32_le_generic(u32 crc, unsigned char const *p,
 }
 
 #if CRC_LE_BITS == 1
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+static u32 __pure crc32c_le_table(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, NULL, CRC32C_POLY_LE);
 }
 #else
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+static u32 __pure crc32c_le_table(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len,
 			(const u32 (*)[256])crc32ctable_le, CRC32C_POLY_LE);
 }
 #endif
 
+static void
+crc32c_le_multi_table(u32 *crc, unsigned char const * const *p,
+		const size_t *len, unsigned int nr)
+{
+	unsigned int	i;
+
+	for (i = 0; i < nr; i++)
+		crc[i] = crc32c_le_table(crc[i], p[i], len[i]);
+}
+
+/*
+ * Hardware accelerated crc32c.
+ *
+ * Both x86 (SSE4.2) and ARMv8 have an instruction that folds eight bytes into
+ * a crc32c.  It has a latency of about three cycles but can issue every cycle,
+ * so a single dependency chain leaves most of the throughput on the table.
+ * Instead we split the buffer into three lanes, run an independent crc over
+ * each lane, and then glue the lane crcs back together by shifting the first
+ * two up by the length of the lanes that follow them:
+ *
+ *	crc(A|B|C) = crc(A) * x^(8 * 2n) ^ crc(B) * x^(8 * n) ^ crc(C)
+ *
+ * modulo the crc32c polynomial.  The shift is a multiplication by a constant
+ * that we compute at startup; on x86 we can do it with a carryless multiply
+ * and let the crc32 instruction do the reduction, elsewhere it's done in
+ * software.  Big lanes amortize the cost of the combine, small lanes keep
+ * the interleave going for shorter buffers.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define CRC32C_X86	1
+# include <nmmintrin.h>
+# include <wmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && __BYTE_ORDER == __LITTLE_ENDIAN
+# define CRC32C_ARM64	1
+# include <sys/auxv.h>
+# ifndef HWCAP_CRC32
+#  define HWCAP_CRC32	(1 << 7)
+# endif
+#endif
+
+#if defined(CRC32C_X86) || defined(CRC32C_ARM64)
+#include <string.h>
+
+#define CRC32C_NR_TIERS		2
+static const size_t crc32c_lane_bytes[CRC32C_NR_TIERS] = { 1024, 128 };
+
+/* x^(8 * 2n) and x^(8 * n) mod P for each lane size */
+static uint32_t crc32c_shift2[CRC32C_NR_TIERS];
+static uint32_t crc32c_shift1[CRC32C_NR_TIERS];
+
+/*
+ * Multiply @b by @a modulo P.  Both are bit reflected, so bit 31 is the x^0
+ * coefficient.  @a must not be zero.
+ */
+static uint32_t
+crc32c_multmodp(
+	uint32_t	a,
+	uint32_t	b)
+{
+	uint32_t	m = 1U << 31;
+	uint32_t	p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY_LE : b >> 1;
+	}
+	return p;
+}
+
+/* Compute x^n mod P. */
+static uint32_t
+crc32c_xpow(
+	uint64_t	n)
+{
+	uint32_t	p = 1U << 31;	/* x^0 */
+	uint32_t	sq = 1U << 30;	/* x^1 */
+
+	while (n) {
+		if (n & 1)
+			p = crc32c_multmodp(sq, p);
+		sq = crc32c_multmodp(sq, sq);
+		n >>= 1;
+	}
+	return p;
+}
+
+static uint32_t
+crc32c_combine_sw(
+	uint32_t	c0,
+	uint32_t	c1,
+	unsigned int	tier)
+{
+	return crc32c_multmodp(crc32c_shift2[tier], c0) ^
+	       crc32c_multmodp(crc32c_shift1[tier], c1);
+}
+
+static inline uint64_t
+crc32c_load64(
+	unsigned char const	*p)
+{
+	uint64_t		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Generic body of the hardware implementations.  This is always inlined into
+ * a function compiled for the right instruction set extensions, which lets
+ * the compiler inline the instruction wrappers too.
+ */
+static inline __attribute__((always_inline)) uint32_t
+crc32c_lanes(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len,
+	uint32_t		(*crc_u64)(uint32_t crc, uint64_t v),
+	uint32_t		(*crc_u8)(uint32_t crc, uint8_t v),
+	uint32_t		(*combine)(uint32_t c0, uint32_t c1,
+					   unsigned int tier))
+{
+	unsigned int		tier;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc_u8(crc, *p++);
+		len--;
+	}
+
+	for (tier = 0; tier < CRC32C_NR_TIERS; tier++) {
+		size_t		n = crc32c_lane_bytes[tier];
+
+		while (len >= 3 * n) {
+			uint32_t	c1 = 0, c2 = 0;
+			size_t		i;
+
+			for (i = 0; i < n; i += 8) {
+				crc = crc_u64(crc, crc32c_load64(p + i));
+				c1 = crc_u64(c1, crc32c_load64(p + n + i));
+				c2 = crc_u64(c2, crc32c_load64(p + 2 * n + i));
+			}
+			crc = combine(crc, c1, tier) ^ c2;
+			p += 3 * n;
+			len -= 3 * n;
+		}
+	}
+
+	for (; len >= 8; p += 8, len -= 8)
+		crc = crc_u64(crc, crc32c_load64(p));
+	while (len--)
+		crc = crc_u8(crc, *p++);
+	return crc;
+}
+
+/*
+ * Checksum independent buffers three at a time.  There's no need to combine
+ * anything since each buffer has its own crc, so we interleave the three over
+ * the length they have in common and finish each one off separately.
+ */
+static inline __attribute__((always_inline)) void
+crc32c_multi_lanes(
+	uint32_t		*crc,
+	unsigned char const * const *p,
+	const size_t		*len,
+	unsigned int		nr,
+	uint32_t		(*crc_u64)(uint32_t crc, uint64_t v),
+	uint32_t		(*crc_one)(uint32_t crc, unsigned char const *p,
+					   size_t len))
+{
+	unsigned int		i;
+
+	for (i = 0; i + 3 <= nr; i += 3) {
+		unsigned char const *p0 = p[i], *p1 = p[i + 1], *p2 = p[i + 2];
+		uint32_t	c0 = crc[i], c1 = crc[i + 1], c2 = crc[i + 2];
+		size_t		n = len[i];
+		size_t		j;
+
+		if (len[i + 1] < n)
+			n = len[i + 1];
+		if (len[i + 2] < n)
+			n = len[i + 2];
+		n &= ~(size_t)7;
+
+		for (j = 0; j < n; j += 8) {
+			c0 = crc_u64(c0, crc32c_load64(p0 + j));
+			c1 = crc_u64(c1, crc32c_load64(p1 + j));
+			c2 = crc_u64(c2, crc32c_load64(p2 + j));
+		}
+		crc[i] = crc_one(c0, p0 + n, len[i] - n);
+		crc[i + 1] = crc_one(c1, p1 + n, len[i + 1] - n);
+		crc[i + 2] = crc_one(c2, p2 + n, len[i + 2] - n);
+	}
+
+	for (; i < nr; i++)
+		crc[i] = crc_one(crc[i], p[i], len[i]);
+}
+#endif /* CRC32C_X86 || CRC32C_ARM64 */
+
+#ifdef CRC32C_X86
+/* x^(8 * 2n - 33) and x^(8 * n - 33) mod P, for the carryless multiply */
+static uint32_t crc32c_clmul2[CRC32C_NR_TIERS];
+static uint32_t crc32c_clmul1[CRC32C_NR_TIERS];
+
+static inline __attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42_u64(
+	uint32_t	crc,
+	uint64_t	v)
+{
+	return _mm_crc32_u64(crc, v);
+}
+
+static inline __attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42_u8(
+	uint32_t	crc,
+	uint8_t		v)
+{
+	return _mm_crc32_u8(crc, v);
+}
+
+/*
+ * The reflected carryless product of two 32-bit values is the 64-bit message
+ * a * b * x, and running crc32 over that multiplies by another x^32 before
+ * reducing mod P, hence the x^-33 in the constants.  Both products can be
+ * added together before the reduction.
+ */
+static inline __attribute__((target("sse4.2,pclmul"))) uint32_t
+crc32c_combine_clmul(
+	uint32_t	c0,
+	uint32_t	c1,
+	unsigned int	tier)
+{
+	__m128i		a, b;
+
+	a = _mm_clmulepi64_si128(_mm_cvtsi32_si128(c0),
+			_mm_cvtsi32_si128(crc32c_clmul2[tier]), 0);
+	b = _mm_clmulepi64_si128(_mm_cvtsi32_si128(c1),
+			_mm_cvtsi32_si128(crc32c_clmul1[tier]), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_xor_si128(a, b)));
+}
+
+static __attribute__((target("sse4.2"))) u32
+crc32c_le_sse42(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32c_lanes(crc, p, len, crc32c_sse42_u64, crc32c_sse42_u8,
+			crc32c_combine_sw);
+}
+
+static __attribute__((target("sse4.2,pclmul"))) u32
+crc32c_le_pclmul(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32c_lanes(crc, p, len, crc32c_sse42_u64, crc32c_sse42_u8,
+			crc32c_combine_clmul);
+}
+
+static __attribute__((target("sse4.2"))) void
+crc32c_le_multi_sse42(u32 *crc, unsigned char const * const *p,
+		const size_t *len, unsigned int nr)
+{
+	crc32c_multi_lanes(crc, p, len, nr, crc32c_sse42_u64, crc32c_le_sse42);
+}
+
+static __attribute__((target("sse4.2,pclmul"))) void
+crc32c_le_multi_pclmul(u32 *crc, unsigned char const * const *p,
+		const size_t *len, unsigned int nr)
+{
+	crc32c_multi_lanes(crc, p, len, nr, crc32c_sse42_u64,
+			crc32c_le_pclmul);
+}
+#endif /* CRC32C_X86 */
+
+#ifdef CRC32C_ARM64
+/*
+ * Use inline assembly rather than the ACLE intrinsics so that we don't have
+ * to build the whole file (or depend on the compiler) for armv8-a+crc.
+ */
+static inline uint32_t
+crc32c_armv8_u64(
+	uint32_t	crc,
+	uint64_t	v)
+{
+	__asm__(".arch_extension crc\n\tcrc32cx %w0, %w0, %x1"
+			: "+r" (crc) : "r" (v));
+	return crc;
+}
+
+static inline uint32_t
+crc32c_armv8_u8(
+	uint32_t	crc,
+	uint8_t		v)
+{
+	__asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1"
+			: "+r" (crc) : "r" ((uint32_t)v));
+	return crc;
+}
+
+static u32
+crc32c_le_armv8(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32c_lanes(crc, p, len, crc32c_armv8_u64, crc32c_armv8_u8,
+			crc32c_combine_sw);
+}
+
+static void
+crc32c_le_multi_armv8(u32 *crc, unsigned char const * const *p,
+		const size_t *len, unsigned int nr)
+{
+	crc32c_multi_lanes(crc, p, len, nr, crc32c_armv8_u64, crc32c_le_armv8);
+}
+#endif /* CRC32C_ARM64 */
+
+/* Ordered from slowest to fastest; the table version must come first. */
+static const struct crc32c_impl crc32c_impls[] = {
+	{ "table",		crc32c_le_table,	crc32c_le_multi_table },
+#ifdef CRC32C_X86
+	{ "sse4.2",		crc32c_le_sse42,	crc32c_le_multi_sse42 },
+	{ "sse4.2+pclmul",	crc32c_le_pclmul,	crc32c_le_multi_pclmul },
+#endif
+#ifdef CRC32C_ARM64
+	{ "armv8",		crc32c_le_armv8,	crc32c_le_multi_armv8 },
+#endif
+};
+#define CRC32C_NR_IMPLS	(sizeof(crc32c_impls) / sizeof(crc32c_impls[0]))
+
+static int crc32c_usable[CRC32C_NR_IMPLS] = { 1 };
+static const struct crc32c_impl *crc32c_active = &crc32c_impls[0];
+
+/*
+ * Figure out which implementations this CPU can run and switch to the fastest
+ * one.  Until this runs, everything goes through the table version.
+ */
+static void __attribute__((constructor))
+crc32c_init(void)
+{
+	unsigned int	i = 1;
+
+#if defined(CRC32C_X86) || defined(CRC32C_ARM64)
+	unsigned int	tier;
+
+	for (tier = 0; tier < CRC32C_NR_TIERS; tier++) {
+		uint64_t	bits = 8 * crc32c_lane_bytes[tier];
+
+		crc32c_shift2[tier] = crc32c_xpow(2 * bits);
+		crc32c_shift1[tier] = crc32c_xpow(bits);
+# ifdef CRC32C_X86
+		crc32c_clmul2[tier] = crc32c_xpow(2 * bits - 33);
+		crc32c_clmul1[tier] = crc32c_xpow(bits - 33);
+# endif
+	}
+#endif
+
+#ifdef CRC32C_X86
+	__builtin_cpu_init();
+	crc32c_usable[i++] = __builtin_cpu_supports("sse4.2");
+	crc32c_usable[i++] = __builtin_cpu_supports("sse4.2") &&
+			     __builtin_cpu_supports("pclmul");
+#endif
+#ifdef CRC32C_ARM64
+	crc32c_usable[i++] = !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#endif
+
+	for (i = 0; i < CRC32C_NR_IMPLS; i++)
+		if (crc32c_usable[i])
+			crc32c_active = &crc32c_impls[i];
+}
+
+/*
+ * Return the @idx'th crc32c implementation that works on this machine, or
+ * NULL if there are no more.  Index zero is always the table version.
+ */
+const struct crc32c_impl *
+crc32c_impl(
+	unsigned int	idx)
+{
+	unsigned int	i;
+
+	for (i = 0; i < CRC32C_NR_IMPLS; i++) {
+		if (!crc32c_usable[i])
+			continue;
+		if (idx-- == 0)
+			return &crc32c_impls[i];
+	}
+	return NULL;
+}
+
+/* Name of the implementation that crc32c_le() uses. */
+const char *
+crc32c_impl_name(void)
+{
+	return crc32c_active->name;
+}
+
+u32 crc32c_le(u32 crc, unsigned char const *p, size_t len)
+{
+	return crc32c_active->fn(crc, p, len);
+}
+
+/*
+ * Checksum @nr independent buffers.  @crc holds the seed for each buffer on
+ * entry and its crc on return.  This is faster than calling crc32c_le() on
+ * each buffer in turn because the hardware versions can work on several
+ * buffers at once.
+ */
+void crc32c_le_multi(u32 *crc, unsigned char const * const *p,
+		const size_t *len, unsigned int nr)
+{
+	crc32c_active->multi(crc, p, len, nr);
+}
+
 
 #ifdef CRC32_SELFTEST
 # include "crc32cselftest.h"
@@ -201,6 +615,7 @@ int main(int argc, char **argv)
 	int errors;
 
 	printf("CRC_LE_BITS = %d\n", CRC_LE_BITS);
+	printf("crc32c implementation = %s\n", crc32c_impl_name());
 
 	errors = crc32c_test(0);
 
@@ -7,5 +7,18 @@
 #define __LIBFROG_CRC32C_H__
 
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *p, size_t len);
+extern void crc32c_le_multi(uint32_t *crc, unsigned char const * const *p,
+		const size_t *len, unsigned int nr);
+
+/* Available crc32c implementations, for testing and benchmarking. */
+struct crc32c_impl {
+	const char	*name;
+	uint32_t	(*fn)(uint32_t crc, unsigned char const *p, size_t len);
+	void		(*multi)(uint32_t *crc, unsigned char const * const *p,
+				 const size_t *len, unsigned int nr);
+};
+
+const struct crc32c_impl *crc32c_impl(unsigned int idx);
+const char *crc32c_impl_name(void);
 
 #endif /* __LIBFROG_CRC32C_H__ */
@@ -664,9 +664,11 @@ static struct crc_test {
 /* Don't print anything to stdout. */
 #define CRC32CTEST_QUIET	(1U << 0)
 
+/* Run the test vectors through one implementation. */
 static int
-crc32c_test(
-	unsigned int	flags)
+crc32c_test_impl(
+	const struct crc32c_impl	*impl,
+	unsigned int			flags)
 {
 	int		i;
 	int		errors = 0;
@@ -682,13 +684,13 @@ crc32c_test(
 	for (i = 0; i < 100; i++) {
 		bytes += 2*test[i].length;
 
-		crc ^= crc32c_le(test[i].crc, test_buf +
+		crc ^= impl->fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length);
 	}
 
 	gettimeofday(&start, NULL);
 	for (i = 0; i < 100; i++) {
-		if (test[i].crc32c_le != crc32c_le(test[i].crc, test_buf +
+		if (test[i].crc32c_le != impl->fn(test[i].crc, test_buf +
 		    test[i].start, test[i].length))
 			errors++;
 	}
@@ -701,12 +703,124 @@ crc32c_test(
 		return errors;
 
 	if (errors)
-		printf("crc32c: %d self tests failed\n", errors);
+		printf("crc32c: %s: %d self tests failed\n", impl->name, errors);
 	else {
-		printf("crc32c: tests passed, %d bytes in %" PRIu64 " usec\n",
-			bytes, usec);
+		printf("crc32c: %s: tests passed, %d bytes in %" PRIu64 " usec\n",
+			impl->name, bytes, usec);
+	}
+
+	return errors;
+}
+
+/*
+ * Compare an implementation against the table version over every short
+ * length at every alignment, the whole buffer, and a pile of pseudorandom
+ * offsets, lengths and seeds.  The lengths straddle the lane sizes of the
+ * interleaved hardware versions.
+ */
+static int
+crc32c_test_cross(
+	const struct crc32c_impl	*impl,
+	const struct crc32c_impl	*ref,
+	unsigned int			flags)
+{
+	uint32_t	rnd = 0x2545f491;
+	uint32_t	seed;
+	unsigned int	start, len;
+	int		errors = 0;
+	int		i;
+
+#define CRC32C_CROSS(seed, start, len) \
+	do { \
+		if (impl->fn((seed), test_buf + (start), (len)) != \
+		    ref->fn((seed), test_buf + (start), (len))) \
+			errors++; \
+	} while (0)
+
+	for (start = 0; start < 8; start++) {
+		for (len = 0; len <= 64; len++)
+			CRC32C_CROSS(~0U, start, len);
+		CRC32C_CROSS(0, start, sizeof(test_buf) - start);
+	}
+
+	for (i = 0; i < 256; i++) {
+		rnd = rnd * 1103515245 + 12345;
+		seed = rnd;
+		rnd = rnd * 1103515245 + 12345;
+		start = (rnd >> 8) % sizeof(test_buf);
+		rnd = rnd * 1103515245 + 12345;
+		len = (rnd >> 8) % (sizeof(test_buf) - start + 1);
+		CRC32C_CROSS(seed, start, len);
+	}
+#undef CRC32C_CROSS
+
+	if (errors && !(flags & CRC32CTEST_QUIET))
+		printf("crc32c: %s: %d mismatches against %s\n", impl->name,
+			errors, ref->name);
+
+	return errors;
+}
+
+/* Check the multi-buffer version against single buffer calls. */
+static int
+crc32c_test_multi(
+	const struct crc32c_impl	*impl,
+	const struct crc32c_impl	*ref,
+	unsigned int			flags)
+{
+	unsigned char const	*p[8];
+	size_t			len[8];
+	uint32_t		crc[8], seed[8];
+	uint32_t		rnd = 0x9e3779b9;
+	unsigned int		nr, i;
+	int			errors = 0;
+
+	for (nr = 1; nr <= 8; nr++) {
+		for (i = 0; i < nr; i++) {
+			unsigned int	start;
+
+			rnd = rnd * 1103515245 + 12345;
+			start = (rnd >> 8) % sizeof(test_buf);
+			rnd = rnd * 1103515245 + 12345;
+			len[i] = (rnd >> 8) % (sizeof(test_buf) - start + 1);
+			p[i] = test_buf + start;
+			rnd = rnd * 1103515245 + 12345;
+			seed[i] = crc[i] = rnd;
+		}
+
+		impl->multi(crc, p, len, nr);
+		for (i = 0; i < nr; i++)
+			if (crc[i] != ref->fn(seed[i], p[i], len[i]))
+				errors++;
 	}
 
+	if (errors && !(flags & CRC32CTEST_QUIET))
+		printf("crc32c: %s: %d multi-buffer mismatches against %s\n",
+			impl->name, errors, ref->name);
+
+	return errors;
+}
+
+/* Test every implementation that this machine can run. */
+static int
+crc32c_test(
+	unsigned int			flags)
+{
+	const struct crc32c_impl	*ref = crc32c_impl(0);
+	const struct crc32c_impl	*impl;
+	unsigned int			idx;
+	int				errors = 0;
+
+	for (idx = 0; (impl = crc32c_impl(idx)) != NULL; idx++) {
+		errors += crc32c_test_impl(impl, flags);
+		errors += crc32c_test_multi(impl, ref, flags);
+		if (impl != ref)
+			errors += crc32c_test_cross(impl, ref, flags);
+	}
+
+	if (!(flags & CRC32CTEST_QUIET))
+		printf("crc32c: using %s\n", crc32c_impl_name());
+
 	return errors;
 }
 
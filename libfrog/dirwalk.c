@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include "platform_defs.h"
+#include "workqueue.h"
+#include "dirwalk.h"
+
+/*
+ * Parallel Directory Tree Walk
+ *
+ * Each directory is a work item.  A worker reads its directory and hands
+ * every entry to the caller; the subdirectories the caller wants walked go
+ * on that worker's own deque, from which idle workers steal, so a wide tree
+ * spreads out over the threads while a deep one stays mostly local.  We
+ * count the directories that are queued or being read and the caller
+ * sleeps until that reaches zero.
+ *
+ * Entries are not visited in any particular order, and the callback must
+ * cope with being called from several threads at once.
+ */
+struct dirwalk {
+	dirwalk_fn		fn;
+	dirwalk_err_fn		err_fn;
+	void			*arg;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wakeup;
+	unsigned int		nr_dirs;	/* queued or in progress */
+	int			error;		/* first fatal error */
+};
+
+struct dirwalk_dir {
+	int			depth;
+	char			path[];
+};
+
+static void dirwalk_dir(struct workqueue *wq, uint32_t index, void *arg);
+
+static void
+dirwalk_set_error(
+	struct dirwalk		*dw,
+	int			error)
+{
+	pthread_mutex_lock(&dw->lock);
+	if (!dw->error)
+		dw->error = error;
+	pthread_mutex_unlock(&dw->lock);
+}
+
+static void
+dirwalk_done(
+	struct dirwalk		*dw)
+{
+	pthread_mutex_lock(&dw->lock);
+	if (--dw->nr_dirs == 0)
+		pthread_cond_signal(&dw->wakeup);
+	pthread_mutex_unlock(&dw->lock);
+}
+
+/* Queue the directory @path/@name to be read. */
+static int
+dirwalk_queue(
+	struct workqueue	*wq,
+	const char		*path,
+	const char		*name,
+	int			depth)
+{
+	struct dirwalk		*dw = wq->wq_ctx;
+	struct dirwalk_dir	*dd;
+	int			error;
+
+	dd = malloc(sizeof(*dd) + strlen(path) + strlen(name) + 2);
+	if (!dd)
+		return -ENOMEM;
+	dd->depth = depth;
+	if (name[0])
+		sprintf(dd->path, "%s/%s", path, name);
+	else
+		strcpy(dd->path, path);
+
+	pthread_mutex_lock(&dw->lock);
+	dw->nr_dirs++;
+	pthread_mutex_unlock(&dw->lock);
+
+	error = -workqueue_add(wq, dirwalk_dir, 0, dd);
+	if (error) {
+		free(dd);
+		dirwalk_done(dw);
+	}
+	return error;
+}
+
+static void
+dirwalk_dir(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct dirwalk		*dw = wq->wq_ctx;
+	struct dirwalk_dir	*dd = arg;
+	struct dirent		*de;
+	char			*path;
+	DIR			*dir;
+	size_t			len = strlen(dd->path);
+	int			fd;
+	int			ret = 0;
+
+	/* don't start on anything new once the walk has failed */
+	if (dw->error)
+		goto out;
+
+	/* only the directory is read, so don't touch its atime */
+	fd = open(dd->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NOATIME);
+	if (fd < 0 && errno == EPERM)
+		fd = open(dd->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		if (dw->err_fn)
+			dw->err_fn(dd->path, errno, dw->arg);
+		goto out;
+	}
+	dir = fdopendir(fd);
+	if (!dir) {
+		if (dw->err_fn)
+			dw->err_fn(dd->path, errno, dw->arg);
+		close(fd);
+		goto out;
+	}
+
+	path = malloc(len + NAME_MAX + 2);
+	if (!path) {
+		ret = -ENOMEM;
+		goto out_dir;
+	}
+	memcpy(path, dd->path, len);
+	path[len] = '/';
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.' &&
+		    (de->d_name[1] == 0 ||
+		     (de->d_name[1] == '.' && de->d_name[2] == 0)))
+			continue;
+
+		strcpy(path + len + 1, de->d_name);
+		ret = dw->fn(path, fd, de->d_name, de->d_type, dd->depth,
+				dw->arg);
+		if (ret == DIRWALK_DESCEND)
+			ret = dirwalk_queue(wq, dd->path, de->d_name,
+					dd->depth + 1);
+		if (ret < 0 || dw->error)
+			break;
+	}
+	free(path);
+out_dir:
+	closedir(dir);
+out:
+	if (ret < 0)
+		dirwalk_set_error(dw, ret);
+	free(dd);
+	dirwalk_done(dw);
+}
+
+/*
+ * Walk the tree under @root with @nr_threads threads, calling @fn for the
+ * root and then for everything below it that @fn asks us to descend into.
+ * Directories that can't be read go to @err_fn, if there is one, and the
+ * walk carries on without them.  Returns zero, the first negative error
+ * that @fn returned, or a negative errno if the walk itself failed.
+ */
+int
+dirwalk(
+	const char		*root,
+	unsigned int		nr_threads,
+	dirwalk_fn		fn,
+	dirwalk_err_fn		err_fn,
+	void			*arg)
+{
+	struct dirwalk		dw = {
+		.fn		= fn,
+		.err_fn		= err_fn,
+		.arg		= arg,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.wakeup		= PTHREAD_COND_INITIALIZER,
+	};
+	struct workqueue	wq;
+	int			ret;
+
+	ret = fn(root, AT_FDCWD, root, DT_UNKNOWN, 0, arg);
+	if (ret != DIRWALK_DESCEND)
+		return ret < 0 ? ret : 0;
+
+	ret = -workqueue_create(&wq, &dw, nr_threads ? nr_threads : 1);
+	if (ret)
+		return ret;
+
+	ret = dirwalk_queue(&wq, root, "", 1);
+	if (!ret) {
+		pthread_mutex_lock(&dw.lock);
+		while (dw.nr_dirs > 0)
+			pthread_cond_wait(&dw.wakeup, &dw.lock);
+		pthread_mutex_unlock(&dw.lock);
+	}
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+	if (!ret)
+		ret = dw.error;
+	return ret;
+}
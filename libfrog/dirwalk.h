@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __LIBFROG_DIRWALK_H__
+#define __LIBFROG_DIRWALK_H__
+
+/* Return from a dirwalk_fn to have the walker read a directory too. */
+#define DIRWALK_DESCEND		1
+
+/*
+ * Visit the root of a walk or an entry below it.  @path is the whole path
+ * of the entry; the entry can also be reached as @name relative to @dirfd,
+ * which for the root is AT_FDCWD and the root path.  @d_type is what
+ * readdir said about the entry (DT_UNKNOWN for the root) and @depth is how
+ * many directories down from the root it is.  Called from several threads
+ * at once.  Return DIRWALK_DESCEND to walk a directory, 0 to carry on, or
+ * a negative errno to stop the walk.
+ */
+typedef int (*dirwalk_fn)(const char *path, int dirfd, const char *name,
+		unsigned char d_type, int depth, void *arg);
+
+/* Report a directory that could not be read; the walk carries on. */
+typedef void (*dirwalk_err_fn)(const char *path, int error, void *arg);
+
+int dirwalk(const char *root, unsigned int nr_threads, dirwalk_fn fn,
+		dirwalk_err_fn err_fn, void *arg);
+
+#endif /* __LIBFROG_DIRWALK_H__ */
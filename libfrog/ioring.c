@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "ioring.h"
+
+#ifdef HAVE_IO_URING
+
+static inline int
+sys_io_uring_setup(
+	unsigned int		entries,
+	struct io_uring_params	*p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_io_uring_enter(
+	int			fd,
+	unsigned int		to_submit,
+	unsigned int		min_complete,
+	unsigned int		flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+static inline int
+sys_io_uring_register(
+	int			fd,
+	unsigned int		opcode,
+	const void		*arg,
+	unsigned int		nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Set up an io_uring with the given number of submission queue entries. */
+int
+ioring_init(
+	struct ioring		*ring,
+	unsigned int		entries,
+	unsigned int		flags)
+{
+	struct io_uring_params	p;
+	int			ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = flags;
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->flags = flags;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(__u32);
+	ring->cq_ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ret = -errno;
+		goto out_fd;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ret = -errno;
+			goto out_sq;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto out_cq;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->sq_mask = *(unsigned int *)(ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = *(unsigned int *)(ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+out_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+out_fd:
+	close(ring->fd);
+	ring->fd = -1;
+	return ret;
+}
+
+/* Tear down a ring.  All submitted I/O must have been reaped. */
+void
+ioring_free(
+	struct ioring		*ring)
+{
+	if (ring->fd < 0)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * Grab the next free submission queue entry, or NULL if the queue is full and
+ * the caller needs to submit what it has queued so far.
+ */
+struct io_uring_sqe *
+ioring_get_sqe(
+	struct ioring		*ring)
+{
+	unsigned int		tail = *ring->sq_tail + ring->sq_queued;
+	unsigned int		head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->sq_entries)
+		return NULL;
+
+	ring->sq_queued++;
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	return &ring->sqes[tail & ring->sq_mask];
+}
+
+/*
+ * Publish all queued sqes to the kernel and optionally wait for @wait_nr
+ * completions.  The kernel may take fewer sqes than it is offered; the rest
+ * stay in the ring and are offered again by the next call.  Returns the
+ * number of sqes submitted or a negative errno.
+ */
+int
+ioring_submit(
+	struct ioring		*ring,
+	unsigned int		wait_nr)
+{
+	unsigned int		to_submit;
+	unsigned int		submitted = 0;
+	unsigned int		flags = 0;
+	int			ret;
+
+	if (ring->sq_queued) {
+		__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_queued,
+				__ATOMIC_RELEASE);
+		ring->sq_queued = 0;
+	}
+	to_submit = ioring_sq_pending(ring);
+
+	if (wait_nr || (ring->flags & IORING_SETUP_IOPOLL))
+		flags |= IORING_ENTER_GETEVENTS;
+	if (!to_submit && !flags)
+		return 0;
+
+	for (;;) {
+		ret = sys_io_uring_enter(ring->fd, to_submit - submitted,
+				wait_nr, flags);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (submitted)
+				break;
+			return -errno;
+		}
+		submitted += ret;
+		if (!ret || submitted >= to_submit)
+			break;
+	}
+
+	return submitted;
+}
+
+/* Return the next completion without blocking, or NULL if there isn't one. */
+struct io_uring_cqe *
+ioring_peek_cqe(
+	struct ioring		*ring)
+{
+	unsigned int		head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Wait for the next completion. */
+int
+ioring_wait_cqe(
+	struct ioring		*ring,
+	struct io_uring_cqe	**cqep)
+{
+	struct io_uring_cqe	*cqe;
+	int			ret;
+
+	while (!(cqe = ioring_peek_cqe(ring))) {
+		do {
+			ret = sys_io_uring_enter(ring->fd, 0, 1,
+					IORING_ENTER_GETEVENTS);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0)
+			return -errno;
+	}
+
+	*cqep = cqe;
+	return 0;
+}
+
+/* Tell the kernel we're done with the completion returned by peek/wait. */
+void
+ioring_cqe_seen(
+	struct ioring		*ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pin @nr buffers so that READ_FIXED and WRITE_FIXED can use them by index
+ * without the kernel mapping the pages for every I/O.  This counts against
+ * RLIMIT_MEMLOCK, so callers must cope with it failing.
+ */
+int
+ioring_register_buffers(
+	struct ioring		*ring,
+	const struct iovec	*iov,
+	unsigned int		nr)
+{
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov,
+				nr) < 0)
+		return -errno;
+	return 0;
+}
+
+#endif /* HAVE_IO_URING */
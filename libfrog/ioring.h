@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __LIBFROG_IORING_H__
+#define __LIBFROG_IORING_H__
+
+/*
+ * Minimal io_uring wrapper.  We talk to the kernel directly through the raw
+ * syscalls rather than dragging in liburing, since all we need is to queue a
+ * batch of reads and writes and reap the completions.
+ *
+ * A ring is not thread safe; callers that want to share one must provide
+ * their own locking, or (preferably) give each thread its own ring.
+ */
+
+#ifdef HAVE_IO_URING
+#include <string.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct ioring {
+	int			fd;
+	unsigned int		flags;		/* IORING_SETUP_* */
+
+	/* submission queue */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_array;
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	unsigned int		sq_queued;	/* sqes not yet published */
+	struct io_uring_sqe	*sqes;
+
+	/* completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* mappings */
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+};
+
+int ioring_init(struct ioring *ring, unsigned int entries, unsigned int flags);
+void ioring_free(struct ioring *ring);
+
+struct io_uring_sqe *ioring_get_sqe(struct ioring *ring);
+int ioring_submit(struct ioring *ring, unsigned int wait_nr);
+struct io_uring_cqe *ioring_peek_cqe(struct ioring *ring);
+int ioring_wait_cqe(struct ioring *ring, struct io_uring_cqe **cqep);
+void ioring_cqe_seen(struct ioring *ring);
+int ioring_register_buffers(struct ioring *ring, const struct iovec *iov,
+		unsigned int nr);
+
+static inline void
+ioring_prep_rw(
+	struct io_uring_sqe	*sqe,
+	int			op,
+	int			fd,
+	void			*buf,
+	unsigned int		len,
+	uint64_t		offset,
+	uint64_t		user_data)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+}
+
+/* Number of sqes queued or published that the kernel hasn't taken yet. */
+static inline unsigned int
+ioring_sq_pending(
+	struct ioring		*ring)
+{
+	return *ring->sq_tail + ring->sq_queued -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Number of sqes that can still be queued before we must submit. */
+static inline unsigned int
+ioring_sq_space(
+	struct ioring		*ring)
+{
+	return ring->sq_entries - ioring_sq_pending(ring);
+}
+#else
+struct ioring {
+	int			fd;
+};
+
+static inline int
+ioring_init(struct ioring *ring, unsigned int entries, unsigned int flags)
+{
+	ring->fd = -1;
+	return -EOPNOTSUPP;
+}
+
+static inline void ioring_free(struct ioring *ring) { }
+#endif /* HAVE_IO_URING */
+
+#endif /* __LIBFROG_IORING_H__ */
@@ -282,3 +282,169 @@ platform_physmem(void)
 	}
 	return (si.totalram >> 10) * si.mem_unit;	/* kilobytes */
 }
+
+/* Read a byte count from a cgroup or sysfs file; "max" means no limit. */
+static unsigned long long
+read_mem_file(
+	const char		*path)
+{
+	char			buf[64];
+	unsigned long long	val;
+	FILE			*fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return ULLONG_MAX;
+	if (!fgets(buf, sizeof(buf), fp) || sscanf(buf, "%llu", &val) != 1)
+		val = ULLONG_MAX;
+	fclose(fp);
+	return val;
+}
+
+/* Is the memory controller in this comma separated list of controllers? */
+static bool
+cgroup_has_memory(
+	const char		*ctrls)
+{
+	const char		*p;
+
+	for (p = ctrls; p; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (!strncmp(p, "memory", 6) && (p[6] == ',' || p[6] == 0))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Find the tightest memory limit, in bytes, set on our cgroup or any of its
+ * ancestors.  cgroup v2 sets memory.max and memory.high on each level of the
+ * unified hierarchy; v1 has memory.limit_in_bytes in the memory controller's
+ * own hierarchy.  Either way the mount is assumed to be in the usual place
+ * under /sys/fs/cgroup.
+ */
+static unsigned long long
+cgroup_memlimit(void)
+{
+	static const char	*v2_files[] = { "memory.max", "memory.high" };
+	unsigned long long	limit = ULLONG_MAX;
+	unsigned long long	val;
+	char			line[PATH_MAX];
+	char			path[PATH_MAX + 64];
+	char			*cgpath, *ctrls, *p;
+	FILE			*fp;
+	int			i;
+
+	fp = fopen("/proc/self/cgroup", "r");
+	if (!fp)
+		return limit;
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = 0;
+		ctrls = strchr(line, ':');
+		if (!ctrls)
+			continue;
+		*ctrls++ = 0;
+		cgpath = strchr(ctrls, ':');
+		if (!cgpath)
+			continue;
+		*cgpath++ = 0;
+
+		/* walk up to the root, since any ancestor can be the limit */
+		for (;;) {
+			if (!strcmp(line, "0") && !*ctrls) {
+				for (i = 0; i < 2; i++) {
+					snprintf(path, sizeof(path),
+						"/sys/fs/cgroup%s/%s",
+						cgpath, v2_files[i]);
+					val = read_mem_file(path);
+					limit = min(limit, val);
+				}
+			} else if (cgroup_has_memory(ctrls)) {
+				snprintf(path, sizeof(path),
+					"/sys/fs/cgroup/memory%s/memory.limit_in_bytes",
+					cgpath);
+				val = read_mem_file(path);
+				limit = min(limit, val);
+			}
+
+			p = strrchr(cgpath, '/');
+			if (!p || p == cgpath)
+				break;
+			*p = 0;
+		}
+	}
+	fclose(fp);
+	return limit;
+}
+
+/*
+ * If we're only allowed to allocate from some of the NUMA nodes, add up how
+ * much memory they have between them, in bytes.
+ */
+static unsigned long long
+numa_memlimit(void)
+{
+	unsigned long long	limit = 0;
+	unsigned long long	kb;
+	unsigned int		first, last, node;
+	char			line[4096];
+	char			path[64];
+	char			*list = NULL;
+	char			*p;
+	FILE			*fp;
+	int			n;
+
+	fp = fopen("/proc/self/status", "r");
+	if (!fp)
+		return ULLONG_MAX;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "Mems_allowed_list:", 18)) {
+			list = line + 18;
+			break;
+		}
+	}
+	fclose(fp);
+	if (!list)
+		return ULLONG_MAX;
+
+	for (p = strtok(list, ", \t\n"); p; p = strtok(NULL, ", \t\n")) {
+		n = sscanf(p, "%u-%u", &first, &last);
+		if (n < 1)
+			return ULLONG_MAX;
+		if (n == 1)
+			last = first;
+		for (node = first; node <= last; node++) {
+			snprintf(path, sizeof(path),
+				"/sys/devices/system/node/node%u/meminfo",
+				node);
+			fp = fopen(path, "r");
+			if (!fp)
+				return ULLONG_MAX;
+			kb = 0;
+			while (fgets(line, sizeof(line), fp))
+				if (sscanf(line, "Node %*u MemTotal: %llu",
+						&kb) == 1)
+					break;
+			fclose(fp);
+			limit += kb << 10;
+		}
+	}
+	return limit ? limit : ULLONG_MAX;
+}
+
+/*
+ * How much memory we can actually use, in kilobytes: physical memory, cut
+ * down to what our memory cgroup allows and to what the NUMA nodes we may
+ * allocate from hold.
+ */
+unsigned long
+platform_memlimit(void)
+{
+	unsigned long long	limit = platform_physmem();
+
+	limit = min(limit, cgroup_memlimit() >> 10);
+	limit = min(limit, numa_memlimit() >> 10);
+	return limit;
+}
@@ -1,7 +1,10 @@
 /* List sorting code from Linux::lib/list_sort.c. */
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "list.h"
+#include "workqueue.h"
 
 #define unlikely(x)	(x)
 #define MAX_LIST_LENGTH_BITS 20
@@ -138,3 +141,153 @@ void list_sort(void *priv, struct list_head *head,
 
 	merge_and_restore_back_links(priv, cmp, head, part[max_lev], list);
 }
+
+/*
+ * Parallel list sort
+ *
+ * Chop the list into one piece per thread, sort the pieces with list_sort()
+ * on a workqueue, then merge neighbouring pieces pairwise, also on the
+ * workqueue, until only two are left for the final merge.  Pieces are
+ * contiguous and merges always take from the left piece first, so the sort
+ * stays stable.  Short lists aren't worth the threads.
+ */
+#define LIST_SORT_PARALLEL_MIN	65536	/* elements per thread */
+
+struct list_sort_ctl {
+	void			*priv;
+	int			(*cmp)(void *priv, struct list_head *a,
+					struct list_head *b);
+	struct list_head	**first;	/* null-terminated pieces */
+	struct list_head	**last;
+	unsigned int		step;		/* distance to merge partner */
+};
+
+static void
+list_sort_piece(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct list_sort_ctl	*ctl = arg;
+	struct list_head	head;
+
+	head.next = ctl->first[index];
+	head.prev = ctl->last[index];
+	ctl->first[index]->prev = &head;
+	ctl->last[index]->next = &head;
+
+	list_sort(ctl->priv, &head, ctl->cmp);
+
+	head.prev->next = NULL;
+	ctl->first[index] = head.next;
+}
+
+static void
+list_merge_pieces(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct list_sort_ctl	*ctl = arg;
+
+	ctl->first[index] = merge(ctl->priv, ctl->cmp, ctl->first[index],
+			ctl->first[index + ctl->step]);
+}
+
+/* Run @fn on each of @nr pieces in parallel, or inline if we can't. */
+static void
+list_sort_run(
+	struct list_sort_ctl	*ctl,
+	workqueue_func_t	*fn,
+	unsigned int		first,
+	unsigned int		nr,
+	unsigned int		stride)
+{
+	struct workqueue	wq;
+	unsigned int		i;
+	bool			threaded;
+
+	threaded = nr > 1 && workqueue_create(&wq, NULL, nr) == 0;
+	for (i = 0; i < nr; i++) {
+		uint32_t	index = first + i * stride;
+
+		if (!threaded || workqueue_add(&wq, fn, index, ctl))
+			fn(NULL, index, ctl);
+	}
+	if (threaded) {
+		workqueue_terminate(&wq);
+		workqueue_destroy(&wq);
+	}
+}
+
+/**
+ * list_sort_parallel - sort a list with several threads
+ * @priv: private data, opaque to list_sort_parallel(), passed to @cmp
+ * @head: the list to sort
+ * @cmp: the elements comparison function
+ * @nr_threads: how many threads to use
+ *
+ * Same as list_sort(), except that long lists are sorted by up to
+ * @nr_threads threads at once.  @cmp must be safe to call from several
+ * threads at the same time.
+ */
+void list_sort_parallel(void *priv, struct list_head *head,
+		int (*cmp)(void *priv, struct list_head *a,
+			struct list_head *b),
+		unsigned int nr_threads)
+{
+	struct list_sort_ctl	ctl = {
+		.priv		= priv,
+		.cmp		= cmp,
+	};
+	struct list_head	*pos;
+	unsigned long		nr = 0;
+	unsigned long		per;
+	unsigned long		j;
+	unsigned int		i;
+
+	list_for_each(pos, head)
+		nr++;
+	if (nr_threads > nr / LIST_SORT_PARALLEL_MIN)
+		nr_threads = nr / LIST_SORT_PARALLEL_MIN;
+	if (nr_threads < 2)
+		goto serial;
+
+	ctl.first = calloc(nr_threads, sizeof(struct list_head *));
+	ctl.last = calloc(nr_threads, sizeof(struct list_head *));
+	if (!ctl.first || !ctl.last)
+		goto serial_free;
+
+	/* Chop the list into pieces of nearly equal length. */
+	pos = head->next;
+	for (i = 0; i < nr_threads; i++) {
+		per = nr / nr_threads + (i < nr % nr_threads);
+		ctl.first[i] = pos;
+		for (j = 1; j < per; j++)
+			pos = pos->next;
+		ctl.last[i] = pos;
+		pos = pos->next;
+		ctl.last[i]->next = NULL;
+	}
+
+	list_sort_run(&ctl, list_sort_piece, 0, nr_threads, 1);
+
+	/* Merge pairs of pieces until there are only two left. */
+	for (ctl.step = 1; ctl.step * 2 < nr_threads; ctl.step *= 2)
+		list_sort_run(&ctl, list_merge_pieces, 0,
+				(nr_threads - ctl.step + 2 * ctl.step - 1) /
+					(2 * ctl.step),
+				2 * ctl.step);
+
+	merge_and_restore_back_links(priv, cmp, head, ctl.first[0],
+			ctl.first[ctl.step]);
+	free(ctl.last);
+	free(ctl.first);
+	return;
+
+serial_free:
+	free(ctl.last);
+	free(ctl.first);
+serial:
+	list_sort(priv, head, cmp);
+}
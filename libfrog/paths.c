@@ -27,6 +27,156 @@ struct fs_path *fs_path;
 char *mtab_file;
 #define PROC_MOUNTS	"/proc/self/mounts"
 
+static int fs_table_size;	/* entries allocated in fs_table */
+
+/*
+ * Hash indexes of the fs table, so that hosts with tens of thousands of
+ * mounts don't make every lookup walk (and stat) the whole table.  The
+ * chains hold table indexes in table order, so a lookup still finds the
+ * same entry that a walk from the front would.  Inserting an entry can
+ * move others around, so it just marks the indexes stale and the next
+ * lookup rebuilds them.
+ */
+enum {
+	FS_INDEX_DEV,		/* fs_datadev */
+	FS_INDEX_DIR,		/* fs_rdir of mount points */
+	FS_INDEX_NAME,		/* fs_rname of mount points */
+	FS_INDEX_NR,
+};
+
+static int *fs_index_head[FS_INDEX_NR];
+static int *fs_index_next[FS_INDEX_NR];
+static unsigned int fs_index_size;	/* buckets, or 0 if no index */
+static int fs_index_count = -1;		/* entries indexed, -1 if stale */
+
+static uint32_t
+fs_hash_dev(
+	dev_t		dev)
+{
+	return ((uint64_t)dev * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static uint32_t
+fs_hash_str(
+	const char	*str)
+{
+	uint32_t	hash = 2166136261U;
+
+	while (*str)
+		hash = (hash ^ (unsigned char)*str++) * 16777619U;
+	return hash;
+}
+
+static void
+fs_index_free(void)
+{
+	int		i;
+
+	for (i = 0; i < FS_INDEX_NR; i++) {
+		free(fs_index_head[i]);
+		free(fs_index_next[i]);
+		fs_index_head[i] = fs_index_next[i] = NULL;
+	}
+	fs_index_size = 0;
+	fs_index_count = -1;
+}
+
+static void
+fs_index_add(
+	int		which,
+	uint32_t	hash,
+	int		i)
+{
+	int		*head = &fs_index_head[which][hash & (fs_index_size - 1)];
+
+	fs_index_next[which][i] = *head;
+	*head = i;
+}
+
+/* (Re)build the indexes if the table has changed; false if we can't. */
+static bool
+fs_table_index(void)
+{
+	struct fs_path	*fsp;
+	unsigned int	size = 64;
+	int		i;
+
+	if (fs_index_count == fs_count)
+		return fs_index_size != 0;
+
+	fs_index_free();
+	fs_index_count = fs_count;
+	while (size < 2 * fs_count)
+		size <<= 1;
+	for (i = 0; i < FS_INDEX_NR; i++) {
+		fs_index_head[i] = malloc(size * sizeof(int));
+		fs_index_next[i] = malloc((fs_count + 1) * sizeof(int));
+		if (!fs_index_head[i] || !fs_index_next[i]) {
+			fs_index_free();
+			fs_index_count = fs_count;
+			return false;
+		}
+		memset(fs_index_head[i], 0xff, size * sizeof(int));
+	}
+	fs_index_size = size;
+
+	/* push from the back so that each chain runs in table order */
+	for (i = fs_count - 1; i >= 0; i--) {
+		fsp = &fs_table[i];
+		fs_index_add(FS_INDEX_DEV, fs_hash_dev(fsp->fs_datadev), i);
+		if (!(fsp->fs_flags & FS_MOUNT_POINT))
+			continue;
+		if (fsp->fs_rdir)
+			fs_index_add(FS_INDEX_DIR, fs_hash_str(fsp->fs_rdir), i);
+		if (fsp->fs_rname)
+			fs_index_add(FS_INDEX_NAME, fs_hash_str(fsp->fs_rname),
+					i);
+	}
+	return true;
+}
+
+/*
+ * Iterate the table entries that might match @hash in index @which, or
+ * all of them if there's no index.  Callers check the entries themselves.
+ */
+static int
+fs_index_first(
+	int		which,
+	uint32_t	hash)
+{
+	if (!fs_table_index())
+		return fs_count ? 0 : -1;
+	return fs_index_head[which][hash & (fs_index_size - 1)];
+}
+
+static int
+fs_index_step(
+	int		which,
+	int		i)
+{
+	if (!fs_index_size)
+		return i + 1 < fs_count ? i + 1 : -1;
+	return fs_index_next[which][i];
+}
+
+#define for_each_fs_index(i, which, hash) \
+	for ((i) = fs_index_first((which), (hash)); (i) >= 0; \
+	     (i) = fs_index_step((which), (i)))
+
+/* Is @rpath the directory @dir or somewhere underneath it? */
+static bool
+fs_path_is_under(
+	const char	*dir,
+	const char	*rpath)
+{
+	size_t		len = strlen(dir);
+
+	if (len == 1 && dir[0] == '/')
+		return true;
+	return !strncmp(dir, rpath, len) &&
+	       (rpath[len] == '/' || rpath[len] == 0);
+}
+
 static int
 fs_device_number(
 	const char	*name,
@@ -62,13 +212,13 @@ fs_table_lookup(
 	const char	*dir,
 	uint		flags)
 {
-	uint		i;
+	int		i;
 	dev_t		dev = 0;
 
 	if (fs_device_number(dir, &dev))
 		return NULL;
 
-	for (i = 0; i < fs_count; i++) {
+	for_each_fs_index(i, FS_INDEX_DEV, fs_hash_dev(dev)) {
 		if (flags && !(flags & fs_table[i].fs_flags))
 			continue;
 		if (fs_table[i].fs_datadev == dev)
@@ -82,8 +232,8 @@ __fs_table_lookup_mount(
 	const char	*dir,
 	const char	*blkdev)
 {
-	uint		i;
-	char		rpath[PATH_MAX];
+	int		i, which = dir ? FS_INDEX_DIR : FS_INDEX_NAME;
+	char		*rpath;
 	char		dpath[PATH_MAX];
 
 	if (!dir && !blkdev)
@@ -94,14 +244,12 @@ __fs_table_lookup_mount(
 	if (blkdev && !realpath(blkdev, dpath))
 		return NULL;
 
-	for (i = 0; i < fs_count; i++) {
+	/* mount points had their paths resolved when they were added */
+	for_each_fs_index(i, which, fs_hash_str(dpath)) {
 		if (fs_table[i].fs_flags != FS_MOUNT_POINT)
 			continue;
-		if (dir && !realpath(fs_table[i].fs_dir, rpath))
-			continue;
-		if (blkdev && !realpath(fs_table[i].fs_name, rpath))
-			continue;
-		if (strcmp(rpath, dpath) == 0)
+		rpath = dir ? fs_table[i].fs_rdir : fs_table[i].fs_rname;
+		if (rpath && strcmp(rpath, dpath) == 0)
 			return &fs_table[i];
 	}
 	return NULL;
@@ -133,6 +281,11 @@ fs_table_lookup_blkdev(
 	return __fs_table_lookup_mount(NULL, bdev);
 }
 
+/*
+ * Add an entry to the table.  @rdir and @rname are the resolved mount point
+ * and device paths for fs_table_lookup_mount and fs_table_lookup_blkdev,
+ * and are NULL for anything but a mount.
+ */
 static int
 fs_table_insert(
 	char		*dir,
@@ -140,10 +293,14 @@ fs_table_insert(
 	uint		flags,
 	char		*fsname,
 	char		*fslog,
-	char		*fsrt)
+	char		*fsrt,
+	const char	*rdir,
+	const char	*rname)
 {
 	dev_t		datadev, logdev, rtdev;
 	struct fs_path	*tmp_fs_table;
+	char		*rdir_copy = NULL, *rname_copy = NULL;
+	int		size;
 	int		error;
 
 	datadev = logdev = rtdev = 0;
@@ -180,11 +337,19 @@ fs_table_insert(
 	fsname = strdup(fsname);
 	if (!fsname)
 		goto out_noname;
-
-	tmp_fs_table = realloc(fs_table, sizeof(fs_path_t) * (fs_count + 1));
-	if (!tmp_fs_table)
+	if (rdir && !(rdir_copy = strdup(rdir)))
 		goto out_norealloc;
-	fs_table = tmp_fs_table;
+	if (rname && !(rname_copy = strdup(rname)))
+		goto out_norealloc;
+
+	if (fs_count == fs_table_size) {
+		size = fs_table_size ? fs_table_size * 2 : 16;
+		tmp_fs_table = realloc(fs_table, sizeof(fs_path_t) * size);
+		if (!tmp_fs_table)
+			goto out_norealloc;
+		fs_table = tmp_fs_table;
+		fs_table_size = size;
+	}
 
 	/* Put foreign filesystems at the end, xfs filesystems at the front */
 	if (flags & FS_FOREIGN || fs_count == 0) {
@@ -204,13 +369,18 @@ fs_table_insert(
 	fs_path->fs_datadev = datadev;
 	fs_path->fs_logdev = logdev;
 	fs_path->fs_rtdev = rtdev;
+	fs_path->fs_rdir = rdir_copy;
+	fs_path->fs_rname = rname_copy;
 	fs_count++;
 	if (!(flags & FS_FOREIGN))
 		xfs_fs_count++;
+	fs_index_count = -1;
 
 	return 0;
 
 out_norealloc:
+	free(rname_copy);
+	free(rdir_copy);
 	free(fsname);
 out_noname:
 	free(dir);
@@ -234,12 +404,16 @@ fs_table_destroy(void)
 		free(fsp->fs_dir);
 		free(fsp->fs_log);
 		free(fsp->fs_rt);
+		free(fsp->fs_rdir);
+		free(fsp->fs_rname);
 	}
 
 	fs_count = 0;
 	xfs_fs_count = 0;
 	free(fs_table);
 	fs_table = NULL;
+	fs_table_size = 0;
+	fs_index_free();
 }
 
 /*
@@ -354,6 +528,17 @@ out_nomem:
 	return ENOMEM;
 }
 
+static FILE *
+fs_setmntent(void)
+{
+	if (!mtab_file) {
+		mtab_file = PROC_MOUNTS;
+		if (access(mtab_file, R_OK) != 0)
+			mtab_file = MOUNTED;
+	}
+	return setmntent(mtab_file, "r");
+}
+
 /*
  * If *path is NULL, initialize the fs table with all xfs mount points in mtab
  * If *path is specified, search for that path in mtab
@@ -374,13 +559,7 @@ fs_table_initialise_mounts(
 	error = found = 0;
 	fslog = fsrt = NULL;
 
-	if (!mtab_file) {
-		mtab_file = PROC_MOUNTS;
-		if (access(mtab_file, R_OK) != 0)
-			mtab_file = MOUNTED;
-	}
-
-	if ((mtp = setmntent(mtab_file, "r")) == NULL)
+	if ((mtp = fs_setmntent()) == NULL)
 		return ENOENT;
 
 	/* Use realpath to resolve symlinks, relative paths, etc */
@@ -403,7 +582,8 @@ fs_table_initialise_mounts(
 		if (fs_extract_mount_options(mnt, &fslog, &fsrt))
 			continue;
 		(void) fs_table_insert(mnt->mnt_dir, 0, FS_MOUNT_POINT,
-					mnt->mnt_fsname, fslog, fsrt);
+					mnt->mnt_fsname, fslog, fsrt,
+					rmnt_dir, rmnt_fsname);
 		if (path) {
 			found = 1;
 			break;
@@ -417,6 +597,87 @@ fs_table_initialise_mounts(
 	return error;
 }
 
+/* Do we already have a mount entry for mount point or device @rpath? */
+static bool
+fs_table_has_mount(
+	const char	*rpath,
+	bool		blkdev)
+{
+	struct fs_path	*fsp;
+	char		*name;
+	int		i, which = blkdev ? FS_INDEX_NAME : FS_INDEX_DIR;
+
+	for_each_fs_index(i, which, fs_hash_str(rpath)) {
+		fsp = &fs_table[i];
+		name = blkdev ? fsp->fs_rname : fsp->fs_rdir;
+		if ((fsp->fs_flags & FS_MOUNT_POINT) && name &&
+		    !strcmp(name, rpath))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Add the mounts that the file @rpath lives on (those of device @dev at or
+ * above it), or that block device @rpath is mounted at.  Unless @all is
+ * set, mtab entries whose names can't match are passed over without any
+ * system calls; the kernel's mount table is already in canonical form, so
+ * that only misses for a hand written mtab.
+ */
+static int
+fs_table_find_mounts(
+	const char	*rpath,
+	bool		blkdev,
+	dev_t		dev,
+	bool		all,
+	int		*found)
+{
+	struct mntent	*mnt;
+	FILE		*mtp;
+	char		*fslog, *fsrt;
+	dev_t		mdev;
+	char		rmnt_fsname[PATH_MAX], rmnt_dir[PATH_MAX];
+
+	if ((mtp = fs_setmntent()) == NULL)
+		return ENOENT;
+
+	while ((mnt = getmntent(mtp)) != NULL) {
+		if (!strcmp(mnt->mnt_type, "autofs"))
+			continue;
+		if (!all && blkdev && mnt->mnt_fsname[0] != '/')
+			continue;
+		if (!all && !blkdev && !fs_path_is_under(mnt->mnt_dir, rpath))
+			continue;
+		if (!realpath(mnt->mnt_dir, rmnt_dir))
+			continue;
+		if (!realpath(mnt->mnt_fsname, rmnt_fsname))
+			continue;
+
+		if (blkdev) {
+			if (strcmp(rpath, rmnt_fsname) != 0)
+				continue;
+		} else {
+			if (!fs_path_is_under(rmnt_dir, rpath))
+				continue;
+			if (fs_device_number(rmnt_dir, &mdev) || mdev != dev)
+				continue;
+		}
+		if (fs_table_has_mount(rmnt_dir, false)) {
+			(*found)++;
+			continue;
+		}
+
+		if (fs_extract_mount_options(mnt, &fslog, &fsrt))
+			continue;
+		if (!fs_table_insert(mnt->mnt_dir, 0, FS_MOUNT_POINT,
+					mnt->mnt_fsname, fslog, fsrt,
+					rmnt_dir, rmnt_fsname))
+			(*found)++;
+	}
+	endmntent(mtp);
+	return 0;
+}
+
 #else
 # error "How do I extract info about mounted filesystems on this platform?"
 #endif
@@ -428,19 +689,7 @@ static struct fs_path *
 fs_mount_point_from_path(
 	const char	*dir)
 {
-	fs_cursor_t	cursor;
-	fs_path_t	*fs;
-	dev_t		dev = 0;
-
-	if (fs_device_number(dir, &dev))
-		return NULL;
-
-	fs_cursor_initialise(NULL, FS_MOUNT_POINT, &cursor);
-	while ((fs = fs_cursor_next_entry(&cursor))) {
-		if (fs->fs_datadev == dev)
-			break;
-	}
-	return fs;
+	return fs_table_lookup(dir, FS_MOUNT_POINT);
 }
 
 static void
@@ -479,7 +728,7 @@ fs_table_initialise_projects(
 		}
 		(void) fs_table_insert(path->pp_pathname, path->pp_prid,
 					FS_PROJECT_PATH, fs->fs_name,
-					NULL, NULL);
+					NULL, NULL, NULL, NULL);
 		if (project) {
 			found = 1;
 			break;
@@ -546,6 +795,40 @@ out_error:
 		progname, strerror(error));
 }
 
+/*
+ * Make sure the fs table has the filesystem that @path lives on, or that
+ * block device @path is mounted at, without the cost of reading every mount
+ * on the system into it.  Tools that only ever look up the paths they are
+ * given can call this instead of fs_table_initialise.  Returns 0 or a
+ * positive errno; ENXIO if no mount could be found.
+ */
+int
+fs_table_initialise_path(
+	const char	*path)
+{
+	struct stat	sbuf;
+	char		rpath[PATH_MAX];
+	bool		blkdev;
+	dev_t		dev;
+	int		found = 0;
+	int		error;
+
+	if (!realpath(path, rpath) || stat(rpath, &sbuf) < 0)
+		return errno;
+	blkdev = S_ISBLK(sbuf.st_mode) || S_ISCHR(sbuf.st_mode);
+	dev = blkdev ? sbuf.st_rdev : sbuf.st_dev;
+
+	if (fs_table_has_mount(rpath, blkdev))
+		return 0;
+
+	error = fs_table_find_mounts(rpath, blkdev, dev, false, &found);
+	if (!error && !found)
+		error = fs_table_find_mounts(rpath, blkdev, dev, true, &found);
+	if (!error && !found)
+		error = ENXIO;
+	return error;
+}
+
 int
 fs_table_insert_project_path(
 	char		*dir,
@@ -557,7 +840,7 @@ fs_table_insert_project_path(
 	fs = fs_mount_point_from_path(dir);
 	if (fs)
 		error = fs_table_insert(dir, prid, FS_PROJECT_PATH,
-					fs->fs_name, NULL, NULL);
+					fs->fs_name, NULL, NULL, NULL, NULL);
 	else
 		error = ENOENT;
 
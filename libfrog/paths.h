@@ -29,6 +29,8 @@ typedef struct fs_path {
 	char		*fs_dir;	/* Directory / mount point	*/
 	uint		fs_flags;	/* FS_{MOUNT_POINT,PROJECT_PATH}*/
 	uint		fs_prid;	/* Project ID for tree root	*/
+	char		*fs_rdir;	/* realpath of fs_dir (mounts)	*/
+	char		*fs_rname;	/* realpath of fs_name (mounts)	*/
 } fs_path_t;
 
 extern int fs_count;		/* number of entries in fs table */
@@ -38,6 +40,7 @@ extern fs_path_t *fs_path;	/* current entry in the fs table */
 extern char *mtab_file;
 
 extern void fs_table_initialise(int, char *[], int, char *[]);
+extern int fs_table_initialise_path(const char *__path);
 extern void fs_table_destroy(void);
 
 extern int fs_table_insert_project_path(char *__dir, uint __projid);
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "projects.h"
 
 #define PROJID		"/etc/projid"
@@ -18,6 +19,31 @@ static FILE *projects;
 
 static FILE *project_paths;
 
+/*
+ * getprnam() and getprprid() look projects up in a copy of the projid file
+ * hashed by name and by id, which is loaded again whenever the file
+ * changes.  Where a name or id appears more than once, the first entry in
+ * the file wins, as it did when the file was searched for each lookup.
+ */
+struct prcache_ent {
+	fs_project_t		pr;
+	struct prcache_ent	*name_next;
+	struct prcache_ent	*id_next;
+};
+
+static struct {
+	char			*path;
+	dev_t			dev;
+	ino_t			ino;
+	off_t			size;
+	struct timespec		mtime;
+	struct prcache_ent	*ents;
+	size_t			nr_ents;
+	struct prcache_ent	**by_name;
+	struct prcache_ent	**by_id;
+	size_t			hash_size;	/* power of two */
+} prcache;
+
 void
 setprfiles(void)
 {
@@ -57,18 +83,20 @@ endprpathent(void)
 	project_paths = NULL;
 }
 
-fs_project_t *
-getprent(void)
+static fs_project_t *
+parse_prent(
+	FILE		*f,
+	fs_project_t	*pp,
+	char		*projects_buffer,
+	size_t		size)
 {
-	static		fs_project_t p;
-	static char	projects_buffer[512];
+	fs_project_t	p;
 	char		*idstart, *idend;
-	size_t		size = sizeof(projects_buffer) - 1;
 
-	if (!projects)
+	if (!f)
 		return NULL;
 	for (;;) {
-		if (!fgets(projects_buffer, size, projects))
+		if (!fgets(projects_buffer, size, f))
 			break;
 		/*
 		 * /etc/projid file format -- "name:id\n", ignore "^#..."
@@ -86,38 +114,169 @@ getprent(void)
 		*idstart = '\0';
 		p.pr_prid = atoi(idstart+1);
 		p.pr_name = &projects_buffer[0];
-		return &p;
+		*pp = p;
+		return pp;
 	}
 
 	return NULL;
 }
 
+fs_project_t *
+getprent(void)
+{
+	static		fs_project_t p;
+	static char	projects_buffer[512];
+
+	return parse_prent(projects, &p, projects_buffer,
+			sizeof(projects_buffer) - 1);
+}
+
+static size_t
+prcache_name_hash(
+	const char	*name)
+{
+	uint32_t	hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash & (prcache.hash_size - 1);
+}
+
+static size_t
+prcache_id_hash(
+	prid_t		prid)
+{
+	return (prid * 2654435761U) & (prcache.hash_size - 1);
+}
+
+static void
+prcache_free(void)
+{
+	size_t		i;
+
+	for (i = 0; i < prcache.nr_ents; i++)
+		free(prcache.ents[i].pr.pr_name);
+	free(prcache.ents);
+	free(prcache.by_name);
+	free(prcache.by_id);
+	free(prcache.path);
+	memset(&prcache, 0, sizeof(prcache));
+}
+
+/*
+ * Make sure the cache matches the projid file.  Returns false if it can't
+ * be read, in which case nothing is found, as before.
+ */
+static bool
+prcache_load(void)
+{
+	static char	buf[512];
+	fs_project_t	p;
+	struct stat	st;
+	size_t		max_ents = 0;
+	size_t		i, h;
+	FILE		*f;
+
+	setprfiles();
+	if (stat(projid_file, &st) < 0) {
+		prcache_free();
+		return false;
+	}
+	if (prcache.path && !strcmp(prcache.path, projid_file) &&
+	    prcache.dev == st.st_dev && prcache.ino == st.st_ino &&
+	    prcache.size == st.st_size &&
+	    prcache.mtime.tv_sec == st.st_mtim.tv_sec &&
+	    prcache.mtime.tv_nsec == st.st_mtim.tv_nsec)
+		return true;
+
+	prcache_free();
+	f = fopen(projid_file, "r");
+	if (!f)
+		return false;
+	while (parse_prent(f, &p, buf, sizeof(buf) - 1)) {
+		struct prcache_ent	*ent;
+
+		if (prcache.nr_ents == max_ents) {
+			max_ents = max_ents ? max_ents * 2 : 64;
+			ent = realloc(prcache.ents, max_ents * sizeof(*ent));
+			if (!ent)
+				goto out_nomem;
+			prcache.ents = ent;
+		}
+		ent = &prcache.ents[prcache.nr_ents];
+		ent->pr.pr_prid = p.pr_prid;
+		ent->pr.pr_name = strdup(p.pr_name);
+		if (!ent->pr.pr_name)
+			goto out_nomem;
+		prcache.nr_ents++;
+	}
+	fclose(f);
+
+	prcache.hash_size = 16;
+	while (prcache.hash_size < prcache.nr_ents)
+		prcache.hash_size <<= 1;
+	prcache.by_name = calloc(prcache.hash_size, sizeof(*prcache.by_name));
+	prcache.by_id = calloc(prcache.hash_size, sizeof(*prcache.by_id));
+	prcache.path = strdup(projid_file);
+	if (!prcache.by_name || !prcache.by_id || !prcache.path) {
+		prcache_free();
+		return false;
+	}
+
+	/* insert backwards so that the first of any duplicates is found */
+	for (i = prcache.nr_ents; i-- > 0; ) {
+		struct prcache_ent	*ent = &prcache.ents[i];
+
+		h = prcache_name_hash(ent->pr.pr_name);
+		ent->name_next = prcache.by_name[h];
+		prcache.by_name[h] = ent;
+		h = prcache_id_hash(ent->pr.pr_prid);
+		ent->id_next = prcache.by_id[h];
+		prcache.by_id[h] = ent;
+	}
+
+	prcache.dev = st.st_dev;
+	prcache.ino = st.st_ino;
+	prcache.size = st.st_size;
+	prcache.mtime = st.st_mtim;
+	return true;
+
+out_nomem:
+	fclose(f);
+	prcache_free();
+	return false;
+}
+
 fs_project_t *
 getprnam(
 	char		*name)
 {
-	fs_project_t	*p = NULL;
+	struct prcache_ent *ent;
 
-	setprent();
-	while ((p = getprent()) != NULL)
-		if (strcmp(p->pr_name, name) == 0)
-			break;
-	endprent();
-	return p;
+	if (!prcache_load())
+		return NULL;
+	for (ent = prcache.by_name[prcache_name_hash(name)]; ent;
+	     ent = ent->name_next)
+		if (strcmp(ent->pr.pr_name, name) == 0)
+			return &ent->pr;
+	return NULL;
 }
 
 fs_project_t *
 getprprid(
 	prid_t		prid)
 {
-	fs_project_t	*p = NULL;
+	struct prcache_ent *ent;
 
-	setprent();
-	while ((p = getprent()) != NULL)
-		if (p->pr_prid == prid)
-			break;
-	endprent();
-	return p;
+	if (!prcache_load())
+		return NULL;
+	for (ent = prcache.by_id[prcache_id_hash(prid)]; ent;
+	     ent = ent->id_next)
+		if (ent->pr.pr_prid == prid)
+			return &ent->pr;
+	return NULL;
 }
 
 fs_project_path_t *
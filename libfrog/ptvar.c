@@ -22,16 +22,49 @@
  * elements to each thread.  This way, each thread gets its own
  * cacheline and (after the first access) doesn't have to contend for a
  * lock for each access.
+ *
+ * The lock only serializes threads claiming a region.  nr_used is published
+ * with release semantics once a region has been handed out, so that readers
+ * who can tolerate concurrent updates can walk the regions without locking.
+ * Each thread also caches the last variable it looked up, which saves the
+ * pthread_getspecific call in the common case of a thread hammering a
+ * single variable.
  */
 struct ptvar {
 	pthread_key_t	key;
 	pthread_mutex_t	lock;
+	uint64_t	gen;
 	size_t		nr_used;
 	size_t		nr_counters;
 	size_t		data_size;
-	unsigned char	data[0];
+	unsigned char	*data;
+};
+
+/* Fallback region alignment if we can't ask the system. */
+#define PTVAR_DEFAULT_ALIGN	64
+
+/* Unique identifier for each ptvar, so the lookup cache survives reuse. */
+static uint64_t			ptvar_next_gen = 1;
+
+struct ptvar_cache {
+	struct ptvar		*ptv;
+	uint64_t		gen;
+	void			*data;
 };
-#define PTVAR_SIZE(nr, sz) (sizeof(struct ptvar) + ((nr) * (size)))
+static __thread struct ptvar_cache	ptvar_cache;
+
+static size_t
+ptvar_align(void)
+{
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+	long		l1_dcache;
+
+	l1_dcache = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+	if (l1_dcache > 0)
+		return l1_dcache;
+#endif
+	return PTVAR_DEFAULT_ALIGN;
+}
 
 /* Allocate a new per-thread counter. */
 int
@@ -41,27 +74,26 @@ ptvar_alloc(
 	struct ptvar	**pptv)
 {
 	struct ptvar	*ptv;
+	size_t		align = ptvar_align();
 	int		ret;
 
-#ifdef _SC_LEVEL1_DCACHE_LINESIZE
-	long		l1_dcache;
-
 	/* Try to prevent cache pingpong by aligning to cacheline size. */
-	l1_dcache = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
-	if (l1_dcache > 0)
-		size = roundup(size, l1_dcache);
-#endif
+	size = roundup(size, align);
 
-	ptv = malloc(PTVAR_SIZE(nr, size));
+	ptv = malloc(sizeof(struct ptvar));
 	if (!ptv)
 		return -errno;
+	ret = -posix_memalign((void **)&ptv->data, align, nr * size);
+	if (ret)
+		goto out;
+	ptv->gen = __atomic_fetch_add(&ptvar_next_gen, 1, __ATOMIC_RELAXED);
 	ptv->data_size = size;
 	ptv->nr_counters = nr;
 	ptv->nr_used = 0;
 	memset(ptv->data, 0, nr * size);
 	ret = -pthread_mutex_init(&ptv->lock, NULL);
 	if (ret)
-		goto out;
+		goto out_data;
 	ret = -pthread_key_create(&ptv->key, NULL);
 	if (ret)
 		goto out_mutex;
@@ -70,6 +102,8 @@ ptvar_alloc(
 	return 0;
 out_mutex:
 	pthread_mutex_destroy(&ptv->lock);
+out_data:
+	free(ptv->data);
 out:
 	free(ptv);
 	return ret;
@@ -82,6 +116,7 @@ ptvar_free(
 {
 	pthread_key_delete(ptv->key);
 	pthread_mutex_destroy(&ptv->lock);
+	free(ptv->data);
 	free(ptv);
 }
 
@@ -91,24 +126,34 @@ ptvar_get(
 	struct ptvar	*ptv,
 	int		*retp)
 {
+	struct ptvar_cache	*pc = &ptvar_cache;
 	void		*p;
 	int		ret;
 
+	if (pc->ptv == ptv && pc->gen == ptv->gen) {
+		*retp = 0;
+		return pc->data;
+	}
+
 	p = pthread_getspecific(ptv->key);
 	if (!p) {
 		pthread_mutex_lock(&ptv->lock);
 		assert(ptv->nr_used < ptv->nr_counters);
-		p = &ptv->data[(ptv->nr_used++) * ptv->data_size];
+		p = &ptv->data[ptv->nr_used * ptv->data_size];
 		ret = -pthread_setspecific(ptv->key, p);
 		if (ret)
 			goto out_unlock;
+		__atomic_store_n(&ptv->nr_used, ptv->nr_used + 1,
+				__ATOMIC_RELEASE);
 		pthread_mutex_unlock(&ptv->lock);
 	}
+	pc->ptv = ptv;
+	pc->gen = ptv->gen;
+	pc->data = p;
 	*retp = 0;
 	return p;
 
 out_unlock:
-	ptv->nr_used--;
 	pthread_mutex_unlock(&ptv->lock);
 	*retp = ret;
 	return NULL;
@@ -134,3 +179,29 @@ ptvar_foreach(
 
 	return ret;
 }
+
+/*
+ * Iterate all of the per-thread variables without taking the lock.  Threads
+ * can claim new variables and change the values while we walk, so the
+ * iterator function must use atomic accesses to read the values and cope
+ * with them being slightly out of date.
+ */
+int
+ptvar_foreach_lockless(
+	struct ptvar	*ptv,
+	ptvar_iter_fn	fn,
+	void		*foreach_arg)
+{
+	size_t		nr_used;
+	size_t		i;
+	int		ret = 0;
+
+	nr_used = __atomic_load_n(&ptv->nr_used, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nr_used; i++) {
+		ret = fn(ptv, &ptv->data[i * ptv->data_size], foreach_arg);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
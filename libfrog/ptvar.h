@@ -18,5 +18,7 @@ void *ptvar_get(struct ptvar *ptv, int *ret);
  */
 typedef int (*ptvar_iter_fn)(struct ptvar *ptv, void *data, void *foreach_arg);
 int ptvar_foreach(struct ptvar *ptv, ptvar_iter_fn fn, void *foreach_arg);
+int ptvar_foreach_lockless(struct ptvar *ptv, ptvar_iter_fn fn,
+		void *foreach_arg);
 
 #endif /* __LIBFROG_PTVAR_H__ */
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include "platform_defs.h"
+#include "list.h"
 #include "radix-tree.h"
 
 #ifndef ARRAY_SIZE
@@ -25,7 +26,9 @@
 #endif
 
 struct radix_tree_node {
+	unsigned int	height;		/* levels from here to the items */
 	unsigned int	count;
+	struct rcu_head	rcu_head;
 	void		*slots[RADIX_TREE_MAP_SIZE];
 #ifdef RADIX_TREE_TAGS
 	unsigned long	tags[RADIX_TREE_MAX_TAGS][RADIX_TREE_TAG_LONGS];
@@ -43,12 +46,43 @@ struct radix_tree_path {
 static unsigned long height_to_maxindex[RADIX_TREE_MAX_PATH];
 
 /*
- * Radix tree node cache.
+ * Concurrency
+ *
+ * Updates (insert, delete, tag set and clear) must be serialized by the
+ * caller, but lookups may run locklessly under rcu_read_lock() while an
+ * update is in progress.  To make that work, every node records its own
+ * height so that readers never look at root->height, new nodes and items
+ * are published with rcu_assign_pointer() only once they're initialised,
+ * and nodes that come out of the tree are freed after a grace period.
+ * Lookups see each slot as it was either before or after a concurrent
+ * update; freeing the items themselves is up to the caller.
  */
 
-#define radix_tree_node_alloc(r)	((struct radix_tree_node *) \
-		calloc(1, sizeof(struct radix_tree_node)))
-#define radix_tree_node_free(n)		free(n)
+static struct radix_tree_node *
+radix_tree_node_alloc(
+	unsigned int		height)
+{
+	struct radix_tree_node	*node;
+
+	node = calloc(1, sizeof(struct radix_tree_node));
+	if (node)
+		node->height = height;
+	return node;
+}
+
+static void
+radix_tree_node_rcu_free(
+	struct rcu_head		*head)
+{
+	free(container_of(head, struct radix_tree_node, rcu_head));
+}
+
+static inline void
+radix_tree_node_free(
+	struct radix_tree_node	*node)
+{
+	call_rcu(&node->rcu_head, radix_tree_node_rcu_free);
+}
 
 #ifdef RADIX_TREE_TAGS
 
@@ -131,7 +165,7 @@ static int radix_tree_extend(struct radix_tree_root *root, unsigned long index)
 	}
 #endif
 	do {
-		if (!(node = radix_tree_node_alloc(root)))
+		if (!(node = radix_tree_node_alloc(root->height + 1)))
 			return -ENOMEM;
 
 		/* Increase the height.  */
@@ -145,7 +179,7 @@ static int radix_tree_extend(struct radix_tree_root *root, unsigned long index)
 		}
 #endif
 		node->count = 1;
-		root->rnode = node;
+		rcu_assign_pointer(root->rnode, node);
 		root->height++;
 	} while (height > root->height);
 out:
@@ -184,13 +218,13 @@ int radix_tree_insert(struct radix_tree_root *root,
 	do {
 		if (slot == NULL) {
 			/* Have to add a child node.  */
-			if (!(slot = radix_tree_node_alloc(root)))
+			if (!(slot = radix_tree_node_alloc(height)))
 				return -ENOMEM;
 			if (node) {
-				node->slots[offset] = slot;
+				rcu_assign_pointer(node->slots[offset], slot);
 				node->count++;
 			} else
-				root->rnode = slot;
+				rcu_assign_pointer(root->rnode, slot);
 		}
 
 		/* Go a level down */
@@ -206,7 +240,7 @@ int radix_tree_insert(struct radix_tree_root *root,
 
 	ASSERT(node);
 	node->count++;
-	node->slots[offset] = item;
+	rcu_assign_pointer(node->slots[offset], item);
 #ifdef RADIX_TREE_TAGS
 	ASSERT(!tag_get(node, 0, offset));
 	ASSERT(!tag_get(node, 1, offset));
@@ -218,27 +252,29 @@ static inline void **__lookup_slot(struct radix_tree_root *root,
 				   unsigned long index)
 {
 	unsigned int height, shift;
-	struct radix_tree_node **slot;
+	struct radix_tree_node *node;
+	void **slot;
 
-	height = root->height;
+	node = rcu_dereference(root->rnode);
+	if (node == NULL)
+		return NULL;
+
+	height = node->height;
 	if (index > radix_tree_maxindex(height))
 		return NULL;
 
 	shift = (height-1) * RADIX_TREE_MAP_SHIFT;
-	slot = &root->rnode;
 
-	while (height > 0) {
-		if (*slot == NULL)
-			return NULL;
+	for (;;) {
+		slot = node->slots + ((index >> shift) & RADIX_TREE_MAP_MASK);
+		if (--height == 0)
+			return slot;
 
-		slot = (struct radix_tree_node **)
-			((*slot)->slots +
-				((index >> shift) & RADIX_TREE_MAP_MASK));
+		node = rcu_dereference(*slot);
+		if (node == NULL)
+			return NULL;
 		shift -= RADIX_TREE_MAP_SHIFT;
-		height--;
 	}
-
-	return (void **)slot;
 }
 
 /**
@@ -266,9 +302,13 @@ void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index)
 	void **slot;
 
 	slot = __lookup_slot(root, index);
-	return slot != NULL ? *slot : NULL;
+	return slot != NULL ? rcu_dereference(*slot) : NULL;
 }
 
+static unsigned int __lookup(struct radix_tree_node *slot, void **results,
+		unsigned long index, unsigned int max_items,
+		unsigned long *next_index);
+
 /**
  *	raid_tree_first_key - find the first index key in the radix tree
  *	@root:		radix tree root
@@ -278,34 +318,26 @@ void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index)
  */
 void *radix_tree_lookup_first(struct radix_tree_root *root, unsigned long *index)
 {
-	unsigned int height, shift;
-	struct radix_tree_node *slot;
-	unsigned long i;
+	struct radix_tree_node *node;
+	unsigned long max_index;
+	unsigned long cur_index = 0;
+	unsigned long next_index;
+	void *item;
 
-	height = root->height;
 	*index = 0;
-	if (height == 0)
+	node = rcu_dereference(root->rnode);
+	if (node == NULL)
 		return NULL;
 
-	shift = (height-1) * RADIX_TREE_MAP_SHIFT;
-	slot = root->rnode;
-
-	for (; height > 1; height--) {
-		for (i = 0; i < RADIX_TREE_MAP_SIZE; i++) {
-			if (slot->slots[i] != NULL)
-				break;
-		}
-		ASSERT(i < RADIX_TREE_MAP_SIZE);
-
-		*index |= (i << shift);
-		shift -= RADIX_TREE_MAP_SHIFT;
-		slot = slot->slots[i];
-	}
-	for (i = 0; i < RADIX_TREE_MAP_SIZE; i++) {
-		if (slot->slots[i] != NULL) {
-			*index |= i;
-			return slot->slots[i];
+	max_index = radix_tree_maxindex(node->height);
+	while (cur_index <= max_index) {
+		if (__lookup(node, &item, cur_index, 1, &next_index)) {
+			*index = next_index - 1;
+			return item;
 		}
+		if (next_index == 0)
+			break;
+		cur_index = next_index;
 	}
 	return NULL;
 }
@@ -333,12 +365,15 @@ int radix_tree_tag_get(struct radix_tree_root *root,
 	unsigned int height, shift;
 	struct radix_tree_node *slot;
 
-	height = root->height;
+	slot = rcu_dereference(root->rnode);
+	if (slot == NULL)
+		return 0;
+
+	height = slot->height;
 	if (index > radix_tree_maxindex(height))
 		return 0;
 
 	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
-	slot = root->rnode;
 
 	while (height > 0) {
 		int offset;
@@ -350,8 +385,7 @@ int radix_tree_tag_get(struct radix_tree_root *root,
 		if (!tag_get(slot, tag, offset))
 			return 0;
 
-		slot = slot->slots[offset];
-		ASSERT(slot != NULL);
+		slot = rcu_dereference(slot->slots[offset]);
 		shift -= RADIX_TREE_MAP_SHIFT;
 		height--;
 	}
@@ -463,26 +497,24 @@ out:
 #endif
 
 static unsigned int
-__lookup(struct radix_tree_root *root, void **results, unsigned long index,
+__lookup(struct radix_tree_node *slot, void **results, unsigned long index,
 	unsigned int max_items, unsigned long *next_index)
 {
 	unsigned int nr_found = 0;
 	unsigned int shift, height;
-	struct radix_tree_node *slot;
+	struct radix_tree_node *child = NULL;
+	void *item;
 	unsigned long i;
 
-	height = root->height;
-	if (height == 0)
-		goto out;
-
+	height = slot->height;
 	shift = (height-1) * RADIX_TREE_MAP_SHIFT;
-	slot = root->rnode;
 
 	for ( ; height > 1; height--) {
 
 		for (i = (index >> shift) & RADIX_TREE_MAP_MASK ;
 				i < RADIX_TREE_MAP_SIZE; i++) {
-			if (slot->slots[i] != NULL)
+			child = rcu_dereference(slot->slots[i]);
+			if (child != NULL)
 				break;
 			index &= ~((1UL << shift) - 1);
 			index += 1UL << shift;
@@ -493,14 +525,15 @@ __lookup(struct radix_tree_root *root, void **results, unsigned long index,
 			goto out;
 
 		shift -= RADIX_TREE_MAP_SHIFT;
-		slot = slot->slots[i];
+		slot = child;
 	}
 
 	/* Bottom level: grab some items */
 	for (i = index & RADIX_TREE_MAP_MASK; i < RADIX_TREE_MAP_SIZE; i++) {
 		index++;
-		if (slot->slots[i]) {
-			results[nr_found++] = slot->slots[i];
+		item = rcu_dereference(slot->slots[i]);
+		if (item) {
+			results[nr_found++] = item;
 			if (nr_found == max_items)
 				goto out;
 		}
@@ -527,17 +560,22 @@ unsigned int
 radix_tree_gang_lookup(struct radix_tree_root *root, void **results,
 			unsigned long first_index, unsigned int max_items)
 {
-	const unsigned long max_index = radix_tree_maxindex(root->height);
+	struct radix_tree_node *node = rcu_dereference(root->rnode);
+	unsigned long max_index;
 	unsigned long cur_index = first_index;
 	unsigned int ret = 0;
 
+	if (node == NULL)
+		return 0;
+	max_index = radix_tree_maxindex(node->height);
+
 	while (ret < max_items) {
 		unsigned int nr_found;
 		unsigned long next_index;	/* Index of next search */
 
 		if (cur_index > max_index)
 			break;
-		nr_found = __lookup(root, results + ret, cur_index,
+		nr_found = __lookup(node, results + ret, cur_index,
 					max_items - ret, &next_index);
 		ret += nr_found;
 		if (next_index == 0)
@@ -567,17 +605,22 @@ radix_tree_gang_lookup_ex(struct radix_tree_root *root, void **results,
 			unsigned long first_index, unsigned long last_index,
 			unsigned int max_items)
 {
-	const unsigned long max_index = radix_tree_maxindex(root->height);
+	struct radix_tree_node *node = rcu_dereference(root->rnode);
+	unsigned long max_index;
 	unsigned long cur_index = first_index;
 	unsigned int ret = 0;
 
+	if (node == NULL)
+		return 0;
+	max_index = radix_tree_maxindex(node->height);
+
 	while (ret < max_items && cur_index < last_index) {
 		unsigned int nr_found;
 		unsigned long next_index;	/* Index of next search */
 
 		if (cur_index > max_index)
 			break;
-		nr_found = __lookup(root, results + ret, cur_index,
+		nr_found = __lookup(node, results + ret, cur_index,
 					max_items - ret, &next_index);
 		ret += nr_found;
 		if (next_index == 0)
@@ -590,24 +633,26 @@ radix_tree_gang_lookup_ex(struct radix_tree_root *root, void **results,
 #ifdef RADIX_TREE_TAGS
 
 static unsigned int
-__lookup_tag(struct radix_tree_root *root, void **results, unsigned long index,
+__lookup_tag(struct radix_tree_node *slot, void **results, unsigned long index,
 	unsigned int max_items, unsigned long *next_index, unsigned int tag)
 {
 	unsigned int nr_found = 0;
 	unsigned int shift;
-	unsigned int height = root->height;
-	struct radix_tree_node *slot;
+	unsigned int height = slot->height;
+	struct radix_tree_node *child = NULL;
+	void *item;
 
 	shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
-	slot = root->rnode;
 
 	while (height > 0) {
 		unsigned long i = (index >> shift) & RADIX_TREE_MAP_MASK;
 
 		for ( ; i < RADIX_TREE_MAP_SIZE; i++) {
+			/* Tags can outlive a slot deleted under us. */
 			if (tag_get(slot, tag, i)) {
-				ASSERT(slot->slots[i] != NULL);
-				break;
+				child = rcu_dereference(slot->slots[i]);
+				if (child != NULL)
+					break;
 			}
 			index &= ~((1UL << shift) - 1);
 			index += 1UL << shift;
@@ -622,16 +667,18 @@ __lookup_tag(struct radix_tree_root *root, void **results, unsigned long index,
 
 			for ( ; j < RADIX_TREE_MAP_SIZE; j++) {
 				index++;
-				if (tag_get(slot, tag, j)) {
-					ASSERT(slot->slots[j] != NULL);
-					results[nr_found++] = slot->slots[j];
-					if (nr_found == max_items)
-						goto out;
-				}
+				if (!tag_get(slot, tag, j))
+					continue;
+				item = rcu_dereference(slot->slots[j]);
+				if (item == NULL)
+					continue;
+				results[nr_found++] = item;
+				if (nr_found == max_items)
+					goto out;
 			}
 		}
 		shift -= RADIX_TREE_MAP_SHIFT;
-		slot = slot->slots[i];
+		slot = child;
 	}
 out:
 	*next_index = index;
@@ -656,17 +703,22 @@ radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results,
 		unsigned long first_index, unsigned int max_items,
 		unsigned int tag)
 {
-	const unsigned long max_index = radix_tree_maxindex(root->height);
+	struct radix_tree_node *node = rcu_dereference(root->rnode);
+	unsigned long max_index;
 	unsigned long cur_index = first_index;
 	unsigned int ret = 0;
 
+	if (node == NULL)
+		return 0;
+	max_index = radix_tree_maxindex(node->height);
+
 	while (ret < max_items) {
 		unsigned int nr_found;
 		unsigned long next_index;	/* Index of next search */
 
 		if (cur_index > max_index)
 			break;
-		nr_found = __lookup_tag(root, results + ret, cur_index,
+		nr_found = __lookup_tag(node, results + ret, cur_index,
 					max_items - ret, &next_index, tag);
 		ret += nr_found;
 		if (next_index == 0)
@@ -690,15 +742,12 @@ static inline void radix_tree_shrink(struct radix_tree_root *root)
 			root->rnode->slots[0]) {
 		struct radix_tree_node *to_free = root->rnode;
 
-		root->rnode = to_free->slots[0];
+		rcu_assign_pointer(root->rnode, to_free->slots[0]);
 		root->height--;
-		/* must only free zeroed nodes into the slab */
-#ifdef RADIX_TREE_TAGS
-		tag_clear(to_free, 0, 0);
-		tag_clear(to_free, 1, 0);
-#endif
-		to_free->slots[0] = NULL;
-		to_free->count = 0;
+		/*
+		 * Leave the old root's slot alone, readers that started at
+		 * it can still walk down through it until it's freed.
+		 */
 		radix_tree_node_free(to_free);
 	}
 }
@@ -783,7 +832,7 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 #endif
 	/* Now free the nodes we do not need anymore */
 	for (pathp = orig_pathp; pathp->node; pathp--) {
-		pathp->node->slots[pathp->offset] = NULL;
+		rcu_assign_pointer(pathp->node->slots[pathp->offset], NULL);
 		pathp->node->count--;
 
 		if (pathp->node->count) {
@@ -795,7 +844,7 @@ void *radix_tree_delete(struct radix_tree_root *root, unsigned long index)
 		/* Node with zero slots in use so free it */
 		radix_tree_node_free(pathp->node);
 	}
-	root->rnode = NULL;
+	rcu_assign_pointer(root->rnode, NULL);
 	root->height = 0;
 out:
 	return ret;
@@ -810,7 +859,7 @@ out:
 int radix_tree_tagged(struct radix_tree_root *root, unsigned int tag)
 {
 	struct radix_tree_node *rnode;
-	rnode = root->rnode;
+	rnode = rcu_dereference(root->rnode);
 	if (!rnode)
 		return 0;
 	return any_tag_set(rnode, tag);
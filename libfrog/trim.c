@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "platform_defs.h"
+#include "xfs.h"
+#include "fsgeom.h"
+#include "workqueue.h"
+#include "trim.h"
+
+/*
+ * Parallel Free Space Trimming
+ *
+ * A single FITRIM call over the whole filesystem walks the AGs one after
+ * another, and holds each AGF locked while it discards every free extent in
+ * that AG.  Instead, we hand each AG to a workqueue thread, and each thread
+ * trims its AG a segment at a time so that the AGF lock is dropped between
+ * calls.  If a rate limit is set, each thread sleeps after each call until
+ * the bytes discarded so far fit in the budget.
+ */
+
+/* Trim this much of an AG's address space per FITRIM call. */
+#define XFROG_TRIM_SEGMENT	(1ULL << 30)
+
+#ifndef FITRIM
+struct fstrim_range {
+	__u64 start;
+	__u64 len;
+	__u64 minlen;
+};
+#define FITRIM		_IOWR('X', 121, struct fstrim_range)	/* Trim */
+#endif
+
+struct trim_ctl {
+	struct xfs_fd		*xfd;
+	struct xfrog_trim	*trim;
+	uint64_t		end;
+	pthread_mutex_t		lock;
+
+	/* When the rate limit lets the next discard start. */
+	uint64_t		next_ns;
+
+	int			error;
+};
+
+static uint64_t
+trim_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Account for bytes discarded and sleep if we're over the rate limit. */
+static void
+trim_account(
+	struct trim_ctl		*tc,
+	uint64_t		trimmed)
+{
+	struct timespec		ts;
+	uint64_t		now = 0;
+	uint64_t		wait = 0;
+
+	pthread_mutex_lock(&tc->lock);
+	tc->trim->trimmed += trimmed;
+	if (tc->trim->rate) {
+		now = trim_now();
+		if (tc->next_ns < now)
+			tc->next_ns = now;
+		tc->next_ns += trimmed * NSEC_PER_SEC / tc->trim->rate;
+		wait = tc->next_ns - now;
+	}
+	pthread_mutex_unlock(&tc->lock);
+
+	if (!wait)
+		return;
+	ts.tv_sec = wait / NSEC_PER_SEC;
+	ts.tv_nsec = wait % NSEC_PER_SEC;
+	nanosleep(&ts, NULL);
+}
+
+static void
+trim_set_error(
+	struct trim_ctl		*tc,
+	int			error)
+{
+	pthread_mutex_lock(&tc->lock);
+	if (!tc->error)
+		tc->error = error;
+	pthread_mutex_unlock(&tc->lock);
+}
+
+/* Trim the part of the requested range that falls in one AG. */
+static void
+trim_ag(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct trim_ctl		*tc = arg;
+	struct xfs_fd		*xfd = tc->xfd;
+	uint64_t		pos = cvt_agbno_to_b(xfd, agno, 0);
+	uint64_t		end = pos + cvt_off_fsb_to_b(xfd,
+						xfd->fsgeom.agblocks);
+
+	pos = max(pos, tc->trim->start);
+	end = min(end, tc->end);
+
+	while (pos < end && !__atomic_load_n(&tc->error, __ATOMIC_RELAXED)) {
+		struct fstrim_range	range = {
+			.start		= pos,
+			.len		= min(end - pos, XFROG_TRIM_SEGMENT),
+			.minlen		= tc->trim->minlen,
+		};
+
+		pos += range.len;
+		if (ioctl(xfd->fd, FITRIM, &range)) {
+			trim_set_error(tc, -errno);
+			return;
+		}
+		trim_account(tc, range.len);
+	}
+}
+
+/*
+ * Discard the free space in a byte range of the data device, one AG per
+ * thread.  Returns zero or a negative error code; the number of bytes
+ * discarded is returned in @trim->trimmed.
+ */
+int
+xfrog_trim(
+	struct xfs_fd		*xfd,
+	struct xfrog_trim	*trim)
+{
+	struct trim_ctl		tc = {
+		.xfd		= xfd,
+		.trim		= trim,
+	};
+	struct workqueue	wq;
+	struct workqueue_work	*work;
+	uint64_t		agbytes;
+	uint64_t		end;
+	unsigned int		nr_ags;
+	xfs_agnumber_t		agno;
+	xfs_agnumber_t		first_ag, last_ag;
+	int			ret;
+
+	trim->trimmed = 0;
+	end = cvt_off_fsb_to_b(xfd, xfd->fsgeom.datablocks);
+	if (trim->len == 0 || trim->start >= end)
+		return 0;
+	if (trim->len < end - trim->start)
+		end = trim->start + trim->len;
+	tc.end = end;
+
+	agbytes = cvt_off_fsb_to_b(xfd, xfd->fsgeom.agblocks);
+	first_ag = trim->start / agbytes;
+	last_ag = (end - 1) / agbytes;
+	nr_ags = last_ag - first_ag + 1;
+
+	work = calloc(nr_ags, sizeof(struct workqueue_work));
+	if (!work)
+		return -errno;
+	for (agno = first_ag; agno <= last_ag; agno++) {
+		work[agno - first_ag].function = trim_ag;
+		work[agno - first_ag].index = agno;
+		work[agno - first_ag].arg = &tc;
+	}
+
+	ret = -pthread_mutex_init(&tc.lock, NULL);
+	if (ret)
+		goto out_work;
+
+	ret = workqueue_create(&wq, NULL, min(trim->nr_threads, nr_ags));
+	if (ret)
+		goto out_lock;
+
+	ret = workqueue_add_batch(&wq, work, nr_ags);
+	if (ret)
+		trim_set_error(&tc, ret);
+
+	ret = workqueue_terminate(&wq);
+	if (ret)
+		trim_set_error(&tc, ret);
+	workqueue_destroy(&wq);
+	ret = tc.error;
+
+out_lock:
+	pthread_mutex_destroy(&tc.lock);
+out_work:
+	free(work);
+	return ret;
+}
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __LIBFROG_TRIM_H__
+#define __LIBFROG_TRIM_H__
+
+struct xfrog_trim {
+	/* Byte range of the data device to trim. */
+	uint64_t		start;
+	uint64_t		len;
+
+	/* Skip free extents shorter than this many bytes. */
+	uint64_t		minlen;
+
+	/* Discard at most this many bytes per second, or zero for no limit. */
+	uint64_t		rate;
+
+	/* Trim this many AGs at once; zero means trim them all in the caller. */
+	unsigned int		nr_threads;
+
+	/* Bytes that were actually discarded. */
+	uint64_t		trimmed;
+};
+
+int xfrog_trim(struct xfs_fd *xfd, struct xfrog_trim *trim);
+
+#endif /* __LIBFROG_TRIM_H__ */
@@ -13,98 +13,695 @@
 #include <assert.h>
 #include <urcu.h>
 #include "workqueue.h"
+#include "cpumap.h"
+
+/*
+ * Each worker thread owns a Chase-Lev work stealing deque.  Work that a
+ * worker queues (e.g. a directory scan queueing its subdirectories) goes on
+ * the bottom of its own deque without taking any locks, and the worker pops
+ * work off the bottom again.  Idle workers steal from the top of the other
+ * workers' deques.  Work queued by threads outside the pool goes on the old
+ * locked list, which workers check before they try to steal.
+ *
+ * See "Correct and Efficient Work-Stealing for Weak Memory Models" by Lê,
+ * Pop, Cohen and Zappa Nardelli (PPoPP 2013) for the memory ordering.
+ */
+
+#define WORKQUEUE_DEQUE_MIN	64
+
+struct workqueue_ring {
+	struct workqueue_ring	*prev;		/* older, smaller rings */
+	long			mask;
+	struct workqueue_item	*items[];
+};
+
+struct workqueue_worker {
+	struct workqueue	*wq;
+	pthread_t		thread;
+	unsigned int		node;
+	bool			pinned;
+	cpu_set_t		cpus;		/* if pinned */
+	struct workqueue_ring	*ring;
+	long			top;
+	long			bottom;
+	unsigned int		rnd;		/* victim selection */
+
+	/* items freed by this worker, which it can reuse without locking */
+	struct workqueue_item	*free_items;
+	unsigned int		nr_free;
+};
+
+/*
+ * Work items are carved out of slabs and recycled through free lists instead
+ * of being malloc'd and freed one at a time.  Each worker keeps the items it
+ * has finished with, and hands a slab's worth back to the shared pool when it
+ * has too many.  The slabs are only freed when the workqueue is destroyed.
+ */
+#define WORKQUEUE_SLAB_ITEMS	64
+
+struct workqueue_slab {
+	struct workqueue_slab	*next;
+	struct workqueue_item	items[WORKQUEUE_SLAB_ITEMS];
+};
+
+/*
+ * Workers can be grouped by NUMA node.  Work can be queued for a particular
+ * node, in which case a worker from that node will be woken up to run it.
+ * Each node has its own condition variable so that we only wake workers on
+ * the node we queued work for.  A workqueue without affinity has one node.
+ */
+struct workqueue_node {
+	struct workqueue_item	*next_item;
+	struct workqueue_item	*last_item;
+	pthread_cond_t		wakeup;
+	unsigned int		nr_sleepers;
+	unsigned int		nr_workers;
+};
+
+/* The worker that the current thread is, if any. */
+static __thread struct workqueue_worker	*workqueue_self;
+
+static struct workqueue_ring *
+workqueue_ring_alloc(
+	long			size)
+{
+	struct workqueue_ring	*ring;
+
+	ring = malloc(sizeof(*ring) + size * sizeof(struct workqueue_item *));
+	if (!ring)
+		return NULL;
+	ring->prev = NULL;
+	ring->mask = size - 1;
+	return ring;
+}
+
+/*
+ * Double the size of a worker's ring.  Thieves may still be reading the old
+ * ring, so we keep it around until the workqueue is destroyed.
+ */
+static struct workqueue_ring *
+workqueue_ring_grow(
+	struct workqueue_worker	*w,
+	struct workqueue_ring	*old,
+	long			top,
+	long			bottom)
+{
+	struct workqueue_ring	*ring;
+	long			i;
+
+	ring = workqueue_ring_alloc(2 * (old->mask + 1));
+	if (!ring)
+		return NULL;
+	for (i = top; i < bottom; i++)
+		ring->items[i & ring->mask] = old->items[i & old->mask];
+	ring->prev = old;
+	__atomic_store_n(&w->ring, ring, __ATOMIC_RELEASE);
+	return ring;
+}
+
+/* Push an item onto the bottom of our own deque. */
+static int
+workqueue_deque_push(
+	struct workqueue_worker	*w,
+	struct workqueue_item	*wi)
+{
+	struct workqueue_ring	*ring;
+	long			b, t;
+
+	b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	ring = __atomic_load_n(&w->ring, __ATOMIC_RELAXED);
+	if (b - t > ring->mask) {
+		ring = workqueue_ring_grow(w, ring, t, b);
+		if (!ring)
+			return -ENOMEM;
+	}
+	__atomic_store_n(&ring->items[b & ring->mask], wi, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Pop an item off the bottom of our own deque. */
+static struct workqueue_item *
+workqueue_deque_take(
+	struct workqueue_worker	*w)
+{
+	struct workqueue_ring	*ring;
+	struct workqueue_item	*wi = NULL;
+	long			b, t;
+
+	b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	ring = __atomic_load_n(&w->ring, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+	if (t <= b) {
+		wi = __atomic_load_n(&ring->items[b & ring->mask],
+				__ATOMIC_RELAXED);
+		if (t == b) {
+			/* Last item; race the thieves for it. */
+			if (!__atomic_compare_exchange_n(&w->top, &t, t + 1,
+					false, __ATOMIC_SEQ_CST,
+					__ATOMIC_RELAXED))
+				wi = NULL;
+			__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return wi;
+}
+
+/* Steal an item off the top of someone else's deque. */
+static struct workqueue_item *
+workqueue_deque_steal(
+	struct workqueue_worker	*w)
+{
+	struct workqueue_ring	*ring;
+	struct workqueue_item	*wi;
+	long			b, t;
+
+	t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+
+	ring = __atomic_load_n(&w->ring, __ATOMIC_ACQUIRE);
+	wi = __atomic_load_n(&ring->items[t & ring->mask], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return wi;
+}
+
+static inline bool
+workqueue_deque_empty(
+	struct workqueue_worker	*w)
+{
+	return __atomic_load_n(&w->top, __ATOMIC_SEQ_CST) >=
+	       __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+}
+
+/* Take the workqueue lock, counting the times we had to wait for it. */
+static inline void
+workqueue_lock(
+	struct workqueue	*wq)
+{
+	if (pthread_mutex_trylock(&wq->lock) == 0)
+		return;
+	__atomic_add_fetch(&wq->nr_contended, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&wq->lock);
+}
+
+/* Get an item from the shared pool.  Caller must hold the lock. */
+static struct workqueue_item *
+workqueue_item_get_locked(
+	struct workqueue	*wq)
+{
+	struct workqueue_item	*wi;
+
+	if (!wq->free_items) {
+		struct workqueue_slab	*slab;
+		unsigned int		i;
+
+		slab = malloc(sizeof(struct workqueue_slab));
+		if (!slab)
+			return NULL;
+		slab->next = wq->slabs;
+		wq->slabs = slab;
+		for (i = 0; i < WORKQUEUE_SLAB_ITEMS; i++) {
+			slab->items[i].next = wq->free_items;
+			wq->free_items = &slab->items[i];
+		}
+	}
+
+	wi = wq->free_items;
+	wq->free_items = wi->next;
+	return wi;
+}
+
+/* Give a chain of items back to the shared pool.  Caller must hold the lock. */
+static void
+workqueue_item_put_locked(
+	struct workqueue	*wq,
+	struct workqueue_item	*first,
+	struct workqueue_item	*last)
+{
+	last->next = wq->free_items;
+	wq->free_items = first;
+}
+
+/* Get an item for a worker, refilling its free list from the pool. */
+static struct workqueue_item *
+workqueue_item_get_worker(
+	struct workqueue_worker	*w)
+{
+	struct workqueue	*wq = w->wq;
+	struct workqueue_item	*wi;
+
+	if (!w->free_items) {
+		unsigned int	i;
+
+		workqueue_lock(wq);
+		for (i = 0; i < WORKQUEUE_SLAB_ITEMS; i++) {
+			wi = workqueue_item_get_locked(wq);
+			if (!wi)
+				break;
+			wi->next = w->free_items;
+			w->free_items = wi;
+			w->nr_free++;
+		}
+		pthread_mutex_unlock(&wq->lock);
+		if (!w->free_items)
+			return NULL;
+	}
+
+	wi = w->free_items;
+	w->free_items = wi->next;
+	w->nr_free--;
+	return wi;
+}
+
+/* A worker is done with an item. */
+static void
+workqueue_item_put_worker(
+	struct workqueue_worker	*w,
+	struct workqueue_item	*wi)
+{
+	struct workqueue_item	*first, *last;
+	unsigned int		i;
+
+	wi->next = w->free_items;
+	w->free_items = wi;
+	if (++w->nr_free < 2 * WORKQUEUE_SLAB_ITEMS)
+		return;
+
+	first = last = w->free_items;
+	for (i = 1; i < WORKQUEUE_SLAB_ITEMS; i++)
+		last = last->next;
+	w->free_items = last->next;
+	w->nr_free -= WORKQUEUE_SLAB_ITEMS;
+
+	workqueue_lock(w->wq);
+	workqueue_item_put_locked(w->wq, first, last);
+	pthread_mutex_unlock(&w->wq->lock);
+}
+
+/*
+ * Wake up sleeping workers to run @nr new items, preferably on @node.  Pass
+ * a negative @node for work that anyone can run.  Caller must hold the lock.
+ */
+static int
+workqueue_wake_locked(
+	struct workqueue	*wq,
+	int			node,
+	unsigned int		nr)
+{
+	unsigned int		i;
+	int			ret = 0;
+
+	if (node >= 0) {
+		struct workqueue_node	*wn = &wq->nodes[node];
+
+		if (!wn->nr_sleepers)
+			return 0;
+		if (nr > 1)
+			return -pthread_cond_broadcast(&wn->wakeup);
+		return -pthread_cond_signal(&wn->wakeup);
+	}
+
+	for (i = 0; i < wq->nr_nodes; i++) {
+		struct workqueue_node	*wn = &wq->nodes[i];
+
+		if (!wn->nr_sleepers)
+			continue;
+		if (nr == 1)
+			return -pthread_cond_signal(&wn->wakeup);
+		ret = -pthread_cond_broadcast(&wn->wakeup);
+		if (ret)
+			break;
+	}
+	return ret;
+}
+
+/* Wake up sleeping workers, if there are any, to run @nr new items. */
+static void
+workqueue_wake(
+	struct workqueue	*wq,
+	unsigned int		nr)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&wq->nr_sleepers, __ATOMIC_SEQ_CST))
+		return;
+
+	workqueue_lock(wq);
+	workqueue_wake_locked(wq, -1, nr);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* An item has been pulled off a queue; let throttled producers know. */
+static void
+workqueue_dequeued(
+	struct workqueue	*wq)
+{
+	__atomic_sub_fetch(&wq->item_count, 1, __ATOMIC_SEQ_CST);
+	if (!wq->max_queued ||
+	    !__atomic_load_n(&wq->nr_full_waiters, __ATOMIC_SEQ_CST))
+		return;
+
+	workqueue_lock(wq);
+	pthread_cond_broadcast(&wq->queue_full);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* Pull an item off our node's list or the shared list. */
+static struct workqueue_item *
+workqueue_list_take(
+	struct workqueue_worker	*self)
+{
+	struct workqueue	*wq = self->wq;
+	struct workqueue_node	*wn = &wq->nodes[self->node];
+	struct workqueue_item	*wi;
+
+	if (!__atomic_load_n(&wn->next_item, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&wq->next_item, __ATOMIC_RELAXED))
+		return NULL;
+
+	workqueue_lock(wq);
+	wi = wn->next_item;
+	if (wi) {
+		wn->next_item = wi->next;
+	} else {
+		wi = wq->next_item;
+		if (wi)
+			wq->next_item = wi->next;
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return wi;
+}
+
+/*
+ * Take work queued for another node.  We only get here if we've run out of
+ * everything else, so it's better to run it remotely than to sit idle.
+ */
+static struct workqueue_item *
+workqueue_list_take_remote(
+	struct workqueue_worker	*self)
+{
+	struct workqueue	*wq = self->wq;
+	struct workqueue_item	*wi = NULL;
+	unsigned int		i;
+
+	if (wq->nr_nodes < 2)
+		return NULL;
+
+	workqueue_lock(wq);
+	for (i = 0; i < wq->nr_nodes; i++) {
+		struct workqueue_node	*wn = &wq->nodes[i];
+
+		wi = wn->next_item;
+		if (wi) {
+			wn->next_item = wi->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return wi;
+}
+
+/* Try to steal from every other worker, starting at a random one. */
+static struct workqueue_item *
+workqueue_steal(
+	struct workqueue_worker	*self)
+{
+	struct workqueue	*wq = self->wq;
+	struct workqueue_item	*wi;
+	unsigned int		start, i;
+
+	if (wq->thread_count < 2)
+		return NULL;
+
+	self->rnd ^= self->rnd << 13;
+	self->rnd ^= self->rnd >> 17;
+	self->rnd ^= self->rnd << 5;
+	start = self->rnd % wq->thread_count;
+
+	for (i = 0; i < wq->thread_count; i++) {
+		struct workqueue_worker	*victim;
+
+		victim = &wq->workers[(start + i) % wq->thread_count];
+		if (victim == self)
+			continue;
+		wi = workqueue_deque_steal(victim);
+		if (wi) {
+			__atomic_add_fetch(&wq->nr_steals, 1,
+					__ATOMIC_RELAXED);
+			return wi;
+		}
+	}
+	return NULL;
+}
+
+/* Is there any work queued anywhere?  Caller must hold the lock. */
+static bool
+workqueue_idle(
+	struct workqueue	*wq)
+{
+	unsigned int		i;
+
+	if (wq->next_item)
+		return false;
+	for (i = 0; i < wq->nr_nodes; i++)
+		if (wq->nodes[i].next_item)
+			return false;
+	for (i = 0; i < wq->thread_count; i++)
+		if (!workqueue_deque_empty(&wq->workers[i]))
+			return false;
+	return true;
+}
 
 /* Main processing thread */
 static void *
 workqueue_thread(void *arg)
 {
-	struct workqueue	*wq = arg;
+	struct workqueue_worker	*self = arg;
+	struct workqueue	*wq = self->wq;
+	struct workqueue_node	*wn = &wq->nodes[self->node];
 	struct workqueue_item	*wi;
 
+	/* Failing to pin ourselves only costs performance, so ignore it. */
+	if (self->pinned)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				&self->cpus);
+
 	/*
-	 * Loop pulling work from the passed in work queue.
-	 * Check for notification to exit after every chunk of work.
+	 * Loop pulling work from our own deque, then our node's list and the
+	 * shared list, then the other workers, then the other nodes.  Go to
+	 * sleep when there's nothing anywhere, and exit if we've been told to.
 	 */
 	rcu_register_thread();
+	workqueue_self = self;
 	while (1) {
-		pthread_mutex_lock(&wq->lock);
+		wi = workqueue_deque_take(self);
+		if (!wi)
+			wi = workqueue_list_take(self);
+		if (!wi)
+			wi = workqueue_steal(self);
+		if (!wi)
+			wi = workqueue_list_take_remote(self);
+		if (wi) {
+			workqueue_dequeued(wq);
+			(wi->function)(wi->queue, wi->index, wi->arg);
+			workqueue_item_put_worker(self, wi);
+			continue;
+		}
 
 		/*
-		 * Wait for work.
+		 * Advertise that we're about to sleep before looking at the
+		 * queues one last time, so that anyone queueing work after
+		 * our check is guaranteed to see us and send a wakeup.
 		 */
-		while (wq->next_item == NULL && !wq->terminate) {
-			assert(wq->item_count == 0);
-			pthread_cond_wait(&wq->wakeup, &wq->lock);
+		workqueue_lock(wq);
+		__atomic_add_fetch(&wq->nr_sleepers, 1, __ATOMIC_SEQ_CST);
+		wn->nr_sleepers++;
+		if (workqueue_idle(wq)) {
+			if (wq->terminate) {
+				wn->nr_sleepers--;
+				__atomic_sub_fetch(&wq->nr_sleepers, 1,
+						__ATOMIC_SEQ_CST);
+				pthread_mutex_unlock(&wq->lock);
+				break;
+			}
+			pthread_cond_wait(&wn->wakeup, &wq->lock);
 		}
-		if (wq->next_item == NULL && wq->terminate) {
-			pthread_mutex_unlock(&wq->lock);
-			break;
+		wn->nr_sleepers--;
+		__atomic_sub_fetch(&wq->nr_sleepers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&wq->lock);
+	}
+	workqueue_self = NULL;
+	rcu_unregister_thread();
+
+	return NULL;
+}
+
+static void
+workqueue_free_workers(
+	struct workqueue	*wq,
+	unsigned int		nr)
+{
+	unsigned int		i;
+
+	for (i = 0; i < nr; i++) {
+		struct workqueue_ring	*ring = wq->workers[i].ring;
+
+		while (ring) {
+			struct workqueue_ring	*prev = ring->prev;
+
+			free(ring);
+			ring = prev;
 		}
+	}
+	free(wq->workers);
+	wq->workers = NULL;
+}
 
-		/*
-		 *  Dequeue work from the head of the list. If the queue was
-		 *  full then send a wakeup if we're configured to do so.
-		 */
-		assert(wq->item_count > 0);
-		if (wq->max_queued)
-			pthread_cond_broadcast(&wq->queue_full);
+static void
+workqueue_free_nodes(
+	struct workqueue	*wq,
+	unsigned int		nr)
+{
+	unsigned int		i;
 
-		wi = wq->next_item;
-		wq->next_item = wi->next;
-		wq->item_count--;
+	for (i = 0; i < nr; i++)
+		pthread_cond_destroy(&wq->nodes[i].wakeup);
+	free(wq->nodes);
+	wq->nodes = NULL;
+	wq->nr_nodes = 0;
+}
 
-		if (wq->max_queued && wq->next_item) {
-			/* more work, wake up another worker */
-			pthread_cond_signal(&wq->wakeup);
+/*
+ * Decide where each worker runs.  Workers are dealt out round robin across
+ * the NUMA nodes, and either confined to their node or pinned to a CPU.
+ * If we can't figure out the topology, we don't pin anything.
+ */
+static int
+workqueue_setup_affinity(
+	struct workqueue		*wq,
+	unsigned int			nr_workers,
+	enum workqueue_affinity		affinity)
+{
+	struct cpumap			map = { .nr_nodes = 1 };
+	unsigned int			i;
+	int				err;
+
+	if (affinity != WQ_AFFINITY_NONE && nr_workers > 0 &&
+	    cpumap_init(&map) != 0) {
+		affinity = WQ_AFFINITY_NONE;
+		map.nr_nodes = 1;
+	}
+
+	wq->nodes = calloc(map.nr_nodes, sizeof(struct workqueue_node));
+	if (!wq->nodes) {
+		err = -errno;
+		goto out_map;
+	}
+	for (i = 0; i < map.nr_nodes; i++) {
+		err = -pthread_cond_init(&wq->nodes[i].wakeup, NULL);
+		if (err) {
+			workqueue_free_nodes(wq, i);
+			goto out_map;
 		}
-		pthread_mutex_unlock(&wq->lock);
+	}
+	wq->nr_nodes = map.nr_nodes;
 
-		(wi->function)(wi->queue, wi->index, wi->arg);
-		free(wi);
+	for (i = 0; i < nr_workers; i++) {
+		struct workqueue_worker	*w = &wq->workers[i];
+
+		switch (affinity) {
+		case WQ_AFFINITY_NONE:
+			w->node = 0;
+			break;
+		case WQ_AFFINITY_NODE:
+			w->node = i % map.nr_nodes;
+			cpumap_node_cpuset(&map, w->node, &w->cpus);
+			w->pinned = true;
+			break;
+		case WQ_AFFINITY_CPU:
+			w->node = map.cpu_node[i % map.nr_cpus];
+			CPU_ZERO(&w->cpus);
+			CPU_SET(map.cpus[i % map.nr_cpus], &w->cpus);
+			w->pinned = true;
+			break;
+		}
+		wq->nodes[w->node].nr_workers++;
 	}
-	rcu_unregister_thread();
+	err = 0;
 
-	return NULL;
+out_map:
+	if (affinity != WQ_AFFINITY_NONE)
+		cpumap_free(&map);
+	return err;
 }
 
-/* Allocate a work queue and threads.  Returns zero or negative error code. */
+/*
+ * Allocate a work queue and threads, optionally tying the threads to NUMA
+ * nodes or CPUs.  Returns zero or negative error code.
+ */
 int
-workqueue_create_bound(
+workqueue_create_affine(
 	struct workqueue	*wq,
 	void			*wq_ctx,
 	unsigned int		nr_workers,
-	unsigned int		max_queue)
+	unsigned int		max_queue,
+	enum workqueue_affinity	affinity)
 {
 	unsigned int		i;
 	int			err = 0;
 
 	memset(wq, 0, sizeof(*wq));
-	err = -pthread_cond_init(&wq->wakeup, NULL);
-	if (err)
-		return err;
 	err = -pthread_cond_init(&wq->queue_full, NULL);
 	if (err)
-		goto out_wake;
+		return err;
 	err = -pthread_mutex_init(&wq->lock, NULL);
 	if (err)
 		goto out_cond;
 
 	wq->wq_ctx = wq_ctx;
-	wq->thread_count = nr_workers;
 	wq->max_queued = max_queue;
-	wq->threads = malloc(nr_workers * sizeof(pthread_t));
-	if (!wq->threads) {
+	wq->workers = calloc(nr_workers, sizeof(struct workqueue_worker));
+	if (!wq->workers && nr_workers) {
 		err = -errno;
 		goto out_mutex;
 	}
+	for (i = 0; i < nr_workers; i++) {
+		struct workqueue_worker	*w = &wq->workers[i];
+
+		w->wq = wq;
+		w->rnd = 2654435761U * (i + 1);
+		w->ring = workqueue_ring_alloc(WORKQUEUE_DEQUE_MIN);
+		if (!w->ring) {
+			err = -errno;
+			workqueue_free_workers(wq, i);
+			goto out_mutex;
+		}
+	}
+	err = workqueue_setup_affinity(wq, nr_workers, affinity);
+	if (err) {
+		workqueue_free_workers(wq, nr_workers);
+		goto out_mutex;
+	}
 	wq->terminate = false;
 	wq->terminated = false;
 
 	for (i = 0; i < nr_workers; i++) {
-		err = -pthread_create(&wq->threads[i], NULL, workqueue_thread,
-				wq);
+		err = -pthread_create(&wq->workers[i].thread, NULL,
+				workqueue_thread, &wq->workers[i]);
 		if (err)
 			break;
+		wq->thread_count++;
 	}
 
 	/*
@@ -112,18 +709,31 @@ workqueue_create_bound(
 	 * the threads that may have been started running before we can destroy
 	 * the workqueue.
 	 */
-	if (err)
+	if (err) {
+		workqueue_terminate(wq);
+		workqueue_free_workers(wq, nr_workers);
 		workqueue_destroy(wq);
+	}
 	return err;
 out_mutex:
 	pthread_mutex_destroy(&wq->lock);
 out_cond:
 	pthread_cond_destroy(&wq->queue_full);
-out_wake:
-	pthread_cond_destroy(&wq->wakeup);
 	return err;
 }
 
+/* Allocate a work queue and threads.  Returns zero or negative error code. */
+int
+workqueue_create_bound(
+	struct workqueue	*wq,
+	void			*wq_ctx,
+	unsigned int		nr_workers,
+	unsigned int		max_queue)
+{
+	return workqueue_create_affine(wq, wq_ctx, nr_workers, max_queue,
+			WQ_AFFINITY_NONE);
+}
+
 int
 workqueue_create(
 	struct workqueue	*wq,
@@ -133,68 +743,182 @@ workqueue_create(
 	return workqueue_create_bound(wq, wq_ctx, nr_workers, 0);
 }
 
+/* Queue a batch of work from one of our own workers onto its deque. */
+static int
+workqueue_add_worker(
+	struct workqueue_worker		*self,
+	const struct workqueue_work	*work,
+	unsigned int			nr)
+{
+	struct workqueue		*wq = self->wq;
+	unsigned int			i;
+	int				ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct workqueue_item	*wi;
+
+		wi = workqueue_item_get_worker(self);
+		if (!wi) {
+			ret = -ENOMEM;
+			break;
+		}
+		wi->function = work[i].function;
+		wi->index = work[i].index;
+		wi->arg = work[i].arg;
+		wi->queue = wq;
+		wi->next = NULL;
+
+		__atomic_add_fetch(&wq->item_count, 1, __ATOMIC_SEQ_CST);
+		ret = workqueue_deque_push(self, wi);
+		if (ret) {
+			__atomic_sub_fetch(&wq->item_count, 1,
+					__ATOMIC_SEQ_CST);
+			workqueue_item_put_worker(self, wi);
+			break;
+		}
+	}
+
+	if (i)
+		workqueue_wake(wq, i);
+	return ret;
+}
+
 /*
- * Create a work item consisting of a function and some arguments and schedule
- * the work item to be run via the thread pool.  Returns zero or a negative
- * error code.
+ * Queue an array of work items to be run on NUMA node @node and publish them
+ * to the workers in one go.  If @node is negative or has no workers, any
+ * worker can run them.  Returns zero or a negative error code.  If a worker
+ * of this queue runs out of memory partway through, the items before the
+ * failure will still run.
+ *
+ * A bounded queue waits until it has room for another item before queueing
+ * the whole batch, so a large batch can briefly overfill it.
  */
 int
-workqueue_add(
-	struct workqueue	*wq,
-	workqueue_func_t	func,
-	uint32_t		index,
-	void			*arg)
+workqueue_add_batch_node(
+	struct workqueue		*wq,
+	int				node,
+	const struct workqueue_work	*work,
+	unsigned int			nr)
 {
-	struct workqueue_item	*wi;
-	int			ret;
+	struct workqueue_worker		*self = workqueue_self;
+	struct workqueue_item		*first = NULL, *last = NULL;
+	struct workqueue_item		**headp, **tailp;
+	unsigned int			i;
+	int				ret;
 
 	assert(!wq->terminated);
 
+	if (nr == 0)
+		return 0;
+
 	if (wq->thread_count == 0) {
-		func(wq, index, arg);
+		for (i = 0; i < nr; i++)
+			work[i].function(wq, work[i].index, work[i].arg);
 		return 0;
 	}
 
-	wi = malloc(sizeof(struct workqueue_item));
-	if (!wi)
-		return -errno;
+	if (node >= (int)wq->nr_nodes || (node >= 0 &&
+					  wq->nodes[node].nr_workers == 0))
+		node = -1;
 
-	wi->function = func;
-	wi->index = index;
-	wi->arg = arg;
-	wi->queue = wq;
-	wi->next = NULL;
+	/*
+	 * Workers queue onto their own deque unless the work belongs to some
+	 * other node.  They are never throttled, since a worker waiting for
+	 * the queue to drain might be the only one that could drain it.
+	 */
+	if (self && self->wq == wq && (node < 0 || node == self->node))
+		return workqueue_add_worker(self, work, nr);
 
-	/* Now queue the new work structure to the work queue. */
-	pthread_mutex_lock(&wq->lock);
-restart:
-	if (wq->next_item == NULL) {
-		assert(wq->item_count == 0);
-		ret = -pthread_cond_signal(&wq->wakeup);
-		if (ret) {
+	/* Now queue the new work structures to the shared list. */
+	workqueue_lock(wq);
+
+	/* throttle on a full queue if configured */
+	while (wq->max_queued && !(self && self->wq == wq) &&
+	       __atomic_load_n(&wq->item_count, __ATOMIC_SEQ_CST) >=
+			wq->max_queued) {
+		/*
+		 * Announce ourselves before checking again so that a worker
+		 * dequeueing after the check will send a wakeup.
+		 */
+		__atomic_add_fetch(&wq->nr_full_waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&wq->item_count, __ATOMIC_SEQ_CST) >=
+		    wq->max_queued)
+			pthread_cond_wait(&wq->queue_full, &wq->lock);
+		__atomic_sub_fetch(&wq->nr_full_waiters, 1, __ATOMIC_SEQ_CST);
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct workqueue_item	*wi;
+
+		wi = workqueue_item_get_locked(wq);
+		if (!wi) {
+			if (first)
+				workqueue_item_put_locked(wq, first, last);
 			pthread_mutex_unlock(&wq->lock);
-			free(wi);
-			return ret;
+			return -ENOMEM;
 		}
-		wq->next_item = wi;
+		wi->function = work[i].function;
+		wi->index = work[i].index;
+		wi->arg = work[i].arg;
+		wi->queue = wq;
+		wi->next = NULL;
+
+		if (last)
+			last->next = wi;
+		else
+			first = wi;
+		last = wi;
+	}
+
+	if (node >= 0) {
+		headp = &wq->nodes[node].next_item;
+		tailp = &wq->nodes[node].last_item;
 	} else {
-		/* throttle on a full queue if configured */
-		if (wq->max_queued && wq->item_count == wq->max_queued) {
-			pthread_cond_wait(&wq->queue_full, &wq->lock);
-			/*
-			 * Queue might be empty or even still full by the time
-			 * we get the lock back, so restart the lookup so we do
-			 * the right thing with the current state of the queue.
-			 */
-			goto restart;
-		}
-		wq->last_item->next = wi;
+		headp = &wq->next_item;
+		tailp = &wq->last_item;
 	}
-	wq->last_item = wi;
-	wq->item_count++;
+	if (*headp == NULL)
+		*headp = first;
+	else
+		(*tailp)->next = first;
+	*tailp = last;
+	__atomic_add_fetch(&wq->item_count, nr, __ATOMIC_SEQ_CST);
+
+	ret = workqueue_wake_locked(wq, node, nr);
 	pthread_mutex_unlock(&wq->lock);
 
-	return 0;
+	return ret;
+}
+
+/* Queue an array of work items that can run anywhere. */
+int
+workqueue_add_batch(
+	struct workqueue		*wq,
+	const struct workqueue_work	*work,
+	unsigned int			nr)
+{
+	return workqueue_add_batch_node(wq, -1, work, nr);
+}
+
+/*
+ * Create a work item consisting of a function and some arguments and schedule
+ * the work item to be run via the thread pool.  Returns zero or a negative
+ * error code.
+ */
+int
+workqueue_add(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	uint32_t		index,
+	void			*arg)
+{
+	struct workqueue_work	work = {
+		.function	= func,
+		.index		= index,
+		.arg		= arg,
+	};
+
+	return workqueue_add_batch(wq, &work, 1);
 }
 
 /*
@@ -212,12 +936,14 @@ workqueue_terminate(
 	wq->terminate = true;
 	pthread_mutex_unlock(&wq->lock);
 
-	ret = -pthread_cond_broadcast(&wq->wakeup);
-	if (ret)
-		return ret;
+	for (i = 0; i < wq->nr_nodes; i++) {
+		ret = -pthread_cond_broadcast(&wq->nodes[i].wakeup);
+		if (ret)
+			return ret;
+	}
 
 	for (i = 0; i < wq->thread_count; i++) {
-		ret = -pthread_join(wq->threads[i], NULL);
+		ret = -pthread_join(wq->workers[i].thread, NULL);
 		if (ret)
 			return ret;
 	}
@@ -236,9 +962,17 @@ workqueue_destroy(
 {
 	assert(wq->terminated);
 
-	free(wq->threads);
+	if (wq->workers)
+		workqueue_free_workers(wq, wq->thread_count);
+	while (wq->slabs) {
+		struct workqueue_slab	*slab = wq->slabs;
+
+		wq->slabs = slab->next;
+		free(slab);
+	}
+	if (wq->nodes)
+		workqueue_free_nodes(wq, wq->nr_nodes);
 	pthread_mutex_destroy(&wq->lock);
-	pthread_cond_destroy(&wq->wakeup);
 	pthread_cond_destroy(&wq->queue_full);
 	memset(wq, 0, sizeof(*wq));
 }
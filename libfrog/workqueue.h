@@ -20,27 +20,63 @@ struct workqueue_item {
 	uint32_t		index;
 };
 
+/* One piece of work for workqueue_add_batch. */
+struct workqueue_work {
+	workqueue_func_t	*function;
+	uint32_t		index;
+	void			*arg;
+};
+
+struct workqueue_worker;
+struct workqueue_node;
+struct workqueue_slab;
+
+/* Where to run the worker threads. */
+enum workqueue_affinity {
+	WQ_AFFINITY_NONE = 0,	/* wherever the scheduler likes */
+	WQ_AFFINITY_NODE,	/* spread across NUMA nodes */
+	WQ_AFFINITY_CPU,	/* spread across NUMA nodes, one CPU each */
+};
+
 struct workqueue {
 	void			*wq_ctx;
-	pthread_t		*threads;
-	struct workqueue_item	*next_item;
+	struct workqueue_worker	*workers;
+	struct workqueue_item	*next_item;	/* items added by non-workers */
 	struct workqueue_item	*last_item;
+	struct workqueue_node	*nodes;
+	unsigned int		nr_nodes;
 	pthread_mutex_t		lock;
-	pthread_cond_t		wakeup;
 	unsigned int		item_count;
 	unsigned int		thread_count;
+	unsigned int		nr_sleepers;
+	unsigned int		nr_full_waiters;
 	bool			terminate;
 	bool			terminated;
 	int			max_queued;
 	pthread_cond_t		queue_full;
+
+	/* item allocation */
+	struct workqueue_item	*free_items;
+	struct workqueue_slab	*slabs;
+
+	/* statistics */
+	unsigned long long	nr_contended;	/* lock was already held */
+	unsigned long long	nr_steals;	/* items taken from another worker */
 };
 
 int workqueue_create(struct workqueue *wq, void *wq_ctx,
 		unsigned int nr_workers);
 int workqueue_create_bound(struct workqueue *wq, void *wq_ctx,
 		unsigned int nr_workers, unsigned int max_queue);
+int workqueue_create_affine(struct workqueue *wq, void *wq_ctx,
+		unsigned int nr_workers, unsigned int max_queue,
+		enum workqueue_affinity affinity);
 int workqueue_add(struct workqueue *wq, workqueue_func_t fn,
 		uint32_t index, void *arg);
+int workqueue_add_batch(struct workqueue *wq,
+		const struct workqueue_work *work, unsigned int nr);
+int workqueue_add_batch_node(struct workqueue *wq, int node,
+		const struct workqueue_work *work, unsigned int nr);
 int workqueue_terminate(struct workqueue *wq);
 void workqueue_destroy(struct workqueue *wq);
 
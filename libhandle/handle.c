@@ -39,6 +39,7 @@ static char *path_to_fspath(char *path);
  * Maps filesystem handles to a corresponding open file descriptor for that
  * filesystem. We need this because we're doing handle operations via xfsctl
  * and we need to remember the open file descriptor for each filesystem.
+ * Every handle call looks up its filesystem here, so hash on the fsid.
  */
 
 struct fdhash {
@@ -48,20 +49,38 @@ struct fdhash {
 	char	fspath[MAXPATHLEN];
 };
 
-static struct fdhash *fdhash_head = NULL;
+#define	FDHASH_SIZE	64
+
+static struct fdhash *fdhash_table[FDHASH_SIZE];
+
+static unsigned int
+fdhash_bucket(
+	void		*fsh)
+{
+	uint64_t	fsid;
+
+	memcpy(&fsid, fsh, FSIDSIZE);
+	fsid ^= fsid >> 32;
+	fsid ^= fsid >> 16;
+	return fsid % FDHASH_SIZE;
+}
 
 void
 fshandle_destroy(void)
 {
 	struct fdhash	*nexth;
-	struct fdhash	*h = fdhash_head;
-
-	while (h) {
-		nexth = h->fnxt;
-		free(h);
-		h = nexth;
+	struct fdhash	*h;
+	int		i;
+
+	for (i = 0; i < FDHASH_SIZE; i++) {
+		h = fdhash_table[i];
+		while (h) {
+			nexth = h->fnxt;
+			free(h);
+			h = nexth;
+		}
+		fdhash_table[i] = NULL;
 	}
-	fdhash_head = NULL;
 }
 
 int
@@ -111,8 +130,8 @@ path_to_fshandle(
 		fdhp->fspath[sizeof(fdhp->fspath) - 1] = 0;
 		memcpy(fdhp->fsh, *fshanp, FSIDSIZE);
 
-		fdhp->fnxt = fdhash_head;
-		fdhash_head = fdhp;
+		fdhp->fnxt = fdhash_table[fdhash_bucket(fdhp->fsh)];
+		fdhash_table[fdhash_bucket(fdhp->fsh)] = fdhp;
 	}
 
 	return result;
@@ -214,7 +233,8 @@ handle_to_fsfd(void *hanp, char **path)
 	 * When found return the file descriptor and path that
 	 * we have in the cache.
 	 */
-	for (fdhp = fdhash_head; fdhp != NULL; fdhp = fdhp->fnxt) {
+	for (fdhp = fdhash_table[fdhash_bucket(hanp)]; fdhp != NULL;
+	     fdhp = fdhp->fnxt) {
 		if (memcmp(fdhp->fsh, hanp, FSIDSIZE) == 0) {
 			*path = fdhp->fspath;
 			return fdhp->fsfd;
@@ -411,6 +431,167 @@ attr_list_by_handle(
 	return error;
 }
 
+/*
+ * Batched variants.  There's no vectored ioctl, but handle based scanners
+ * hand us long runs of handles from the same filesystem, so only look up
+ * the filesystem again when the fsid changes.  results[i] gets what the
+ * single handle call would have returned, or -errno if it failed.  These
+ * return 0 unless the arguments are bad.
+ */
+static int
+handles_fsfd(
+	void		*hanp,
+	size_t		hlen,
+	void		**last,
+	int		*fsfd,
+	char		**path)
+{
+	if (hlen < FSIDSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (*last && memcmp(*last, hanp, FSIDSIZE) == 0)
+		return 0;
+	*last = NULL;
+	if ((*fsfd = handle_to_fsfd(hanp, path)) < 0)
+		return -1;
+	*last = hanp;
+	return 0;
+}
+
+int
+open_by_handles(
+	void		**hanps,
+	size_t		*hlens,
+	int		count,
+	int		rw,
+	int		*results)
+{
+	int		fsfd = -1;
+	char		*path = NULL;
+	void		*last = NULL;
+	int		i;
+	xfs_fsop_handlereq_t hreq;
+
+	if (count < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hreq.fd       = 0;
+	hreq.path     = NULL;
+	hreq.oflags   = rw | O_LARGEFILE;
+	hreq.ohandle  = NULL;
+	hreq.ohandlen = NULL;
+
+	for (i = 0; i < count; i++) {
+		if (handles_fsfd(hanps[i], hlens[i], &last, &fsfd, &path)) {
+			results[i] = -errno;
+			continue;
+		}
+		hreq.ihandle  = hanps[i];
+		hreq.ihandlen = hlens[i];
+		results[i] = xfsctl(path, fsfd, XFS_IOC_OPEN_BY_HANDLE, &hreq);
+		if (results[i] < 0)
+			results[i] = -errno;
+	}
+	return 0;
+}
+
+int
+readlink_by_handles(
+	void		**hanps,
+	size_t		*hlens,
+	int		count,
+	void		**bufs,
+	size_t		bufsiz,
+	int		*results)
+{
+	int		fsfd = -1;
+	char		*path = NULL;
+	void		*last = NULL;
+	__u32		buflen;
+	int		i;
+	xfs_fsop_handlereq_t hreq;
+
+	if (count < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hreq.fd       = 0;
+	hreq.path     = NULL;
+	hreq.oflags   = O_LARGEFILE;
+	hreq.ohandlen = &buflen;
+
+	for (i = 0; i < count; i++) {
+		if (handles_fsfd(hanps[i], hlens[i], &last, &fsfd, &path)) {
+			results[i] = -errno;
+			continue;
+		}
+		buflen = (__u32)bufsiz;
+		hreq.ihandle  = hanps[i];
+		hreq.ihandlen = hlens[i];
+		hreq.ohandle  = bufs[i];
+		results[i] = xfsctl(path, fsfd, XFS_IOC_READLINK_BY_HANDLE,
+				&hreq);
+		if (results[i] < 0)
+			results[i] = -errno;
+	}
+	return 0;
+}
+
+int
+attr_list_by_handles(
+	void		**hanps,
+	size_t		*hlens,
+	int		count,
+	void		**bufs,
+	size_t		bufsize,
+	int		flags,
+	struct attrlist_cursor **cursors,
+	int		*results)
+{
+	int		fsfd = -1;
+	char		*path = NULL;
+	void		*last = NULL;
+	int		i;
+	struct xfs_fsop_attrlist_handlereq alhreq = { };
+
+	if (count < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	alhreq.hreq.fd       = 0;
+	alhreq.hreq.path     = NULL;
+	alhreq.hreq.oflags   = O_LARGEFILE;
+	alhreq.hreq.ohandle  = NULL;
+	alhreq.hreq.ohandlen = NULL;
+	alhreq.flags = flags;
+	alhreq.buflen = bufsize;
+	/* prevent needless EINVAL from the kernel */
+	if (alhreq.buflen > XFS_XATTR_LIST_MAX)
+		alhreq.buflen = XFS_XATTR_LIST_MAX;
+
+	for (i = 0; i < count; i++) {
+		if (handles_fsfd(hanps[i], hlens[i], &last, &fsfd, &path)) {
+			results[i] = -errno;
+			continue;
+		}
+		alhreq.hreq.ihandle  = hanps[i];
+		alhreq.hreq.ihandlen = hlens[i];
+		alhreq.buffer = bufs[i];
+		memcpy(&alhreq.pos, cursors[i], sizeof(alhreq.pos));
+		results[i] = xfsctl(path, fsfd, XFS_IOC_ATTRLIST_BY_HANDLE,
+				&alhreq);
+		if (results[i] < 0)
+			results[i] = -errno;
+		memcpy(cursors[i], &alhreq.pos, sizeof(alhreq.pos));
+	}
+	return 0;
+}
+
 int
 parents_by_handle(
 	void		*hanp,
@@ -17,11 +17,20 @@ static checkfunc_t	check_func;
 struct cmdline {
 	char	*cmdline;
 	bool	iterate;
+	bool	script;		/* cmdline is a file of commands */
 };
 
 static int		ncmdline;
 static struct cmdline	*cmdline;
 
+/*
+ * Command lookup hash, indexes into cmdtab plus one so that zero is an
+ * empty slot.  Rebuilt on the first lookup after a command is added,
+ * since add_command shuffles cmdtab around.
+ */
+static int		*cmdhash;
+static unsigned int	cmdhash_size;
+
 static int
 compare(const void *a, const void *b)
 {
@@ -36,6 +45,8 @@ add_command(
 	cmdtab = realloc((void *)cmdtab, ++ncmds * sizeof(*cmdtab));
 	cmdtab[ncmds - 1] = *ci;
 	qsort(cmdtab, ncmds, sizeof(*cmdtab), compare);
+	free(cmdhash);
+	cmdhash = NULL;
 }
 
 static int
@@ -96,16 +107,78 @@ command(
 	return ct->cfunc(argc, argv);
 }
 
+static unsigned int
+cmdhash_val(
+	const char	*name)
+{
+	unsigned int	h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+static void
+cmdhash_insert(
+	const char	*name,
+	int		idx)
+{
+	unsigned int	i = cmdhash_val(name) & (cmdhash_size - 1);
+
+	/* the first command in cmdtab with a given name wins */
+	while (cmdhash[i]) {
+		const cmdinfo_t	*ct = &cmdtab[cmdhash[i] - 1];
+
+		if (strcmp(ct->name, name) == 0 ||
+		    (ct->altname && strcmp(ct->altname, name) == 0))
+			return;
+		i = (i + 1) & (cmdhash_size - 1);
+	}
+	cmdhash[i] = idx + 1;
+}
+
+static void
+cmdhash_build(void)
+{
+	int		i;
+
+	for (cmdhash_size = 16; cmdhash_size < ncmds * 4; cmdhash_size <<= 1)
+		;
+	cmdhash = calloc(cmdhash_size, sizeof(*cmdhash));
+	if (!cmdhash)
+		return;
+	for (i = 0; i < ncmds; i++) {
+		cmdhash_insert(cmdtab[i].name, i);
+		if (cmdtab[i].altname)
+			cmdhash_insert(cmdtab[i].altname, i);
+	}
+}
+
 const cmdinfo_t *
 find_command(
 	const char	*cmd)
 {
 	cmdinfo_t	*ct;
+	unsigned int	i;
+
+	if (!cmdhash)
+		cmdhash_build();
+	if (!cmdhash) {
+		for (ct = cmdtab; ct < &cmdtab[ncmds]; ct++) {
+			if (strcmp(ct->name, cmd) == 0 ||
+			    (ct->altname && strcmp(ct->altname, cmd) == 0))
+				return (const cmdinfo_t *)ct;
+		}
+		return NULL;
+	}
 
-	for (ct = cmdtab; ct < &cmdtab[ncmds]; ct++) {
+	i = cmdhash_val(cmd) & (cmdhash_size - 1);
+	while (cmdhash[i]) {
+		ct = &cmdtab[cmdhash[i] - 1];
 		if (strcmp(ct->name, cmd) == 0 ||
 		    (ct->altname && strcmp(ct->altname, cmd) == 0))
 			return (const cmdinfo_t *)ct;
+		i = (i + 1) & (cmdhash_size - 1);
 	}
 	return NULL;
 }
@@ -121,7 +194,7 @@ add_user_command(char *optarg)
 	}
 	cmdline[ncmdline-1].cmdline = optarg;
 	cmdline[ncmdline-1].iterate = true;
-
+	cmdline[ncmdline-1].script = false;
 }
 
 void
@@ -135,6 +208,22 @@ add_oneshot_user_command(char *optarg)
 	}
 	cmdline[ncmdline-1].cmdline = optarg;
 	cmdline[ncmdline-1].iterate = false;
+	cmdline[ncmdline-1].script = false;
+}
+
+/* Run every line of a file ("-" for stdin) as a -c command. */
+void
+add_user_script(char *path)
+{
+	ncmdline++;
+	cmdline = realloc(cmdline, sizeof(struct cmdline) * (ncmdline));
+	if (!cmdline) {
+		perror("realloc");
+		exit(1);
+	}
+	cmdline[ncmdline-1].cmdline = path;
+	cmdline[ncmdline-1].iterate = true;
+	cmdline[ncmdline-1].script = true;
 }
 
 /*
@@ -172,35 +261,117 @@ add_command_iterator(
 }
 
 static int
-process_input(
-	char		*input,
+process_args(
+	char		**v,
+	int		c,
 	bool		iterate)
 {
-	char		**v;
 	const cmdinfo_t	*ct;
-	int		c = 0;
-	int		error = 0;
-
-	v = breakline(input, &c);
-	if (!c)
-		goto out;
 
 	ct = find_command(v[0]);
 	if (!ct) {
 		fprintf(stderr, _("command \"%s\" not found\n"), v[0]);
-		goto out;
+		return 0;
 	}
 
 	/* oneshot commands don't iterate */
 	if (!iterate || (ct->flags & CMD_FLAG_ONESHOT))
-		error = command(ct, c, v);
-	else
-		error = iterate_command(ct, c, v);
-out:
+		return command(ct, c, v);
+	return iterate_command(ct, c, v);
+}
+
+static int
+process_input(
+	char		*input,
+	bool		iterate)
+{
+	char		**v;
+	int		c = 0;
+	int		error = 0;
+
+	v = breakline(input, &c);
+	if (c)
+		error = process_args(v, c, iterate);
 	doneline(input, v);
 	return error;
 }
 
+/*
+ * Split a line like breakline does, but into a vector that is kept from
+ * one line to the next.
+ */
+static int
+script_breakline(
+	char		*input,
+	char		***vec,
+	int		*size)
+{
+	char		*p;
+	int		c = 0;
+
+	while ((p = strsep(&input, " \t")) != NULL) {
+		if (!*p)
+			continue;
+		if (c + 1 >= *size) {
+			*size = *size ? *size * 2 : 16;
+			*vec = realloc(*vec, *size * sizeof(char *));
+			if (!*vec) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		(*vec)[c++] = p;
+	}
+	if (*vec)
+		(*vec)[c] = NULL;
+	return c;
+}
+
+/*
+ * Stream commands from a script.  Scripts can be millions of lines long,
+ * so the line buffer and argument vector are reused for every line rather
+ * than allocated and freed each time.  Blank lines and lines starting with
+ * '#' are skipped.
+ */
+static int
+process_script(
+	const char	*path,
+	bool		iterate)
+{
+	FILE		*fp = stdin;
+	char		*line = NULL;
+	size_t		len = 0;
+	ssize_t		n;
+	char		**v = NULL;
+	int		size = 0;
+	int		c;
+	int		done = 0;
+
+	if (strcmp(path, "-") != 0) {
+		fp = fopen(path, "r");
+		if (!fp) {
+			fprintf(stderr, _("cannot open script '%s': %s\n"),
+				path, strerror(errno));
+			exit(1);
+		}
+	}
+
+	while (!done && (n = getline(&line, &len, fp)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		c = script_breakline(line, &v, &size);
+		if (!c || v[0][0] == '#')
+			continue;
+		done = process_args(v, c, iterate);
+	}
+
+	free(v);
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return done;
+}
+
 void
 command_loop(void)
 {
@@ -221,6 +392,11 @@ command_loop(void)
 
 	/* command line mode */
 	for (i = 0; !done && i < ncmdline; i++) {
+		if (cmdline[i].script) {
+			done = process_script(cmdline[i].cmdline,
+					cmdline[i].iterate);
+			continue;
+		}
 		input = strdup(cmdline[i].cmdline);
 		if (!input) {
 			fprintf(stderr,
@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs_priv.h"
+#include "xfs_fs.h"
+#include "xfs_shared.h"
+#include "xfs_format.h"
+#include "xfs_bit.h"
+#include "libfrog/platform.h"
+#include <sys/mman.h>
+
+/*
+ * Size-classed arena for buffer bodies.
+ *
+ * Every cached buffer used to get its own memalign() allocation, which at
+ * millions of buffers costs a lot in malloc metadata and fragmentation, and
+ * hides how much memory the buffer cache really uses.  Instead, we carve
+ * buffer bodies out of large anonymous mappings, one power of two size class
+ * per block size, and recycle freed bodies through a per-class free list.
+ * Memory is only returned to the system at teardown.
+ *
+ * Chunks can optionally be backed by transparent huge pages.  Requests bigger
+ * than the largest size class (which only log recovery makes) fall back to
+ * memalign(), but are still accounted for.
+ */
+
+#define BUF_ARENA_CHUNK_SIZE	(2U << 20)	/* one x86 huge page */
+#define BUF_ARENA_MIN_SHIFT	BBSHIFT
+#define BUF_ARENA_MAX_SHIFT	XFS_MAX_BLOCKSIZE_LOG
+#define BUF_ARENA_NR_CLASSES	(BUF_ARENA_MAX_SHIFT - BUF_ARENA_MIN_SHIFT + 1)
+
+struct buf_arena_class {
+	pthread_mutex_t		lock;
+	void			*freelist;	/* chained through first word */
+	char			*next;		/* unused part of current chunk */
+	char			*end;
+	unsigned long		nr_used;
+	unsigned long		nr_free;
+};
+
+static struct buf_arena_class	arena_classes[BUF_ARENA_NR_CLASSES];
+static int			arena_min_shift;	/* zero if disabled */
+static bool			arena_hugepages;
+
+/* chunk_lock protects the chunk table and the byte counters below */
+static pthread_mutex_t		arena_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static void			**arena_chunks;
+static unsigned int		arena_nr_chunks;
+static unsigned int		arena_max_chunks;
+static unsigned long long	arena_oversize;		/* memalign()ed bytes */
+static unsigned long long	arena_limit;
+
+/* Set up the arena.  Buffers allocated before this use memalign(). */
+void
+libxfs_buf_arena_init(
+	bool			hugepages)
+{
+	int			i;
+
+	if (arena_min_shift)
+		return;
+
+	for (i = 0; i < BUF_ARENA_NR_CLASSES; i++)
+		pthread_mutex_init(&arena_classes[i].lock, NULL);
+
+	arena_hugepages = hugepages;
+	arena_min_shift = max(BUF_ARENA_MIN_SHIFT,
+			xfs_highbit32(platform_align_blockdev()));
+}
+
+/* Tell the arena how much buffer memory the program would like to use. */
+void
+libxfs_buf_arena_set_limit(
+	unsigned long long	bytes)
+{
+	pthread_mutex_lock(&arena_chunk_lock);
+	arena_limit = bytes;
+	pthread_mutex_unlock(&arena_chunk_lock);
+}
+
+static inline unsigned long long
+__buf_arena_usage(void)
+{
+	return (unsigned long long)arena_nr_chunks * BUF_ARENA_CHUNK_SIZE +
+		arena_oversize;
+}
+
+/* Total bytes of buffer memory obtained from the system. */
+unsigned long long
+libxfs_buf_arena_usage(void)
+{
+	unsigned long long	bytes;
+
+	pthread_mutex_lock(&arena_chunk_lock);
+	bytes = __buf_arena_usage();
+	pthread_mutex_unlock(&arena_chunk_lock);
+	return bytes;
+}
+
+/* Have we gone past the memory limit? */
+bool
+libxfs_buf_arena_overlimit(void)
+{
+	bool			ret;
+
+	pthread_mutex_lock(&arena_chunk_lock);
+	ret = arena_limit && __buf_arena_usage() > arena_limit;
+	pthread_mutex_unlock(&arena_chunk_lock);
+	return ret;
+}
+
+static inline int
+buf_arena_shift(
+	size_t			bytes)
+{
+	int			shift = arena_min_shift;
+
+	while (shift <= BUF_ARENA_MAX_SHIFT && (1U << shift) < bytes)
+		shift++;
+	return shift;
+}
+
+static void *
+buf_arena_map_chunk(void)
+{
+	size_t			len = BUF_ARENA_CHUNK_SIZE;
+	char			*p, *aligned;
+
+	if (!arena_hugepages) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
+	}
+
+	/* Huge pages need a naturally aligned chunk, so trim an oversize map */
+	p = mmap(NULL, 2 * len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	aligned = (char *)round_up((uintptr_t)p, len);
+	if (aligned > p)
+		munmap(p, aligned - p);
+	munmap(aligned + len, p + len - aligned);
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+
+static bool
+buf_arena_grow(
+	struct buf_arena_class	*bc)
+{
+	void			*p;
+
+	pthread_mutex_lock(&arena_chunk_lock);
+	if (arena_nr_chunks == arena_max_chunks) {
+		unsigned int	nr = max(arena_max_chunks * 2, 64U);
+		void		**chunks;
+
+		chunks = realloc(arena_chunks, nr * sizeof(void *));
+		if (!chunks)
+			goto out_unlock;
+		arena_chunks = chunks;
+		arena_max_chunks = nr;
+	}
+
+	p = buf_arena_map_chunk();
+	if (!p)
+		goto out_unlock;
+	arena_chunks[arena_nr_chunks++] = p;
+	pthread_mutex_unlock(&arena_chunk_lock);
+
+	bc->next = p;
+	bc->end = bc->next + BUF_ARENA_CHUNK_SIZE;
+	return true;
+
+out_unlock:
+	pthread_mutex_unlock(&arena_chunk_lock);
+	return false;
+}
+
+/* Allocate a buffer body of @bytes, suitably aligned for direct I/O. */
+void *
+libxfs_buf_arena_alloc(
+	size_t			bytes)
+{
+	struct buf_arena_class	*bc;
+	void			*p;
+	int			shift = buf_arena_shift(bytes);
+
+	if (!arena_min_shift || shift > BUF_ARENA_MAX_SHIFT) {
+		p = memalign(platform_align_blockdev(), bytes);
+		if (p) {
+			pthread_mutex_lock(&arena_chunk_lock);
+			arena_oversize += bytes;
+			pthread_mutex_unlock(&arena_chunk_lock);
+		}
+		return p;
+	}
+
+	bc = &arena_classes[shift - BUF_ARENA_MIN_SHIFT];
+	pthread_mutex_lock(&bc->lock);
+	if (bc->freelist) {
+		p = bc->freelist;
+		bc->freelist = *(void **)p;
+		bc->nr_free--;
+	} else {
+		if (bc->next == bc->end && !buf_arena_grow(bc)) {
+			pthread_mutex_unlock(&bc->lock);
+			return NULL;
+		}
+		p = bc->next;
+		bc->next += 1U << shift;
+	}
+	bc->nr_used++;
+	pthread_mutex_unlock(&bc->lock);
+	return p;
+}
+
+/* Give back a buffer body; @bytes must match what was passed to alloc. */
+void
+libxfs_buf_arena_free(
+	void			*p,
+	size_t			bytes)
+{
+	struct buf_arena_class	*bc;
+	int			shift = buf_arena_shift(bytes);
+
+	if (!p)
+		return;
+
+	if (!arena_min_shift || shift > BUF_ARENA_MAX_SHIFT) {
+		free(p);
+		pthread_mutex_lock(&arena_chunk_lock);
+		arena_oversize -= bytes;
+		pthread_mutex_unlock(&arena_chunk_lock);
+		return;
+	}
+
+	bc = &arena_classes[shift - BUF_ARENA_MIN_SHIFT];
+	pthread_mutex_lock(&bc->lock);
+	*(void **)p = bc->freelist;
+	bc->freelist = p;
+	bc->nr_used--;
+	bc->nr_free++;
+	pthread_mutex_unlock(&bc->lock);
+}
+
+/*
+ * Unmap everything.  If somebody leaked a buffer we leave the arena alone;
+ * the buffer cache leak checking will complain about it.
+ */
+void
+libxfs_buf_arena_destroy(void)
+{
+	unsigned int		i;
+
+	for (i = 0; i < BUF_ARENA_NR_CLASSES; i++)
+		if (arena_classes[i].nr_used)
+			return;
+
+	for (i = 0; i < BUF_ARENA_NR_CLASSES; i++) {
+		struct buf_arena_class	*bc = &arena_classes[i];
+
+		bc->freelist = NULL;
+		bc->next = bc->end = NULL;
+		bc->nr_free = 0;
+	}
+
+	pthread_mutex_lock(&arena_chunk_lock);
+	for (i = 0; i < arena_nr_chunks; i++)
+		munmap(arena_chunks[i], BUF_ARENA_CHUNK_SIZE);
+	free(arena_chunks);
+	arena_chunks = NULL;
+	arena_nr_chunks = arena_max_chunks = 0;
+	pthread_mutex_unlock(&arena_chunk_lock);
+}
+
+void
+libxfs_buf_arena_report(
+	FILE			*fp)
+{
+	struct buf_arena_class	*bc;
+	unsigned long long	usage = libxfs_buf_arena_usage();
+	int			i;
+
+	if (!usage)
+		return;
+
+	fprintf(fp, "Buffer arena: %s\n"
+			"Mapped chunks = %u (%llu KiB)\n"
+			"Outside arena = %llu KiB\n"
+			"Memory limit = %llu KiB\n",
+			arena_min_shift ?
+				(arena_hugepages ? "huge pages" : "enabled") :
+				"disabled",
+			arena_nr_chunks,
+			((unsigned long long)arena_nr_chunks *
+					BUF_ARENA_CHUNK_SIZE) >> 10,
+			arena_oversize >> 10,
+			arena_limit >> 10);
+
+	for (i = 0; i < BUF_ARENA_NR_CLASSES; i++) {
+		bc = &arena_classes[i];
+		if (!bc->nr_used && !bc->nr_free)
+			continue;
+		fprintf(fp, "Size %6u buffers: %8lu in use, %8lu free\n",
+			1U << (i + BUF_ARENA_MIN_SHIFT),
+			bc->nr_used, bc->nr_free);
+	}
+}
@@ -17,6 +17,7 @@
 #include "xfs_trans_resv.h"
 #include "xfs_mount.h"
 #include "xfs_bit.h"
+#include "xfs_trace.h"
 
 #define CACHE_DEBUG 1
 #undef CACHE_DEBUG
@@ -28,6 +29,67 @@
 
 static unsigned int cache_generic_bulkrelse(struct cache *, struct list_head *);
 
+/*
+ * Plain LRU: the most recently released node goes to the head of its MRU and
+ * the shaker reclaims from the tail.
+ */
+static void
+cache_lru_insert(
+	struct cache_mru	*mru,
+	struct cache_node	*node)
+{
+	list_add(&node->cn_mru, &mru->cm_list);
+}
+
+static bool
+cache_lru_reclaim(
+	struct cache_node	*node)
+{
+	return true;
+}
+
+const struct cache_policy cache_lru_policy = {
+	.name		= "lru",
+	.insert		= cache_lru_insert,
+	.reclaim	= cache_lru_reclaim,
+};
+
+/*
+ * CLOCK with cold insertion: a node that was never looked up again after it
+ * was created is most likely part of a one-shot scan, so park it at the tail
+ * of its MRU where it will be reclaimed first.  Nodes that have been reused go
+ * to the head, and any node hit since the shaker last looked at it gets a
+ * second chance.  Prefetched nodes have not been consumed yet, so they are
+ * always treated as hot.
+ */
+static void
+cache_clock_insert(
+	struct cache_mru	*mru,
+	struct cache_node	*node)
+{
+	if (node->cn_reuse == 0 && node->cn_priority < CACHE_PREFETCH_PRIORITY)
+		list_add_tail(&node->cn_mru, &mru->cm_list);
+	else
+		list_add(&node->cn_mru, &mru->cm_list);
+}
+
+static bool
+cache_clock_reclaim(
+	struct cache_node	*node)
+{
+	if (node->cn_referenced) {
+		node->cn_referenced = false;
+		return false;
+	}
+	return true;
+}
+
+const struct cache_policy cache_clock_policy = {
+	.name		= "clock",
+	.insert		= cache_clock_insert,
+	.reclaim	= cache_clock_reclaim,
+};
+
 struct cache *
 cache_init(
 	int			flags,
@@ -47,10 +109,7 @@ cache_init(
 	}
 
 	cache->c_flags = flags;
-	cache->c_count = 0;
 	cache->c_max = 0;
-	cache->c_hits = 0;
-	cache->c_misses = 0;
 	cache->c_maxcount = maxcount;
 	cache->c_hashsize = hashsize;
 	cache->c_hashshift = libxfs_highbit32(hashsize);
@@ -61,14 +120,38 @@ cache_init(
 	cache->compare = cache_operations->compare;
 	cache->bulkrelse = cache_operations->bulkrelse ?
 		cache_operations->bulkrelse : cache_generic_bulkrelse;
-	pthread_mutex_init(&cache->c_mutex, NULL);
+	if (cache_operations->dirty && cache_operations->bulkflush) {
+		cache->dirty = cache_operations->dirty;
+		cache->bulkflush = cache_operations->bulkflush;
+	} else {
+		cache->dirty = NULL;
+		cache->bulkflush = NULL;
+	}
+	cache->fingerprint = cache_operations->fingerprint;
+	if (cache_operations->policy)
+		cache->c_policy = cache_operations->policy;
+	else if (flags & CACHE_SCAN_RESISTANT)
+		cache->c_policy = &cache_clock_policy;
+	else
+		cache->c_policy = &cache_lru_policy;
+	cache->c_oneshot = 0;
+	cache->c_reused = 0;
+	cache->c_reprieves = 0;
 
 	for (i = 0; i < hashsize; i++) {
 		list_head_init(&cache->c_hash[i].ch_list);
 		cache->c_hash[i].ch_count = 0;
-		pthread_mutex_init(&cache->c_hash[i].ch_mutex, NULL);
+		cache->c_hash[i].ch_stale = 0;
+		cache->c_hash[i].ch_bloom = 0;
+		cache->c_hash[i].ch_hits = 0;
+		cache->c_hash[i].ch_misses = 0;
+		cache->c_hash[i].ch_skips = 0;
+		pthread_rwlock_init(&cache->c_hash[i].ch_lock, NULL);
 	}
 
+	for (i = 0; i < CACHE_COUNT_SHARDS; i++)
+		cache->c_count[i].cc_count = 0;
+
 	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
 		list_head_init(&cache->c_mrus[i].cm_list);
 		cache->c_mrus[i].cm_count = 0;
@@ -77,16 +160,152 @@ cache_init(
 	return cache;
 }
 
+/*
+ * Double the cache size limit.  Several threads may decide to grow the cache
+ * at the same time after failing to reclaim anything; only the first one to
+ * get here for a given size actually doubles it.
+ */
 static void
 cache_expand(
-	struct cache *		cache)
+	struct cache *		cache,
+	unsigned int		oldmax)
 {
-	pthread_mutex_lock(&cache->c_mutex);
+	if (uatomic_cmpxchg(&cache->c_maxcount, oldmax, 2 * oldmax) != oldmax)
+		return;
+	trace_libxfs_cache_expand(cache, 2 * oldmax);
 #ifdef CACHE_DEBUG
-	fprintf(stderr, "doubling cache size to %d\n", 2 * cache->c_maxcount);
+	fprintf(stderr, "doubling cache size to %d\n", 2 * oldmax);
 #endif
-	cache->c_maxcount *= 2;
-	pthread_mutex_unlock(&cache->c_mutex);
+}
+
+/*
+ * Bucket filters.  Each key sets two of the 64 bits in its bucket's filter,
+ * which with the usual HASH_CACHE_RATIO nodes per chain lets about 95% of
+ * lookups for absent keys skip the chain.  A zero return means the cache
+ * has no fingerprints and every lookup has to walk the chain.
+ */
+static inline uint64_t
+cache_key_bloom(
+	struct cache		*cache,
+	cache_key_t		key)
+{
+	uint64_t		fp;
+
+	if (!cache->fingerprint)
+		return 0;
+	fp = cache->fingerprint(key) * 0x9E3779B97F4A7C15ULL;
+	return (1ULL << (fp >> 58)) | (1ULL << ((fp >> 52) & 63));
+}
+
+/* Could this key be on the chain?  Called without the bucket lock. */
+static inline bool
+cache_hash_may_contain(
+	struct cache_hash	*hash,
+	uint64_t		bloom)
+{
+	return (uatomic_read(&hash->ch_bloom) & bloom) == bloom;
+}
+
+/*
+ * Add a node to a hash chain; caller holds the bucket lock for write.  The
+ * filter bits must be visible before the node is, or a lookup could skip a
+ * chain that has its key on it.
+ */
+static void
+cache_hash_add(
+	struct cache_hash	*hash,
+	struct cache_node	*node,
+	uint64_t		bloom)
+{
+	node->cn_bloom = bloom;
+	uatomic_set(&hash->ch_bloom, hash->ch_bloom | bloom);
+	cmm_smp_wmb();
+	hash->ch_count++;
+	list_add(&node->cn_hash, &hash->ch_list);
+}
+
+/*
+ * A node has come off a hash chain; caller holds the bucket lock for write.
+ * Its bits stay in the filter for a while, which only costs the odd needless
+ * chain walk.  But evicted blocks are often the next ones to be looked up
+ * again, so don't let the stale bits build up for long.
+ */
+static void
+cache_hash_removed(
+	struct cache_hash	*hash)
+{
+	struct cache_node	*node;
+	uint64_t		bloom = 0;
+
+	hash->ch_count--;
+	if (++hash->ch_stale <= hash->ch_count / 4)
+		return;
+
+	list_for_each_entry(node, &hash->ch_list, cn_hash)
+		bloom |= node->cn_bloom;
+	uatomic_set(&hash->ch_bloom, bloom);
+	hash->ch_stale = 0;
+}
+
+/*
+ * Node accounting.  Nodes are counted in the shard of the hash bucket they
+ * live in, so allocation and reclaim only update a counter shared with the
+ * other buckets in the same group.  The limit check sums the shards without
+ * writing to them, so racing allocations can overshoot the limit by a node
+ * each; the high water mark never goes past the limit, so cache_overflowed()
+ * still sees a full cache.
+ */
+static inline struct cache_count *
+cache_count_shard(
+	struct cache *		cache,
+	unsigned int		hashidx)
+{
+	return &cache->c_count[hashidx & (CACHE_COUNT_SHARDS - 1)];
+}
+
+unsigned int
+cache_node_count(
+	struct cache *		cache)
+{
+	unsigned int		count = 0;
+	int			i;
+
+	for (i = 0; i < CACHE_COUNT_SHARDS; i++)
+		count += uatomic_read(&cache->c_count[i].cc_count);
+	return count;
+}
+
+static inline void
+cache_count_sub(
+	struct cache *		cache,
+	unsigned int		hashidx,
+	unsigned int		count)
+{
+	uatomic_sub(&cache_count_shard(cache, hashidx)->cc_count, count);
+}
+
+static bool
+cache_count_reserve(
+	struct cache *		cache,
+	unsigned int		hashidx)
+{
+	unsigned int		maxcount = uatomic_read(&cache->c_maxcount);
+	unsigned int		old, new, prev;
+
+	new = cache_node_count(cache);
+	if (new >= maxcount)
+		return false;
+	uatomic_inc(&cache_count_shard(cache, hashidx)->cc_count);
+
+	new++;
+	old = uatomic_read(&cache->c_max);
+	while (old < new) {
+		prev = uatomic_cmpxchg(&cache->c_max, old, new);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+	return true;
 }
 
 void
@@ -102,10 +321,10 @@ cache_walk(
 	for (i = 0; i < cache->c_hashsize; i++) {
 		hash = &cache->c_hash[i];
 		head = &hash->ch_list;
-		pthread_mutex_lock(&hash->ch_mutex);
+		pthread_rwlock_rdlock(&hash->ch_lock);
 		for (pos = head->next; pos != head; pos = pos->next)
 			visit((struct cache_node *)pos);
-		pthread_mutex_unlock(&hash->ch_mutex);
+		pthread_rwlock_unlock(&hash->ch_lock);
 	}
 }
 
@@ -140,13 +359,12 @@ cache_destroy(
 	cache_destroy_check(cache);
 	for (i = 0; i < cache->c_hashsize; i++) {
 		list_head_destroy(&cache->c_hash[i].ch_list);
-		pthread_mutex_destroy(&cache->c_hash[i].ch_mutex);
+		pthread_rwlock_destroy(&cache->c_hash[i].ch_lock);
 	}
 	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
 		list_head_destroy(&cache->c_mrus[i].cm_list);
 		pthread_mutex_destroy(&cache->c_mrus[i].cm_mutex);
 	}
-	pthread_mutex_destroy(&cache->c_mutex);
 	free(cache->c_hash);
 	free(cache);
 }
@@ -213,11 +431,16 @@ cache_shake(
 	struct cache_mru	*mru;
 	struct cache_hash *	hash;
 	struct list_head	temp;
+	struct list_head	reprieved;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
 	struct cache_node *	node;
 	unsigned int		count;
+	unsigned int		oneshot = 0;
+	unsigned int		reprieves = 0;
+	unsigned int		freed[CACHE_COUNT_SHARDS] = { 0 };
+	int			i;
 
 	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
 	if (priority > CACHE_MAX_PRIORITY && !purge)
@@ -226,6 +449,7 @@ cache_shake(
 	mru = &cache->c_mrus[priority];
 	count = 0;
 	list_head_init(&temp);
+	list_head_init(&reprieved);
 	head = &mru->cm_list;
 
 	pthread_mutex_lock(&mru->cm_mutex);
@@ -236,6 +460,18 @@ cache_shake(
 		if (pthread_mutex_trylock(&node->cn_mutex) != 0)
 			continue;
 
+		/*
+		 * Give recently used nodes another trip around the MRU.  They
+		 * go back on the head after the walk, so that this walk doesn't
+		 * come across them again and reclaim them anyway.
+		 */
+		if (!purge && !cache->c_policy->reclaim(node)) {
+			list_move(&node->cn_mru, &reprieved);
+			pthread_mutex_unlock(&node->cn_mutex);
+			reprieves++;
+			continue;
+		}
+
 		/* memory pressure is not allowed to release dirty objects */
 		if (cache->flush(node) && !purge) {
 			list_del(&node->cn_mru);
@@ -247,33 +483,41 @@ cache_shake(
 		}
 
 		hash = cache->c_hash + node->cn_hashidx;
-		if (pthread_mutex_trylock(&hash->ch_mutex) != 0) {
+		if (pthread_rwlock_trywrlock(&hash->ch_lock) != 0) {
 			pthread_mutex_unlock(&node->cn_mutex);
 			continue;
 		}
 		ASSERT(node->cn_count == 0);
 		ASSERT(node->cn_priority == priority);
 		node->cn_priority = -1;
+		if (node->cn_reuse == 0)
+			oneshot++;
 
 		list_move(&node->cn_mru, &temp);
 		list_del_init(&node->cn_hash);
-		hash->ch_count--;
+		cache_hash_removed(hash);
 		mru->cm_count--;
-		pthread_mutex_unlock(&hash->ch_mutex);
+		pthread_rwlock_unlock(&hash->ch_lock);
 		pthread_mutex_unlock(&node->cn_mutex);
 
+		freed[node->cn_hashidx & (CACHE_COUNT_SHARDS - 1)]++;
 		count++;
 		if (!purge && count == CACHE_SHAKE_COUNT)
 			break;
 	}
+	list_splice(&reprieved, head);
 	pthread_mutex_unlock(&mru->cm_mutex);
 
+	trace_libxfs_cache_shake(cache, priority, purge, count, reprieves);
+	if (reprieves)
+		uatomic_add(&cache->c_reprieves, reprieves);
 	if (count > 0) {
 		cache->bulkrelse(cache, &temp);
-
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= count;
-		pthread_mutex_unlock(&cache->c_mutex);
+		for (i = 0; i < CACHE_COUNT_SHARDS; i++)
+			if (freed[i])
+				cache_count_sub(cache, i, freed[i]);
+		uatomic_add(&cache->c_oneshot, oneshot);
+		uatomic_add(&cache->c_reused, count - oneshot);
 	}
 
 	return (count == CACHE_SHAKE_COUNT) ? priority : ++priority;
@@ -286,27 +530,16 @@ cache_shake(
 static struct cache_node *
 cache_node_allocate(
 	struct cache *		cache,
-	cache_key_t		key)
+	cache_key_t		key,
+	unsigned int		hashidx)
 {
-	unsigned int		nodesfree;
 	struct cache_node *	node;
 
-	pthread_mutex_lock(&cache->c_mutex);
-	nodesfree = (cache->c_count < cache->c_maxcount);
-	if (nodesfree) {
-		cache->c_count++;
-		if (cache->c_count > cache->c_max)
-			cache->c_max = cache->c_count;
-	}
-	cache->c_misses++;
-	pthread_mutex_unlock(&cache->c_mutex);
-	if (!nodesfree)
+	if (!cache_count_reserve(cache, hashidx))
 		return NULL;
 	node = cache->alloc(key);
 	if (node == NULL) {	/* uh-oh */
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
+		cache_count_sub(cache, hashidx, 1);
 		return NULL;
 	}
 	pthread_mutex_init(&node->cn_mutex, NULL);
@@ -314,6 +547,8 @@ cache_node_allocate(
 	node->cn_count = 1;
 	node->cn_priority = 0;
 	node->cn_old_priority = -1;
+	node->cn_reuse = 0;
+	node->cn_referenced = false;
 	return node;
 }
 
@@ -321,7 +556,43 @@ int
 cache_overflowed(
 	struct cache *		cache)
 {
-	return cache->c_maxcount == cache->c_max;
+	return uatomic_read(&cache->c_maxcount) == uatomic_read(&cache->c_max);
+}
+
+/*
+ * Lower the cache size limit to @maxcount nodes and reclaim clean nodes until
+ * the cache fits, or until nothing more can be reclaimed.  The high water
+ * mark comes down too, so that cache_overflowed() starts throttling callers
+ * at the new size.  The cache can still grow again if it fills up with nodes
+ * that cannot be reclaimed.
+ */
+void
+cache_shrink(
+	struct cache *		cache,
+	unsigned int		maxcount)
+{
+	unsigned int		old, prev;
+	unsigned int		priority = 0;
+
+	old = uatomic_read(&cache->c_maxcount);
+	while (maxcount < old) {
+		prev = uatomic_cmpxchg(&cache->c_maxcount, old, maxcount);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+
+	old = uatomic_read(&cache->c_max);
+	while (maxcount < old) {
+		prev = uatomic_cmpxchg(&cache->c_max, old, maxcount);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+
+	while (priority <= CACHE_MAX_PRIORITY &&
+	       cache_node_count(cache) > maxcount)
+		priority = cache_shake(cache, priority, false);
 }
 
 
@@ -359,6 +630,34 @@ __cache_node_purge(
 	return 0;
 }
 
+/*
+ * Take a reference to a node that we found in the hash table, pulling it off
+ * its MRU list if it was unreferenced.  Caller must hold the node lock.
+ */
+static void
+__cache_node_grab(
+	struct cache *		cache,
+	struct cache_node *	node)
+{
+	struct cache_mru *	mru;
+
+	if (node->cn_count == 0) {
+		ASSERT(node->cn_priority >= 0);
+		ASSERT(!list_empty(&node->cn_mru));
+		mru = &cache->c_mrus[node->cn_priority];
+		pthread_mutex_lock(&mru->cm_mutex);
+		mru->cm_count--;
+		list_del_init(&node->cn_mru);
+		pthread_mutex_unlock(&mru->cm_mutex);
+		if (node->cn_old_priority != -1) {
+			ASSERT(node->cn_priority == CACHE_DIRTY_PRIORITY);
+			node->cn_priority = node->cn_old_priority;
+			node->cn_old_priority = -1;
+		}
+	}
+	node->cn_count++;
+}
+
 /*
  * Lookup in the cache hash table.  With any luck we'll get a cache
  * hit, in which case this will all be over quickly and painlessly.
@@ -366,6 +665,10 @@ __cache_node_purge(
  * cache beyond the requested maximum size (shrink it if it would).
  * Returns one if hit in cache, otherwise zero.  A node is _always_
  * returned, however.
+ *
+ * The chain walk only takes the bucket lock shared, so lookups that hit the
+ * same bucket run concurrently.  If we find a node that has to be purged we
+ * retry the walk with the bucket lock held exclusively.
  */
 int
 cache_node_get(
@@ -375,20 +678,33 @@ cache_node_get(
 {
 	struct cache_node *	node = NULL;
 	struct cache_hash *	hash;
-	struct cache_mru *	mru;
 	struct list_head *	head;
 	struct list_head *	pos;
 	struct list_head *	n;
 	unsigned int		hashidx;
+	unsigned int		maxcount;
+	uint64_t		bloom;
 	int			priority = 0;
 	int			purged = 0;
+	bool			exclusive = false;
+	bool			skipped = false;
 
 	hashidx = cache->hash(key, cache->c_hashsize, cache->c_hashshift);
 	hash = cache->c_hash + hashidx;
 	head = &hash->ch_list;
+	bloom = cache_key_bloom(cache, key);
 
 	for (;;) {
-		pthread_mutex_lock(&hash->ch_mutex);
+		if (bloom && !cache_hash_may_contain(hash, bloom)) {
+			if (!skipped)
+				uatomic_inc(&hash->ch_skips);
+			skipped = true;
+			goto allocate;
+		}
+		if (exclusive)
+			pthread_rwlock_wrlock(&hash->ch_lock);
+		else
+			pthread_rwlock_rdlock(&hash->ch_lock);
 		for (pos = head->next, n = pos->next; pos != head;
 						pos = n, n = pos->next) {
 			int result;
@@ -399,10 +715,16 @@ cache_node_get(
 			case CACHE_HIT:
 				break;
 			case CACHE_PURGE:
-				if ((cache->c_flags & CACHE_MISCOMPARE_PURGE) &&
-				    !__cache_node_purge(cache, node)) {
+				if (!(cache->c_flags & CACHE_MISCOMPARE_PURGE))
+					goto next_object;
+				if (!exclusive) {
+					pthread_rwlock_unlock(&hash->ch_lock);
+					exclusive = true;
+					goto retry;
+				}
+				if (!__cache_node_purge(cache, node)) {
 					purged++;
-					hash->ch_count--;
+					cache_hash_removed(hash);
 				}
 				/* FALL THROUGH */
 			case CACHE_MISS:
@@ -414,41 +736,30 @@ cache_node_get(
 			 * from its MRU list, and update stats.
 			 */
 			pthread_mutex_lock(&node->cn_mutex);
-
-			if (node->cn_count == 0) {
-				ASSERT(node->cn_priority >= 0);
-				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
-				pthread_mutex_lock(&mru->cm_mutex);
-				mru->cm_count--;
-				list_del_init(&node->cn_mru);
-				pthread_mutex_unlock(&mru->cm_mutex);
-				if (node->cn_old_priority != -1) {
-					ASSERT(node->cn_priority ==
-							CACHE_DIRTY_PRIORITY);
-					node->cn_priority = node->cn_old_priority;
-					node->cn_old_priority = -1;
-				}
-			}
-			node->cn_count++;
+			__cache_node_grab(cache, node);
+			node->cn_reuse++;
+			node->cn_referenced = true;
 
 			pthread_mutex_unlock(&node->cn_mutex);
-			pthread_mutex_unlock(&hash->ch_mutex);
+			pthread_rwlock_unlock(&hash->ch_lock);
 
-			pthread_mutex_lock(&cache->c_mutex);
-			cache->c_hits++;
-			pthread_mutex_unlock(&cache->c_mutex);
+			uatomic_inc(&hash->ch_hits);
+			trace_libxfs_cache_hit(cache, node, hashidx);
+			if (purged)
+				cache_count_sub(cache, hashidx, purged);
 
 			*nodep = node;
 			return 0;
 next_object:
 			continue;	/* what the hell, gcc? */
 		}
-		pthread_mutex_unlock(&hash->ch_mutex);
+		pthread_rwlock_unlock(&hash->ch_lock);
+allocate:
 		/*
 		 * not found, allocate a new entry
 		 */
-		node = cache_node_allocate(cache, key);
+		maxcount = uatomic_read(&cache->c_maxcount);
+		node = cache_node_allocate(cache, key, hashidx);
 		if (node)
 			break;
 		priority = cache_shake(cache, priority, false);
@@ -459,23 +770,23 @@ next_object:
 		 */
 		if (priority > CACHE_MAX_PRIORITY) {
 			priority = 0;
-			cache_expand(cache);
+			cache_expand(cache, maxcount);
 		}
+retry:
+		continue;
 	}
 
 	node->cn_hashidx = hashidx;
 
 	/* add new node to appropriate hash */
-	pthread_mutex_lock(&hash->ch_mutex);
-	hash->ch_count++;
-	list_add(&node->cn_hash, &hash->ch_list);
-	pthread_mutex_unlock(&hash->ch_mutex);
+	pthread_rwlock_wrlock(&hash->ch_lock);
+	cache_hash_add(hash, node, bloom);
+	pthread_rwlock_unlock(&hash->ch_lock);
 
-	if (purged) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= purged;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
+	uatomic_inc(&hash->ch_misses);
+	trace_libxfs_cache_miss(cache, node, hashidx);
+	if (purged)
+		cache_count_sub(cache, hashidx, purged);
 
 	*nodep = node;
 	return 1;
@@ -508,7 +819,7 @@ cache_node_put(
 		mru = &cache->c_mrus[node->cn_priority];
 		pthread_mutex_lock(&mru->cm_mutex);
 		mru->cm_count++;
-		list_add(&node->cn_mru, &mru->cm_list);
+		cache->c_policy->insert(mru, node);
 		pthread_mutex_unlock(&mru->cm_mutex);
 	}
 
@@ -560,12 +871,13 @@ cache_node_purge(
 	struct list_head *	pos;
 	struct list_head *	n;
 	struct cache_hash *	hash;
+	unsigned int		hashidx;
 	int			count = -1;
 
-	hash = cache->c_hash + cache->hash(key, cache->c_hashsize,
-					   cache->c_hashshift);
+	hashidx = cache->hash(key, cache->c_hashsize, cache->c_hashshift);
+	hash = cache->c_hash + hashidx;
 	head = &hash->ch_list;
-	pthread_mutex_lock(&hash->ch_mutex);
+	pthread_rwlock_wrlock(&hash->ch_lock);
 	for (pos = head->next, n = pos->next; pos != head;
 						pos = n, n = pos->next) {
 		if ((struct cache_node *)pos != node)
@@ -573,16 +885,13 @@ cache_node_purge(
 
 		count = __cache_node_purge(cache, node);
 		if (!count)
-			hash->ch_count--;
+			cache_hash_removed(hash);
 		break;
 	}
-	pthread_mutex_unlock(&hash->ch_mutex);
+	pthread_rwlock_unlock(&hash->ch_lock);
 
-	if (count == 0) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
+	if (count == 0)
+		cache_count_sub(cache, hashidx, 1);
 #ifdef CACHE_DEBUG
 	if (count >= 1) {
 		fprintf(stderr, "%s: refcount was %u, not zero (node=%p)\n",
@@ -611,16 +920,86 @@ cache_purge(
 		cache_shake(cache, i, true);
 
 #ifdef CACHE_DEBUG
-	if (cache->c_count != 0) {
+	if (cache_node_count(cache) != 0) {
 		/* flush referenced nodes to disk */
 		cache_flush(cache);
 		fprintf(stderr, "%s: shake on cache %p left %u nodes!?\n",
-				__FUNCTION__, cache, cache->c_count);
+				__FUNCTION__, cache, cache_node_count(cache));
 		cache_abort();
 	}
 #endif
 }
 
+/*
+ * Gather up all the dirty nodes in the cache and hand them to the bulk flush
+ * routine in one go, so that it can sort and merge the writes.  Each node is
+ * referenced while it sits in the array so that it can't be reclaimed before
+ * it has been written.  Returns false if we couldn't allocate enough memory
+ * to gather everything, in which case the caller should flush whatever is
+ * left one node at a time.
+ */
+#define CACHE_FLUSH_BATCH	1024
+
+static bool
+cache_bulk_flush(
+	struct cache *		cache)
+{
+	struct cache_hash *	hash;
+	struct list_head *	head;
+	struct list_head *	pos;
+	struct cache_node *	node;
+	struct cache_node **	nodes;
+	struct cache_node **	n;
+	unsigned int		nr = 0;
+	unsigned int		size = CACHE_FLUSH_BATCH;
+	unsigned int		i;
+	bool			done = true;
+
+	nodes = malloc(size * sizeof(struct cache_node *));
+	if (!nodes)
+		return false;
+
+	for (i = 0; i < cache->c_hashsize; i++) {
+		hash = &cache->c_hash[i];
+
+		pthread_rwlock_rdlock(&hash->ch_lock);
+		head = &hash->ch_list;
+		for (pos = head->next; pos != head; pos = pos->next) {
+			node = (struct cache_node *)pos;
+			pthread_mutex_lock(&node->cn_mutex);
+			if (!cache->dirty(node)) {
+				pthread_mutex_unlock(&node->cn_mutex);
+				continue;
+			}
+			if (nr == size) {
+				n = realloc(nodes, 2 * size *
+						sizeof(struct cache_node *));
+				if (!n) {
+					/* write what we have so far */
+					pthread_mutex_unlock(&node->cn_mutex);
+					pthread_rwlock_unlock(&hash->ch_lock);
+					done = false;
+					goto flush;
+				}
+				nodes = n;
+				size *= 2;
+			}
+			__cache_node_grab(cache, node);
+			nodes[nr++] = node;
+			pthread_mutex_unlock(&node->cn_mutex);
+		}
+		pthread_rwlock_unlock(&hash->ch_lock);
+	}
+
+flush:
+	if (nr)
+		cache->bulkflush(cache, nodes, nr);
+	for (i = 0; i < nr; i++)
+		cache_node_put(cache, nodes[i]);
+	free(nodes);
+	return done;
+}
+
 /*
  * Flush all nodes in the cache to disk.
  */
@@ -637,10 +1016,13 @@ cache_flush(
 	if (!cache->flush)
 		return;
 
+	if (cache->bulkflush && cache_bulk_flush(cache))
+		return;
+
 	for (i = 0; i < cache->c_hashsize; i++) {
 		hash = &cache->c_hash[i];
 
-		pthread_mutex_lock(&hash->ch_mutex);
+		pthread_rwlock_rdlock(&hash->ch_lock);
 		head = &hash->ch_list;
 		for (pos = head->next; pos != head; pos = pos->next) {
 			node = (struct cache_node *)pos;
@@ -648,7 +1030,23 @@ cache_flush(
 			cache->flush(node);
 			pthread_mutex_unlock(&node->cn_mutex);
 		}
-		pthread_mutex_unlock(&hash->ch_mutex);
+		pthread_rwlock_unlock(&hash->ch_lock);
+	}
+}
+
+/* Sum the lookup hits and misses over all the hash buckets. */
+void
+cache_hit_stats(
+	struct cache		*cache,
+	unsigned long long	*hits,
+	unsigned long long	*misses)
+{
+	int			i;
+
+	*hits = *misses = 0;
+	for (i = 0; i < cache->c_hashsize; i++) {
+		*hits += uatomic_read(&cache->c_hash[i].ch_hits);
+		*misses += uatomic_read(&cache->c_hash[i].ch_misses);
 	}
 }
 
@@ -662,12 +1060,18 @@ cache_report(
 	int		i;
 	unsigned long	count, index, total;
 	unsigned long	hash_bucket_lengths[HASH_REPORT + 2];
+	unsigned int	nodes = cache_node_count(cache);
+	unsigned long long hits, misses, skips = 0;
 
-	if ((cache->c_hits + cache->c_misses) == 0)
+	cache_hit_stats(cache, &hits, &misses);
+	if ((hits + misses) == 0)
 		return;
+	for (i = 0; i < cache->c_hashsize; i++)
+		skips += uatomic_read(&cache->c_hash[i].ch_skips);
 
 	/* report cache summary */
 	fprintf(fp, "%s: %p\n"
+			"Replacement policy = %s\n"
 			"Max supported entries = %u\n"
 			"Max utilized entries = %u\n"
 			"Active entries = %u\n"
@@ -676,25 +1080,36 @@ cache_report(
 			"Misses = %llu\n"
 			"Hit ratio = %5.2f\n",
 			name, cache,
+			cache->c_policy->name,
 			cache->c_maxcount,
 			cache->c_max,
-			cache->c_count,
+			nodes,
 			cache->c_hashsize,
-			cache->c_hits,
-			cache->c_misses,
-			(double)cache->c_hits * 100 /
-				(cache->c_hits + cache->c_misses)
+			hits,
+			misses,
+			(double)hits * 100 / (hits + misses)
 	);
 
+	if (cache->fingerprint)
+		fprintf(fp, "Misses skipping chain walk = %llu (%5.2f%%)\n",
+				skips, misses ? (double)skips * 100 / misses : 0.0);
+
+	fprintf(fp, "Reclaimed one-shot entries = %lu\n"
+			"Reclaimed reused entries = %lu\n"
+			"Reclaims deferred by policy = %lu\n",
+			uatomic_read(&cache->c_oneshot),
+			uatomic_read(&cache->c_reused),
+			uatomic_read(&cache->c_reprieves));
+
 	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
 		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
 			i, cache->c_mrus[i].cm_count,
-			cache->c_mrus[i].cm_count * 100 / cache->c_count);
+			cache->c_mrus[i].cm_count * 100 / nodes);
 
 	i = CACHE_DIRTY_PRIORITY;
 	fprintf(fp, "Dirty MRU %d entries = %6u (%3u%%)\n",
 		i, cache->c_mrus[i].cm_count,
-		cache->c_mrus[i].cm_count * 100 / cache->c_count);
+		cache->c_mrus[i].cm_count * 100 / nodes);
 
 	/* report hash bucket lengths */
 	bzero(hash_bucket_lengths, sizeof(hash_bucket_lengths));
@@ -715,10 +1130,10 @@ cache_report(
 			continue;
 		fprintf(fp, "Hash buckets with  %2d entries %6ld (%3ld%%)\n",
 			i, hash_bucket_lengths[i],
-			(i * hash_bucket_lengths[i] * 100) / cache->c_count);
+			(i * hash_bucket_lengths[i] * 100) / nodes);
 	}
 	if (hash_bucket_lengths[i])	/* last report bucket is the overflow bucket */
 		fprintf(fp, "Hash buckets with >%2d entries %6ld (%3ld%%)\n",
 			i - 1, hash_bucket_lengths[i],
-			((cache->c_count - total) * 100) / cache->c_count);
+			((nodes - total) * 100) / nodes);
 }
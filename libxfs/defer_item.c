@@ -42,6 +42,17 @@ xfs_extent_free_diff_items(
 		XFS_FSB_TO_AGNO(mp, rb->xefi_startblock);
 }
 
+static xfs_agnumber_t
+xfs_extent_free_item_agno(
+	struct xfs_mount		*mp,
+	struct list_head		*item)
+{
+	struct xfs_extent_free_item	*free;
+
+	free = container_of(item, struct xfs_extent_free_item, xefi_list);
+	return XFS_FSB_TO_AGNO(mp, free->xefi_startblock);
+}
+
 /* Get an EFI. */
 static struct xfs_log_item *
 xfs_extent_free_create_intent(
@@ -115,6 +126,7 @@ const struct xfs_defer_op_type xfs_extent_free_defer_type = {
 	.create_done	= xfs_extent_free_create_done,
 	.finish_item	= xfs_extent_free_finish_item,
 	.cancel_item	= xfs_extent_free_cancel_item,
+	.item_agno	= xfs_extent_free_item_agno,
 };
 
 /*
@@ -156,6 +168,7 @@ const struct xfs_defer_op_type xfs_agfl_free_defer_type = {
 	.create_done	= xfs_extent_free_create_done,
 	.finish_item	= xfs_agfl_free_finish_item,
 	.cancel_item	= xfs_extent_free_cancel_item,
+	.item_agno	= xfs_extent_free_item_agno,
 };
 
 /* Reverse Mapping */
@@ -177,6 +190,17 @@ xfs_rmap_update_diff_items(
 		XFS_FSB_TO_AGNO(mp, rb->ri_bmap.br_startblock);
 }
 
+static xfs_agnumber_t
+xfs_rmap_update_item_agno(
+	struct xfs_mount		*mp,
+	struct list_head		*item)
+{
+	struct xfs_rmap_intent		*rmap;
+
+	rmap = container_of(item, struct xfs_rmap_intent, ri_list);
+	return XFS_FSB_TO_AGNO(mp, rmap->ri_bmap.br_startblock);
+}
+
 /* Get an RUI. */
 static struct xfs_log_item *
 xfs_rmap_update_create_intent(
@@ -251,6 +275,7 @@ const struct xfs_defer_op_type xfs_rmap_update_defer_type = {
 	.finish_item	= xfs_rmap_update_finish_item,
 	.finish_cleanup = xfs_rmap_finish_one_cleanup,
 	.cancel_item	= xfs_rmap_update_cancel_item,
+	.item_agno	= xfs_rmap_update_item_agno,
 };
 
 /* Reference Counting */
@@ -272,6 +297,17 @@ xfs_refcount_update_diff_items(
 		XFS_FSB_TO_AGNO(mp, rb->ri_startblock);
 }
 
+static xfs_agnumber_t
+xfs_refcount_update_item_agno(
+	struct xfs_mount		*mp,
+	struct list_head		*item)
+{
+	struct xfs_refcount_intent	*refc;
+
+	refc = container_of(item, struct xfs_refcount_intent, ri_list);
+	return XFS_FSB_TO_AGNO(mp, refc->ri_startblock);
+}
+
 /* Get an CUI. */
 static struct xfs_log_item *
 xfs_refcount_update_create_intent(
@@ -354,6 +390,7 @@ const struct xfs_defer_op_type xfs_refcount_update_defer_type = {
 	.finish_item	= xfs_refcount_update_finish_item,
 	.finish_cleanup = xfs_refcount_finish_one_cleanup,
 	.cancel_item	= xfs_refcount_update_cancel_item,
+	.item_agno	= xfs_refcount_update_item_agno,
 };
 
 /* Inode Block Mapping */
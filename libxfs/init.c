@@ -294,6 +294,62 @@ libxfs_close_devices(
 	li->dfd = li->logfd = li->rtfd = -1;
 }
 
+enum libxfs_buf_arena_opts {
+	BA_OFF = 0,
+	BA_HUGEPAGES,
+	BA_MAX_OPTS,
+};
+
+static char *ba_opts[] = {
+	[BA_OFF]		= "off",
+	[BA_HUGEPAGES]		= "hugepages",
+	[BA_MAX_OPTS]		= NULL,
+};
+
+/*
+ * Set up the buffer body arena.  LIBXFS_BUF_ARENA=off goes back to allocating
+ * each buffer separately, and "hugepages" backs the arena with transparent
+ * huge pages.
+ */
+static void
+libxfs_buf_arena_setup(void)
+{
+	char			*p = getenv("LIBXFS_BUF_ARENA");
+	bool			hugepages = false;
+
+	while (p && *p) {
+		char *val;
+
+		switch (getsubopt(&p, ba_opts, &val)) {
+		case BA_OFF:
+			return;
+		case BA_HUGEPAGES:
+			hugepages = true;
+			break;
+		default:
+			fprintf(stderr, _("unknown buffer arena option %s\n"),
+					val);
+			exit(1);
+			break;
+		}
+	}
+
+	libxfs_buf_arena_init(hugepages);
+}
+
+/*
+ * LIBXFS_VERIFY_THREADS=N runs the read verifiers for blocks brought in by
+ * readahead on a pool of N threads as soon as the read completes.
+ */
+static void
+libxfs_verify_offload_setup(void)
+{
+	char			*p = getenv("LIBXFS_VERIFY_THREADS");
+
+	if (p)
+		libxfs_buf_verify_offload(strtoul(p, NULL, 0));
+}
+
 /*
  * libxfs initialization.
  * Caller gets a 0 on failure (and we print a message), 1 on success.
@@ -407,6 +463,8 @@ libxfs_init(libxfs_init_t *a)
 	}
 	if (!libxfs_bhash_size)
 		libxfs_bhash_size = LIBXFS_BHASHSIZE(sbp);
+	libxfs_buf_arena_setup();
+	libxfs_verify_offload_setup();
 	libxfs_bcache = cache_init(a->bcache_flags, libxfs_bhash_size,
 				   &libxfs_bcache_operations);
 	use_xfs_buf_lock = a->usebuflock;
@@ -588,11 +646,72 @@ xfs_set_inode_alloc(
 	return xfs_is_inode32(mp) ? maxagi : agcount;
 }
 
+enum libxfs_io_engine_nums {
+	IOE_URING = 0,
+	IOE_DEPTH,
+	IOE_POLL,
+	IOE_MAX_OPTS,
+};
+
+static char *ioe_opts[] = {
+	[IOE_URING]		= "uring",
+	[IOE_DEPTH]		= "depth",
+	[IOE_POLL]		= "poll",
+	[IOE_MAX_OPTS]		= NULL,
+};
+
+/*
+ * Pick the I/O engine for the buffer targets.  LIBXFS_IO_ENGINE takes a
+ * comma separated list: "uring" turns on io_uring submission, "depth=N" sets
+ * the per-thread ring size and "poll" asks for polled completions (which only
+ * works for O_DIRECT I/O to devices that support it).  Returns the buftarg
+ * flags to set.
+ */
+static unsigned int
+libxfs_buftarg_io_engine(void)
+{
+	char			*p = getenv("LIBXFS_IO_ENGINE");
+	unsigned int		flags = 0;
+	unsigned int		depth = 0;
+	bool			poll = false;
+
+	while (p && *p) {
+		char *val;
+
+		switch (getsubopt(&p, ioe_opts, &val)) {
+		case IOE_URING:
+			flags |= XFS_BUFTARG_IORING;
+			break;
+		case IOE_DEPTH:
+			if (!val) {
+				fprintf(stderr,
+		_("io engine depth requires a parameter\n"));
+				exit(1);
+			}
+			depth = strtoul(val, NULL, 0);
+			break;
+		case IOE_POLL:
+			poll = true;
+			break;
+		default:
+			fprintf(stderr, _("unknown io engine option %s\n"),
+					val);
+			exit(1);
+			break;
+		}
+	}
+
+	if (flags & XFS_BUFTARG_IORING)
+		libxfs_buftarg_ioring_config(depth, poll);
+	return flags;
+}
+
 static struct xfs_buftarg *
 libxfs_buftarg_alloc(
 	struct xfs_mount	*mp,
 	dev_t			dev,
-	unsigned long		write_fails)
+	unsigned long		write_fails,
+	unsigned int		ioflags)
 {
 	struct xfs_buftarg	*btp;
 
@@ -604,7 +723,7 @@ libxfs_buftarg_alloc(
 	}
 	btp->bt_mount = mp;
 	btp->bt_bdev = dev;
-	btp->flags = 0;
+	btp->flags = ioflags;
 	if (write_fails) {
 		btp->writes_left = write_fails;
 		btp->flags |= XFS_BUFTARG_INJECT_WRITE_FAIL;
@@ -637,6 +756,7 @@ libxfs_buftarg_init(
 {
 	char			*p = getenv("LIBXFS_DEBUG_WRITE_CRASH");
 	unsigned long		dfail = 0, lfail = 0, rfail = 0;
+	unsigned int		ioflags;
 
 	/* Simulate utility crash after a certain number of writes. */
 	while (p && *p) {
@@ -708,12 +828,14 @@ libxfs_buftarg_init(
 		return;
 	}
 
-	mp->m_ddev_targp = libxfs_buftarg_alloc(mp, dev, dfail);
+	ioflags = libxfs_buftarg_io_engine();
+	mp->m_ddev_targp = libxfs_buftarg_alloc(mp, dev, dfail, ioflags);
 	if (!logdev || logdev == dev)
 		mp->m_logdev_targp = mp->m_ddev_targp;
 	else
-		mp->m_logdev_targp = libxfs_buftarg_alloc(mp, logdev, lfail);
-	mp->m_rtdev_targp = libxfs_buftarg_alloc(mp, rtdev, rfail);
+		mp->m_logdev_targp = libxfs_buftarg_alloc(mp, logdev, lfail,
+				ioflags);
+	mp->m_rtdev_targp = libxfs_buftarg_alloc(mp, rtdev, rfail, ioflags);
 }
 
 /* Compute maximum possible height for per-AG btree types for this fs. */
@@ -757,6 +879,7 @@ libxfs_mount(
 	mp->m_finobt_nores = true;
 	xfs_set_inode32(mp);
 	mp->m_sb = *sb;
+	libxfs_bcache_stats_init(sb->sb_agcount);
 	INIT_RADIX_TREE(&mp->m_perag_tree, GFP_KERNEL);
 	sbp = &mp->m_sb;
 	spin_lock_init(&mp->m_sb_lock);
@@ -999,6 +1122,7 @@ libxfs_umount(
 	int			error;
 
 	libxfs_rtmount_destroy(mp);
+	libxfs_icache_purge(mp);
 
 	/*
 	 * Purge the buffer cache to write all dirty buffers to disk and free
@@ -1035,6 +1159,7 @@ libxfs_destroy(
 {
 	int			leaked;
 
+	libxfs_buf_readahead_destroy();
 	libxfs_close_devices(li);
 
 	/* Free everything from the buffer cache before freeing buffer cache */
@@ -1060,6 +1185,8 @@ libxfs_report(FILE *fp)
 	char *c;
 
 	cache_report(fp, "libxfs_bcache", libxfs_bcache);
+	libxfs_bcache_stats_report(fp);
+	libxfs_buf_arena_report(fp);
 
 	t = time(NULL);
 	c = asctime(localtime(&t));
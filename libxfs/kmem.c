@@ -6,6 +6,140 @@
 /*
  * Simple memory interface
  */
+
+/*
+ * Cache units are allocated one at a time from malloc, but freed units are
+ * kept for reuse instead of being handed straight back.  Each thread has a
+ * small pool of free units per cache that it allocates from and frees to
+ * without any locking.  When a thread's pool runs dry it takes a batch of
+ * units from the cache's depot, and when it fills up it hands a batch back,
+ * so units freed by one thread can be reused by another.  Only when the
+ * depot is empty do we call malloc, and only when it is full do we free.
+ *
+ * Thread pools are indexed by a generation number each cache gets when it
+ * is created.  A pool still holding units for a destroyed cache is emptied
+ * when a newer cache claims its slot; since every unit came from malloc,
+ * it can always be freed without knowing which cache it belonged to.
+ */
+#define KMEM_POOL_CACHES	64	/* pool slots per thread */
+#define KMEM_POOL_MAX		64	/* free units in one thread pool */
+#define KMEM_POOL_BATCH		(KMEM_POOL_MAX / 2) /* units moved to/from depot */
+#define KMEM_DEPOT_MAX		1024	/* free units kept by each depot */
+
+struct kmem_pool {
+	unsigned int		gen;
+	unsigned int		nr;
+	void			*free;	/* chained through the first word */
+};
+
+static __thread struct kmem_pool	kmem_pools[KMEM_POOL_CACHES];
+static unsigned int			kmem_cache_gen;
+static pthread_key_t			kmem_pool_key;
+static pthread_once_t			kmem_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+kmem_free_units(
+	void			*ptr)
+{
+	void			*next;
+
+	for (; ptr; ptr = next) {
+		next = *(void **)ptr;
+		free(ptr);
+	}
+}
+
+/* Give a thread's pooled units back to malloc when the thread exits. */
+static void
+kmem_pool_exit(
+	void			*arg)
+{
+	struct kmem_pool	*pools = arg;
+	int			i;
+
+	for (i = 0; i < KMEM_POOL_CACHES; i++) {
+		kmem_free_units(pools[i].free);
+		memset(&pools[i], 0, sizeof(pools[i]));
+	}
+}
+
+static void
+kmem_pool_key_init(void)
+{
+	pthread_key_create(&kmem_pool_key, kmem_pool_exit);
+}
+
+static struct kmem_pool *
+kmem_pool(
+	struct kmem_cache	*cache)
+{
+	struct kmem_pool	*pool = &kmem_pools[cache->gen % KMEM_POOL_CACHES];
+
+	if (pool->gen != cache->gen) {
+		kmem_free_units(pool->free);
+		pool->free = NULL;
+		pool->nr = 0;
+		pool->gen = cache->gen;
+
+		pthread_once(&kmem_pool_once, kmem_pool_key_init);
+		pthread_setspecific(kmem_pool_key, kmem_pools);
+	}
+	return pool;
+}
+
+/* Refill an empty thread pool from the depot. */
+static void
+kmem_depot_get(
+	struct kmem_cache	*cache,
+	struct kmem_pool	*pool)
+{
+	void			*ptr;
+
+	pthread_mutex_lock(&cache->depot_lock);
+	while (cache->depot && pool->nr < KMEM_POOL_BATCH) {
+		ptr = cache->depot;
+		cache->depot = *(void **)ptr;
+		cache->depot_nr--;
+		*(void **)ptr = pool->free;
+		pool->free = ptr;
+		pool->nr++;
+	}
+	if (pool->nr)
+		cache->nr_depot_gets++;
+	pthread_mutex_unlock(&cache->depot_lock);
+}
+
+/* Move a batch of units out of a full thread pool into the depot. */
+static void
+kmem_depot_put(
+	struct kmem_cache	*cache,
+	struct kmem_pool	*pool)
+{
+	void			*head = pool->free;
+	void			*tail = head;
+	int			i;
+
+	for (i = 1; i < KMEM_POOL_BATCH; i++)
+		tail = *(void **)tail;
+	pool->free = *(void **)tail;
+	pool->nr -= KMEM_POOL_BATCH;
+
+	pthread_mutex_lock(&cache->depot_lock);
+	if (cache->depot_nr + KMEM_POOL_BATCH <= KMEM_DEPOT_MAX) {
+		*(void **)tail = cache->depot;
+		cache->depot = head;
+		cache->depot_nr += KMEM_POOL_BATCH;
+		cache->nr_depot_puts++;
+		head = NULL;
+	}
+	pthread_mutex_unlock(&cache->depot_lock);
+
+	if (head) {
+		*(void **)tail = NULL;
+		kmem_free_units(head);
+	}
+}
+
 struct kmem_cache *
 kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 		unsigned int slab_flags, void (*ctor)(void *))
@@ -18,11 +152,18 @@ kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 			strerror(errno));
 		exit(1);
 	}
-	ptr->cache_unitsize = size;
+	memset(ptr, 0, sizeof(*ptr));
+	/* free units are chained through their first word */
+	ptr->cache_unitsize = max_t(unsigned int, size, sizeof(void *));
 	ptr->cache_name = name;
 	ptr->allocated = 0;
 	ptr->align = align;
 	ptr->ctor = ctor;
+	ptr->gen = __atomic_add_fetch(&kmem_cache_gen, 1, __ATOMIC_RELAXED);
+	if (!(ptr->gen % KMEM_POOL_CACHES))
+		ptr->gen = __atomic_add_fetch(&kmem_cache_gen, 1,
+				__ATOMIC_RELAXED);
+	pthread_mutex_init(&ptr->depot_lock, NULL);
 
 	return ptr;
 }
@@ -30,13 +171,30 @@ kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 int
 kmem_cache_destroy(struct kmem_cache *cache)
 {
+	struct kmem_pool *pool = &kmem_pools[cache->gen % KMEM_POOL_CACHES];
 	int	leaked = 0;
 
+	if (pool->gen == cache->gen) {
+		kmem_free_units(pool->free);
+		memset(pool, 0, sizeof(*pool));
+	}
+	kmem_free_units(cache->depot);
+
+	if (getenv("LIBXFS_KMEM_STATS"))
+		fprintf(stderr,
+	"cache %s: %llu allocs, %llu mallocs, %llu depot gets, %llu depot puts\n",
+				cache->cache_name,
+				(unsigned long long)cache->nr_allocs,
+				(unsigned long long)cache->nr_mallocs,
+				(unsigned long long)cache->nr_depot_gets,
+				(unsigned long long)cache->nr_depot_puts);
+
 	if (getenv("LIBXFS_LEAK_CHECK") && cache->allocated) {
 		leaked = 1;
 		fprintf(stderr, "cache %s freed with %d items allocated\n",
 				cache->cache_name, cache->allocated);
 	}
+	pthread_mutex_destroy(&cache->depot_lock);
 	free(cache);
 	return leaked;
 }
@@ -44,18 +202,47 @@ kmem_cache_destroy(struct kmem_cache *cache)
 void *
 kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
 {
-	void	*ptr = malloc(cache->cache_unitsize);
+	struct kmem_pool	*pool = kmem_pool(cache);
+	void			*ptr;
 
-	if (ptr == NULL) {
-		fprintf(stderr, _("%s: cache alloc failed (%s, %d bytes): %s\n"),
-			progname, cache->cache_name, cache->cache_unitsize,
-			strerror(errno));
-		exit(1);
+	if (!pool->free)
+		kmem_depot_get(cache, pool);
+	if (pool->free) {
+		ptr = pool->free;
+		pool->free = *(void **)ptr;
+		pool->nr--;
+	} else {
+		if (cache->align > 2 * sizeof(void *))
+			ptr = memalign(cache->align, cache->cache_unitsize);
+		else
+			ptr = malloc(cache->cache_unitsize);
+		if (ptr == NULL) {
+			fprintf(stderr,
+				_("%s: cache alloc failed (%s, %d bytes): %s\n"),
+				progname, cache->cache_name,
+				cache->cache_unitsize, strerror(errno));
+			exit(1);
+		}
+		__atomic_add_fetch(&cache->nr_mallocs, 1, __ATOMIC_RELAXED);
 	}
+	__atomic_add_fetch(&cache->nr_allocs, 1, __ATOMIC_RELAXED);
 	cache->allocated++;
 	return ptr;
 }
 
+void
+kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	struct kmem_pool	*pool = kmem_pool(cache);
+
+	cache->allocated--;
+	if (pool->nr >= KMEM_POOL_MAX)
+		kmem_depot_put(cache, pool);
+	*(void **)ptr = pool->free;
+	pool->free = ptr;
+	pool->nr++;
+}
+
 void *
 kmem_cache_zalloc(struct kmem_cache *cache, gfp_t flags)
 {
@@ -34,6 +34,8 @@ struct xfs_buftarg {
 #define XFS_BUFTARG_CORRUPT_WRITE	(1 << 1)
 /* Simulate failure after a certain number of writes. */
 #define XFS_BUFTARG_INJECT_WRITE_FAIL	(1 << 2)
+/* Issue I/O through io_uring instead of pread/pwrite. */
+#define XFS_BUFTARG_IORING		(1 << 3)
 
 /* Simulate the system crashing after a certain number of writes. */
 static inline void
@@ -54,6 +56,54 @@ extern void	libxfs_buftarg_init(struct xfs_mount *mp, dev_t ddev,
 				    dev_t logdev, dev_t rtdev);
 int libxfs_blkdev_issue_flush(struct xfs_buftarg *btp);
 
+/*
+ * One raw I/O in a batch handed to libxfs_buftarg_rw().  The whole batch is
+ * submitted at once if the target uses io_uring; bio_error is set for each
+ * element and the first error encountered is returned.  If bio_iov is set the
+ * I/O is vectored and bio_buf is ignored; bio_len must still be the total
+ * length of the I/O.
+ */
+struct xfs_buftarg_io {
+	void			*bio_buf;
+	struct iovec		*bio_iov;
+	int			bio_iovcnt;
+	size_t			bio_len;
+	off64_t			bio_offset;
+	int			bio_error;
+};
+
+int libxfs_buftarg_rw(struct xfs_buftarg *btp, struct xfs_buftarg_io *io,
+		unsigned int nr, bool write);
+void libxfs_buftarg_ioring_config(unsigned int depth, bool poll);
+
+/* I/O completed through the buftargs (or reported with libxfs_io_account) */
+struct libxfs_io_stats {
+	uint64_t		reads;
+	uint64_t		read_bytes;
+	uint64_t		writes;
+	uint64_t		write_bytes;
+};
+
+void libxfs_io_account(bool write, size_t len);
+void libxfs_io_stats(struct libxfs_io_stats *stats, bool this_thread);
+
+/* Buffer cache activity broken down by verifier; see rdwr.c */
+struct libxfs_bcache_type_stats {
+	const char		*name;		/* verifier name */
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+	uint64_t		ra_reads;	/* blocks read by readahead */
+	uint64_t		ra_wasted;	/* ...and thrown away unused */
+};
+
+unsigned int libxfs_bcache_type_stats(struct libxfs_bcache_type_stats *st,
+		unsigned int nr);
+uint64_t libxfs_bcache_ag_reads(xfs_agnumber_t agno);
+void libxfs_bcache_stats_init(xfs_agnumber_t agcount);
+void libxfs_bcache_stats_reset(void);
+void libxfs_bcache_stats_report(FILE *fp);
+
 #define LIBXFS_BBTOOFF64(bbs)	(((xfs_off_t)(bbs)) << BBSHIFT)
 
 #define XB_PAGES        2
@@ -91,11 +141,16 @@ struct xfs_buf {
 	void			*b_addr;
 	int			b_error;
 	const struct xfs_buf_ops *b_ops;
+	const struct xfs_buf_ops *b_verify_ops;	/* offloaded verifier run */
+	int			b_verify_error;	/* ...and its outcome */
+	const struct xfs_buf_ops *b_ra_ops;	/* readahead's verifier */
 	struct xfs_perag	*b_pag;
 	struct xfs_mount	*b_mount;
 	struct xfs_buf_map	*b_maps;
 	struct xfs_buf_map	__b_map;
 	int			b_nmaps;
+	unsigned int		b_addr_len;	/* bytes allocated at b_addr */
+	unsigned long		b_cksum_offset;	/* deferred crc location */
 	struct list_head	b_list;
 };
 
@@ -108,6 +163,10 @@ bool xfs_verify_magic16(struct xfs_buf *bp, __be16 dmagic);
 #define LIBXFS_B_UPTODATE	0x0008	/* buffer is sync'd to disk */
 #define LIBXFS_B_DISCONTIG	0x0010	/* discontiguous buffer */
 #define LIBXFS_B_UNCHECKED	0x0020	/* needs verification */
+#define LIBXFS_B_READAHEAD	0x0040	/* background read/verify running */
+#define LIBXFS_B_CKSUM_DEFER	0x0080	/* write verifier may defer crc */
+#define LIBXFS_B_CKSUM_PENDING	0x0100	/* crc deferred to b_cksum_offset */
+#define LIBXFS_B_RA_UNUSED	0x0200	/* readahead, not yet read by anyone */
 
 typedef unsigned int xfs_buf_flags_t;
 
@@ -150,6 +209,14 @@ extern struct cache_operations	libxfs_bcache_operations;
 int libxfs_buf_read_map(struct xfs_buftarg *btp, struct xfs_buf_map *maps,
 			int nmaps, int flags, struct xfs_buf **bpp,
 			const struct xfs_buf_ops *ops);
+void libxfs_buf_readahead_map(struct xfs_buftarg *btp,
+			struct xfs_buf_map *maps, int nmaps,
+			const struct xfs_buf_ops *ops);
+void libxfs_buf_readahead_drain(void);
+bool libxfs_buf_prime(struct xfs_buftarg *btp, xfs_daddr_t blkno,
+			size_t numblks, const void *data);
+void libxfs_buf_verify_offload(unsigned int nr_threads);
+void libxfs_buf_readahead_destroy(void);
 void libxfs_buf_mark_dirty(struct xfs_buf *bp);
 int libxfs_buf_get_map(struct xfs_buftarg *btp, struct xfs_buf_map *maps,
 			int nmaps, int flags, struct xfs_buf **bpp);
@@ -181,12 +248,36 @@ libxfs_buf_read(
 	return libxfs_buf_read_map(target, &map, 1, flags, bpp, ops);
 }
 
+static inline void
+libxfs_buf_readahead(
+	struct xfs_buftarg	*target,
+	xfs_daddr_t		blkno,
+	size_t			numblks,
+	const struct xfs_buf_ops *ops)
+{
+	DEFINE_SINGLE_BUF_MAP(map, blkno, numblks);
+
+	libxfs_buf_readahead_map(target, &map, 1, ops);
+}
+
 int libxfs_readbuf_verify(struct xfs_buf *bp, const struct xfs_buf_ops *ops);
+
+/* Buffer body arena */
+void libxfs_buf_arena_init(bool hugepages);
+void libxfs_buf_arena_set_limit(unsigned long long bytes);
+unsigned long long libxfs_buf_arena_usage(void);
+bool libxfs_buf_arena_overlimit(void);
+void *libxfs_buf_arena_alloc(size_t bytes);
+void libxfs_buf_arena_free(void *p, size_t bytes);
+void libxfs_buf_arena_destroy(void);
+void libxfs_buf_arena_report(FILE *fp);
 struct xfs_buf *libxfs_getsb(struct xfs_mount *mp);
 extern void	libxfs_bcache_purge(void);
 extern void	libxfs_bcache_free(void);
 extern void	libxfs_bcache_flush(void);
 extern int	libxfs_bcache_overflowed(void);
+extern void	libxfs_bcache_shrink(unsigned int percent,
+				     unsigned int min_nodes);
 
 /* Buffer (Raw) Interfaces */
 int		libxfs_bwrite(struct xfs_buf *bp);
@@ -204,9 +295,19 @@ xfs_buf_verify_cksum(struct xfs_buf *bp, unsigned long cksum_offset)
 				cksum_offset);
 }
 
+/*
+ * Batched writeback lets the write verifier leave the crc for later so that
+ * it can checksum a whole batch of buffers at once; see libxfs_bwrite_batch.
+ * The crc is always the last thing a write verifier touches.
+ */
 static inline void
 xfs_buf_update_cksum(struct xfs_buf *bp, unsigned long cksum_offset)
 {
+	if (bp->b_flags & LIBXFS_B_CKSUM_DEFER) {
+		bp->b_cksum_offset = cksum_offset;
+		bp->b_flags |= LIBXFS_B_CKSUM_PENDING;
+		return;
+	}
 	xfs_update_cksum(bp->b_addr, BBTOB(bp->b_length),
 			 cksum_offset);
 }
@@ -231,10 +332,15 @@ int libxfs_buf_read_uncached(struct xfs_buftarg *targ, xfs_daddr_t daddr,
 		size_t bblen, int flags, struct xfs_buf **bpp,
 		const struct xfs_buf_ops *ops);
 
-/* Push a single buffer on a delwri queue. */
+/*
+ * Push a single buffer on a delwri queue.  The caller has filled in the whole
+ * buffer, so mark it uptodate to stop a read from clobbering the contents
+ * before the queue is written.
+ */
 static inline bool
 xfs_buf_delwri_queue(struct xfs_buf *bp, struct list_head *buffer_list)
 {
+	bp->b_flags |= LIBXFS_B_UPTODATE;
 	xfs_buf_hold(bp);
 	list_add_tail(&bp->b_list, buffer_list);
 	return true;
@@ -88,6 +88,9 @@ struct iomap;
 /* for all the support code that uses progname in error messages */
 extern char    *progname;
 
+/* buffers are locked so that several threads can share the cache */
+extern int	use_xfs_buf_lock;
+
 #undef ASSERT
 #define ASSERT(ex) assert(ex)
 
@@ -453,12 +456,8 @@ void __xfs_buf_mark_corrupt(struct xfs_buf *bp, xfs_failaddr_t fa);
 
 #define xfs_trans_buf_copy_type(dbp, sbp)
 
-/* no readahead, need to avoid set-but-unused var warnings. */
-#define xfs_buf_readahead(a,d,c,ops)		({	\
-	xfs_daddr_t __d = d;				\
-	__d = __d; /* no set-but-unused warning */	\
-})
-#define xfs_buf_readahead_map(a,b,c,ops)	((void) 0)	/* no readahead */
+#define xfs_buf_readahead		libxfs_buf_readahead
+#define xfs_buf_readahead_map		libxfs_buf_readahead_map
 
 #define xfs_sort					qsort
 
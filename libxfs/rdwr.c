@@ -4,6 +4,7 @@
  * All Rights Reserved.
  */
 
+#include <sys/uio.h>
 
 #include "libxfs_priv.h"
 #include "init.h"
@@ -18,10 +19,12 @@
 #include "xfs_inode.h"
 #include "xfs_trans.h"
 #include "libfrog/platform.h"
+#include "libfrog/ioring.h"
+#include "libfrog/workqueue.h"
 
 #include "libxfs.h"
 
-static void libxfs_brelse(struct cache_node *node);
+static void __libxfs_brelse(struct xfs_buf *bp);
 
 /*
  * Important design/architecture note:
@@ -56,6 +59,14 @@ static void libxfs_brelse(struct cache_node *node);
 
 #define BDSTRAT_SIZE	(256 * 1024)
 
+/*
+ * Zeroing and formatting the log go through much larger writes; a log
+ * can be 2GB and issuing that 256k at a time takes far longer than the
+ * device needs.
+ */
+#define ZERO_CHUNK_SIZE	(8 * 1024 * 1024)
+#define LOG_CLEAR_BATCH	8		/* chunks of log records per submission */
+
 #define IO_BCOMPARE_CHECK
 
 /* XXX: (dgc) Propagate errors, only exit if fail-on-error flag set */
@@ -79,7 +90,7 @@ libxfs_device_zero(struct xfs_buftarg *btp, xfs_daddr_t start, uint len)
 		return 0;
 	}
 
-	zsize = min(BDSTRAT_SIZE, BBTOB(len));
+	zsize = min(ZERO_CHUNK_SIZE, BBTOB(len));
 	if ((z = memalign(libxfs_device_alignment(), zsize)) == NULL) {
 		fprintf(stderr,
 			_("%s: %s can't memalign %d bytes: %s\n"),
@@ -197,6 +208,20 @@ libxfs_bhash(cache_key_t key, unsigned int hashsize, unsigned int hashshift)
 	return tmp % hashsize;
 }
 
+/*
+ * Everything libxfs_bcompare looks at to decide whether a buffer might be the
+ * one we want, for the bucket filters.  Lengths are left out on purpose so
+ * that a lookup with the wrong length still finds (and purges) the old one.
+ */
+static uint64_t
+libxfs_bfingerprint(
+	cache_key_t		key)
+{
+	struct xfs_bufkey	*bkey = (struct xfs_bufkey *)key;
+
+	return bkey->blkno ^ ((uint64_t)bkey->buftarg->bt_bdev << 40);
+}
+
 static int
 libxfs_bcompare(struct cache_node *node, cache_key_t key)
 {
@@ -235,11 +260,13 @@ __initbuf(struct xfs_buf *bp, struct xfs_buftarg *btp, xfs_daddr_t bno,
 	bp->b_target = btp;
 	bp->b_mount = btp->bt_mount;
 	bp->b_error = 0;
-	if (!bp->b_addr)
-		bp->b_addr = memalign(libxfs_device_alignment(), bytes);
+	if (!bp->b_addr) {
+		bp->b_addr = libxfs_buf_arena_alloc(bytes);
+		bp->b_addr_len = bytes;
+	}
 	if (!bp->b_addr) {
 		fprintf(stderr,
-			_("%s: %s can't memalign %u bytes: %s\n"),
+			_("%s: %s can't allocate %u bytes: %s\n"),
 			progname, __FUNCTION__, bytes,
 			strerror(errno));
 		exit(1);
@@ -249,6 +276,7 @@ __initbuf(struct xfs_buf *bp, struct xfs_buftarg *btp, xfs_daddr_t bno,
 	bp->b_holder = 0;
 	bp->b_recur = 0;
 	bp->b_ops = NULL;
+	bp->b_verify_ops = NULL;
 	INIT_LIST_HEAD(&bp->b_li_list);
 
 	if (!bp->b_maps)
@@ -320,7 +348,7 @@ __libxfs_getbufr(int blen)
 			bp = list_entry(xfs_buf_freelist.cm_list.next,
 					struct xfs_buf, b_node.cn_mru);
 			list_del_init(&bp->b_node.cn_mru);
-			free(bp->b_addr);
+			libxfs_buf_arena_free(bp->b_addr, bp->b_addr_len);
 			bp->b_addr = NULL;
 			if (bp->b_maps != &bp->__b_map)
 				free(bp->b_maps);
@@ -376,6 +404,68 @@ libxfs_getbufr_map(struct xfs_buftarg *btp, xfs_daddr_t blkno, int bblen,
 	return bp;
 }
 
+/*
+ * Asynchronous buffer readahead.  Callers hand us a buffer map and a pool of
+ * worker threads pulls the blocks into the cache in the background, so that a
+ * later libxfs_buf_read_map finds them already there.  We never verify the
+ * contents here; the buffer is marked unchecked so that the real reader runs
+ * the verifier with the ops it actually wants.
+ *
+ * Readahead is advisory.  If too much is already in flight, or we cannot
+ * allocate memory, or somebody else is using the buffer, we simply drop the
+ * request.
+ *
+ * Not all programs use the buffer locks, so a worker only reads into a buffer
+ * if it holds the sole reference to it, and it sets LIBXFS_B_READAHEAD under
+ * the node lock while it does so.  Anyone looking up the buffer afterwards
+ * takes the node lock to get its reference, so they are guaranteed to see the
+ * flag and will wait for the I/O to finish before using the buffer.
+ */
+#define LIBXFS_RA_WORKERS	4
+#define LIBXFS_RA_MAX_INFLIGHT	256
+
+struct libxfs_ra_work {
+	struct xfs_buftarg	*btp;
+	const struct xfs_buf_ops *ops;
+	int			nmaps;
+	struct xfs_buf_map	maps[];
+};
+
+static pthread_mutex_t	libxfs_ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	libxfs_ra_cond = PTHREAD_COND_INITIALIZER;
+static struct workqueue	libxfs_ra_wq;
+static bool		libxfs_ra_active;	/* workqueue is running */
+static bool		libxfs_ra_failed;	/* couldn't start workqueue */
+static unsigned int	libxfs_ra_inflight;
+
+/*
+ * Optionally, blocks that readahead brings in are verified on a separate pool
+ * of threads as soon as the read completes, so that the verifier overlaps with
+ * whatever the reader is doing.  The outcome is stashed in the buffer and
+ * handed to the first reader that asks for the same verifier.
+ */
+static struct workqueue	libxfs_verify_wq;
+static unsigned int	libxfs_verify_threads;
+static bool		libxfs_verify_active;
+
+/*
+ * Wait for any readahead I/O to this buffer to complete.  The flag is set
+ * before anyone else can get a reference, so we only need the lock if we see
+ * it set.
+ */
+static void
+libxfs_buf_ra_wait(
+	struct xfs_buf		*bp)
+{
+	if (!(uatomic_read(&bp->b_flags) & LIBXFS_B_READAHEAD))
+		return;
+
+	pthread_mutex_lock(&libxfs_ra_lock);
+	while (bp->b_flags & LIBXFS_B_READAHEAD)
+		pthread_cond_wait(&libxfs_ra_cond, &libxfs_ra_lock);
+	pthread_mutex_unlock(&libxfs_ra_lock);
+}
+
 static int
 __cache_lookup(
 	struct xfs_bufkey	*key,
@@ -418,6 +508,9 @@ __cache_lookup(
 		bp->b_holder = pthread_self();
 	}
 
+	if (libxfs_ra_active)
+		libxfs_buf_ra_wait(bp);
+
 	cache_node_set_priority(libxfs_bcache, cn,
 			cache_node_get_priority(cn) - CACHE_PREFETCH_PRIORITY);
 	*bpp = bp;
@@ -466,9 +559,11 @@ static void
 reset_buf_state(
 	struct xfs_buf	*bp)
 {
-	if (bp && !(bp->b_flags & LIBXFS_B_DIRTY))
+	if (bp && !(bp->b_flags & LIBXFS_B_DIRTY)) {
 		bp->b_flags &= ~(LIBXFS_B_UNCHECKED | LIBXFS_B_STALE |
 				LIBXFS_B_UPTODATE);
+		bp->b_verify_ops = NULL;
+	}
 }
 
 static int
@@ -538,7 +633,7 @@ libxfs_buf_relse(
 	else if (--bp->b_node.cn_count == 0) {
 		if (bp->b_flags & LIBXFS_B_DIRTY)
 			libxfs_bwrite(bp);
-		libxfs_brelse(&bp->b_node);
+		__libxfs_brelse(bp);
 	}
 }
 
@@ -578,299 +673,1381 @@ __read_buf(int fd, void *buf, int len, off64_t offset, int flags)
 	return 0;
 }
 
-int
-libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, struct xfs_buf *bp,
-		int len, int flags)
+static int
+__write_buf(int fd, void *buf, int len, off64_t offset, int flags)
 {
-	int	fd = libxfs_device_to_fd(btp->bt_bdev);
-	int	bytes = BBTOB(len);
-	int	error;
-
-	ASSERT(len <= bp->b_length);
+	int	sts;
 
-	error = __read_buf(fd, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno), flags);
-	if (!error &&
-	    bp->b_target->bt_bdev == btp->bt_bdev &&
-	    bp->b_cache_key == blkno &&
-	    bp->b_length == len)
-		bp->b_flags |= LIBXFS_B_UPTODATE;
-	bp->b_error = error;
-	return error;
+	sts = pwrite(fd, buf, len, offset);
+	if (sts < 0) {
+		int error = errno;
+		fprintf(stderr, _("%s: pwrite failed: %s\n"),
+			progname, strerror(error));
+		return -error;
+	} else if (sts != len) {
+		fprintf(stderr, _("%s: error - pwrite only %d of %d bytes\n"),
+			progname, sts, len);
+		return -EIO;
+	}
+	return 0;
 }
 
-int
-libxfs_readbuf_verify(
-	struct xfs_buf		*bp,
-	const struct xfs_buf_ops *ops)
+#ifdef HAVE_PREADV
+static inline ssize_t
+__pwritev(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
 {
-	if (!ops)
-		return bp->b_error;
-
-	bp->b_ops = ops;
-	bp->b_ops->verify_read(bp);
-	bp->b_flags &= ~LIBXFS_B_UNCHECKED;
-	return bp->b_error;
+	return pwritev(fd, iov, iovcnt, offset);
 }
-
-int
-libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
+#else
+static ssize_t
+__pwritev(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
 {
-	int	fd;
-	int	error = 0;
-	void	*buf;
+	ssize_t	done = 0;
+	ssize_t	sts;
 	int	i;
 
-	fd = libxfs_device_to_fd(btp->bt_bdev);
-	buf = bp->b_addr;
-	for (i = 0; i < bp->b_nmaps; i++) {
-		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-		int len = BBTOB(bp->b_maps[i].bm_len);
-
-		error = __read_buf(fd, buf, len, offset, flags);
-		if (error) {
-			bp->b_error = error;
+	for (i = 0; i < iovcnt; i++) {
+		sts = pwrite(fd, iov[i].iov_base, iov[i].iov_len,
+				offset + done);
+		if (sts < 0)
+			return done ? done : sts;
+		done += sts;
+		if (sts != iov[i].iov_len)
 			break;
-		}
-		buf += len;
 	}
-
-	if (!error)
-		bp->b_flags |= LIBXFS_B_UPTODATE;
-	return error;
+	return done;
 }
+#endif
 
-int
-libxfs_buf_read_map(
-	struct xfs_buftarg	*btp,
-	struct xfs_buf_map	*map,
-	int			nmaps,
-	int			flags,
-	struct xfs_buf		**bpp,
-	const struct xfs_buf_ops *ops)
+static int
+__writev_buf(int fd, struct iovec *iov, int iovcnt, int len, off64_t offset)
 {
-	struct xfs_buf		*bp;
-	bool			salvage = flags & LIBXFS_READBUF_SALVAGE;
-	int			error = 0;
-
-	*bpp = NULL;
-	if (nmaps == 1)
-		error = libxfs_getbuf_flags(btp, map[0].bm_bn, map[0].bm_len,
-				0, &bp);
-	else
-		error = __libxfs_buf_get_map(btp, map, nmaps, 0, &bp);
-	if (error)
-		return error;
+	int	sts;
 
-	/*
-	 * If the buffer was prefetched, it is likely that it was not validated.
-	 * Hence if we are supplied an ops function and the buffer is marked as
-	 * unchecked, we need to validate it now.
-	 *
-	 * We do this verification even if the buffer is dirty - the
-	 * verification is almost certainly going to fail the CRC check in this
-	 * case as a dirty buffer has not had the CRC recalculated. However, we
-	 * should not be dirtying unchecked buffers and therefore failing it
-	 * here because it's dirty and unchecked indicates we've screwed up
-	 * somewhere else.
-	 *
-	 * Note that if the caller passes in LIBXFS_READBUF_SALVAGE, that means
-	 * they want the buffer even if it fails verification.
-	 */
-	bp->b_error = 0;
-	if (bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY)) {
-		if (bp->b_flags & LIBXFS_B_UNCHECKED)
-			error = libxfs_readbuf_verify(bp, ops);
-		if (error && !salvage)
-			goto err;
-		goto ok;
+	sts = __pwritev(fd, iov, iovcnt, offset);
+	if (sts < 0) {
+		int error = errno;
+		fprintf(stderr, _("%s: pwrite failed: %s\n"),
+			progname, strerror(error));
+		return -error;
+	} else if (sts != len) {
+		fprintf(stderr, _("%s: error - pwrite only %d of %d bytes\n"),
+			progname, sts, len);
+		return -EIO;
 	}
+	return 0;
+}
 
-	/*
-	 * Set the ops on a cache miss (i.e. first physical read) as the
-	 * verifier may change the ops to match the type of buffer it contains.
-	 * A cache hit might reset the verifier to the original type if we set
-	 * it again, but it won't get called again and set to match the buffer
-	 * contents. *cough* xfs_da_node_buf_ops *cough*.
-	 */
-	if (nmaps == 1)
-		error = libxfs_readbufr(btp, map[0].bm_bn, bp, map[0].bm_len,
-				flags);
-	else
-		error = libxfs_readbufr_map(btp, bp, flags);
-	if (error)
-		goto err;
+/*
+ * io_uring I/O engine.
+ *
+ * Rings aren't thread safe, so each thread that does I/O to an io_uring
+ * enabled buftarg gets its own ring, created on first use and torn down when
+ * the thread exits.  The ring is purely a fast path: anything that doesn't
+ * complete in full through the ring (errors, short I/O, a ring that can't be
+ * set up) is redone with pread/pwrite, so the error reporting is exactly the
+ * same as for synchronous I/O.
+ */
+#define LIBXFS_IORING_DEFAULT_DEPTH	64
 
-	error = libxfs_readbuf_verify(bp, ops);
-	if (error && !salvage)
-		goto err;
+static unsigned int	libxfs_ioring_depth = LIBXFS_IORING_DEFAULT_DEPTH;
+static unsigned int	libxfs_ioring_flags;
+static pthread_key_t	libxfs_ioring_key;
+static pthread_once_t	libxfs_ioring_once = PTHREAD_ONCE_INIT;
 
-ok:
-	*bpp = bp;
-	return 0;
-err:
-	libxfs_buf_relse(bp);
-	return error;
+void
+libxfs_buftarg_ioring_config(
+	unsigned int		depth,
+	bool			poll)
+{
+	if (depth)
+		libxfs_ioring_depth = depth;
+#ifdef HAVE_IO_URING
+	if (poll)
+		libxfs_ioring_flags |= IORING_SETUP_IOPOLL;
+#endif
 }
 
-/* Allocate a raw uncached buffer. */
-static inline struct xfs_buf *
-libxfs_getbufr_uncached(
-	struct xfs_buftarg	*targ,
-	xfs_daddr_t		daddr,
-	size_t			bblen)
+static void
+libxfs_ioring_destroy(
+	void			*priv)
 {
-	struct xfs_buf		*bp;
+	struct ioring		*ring = priv;
 
-	bp = libxfs_getbufr(targ, daddr, bblen);
-	if (!bp)
+	ioring_free(ring);
+	free(ring);
+}
+
+static void
+libxfs_ioring_key_init(void)
+{
+	pthread_key_create(&libxfs_ioring_key, libxfs_ioring_destroy);
+}
+
+/* Return this thread's ring, or NULL if we have to use synchronous I/O. */
+static struct ioring *
+libxfs_thread_ioring(
+	struct xfs_buftarg	*btp)
+{
+	static bool		warned;
+	struct ioring		*ring;
+	int			error;
+
+	if (!(btp->flags & XFS_BUFTARG_IORING))
 		return NULL;
 
-	INIT_LIST_HEAD(&bp->b_node.cn_hash);
-	bp->b_node.cn_count = 1;
-	return bp;
+	pthread_once(&libxfs_ioring_once, libxfs_ioring_key_init);
+	ring = pthread_getspecific(libxfs_ioring_key);
+	if (ring)
+		return ring->fd >= 0 ? ring : NULL;
+
+	ring = malloc(sizeof(struct ioring));
+	if (!ring)
+		return NULL;
+	error = ioring_init(ring, libxfs_ioring_depth, libxfs_ioring_flags);
+	if (error && !warned) {
+		warned = true;
+		fprintf(stderr,
+	_("%s: cannot set up io_uring (%s), falling back to synchronous I/O\n"),
+			progname, strerror(-error));
+	}
+	pthread_setspecific(libxfs_ioring_key, ring);
+	return ring->fd >= 0 ? ring : NULL;
 }
 
-/*
- * Allocate an uncached buffer that points nowhere.  The refcount will be 1,
- * and the cache node hash list will be empty to indicate that it's uncached.
- */
-int
-libxfs_buf_get_uncached(
-	struct xfs_buftarg	*targ,
-	size_t			bblen,
-	int			flags,
-	struct xfs_buf		**bpp)
+#ifdef HAVE_IO_URING
+static void
+libxfs_ioring_complete(
+	struct xfs_buftarg_io	*io,
+	struct io_uring_cqe	*cqe)
 {
-	*bpp = libxfs_getbufr_uncached(targ, XFS_BUF_DADDR_NULL, bblen);
-	return *bpp != NULL ? 0 : -ENOMEM;
+	struct xfs_buftarg_io	*iop = &io[cqe->user_data];
+
+	/* Leave failed and short I/Os pending so they get redone. */
+	if (cqe->res >= 0 && cqe->res == iop->bio_len)
+		iop->bio_error = 0;
+	else
+		iop->bio_error = -EINPROGRESS;
 }
 
 /*
- * Allocate and read an uncached buffer.  The refcount will be 1, and the cache
- * node hash list will be empty to indicate that it's uncached.
+ * Push as much of the batch as possible through the ring.  I/Os that don't
+ * complete successfully are left with bio_error == -EINPROGRESS.  While the
+ * kernel has an I/O, its bio_error is -EBUSY.
  */
-int
-libxfs_buf_read_uncached(
-	struct xfs_buftarg	*targ,
-	xfs_daddr_t		daddr,
-	size_t			bblen,
-	int			flags,
-	struct xfs_buf		**bpp,
-	const struct xfs_buf_ops *ops)
+static void
+libxfs_ioring_rw(
+	struct ioring		*ring,
+	int			fd,
+	struct xfs_buftarg_io	*io,
+	unsigned int		nr,
+	bool			write)
 {
-	struct xfs_buf		*bp;
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	unsigned int		next = 0;
+	unsigned int		inflight = 0;
 	int			error;
 
-	*bpp = NULL;
-	bp = libxfs_getbufr_uncached(targ, daddr, bblen);
-	if (!bp)
-		return -ENOMEM;
+	while (next < nr || inflight) {
+		while (next < nr && (sqe = ioring_get_sqe(ring)) != NULL) {
+			struct xfs_buftarg_io	*iop = &io[next];
+
+			if (iop->bio_iov)
+				ioring_prep_rw(sqe, write ? IORING_OP_WRITEV :
+							    IORING_OP_READV,
+						fd, iop->bio_iov,
+						iop->bio_iovcnt,
+						iop->bio_offset, next);
+			else
+				ioring_prep_rw(sqe, write ? IORING_OP_WRITE :
+							    IORING_OP_READ,
+						fd, iop->bio_buf, iop->bio_len,
+						iop->bio_offset, next);
+			iop->bio_error = -EBUSY;
+			next++;
+			inflight++;
+		}
 
-	error = libxfs_readbufr(targ, daddr, bp, bblen, flags);
-	if (error)
-		goto err;
+		error = ioring_submit(ring, 1);
+		if (error < 0)
+			goto out_dead;
 
-	error = libxfs_readbuf_verify(bp, ops);
-	if (error)
-		goto err;
+		while ((cqe = ioring_peek_cqe(ring)) != NULL) {
+			libxfs_ioring_complete(io, cqe);
+			ioring_cqe_seen(ring);
+			inflight--;
+		}
+	}
+	return;
 
-	*bpp = bp;
-	return 0;
-err:
-	libxfs_buf_relse(bp);
-	return error;
-}
+out_dead:
+	/*
+	 * The ring is unusable.  Whatever the kernel never took stays pending
+	 * and gets redone synchronously.  Reap the rest so that the kernel is
+	 * done with the buffers, then switch this thread over to synchronous
+	 * I/O for good.
+	 */
+	fprintf(stderr, _("%s: io_uring submission failed: %s\n"),
+			progname, strerror(-error));
+	for (next = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	     next != *ring->sq_tail; next++) {
+		sqe = &ring->sqes[ring->sq_array[next & ring->sq_mask]];
+		io[sqe->user_data].bio_error = -EINPROGRESS;
+		inflight--;
+	}
+	while (inflight) {
+		if (ioring_wait_cqe(ring, &cqe))
+			break;
+		libxfs_ioring_complete(io, cqe);
+		ioring_cqe_seen(ring);
+		inflight--;
+	}
 
-static int
-__write_buf(int fd, void *buf, int len, off64_t offset, int flags)
+	/*
+	 * If we couldn't wait for everything, the kernel may still be using
+	 * some of the buffers, so redoing those I/Os isn't safe.  Fail them.
+	 */
+	for (next = 0; inflight && next < nr; next++)
+		if (io[next].bio_error == -EBUSY)
+			io[next].bio_error = -EIO;
+	ioring_free(ring);
+}
+#else
+static inline void
+libxfs_ioring_rw(
+	struct ioring		*ring,
+	int			fd,
+	struct xfs_buftarg_io	*io,
+	unsigned int		nr,
+	bool			write)
 {
-	int	sts;
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * Bytes moved by the I/O engine, for anyone who wants to report throughput.
+ * The per-thread copy lets callers charge I/O to the work done by a thread.
+ */
+static struct libxfs_io_stats		libxfs_io_totals;
+static __thread struct libxfs_io_stats	libxfs_thread_io;
+
+void
+libxfs_io_account(
+	bool			write,
+	size_t			len)
+{
+	if (write) {
+		libxfs_thread_io.writes++;
+		libxfs_thread_io.write_bytes += len;
+		uatomic_inc(&libxfs_io_totals.writes);
+		uatomic_add(&libxfs_io_totals.write_bytes, len);
+	} else {
+		libxfs_thread_io.reads++;
+		libxfs_thread_io.read_bytes += len;
+		uatomic_inc(&libxfs_io_totals.reads);
+		uatomic_add(&libxfs_io_totals.read_bytes, len);
+	}
+}
+
+/* Sample the I/O done by the whole process, or just by the calling thread. */
+void
+libxfs_io_stats(
+	struct libxfs_io_stats	*stats,
+	bool			this_thread)
+{
+	if (this_thread) {
+		*stats = libxfs_thread_io;
+		return;
+	}
+	stats->reads = uatomic_read(&libxfs_io_totals.reads);
+	stats->read_bytes = uatomic_read(&libxfs_io_totals.read_bytes);
+	stats->writes = uatomic_read(&libxfs_io_totals.writes);
+	stats->write_bytes = uatomic_read(&libxfs_io_totals.write_bytes);
+}
+
+/*
+ * Buffer cache statistics by metadata type.
+ *
+ * The cache itself only knows about hits and misses in general, which
+ * doesn't say whether it's the bmbt blocks or the inode clusters that keep
+ * falling out of it.  So the buffer layer counts lookups, evictions and
+ * readahead by the verifier attached to each buffer, and reads that go to
+ * the data device by AG, which is what it takes to size the cache from
+ * real workloads.
+ *
+ * Verifiers are static and there are a few dozen of them, so each gets a
+ * slot in a small open addressed table the first time it is seen.  Slots
+ * are cacheline aligned since every thread doing I/O bangs on them.
+ */
+#define BCACHE_TYPE_SLOTS	64
+
+struct bcache_type {
+	const struct xfs_buf_ops *ops;
+	struct libxfs_bcache_type_stats	st;
+} __attribute__((aligned(64)));
+
+static struct bcache_type	bcache_types[BCACHE_TYPE_SLOTS];
+static struct bcache_type	bcache_untyped;
+
+static uint64_t			*bcache_ag_reads;
+static xfs_agnumber_t		bcache_ag_count;
+
+/* Emptying the cache on purpose isn't eviction. */
+static bool			bcache_purging;
+
+static struct bcache_type *
+bcache_type(
+	const struct xfs_buf_ops *ops)
+{
+	struct bcache_type	*bt;
+	const struct xfs_buf_ops *old;
+	unsigned int		i, slot;
+
+	if (!ops)
+		return &bcache_untyped;
+
+	slot = ((uintptr_t)ops >> 4) % BCACHE_TYPE_SLOTS;
+	for (i = 0; i < BCACHE_TYPE_SLOTS; i++) {
+		bt = &bcache_types[(slot + i) % BCACHE_TYPE_SLOTS];
+		old = uatomic_read(&bt->ops);
+		if (!old)
+			old = uatomic_cmpxchg(&bt->ops, NULL, ops);
+		if (!old || old == ops)
+			return bt;
+	}
+	return &bcache_untyped;
+}
+
+static inline void
+bcache_count_hit(
+	const struct xfs_buf_ops *ops)
+{
+	uatomic_inc(&bcache_type(ops)->st.hits);
+}
+
+static inline void
+bcache_count_miss(
+	const struct xfs_buf_ops *ops)
+{
+	uatomic_inc(&bcache_type(ops)->st.misses);
+}
+
+/* A block is about to be read from the device into the cache. */
+static void
+bcache_count_read(
+	struct xfs_buftarg	*btp,
+	xfs_daddr_t		daddr)
+{
+	struct xfs_mount	*mp = btp->bt_mount;
+	xfs_agnumber_t		agno;
+
+	if (!mp || btp != mp->m_ddev_targp || !mp->m_sb.sb_agblocks)
+		return;
+	agno = xfs_daddr_to_agno(mp, daddr);
+	if (agno < bcache_ag_count)
+		uatomic_inc(&bcache_ag_reads[agno]);
+}
+
+/* The cache is done with this buffer; charge it to whoever used it. */
+static void
+bcache_count_evict(
+	struct xfs_buf		*bp)
+{
+	struct bcache_type	*bt;
+
+	trace_libxfs_buf_evict(bp, xfs_buf_daddr(bp), bp->b_length,
+			bp->b_flags);
+	if (bcache_purging)
+		return;
+	if (bp->b_flags & LIBXFS_B_RA_UNUSED) {
+		bt = bcache_type(bp->b_ra_ops);
+		uatomic_inc(&bt->st.ra_wasted);
+	} else {
+		bt = bcache_type(bp->b_ops);
+	}
+	uatomic_inc(&bt->st.evictions);
+}
+
+/*
+ * A buffer that readahead brought in is being used, or is about to be read
+ * again because the cache forgot it was up to date.
+ */
+static inline void
+bcache_ra_consumed(
+	struct xfs_buf		*bp,
+	bool			wasted)
+{
+	if (!(bp->b_flags & LIBXFS_B_RA_UNUSED))
+		return;
+	if (wasted)
+		uatomic_inc(&bcache_type(bp->b_ra_ops)->st.ra_wasted);
+	bp->b_flags &= ~LIBXFS_B_RA_UNUSED;
+}
+
+/* Size the per-AG read counters; called at mount time. */
+void
+libxfs_bcache_stats_init(
+	xfs_agnumber_t		agcount)
+{
+	uint64_t		*p;
+
+	/* Nobody else can be reading yet, and we never shrink. */
+	if (agcount <= bcache_ag_count)
+		return;
+	p = realloc(bcache_ag_reads, agcount * sizeof(uint64_t));
+	if (!p)
+		return;
+	memset(p + bcache_ag_count, 0,
+			(agcount - bcache_ag_count) * sizeof(uint64_t));
+	bcache_ag_reads = p;
+	bcache_ag_count = agcount;
+}
+
+void
+libxfs_bcache_stats_reset(void)
+{
+	unsigned int		i;
+
+	for (i = 0; i < BCACHE_TYPE_SLOTS; i++)
+		memset(&bcache_types[i].st, 0, sizeof(bcache_types[i].st));
+	memset(&bcache_untyped.st, 0, sizeof(bcache_untyped.st));
+	if (bcache_ag_reads)
+		memset(bcache_ag_reads, 0, bcache_ag_count * sizeof(uint64_t));
+}
+
+static void
+bcache_type_sample(
+	struct bcache_type	*bt,
+	struct libxfs_bcache_type_stats *st)
+{
+	st->name = bt->ops ? bt->ops->name : "untyped";
+	st->hits = uatomic_read(&bt->st.hits);
+	st->misses = uatomic_read(&bt->st.misses);
+	st->evictions = uatomic_read(&bt->st.evictions);
+	st->ra_reads = uatomic_read(&bt->st.ra_reads);
+	st->ra_wasted = uatomic_read(&bt->st.ra_wasted);
+}
+
+/*
+ * Fill out up to @nr stats for the metadata types that have been seen, and
+ * return how many there are in total.
+ */
+unsigned int
+libxfs_bcache_type_stats(
+	struct libxfs_bcache_type_stats *st,
+	unsigned int		nr)
+{
+	struct libxfs_bcache_type_stats	tmp;
+	unsigned int		i, found = 0;
+
+	for (i = 0; i <= BCACHE_TYPE_SLOTS; i++) {
+		struct bcache_type	*bt;
+
+		bt = i < BCACHE_TYPE_SLOTS ? &bcache_types[i] :
+					     &bcache_untyped;
+		if (bt != &bcache_untyped && !uatomic_read(&bt->ops))
+			continue;
+		bcache_type_sample(bt, &tmp);
+		if (!tmp.hits && !tmp.misses && !tmp.evictions &&
+		    !tmp.ra_reads)
+			continue;
+		if (found < nr)
+			st[found] = tmp;
+		found++;
+	}
+	return found;
+}
+
+uint64_t
+libxfs_bcache_ag_reads(
+	xfs_agnumber_t		agno)
+{
+	if (agno >= bcache_ag_count)
+		return 0;
+	return uatomic_read(&bcache_ag_reads[agno]);
+}
+
+void
+libxfs_bcache_stats_report(
+	FILE			*fp)
+{
+	struct libxfs_bcache_type_stats	st[BCACHE_TYPE_SLOTS + 1];
+	unsigned int		i, nr;
+	xfs_agnumber_t		agno;
+
+	nr = libxfs_bcache_type_stats(st, BCACHE_TYPE_SLOTS + 1);
+	if (nr) {
+		fprintf(fp, "%-24s %12s %12s %6s %12s %12s %12s\n",
+				"Buffer type", "Hits", "Misses", "Hit%",
+				"Evictions", "RA reads", "RA wasted");
+		for (i = 0; i < nr; i++)
+			fprintf(fp,
+	"%-24s %12llu %12llu %6.2f %12llu %12llu %12llu\n",
+				st[i].name,
+				(unsigned long long)st[i].hits,
+				(unsigned long long)st[i].misses,
+				st[i].hits + st[i].misses ?
+					(double)st[i].hits * 100 /
+					(st[i].hits + st[i].misses) : 0.0,
+				(unsigned long long)st[i].evictions,
+				(unsigned long long)st[i].ra_reads,
+				(unsigned long long)st[i].ra_wasted);
+	}
+
+	for (agno = 0; agno < bcache_ag_count; agno++) {
+		uint64_t	reads = libxfs_bcache_ag_reads(agno);
+
+		if (reads)
+			fprintf(fp, "AG %u reads = %llu\n", agno,
+					(unsigned long long)reads);
+	}
+}
+
+/*
+ * Read or write a batch of discrete buffers on a target.  Every I/O in the
+ * batch is attempted, and the first error encountered is returned.  Vectored
+ * reads are not supported.
+ */
+int
+libxfs_buftarg_rw(
+	struct xfs_buftarg	*btp,
+	struct xfs_buftarg_io	*io,
+	unsigned int		nr,
+	bool			write)
+{
+	struct ioring		*ring = libxfs_thread_ioring(btp);
+	int			fd = libxfs_device_to_fd(btp->bt_bdev);
+	unsigned int		i;
+	int			error = 0;
+
+	for (i = 0; i < nr; i++) {
+		ASSERT(write || !io[i].bio_iov);
+		io[i].bio_error = -EINPROGRESS;
+	}
+
+	if (ring)
+		libxfs_ioring_rw(ring, fd, io, nr, write);
+
+	for (i = 0; i < nr; i++) {
+		struct xfs_buftarg_io	*iop = &io[i];
+
+		if (iop->bio_error == -EINPROGRESS) {
+			if (iop->bio_iov)
+				iop->bio_error = __writev_buf(fd, iop->bio_iov,
+						iop->bio_iovcnt, iop->bio_len,
+						iop->bio_offset);
+			else if (write)
+				iop->bio_error = __write_buf(fd, iop->bio_buf,
+						iop->bio_len, iop->bio_offset,
+						0);
+			else
+				iop->bio_error = __read_buf(fd, iop->bio_buf,
+						iop->bio_len, iop->bio_offset,
+						0);
+		}
+		trace_libxfs_buftarg_io(btp->bt_bdev, iop->bio_offset,
+				iop->bio_len, write, iop->bio_error);
+		if (!iop->bio_error)
+			libxfs_io_account(write, iop->bio_len);
+		else if (!error)
+			error = iop->bio_error;
+	}
+	return error;
+}
+
+int
+libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, struct xfs_buf *bp,
+		int len, int flags)
+{
+	struct xfs_buftarg_io	io = {
+		.bio_buf	= bp->b_addr,
+		.bio_len	= BBTOB(len),
+		.bio_offset	= LIBXFS_BBTOOFF64(blkno),
+	};
+	int			error;
+
+	ASSERT(len <= bp->b_length);
+
+	error = libxfs_buftarg_rw(btp, &io, 1, false);
+	if (!error &&
+	    bp->b_target->bt_bdev == btp->bt_bdev &&
+	    bp->b_cache_key == blkno &&
+	    bp->b_length == len)
+		bp->b_flags |= LIBXFS_B_UPTODATE;
+	bp->b_error = error;
+	return error;
+}
+
+int
+libxfs_readbuf_verify(
+	struct xfs_buf		*bp,
+	const struct xfs_buf_ops *ops)
+{
+	if (!ops)
+		return bp->b_error;
+
+	bp->b_ops = ops;
+	bp->b_verify_ops = NULL;
+	bp->b_ops->verify_read(bp);
+	bp->b_flags &= ~LIBXFS_B_UNCHECKED;
+	return bp->b_error;
+}
+
+/*
+ * Number of discontiguous segments we can describe on the stack when doing
+ * I/O to a multi-map buffer.  Anything bigger needs a heap allocation.
+ */
+#define XB_STACK_IOS	8
+
+/*
+ * Read or write all the maps of a discontiguous buffer with a single batch.
+ * The buffer memory is laid out map after map, so maps that are also
+ * adjacent on disk are merged into a single I/O; what's left is submitted in
+ * one go through the target's I/O engine.  Note that preadv/pwritev can't
+ * help with the remaining segments because they all live at different disk
+ * offsets.
+ */
+static int
+libxfs_buf_rw_maps(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		*bp,
+	bool			write)
+{
+	struct xfs_buftarg_io	stack_io[XB_STACK_IOS];
+	struct xfs_buftarg_io	*io = stack_io;
+	void			*buf = bp->b_addr;
+	unsigned int		nr = 0;
+	int			error;
+	int			i;
+
+	if (bp->b_nmaps > XB_STACK_IOS) {
+		io = malloc(bp->b_nmaps * sizeof(struct xfs_buftarg_io));
+		if (!io)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < bp->b_nmaps; i++) {
+		off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
+		size_t	len = BBTOB(bp->b_maps[i].bm_len);
+
+		if (nr > 0 &&
+		    io[nr - 1].bio_offset + io[nr - 1].bio_len == offset) {
+			io[nr - 1].bio_len += len;
+		} else {
+			io[nr].bio_buf = buf;
+			io[nr].bio_iov = NULL;
+			io[nr].bio_len = len;
+			io[nr].bio_offset = offset;
+			nr++;
+		}
+		buf += len;
+	}
+
+	error = libxfs_buftarg_rw(btp, io, nr, write);
+	if (io != stack_io)
+		free(io);
+	return error;
+}
+
+int
+libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
+{
+	int	error;
+
+	error = libxfs_buf_rw_maps(btp, bp, false);
+	if (error)
+		bp->b_error = error;
+	else
+		bp->b_flags |= LIBXFS_B_UPTODATE;
+	return error;
+}
+
+/*
+ * Pick up the result of an offloaded verifier run.  If the caller wants a
+ * different verifier, run that one now instead.  The result is only handed out
+ * once, just like a verifier run at read time.
+ */
+static int
+libxfs_buf_verify_result(
+	struct xfs_buf		*bp,
+	const struct xfs_buf_ops *ops)
+{
+	int			error;
+
+	if (!ops)
+		return 0;
+	if (ops != bp->b_verify_ops)
+		return libxfs_readbuf_verify(bp, ops);
+
+	error = bp->b_verify_error;
+	bp->b_error = error;
+	bp->b_verify_ops = NULL;
+	bp->b_verify_error = 0;
+	return error;
+}
+
+int
+libxfs_buf_read_map(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf_map	*map,
+	int			nmaps,
+	int			flags,
+	struct xfs_buf		**bpp,
+	const struct xfs_buf_ops *ops)
+{
+	struct xfs_buf		*bp;
+	bool			salvage = flags & LIBXFS_READBUF_SALVAGE;
+	int			error = 0;
+
+	*bpp = NULL;
+	if (nmaps == 1)
+		error = libxfs_getbuf_flags(btp, map[0].bm_bn, map[0].bm_len,
+				0, &bp);
+	else
+		error = __libxfs_buf_get_map(btp, map, nmaps, 0, &bp);
+	if (error)
+		return error;
+
+	/*
+	 * If the buffer was prefetched, it is likely that it was not validated.
+	 * Hence if we are supplied an ops function and the buffer is marked as
+	 * unchecked, we need to validate it now.
+	 *
+	 * We do this verification even if the buffer is dirty - the
+	 * verification is almost certainly going to fail the CRC check in this
+	 * case as a dirty buffer has not had the CRC recalculated. However, we
+	 * should not be dirtying unchecked buffers and therefore failing it
+	 * here because it's dirty and unchecked indicates we've screwed up
+	 * somewhere else.
+	 *
+	 * Note that if the caller passes in LIBXFS_READBUF_SALVAGE, that means
+	 * they want the buffer even if it fails verification.
+	 */
+	bp->b_error = 0;
+	if (bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY)) {
+		bcache_ra_consumed(bp, false);
+		if (bp->b_flags & LIBXFS_B_UNCHECKED)
+			error = libxfs_readbuf_verify(bp, ops);
+		else if (bp->b_verify_ops)
+			error = libxfs_buf_verify_result(bp, ops);
+		bcache_count_hit(bp->b_ops ? bp->b_ops : ops);
+		trace_libxfs_buf_hit(bp, map[0].bm_bn, bp->b_length, error);
+		if (error && !salvage)
+			goto err;
+		goto ok;
+	}
+
+	/*
+	 * Set the ops on a cache miss (i.e. first physical read) as the
+	 * verifier may change the ops to match the type of buffer it contains.
+	 * A cache hit might reset the verifier to the original type if we set
+	 * it again, but it won't get called again and set to match the buffer
+	 * contents. *cough* xfs_da_node_buf_ops *cough*.
+	 */
+	bcache_ra_consumed(bp, true);
+	bcache_count_miss(ops);
+	bcache_count_read(btp, map[0].bm_bn);
+	trace_libxfs_buf_miss(bp, map[0].bm_bn, bp->b_length);
+	if (nmaps == 1)
+		error = libxfs_readbufr(btp, map[0].bm_bn, bp, map[0].bm_len,
+				flags);
+	else
+		error = libxfs_readbufr_map(btp, bp, flags);
+	if (error)
+		goto err;
+
+	error = libxfs_readbuf_verify(bp, ops);
+	if (error && !salvage)
+		goto err;
 
-	sts = pwrite(fd, buf, len, offset);
-	if (sts < 0) {
-		int error = errno;
-		fprintf(stderr, _("%s: pwrite failed: %s\n"),
-			progname, strerror(error));
-		return -error;
-	} else if (sts != len) {
-		fprintf(stderr, _("%s: error - pwrite only %d of %d bytes\n"),
-			progname, sts, len);
-		return -EIO;
+ok:
+	*bpp = bp;
+	return 0;
+err:
+	libxfs_buf_relse(bp);
+	return error;
+}
+
+/* Release a buffer that a readahead worker was busy with. */
+static void
+libxfs_buf_ra_done(
+	struct xfs_buf		*bp)
+{
+	pthread_mutex_lock(&libxfs_ra_lock);
+	bp->b_flags &= ~LIBXFS_B_READAHEAD;
+	pthread_cond_broadcast(&libxfs_ra_cond);
+	pthread_mutex_unlock(&libxfs_ra_lock);
+
+	/* Undo the lookup's priority drop so it survives until used. */
+	cache_node_set_priority(libxfs_bcache, &bp->b_node,
+			cache_node_get_priority(&bp->b_node) +
+			CACHE_PREFETCH_PRIORITY);
+}
+
+static void
+libxfs_buf_ra_free(
+	struct libxfs_ra_work	*raw)
+{
+	free(raw);
+	pthread_mutex_lock(&libxfs_ra_lock);
+	if (--libxfs_ra_inflight == 0)
+		pthread_cond_broadcast(&libxfs_ra_cond);
+	pthread_mutex_unlock(&libxfs_ra_lock);
+}
+
+/*
+ * Run the verifier on a block that readahead just brought in, unless the
+ * reader got there first.
+ */
+static void
+libxfs_buf_verify_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct libxfs_ra_work	*raw = arg;
+	struct xfs_buf		*bp;
+	bool			doverify = false;
+	int			error;
+
+	error = __libxfs_buf_get_map(raw->btp, raw->maps, raw->nmaps,
+			LIBXFS_GETBUF_TRYLOCK, &bp);
+	if (error)
+		goto out;
+
+	pthread_mutex_lock(&bp->b_node.cn_mutex);
+	if (bp->b_node.cn_count == 1 &&
+	    (bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY |
+			    LIBXFS_B_UNCHECKED)) ==
+			(LIBXFS_B_UPTODATE | LIBXFS_B_UNCHECKED)) {
+		bp->b_flags |= LIBXFS_B_READAHEAD;
+		doverify = true;
+	}
+	pthread_mutex_unlock(&bp->b_node.cn_mutex);
+
+	if (doverify) {
+		bp->b_verify_error = libxfs_readbuf_verify(bp, raw->ops);
+		bp->b_verify_ops = raw->ops;
+		bp->b_error = 0;
+		libxfs_buf_ra_done(bp);
+	}
+	libxfs_buf_relse(bp);
+out:
+	libxfs_buf_ra_free(raw);
+}
+
+/* Set the number of threads that verify blocks brought in by readahead. */
+void
+libxfs_buf_verify_offload(
+	unsigned int		nr_threads)
+{
+	pthread_mutex_lock(&libxfs_ra_lock);
+	libxfs_verify_threads = nr_threads;
+	pthread_mutex_unlock(&libxfs_ra_lock);
+}
+
+static void
+libxfs_buf_ra_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct libxfs_ra_work	*raw = arg;
+	struct xfs_buf		*bp;
+	bool			doread = false;
+	int			error;
+
+	error = __libxfs_buf_get_map(raw->btp, raw->maps, raw->nmaps,
+			LIBXFS_GETBUF_TRYLOCK, &bp);
+	if (error)
+		goto out;
+
+	pthread_mutex_lock(&bp->b_node.cn_mutex);
+	if (bp->b_node.cn_count == 1 &&
+	    !(bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY))) {
+		bp->b_flags |= LIBXFS_B_READAHEAD;
+		doread = true;
+	}
+	pthread_mutex_unlock(&bp->b_node.cn_mutex);
+
+	if (doread) {
+		if (raw->nmaps == 1)
+			error = libxfs_readbufr(raw->btp, raw->maps[0].bm_bn,
+					bp, raw->maps[0].bm_len, 0);
+		else
+			error = libxfs_readbufr_map(raw->btp, bp, 0);
+		if (!error) {
+			bp->b_flags |= LIBXFS_B_UNCHECKED | LIBXFS_B_RA_UNUSED;
+			bp->b_ra_ops = raw->ops;
+			uatomic_inc(&bcache_type(raw->ops)->st.ra_reads);
+			bcache_count_read(raw->btp, raw->maps[0].bm_bn);
+		}
+		libxfs_buf_ra_done(bp);
+	}
+	libxfs_buf_relse(bp);
+
+	/* Hand the work item on to the verifier pool if there is one. */
+	if (doread && !error && raw->ops && libxfs_verify_active &&
+	    !workqueue_add(&libxfs_verify_wq, libxfs_buf_verify_worker, 0,
+			raw))
+		return;
+out:
+	libxfs_buf_ra_free(raw);
+}
+
+/* Start reading a buffer into the cache without waiting for it. */
+void
+libxfs_buf_readahead_map(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf_map	*map,
+	int			nmaps,
+	const struct xfs_buf_ops *ops)
+{
+	struct libxfs_ra_work	*raw;
+
+	pthread_mutex_lock(&libxfs_ra_lock);
+	if (!libxfs_ra_active && !libxfs_ra_failed) {
+		if (workqueue_create(&libxfs_ra_wq, NULL, LIBXFS_RA_WORKERS))
+			libxfs_ra_failed = true;
+		else
+			libxfs_ra_active = true;
+		if (libxfs_ra_active && libxfs_verify_threads &&
+		    !workqueue_create(&libxfs_verify_wq, NULL,
+				libxfs_verify_threads))
+			libxfs_verify_active = true;
+	}
+	if (!libxfs_ra_active ||
+	    libxfs_ra_inflight >= LIBXFS_RA_MAX_INFLIGHT) {
+		pthread_mutex_unlock(&libxfs_ra_lock);
+		return;
+	}
+	libxfs_ra_inflight++;
+	pthread_mutex_unlock(&libxfs_ra_lock);
+
+	raw = malloc(sizeof(*raw) + nmaps * sizeof(struct xfs_buf_map));
+	if (!raw)
+		goto out_drop;
+	raw->btp = btp;
+	raw->ops = ops;
+	raw->nmaps = nmaps;
+	memcpy(raw->maps, map, nmaps * sizeof(struct xfs_buf_map));
+
+	if (workqueue_add(&libxfs_ra_wq, libxfs_buf_ra_worker, 0, raw)) {
+		free(raw);
+		goto out_drop;
+	}
+	return;
+
+out_drop:
+	pthread_mutex_lock(&libxfs_ra_lock);
+	if (--libxfs_ra_inflight == 0)
+		pthread_cond_broadcast(&libxfs_ra_cond);
+	pthread_mutex_unlock(&libxfs_ra_lock);
+}
+
+/*
+ * Fill a buffer from a copy of the block that the caller saved elsewhere,
+ * so that reading it doesn't have to go to the device.  Like readahead,
+ * the contents are verified when the buffer is first read.  Returns true
+ * if the buffer is up to date, whether or not we filled it.
+ */
+bool
+libxfs_buf_prime(
+	struct xfs_buftarg	*btp,
+	xfs_daddr_t		blkno,
+	size_t			numblks,
+	const void		*data)
+{
+	DEFINE_SINGLE_BUF_MAP(map, blkno, numblks);
+	struct xfs_buf		*bp;
+	bool			uptodate = false;
+
+	if (__libxfs_buf_get_map(btp, &map, 1, LIBXFS_GETBUF_TRYLOCK, &bp))
+		return false;
+
+	pthread_mutex_lock(&bp->b_node.cn_mutex);
+	if (bp->b_flags & (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY)) {
+		uptodate = true;
+	} else if (bp->b_node.cn_count == 1 &&
+		   !(bp->b_flags & LIBXFS_B_READAHEAD)) {
+		memcpy(bp->b_addr, data, BBTOB(numblks));
+		bp->b_flags |= LIBXFS_B_UPTODATE | LIBXFS_B_UNCHECKED;
+		bp->b_error = 0;
+		uptodate = true;
+	}
+	pthread_mutex_unlock(&bp->b_node.cn_mutex);
+
+	libxfs_buf_relse(bp);
+	return uptodate;
+}
+
+/* Wait for all outstanding readahead to finish. */
+void
+libxfs_buf_readahead_drain(void)
+{
+	pthread_mutex_lock(&libxfs_ra_lock);
+	while (libxfs_ra_inflight > 0)
+		pthread_cond_wait(&libxfs_ra_cond, &libxfs_ra_lock);
+	pthread_mutex_unlock(&libxfs_ra_lock);
+}
+
+/* Drain readahead and shut down the worker threads. */
+void
+libxfs_buf_readahead_destroy(void)
+{
+	libxfs_buf_readahead_drain();
+
+	pthread_mutex_lock(&libxfs_ra_lock);
+	if (!libxfs_ra_active) {
+		pthread_mutex_unlock(&libxfs_ra_lock);
+		return;
+	}
+	libxfs_ra_active = false;
+	pthread_mutex_unlock(&libxfs_ra_lock);
+
+	workqueue_terminate(&libxfs_ra_wq);
+	workqueue_destroy(&libxfs_ra_wq);
+	if (libxfs_verify_active) {
+		libxfs_verify_active = false;
+		workqueue_terminate(&libxfs_verify_wq);
+		workqueue_destroy(&libxfs_verify_wq);
+	}
+}
+
+/* Allocate a raw uncached buffer. */
+static inline struct xfs_buf *
+libxfs_getbufr_uncached(
+	struct xfs_buftarg	*targ,
+	xfs_daddr_t		daddr,
+	size_t			bblen)
+{
+	struct xfs_buf		*bp;
+
+	bp = libxfs_getbufr(targ, daddr, bblen);
+	if (!bp)
+		return NULL;
+
+	INIT_LIST_HEAD(&bp->b_node.cn_hash);
+	bp->b_node.cn_count = 1;
+	return bp;
+}
+
+/*
+ * Allocate an uncached buffer that points nowhere.  The refcount will be 1,
+ * and the cache node hash list will be empty to indicate that it's uncached.
+ */
+int
+libxfs_buf_get_uncached(
+	struct xfs_buftarg	*targ,
+	size_t			bblen,
+	int			flags,
+	struct xfs_buf		**bpp)
+{
+	*bpp = libxfs_getbufr_uncached(targ, XFS_BUF_DADDR_NULL, bblen);
+	return *bpp != NULL ? 0 : -ENOMEM;
+}
+
+/*
+ * Allocate and read an uncached buffer.  The refcount will be 1, and the cache
+ * node hash list will be empty to indicate that it's uncached.
+ */
+int
+libxfs_buf_read_uncached(
+	struct xfs_buftarg	*targ,
+	xfs_daddr_t		daddr,
+	size_t			bblen,
+	int			flags,
+	struct xfs_buf		**bpp,
+	const struct xfs_buf_ops *ops)
+{
+	struct xfs_buf		*bp;
+	int			error;
+
+	*bpp = NULL;
+	bp = libxfs_getbufr_uncached(targ, daddr, bblen);
+	if (!bp)
+		return -ENOMEM;
+
+	error = libxfs_readbufr(targ, daddr, bp, bblen, flags);
+	if (error)
+		goto err;
+
+	error = libxfs_readbuf_verify(bp, ops);
+	if (error)
+		goto err;
+
+	*bpp = bp;
+	return 0;
+err:
+	libxfs_buf_relse(bp);
+	return error;
+}
+
+/*
+ * Get a buffer ready to be written: run the writeback hook and the write
+ * verifier.  Returns nonzero if the buffer must not be written.  The messages
+ * here and in libxfs_bwrite_done() name libxfs_bwrite because that's what
+ * users have always seen, even when the write is part of a batch.
+ */
+static int
+libxfs_bwrite_prep(
+	struct xfs_buf	*bp)
+{
+	/*
+	 * we never write buffers that are marked stale. This indicates they
+	 * contain data that has been invalidated, and even if the buffer is
+	 * dirty it must *never* be written. Verifiers are wonderful for finding
+	 * bugs like this. Make sure the error is obvious as to the cause.
+	 */
+	if (bp->b_flags & LIBXFS_B_STALE) {
+		bp->b_error = -ESTALE;
+		return bp->b_error;
+	}
+
+	/* Trigger the writeback hook if there is one. */
+	if (bp->b_mount->m_buf_writeback_fn)
+		bp->b_mount->m_buf_writeback_fn(bp);
+
+	/*
+	 * clear any pre-existing error status on the buffer. This can occur if
+	 * the buffer is corrupt on disk and the repair process doesn't clear
+	 * the error before fixing and writing it back.
+	 */
+	bp->b_error = 0;
+	if (bp->b_ops) {
+		bp->b_ops->verify_write(bp);
+		if (bp->b_error) {
+			fprintf(stderr,
+	_("%s: write verifier failed on %s bno 0x%llx/0x%x\n"),
+				"libxfs_bwrite", bp->b_ops->name,
+				(unsigned long long)xfs_buf_daddr(bp),
+				bp->b_length);
+			return bp->b_error;
+		}
+	}
+	return 0;
+}
+
+/* Record the outcome of the write in bp->b_error. */
+static void
+libxfs_bwrite_done(
+	struct xfs_buf	*bp)
+{
+	if (bp->b_error) {
+		fprintf(stderr,
+	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
+			"libxfs_bwrite",
+			bp->b_ops ? bp->b_ops->name : "(unknown)",
+			(unsigned long long)xfs_buf_daddr(bp),
+			bp->b_length, -bp->b_error);
+	} else {
+		bp->b_flags |= LIBXFS_B_UPTODATE;
+		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
+		xfs_buftarg_trip_write(bp->b_target);
+	}
+}
+
+int
+libxfs_bwrite(
+	struct xfs_buf	*bp)
+{
+	if (libxfs_bwrite_prep(bp))
+		return bp->b_error;
+
+	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
+		struct xfs_buftarg_io	io = {
+			.bio_buf	= bp->b_addr,
+			.bio_len	= BBTOB(bp->b_length),
+			.bio_offset	= LIBXFS_BBTOOFF64(xfs_buf_daddr(bp)),
+		};
+
+		bp->b_error = libxfs_buftarg_rw(bp->b_target, &io, 1, true);
+	} else {
+		bp->b_error = libxfs_buf_rw_maps(bp->b_target, bp, true);
+	}
+
+	libxfs_bwrite_done(bp);
+	return bp->b_error;
+}
+
+/*
+ * Sorted, merged writeback.
+ *
+ * Writing back a large number of dirty buffers in whatever order they happen
+ * to be in generates lots of small random writes.  Instead, sort the buffers
+ * by disk address, merge buffers that are adjacent on disk into a single
+ * vectored write and hand the writes to the I/O engine in batches, so that
+ * they can all be in flight at the same time if the target uses io_uring.
+ */
+#define LIBXFS_WB_BATCH		256		/* buffers per batch */
+#define LIBXFS_WB_MAX_IOV	64		/* buffers per write */
+#define LIBXFS_WB_MAX_BYTES	(1U << 20)	/* bytes per write */
+
+static int
+libxfs_buf_cmp_daddr(
+	const void		*a,
+	const void		*b)
+{
+	struct xfs_buf		*ba = *(struct xfs_buf **)a;
+	struct xfs_buf		*bb = *(struct xfs_buf **)b;
+
+	if (ba->b_target != bb->b_target)
+		return ba->b_target < bb->b_target ? -1 : 1;
+	if (xfs_buf_daddr(ba) != xfs_buf_daddr(bb))
+		return xfs_buf_daddr(ba) < xfs_buf_daddr(bb) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Compute the crcs that the write verifiers deferred.  Zero the crc field of
+ * each buffer, checksum them all in one go and fill in the results.
+ */
+static void
+libxfs_bwrite_cksums(
+	struct xfs_buf		**bps,
+	unsigned int		nr)
+{
+	unsigned char const	*p[LIBXFS_WB_BATCH];
+	size_t			len[LIBXFS_WB_BATCH];
+	uint32_t		crc[LIBXFS_WB_BATCH];
+	unsigned int		i;
+
+	ASSERT(nr <= LIBXFS_WB_BATCH);
+
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
+
+		*(__le32 *)(bp->b_addr + bp->b_cksum_offset) = 0;
+		p[i] = bp->b_addr;
+		len[i] = BBTOB(bp->b_length);
+		crc[i] = XFS_CRC_SEED;
+	}
+
+	crc32c_le_multi(crc, p, len, nr);
+
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
+
+		*(__le32 *)(bp->b_addr + bp->b_cksum_offset) =
+				xfs_end_cksum(crc[i]);
+		bp->b_flags &= ~LIBXFS_B_CKSUM_PENDING;
 	}
-	return 0;
 }
 
-int
-libxfs_bwrite(
-	struct xfs_buf	*bp)
+/*
+ * Write one batch of sorted buffers, all of which belong to the same target.
+ * Returns the first error encountered.
+ */
+static int
+libxfs_bwrite_batch(
+	struct xfs_buf		**bps,
+	unsigned int		nr)
 {
-	int		fd = libxfs_device_to_fd(bp->b_target->bt_bdev);
+	struct iovec		iov[LIBXFS_WB_BATCH];
+	struct xfs_buftarg_io	io[LIBXFS_WB_BATCH];
+	int			ioidx[LIBXFS_WB_BATCH];
+	struct xfs_buf		*cksum[LIBXFS_WB_BATCH];
+	struct xfs_buftarg_io	*cur = NULL;
+	unsigned int		nr_io = 0;
+	unsigned int		nr_iov = 0;
+	unsigned int		nr_cksum = 0;
+	unsigned int		i;
+	int			error = 0;
 
-	/*
-	 * we never write buffers that are marked stale. This indicates they
-	 * contain data that has been invalidated, and even if the buffer is
-	 * dirty it must *never* be written. Verifiers are wonderful for finding
-	 * bugs like this. Make sure the error is obvious as to the cause.
-	 */
-	if (bp->b_flags & LIBXFS_B_STALE) {
-		bp->b_error = -ESTALE;
-		return bp->b_error;
-	}
+	ASSERT(nr <= LIBXFS_WB_BATCH);
 
-	/* Trigger the writeback hook if there is one. */
-	if (bp->b_mount->m_buf_writeback_fn)
-		bp->b_mount->m_buf_writeback_fn(bp);
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
+		off64_t		offset = LIBXFS_BBTOOFF64(xfs_buf_daddr(bp));
+		size_t		len = BBTOB(bp->b_length);
 
-	/*
-	 * clear any pre-existing error status on the buffer. This can occur if
-	 * the buffer is corrupt on disk and the repair process doesn't clear
-	 * the error before fixing and writing it back.
-	 */
-	bp->b_error = 0;
-	if (bp->b_ops) {
-		bp->b_ops->verify_write(bp);
+		ioidx[i] = -1;
+		if (bp->b_flags & LIBXFS_B_DISCONTIG) {
+			libxfs_bwrite(bp);
+			continue;
+		}
+
+		bp->b_flags |= LIBXFS_B_CKSUM_DEFER;
+		libxfs_bwrite_prep(bp);
+		bp->b_flags &= ~LIBXFS_B_CKSUM_DEFER;
 		if (bp->b_error) {
-			fprintf(stderr,
-	_("%s: write verifier failed on %s bno 0x%llx/0x%x\n"),
-				__func__, bp->b_ops->name,
-				(unsigned long long)xfs_buf_daddr(bp),
-				bp->b_length);
-			return bp->b_error;
+			bp->b_flags &= ~LIBXFS_B_CKSUM_PENDING;
+			continue;
+		}
+		if (bp->b_flags & LIBXFS_B_CKSUM_PENDING)
+			cksum[nr_cksum++] = bp;
+
+		if (!cur || cur->bio_offset + cur->bio_len != offset ||
+		    cur->bio_iovcnt >= LIBXFS_WB_MAX_IOV ||
+		    cur->bio_len + len > LIBXFS_WB_MAX_BYTES) {
+			cur = &io[nr_io++];
+			cur->bio_buf = NULL;
+			cur->bio_iov = &iov[nr_iov];
+			cur->bio_iovcnt = 0;
+			cur->bio_len = 0;
+			cur->bio_offset = offset;
 		}
+		iov[nr_iov].iov_base = bp->b_addr;
+		iov[nr_iov].iov_len = len;
+		nr_iov++;
+		cur->bio_iovcnt++;
+		cur->bio_len += len;
+		ioidx[i] = cur - io;
 	}
 
-	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
-		bp->b_error = __write_buf(fd, bp->b_addr, BBTOB(bp->b_length),
-				    LIBXFS_BBTOOFF64(xfs_buf_daddr(bp)),
-				    bp->b_flags);
-	} else {
-		int	i;
-		void	*buf = bp->b_addr;
+	if (nr_cksum)
+		libxfs_bwrite_cksums(cksum, nr_cksum);
+	if (nr_io)
+		libxfs_buftarg_rw(bps[0]->b_target, io, nr_io, true);
 
-		for (i = 0; i < bp->b_nmaps; i++) {
-			off64_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-			int len = BBTOB(bp->b_maps[i].bm_len);
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
 
-			bp->b_error = __write_buf(fd, buf, len, offset,
-						  bp->b_flags);
-			if (bp->b_error)
-				break;
-			buf += len;
+		if (ioidx[i] >= 0) {
+			bp->b_error = io[ioidx[i]].bio_error;
+			libxfs_bwrite_done(bp);
 		}
+		if (bp->b_error && !error)
+			error = bp->b_error;
 	}
+	return error;
+}
 
-	if (bp->b_error) {
-		fprintf(stderr,
-	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
-			__func__, bp->b_ops ? bp->b_ops->name : "(unknown)",
-			(unsigned long long)xfs_buf_daddr(bp),
-			bp->b_length, -bp->b_error);
-	} else {
-		bp->b_flags |= LIBXFS_B_UPTODATE;
-		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
-		xfs_buftarg_trip_write(bp->b_target);
+/*
+ * Write out an array of buffers that is already in disk address order.
+ * Returns the first error encountered.
+ */
+static int
+libxfs_bwrite_ordered(
+	struct xfs_buf		**bps,
+	unsigned int		nr)
+{
+	unsigned int		i, j;
+	int			error = 0, error2;
+
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr && j - i < LIBXFS_WB_BATCH; j++)
+			if (bps[j]->b_target != bps[i]->b_target)
+				break;
+		error2 = libxfs_bwrite_batch(&bps[i], j - i);
+		if (!error)
+			error = error2;
 	}
-	return bp->b_error;
+	return error;
+}
+
+/*
+ * Write out an array of buffers in disk address order.  The array is sorted
+ * in place.  Returns the first error encountered.
+ */
+static int
+libxfs_bwrite_sorted(
+	struct xfs_buf		**bps,
+	unsigned int		nr)
+{
+	qsort(bps, nr, sizeof(struct xfs_buf *), libxfs_buf_cmp_daddr);
+	return libxfs_bwrite_ordered(bps, nr);
 }
 
 /*
@@ -911,6 +2088,19 @@ libxfs_buf_prepare_mru(
 	bp->b_target->flags |= XFS_BUFTARG_LOST_WRITE;
 }
 
+/* Put a buffer on the free list. */
+static void
+__libxfs_brelse(
+	struct xfs_buf		*bp)
+{
+	libxfs_buf_prepare_mru(bp);
+
+	pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
+	list_add(&bp->b_node.cn_mru, &xfs_buf_freelist.cm_list);
+	pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
+}
+
+/* The cache has evicted a buffer. */
 static void
 libxfs_brelse(
 	struct cache_node	*node)
@@ -920,11 +2110,8 @@ libxfs_brelse(
 
 	if (!bp)
 		return;
-	libxfs_buf_prepare_mru(bp);
-
-	pthread_mutex_lock(&xfs_buf_freelist.cm_mutex);
-	list_add(&bp->b_node.cn_mru, &xfs_buf_freelist.cm_list);
-	pthread_mutex_unlock(&xfs_buf_freelist.cm_mutex);
+	bcache_count_evict(bp);
+	__libxfs_brelse(bp);
 }
 
 static unsigned int
@@ -939,6 +2126,7 @@ libxfs_bulkrelse(
 		return 0 ;
 
 	list_for_each_entry(bp, list, b_node.cn_mru) {
+		bcache_count_evict(bp);
 		libxfs_buf_prepare_mru(bp);
 		count++;
 	}
@@ -961,11 +2149,13 @@ libxfs_bcache_free(void)
 
 	cm_list = &xfs_buf_freelist.cm_list;
 	list_for_each_entry_safe(bp, next, cm_list, b_node.cn_mru) {
-		free(bp->b_addr);
+		libxfs_buf_arena_free(bp->b_addr, bp->b_addr_len);
 		if (bp->b_maps != &bp->__b_map)
 			free(bp->b_maps);
 		kmem_cache_free(xfs_buf_cache, bp);
 	}
+	INIT_LIST_HEAD(cm_list);
+	libxfs_buf_arena_destroy();
 }
 
 /*
@@ -987,10 +2177,46 @@ libxfs_bflush(
 	return bp->b_error;
 }
 
+static bool
+libxfs_bdirty(
+	struct cache_node	*node)
+{
+	struct xfs_buf		*bp = container_of(node, struct xfs_buf,
+						   b_node);
+
+	return !bp->b_error && (bp->b_flags & LIBXFS_B_DIRTY);
+}
+
+/* Write back a set of dirty (and referenced) buffers in disk order. */
+static void
+libxfs_bulkflush(
+	struct cache		*cache,
+	struct cache_node	**nodes,
+	unsigned int		nr)
+{
+	struct xfs_buf		**bps;
+	unsigned int		i;
+
+	bps = malloc(nr * sizeof(struct xfs_buf *));
+	if (!bps) {
+		for (i = 0; i < nr; i++)
+			libxfs_bflush(nodes[i]);
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+		bps[i] = container_of(nodes[i], struct xfs_buf, b_node);
+	libxfs_bwrite_sorted(bps, nr);
+	free(bps);
+}
+
 void
 libxfs_bcache_purge(void)
 {
+	libxfs_buf_readahead_drain();
+	bcache_purging = true;
 	cache_purge(libxfs_bcache);
+	bcache_purging = false;
 }
 
 void
@@ -1002,7 +2228,27 @@ libxfs_bcache_flush(void)
 int
 libxfs_bcache_overflowed(void)
 {
-	return cache_overflowed(libxfs_bcache);
+	return cache_overflowed(libxfs_bcache) || libxfs_buf_arena_overlimit();
+}
+
+/*
+ * Give back some memory: cut the buffer cache and the buffer arena limit by
+ * @percent, but never below @min_nodes cache entries.
+ */
+void
+libxfs_bcache_shrink(
+	unsigned int		percent,
+	unsigned int		min_nodes)
+{
+	unsigned long long	usage = libxfs_buf_arena_usage();
+	unsigned int		count = cache_node_count(libxfs_bcache);
+	unsigned int		target;
+
+	target = count - (unsigned long long)count * percent / 100;
+	if (target < min_nodes)
+		target = min_nodes;
+	cache_shrink(libxfs_bcache, target);
+	libxfs_buf_arena_set_limit(usage - usage * percent / 100);
 }
 
 struct cache_operations libxfs_bcache_operations = {
@@ -1011,7 +2257,10 @@ struct cache_operations libxfs_bcache_operations = {
 	.flush		= libxfs_bflush,
 	.relse		= libxfs_brelse,
 	.compare	= libxfs_bcompare,
-	.bulkrelse	= libxfs_bulkrelse
+	.bulkrelse	= libxfs_bulkrelse,
+	.dirty		= libxfs_bdirty,
+	.bulkflush	= libxfs_bulkflush,
+	.fingerprint	= libxfs_bfingerprint,
 };
 
 /*
@@ -1053,12 +2302,193 @@ xfs_verify_magic16(
 }
 
 /*
- * Inode cache stubs.
+ * Inode cache.
+ *
+ * Inodes whose last reference is dropped are parked here rather than torn
+ * down, so that going back to the same inode - the root directory, the
+ * orphanage, the parent of the directory being fixed - doesn't have to decode
+ * the dinode and load the extent list all over again.  Parked inodes have no
+ * references, so a cache hit hands out an inode that nobody else holds, just
+ * like a fresh read would.
+ *
+ * Each inode keeps a copy of its dinode as it was read in or last flushed by
+ * a transaction commit, and a parked inode is only reused if the cluster
+ * buffer still holds exactly that.  Anything that changes the inode on disk
+ * behind our back, such as poking at the buffer directly, makes us read it
+ * afresh.  Changes logged to a transaction that is then cancelled throw the
+ * copy away, so such an inode is never parked.
  */
+#define LIBXFS_ICACHE_HASH	1024
+#define LIBXFS_ICACHE_MAX	1024
 
 struct kmem_cache		*xfs_inode_cache;
 extern struct kmem_cache	*xfs_ili_cache;
 
+static struct list_head		icache_hash[LIBXFS_ICACHE_HASH];
+static LIST_HEAD(icache_lru);
+static unsigned int		icache_count;
+static pthread_mutex_t		icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct list_head *
+libxfs_icache_bucket(
+	xfs_ino_t		ino)
+{
+	return &icache_hash[ino % LIBXFS_ICACHE_HASH];
+}
+
+static void
+libxfs_idestroy(xfs_inode_t *ip)
+{
+	switch (VFS_I(ip)->i_mode & S_IFMT) {
+		case S_IFREG:
+		case S_IFDIR:
+		case S_IFLNK:
+			libxfs_idestroy_fork(&ip->i_df);
+			break;
+	}
+	if (ip->i_afp) {
+		libxfs_idestroy_fork(ip->i_afp);
+		kmem_cache_free(xfs_ifork_cache, ip->i_afp);
+	}
+	if (ip->i_cowfp) {
+		libxfs_idestroy_fork(ip->i_cowfp);
+		kmem_cache_free(xfs_ifork_cache, ip->i_cowfp);
+	}
+	free(ip->i_dcopy);
+	kmem_cache_free(xfs_inode_cache, ip);
+}
+
+/* Pull a parked inode out of the cache, if there is one. */
+static struct xfs_inode *
+libxfs_icache_take(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino)
+{
+	struct list_head	*bucket = libxfs_icache_bucket(ino);
+	struct xfs_inode	*ip;
+
+	pthread_mutex_lock(&icache_lock);
+	if (!icache_count)
+		goto out;
+	list_for_each_entry(ip, bucket, i_hash) {
+		if (ip->i_ino == ino && ip->i_mount == mp) {
+			list_del_init(&ip->i_hash);
+			list_del_init(&ip->i_lru);
+			icache_count--;
+			pthread_mutex_unlock(&icache_lock);
+			return ip;
+		}
+	}
+out:
+	pthread_mutex_unlock(&icache_lock);
+	return NULL;
+}
+
+/* Park an unreferenced inode, pushing out the least recently parked. */
+static void
+libxfs_icache_park(
+	struct xfs_inode	*ip)
+{
+	struct xfs_inode	*victim = NULL;
+	int			i;
+
+	pthread_mutex_lock(&icache_lock);
+	if (!icache_hash[0].next) {
+		for (i = 0; i < LIBXFS_ICACHE_HASH; i++)
+			INIT_LIST_HEAD(&icache_hash[i]);
+	}
+	if (icache_count == LIBXFS_ICACHE_MAX) {
+		victim = list_last_entry(&icache_lru, struct xfs_inode, i_lru);
+		list_del_init(&victim->i_hash);
+		list_del_init(&victim->i_lru);
+		icache_count--;
+	}
+	list_add(&ip->i_hash, libxfs_icache_bucket(ip->i_ino));
+	list_add(&ip->i_lru, &icache_lru);
+	icache_count++;
+	pthread_mutex_unlock(&icache_lock);
+
+	if (victim)
+		libxfs_idestroy(victim);
+}
+
+/*
+ * Record what the inode looks like on disk after it has been flushed to @bp,
+ * or forget it if the incore inode can no longer be trusted to match.
+ */
+void
+libxfs_icache_sync(
+	struct xfs_inode	*ip,
+	struct xfs_buf		*bp)
+{
+	if (!bp) {
+		free(ip->i_dcopy);
+		ip->i_dcopy = NULL;
+		return;
+	}
+	if (ip->i_dcopy)
+		memcpy(ip->i_dcopy, xfs_buf_offset(bp, ip->i_imap.im_boffset),
+				ip->i_mount->m_sb.sb_inodesize);
+}
+
+/* Throw away every parked inode of this mount. */
+void
+libxfs_icache_purge(
+	struct xfs_mount	*mp)
+{
+	struct xfs_inode	*ip, *n;
+	LIST_HEAD(dispose);
+
+	pthread_mutex_lock(&icache_lock);
+	list_for_each_entry_safe(ip, n, &icache_lru, i_lru) {
+		if (ip->i_mount != mp)
+			continue;
+		list_del_init(&ip->i_hash);
+		list_move(&ip->i_lru, &dispose);
+		icache_count--;
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	list_for_each_entry_safe(ip, n, &dispose, i_lru)
+		libxfs_idestroy(ip);
+}
+
+/*
+ * Try to reuse a parked inode.  The cluster buffer is read (and joined to
+ * the transaction) either way, so all a hit saves is decoding the inode.
+ */
+static struct xfs_inode *
+libxfs_iget_cached(
+	struct xfs_mount	*mp,
+	struct xfs_trans	*tp,
+	xfs_ino_t		ino)
+{
+	struct xfs_inode	*ip;
+	struct xfs_buf		*bp;
+	bool			same;
+
+	ip = libxfs_icache_take(mp, ino);
+	if (!ip)
+		return NULL;
+
+	if (xfs_imap_to_bp(mp, tp, &ip->i_imap, &bp)) {
+		libxfs_idestroy(ip);
+		return NULL;
+	}
+	same = !memcmp(ip->i_dcopy, xfs_buf_offset(bp, ip->i_imap.im_boffset),
+			mp->m_sb.sb_inodesize);
+	if (same)
+		xfs_buf_set_ref(bp, XFS_INO_REF);
+	xfs_trans_brelse(tp, bp);
+	if (!same) {
+		libxfs_idestroy(ip);
+		return NULL;
+	}
+
+	VFS_I(ip)->i_count = 1;
+	return ip;
+}
+
 int
 libxfs_iget(
 	struct xfs_mount	*mp,
@@ -1071,6 +2501,12 @@ libxfs_iget(
 	struct xfs_buf		*bp;
 	int			error = 0;
 
+	ip = libxfs_iget_cached(mp, tp, ino);
+	if (ip) {
+		*ipp = ip;
+		return 0;
+	}
+
 	ip = kmem_cache_zalloc(xfs_inode_cache, 0);
 	if (!ip)
 		return -ENOMEM;
@@ -1078,6 +2514,8 @@ libxfs_iget(
 	VFS_I(ip)->i_count = 1;
 	ip->i_ino = ino;
 	ip->i_mount = mp;
+	INIT_LIST_HEAD(&ip->i_hash);
+	INIT_LIST_HEAD(&ip->i_lru);
 	spin_lock_init(&VFS_I(ip)->i_lock);
 
 	error = xfs_imap(mp, tp, ip->i_ino, &ip->i_imap, 0);
@@ -1090,8 +2528,12 @@ libxfs_iget(
 
 	error = xfs_inode_from_disk(ip,
 			xfs_buf_offset(bp, ip->i_imap.im_boffset));
-	if (!error)
+	if (!error) {
 		xfs_buf_set_ref(bp, XFS_INO_REF);
+		/* without a copy to check against, it just won't be cached */
+		ip->i_dcopy = malloc(mp->m_sb.sb_inodesize);
+		libxfs_icache_sync(ip, bp);
+	}
 	xfs_trans_brelse(tp, bp);
 
 	if (error)
@@ -1106,26 +2548,6 @@ out_destroy:
 	return error;
 }
 
-static void
-libxfs_idestroy(xfs_inode_t *ip)
-{
-	switch (VFS_I(ip)->i_mode & S_IFMT) {
-		case S_IFREG:
-		case S_IFDIR:
-		case S_IFLNK:
-			libxfs_idestroy_fork(&ip->i_df);
-			break;
-	}
-	if (ip->i_afp) {
-		libxfs_idestroy_fork(ip->i_afp);
-		kmem_cache_free(xfs_ifork_cache, ip->i_afp);
-	}
-	if (ip->i_cowfp) {
-		libxfs_idestroy_fork(ip->i_cowfp);
-		kmem_cache_free(xfs_ifork_cache, ip->i_cowfp);
-	}
-}
-
 void
 libxfs_irele(
 	struct xfs_inode	*ip)
@@ -1134,8 +2556,10 @@ libxfs_irele(
 
 	if (VFS_I(ip)->i_count == 0) {
 		ASSERT(ip->i_itemp == NULL);
-		libxfs_idestroy(ip);
-		kmem_cache_free(xfs_inode_cache, ip);
+		if (ip->i_dcopy)
+			libxfs_icache_park(ip);
+		else
+			libxfs_idestroy(ip);
 	}
 }
 
@@ -1157,29 +2581,64 @@ libxfs_blkdev_issue_flush(
 	return ret ? -errno : 0;
 }
 
+/* Order delwri list buffers the same way as libxfs_buf_cmp_daddr. */
+static int
+xfs_buf_delwri_cmp(
+	void			*priv,
+	struct list_head	*a,
+	struct list_head	*b)
+{
+	struct xfs_buf		*ba = list_entry(a, struct xfs_buf, b_list);
+	struct xfs_buf		*bb = list_entry(b, struct xfs_buf, b_list);
+
+	return libxfs_buf_cmp_daddr(&ba, &bb);
+}
+
 /*
  * Write out a buffer list synchronously.
  *
  * This will take the @buffer_list, write all buffers out and wait for I/O
  * completion on all of the buffers. @buffer_list is consumed by the function,
  * so callers must have some other way of tracking buffers if they require such
- * functionality.
+ * functionality.  Huge lists are sorted into disk order by several threads.
  */
 int
 xfs_buf_delwri_submit(
 	struct list_head	*buffer_list)
 {
 	struct xfs_buf		*bp, *n;
+	struct xfs_buf		**bps;
+	unsigned int		nr = 0, i;
 	int			error = 0, error2;
 
+	list_sort_parallel(NULL, buffer_list, xfs_buf_delwri_cmp,
+			platform_nproc());
+
+	list_for_each_entry(bp, buffer_list, b_list)
+		nr++;
+
+	bps = malloc(nr * sizeof(struct xfs_buf *));
+	if (!bps) {
+		list_for_each_entry_safe(bp, n, buffer_list, b_list) {
+			list_del_init(&bp->b_list);
+			error2 = libxfs_bwrite(bp);
+			if (!error)
+				error = error2;
+			libxfs_buf_relse(bp);
+		}
+		return error;
+	}
+
+	nr = 0;
 	list_for_each_entry_safe(bp, n, buffer_list, b_list) {
 		list_del_init(&bp->b_list);
-		error2 = libxfs_bwrite(bp);
-		if (!error)
-			error = error2;
-		libxfs_buf_relse(bp);
+		bps[nr++] = bp;
 	}
 
+	error = libxfs_bwrite_ordered(bps, nr);
+	for (i = 0; i < nr; i++)
+		libxfs_buf_relse(bps[i]);
+	free(bps);
 	return error;
 }
 
@@ -1221,24 +2680,25 @@ libxfs_log_clear(
 	int			cycle,
 	bool			max)
 {
+	struct xfs_buftarg_io	io[LOG_CLEAR_BATCH];
+	char			*chunks[LOG_CLEAR_BATCH] = { NULL };
 	struct xfs_buf		*bp = NULL;
 	int			len;
 	xfs_lsn_t		lsn;
 	xfs_lsn_t		tail_lsn;
 	xfs_daddr_t		blk;
 	xfs_daddr_t		end_blk;
+	xfs_daddr_t		chunk_blk;
+	xfs_daddr_t		chunk_end;
+	unsigned int		nr;
+	unsigned int		i;
 	char			*ptr;
+	int			error = 0;
 
 	if (((btp && dptr) || (!btp && !dptr)) ||
 	    (btp && !btp->bt_bdev) || !fs_uuid)
 		return -EINVAL;
 
-	/* first zero the log */
-	if (btp)
-		libxfs_device_zero(btp, start, length);
-	else
-		memset(dptr, 0, BBTOB(length));
-
 	/*
 	 * Initialize the log record length and LSNs. XLOG_INIT_CYCLE is a
 	 * special reset case where we only write a single record where the lsn
@@ -1254,11 +2714,24 @@ libxfs_log_clear(
 	else
 		tail_lsn = xlog_assign_lsn(cycle - 1, length - len);
 
+	/*
+	 * First zero the log.  If we're going to fill the whole log with
+	 * records of the previous cycle there's no point in writing it twice,
+	 * the record buffers below are zeroed before they're formatted.  The
+	 * first record is written in full below, so leave it out too.
+	 */
+	if (btp) {
+		if (cycle == XLOG_INIT_CYCLE && length > len)
+			libxfs_device_zero(btp, start + len, length - len);
+	} else
+		memset(dptr, 0, BBTOB(length));
+
 	/* write out the first log record */
 	ptr = dptr;
 	if (btp) {
 		bp = libxfs_getbufr_uncached(btp, start, len);
 		ptr = bp->b_addr;
+		memset(ptr, 0, BBTOB(len));
 	}
 	libxfs_log_header(ptr, fs_uuid, version, sunit, fmt, lsn, tail_lsn,
 			  next, bp);
@@ -1291,6 +2764,12 @@ libxfs_log_clear(
 	 * kernel finds 1.) a clean log and 2.) the correct current cycle value.
 	 * Therefore, bump up the record size to the max to use larger I/Os and
 	 * improve performance.
+	 *
+	 * Every block of a record starts with the cycle number, so none of this
+	 * can be left to the device to zero.  When writing through the buftarg,
+	 * the records are formatted into chunks holding as many whole records
+	 * as fit in ZERO_CHUNK_SIZE, and LOG_CLEAR_BATCH chunks at a time are
+	 * handed to the I/O engine so that they can all be in flight at once.
 	 */
 	cycle--;
 	blk = start + len;
@@ -1300,32 +2779,68 @@ libxfs_log_clear(
 
 	len = min(end_blk - blk, len);
 	while (blk < end_blk) {
-		lsn = xlog_assign_lsn(cycle, blk - start);
-		tail_lsn = xlog_assign_lsn(cycle, blk - start - len);
+		for (nr = 0; nr < LOG_CLEAR_BATCH && blk < end_blk; nr++) {
+			chunk_blk = blk;
+			chunk_end = end_blk;
+			if (btp) {
+				chunk_end = blk + max_t(int, len,
+					BTOBB(ZERO_CHUNK_SIZE) / len * len);
+				chunk_end = min(end_blk, chunk_end);
+				if (!chunks[nr]) {
+					chunks[nr] = memalign(
+						libxfs_device_alignment(),
+						max_t(size_t, ZERO_CHUNK_SIZE,
+						      BBTOB(len)));
+					if (!chunks[nr]) {
+						error = -ENOMEM;
+						goto out_free;
+					}
+				}
+				memset(chunks[nr], 0, BBTOB(chunk_end - blk));
+				io[nr].bio_buf = chunks[nr];
+				io[nr].bio_iov = NULL;
+				io[nr].bio_iovcnt = 0;
+				io[nr].bio_len = BBTOB(chunk_end - blk);
+				io[nr].bio_offset = BBTOB(blk);
+			}
 
-		ptr = dptr;
-		if (btp) {
-			bp = libxfs_getbufr_uncached(btp, blk, len);
-			ptr = bp->b_addr;
-		}
-		/*
-		 * Note: pass the full buffer length as the sunit to initialize
-		 * the entire buffer.
-		 */
-		libxfs_log_header(ptr, fs_uuid, version, BBTOB(len), fmt, lsn,
-				  tail_lsn, next, bp);
-		if (bp) {
-			libxfs_buf_mark_dirty(bp);
-			libxfs_buf_relse(bp);
+			while (blk < chunk_end) {
+				lsn = xlog_assign_lsn(cycle, blk - start);
+				tail_lsn = xlog_assign_lsn(cycle,
+						blk - start - len);
+
+				ptr = dptr;
+				if (btp)
+					ptr = chunks[nr] +
+						BBTOB(blk - chunk_blk);
+				/*
+				 * Note: pass the full record length as the
+				 * sunit to initialize the entire record.
+				 */
+				libxfs_log_header(ptr, fs_uuid, version,
+						BBTOB(len), fmt, lsn, tail_lsn,
+						next, NULL);
+
+				blk += len;
+				if (dptr)
+					dptr += BBTOB(len);
+				len = min(end_blk - blk, len);
+			}
 		}
 
-		blk += len;
-		if (dptr)
-			dptr += BBTOB(len);
-		len = min(end_blk - blk, len);
+		if (btp) {
+			error = libxfs_buftarg_rw(btp, io, nr, true);
+			if (error)
+				goto out_free;
+			for (i = 0; i < nr; i++)
+				xfs_buftarg_trip_write(btp);
+		}
 	}
 
-	return 0;
+out_free:
+	for (i = 0; i < LOG_CLEAR_BATCH; i++)
+		free(chunks[i]);
+	return error;
 }
 
 int
@@ -11,6 +11,8 @@
 #endif /* ENABLE_BLKID */
 #include "xfs_multidisk.h"
 #include "libfrog/platform.h"
+#include <dirent.h>
+#include <sys/sysmacros.h>
 
 #define TERABYTES(count, blog)	((uint64_t)(count) << (40 - (blog)))
 #define GIGABYTES(count, blog)	((uint64_t)(count) << (30 - (blog)))
@@ -89,6 +91,144 @@ done:
 	*agcount = dblocks / blocks + (dblocks % blocks != 0);
 }
 
+/*
+ * Size the AGs so that @concurrency threads can allocate space at the same
+ * time without queueing up on each other's AGF locks, without making the
+ * AGs so small that a file can't grow without hopping between AGs.  This
+ * can mean fewer AGs than the default on small devices, too.
+ */
+void
+calc_concurrency_ag_geometry(
+	int		blocklog,
+	uint64_t	dblocks,
+	unsigned int	concurrency,
+	uint64_t	*agsize,
+	uint64_t	*agcount)
+{
+	uint64_t	minblocks = GIGABYTES(1, blocklog);
+	uint64_t	blocks;
+
+	if (dblocks < 2 * minblocks)
+		minblocks = XFS_AG_MIN_BLOCKS(blocklog);
+
+	blocks = howmany(dblocks, max(concurrency, 2U));
+	if (blocks < minblocks)
+		blocks = min(minblocks, dblocks);
+	if (blocks > XFS_AG_MAX_BLOCKS(blocklog))
+		blocks = XFS_AG_MAX_BLOCKS(blocklog);
+
+	*agsize = blocks;
+	*agcount = dblocks / blocks + (dblocks % blocks != 0);
+}
+
+/* Read one number out of the block queue attributes in sysfs. */
+static int
+sysfs_queue_attr(
+	const char	*devdir,
+	const char	*attr,
+	char		*buf,
+	size_t		len)
+{
+	char		path[PATH_MAX];
+	FILE		*fp;
+	int		ret = -1;
+
+	/* partitions keep their queue attributes in the parent disk */
+	snprintf(path, sizeof(path), "%s/queue/%s", devdir, attr);
+	fp = fopen(path, "r");
+	if (!fp) {
+		snprintf(path, sizeof(path), "%s/../queue/%s", devdir, attr);
+		fp = fopen(path, "r");
+	}
+	if (!fp)
+		return -1;
+	if (fgets(buf, len, fp)) {
+		buf[strcspn(buf, "\n")] = 0;
+		ret = 0;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/* Count the blk-mq hardware queues of a device, 0 if we can't tell. */
+static int
+sysfs_hw_queues(
+	const char	*devdir)
+{
+	char		path[PATH_MAX];
+	struct dirent	*de;
+	DIR		*dir;
+	int		nr = 0;
+
+	snprintf(path, sizeof(path), "%s/mq", devdir);
+	dir = opendir(path);
+	if (!dir) {
+		snprintf(path, sizeof(path), "%s/../mq", devdir);
+		dir = opendir(path);
+	}
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)) != NULL)
+		if (de->d_name[0] != '.')
+			nr++;
+	closedir(dir);
+	return nr;
+}
+
+/*
+ * Work out how many threads are likely to be allocating space at the same
+ * time on the filesystem we're about to make on @path, from the CPU count
+ * and what sysfs tells us about the device.  Returns 0 if the default AG
+ * geometry is the better choice, and says why in @why.
+ */
+unsigned int
+guess_concurrency(
+	const char	*path,
+	struct fs_concurrency *fc,
+	char		*why,
+	size_t		whylen)
+{
+	char		devdir[PATH_MAX];
+	char		buf[64];
+	struct stat	st;
+	dev_t		dev;
+
+	memset(fc, 0, sizeof(*fc));
+	fc->nr_cpus = platform_nproc();
+	fc->rotational = -1;
+
+	if (path && stat(path, &st) == 0) {
+		dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+		snprintf(devdir, sizeof(devdir), "/sys/dev/block/%u:%u",
+				major(dev), minor(dev));
+		if (!sysfs_queue_attr(devdir, "rotational", buf, sizeof(buf)))
+			fc->rotational = atoi(buf);
+		if (!sysfs_queue_attr(devdir, "zoned", buf, sizeof(buf)))
+			fc->zoned = strcmp(buf, "none") != 0;
+		fc->nr_hw_queues = sysfs_hw_queues(devdir);
+	}
+
+	if (fc->zoned) {
+		snprintf(why, whylen, _("zoned device"));
+		return 0;
+	}
+	if (fc->rotational != 0) {
+		snprintf(why, whylen, fc->rotational < 0 ?
+				_("can't tell if the device is rotational") :
+				_("rotational device"));
+		return 0;
+	}
+	if (fc->nr_hw_queues <= 1) {
+		snprintf(why, whylen, _("single hardware queue"));
+		return 0;
+	}
+
+	snprintf(why, whylen,
+		_("%d CPUs, %d hardware queues, non-rotational"),
+		fc->nr_cpus, fc->nr_hw_queues);
+	return min(fc->nr_cpus, fc->nr_hw_queues);
+}
+
 /*
  * Check for existing filesystem or partition table on device.
  * Returns:
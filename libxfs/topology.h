@@ -32,6 +32,29 @@ calc_default_ag_geometry(
 	uint64_t	*agsize,
 	uint64_t	*agcount);
 
+/* What we know about how parallel the storage and the machine are. */
+struct fs_concurrency {
+	int	nr_cpus;
+	int	nr_hw_queues;	/* blk-mq hardware queues, 0 if unknown */
+	int	rotational;	/* -1 if unknown */
+	int	zoned;
+};
+
+extern unsigned int
+guess_concurrency(
+	const char		*path,
+	struct fs_concurrency	*fc,
+	char			*why,
+	size_t			whylen);
+
+extern void
+calc_concurrency_ag_geometry(
+	int		blocklog,
+	uint64_t	dblocks,
+	unsigned int	concurrency,
+	uint64_t	*agsize,
+	uint64_t	*agcount);
+
 extern int
 check_overwrite(
 	const char	*device);
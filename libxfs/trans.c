@@ -848,6 +848,7 @@ inode_item_done(
 	 */
 	error = libxfs_iflush_int(iip->ili_inode, bp);
 	bp->b_transp = NULL;	/* remove xact ptr */
+	libxfs_icache_sync(iip->ili_inode, error ? NULL : bp);
 
 	if (error) {
 		fprintf(stderr, _("%s: warning - iflush_int failed (%d)\n"),
@@ -927,6 +928,9 @@ static void
 inode_item_unlock(
 	struct xfs_inode_log_item	*iip)
 {
+	/* logged changes that never made it to the buffer */
+	if (iip->ili_fields & XFS_ILOG_ALL)
+		libxfs_icache_sync(iip->ili_inode, NULL);
 	xfs_inode_item_put(iip);
 }
 
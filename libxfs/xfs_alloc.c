@@ -1542,6 +1542,29 @@ xfs_alloc_ag_vextent_lastblock(
 	return 0;
 }
 
+#ifndef __KERNEL__
+/*
+ * Offline tools mostly allocate right after whatever they allocated last,
+ * so the target block is usually free with plenty of free space after it.
+ * When a full maxlen extent fits right at the target, the near search can
+ * only ever pick exactly that, so try it with one bnobt lookup before
+ * setting up the whole search.  Leaves args->agbno at NULLAGBLOCK if it
+ * doesn't fit.
+ */
+STATIC int
+xfs_alloc_ag_vextent_near_exact(
+	struct xfs_alloc_arg	*args)
+{
+	xfs_extlen_t		minlen = args->minlen;
+	int			error;
+
+	args->minlen = args->maxlen;
+	error = xfs_alloc_ag_vextent_exact(args);
+	args->minlen = minlen;
+	return error;
+}
+#endif /* __KERNEL__ */
+
 /*
  * Allocate a variable extent near bno in the allocation group agno.
  * Extent's length (returned in len) will be between minlen and maxlen,
@@ -1569,6 +1592,17 @@ xfs_alloc_ag_vextent_near(
 	if (args->agbno > args->max_agbno)
 		args->agbno = args->max_agbno;
 
+#ifndef __KERNEL__
+	if (args->alignment == 1) {
+		xfs_agblock_t	target = args->agbno;
+
+		error = xfs_alloc_ag_vextent_near_exact(args);
+		if (error || args->agbno != NULLAGBLOCK)
+			return error;
+		args->agbno = target;
+	}
+#endif
+
 restart:
 	len = 0;
 
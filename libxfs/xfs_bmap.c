@@ -1091,7 +1091,7 @@ trans_cancel:
  */
 
 struct xfs_iread_state {
-	struct xfs_iext_cursor	icur;
+	struct xfs_iext_bulk	bulk;
 	xfs_extnum_t		loaded;
 };
 
@@ -1139,11 +1139,7 @@ xfs_iread_bmbt_block(
 					sizeof(*frp), fa);
 			return -EFSCORRUPTED;
 		}
-		xfs_iext_insert(ip, &ir->icur, &new,
-				xfs_bmap_fork_to_state(whichfork));
-		trace_xfs_read_extent(ip, &ir->icur,
-				xfs_bmap_fork_to_state(whichfork), _THIS_IP_);
-		xfs_iext_next(ifp, &ir->icur);
+		xfs_iext_bulk_add(&ir->bulk, &new);
 	}
 
 	return 0;
@@ -1170,11 +1166,12 @@ xfs_iread_extents(
 	ASSERT(xfs_isilocked(ip, XFS_ILOCK_EXCL));
 
 	ir.loaded = 0;
-	xfs_iext_first(ifp, &ir.icur);
+	xfs_iext_bulk_init(&ir.bulk, ifp);
 	cur = xfs_bmbt_init_cursor(mp, tp, ip, whichfork);
 	error = xfs_btree_visit_blocks(cur, xfs_iread_bmbt_block,
 			XFS_BTREE_VISIT_RECORDS, &ir);
 	xfs_btree_del_cursor(cur, error);
+	xfs_iext_bulk_finish(&ir.bulk);
 	if (error)
 		goto out;
 
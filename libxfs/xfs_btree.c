@@ -369,6 +369,8 @@ xfs_btree_del_cursor(
 		else if (!error)
 			break;
 	}
+	for (i = 0; i < cur->bc_nstash; i++)
+		xfs_buf_relse(cur->bc_stash[i]);
 
 	ASSERT(cur->bc_btnum != XFS_BTNUM_BMAP || cur->bc_ino.allocated == 0 ||
 	       xfs_is_shutdown(cur->bc_mp));
@@ -976,6 +978,49 @@ xfs_btree_readahead_ptr(
 			  cur->bc_mp->m_bsize * count, cur->bc_ops->buf_ops);
 }
 
+/*
+ * Hang on to a node block that the cursor is moving off of, pushing out the
+ * oldest one if the stash is full.  Only cursors without a transaction do
+ * this, since a transaction already finds its own buffers without going to
+ * the cache, and staging cursors have no real blocks to revisit.  Nor do we
+ * when buffers are locked, as a stashed buffer stays locked and would block
+ * any other thread or cursor that wants it.
+ */
+STATIC void
+xfs_btree_stash_buf(
+	struct xfs_btree_cur	*cur,
+	struct xfs_buf		*bp)
+{
+	if (cur->bc_nstash == XFS_BTREE_STASH) {
+		xfs_buf_relse(cur->bc_stash[0]);
+		memmove(&cur->bc_stash[0], &cur->bc_stash[1],
+				(XFS_BTREE_STASH - 1) * sizeof(bp));
+		cur->bc_nstash--;
+	}
+	cur->bc_stash[cur->bc_nstash++] = bp;
+}
+
+/* Take a stashed buffer for this disk address back, if we have one. */
+STATIC struct xfs_buf *
+xfs_btree_unstash_buf(
+	struct xfs_btree_cur	*cur,
+	xfs_daddr_t		daddr)
+{
+	struct xfs_buf		*bp;
+	int			i;
+
+	for (i = cur->bc_nstash - 1; i >= 0; i--) {
+		bp = cur->bc_stash[i];
+		if (xfs_buf_daddr(bp) != daddr)
+			continue;
+		memmove(&cur->bc_stash[i], &cur->bc_stash[i + 1],
+				(cur->bc_nstash - i - 1) * sizeof(bp));
+		cur->bc_nstash--;
+		return bp;
+	}
+	return NULL;
+}
+
 /*
  * Set the buffer for level "lev" in the cursor to bp, releasing
  * any previous buffer.
@@ -987,9 +1032,13 @@ xfs_btree_setbuf(
 	struct xfs_buf		*bp)	/* new buffer to set */
 {
 	struct xfs_btree_block	*b;	/* btree block */
+	struct xfs_buf		*obp = cur->bc_levels[lev].bp;
 
-	if (cur->bc_levels[lev].bp)
-		xfs_trans_brelse(cur->bc_tp, cur->bc_levels[lev].bp);
+	if (obp && lev > 0 && !cur->bc_tp && !use_xfs_buf_lock &&
+	    !(cur->bc_flags & XFS_BTREE_STAGING))
+		xfs_btree_stash_buf(cur, obp);
+	else if (obp)
+		xfs_trans_brelse(cur->bc_tp, obp);
 	cur->bc_levels[lev].bp = bp;
 	cur->bc_levels[lev].ra = 0;
 
@@ -1252,7 +1301,7 @@ xfs_btree_get_buf_block(
  * Read in the buffer at the given ptr and return the buffer and
  * the block pointer within the buffer.
  */
-STATIC int
+int
 xfs_btree_read_buf_block(
 	struct xfs_btree_cur		*cur,
 	const union xfs_btree_ptr	*ptr,
@@ -1270,6 +1319,13 @@ xfs_btree_read_buf_block(
 	error = xfs_btree_ptr_to_daddr(cur, ptr, &d);
 	if (error)
 		return error;
+	if (cur->bc_nstash) {
+		*bpp = xfs_btree_unstash_buf(cur, d);
+		if (*bpp) {
+			*block = XFS_BUF_TO_BLOCK(*bpp);
+			return 0;
+		}
+	}
 	error = xfs_trans_read_buf(mp, cur->bc_tp, mp->m_ddev_targp, d,
 				   mp->m_bsize, flags, bpp,
 				   cur->bc_ops->buf_ops);
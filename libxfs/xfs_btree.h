@@ -221,6 +221,9 @@ struct xfs_btree_level {
 	uint16_t		ra;
 };
 
+/* Number of node buffers a cursor without a transaction holds on to. */
+#define XFS_BTREE_STASH		4
+
 /*
  * Btree cursor structure.
  * This collects all information needed by the btree code in one place.
@@ -249,6 +252,13 @@ struct xfs_btree_cur
 		struct xfs_btree_cur_ino bc_ino;
 	};
 
+	/*
+	 * Node blocks that a cursor with no transaction has stepped off of,
+	 * kept so that going back to them doesn't need a cache lookup.
+	 */
+	struct xfs_buf		*bc_stash[XFS_BTREE_STASH];
+	uint8_t			bc_nstash;
+
 	/* Must be at the end of the struct! */
 	struct xfs_btree_level	bc_levels[];
 };
@@ -568,6 +578,9 @@ void xfs_btree_set_ptr_null(struct xfs_btree_cur *cur,
 int xfs_btree_get_buf_block(struct xfs_btree_cur *cur,
 		const union xfs_btree_ptr *ptr, struct xfs_btree_block **block,
 		struct xfs_buf **bpp);
+int xfs_btree_read_buf_block(struct xfs_btree_cur *cur,
+		const union xfs_btree_ptr *ptr, int flags,
+		struct xfs_btree_block **block, struct xfs_buf **bpp);
 void xfs_btree_set_sibling(struct xfs_btree_cur *cur,
 		struct xfs_btree_block *block, const union xfs_btree_ptr *ptr,
 		int lr);
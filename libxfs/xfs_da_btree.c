@@ -2092,15 +2092,13 @@ xfs_da3_path_shift(
  * Rotate the hash value by 7 bits, then XOR each character in.
  * This is implemented with some source-level loop unrolling.
  */
-xfs_dahash_t
-xfs_da_hashname(const uint8_t *name, int namelen)
+static inline xfs_dahash_t
+xfs_da_hashname_from(xfs_dahash_t hash, const uint8_t *name, int namelen)
 {
-	xfs_dahash_t hash;
-
 	/*
 	 * Do four characters at a time as long as we can.
 	 */
-	for (hash = 0; namelen >= 4; namelen -= 4, name += 4)
+	for (; namelen >= 4; namelen -= 4, name += 4)
 		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
 		       (name[3] << 0) ^ rol32(hash, 7 * 4);
 
@@ -2120,6 +2118,55 @@ xfs_da_hashname(const uint8_t *name, int namelen)
 	}
 }
 
+xfs_dahash_t
+xfs_da_hashname(const uint8_t *name, int namelen)
+{
+	return xfs_da_hashname_from(0, name, namelen);
+}
+
+/*
+ * Hash a batch of names.  The names are taken XFS_DA_HASH_LANES at a time
+ * and their common prefix length is hashed in lock step, four bytes per
+ * lane per round, which the compiler can keep in vector registers.  Each
+ * name's tail is then finished on its own from where its lane stopped.
+ */
+#define XFS_DA_HASH_LANES	8
+
+void
+xfs_da_hashname_batch(
+	const uint8_t		* const *names,
+	const int		*namelens,
+	xfs_dahash_t		*hashes,
+	int			nr)
+{
+	xfs_dahash_t		h[XFS_DA_HASH_LANES];
+	int			i, l, n, off, minlen;
+
+	for (i = 0; i < nr; i += n) {
+		n = min(nr - i, XFS_DA_HASH_LANES);
+		minlen = namelens[i];
+		for (l = 1; l < n; l++)
+			minlen = min(minlen, namelens[i + l]);
+
+		memset(h, 0, sizeof(h));
+		for (off = 0; n == XFS_DA_HASH_LANES && off + 4 <= minlen;
+		     off += 4) {
+			for (l = 0; l < XFS_DA_HASH_LANES; l++) {
+				const uint8_t	*p = names[i + l] + off;
+
+				h[l] = (p[0] << 21) ^ (p[1] << 14) ^
+				       (p[2] << 7) ^ (p[3] << 0) ^
+				       rol32(h[l], 7 * 4);
+			}
+		}
+
+		for (l = 0; l < n; l++)
+			hashes[i + l] = xfs_da_hashname_from(h[l],
+					names[i + l] + off,
+					namelens[i + l] - off);
+	}
+}
+
 enum xfs_dacmp
 xfs_da_compname(
 	struct xfs_da_args *args,
@@ -214,6 +214,8 @@ int	xfs_da_shrink_inode(xfs_da_args_t *args, xfs_dablk_t dead_blkno,
 					  struct xfs_buf *dead_buf);
 
 uint xfs_da_hashname(const uint8_t *name_string, int name_length);
+void xfs_da_hashname_batch(const uint8_t * const *names, const int *namelens,
+		xfs_dahash_t *hashes, int nr);
 enum xfs_dacmp xfs_da_compname(struct xfs_da_args *args,
 				const unsigned char *name, int len);
 
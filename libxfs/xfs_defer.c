@@ -471,6 +471,37 @@ out:
 	return error;
 }
 
+/*
+ * Userspace has no log to run out of, so there is no need to roll the
+ * transaction after every pending item as the kernel does.  What the rolls
+ * still protect is AG locking order: within one transaction, AG headers
+ * must be locked in increasing AG order.  So after finishing a pending
+ * item, keep going with the next one in the same transaction if it didn't
+ * queue up any new work (which must be finished first), and if every item
+ * of the next one works only in AGs at or above the last one we touched.
+ * Pending items are sorted by AG when their intents are created, so that
+ * only means looking at the first and last work items.
+ */
+#define XFS_DEFER_BATCH		32	/* pending items per transaction */
+
+static bool
+xfs_defer_can_batch(
+	struct xfs_trans		*tp,
+	struct xfs_defer_pending	*dfp,
+	xfs_agnumber_t			*agnop)
+{
+	const struct xfs_defer_op_type	*ops = defer_op_types[dfp->dfp_type];
+	xfs_agnumber_t			agno;
+
+	if (!ops->item_agno || list_empty(&dfp->dfp_work))
+		return false;
+	agno = ops->item_agno(tp->t_mountp, dfp->dfp_work.next);
+	if (*agnop != NULLAGNUMBER && agno < *agnop)
+		return false;
+	*agnop = ops->item_agno(tp->t_mountp, dfp->dfp_work.prev);
+	return true;
+}
+
 /*
  * Finish all the pending work.  This involves logging intent items for
  * any work items that wandered in since the last transaction roll (if
@@ -484,6 +515,9 @@ xfs_defer_finish_noroll(
 	struct xfs_trans		**tp)
 {
 	struct xfs_defer_pending	*dfp;
+	xfs_agnumber_t			agno;
+	bool				can_batch;
+	int				batch;
 	int				error = 0;
 	LIST_HEAD(dop_pending);
 
@@ -516,7 +550,19 @@ xfs_defer_finish_noroll(
 
 		dfp = list_first_entry(&dop_pending, struct xfs_defer_pending,
 				       dfp_list);
-		error = xfs_defer_finish_one(*tp, dfp);
+		agno = NULLAGNUMBER;
+		can_batch = xfs_defer_can_batch(*tp, dfp, &agno);
+		for (batch = 1; ; batch++) {
+			error = xfs_defer_finish_one(*tp, dfp);
+			if (error || !can_batch || batch == XFS_DEFER_BATCH ||
+			    !list_empty(&(*tp)->t_dfops) ||
+			    list_empty(&dop_pending))
+				break;
+			dfp = list_first_entry(&dop_pending,
+					struct xfs_defer_pending, dfp_list);
+			if (!xfs_defer_can_batch(*tp, dfp, &agno))
+				break;
+		}
 		if (error && error != -EAGAIN)
 			goto out_shutdown;
 	}
@@ -55,6 +55,9 @@ struct xfs_defer_op_type {
 	void (*finish_cleanup)(struct xfs_trans *tp,
 			struct xfs_btree_cur *state, int error);
 	void (*cancel_item)(struct list_head *item);
+	/* AG an item works in; lets pending items share a transaction */
+	xfs_agnumber_t (*item_agno)(struct xfs_mount *mp,
+			struct list_head *item);
 	unsigned int		max_items;
 };
 
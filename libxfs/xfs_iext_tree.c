@@ -300,6 +300,25 @@ xfs_iext_rec_cmp(
 	return 0;
 }
 
+/*
+ * Keys are sorted and unused ones are XFS_IEXT_KEY_INVALID, which is larger
+ * than any file offset, so the slot to descend into is just the number of
+ * keys after the first that are <= offset.  Counting them without an early
+ * exit lets the compiler turn this into a few vector compares.
+ */
+static inline int
+xfs_iext_node_pos(
+	struct xfs_iext_node	*node,
+	xfs_fileoff_t		offset)
+{
+	int			i, pos = 0;
+
+	for (i = 1; i < KEYS_PER_NODE; i++)
+		pos += node->keys[i] <= offset;
+
+	return pos;
+}
+
 static void *
 xfs_iext_find_level(
 	struct xfs_ifork	*ifp,
@@ -307,17 +326,13 @@ xfs_iext_find_level(
 	int			level)
 {
 	struct xfs_iext_node	*node = ifp->if_u1.if_root;
-	int			height, i;
+	int			height;
 
 	if (!ifp->if_height)
 		return NULL;
 
 	for (height = ifp->if_height; height > level; height--) {
-		for (i = 1; i < KEYS_PER_NODE; i++)
-			if (xfs_iext_key_cmp(node, i, offset) > 0)
-				break;
-
-		node = node->ptrs[i - 1];
+		node = node->ptrs[xfs_iext_node_pos(node, offset)];
 		if (!node)
 			break;
 	}
@@ -325,21 +340,6 @@ xfs_iext_find_level(
 	return node;
 }
 
-static int
-xfs_iext_node_pos(
-	struct xfs_iext_node	*node,
-	xfs_fileoff_t		offset)
-{
-	int			i;
-
-	for (i = 1; i < KEYS_PER_NODE; i++) {
-		if (xfs_iext_key_cmp(node, i, offset) > 0)
-			break;
-	}
-
-	return i - 1;
-}
-
 static int
 xfs_iext_node_insert_pos(
 	struct xfs_iext_node	*node,
@@ -668,6 +668,119 @@ xfs_iext_insert(
 		xfs_iext_insert_node(ifp, xfs_iext_leaf_key(new, 0), new, 2);
 }
 
+/*
+ * Loading a fork one xfs_iext_insert() at a time splits every leaf and node
+ * on the way, leaving them half full.  When the whole sorted extent list is
+ * at hand we can instead fill leaves completely as the records stream in,
+ * chain them together, and build the inner nodes over them bottom-up once
+ * we know how many leaves there are.
+ */
+void
+xfs_iext_bulk_init(
+	struct xfs_iext_bulk	*b,
+	struct xfs_ifork	*ifp)
+{
+	ASSERT(ifp->if_height == 0 && ifp->if_bytes == 0);
+
+	memset(b, 0, sizeof(*b));
+	b->ifp = ifp;
+}
+
+void
+xfs_iext_bulk_add(
+	struct xfs_iext_bulk	*b,
+	struct xfs_bmbt_irec	*irec)
+{
+	struct xfs_iext_leaf	*new;
+
+	if (!b->leaf || b->nr == RECS_PER_LEAF) {
+		new = kmem_zalloc(NODE_SIZE, KM_NOFS);
+		if (b->leaf) {
+			b->leaf->next = new;
+			new->prev = b->leaf;
+		} else {
+			b->first = new;
+		}
+		b->leaf = new;
+		b->nr = 0;
+		b->nr_leaves++;
+	}
+
+	ASSERT(b->nr == 0 ||
+	       xfs_iext_rec_cmp(&b->leaf->recs[b->nr - 1],
+				irec->br_startoff) < 0);
+	xfs_iext_set(&b->leaf->recs[b->nr++], irec);
+	b->count++;
+}
+
+static inline uint64_t
+xfs_iext_bulk_key(
+	void			*ptr,
+	int			level)
+{
+	if (level == 1)
+		return xfs_iext_leaf_key(ptr, 0);
+	return ((struct xfs_iext_node *)ptr)->keys[0];
+}
+
+/*
+ * Hang everything added so far off the fork.  Also call this on error
+ * paths, so that xfs_iext_destroy() can free what was loaded.
+ */
+void
+xfs_iext_bulk_finish(
+	struct xfs_iext_bulk	*b)
+{
+	struct xfs_ifork	*ifp = b->ifp;
+	void			**ptrs;
+	xfs_extnum_t		n, i, j;
+	int			level = 1, k;
+
+	if (!b->count)
+		return;
+
+	xfs_iext_inc_seq(ifp);
+	ifp->if_bytes = b->count * sizeof(struct xfs_iext_rec);
+	ifp->if_hint_leaf = NULL;
+
+	/* a lone leaf is the root, sized to fit like xfs_iext_insert does */
+	if (b->nr_leaves == 1) {
+		if (b->count < RECS_PER_LEAF)
+			b->first = krealloc(b->first, ifp->if_bytes,
+					GFP_NOFS | __GFP_NOFAIL);
+		ifp->if_u1.if_root = b->first;
+		ifp->if_height = 1;
+		return;
+	}
+
+	ptrs = kmem_alloc(b->nr_leaves * sizeof(void *), KM_NOFS);
+	for (i = 0, b->leaf = b->first; b->leaf; b->leaf = b->leaf->next)
+		ptrs[i++] = b->leaf;
+
+	/* each pass packs the level below into as few nodes as possible */
+	for (n = b->nr_leaves; n > 1; n = j, level++) {
+		for (i = 0, j = 0; i < n; j++) {
+			struct xfs_iext_node	*node;
+
+			node = kmem_zalloc(NODE_SIZE, KM_NOFS);
+			for (k = 0; k < KEYS_PER_NODE; k++, i++) {
+				if (i < n) {
+					node->keys[k] =
+						xfs_iext_bulk_key(ptrs[i], level);
+					node->ptrs[k] = ptrs[i];
+				} else {
+					node->keys[k] = XFS_IEXT_KEY_INVALID;
+				}
+			}
+			ptrs[j] = node;
+		}
+	}
+
+	ifp->if_u1.if_root = ptrs[0];
+	ifp->if_height = level;
+	kmem_free(ptrs);
+}
+
 static struct xfs_iext_node *
 xfs_iext_rebalance_node(
 	struct xfs_iext_node	*parent,
@@ -904,6 +1017,52 @@ xfs_iext_remove(
 		xfs_iext_free_last_leaf(ifp);
 }
 
+/*
+ * Lookups mostly walk forward through a file, so remember the leaf the last
+ * one ended up in and try it, and the leaf after it, before descending from
+ * the root.  A leaf covers the offsets from its first record up to the first
+ * record of the next leaf, which is exactly the leaf the descent would pick.
+ * Any change to the tree can split or free leaves, so the hint is only good
+ * while the fork sequence number hasn't moved.
+ */
+static struct xfs_iext_leaf *
+xfs_iext_hint_leaf(
+	struct xfs_ifork	*ifp,
+	xfs_fileoff_t		offset)
+{
+	struct xfs_iext_leaf	*leaf = ifp->if_hint_leaf;
+	int			i;
+
+	if (ifp->if_height <= 1 || !leaf ||
+	    ifp->if_hint_seq != READ_ONCE(ifp->if_seq))
+		return NULL;
+	if (xfs_iext_rec_is_empty(&leaf->recs[0]) ||
+	    xfs_iext_leaf_key(leaf, 0) > offset)
+		return NULL;
+
+	for (i = 0; i < 2; i++) {
+		if (!leaf->next)
+			return leaf;
+		if (xfs_iext_rec_is_empty(&leaf->next->recs[0]))
+			return NULL;
+		if (xfs_iext_leaf_key(leaf->next, 0) > offset)
+			return leaf;
+		leaf = leaf->next;
+	}
+	return NULL;
+}
+
+static inline void
+xfs_iext_set_hint(
+	struct xfs_ifork	*ifp,
+	struct xfs_iext_leaf	*leaf)
+{
+	if (ifp->if_height <= 1)
+		return;
+	ifp->if_hint_leaf = leaf;
+	ifp->if_hint_seq = READ_ONCE(ifp->if_seq);
+}
+
 /*
  * Lookup the extent covering bno.
  *
@@ -925,7 +1084,9 @@ xfs_iext_lookup_extent(
 {
 	XFS_STATS_INC(ip->i_mount, xs_look_exlist);
 
-	cur->leaf = xfs_iext_find_level(ifp, offset, 1);
+	cur->leaf = xfs_iext_hint_leaf(ifp, offset);
+	if (!cur->leaf)
+		cur->leaf = xfs_iext_find_level(ifp, offset, 1);
 	if (!cur->leaf) {
 		cur->pos = 0;
 		return false;
@@ -948,6 +1109,7 @@ xfs_iext_lookup_extent(
 	if (!xfs_iext_valid(ifp, cur))
 		return false;
 found:
+	xfs_iext_set_hint(ifp, cur->leaf);
 	xfs_iext_get(gotp, cur_rec(cur));
 	return true;
 }
@@ -1047,4 +1209,5 @@ xfs_iext_destroy(
 	ifp->if_bytes = 0;
 	ifp->if_height = 0;
 	ifp->if_u1.if_root = NULL;
+	ifp->if_hint_leaf = NULL;
 }
@@ -117,6 +117,74 @@ const struct xfs_buf_ops xfs_inode_buf_ra_ops = {
 	.verify_write = xfs_inode_buf_write_verify,
 };
 
+#ifndef __KERNEL__
+#define XFS_INODE_CLUSTER_BATCH	32
+
+/*
+ * Check the magic, version and crc of every inode in a cluster buffer.  The
+ * crcs are computed a batch of inodes at a time so that the multi-buffer crc
+ * code can interleave them; the crc field counts as zero, so each inode is
+ * checksummed in two pieces around it.  @ok[i] is set if inode i passed, and
+ * the number of inodes that did not is returned.  Callers should only run
+ * the detailed per-inode checks on those.
+ */
+int
+xfs_inode_buf_verify_cluster(
+	struct xfs_buf		*bp,
+	bool			*ok)
+{
+	struct xfs_mount	*mp = bp->b_mount;
+	unsigned char const	*p[XFS_INODE_CLUSTER_BATCH];
+	size_t			len[XFS_INODE_CLUSTER_BATCH];
+	uint32_t		crc[XFS_INODE_CLUSTER_BATCH];
+	const uint32_t		zero = 0;
+	size_t			isize = mp->m_sb.sb_inodesize;
+	int			ilog = mp->m_sb.sb_inodelog;
+	int			ni = BBTOB(bp->b_length) >> ilog;
+	int			nbad = 0;
+	int			i, j, nr;
+
+	for (i = 0; i < ni; i += nr) {
+		nr = min(ni - i, XFS_INODE_CLUSTER_BATCH);
+
+		for (j = 0; j < nr; j++) {
+			struct xfs_dinode	*dip;
+
+			dip = xfs_buf_offset(bp, (i + j) << ilog);
+			ok[i + j] =
+				dip->di_magic == cpu_to_be16(XFS_DINODE_MAGIC) &&
+				xfs_dinode_good_version(mp, dip->di_version);
+			p[j] = (unsigned char const *)dip;
+			len[j] = XFS_DINODE_CRC_OFF;
+			crc[j] = XFS_CRC_SEED;
+		}
+		if (!xfs_has_crc(mp))
+			goto tally;
+
+		crc32c_le_multi(crc, p, len, nr);
+		for (j = 0; j < nr; j++) {
+			crc[j] = crc32c_le(crc[j], (unsigned char const *)&zero,
+					sizeof(zero));
+			p[j] += XFS_DINODE_CRC_OFF + sizeof(__le32);
+			len[j] = isize - XFS_DINODE_CRC_OFF - sizeof(__le32);
+		}
+		crc32c_le_multi(crc, p, len, nr);
+
+		for (j = 0; j < nr; j++) {
+			struct xfs_dinode	*dip;
+
+			dip = xfs_buf_offset(bp, (i + j) << ilog);
+			if (dip->di_crc != xfs_end_cksum(crc[j]))
+				ok[i + j] = false;
+		}
+tally:
+		for (j = 0; j < nr; j++)
+			if (!ok[i + j])
+				nbad++;
+	}
+	return nbad;
+}
+#endif /* __KERNEL__ */
 
 /*
  * This routine is called to map an inode to the buffer containing the on-disk
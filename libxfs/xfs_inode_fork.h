@@ -24,6 +24,8 @@ struct xfs_ifork {
 	short			if_broot_bytes;	/* bytes allocated for root */
 	int8_t			if_format;	/* format of this fork */
 	xfs_extnum_t		if_nextents;	/* # of extents in this fork */
+	void			*if_hint_leaf;	/* last leaf looked up */
+	unsigned int		if_hint_seq;	/* if_seq when hint was set */
 };
 
 /*
@@ -151,7 +153,24 @@ int		xfs_iextents_copy(struct xfs_inode *, struct xfs_bmbt_rec *,
 void		xfs_init_local_fork(struct xfs_inode *ip, int whichfork,
 				const void *data, int64_t size);
 
+/*
+ * Bottom-up builder for loading a whole extent list into an empty fork.
+ * Records must be added in file offset order.
+ */
+struct xfs_iext_bulk {
+	struct xfs_ifork	*ifp;
+	struct xfs_iext_leaf	*first;		/* head of the leaf chain */
+	struct xfs_iext_leaf	*leaf;		/* leaf being filled */
+	int			nr;		/* records in leaf */
+	xfs_extnum_t		count;		/* records added */
+	xfs_extnum_t		nr_leaves;
+};
+
 xfs_extnum_t	xfs_iext_count(struct xfs_ifork *ifp);
+void		xfs_iext_bulk_init(struct xfs_iext_bulk *, struct xfs_ifork *);
+void		xfs_iext_bulk_add(struct xfs_iext_bulk *,
+			struct xfs_bmbt_irec *);
+void		xfs_iext_bulk_finish(struct xfs_iext_bulk *);
 void		xfs_iext_insert(struct xfs_inode *, struct xfs_iext_cursor *cur,
 			struct xfs_bmbt_irec *, int);
 void		xfs_iext_remove(struct xfs_inode *, struct xfs_iext_cursor *,
@@ -91,6 +91,146 @@ xlog_align(
 }
 
 
+/*
+ * Finding the head and tail of the log probes single blocks all over it: a
+ * binary search for the cycle change, short scans either side of the head
+ * and a walk back to the last record header.  On storage with a long round
+ * trip those probes dominate, so while a search is running we read the log
+ * in large aligned chunks and keep the most recently used ones around.
+ * Later phases mostly look at blocks an earlier phase already pulled in.
+ */
+#define XLOG_BCACHE_BBS		BTOBB(256 * 1024)
+#define XLOG_BCACHE_NR		16
+
+struct xlog_bcache_ent {
+	struct xfs_buf	*bp;
+	int		bp_len;		/* BBs allocated in bp */
+	xfs_daddr_t	blk;		/* first block, or -1 if empty */
+	unsigned long	used;
+};
+
+static struct {
+	struct xlog		*log;	/* NULL when not caching */
+	unsigned long		clock;
+	struct xlog_bcache_ent	ent[XLOG_BCACHE_NR];
+} xlog_bcache;
+
+/*
+ * Start caching reads of this log.  Returns false if a cache is already
+ * active, in which case the caller must not stop it.
+ */
+bool
+xlog_bcache_start(
+	struct xlog	*log)
+{
+	int		i;
+
+	if (xlog_bcache.log)
+		return false;
+	memset(&xlog_bcache, 0, sizeof(xlog_bcache));
+	for (i = 0; i < XLOG_BCACHE_NR; i++)
+		xlog_bcache.ent[i].blk = -1;
+	xlog_bcache.log = log;
+	return true;
+}
+
+void
+xlog_bcache_stop(void)
+{
+	int		i;
+
+	for (i = 0; i < XLOG_BCACHE_NR; i++)
+		if (xlog_bcache.ent[i].bp)
+			libxfs_buf_relse(xlog_bcache.ent[i].bp);
+	memset(&xlog_bcache, 0, sizeof(xlog_bcache));
+}
+
+/* Return the cached chunk starting at chunk_blk, reading it if need be. */
+static char *
+xlog_bcache_chunk(
+	struct xlog		*log,
+	xfs_daddr_t		chunk_blk,
+	int			*error)
+{
+	struct xlog_bcache_ent	*e, *victim = NULL;
+	int			nbblks;
+	int			i;
+
+	for (i = 0; i < XLOG_BCACHE_NR; i++) {
+		e = &xlog_bcache.ent[i];
+		if (e->blk == chunk_blk) {
+			e->used = ++xlog_bcache.clock;
+			return e->bp->b_addr;
+		}
+		if (!victim || e->used < victim->used)
+			victim = e;
+	}
+
+	nbblks = min((xfs_daddr_t)XLOG_BCACHE_BBS,
+			log->l_logBBsize - chunk_blk);
+	nbblks = round_up(nbblks, log->l_sectBBsize);
+	if (!victim->bp) {
+		victim->bp_len = min(XLOG_BCACHE_BBS, log->l_logBBsize);
+		victim->bp = xlog_get_bp(log, victim->bp_len);
+		if (!victim->bp)
+			return NULL;
+	}
+	if (nbblks > victim->bp_len)
+		return NULL;
+
+	/* not through xlog_bread_noalign, or we'd end up back here */
+	victim->blk = -1;
+	xfs_buf_set_daddr(victim->bp, log->l_logBBstart + chunk_blk);
+	victim->bp->b_length = nbblks;
+	victim->bp->b_error = 0;
+	*error = libxfs_readbufr(log->l_dev, xfs_buf_daddr(victim->bp),
+			victim->bp, nbblks, 0);
+	if (*error)
+		return NULL;
+	victim->blk = chunk_blk;
+	victim->used = ++xlog_bcache.clock;
+	return victim->bp->b_addr;
+}
+
+/*
+ * Fill bp with nbblks (sector aligned) blocks at blk_no from the cache.
+ * Returns false if the range can't be served from the cache and has to
+ * be read directly; *error is set if reading a chunk failed.
+ */
+static bool
+xlog_bcache_read(
+	struct xlog	*log,
+	xfs_daddr_t	blk_no,
+	int		nbblks,
+	struct xfs_buf	*bp,
+	int		*error)
+{
+	xfs_daddr_t	blk, chunk_blk;
+	char		*chunk, *dst = bp->b_addr;
+	int		count;
+
+	*error = 0;
+	if (blk_no < 0 || nbblks > XLOG_BCACHE_BBS ||
+	    blk_no + nbblks > log->l_logBBsize)
+		return false;
+
+	for (blk = blk_no; blk < blk_no + nbblks; blk += count) {
+		chunk_blk = round_down(blk, (xfs_daddr_t)XLOG_BCACHE_BBS);
+		chunk = xlog_bcache_chunk(log, chunk_blk, error);
+		if (!chunk)
+			return *error != 0;
+		count = min(blk_no + nbblks,
+				chunk_blk + XLOG_BCACHE_BBS) - blk;
+		memcpy(dst, chunk + BBTOB(blk - chunk_blk), BBTOB(count));
+		dst += BBTOB(count);
+	}
+
+	xfs_buf_set_daddr(bp, log->l_logBBstart + blk_no);
+	bp->b_length = nbblks;
+	bp->b_error = 0;
+	return true;
+}
+
 /*
  * nbblks should be uint, but oh well.  Just want to catch that 32-bit length.
  */
@@ -114,6 +254,13 @@ xlog_bread_noalign(
 	ASSERT(nbblks > 0);
 	ASSERT(nbblks <= bp->b_length);
 
+	if (xlog_bcache.log == log) {
+		int	error;
+
+		if (xlog_bcache_read(log, blk_no, nbblks, bp, &error))
+			return error;
+	}
+
 	xfs_buf_set_daddr(bp, log->l_logBBstart + blk_no);
 	bp->b_length = nbblks;
 	bp->b_error = 0;
@@ -168,6 +315,13 @@ xlog_bread_offset(
 	return error2;
 }
 
+/*
+ * Once the binary search below has narrowed the range down to this many
+ * blocks, read all of it at once and finish the search in memory instead of
+ * reading one block at a time.
+ */
+#define XLOG_CYCLE_SEARCH_BBS	BTOBB(1024 * 1024)
+
 /*
  * This routine finds (to an approximation) the first block in the physical
  * log which contains the given cycle.  It uses a binary search algorithm.
@@ -182,7 +336,10 @@ xlog_find_cycle_start(
 	xfs_daddr_t	*last_blk,
 	uint		cycle)
 {
+	struct xfs_buf	*wbp = NULL;
+	char		*window = NULL;
 	char		*offset;
+	xfs_daddr_t	window_blk = 0;
 	xfs_daddr_t	mid_blk;
 	xfs_daddr_t	end_blk;
 	uint		mid_cycle;
@@ -191,9 +348,27 @@ xlog_find_cycle_start(
 	end_blk = *last_blk;
 	mid_blk = BLK_AVG(first_blk, end_blk);
 	while (mid_blk != first_blk && mid_blk != end_blk) {
-		error = xlog_bread(log, mid_blk, 1, bp, &offset);
-		if (error)
-			return error;
+		if (!window && end_blk - first_blk <= XLOG_CYCLE_SEARCH_BBS) {
+			wbp = xlog_get_bp(log, end_blk - first_blk);
+			if (wbp) {
+				error = xlog_bread(log, first_blk,
+						end_blk - first_blk, wbp,
+						&window);
+				if (error) {
+					libxfs_buf_relse(wbp);
+					return error;
+				}
+				window_blk = first_blk;
+			}
+		}
+
+		if (window) {
+			offset = window + BBTOB(mid_blk - window_blk);
+		} else {
+			error = xlog_bread(log, mid_blk, 1, bp, &offset);
+			if (error)
+				return error;
+		}
 		mid_cycle = xlog_get_cycle(offset);
 		if (mid_cycle == cycle)
 			end_blk = mid_blk;   /* last_half_cycle == mid_cycle */
@@ -204,6 +379,8 @@ xlog_find_cycle_start(
 	ASSERT((mid_blk == first_blk && mid_blk+1 == end_blk) ||
 	       (mid_blk == end_blk && mid_blk-1 == first_blk));
 
+	if (wbp)
+		libxfs_buf_relse(wbp);
 	*last_blk = end_blk;
 
 	return 0;
@@ -667,8 +844,8 @@ validate_head:
  * We could speed up search by using current head_blk buffer, but it is not
  * available.
  */
-int
-xlog_find_tail(
+STATIC int
+xlog_find_tail_search(
 	struct xlog		*log,
 	xfs_daddr_t		*head_blk,
 	xfs_daddr_t		*tail_blk)
@@ -853,6 +1030,22 @@ done:
 	return error;
 }
 
+/* Find head and tail with every phase sharing one read cache. */
+int
+xlog_find_tail(
+	struct xlog		*log,
+	xfs_daddr_t		*head_blk,
+	xfs_daddr_t		*tail_blk)
+{
+	bool			cached = xlog_bcache_start(log);
+	int			error;
+
+	error = xlog_find_tail_search(log, head_blk, tail_blk);
+	if (cached)
+		xlog_bcache_stop();
+	return error;
+}
+
 /*
  * Is the log zeroed at all?
  *
@@ -1281,6 +1474,45 @@ xlog_recover_process_data(
 	return 0;
 }
 
+/*
+ * Checksum a log record the same way the kernel does when it writes it out:
+ * the record header, the extended headers of a v2 log and the (still packed)
+ * payload.
+ */
+static __le32
+xlog_cksum(
+	struct xlog		*log,
+	struct xlog_rec_header	*rhead,
+	char			*dp,
+	int			size)
+{
+	uint32_t		crc;
+
+	/* first generate the crc for the record header ... */
+	crc = xfs_start_cksum_safe((char *)rhead,
+			      sizeof(struct xlog_rec_header),
+			      offsetof(struct xlog_rec_header, h_crc));
+
+	/* ... then for additional cycle data for v2 logs ... */
+	if (xfs_has_logv2(log->l_mp)) {
+		union xlog_in_core2	*xhdr = (union xlog_in_core2 *)rhead;
+		int			i;
+		int			xheads;
+
+		xheads = (size + XLOG_HEADER_CYCLE_SIZE - 1) /
+				XLOG_HEADER_CYCLE_SIZE;
+		for (i = 1; i < xheads; i++) {
+			crc = crc32c(crc, &xhdr[i].hic_xheader,
+				     sizeof(struct xlog_rec_ext_header));
+		}
+	}
+
+	/* ... and finally for the payload */
+	crc = crc32c(crc, dp, size);
+
+	return xfs_end_cksum(crc);
+}
+
 /*
  * Upack the log buffer data and crc check it. If the check fails, issue a
  * warning if and only if the CRC in the header is non-zero. This makes the
@@ -1289,12 +1521,9 @@ xlog_recover_process_data(
  * add CRCs by default.
  *
  * When filesystems are CRC enabled, this CRC mismatch becomes a fatal log
- * corruption failure
- *
- * XXX: we do not calculate the CRC here yet. It's not clear what we should do
- * with CRC errors here in userspace, so we'll address that problem later on.
+ * corruption failure if the caller set l_crc_fatal.  Tools that only print the
+ * log want to see the damaged records, so for them it stays a warning.
  */
-#define xlog_cksum(l,r,dp,len)	((r)->h_crc)
 STATIC int
 xlog_unpack_data_crc(
 	struct xlog_rec_header	*rhead,
@@ -1318,8 +1547,8 @@ xlog_unpack_data_crc(
 		 * recover past this point. Abort recovery if we are enforcing
 		 * CRC protection by punting an error back up the stack.
 		 */
-		if (xfs_has_crc(log->l_mp))
-			return EFSCORRUPTED;
+		if (log->l_crc_fatal && xfs_has_crc(log->l_mp))
+			return -EFSCORRUPTED;
 	}
 
 	return 0;
@@ -8,6 +8,117 @@
 
 #include "logprint.h"
 
+/* Copy the log this much at a time. */
+#define LOG_COPY_CHUNK	(4U << 20)
+
+struct log_copy_progress {
+	bool		tty;
+	bool		shown;
+	time_t		last;
+	long long	total;
+};
+
+static void
+log_copy_progress(
+	struct log_copy_progress *lp,
+	long long	done,
+	bool		final)
+{
+	time_t		now;
+
+	if (!lp->tty)
+		return;
+	now = time(NULL);
+	if (!final && now == lp->last)
+		return;
+	if (final && !lp->shown)
+		return;
+
+	lp->last = now;
+	lp->shown = true;
+	fprintf(stderr, _("\rcopied %lld of %lld MiB (%lld%%)"),
+			done >> 20, lp->total >> 20,
+			lp->total ? done * 100 / lp->total : 100);
+	if (final)
+		fputc('\n', stderr);
+}
+
+/*
+ * Reread a chunk that failed a sector at a time, so that only the sectors
+ * we really can't read are lost.  Those are zeroed, so everything after
+ * them stays at the right offset in the copy.  Returns the number of bytes
+ * in the chunk, or less if we hit the end of the device.
+ */
+static ssize_t
+log_copy_salvage(
+	int		fd,
+	char		*buf,
+	size_t		len,
+	off_t		off,
+	xfs_daddr_t	blkno)
+{
+	size_t		i;
+	ssize_t		r;
+
+	for (i = 0; i < len; i += BBSIZE, blkno++) {
+		r = pread(fd, buf + i, BBSIZE, off + i);
+		if (r == BBSIZE)
+			continue;
+		if (r == 0)
+			return i;
+		if (r < 0)
+			fprintf(stderr, _("%s: read error (%lld): %s\n"),
+				__FUNCTION__, (long long)blkno,
+				strerror(errno));
+		else
+			fprintf(stderr, _("%s: short read? (%lld)\n"),
+				__FUNCTION__, (long long)blkno);
+		memset(buf + i, 0, BBSIZE);
+	}
+	return len;
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+ * Have the kernel copy the log if it can, so that nothing has to bounce
+ * through userspace.  Block devices and some filesystems can't do this, and
+ * it stops at the first error; the caller copies whatever is left.  Returns
+ * the number of bytes copied.
+ */
+static long long
+log_copy_range(
+	int		fd,
+	off_t		start,
+	int		ofd,
+	long long	len,
+	struct log_copy_progress *lp)
+{
+	loff_t		in = start;
+	loff_t		out = 0;
+	ssize_t		r;
+
+	while (out < len) {
+		r = copy_file_range(fd, &in, ofd, &out,
+				min(len - out, (long long)LOG_COPY_CHUNK), 0);
+		if (r <= 0)
+			break;
+		log_copy_progress(lp, out, false);
+	}
+	return out;
+}
+#else
+static inline long long
+log_copy_range(
+	int		fd,
+	off_t		start,
+	int		ofd,
+	long long	len,
+	struct log_copy_progress *lp)
+{
+	return 0;
+}
+#endif
+
 /*
  * Extract a log and write it out to a file
  */
@@ -18,9 +129,16 @@ xfs_log_copy(
 	int		fd,
 	char		*filename)
 {
-	int		ofd, r;
-	xfs_daddr_t	blkno;
-	char		buf[XLOG_HEADER_SIZE];
+	struct log_copy_progress lp = {
+		.tty	= isatty(STDERR_FILENO),
+		.total	= (long long)log->l_logBBsize << BBSHIFT,
+	};
+	long long	done;
+	off_t		start;
+	ssize_t		r, w;
+	size_t		want;
+	char		*buf;
+	int		ofd;
 
 	if ((ofd = open(filename, O_CREAT|O_EXCL|O_RDWR|O_TRUNC, 0666)) == -1) {
 		perror("open");
@@ -28,35 +146,47 @@ xfs_log_copy(
 	}
 
 	xlog_print_lseek(log, fd, 0, SEEK_SET);
-	for (blkno = 0; blkno < log->l_logBBsize; blkno++) {
-		r = read(fd, buf, sizeof(buf));
-		if (r < 0) {
-			fprintf(stderr, _("%s: read error (%lld): %s\n"),
-				__FUNCTION__, (long long)blkno,
-				strerror(errno));
-			continue;
-		} else if (r == 0) {
+	start = lseek(fd, 0, SEEK_CUR);
+
+	done = log_copy_range(fd, start, ofd, lp.total, &lp);
+	if (done == lp.total)
+		goto out;
+
+	buf = memalign(getpagesize(), LOG_COPY_CHUNK);
+	if (!buf) {
+		perror("memalign");
+		exit(1);
+	}
+
+	while (done < lp.total) {
+		want = min(lp.total - done, (long long)LOG_COPY_CHUNK);
+		r = pread(fd, buf, want, start + done);
+		if (r < 0)
+			r = log_copy_salvage(fd, buf, want, start + done,
+					done >> BBSHIFT);
+		if (r == 0) {
 			printf(_("%s: physical end of log at %lld\n"),
-				__FUNCTION__, (long long)blkno);
+				__FUNCTION__, done >> BBSHIFT);
 			break;
-		} else if (r != sizeof(buf)) {
-			fprintf(stderr, _("%s: short read? (%lld)\n"),
-					__FUNCTION__, (long long)blkno);
-			continue;
 		}
 
-		r = write(ofd, buf, sizeof(buf));
-		if (r < 0) {
+		w = pwrite(ofd, buf, r, done);
+		if (w < 0) {
 			fprintf(stderr, _("%s: write error (%lld): %s\n"),
-				__FUNCTION__, (long long)blkno,
+				__FUNCTION__, done >> BBSHIFT,
 				strerror(errno));
 			break;
-		} else if (r != sizeof(buf)) {
+		} else if (w != r) {
 			fprintf(stderr, _("%s: short write? (%lld)\n"),
-				__FUNCTION__, (long long)blkno);
-			continue;
+				__FUNCTION__, (done + w) >> BBSHIFT);
+			break;
 		}
+		done += r;
+		log_copy_progress(&lp, done, false);
 	}
+	free(buf);
 
+out:
+	log_copy_progress(&lp, done, true);
 	close(ofd);
 }
@@ -0,0 +1,374 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include "libxlog.h"
+
+#include "logprint.h"
+
+/*
+ * JSON lines output for xfs_logprint -J.
+ *
+ * Every log operation in every record becomes one line on stdout, so scripts
+ * can digest a big log without parsing the human readable dump.  Only the
+ * fields needed to account for log traffic are decoded; nothing is printed
+ * about the contents of the items themselves.  The -S summary classifies
+ * ops the same way.
+ *
+ * A log item is a format header op followed by the rest of its regions as
+ * separate ops, possibly spread over several records, so we remember per
+ * transaction which item is open and how many regions it still has coming.
+ */
+
+struct xlog_json_tid {
+	struct xlog_json_tid	*next;
+	xlog_tid_t		tid;
+	const char		*type;		/* item the next regions are for */
+	int			left;		/* regions still to come */
+	int			region;		/* index of the last region */
+	int			trans_type;
+	int64_t			blkno;		/* of the open item */
+	uint64_t		ino;
+};
+
+#define XLOG_JSON_HASH	1024
+static struct xlog_json_tid *json_tids[XLOG_JSON_HASH];
+
+static struct xlog_json_tid *
+xlog_json_find_tid(
+	xlog_tid_t		tid,
+	bool			create)
+{
+	struct xlog_json_tid	**head = &json_tids[tid % XLOG_JSON_HASH];
+	struct xlog_json_tid	*t;
+
+	for (t = *head; t; t = t->next)
+		if (t->tid == tid)
+			return t;
+	if (!create)
+		return NULL;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		fprintf(stderr, _("%s: xlog_json_find_tid: malloc failed\n"),
+				progname);
+		exit(1);
+	}
+	t->tid = tid;
+	t->trans_type = -1;
+	t->blkno = -1;
+	t->next = *head;
+	*head = t;
+	return t;
+}
+
+static void
+xlog_json_forget_tid(
+	xlog_tid_t		tid)
+{
+	struct xlog_json_tid	**tp = &json_tids[tid % XLOG_JSON_HASH];
+	struct xlog_json_tid	*t;
+
+	for (; (t = *tp) != NULL; tp = &t->next) {
+		if (t->tid == tid) {
+			*tp = t->next;
+			free(t);
+			return;
+		}
+	}
+}
+
+static const char *
+xlog_json_item_type(
+	unsigned short		type)
+{
+	switch (type) {
+	case XFS_LI_EFI:	return "efi";
+	case XFS_LI_EFD:	return "efd";
+	case XFS_LI_IUNLINK:	return "iunlink";
+	case XFS_LI_INODE:	return "inode";
+	case XFS_LI_BUF:	return "buf";
+	case XFS_LI_DQUOT:	return "dquot";
+	case XFS_LI_QUOTAOFF:	return "quotaoff";
+	case XFS_LI_ICREATE:	return "icreate";
+	case XFS_LI_RUI:	return "rui";
+	case XFS_LI_RUD:	return "rud";
+	case XFS_LI_CUI:	return "cui";
+	case XFS_LI_CUD:	return "cud";
+	case XFS_LI_BUI:	return "bui";
+	case XFS_LI_BUD:	return "bud";
+	default:		return NULL;
+	}
+}
+
+static void
+xlog_json_flags(
+	uint8_t			flags)
+{
+	static const struct {
+		uint8_t		flag;
+		const char	*name;
+	} names[] = {
+		{ XLOG_START_TRANS,	"start" },
+		{ XLOG_COMMIT_TRANS,	"commit" },
+		{ XLOG_WAS_CONT_TRANS,	"was_cont" },
+		{ XLOG_UNMOUNT_TRANS,	"unmount" },
+		{ XLOG_CONTINUE_TRANS,	"continue" },
+		{ XLOG_END_TRANS,	"end" },
+	};
+	const char		*sep = "";
+	int			i;
+
+	printf(",\"flags\":[");
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (flags & names[i].flag) {
+			printf("%s\"%s\"", sep, names[i].name);
+			sep = ",";
+		}
+	}
+	printf("]");
+}
+
+/*
+ * Pull the disk address (and inode) an item covers out of its format
+ * header.  The headers are in the writer's byte order and may not be
+ * aligned, so copy them out first.
+ */
+static void
+xlog_json_item_where(
+	unsigned short		type,
+	char			*ptr,
+	int			len,
+	struct xlog_json_tid	*t)
+{
+	t->blkno = -1;
+	t->ino = 0;
+
+	switch (type) {
+	case XFS_LI_BUF: {
+		struct xfs_buf_log_format	f = { 0 };
+
+		memcpy(&f, ptr, min(len, (int)sizeof(f)));
+		t->blkno = f.blf_blkno;
+		break;
+	}
+	case XFS_LI_INODE: {
+		struct xfs_inode_log_format	f = { 0 };
+		struct xfs_inode_log_format	*fp;
+		char				*copy;
+
+		/* the 32 bit format is smaller, so convert from a copy */
+		copy = calloc(1, sizeof(f));
+		if (!copy)
+			break;
+		memcpy(copy, ptr, min(len, (int)sizeof(f)));
+		fp = xfs_inode_item_format_convert(copy, len, &f);
+		t->ino = fp->ilf_ino;
+		t->blkno = fp->ilf_blkno;
+		free(copy);
+		break;
+	}
+	case XFS_LI_DQUOT: {
+		struct xfs_dq_logformat		f = { 0 };
+
+		memcpy(&f, ptr, min(len, (int)sizeof(f)));
+		t->blkno = f.qlf_blkno;
+		break;
+	}
+	}
+}
+
+/* Print the extra fields of the op that starts an item. */
+static void
+xlog_json_item_fields(
+	const struct xlog_op_info *info,
+	char			*ptr,
+	int			len)
+{
+	switch (info->li_type) {
+	case XFS_LI_BUF: {
+		struct xfs_buf_log_format	f = { 0 };
+
+		memcpy(&f, ptr, min(len, (int)sizeof(f)));
+		printf(",\"blkno\":%lld,\"bblen\":%u",
+				(long long)f.blf_blkno, f.blf_len);
+		break;
+	}
+	case XFS_LI_INODE:
+		printf(",\"ino\":%llu,\"blkno\":%lld",
+				(unsigned long long)info->ino,
+				(long long)info->blkno);
+		break;
+	case XFS_LI_DQUOT: {
+		struct xfs_dq_logformat		f = { 0 };
+
+		memcpy(&f, ptr, min(len, (int)sizeof(f)));
+		printf(",\"id\":%u,\"blkno\":%lld,\"bblen\":%d",
+				f.qlf_id, (long long)f.qlf_blkno, f.qlf_len);
+		break;
+	}
+	case XFS_LI_ICREATE: {
+		struct xfs_icreate_log		f = { 0 };
+
+		memcpy(&f, ptr, min(len, (int)sizeof(f)));
+		printf(",\"agno\":%u,\"agbno\":%u,\"fsblen\":%u",
+				be32_to_cpu(f.icl_ag),
+				be32_to_cpu(f.icl_agbno),
+				be32_to_cpu(f.icl_length));
+		break;
+	}
+	}
+}
+
+/*
+ * Work out which item and transaction an op belongs to.  The op's data
+ * starts at ptr.  Must be called for every op, in log order.
+ */
+void
+xlog_op_classify(
+	xlog_op_header_t	*op_head,
+	char			*ptr,
+	struct xlog_op_info	*info)
+{
+	xlog_tid_t		tid = be32_to_cpu(op_head->oh_tid);
+	int			len = be32_to_cpu(op_head->oh_len);
+	struct xlog_json_tid	*t;
+	unsigned short		li_type = 0;
+	uint32_t		magic = 0;
+
+	memset(info, 0, sizeof(*info));
+	info->type = "unknown";
+	info->region = -1;
+	info->trans_type = -1;
+	info->blkno = -1;
+
+	t = xlog_json_find_tid(tid, false);
+	if (op_head->oh_flags & XLOG_WAS_CONT_TRANS) {
+		/* the rest of a region started in an earlier record */
+		if (t && t->type) {
+			info->type = t->type;
+			info->region = t->region;
+		}
+		info->cont = true;
+	} else if (len == 0) {
+		if (op_head->oh_flags & XLOG_START_TRANS)
+			info->type = "start";
+		else if (op_head->oh_flags & XLOG_COMMIT_TRANS)
+			info->type = "commit";
+		else
+			info->type = "empty";
+	} else if (t && t->left > 0) {
+		info->type = t->type;
+		info->region = ++t->region;
+		t->left--;
+	} else {
+		if (len >= sizeof(magic))
+			memcpy(&magic, ptr, sizeof(magic));
+		if (len >= sizeof(li_type))
+			memcpy(&li_type, ptr, sizeof(li_type));
+
+		if (magic == XFS_TRANS_HEADER_MAGIC) {
+			xfs_trans_header_t	th = { 0 };
+
+			memcpy(&th, ptr, min(len, (int)sizeof(th)));
+			t = xlog_json_find_tid(tid, true);
+			t->trans_type = th.th_type;
+			t->type = info->type = "trans";
+			t->blkno = -1;
+			t->ino = 0;
+		} else if (li_type == XLOG_UNMOUNT_TYPE) {
+			info->type = "unmount";
+		} else if (xlog_json_item_type(li_type)) {
+			uint16_t	size = 0;
+
+			if (len >= 2 * sizeof(uint16_t))
+				memcpy(&size, ptr + sizeof(uint16_t),
+						sizeof(size));
+			t = xlog_json_find_tid(tid, true);
+			t->type = info->type = xlog_json_item_type(li_type);
+			t->region = info->region = 0;
+			t->left = size > 0 ? size - 1 : 0;
+			xlog_json_item_where(li_type, ptr, len, t);
+			info->li_type = li_type;
+		}
+	}
+
+	if (t) {
+		info->trans_type = t->trans_type;
+		if (info->region >= 0) {
+			info->blkno = t->blkno;
+			info->ino = t->ino;
+		}
+	}
+	if (op_head->oh_flags & XLOG_COMMIT_TRANS)
+		xlog_json_forget_tid(tid);
+}
+
+static void
+xlog_json_op(
+	xlog_rec_header_t	*rhead,
+	int			i,
+	xlog_op_header_t	*op_head,
+	char			*ptr)
+{
+	struct xlog_op_info	info;
+	int			len = be32_to_cpu(op_head->oh_len);
+
+	xlog_op_classify(op_head, ptr, &info);
+
+	printf("{\"cycle\":%u,\"block\":%u,\"op\":%d,\"tid\":\"0x%x\"",
+			CYCLE_LSN(be64_to_cpu(rhead->h_lsn)),
+			BLOCK_LSN(be64_to_cpu(rhead->h_lsn)), i,
+			be32_to_cpu(op_head->oh_tid));
+	printf(",\"client\":\"%s\"",
+			op_head->oh_clientid == XFS_TRANSACTION ? "trans" :
+			op_head->oh_clientid == XFS_LOG ? "log" : "error");
+	xlog_json_flags(op_head->oh_flags);
+	printf(",\"len\":%d,\"type\":\"%s\"", len, info.type);
+	if (info.region >= 0)
+		printf(",\"region\":%d", info.region);
+	if (info.cont)
+		printf(",\"cont\":true");
+	if (info.li_type)
+		xlog_json_item_fields(&info, ptr, len);
+	printf("}\n");
+}
+
+/*
+ * Print a line for each op of a record whose data has already been read and
+ * had its cycle numbers put back.  Returns -1 if the ops overrun the record.
+ */
+int
+xlog_json_record(
+	xlog_rec_header_t	*rhead,
+	char			*buf,
+	int			num_ops,
+	int			len)
+{
+	char			*ptr = buf;
+	char			*end = buf + len;
+	xlog_op_header_t	op_head;
+	int			i;
+
+	for (i = 0; i < num_ops; i++) {
+		if (ptr + sizeof(op_head) > end)
+			return -1;
+		memcpy(&op_head, ptr, sizeof(op_head));
+		ptr += sizeof(op_head);
+		if (ptr + be32_to_cpu(op_head.oh_len) > end)
+			return -1;
+		xlog_json_op(rhead, i, &op_head, ptr);
+		ptr += be32_to_cpu(op_head.oh_len);
+	}
+	return 0;
+}
+
+/* Log damage gets a line of its own so consumers can see the gaps. */
+void
+xlog_json_error(
+	const char		*what,
+	xfs_daddr_t		blkno)
+{
+	printf("{\"error\":\"%s\",\"blkno\":%lld}\n", what, (long long)blkno);
+}
@@ -24,7 +24,24 @@ typedef struct xlog_split_item {
 	int			si_skip;
 } xlog_split_item_t;
 
-static xlog_split_item_t *split_list = NULL;
+/* Split items still waiting for their continuations, hashed by tid. */
+#define XLOG_SPLIT_HASH	1024
+static xlog_split_item_t *split_hash[XLOG_SPLIT_HASH];
+static int nr_split_items;
+
+/*
+ * xfs_log_print reads a header block and then a record at a time, which
+ * is two small reads per record, or one per block with -D.  Serve those
+ * out of a big buffer so a long log is read in large sequential chunks.
+ */
+#define XLOG_PRINT_READ_SIZE	(4 << 20)
+
+static struct {
+	char		*buf;
+	size_t		len;		/* bytes in buf */
+	size_t		pos;		/* next byte to hand out */
+	bool		eof;
+} xlog_rbuf;
 
 void
 print_xlog_op_line(void)
@@ -43,6 +60,8 @@ print_xlog_xhdr_line(void)
 void
 print_xlog_record_line(void)
 {
+    if (print_quiet)
+	return;
     printf("======================================"
 	   "======================================\n");
 }	/* print_xlog_record_line */
@@ -102,25 +121,28 @@ static void
 xlog_print_add_to_trans(xlog_tid_t	tid,
 			int		skip)
 {
+    xlog_split_item_t **head = &split_hash[tid % XLOG_SPLIT_HASH];
     xlog_split_item_t *item;
 
     item	  = (xlog_split_item_t *)calloc(sizeof(xlog_split_item_t), 1);
     item->si_xtid  = tid;
     item->si_skip = skip;
-    item->si_next = split_list;
+    item->si_next = *head;
     item->si_prev = NULL;
-    if (split_list)
-	split_list->si_prev = item;
-    split_list	  = item;
+    if (*head)
+	(*head)->si_prev = item;
+    *head	  = item;
+    nr_split_items++;
 }	/* xlog_print_add_to_trans */
 
 
 static int
 xlog_print_find_tid(xlog_tid_t tid, uint was_cont)
 {
-    xlog_split_item_t *listp = split_list;
+    xlog_split_item_t **head = &split_hash[tid % XLOG_SPLIT_HASH];
+    xlog_split_item_t *listp = *head;
 
-    if (!split_list) {
+    if (!nr_split_items) {
 	if (was_cont != 0)	/* Not first time we have used this tid */
 	    return 1;
 	else
@@ -135,16 +157,17 @@ xlog_print_find_tid(xlog_tid_t tid, uint was_cont)
 	return 0;
     }
     if (--listp->si_skip == 0) {
-	if (listp == split_list) {		/* delete at head */
-	    split_list = listp->si_next;
-	    if (split_list)
-		split_list->si_prev = NULL;
+	if (listp == *head) {			/* delete at head */
+	    *head = listp->si_next;
+	    if (*head)
+		(*head)->si_prev = NULL;
 	} else {
 	    if (listp->si_next)
 		listp->si_next->si_prev = listp->si_prev;
 	    listp->si_prev->si_next = listp->si_next;
 	}
 	free(listp);
+	nr_split_items--;
     }
     return 1;
 }	/* xlog_print_find_tid */
@@ -751,12 +774,53 @@ xlog_extract_dinode_ts(
 	return (time64_t)lits->t_sec;
 }
 
+/*
+ * Read like read(2), but from the read buffer, refilling it with one big
+ * read when it runs dry.
+ */
+static ssize_t
+xlog_print_read(int fd, void *buf, size_t count)
+{
+	size_t		done = 0, n;
+	ssize_t		ret;
+
+	if (!xlog_rbuf.buf) {
+		xlog_rbuf.buf = malloc(XLOG_PRINT_READ_SIZE);
+		if (!xlog_rbuf.buf)
+			return read(fd, buf, count);
+	}
+
+	while (done < count) {
+		if (xlog_rbuf.pos == xlog_rbuf.len) {
+			if (xlog_rbuf.eof)
+				break;
+			ret = read(fd, xlog_rbuf.buf, XLOG_PRINT_READ_SIZE);
+			if (ret < 0)
+				return done ? done : -1;
+			if (ret == 0)
+				xlog_rbuf.eof = true;
+			xlog_rbuf.len = ret;
+			xlog_rbuf.pos = 0;
+			continue;
+		}
+		n = min(count - done, xlog_rbuf.len - xlog_rbuf.pos);
+		memcpy((char *)buf + done, xlog_rbuf.buf + xlog_rbuf.pos, n);
+		xlog_rbuf.pos += n;
+		done += n;
+	}
+	return done;
+}
+
 void
 xlog_print_lseek(struct xlog *log, int fd, xfs_daddr_t blkno, int whence)
 {
 #define BBTOOFF64(bbs)	(((xfs_off_t)(bbs)) << BBSHIFT)
 	xfs_off_t offset;
 
+	/* whatever was buffered is from the old position */
+	xlog_rbuf.len = xlog_rbuf.pos = 0;
+	xlog_rbuf.eof = false;
+
 	if (whence == SEEK_SET)
 		offset = BBTOOFF64(blkno+log->l_logBBstart);
 	else
@@ -798,7 +862,8 @@ xlog_print_record(
 	    return NO_ERROR;
 
     if (!len) {
-	printf("\n");
+	if (!print_quiet)
+	    printf("\n");
 	return NO_ERROR;
     }
 
@@ -816,7 +881,7 @@ xlog_print_record(
 	buf = (char *)((intptr_t)(*partial_buf) + (intptr_t)(*read_type));
 	ptr = *partial_buf;
     }
-    if ((ret = (int) read(fd, buf, read_len)) == -1) {
+    if ((ret = (int) xlog_print_read(fd, buf, read_len)) == -1) {
 	fprintf(stderr, _("%s: xlog_print_record: read error\n"), progname);
 	exit(1);
     }
@@ -884,6 +949,15 @@ xlog_print_record(
 
     }
 
+    if (print_quiet) {
+	if (print_json)
+	    ret = xlog_json_record(rhead, buf, num_ops, len);
+	else
+	    ret = xlog_stats_record(log, rhead, buf, num_ops, len);
+	free(buf);
+	return ret;
+    }
+
     ptr = buf;
     for (i=0; i<num_ops; i++) {
 	int continued;
@@ -1047,7 +1121,7 @@ xlog_print_rec_head(xlog_rec_header_t *head, int *len, int bad_hdr_warn)
 	return ZEROED_LOG;
 
     if (be32_to_cpu(head->h_magicno) != XLOG_HEADER_MAGIC_NUM) {
-	if (bad_hdr_warn)
+	if (bad_hdr_warn && !print_quiet)
 		printf(_("Header 0x%x wanted 0x%x\n"),
 			be32_to_cpu(head->h_magicno),
 			XLOG_HEADER_MAGIC_NUM);
@@ -1059,6 +1133,11 @@ xlog_print_rec_head(xlog_rec_header_t *head, int *len, int bad_hdr_warn)
 	!head->h_num_logops && !head->h_size)
 	return CLEARED_BLKS;
 
+    if (print_quiet) {
+	*len = be32_to_cpu(head->h_len);
+	return be32_to_cpu(head->h_num_logops);
+    }
+
     datalen=be32_to_cpu(head->h_len);
     bbs=BTOBB(datalen);
 
@@ -1112,6 +1191,9 @@ xlog_print_rec_xhead(xlog_rec_ext_header_t *head, int coverage)
 {
     int i;
 
+    if (print_quiet)
+	return;
+
     print_xlog_xhdr_line();
     printf(_("extended-header: cycle: %d\n"), be32_to_cpu(head->xh_cycle));
 
@@ -1125,13 +1207,28 @@ xlog_print_rec_xhead(xlog_rec_ext_header_t *head, int coverage)
     }
 }	/* xlog_print_rec_xhead */
 
+/* Report log damage without the human readable dump around it. */
+static void
+xlog_quiet_error(const char *what, xfs_daddr_t blkno)
+{
+	if (print_json)
+		xlog_json_error(what, blkno);
+	else
+		xlog_stats_error();
+}
+
 static void
 print_xlog_bad_zeroed(xfs_daddr_t blkno)
 {
+	if (print_quiet) {
+		xlog_quiet_error("zeroed", blkno);
+		goto out;
+	}
 	print_stars();
 	printf(_("* ERROR: found data after zeroed blocks block=%-21lld  *\n"),
 		(long long)blkno);
 	print_stars();
+out:
 	if (print_exit)
 	    xlog_exit("Bad log - data after zeroed blocks");
 }	/* print_xlog_bad_zeroed */
@@ -1139,10 +1236,15 @@ print_xlog_bad_zeroed(xfs_daddr_t blkno)
 static void
 print_xlog_bad_header(xfs_daddr_t blkno, char *buf)
 {
+	if (print_quiet) {
+		xlog_quiet_error("bad_header", blkno);
+		goto out;
+	}
 	print_stars();
 	printf(_("* ERROR: header cycle=%-11d block=%-21lld        *\n"),
 		xlog_get_cycle(buf), (long long)blkno);
 	print_stars();
+out:
 	if (print_exit)
 	    xlog_exit("Bad log record header");
 }	/* print_xlog_bad_header */
@@ -1150,10 +1252,15 @@ print_xlog_bad_header(xfs_daddr_t blkno, char *buf)
 static void
 print_xlog_bad_data(xfs_daddr_t blkno)
 {
+	if (print_quiet) {
+		xlog_quiet_error("bad_data", blkno);
+		goto out;
+	}
 	print_stars();
 	printf(_("* ERROR: data block=%-21lld                             *\n"),
 		(long long)blkno);
 	print_stars();
+out:
 	if (print_exit)
 	    xlog_exit("Bad data in log");
 }	/* print_xlog_bad_data */
@@ -1161,12 +1268,17 @@ print_xlog_bad_data(xfs_daddr_t blkno)
 static void
 print_xlog_bad_reqd_hdrs(xfs_daddr_t blkno, int num_reqd, int num_hdrs)
 {
+	if (print_quiet) {
+		xlog_quiet_error("short_headers", blkno);
+		goto out;
+	}
 	print_stars();
 	printf(_("* ERROR: for header block=%lld\n"
 	       "*        not enough hdrs for data length, "
 		"required num = %d, hdr num = %d\n"),
 		(long long)blkno, num_reqd, num_hdrs);
 	print_stars();
+out:
 	if (print_exit)
 	    xlog_exit(_("Not enough headers for data length."));
 }	/* print_xlog_bad_reqd_hdrs */
@@ -1225,8 +1337,9 @@ xlog_print_extended_headers(
 	/* don't include 1st header */
 	for (i = 1, xhdr = *ret_xhdrs; i < num_hdrs; i++, (*blkno)++, xhdr++) {
 	    /* read one extra header blk */
-	    if (read(fd, xhbuf, 512) == 0) {
-		printf(_("%s: physical end of log\n"), progname);
+	    if (xlog_print_read(fd, xhbuf, 512) == 0) {
+		if (!print_quiet)
+		    printf(_("%s: physical end of log\n"), progname);
 		print_xlog_record_line();
 		/* reached the end so return 1 */
 		return 1;
@@ -1301,8 +1414,9 @@ void xfs_log_print(struct xlog  *log,
     blkno = block_start;
 
     for (;;) {
-	if (read(fd, hbuf, 512) == 0) {
-	    printf(_("%s: physical end of log\n"), progname);
+	if (xlog_print_read(fd, hbuf, 512) == 0) {
+	    if (!print_quiet)
+		printf(_("%s: physical end of log\n"), progname);
 	    print_xlog_record_line();
 	    break;
 	}
@@ -1316,7 +1430,8 @@ void xfs_log_print(struct xlog  *log,
 	blkno++;
 
 	if (zeroed && num_ops != ZEROED_LOG) {
-	    printf(_("%s: after %d zeroed blocks\n"), progname, zeroed);
+	    if (!print_quiet)
+		printf(_("%s: after %d zeroed blocks\n"), progname, zeroed);
 	    /* once we find zeroed blocks - that's all we expect */
 	    print_xlog_bad_zeroed(blkno-1);
 	    /* reset count since we're assuming previous zeroed blocks
@@ -1373,7 +1488,8 @@ void xfs_log_print(struct xlog  *log,
 	    }
 	    case PARTIAL_READ: {
 		print_xlog_record_line();
-		printf(_("%s: physical end of log\n"), progname);
+		if (!print_quiet)
+		    printf(_("%s: physical end of log\n"), progname);
 		print_xlog_record_line();
 		blkno = 0;
 		xlog_print_lseek(log, fd, 0, SEEK_SET);
@@ -1390,7 +1506,7 @@ void xfs_log_print(struct xlog  *log,
 	print_xlog_record_line();
 loop:
 	if (blkno >= logBBsize) {
-	    if (cleared) {
+	    if (cleared && !print_quiet) {
 		printf(_("%s: skipped %d cleared blocks in range: %lld - %lld\n"),
 			progname, cleared,
 			(long long)(cleared_blkno),
@@ -1400,7 +1516,7 @@ loop:
 
 		cleared=0;
 	    }
-	    if (zeroed) {
+	    if (zeroed && !print_quiet) {
 		printf(_("%s: skipped %d zeroed blocks in range: %lld - %lld\n"),
 			progname, zeroed,
 			(long long)(zeroed_blkno),
@@ -1410,7 +1526,8 @@ loop:
 
 		zeroed=0;
 	    }
-	    printf(_("%s: physical end of log\n"), progname);
+	    if (!print_quiet)
+		printf(_("%s: physical end of log\n"), progname);
 	    print_xlog_record_line();
 	    break;
 	}
@@ -1421,7 +1538,7 @@ loop:
 	blkno = 0;
 	xlog_print_lseek(log, fd, 0, SEEK_SET);
 	for (;;) {
-	    if (read(fd, hbuf, 512) == 0) {
+	    if (xlog_print_read(fd, hbuf, 512) == 0) {
 		xlog_panic(_("xlog_find_head: bad read"));
 	    }
 	    if (print_only_data) {
@@ -1474,8 +1591,13 @@ loop2:
     }
 
 end:
-    printf(_("%s: logical end of log\n"), progname);
+    if (print_stats)
+	xlog_stats_report();
+    if (!print_quiet)
+	printf(_("%s: logical end of log\n"), progname);
     print_xlog_record_line();
+    free(xlog_rbuf.buf);
+    memset(&xlog_rbuf, 0, sizeof(xlog_rbuf));
 }
 
 /*
@@ -19,10 +19,12 @@ xlog_print_find_oldest(
 	struct xfs_buf	*bp;
 	xfs_daddr_t	first_blk;
 	uint		first_half_cycle, last_half_cycle;
+	bool		cached;
 	int		error = 0;
 
+	cached = xlog_bcache_start(log);
 	if (xlog_find_zeroed(log, &first_blk))
-		return 0;
+		goto out;
 
 	first_blk = 0;		/* read first block */
 	bp = xlog_get_bp(log, 1);
@@ -40,6 +42,9 @@ xlog_print_find_oldest(
 					      last_blk, last_half_cycle);
 
 	libxfs_buf_relse(bp);
+out:
+	if (cached)
+		xlog_bcache_stop();
 	return error;
 }
 
@@ -0,0 +1,339 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include "libxlog.h"
+
+#include "logprint.h"
+
+/*
+ * Log traffic summary for xfs_logprint -S.
+ *
+ * Instead of printing the records we add up how many ops and bytes each log
+ * item type, transaction type, AG and inode accounts for, and print the
+ * totals once the whole log has been walked.  Byte counts include each op's
+ * header, since that is log space too.
+ */
+
+struct xlog_stat {
+	const char		*name;
+	uint64_t		items;
+	uint64_t		ops;
+	uint64_t		bytes;
+};
+
+struct xlog_ino_stat {
+	struct xlog_ino_stat	*next;
+	uint64_t		ino;
+	uint64_t		items;
+	uint64_t		bytes;
+};
+
+#define XLOG_STAT_TYPES		32
+#define XLOG_STAT_TRANS		64
+#define XLOG_INO_HASH		4096
+#define XLOG_TOP_INODES		20
+
+static struct {
+	uint64_t		records;
+	uint64_t		record_bytes;
+	uint64_t		ops;
+	uint64_t		op_bytes;
+	uint64_t		errors;
+	uint64_t		nr_inodes;
+
+	struct xlog_stat	types[XLOG_STAT_TYPES];
+	int			nr_types;
+
+	/* transaction headers seen and bytes logged, by th_type */
+	struct xlog_stat	trans[XLOG_STAT_TRANS];
+	struct xlog_stat	trans_unknown;
+
+	struct xlog_stat	*ags;
+	xfs_agnumber_t		nr_ags;
+	struct xlog_stat	no_ag;
+
+	struct xlog_ino_stat	*inodes[XLOG_INO_HASH];
+} xst;
+
+static struct xlog_stat *
+xlog_stats_type(
+	const char		*name)
+{
+	int			i;
+
+	/* names come from string constants, so pointers compare */
+	for (i = 0; i < xst.nr_types; i++)
+		if (xst.types[i].name == name)
+			return &xst.types[i];
+	if (xst.nr_types == XLOG_STAT_TYPES)
+		return &xst.types[XLOG_STAT_TYPES - 1];
+	xst.types[xst.nr_types].name = name;
+	return &xst.types[xst.nr_types++];
+}
+
+static void
+xlog_stats_inode(
+	uint64_t		ino,
+	bool			first,
+	int			bytes)
+{
+	struct xlog_ino_stat	**head = &xst.inodes[ino % XLOG_INO_HASH];
+	struct xlog_ino_stat	*s;
+
+	for (s = *head; s; s = s->next)
+		if (s->ino == ino)
+			break;
+	if (!s) {
+		s = calloc(1, sizeof(*s));
+		if (!s) {
+			fprintf(stderr, _("%s: xlog_stats_inode: malloc failed\n"),
+					progname);
+			exit(1);
+		}
+		s->ino = ino;
+		s->next = *head;
+		*head = s;
+		xst.nr_inodes++;
+	}
+	if (first)
+		s->items++;
+	s->bytes += bytes;
+}
+
+/* Which AG does this op's item live in, or NULLAGNUMBER? */
+static xfs_agnumber_t
+xlog_stats_agno(
+	struct xfs_mount	*mp,
+	const struct xlog_op_info *info)
+{
+	struct xfs_sb		*sb = &mp->m_sb;
+	uint64_t		agno;
+
+	if (!sb->sb_agblocks || !sb->sb_agcount)
+		return NULLAGNUMBER;
+	if (info->ino)
+		agno = info->ino >> (sb->sb_agblklog + sb->sb_inopblog);
+	else if (info->blkno >= 0)
+		agno = (info->blkno >> (sb->sb_blocklog - BBSHIFT)) /
+				sb->sb_agblocks;
+	else
+		return NULLAGNUMBER;
+	return agno < sb->sb_agcount ? agno : NULLAGNUMBER;
+}
+
+static void
+xlog_stats_op(
+	struct xfs_mount	*mp,
+	xlog_op_header_t	*op_head,
+	char			*ptr)
+{
+	struct xlog_op_info	info;
+	struct xlog_stat	*st;
+	xfs_agnumber_t		agno;
+	int			bytes;
+	bool			first;
+
+	xlog_op_classify(op_head, ptr, &info);
+	bytes = be32_to_cpu(op_head->oh_len) + sizeof(xlog_op_header_t);
+	first = info.region == 0 && !info.cont;
+
+	xst.ops++;
+	xst.op_bytes += bytes;
+
+	st = xlog_stats_type(info.type);
+	st->ops++;
+	st->bytes += bytes;
+	if (first || (info.region < 0 && !info.cont))
+		st->items++;
+
+	if (info.trans_type >= 0 && info.trans_type < XLOG_STAT_TRANS)
+		st = &xst.trans[info.trans_type];
+	else
+		st = &xst.trans_unknown;
+	st->ops++;
+	st->bytes += bytes;
+	if (!strcmp(info.type, "trans") && !info.cont)
+		st->items++;
+
+	agno = xlog_stats_agno(mp, &info);
+	if (agno != NULLAGNUMBER) {
+		if (agno >= xst.nr_ags) {
+			st = realloc(xst.ags, (agno + 1) * sizeof(*st));
+			if (!st) {
+				fprintf(stderr,
+			_("%s: xlog_stats_op: malloc failed\n"), progname);
+				exit(1);
+			}
+			memset(st + xst.nr_ags, 0,
+				(agno + 1 - xst.nr_ags) * sizeof(*st));
+			xst.ags = st;
+			xst.nr_ags = agno + 1;
+		}
+		st = &xst.ags[agno];
+	} else {
+		st = &xst.no_ag;
+	}
+	st->ops++;
+	st->bytes += bytes;
+	if (first)
+		st->items++;
+
+	if (info.ino)
+		xlog_stats_inode(info.ino, first, bytes);
+}
+
+/* Account for the ops of a record already read in and unpacked. */
+int
+xlog_stats_record(
+	struct xlog		*log,
+	xlog_rec_header_t	*rhead,
+	char			*buf,
+	int			num_ops,
+	int			len)
+{
+	char			*ptr = buf;
+	char			*end = buf + len;
+	xlog_op_header_t	op_head;
+	int			i;
+
+	xst.records++;
+	xst.record_bytes += BBTOB(BTOBB(len)) + BBSIZE;
+	for (i = 0; i < num_ops; i++) {
+		if (ptr + sizeof(op_head) > end)
+			return -1;
+		memcpy(&op_head, ptr, sizeof(op_head));
+		ptr += sizeof(op_head);
+		if (ptr + be32_to_cpu(op_head.oh_len) > end)
+			return -1;
+		xlog_stats_op(log->l_mp, &op_head, ptr);
+		ptr += be32_to_cpu(op_head.oh_len);
+	}
+	return 0;
+}
+
+void
+xlog_stats_error(void)
+{
+	xst.errors++;
+}
+
+static int
+xlog_stat_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xlog_stat	*sa = a, *sb = b;
+
+	if (sa->bytes != sb->bytes)
+		return sa->bytes > sb->bytes ? -1 : 1;
+	return 0;
+}
+
+static int
+xlog_ino_stat_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xlog_ino_stat *sa = *(struct xlog_ino_stat **)a;
+	const struct xlog_ino_stat *sb = *(struct xlog_ino_stat **)b;
+
+	if (sa->bytes != sb->bytes)
+		return sa->bytes > sb->bytes ? -1 : 1;
+	return sa->ino < sb->ino ? -1 : sa->ino > sb->ino;
+}
+
+static void
+xlog_stat_line(
+	const char		*name,
+	const struct xlog_stat	*st)
+{
+	printf("%-16s %12llu %12llu %16llu %6.2f%%\n", name,
+			(unsigned long long)st->items,
+			(unsigned long long)st->ops,
+			(unsigned long long)st->bytes,
+			xst.op_bytes ? st->bytes * 100.0 / xst.op_bytes : 0.0);
+}
+
+static void
+xlog_stat_header(
+	const char		*what)
+{
+	printf(_("\n%-16s %12s %12s %16s %7s\n"), what,
+			_("items"), _("ops"), _("bytes"), _("pct"));
+}
+
+void
+xlog_stats_report(void)
+{
+	struct xlog_ino_stat	**inodes, *s;
+	char			name[32];
+	uint64_t		i, n;
+
+	printf(_("records: %llu  bytes: %llu  ops: %llu  op bytes: %llu"),
+			(unsigned long long)xst.records,
+			(unsigned long long)xst.record_bytes,
+			(unsigned long long)xst.ops,
+			(unsigned long long)xst.op_bytes);
+	if (xst.errors)
+		printf(_("  damaged: %llu"), (unsigned long long)xst.errors);
+	printf("\n");
+
+	xlog_stat_header(_("item type"));
+	qsort(xst.types, xst.nr_types, sizeof(struct xlog_stat),
+			xlog_stat_cmp);
+	for (i = 0; i < xst.nr_types; i++)
+		xlog_stat_line(xst.types[i].name, &xst.types[i]);
+
+	xlog_stat_header(_("trans type"));
+	for (i = 0; i < XLOG_STAT_TRANS; i++) {
+		if (!xst.trans[i].ops)
+			continue;
+		if (i == XFS_TRANS_CHECKPOINT)
+			snprintf(name, sizeof(name), "checkpoint");
+		else
+			snprintf(name, sizeof(name), "%llu",
+					(unsigned long long)i);
+		xlog_stat_line(name, &xst.trans[i]);
+	}
+	if (xst.trans_unknown.ops)
+		xlog_stat_line(_("unknown"), &xst.trans_unknown);
+
+	if (xst.nr_ags) {
+		xlog_stat_header(_("AG"));
+		for (i = 0; i < xst.nr_ags; i++) {
+			if (!xst.ags[i].ops)
+				continue;
+			snprintf(name, sizeof(name), "%llu",
+					(unsigned long long)i);
+			xlog_stat_line(name, &xst.ags[i]);
+		}
+		xlog_stat_line(_("none"), &xst.no_ag);
+	}
+
+	if (xst.nr_inodes) {
+		inodes = malloc(xst.nr_inodes * sizeof(*inodes));
+		if (!inodes) {
+			fprintf(stderr, _("%s: xlog_stats_report: malloc failed\n"),
+					progname);
+			exit(1);
+		}
+		for (i = 0, n = 0; i < XLOG_INO_HASH; i++)
+			for (s = xst.inodes[i]; s; s = s->next)
+				inodes[n++] = s;
+		qsort(inodes, n, sizeof(*inodes), xlog_ino_stat_cmp);
+
+		printf(_("\n%llu inodes logged, busiest:\n"),
+				(unsigned long long)n);
+		printf(_("%-20s %12s %16s %7s\n"),
+				_("inode"), _("items"), _("bytes"), _("pct"));
+		for (i = 0; i < n && i < XLOG_TOP_INODES; i++)
+			printf("%-20llu %12llu %16llu %6.2f%%\n",
+				(unsigned long long)inodes[i]->ino,
+				(unsigned long long)inodes[i]->items,
+				(unsigned long long)inodes[i]->bytes,
+				inodes[i]->bytes * 100.0 / xst.op_bytes);
+		free(inodes);
+	}
+}
@@ -24,6 +24,9 @@ int	print_buffer;
 int	print_overwrite;
 int     print_no_data;
 int     print_no_print;
+int	print_json;
+int	print_stats;
+int	print_quiet;		/* no human readable dump */
 static int	print_operation = OP_PRINT;
 
 static void
@@ -36,10 +39,12 @@ Options:\n\
     -d	            dump the log in log-record format\n\
     -e	            exit when an error is found in the log\n\
     -f	            specified device is actually a file\n\
+    -J              print one JSON object per log operation\n\
     -l <device>     filename of external log\n\
     -n	            don't try and interpret log data\n\
     -o	            print buffer data in hex\n\
     -s <start blk>  block # to start printing\n\
+    -S              summarise log traffic by item, transaction, AG and inode\n\
     -v              print \"overwrite\" data\n\
     -t	            print out transactional view\n\
 	-b          in transactional view, extract buffer info\n\
@@ -135,7 +140,7 @@ main(int argc, char **argv)
 	print_exit = 1; /* -e is now default. specify -c to override */
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "bC:cdefl:iqnors:tDVv")) != EOF) {
+	while ((c = getopt(argc, argv, "bC:cdefJl:iqnors:StDVv")) != EOF) {
 		switch (c) {
 			case 'D':
 				print_only_data++;
@@ -166,6 +171,9 @@ main(int argc, char **argv)
 				print_skip_uuid++;
 				x.disfile = 1;
 				break;
+			case 'J':
+				print_json++;
+				break;
 			case 'l':
 				x.logname = optarg;
 				x.lisfile = 1;
@@ -185,6 +193,9 @@ main(int argc, char **argv)
 			case 's':
 				print_start = atoi(optarg);
 				break;
+			case 'S':
+				print_stats++;
+				break;
 			case 't':
 				print_operation = OP_PRINT_TRANS;
 				break;
@@ -201,6 +212,10 @@ main(int argc, char **argv)
 
 	if (argc - optind != 1)
 		usage();
+	print_quiet = print_json || print_stats;
+	if (print_quiet && (print_operation != OP_PRINT || print_only_data ||
+			    print_no_data || (print_json && print_stats)))
+		usage();
 
 	x.dname = argv[optind];
 
@@ -208,7 +223,8 @@ main(int argc, char **argv)
 		usage();
 
 	x.isreadonly = LIBXFS_ISINACTIVE;
-	printf(_("xfs_logprint:\n"));
+	if (!print_quiet)
+		printf(_("xfs_logprint:\n"));
 	if (!libxfs_init(&x))
 		exit(1);
 
@@ -217,17 +233,18 @@ main(int argc, char **argv)
 
 	logfd = (x.logfd < 0) ? x.dfd : x.logfd;
 
-	printf(_("    data device: 0x%llx\n"), (unsigned long long)x.ddev);
-
-	if (x.logname) {
-		printf(_("    log file: \"%s\" "), x.logname);
-	} else {
-		printf(_("    log device: 0x%llx "), (unsigned long long)x.logdev);
+	if (!print_quiet) {
+		printf(_("    data device: 0x%llx\n"),
+				(unsigned long long)x.ddev);
+		if (x.logname)
+			printf(_("    log file: \"%s\" "), x.logname);
+		else
+			printf(_("    log device: 0x%llx "),
+					(unsigned long long)x.logdev);
+		printf(_("daddr: %lld length: %lld\n\n"),
+			(long long)x.logBBstart, (long long)x.logBBsize);
 	}
 
-	printf(_("daddr: %lld length: %lld\n\n"),
-		(long long)x.logBBstart, (long long)x.logBBsize);
-
 	ASSERT(x.logBBsize <= INT_MAX);
 
 	log.l_dev = mount.m_logdev_targp;
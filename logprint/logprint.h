@@ -16,6 +16,9 @@ extern int	print_transactions;
 extern int	print_overwrite;
 extern int	print_no_data;
 extern int	print_no_print;
+extern int	print_json;
+extern int	print_stats;
+extern int	print_quiet;
 
 /* exports */
 extern time64_t xlog_extract_dinode_ts(const xfs_log_timestamp_t);
@@ -30,6 +33,25 @@ extern void print_xlog_record_line(void);
 extern void print_xlog_op_line(void);
 extern void print_stars(void);
 
+/* what xlog_op_classify() makes of a log op */
+struct xlog_op_info {
+	const char	*type;		/* item type, "trans", "commit"... */
+	unsigned short	li_type;	/* set on the op with the item format */
+	int		region;		/* region of the item, or -1 */
+	bool		cont;		/* rest of a region from a previous op */
+	int		trans_type;	/* from the trans header, or -1 */
+	int64_t		blkno;		/* daddr the item covers, or -1 */
+	uint64_t	ino;		/* inode the item covers, or 0 */
+};
+
+extern void xlog_op_classify(xlog_op_header_t *, char *, struct xlog_op_info *);
+extern int xlog_json_record(xlog_rec_header_t *, char *, int, int);
+extern void xlog_json_error(const char *, xfs_daddr_t);
+extern int xlog_stats_record(struct xlog *, xlog_rec_header_t *, char *,
+			     int, int);
+extern void xlog_stats_error(void);
+extern void xlog_stats_report(void);
+
 extern struct xfs_inode_log_format *
 	xfs_inode_item_format_convert(char *, uint, struct xfs_inode_log_format *);
 
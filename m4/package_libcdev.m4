@@ -163,6 +163,44 @@ AC_DEFUN([AC_HAVE_COPY_FILE_RANGE],
     AC_SUBST(have_copy_file_range)
   ])
 
+#
+# Check if we have the io_uring syscalls and the uapi header that describes
+# the rings (Linux 5.6+ for IORING_OP_READ/WRITE)
+#
+AC_DEFUN([AC_HAVE_IO_URING],
+  [ AC_MSG_CHECKING([for io_uring])
+    AC_TRY_COMPILE([
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+    ], [
+         struct io_uring_params p = { .flags = IORING_SETUP_IOPOLL };
+         int op = IORING_OP_READ + IORING_OP_WRITE;
+         syscall(__NR_io_uring_setup, 0, &p);
+         syscall(__NR_io_uring_enter, 0, op, 0, 0, 0, 0);
+    ], have_io_uring=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_io_uring)
+  ])
+
+#
+# Check if we have sys/sdt.h for USDT probes
+#
+AC_DEFUN([AC_HAVE_SDT],
+  [ AC_MSG_CHECKING([for sys/sdt.h])
+    AC_TRY_COMPILE([
+#include <sys/sdt.h>
+    ], [
+         int a = 1;
+         STAP_PROBEV(xfs, test, a, &a);
+    ], have_sdt=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_sdt)
+  ])
+
 #
 # Check if we have a sync_file_range libc call (Linux)
 #
@@ -425,6 +463,24 @@ AC_DEFUN([AC_HAVE_HDIO_GETGEO],
     AC_SUBST(have_hdio_getgeo)
   ])
 
+#
+# Check if we have the NVME_IOCTL_IO_CMD passthrough ioctl
+#
+AC_DEFUN([AC_HAVE_NVME_IO_CMD],
+  [ AC_MSG_CHECKING([for struct nvme_passthru_cmd ])
+    AC_TRY_COMPILE([
+#include <sys/ioctl.h>
+#include <linux/nvme_ioctl.h>
+    ],
+    [
+         struct nvme_passthru_cmd cmd;
+         ioctl(0, NVME_IOCTL_IO_CMD, &cmd);
+    ], have_nvme_io_cmd=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_nvme_io_cmd)
+  ])
+
 AC_DEFUN([AC_PACKAGE_CHECK_LTO],
   [ AC_MSG_CHECKING([if C compiler supports LTO])
     OLD_CFLAGS="$CFLAGS"
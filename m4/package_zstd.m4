@@ -0,0 +1,6 @@
+AC_DEFUN([AC_HAVE_LIBZSTD],
+  [ PKG_CHECK_MODULES([libzstd], [libzstd], [have_libzstd=yes], [have_libzstd=no])
+    AC_SUBST(have_libzstd)
+    AC_SUBST(libzstd_CFLAGS)
+    AC_SUBST(libzstd_LIBS)
+  ])
@@ -4,13 +4,40 @@
  * All Rights Reserved.
  */
 
+#if defined(HAVE_FALLOCATE)
+#include <linux/falloc.h>
+#endif
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "libxfs.h"
 #include "xfs_metadump.h"
+#include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE	0x10
+#endif
+
+/* metablocks of a v1 dump that are sorted and written out together */
+#define V1_BATCH_METABLOCKS	32
 
 static int	show_progress = 0;
 static int	show_info = 0;
 static int	progress_since_warning = 0;
 
+/* throughput for -g and -S; worker times are summed over the threads */
+static char		*stats_path;
+static uint64_t		start_ns;
+static uint64_t		bytes_read;	/* from the metadumps */
+static uint64_t		read_ns;	/* waiting for the metadumps */
+static atomic64_t	bytes_written;	/* to all the targets */
+static atomic64_t	unpack_ns;	/* decompressing chunks */
+static atomic64_t	write_ns;	/* writing the targets */
+
 static void
 fatal(const char *msg, ...)
 {
@@ -25,7 +52,7 @@ fatal(const char *msg, ...)
 static void
 print_progress(const char *fmt, ...)
 {
-	char		buf[60];
+	char		buf[80];
 	va_list		ap;
 
 	va_start(ap, fmt);
@@ -33,44 +60,552 @@ print_progress(const char *fmt, ...)
 	va_end(ap);
 	buf[sizeof(buf)-1] = '\0';
 
-	printf("\r%-59s", buf);
+	printf("\r%-79s", buf);
 	fflush(stdout);
 	progress_since_warning = 1;
 }
 
+static uint64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read from a metadump, accounting for the bytes and the time it took. */
+static void
+read_src(
+	void		*buf,
+	size_t		len,
+	FILE		*src_f)
+{
+	uint64_t	start = now_ns();
+
+	if (fread(buf, len, 1, src_f) != 1)
+		fatal("error reading from metadump file\n");
+	read_ns += now_ns() - start;
+	bytes_read += len;
+}
+
+/*
+ * Show how much has been read and how fast.  If the metadump is a regular
+ * file, how far into it we are also gives the time left.
+ */
+static void
+restore_progress(
+	FILE		*src_f)
+{
+	double		secs = (now_ns() - start_ns) / 1e9;
+	double		rate = secs > 0 ? bytes_read / secs : 0;
+	struct stat	st;
+	off_t		pos;
+	uint64_t	left;
+
+	pos = ftello(src_f);
+	if (rate <= 0 || pos <= 0 || fstat(fileno(src_f), &st) < 0 ||
+	    !S_ISREG(st.st_mode) || st.st_size < pos) {
+		print_progress("%llu MB read, %.1f MB/s",
+				(unsigned long long)bytes_read >> 20,
+				rate / 1048576);
+		return;
+	}
+
+	left = (st.st_size - pos) / rate;
+	print_progress("%llu MB read, %.1f MB/s, %d%% done, ETA %llu:%02llu",
+			(unsigned long long)bytes_read >> 20, rate / 1048576,
+			(int)(pos * 100 / st.st_size),
+			(unsigned long long)left / 60,
+			(unsigned long long)left % 60);
+}
+
+/*
+ * Print the totals of a restore for -g, and write them to the -S file.
+ * Decompression and writing are done by a pool of threads, so their times
+ * can add up to more than the elapsed time.
+ */
+static void
+report_stats(void)
+{
+	double		secs = (now_ns() - start_ns) / 1e9;
+	uint64_t	written = atomic64_read(&bytes_written);
+	double		rd = read_ns / 1e9;
+	double		un = atomic64_read(&unpack_ns) / 1e9;
+	double		wr = atomic64_read(&write_ns) / 1e9;
+	FILE		*f;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	if (show_progress) {
+		printf(
+"Read %llu MB, wrote %llu MB in %.1fs (%.1f MB/s read)\n",
+			(unsigned long long)bytes_read >> 20,
+			(unsigned long long)written >> 20, secs,
+			bytes_read / secs / 1048576);
+		printf(
+"Time reading %.1fs (%.0f%%), decompressing %.1fs (%.0f%%), writing %.1fs (%.0f%%)\n",
+			rd, rd * 100 / secs, un, un * 100 / secs,
+			wr, wr * 100 / secs);
+	}
+
+	if (!stats_path)
+		return;
+	f = fopen(stats_path, "w");
+	if (!f)
+		fatal("cannot open stats file %s: %s\n", stats_path,
+				strerror(errno));
+	fprintf(f, "elapsed_sec %.3f\n", secs);
+	fprintf(f, "bytes_read %llu\n", (unsigned long long)bytes_read);
+	fprintf(f, "bytes_written %llu\n", (unsigned long long)written);
+	fprintf(f, "mb_per_sec %.3f\n", bytes_read / secs / 1048576);
+	fprintf(f, "read_sec %.3f\n", rd);
+	fprintf(f, "decompress_sec %.3f\n", un);
+	fprintf(f, "write_sec %.3f\n", wr);
+	if (fclose(f))
+		fatal("error writing stats file %s\n", stats_path);
+}
+
+/*
+ * Check the primary superblock that a metadump starts with.  A metablock
+ * holds at most @max_bytes of blocks.
+ */
+static void
+check_primary_sb(
+	char		*block,
+	xfs_sb_t	*sb,
+	int		max_bytes)
+{
+	libxfs_sb_from_disk(sb, (struct xfs_dsb *)block);
+
+	if (sb->sb_magicnum != XFS_SB_MAGIC)
+		fatal("bad magic number for primary superblock\n");
+
+	/*
+	 * Normally the upper bound would be simply XFS_MAX_SECTORSIZE
+	 * but the metadump format has a maximum number of BBSIZE blocks
+	 * it can store in a single metablock.
+	 */
+	if (sb->sb_sectsize < XFS_MIN_SECTORSIZE ||
+	    sb->sb_sectsize > XFS_MAX_SECTORSIZE ||
+	    sb->sb_sectsize > max_bytes)
+		fatal("bad sector size %u in metadump image\n", sb->sb_sectsize);
+
+	((struct xfs_dsb *)block)->sb_inprogress = 1;
+}
+
+static void
+size_target(
+	int		dst_fd,
+	int		is_target_file,
+	xfs_sb_t	*sb)
+{
+	if (is_target_file)  {
+		/* ensure regular files are correctly sized */
+
+		if (ftruncate(dst_fd, sb->sb_dblocks * sb->sb_blocksize))
+			fatal("cannot set filesystem image size: %s\n",
+				strerror(errno));
+	} else  {
+		/* ensure device is sufficiently large enough */
+
+		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
+		off64_t		off;
+
+		off = sb->sb_dblocks * sb->sb_blocksize - sizeof(lb);
+		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
+			fatal("failed to write last block, is target too "
+				"small? (error: %s)\n", strerror(errno));
+	}
+}
+
+/* Clear the in-progress flag once everything else has been restored. */
+static void
+write_primary_sb(
+	int		dst_fd,
+	xfs_sb_t	*sb,
+	char		*block_buffer)
+{
+	memset(block_buffer, 0, sb->sb_sectsize);
+	sb->sb_inprogress = 0;
+	libxfs_sb_to_disk((struct xfs_dsb *)block_buffer, sb);
+	if (xfs_sb_version_hascrc(sb)) {
+		xfs_update_cksum(block_buffer, sb->sb_sectsize,
+				 offsetof(struct xfs_sb, sb_crc));
+	}
+
+	if (pwrite(dst_fd, block_buffer, sb->sb_sectsize, 0) < 0)
+		fatal("error writing primary superblock: %s\n", strerror(errno));
+}
+
+/* Where the blocks of a dump are being restored to. */
+struct restore_target {
+	int		fd;
+	bool		is_file;	/* a regular file, truncated to empty */
+	bool		zero_range;	/* try FALLOC_FL_ZERO_RANGE on a device */
+	bool		overlay;	/* a base dump has been restored to it */
+	struct workqueue wq;		/* writers of this target */
+};
+
+/* All the targets that one pass over a dump is restored to. */
+struct restore_set {
+	struct restore_target	*targets;
+	unsigned int		nr_targets;
+};
+
+#define for_each_target(set, t) \
+	for ((t) = (set)->targets; (t) < (set)->targets + (set)->nr_targets; (t)++)
+
+/*
+ * Blocks are restored in batches.  The blocks of a batch are sorted by
+ * disk address so that runs of adjacent blocks go out in one pwritev()
+ * call, and runs of zeroed blocks aren't written at all: a regular file
+ * target starts out empty, so they already read back as zeroes, and a
+ * device gets them zeroed with fallocate() where it can.
+ *
+ * A batch is read and decoded once, then handed to each target's own pool
+ * of writer threads, so several writes are in flight on every target at
+ * once and a slow target only holds up the batches it hasn't written yet.
+ * The last target to write a batch frees it.
+ */
+struct batch_ent {
+	int64_t		daddr;
+	char		*block;		/* BBSIZE bytes of data */
+};
+
+struct write_batch {
+	char		*buf;		/* what the entries point into */
+	struct batch_ent *ents;
+	unsigned int	nr_ents;
+	unsigned int	max_ents;
+	atomic_t	refs;		/* targets yet to write it */
+};
+
+static struct write_batch *
+alloc_batch(
+	char			*buf)
+{
+	struct write_batch	*batch;
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		fatal("memory allocation failure\n");
+	batch->buf = buf;
+	return batch;
+}
+
+static void
+free_batch(
+	struct write_batch	*batch)
+{
+	free(batch->buf);
+	free(batch->ents);
+	free(batch);
+}
+
+static void
+batch_add(
+	int64_t			daddr,
+	char			*block,
+	void			*priv)
+{
+	struct write_batch	*batch = priv;
+	struct batch_ent	*ents;
+
+	if (batch->nr_ents == batch->max_ents) {
+		batch->max_ents = batch->max_ents ? batch->max_ents * 2 : 256;
+		ents = realloc(batch->ents,
+				batch->max_ents * sizeof(struct batch_ent));
+		if (!ents)
+			fatal("memory allocation failure\n");
+		batch->ents = ents;
+	}
+	batch->ents[batch->nr_ents].daddr = daddr;
+	batch->ents[batch->nr_ents].block = block;
+	batch->nr_ents++;
+}
+
+/*
+ * Sort by disk address, and for copies of the same block by where they are
+ * in the batch, since the copy that comes last in the dump wins.
+ */
+static int
+batch_ent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct batch_ent	*ea = a;
+	const struct batch_ent	*eb = b;
+
+	if (ea->daddr != eb->daddr)
+		return ea->daddr < eb->daddr ? -1 : 1;
+	if (ea->block != eb->block)
+		return ea->block < eb->block ? -1 : 1;
+	return 0;
+}
+
+static void
+sort_batch(
+	struct write_batch	*batch)
+{
+	qsort(batch->ents, batch->nr_ents, sizeof(struct batch_ent),
+			batch_ent_cmp);
+}
+
+static bool
+is_zero_block(
+	const char	*block)
+{
+	return block[0] == 0 && !memcmp(block, block + 1, BBSIZE - 1);
+}
+
+static void
+write_run(
+	struct restore_target	*target,
+	int64_t			daddr,
+	struct iovec		*iov,
+	int			nr,
+	bool			zero)
+{
+	off64_t			off = daddr << BBSHIFT;
+	ssize_t			len = (ssize_t)nr << BBSHIFT;
+	ssize_t			ret;
+	uint64_t		start = now_ns();
+
+	if (zero) {
+		if (target->is_file && !target->overlay)
+			return;
+#ifdef HAVE_FALLOCATE
+		if (target->zero_range &&
+		    fallocate(target->fd, FALLOC_FL_ZERO_RANGE |
+				FALLOC_FL_KEEP_SIZE, off, len) == 0)
+			goto done;
+#endif
+		/* not supported here, write the zeroes instead */
+		target->zero_range = false;
+	}
+
+#ifdef HAVE_PWRITEV
+	ret = pwritev(target->fd, iov, nr, off);
+#else
+	for (ret = 0; nr > 0; iov++, nr--) {
+		if (pwrite(target->fd, iov->iov_base, iov->iov_len,
+				off + ret) != iov->iov_len) {
+			ret = -1;
+			break;
+		}
+		ret += iov->iov_len;
+	}
+#endif
+	if (ret < 0)
+		fatal("error writing block %llu: %s\n",
+			(unsigned long long)off, strerror(errno));
+	if (ret != len)
+		fatal("short write of %zd bytes at block %llu\n",
+			ret, (unsigned long long)off);
+#ifdef HAVE_FALLOCATE
+done:
+#endif
+	atomic64_add(now_ns() - start, &write_ns);
+	atomic64_add(len, &bytes_written);
+}
+
+static void
+write_batch(
+	struct restore_target	*target,
+	struct write_batch	*batch)
+{
+	struct iovec		iov[IOV_MAX];
+	struct batch_ent	*ent;
+	int64_t			start = 0;
+	bool			zero = false;
+	bool			ent_zero = false;
+	int			nr = 0;
+	unsigned int		i;
+
+	for (i = 0, ent = batch->ents; i < batch->nr_ents; i++, ent++) {
+		if (i + 1 < batch->nr_ents && ent[1].daddr == ent->daddr)
+			continue;
+
+		if (target->is_file || target->zero_range)
+			ent_zero = is_zero_block(ent->block);
+		if (nr > 0 && (ent->daddr != start + nr || ent_zero != zero ||
+			       nr == IOV_MAX)) {
+			write_run(target, start, iov, nr, zero);
+			nr = 0;
+		}
+		if (nr == 0) {
+			start = ent->daddr;
+			zero = ent_zero;
+		}
+		iov[nr].iov_base = ent->block;
+		iov[nr].iov_len = BBSIZE;
+		nr++;
+	}
+	if (nr > 0)
+		write_run(target, start, iov, nr, zero);
+}
+
+static void
+write_batch_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct write_batch	*batch = arg;
+
+	write_batch(wq->wq_ctx, batch);
+	if (atomic_dec_and_test(&batch->refs))
+		free_batch(batch);
+}
+
+static void
+start_workers(
+	struct workqueue	*wq,
+	void			*ctx,
+	unsigned int		nr_workers)
+{
+	int			error;
+
+	error = -workqueue_create_bound(wq, ctx, nr_workers, 2 * nr_workers);
+	if (error)
+		fatal("cannot create worker threads: %s\n", strerror(error));
+}
+
+/* The targets share the CPUs, but each keeps at least two writes going. */
+static void
+start_writers(
+	struct restore_set	*set)
+{
+	struct restore_target	*t;
+
+	for_each_target(set, t)
+		start_workers(&t->wq, t,
+				max(2U, platform_nproc() / set->nr_targets));
+}
+
+static void
+queue_work(
+	struct workqueue	*wq,
+	workqueue_func_t	fn,
+	void			*arg)
+{
+	int			error;
+
+	error = -workqueue_add(wq, fn, 0, arg);
+	if (error)
+		fatal("cannot queue blocks for writing: %s\n",
+				strerror(error));
+}
+
+/* Sort a decoded batch and hand it to every target to write. */
+static void
+fan_out_batch(
+	struct restore_set	*set,
+	struct write_batch	*batch)
+{
+	struct restore_target	*t;
+
+	sort_batch(batch);
+	atomic_set(&batch->refs, set->nr_targets);
+	for_each_target(set, t)
+		queue_work(&t->wq, write_batch_work, batch);
+}
+
+static void
+finish_workers(
+	struct workqueue	*wq)
+{
+	int			error;
+
+	error = -workqueue_terminate(wq);
+	if (error)
+		fatal("cannot finish writing blocks: %s\n", strerror(error));
+	workqueue_destroy(wq);
+}
+
+static void
+finish_writers(
+	struct restore_set	*set)
+{
+	struct restore_target	*t;
+
+	for_each_target(set, t)
+		finish_workers(&t->wq);
+}
+
+/* Size every target for the filesystem in @sb. */
+static void
+size_targets(
+	struct restore_set	*set,
+	xfs_sb_t		*sb)
+{
+	struct restore_target	*t;
+
+	for_each_target(set, t)
+		size_target(t->fd, t->is_file, sb);
+}
+
+static void
+write_primary_sbs(
+	struct restore_set	*set,
+	xfs_sb_t		*sb)
+{
+	struct restore_target	*t;
+	char			*sb_buf;
+
+	sb_buf = malloc(sb->sb_sectsize);
+	if (!sb_buf)
+		fatal("memory allocation failure\n");
+	for_each_target(set, t)
+		write_primary_sb(t->fd, sb, sb_buf);
+	free(sb_buf);
+}
+
 /*
  * perform_restore() -- do the actual work to restore the metadump
  *
  * @src_f: A FILE pointer to the source metadump
- * @dst_fd: the file descriptor for the target file
- * @is_target_file: designates whether the target is a regular file
+ * @set: where to restore the blocks to
  * @mbp: pointer to metadump's first xfs_metablock, read and verified by the caller
  *
  * src_f should be positioned just past a read the previously validated metablock
+ *
+ * The metablocks are read into batches of V1_BATCH_METABLOCKS, which are
+ * handed to the writer threads of every target.
  */
 static void
 perform_restore(
 	FILE			*src_f,
-	int			dst_fd,
-	int			is_target_file,
+	struct restore_set	*set,
 	const struct xfs_metablock	*mbp)
 {
 	struct xfs_metablock	*metablock;	/* header + index + blocks */
+	struct write_batch	*batch;
 	__be64			*block_index;
 	char			*block_buffer;
+	size_t			mb_size;
+	size_t			used;
 	int			block_size;
 	int			max_indices;
 	int			cur_index;
 	int			mb_count;
 	xfs_sb_t		sb;
-	int64_t			bytes_read;
+
+	if (mbp->mb_blocklog != BBSHIFT)
+		fatal("bad metablock size %u\n", 1U << mbp->mb_blocklog);
 
 	block_size = 1 << mbp->mb_blocklog;
 	max_indices = (block_size - sizeof(xfs_metablock_t)) / sizeof(__be64);
+	mb_size = (max_indices + 1) * block_size;
 
-	metablock = (xfs_metablock_t *)calloc(max_indices + 1, block_size);
-	if (metablock == NULL)
+	batch = alloc_batch(malloc(V1_BATCH_METABLOCKS * mb_size));
+	if (!batch->buf)
 		fatal("memory allocation failure\n");
+	metablock = (struct xfs_metablock *)batch->buf;
+	memcpy(metablock, mbp, sizeof(*mbp));
+	used = 0;
 
 	mb_count = be16_to_cpu(mbp->mb_count);
 	if (mb_count == 0 || mb_count > max_indices)
@@ -79,106 +614,983 @@ perform_restore(
 	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
 	block_buffer = (char *)metablock + block_size;
 
-	if (fread(block_index, block_size - sizeof(struct xfs_metablock), 1, src_f) != 1)
-		fatal("error reading from metadump file\n");
+	read_src(block_index, block_size - sizeof(struct xfs_metablock), src_f);
 
 	if (block_index[0] != 0)
 		fatal("first block is not the primary superblock\n");
 
 
-	if (fread(block_buffer, mb_count << mbp->mb_blocklog, 1, src_f) != 1)
-		fatal("error reading from metadump file\n");
+	read_src(block_buffer, mb_count << mbp->mb_blocklog, src_f);
 
-	libxfs_sb_from_disk(&sb, (struct xfs_dsb *)block_buffer);
+	check_primary_sb(block_buffer, &sb, max_indices * block_size);
+	size_targets(set, &sb);
+	start_writers(set);
 
-	if (sb.sb_magicnum != XFS_SB_MAGIC)
-		fatal("bad magic number for primary superblock\n");
+	for (;;) {
+		for (cur_index = 0; cur_index < mb_count; cur_index++)
+			batch_add(be64_to_cpu(block_index[cur_index]),
+				&block_buffer[cur_index << mbp->mb_blocklog],
+				batch);
+		used += (mb_count + 1) << mbp->mb_blocklog;
+		if (mb_count < max_indices)
+			break;
 
-	/*
-	 * Normally the upper bound would be simply XFS_MAX_SECTORSIZE
-	 * but the metadump format has a maximum number of BBSIZE blocks
-	 * it can store in a single metablock.
-	 */
-	if (sb.sb_sectsize < XFS_MIN_SECTORSIZE ||
-	    sb.sb_sectsize > XFS_MAX_SECTORSIZE ||
-	    sb.sb_sectsize > max_indices * block_size)
-		fatal("bad sector size %u in metadump image\n", sb.sb_sectsize);
+		if (used + mb_size > V1_BATCH_METABLOCKS * mb_size) {
+			if (show_progress)
+				restore_progress(src_f);
+			fan_out_batch(set, batch);
+			batch = alloc_batch(malloc(V1_BATCH_METABLOCKS *
+						mb_size));
+			if (!batch->buf)
+				fatal("memory allocation failure\n");
+			used = 0;
+		}
+		metablock = (struct xfs_metablock *)(batch->buf + used);
+		block_index = (__be64 *)((char *)metablock +
+					sizeof(xfs_metablock_t));
+		block_buffer = (char *)metablock + block_size;
 
-	((struct xfs_dsb*)block_buffer)->sb_inprogress = 1;
+		read_src(metablock, block_size, src_f);
 
-	if (is_target_file)  {
-		/* ensure regular files are correctly sized */
+		mb_count = be16_to_cpu(metablock->mb_count);
+		if (mb_count == 0)
+			break;
+		if (mb_count > max_indices)
+			fatal("bad block count: %u\n", mb_count);
 
-		if (ftruncate(dst_fd, sb.sb_dblocks * sb.sb_blocksize))
-			fatal("cannot set filesystem image size: %s\n",
-				strerror(errno));
-	} else  {
-		/* ensure device is sufficiently large enough */
+		read_src(block_buffer, mb_count << mbp->mb_blocklog, src_f);
+	}
 
-		char		*lb[XFS_MAX_SECTORSIZE] = { NULL };
-		off64_t		off;
+	fan_out_batch(set, batch);
+	finish_writers(set);
 
-		off = sb.sb_dblocks * sb.sb_blocksize - sizeof(lb);
-		if (pwrite(dst_fd, lb, sizeof(lb), off) < 0)
-			fatal("failed to write last block, is target too "
-				"small? (error: %s)\n", strerror(errno));
+	if (progress_since_warning)
+		putchar('\n');
+
+	write_primary_sbs(set, &sb);
+}
+
+/* A chunk of a chunked metadump. */
+struct md_chunk {
+	char		*data;
+	uint32_t	len;
+	uint32_t	raw_len;
+};
+
+typedef void (*md_block_fn)(int64_t daddr, char *block, void *priv);
+
+static uint8_t	chunk_compress;		/* XFS_MD_COMPRESS_* of the dump */
+static uint32_t	chunk_size;		/* max uncompressed chunk payload */
+
+/*
+ * Read the next chunk header and its payload from a chunked dump.  Returns the
+ * magic number of the header, which is XFS_MD_INDEX_MAGIC after the last
+ * chunk of blocks.
+ */
+static uint32_t
+read_chunk(
+	FILE				*src_f,
+	struct md_chunk			*chunk)
+{
+	struct xfs_metadump_chunk	hdr;
+	uint32_t			magic;
+
+	read_src(&hdr, sizeof(hdr), src_f);
+
+	magic = be32_to_cpu(hdr.xmc_magic);
+	chunk->len = be32_to_cpu(hdr.xmc_len);
+	chunk->raw_len = be32_to_cpu(hdr.xmc_raw_len);
+	if (magic == XFS_MD_CHUNK_MAGIC) {
+		if (chunk->raw_len > chunk_size || chunk->len > chunk->raw_len)
+			fatal("bad chunk length %u/%u\n", chunk->len,
+					chunk->raw_len);
+	} else if ((magic != XFS_MD_INDEX_MAGIC &&
+		    magic != XFS_MD_TOMB_MAGIC) ||
+		   chunk->len != chunk->raw_len)
+		fatal("bad chunk header\n");
+
+	chunk->data = malloc(chunk->len);
+	if (chunk->len && !chunk->data)
+		fatal("memory allocation failure\n");
+	if (chunk->len)
+		read_src(chunk->data, chunk->len, src_f);
+	return magic;
+}
+
+/* Replace a chunk's payload with its uncompressed contents. */
+static void
+unpack_chunk(
+	struct md_chunk	*chunk)
+{
+	if (chunk->len == chunk->raw_len)	/* stored as is */
+		return;
+
+#ifdef HAVE_LIBZSTD
+	if (chunk_compress == XFS_MD_COMPRESS_ZSTD) {
+		uint64_t start = now_ns();
+		char	*raw;
+		size_t	res;
+
+		raw = malloc(chunk->raw_len);
+		if (!raw)
+			fatal("memory allocation failure\n");
+		res = ZSTD_decompress(raw, chunk->raw_len, chunk->data,
+				chunk->len);
+		atomic64_add(now_ns() - start, &unpack_ns);
+		if (ZSTD_isError(res))
+			fatal("error decompressing chunk: %s\n",
+					ZSTD_getErrorName(res));
+		if (res != chunk->raw_len)
+			fatal("chunk decompressed to %zu bytes, expected %u\n",
+					res, chunk->raw_len);
+		free(chunk->data);
+		chunk->data = raw;
+		chunk->len = chunk->raw_len;
+		return;
+	}
+#endif
+	fatal("unsupported metadump compression type %u\n", chunk_compress);
+}
+
+/* Call @fn for each block of the metablocks in an unpacked chunk. */
+static void
+walk_chunk(
+	struct md_chunk		*chunk,
+	md_block_fn		fn,
+	void			*priv)
+{
+	struct xfs_metablock	*mb;
+	__be64			*block_index;
+	char			*p = chunk->data;
+	char			*end = chunk->data + chunk->len;
+	int			max_indices;
+	int			count;
+	int			i;
+
+	max_indices = (BBSIZE - sizeof(xfs_metablock_t)) / sizeof(__be64);
+	while (p < end) {
+		mb = (struct xfs_metablock *)p;
+		if (end - p < BBSIZE || mb->mb_blocklog != BBSHIFT)
+			fatal("bad metablock in chunk\n");
+		count = be16_to_cpu(mb->mb_count);
+		if (count == 0 || count > max_indices ||
+		    end - p < (count + 1) << BBSHIFT)
+			fatal("bad block count: %u\n", count);
+
+		block_index = (__be64 *)(p + sizeof(xfs_metablock_t));
+		for (i = 0; i < count; i++)
+			fn(be64_to_cpu(block_index[i]),
+					p + ((i + 1) << BBSHIFT), priv);
+		p += (count + 1) << BBSHIFT;
 	}
+}
+
+/* Unpack a chunk into a sorted batch of blocks. */
+static struct write_batch *
+decode_chunk(
+	struct md_chunk		*chunk)
+{
+	struct write_batch	*batch;
+
+	unpack_chunk(chunk);
+	batch = alloc_batch(chunk->data);
+	walk_chunk(chunk, batch_add, batch);
+	sort_batch(batch);
+	return batch;
+}
+
+/* Write out the blocks of a chunk to every target before returning. */
+static void
+restore_chunk(
+	struct restore_set	*set,
+	struct md_chunk		*chunk)
+{
+	struct restore_target	*t;
+	struct write_batch	*batch;
+
+	batch = decode_chunk(chunk);
+	for_each_target(set, t)
+		write_batch(t, batch);
+	free_batch(batch);
+}
+
+/* Decode a chunk and pass its blocks on to the targets' writers. */
+static void
+restore_chunk_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct md_chunk		*chunk = arg;
+
+	fan_out_batch(wq->wq_ctx, decode_chunk(chunk));
+	free(chunk);
+}
+
+/* Zero the sectors that a delta dump says are no longer metadata. */
+static void
+clear_tombstones(
+	struct restore_target	*target,
+	struct md_chunk		*chunk)
+{
+	static char		zero_block[BBSIZE];
+	struct iovec		iov[IOV_MAX];
+	__be64			*tombs = (__be64 *)chunk->data;
+	uint32_t		nr_tombs = chunk->len / sizeof(__be64);
+	int64_t			start = 0;
+	int			nr = 0;
+	uint32_t		i;
+
+	for (i = 0; i < IOV_MAX; i++) {
+		iov[i].iov_base = zero_block;
+		iov[i].iov_len = BBSIZE;
+	}
+
+	for (i = 0; i < nr_tombs; i++) {
+		int64_t		daddr = be64_to_cpu(tombs[i]);
+
+		if (nr > 0 && (daddr != start + nr || nr == IOV_MAX)) {
+			write_run(target, start, iov, nr, true);
+			nr = 0;
+		}
+		if (nr == 0)
+			start = daddr;
+		nr++;
+	}
+	if (nr > 0)
+		write_run(target, start, iov, nr, true);
+}
+
+/*
+ * perform_restore_chunked() -- restore a chunked metadump
+ *
+ * The chunks are read in order, but decompressed by a pool of worker
+ * threads, which hand the blocks to the writers of each target.  Metadump
+ * only copies a block once unless the metadata is cross-linked, so the
+ * order the chunks land in doesn't matter.  The first chunk is restored up
+ * front, as it holds the primary superblock that says how big the targets
+ * must be.
+ *
+ * A delta dump is restored over its base, and its tombstones are cleared
+ * once all of its blocks have been written.
+ *
+ * src_f should be positioned just past the header.
+ */
+static void
+perform_restore_chunked(
+	FILE				*src_f,
+	struct restore_set		*set,
+	const struct xfs_metadump_chunked_header *hdr)
+{
+	struct md_chunk			first;
+	struct md_chunk			*chunk;
+	struct md_chunk			tombs = { };
+	struct restore_target		*t;
+	struct workqueue		wq;
+	uint32_t			magic;
+	xfs_sb_t			sb;
+	int				max_indices;
+
+	chunk_compress = hdr->xmh_compress;
+	chunk_size = be32_to_cpu(hdr->xmh_chunk_size);
+	max_indices = (BBSIZE - sizeof(xfs_metablock_t)) / sizeof(__be64);
 
-	bytes_read = 0;
+	if (read_chunk(src_f, &first) != XFS_MD_CHUNK_MAGIC)
+		fatal("metadump contains no blocks\n");
+	unpack_chunk(&first);
+	if (first.len < 2 * BBSIZE ||
+	    *(__be64 *)(first.data + sizeof(xfs_metablock_t)) != 0)
+		fatal("first block is not the primary superblock\n");
+
+	check_primary_sb(first.data + BBSIZE, &sb, max_indices * BBSIZE);
+	size_targets(set, &sb);
+	restore_chunk(set, &first);
+	start_writers(set);
+	start_workers(&wq, set, platform_nproc());
 
 	for (;;) {
-		if (show_progress && (bytes_read & ((1 << 20) - 1)) == 0)
-			print_progress("%lld MB read", bytes_read >> 20);
-
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite(dst_fd, &block_buffer[cur_index <<
-					mbp->mb_blocklog], block_size,
-					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
+		if (show_progress)
+			restore_progress(src_f);
+
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			fatal("memory allocation failure\n");
+		magic = read_chunk(src_f, chunk);
+		if (magic == XFS_MD_TOMB_MAGIC && !tombs.data) {
+			tombs = *chunk;
+			free(chunk);
+			continue;
 		}
-		if (mb_count < max_indices)
+		if (magic != XFS_MD_CHUNK_MAGIC) {
+			free(chunk->data);
+			free(chunk);
+			if (magic != XFS_MD_INDEX_MAGIC)
+				fatal("bad chunk header\n");
 			break;
+		}
+		queue_work(&wq, restore_chunk_work, chunk);
+	}
+	finish_workers(&wq);
+	finish_writers(set);
 
-		if (fread(metablock, block_size, 1, src_f) != 1)
-			fatal("error reading from metadump file\n");
+	if (tombs.data) {
+		if (!(hdr->xmh_info & XFS_METADUMP_DELTA))
+			fatal("tombstones in a metadump that isn't a delta\n");
+		for_each_target(set, t)
+			clear_tombstones(t, &tombs);
+		free(tombs.data);
+	}
 
-		mb_count = be16_to_cpu(metablock->mb_count);
-		if (mb_count == 0)
+	if (progress_since_warning)
+		putchar('\n');
+
+	write_primary_sbs(set, &sb);
+}
+
+/* A chunk of a chunked dump, decompressed and with its blocks sorted. */
+struct md_cached_chunk {
+	uint64_t		offset;		/* in the dump, 0 if unused */
+	struct write_batch	*blocks;
+	unsigned long		last_used;
+};
+
+#define MD_CACHE_CHUNKS		64
+
+struct md_index_ent {
+	uint64_t		offset;		/* of the chunk header */
+	int64_t			low;
+	int64_t			high;
+	int64_t			max_high;	/* highest high up to here */
+};
+
+/*
+ * A chunked metadump opened for reading blocks on demand.  The chunk index is
+ * sorted by the lowest disk address of each chunk, so the chunks that can
+ * hold a block are found with a binary search and a short walk back.
+ */
+struct md_image {
+	FILE			*src_f;
+	struct md_index_ent	*index;
+	uint64_t		nr_chunks;
+	uint64_t		size;		/* bytes, from the primary sb */
+	struct md_cached_chunk	cache[MD_CACHE_CHUNKS];
+	unsigned long		clock;
+};
+
+static int
+md_index_ent_cmp(
+	const void			*a,
+	const void			*b)
+{
+	const struct md_index_ent	*ea = a;
+	const struct md_index_ent	*eb = b;
+
+	if (ea->low != eb->low)
+		return ea->low < eb->low ? -1 : 1;
+	return 0;
+}
+
+/* Read and sort the chunk index.  The source must be seekable. */
+static void
+open_image(
+	struct md_image			*img,
+	FILE				*src_f,
+	const struct xfs_metadump_chunked_header *hdr)
+{
+	struct xfs_metadump_footer	footer;
+	struct xfs_metadump_index_ent	*ent;
+	struct md_chunk			index;
+	int64_t				max_high = -1;
+	uint64_t			i;
+
+	memset(img, 0, sizeof(*img));
+	img->src_f = src_f;
+	chunk_compress = hdr->xmh_compress;
+	chunk_size = be32_to_cpu(hdr->xmh_chunk_size);
+
+	if (fseeko(src_f, -(off_t)sizeof(footer), SEEK_END) < 0 ||
+	    fread(&footer, sizeof(footer), 1, src_f) != 1)
+		fatal("cannot read metadump footer\n");
+	if (be32_to_cpu(footer.xmf_magic) != XFS_MD_MAGIC_CHUNKED)
+		fatal("metadump is incomplete, no chunk index found\n");
+
+	img->nr_chunks = be64_to_cpu(footer.xmf_nr_chunks);
+	if (fseeko(src_f, be64_to_cpu(footer.xmf_index_offset), SEEK_SET) < 0 ||
+	    read_chunk(src_f, &index) != XFS_MD_INDEX_MAGIC ||
+	    index.len != img->nr_chunks * sizeof(*ent))
+		fatal("bad metadump chunk index\n");
+
+	img->index = calloc(img->nr_chunks, sizeof(struct md_index_ent));
+	if (img->nr_chunks && !img->index)
+		fatal("memory allocation failure\n");
+
+	ent = (struct xfs_metadump_index_ent *)index.data;
+	for (i = 0; i < img->nr_chunks; i++, ent++) {
+		img->index[i].offset = be64_to_cpu(ent->xmi_offset);
+		img->index[i].low = be64_to_cpu(ent->xmi_low);
+		img->index[i].high = be64_to_cpu(ent->xmi_high);
+	}
+	free(index.data);
+
+	qsort(img->index, img->nr_chunks, sizeof(struct md_index_ent),
+			md_index_ent_cmp);
+	for (i = 0; i < img->nr_chunks; i++) {
+		max_high = max(max_high, img->index[i].high);
+		img->index[i].max_high = max_high;
+	}
+}
+
+static void
+close_image(
+	struct md_image		*img)
+{
+	int			i;
+
+	for (i = 0; i < MD_CACHE_CHUNKS; i++)
+		if (img->cache[i].blocks)
+			free_batch(img->cache[i].blocks);
+	free(img->index);
+}
+
+/* Return the sorted blocks of a chunk, reading it in if it isn't cached. */
+static struct write_batch *
+get_chunk(
+	struct md_image		*img,
+	uint64_t		offset)
+{
+	struct md_cached_chunk	*cc = NULL;
+	struct md_chunk		chunk;
+	int			i;
+
+	for (i = 0; i < MD_CACHE_CHUNKS; i++) {
+		if (img->cache[i].offset == offset) {
+			cc = &img->cache[i];
+			goto out;
+		}
+		if (!cc || img->cache[i].last_used < cc->last_used)
+			cc = &img->cache[i];
+	}
+
+	if (cc->blocks)
+		free_batch(cc->blocks);
+	if (fseeko(img->src_f, offset, SEEK_SET) < 0 ||
+	    read_chunk(img->src_f, &chunk) != XFS_MD_CHUNK_MAGIC)
+		fatal("bad metadump chunk at offset %llu\n",
+				(unsigned long long)offset);
+	cc->blocks = decode_chunk(&chunk);
+	cc->offset = offset;
+out:
+	cc->last_used = ++img->clock;
+	return cc->blocks;
+}
+
+/* Copy the parts of the blocks of @blocks that fall in [@off, @off + @len). */
+static void
+copy_blocks(
+	struct write_batch	*blocks,
+	char			*buf,
+	uint64_t		off,
+	size_t			len)
+{
+	struct batch_ent	*ent = blocks->ents;
+	struct batch_ent	*end = blocks->ents + blocks->nr_ents;
+	int64_t			first = off >> BBSHIFT;
+	size_t			lo = 0;
+	size_t			hi = blocks->nr_ents;
+
+	/* find the first block at or after @first */
+	while (lo < hi) {
+		size_t		mid = (lo + hi) / 2;
+
+		if (ent[mid].daddr < first)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (ent += lo; ent < end; ent++) {
+		uint64_t	bstart = (uint64_t)ent->daddr << BBSHIFT;
+		uint64_t	from = max(bstart, off);
+		uint64_t	to = min(bstart + BBSIZE, off + len);
+
+		if (bstart >= off + len)
 			break;
-		if (mb_count > max_indices)
-			fatal("bad block count: %u\n", mb_count);
+		memcpy(buf + (from - off), ent->block + (from - bstart),
+				to - from);
+	}
+}
 
-		if (fread(block_buffer, mb_count << mbp->mb_blocklog,
-								1, src_f) != 1)
-			fatal("error reading from metadump file\n");
+/*
+ * Read @len bytes at @off of the filesystem a chunked metadump was taken of.
+ * Anything the dump doesn't have reads back as zeroes.
+ */
+static void
+read_image(
+	struct md_image		*img,
+	char			*buf,
+	uint64_t		off,
+	size_t			len)
+{
+	int64_t			first = off >> BBSHIFT;
+	int64_t			last = (off + len - 1) >> BBSHIFT;
+	uint64_t		lo = 0;
+	uint64_t		hi = img->nr_chunks;
 
-		bytes_read += block_size + (mb_count << mbp->mb_blocklog);
+	memset(buf, 0, len);
+	if (len == 0)
+		return;
+
+	/* find the first chunk that starts past @last... */
+	while (lo < hi) {
+		uint64_t	mid = (lo + hi) / 2;
+
+		if (img->index[mid].low <= last)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	if (progress_since_warning)
-		putchar('\n');
+	/* ...and walk back over the chunks that can reach @first */
+	while (lo > 0 && img->index[lo - 1].max_high >= first) {
+		struct md_index_ent	*ent = &img->index[--lo];
 
-	memset(block_buffer, 0, sb.sb_sectsize);
-	sb.sb_inprogress = 0;
-	libxfs_sb_to_disk((struct xfs_dsb *)block_buffer, &sb);
-	if (xfs_sb_version_hascrc(&sb)) {
-		xfs_update_cksum(block_buffer, sb.sb_sectsize,
-				 offsetof(struct xfs_sb, sb_crc));
+		if (ent->high >= first)
+			copy_blocks(get_chunk(img, ent->offset), buf, off,
+					len);
 	}
+}
 
-	if (pwrite(dst_fd, block_buffer, sb.sb_sectsize, 0) < 0)
-		fatal("error writing primary superblock: %s\n", strerror(errno));
+/* Find out how big the filesystem is from its primary superblock. */
+static void
+size_image(
+	struct md_image		*img)
+{
+	struct xfs_sb		sb;
+	char			block[BBSIZE];
 
-	free(metablock);
+	read_image(img, block, 0, BBSIZE);
+	libxfs_sb_from_disk(&sb, (struct xfs_dsb *)block);
+	if (sb.sb_magicnum != XFS_SB_MAGIC)
+		fatal("bad magic number for primary superblock\n");
+	img->size = sb.sb_dblocks * sb.sb_blocksize;
+}
+
+/*
+ * extract_blocks() -- write @count sectors from @daddr of a chunked metadump
+ * to stdout, using the chunk index to decompress only the chunks that
+ * might hold them.  Sectors the dump doesn't have read back as zeroes.
+ *
+ * The source must be seekable.
+ */
+static void
+extract_blocks(
+	FILE				*src_f,
+	const struct xfs_metadump_chunked_header *hdr,
+	int64_t				daddr,
+	int64_t				count)
+{
+	struct md_image			img;
+	char				*buf;
+
+	open_image(&img, src_f, hdr);
+
+	buf = malloc(count << BBSHIFT);
+	if (!buf)
+		fatal("memory allocation failure\n");
+	read_image(&img, buf, daddr << BBSHIFT, count << BBSHIFT);
+	if (fwrite(buf, BBSIZE, count, stdout) != count)
+		fatal("error writing to stdout: %s\n", strerror(errno));
+
+	free(buf);
+	close_image(&img);
+}
+
+/*
+ * Serving a chunked metadump as a read-only NBD export, so that a filesystem
+ * can be looked at without restoring the dump first.  Only the parts of
+ * the NBD protocol that a Linux client needs are spoken: fixed newstyle
+ * negotiation, and read requests in simple replies.
+ */
+#define NBD_MAGIC		0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_IHAVEOPT		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC	0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)	/* handshake flags */
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)	/* transmission flags */
+#define NBD_FLAG_READ_ONLY	(1 << 1)
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	(0x80000000U | 1)
+#define NBD_INFO_EXPORT		0
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+
+#define NBD_MAX_READ		(32U << 20)
+
+struct nbd_option {
+	__be64		magic;		/* NBD_IHAVEOPT */
+	__be32		option;
+	__be32		len;
+} __attribute__((packed));
+
+struct nbd_option_reply {
+	__be64		magic;		/* NBD_REP_MAGIC */
+	__be32		option;
+	__be32		type;
+	__be32		len;
+} __attribute__((packed));
+
+struct nbd_info_export {
+	__be16		type;		/* NBD_INFO_EXPORT */
+	__be64		size;
+	__be16		flags;
+} __attribute__((packed));
+
+struct nbd_request {
+	__be32		magic;		/* NBD_REQUEST_MAGIC */
+	__be16		flags;
+	__be16		type;
+	__be64		handle;
+	__be64		offset;
+	__be32		len;
+} __attribute__((packed));
+
+struct nbd_reply {
+	__be32		magic;		/* NBD_SIMPLE_REPLY_MAGIC */
+	__be32		error;
+	__be64		handle;
+} __attribute__((packed));
+
+static const char	*serve_path;
+
+/* Return 0 for success, -1 if the client went away. */
+static int
+recv_full(
+	int		fd,
+	void		*buf,
+	size_t		len)
+{
+	ssize_t		ret;
+
+	while (len > 0) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Return 0 for success, -1 if the client went away. */
+static int
+send_full(
+	int		fd,
+	const void	*buf,
+	size_t		len)
+{
+	ssize_t		ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Read and throw away @len bytes that the client sent. */
+static int
+recv_discard(
+	int		fd,
+	uint64_t	len)
+{
+	char		buf[4096];
+
+	while (len > 0) {
+		size_t	n = min(len, sizeof(buf));
+
+		if (recv_full(fd, buf, n))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+send_option_reply(
+	int			fd,
+	uint32_t		option,
+	uint32_t		type,
+	const void		*data,
+	uint32_t		len)
+{
+	struct nbd_option_reply	rep = {
+		.magic		= cpu_to_be64(NBD_REP_MAGIC),
+		.option		= cpu_to_be32(option),
+		.type		= cpu_to_be32(type),
+		.len		= cpu_to_be32(len),
+	};
+
+	if (send_full(fd, &rep, sizeof(rep)))
+		return -1;
+	return len ? send_full(fd, data, len) : 0;
+}
+
+/*
+ * Negotiate an export with a client.  Every export name gets the same
+ * image.  Return 0 to go on to transmission, -1 to drop the client.
+ */
+static int
+nbd_negotiate(
+	struct md_image		*img,
+	int			fd)
+{
+	struct {
+		__be64		magic;
+		__be64		ihaveopt;
+		__be16		flags;
+	} __attribute__((packed)) hello = {
+		.magic		= cpu_to_be64(NBD_MAGIC),
+		.ihaveopt	= cpu_to_be64(NBD_IHAVEOPT),
+		.flags		= cpu_to_be16(NBD_FLAG_FIXED_NEWSTYLE |
+					      NBD_FLAG_NO_ZEROES),
+	};
+	struct nbd_info_export	info = {
+		.type		= cpu_to_be16(NBD_INFO_EXPORT),
+		.size		= cpu_to_be64(img->size),
+		.flags		= cpu_to_be16(NBD_FLAG_HAS_FLAGS |
+					      NBD_FLAG_READ_ONLY),
+	};
+	struct nbd_option	opt;
+	char			zeroes[124] = { 0 };
+	__be32			client_flags;
+	uint32_t		option;
+
+	if (send_full(fd, &hello, sizeof(hello)) ||
+	    recv_full(fd, &client_flags, sizeof(client_flags)))
+		return -1;
+
+	for (;;) {
+		if (recv_full(fd, &opt, sizeof(opt)) ||
+		    be64_to_cpu(opt.magic) != NBD_IHAVEOPT ||
+		    recv_discard(fd, be32_to_cpu(opt.len)))
+			return -1;
+
+		option = be32_to_cpu(opt.option);
+		switch (option) {
+		case NBD_OPT_EXPORT_NAME:
+			/* the old way: size and flags, no reply header */
+			if (send_full(fd, &info.size, sizeof(info.size) +
+						sizeof(info.flags)))
+				return -1;
+			if (!(be32_to_cpu(client_flags) & NBD_FLAG_NO_ZEROES) &&
+			    send_full(fd, zeroes, sizeof(zeroes)))
+				return -1;
+			return 0;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			if (send_option_reply(fd, option, NBD_REP_INFO, &info,
+						sizeof(info)) ||
+			    send_option_reply(fd, option, NBD_REP_ACK, NULL, 0))
+				return -1;
+			if (option == NBD_OPT_GO)
+				return 0;
+			break;
+		case NBD_OPT_ABORT:
+			send_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+			return -1;
+		default:
+			if (send_option_reply(fd, option, NBD_REP_ERR_UNSUP,
+						NULL, 0))
+				return -1;
+			break;
+		}
+	}
+}
+
+/* Answer requests from a client until it disconnects. */
+static void
+nbd_transmit(
+	struct md_image		*img,
+	int			fd)
+{
+	struct nbd_request	req;
+	struct nbd_reply	rep;
+	char			*buf;
+	uint64_t		off;
+	uint32_t		len;
+
+	buf = malloc(NBD_MAX_READ);
+	if (!buf)
+		fatal("memory allocation failure\n");
+
+	while (recv_full(fd, &req, sizeof(req)) == 0 &&
+	       be32_to_cpu(req.magic) == NBD_REQUEST_MAGIC) {
+		off = be64_to_cpu(req.offset);
+		len = be32_to_cpu(req.len);
+
+		rep.magic = cpu_to_be32(NBD_SIMPLE_REPLY_MAGIC);
+		rep.error = 0;
+		rep.handle = req.handle;
+
+		switch (be16_to_cpu(req.type)) {
+		case NBD_CMD_DISC:
+			goto out;
+		case NBD_CMD_READ:
+			if (len > NBD_MAX_READ || off > img->size ||
+			    len > img->size - off) {
+				rep.error = cpu_to_be32(EINVAL);
+				break;
+			}
+			read_image(img, buf, off, len);
+			if (send_full(fd, &rep, sizeof(rep)) ||
+			    send_full(fd, buf, len))
+				goto out;
+			continue;
+		case NBD_CMD_FLUSH:
+			break;
+		case NBD_CMD_WRITE:
+			if (recv_discard(fd, len))
+				goto out;
+			/* fall through */
+		default:
+			rep.error = cpu_to_be32(EPERM);
+			break;
+		}
+		if (send_full(fd, &rep, sizeof(rep)))
+			goto out;
+	}
+out:
+	free(buf);
+}
+
+static void
+stop_serving(
+	int		sig)
+{
+	unlink(serve_path);
+	_exit(0);
+}
+
+/*
+ * serve_image() -- serve a chunked metadump as a read-only NBD export on the
+ * unix socket @path, one client at a time, until killed.  Blocks are
+ * read from the dump as they are asked for.
+ */
+static void
+serve_image(
+	FILE				*src_f,
+	const struct xfs_metadump_chunked_header *hdr,
+	const char			*path)
+{
+	struct sockaddr_un		addr = { .sun_family = AF_UNIX };
+	struct md_image			img;
+	int				lfd;
+	int				fd;
+
+	open_image(&img, src_f, hdr);
+	size_image(&img);
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fatal("socket path \"%s\" is too long\n", path);
+	strcpy(addr.sun_path, path);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0)
+		fatal("cannot create socket: %s\n", strerror(errno));
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fatal("cannot bind to \"%s\": %s\n", path, strerror(errno));
+	serve_path = path;
+	signal(SIGINT, stop_serving);
+	signal(SIGTERM, stop_serving);
+	signal(SIGPIPE, SIG_IGN);
+	if (listen(lfd, 1) < 0)
+		fatal("cannot listen on \"%s\": %s\n", path, strerror(errno));
+
+	printf("%s: serving %llu bytes on %s\n", progname,
+			(unsigned long long)img.size, path);
+	fflush(stdout);
+
+	for (;;) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fatal("cannot accept connection: %s\n",
+					strerror(errno));
+		}
+		if (nbd_negotiate(&img, fd) == 0)
+			nbd_transmit(&img, fd);
+		close(fd);
+	}
+}
+
+static void
+check_compress(
+	const struct xfs_metadump_chunked_header *hdr)
+{
+	if (hdr->xmh_compress != XFS_MD_COMPRESS_NONE
+#ifdef HAVE_LIBZSTD
+	    && hdr->xmh_compress != XFS_MD_COMPRESS_ZSTD
+#endif
+	   )
+		fatal("unsupported metadump compression type %u\n",
+			hdr->xmh_compress);
+}
+
+/* Restore the full dump that a delta dump was taken against. */
+static void
+restore_base(
+	const char			*path,
+	struct restore_set		*set)
+{
+	struct xfs_metadump_chunked_header	hdr;
+	struct restore_target		*t;
+	FILE				*base_f;
+
+	base_f = fopen(path, "rb");
+	if (!base_f)
+		fatal("cannot open base dump file\n");
+	if (fread(&hdr, sizeof(hdr), 1, base_f) != 1)
+		fatal("error reading from base dump file\n");
+	if (hdr.xmh_magic != cpu_to_be32(XFS_MD_MAGIC_CHUNKED))
+		fatal("base dump is not a chunked metadump\n");
+	if (hdr.xmh_info & XFS_METADUMP_DELTA)
+		fatal("base dump is itself a delta\n");
+	check_compress(&hdr);
+
+	perform_restore_chunked(base_f, set, &hdr);
+	fclose(base_f);
+	for_each_target(set, t)
+		t->overlay = true;
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-V] [-g] [-i] source target\n", progname);
+	fprintf(stderr,
+"Usage: %s [-V] [-g] [-i] [-b base] [-S statsfile] source target [target ...]\n"
+"       %s -r daddr[,count] source\n"
+"       %s -s socket source\n", progname, progname, progname);
 	exit(1);
 }
 
@@ -190,23 +1602,48 @@ main(
 	char 		**argv)
 {
 	FILE		*src_f;
-	int		dst_fd;
+	struct restore_set set = { };
+	struct restore_target *target;
 	int		c;
 	int		open_flags;
 	struct stat	statbuf;
-	int		is_target_file;
 	struct xfs_metablock	mb;
+	struct xfs_metadump_chunked_header hdr;
+	bool		is_chunked;
+	uint8_t		info;
+	int64_t		extract_daddr = -1;
+	int64_t		extract_count = 1;
+	char		*serve_socket = NULL;
+	char		*base_path = NULL;
+	char		*p;
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "giV")) != EOF) {
+	while ((c = getopt(argc, argv, "b:gir:s:S:V")) != EOF) {
 		switch (c) {
+			case 'b':
+				base_path = optarg;
+				break;
 			case 'g':
 				show_progress = 1;
 				break;
 			case 'i':
 				show_info = 1;
 				break;
+			case 'r':
+				extract_daddr = strtoll(optarg, &p, 0);
+				if (*p == ',')
+					extract_count = strtoll(p + 1, &p, 0);
+				if (*p != '\0' || extract_daddr < 0 ||
+				    extract_count <= 0)
+					fatal("bad sector range %s\n", optarg);
+				break;
+			case 's':
+				serve_socket = optarg;
+				break;
+			case 'S':
+				stats_path = optarg;
+				break;
 			case 'V':
 				printf("%s version %s\n", progname, VERSION);
 				exit(0);
@@ -215,11 +1652,19 @@ main(
 		}
 	}
 
-	if (argc - optind < 1 || argc - optind > 2)
+	if (argc - optind < 1)
 		usage();
 
-	/* show_info without a target is ok */
-	if (!show_info && argc - optind != 2)
+	/*
+	 * show_info without a target is ok, extracting sectors and serving
+	 * the image need none
+	 */
+	if ((extract_daddr >= 0 || serve_socket) &&
+	    (show_info || argc - optind != 1 ||
+	     (extract_daddr >= 0 && serve_socket)))
+		usage();
+	if (!show_info && extract_daddr < 0 && !serve_socket &&
+	    argc - optind < 2)
 		usage();
 
 	/*
@@ -240,16 +1685,51 @@ main(
 
 	if (fread(&mb, sizeof(mb), 1, src_f) != 1)
 		fatal("error reading from metadump file\n");
-	if (mb.mb_magic != cpu_to_be32(XFS_MD_MAGIC))
+	is_chunked = mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC_CHUNKED);
+	if (is_chunked) {
+		/* the rest of the chunked header */
+		memcpy(&hdr, &mb, sizeof(mb));
+		if (fread((char *)&hdr + sizeof(mb), sizeof(hdr) - sizeof(mb),
+				1, src_f) != 1)
+			fatal("error reading from metadump file\n");
+		info = hdr.xmh_info;
+		check_compress(&hdr);
+	} else if (mb.mb_magic == cpu_to_be32(XFS_MD_MAGIC))
+		info = mb.mb_info;
+	else
 		fatal("specified file is not a metadata dump\n");
 
+	if (extract_daddr >= 0) {
+		if (!is_chunked)
+			fatal("only chunked metadumps can be read without "
+				"a restore\n");
+		if (src_f == stdin)
+			fatal("cannot seek in a metadump read from stdin\n");
+		extract_blocks(src_f, &hdr, extract_daddr, extract_count);
+		fclose(src_f);
+		return 0;
+	}
+
+	if (serve_socket) {
+		if (!is_chunked)
+			fatal("only chunked metadumps can be served\n");
+		if (src_f == stdin)
+			fatal("cannot seek in a metadump read from stdin\n");
+		serve_image(src_f, &hdr, serve_socket);
+	}
+
 	if (show_info) {
-		if (mb.mb_info & XFS_METADUMP_INFO_FLAGS) {
-			printf("%s: %sobfuscated, %s log, %s metadata blocks\n",
+		if (info & XFS_METADUMP_INFO_FLAGS) {
+			printf("%s: %sobfuscated, %s log, %s metadata blocks%s%s\n",
 			argv[optind],
-			mb.mb_info & XFS_METADUMP_OBFUSCATED ? "":"not ",
-			mb.mb_info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
-			mb.mb_info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed");
+			info & XFS_METADUMP_OBFUSCATED ? "":"not ",
+			info & XFS_METADUMP_DIRTYLOG ? "dirty":"clean",
+			info & XFS_METADUMP_FULLBLOCKS ? "full":"zeroed",
+			!is_chunked ? "" :
+			hdr.xmh_compress == XFS_MD_COMPRESS_ZSTD ?
+				", chunked, zstd compressed" :
+				", chunked, uncompressed",
+			info & XFS_METADUMP_DELTA ? ", delta" : "");
 		} else {
 			printf("%s: no informational flags present\n",
 				argv[optind]);
@@ -259,35 +1739,59 @@ main(
 			exit(0);
 	}
 
+	if (!!base_path != (is_chunked && (info & XFS_METADUMP_DELTA)))
+		fatal(base_path ? "-b is only for restoring delta metadumps\n" :
+				"a delta metadump needs its base dump (-b)\n");
+
 	optind++;
 
-	/* check and open target */
-	open_flags = O_RDWR;
-	is_target_file = 0;
-	if (stat(argv[optind], &statbuf) < 0)  {
-		/* ok, assume it's a file and create it */
-		open_flags |= O_CREAT;
-		is_target_file = 1;
-	} else if (S_ISREG(statbuf.st_mode))  {
-		open_flags |= O_TRUNC;
-		is_target_file = 1;
-	} else  {
-		/*
-		 * check to make sure a filesystem isn't mounted on the device
-		 */
-		if (platform_check_ismounted(argv[optind], NULL, &statbuf, 0))
-			fatal("a filesystem is mounted on target device \"%s\","
-				" cannot restore to a mounted filesystem.\n",
-				argv[optind]);
-	}
+	set.nr_targets = argc - optind;
+	set.targets = calloc(set.nr_targets, sizeof(struct restore_target));
+	if (!set.targets)
+		fatal("memory allocation failure\n");
 
-	dst_fd = open(argv[optind], open_flags, 0644);
-	if (dst_fd < 0)
-		fatal("couldn't open target \"%s\"\n", argv[optind]);
+	/* check and open targets */
+	for_each_target(&set, target) {
+		open_flags = O_RDWR;
+		if (stat(argv[optind], &statbuf) < 0)  {
+			/* ok, assume it's a file and create it */
+			open_flags |= O_CREAT;
+			target->is_file = true;
+		} else if (S_ISREG(statbuf.st_mode))  {
+			open_flags |= O_TRUNC;
+			target->is_file = true;
+		} else  {
+			/*
+			 * check to make sure a filesystem isn't mounted on
+			 * the device
+			 */
+			if (platform_check_ismounted(argv[optind], NULL,
+						&statbuf, 0))
+				fatal("a filesystem is mounted on target "
+					"device \"%s\", cannot restore to a "
+					"mounted filesystem.\n", argv[optind]);
+			target->zero_range = true;
+		}
+
+		target->fd = open(argv[optind], open_flags, 0644);
+		if (target->fd < 0)
+			fatal("couldn't open target \"%s\"\n", argv[optind]);
+		optind++;
+	}
 
-	perform_restore(src_f, dst_fd, is_target_file, &mb);
+	start_ns = now_ns();
+	if (base_path)
+		restore_base(base_path, &set);
+	if (is_chunked)
+		perform_restore_chunked(src_f, &set, &hdr);
+	else
+		perform_restore(src_f, &set, &mb);
+	if (show_progress || stats_path)
+		report_stats();
 
-	close(dst_fd);
+	for_each_target(&set, target)
+		close(target->fd);
+	free(set.targets);
 	if (src_f != stdin)
 		fclose(src_f);
 
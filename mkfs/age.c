@@ -0,0 +1,949 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+
+#include "libxfs.h"
+#include <ini.h>
+#include "libfrog/convert.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
+#include "proto.h"
+#include "age.h"
+
+/*
+ * Filesystem Aging
+ *
+ * Benchmarks of repair, scrub, fsr and the allocator want filesystems that
+ * look like they have been in use for years, and aging one through the
+ * kernel takes about that long.  Instead, mkfs can synthesize one as it
+ * goes: a profile describes the files (how many, how big, how many xattrs,
+ * how many are clones of others), the directory tree they live in and how
+ * fragmented things should be, and all of it is created with the same
+ * allocator the kernel uses, in the bulk transactions that proto.c uses
+ * for protofiles.
+ *
+ * Fragmentation comes from two places.  Some files are allocated a chunk
+ * at a time, round robin with several others, as though they were all
+ * being appended to at once, so their extents are interleaved.  And some
+ * space is allocated the same way for files that are later deleted, which
+ * here are just extents taken from the allocator and given back at the
+ * end, leaving the free space full of holes.
+ *
+ * Everything is chosen by a seeded pseudorandom generator, so the same
+ * profile on the same geometry always makes the same filesystem.
+ */
+
+#define AGE_MAX_BUCKETS		16
+#define AGE_NMAPS		16
+#define AGE_CLONE_SOURCES	64
+#define AGE_WRITE_SIZE		(4 << 20)
+#define AGE_MAX_STREAMS		1024
+
+struct age_profile {
+	const char		*fname;
+	uint64_t		seed;
+
+	/* [files] */
+	uint64_t		nr_files;
+	unsigned int		nr_buckets;
+	uint64_t		bucket_size[AGE_MAX_BUCKETS];
+	unsigned int		bucket_weight[AGE_MAX_BUCKETS];
+	unsigned int		total_weight;
+	bool			write_data;
+
+	/* [dirs] */
+	uint64_t		nr_dirs;
+	unsigned int		depth;
+	unsigned int		skew;
+
+	/* [fragmentation] */
+	unsigned int		interleave_pct;
+	unsigned int		streams;
+	uint64_t		chunk;
+	unsigned int		churn_pct;
+
+	/* [reflink] */
+	unsigned int		clone_pct;
+
+	/* [xattr] */
+	unsigned int		xattrs;
+	unsigned int		xattr_size;
+};
+
+/* A file being allocated, or space that will be freed again. */
+struct age_file {
+	struct xfs_inode	*ip;		/* NULL for space to be freed */
+	xfs_filblks_t		done;		/* blocks allocated so far */
+	xfs_filblks_t		len;		/* blocks wanted */
+	xfs_fsblock_t		target;		/* where freed space goes next */
+	unsigned int		nr_maps;
+	struct xfs_bmbt_irec	*maps;
+};
+
+struct age_xattrs {
+	xfs_ino_t		ino;
+	unsigned int		nr;
+};
+
+struct age {
+	struct xfs_mount	*mp;
+	struct fsxattr		*fsxp;
+	struct age_profile	*prof;
+	uint64_t		rng;
+	time_t			now;
+
+	struct xfs_inode	**dirs;
+	uint64_t		nr_dirs;
+
+	/* files being allocated a chunk at a time */
+	struct age_file		**streams;
+	unsigned int		nr_streams;
+	xfs_filblks_t		chunk;
+	xfs_fsblock_t		last_fsb;
+
+	/* recently finished files that new ones can be cloned from */
+	struct age_file		*sources[AGE_CLONE_SOURCES];
+	unsigned int		next_source;
+
+	/* space to give back at the end */
+	struct xfs_bmbt_irec	*holes;
+	uint64_t		nr_holes;
+
+	/* xattrs to add once everything else is done */
+	struct age_xattrs	*xattrs;
+	uint64_t		nr_xattrs;
+
+	/* file contents are written out by these threads */
+	struct workqueue	wq;
+	int			devfd;
+	char			*pattern;
+};
+
+static void
+age_bad_value(
+	struct age_profile	*prof,
+	const char		*section,
+	const char		*name,
+	const char		*value)
+{
+	fprintf(stderr, _("%s: bad value \"%s\" for %s.%s in aging profile %s\n"),
+			progname, value, section, name, prof->fname);
+	exit(1);
+}
+
+static uint64_t
+age_getnum(
+	struct age_profile	*prof,
+	const char		*section,
+	const char		*name,
+	const char		*value,
+	uint64_t		max)
+{
+	long long		v = cvtnum(0, 0, value);
+
+	if (v < 0 || v > max)
+		age_bad_value(prof, section, name, value);
+	return v;
+}
+
+/* Parse a list of size:weight pairs, in ascending order of size. */
+static void
+age_parse_sizes(
+	struct age_profile	*prof,
+	const char		*value)
+{
+	char			*buf = strdup(value);
+	char			*tok, *save, *colon;
+	long long		size, weight;
+
+	if (!buf)
+		fail(_("cannot parse aging profile"), ENOMEM);
+	prof->nr_buckets = 0;
+	prof->total_weight = 0;
+	for (tok = strtok_r(buf, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		colon = strchr(tok, ':');
+		if (!colon || prof->nr_buckets == AGE_MAX_BUCKETS)
+			age_bad_value(prof, "files", "sizes", value);
+		*colon = '\0';
+		size = cvtnum(0, 0, tok);
+		weight = cvtnum(0, 0, colon + 1);
+		if (size < 0 || weight <= 0 || weight > 1000000 ||
+		    (prof->nr_buckets &&
+		     size <= prof->bucket_size[prof->nr_buckets - 1]))
+			age_bad_value(prof, "files", "sizes", value);
+		prof->bucket_size[prof->nr_buckets] = size;
+		prof->bucket_weight[prof->nr_buckets] = weight;
+		prof->total_weight += weight;
+		prof->nr_buckets++;
+	}
+	if (!prof->nr_buckets)
+		age_bad_value(prof, "files", "sizes", value);
+	free(buf);
+}
+
+static int
+age_parse_ini(
+	void			*user,
+	const char		*section,
+	const char		*name,
+	const char		*value)
+{
+	struct age_profile	*prof = user;
+
+	if (!strcmp(section, "") && !strcmp(name, "seed")) {
+		prof->seed = age_getnum(prof, section, name, value, ULLONG_MAX);
+	} else if (!strcmp(section, "files")) {
+		if (!strcmp(name, "count"))
+			prof->nr_files = age_getnum(prof, section, name,
+					value, UINT_MAX);
+		else if (!strcmp(name, "sizes"))
+			age_parse_sizes(prof, value);
+		else if (!strcmp(name, "data"))
+			prof->write_data = age_getnum(prof, section, name,
+					value, 1);
+		else
+			return 0;
+	} else if (!strcmp(section, "dirs")) {
+		if (!strcmp(name, "count"))
+			prof->nr_dirs = age_getnum(prof, section, name,
+					value, UINT_MAX);
+		else if (!strcmp(name, "depth"))
+			prof->depth = age_getnum(prof, section, name, value,
+					64);
+		else if (!strcmp(name, "skew"))
+			prof->skew = age_getnum(prof, section, name, value, 16);
+		else
+			return 0;
+	} else if (!strcmp(section, "fragmentation")) {
+		if (!strcmp(name, "interleave"))
+			prof->interleave_pct = age_getnum(prof, section, name,
+					value, 100);
+		else if (!strcmp(name, "streams"))
+			prof->streams = age_getnum(prof, section, name, value,
+					AGE_MAX_STREAMS);
+		else if (!strcmp(name, "chunk"))
+			prof->chunk = age_getnum(prof, section, name, value,
+					UINT_MAX);
+		else if (!strcmp(name, "churn"))
+			prof->churn_pct = age_getnum(prof, section, name,
+					value, 100);
+		else
+			return 0;
+	} else if (!strcmp(section, "reflink")) {
+		if (!strcmp(name, "clones"))
+			prof->clone_pct = age_getnum(prof, section, name,
+					value, 100);
+		else
+			return 0;
+	} else if (!strcmp(section, "xattr")) {
+		if (!strcmp(name, "count"))
+			prof->xattrs = age_getnum(prof, section, name, value,
+					1000);
+		else if (!strcmp(name, "size"))
+			prof->xattr_size = age_getnum(prof, section, name,
+					value, XATTR_SIZE_MAX);
+		else
+			return 0;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Read the aging profile, if there is one, before anything is written so
+ * that mistakes in it don't leave a half made filesystem behind.
+ */
+struct age_profile *
+setup_age(
+	const char		*fname)
+{
+	struct age_profile	*prof;
+	int			error;
+
+	if (!fname)
+		return NULL;
+
+	prof = calloc(1, sizeof(*prof));
+	if (!prof)
+		fail(_("cannot parse aging profile"), ENOMEM);
+	prof->fname = fname;
+	prof->seed = 1;
+	prof->nr_files = 10000;
+	prof->bucket_size[0] = 64 << 10;
+	prof->bucket_weight[0] = 1;
+	prof->total_weight = 1;
+	prof->nr_buckets = 1;
+	prof->nr_dirs = 100;
+	prof->depth = 3;
+	prof->streams = 8;
+	prof->chunk = 64 << 10;
+	prof->xattr_size = 64;
+
+	error = ini_parse(fname, age_parse_ini, prof);
+	if (error > 0) {
+		fprintf(stderr,
+	_("%s: unrecognised input on line %d of aging profile %s\n"),
+				progname, error, fname);
+		exit(1);
+	} else if (error) {
+		fprintf(stderr, _("%s: cannot read aging profile %s\n"),
+				progname, fname);
+		exit(1);
+	}
+	if (prof->streams == 0)
+		prof->streams = 1;
+	return prof;
+}
+
+/* xorshift64*, so that images don't depend on the C library */
+static uint64_t
+age_rand(
+	struct age		*age)
+{
+	uint64_t		x = age->rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	age->rng = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t
+age_rand_below(
+	struct age		*age,
+	uint64_t		n)
+{
+	return n ? age_rand(age) % n : 0;
+}
+
+static bool
+age_chance(
+	struct age		*age,
+	unsigned int		pct)
+{
+	return age_rand_below(age, 100) < pct;
+}
+
+/*
+ * Pick a file size from the profile's buckets.  Within a bucket, each power
+ * of two is as likely as any other, so small sizes aren't swamped by the
+ * number of big ones there could be.
+ */
+static uint64_t
+age_pick_size(
+	struct age		*age)
+{
+	struct age_profile	*prof = age->prof;
+	uint64_t		r = age_rand_below(age, prof->total_weight);
+	uint64_t		lo = 0, hi = 0, size;
+	unsigned int		i, lbits, hbits, bits;
+
+	for (i = 0; i < prof->nr_buckets; i++) {
+		hi = prof->bucket_size[i];
+		if (r < prof->bucket_weight[i])
+			break;
+		r -= prof->bucket_weight[i];
+		lo = hi + 1;
+	}
+
+	lbits = fls64(lo);
+	hbits = fls64(hi);
+	bits = lbits + age_rand_below(age, hbits - lbits + 1);
+	if (bits == 0)
+		return 0;
+	size = (1ULL << (bits - 1)) + age_rand_below(age, 1ULL << (bits - 1));
+	return max(lo, min(hi, size));
+}
+
+/*
+ * Pick a directory for a new file.  The more skew, the more the files pile
+ * up in a few directories, which are the ones furthest from the root.
+ */
+static struct xfs_inode *
+age_pick_dir(
+	struct age		*age)
+{
+	uint64_t		idx = age_rand_below(age, age->nr_dirs);
+	unsigned int		i;
+
+	for (i = 0; i < age->prof->skew; i++)
+		idx = min(idx, age_rand_below(age, age->nr_dirs));
+	return age->dirs[age->nr_dirs - 1 - idx];
+}
+
+/* Create an inode and link it into pip, leaving the transaction open. */
+static struct xfs_inode *
+age_create(
+	struct age		*age,
+	struct xfs_inode	*pip,
+	const char		*name,
+	umode_t			mode,
+	uint			blocks,
+	struct xfs_trans	**tpp)
+{
+	struct xfs_mount	*mp = age->mp;
+	struct xfs_inode	*ip;
+	struct xfs_name		xname = {
+		.name		= (unsigned char *)name,
+		.len		= strlen(name),
+		.type		= libxfs_mode_to_ftype(mode),
+	};
+	cred_t			creds = { 0 };
+	time_t			when;
+	int			error;
+
+	*tpp = bulk_getres(mp, blocks);
+	error = -libxfs_dir_ialloc(tpp, pip, mode, 1, 0, &creds, age->fsxp,
+			&ip);
+	if (error)
+		fail(_("Inode allocation failed"), error);
+
+	/* sometime in the last year */
+	when = age->now - age_rand_below(age, 365 * 24 * 3600);
+	VFS_I(ip)->i_mtime.tv_sec = when;
+	VFS_I(ip)->i_atime.tv_sec = when + age_rand_below(age, age->now - when);
+
+	bulk_ijoin(*tpp, pip);
+	newdirent(mp, *tpp, pip, &xname, ip->i_ino);
+	return ip;
+}
+
+/*
+ * Lay the directories out as a tree with the fanout that makes it as deep
+ * as the profile wants, numbering them breadth first from the root so the
+ * last ones are the leaves.
+ */
+static void
+age_make_dirs(
+	struct age		*age)
+{
+	struct age_profile	*prof = age->prof;
+	struct xfs_mount	*mp = age->mp;
+	struct xfs_inode	*ip, *pip;
+	struct xfs_trans	*tp;
+	uint64_t		fanout, n, level, i;
+	char			name[32];
+	int			error;
+
+	age->nr_dirs = prof->nr_dirs + 1;
+	age->dirs = calloc(age->nr_dirs, sizeof(struct xfs_inode *));
+	if (!age->dirs)
+		fail(_("cannot allocate directory list"), ENOMEM);
+
+	error = -libxfs_iget(mp, NULL, mp->m_sb.sb_rootino, 0, &age->dirs[0]);
+	if (error)
+		fail(_("cannot read root directory"), error);
+
+	for (fanout = 2; prof->depth > 0; fanout++) {
+		for (n = 0, level = 1, i = 0; i < prof->depth; i++) {
+			level *= fanout;
+			n += level;
+			if (n >= prof->nr_dirs)
+				break;
+		}
+		if (n >= prof->nr_dirs)
+			break;
+	}
+
+	for (i = 1; i < age->nr_dirs; i++) {
+		pip = age->dirs[(i - 1) / fanout];
+		snprintf(name, sizeof(name), "d%llu",
+				(unsigned long long)(i - 1) % fanout);
+		ip = age_create(age, pip, name, S_IFDIR | 0755, 0, &tp);
+		inc_nlink(VFS_I(ip));		/* account for . */
+		inc_nlink(VFS_I(pip));
+		libxfs_trans_log_inode(tp, pip, XFS_ILOG_CORE);
+		newdirectory(mp, tp, ip, pip);
+		libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+		bulk_done(tp);
+		age->dirs[i] = ip;
+	}
+}
+
+static void
+age_add_map(
+	struct age_file		*f,
+	struct xfs_bmbt_irec	*map)
+{
+	if ((f->nr_maps & (f->nr_maps - 1)) == 0) {
+		f->maps = realloc(f->maps, max(f->nr_maps * 2, 4U) *
+				sizeof(struct xfs_bmbt_irec));
+		if (!f->maps)
+			fail(_("cannot allocate extent list"), ENOMEM);
+	}
+	f->maps[f->nr_maps++] = *map;
+}
+
+/* Allocate up to len more blocks for a file. */
+static void
+age_alloc_file(
+	struct age		*age,
+	struct age_file		*f,
+	xfs_filblks_t		len)
+{
+	struct xfs_mount	*mp = age->mp;
+	struct xfs_bmbt_irec	maps[AGE_NMAPS];
+	struct xfs_trans	*tp;
+	int			nmap = AGE_NMAPS;
+	int			i;
+	int			error;
+
+	len = min(len, (xfs_filblks_t)MAXEXTLEN);
+	tp = bulk_getres(mp, len);
+	bulk_ijoin(tp, f->ip);
+	error = -libxfs_bmapi_write(tp, f->ip, f->done, len, 0, len, maps,
+			&nmap);
+	if (error == ENOSYS && XFS_IS_REALTIME_INODE(f->ip)) {
+		fprintf(stderr,
+	_("%s: aging realtime files is not supported.\n"), progname);
+		exit(1);
+	}
+	if (error)
+		fail(_("error allocating space for a file"), error);
+	if (nmap == 0)
+		fail(_("error allocating space for a file"), ENOSPC);
+	libxfs_trans_log_inode(tp, f->ip, XFS_ILOG_CORE);
+	bulk_done(tp);
+
+	for (i = 0; i < nmap; i++)
+		age_add_map(f, &maps[i]);
+	f->done = maps[nmap - 1].br_startoff + maps[nmap - 1].br_blockcount;
+	age->last_fsb = maps[nmap - 1].br_startblock +
+			maps[nmap - 1].br_blockcount;
+}
+
+/* Take up to len blocks from the allocator, to be freed at the end. */
+static void
+age_alloc_hole(
+	struct age		*age,
+	struct age_file		*f,
+	xfs_filblks_t		len)
+{
+	struct xfs_mount	*mp = age->mp;
+	struct xfs_bmbt_irec	map = { 0 };
+	struct xfs_alloc_arg	args = {
+		.mp		= mp,
+		.fsbno		= f->target,
+		.type		= XFS_ALLOCTYPE_START_BNO,
+		.minlen		= 1,
+		.prod		= 1,
+		.alignment	= 1,
+		.datatype	= XFS_ALLOC_USERDATA,
+		.resv		= XFS_AG_RESV_NONE,
+		.oinfo		= XFS_RMAP_OINFO_SKIP_UPDATE,
+	};
+	int			error;
+
+	args.maxlen = min(len,
+			(xfs_filblks_t)libxfs_alloc_ag_max_usable(mp) / 2);
+	args.tp = bulk_getres(mp, args.maxlen);
+	error = -libxfs_alloc_vextent(&args);
+	if (error)
+		fail(_("error allocating space to free"), error);
+	if (args.fsbno == NULLFSBLOCK)
+		fail(_("error allocating space to free"), ENOSPC);
+	bulk_done(args.tp);
+
+	map.br_startblock = args.fsbno;
+	map.br_blockcount = args.len;
+	age_add_map(f, &map);
+	f->done += args.len;
+	f->target = args.fsbno + args.len;
+}
+
+static void
+age_write_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct age		*age = wq->wq_ctx;
+	struct xfs_mount	*mp = age->mp;
+	struct age_file		*f = arg;
+	struct xfs_bmbt_irec	*map;
+	uint64_t		done, len, pos;
+	size_t			count;
+	ssize_t			n;
+	unsigned int		i;
+
+	for (i = 0, map = f->maps; i < f->nr_maps; i++, map++) {
+		len = XFS_FSB_TO_B(mp, map->br_blockcount);
+		pos = BBTOB(XFS_FSB_TO_DADDR(mp, map->br_startblock));
+		for (done = 0; done < len; done += count) {
+			count = min((uint64_t)AGE_WRITE_SIZE, len - done);
+			n = pwrite(age->devfd, age->pattern, count, pos + done);
+			if (n != count) {
+				fprintf(stderr,
+			_("%s: writing aged file data failed: %s\n"),
+					progname, n < 0 ? strerror(errno) :
+						_("short write"));
+				exit(1);
+			}
+		}
+	}
+	free(f->maps);
+	free(f);
+}
+
+static void
+age_free_file(
+	struct age_file		*f)
+{
+	if (f->ip)
+		bulk_irele(f->ip);
+	free(f->maps);
+	free(f);
+}
+
+/* A file has all its space; keep it around as something to clone. */
+static void
+age_file_done(
+	struct age		*age,
+	struct age_file		*f)
+{
+	struct age_file		*data;
+	struct age_file		**slot;
+
+	if (!f->ip) {
+		age->holes = realloc(age->holes, (age->nr_holes + f->nr_maps) *
+				sizeof(struct xfs_bmbt_irec));
+		if (!age->holes)
+			fail(_("cannot allocate extent list"), ENOMEM);
+		memcpy(&age->holes[age->nr_holes], f->maps,
+				f->nr_maps * sizeof(struct xfs_bmbt_irec));
+		age->nr_holes += f->nr_maps;
+		age_free_file(f);
+		return;
+	}
+
+	if (age->prof->write_data && f->nr_maps) {
+		data = calloc(1, sizeof(*data));
+		if (!data)
+			fail(_("cannot queue file data"), ENOMEM);
+		data->nr_maps = f->nr_maps;
+		data->maps = malloc(f->nr_maps * sizeof(struct xfs_bmbt_irec));
+		if (!data->maps)
+			fail(_("cannot queue file data"), ENOMEM);
+		memcpy(data->maps, f->maps,
+				f->nr_maps * sizeof(struct xfs_bmbt_irec));
+		if (workqueue_add(&age->wq, age_write_work, 0, data))
+			fail(_("cannot queue file data"), ENOMEM);
+	}
+
+	if (!f->nr_maps || !age->prof->clone_pct) {
+		age_free_file(f);
+		return;
+	}
+	slot = &age->sources[age->next_source++ % AGE_CLONE_SOURCES];
+	if (*slot)
+		age_free_file(*slot);
+	*slot = f;
+}
+
+/* Give every file being allocated a chunk at a time its next chunk. */
+static void
+age_stream_round(
+	struct age		*age)
+{
+	struct age_file		*f;
+	unsigned int		i = 0;
+
+	while (i < age->nr_streams) {
+		f = age->streams[i];
+		if (f->ip)
+			age_alloc_file(age, f, min(age->chunk, f->len - f->done));
+		else
+			age_alloc_hole(age, f, min(age->chunk, f->len - f->done));
+		if (f->done < f->len) {
+			i++;
+			continue;
+		}
+		age_file_done(age, f);
+		age->streams[i] = age->streams[--age->nr_streams];
+	}
+}
+
+/* Allocate a file's space, interleaved with others or all at once. */
+static void
+age_fill(
+	struct age		*age,
+	struct age_file		*f)
+{
+	if (f->len == 0) {
+		age_file_done(age, f);
+		return;
+	}
+
+	if (age->prof->streams > 1 &&
+	    age_chance(age, age->prof->interleave_pct)) {
+		while (age->nr_streams == age->prof->streams)
+			age_stream_round(age);
+		age->streams[age->nr_streams++] = f;
+		return;
+	}
+
+	while (f->done < f->len) {
+		if (f->ip)
+			age_alloc_file(age, f, f->len - f->done);
+		else
+			age_alloc_hole(age, f, f->len - f->done);
+	}
+	age_file_done(age, f);
+}
+
+/* Make a new file share all the blocks of a recent one. */
+static xfs_ino_t
+age_clone(
+	struct age		*age,
+	struct xfs_inode	*pip,
+	const char		*name)
+{
+	struct xfs_mount	*mp = age->mp;
+	struct age_file		*src;
+	struct xfs_inode	*ip;
+	struct xfs_trans	*tp;
+	struct xfs_bmbt_irec	irec;
+	xfs_ino_t		ino;
+	unsigned int		i;
+	int			error;
+
+	src = age->sources[age_rand_below(age, AGE_CLONE_SOURCES)];
+	if (!src)
+		return NULLFSINO;
+
+	ip = age_create(age, pip, name, S_IFREG | 0644,
+			src->nr_maps * XFS_EXTENTADD_SPACE_RES(mp,
+				XFS_DATA_FORK), &tp);
+	bulk_ijoin(tp, src->ip);
+	for (i = 0; i < src->nr_maps; i++) {
+		irec = src->maps[i];
+		libxfs_refcount_increase_extent(tp, &irec);
+		libxfs_bmap_map_extent(tp, ip, &irec);
+	}
+	ip->i_disk_size = src->ip->i_disk_size;
+	ip->i_diflags2 |= XFS_DIFLAG2_REFLINK;
+	src->ip->i_diflags2 |= XFS_DIFLAG2_REFLINK;
+	libxfs_trans_log_inode(tp, src->ip, XFS_ILOG_CORE);
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+
+	error = -libxfs_defer_finish(&tp);
+	if (error)
+		fail(_("error sharing blocks between files"), error);
+	bulk_done(tp);
+	ino = ip->i_ino;
+	bulk_irele(ip);
+	return ino;
+}
+
+static void
+age_make_files(
+	struct age		*age)
+{
+	struct age_profile	*prof = age->prof;
+	struct xfs_mount	*mp = age->mp;
+	struct age_file		*f;
+	struct xfs_inode	*pip;
+	struct xfs_trans	*tp;
+	xfs_ino_t		ino = NULLFSINO;
+	uint64_t		i, size;
+	char			name[32];
+	bool			can_clone = xfs_has_reflink(mp);
+
+	if (prof->clone_pct && !can_clone)
+		fprintf(stderr,
+	_("%s: warning: no reflink support, aging profile clones ignored\n"),
+				progname);
+
+	for (i = 0; i < prof->nr_files; i++) {
+		pip = age_pick_dir(age);
+		snprintf(name, sizeof(name), "f%llu", (unsigned long long)i);
+
+		if (can_clone && age_chance(age, prof->clone_pct)) {
+			ino = age_clone(age, pip, name);
+			if (ino != NULLFSINO)
+				goto xattrs;
+		}
+
+		size = age_pick_size(age);
+		f = calloc(1, sizeof(*f));
+		if (!f)
+			fail(_("cannot allocate file"), ENOMEM);
+		f->ip = age_create(age, pip, name, S_IFREG | 0644, 0, &tp);
+		f->ip->i_disk_size = size;
+		f->len = XFS_B_TO_FSB(mp, size);
+		ino = f->ip->i_ino;
+		libxfs_trans_log_inode(tp, f->ip, XFS_ILOG_CORE);
+		bulk_done(tp);
+		age_fill(age, f);
+
+		/* and maybe something that gets deleted */
+		if (age_chance(age, prof->churn_pct)) {
+			f = calloc(1, sizeof(*f));
+			if (!f)
+				fail(_("cannot allocate file"), ENOMEM);
+			f->len = XFS_B_TO_FSB(mp, age_pick_size(age));
+			f->target = age->last_fsb;
+			age_fill(age, f);
+		}
+
+xattrs:
+		if (prof->xattrs) {
+			struct age_xattrs	*ax;
+
+			if ((age->nr_xattrs & (age->nr_xattrs - 1)) == 0) {
+				age->xattrs = realloc(age->xattrs,
+						max(age->nr_xattrs * 2,
+							(uint64_t)64) * sizeof(*ax));
+				if (!age->xattrs)
+					fail(_("cannot allocate xattr list"),
+							ENOMEM);
+			}
+			ax = &age->xattrs[age->nr_xattrs++];
+			ax->ino = ino;
+			ax->nr = age_rand_below(age, prof->xattrs * 2 + 1);
+		}
+	}
+
+	while (age->nr_streams)
+		age_stream_round(age);
+}
+
+/*
+ * Xattrs are set through libxfs_attr_set, which runs its own transactions,
+ * so they're added once all the files exist and the bulk transaction has
+ * been committed.
+ */
+static void
+age_set_xattrs(
+	struct age		*age)
+{
+	struct xfs_mount	*mp = age->mp;
+	struct age_xattrs	*ax;
+	struct xfs_inode	*ip;
+	unsigned char		name[16];
+	char			*value;
+	uint64_t		i;
+	unsigned int		j;
+	int			error;
+
+	value = malloc(age->prof->xattr_size + 1);
+	if (!value)
+		fail(_("cannot allocate xattr value"), ENOMEM);
+	memset(value, 'v', age->prof->xattr_size + 1);
+
+	for (i = 0, ax = age->xattrs; i < age->nr_xattrs; i++, ax++) {
+		if (!ax->nr)
+			continue;
+		error = -libxfs_iget(mp, NULL, ax->ino, 0, &ip);
+		if (error)
+			fail(_("cannot read back aged file"), error);
+		for (j = 0; j < ax->nr; j++) {
+			struct xfs_da_args	args = {
+				.dp		= ip,
+				.name		= name,
+				.value		= value,
+				.valuelen	= 1 + age_rand_below(age,
+						age->prof->xattr_size),
+			};
+
+			args.namelen = snprintf((char *)name, sizeof(name),
+					"age%u", j);
+			error = -libxfs_attr_set(&args);
+			if (error)
+				fail(_("error setting xattr"), error);
+		}
+		libxfs_irele(ip);
+	}
+	free(value);
+}
+
+/* Give back the space that belonged to deleted files. */
+static void
+age_free_holes(
+	struct age		*age)
+{
+	struct xfs_bmbt_irec	*map;
+	struct xfs_trans	*tp;
+	uint64_t		i;
+	int			error;
+
+	for (i = 0, map = age->holes; i < age->nr_holes; i++, map++) {
+		tp = bulk_getres(age->mp, 0);
+		error = -libxfs_free_extent(tp, map->br_startblock,
+				map->br_blockcount, &XFS_RMAP_OINFO_SKIP_UPDATE,
+				XFS_AG_RESV_NONE);
+		if (error)
+			fail(_("error freeing space"), error);
+		bulk_done(tp);
+	}
+	free(age->holes);
+}
+
+void
+age_filesystem(
+	struct xfs_mount	*mp,
+	struct fsxattr		*fsxp,
+	struct age_profile	*prof)
+{
+	struct age		age = {
+		.mp		= mp,
+		.fsxp		= fsxp,
+		.prof		= prof,
+		.now		= time(NULL),
+	};
+	unsigned int		i;
+	int			error;
+
+	/* splitmix the seed so that small seeds give different streams */
+	age.rng = (prof->seed + 1) * 0x9E3779B97F4A7C15ULL;
+	age.rng ^= age.rng >> 31;
+	if (!age.rng)
+		age.rng = 1;
+	age.chunk = max((xfs_filblks_t)1, XFS_B_TO_FSB(mp, prof->chunk));
+	age.streams = calloc(prof->streams, sizeof(struct age_file *));
+	if (!age.streams)
+		fail(_("cannot allocate file streams"), ENOMEM);
+
+	if (prof->write_data) {
+		age.devfd = libxfs_device_to_fd(mp->m_ddev_targp->bt_bdev);
+		age.pattern = memalign(libxfs_device_alignment(),
+				AGE_WRITE_SIZE);
+		if (!age.pattern)
+			fail(_("cannot allocate write buffer"), ENOMEM);
+		for (i = 0; i < AGE_WRITE_SIZE / sizeof(uint64_t); i++)
+			((uint64_t *)age.pattern)[i] = age_rand(&age);
+		error = -workqueue_create(&age.wq, &age, platform_nproc());
+		if (error)
+			fail(_("cannot start file write threads"), error);
+	}
+
+	/* parse_proto has flushed everything, so the root can be read */
+	bulk_flush();
+	age_make_dirs(&age);
+	age_make_files(&age);
+
+	for (i = 0; i < AGE_CLONE_SOURCES; i++)
+		if (age.sources[i])
+			age_free_file(age.sources[i]);
+	age_free_holes(&age);
+	for (i = 0; i < age.nr_dirs; i++)
+		bulk_irele(age.dirs[i]);
+	bulk_flush();
+
+	age_set_xattrs(&age);
+
+	if (prof->write_data) {
+		error = -workqueue_terminate(&age.wq);
+		if (error)
+			fail(_("writing file data failed"), error);
+		workqueue_destroy(&age.wq);
+		free(age.pattern);
+	}
+	free(age.xattrs);
+	free(age.streams);
+	free(age.dirs);
+}
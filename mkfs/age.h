@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef MKFS_AGE_H_
+#define MKFS_AGE_H_
+
+struct age_profile;
+
+struct age_profile *setup_age(const char *fname);
+void age_filesystem(struct xfs_mount *mp, struct fsxattr *fsx,
+		struct age_profile *prof);
+
+#endif /* MKFS_AGE_H_ */
@@ -6,14 +6,18 @@
 
 #include "libxfs.h"
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <search.h>
 #include "libfrog/convert.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
 #include "proto.h"
 
 /*
  * Prototypes for internal functions.
  */
 static char *getstr(char **pp);
-static void fail(char *msg, int i);
 static struct xfs_trans * getres(struct xfs_mount *mp, uint blocks);
 static void rsvfile(xfs_mount_t *mp, xfs_inode_t *ip, long long len);
 static int newfile(xfs_trans_t *tp, xfs_inode_t *ip, int symlink, int logit,
@@ -21,6 +25,11 @@ static int newfile(xfs_trans_t *tp, xfs_inode_t *ip, int symlink, int logit,
 static char *newregfile(char **pp, int *len);
 static void rtinit(xfs_mount_t *mp);
 static long filesize(int fd);
+static void populate_from_dir(struct xfs_mount *mp, struct fsxattr *fsxp,
+			char *dir);
+
+/* Set if -p named a directory to copy in rather than a proto file. */
+static char	*proto_dir;
 
 /*
  * Use this for block reservations needed for mkfs's conditions
@@ -59,11 +68,16 @@ setup_proto(
 {
 	char		*buf = NULL;
 	static char	dflt[] = "d--755 0 0 $";
+	struct stat	st;
 	int		fd;
 	long		size;
 
 	if (!fname)
 		return dflt;
+	if (stat(fname, &st) == 0 && S_ISDIR(st.st_mode)) {
+		proto_dir = fname;
+		return dflt;
+	}
 	if ((fd = open(fname, O_RDONLY)) < 0 || (size = filesize(fd)) < 0) {
 		fprintf(stderr, _("%s: failed to open %s: %s\n"),
 			progname, fname, strerror(errno));
@@ -98,7 +112,7 @@ out_fail:
 	exit(1);
 }
 
-static void
+void
 fail(
 	char	*msg,
 	int	i)
@@ -133,6 +147,106 @@ getres(
 	return NULL;
 }
 
+/*
+ * Bulk transactions.
+ *
+ * mkfs has the device to itself and nothing is logged, so there's no
+ * reason to pay for a transaction allocation and commit, and for flushing
+ * the parent directory inode, for every file created.  Instead keep one
+ * transaction open for up to PROTO_BULK_OPS files, or until its block
+ * reservation runs low.  Inodes can't be released until the transaction
+ * that has them joined commits, so that's put off until then too.
+ *
+ * Anything that runs its own transactions, or reads an inode that might
+ * still be dirty in the bulk transaction, must call bulk_flush() first.
+ */
+#define PROTO_BULK_OPS	1024
+
+static struct xfs_trans	*bulk_tp;
+static unsigned int	bulk_ops;
+static struct xfs_inode	**bulk_inodes;
+static unsigned int	bulk_nr_inodes;
+static unsigned int	bulk_max_inodes;
+
+void
+bulk_flush(void)
+{
+	unsigned int	i;
+	int		error;
+
+	if (bulk_tp) {
+		error = -libxfs_trans_commit(bulk_tp);
+		if (error)
+			fail(_("Error encountered creating files"), error);
+		bulk_tp = NULL;
+	}
+	for (i = 0; i < bulk_nr_inodes; i++)
+		libxfs_irele(bulk_inodes[i]);
+	bulk_nr_inodes = 0;
+	bulk_ops = 0;
+}
+
+/* Get a transaction with at least the reservation getres would make. */
+struct xfs_trans *
+bulk_getres(
+	struct xfs_mount	*mp,
+	uint			blocks)
+{
+	uint64_t		extra;
+
+	if (bulk_tp && bulk_ops < PROTO_BULK_OPS &&
+	    bulk_tp->t_blk_res - bulk_tp->t_blk_res_used >=
+			MKFS_BLOCKRES(blocks))
+		return bulk_tp;
+
+	bulk_flush();
+
+	/* Reserve enough for a batch of small files if there's room. */
+	extra = (uint64_t)PROTO_BULK_OPS * MKFS_BLOCKRES(0);
+	extra = min(extra, mp->m_sb.sb_fdblocks / 4);
+	if (blocks + extra > mp->m_sb.sb_fdblocks / 2)
+		extra = 0;
+	bulk_tp = getres(mp, blocks + extra);
+	return bulk_tp;
+}
+
+/* One more file is done with tp, which may have been rolled meanwhile. */
+void
+bulk_done(
+	struct xfs_trans	*tp)
+{
+	bulk_tp = tp;
+	bulk_ops++;
+}
+
+/* Join an inode unless an earlier file in the batch already did. */
+void
+bulk_ijoin(
+	struct xfs_trans	*tp,
+	struct xfs_inode	*ip)
+{
+	if (!ip->i_itemp || list_empty(&ip->i_itemp->ili_item.li_trans))
+		libxfs_trans_ijoin(tp, ip, 0);
+}
+
+void
+bulk_irele(
+	struct xfs_inode	*ip)
+{
+	if (!bulk_tp) {
+		libxfs_irele(ip);
+		return;
+	}
+	if (bulk_nr_inodes == bulk_max_inodes) {
+		bulk_max_inodes = max(bulk_max_inodes * 2, 256U);
+		bulk_inodes = realloc(bulk_inodes,
+				bulk_max_inodes * sizeof(*bulk_inodes));
+		if (!bulk_inodes)
+			fail(_("cannot allocate inode list"), ENOMEM);
+	}
+	bulk_inodes[bulk_nr_inodes++] = ip;
+}
+
 static char *
 getstr(
 	char	**pp)
@@ -315,7 +429,7 @@ newregfile(
 	return buf;
 }
 
-static void
+void
 newdirent(
 	xfs_mount_t	*mp,
 	xfs_trans_t	*tp,
@@ -333,7 +447,7 @@ newdirent(
 		fail(_("directory createname error"), error);
 }
 
-static void
+void
 newdirectory(
 	xfs_mount_t	*mp,
 	xfs_trans_t	*tp,
@@ -453,7 +567,7 @@ parseproto(
 	switch (fmt) {
 	case IF_REGULAR:
 		buf = newregfile(pp, &len);
-		tp = getres(mp, XFS_B_TO_FSB(mp, len));
+		tp = bulk_getres(mp, XFS_B_TO_FSB(mp, len));
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFREG, 1, 0,
 					   &creds, fsxp, &ip);
 		if (error)
@@ -461,7 +575,7 @@ parseproto(
 		flags |= newfile(tp, ip, 0, 0, buf, len);
 		if (buf)
 			free(buf);
-		libxfs_trans_ijoin(tp, pip, 0);
+		bulk_ijoin(tp, pip);
 		xname.type = XFS_DIR3_FT_REG_FILE;
 		newdirent(mp, tp, pip, &xname, ip->i_ino);
 		break;
@@ -476,27 +590,26 @@ parseproto(
 				progname, value, name);
 			exit(1);
 		}
-		tp = getres(mp, XFS_B_TO_FSB(mp, llen));
+		tp = bulk_getres(mp, XFS_B_TO_FSB(mp, llen));
 
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFREG, 1, 0,
 					  &creds, fsxp, &ip);
 		if (error)
 			fail(_("Inode pre-allocation failed"), error);
 
-		libxfs_trans_ijoin(tp, pip, 0);
+		bulk_ijoin(tp, pip);
 
 		xname.type = XFS_DIR3_FT_REG_FILE;
 		newdirent(mp, tp, pip, &xname, ip->i_ino);
 		libxfs_trans_log_inode(tp, ip, flags);
-		error = -libxfs_trans_commit(tp);
-		if (error)
-			fail(_("Space preallocation failed."), error);
+		bulk_done(tp);
+		bulk_flush();
 		rsvfile(mp, ip, llen);
 		libxfs_irele(ip);
 		return;
 
 	case IF_BLOCK:
-		tp = getres(mp, 0);
+		tp = bulk_getres(mp, 0);
 		majdev = getnum(getstr(pp), 0, 0, false);
 		mindev = getnum(getstr(pp), 0, 0, false);
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFBLK, 1,
@@ -504,51 +617,51 @@ parseproto(
 		if (error) {
 			fail(_("Inode allocation failed"), error);
 		}
-		libxfs_trans_ijoin(tp, pip, 0);
+		bulk_ijoin(tp, pip);
 		xname.type = XFS_DIR3_FT_BLKDEV;
 		newdirent(mp, tp, pip, &xname, ip->i_ino);
 		flags |= XFS_ILOG_DEV;
 		break;
 
 	case IF_CHAR:
-		tp = getres(mp, 0);
+		tp = bulk_getres(mp, 0);
 		majdev = getnum(getstr(pp), 0, 0, false);
 		mindev = getnum(getstr(pp), 0, 0, false);
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFCHR, 1,
 				IRIX_MKDEV(majdev, mindev), &creds, fsxp, &ip);
 		if (error)
 			fail(_("Inode allocation failed"), error);
-		libxfs_trans_ijoin(tp, pip, 0);
+		bulk_ijoin(tp, pip);
 		xname.type = XFS_DIR3_FT_CHRDEV;
 		newdirent(mp, tp, pip, &xname, ip->i_ino);
 		flags |= XFS_ILOG_DEV;
 		break;
 
 	case IF_FIFO:
-		tp = getres(mp, 0);
+		tp = bulk_getres(mp, 0);
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFIFO, 1, 0,
 				&creds, fsxp, &ip);
 		if (error)
 			fail(_("Inode allocation failed"), error);
-		libxfs_trans_ijoin(tp, pip, 0);
+		bulk_ijoin(tp, pip);
 		xname.type = XFS_DIR3_FT_FIFO;
 		newdirent(mp, tp, pip, &xname, ip->i_ino);
 		break;
 	case IF_SYMLINK:
 		buf = getstr(pp);
 		len = (int)strlen(buf);
-		tp = getres(mp, XFS_B_TO_FSB(mp, len));
+		tp = bulk_getres(mp, XFS_B_TO_FSB(mp, len));
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFLNK, 1, 0,
 				&creds, fsxp, &ip);
 		if (error)
 			fail(_("Inode allocation failed"), error);
 		flags |= newfile(tp, ip, 1, 1, buf, len);
-		libxfs_trans_ijoin(tp, pip, 0);
+		bulk_ijoin(tp, pip);
 		xname.type = XFS_DIR3_FT_SYMLINK;
 		newdirent(mp, tp, pip, &xname, ip->i_ino);
 		break;
 	case IF_DIRECTORY:
-		tp = getres(mp, 0);
+		tp = bulk_getres(mp, 0);
 		error = -libxfs_dir_ialloc(&tp, pip, mode|S_IFDIR, 1, 0,
 				&creds, fsxp, &ip);
 		if (error)
@@ -560,7 +673,7 @@ parseproto(
 			libxfs_log_sb(tp);
 			isroot = 1;
 		} else {
-			libxfs_trans_ijoin(tp, pip, 0);
+			bulk_ijoin(tp, pip);
 			xname.type = XFS_DIR3_FT_DIR;
 			newdirent(mp, tp, pip, &xname, ip->i_ino);
 			inc_nlink(VFS_I(pip));
@@ -568,15 +681,15 @@ parseproto(
 		}
 		newdirectory(mp, tp, ip, pip);
 		libxfs_trans_log_inode(tp, ip, flags);
-		error = -libxfs_trans_commit(tp);
-		if (error)
-			fail(_("Directory inode allocation failed."), error);
+		bulk_done(tp);
 		/*
 		 * RT initialization.  Do this here to ensure that
 		 * the RT inodes get placed after the root inode.
 		 */
-		if (isroot)
+		if (isroot) {
+			bulk_flush();
 			rtinit(mp);
+		}
 		tp = NULL;
 		for (;;) {
 			name = getstr(pp);
@@ -586,19 +699,15 @@ parseproto(
 				break;
 			parseproto(mp, ip, fsxp, pp, name);
 		}
-		libxfs_irele(ip);
+		bulk_irele(ip);
 		return;
 	default:
 		ASSERT(0);
 		fail(_("Unknown format"), EINVAL);
 	}
 	libxfs_trans_log_inode(tp, ip, flags);
-	error = -libxfs_trans_commit(tp);
-	if (error) {
-		fail(_("Error encountered creating file from prototype file"),
-			error);
-	}
-	libxfs_irele(ip);
+	bulk_done(tp);
+	bulk_irele(ip);
 }
 
 void
@@ -607,7 +716,484 @@ parse_proto(
 	struct fsxattr	*fsx,
 	char		**pp)
 {
-	parseproto(mp, NULL, fsx, pp, NULL);
+	if (proto_dir)
+		populate_from_dir(mp, fsx, proto_dir);
+	else
+		parseproto(mp, NULL, fsx, pp, NULL);
+	bulk_flush();
+}
+
+/*
+ * Populating the filesystem from a directory tree.
+ *
+ * The inodes, directories and block mappings are created one at a time
+ * here, since libxfs transactions aren't safe to run from several threads.
+ * Each regular file gets all of its space allocated up front in as few
+ * extents as the allocator can manage, and copying its contents into those
+ * extents is handed to a pool of threads that read the source file in big
+ * sequential chunks and write straight to the data device.
+ */
+#define COPY_BUF_SIZE	(4 << 20)
+#define COPY_NMAPS	16
+
+struct copy_file {
+	char			*path;
+	unsigned int		nr;
+	struct xfs_bmbt_irec	maps[];
+};
+
+struct populate {
+	struct xfs_mount	*mp;
+	struct fsxattr		*fsxp;
+	struct workqueue	wq;
+	int			devfd;
+	void			*links;		/* tsearch tree of hardlinks */
+};
+
+struct populate_link {
+	dev_t			dev;
+	ino_t			ino;
+	xfs_ino_t		xfs_ino;
+};
+
+static int
+populate_link_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct populate_link *la = a;
+	const struct populate_link *lb = b;
+
+	if (la->dev != lb->dev)
+		return la->dev < lb->dev ? -1 : 1;
+	if (la->ino != lb->ino)
+		return la->ino < lb->ino ? -1 : 1;
+	return 0;
+}
+
+/* Fill buf from the file at pos, zeroing whatever is past EOF. */
+static void
+copy_read(
+	struct copy_file	*cf,
+	int			fd,
+	char			*buf,
+	size_t			len,
+	off_t			pos)
+{
+	size_t			done = 0;
+	ssize_t			n;
+
+	while (done < len) {
+		n = pread(fd, buf + done, len - done, pos + done);
+		if (n < 0) {
+			fprintf(stderr, _("%s: read failed on %s: %s\n"),
+				progname, cf->path, strerror(errno));
+			exit(1);
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	if (done < len)
+		memset(buf + done, 0, len - done);
+}
+
+static void
+copy_file_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct populate		*pop = wq->wq_ctx;
+	struct xfs_mount	*mp = pop->mp;
+	struct copy_file	*cf = arg;
+	struct xfs_bmbt_irec	*map;
+	unsigned int		i;
+	uint64_t		done;
+	uint64_t		len;
+	size_t			count;
+	ssize_t			n;
+	char			*buf;
+	int			fd;
+
+	fd = open(cf->path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, _("%s: cannot open %s: %s\n"),
+			progname, cf->path, strerror(errno));
+		exit(1);
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	buf = memalign(libxfs_device_alignment(), COPY_BUF_SIZE);
+	if (!buf)
+		fail(_("cannot allocate copy buffer"), ENOMEM);
+
+	for (i = 0, map = cf->maps; i < cf->nr; i++, map++) {
+		len = XFS_FSB_TO_B(mp, map->br_blockcount);
+		for (done = 0; done < len; done += count) {
+			count = min((uint64_t)COPY_BUF_SIZE, len - done);
+			copy_read(cf, fd, buf, count,
+					XFS_FSB_TO_B(mp, map->br_startoff) +
+					done);
+			n = pwrite(pop->devfd, buf, count,
+					BBTOB(XFS_FSB_TO_DADDR(mp,
+						map->br_startblock)) + done);
+			if (n != count) {
+				fprintf(stderr,
+			_("%s: writing data for %s failed: %s\n"),
+					progname, cf->path,
+					n < 0 ? strerror(errno) :
+						_("short write"));
+				exit(1);
+			}
+		}
+	}
+
+	free(buf);
+	close(fd);
+	free(cf->path);
+	free(cf);
+}
+
+
+static void
+populate_times(
+	struct xfs_inode	*ip,
+	struct stat		*st)
+{
+	VFS_I(ip)->i_atime.tv_sec = st->st_atim.tv_sec;
+	VFS_I(ip)->i_atime.tv_nsec = st->st_atim.tv_nsec;
+	VFS_I(ip)->i_mtime.tv_sec = st->st_mtim.tv_sec;
+	VFS_I(ip)->i_mtime.tv_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * Create an inode like the one described by st and link it into pip (or
+ * make it the root directory).  The transaction is left open for the
+ * caller to finish off.
+ */
+static struct xfs_inode *
+populate_inode(
+	struct populate		*pop,
+	struct xfs_inode	*pip,
+	char			*name,
+	struct stat		*st,
+	uint			blocks,
+	struct xfs_trans	**tpp)
+{
+	struct xfs_mount	*mp = pop->mp;
+	struct xfs_inode	*ip;
+	struct xfs_name		xname;
+	xfs_dev_t		rdev = 0;
+	cred_t			creds = {
+		.cr_uid		= st->st_uid,
+		.cr_gid		= st->st_gid,
+	};
+	int			error;
+
+	if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+		rdev = IRIX_MKDEV(major(st->st_rdev), minor(st->st_rdev));
+
+	*tpp = bulk_getres(mp, blocks);
+	error = -libxfs_dir_ialloc(tpp, pip, st->st_mode, 1, rdev, &creds,
+			pop->fsxp, &ip);
+	if (error)
+		fail(_("Inode allocation failed"), error);
+	populate_times(ip, st);
+
+	if (pip) {
+		bulk_ijoin(*tpp, pip);
+		xname.name = (unsigned char *)name;
+		xname.len = strlen(name);
+		xname.type = libxfs_mode_to_ftype(st->st_mode);
+		newdirent(mp, *tpp, pip, &xname, ip->i_ino);
+	}
+	return ip;
+}
+
+/* Allocate all the space for a regular file and queue up the copy. */
+static void
+populate_file_data(
+	struct populate		*pop,
+	struct xfs_inode	*ip,
+	char			*path,
+	off_t			size)
+{
+	struct xfs_mount	*mp = pop->mp;
+	struct xfs_bmbt_irec	maps[COPY_NMAPS];
+	struct copy_file	*cf;
+	struct xfs_trans	*tp;
+	xfs_fileoff_t		off = 0;
+	xfs_fileoff_t		nb = XFS_B_TO_FSB(mp, size);
+	xfs_filblks_t		len;
+	int			nmap;
+	int			error;
+
+	cf = calloc(1, sizeof(*cf));
+	if (!cf)
+		fail(_("cannot allocate copy request"), ENOMEM);
+
+	while (off < nb) {
+		len = min(nb - off, (xfs_filblks_t)MAXEXTLEN);
+		tp = bulk_getres(mp, len);
+		bulk_ijoin(tp, ip);
+
+		nmap = COPY_NMAPS;
+		error = -libxfs_bmapi_write(tp, ip, off, len, 0, len, maps,
+				&nmap);
+		if (error == ENOSYS && XFS_IS_REALTIME_INODE(ip)) {
+			fprintf(stderr,
+	_("%s: creating realtime files from a directory not supported.\n"),
+					progname);
+			exit(1);
+		}
+		if (error)
+			fail(_("error allocating space for a file"), error);
+		if (nmap == 0)
+			fail(_("error allocating space for a file"), ENOSPC);
+
+		libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+		bulk_done(tp);
+
+		cf = realloc(cf, sizeof(*cf) + (cf->nr + nmap) * sizeof(*maps));
+		if (!cf)
+			fail(_("cannot allocate copy request"), ENOMEM);
+		memcpy(&cf->maps[cf->nr], maps, nmap * sizeof(*maps));
+		cf->nr += nmap;
+		off = maps[nmap - 1].br_startoff + maps[nmap - 1].br_blockcount;
+	}
+
+	cf->path = strdup(path);
+	if (!cf->path)
+		fail(_("cannot allocate copy request"), ENOMEM);
+	error = -workqueue_add(&pop->wq, copy_file_work, 0, cf);
+	if (error)
+		fail(_("cannot queue file copy"), error);
+}
+
+/* Add another name for an inode we've already created. */
+static bool
+populate_hardlink(
+	struct populate		*pop,
+	struct xfs_inode	*pip,
+	char			*name,
+	struct stat		*st)
+{
+	struct populate_link	key = {
+		.dev		= st->st_dev,
+		.ino		= st->st_ino,
+	};
+	struct populate_link	**found;
+	struct xfs_mount	*mp = pop->mp;
+	struct xfs_inode	*ip;
+	struct xfs_trans	*tp;
+	struct xfs_name		xname;
+	int			error;
+
+	found = tfind(&key, &pop->links, populate_link_cmp);
+	if (!found)
+		return false;
+
+	/* The inode may still be dirty in the bulk transaction. */
+	bulk_flush();
+	error = -libxfs_iget(mp, NULL, (*found)->xfs_ino, 0, &ip);
+	if (error)
+		fail(_("cannot read back hard linked inode"), error);
+
+	tp = bulk_getres(mp, 0);
+	bulk_ijoin(tp, ip);
+	bulk_ijoin(tp, pip);
+	xname.name = (unsigned char *)name;
+	xname.len = strlen(name);
+	xname.type = libxfs_mode_to_ftype(st->st_mode);
+	newdirent(mp, tp, pip, &xname, ip->i_ino);
+	inc_nlink(VFS_I(ip));
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	bulk_done(tp);
+	bulk_irele(ip);
+	return true;
+}
+
+static void
+populate_remember_link(
+	struct populate		*pop,
+	struct stat		*st,
+	xfs_ino_t		ino)
+{
+	struct populate_link	*link;
+
+	link = malloc(sizeof(*link));
+	if (!link)
+		fail(_("cannot remember hard link"), ENOMEM);
+	link->dev = st->st_dev;
+	link->ino = st->st_ino;
+	link->xfs_ino = ino;
+	if (!tsearch(link, &pop->links, populate_link_cmp))
+		fail(_("cannot remember hard link"), ENOMEM);
+}
+
+static void populate_dir(struct populate *pop, struct xfs_inode *dp,
+			char *path);
+
+static void
+populate_entry(
+	struct populate		*pop,
+	struct xfs_inode	*pip,
+	char			*dirpath,
+	char			*name)
+{
+	struct xfs_mount	*mp = pop->mp;
+	struct xfs_inode	*ip;
+	struct xfs_trans	*tp;
+	struct stat		st;
+	char			path[PATH_MAX];
+	char			target[PATH_MAX];
+	ssize_t			len;
+	int			flags = XFS_ILOG_CORE;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dirpath, name) >=
+			sizeof(path))
+		fail(_("path too long"), ENAMETOOLONG);
+	if (lstat(path, &st) < 0) {
+		fprintf(stderr, _("%s: cannot stat %s: %s\n"),
+			progname, path, strerror(errno));
+		exit(1);
+	}
+
+	if (!S_ISDIR(st.st_mode) && st.st_nlink > 1 &&
+	    populate_hardlink(pop, pip, name, &st))
+		return;
+
+	switch (st.st_mode & S_IFMT) {
+	case S_IFDIR:
+		ip = populate_inode(pop, pip, name, &st, 0, &tp);
+		inc_nlink(VFS_I(ip));		/* account for . */
+		inc_nlink(VFS_I(pip));
+		libxfs_trans_log_inode(tp, pip, XFS_ILOG_CORE);
+		newdirectory(mp, tp, ip, pip);
+		libxfs_trans_log_inode(tp, ip, flags);
+		bulk_done(tp);
+		populate_dir(pop, ip, path);
+		bulk_irele(ip);
+		return;
+	case S_IFREG:
+		ip = populate_inode(pop, pip, name, &st, 0, &tp);
+		ip->i_disk_size = st.st_size;
+		break;
+	case S_IFLNK:
+		len = readlink(path, target, sizeof(target) - 1);
+		if (len < 0) {
+			fprintf(stderr, _("%s: cannot read link %s: %s\n"),
+				progname, path, strerror(errno));
+			exit(1);
+		}
+		target[len] = '\0';
+		ip = populate_inode(pop, pip, name, &st,
+				XFS_B_TO_FSB(mp, len), &tp);
+		flags |= newfile(tp, ip, 1, 1, target, len);
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+		ip = populate_inode(pop, pip, name, &st, 0, &tp);
+		flags |= XFS_ILOG_DEV;
+		break;
+	case S_IFIFO:
+	case S_IFSOCK:
+		ip = populate_inode(pop, pip, name, &st, 0, &tp);
+		break;
+	default:
+		fprintf(stderr, _("%s: unknown file type for %s\n"),
+			progname, path);
+		exit(1);
+	}
+
+	libxfs_trans_log_inode(tp, ip, flags);
+	bulk_done(tp);
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0)
+		populate_file_data(pop, ip, path, st.st_size);
+	if (st.st_nlink > 1)
+		populate_remember_link(pop, &st, ip->i_ino);
+	bulk_irele(ip);
+}
+
+/* Copy the entries of a directory, in name order so images are repeatable. */
+static void
+populate_dir(
+	struct populate		*pop,
+	struct xfs_inode	*dp,
+	char			*path)
+{
+	struct dirent		**names;
+	int			nr;
+	int			i;
+
+	nr = scandir(path, &names, NULL, alphasort);
+	if (nr < 0) {
+		fprintf(stderr, _("%s: cannot read directory %s: %s\n"),
+			progname, path, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < nr; i++) {
+		if (strcmp(names[i]->d_name, ".") &&
+		    strcmp(names[i]->d_name, ".."))
+			populate_entry(pop, dp, path, names[i]->d_name);
+		free(names[i]);
+	}
+	free(names);
+}
+
+static void
+populate_from_dir(
+	struct xfs_mount	*mp,
+	struct fsxattr		*fsxp,
+	char			*dir)
+{
+	struct populate		pop = {
+		.mp		= mp,
+		.fsxp		= fsxp,
+	};
+	struct xfs_inode	*ip;
+	struct xfs_trans	*tp;
+	struct stat		st;
+	int			error;
+
+	if (stat(dir, &st) < 0) {
+		fprintf(stderr, _("%s: cannot stat %s: %s\n"),
+			progname, dir, strerror(errno));
+		exit(1);
+	}
+
+	pop.devfd = libxfs_device_to_fd(mp->m_ddev_targp->bt_bdev);
+	error = -workqueue_create(&pop.wq, &pop, platform_nproc());
+	if (error)
+		fail(_("cannot start file copy threads"), error);
+
+	/* The root directory takes its owner, mode and times from dir. */
+	ip = populate_inode(&pop, NULL, NULL, &st, 0, &tp);
+	inc_nlink(VFS_I(ip));		/* account for . */
+	mp->m_sb.sb_rootino = ip->i_ino;
+	libxfs_log_sb(tp);
+	newdirectory(mp, tp, ip, ip);
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	bulk_done(tp);
+
+	/*
+	 * RT initialization.  Do this here to ensure that
+	 * the RT inodes get placed after the root inode.
+	 */
+	bulk_flush();
+	rtinit(mp);
+
+	populate_dir(&pop, ip, dir);
+	bulk_irele(ip);
+	bulk_flush();
+
+	error = -workqueue_terminate(&pop.wq);
+	if (error)
+		fail(_("copying file data failed"), error);
+	workqueue_destroy(&pop.wq);
+	tdestroy(pop.links, free);
 }
 
 /*
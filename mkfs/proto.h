@@ -9,5 +9,17 @@
 char *setup_proto(char *fname);
 void parse_proto(struct xfs_mount *mp, struct fsxattr *fsx, char **pp);
 void res_failed(int err);
+void fail(char *msg, int i);
+
+/* Batched transactions for creating lots of files; see proto.c. */
+void bulk_flush(void);
+struct xfs_trans *bulk_getres(struct xfs_mount *mp, uint blocks);
+void bulk_done(struct xfs_trans *tp);
+void bulk_ijoin(struct xfs_trans *tp, struct xfs_inode *ip);
+void bulk_irele(struct xfs_inode *ip);
+void newdirent(struct xfs_mount *mp, struct xfs_trans *tp,
+		struct xfs_inode *pip, struct xfs_name *name, xfs_ino_t inum);
+void newdirectory(struct xfs_mount *mp, struct xfs_trans *tp,
+		struct xfs_inode *dp, struct xfs_inode *pdp);
 
 #endif /* MKFS_PROTO_H_ */
@@ -10,8 +10,12 @@
 #include "libxcmd.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/convert.h"
+#include "libfrog/crc32c.h"
 #include "libfrog/crc32cselftest.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
 #include "proto.h"
+#include "age.h"
 #include <ini.h>
 
 #define TERABYTES(count, blog)	((uint64_t)(count) << (40 - (blog)))
@@ -76,6 +80,8 @@ enum {
 	D_EXTSZINHERIT,
 	D_COWEXTSIZE,
 	D_DAXINHERIT,
+	D_DISCARDFREE,
+	D_CONCURRENCY,
 	D_MAX_OPTS,
 };
 
@@ -305,10 +311,13 @@ static struct opt_params dopts = {
 		[D_EXTSZINHERIT] = "extszinherit",
 		[D_COWEXTSIZE] = "cowextsize",
 		[D_DAXINHERIT] = "daxinherit",
+		[D_DISCARDFREE] = "discardfree",
+		[D_CONCURRENCY] = "concurrency",
 	},
 	.subopt_params = {
 		{ .index = D_AGCOUNT,
 		  .conflicts = { { &dopts, D_AGSIZE },
+				 { &dopts, D_CONCURRENCY },
 				 { NULL, LAST_CONFLICT } },
 		  .minval = 1,
 		  .maxval = XFS_MAX_AGNUMBER,
@@ -351,6 +360,7 @@ static struct opt_params dopts = {
 		},
 		{ .index = D_AGSIZE,
 		  .conflicts = { { &dopts, D_AGCOUNT },
+				 { &dopts, D_CONCURRENCY },
 				 { NULL, LAST_CONFLICT } },
 		  .convert = true,
 		  .minval = XFS_AG_MIN_BYTES,
@@ -426,6 +436,20 @@ static struct opt_params dopts = {
 		  .maxval = 1,
 		  .defaultval = 1,
 		},
+		{ .index = D_DISCARDFREE,
+		  .conflicts = { { NULL, LAST_CONFLICT } },
+		  .minval = 0,
+		  .maxval = 1,
+		  .defaultval = 1,
+		},
+		{ .index = D_CONCURRENCY,
+		  .conflicts = { { &dopts, D_AGCOUNT },
+				 { &dopts, D_AGSIZE },
+				 { NULL, LAST_CONFLICT } },
+		  .minval = 0,
+		  .maxval = XFS_MAX_AGNUMBER,
+		  .defaultval = SUBOPT_NEEDS_VAL,
+		},
 	},
 };
 
@@ -826,6 +850,7 @@ struct cli_params {
 	char	*agsize;
 	char	*dsu;
 	char	*dirblocksize;
+	char	*dconcurrency;
 	char	*logsize;
 	char	*lsu;
 	char	*rtextsize;
@@ -838,6 +863,7 @@ struct cli_params {
 	int64_t	logagno;
 	int	loginternal;
 	int	lsunit;
+	int	discardfree;
 
 	/* parameters where 0 is not a valid value */
 	int64_t	agcount;
@@ -934,13 +960,14 @@ static void __attribute__((noreturn))
 usage( void )
 {
 	fprintf(stderr, _("Usage: %s\n\
+/* aging profile */	[-a fname]\n\
 /* blocksize */		[-b size=num]\n\
 /* config file */	[-c options=xxx]\n\
 /* metadata */		[-m crc=0|1,finobt=0|1,uuid=xxx,rmapbt=0|1,reflink=0|1,\n\
 			    inobtcount=0|1,bigtime=0|1]\n\
 /* data subvol */	[-d agcount=n,agsize=n,file,name=xxx,size=num,\n\
 			    (sunit=value,swidth=value|su=num,sw=num|noalign),\n\
-			    sectsize=num\n\
+			    sectsize=num,discardfree=0|1,concurrency=n|auto\n\
 /* force overwrite */	[-f]\n\
 /* inode size */	[-i perblock=n|size=num,maxpct=n,attr=0|1|2,\n\
 			    projid32bit=0|1,sparse=0|1]\n\
@@ -1271,45 +1298,111 @@ done:
 	free(buf);
 }
 
+/* Discard the device 2G at a time, several pieces at once */
+#define DISCARD_STEP	(2ULL << 30)
+
+struct discard_work {
+	int		fd;
+	uint64_t	count;
+	bool		failed;
+};
+
+static void
+discard_step_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct discard_work	*dw = wq->wq_ctx;
+	uint64_t		offset = index * DISCARD_STEP;
+
+	/*
+	 * We intentionally ignore errors from the discard ioctl. It is
+	 * not necessary for the mkfs functionality but just an
+	 * optimization. However we should stop on error.
+	 */
+	if (dw->failed)
+		return;
+	if (platform_discard_blocks(dw->fd, offset,
+				min(DISCARD_STEP, dw->count - offset)))
+		dw->failed = true;
+}
+
 static void
 discard_blocks(dev_t dev, uint64_t nsectors, int quiet)
 {
-	int		fd;
-	uint64_t	offset = 0;
-	/* Discard the device 2G at a time */
-	const uint64_t	step = 2ULL << 30;
-	const uint64_t	count = BBTOB(nsectors);
+	struct discard_work	dw = {
+		.count		= BBTOB(nsectors),
+	};
+	struct workqueue	wq;
+	uint64_t		nr_steps;
+	uint64_t		i;
 
-	fd = libxfs_device_to_fd(dev);
-	if (fd <= 0)
+	dw.fd = libxfs_device_to_fd(dev);
+	if (dw.fd <= 0 || dw.count == 0)
 		return;
 
-	/* The block discarding happens in smaller batches so it can be
-	 * interrupted prematurely
+	/*
+	 * Try the first piece on its own so that we don't say anything or
+	 * start any threads if the device can't discard.
 	 */
-	while (offset < count) {
-		uint64_t	tmp_step = min(step, count - offset);
+	if (platform_discard_blocks(dw.fd, 0, min(DISCARD_STEP, dw.count)))
+		return;
+	if (!quiet) {
+		printf("Discarding blocks...");
+		fflush(stdout);
+	}
 
-		/*
-		 * We intentionally ignore errors from the discard ioctl. It is
-		 * not necessary for the mkfs functionality but just an
-		 * optimization. However we should stop on error.
-		 */
-		if (platform_discard_blocks(fd, offset, tmp_step) == 0) {
-			if (offset == 0 && !quiet) {
-				printf("Discarding blocks...");
-				fflush(stdout);
-			}
-		} else {
-			if (offset > 0 && !quiet)
-				printf("\n");
-			return;
-		}
+	nr_steps = (dw.count + DISCARD_STEP - 1) / DISCARD_STEP;
+	if (nr_steps > 1 &&
+	    !workqueue_create(&wq, &dw, min((uint64_t)platform_nproc(),
+					    nr_steps - 1))) {
+		for (i = 1; i < nr_steps; i++)
+			if (workqueue_add(&wq, discard_step_work, i, NULL))
+				break;
+		workqueue_terminate(&wq);
+		workqueue_destroy(&wq);
+	}
+	if (!quiet)
+		printf(dw.failed ? "\n" : "Done.\n");
+}
 
-		offset += tmp_step;
+/*
+ * Discard the part of [start, end) on the data device that doesn't overlap
+ * anything mkfs writes before the AG headers: the zeroed areas at each end
+ * of the device and the internal log.  Used to discard the free space of
+ * each AG while its headers are written.
+ */
+static void
+discard_free_range(
+	struct mkfs_params	*cfg,
+	struct xfs_mount	*mp,
+	int			fd,
+	uint64_t		dsize,
+	uint64_t		start,
+	uint64_t		end)
+{
+	uint64_t		holes[3][2] = {
+		{ 0, WHACK_SIZE },
+		{ 0, 0 },
+		{ BBTOB(dsize) - WHACK_SIZE, BBTOB(dsize) },
+	};
+	int			i;
+
+	if (cfg->loginternal) {
+		holes[1][0] = BBTOB(XFS_FSB_TO_DADDR(mp, cfg->logstart));
+		holes[1][1] = holes[1][0] + cfg->logblocks * cfg->blocksize;
 	}
-	if (offset > 0 && !quiet)
-		printf("Done.\n");
+
+	for (i = 0; i < 3 && start < end; i++) {
+		if (holes[i][1] <= start || holes[i][0] >= end)
+			continue;
+		if (holes[i][0] > start)
+			platform_discard_blocks(fd, start, holes[i][0] - start);
+		start = holes[i][1];
+	}
+	if (start < end)
+		platform_discard_blocks(fd, start, end - start);
 }
 
 static __attribute__((noreturn)) void
@@ -1568,6 +1661,12 @@ data_opts_parser(
 		else
 			cli->fsx.fsx_xflags &= ~FS_XFLAG_DAX;
 		break;
+	case D_DISCARDFREE:
+		cli->discardfree = getnum(value, opts, subopt);
+		break;
+	case D_CONCURRENCY:
+		cli->dconcurrency = getstr(value, opts, subopt);
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -2685,17 +2784,23 @@ open_devices(
 static void
 discard_devices(
 	struct libxfs_xinit	*xi,
+	bool			discardfree,
 	int			quiet)
 {
 	/*
-	 * This function has to be called after libxfs has been initialized.
+	 * This function has to be called after libxfs has been initialized.
+	 *
+	 * If we're only discarding free space, the data device is done along
+	 * with the AG headers, and an external log is about to be written
+	 * from one end to the other anyway.
 	 */
 
-	if (!xi->disfile)
+	if (!xi->disfile && !discardfree)
 		discard_blocks(xi->ddev, xi->dsize, quiet);
 	if (xi->rtdev && !xi->risfile)
 		discard_blocks(xi->rtdev, xi->rtsize, quiet);
-	if (xi->logdev && xi->logdev != xi->ddev && !xi->lisfile)
+	if (xi->logdev && xi->logdev != xi->ddev && !xi->lisfile &&
+	    !discardfree)
 		discard_blocks(xi->logdev, xi->logBBsize, quiet);
 }
 
@@ -2890,10 +2995,49 @@ reported by the device (%u).\n"),
 						NBBY * cfg->blocksize);
 }
 
+/*
+ * Size the AGs for the number of writers the storage can keep busy in
+ * parallel rather than from the device size alone.  "auto" asks the block
+ * layer; anything it can't vouch for gets the default geometry.
+ */
+static void
+calculate_concurrency_ag_geometry(
+	struct mkfs_params	*cfg,
+	struct cli_params	*cli,
+	int			quiet)
+{
+	struct fs_concurrency	fc;
+	char			why[128];
+	unsigned int		nr;
+
+	if (!strcmp(cli->dconcurrency, "auto")) {
+		nr = guess_concurrency(cli->xi->dname, &fc, why, sizeof(why));
+	} else {
+		nr = getnum(cli->dconcurrency, &dopts, D_CONCURRENCY);
+		snprintf(why, sizeof(why), _("set on the command line"));
+	}
+
+	if (!nr) {
+		calc_default_ag_geometry(cfg->blocklog, cfg->dblocks,
+					 cfg->dsunit, &cfg->agsize,
+					 &cfg->agcount);
+		if (!quiet)
+			printf(_("concurrency: default AG geometry, %s\n"), why);
+		return;
+	}
+
+	calc_concurrency_ag_geometry(cfg->blocklog, cfg->dblocks, nr,
+				     &cfg->agsize, &cfg->agcount);
+	if (!quiet)
+		printf(_("concurrency: %llu AGs for %u writers, %s\n"),
+				(unsigned long long)cfg->agcount, nr, why);
+}
+
 static void
 calculate_initial_ag_geometry(
 	struct mkfs_params	*cfg,
-	struct cli_params	*cli)
+	struct cli_params	*cli,
+	int			quiet)
 {
 	if (cli->agsize) {		/* User-specified AG size */
 		cfg->agsize = getnum(cli->agsize, &dopts, D_AGSIZE);
@@ -2915,6 +3059,8 @@ _("agsize (%s) not a multiple of fs blk size (%d)\n"),
 		cfg->agcount = cli->agcount;
 		cfg->agsize = cfg->dblocks / cfg->agcount +
 				(cfg->dblocks % cfg->agcount != 0);
+	} else if (cli->dconcurrency) {
+		calculate_concurrency_ag_geometry(cfg, cli, quiet);
 	} else {
 		calc_default_ag_geometry(cfg->blocklog, cfg->dblocks,
 					 cfg->dsunit, &cfg->agsize,
@@ -3646,6 +3792,126 @@ initialise_ag_headers(
 	libxfs_perag_put(pag);
 }
 
+/*
+ * Initialising the AG headers is mostly waiting for writes, so do it from a
+ * pool of threads.  Each work item initialises a batch of AGs and writes all
+ * of their headers out in one go.  With -d discardfree, it also discards the
+ * rest of each AG, which nothing else writes to until the headers are done.
+ */
+#define AGHDR_BATCH	16
+
+struct aghdr_work {
+	struct mkfs_params	*cfg;
+	struct xfs_mount	*mp;
+	int			discard_fd;	/* -1 if not discarding */
+	uint64_t		dsize;
+	pthread_mutex_t		lock;
+	int			worst_freelist;
+};
+
+static void
+discard_ag_free(
+	struct aghdr_work	*aw,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_mount	*mp = aw->mp;
+	uint64_t		agsize = aw->cfg->agsize;
+
+	if (agno == aw->cfg->agcount - 1)
+		agsize = aw->cfg->dblocks - (xfs_rfsblock_t)(agno * agsize);
+
+	discard_free_range(aw->cfg, mp, aw->discard_fd, aw->dsize,
+			BBTOB(XFS_AGB_TO_DADDR(mp, agno,
+					libxfs_prealloc_blocks(mp))),
+			BBTOB(XFS_AGB_TO_DADDR(mp, agno, agsize)));
+}
+
+static void
+initialise_ag_headers_work(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct aghdr_work	*aw = wq->wq_ctx;
+	xfs_agnumber_t		end_agno;
+	int			worst_freelist = 0;
+	int			error;
+	LIST_HEAD(buffer_list);
+
+	end_agno = min(agno + AGHDR_BATCH, aw->cfg->agcount);
+	for (; agno < end_agno; agno++) {
+		if (aw->discard_fd >= 0)
+			discard_ag_free(aw, agno);
+		initialise_ag_headers(aw->cfg, aw->mp, agno, &worst_freelist,
+				&buffer_list);
+	}
+
+	error = -libxfs_buf_delwri_submit(&buffer_list);
+	if (error) {
+		fprintf(stderr, _("%s: writing AG headers failed, err=%d\n"),
+				progname, error);
+		exit(1);
+	}
+
+	pthread_mutex_lock(&aw->lock);
+	aw->worst_freelist = max(aw->worst_freelist, worst_freelist);
+	pthread_mutex_unlock(&aw->lock);
+}
+
+static int
+initialise_all_ag_headers(
+	struct mkfs_params	*cfg,
+	struct libxfs_xinit	*xi,
+	struct xfs_mount	*mp,
+	bool			discard)
+{
+	struct aghdr_work	aw = {
+		.cfg		= cfg,
+		.mp		= mp,
+		.discard_fd	= -1,
+		.dsize		= xi->dsize,
+	};
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	unsigned int		nr_batches;
+	int			error;
+
+	if (discard && !xi->disfile)
+		aw.discard_fd = libxfs_device_to_fd(xi->ddev);
+
+	nr_batches = (cfg->agcount + AGHDR_BATCH - 1) / AGHDR_BATCH;
+	pthread_mutex_init(&aw.lock, NULL);
+	error = -workqueue_create(&wq, &aw,
+			min(platform_nproc(), (int)nr_batches));
+	if (error) {
+		fprintf(stderr, _("%s: cannot create AG header threads: %s\n"),
+				progname, strerror(error));
+		exit(1);
+	}
+
+	for (agno = 0; agno < cfg->agcount; agno += AGHDR_BATCH) {
+		error = -workqueue_add(&wq, initialise_ag_headers_work, agno,
+				NULL);
+		if (error) {
+			fprintf(stderr,
+	_("%s: cannot queue AG %u header init: %s\n"),
+					progname, agno, strerror(error));
+			exit(1);
+		}
+	}
+
+	error = -workqueue_terminate(&wq);
+	if (error) {
+		fprintf(stderr, _("%s: AG header threads failed: %s\n"),
+				progname, strerror(error));
+		exit(1);
+	}
+	workqueue_destroy(&wq);
+	pthread_mutex_destroy(&aw.lock);
+
+	return aw.worst_freelist;
+}
+
 static void
 initialise_ag_freespace(
 	struct xfs_mount	*mp,
@@ -3690,6 +3956,13 @@ rewrite_secondary_superblocks(
 	struct xfs_dsb		*dsb;
 	int			error;
 
+	/* start reading the middle one while we do the last one */
+	if (mp->m_sb.sb_agcount > 2)
+		libxfs_buf_readahead(mp->m_dev,
+				XFS_AGB_TO_DADDR(mp, (mp->m_sb.sb_agcount - 1) / 2,
+					XFS_SB_DADDR),
+				XFS_FSS_TO_BB(mp, 1), &xfs_sb_buf_ops);
+
 	/* rewrite the last superblock */
 	error = -libxfs_buf_read(mp->m_dev,
 			XFS_AGB_TO_DADDR(mp, mp->m_sb.sb_agcount - 1,
@@ -3831,6 +4104,8 @@ main(
 	int			quiet = 0;
 	char			*protofile = NULL;
 	char			*protostring = NULL;
+	char			*agefile = NULL;
+	struct age_profile	*ageprof;
 	int			worst_freelist = 0;
 
 	struct libxfs_xinit	xi = {
@@ -3879,7 +4154,6 @@ main(
 		},
 	};
 
-	struct list_head	buffer_list;
 	int			error;
 
 	platform_uuid_generate(&cli.uuid);
@@ -3906,8 +4180,13 @@ main(
 	memcpy(&cli.sb_feat, &dft.sb_feat, sizeof(cli.sb_feat));
 	memcpy(&cli.fsx, &dft.fsx, sizeof(cli.fsx));
 
-	while ((c = getopt(argc, argv, "b:c:d:i:l:L:m:n:KNp:qr:s:CfV")) != EOF) {
+	while ((c = getopt(argc, argv, "a:b:c:d:i:l:L:m:n:KNp:qr:s:CfV")) != EOF) {
 		switch (c) {
+		case 'a':
+			if (agefile)
+				respec('a', NULL, 0);
+			agefile = optarg;
+			break;
 		case 'C':
 		case 'f':
 			force_overwrite = 1;
@@ -3966,6 +4245,7 @@ main(
 	cfgfile_parse(&cli);
 
 	protostring = setup_proto(protofile);
+	ageprof = setup_age(agefile);
 
 	/*
 	 * Extract as much of the valid config as we can from the CLI input
@@ -4020,7 +4300,7 @@ main(
 	 * dependent on device sizes. Once calculated, make sure everything
 	 * aligns to device geometry correctly.
 	 */
-	calculate_initial_ag_geometry(&cfg, &cli);
+	calculate_initial_ag_geometry(&cfg, &cli, quiet);
 	align_ag_geometry(&cfg);
 
 	calculate_imaxpct(&cfg, &cli);
@@ -4066,7 +4346,7 @@ main(
 	 * All values have been validated, discard the old device layout.
 	 */
 	if (discard && !dry_run)
-		discard_devices(&xi, quiet);
+		discard_devices(&xi, cli.discardfree, quiet);
 
 	/*
 	 * we need the libxfs buffer cache from here on in.
@@ -4089,29 +4369,8 @@ main(
 	/*
 	 * Initialise all the static on disk metadata.
 	 */
-	INIT_LIST_HEAD(&buffer_list);
-	for (agno = 0; agno < cfg.agcount; agno++) {
-		initialise_ag_headers(&cfg, mp, agno, &worst_freelist,
-				&buffer_list);
-
-		if (agno % 16)
-			continue;
-
-		error = -libxfs_buf_delwri_submit(&buffer_list);
-		if (error) {
-			fprintf(stderr,
-	_("%s: writing AG headers failed, err=%d\n"),
-					progname, error);
-			exit(1);
-		}
-	}
-
-	error = -libxfs_buf_delwri_submit(&buffer_list);
-	if (error) {
-		fprintf(stderr, _("%s: writing AG headers failed, err=%d\n"),
-				progname, error);
-		exit(1);
-	}
+	worst_freelist = initialise_all_ag_headers(&cfg, &xi, mp,
+			discard && cli.discardfree && !dry_run);
 
 	/*
 	 * Initialise the freespace freelists (i.e. AGFLs) in each AG.
@@ -4124,6 +4383,12 @@ main(
 	 */
 	parse_proto(mp, &cli.fsx, &protostring);
 
+	/*
+	 * Fill the filesystem up with whatever the aging profile asks for.
+	 */
+	if (ageprof)
+		age_filesystem(mp, &cli.fsx, ageprof);
+
 	/*
 	 * Protect ourselves against possible stupidity
 	 */
@@ -8,10 +8,14 @@
 #include "input.h"
 #include "init.h"
 #include "quota.h"
+#include "libfrog/dirwalk.h"
+#include "libfrog/platform.h"
 
 static cmdinfo_t project_cmd;
 static prid_t prid;
 static int recurse_depth = -1;
+static int nr_threads;
+static int verbose;
 
 enum {
 	CHECK_PROJECT	= 0x1,
@@ -73,170 +77,212 @@ project_help(void)
 " below the command line arguments. -d 0 means only apply the actions\n"
 " to the top level of the projects. -d -1 means no recursion limit (default).\n"
 "\n"
+" The tree is walked with one thread per CPU; -j <threads> sets how many.\n"
+" Entries are visited in no particular order.  The -v option reports progress\n"
+" and how many inodes were looked at and changed, and how fast.\n"
+"\n"
 " The /etc/projid and /etc/projects file formats are simple, and described\n"
 " on the xfs_quota man page.\n"
 "\n"));
 }
 
-static int
-check_project(
-	const char		*path,
-	const struct stat	*stat,
-	int			flag,
-	struct FTW		*data)
+/*
+ * The tree is walked in parallel, so entries are visited in no particular
+ * order and everything below is done from several threads at once.
+ */
+struct project_walk {
+	int			type;
+	dev_t			dev;		/* stay on this fs, like FTW_MOUNT */
+	uint64_t		nr_inodes;	/* inodes looked at */
+	uint64_t		nr_changed;	/* inodes we had to set */
+	uint64_t		start_ns;
+};
+
+static uint64_t
+project_now_ns(void)
 {
-	struct fsxattr		fsx;
-	int			fd;
+	struct timespec		ts;
 
-	if (recurse_depth >= 0 && data->level > recurse_depth)
-		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	if (flag == FTW_NS ){
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot stat file %s\n"), progname, path);
-		return 0;
-	}
-	if (EXCLUDED_FILE_TYPES(stat->st_mode)) {
-		fprintf(stderr, _("%s: skipping special file %s\n"), progname, path);
-		return 0;
-	}
+static double
+project_rate(
+	struct project_walk	*pw,
+	uint64_t		nr_inodes)
+{
+	uint64_t		ns = project_now_ns() - pw->start_ns;
 
-	if ((fd = open(path, O_RDONLY|O_NOCTTY)) == -1) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot open %s: %s\n"),
-			progname, path, strerror(errno));
-	} else if ((xfsctl(path, fd, FS_IOC_FSGETXATTR, &fsx)) < 0) {
+	return ns ? nr_inodes * 1000000000.0 / ns : 0.0;
+}
+
+/* Does this inode already have the settings we are about to give it? */
+static bool
+project_is_set(
+	struct project_walk	*pw,
+	const struct stat	*st,
+	const struct fsxattr	*fsx)
+{
+	bool			inherit = fsx->fsx_xflags & FS_XFLAG_PROJINHERIT;
+
+	if (pw->type == SETUP_PROJECT)
+		return fsx->fsx_projid == prid &&
+		       (inherit || !S_ISDIR(st->st_mode));
+	return fsx->fsx_projid == 0 && !inherit;
+}
+
+static void
+project_inode(
+	struct project_walk	*pw,
+	const char		*path,
+	int			fd,
+	const struct stat	*st)
+{
+	struct fsxattr		fsx;
+
+	if (xfsctl(path, fd, FS_IOC_FSGETXATTR, &fsx) < 0) {
 		exitcode = 1;
 		fprintf(stderr, _("%s: cannot get flags on %s: %s\n"),
 			progname, path, strerror(errno));
-	} else {
+		return;
+	}
+
+	if (pw->type == CHECK_PROJECT) {
 		if (fsx.fsx_projid != prid)
 			printf(_("%s - project identifier is not set"
 				 " (inode=%u, tree=%u)\n"),
 				path, fsx.fsx_projid, (unsigned int)prid);
-		if (!(fsx.fsx_xflags & FS_XFLAG_PROJINHERIT) && S_ISDIR(stat->st_mode))
+		if (!(fsx.fsx_xflags & FS_XFLAG_PROJINHERIT) &&
+		    S_ISDIR(st->st_mode))
 			printf(_("%s - project inheritance flag is not set\n"),
 				path);
+		return;
 	}
-	if (fd != -1)
-		close(fd);
-	return 0;
-}
 
-static int
-clear_project(
-	const char		*path,
-	const struct stat	*stat,
-	int			flag,
-	struct FTW		*data)
-{
-	struct fsxattr		fsx;
-	int			fd;
+	/* most of a tree that is set up again is already right */
+	if (project_is_set(pw, st, &fsx))
+		return;
 
-	if (recurse_depth >= 0 && data->level > recurse_depth)
-		return 0;
-
-	if (flag == FTW_NS ){
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot stat file %s\n"), progname, path);
-		return 0;
-	}
-	if (EXCLUDED_FILE_TYPES(stat->st_mode)) {
-		fprintf(stderr, _("%s: skipping special file %s\n"), progname, path);
-		return 0;
-	}
-
-	if ((fd = open(path, O_RDONLY|O_NOCTTY)) == -1) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot open %s: %s\n"),
-			progname, path, strerror(errno));
-		return 0;
-	} else if (xfsctl(path, fd, FS_IOC_FSGETXATTR, &fsx) < 0) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot get flags on %s: %s\n"),
-			progname, path, strerror(errno));
-		close(fd);
-		return 0;
+	if (pw->type == SETUP_PROJECT) {
+		fsx.fsx_projid = prid;
+		fsx.fsx_xflags |= FS_XFLAG_PROJINHERIT;
+	} else {
+		fsx.fsx_projid = 0;
+		fsx.fsx_xflags &= ~FS_XFLAG_PROJINHERIT;
 	}
-
-	fsx.fsx_projid = 0;
-	fsx.fsx_xflags &= ~FS_XFLAG_PROJINHERIT;
 	if (xfsctl(path, fd, FS_IOC_FSSETXATTR, &fsx) < 0) {
 		exitcode = 1;
-		fprintf(stderr, _("%s: cannot clear project on %s: %s\n"),
+		fprintf(stderr, pw->type == SETUP_PROJECT ?
+			_("%s: cannot set project on %s: %s\n") :
+			_("%s: cannot clear project on %s: %s\n"),
 			progname, path, strerror(errno));
+		return;
 	}
-	close(fd);
-	return 0;
+	__atomic_add_fetch(&pw->nr_changed, 1, __ATOMIC_RELAXED);
 }
 
 static int
-setup_project(
+project_visit(
 	const char		*path,
-	const struct stat	*stat,
-	int			flag,
-	struct FTW		*data)
+	int			dirfd,
+	const char		*name,
+	unsigned char		d_type,
+	int			depth,
+	void			*arg)
 {
-	struct fsxattr		fsx;
+	struct project_walk	*pw = arg;
+	struct stat		st;
+	uint64_t		nr;
 	int			fd;
 
-	if (recurse_depth >= 0 && data->level > recurse_depth)
-		return 0;
-
-	if (flag == FTW_NS ){
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
 		exitcode = 1;
 		fprintf(stderr, _("%s: cannot stat file %s\n"), progname, path);
 		return 0;
 	}
-	if (EXCLUDED_FILE_TYPES(stat->st_mode)) {
+	if (depth == 0)
+		pw->dev = st.st_dev;
+	else if (st.st_dev != pw->dev)
+		return 0;
+	if (EXCLUDED_FILE_TYPES(st.st_mode)) {
 		fprintf(stderr, _("%s: skipping special file %s\n"), progname, path);
 		return 0;
 	}
 
-	if ((fd = open(path, O_RDONLY|O_NOCTTY)) == -1) {
+	fd = openat(dirfd, name, O_RDONLY | O_NOCTTY | O_NOFOLLOW);
+	if (fd < 0) {
 		exitcode = 1;
 		fprintf(stderr, _("%s: cannot open %s: %s\n"),
 			progname, path, strerror(errno));
-		return 0;
-	} else if (xfsctl(path, fd, FS_IOC_FSGETXATTR, &fsx) < 0) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot get flags on %s: %s\n"),
-			progname, path, strerror(errno));
+	} else {
+		project_inode(pw, path, fd, &st);
 		close(fd);
-		return 0;
 	}
 
-	fsx.fsx_projid = prid;
-	fsx.fsx_xflags |= FS_XFLAG_PROJINHERIT;
-	if (xfsctl(path, fd, FS_IOC_FSSETXATTR, &fsx) < 0) {
-		exitcode = 1;
-		fprintf(stderr, _("%s: cannot set project on %s: %s\n"),
-			progname, path, strerror(errno));
-	}
-	close(fd);
+	nr = __atomic_add_fetch(&pw->nr_inodes, 1, __ATOMIC_RELAXED);
+	if (verbose && nr % 100000 == 0)
+		fprintf(stderr, _("%s: %llu inodes, %.0f inodes/s\n"),
+			progname, (unsigned long long)nr,
+			project_rate(pw, nr));
+
+	if (S_ISDIR(st.st_mode) &&
+	    (recurse_depth < 0 || depth < recurse_depth))
+		return DIRWALK_DESCEND;
 	return 0;
 }
 
+static void
+project_walk_error(
+	const char		*path,
+	int			error,
+	void			*arg)
+{
+	exitcode = 1;
+	fprintf(stderr, _("%s: cannot read directory %s: %s\n"),
+		progname, path, strerror(error));
+}
+
 static void
 project_operations(
 	char		*project,
 	char		*dir,
 	int		type)
 {
+	struct project_walk	pw = {
+		.type		= type,
+		.start_ns	= project_now_ns(),
+	};
+	int			error;
+
 	switch (type) {
 	case CHECK_PROJECT:
 		printf(_("Checking project %s (path %s)...\n"), project, dir);
-		nftw(dir, check_project, 100, FTW_PHYS|FTW_MOUNT);
 		break;
 	case SETUP_PROJECT:
 		printf(_("Setting up project %s (path %s)...\n"), project, dir);
-		nftw(dir, setup_project, 100, FTW_PHYS|FTW_MOUNT);
 		break;
 	case CLEAR_PROJECT:
 		printf(_("Clearing project %s (path %s)...\n"), project, dir);
-		nftw(dir, clear_project, 100, FTW_PHYS|FTW_MOUNT);
 		break;
 	}
+	fflush(stdout);
+
+	error = -dirwalk(dir, nr_threads, project_visit, project_walk_error,
+			&pw);
+	if (error) {
+		exitcode = 1;
+		fprintf(stderr, _("%s: cannot walk %s: %s\n"),
+			progname, dir, strerror(error));
+	}
+
+	if (verbose)
+		printf(_("%s: %llu inodes, %llu changed, %.1f seconds, "
+			 "%.0f inodes/s\n"), dir,
+			(unsigned long long)pw.nr_inodes,
+			(unsigned long long)pw.nr_changed,
+			(project_now_ns() - pw.start_ns) / 1000000000.0,
+			project_rate(&pw, pw.nr_inodes));
 }
 
 static void
@@ -269,7 +315,9 @@ project_f(
 {
 	int		c, type = 0, ispath = 0, error = 0;
 
-	while ((c = getopt(argc, argv, "cd:p:sC")) != EOF) {
+	nr_threads = platform_nproc();
+	verbose = 0;
+	while ((c = getopt(argc, argv, "cd:j:p:svC")) != EOF) {
 		switch (c) {
 		case 'c':
 			type = CHECK_PROJECT;
@@ -279,6 +327,11 @@ project_f(
 			if (recurse_depth < 0)
 				recurse_depth = -1;
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1)
+				nr_threads = 1;
+			break;
 		case 'p':
 			ispath = 1;
 			error = fs_table_insert_project_path(optarg, -1);
@@ -292,6 +345,9 @@ _("%s: cannot setup path for project dir %s: %s\n"),
 		case 's':
 			type = SETUP_PROJECT;
 			break;
+		case 'v':
+			verbose = 1;
+			break;
 		case 'C':
 			type = CLEAR_PROJECT;
 			break;
@@ -344,7 +400,7 @@ project_init(void)
 	project_cmd.name = "project";
 	project_cmd.altname = "tree";
 	project_cmd.cfunc = project_f;
-	project_cmd.args = _("[-c|-s|-C|-d <depth>|-p <path>] project ...");
+	project_cmd.args = _("[-c|-s|-C|-d <depth>|-j <threads>|-p <path>|-v] project ...");
 	project_cmd.argmin = 1;
 	project_cmd.argmax = -1;
 	project_cmd.oneline = _("check, setup or clear project quota trees");
@@ -10,10 +10,21 @@
 #include <pwd.h>
 #include <grp.h>
 #include "init.h"
+#include "input.h"
 #include "quota.h"
 #include "libfrog/logging.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
+#include "libfrog/platform.h"
+
+/* Per-ID histogram of file sizes for -H, in power of two KB buckets. */
+#define QHIST		32
+struct du_hist {
+	uint64_t	nfiles[QHIST];
+	uint64_t	blocks[QHIST];
+};
 
 typedef struct du {
 	struct du	*next;
@@ -23,20 +34,29 @@ typedef struct du {
 	uint64_t	blocks90;
 	uint64_t	nfiles;
 	uint32_t	id;
+	struct du_hist	*hist;
 } du_t;
 
 #define	TSIZE		500
-static uint64_t	sizes[TSIZE];
-static uint64_t	overflow;
-
-#define	NDU		60000
 #define	DUHASH		8209
-static du_t		du[3][NDU];
-static du_t		*duhash[3][DUHASH];
-static int		ndu[3];	/* #usr/grp/prj */
 
-#define NBSTAT 		4069
+/*
+ * Everything one scan adds up.  Each thread sweeping the filesystem gets
+ * its own, so there's no locking while we're scanning, and they're all
+ * merged into one when the sweep is done.
+ */
+struct quot_tally {
+	uint64_t	sizes[TSIZE];
+	uint64_t	overflow;
+	du_t		*duhash[3][DUHASH];
+	int		ndu[3];	/* #usr/grp/prj */
+};
+
+static struct quot_tally	total;
+static du_t			*du[3];	/* sorted for report */
+static unsigned int		nr_threads;
 
+#define NBSTAT 		4069
 static time_t now;
 static cmdinfo_t quot_cmd;
 
@@ -60,6 +80,10 @@ quot_help(void)
 " -b -- display number of blocks used\n"
 " -i -- display number of inodes used\n"
 " -r -- display number of realtime blocks used\n"
+" -H -- after each user/group/project, display a histogram of its file\n"
+"       sizes: the range in kilobytes, the number of files in that range,\n"
+"       and the kilobytes they use.\n"
+" -j -- scan this many allocation groups in parallel (default: one per CPU)\n"
 " -n -- skip identifier-to-name translations, just report IDs\n"
 " -N -- suppress the initial header\n"
 " -f -- send output to a file\n"
@@ -68,15 +92,60 @@ quot_help(void)
 "\n"));
 }
 
+/* Find the entry for @id in table @i, adding one if there isn't one. */
+static du_t *
+quot_du_get(
+	struct quot_tally	*qt,
+	int			i,
+	uint32_t		id,
+	uint			flags)
+{
+	du_t			**hp = &qt->duhash[i][id % DUHASH];
+	du_t			*dp;
+
+	for (dp = *hp; dp; dp = dp->next)
+		if (dp->id == id)
+			return dp;
+
+	dp = calloc(1, sizeof(*dp));
+	if (!dp)
+		return NULL;
+	if (flags & PER_ID_HIST_FLAG) {
+		dp->hist = calloc(1, sizeof(*dp->hist));
+		if (!dp->hist) {
+			free(dp);
+			return NULL;
+		}
+	}
+	dp->id = id;
+	dp->next = *hp;
+	*hp = dp;
+	qt->ndu[i]++;
+	return dp;
+}
+
+static inline unsigned int
+quot_hist_bucket(
+	uint64_t	size)
+{
+	unsigned int	b;
+
+	if (size == 0)
+		return 0;
+	b = 64 - __builtin_clzll(size);
+	return min(b, QHIST - 1);
+}
+
 static void
 quot_bulkstat_add(
+	struct quot_tally	*qt,
 	struct xfs_bulkstat	*p,
 	uint		flags)
 {
 	du_t		*dp;
-	du_t		**hp;
 	uint64_t	size;
 	uint32_t	i, id;
+	unsigned int	b;
 
 	if ((p->bs_mode & S_IFMT) == 0)
 		return;
@@ -86,32 +155,18 @@ quot_bulkstat_add(
 		if (!(S_ISDIR(p->bs_mode) || S_ISREG(p->bs_mode)))
 			return;
 		if (size >= TSIZE) {
-			overflow += size;
+			qt->overflow += size;
 			size = TSIZE - 1;
 		}
-		sizes[(int)size]++;
+		qt->sizes[(int)size]++;
 		return;
 	}
 	for (i = 0; i < 3; i++) {
 		id = (i == 0) ? p->bs_uid : ((i == 1) ?
 			p->bs_gid : p->bs_projectid);
-		hp = &duhash[i][id % DUHASH];
-		for (dp = *hp; dp; dp = dp->next)
-			if (dp->id == id)
-				break;
-		if (dp == NULL) {
-			if (ndu[i] >= NDU)
-				return;
-			dp = &du[i][(ndu[i]++)];
-			dp->next = *hp;
-			*hp = dp;
-			dp->id = id;
-			dp->nfiles = 0;
-			dp->blocks = 0;
-			dp->blocks30 = 0;
-			dp->blocks60 = 0;
-			dp->blocks90 = 0;
-		}
+		dp = quot_du_get(qt, i, id, flags);
+		if (dp == NULL)
+			return;
 		dp->blocks += size;
 
 		if (now - p->bs_atime > 30 * (60*60*24))
@@ -121,54 +176,232 @@ quot_bulkstat_add(
 		if (now - p->bs_atime > 90 * (60*60*24))
 			dp->blocks90 += size;
 		dp->nfiles++;
+		if (dp->hist) {
+			b = quot_hist_bucket(size);
+			dp->hist->nfiles[b]++;
+			dp->hist->blocks[b] += size;
+		}
 	}
 }
 
+/* Free every entry in a tally and clear it for the next scan. */
+static void
+quot_tally_reset(
+	struct quot_tally	*qt)
+{
+	du_t			*dp, *next;
+	int			i, h;
+
+	for (i = 0; i < 3; i++) {
+		for (h = 0; h < DUHASH; h++) {
+			for (dp = qt->duhash[i][h]; dp; dp = next) {
+				next = dp->next;
+				free(dp->hist);
+				free(dp);
+			}
+		}
+	}
+	memset(qt, 0, sizeof(*qt));
+}
+
+/* Fold one thread's tally into the total, then throw it away. */
+static int
+quot_tally_merge(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*foreach_arg)
+{
+	struct quot_tally	*qt = data;
+	uint			flags = *(uint *)foreach_arg;
+	du_t			*dp, *tp;
+	int			i, h, b;
+
+	for (i = 0; i < TSIZE; i++)
+		total.sizes[i] += qt->sizes[i];
+	total.overflow += qt->overflow;
+
+	for (i = 0; i < 3; i++) {
+		for (h = 0; h < DUHASH; h++) {
+			for (dp = qt->duhash[i][h]; dp; dp = dp->next) {
+				tp = quot_du_get(&total, i, dp->id, flags);
+				if (!tp)
+					return ENOMEM;
+				tp->blocks += dp->blocks;
+				tp->blocks30 += dp->blocks30;
+				tp->blocks60 += dp->blocks60;
+				tp->blocks90 += dp->blocks90;
+				tp->nfiles += dp->nfiles;
+				if (!dp->hist)
+					continue;
+				for (b = 0; b < QHIST; b++) {
+					tp->hist->nfiles[b] +=
+							dp->hist->nfiles[b];
+					tp->hist->blocks[b] +=
+							dp->hist->blocks[b];
+				}
+			}
+		}
+	}
+	quot_tally_reset(qt);
+	return 0;
+}
+
+struct quot_sweep {
+	struct xfs_fd		*xfd;
+	struct ptvar		*tallies;
+	uint			flags;
+	int			error;
+};
+
+/* Bulkstat every inode in @agno, or in the whole fs if NULLAGNUMBER. */
+static int
+quot_bulkstat_ag(
+	struct xfs_fd		*fsxfd,
+	struct quot_tally	*qt,
+	uint32_t		agno,
+	uint			flags)
+{
+	struct xfs_fd		xfd = *fsxfd;	/* per thread */
+	struct xfs_bulkstat_req	*breq;
+	int			i, sts;
+
+	sts = -xfrog_bulkstat_alloc_req(NBSTAT, 0, &breq);
+	if (sts) {
+		xfrog_perror(sts, "calloc");
+		return sts;
+	}
+	if (agno != NULLAGNUMBER)
+		xfrog_bulkstat_set_ag(breq, agno);
+
+	while ((sts = -xfrog_bulkstat(&xfd, breq)) == 0) {
+		if (breq->hdr.ocount == 0)
+			break;
+		for (i = 0; i < breq->hdr.ocount; i++)
+			quot_bulkstat_add(qt, &breq->bulkstat[i], flags);
+	}
+	if (sts)
+		xfrog_perror(sts, "XFS_IOC_FSBULKSTAT");
+	free(breq);
+	return sts;
+}
+
+static void
+quot_bulkstat_work(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	struct quot_sweep	*qs = wq->wq_ctx;
+	struct quot_tally	*qt;
+	int			ret;
+
+	qt = ptvar_get(qs->tallies, &ret);
+	if (!ret)
+		ret = quot_bulkstat_ag(qs->xfd, qt, agno, qs->flags);
+	if (ret)
+		qs->error = ret;
+}
+
+/* Sweep the AGs nr_threads at a time, each thread tallying for itself. */
+static int
+quot_bulkstat_sweep(
+	struct xfs_fd		*fsxfd,
+	uint			flags)
+{
+	struct quot_sweep	qs = {
+		.xfd		= fsxfd,
+		.flags		= flags,
+	};
+	struct workqueue	wq;
+	uint32_t		agno;
+	unsigned int		nr = min(nr_threads, fsxfd->fsgeom.agcount);
+	int			ret;
+
+	ret = -ptvar_alloc(nr, sizeof(struct quot_tally), &qs.tallies);
+	if (ret) {
+		xfrog_perror(ret, "ptvar_alloc");
+		return ret;
+	}
+	ret = -workqueue_create(&wq, &qs, nr);
+	if (ret) {
+		xfrog_perror(ret, "workqueue_create");
+		goto out_tallies;
+	}
+	for (agno = 0; !ret && agno < fsxfd->fsgeom.agcount; agno++)
+		ret = -workqueue_add(&wq, quot_bulkstat_work, agno, NULL);
+	if (ret)
+		xfrog_perror(ret, "workqueue_add");
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+	if (!ret)
+		ret = qs.error;
+
+	/* merge even after an error, it frees the per-thread entries */
+	if (ptvar_foreach(qs.tallies, quot_tally_merge, &flags) && !ret) {
+		ret = ENOMEM;
+		xfrog_perror(ret, "merging usage");
+	}
+out_tallies:
+	ptvar_free(qs.tallies);
+	return ret;
+}
+
+/* Flatten table @i of the total into du[i] so that it can be sorted. */
+static void
+quot_flatten(
+	int		i)
+{
+	du_t		*dp;
+	int		h, n = 0;
+
+	free(du[i]);
+	du[i] = calloc(max(total.ndu[i], 1), sizeof(du_t));
+	if (!du[i]) {
+		total.ndu[i] = 0;
+		return;
+	}
+	for (h = 0; h < DUHASH; h++)
+		for (dp = total.duhash[i][h]; dp; dp = dp->next)
+			du[i][n++] = *dp;
+}
+
 static void
 quot_bulkstat_mount(
 	char			*fsdir,
 	unsigned int		flags)
 {
 	struct xfs_fd		fsxfd = XFS_FD_INIT_EMPTY;
-	struct xfs_bulkstat_req	*breq;
-	int			i, sts, ret;
-	du_t			**dp;
+	struct quot_tally	*qt;
+	int			i, ret;
 
 	/*
 	 * Initialize tables between checks; because of the qsort
 	 * in report() the hash tables must be rebuilt each time.
 	 */
-	for (sts = 0; sts < TSIZE; sts++)
-		sizes[sts] = 0;
-	overflow = 0;
-	for (i = 0; i < 3; i++)
-		for (dp = duhash[i]; dp < &duhash[i][DUHASH]; dp++)
-			*dp = NULL;
-	ndu[0] = ndu[1] = ndu[2] = 0;
+	quot_tally_reset(&total);
 
 	ret = -xfd_open(&fsxfd, fsdir, O_RDONLY);
 	if (ret) {
 		xfrog_perror(ret, fsdir);
-		return;
-	}
-
-	ret = -xfrog_bulkstat_alloc_req(NBSTAT, 0, &breq);
-	if (ret) {
-		xfrog_perror(ret, "calloc");
-		xfd_close(&fsxfd);
-		return;
+		goto flatten;
 	}
 
-	while ((sts = -xfrog_bulkstat(&fsxfd, breq)) == 0) {
-		if (breq->hdr.ocount == 0)
-			break;
-		for (i = 0; i < breq->hdr.ocount; i++)
-			quot_bulkstat_add(&breq->bulkstat[i], flags);
+	if (nr_threads > 1 && fsxfd.fsgeom.agcount > 1) {
+		quot_bulkstat_sweep(&fsxfd, flags);
+	} else {
+		qt = calloc(1, sizeof(*qt));
+		if (!qt) {
+			perror("calloc");
+		} else {
+			quot_bulkstat_ag(&fsxfd, qt, NULLAGNUMBER, flags);
+			quot_tally_merge(NULL, qt, &flags);
+			free(qt);
+		}
 	}
-	if (sts < 0)
-		xfrog_perror(sts, "XFS_IOC_FSBULKSTAT");
-	free(breq);
 	xfd_close(&fsxfd);
+flatten:
+	for (i = 0; i < 3; i++)
+		quot_flatten(i);
 }
 
 static int
@@ -192,6 +425,33 @@ qcompare(
 
 typedef char *(*idtoname_t)(uint32_t);
 
+/*
+ * Print an ID's file size histogram for -H: the range of sizes in
+ * kilobytes, then the number of files and kilobytes in that range.
+ */
+static void
+quot_report_hist(
+	FILE		*fp,
+	struct du_hist	*hist)
+{
+	unsigned long long lo, hi;
+	int		b;
+
+	for (b = 0; b < QHIST; b++) {
+		if (!hist->nfiles[b])
+			continue;
+		lo = b ? 1ULL << (b - 1) : 0;
+		hi = b ? (1ULL << b) - 1 : 0;
+		if (b == QHIST - 1)
+			fprintf(fp, "\t%llu+", lo);
+		else
+			fprintf(fp, "\t%llu-%llu", lo, hi);
+		fprintf(fp, "\t%llu\t%llu\n",
+			(unsigned long long) hist->nfiles[b],
+			(unsigned long long) hist->blocks[b]);
+	}
+}
+
 static void
 quot_report_mount_any_type(
 	FILE		*fp,
@@ -203,12 +463,13 @@ quot_report_mount_any_type(
 	fs_path_t	*mount,
 	uint		flags)
 {
+	du_t		*end = dp + count;
 	char		*cp;
 
 	fprintf(fp, _("%s (%s) %s:\n"),
 		mount->fs_name, mount->fs_dir, type_to_string(type));
 	qsort(dp, count, sizeof(dp[0]), qcompare);
-	for (; dp < &dp[count]; dp++) {
+	for (; dp < end; dp++) {
 		if (dp->blocks == 0)
 			return;
 		fprintf(fp, "%8llu    ", (unsigned long long) dp->blocks);
@@ -226,6 +487,8 @@ quot_report_mount_any_type(
 			       (unsigned long long) dp->blocks60,
 			       (unsigned long long) dp->blocks90);
 		fputc('\n', fp);
+		if (dp->hist)
+			quot_report_hist(fp, dp->hist);
 	}
 }
 
@@ -239,16 +502,16 @@ quot_report_mount(
 {
 	switch (type) {
 	case XFS_GROUP_QUOTA:
-		quot_report_mount_any_type(fp, du[1], ndu[1], gid_to_name,
-						form, type, mount, flags);
+		quot_report_mount_any_type(fp, du[1], total.ndu[1],
+				gid_to_name, form, type, mount, flags);
 		break;
 	case XFS_PROJ_QUOTA:
-		quot_report_mount_any_type(fp, du[2], ndu[2], prid_to_name,
-						form, type, mount, flags);
+		quot_report_mount_any_type(fp, du[2], total.ndu[2],
+				prid_to_name, form, type, mount, flags);
 		break;
 	case XFS_USER_QUOTA:
-		quot_report_mount_any_type(fp, du[0], ndu[0], uid_to_name,
-						form, type, mount, flags);
+		quot_report_mount_any_type(fp, du[0], total.ndu[0],
+				uid_to_name, form, type, mount, flags);
 	}
 }
 
@@ -283,15 +546,15 @@ quot_histogram_mount(
 	fprintf(fp, _("%s (%s):\n"), mount->fs_name, mount->fs_dir);
 
 	for (i = 0; i < TSIZE - 1; i++)
-		if (sizes[i] > 0) {
-			t += sizes[i] * i;
+		if (total.sizes[i] > 0) {
+			t += total.sizes[i] * i;
 			fprintf(fp, _("%d\t%llu\t%llu\n"), i,
-			       (unsigned long long) sizes[i],
+			       (unsigned long long) total.sizes[i],
 			       (unsigned long long) t);
 		}
 	fprintf(fp, _("%d\t%llu\t%llu\n"), TSIZE - 1,
-		(unsigned long long) sizes[TSIZE - 1],
-		(unsigned long long) (overflow + t));
+		(unsigned long long) total.sizes[TSIZE - 1],
+		(unsigned long long) (total.overflow + t));
 }
 
 static void
@@ -333,7 +596,8 @@ quot_f(
 	char		*fname = NULL;
 	int		c, flags = 0, type = 0, form = 0;
 
-	while ((c = getopt(argc, argv, "abcf:ghinpruv")) != EOF) {
+	nr_threads = platform_nproc();
+	while ((c = getopt(argc, argv, "abcf:gHij:npruv")) != EOF) {
 		switch (c) {
 		case 'f':
 			fname = optarg;
@@ -362,6 +626,14 @@ quot_f(
 		case 'c':
 			flags |= HISTOGRAM_FLAG;
 			break;
+		case 'H':
+			flags |= PER_ID_HIST_FLAG;
+			break;
+		case 'j':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno || nr_threads == 0)
+				return command_usage(&quot_cmd);
+			break;
 		case 'n':
 			flags |= NO_LOOKUP_FLAG;
 			break;
@@ -408,7 +680,7 @@ quot_init(void)
 	quot_cmd.cfunc = quot_f;
 	quot_cmd.argmin = 0;
 	quot_cmd.argmax = -1;
-	quot_cmd.args = _("[-bir] [-g|-p|-u] [-acv] [-f file]");
+	quot_cmd.args = _("[-bir] [-g|-p|-u] [-acHv] [-j nr] [-f file]");
 	quot_cmd.oneline = _("summarize filesystem ownership");
 	quot_cmd.help = quot_help;
 
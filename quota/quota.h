@@ -65,6 +65,7 @@ enum {
 	ABSOLUTE_FLAG =		0x0200, /* absolute time, not related to now */
 	NO_LOOKUP_FLAG =	0x0400, /* skip name lookups, just report ID */
 	GETNEXTQUOTA_FLAG =	0x0800, /* use getnextquota quotactl */
+	PER_ID_HIST_FLAG =	0x1000, /* file size histogram for each ID */
 };
 
 /*
@@ -4,6 +4,7 @@
  * All Rights Reserved.
  */
 #include <stdbool.h>
+#include <limits.h>
 #include "command.h"
 #include <sys/types.h>
 #include <pwd.h>
@@ -64,6 +65,7 @@ dump_file(
 	FILE		*fp,
 	uint		id,
 	uint		*oid,
+	uint		upper,
 	uint		type,
 	char		*dev,
 	int		flags)
@@ -86,8 +88,8 @@ dump_file(
 
 	if (oid) {
 		*oid = d.d_id;
-		/* Did kernelspace wrap? */
-		if (*oid < id)
+		/* Did kernelspace wrap, or go past the end of the range? */
+		if (*oid < id || *oid > upper)
 			return 0;
 	}
 
@@ -135,17 +137,36 @@ dump_limits_any_type(
 		return;
 	}
 
-	/* Range was specified; query everything in it */
+	/*
+	 * Range was specified; skip from dquot to dquot with GETNEXTQUOTA if
+	 * we can, or query everything in it if we can't.
+	 */
 	if (upper) {
-		for (id = lower; id <= upper; id++)
-			dump_file(fp, id, NULL, type, mount->fs_name, 0);
+		oid = upper;
+		if (dump_file(fp, lower, &oid, upper, type, mount->fs_name,
+				GETNEXTQUOTA_FLAG)) {
+			while (oid < upper &&
+			       dump_file(fp, oid + 1, &oid, upper, type,
+					mount->fs_name, GETNEXTQUOTA_FLAG))
+				;
+			return;
+		}
+		/* GETNEXTQUOTA worked, there's just nothing in the range */
+		if (oid != upper)
+			return;
+		for (id = lower; id <= upper; id++) {
+			dump_file(fp, id, NULL, upper, type, mount->fs_name, 0);
+			if (id == UINT_MAX)
+				break;
+		}
 		return;
 	}
 
 	/* Use GETNEXTQUOTA if it's available */
-	if (dump_file(fp, id, &oid, type, mount->fs_name, GETNEXTQUOTA_FLAG)) {
+	if (dump_file(fp, id, &oid, UINT_MAX, type, mount->fs_name,
+			GETNEXTQUOTA_FLAG)) {
 		id = oid + 1;
-		while (dump_file(fp, id, &oid, type, mount->fs_name,
+		while (dump_file(fp, id, &oid, UINT_MAX, type, mount->fs_name,
 				 GETNEXTQUOTA_FLAG))
 			id = oid + 1;
 		return;
@@ -157,7 +178,7 @@ dump_limits_any_type(
 			struct group *g;
 			setgrent();
 			while ((g = getgrent()) != NULL)
-				dump_file(fp, g->gr_gid, NULL, type,
+				dump_file(fp, g->gr_gid, NULL, UINT_MAX, type,
 					  mount->fs_name, 0);
 			endgrent();
 			break;
@@ -166,7 +187,7 @@ dump_limits_any_type(
 			struct fs_project *p;
 			setprent();
 			while ((p = getprent()) != NULL)
-				dump_file(fp, p->pr_prid, NULL, type,
+				dump_file(fp, p->pr_prid, NULL, UINT_MAX, type,
 					  mount->fs_name, 0);
 			endprent();
 			break;
@@ -175,7 +196,7 @@ dump_limits_any_type(
 			struct passwd *u;
 			setpwent();
 			while ((u = getpwent()) != NULL)
-				dump_file(fp, u->pw_uid, NULL, type,
+				dump_file(fp, u->pw_uid, NULL, UINT_MAX, type,
 					  mount->fs_name, 0);
 			endpwent();
 			break;
@@ -316,23 +337,179 @@ report_header(
 	fputc('\n', fp);
 }
 
+/*
+ * ID to name lookups for report.  getpwuid() and getgrgid() can go out
+ * to a directory service on every call, so looking up each ID as we
+ * print it is slow.  Instead, read each name database once per report
+ * into an array sorted by ID.  Users and groups that getpwent
+ * and getgrent don't list (some directory services won't enumerate)
+ * are still looked up one at a time.
+ */
+struct id_name {
+	uint32_t	id;
+	uint32_t	seq;		/* first entry for an ID wins */
+	char		*name;
+};
+
+struct id_names {
+	struct id_name	*names;
+	size_t		nr;
+	size_t		max;
+	bool		loaded;
+};
+
+static struct id_names	user_names, group_names, proj_names;
+
+static void
+id_names_add(
+	struct id_names	*idn,
+	uint32_t	id,
+	const char	*name)
+{
+	struct id_name	*n;
+
+	if (idn->nr == idn->max) {
+		size_t	newmax = idn->max ? idn->max * 2 : 256;
+
+		n = realloc(idn->names, newmax * sizeof(*n));
+		if (!n)
+			return;
+		idn->names = n;
+		idn->max = newmax;
+	}
+	n = &idn->names[idn->nr];
+	n->name = strdup(name);
+	if (!n->name)
+		return;
+	n->id = id;
+	n->seq = idn->nr++;
+}
+
 static int
-report_mount(
-	FILE		*fp,
+id_name_cmp(
+	const void	*a,
+	const void	*b)
+{
+	const struct id_name *x = a, *y = b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void
+id_names_load(
+	struct id_names	*idn,
+	uint		type)
+{
+	struct passwd	*u;
+	struct group	*g;
+	fs_project_t	*p;
+	size_t		i, j;
+
+	idn->loaded = true;
+	switch (type) {
+	case XFS_USER_QUOTA:
+		setpwent();
+		while ((u = getpwent()) != NULL)
+			id_names_add(idn, u->pw_uid, u->pw_name);
+		endpwent();
+		break;
+	case XFS_GROUP_QUOTA:
+		setgrent();
+		while ((g = getgrent()) != NULL)
+			id_names_add(idn, g->gr_gid, g->gr_name);
+		endgrent();
+		break;
+	case XFS_PROJ_QUOTA:
+		setprent();
+		while ((p = getprent()) != NULL)
+			id_names_add(idn, p->pr_prid, p->pr_name);
+		endprent();
+		break;
+	}
+	if (!idn->nr)
+		return;
+
+	/* sort by ID and drop all but the first name for each */
+	qsort(idn->names, idn->nr, sizeof(*idn->names), id_name_cmp);
+	for (i = 1, j = 0; i < idn->nr; i++) {
+		if (idn->names[i].id == idn->names[j].id) {
+			free(idn->names[i].name);
+			continue;
+		}
+		idn->names[++j] = idn->names[i];
+	}
+	idn->nr = j + 1;
+}
+
+static void
+id_names_free(
+	struct id_names	*idn)
+{
+	size_t		i;
+
+	for (i = 0; i < idn->nr; i++)
+		free(idn->names[i].name);
+	free(idn->names);
+	memset(idn, 0, sizeof(*idn));
+}
+
+static char *
+id_to_name(
+	uint32_t	id,
+	uint		type)
+{
+	struct id_names	*idn;
+	struct id_name	*n;
+	struct passwd	*u;
+	struct group	*g;
+	size_t		lo, hi, mid;
+
+	if (type == XFS_USER_QUOTA)
+		idn = &user_names;
+	else if (type == XFS_GROUP_QUOTA)
+		idn = &group_names;
+	else
+		idn = &proj_names;
+	if (!idn->loaded)
+		id_names_load(idn, type);
+
+	for (lo = 0, hi = idn->nr; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		n = &idn->names[mid];
+		if (n->id == id)
+			return n->name;
+		if (n->id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* we've read all of the projects file already */
+	if (type == XFS_USER_QUOTA) {
+		u = getpwuid(id);
+		return u ? u->pw_name : NULL;
+	}
+	if (type == XFS_GROUP_QUOTA) {
+		g = getgrgid(id);
+		return g ? g->gr_name : NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Fetch the dquot for @id, or with GETNEXTQUOTA_FLAG, the first one at or
+ * after @id.  Returns 0 or an errno.
+ */
+static int
+report_fetch(
+	fs_disk_quota_t	*d,
 	uint32_t	id,
-	char		*name,
-	uint32_t	*oid,
-	uint		form,
 	uint		type,
-	fs_path_t	*mount,
+	char		*dev,
 	uint		flags)
 {
-	fs_disk_quota_t	d;
-	time64_t	timer;
-	char		*dev = mount->fs_name;
-	char		c[8], h[8], s[8];
-	uint		qflags;
-	int		count;
 	int		cmd;
 
 	if (flags & GETNEXTQUOTA_FLAG)
@@ -341,27 +518,42 @@ report_mount(
 		cmd = XFS_GETQUOTA;
 
 	/* Fall back silently if XFS_GETNEXTQUOTA fails, warn on XFS_GETQUOTA*/
-	if (xfsquotactl(cmd, dev, type, id, (void *)&d) < 0) {
+	if (xfsquotactl(cmd, dev, type, id, (void *)d) < 0) {
 		if (errno != ENOENT && errno != ENOSYS && errno != ESRCH &&
 		    cmd == XFS_GETQUOTA)
 			perror("XFS_GETQUOTA");
-		return 0;
+		return errno;
 	}
 
-	if (oid) {
-		*oid = d.d_id;
-		/* Did kernelspace wrap? */
-		if (* oid < id)
-			return 0;
-	}
+	/* Did kernelspace wrap? */
+	if (d->d_id < id)
+		return ENOENT;
+	return 0;
+}
+
+/* Print one dquot; returns 0 if -t hid it. */
+static int
+report_dquot(
+	FILE		*fp,
+	fs_disk_quota_t	*d,
+	char		*name,
+	uint		form,
+	uint		type,
+	fs_path_t	*mount,
+	uint		flags)
+{
+	time64_t	timer;
+	char		c[8], h[8], s[8];
+	uint		qflags;
+	int		count;
 
 	if (flags & TERSE_FLAG) {
 		count = 0;
-		if ((form & XFS_BLOCK_QUOTA) && d.d_bcount)
+		if ((form & XFS_BLOCK_QUOTA) && d->d_bcount)
 			count++;
-		if ((form & XFS_INODE_QUOTA) && d.d_icount)
+		if ((form & XFS_INODE_QUOTA) && d->d_icount)
 			count++;
-		if ((form & XFS_RTBLOCK_QUOTA) && d.d_rtbcount)
+		if ((form & XFS_RTBLOCK_QUOTA) && d->d_rtbcount)
 			count++;
 		if (!count)
 			return 0;
@@ -371,100 +563,151 @@ report_mount(
 		report_header(fp, form, type, mount, flags);
 
 	if (flags & NO_LOOKUP_FLAG) {
-		fprintf(fp, "#%-10u", d.d_id);
+		fprintf(fp, "#%-10u", d->d_id);
 	} else {
-		if (name == NULL) {
-			if (type == XFS_USER_QUOTA) {
-				struct passwd	*u = getpwuid(d.d_id);
-				if (u)
-					name = u->pw_name;
-			} else if (type == XFS_GROUP_QUOTA) {
-				struct group	*g = getgrgid(d.d_id);
-				if (g)
-					name = g->gr_name;
-			} else if (type == XFS_PROJ_QUOTA) {
-				fs_project_t	*p = getprprid(d.d_id);
-				if (p)
-					name = p->pr_name;
-			}
-		}
+		if (name == NULL)
+			name = id_to_name(d->d_id, type);
 		/* If no name is found, print the id #num instead of (null) */
 		if (name != NULL)
 			fprintf(fp, "%-10s", name);
 		else
-			fprintf(fp, "#%-9u", d.d_id);
+			fprintf(fp, "#%-9u", d->d_id);
 	}
 
 	if (form & XFS_BLOCK_QUOTA) {
-		timer = decode_timer(&d, d.d_btimer, d.d_btimer_hi);
+		timer = decode_timer(d, d->d_btimer, d->d_btimer_hi);
 		qflags = (flags & HUMAN_FLAG);
-		if (d.d_blk_hardlimit && d.d_bcount > d.d_blk_hardlimit)
+		if (d->d_blk_hardlimit && d->d_bcount > d->d_blk_hardlimit)
 			qflags |= LIMIT_FLAG;
-		if (d.d_blk_softlimit && d.d_bcount > d.d_blk_softlimit)
+		if (d->d_blk_softlimit && d->d_bcount > d->d_blk_softlimit)
 			qflags |= QUOTA_FLAG;
 		if (flags & HUMAN_FLAG)
 			fprintf(fp, " %6s %6s %6s  %02d %8s",
-				bbs_to_string(d.d_bcount, c, sizeof(c)),
-				bbs_to_string(d.d_blk_softlimit, s, sizeof(s)),
-				bbs_to_string(d.d_blk_hardlimit, h, sizeof(h)),
-				d.d_bwarns,
+				bbs_to_string(d->d_bcount, c, sizeof(c)),
+				bbs_to_string(d->d_blk_softlimit, s, sizeof(s)),
+				bbs_to_string(d->d_blk_hardlimit, h, sizeof(h)),
+				d->d_bwarns,
 				time_to_string(timer, qflags));
 		else
 			fprintf(fp, " %10llu %10llu %10llu     %02d %9s",
-				(unsigned long long)d.d_bcount >> 1,
-				(unsigned long long)d.d_blk_softlimit >> 1,
-				(unsigned long long)d.d_blk_hardlimit >> 1,
-				d.d_bwarns,
+				(unsigned long long)d->d_bcount >> 1,
+				(unsigned long long)d->d_blk_softlimit >> 1,
+				(unsigned long long)d->d_blk_hardlimit >> 1,
+				d->d_bwarns,
 				time_to_string(timer, qflags));
 	}
 	if (form & XFS_INODE_QUOTA) {
-		timer = decode_timer(&d, d.d_itimer, d.d_itimer_hi);
+		timer = decode_timer(d, d->d_itimer, d->d_itimer_hi);
 		qflags = (flags & HUMAN_FLAG);
-		if (d.d_ino_hardlimit && d.d_icount > d.d_ino_hardlimit)
+		if (d->d_ino_hardlimit && d->d_icount > d->d_ino_hardlimit)
 			qflags |= LIMIT_FLAG;
-		if (d.d_ino_softlimit && d.d_icount > d.d_ino_softlimit)
+		if (d->d_ino_softlimit && d->d_icount > d->d_ino_softlimit)
 			qflags |= QUOTA_FLAG;
 		if (flags & HUMAN_FLAG)
 			fprintf(fp, " %6s %6s %6s  %02d %8s",
-				num_to_string(d.d_icount, c, sizeof(c)),
-				num_to_string(d.d_ino_softlimit, s, sizeof(s)),
-				num_to_string(d.d_ino_hardlimit, h, sizeof(h)),
-				d.d_iwarns,
+				num_to_string(d->d_icount, c, sizeof(c)),
+				num_to_string(d->d_ino_softlimit, s, sizeof(s)),
+				num_to_string(d->d_ino_hardlimit, h, sizeof(h)),
+				d->d_iwarns,
 				time_to_string(timer, qflags));
 		else
 			fprintf(fp, " %10llu %10llu %10llu     %02d %9s",
-				(unsigned long long)d.d_icount,
-				(unsigned long long)d.d_ino_softlimit,
-				(unsigned long long)d.d_ino_hardlimit,
-				d.d_iwarns,
+				(unsigned long long)d->d_icount,
+				(unsigned long long)d->d_ino_softlimit,
+				(unsigned long long)d->d_ino_hardlimit,
+				d->d_iwarns,
 				time_to_string(timer, qflags));
 	}
 	if (form & XFS_RTBLOCK_QUOTA) {
-		timer = decode_timer(&d, d.d_rtbtimer, d.d_rtbtimer_hi);
+		timer = decode_timer(d, d->d_rtbtimer, d->d_rtbtimer_hi);
 		qflags = (flags & HUMAN_FLAG);
-		if (d.d_rtb_hardlimit && d.d_rtbcount > d.d_rtb_hardlimit)
+		if (d->d_rtb_hardlimit && d->d_rtbcount > d->d_rtb_hardlimit)
 			qflags |= LIMIT_FLAG;
-		if (d.d_rtb_softlimit && d.d_rtbcount > d.d_rtb_softlimit)
+		if (d->d_rtb_softlimit && d->d_rtbcount > d->d_rtb_softlimit)
 			qflags |= QUOTA_FLAG;
 		if (flags & HUMAN_FLAG)
 			fprintf(fp, " %6s %6s %6s  %02d %8s",
-				bbs_to_string(d.d_rtbcount, c, sizeof(c)),
-				bbs_to_string(d.d_rtb_softlimit, s, sizeof(s)),
-				bbs_to_string(d.d_rtb_hardlimit, h, sizeof(h)),
-				d.d_rtbwarns,
+				bbs_to_string(d->d_rtbcount, c, sizeof(c)),
+				bbs_to_string(d->d_rtb_softlimit, s, sizeof(s)),
+				bbs_to_string(d->d_rtb_hardlimit, h, sizeof(h)),
+				d->d_rtbwarns,
 				time_to_string(timer, qflags));
 		else
 			fprintf(fp, " %10llu %10llu %10llu     %02d %9s",
-				(unsigned long long)d.d_rtbcount >> 1,
-				(unsigned long long)d.d_rtb_softlimit >> 1,
-				(unsigned long long)d.d_rtb_hardlimit >> 1,
-				d.d_rtbwarns,
+				(unsigned long long)d->d_rtbcount >> 1,
+				(unsigned long long)d->d_rtb_softlimit >> 1,
+				(unsigned long long)d->d_rtb_hardlimit >> 1,
+				d->d_rtbwarns,
 				time_to_string(timer, qflags));
 	}
 	fputc('\n', fp);
 	return 1;
 }
 
+static int
+report_mount(
+	FILE		*fp,
+	uint32_t	id,
+	char		*name,
+	uint32_t	*oid,
+	uint		form,
+	uint		type,
+	fs_path_t	*mount,
+	uint		flags)
+{
+	fs_disk_quota_t	d;
+
+	if (report_fetch(&d, id, type, mount->fs_name, flags))
+		return 0;
+	if (oid)
+		*oid = d.d_id;
+	return report_dquot(fp, &d, name, form, type, mount, flags);
+}
+
+/*
+ * Report on the IDs from @lower to @upper.  GETNEXTQUOTA jumps straight
+ * to the next ID that has a dquot, so a sparse range takes one call per
+ * dquot instead of one per ID.  Returns the updated flags.
+ */
+static uint
+report_range(
+	FILE		*fp,
+	uint		form,
+	uint		type,
+	fs_path_t	*mount,
+	uint		lower,
+	uint		upper,
+	uint		flags)
+{
+	fs_disk_quota_t	d;
+	uint		id = lower;
+	int		error;
+
+	error = report_fetch(&d, id, type, mount->fs_name,
+			GETNEXTQUOTA_FLAG);
+	if (!error || error == ENOENT) {
+		while (!error && d.d_id <= upper) {
+			if (report_dquot(fp, &d, NULL, form, type, mount,
+					flags))
+				flags |= NO_HEADER_FLAG;
+			if (d.d_id == UINT_MAX)
+				break;
+			error = report_fetch(&d, d.d_id + 1, type,
+					mount->fs_name, GETNEXTQUOTA_FLAG);
+		}
+		return flags;
+	}
+
+	/* No GETNEXTQUOTA, so ask about every ID. */
+	for (id = lower; id <= upper; id++) {
+		if (report_mount(fp, id, NULL, NULL, form, type, mount, flags))
+			flags |= NO_HEADER_FLAG;
+		if (id == UINT_MAX)
+			break;
+	}
+	return flags;
+}
+
 static void
 report_user_mount(
 	FILE		*fp,
@@ -478,11 +721,8 @@ report_user_mount(
 	uint		id = 0, oid;
 
 	if (upper) {	/* identifier range specified */
-		for (id = lower; id <= upper; id++) {
-			if (report_mount(fp, id, NULL, NULL,
-					form, XFS_USER_QUOTA, mount, flags))
-				flags |= NO_HEADER_FLAG;
-		}
+		flags = report_range(fp, form, XFS_USER_QUOTA, mount,
+				lower, upper, flags);
 	} else if (report_mount(fp, id, NULL, &oid, form,
 				XFS_USER_QUOTA, mount,
 				flags|GETNEXTQUOTA_FLAG)) {
@@ -520,11 +760,8 @@ report_group_mount(
 	uint		id = 0, oid;
 
 	if (upper) {	/* identifier range specified */
-		for (id = lower; id <= upper; id++) {
-			if (report_mount(fp, id, NULL, NULL,
-					form, XFS_GROUP_QUOTA, mount, flags))
-				flags |= NO_HEADER_FLAG;
-		}
+		flags = report_range(fp, form, XFS_GROUP_QUOTA, mount,
+				lower, upper, flags);
 	} else if (report_mount(fp, id, NULL, &oid, form,
 				XFS_GROUP_QUOTA, mount,
 				flags|GETNEXTQUOTA_FLAG)) {
@@ -561,11 +798,8 @@ report_project_mount(
 	uint		id = 0, oid;
 
 	if (upper) {	/* identifier range specified */
-		for (id = lower; id <= upper; id++) {
-			if (report_mount(fp, id, NULL, NULL,
-					form, XFS_PROJ_QUOTA, mount, flags))
-				flags |= NO_HEADER_FLAG;
-		}
+		flags = report_range(fp, form, XFS_PROJ_QUOTA, mount,
+				lower, upper, flags);
 	} else if (report_mount(fp, id, NULL, &oid, form,
 				XFS_PROJ_QUOTA, mount,
 				flags|GETNEXTQUOTA_FLAG)) {
@@ -745,6 +979,9 @@ report_f(
 
 	if (fname)
 		fclose(fp);
+	id_names_free(&user_names);
+	id_names_free(&group_names);
+	id_names_free(&proj_names);
 	return 0;
 }
 
@@ -24,6 +24,13 @@ init_rebuild(
 
 	bulkload_init_ag(&btr->newbt, sc, oinfo);
 	bulkload_estimate_ag_slack(sc, &btr->bload, free_space);
+
+	/*
+	 * Write the new btree blocks out in batches as they're formatted
+	 * instead of pinning every buffer until the load finishes, so that the
+	 * memory needed to rebuild a btree doesn't grow with its size.
+	 */
+	btr->bload.max_dirty = XFS_B_TO_FSBT(sc->mp, BULKLOAD_MAX_DIRTY);
 }
 
 /*
@@ -48,11 +55,7 @@ consume_freespace(
 	bno_ext_ptr = find_bno_extent(agno, ext_ptr->ex_startblock);
 	ASSERT(bno_ext_ptr != NULL);
 	get_bno_extent(agno, bno_ext_ptr);
-	release_extent_tree_node(bno_ext_ptr);
-
-	ext_ptr = get_bcnt_extent(agno, ext_ptr->ex_startblock,
-			ext_ptr->ex_blockcount);
-	release_extent_tree_node(ext_ptr);
+	get_bcnt_extent(agno, ext_ptr->ex_startblock, ext_ptr->ex_blockcount);
 
 	/*
 	 * If we only used part of this last extent, then we must reinsert the
@@ -198,7 +201,7 @@ get_bno_rec(
 	if (cur->bc_btnum == XFS_BTNUM_BNO) {
 		if (!prev_value)
 			return findfirst_bno_extent(agno);
-		return findnext_bno_extent(prev_value);
+		return findnext_bno_extent(agno, prev_value);
 	}
 
 	/* cnt btree */
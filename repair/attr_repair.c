@@ -558,6 +558,51 @@ bad_free_out:
 	return -1;
 }
 
+/*
+ * Start reading all the remote values of a leaf block before we check any
+ * of them.  With verifier offload turned on, their crcs are checked by the
+ * readahead threads as the blocks come in, so rmtval_get mostly just copies
+ * the values out.
+ */
+static void
+readahead_leaf_attr_remotes(
+	struct xfs_mount	*mp,
+	xfs_attr_leafblock_t	*leaf,
+	struct xfs_attr3_icleaf_hdr *leafhdr,
+	blkmap_t		*blkmap)
+{
+	struct xfs_attr_leaf_entry *entry = xfs_attr3_leaf_entryp(leaf);
+	int			bufspace;
+	int			i, j;
+
+	bufspace = XFS_ATTR3_RMT_BUF_SPACE(mp, mp->m_sb.sb_blocksize);
+	for (i = 0; i < leafhdr->count; i++, entry++) {
+		struct xfs_attr_leaf_name_remote *remotep;
+		xfs_dablk_t	valueblk;
+		int		valuelen;
+
+		if ((entry->flags & XFS_ATTR_LOCAL) ||
+		    be16_to_cpu(entry->nameidx) >= mp->m_sb.sb_blocksize)
+			continue;
+		remotep = xfs_attr3_leaf_name_remote(leaf, i);
+		valueblk = be32_to_cpu(remotep->valueblk);
+		valuelen = be32_to_cpu(remotep->valuelen);
+		if (valueblk == 0 || valuelen > XFS_XATTR_SIZE_MAX)
+			continue;
+
+		for (j = 0; j < howmany(valuelen, bufspace); j++) {
+			xfs_fsblock_t	bno = blkmap_get(blkmap, valueblk + j);
+
+			if (bno == NULLFSBLOCK)
+				break;
+			libxfs_buf_readahead(mp->m_dev,
+					XFS_FSB_TO_DADDR(mp, bno),
+					XFS_FSB_TO_BB(mp, 1),
+					&xfs_attr3_rmt_buf_ops);
+		}
+	}
+}
+
 static int
 process_leaf_attr_block(
 	xfs_mount_t	*mp,
@@ -589,6 +634,8 @@ process_leaf_attr_block(
 		return 1;
 	}
 
+	readahead_leaf_attr_remotes(mp, leaf, &leafhdr, blkmap);
+
 	attr_freemap = alloc_da_freemap(mp);
 	(void) set_da_freemap(mp, attr_freemap, 0, stop);
 
@@ -789,6 +836,18 @@ process_leaf_attr_level(xfs_mount_t	*mp,
 			goto error_out;
 		}
 
+		/* get the next leaf going while we check this one */
+		if (leafhdr.forw != 0) {
+			xfs_fsblock_t	next = blkmap_get(da_cursor->blkmap,
+							  leafhdr.forw);
+
+			if (next != NULLFSBLOCK)
+				libxfs_buf_readahead(mp->m_dev,
+						XFS_FSB_TO_DADDR(mp, next),
+						XFS_FSB_TO_BB(mp, 1),
+						&xfs_attr3_leaf_buf_ops);
+		}
+
 		/*
 		 * for each block, process the block, verify its path,
 		 * then get next block.  update cursor values along the way
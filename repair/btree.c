@@ -8,10 +8,19 @@
 #include "btree.h"
 
 /*
- * Maximum number of keys per node.  Must be greater than 2 for the code
- * to work.
+ * Nodes are a whole number of cache lines.  The key count and the keys fill
+ * the first half of a node and the pointers the second half, so searching a
+ * node only reads the first half.  BTREE_NODE_LINES sets the fanout: with n
+ * lines a node holds 4n - 1 keys.  It must be at least 1, so that there are
+ * more than 2 keys per node.
  */
-#define BTREE_KEY_MAX		7
+#ifndef BTREE_NODE_LINES
+#define BTREE_NODE_LINES	4
+#endif
+#define BTREE_NODE_ALIGN	64
+
+#define BTREE_KEY_MAX		(BTREE_NODE_LINES * BTREE_NODE_ALIGN / \
+				 (2 * (int)sizeof(unsigned long)) - 1)
 #define BTREE_KEY_MIN		(BTREE_KEY_MAX / 2)
 
 #define BTREE_PTR_MAX		(BTREE_KEY_MAX + 1)
@@ -20,6 +29,20 @@ struct btree_node {
 	unsigned long		num_keys;
 	unsigned long		keys[BTREE_KEY_MAX];
 	struct btree_node	*ptrs[BTREE_PTR_MAX];
+} __attribute__((aligned(BTREE_NODE_ALIGN)));
+
+/*
+ * Each tree carves its nodes out of chunks that double in size up to
+ * BTREE_CHUNK_MAX nodes, and keeps freed nodes on a list of its own.  A tree
+ * is only ever used by one thread at a time, so this needs no locking, and
+ * the chunks all go at once when the tree is torn down.
+ */
+#define BTREE_CHUNK_MIN		4
+#define BTREE_CHUNK_MAX		256
+
+struct btree_chunk {
+	struct btree_chunk	*next;
+	/* nodes start at the next node boundary */
 };
 
 struct btree_cursor {
@@ -38,6 +61,10 @@ struct btree_root {
 	void			*next_value;
 	unsigned long		prev_key;
 	void			*prev_value;
+	/* node pool */
+	struct btree_node	*free_nodes;	/* chained through ptrs[0] */
+	struct btree_chunk	*chunks;
+	unsigned int		chunk_nodes;	/* size of the next chunk */
 #ifdef BTREE_STATS
 	struct btree_stats {
 		unsigned long	num_items;
@@ -66,29 +93,44 @@ struct btree_root {
 
 
 static struct btree_node *
-btree_node_alloc(void)
+btree_node_alloc(
+	struct btree_root	*root)
 {
-	return calloc(1, sizeof(struct btree_node));
+	struct btree_node	*node = root->free_nodes;
+	struct btree_chunk	*chunk;
+	unsigned int		nr, i;
+
+	if (!node) {
+		nr = root->chunk_nodes;
+		if (nr < BTREE_CHUNK_MIN)
+			nr = BTREE_CHUNK_MIN;
+		chunk = memalign(BTREE_NODE_ALIGN,
+				BTREE_NODE_ALIGN + nr * sizeof(*node));
+		if (!chunk)
+			return NULL;
+		chunk->next = root->chunks;
+		root->chunks = chunk;
+		if (nr < BTREE_CHUNK_MAX)
+			root->chunk_nodes = nr * 2;
+
+		node = (struct btree_node *)((char *)chunk + BTREE_NODE_ALIGN);
+		for (i = 0; i < nr - 1; i++)
+			node[i].ptrs[0] = &node[i + 1];
+		node[nr - 1].ptrs[0] = NULL;
+	}
+
+	root->free_nodes = node->ptrs[0];
+	memset(node, 0, sizeof(*node));
+	return node;
 }
 
 static void
 btree_node_free(
+	struct btree_root	*root,
 	struct btree_node 	*node)
 {
-	free(node);
-}
-
-static void
-btree_free_nodes(
-	struct btree_node	*node,
-	int			level)
-{
-	int			i;
-
-	if (level)
-		for (i = 0; i <= node->num_keys; i++)
-			btree_free_nodes(node->ptrs[i], level - 1);
-	btree_node_free(node);
+	node->ptrs[0] = root->free_nodes;
+	root->free_nodes = node;
 }
 
 static void
@@ -98,7 +140,7 @@ __btree_init(
 	memset(root, 0, sizeof(struct btree_root));
 	root->height = 1;
 	root->cursor = calloc(1, sizeof(struct btree_cursor));
-	root->root_node = btree_node_alloc();
+	root->root_node = btree_node_alloc(root);
 	ASSERT(root->root_node);
 #ifdef BTREE_STATS
 	root->stats.max_items = 1;
@@ -110,7 +152,14 @@ static void
 __btree_free(
 	struct btree_root	*root)
 {
-	btree_free_nodes(root->root_node, root->height - 1);
+	struct btree_chunk	*chunk, *next;
+
+	for (chunk = root->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	root->chunks = NULL;
+	root->free_nodes = NULL;
 	free(root->cursor);
 	root->height = 0;
 	root->cursor = NULL;
@@ -237,6 +286,26 @@ btree_get_next(
  * Lookup/Search functions
  */
 
+/*
+ * Index of the first key in @node that is not less than @key, or num_keys if
+ * there isn't one.  The keys are sorted, so that is the number of keys less
+ * than @key.  Counting them rather than stopping at the first big one leaves
+ * no data dependent branch to mispredict; it beats both an early exit and a
+ * binary search at these node sizes (see "xfs_bench btree_fanout").
+ */
+static inline int
+btree_node_search(
+	struct btree_node	*node,
+	unsigned long		key)
+{
+	int			nr = node->num_keys;
+	int			i, idx = 0;
+
+	for (i = 0; i < nr; i++)
+		idx += node->keys[i] < key;
+	return idx;
+}
+
 static int
 btree_do_search(
 	struct btree_root	*root,
@@ -251,12 +320,11 @@ btree_do_search(
 
 	while (--height >= 0) {
 		cur--;
-		for (i = 0; i < node->num_keys; i++)
-			if (node->keys[i] >= key) {
-				k = node->keys[i];
-				key_found = 1;
-				break;
-			}
+		i = btree_node_search(node, key);
+		if (i < node->num_keys) {
+			k = node->keys[i];
+			key_found = 1;
+		}
 		cur->node = node;
 		cur->index = i;
 		node = node->ptrs[i];
@@ -737,7 +805,7 @@ btree_increase_height(
 		return NULL;
 	root->cursor = new_cursor;
 
-	new_root = btree_node_alloc();
+	new_root = btree_node_alloc(root);
 	if (!new_root)
 		return NULL;
 
@@ -777,13 +845,13 @@ btree_split(
 	struct btree_node	*new_node;
 	int			i;
 
-	new_node = btree_node_alloc();
+	new_node = btree_node_alloc(root);
 	if (!new_node)
 		return NULL;
 
 	if (btree_insert_item(root, level + 1, node->keys[BTREE_KEY_MIN],
 							new_node) != 0) {
-		btree_node_free(new_node);
+		btree_node_free(root, new_node);
 		return NULL;
 	}
 
@@ -953,7 +1021,7 @@ btree_decrease_height(
 	root->stats.max_items /= BTREE_PTR_MAX;
 #endif
 	root->root_node = old_root->ptrs[0];
-	btree_node_free(old_root);
+	btree_node_free(root, old_root);
 	root->height--;
 }
 
@@ -1104,7 +1172,7 @@ btree_delete_node(
 #ifdef BTREE_STATS
 	root->stats.alloced -= 1;
 #endif
-	btree_node_free(root->cursor[level].node);
+	btree_node_free(root, root->cursor[level].node);
 
 	btree_delete_key(root, level + 1);
 }
@@ -9,6 +9,9 @@
 extern int bload_leaf_slack;
 extern int bload_node_slack;
 
+/* Bytes of new btree blocks to format before writing them to disk. */
+#define BULKLOAD_MAX_DIRTY	(1U << 20)
+
 struct repair_ctx {
 	struct xfs_mount	*mp;
 };
@@ -0,0 +1,573 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include "globals.h"
+#include "incore.h"
+#include "protos.h"
+#include "err_protos.h"
+#include "slab.h"
+#include "rmap.h"
+#include "checkpoint.h"
+
+/*
+ * Repair checkpoints.
+ *
+ * Phases 3 and 4 walk every inode and every block mapping in the filesystem,
+ * which on a big filesystem can take many hours.  If the user asks for it, we
+ * write the incore state that phases 5-7 depend on to a file at the end of
+ * each of those phases, so that a repair that gets interrupted can pick up
+ * from there instead of starting over.  That state is:
+ *
+ *  - the status globals (root inode, quota inodes, dirty flag, ...)
+ *  - the block usage map of every AG and of the realtime device
+ *  - the good inode records, with their link counts, file types and the
+ *    parent pointers of directories
+ *  - the duplicate extents found in phase 4
+ *  - the reverse mapping and refcount observations
+ *
+ * Before writing a checkpoint we flush the buffer cache so that everything
+ * phases 2-4 fixed is on disk, and record a checksum of the superblock and
+ * AG headers of every AG.  A checkpoint can only be resumed if that checksum
+ * still matches, i.e. nobody has written to the filesystem since.  Once
+ * phase 5 starts rebuilding the AG btrees the checkpoint is no longer useful
+ * and we delete it.
+ *
+ * The file is in host byte order and tied to the xfsprogs version that wrote
+ * it; it's a scratch file for one machine, not an interchange format.
+ */
+
+#define CKPT_MAGIC		"XFSRCKPT"
+#define CKPT_VERSION		2
+
+struct ckpt_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		phase;		/* last completed phase */
+	uuid_t			uuid;
+	uint64_t		dblocks;
+	uint64_t		rextents;
+	uint32_t		agcount;
+	uint32_t		agblocks;
+	uint32_t		no_modify;
+	uint32_t		headers_crc;	/* sb + AG headers on disk */
+	char			progver[32];
+};
+
+/* One good inode chunk, followed by a parent for every bit in pmask. */
+struct ckpt_irec {
+	uint64_t		ir_free;
+	uint64_t		ir_sparse;
+	uint64_t		confirmed;
+	uint64_t		isa_dir;
+	uint64_t		was_rl;
+	uint64_t		is_rl;
+	uint64_t		pmask;
+	uint32_t		startnum;
+	uint32_t		nlinks[XFS_INODES_PER_CHUNK];
+	uint8_t			ftypes[XFS_INODES_PER_CHUNK];
+};
+
+struct repair_ckpt {
+	FILE			*fp;
+	uint32_t		crc;
+	int			error;
+};
+
+static char			*ckpt_path;
+
+/* Status globals that phases 2-4 can set and later phases look at. */
+static int			*ckpt_globals[] = {
+	&primary_sb_modified,
+	&bad_ino_btree,
+	&fs_is_dirty,
+	&bmap_conflicts,
+	&need_root_inode,
+	&need_root_dotdot,
+	&need_rbmino,
+	&need_rsumino,
+	&lost_quotas,
+	&have_uquotino,
+	&have_gquotino,
+	&have_pquotino,
+	&lost_uquotino,
+	&lost_gquotino,
+	&lost_pquotino,
+};
+
+void
+ckpt_set_error(
+	struct repair_ckpt	*ck,
+	int			error)
+{
+	if (!ck->error)
+		ck->error = error;
+}
+
+void
+ckpt_write(
+	struct repair_ckpt	*ck,
+	const void		*buf,
+	size_t			len)
+{
+	if (ck->error || !len)
+		return;
+	ck->crc = crc32c(ck->crc, buf, len);
+	if (fwrite(buf, len, 1, ck->fp) != 1)
+		ckpt_set_error(ck, errno ? -errno : -EIO);
+}
+
+void
+ckpt_read(
+	struct repair_ckpt	*ck,
+	void			*buf,
+	size_t			len)
+{
+	if (len && fread(buf, len, 1, ck->fp) != 1)
+		do_error(_("checkpoint %s is truncated\n"), ckpt_path);
+}
+
+/* Remember where checkpoints go. */
+void
+checkpoint_setup(
+	const char		*path)
+{
+	ckpt_path = strdup(path);
+	if (!ckpt_path)
+		do_error(_("couldn't allocate checkpoint path\n"));
+}
+
+/* Checksum the superblock, AGF, AGI and AGFL sectors of every AG. */
+static int
+ckpt_headers_crc(
+	struct xfs_mount	*mp,
+	uint32_t		*crcp)
+{
+	struct xfs_buf		*bp;
+	xfs_agnumber_t		agno;
+	uint32_t		crc = XFS_CRC_SEED;
+	int			error;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		error = -libxfs_buf_read_uncached(mp->m_ddev_targp,
+				XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+				XFS_FSS_TO_BB(mp, 4), 0, &bp, NULL);
+		if (error)
+			return error;
+		crc = crc32c(crc, bp->b_addr, BBTOB(bp->b_length));
+		libxfs_buf_relse(bp);
+	}
+
+	*crcp = crc;
+	return 0;
+}
+
+static void
+ckpt_save_globals(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	uint32_t		nr = ARRAY_SIZE(ckpt_globals);
+	unsigned int		i;
+
+	ckpt_write(ck, &nr, sizeof(nr));
+	for (i = 0; i < nr; i++)
+		ckpt_write(ck, ckpt_globals[i], sizeof(int));
+
+	/* phases 3 and 4 clear bad quota inodes in the incore superblock */
+	ckpt_write(ck, &mp->m_sb.sb_uquotino, sizeof(xfs_ino_t));
+	ckpt_write(ck, &mp->m_sb.sb_gquotino, sizeof(xfs_ino_t));
+	ckpt_write(ck, &mp->m_sb.sb_pquotino, sizeof(xfs_ino_t));
+
+	/* the metadata we skip on resume may carry the newest LSNs */
+	ckpt_write(ck, &libxfs_max_lsn, sizeof(libxfs_max_lsn));
+}
+
+static void
+ckpt_load_globals(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	xfs_lsn_t		max_lsn;
+	uint32_t		nr;
+	unsigned int		i;
+
+	ckpt_read(ck, &nr, sizeof(nr));
+	if (nr != ARRAY_SIZE(ckpt_globals))
+		do_error(_("checkpoint %s is corrupt\n"), ckpt_path);
+	for (i = 0; i < nr; i++)
+		ckpt_read(ck, ckpt_globals[i], sizeof(int));
+
+	ckpt_read(ck, &mp->m_sb.sb_uquotino, sizeof(xfs_ino_t));
+	ckpt_read(ck, &mp->m_sb.sb_gquotino, sizeof(xfs_ino_t));
+	ckpt_read(ck, &mp->m_sb.sb_pquotino, sizeof(xfs_ino_t));
+
+	ckpt_read(ck, &max_lsn, sizeof(max_lsn));
+	if (XFS_LSN_CMP(max_lsn, libxfs_max_lsn) > 0)
+		libxfs_max_lsn = max_lsn;
+}
+
+/* Block maps go out as (length, state) runs. */
+static void
+ckpt_save_bmaps(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	xfs_agnumber_t		agno;
+	xfs_rtblock_t		bno;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		xfs_agblock_t	ag_end = libxfs_ag_block_count(mp, agno);
+		xfs_agblock_t	agbno;
+		xfs_extlen_t	blen;
+		uint32_t	run[2];
+
+		for (agbno = 0; agbno < ag_end; agbno += blen) {
+			run[1] = get_bmap_ext(agno, agbno, ag_end, &blen);
+			run[0] = blen;
+			ckpt_write(ck, run, sizeof(run));
+		}
+	}
+
+	for (bno = 0; bno < mp->m_sb.sb_rextents; ) {
+		uint64_t	run[2];
+
+		run[0] = 1;
+		run[1] = get_rtbmap(bno);
+		while (bno + run[0] < mp->m_sb.sb_rextents &&
+		       get_rtbmap(bno + run[0]) == run[1])
+			run[0]++;
+		ckpt_write(ck, run, sizeof(run));
+		bno += run[0];
+	}
+}
+
+static void
+ckpt_load_bmaps(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	xfs_agnumber_t		agno;
+	xfs_rtblock_t		bno;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		xfs_agblock_t	ag_end = libxfs_ag_block_count(mp, agno);
+		xfs_agblock_t	agbno;
+		uint32_t	run[2];
+
+		for (agbno = 0; agbno < ag_end; agbno += run[0]) {
+			ckpt_read(ck, run, sizeof(run));
+			if (run[0] == 0 || run[0] > ag_end - agbno)
+				do_error(_("checkpoint %s is corrupt\n"),
+						ckpt_path);
+			set_bmap_ext(agno, agbno, run[0], run[1]);
+		}
+	}
+
+	for (bno = 0; bno < mp->m_sb.sb_rextents; ) {
+		uint64_t	run[2];
+		uint64_t	i;
+
+		ckpt_read(ck, run, sizeof(run));
+		if (run[0] == 0 || run[0] > mp->m_sb.sb_rextents - bno)
+			do_error(_("checkpoint %s is corrupt\n"), ckpt_path);
+		for (i = 0; i < run[0]; i++)
+			set_rtbmap(bno++, run[1]);
+	}
+}
+
+/* Inode chunks, terminated by a record starting at NULLAGINO. */
+static void
+ckpt_save_inodes(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	struct ckpt_irec	cr;
+	struct ino_tree_node	*irec;
+	xfs_agnumber_t		agno;
+	int			i;
+
+	ASSERT(!full_ino_ex_data);
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		for (irec = findfirst_inode_rec(agno);
+		     irec != NULL;
+		     irec = next_ino_rec(irec)) {
+			memset(&cr, 0, sizeof(cr));
+			cr.startnum = irec->ino_startnum;
+			cr.ir_free = irec->ir_free;
+			cr.ir_sparse = irec->ir_sparse;
+			cr.confirmed = irec->ino_confirmed;
+			cr.isa_dir = irec->ino_isa_dir;
+			cr.was_rl = irec->ino_was_rl;
+			cr.is_rl = irec->ino_is_rl;
+			cr.pmask = irec->parents.pmask;
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+				cr.nlinks[i] = get_inode_disk_nlinks(irec, i);
+				cr.ftypes[i] = get_inode_ftype(irec, i);
+			}
+			ckpt_write(ck, &cr, sizeof(cr));
+
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+				xfs_ino_t	parent;
+
+				if (!(cr.pmask & (1ULL << i)))
+					continue;
+				parent = get_inode_parent(irec, i);
+				ckpt_write(ck, &parent, sizeof(parent));
+			}
+		}
+
+		memset(&cr, 0, sizeof(cr));
+		cr.startnum = NULLAGINO;
+		ckpt_write(ck, &cr, sizeof(cr));
+	}
+}
+
+static void
+ckpt_load_inodes(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	struct ckpt_irec	cr;
+	struct ino_tree_node	*irec;
+	xfs_agnumber_t		agno;
+	int			i;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		for (ckpt_read(ck, &cr, sizeof(cr));
+		     cr.startnum != NULLAGINO;
+		     ckpt_read(ck, &cr, sizeof(cr))) {
+			if (!libxfs_verify_agino(mp, agno, cr.startnum))
+				do_error(_("checkpoint %s is corrupt\n"),
+						ckpt_path);
+
+			irec = set_inode_free_alloc(mp, agno, cr.startnum);
+			irec->ir_free = cr.ir_free;
+			irec->ir_sparse = cr.ir_sparse;
+			irec->ino_confirmed = cr.confirmed;
+			irec->ino_isa_dir = cr.isa_dir;
+			irec->ino_was_rl = cr.was_rl;
+			irec->ino_is_rl = cr.is_rl;
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+				set_inode_disk_nlinks(irec, i, cr.nlinks[i]);
+				set_inode_ftype(irec, i, cr.ftypes[i]);
+			}
+
+			for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
+				xfs_ino_t	parent;
+
+				if (!(cr.pmask & (1ULL << i)))
+					continue;
+				ckpt_read(ck, &parent, sizeof(parent));
+				set_inode_parent(irec, i, parent);
+			}
+		}
+	}
+}
+
+/*
+ * Write a checkpoint after @phase.  Failing to write one is not a reason to
+ * stop repairing, so we only complain about it.
+ */
+void
+checkpoint_save(
+	struct xfs_mount	*mp,
+	int			phase)
+{
+	struct repair_ckpt	ck = { .crc = XFS_CRC_SEED };
+	struct ckpt_header	hdr = { };
+	char			*tmp_path;
+	xfs_agnumber_t		agno;
+	int			error;
+
+	if (!ckpt_path)
+		return;
+
+	/* Uncertain inodes don't survive phase 3; if some did, give up. */
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		if (findfirst_uncertain_inode_rec(agno) != NULL) {
+			do_warn(
+_("uncertain inodes left after phase %d, not writing a checkpoint\n"),
+				phase);
+			return;
+		}
+	}
+
+	/* Everything we fixed so far has to be on disk for a resume. */
+	libxfs_bcache_flush();
+	error = -libxfs_blkdev_issue_flush(mp->m_ddev_targp);
+	if (!error)
+		error = ckpt_headers_crc(mp, &hdr.headers_crc);
+	if (error) {
+		do_warn(_("couldn't write checkpoint %s: %s\n"), ckpt_path,
+				strerror(-error));
+		return;
+	}
+
+	memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+	hdr.version = CKPT_VERSION;
+	hdr.phase = phase;
+	platform_uuid_copy(&hdr.uuid, &mp->m_sb.sb_uuid);
+	hdr.dblocks = mp->m_sb.sb_dblocks;
+	hdr.rextents = mp->m_sb.sb_rextents;
+	hdr.agcount = mp->m_sb.sb_agcount;
+	hdr.agblocks = mp->m_sb.sb_agblocks;
+	hdr.no_modify = no_modify;
+	strncpy(hdr.progver, VERSION, sizeof(hdr.progver) - 1);
+
+	/* Write a new file and rename it over the old one once it's safe. */
+	if (asprintf(&tmp_path, "%s.tmp", ckpt_path) < 0) {
+		do_warn(_("couldn't write checkpoint %s: %s\n"), ckpt_path,
+				strerror(ENOMEM));
+		return;
+	}
+	ck.fp = fopen(tmp_path, "w");
+	if (!ck.fp) {
+		error = -errno;
+		goto out_warn;
+	}
+
+	ckpt_write(&ck, &hdr, sizeof(hdr));
+	ckpt_save_globals(mp, &ck);
+	ckpt_save_bmaps(mp, &ck);
+	ckpt_save_inodes(mp, &ck);
+	dup_extents_save_checkpoint(mp, &ck);
+	rmaps_save_checkpoint(mp, &ck);
+	if (!ck.error && fwrite(&ck.crc, sizeof(ck.crc), 1, ck.fp) != 1)
+		ckpt_set_error(&ck, -errno);
+	if (!ck.error && (fflush(ck.fp) || fsync(fileno(ck.fp))))
+		ckpt_set_error(&ck, -errno);
+	if (fclose(ck.fp))
+		ckpt_set_error(&ck, -errno);
+	if (!ck.error && rename(tmp_path, ckpt_path))
+		ckpt_set_error(&ck, -errno);
+	error = ck.error;
+	if (error) {
+		unlink(tmp_path);
+		goto out_warn;
+	}
+
+	do_log(_("        - saved checkpoint after phase %d to %s\n"), phase,
+			ckpt_path);
+	free(tmp_path);
+	return;
+
+out_warn:
+	do_warn(_("couldn't write checkpoint %s: %s\n"), ckpt_path,
+			strerror(-error));
+	free(tmp_path);
+}
+
+/* Check the trailing checksum of the whole file before loading anything. */
+static bool
+ckpt_verify_file(
+	FILE			*fp)
+{
+	char			buf[65536];
+	struct stat		sb;
+	uint32_t		crc = XFS_CRC_SEED;
+	uint32_t		disk_crc;
+	off_t			left;
+
+	if (fstat(fileno(fp), &sb) || sb.st_size < sizeof(struct ckpt_header) +
+						  sizeof(disk_crc))
+		return false;
+
+	for (left = sb.st_size - sizeof(disk_crc); left > 0; ) {
+		size_t		len = left > sizeof(buf) ? sizeof(buf) : left;
+
+		if (fread(buf, len, 1, fp) != 1)
+			return false;
+		crc = crc32c(crc, buf, len);
+		left -= len;
+	}
+	if (fread(&disk_crc, sizeof(disk_crc), 1, fp) != 1)
+		return false;
+
+	rewind(fp);
+	return crc == disk_crc;
+}
+
+/*
+ * Load the checkpoint, if there is one.  Returns the last phase it covers, or
+ * zero if repair has to start from the beginning.  A checkpoint that doesn't
+ * match the filesystem is a fatal error, since the user asked for a resume
+ * and we'd otherwise silently redo hours of work.
+ */
+int
+checkpoint_resume(
+	struct xfs_mount	*mp)
+{
+	struct repair_ckpt	ck = { 0 };
+	struct ckpt_header	hdr;
+	uint32_t		headers_crc;
+	int			error;
+
+	if (!ckpt_path)
+		return 0;
+
+	ck.fp = fopen(ckpt_path, "r");
+	if (!ck.fp) {
+		if (errno == ENOENT)
+			return 0;
+		do_error(_("couldn't open checkpoint %s: %s\n"), ckpt_path,
+				strerror(errno));
+	}
+
+	if (!ckpt_verify_file(ck.fp))
+		do_error(_("checkpoint %s is corrupt\n"), ckpt_path);
+	ckpt_read(&ck, &hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != CKPT_VERSION ||
+	    (hdr.phase != 3 && hdr.phase != 4))
+		do_error(_("%s is not a repair checkpoint\n"), ckpt_path);
+
+	hdr.progver[sizeof(hdr.progver) - 1] = 0;
+	if (strcmp(hdr.progver, VERSION))
+		do_error(
+_("checkpoint %s was written by xfs_repair version %s, remove it to start over\n"),
+			ckpt_path, hdr.progver);
+	if (platform_uuid_compare(&hdr.uuid, &mp->m_sb.sb_uuid) ||
+	    hdr.dblocks != mp->m_sb.sb_dblocks ||
+	    hdr.rextents != mp->m_sb.sb_rextents ||
+	    hdr.agcount != mp->m_sb.sb_agcount ||
+	    hdr.agblocks != mp->m_sb.sb_agblocks)
+		do_error(
+_("checkpoint %s belongs to a different filesystem\n"), ckpt_path);
+	if (hdr.no_modify != no_modify)
+		do_error(
+_("checkpoint %s was written %s -n, remove it to start over\n"),
+			ckpt_path, hdr.no_modify ? _("with") : _("without"));
+
+	error = ckpt_headers_crc(mp, &headers_crc);
+	if (error)
+		do_error(_("couldn't read AG headers: %s\n"), strerror(-error));
+	if (headers_crc != hdr.headers_crc)
+		do_error(
+_("filesystem has changed since checkpoint %s was written, remove it to start over\n"),
+			ckpt_path);
+
+	ckpt_load_globals(mp, &ck);
+	ckpt_load_bmaps(mp, &ck);
+	ckpt_load_inodes(mp, &ck);
+	dup_extents_load_checkpoint(mp, &ck);
+	rmaps_load_checkpoint(mp, &ck);
+	fclose(ck.fp);
+
+	do_log(_("Resuming from checkpoint %s after phase %d\n"), ckpt_path,
+			hdr.phase);
+	return hdr.phase;
+}
+
+/* The checkpoint is stale or no longer needed; get rid of it. */
+void
+checkpoint_discard(void)
+{
+	if (!ckpt_path)
+		return;
+	if (unlink(ckpt_path) && errno != ENOENT)
+		do_warn(_("couldn't remove checkpoint %s: %s\n"), ckpt_path,
+				strerror(errno));
+}
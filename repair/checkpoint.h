@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_REPAIR_CHECKPOINT_H__
+#define __XFS_REPAIR_CHECKPOINT_H__
+
+struct repair_ckpt;
+
+/*
+ * Stream helpers for the per-module save and load functions.  Write errors
+ * are remembered in the checkpoint and reported when it is finished; a
+ * failed read is fatal because the incore state is already half loaded.
+ */
+void ckpt_write(struct repair_ckpt *ck, const void *buf, size_t len);
+void ckpt_read(struct repair_ckpt *ck, void *buf, size_t len);
+void ckpt_set_error(struct repair_ckpt *ck, int error);
+
+void checkpoint_setup(const char *path);
+int checkpoint_resume(struct xfs_mount *mp);
+void checkpoint_save(struct xfs_mount *mp, int phase);
+void checkpoint_discard(void);
+
+#endif /* __XFS_REPAIR_CHECKPOINT_H__ */
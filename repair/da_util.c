@@ -71,6 +71,96 @@ da_read_buf(
 	return bp;
 }
 
+void
+da_ra_init(
+	struct da_ra		*ra,
+	struct xfs_mount	*mp,
+	xfs_dablk_t		end)
+{
+	ra->mp = mp;
+	ra->next = 0;
+	ra->end = end;
+	ra->nr = 0;
+}
+
+/* Is it time to queue up the next window, now that we're reading @bno? */
+bool
+da_ra_due(
+	struct da_ra		*ra,
+	xfs_dablk_t		bno)
+{
+	if (ra->next >= ra->end)
+		return false;
+	return bno + (DA_RA_WINDOW / 2) * ra->mp->m_dir_geo->fsbcount >=
+			ra->next;
+}
+
+/*
+ * Queue the directory blocks of one extent that fall in the window.  A
+ * block that spans two extents is skipped; da_read_buf will read it the
+ * slow way.  Returns false once the window is full.
+ */
+bool
+da_ra_extent(
+	struct da_ra		*ra,
+	xfs_fileoff_t		startoff,
+	xfs_fsblock_t		startblock,
+	xfs_filblks_t		blockcount)
+{
+	struct xfs_mount	*mp = ra->mp;
+	xfs_filblks_t		fsbcount = mp->m_dir_geo->fsbcount;
+	xfs_fileoff_t		off;
+
+	off = max((xfs_fileoff_t)ra->next, round_up(startoff, fsbcount));
+	while (off < ra->end && off + fsbcount <= startoff + blockcount) {
+		if (ra->nr == DA_RA_WINDOW) {
+			ra->next = off;
+			return false;
+		}
+		ra->map[ra->nr].bm_bn = XFS_FSB_TO_DADDR(mp,
+				startblock + (off - startoff));
+		ra->map[ra->nr].bm_len = XFS_FSB_TO_BB(mp, fsbcount);
+		ra->nr++;
+		off += fsbcount;
+	}
+	ra->next = max((xfs_fileoff_t)ra->next, startoff + blockcount);
+	return true;
+}
+
+static int
+da_ra_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct xfs_buf_map *ma = a;
+	const struct xfs_buf_map *mb = b;
+
+	if (ma->bm_bn != mb->bm_bn)
+		return ma->bm_bn < mb->bm_bn ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Start reading everything queued, sorted by disk address.  @done says the
+ * caller ran out of extents, so there's nothing left to queue.
+ */
+void
+da_ra_submit(
+	struct da_ra		*ra,
+	bool			done,
+	const struct xfs_buf_ops *ops)
+{
+	int			i;
+
+	qsort(ra->map, ra->nr, sizeof(ra->map[0]), da_ra_cmp);
+	for (i = 0; i < ra->nr; i++)
+		libxfs_buf_readahead(ra->mp->m_dev, ra->map[i].bm_bn,
+				ra->map[i].bm_len, ops);
+	ra->nr = 0;
+	if (done)
+		ra->next = ra->end;
+}
+
 #define FORKNAME(type) (type == XFS_DATA_FORK ? _("directory") : _("attribute"))
 
 /*
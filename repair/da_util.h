@@ -24,6 +24,44 @@ typedef struct da_bt_cursor {
 	struct blkmap		*blkmap;
 } da_bt_cursor_t;
 
+/*
+ * Directory block readahead window.  Blocks are queued up an extent at a
+ * time in file offset order and then submitted in disk order.
+ */
+#define DA_RA_WINDOW	64
+
+struct da_ra {
+	struct xfs_mount	*mp;
+	xfs_dablk_t		next;	/* first block not queued yet */
+	xfs_dablk_t		end;	/* stop before this block */
+	int			nr;
+	struct xfs_buf_map	map[DA_RA_WINDOW];
+};
+
+void
+da_ra_init(
+	struct da_ra	*ra,
+	struct xfs_mount *mp,
+	xfs_dablk_t	end);
+
+bool
+da_ra_due(
+	struct da_ra	*ra,
+	xfs_dablk_t	bno);
+
+bool
+da_ra_extent(
+	struct da_ra	*ra,
+	xfs_fileoff_t	startoff,
+	xfs_fsblock_t	startblock,
+	xfs_filblks_t	blockcount);
+
+void
+da_ra_submit(
+	struct da_ra	*ra,
+	bool		done,
+	const struct xfs_buf_ops *ops);
+
 struct xfs_buf *
 da_read_buf(
 	xfs_mount_t	*mp,
@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -15,6 +14,7 @@
 #include "versions.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "pftrace.h"
 
 /*
  * validates inode block or chunk, returns # of good inodes
@@ -578,6 +578,75 @@ process_inode_agbno_state(
 	pthread_mutex_unlock(&ag_locks[agno].lock);
 }
 
+/*
+ * Start reading the blocks under the in-inode root of a btree format fork.
+ * The dinode hasn't been checked yet, so give up on anything that looks odd;
+ * process_dinode will complain about it later.
+ */
+static void
+readahead_btree_fork(
+	struct xfs_mount	*mp,
+	struct xfs_dinode	*dino,
+	int			whichfork)
+{
+	struct xfs_bmdr_block	*dib;
+	xfs_bmbt_ptr_t		*pp;
+	int			size = XFS_DFORK_SIZE(dino, mp, whichfork);
+	int			numrecs;
+	int			i;
+
+	dib = (struct xfs_bmdr_block *)XFS_DFORK_PTR(dino, whichfork);
+	numrecs = be16_to_cpu(dib->bb_numrecs);
+	if (numrecs == 0 || be16_to_cpu(dib->bb_level) == 0 ||
+	    XFS_BMDR_SPACE_CALC(numrecs) > size)
+		return;
+
+	pp = XFS_BMDR_PTR_ADDR(dib, 1, libxfs_bmdr_maxrecs(size, 0));
+	for (i = 0; i < numrecs; i++) {
+		xfs_fsblock_t	fsbno = get_unaligned_be64(&pp[i]);
+
+		if (!libxfs_verify_fsbno(mp, fsbno))
+			return;
+		libxfs_buf_readahead(mp->m_dev, XFS_FSB_TO_DADDR(mp, fsbno),
+				XFS_FSB_TO_BB(mp, 1), &xfs_bmbt_buf_ops);
+	}
+}
+
+/*
+ * Before we process the inodes in a cluster one by one, go through their
+ * cores and start reading the top level of every bmap btree, data and attr
+ * fork alike.  By the time process_dinode gets to an inode with a big
+ * btree, its first level is in memory, and the walk reads ahead the levels
+ * below as it goes; the worker no longer sits out a synchronous read per
+ * node of the first inode before it can even start on the next.
+ */
+static void
+readahead_cluster_forks(
+	struct xfs_mount	*mp,
+	struct xfs_buf		*bp)
+{
+	struct xfs_dinode	*dino;
+	int			ni = BBTOB(bp->b_length) >> mp->m_sb.sb_inodelog;
+	int			i;
+
+	for (i = 0; i < ni; i++) {
+		dino = xfs_make_iptr(mp, bp, i);
+
+		if (be16_to_cpu(dino->di_magic) != XFS_DINODE_MAGIC ||
+		    !libxfs_dinode_good_version(mp, dino->di_version) ||
+		    dino->di_mode == 0)
+			continue;
+		if (dino->di_forkoff >= (XFS_LITINO(mp) >> 3))
+			continue;
+
+		if (dino->di_format == XFS_DINODE_FMT_BTREE)
+			readahead_btree_fork(mp, dino, XFS_DATA_FORK);
+		if (dino->di_forkoff &&
+		    dino->di_aformat == XFS_DINODE_FMT_BTREE)
+			readahead_btree_fork(mp, dino, XFS_ATTR_FORK);
+	}
+}
+
 /*
  * processes an inode allocation chunk/block, returns 1 on I/O errors,
  * 0 otherwise
@@ -598,6 +667,7 @@ process_inode_chunk(
 	xfs_ino_t		parent;
 	ino_tree_node_t		*ino_rec;
 	struct xfs_buf		**bplist;
+	bool			*crc_ok;
 	struct xfs_dinode	*dino;
 	int			icnt;
 	int			status;
@@ -615,6 +685,7 @@ process_inode_chunk(
 	int			bp_index;
 	int			cluster_offset;
 	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	struct libxfs_io_stats	io_before;
 	bool			can_punch_sparse = false;
 	int			error;
 
@@ -649,6 +720,16 @@ process_inode_chunk(
 		do_error(_("failed to allocate %zd bytes of memory\n"),
 			cluster_count * sizeof(struct xfs_buf *));
 
+	/*
+	 * The crcs of each cluster are checked all at once when it is read
+	 * in, so that process_dinode only needs to do it for the inodes that
+	 * failed.
+	 */
+	crc_ok = calloc(cluster_count * igeo->inodes_per_cluster, sizeof(bool));
+	if (crc_ok == NULL)
+		do_error(_("failed to allocate %zd bytes of memory\n"),
+			cluster_count * igeo->inodes_per_cluster * sizeof(bool));
+
 	for (bp_index = 0; bp_index < cluster_count; bp_index++) {
 		/*
 		 * Skip the cluster buffer if the first inode is sparse. The
@@ -665,12 +746,26 @@ process_inode_chunk(
 		pftrace("about to read off %llu in AG %d",
 			XFS_AGB_TO_DADDR(mp, agno, agbno), agno);
 
+		if (pft_enabled)
+			libxfs_io_stats(&io_before, true);
 		error = -libxfs_buf_read(mp->m_dev,
 				XFS_AGB_TO_DADDR(mp, agno, agbno),
 				XFS_FSB_TO_BB(mp,
 					M_IGEO(mp)->blocks_per_cluster),
 				LIBXFS_READBUF_SALVAGE, &bplist[bp_index],
 				&xfs_inode_buf_ops);
+		if (pft_enabled) {
+			struct libxfs_io_stats	io_after;
+
+			/* Did we have to go to the disk for this cluster? */
+			libxfs_io_stats(&io_after, true);
+			if (io_after.reads != io_before.reads)
+				pft_event(PFT_CACHE_MISS, agno,
+					XFS_AGB_TO_DADDR(mp, agno, agbno),
+					XFS_FSB_TO_B(mp,
+						igeo->blocks_per_cluster),
+					0, 0);
+		}
 		if (error) {
 			do_warn(_("cannot read inode %" PRIu64 ", disk block %" PRId64 ", cnt %d\n"),
 				XFS_AGINO_TO_INO(mp, agno, first_irec->ino_startnum),
@@ -682,6 +777,7 @@ process_inode_chunk(
 				libxfs_buf_relse(bplist[bp_index]);
 			}
 			free(bplist);
+			free(crc_ok);
 			return(1);
 		}
 
@@ -690,6 +786,8 @@ process_inode_chunk(
 			bplist[bp_index]->b_length, agno);
 
 		bplist[bp_index]->b_ops = &xfs_inode_buf_ops;
+		libxfs_inode_buf_verify_cluster(bplist[bp_index],
+				&crc_ok[bp_index * igeo->inodes_per_cluster]);
 
 next_readbuf:
 		irec_offset += mp->m_sb.sb_inopblock *
@@ -728,7 +826,10 @@ next_readbuf:
 				 * to reset them later to keep from losing the
 				 * chunk that they're in
 				 */
-				if (verify_dinode(mp, dino, agno, agino) == 0 ||
+				if (verify_dinode(mp, dino, agno, agino,
+						crc_ok[bp_index *
+						igeo->inodes_per_cluster +
+						cluster_offset]) == 0 ||
 						(agno == 0 &&
 						(mp->m_sb.sb_rootino == agino ||
 						 mp->m_sb.sb_rsumino == agino ||
@@ -797,6 +898,7 @@ next_readbuf:
 				if (bplist[bp_index])
 					libxfs_buf_relse(bplist[bp_index]);
 			free(bplist);
+			free(crc_ok);
 			return(0);
 		}
 
@@ -812,6 +914,11 @@ next_readbuf:
 		status = 0;
 	}
 
+	for (bp_index = 0; bp_index < cluster_count; bp_index++)
+		if (bplist[bp_index])
+			readahead_cluster_forks(mp, bplist[bp_index]);
+	bp_index = 0;
+
 	/*
 	 * mark block as an inode block in the incore bitmap
 	 */
@@ -855,7 +962,10 @@ next_readbuf:
 		status = process_dinode(mp, dino, agno, agino,
 				is_inode_free(ino_rec, irec_offset),
 				&ino_dirty, &is_used,ino_discovery, check_dups,
-				extra_attr_check, &isa_dir, &parent);
+				extra_attr_check,
+				crc_ok[bp_index * igeo->inodes_per_cluster +
+				       cluster_offset],
+				&isa_dir, &parent);
 
 		ASSERT(is_used != 3);
 		if (ino_dirty) {
@@ -995,6 +1105,7 @@ process_next:
 					libxfs_buf_relse(bplist[bp_index]);
 			}
 			free(bplist);
+			free(crc_ok);
 			break;
 		} else if (ibuf_offset == mp->m_sb.sb_inopblock)  {
 			/*
@@ -1119,6 +1230,53 @@ process_aginodes(
 	}
 }
 
+/* Uncertain inode records are pulled out of the index this many at a time. */
+#define UNCERTAIN_BATCH		64
+
+/*
+ * look on disk to see if the confirmed inodes in an uncertain record are
+ * good.  @nrec caches the last good chunk found.  returns 1 if any were.
+ */
+static int
+check_uncertain_irec(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	ino_tree_node_t		*irec,
+	ino_tree_node_t		**nrec)
+{
+	xfs_agino_t		start;
+	xfs_agino_t		i;
+	xfs_agino_t		agino;
+	int			got_some = 0;
+
+	/*
+	 * check every confirmed (which in this case means
+	 * inode that we really suspect to be an inode) inode
+	 */
+	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
+		if (!is_inode_confirmed(irec, i))
+			continue;
+
+		agino = i + irec->ino_startnum;
+
+		if (!libxfs_verify_agino(mp, agno, agino))
+			continue;
+
+		if (*nrec != NULL && (*nrec)->ino_startnum <= agino &&
+				agino < (*nrec)->ino_startnum +
+				XFS_INODES_PER_CHUNK)
+			continue;
+
+		if ((*nrec = find_inode_rec(mp, agno, agino)) == NULL)
+			if (libxfs_verify_agino(mp, agno, agino))
+				if (verify_aginode_chunk(mp, agno,
+						agino, &start))
+					got_some = 1;
+	}
+
+	return got_some;
+}
+
 /*
  * verify the uncertain inode list for an ag.
  * Good inodes get moved into the good inode tree.
@@ -1129,11 +1287,10 @@ process_aginodes(
 void
 check_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 {
-	ino_tree_node_t		*irec;
+	ino_tree_node_t		*batch[UNCERTAIN_BATCH];
 	ino_tree_node_t		*nrec;
-	xfs_agino_t		start;
-	xfs_agino_t		i;
-	xfs_agino_t		agino;
+	unsigned int		nr;
+	unsigned int		i;
 	int			got_some;
 
 	nrec = NULL;
@@ -1141,7 +1298,8 @@ check_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 
 	clear_uncertain_ino_cache(agno);
 
-	if ((irec = findfirst_uncertain_inode_rec(agno)) == NULL)
+	nr = find_uncertain_inode_recs(agno, batch, UNCERTAIN_BATCH);
+	if (!nr)
 		return;
 
 	/*
@@ -1159,41 +1317,91 @@ check_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 	do_warn(_("found inodes not in the inode allocation tree\n"));
 
 	do {
-		/*
-		 * check every confirmed (which in this case means
-		 * inode that we really suspect to be an inode) inode
-		 */
-		for (i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
-			if (!is_inode_confirmed(irec, i))
-				continue;
+		for (i = 0; i < nr; i++) {
+			got_some |= check_uncertain_irec(mp, agno, batch[i],
+					&nrec);
+			get_uncertain_inode_rec(mp, agno, batch[i]);
+			free_inode_rec(agno, batch[i]);
+		}
+		nr = find_uncertain_inode_recs(agno, batch, UNCERTAIN_BATCH);
+	} while (nr > 0);
 
-			agino = i + irec->ino_startnum;
+	if (got_some)
+		do_warn(_("found inodes not in the inode allocation tree\n"));
 
-			if (!libxfs_verify_agino(mp, agno, agino))
-				continue;
+	return;
+}
 
-			if (nrec != NULL && nrec->ino_startnum <= agino &&
-					agino < nrec->ino_startnum +
-					XFS_INODES_PER_CHUNK)
-				continue;
+/*
+ * verify and process the confirmed inodes in an uncertain record.  @nrec
+ * caches the last good chunk found.  returns 1 if any inodes were processed.
+ */
+static int
+process_uncertain_irec(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	ino_tree_node_t		*irec,
+	ino_tree_node_t		**nrec)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	xfs_agino_t		agino;
+	int			i;
+	int			bogus;
+	int			cnt;
+	int			got_some = 0;
 
-			if ((nrec = find_inode_rec(mp, agno, agino)) == NULL)
-				if (libxfs_verify_agino(mp, agno, agino))
-					if (verify_aginode_chunk(mp, agno,
-							agino, &start))
-						got_some = 1;
-		}
+	/*
+	 * check every confirmed inode
+	 */
+	for (cnt = i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
+		if (!is_inode_confirmed(irec, i))
+			continue;
+		cnt++;
+		agino = i + irec->ino_startnum;
+#ifdef XR_INODE_TRACE
+	fprintf(stderr, "ag inode = %d (0x%x)\n", agino, agino);
+#endif
+		/*
+		 * skip over inodes already processed (in the
+		 * good tree), bad inode numbers, and inode numbers
+		 * pointing to bogus inodes
+		 */
+		if (!libxfs_verify_agino(mp, agno, agino))
+			continue;
 
-		get_uncertain_inode_rec(mp, agno, irec);
-		free_inode_rec(agno, irec);
+		if (*nrec != NULL && (*nrec)->ino_startnum <= agino &&
+				agino < (*nrec)->ino_startnum +
+				XFS_INODES_PER_CHUNK)
+			continue;
 
-		irec = findfirst_uncertain_inode_rec(agno);
-	} while (irec != NULL);
+		if ((*nrec = find_inode_rec(mp, agno, agino)) != NULL)
+			continue;
 
-	if (got_some)
-		do_warn(_("found inodes not in the inode allocation tree\n"));
+		/*
+		 * verify the chunk.  if good, it will be
+		 * added to the good inode tree.
+		 */
+		if ((*nrec = verify_aginode_chunk_irec(mp,
+					agno, agino)) == NULL)
+			continue;
 
-	return;
+		got_some = 1;
+
+		/*
+		 * process the inode record we just added
+		 * to the good inode tree.  The inode
+		 * processing may add more records to the
+		 * uncertain inode lists.
+		 */
+		if (process_inode_chunk(mp, agno, igeo->ialloc_inos,
+					*nrec, 1, 0, 0, &bogus))  {
+			/* XXX - i/o error, we've got a problem */
+			abort();
+		}
+	}
+
+	ASSERT(cnt != 0);
+	return got_some;
 }
 
 /*
@@ -1221,14 +1429,11 @@ check_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 int
 process_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 {
-	ino_tree_node_t		*irec;
+	ino_tree_node_t		*batch[UNCERTAIN_BATCH];
 	ino_tree_node_t		*nrec;
-	xfs_agino_t		agino;
-	int			i;
-	int			bogus;
-	int			cnt;
+	unsigned int		nr;
+	unsigned int		i;
 	int			got_some;
-	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
 
 #ifdef XR_INODE_TRACE
 	fprintf(stderr, "in process_uncertain_aginodes, agno = %d\n", agno);
@@ -1238,72 +1443,26 @@ process_uncertain_aginodes(xfs_mount_t *mp, xfs_agnumber_t agno)
 
 	clear_uncertain_ino_cache(agno);
 
-	if ((irec = findfirst_uncertain_inode_rec(agno)) == NULL)
+	nr = find_uncertain_inode_recs(agno, batch, UNCERTAIN_BATCH);
+	if (!nr)
 		return(0);
 
 	nrec = NULL;
 
 	do  {
 		/*
-		 * check every confirmed inode
+		 * process each record, then return it to the free pool.
+		 * processing may add more uncertain records, which the
+		 * next lookup picks up.
 		 */
-		for (cnt = i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
-			if (!is_inode_confirmed(irec, i))
-				continue;
-			cnt++;
-			agino = i + irec->ino_startnum;
-#ifdef XR_INODE_TRACE
-	fprintf(stderr, "ag inode = %d (0x%x)\n", agino, agino);
-#endif
-			/*
-			 * skip over inodes already processed (in the
-			 * good tree), bad inode numbers, and inode numbers
-			 * pointing to bogus inodes
-			 */
-			if (!libxfs_verify_agino(mp, agno, agino))
-				continue;
-
-			if (nrec != NULL && nrec->ino_startnum <= agino &&
-					agino < nrec->ino_startnum +
-					XFS_INODES_PER_CHUNK)
-				continue;
-
-			if ((nrec = find_inode_rec(mp, agno, agino)) != NULL)
-				continue;
-
-			/*
-			 * verify the chunk.  if good, it will be
-			 * added to the good inode tree.
-			 */
-			if ((nrec = verify_aginode_chunk_irec(mp,
-						agno, agino)) == NULL)
-				continue;
-
-			got_some = 1;
-
-			/*
-			 * process the inode record we just added
-			 * to the good inode tree.  The inode
-			 * processing may add more records to the
-			 * uncertain inode lists.
-			 */
-			if (process_inode_chunk(mp, agno, igeo->ialloc_inos,
-						nrec, 1, 0, 0, &bogus))  {
-				/* XXX - i/o error, we've got a problem */
-				abort();
-			}
+		for (i = 0; i < nr; i++) {
+			got_some |= process_uncertain_irec(mp, agno, batch[i],
+					&nrec);
+			get_uncertain_inode_rec(mp, agno, batch[i]);
+			free_inode_rec(agno, batch[i]);
 		}
-
-		ASSERT(cnt != 0);
-		/*
-		 * now return the uncertain inode record to the free pool
-		 * and pull another one off the list for processing
-		 */
-		get_uncertain_inode_rec(mp, agno, irec);
-		free_inode_rec(agno, irec);
-
-		irec = findfirst_uncertain_inode_rec(agno);
-	} while (irec != NULL);
+		nr = find_uncertain_inode_recs(agno, batch, UNCERTAIN_BATCH);
+	} while (nr > 0);
 
 	if (got_some)
 		do_warn(_("found inodes not in the inode allocation tree\n"));
@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -520,6 +519,19 @@ _("Fatal error: inode %" PRIu64 " - blkmap_set_ext(): %s\n"
 		agno = XFS_FSB_TO_AGNO(mp, irec.br_startblock);
 		agbno = XFS_FSB_TO_AGBNO(mp, irec.br_startblock);
 		ebno = agbno + irec.br_blockcount;
+
+		/*
+		 * Two inodes can only fight over a block in phase 4 if they
+		 * both claimed it in phase 3.  Unless phase 3 turned away a
+		 * claim, every such block is in the duplicate extent list,
+		 * so the dup check can skip extents that miss all of them.
+		 */
+		if (check_dups && !uatomic_read(&bmap_conflicts) &&
+		    !dup_extent_possible(agno, agbno, ebno)) {
+			*tot += irec.br_blockcount;
+			continue;
+		}
+
 		if (agno != locked_agno) {
 			if (locked_agno != -1)
 				pthread_mutex_unlock(&ag_locks[locked_agno].lock);
@@ -557,7 +569,7 @@ _("%s fork in ino %" PRIu64 " claims free block %" PRIu64 "\n"),
 				do_warn(
 _("%s fork in inode %" PRIu64 " claims metadata block %" PRIu64 "\n"),
 					forkname, ino, b);
-				goto done;
+				goto conflict;
 
 			case XR_E_INUSE:
 			case XR_E_MULT:
@@ -567,13 +579,13 @@ _("%s fork in inode %" PRIu64 " claims metadata block %" PRIu64 "\n"),
 				do_warn(
 _("%s fork in %s inode %" PRIu64 " claims used block %" PRIu64 "\n"),
 					forkname, ftype, ino, b);
-				goto done;
+				goto conflict;
 
 			case XR_E_COW:
 				do_warn(
 _("%s fork in %s inode %" PRIu64 " claims CoW block %" PRIu64 "\n"),
 					forkname, ftype, ino, b);
-				goto done;
+				goto conflict;
 
 			default:
 				do_error(
@@ -630,6 +642,9 @@ _("couldn't add reverse mapping\n")
 		*tot += irec.br_blockcount;
 	}
 	error = 0;
+	goto done;
+conflict:
+	uatomic_inc(&bmap_conflicts);
 done:
 	if (locked_agno != -1)
 		pthread_mutex_unlock(&ag_locks[locked_agno].lock);
@@ -2258,6 +2273,7 @@ process_dinode_int(xfs_mount_t *mp,
 		int *used,		/* out == 1 if inode is in use */
 		int verify_mode,	/* 1 == verify but don't modify inode */
 		int uncertain,		/* 1 == inode is uncertain */
+		int crc_ok,		/* 1 == crc already checked good */
 		int ino_discovery,	/* 1 == check dirs for unknown inodes */
 		int check_dups,		/* 1 == check if inode claims
 					 * duplicate blocks		*/
@@ -2307,7 +2323,7 @@ process_dinode_int(xfs_mount_t *mp,
 	 * Of course if we make any modifications after this, the inode gets
 	 * rewritten, and the CRC is updated automagically.
 	 */
-	if (xfs_has_crc(mp) &&
+	if (xfs_has_crc(mp) && !crc_ok &&
 	    !libxfs_verify_cksum((char *)dino, mp->m_sb.sb_inodesize,
 				XFS_DINODE_CRC_OFF)) {
 		retval = 1;
@@ -2919,6 +2935,7 @@ bad_out:
  *				set the bitmap.  If not, we set the
  *				bitmap and try and detect multiply
  *				claimed blocks using the bitmap.
+ *		crc_ok -- the caller already verified the inode crc
  *	Outs:
  *		dirty -- whether we changed the inode (1 == yes)
  *		used -- 1 if the inode is used, 0 if free.  In no modify
@@ -2941,6 +2958,7 @@ process_dinode(
 	int			ino_discovery,
 	int			check_dups,
 	int			extra_attr_check,
+	int			crc_ok,
 	int			*isa_dir,
 	xfs_ino_t		*parent)
 {
@@ -2951,7 +2969,7 @@ process_dinode(
 	fprintf(stderr, _("processing inode %d/%d\n"), agno, ino);
 #endif
 	return process_dinode_int(mp, dino, agno, ino, was_free, dirty, used,
-				verify_mode, uncertain, ino_discovery,
+				verify_mode, uncertain, crc_ok, ino_discovery,
 				check_dups, extra_attr_check, isa_dir, parent);
 }
 
@@ -2966,7 +2984,8 @@ verify_dinode(
 	xfs_mount_t		*mp,
 	struct xfs_dinode	*dino,
 	xfs_agnumber_t		agno,
-	xfs_agino_t		ino)
+	xfs_agino_t		ino,
+	int			crc_ok)
 {
 	xfs_ino_t		parent;
 	int			used = 0;
@@ -2978,7 +2997,7 @@ verify_dinode(
 	const int		uncertain = 0;
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
-				verify_mode, uncertain, ino_discovery,
+				verify_mode, uncertain, crc_ok, ino_discovery,
 				check_dups, 0, &isa_dir, &parent);
 }
 
@@ -3004,6 +3023,6 @@ verify_uncertain_dinode(
 	const int		uncertain = 1;
 
 	return process_dinode_int(mp, dino, agno, ino, 0, &dirty, &used,
-				verify_mode, uncertain, ino_discovery,
+				verify_mode, uncertain, 0, ino_discovery,
 				check_dups, 0, &isa_dir, &parent);
 }
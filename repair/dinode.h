@@ -53,6 +53,7 @@ process_dinode(xfs_mount_t *mp,
 		int check_dirs,
 		int check_dups,
 		int extra_attr_check,
+		int crc_ok,
 		int *isa_dir,
 		xfs_ino_t *parent);
 
@@ -60,7 +61,8 @@ int
 verify_dinode(xfs_mount_t *mp,
 		struct xfs_dinode *dino,
 		xfs_agnumber_t agno,
-		xfs_agino_t ino);
+		xfs_agino_t ino,
+		int crc_ok);
 
 int
 verify_uncertain_dinode(xfs_mount_t *mp,
@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "incore.h"
 #include "err_protos.h"
@@ -15,6 +14,7 @@
 #include "da_util.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "incremental.h"
 
 /*
  * Known bad inode list.  These are seen when the leaf and node
@@ -242,6 +242,9 @@ process_sf_dir2(
 		} else if (lino == mp->m_sb.sb_pquotino)  {
 			junkit = 1;
 			junkreason = _("project quota");
+		} else if (incremental_skip_ag(XFS_INO_TO_AGNO(mp, lino))) {
+			/* we aren't checking that AG this time */
+			;
 		} else if ((irec_p = find_inode_rec(mp,
 					XFS_INO_TO_AGNO(mp, lino),
 					XFS_INO_TO_AGINO(mp, lino))) != NULL) {
@@ -708,6 +711,9 @@ process_dir2_data(
 			clearreason = _("group quota");
 		} else if (ent_ino == mp->m_sb.sb_pquotino) {
 			clearreason = _("project quota");
+		} else if (incremental_skip_ag(XFS_INO_TO_AGNO(mp, ent_ino))) {
+			/* we aren't checking that AG this time */
+			clearino = 0;
 		} else {
 			irec_p = find_inode_rec(mp,
 						XFS_INO_TO_AGNO(mp, ent_ino),
@@ -1330,11 +1336,26 @@ process_leaf_node_dir2(
 	int			t;
 	bmap_ext_t		lbmp;
 	int			dirty = 0;
+	struct da_ra		ra;
+	int			ra_ext = 0;
 
 	*repair = *dot = *dotdot = good = 0;
 	*parent = NULLFSINO;
 	ndbno = NULLFILEOFF;
+	da_ra_init(&ra, mp, mp->m_dir_geo->leafblk);
 	while ((dbno = blkmap_next_off(blkmap, ndbno, &t)) < mp->m_dir_geo->leafblk) {
+		if (da_ra_due(&ra, dbno)) {
+			for (; ra_ext < blkmap->nexts; ra_ext++) {
+				bmap_ext_t	*ext = &blkmap->exts[ra_ext];
+
+				if (!da_ra_extent(&ra, ext->startoff,
+						ext->startblock,
+						ext->blockcount))
+					break;
+			}
+			da_ra_submit(&ra, ra_ext == blkmap->nexts,
+					&xfs_dir3_data_buf_ops);
+		}
 		nex = blkmap_getn(blkmap, dbno, mp->m_dir_geo->fsbcount, &bmp, &lbmp);
 		/* Advance through map to last dfs block in this dir block */
 		ndbno = dbno;
@@ -39,6 +39,7 @@ int	no_modify;
 int	dangerously;		/* live dangerously ... fix ro mount */
 int	isa_file;
 int	zap_log;
+int	replay_log;		/* replay a dirty log */
 int	dumpcore;		/* abort, not exit on fatal errs */
 int	force_geo;		/* can set geo on low confidence info */
 int	assume_xfs;		/* assume we have an xfs fs */
@@ -58,6 +59,7 @@ int	primary_sb_modified;
 int	bad_ino_btree;
 int	copied_sunit;
 int	fs_is_dirty;
+int	bmap_conflicts;
 
 /* for hunting down the root inode */
 
@@ -91,10 +93,9 @@ xfs_suminfo_t	*sumcompute;
 /* inode tree records have full or partial backptr fields ? */
 
 int	full_ino_ex_data;	/*
-				 * if 1, use ino_ex_data_t component
-				 * of ino_un union, if 0, use
-				 * parent_list_t component.  see
-				 * incore.h for more details
+				 * if 1, every inode record has
+				 * its ino_ex_data_t allocated.
+				 * see incore.h for more details
 				 */
 
 #define ORPHANAGE	"lost+found"
@@ -121,5 +122,9 @@ uint64_t	*prog_rpt_done;
 int		ag_stride;
 int		thread_count;
 
+/* buffer cache initialisation flags */
+int		bcache_flags;
+enum workqueue_affinity	worker_affinity;
+
 /* If nonzero, simulate failure after this phase. */
 int		fail_after_phase;
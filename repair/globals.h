@@ -8,6 +8,7 @@
 #define _XFS_REPAIR_GLOBAL_H
 
 #include "libxfs.h"
+#include "libfrog/workqueue.h"
 
 /* useful macros */
 
@@ -80,6 +81,7 @@ extern int	no_modify;
 extern int	dangerously;		/* live dangerously ... fix ro mount */
 extern int	isa_file;
 extern int	zap_log;
+extern int	replay_log;		/* replay a dirty log */
 extern int	dumpcore;		/* abort, not exit on fatal errs */
 extern int	force_geo;		/* can set geo on low confidence info */
 extern int	assume_xfs;		/* assume we have an xfs fs */
@@ -99,6 +101,7 @@ extern int		primary_sb_modified;
 extern int		bad_ino_btree;
 extern int		copied_sunit;
 extern int		fs_is_dirty;
+extern int		bmap_conflicts;	/* fork claims turned away */
 
 /* for hunting down the root inode */
 
@@ -132,10 +135,9 @@ extern xfs_suminfo_t	*sumcompute;
 /* inode tree records have full or partial backptr fields ? */
 
 extern int		full_ino_ex_data;/*
-					  * if 1, use ino_ex_data_t component
-					  * of ino_un union, if 0, use
-					  * parent_list_t component.  see
-					  * incore.h for more details
+					  * if 1, every inode record has
+					  * its ino_ex_data_t allocated.
+					  * see incore.h for more details
 					  */
 
 #define ORPHANAGE	"lost+found"
@@ -165,6 +167,10 @@ extern uint64_t		*prog_rpt_done;
 extern int		ag_stride;
 extern int		thread_count;
 
+/* buffer cache initialisation flags */
+extern int		bcache_flags;
+extern enum workqueue_affinity	worker_affinity;
+
 /* If nonzero, simulate failure after this phase. */
 extern int		fail_after_phase;
 
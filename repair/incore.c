@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "btree.h"
 #include "globals.h"
 #include "incore.h"
@@ -13,6 +12,7 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "threads.h"
+#include "slab.h"
 
 /*
  * The following manages the in-core bitmap of the entire filesystem
@@ -20,13 +20,158 @@
  *
  * The btree items will point to one of the state values below,
  * rather than storing the value itself in the pointer.
+ *
+ * Badly fragmented AGs can need millions of extents to describe, at which
+ * point the btree costs far more memory than simply storing the state of
+ * every block, and every update has to split and merge extents.  Once an
+ * AG's tree needs more than one record per XR_BMAP_DENSE_RATIO blocks, we
+ * switch that AG to a packed array of 4-bit states.
+ *
+ * The packed arrays come out of the slab memory budget, so with -o
+ * slab_spill they go to spill files once repair is over its threshold.  On
+ * a very large filesystem these maps are most of repair's memory, and the
+ * kernel can page the AGs we aren't working on out to the spill directory.
+ * When spilling, we also switch to the packed array at a lower density.
  */
 static int states[16] =
 	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
 
-static struct btree_root	**ag_bmap;
+#define XR_BMAP_DENSE_RATIO	32
+#define XR_BMAP_SPILL_RATIO	256
+
+struct ag_bmap {
+	struct btree_root	*tree;
+	uint64_t		*dense;		/* 4 bits per block, or NULL */
+	enum slab_mem		dense_mem;	/* where dense lives */
+	unsigned long		nr_recs;	/* records in the tree */
+	xfs_agblock_t		size;		/* blocks in this AG */
+};
+
+static struct ag_bmap		*ag_bmap;
+
+/* block records fit into uint64_t's units */
+#define XR_BB_UNIT	64			/* number of bits/unit */
+#define XR_BB		4			/* bits per block record */
+#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
+#define XR_BB_MASK	0xF			/* block record mask */
+
+/* A state replicated into every record of a unit. */
+static inline uint64_t
+dense_pattern(
+	int			state)
+{
+	return (uint64_t)state * 0x1111111111111111ULL;
+}
+
+static inline int
+dense_get(
+	uint64_t		*dense,
+	xfs_agblock_t		bno)
+{
+	return (dense[bno / XR_BB_NUM] >> ((bno % XR_BB_NUM) * XR_BB)) &
+			XR_BB_MASK;
+}
+
+static void
+dense_set(
+	uint64_t		*dense,
+	uint64_t		bno,
+	uint64_t		len,
+	int			state)
+{
+	uint64_t		pattern = dense_pattern(state);
+	uint64_t		end = bno + len;
+
+	while (bno < end && (bno % XR_BB_NUM)) {
+		unsigned int	shift = (bno % XR_BB_NUM) * XR_BB;
+
+		dense[bno / XR_BB_NUM] &= ~((uint64_t)XR_BB_MASK << shift);
+		dense[bno / XR_BB_NUM] |= (uint64_t)state << shift;
+		bno++;
+	}
+	while (end - bno >= XR_BB_NUM) {
+		dense[bno / XR_BB_NUM] = pattern;
+		bno += XR_BB_NUM;
+	}
+	while (bno < end) {
+		unsigned int	shift = (bno % XR_BB_NUM) * XR_BB;
+
+		dense[bno / XR_BB_NUM] &= ~((uint64_t)XR_BB_MASK << shift);
+		dense[bno / XR_BB_NUM] |= (uint64_t)state << shift;
+		bno++;
+	}
+}
+
+/* Find the end of the run of blocks starting at @bno with the same state. */
+static xfs_agblock_t
+dense_run_end(
+	uint64_t		*dense,
+	xfs_agblock_t		bno,
+	xfs_agblock_t		end)
+{
+	int			state = dense_get(dense, bno);
+	uint64_t		pattern = dense_pattern(state);
+
+	while (bno < end && (bno % XR_BB_NUM)) {
+		if (dense_get(dense, bno) != state)
+			return bno;
+		bno++;
+	}
+	while (end - bno >= XR_BB_NUM && dense[bno / XR_BB_NUM] == pattern)
+		bno += XR_BB_NUM;
+	while (bno < end && dense_get(dense, bno) == state)
+		bno++;
+	return bno;
+}
+
+static inline size_t
+dense_size(
+	struct ag_bmap		*bmap)
+{
+	return howmany(bmap->size, XR_BB_NUM) * sizeof(uint64_t);
+}
 
 static void
+dense_alloc(
+	struct ag_bmap		*bmap)
+{
+	size_t			size = dense_size(bmap);
+
+	bmap->dense = slab_alloc_array(size, &bmap->dense_mem);
+	if (!bmap->dense)
+		do_error(_("couldn't allocate block map, size = %zu\n"), size);
+}
+
+/* Copy the tree into a packed array and throw the tree away. */
+static void
+convert_to_dense(
+	struct ag_bmap		*bmap)
+{
+	unsigned long		key, next_key;
+	int			*statep, *next_statep;
+
+	dense_alloc(bmap);
+
+	statep = btree_find(bmap->tree, 0, &key);
+	while (statep && key < bmap->size) {
+		next_statep = btree_lookup_next(bmap->tree, &next_key);
+		if (!next_statep)
+			next_key = bmap->size;
+		dense_set(bmap->dense, key,
+				min(next_key, (unsigned long)bmap->size) - key,
+				*statep);
+		statep = next_statep;
+		key = next_key;
+	}
+
+	btree_clear(bmap->tree);
+	bmap->nr_recs = 0;
+}
+
+/*
+ * Returns the change in the number of records in the tree.
+ */
+static int
 update_bmap(
 	struct btree_root	*bmap,
 	unsigned long		offset,
@@ -42,12 +187,12 @@ update_bmap(
 
 	cur_state = btree_find(bmap, offset, &cur_key);
 	if (!cur_state)
-		return;
+		return 0;
 
 	if (offset == cur_key) {
 		/* if the start is the same as the "item" extent */
 		if (cur_state == new_state)
-			return;
+			return 0;
 
 		/*
 		 * Note: this may be NULL if we are updating the map for
@@ -61,13 +206,13 @@ update_bmap(
 			if (new_state == prev_state) {
 				/* #1: prev has same state, move offset up */
 				btree_update_key(bmap, offset, end);
-				return;
+				return 0;
 			}
 
 			/* #4: insert new extent after, update current value */
 			btree_update_value(bmap, offset, new_state);
 			btree_insert(bmap, end, cur_state);
-			return;
+			return 1;
 		}
 
 		/* same end (and same start) */
@@ -77,49 +222,50 @@ update_bmap(
 				/* #3: merge prev & next */
 				btree_delete(bmap, offset);
 				btree_delete(bmap, end);
-				return;
+				return -2;
 			}
 
 			/* #8: merge next */
 			btree_update_value(bmap, offset, new_state);
 			btree_delete(bmap, end);
-			return;
+			return -1;
 		}
 
 		/* same start, same end, next has different state */
 		if (new_state == prev_state) {
 			/* #5: prev has same state */
 			btree_delete(bmap, offset);
-			return;
+			return -1;
 		}
 
 		/* #6: update value only */
 		btree_update_value(bmap, offset, new_state);
-		return;
+		return 0;
 	}
 
 	/* different start, offset is in the middle of "cur" */
 	prev_state = btree_peek_prev(bmap, NULL);
 	ASSERT(prev_state != NULL);
 	if (prev_state == new_state)
-		return;
+		return 0;
 
 	if (end == cur_key) {
 		/* end is at the same point as the current extent */
 		if (new_state == cur_state) {
 			/* #7: move next extent down */
 			btree_update_key(bmap, end, offset);
-			return;
+			return 0;
 		}
 
 		/* #9: different start, same end, add new extent */
 		btree_insert(bmap, offset, new_state);
-		return;
+		return 1;
 	}
 
 	/* #2: insert an extent into the middle of another extent */
 	btree_insert(bmap, offset, new_state);
 	btree_insert(bmap, end, prev_state);
+	return 2;
 }
 
 void
@@ -129,7 +275,20 @@ set_bmap_ext(
 	xfs_extlen_t		blen,
 	int			state)
 {
-	update_bmap(ag_bmap[agno], agbno, blen, &states[state]);
+	struct ag_bmap		*bmap = &ag_bmap[agno];
+
+	if (bmap->dense) {
+		if (agbno >= bmap->size)
+			return;
+		dense_set(bmap->dense, agbno, min(blen, bmap->size - agbno),
+				state);
+		return;
+	}
+
+	bmap->nr_recs += update_bmap(bmap->tree, agbno, blen, &states[state]);
+	if (bmap->nr_recs > bmap->size / (slab_spilling() ?
+			XR_BMAP_SPILL_RATIO : XR_BMAP_DENSE_RATIO))
+		convert_to_dense(bmap);
 }
 
 int
@@ -139,23 +298,37 @@ get_bmap_ext(
 	xfs_agblock_t		maxbno,
 	xfs_extlen_t		*blen)
 {
+	struct ag_bmap		*bmap = &ag_bmap[agno];
 	int			*statep;
 	unsigned long		key;
 
-	statep = btree_find(ag_bmap[agno], agbno, &key);
+	if (bmap->dense) {
+		/* the tree has a single bad state record at the AG end */
+		if (agbno >= bmap->size) {
+			if (agbno > bmap->size || blen)
+				return -1;
+			return XR_E_BAD_STATE;
+		}
+		if (blen)
+			*blen = dense_run_end(bmap->dense, agbno,
+					min(maxbno, bmap->size)) - agbno;
+		return dense_get(bmap->dense, agbno);
+	}
+
+	statep = btree_find(bmap->tree, agbno, &key);
 	if (!statep)
 		return -1;
 
 	if (key == agbno) {
 		if (blen) {
-			if (!btree_peek_next(ag_bmap[agno], &key))
+			if (!btree_peek_next(bmap->tree, &key))
 				return -1;
 			*blen = min(maxbno, key) - agbno;
 		}
 		return *statep;
 	}
 
-	statep = btree_peek_prev(ag_bmap[agno], NULL);
+	statep = btree_peek_prev(bmap->tree, NULL);
 	if (!statep)
 		return -1;
 	if (blen)
@@ -167,12 +340,6 @@ get_bmap_ext(
 static uint64_t		*rt_bmap;
 static size_t		rt_bmap_size;
 
-/* block records fit into uint64_t's units */
-#define XR_BB_UNIT	64			/* number of bits/unit */
-#define XR_BB		4			/* bits per block record */
-#define XR_BB_NUM	(XR_BB_UNIT/XR_BB)	/* number of records per unit */
-#define XR_BB_MASK	0xF			/* block record mask */
-
 /*
  * these work in real-time extents (e.g. fsbno == rt extent number)
  */
@@ -195,6 +362,48 @@ set_rtbmap(
 	 (((uint64_t) state) << ((bno % XR_BB_NUM) * XR_BB)));
 }
 
+void
+set_rtbmap_ext(
+	xfs_rtblock_t	bno,
+	xfs_rtblock_t	len,
+	int		state)
+{
+	dense_set(rt_bmap, bno, len, state);
+}
+
+/*
+ * Find the end of the run of rt extents starting at @bno that are either all
+ * free or all in use, and say which in @freep.  A unit of records is checked
+ * at a time: fold each record's bits down into its low bit after xoring with
+ * the free pattern, and the lowest set bit is the first record that isn't
+ * free.
+ */
+xfs_rtblock_t
+get_rtbmap_run(
+	xfs_rtblock_t	bno,
+	xfs_rtblock_t	end,
+	bool		*freep)
+{
+	const uint64_t	lowbits = dense_pattern(1);
+	bool		free = get_rtbmap(bno) == XR_E_FREE;
+	unsigned int	skip = bno % XR_BB_NUM;
+	xfs_rtblock_t	i;
+	uint64_t	diff;
+
+	*freep = free;
+	for (i = bno / XR_BB_NUM; i * XR_BB_NUM < end; i++, skip = 0) {
+		diff = rt_bmap[i] ^ dense_pattern(XR_E_FREE);
+		diff = (diff | diff >> 1 | diff >> 2 | diff >> 3) & lowbits;
+		if (!free)
+			diff ^= lowbits;
+		diff &= ~0ULL << (skip * XR_BB);
+		if (diff)
+			return min(i * XR_BB_NUM +
+				   __builtin_ctzll(diff) / XR_BB, end);
+	}
+	return end;
+}
+
 static void
 reset_rt_bmap(void)
 {
@@ -209,8 +418,8 @@ init_rt_bmap(
 	if (mp->m_sb.sb_rextents == 0)
 		return;
 
-	rt_bmap_size = roundup(mp->m_sb.sb_rextents / (NBBY / XR_BB),
-			       sizeof(uint64_t));
+	rt_bmap_size = howmany(mp->m_sb.sb_rextents, XR_BB_NUM) *
+			sizeof(uint64_t);
 
 	rt_bmap = memalign(sizeof(uint64_t), rt_bmap_size);
 	if (!rt_bmap) {
@@ -240,13 +449,24 @@ reset_bmaps(xfs_mount_t *mp)
 	ag_size = mp->m_sb.sb_agblocks;
 
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		struct ag_bmap	*bmap = &ag_bmap[agno];
+
 		if (agno == mp->m_sb.sb_agcount - 1)
 			ag_size = (xfs_extlen_t)(mp->m_sb.sb_dblocks -
 				   (xfs_rfsblock_t)mp->m_sb.sb_agblocks * agno);
+		bmap->size = ag_size;
+
+		/* An AG that was fragmented before will be fragmented again. */
+		if (bmap->dense) {
+			dense_set(bmap->dense, 0, ag_hdr_block, XR_E_INUSE_FS);
+			dense_set(bmap->dense, ag_hdr_block,
+					ag_size - ag_hdr_block, XR_E_UNKNOWN);
+			continue;
+		}
 #ifdef BTREE_STATS
-		if (btree_find(ag_bmap[agno], 0, NULL)) {
+		if (btree_find(bmap->tree, 0, NULL)) {
 			printf("ag_bmap[%d] btree stats:\n", i);
-			btree_print_stats(ag_bmap[agno], stdout);
+			btree_print_stats(bmap->tree, stdout);
 		}
 #endif
 		/*
@@ -257,11 +477,11 @@ reset_bmaps(xfs_mount_t *mp)
 		 *	ag_hdr_block..ag_size:		XR_E_UNKNOWN
 		 *	ag_size...			XR_E_BAD_STATE
 		 */
-		btree_clear(ag_bmap[agno]);
-		btree_insert(ag_bmap[agno], 0, &states[XR_E_INUSE_FS]);
-		btree_insert(ag_bmap[agno],
-				ag_hdr_block, &states[XR_E_UNKNOWN]);
-		btree_insert(ag_bmap[agno], ag_size, &states[XR_E_BAD_STATE]);
+		btree_clear(bmap->tree);
+		btree_insert(bmap->tree, 0, &states[XR_E_INUSE_FS]);
+		btree_insert(bmap->tree, ag_hdr_block, &states[XR_E_UNKNOWN]);
+		btree_insert(bmap->tree, ag_size, &states[XR_E_BAD_STATE]);
+		bmap->nr_recs = 3;
 	}
 
 	if (mp->m_sb.sb_logstart != 0) {
@@ -278,7 +498,7 @@ init_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct btree_root *));
+	ag_bmap = calloc(mp->m_sb.sb_agcount, sizeof(struct ag_bmap));
 	if (!ag_bmap)
 		do_error(_("couldn't allocate block map btree roots\n"));
 
@@ -287,7 +507,7 @@ init_bmaps(xfs_mount_t *mp)
 		do_error(_("couldn't allocate block map locks\n"));
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_init(&ag_bmap[i]);
+		btree_init(&ag_bmap[i].tree);
 		pthread_mutex_init(&ag_locks[i].lock, NULL);
 	}
 	pthread_mutex_init(&rt_lock.lock, NULL);
@@ -301,8 +521,11 @@ free_bmaps(xfs_mount_t *mp)
 {
 	xfs_agnumber_t i;
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		btree_destroy(ag_bmap[i]);
+	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		btree_destroy(ag_bmap[i].tree);
+		slab_free_array(ag_bmap[i].dense, dense_size(&ag_bmap[i]),
+				ag_bmap[i].dense_mem);
+	}
 	free(ag_bmap);
 	ag_bmap = NULL;
 
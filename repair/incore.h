@@ -7,7 +7,7 @@
 #ifndef XFS_REPAIR_INCORE_H
 #define XFS_REPAIR_INCORE_H
 
-#include "avl.h"
+#include "rangemap.h"
 
 
 /*
@@ -30,6 +30,10 @@ int		get_bmap_ext(xfs_agnumber_t agno, xfs_agblock_t agbno,
 
 void		set_rtbmap(xfs_rtblock_t bno, int state);
 int		get_rtbmap(xfs_rtblock_t bno);
+void		set_rtbmap_ext(xfs_rtblock_t bno, xfs_rtblock_t len,
+			       int state);
+xfs_rtblock_t	get_rtbmap_run(xfs_rtblock_t bno, xfs_rtblock_t end,
+			       bool *freep);
 
 static inline void
 set_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno, int state)
@@ -55,31 +59,10 @@ get_bmap(xfs_agnumber_t agno, xfs_agblock_t agbno)
 typedef unsigned char extent_state_t;
 
 typedef struct extent_tree_node  {
-	avlnode_t		avl_node;
 	xfs_agblock_t		ex_startblock;	/* starting block (agbno) */
 	xfs_extlen_t		ex_blockcount;	/* number of blocks in extent */
-	extent_state_t		ex_state;	/* see state flags below */
-
-	struct extent_tree_node		*next;	/* for bcnt extent lists */
-	struct extent_tree_node		*last;	/* for bcnt extent list anchors */
-#if 0
-	xfs_ino_t		ex_inode;	/* owner, NULL if free or  */
-						/*	multiply allocated */
-#endif
 } extent_tree_node_t;
 
-typedef struct rt_extent_tree_node  {
-	avlnode_t		avl_node;
-	xfs_rtblock_t		rt_startblock;	/* starting realtime block */
-	xfs_extlen_t		rt_blockcount;	/* number of blocks in extent */
-	extent_state_t		rt_state;	/* see state flags below */
-
-#if 0
-	xfs_ino_t		ex_inode;	/* owner, NULL if free or  */
-						/*	multiply allocated */
-#endif
-} rt_extent_tree_node_t;
-
 /* extent states, prefix with XR_ to avoid conflict with buffer cache defines */
 
 #define XR_E_UNKNOWN	0	/* unknown state */
@@ -120,8 +103,8 @@ find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t agbno);
 extent_tree_node_t *
 findfirst_bno_extent(xfs_agnumber_t agno);
 
-#define findnext_bno_extent(exent_ptr)	\
-		((extent_tree_node_t *) ((exent_ptr)->avl_node.avl_nextino))
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
 
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
@@ -145,7 +128,7 @@ findbiggest_bcnt_extent(xfs_agnumber_t agno);
 extent_tree_node_t *
 findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext);
 
-extent_tree_node_t *
+void
 get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount);
 
@@ -157,20 +140,23 @@ int		add_dup_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 			xfs_extlen_t blockcount);
 int		search_dup_extent(xfs_agnumber_t agno,
 			xfs_agblock_t start_agbno, xfs_agblock_t end_agbno);
+bool		dup_extent_possible(xfs_agnumber_t agno,
+			xfs_agblock_t start_agbno, xfs_agblock_t end_agbno);
 void		add_rt_dup_extent(xfs_rtblock_t	startblock,
 				xfs_extlen_t	blockcount);
 
 int		search_rt_dup_extent(xfs_mount_t	*mp,
 					xfs_rtblock_t	bno);
 
-/*
- * extent/tree recyling and deletion routines
- */
+struct repair_ckpt;
+void		dup_extents_save_checkpoint(struct xfs_mount *mp,
+					struct repair_ckpt *ck);
+void		dup_extents_load_checkpoint(struct xfs_mount *mp,
+					struct repair_ckpt *ck);
 
 /*
- * return an extent node to the extent node free list
+ * extent/tree recyling and deletion routines
  */
-void		release_extent_tree_node(extent_tree_node_t *node);
 
 /*
  * recycle all the nodes in the per-AG tree
@@ -242,48 +228,73 @@ int		count_bcnt_extents(xfs_agnumber_t);
 
 typedef xfs_ino_t parent_entry_t;
 
-struct nlink_ops;
-
+/*
+ * Parents of the inodes in a record, packed: the Nth bit set in pmask has its
+ * parent in pentries[N].  The array grows PLIST_CHUNK_SIZE entries at a time.
+ */
 typedef struct parent_list  {
 	uint64_t		pmask;
 	parent_entry_t		*pentries;
-#ifdef DEBUG
-	short			cnt;
-#endif
 } parent_list_t;
 
-union ino_nlink {
-	uint8_t		*un8;
-	uint16_t	*un16;
-	uint32_t	*un32;
-};
-
 typedef struct ino_ex_data  {
 	uint64_t		ino_reached;	/* bit == 1 if reached */
 	uint64_t		ino_processed;	/* reference checked bit mask */
-	parent_list_t		*parents;
-	union ino_nlink		counted_nlinks;/* counted nlinks in P6 */
+	uint8_t			counted_nlinks[XFS_INODES_PER_CHUNK];
+						/* counted nlinks in P6 */
 } ino_ex_data_t;
 
+/*
+ * Link counts are kept one byte per inode.  A count that doesn't fit is
+ * promoted in place: its byte is set to IREC_NLINK_WIDE and the real value
+ * lives in the record's nlinks_wide array, disk counts first and then the
+ * counted links, which is only allocated for the few records that need it.
+ */
+#define IREC_NLINK_WIDE		0xff
+
+/* ino_flags */
+#define IREC_HAS_FTYPES		(1U << 0)	/* ftypes[] is in use */
+
+/*
+ * Inode records are carved out of per-AG pools and sized to a whole number
+ * of cache lines, with the tree linkage and the bitmaps that every phase
+ * looks at up front.  The byte arrays are embedded so that a record costs a
+ * single pool slot; the records are protected by a table of striped locks
+ * (see irec_lock) instead of a mutex each.
+ */
 typedef struct ino_tree_node  {
-	avlnode_t		avl_node;
+	struct ino_tree_node	*next;		/* next record in the AG */
 	xfs_agino_t		ino_startnum;	/* starting inode # */
+	uint8_t			ino_flags;
 	xfs_inofree_t		ir_free;	/* inode free bit mask */
 	uint64_t		ir_sparse;	/* sparse inode bitmask */
 	uint64_t		ino_confirmed;	/* confirmed bitmask */
 	uint64_t		ino_isa_dir;	/* bit == 1 if a directory */
 	uint64_t		ino_was_rl;	/* bit == 1 if reflink flag set */
 	uint64_t		ino_is_rl;	/* bit == 1 if reflink flag should be set */
-	uint8_t			nlink_size;
-	union ino_nlink		disk_nlinks;	/* on-disk nlinks, set in P3 */
-	union  {
-		ino_ex_data_t	*ex_data;	/* phases 6,7 */
-		parent_list_t	*plist;		/* phases 2-5 */
-	} ino_un;
-	uint8_t			*ftypes;	/* phases 3,6 */
-	pthread_mutex_t		lock;
+	ino_ex_data_t		*ex_data;	/* phases 6,7 */
+	parent_list_t		parents;	/* phases 2-7 */
+	uint32_t		*nlinks_wide;	/* promoted link counts */
+	uint8_t			disk_nlinks[XFS_INODES_PER_CHUNK];
+						/* on-disk nlinks, set in P3 */
+	uint8_t			ftypes[XFS_INODES_PER_CHUNK];
+						/* phases 3,6 */
 } ino_tree_node_t;
 
+/* pool slots are rounded up to this, a cache line on most machines */
+#define IREC_ALIGN		64
+
+#define IREC_LOCK_STRIPES	1024
+extern pthread_mutex_t		irec_locks[IREC_LOCK_STRIPES];
+
+static inline pthread_mutex_t *
+irec_lock(struct ino_tree_node *irec)
+{
+	uintptr_t	slot = (uintptr_t)irec / sizeof(struct ino_tree_node);
+
+	return &irec_locks[slot & (IREC_LOCK_STRIPES - 1)];
+}
+
 #define INOS_PER_IREC	(sizeof(uint64_t) * NBBY)
 #define	IREC_MASK(i)	((uint64_t)1 << (i))
 
@@ -300,7 +311,7 @@ void		free_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec);
 void		get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
 			      ino_tree_node_t *ino_rec);
 
-extern avltree_desc_t     **inode_tree_ptrs;
+extern struct rangemap		*inode_trees;
 
 static inline int
 get_inode_offset(struct xfs_mount *mp, xfs_ino_t ino, ino_tree_node_t *irec)
@@ -310,7 +321,7 @@ get_inode_offset(struct xfs_mount *mp, xfs_ino_t ino, ino_tree_node_t *irec)
 static inline ino_tree_node_t *
 findfirst_inode_rec(xfs_agnumber_t agno)
 {
-	return((ino_tree_node_t *) inode_tree_ptrs[agno]->avl_firstino);
+	return rangemap_first(&inode_trees[agno]);
 }
 static inline ino_tree_node_t *
 find_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, xfs_agino_t ino)
@@ -320,8 +331,7 @@ find_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, xfs_agino_t ino)
 	 */
 	if (agno >= mp->m_sb.sb_agcount)
 		return NULL;
-	return((ino_tree_node_t *)
-		avl_findrange(inode_tree_ptrs[agno], ino));
+	return rangemap_find(&inode_trees[agno], ino);
 }
 void		find_inode_rec_range(struct xfs_mount *mp, xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
@@ -341,9 +351,12 @@ void		print_inode_list(xfs_agnumber_t agno);
 void		print_uncertain_inode_list(xfs_agnumber_t agno);
 
 /*
- * separate trees for uncertain inodes (they may not exist).
+ * separate indexes for uncertain inodes (they may not exist).
  */
 ino_tree_node_t		*findfirst_uncertain_inode_rec(xfs_agnumber_t agno);
+unsigned int		find_uncertain_inode_recs(xfs_agnumber_t agno,
+						ino_tree_node_t **recs,
+						unsigned int nr);
 ino_tree_node_t		*find_uncertain_inode_rec(xfs_agnumber_t agno,
 						xfs_agino_t ino);
 void			add_inode_uncertain(xfs_mount_t *mp,
@@ -359,14 +372,7 @@ void			clear_uncertain_ino_cache(xfs_agnumber_t agno);
 /*
  * return next in-order inode tree node.  takes an "ino_tree_node_t *"
  */
-#define next_ino_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_nextino))
-/*
- * return the next linked inode (forward avl tree link)-- meant to be used
- * by linked list routines (uncertain inode routines/records)
- */
-#define next_link_rec(ino_node_ptr)	\
-		((ino_tree_node_t *) ((ino_node_ptr)->avl_node.avl_forw))
+#define next_ino_rec(ino_node_ptr)	((ino_node_ptr)->next)
 
 /*
  * finobt helpers
@@ -412,14 +418,14 @@ next_free_ino_rec(ino_tree_node_t *ino_rec)
  */
 static inline void add_inode_refchecked(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
-	irec->ino_un.ex_data->ino_processed |= IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
+	irec->ex_data->ino_processed |= IREC_MASK(offset);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline int is_inode_refchecked(struct ino_tree_node *irec, int offset)
 {
-	return (irec->ino_un.ex_data->ino_processed & IREC_MASK(offset)) != 0;
+	return (irec->ex_data->ino_processed & IREC_MASK(offset)) != 0;
 }
 
 /*
@@ -440,16 +446,16 @@ static inline int is_inode_confirmed(struct ino_tree_node *irec, int offset)
  */
 static inline void set_inode_isadir(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	irec->ino_isa_dir |= IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline void clear_inode_isadir(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	irec->ino_isa_dir &= ~IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline int inode_isadir(struct ino_tree_node *irec, int offset)
@@ -462,19 +468,19 @@ static inline int inode_isadir(struct ino_tree_node *irec, int offset)
  */
 static inline void set_inode_free(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	set_inode_confirmed(irec, offset);
 	irec->ir_free |= XFS_INOBT_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 
 }
 
 static inline void set_inode_used(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	set_inode_confirmed(irec, offset);
 	irec->ir_free &= ~XFS_INOBT_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline int is_inode_free(struct ino_tree_node *irec, int offset)
@@ -487,9 +493,9 @@ static inline int is_inode_free(struct ino_tree_node *irec, int offset)
  */
 static inline void set_inode_sparse(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	irec->ir_sparse |= XFS_INOBT_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline bool is_inode_sparse(struct ino_tree_node *irec, int offset)
@@ -502,16 +508,16 @@ static inline bool is_inode_sparse(struct ino_tree_node *irec, int offset)
  */
 static inline void set_inode_was_rl(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	irec->ino_was_rl |= IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline void clear_inode_was_rl(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	irec->ino_was_rl &= ~IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline int inode_was_rl(struct ino_tree_node *irec, int offset)
@@ -524,16 +530,16 @@ static inline int inode_was_rl(struct ino_tree_node *irec, int offset)
  */
 static inline void set_inode_is_rl(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	irec->ino_is_rl |= IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline void clear_inode_is_rl(struct ino_tree_node *irec, int offset)
 {
-	pthread_mutex_lock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
 	irec->ino_is_rl &= ~IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 static inline int inode_is_rl(struct ino_tree_node *irec, int offset)
@@ -559,28 +565,28 @@ uint32_t get_inode_disk_nlinks(struct ino_tree_node *irec, int offset);
 
 static inline int is_inode_reached(struct ino_tree_node *irec, int offset)
 {
-	ASSERT(irec->ino_un.ex_data != NULL);
-	return (irec->ino_un.ex_data->ino_reached & IREC_MASK(offset)) != 0;
+	ASSERT(irec->ex_data != NULL);
+	return (irec->ex_data->ino_reached & IREC_MASK(offset)) != 0;
 }
 
 static inline void add_inode_reached(struct ino_tree_node *irec, int offset)
 {
 	add_inode_ref(irec, offset);
-	pthread_mutex_lock(&irec->lock);
-	irec->ino_un.ex_data->ino_reached |= IREC_MASK(offset);
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_lock(irec_lock(irec));
+	irec->ex_data->ino_reached |= IREC_MASK(offset);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 /*
- * get/set inode filetype. Only used if the superblock feature bit is set
- * which allocates irec->ftypes.
+ * get/set inode filetype. Only used if the superblock feature bit is set,
+ * which sets IREC_HAS_FTYPES on every record.
  */
 static inline void
 set_inode_ftype(struct ino_tree_node *irec,
 	int		ino_offset,
 	uint8_t		ftype)
 {
-	if (irec->ftypes)
+	if (irec->ino_flags & IREC_HAS_FTYPES)
 		irec->ftypes[ino_offset] = ftype;
 }
 
@@ -589,7 +595,7 @@ get_inode_ftype(
 	struct ino_tree_node *irec,
 	int		ino_offset)
 {
-	if (!irec->ftypes)
+	if (!(irec->ino_flags & IREC_HAS_FTYPES))
 		return XFS_DIR3_FT_UNKNOWN;
 	return irec->ftypes[ino_offset];
 }
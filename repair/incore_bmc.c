@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
@@ -5,15 +5,13 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
-#include "btree.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
 #include "protos.h"
 #include "err_protos.h"
-#include "libfrog/avl64.h"
 #include "threads.h"
+#include "checkpoint.h"
 
 /*
  * note:  there are 4 sets of incore things handled here:
@@ -32,35 +30,179 @@
  * phase 3.  The inode tree and bno/bnct trees go away after phase 5.
  */
 
-static avl64tree_desc_t	*rt_ext_tree_ptr;	/* dup extent tree for rt */
-static pthread_mutex_t	rt_ext_tree_lock;
+/*
+ * Duplicate extents are kept in packed arrays of disjoint extents sorted by
+ * start block, with the start and end blocks in separate arrays so that a
+ * lookup binary searches through densely packed keys.  Phase 4 finds the
+ * duplicates with an ordered sweep of the block map, so new extents nearly
+ * always get appended (or merged into the last one).
+ *
+ * The lists are fully built before any inode is checked against them, so
+ * lookups don't take the lock.  Releasing a list only forgets its contents;
+ * the arrays stay put until teardown in case another AG is still looking.
+ */
+struct dup_extent_list {
+	pthread_mutex_t		lock;		/* serialises updates */
+	uint64_t		*starts;
+	uint64_t		*ends;		/* first block past the extent */
+	size_t			nr;
+	size_t			max;
+	bool			forgotten;	/* released while not empty */
+};
+
+static struct dup_extent_list	rt_dup_extents;	/* dup extents for rt */
+static struct dup_extent_list	*dup_extent_lists; /* per ag dup extents */
 
-static struct btree_root **dup_extent_trees;	/* per ag dup extent trees */
-static pthread_mutex_t *dup_extent_tree_locks;
+/*
+ * Free space extents are kept in two packed arrays per AG, one sorted by
+ * starting block and one by size (then starting block), which is the order
+ * the bnobt and cntbt records must be loaded in.
+ *
+ * Phase 5 fills both from a single ordered sweep of the block map, so the
+ * by-block list is built by appending and the by-size list is sorted once,
+ * the first time somebody looks at it.  After that the only updates come
+ * from reserving btree blocks, which always consumes the smallest extent and
+ * may put back a shorter remainder.  Deleting from the by-size list is then
+ * just moving its start forward, and the remainder (which is shorter than
+ * anything else left) goes right back in front.  In the by-block list the
+ * remainder lands in the slot of the extent it came from, so deleted extents
+ * there are left behind as zero length holes.  Anything else still works,
+ * it's just slower.
+ */
+struct free_extent_list {
+	extent_tree_node_t	*exts;
+	size_t			first;		/* skip consumed by-size exts */
+	size_t			nr;		/* slots used, including holes */
+	size_t			max;
+	size_t			nr_live;	/* extents, not counting holes */
+	uint64_t		nr_blocks;
+	bool			sorted;		/* by-size list is sorted */
+};
 
-static avltree_desc_t	**extent_bno_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
-						 * sorted by starting block
-						 * number
-						 */
-static avltree_desc_t	**extent_bcnt_ptrs;	/*
-						 * array of extent tree ptrs
-						 * one per ag for free extents
-						 * sorted by size
-						 */
+static struct free_extent_list	*extent_bno_lists; /* per ag by block list */
+static struct free_extent_list	*extent_bcnt_lists; /* per ag by size list */
 
 /*
- * duplicate extent tree functions
+ * duplicate extent list functions
  */
 
+static void
+dup_extent_list_init(
+	struct dup_extent_list	*del)
+{
+	pthread_mutex_init(&del->lock, NULL);
+	del->starts = del->ends = NULL;
+	del->nr = del->max = 0;
+	del->forgotten = false;
+}
+
+static void
+dup_extent_list_destroy(
+	struct dup_extent_list	*del)
+{
+	free(del->starts);
+	free(del->ends);
+	del->starts = del->ends = NULL;
+	del->nr = del->max = 0;
+	pthread_mutex_destroy(&del->lock);
+}
+
+/* Index of the first extent starting after @bno. */
+static size_t
+dup_extent_upper_bound(
+	const uint64_t		*starts,
+	size_t			nr,
+	uint64_t		bno)
+{
+	size_t			lo = 0;
+	size_t			hi = nr;
+
+	while (lo < hi) {
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (starts[mid] <= bno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Add [start, end) to the list, merging with overlapping or adjacent ones. */
+static void
+dup_extent_list_add(
+	struct dup_extent_list	*del,
+	uint64_t		start,
+	uint64_t		end)
+{
+	size_t			lo, hi;
+
+	pthread_mutex_lock(&del->lock);
+
+	/* lo is the first extent we touch, hi the first one past that */
+	lo = dup_extent_upper_bound(del->starts, del->nr, start);
+	if (lo > 0 && del->ends[lo - 1] >= start)
+		lo--;
+	for (hi = lo; hi < del->nr && del->starts[hi] <= end; hi++) {
+		start = min(start, del->starts[hi]);
+		end = max(end, del->ends[hi]);
+	}
+
+	if (lo == hi && del->nr == del->max) {
+		size_t		max = max(del->max * 2, (size_t)64);
+		uint64_t	*starts, *ends;
+
+		starts = realloc(del->starts, max * sizeof(uint64_t));
+		if (!starts)
+			do_error(_("couldn't allocate duplicate extent list\n"));
+		del->starts = starts;
+		ends = realloc(del->ends, max * sizeof(uint64_t));
+		if (!ends)
+			do_error(_("couldn't allocate duplicate extent list\n"));
+		del->ends = ends;
+		del->max = max;
+	}
+
+	/* replace extents [lo, hi) with the new one */
+	if (hi != lo + 1) {
+		memmove(&del->starts[lo + 1], &del->starts[hi],
+				(del->nr - hi) * sizeof(uint64_t));
+		memmove(&del->ends[lo + 1], &del->ends[hi],
+				(del->nr - hi) * sizeof(uint64_t));
+		del->nr = del->nr + 1 - (hi - lo);
+	}
+	del->starts[lo] = start;
+	del->ends[lo] = end;
+
+	pthread_mutex_unlock(&del->lock);
+}
+
+/* Does any duplicate extent overlap [start, end)? */
+static bool
+dup_extent_list_search(
+	struct dup_extent_list	*del,
+	uint64_t		start,
+	uint64_t		end)
+{
+	size_t			nr = uatomic_read(&del->nr);
+	size_t			i;
+
+	/* the last extent starting before @end is the only candidate */
+	i = dup_extent_upper_bound(del->starts, nr, end - 1);
+	return i > 0 && del->ends[i - 1] > start;
+}
+
 void
 release_dup_extent_tree(
 	xfs_agnumber_t		agno)
 {
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	btree_clear(dup_extent_trees[agno]);
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
+	struct dup_extent_list	*del = &dup_extent_lists[agno];
+
+	pthread_mutex_lock(&del->lock);
+	if (del->nr)
+		uatomic_set(&del->forgotten, true);
+	uatomic_set(&del->nr, 0);
+	pthread_mutex_unlock(&del->lock);
 }
 
 int
@@ -69,16 +211,13 @@ add_dup_extent(
 	xfs_agblock_t		startblock,
 	xfs_extlen_t		blockcount)
 {
-	int	ret;
 #ifdef XR_DUP_TRACE
 	fprintf(stderr, "Adding dup extent - %d/%d %d\n", agno, startblock,
 		blockcount);
 #endif
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	ret = btree_insert(dup_extent_trees[agno], startblock,
-				(void *)(uintptr_t)(startblock + blockcount));
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
-	return ret;
+	dup_extent_list_add(&dup_extent_lists[agno], startblock,
+			(uint64_t)startblock + blockcount);
+	return 0;
 }
 
 int
@@ -87,513 +226,416 @@ search_dup_extent(
 	xfs_agblock_t		start_agbno,
 	xfs_agblock_t		end_agbno)
 {
-	unsigned long	bno;
-	int		ret;
-
-	pthread_mutex_lock(&dup_extent_tree_locks[agno]);
-	if (!btree_find(dup_extent_trees[agno], start_agbno, &bno)) {
-		ret = 0;
-		goto out;	/* this really shouldn't happen */
-	}
-	if (bno < end_agbno) {
-		ret = 1;
-		goto out;
-	}
-	ret = (uintptr_t)btree_peek_prev(dup_extent_trees[agno], NULL) >
-								start_agbno;
-out:
-	pthread_mutex_unlock(&dup_extent_tree_locks[agno]);
-	return ret;
+	return dup_extent_list_search(&dup_extent_lists[agno], start_agbno,
+			end_agbno);
 }
 
-
 /*
- * extent tree stuff is avl trees of duplicate extents,
- * sorted in order by block number.  there is one tree per ag.
+ * Could anything in [start_agbno, end_agbno) be claimed more than once?
+ * Unlike search_dup_extent, say yes for every block of an AG whose list
+ * has already been released with extents in it.
  */
+bool
+dup_extent_possible(
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		start_agbno,
+	xfs_agblock_t		end_agbno)
+{
+	struct dup_extent_list	*del = &dup_extent_lists[agno];
 
-static extent_tree_node_t *
-mk_extent_tree_nodes(xfs_agblock_t new_startblock,
-	xfs_extlen_t new_blockcount, extent_state_t new_state)
+	return uatomic_read(&del->forgotten) ||
+	       dup_extent_list_search(del, start_agbno, end_agbno);
+}
+
+static void
+dup_extent_list_save(
+	struct dup_extent_list	*del,
+	struct repair_ckpt	*ck)
 {
-	extent_tree_node_t *new;
+	uint64_t		nr = del->nr;
 
-	new = malloc(sizeof(*new));
-	if (!new)
-		do_error(_("couldn't allocate new extent descriptor.\n"));
+	ckpt_write(ck, &nr, sizeof(nr));
+	ckpt_write(ck, del->starts, nr * sizeof(uint64_t));
+	ckpt_write(ck, del->ends, nr * sizeof(uint64_t));
+}
 
-	new->avl_node.avl_nextino = NULL;
-	new->ex_startblock = new_startblock;
-	new->ex_blockcount = new_blockcount;
-	new->ex_state = new_state;
-	new->next = NULL;
-	new->last = NULL;
+static void
+dup_extent_list_load(
+	struct dup_extent_list	*del,
+	struct repair_ckpt	*ck)
+{
+	uint64_t		nr, end;
+	uint64_t		*starts;
+	uint64_t		i;
 
-	return new;
+	ckpt_read(ck, &nr, sizeof(nr));
+	if (!nr)
+		return;
+	starts = malloc(nr * sizeof(uint64_t));
+	if (!starts)
+		do_error(_("couldn't allocate duplicate extent list\n"));
+
+	ckpt_read(ck, starts, nr * sizeof(uint64_t));
+	for (i = 0; i < nr; i++) {
+		ckpt_read(ck, &end, sizeof(end));
+		dup_extent_list_add(del, starts[i], end);
+	}
+	free(starts);
 }
 
+/* Save the duplicate extents found in phase 4 to a checkpoint. */
 void
-release_extent_tree_node(extent_tree_node_t *node)
+dup_extents_save_checkpoint(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
 {
-	free(node);
+	xfs_agnumber_t		agno;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		dup_extent_list_save(&dup_extent_lists[agno], ck);
+	dup_extent_list_save(&rt_dup_extents, ck);
+}
+
+void
+dup_extents_load_checkpoint(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	xfs_agnumber_t		agno;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		dup_extent_list_load(&dup_extent_lists[agno], ck);
+	dup_extent_list_load(&rt_dup_extents, ck);
 }
 
 /*
- * routines to recycle all nodes in a tree.  it walks the tree
- * and puts all nodes back on the free list so the nodes can be
- * reused.  the duplicate and bno/bcnt extent trees for each AG
- * are recycled after they're no longer needed to save memory
+ * free space extent list functions
  */
+
 static void
-release_extent_tree(avltree_desc_t *tree)
+free_extent_list_reset(
+	struct free_extent_list	*fel)
 {
-	extent_tree_node_t	*ext;
-	extent_tree_node_t	*tmp;
-	extent_tree_node_t	*lext;
-	extent_tree_node_t	*ltmp;
+	free(fel->exts);
+	memset(fel, 0, sizeof(*fel));
+}
 
-	if (tree->avl_firstino == NULL)
-		return;
+/* Open up a slot at @idx and fill it in. */
+static void
+free_extent_list_insert(
+	struct free_extent_list	*fel,
+	size_t			idx,
+	xfs_agblock_t		startblock,
+	xfs_extlen_t		blockcount)
+{
+	if (fel->nr == fel->max) {
+		size_t			max = max(fel->max * 2, (size_t)256);
+		extent_tree_node_t	*exts;
 
-	ext = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
-
-		/*
-		 * ext->next is guaranteed to be set only in bcnt trees
-		 */
-		if (ext->next != NULL)  {
-			lext = ext->next;
-			while (lext != NULL)  {
-				ltmp = lext->next;
-				release_extent_tree_node(lext);
-				lext = ltmp;
-			}
-		}
-
-		release_extent_tree_node(ext);
-		ext = tmp;
+		exts = realloc(fel->exts, max * sizeof(extent_tree_node_t));
+		if (!exts)
+			do_error(_("couldn't allocate new extent descriptor.\n"));
+		fel->exts = exts;
+		fel->max = max;
 	}
 
-	tree->avl_root = tree->avl_firstino = NULL;
-
-	return;
+	if (idx < fel->nr)
+		memmove(&fel->exts[idx + 1], &fel->exts[idx],
+				(fel->nr - idx) * sizeof(extent_tree_node_t));
+	fel->nr++;
+	fel->exts[idx].ex_startblock = startblock;
+	fel->exts[idx].ex_blockcount = blockcount;
 }
 
 /*
- * top-level (visible) routines
+ * routines to recycle the lists once they're no longer needed to save
+ * memory
  */
 void
 release_agbno_extent_tree(xfs_agnumber_t agno)
 {
-	release_extent_tree(extent_bno_ptrs[agno]);
-
-	return;
+	free_extent_list_reset(&extent_bno_lists[agno]);
 }
 
 void
 release_agbcnt_extent_tree(xfs_agnumber_t agno)
 {
-	release_extent_tree(extent_bcnt_ptrs[agno]);
-
-	return;
+	free_extent_list_reset(&extent_bcnt_lists[agno]);
 }
 
 /*
- * the next 4 routines manage the trees of free extents -- 2 trees
- * per AG.  The first tree is sorted by block number.  The second
- * tree is sorted by extent size.  This is the bno tree.
+ * the next 4 routines manage the lists of free extents -- 2 lists
+ * per AG.  The first list is sorted by block number.  This is the bno list.
  */
+
+/* Index of the first slot starting after @startblock. */
+static size_t
+bno_upper_bound(
+	struct free_extent_list	*fel,
+	xfs_agblock_t		startblock)
+{
+	size_t			lo = 0;
+	size_t			hi = fel->nr;
+
+	while (lo < hi) {
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (fel->exts[mid].ex_startblock <= startblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 void
 add_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t *ext;
+	struct free_extent_list	*fel = &extent_bno_lists[agno];
+	size_t			idx = bno_upper_bound(fel, startblock);
 
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	ASSERT(blockcount > 0);
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
-
-	if (avl_insert(extent_bno_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	if (idx > 0 && fel->exts[idx - 1].ex_blockcount == 0) {
+		/* refill the hole in front of us */
+		fel->exts[idx - 1].ex_startblock = startblock;
+		fel->exts[idx - 1].ex_blockcount = blockcount;
+	} else if (idx > 0 && fel->exts[idx - 1].ex_startblock == startblock) {
 		do_error(_("duplicate bno extent range\n"));
+	} else {
+		free_extent_list_insert(fel, idx, startblock, blockcount);
 	}
+
+	fel->nr_live++;
+	fel->nr_blocks += blockcount;
+}
+
+static extent_tree_node_t *
+bno_next_live(
+	struct free_extent_list	*fel,
+	extent_tree_node_t	*ext)
+{
+	extent_tree_node_t	*end = fel->exts + fel->nr;
+
+	while (ext < end && ext->ex_blockcount == 0)
+		ext++;
+	return ext < end ? ext : NULL;
 }
 
 extent_tree_node_t *
 findfirst_bno_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	struct free_extent_list	*fel = &extent_bno_lists[agno];
 
-	return((extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino);
+	return bno_next_live(fel, fel->exts);
+}
+
+extent_tree_node_t *
+findnext_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
+{
+	return bno_next_live(&extent_bno_lists[agno], ext + 1);
 }
 
 extent_tree_node_t *
 find_bno_extent(xfs_agnumber_t agno, xfs_agblock_t startblock)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	struct free_extent_list	*fel = &extent_bno_lists[agno];
+	size_t			idx = bno_upper_bound(fel, startblock);
+	extent_tree_node_t	*ext;
 
-	return((extent_tree_node_t *) avl_find(extent_bno_ptrs[agno],
-						startblock));
+	if (idx == 0)
+		return NULL;
+	ext = &fel->exts[idx - 1];
+	if (ext->ex_startblock != startblock || ext->ex_blockcount == 0)
+		return NULL;
+	return ext;
 }
 
 /*
- * delete a node that's in the tree (pointer obtained by a find routine)
+ * delete an extent that's in the list (pointer obtained by a find routine)
  */
 void
 get_bno_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	ASSERT(extent_bno_ptrs != NULL);
-	ASSERT(extent_bno_ptrs[agno] != NULL);
+	struct free_extent_list	*fel = &extent_bno_lists[agno];
 
-	avl_delete(extent_bno_ptrs[agno], &ext->avl_node);
+	ASSERT(ext->ex_blockcount > 0);
 
-	return;
+	fel->nr_live--;
+	fel->nr_blocks -= ext->ex_blockcount;
+	ext->ex_blockcount = 0;
 }
 
 /*
- * the next 4 routines manage the trees of free extents -- 2 trees
- * per AG.  The first tree is sorted by block number.  The second
- * tree is sorted by extent size.  This is the bcnt tree.
+ * the next 4 routines manage the lists of free extents -- 2 lists
+ * per AG.  The second list is sorted by extent size, then by block number.
+ * This is the bcnt list.
  */
-void
-add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
-		xfs_extlen_t blockcount)
+
+static inline int
+bcnt_cmp(
+	xfs_extlen_t		blockcount1,
+	xfs_agblock_t		startblock1,
+	xfs_extlen_t		blockcount2,
+	xfs_agblock_t		startblock2)
+{
+	if (blockcount1 != blockcount2)
+		return blockcount1 < blockcount2 ? -1 : 1;
+	if (startblock1 != startblock2)
+		return startblock1 < startblock2 ? -1 : 1;
+	return 0;
+}
+
+static int
+bcnt_sort_cmp(
+	const void		*a,
+	const void		*b)
 {
-	extent_tree_node_t *ext, *prev, *current, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
+	const extent_tree_node_t *ea = a;
+	const extent_tree_node_t *eb = b;
 
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	return bcnt_cmp(ea->ex_blockcount, ea->ex_startblock,
+			eb->ex_blockcount, eb->ex_startblock);
+}
 
-	ext = mk_extent_tree_nodes(startblock, blockcount, XR_E_FREE);
+static struct free_extent_list *
+bcnt_list(
+	xfs_agnumber_t		agno)
+{
+	struct free_extent_list	*fel = &extent_bcnt_lists[agno];
 
-	ASSERT(ext->next == NULL);
+	if (!fel->sorted) {
+		qsort(fel->exts + fel->first, fel->nr - fel->first,
+				sizeof(extent_tree_node_t), bcnt_sort_cmp);
+		fel->sorted = true;
+	}
+	return fel;
+}
+
+/* Index of the first extent not sorting before (@blockcount, @startblock). */
+static size_t
+bcnt_lower_bound(
+	struct free_extent_list	*fel,
+	xfs_agblock_t		startblock,
+	xfs_extlen_t		blockcount)
+{
+	size_t			lo = fel->first;
+	size_t			hi = fel->nr;
+
+	while (lo < hi) {
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (bcnt_cmp(fel->exts[mid].ex_blockcount,
+			     fel->exts[mid].ex_startblock,
+			     blockcount, startblock) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void
+add_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
+		xfs_extlen_t blockcount)
+{
+	struct free_extent_list	*fel = &extent_bcnt_lists[agno];
+	size_t			idx;
 
 #ifdef XR_BCNT_TRACE
 	fprintf(stderr, "adding bcnt: agno = %d, start = %u, count = %u\n",
 			agno, startblock, blockcount);
 #endif
-	if ((current = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) != NULL)  {
-		/*
-		 * avl tree code doesn't handle dups so insert
-		 * onto linked list in increasing startblock order
-		 *
-		 * when called from mk_incore_fstree,
-		 * startblock is in increasing order.
-		 * current is an "anchor" node.
-		 * quick check if the new ext goes to the end.
-		 * if so, append at the end, using the last field
-		 * of the "anchor".
-		 */
-		ASSERT(current->last != NULL);
-		if (startblock > current->last->ex_startblock) {
-			current->last->next = ext;
-			current->last = ext;
-			return;
-		}
-
-		/*
-		 * scan, to find the proper location for new entry.
-		 * this scan is *very* expensive and gets worse with
-		 * with increasing entries.
-		 */
-		top = prev = current;
-		while (current != NULL &&
-				startblock > current->ex_startblock)  {
-			prev = current;
-			current = current->next;
-		}
-
-		if (top == current)  {
-			ASSERT(top == prev);
-			/*
-			 * new entry should be ahead of current.
-			 * to keep the avl tree intact,
-			 * swap the values of to-be-inserted element
-			 * and the values of the head of the list.
-			 * then insert as the 2nd element on the list.
-			 *
-			 * see the comment in get_bcnt_extent()
-			 * as to why we have to do this.
-			 */
-			tmp_startblock = top->ex_startblock;
-			tmp_blockcount = top->ex_blockcount;
-			tmp_state = top->ex_state;
-
-			top->ex_startblock = ext->ex_startblock;
-			top->ex_blockcount = ext->ex_blockcount;
-			top->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			current = top->next;
-			prev = top;
-		}
-
-		prev->next = ext;
-		ext->next = current;
-
+	/* not sorted yet, so just pile it on the end */
+	if (!fel->sorted) {
+		free_extent_list_insert(fel, fel->nr, startblock, blockcount);
 		return;
 	}
 
-	if (avl_insert(extent_bcnt_ptrs[agno], (avlnode_t *) ext) == NULL)  {
+	idx = bcnt_lower_bound(fel, startblock, blockcount);
+	if (idx < fel->nr &&
+	    bcnt_cmp(fel->exts[idx].ex_blockcount,
+		     fel->exts[idx].ex_startblock,
+		     blockcount, startblock) == 0)
 		do_error(_(":  duplicate bno extent range\n"));
-	}
 
-	ext->last = ext;	/* ext is an "anchor" node */
+	if (fel->first > 0) {
+		/* reuse the space of consumed extents if we can */
+		fel->first--;
+		memmove(&fel->exts[fel->first], &fel->exts[fel->first + 1],
+				(idx - fel->first - 1) *
+						sizeof(extent_tree_node_t));
+		fel->exts[idx - 1].ex_startblock = startblock;
+		fel->exts[idx - 1].ex_blockcount = blockcount;
+		return;
+	}
 
-	return;
+	free_extent_list_insert(fel, idx, startblock, blockcount);
 }
 
 extent_tree_node_t *
 findfirst_bcnt_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	struct free_extent_list	*fel = bcnt_list(agno);
 
-	return((extent_tree_node_t *) extent_bcnt_ptrs[agno]->avl_firstino);
+	return fel->first < fel->nr ? &fel->exts[fel->first] : NULL;
 }
 
 extent_tree_node_t *
 findbiggest_bcnt_extent(xfs_agnumber_t agno)
 {
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
+	struct free_extent_list	*fel = bcnt_list(agno);
 
-	return((extent_tree_node_t *) avl_lastino(extent_bcnt_ptrs[agno]->avl_root));
+	return fel->first < fel->nr ? &fel->exts[fel->nr - 1] : NULL;
 }
 
 extent_tree_node_t *
 findnext_bcnt_extent(xfs_agnumber_t agno, extent_tree_node_t *ext)
 {
-	avlnode_t *nextino;
-
-	if (ext->next != NULL)  {
-		ASSERT(ext->ex_blockcount == ext->next->ex_blockcount);
-		ASSERT(ext->ex_startblock < ext->next->ex_startblock);
-		return(ext->next);
-	} else  {
-		/*
-		 * have to look at the top of the list to get the
-		 * correct avl_nextino pointer since that pointer
-		 * is maintained and altered by the AVL code.
-		 */
-		nextino = avl_find(extent_bcnt_ptrs[agno], ext->ex_blockcount);
-		ASSERT(nextino != NULL);
-		if (nextino->avl_nextino != NULL)  {
-			ASSERT(ext->ex_blockcount < ((extent_tree_node_t *)
-					nextino->avl_nextino)->ex_blockcount);
-		}
-		return((extent_tree_node_t *) nextino->avl_nextino);
-	}
+	struct free_extent_list	*fel = bcnt_list(agno);
+
+	ASSERT(ext >= &fel->exts[fel->first] && ext < &fel->exts[fel->nr]);
+	return ++ext < &fel->exts[fel->nr] ? ext : NULL;
 }
 
 /*
- * this is meant to be called after you walk the bno tree to
+ * this is meant to be called after you walk the bno list to
  * determine exactly which extent you want (so you'll know the
  * desired value for startblock when you call this routine).
  */
-extent_tree_node_t *
+void
 get_bcnt_extent(xfs_agnumber_t agno, xfs_agblock_t startblock,
 		xfs_extlen_t blockcount)
 {
-	extent_tree_node_t	*ext, *prev, *top;
-	xfs_agblock_t		tmp_startblock;
-	xfs_extlen_t		tmp_blockcount;
-	extent_state_t		tmp_state;
-
-	prev = NULL;
-	ASSERT(extent_bcnt_ptrs != NULL);
-	ASSERT(extent_bcnt_ptrs[agno] != NULL);
-
-	if ((ext = (extent_tree_node_t *) avl_find(extent_bcnt_ptrs[agno],
-							blockcount)) == NULL)
-		return(NULL);
-
-	top = ext;
-
-	if (ext->next != NULL)  {
-		/*
-		 * pull it off the list
-		 */
-		while (ext != NULL && startblock != ext->ex_startblock)  {
-			prev = ext;
-			ext = ext->next;
-		}
-		ASSERT(ext != NULL);
-		if (ext == top)  {
-			/*
-			 * this node is linked into the tree so we
-			 * swap the core values so we can delete
-			 * the next item on the list instead of
-			 * the head of the list.  This is because
-			 * the rest of the tree undoubtedly has
-			 * pointers to the piece of memory that
-			 * is the head of the list so pulling
-			 * the item out of the list and hence
-			 * the avl tree would be a bad idea.
-			 *
-			 * (cheaper than the alternative, a tree
-			 * delete of this node followed by a tree
-			 * insert of the next node on the list).
-			 */
-			tmp_startblock = ext->next->ex_startblock;
-			tmp_blockcount = ext->next->ex_blockcount;
-			tmp_state = ext->next->ex_state;
-
-			ext->next->ex_startblock = ext->ex_startblock;
-			ext->next->ex_blockcount = ext->ex_blockcount;
-			ext->next->ex_state = ext->ex_state;
-
-			ext->ex_startblock = tmp_startblock;
-			ext->ex_blockcount = tmp_blockcount;
-			ext->ex_state = tmp_state;
-
-			ext = ext->next;
-			prev = top;
-		}
-		/*
-		 * now, a simple list deletion
-		 */
-		prev->next = ext->next;
-		ext->next = NULL;
-	} else  {
-		/*
-		 * no list, just one node.  simply delete
-		 */
-		avl_delete(extent_bcnt_ptrs[agno], &ext->avl_node);
-	}
-
-	ASSERT(ext->ex_startblock == startblock);
-	ASSERT(ext->ex_blockcount == blockcount);
-	return(ext);
-}
-
-static uintptr_t
-avl_ext_start(avlnode_t *node)
-{
-	return((uintptr_t)
-		((extent_tree_node_t *) node)->ex_startblock);
-}
-
-static uintptr_t
-avl_ext_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((extent_tree_node_t *) node)->ex_startblock +
-		((extent_tree_node_t *) node)->ex_blockcount));
-}
-
-/*
- * convert size to an address for the AVL tree code -- the bigger the size,
- * the lower the address so the biggest extent will be first in the tree
- */
-static uintptr_t
-avl_ext_bcnt_start(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-static uintptr_t
-avl_ext_bcnt_end(avlnode_t *node)
-{
-/*
-	return((uintptr_t) (BCNT_ADDR(((extent_tree_node_t *)
-						node)->ex_blockcount)));
-*/
-	return((uintptr_t) ((extent_tree_node_t *)node)->ex_blockcount);
-}
-
-static avlops_t avl_extent_bcnt_tree_ops = {
-	avl_ext_bcnt_start,
-	avl_ext_bcnt_end
-};
-
-static avlops_t avl_extent_tree_ops = {
-	avl_ext_start,
-	avl_ext_end
-};
-
-/*
- * for real-time extents -- have to dup code since realtime extent
- * startblocks can be 64-bit values.
- */
-static rt_extent_tree_node_t *
-mk_rt_extent_tree_nodes(xfs_rtblock_t new_startblock,
-	xfs_extlen_t new_blockcount, extent_state_t new_state)
-{
-	rt_extent_tree_node_t *new;
-
-	new = malloc(sizeof(*new));
-	if (!new)
-		do_error(_("couldn't allocate new extent descriptor.\n"));
-
-	new->avl_node.avl_nextino = NULL;
-	new->rt_startblock = new_startblock;
-	new->rt_blockcount = new_blockcount;
-	new->rt_state = new_state;
-	return new;
-}
-
-#if 0
-void
-release_rt_extent_tree_node(rt_extent_tree_node_t *node)
-{
-	free(node);
-}
+	struct free_extent_list	*fel = bcnt_list(agno);
+	size_t			idx;
 
-void
-release_rt_extent_tree()
-{
-	extent_tree_node_t	*ext;
-	extent_tree_node_t	*tmp;
-	extent_tree_node_t	*lext;
-	extent_tree_node_t	*ltmp;
-	avl64tree_desc_t	*tree;
-
-	tree = rt_extent_tree_ptr;
+	idx = bcnt_lower_bound(fel, startblock, blockcount);
+	ASSERT(idx < fel->nr);
+	ASSERT(fel->exts[idx].ex_startblock == startblock);
+	ASSERT(fel->exts[idx].ex_blockcount == blockcount);
 
-	if (tree->avl_firstino == NULL)
+	if (idx == fel->first) {
+		fel->first++;
 		return;
-
-	ext = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (ext != NULL)  {
-		tmp = (extent_tree_node_t *) ext->avl_node.avl_nextino;
-		release_rt_extent_tree_node(ext);
-		ext = tmp;
 	}
 
-	tree->avl_root = tree->avl_firstino = NULL;
-
-	return;
+	memmove(&fel->exts[idx], &fel->exts[idx + 1],
+			(fel->nr - idx - 1) * sizeof(extent_tree_node_t));
+	fel->nr--;
 }
-#endif
 
 /*
- * don't need release functions for realtime tree teardown
- * since we only have one tree, not one per AG
+ * realtime duplicate extents share the list code since it handles 64-bit
+ * block numbers; there's only one list, not one per AG.
  */
 /* ARGSUSED */
 void
 free_rt_dup_extent_tree(xfs_mount_t *mp)
 {
 	ASSERT(mp->m_sb.sb_rblocks != 0);
-	free(rt_ext_tree_ptr);
-	rt_ext_tree_ptr = NULL;
+	dup_extent_list_destroy(&rt_dup_extents);
 }
 
 /*
@@ -602,85 +644,8 @@ free_rt_dup_extent_tree(xfs_mount_t *mp)
 void
 add_rt_dup_extent(xfs_rtblock_t startblock, xfs_extlen_t blockcount)
 {
-	rt_extent_tree_node_t *first, *last, *ext, *next_ext;
-	xfs_rtblock_t new_startblock;
-	xfs_extlen_t new_blockcount;
-
-	pthread_mutex_lock(&rt_ext_tree_lock);
-	avl64_findranges(rt_ext_tree_ptr, startblock - 1,
-		startblock + blockcount + 1,
-		(avl64node_t **) &first, (avl64node_t **) &last);
-	/*
-	 * find adjacent and overlapping extent blocks
-	 */
-	if (first == NULL && last == NULL)  {
-		/* nothing, just make and insert new extent */
-
-		ext = mk_rt_extent_tree_nodes(startblock,
-				blockcount, XR_E_MULT);
-
-		if (avl64_insert(rt_ext_tree_ptr,
-				(avl64node_t *) ext) == NULL)  {
-			do_error(_("duplicate extent range\n"));
-		}
-
-		pthread_mutex_unlock(&rt_ext_tree_lock);
-		return;
-	}
-
-	ASSERT(first != NULL && last != NULL);
-
-	/*
-	 * find the new composite range, delete old extent nodes
-	 * as we go
-	 */
-	new_startblock = startblock;
-	new_blockcount = blockcount;
-
-	for (ext = first;
-		ext != (rt_extent_tree_node_t *) last->avl_node.avl_nextino;
-		ext = next_ext)  {
-		/*
-		 * preserve the next inorder node
-		 */
-		next_ext = (rt_extent_tree_node_t *) ext->avl_node.avl_nextino;
-		/*
-		 * just bail if the new extent is contained within an old one
-		 */
-		if (ext->rt_startblock <= startblock &&
-				ext->rt_blockcount >= blockcount) {
-			pthread_mutex_unlock(&rt_ext_tree_lock);
-			return;
-		}
-		/*
-		 * now check for overlaps and adjacent extents
-		 */
-		if (ext->rt_startblock + ext->rt_blockcount >= startblock
-			|| ext->rt_startblock <= startblock + blockcount)  {
-
-			if (ext->rt_startblock < new_startblock)
-				new_startblock = ext->rt_startblock;
-
-			if (ext->rt_startblock + ext->rt_blockcount >
-					new_startblock + new_blockcount)
-				new_blockcount = ext->rt_startblock +
-							ext->rt_blockcount -
-							new_startblock;
-
-			avl64_delete(rt_ext_tree_ptr, (avl64node_t *) ext);
-			continue;
-		}
-	}
-
-	ext = mk_rt_extent_tree_nodes(new_startblock,
-				new_blockcount, XR_E_MULT);
-
-	if (avl64_insert(rt_ext_tree_ptr, (avl64node_t *) ext) == NULL)  {
-		do_error(_("duplicate extent range\n"));
-	}
-
-	pthread_mutex_unlock(&rt_ext_tree_lock);
-	return;
+	dup_extent_list_add(&rt_dup_extents, startblock,
+			startblock + blockcount);
 }
 
 /*
@@ -690,83 +655,33 @@ add_rt_dup_extent(xfs_rtblock_t startblock, xfs_extlen_t blockcount)
 int
 search_rt_dup_extent(xfs_mount_t *mp, xfs_rtblock_t bno)
 {
-	int ret;
-
-	pthread_mutex_lock(&rt_ext_tree_lock);
-	if (avl64_findrange(rt_ext_tree_ptr, bno) != NULL)
-		ret = 1;
-	else
-		ret = 0;
-	pthread_mutex_unlock(&rt_ext_tree_lock);
-	return(ret);
-}
-
-static uint64_t
-avl64_rt_ext_start(avl64node_t *node)
-{
-	return(((rt_extent_tree_node_t *) node)->rt_startblock);
+	return dup_extent_list_search(&rt_dup_extents, bno, bno + 1);
 }
 
-static uint64_t
-avl64_ext_end(avl64node_t *node)
-{
-	return(((rt_extent_tree_node_t *) node)->rt_startblock +
-		((rt_extent_tree_node_t *) node)->rt_blockcount);
-}
-
-static avl64ops_t avl64_extent_tree_ops = {
-	avl64_rt_ext_start,
-	avl64_ext_end
-};
-
 void
 incore_ext_init(xfs_mount_t *mp)
 {
 	int i;
 	xfs_agnumber_t agcount = mp->m_sb.sb_agcount;
 
-	pthread_mutex_init(&rt_ext_tree_lock, NULL);
+	dup_extent_list_init(&rt_dup_extents);
 
-	dup_extent_trees = calloc(agcount, sizeof(struct btree_root *));
-	if (!dup_extent_trees)
+	dup_extent_lists = calloc(agcount, sizeof(struct dup_extent_list));
+	if (!dup_extent_lists)
 		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
 
-	dup_extent_tree_locks = calloc(agcount, sizeof(pthread_mutex_t));
-	if (!dup_extent_tree_locks)
-		do_error(_("couldn't malloc dup extent tree descriptor table\n"));
-
-	if ((extent_bno_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	extent_bno_lists = calloc(agcount, sizeof(struct free_extent_list));
+	if (!extent_bno_lists)
 		do_error(
 	_("couldn't malloc free by-bno extent tree descriptor table\n"));
 
-	if ((extent_bcnt_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	extent_bcnt_lists = calloc(agcount, sizeof(struct free_extent_list));
+	if (!extent_bcnt_lists)
 		do_error(
 	_("couldn't malloc free by-bcnt extent tree descriptor table\n"));
 
-	for (i = 0; i < agcount; i++)  {
-		if ((extent_bno_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bno extent tree descriptor\n"));
-		if ((extent_bcnt_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc bcnt extent tree descriptor\n"));
-	}
-
-	for (i = 0; i < agcount; i++)  {
-		btree_init(&dup_extent_trees[i]);
-		pthread_mutex_init(&dup_extent_tree_locks[i], NULL);
-		avl_init_tree(extent_bno_ptrs[i], &avl_extent_tree_ops);
-		avl_init_tree(extent_bcnt_ptrs[i], &avl_extent_bcnt_tree_ops);
-	}
-
-	if ((rt_ext_tree_ptr = malloc(sizeof(avl64tree_desc_t))) == NULL)
-		do_error(_("couldn't malloc dup rt extent tree descriptor\n"));
-
-	avl64_init_tree(rt_ext_tree_ptr, &avl64_extent_tree_ops);
+	for (i = 0; i < agcount; i++)
+		dup_extent_list_init(&dup_extent_lists[i]);
 }
 
 /*
@@ -778,72 +693,39 @@ incore_ext_teardown(xfs_mount_t *mp)
 	xfs_agnumber_t i;
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)  {
-		btree_destroy(dup_extent_trees[i]);
-		free(extent_bno_ptrs[i]);
-		free(extent_bcnt_ptrs[i]);
+		dup_extent_list_destroy(&dup_extent_lists[i]);
+		free_extent_list_reset(&extent_bno_lists[i]);
+		free_extent_list_reset(&extent_bcnt_lists[i]);
 	}
 
-	free(dup_extent_trees);
-	free(extent_bcnt_ptrs);
-	free(extent_bno_ptrs);
+	free(dup_extent_lists);
+	free(extent_bcnt_lists);
+	free(extent_bno_lists);
 
-	dup_extent_trees = NULL;
-	extent_bcnt_ptrs = NULL;
-	extent_bno_ptrs = NULL;
-}
-
-static int
-count_extents(xfs_agnumber_t agno, avltree_desc_t *tree, int whichtree)
-{
-	extent_tree_node_t *node;
-	int i = 0;
-
-	node = (extent_tree_node_t *) tree->avl_firstino;
-
-	while (node != NULL)  {
-		i++;
-		if (whichtree)
-			node = findnext_bcnt_extent(agno, node);
-		else
-			node = findnext_bno_extent(node);
-	}
-
-	return(i);
+	dup_extent_lists = NULL;
+	extent_bcnt_lists = NULL;
+	extent_bno_lists = NULL;
 }
 
 int
 count_bno_extents_blocks(xfs_agnumber_t agno, uint *numblocks)
 {
-	uint64_t nblocks;
-	extent_tree_node_t *node;
-	int i = 0;
-
 	ASSERT(agno < glob_agcount);
 
-	nblocks = 0;
-
-	node = (extent_tree_node_t *) extent_bno_ptrs[agno]->avl_firstino;
-
-	while (node != NULL) {
-		nblocks += node->ex_blockcount;
-		i++;
-		node = findnext_bno_extent(node);
-	}
-
-	*numblocks = nblocks;
-	return(i);
+	*numblocks = extent_bno_lists[agno].nr_blocks;
+	return extent_bno_lists[agno].nr_live;
 }
 
 int
 count_bno_extents(xfs_agnumber_t agno)
 {
 	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bno_ptrs[agno], 0));
+	return extent_bno_lists[agno].nr_live;
 }
 
 int
 count_bcnt_extents(xfs_agnumber_t agno)
 {
 	ASSERT(agno < glob_agcount);
-	return(count_extents(agno, extent_bcnt_ptrs[agno], 1));
+	return extent_bcnt_lists[agno].nr - extent_bcnt_lists[agno].first;
 }
@@ -5,219 +5,227 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "incore.h"
 #include "agheader.h"
 #include "protos.h"
 #include "threads.h"
 #include "err_protos.h"
+#include "slab.h"
+#include "libfrog/radix-tree.h"
 
 /*
- * array of inode tree ptrs, one per ag
+ * inode record trees, one per ag, mapping each record's inode range to it
  */
-avltree_desc_t	**inode_tree_ptrs;
+struct rangemap	*inode_trees;
 
 /*
- * ditto for uncertain inodes
+ * Uncertain inodes are looked up far more often than they are walked, and a
+ * badly damaged filesystem can have a great many of them, so they are kept
+ * in a radix tree per AG indexed by inode chunk number.  Directory scans in
+ * other AGs can add to an AG's uncertain list while that AG is being
+ * processed, so each index has a lock for updates; lookups only need the
+ * RCU read lock.
  */
-static avltree_desc_t	**inode_uncertain_tree_ptrs;
+struct uncertain_index {
+	pthread_mutex_t		lock;
+	struct radix_tree_root	tree;
+	struct ino_tree_node	*last_rec;	/* last referenced record */
+};
 
-/* memory optimised nlink counting for all inodes */
+static struct uncertain_index	*uncertain_inodes;
 
-static void *
-alloc_nlink_array(uint8_t nlink_size)
+static inline unsigned long
+uncertain_key(
+	xfs_agino_t		agino)
 {
-	void *ptr;
-
-	ptr = calloc(XFS_INODES_PER_CHUNK, nlink_size);
-	if (!ptr)
-		do_error(_("could not allocate nlink array\n"));
-	return ptr;
+	return agino >> XFS_INODES_PER_CHUNK_LOG;
 }
 
-static void
-nlink_grow_8_to_16(ino_tree_node_t *irec)
-{
-	uint16_t	*new_nlinks;
-	int		i;
+/*
+ * Inode records come from per-AG pools, and the extra data hung off them for
+ * phases 6 and 7 from a global one.  The pools hand out cache aligned slots
+ * from large batches and recycle freed slots, so a record costs neither a
+ * malloc nor the allocator's per-object overhead.  Nothing ever gives the
+ * batches back; the records live until repair exits.  Once a pool has grown
+ * to a huge page, later batches are whole huge pages, if we've been asked to
+ * use them.
+ */
+#define IREC_POOL_BATCH		256
+
+struct irec_pool {
+	pthread_mutex_t		lock;
+	size_t			objsize;
+	void			*free;		/* singly linked via 1st word */
+	char			*next;		/* unused part of the batch */
+	char			*end;
+	size_t			allocated;	/* bytes in all batches */
+};
+
+static struct irec_pool		*irec_pools;	/* one per AG */
+static struct irec_pool		exdata_pool;
 
-	irec->nlink_size = sizeof(uint16_t);
+pthread_mutex_t			irec_locks[IREC_LOCK_STRIPES];
 
-	new_nlinks = alloc_nlink_array(irec->nlink_size);
-	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
-		new_nlinks[i] = irec->disk_nlinks.un8[i];
-	free(irec->disk_nlinks.un8);
-	irec->disk_nlinks.un16 = new_nlinks;
+static void
+irec_pool_init(
+	struct irec_pool	*pool,
+	size_t			objsize)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->objsize = roundup(objsize, IREC_ALIGN);
+	pool->free = NULL;
+	pool->next = pool->end = NULL;
+	pool->allocated = 0;
+}
 
-	if (full_ino_ex_data) {
-		new_nlinks = alloc_nlink_array(irec->nlink_size);
-		for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
-			new_nlinks[i] =
-				irec->ino_un.ex_data->counted_nlinks.un8[i];
+static void *
+irec_pool_get(
+	struct irec_pool	*pool)
+{
+	void			*obj;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free) {
+		obj = pool->free;
+		pool->free = *(void **)obj;
+	} else {
+		if (pool->next == pool->end) {
+			size_t	len = pool->objsize * IREC_POOL_BATCH;
+
+			pool->next = NULL;
+			if (pool->allocated >= SLAB_HUGE_PAGE_SIZE) {
+				pool->next = slab_alloc_huge(
+						SLAB_HUGE_PAGE_SIZE);
+				if (pool->next)
+					len = SLAB_HUGE_PAGE_SIZE /
+						pool->objsize * pool->objsize;
+			}
+			if (!pool->next)
+				pool->next = memalign(IREC_ALIGN, len);
+			if (!pool->next)
+				do_error(_("inode map malloc failed\n"));
+			pool->end = pool->next + len;
+			pool->allocated += len;
 		}
-		free(irec->ino_un.ex_data->counted_nlinks.un8);
-		irec->ino_un.ex_data->counted_nlinks.un16 = new_nlinks;
+		obj = pool->next;
+		pool->next += pool->objsize;
 	}
+	pthread_mutex_unlock(&pool->lock);
+	return obj;
 }
 
 static void
-nlink_grow_16_to_32(ino_tree_node_t *irec)
+irec_pool_put(
+	struct irec_pool	*pool,
+	void			*obj)
 {
-	uint32_t	*new_nlinks;
-	int		i;
-
-	irec->nlink_size = sizeof(uint32_t);
-
-	new_nlinks = alloc_nlink_array(irec->nlink_size);
-	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)
-		new_nlinks[i] = irec->disk_nlinks.un16[i];
-	free(irec->disk_nlinks.un16);
-	irec->disk_nlinks.un32 = new_nlinks;
-
-	if (full_ino_ex_data) {
-		new_nlinks = alloc_nlink_array(irec->nlink_size);
+	pthread_mutex_lock(&pool->lock);
+	*(void **)obj = pool->free;
+	pool->free = obj;
+	pthread_mutex_unlock(&pool->lock);
+}
 
-		for (i = 0; i < XFS_INODES_PER_CHUNK; i++) {
-			new_nlinks[i] =
-				irec->ino_un.ex_data->counted_nlinks.un16[i];
-		}
-		free(irec->ino_un.ex_data->counted_nlinks.un16);
-		irec->ino_un.ex_data->counted_nlinks.un32 = new_nlinks;
+/*
+ * memory optimised nlink counting for all inodes: one byte per inode, with
+ * counts that don't fit promoted in place to the record's wide array.
+ */
+static uint32_t *
+irec_nlinks_wide(
+	struct ino_tree_node	*irec)
+{
+	if (!irec->nlinks_wide) {
+		irec->nlinks_wide = calloc(2 * XFS_INODES_PER_CHUNK,
+				sizeof(uint32_t));
+		if (!irec->nlinks_wide)
+			do_error(_("could not allocate nlink array\n"));
 	}
+	return irec->nlinks_wide;
+}
+
+static inline uint32_t *
+counted_nlink_wide(
+	struct ino_tree_node	*irec,
+	int			ino_offset)
+{
+	return &irec_nlinks_wide(irec)[XFS_INODES_PER_CHUNK + ino_offset];
 }
 
 void add_inode_ref(struct ino_tree_node *irec, int ino_offset)
 {
-	ASSERT(irec->ino_un.ex_data != NULL);
+	uint8_t		*nlink;
 
-	pthread_mutex_lock(&irec->lock);
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		if (irec->ino_un.ex_data->counted_nlinks.un8[ino_offset] < 0xff) {
-			irec->ino_un.ex_data->counted_nlinks.un8[ino_offset]++;
-			break;
-		}
-		nlink_grow_8_to_16(irec);
-		/*FALLTHRU*/
-	case sizeof(uint16_t):
-		if (irec->ino_un.ex_data->counted_nlinks.un16[ino_offset] < 0xffff) {
-			irec->ino_un.ex_data->counted_nlinks.un16[ino_offset]++;
-			break;
-		}
-		nlink_grow_16_to_32(irec);
-		/*FALLTHRU*/
-	case sizeof(uint32_t):
-		irec->ino_un.ex_data->counted_nlinks.un32[ino_offset]++;
-		break;
-	default:
-		ASSERT(0);
+	ASSERT(irec->ex_data != NULL);
+
+	pthread_mutex_lock(irec_lock(irec));
+	nlink = &irec->ex_data->counted_nlinks[ino_offset];
+	if (*nlink == IREC_NLINK_WIDE) {
+		(*counted_nlink_wide(irec, ino_offset))++;
+	} else if (*nlink == IREC_NLINK_WIDE - 1) {
+		*counted_nlink_wide(irec, ino_offset) = IREC_NLINK_WIDE;
+		*nlink = IREC_NLINK_WIDE;
+	} else {
+		(*nlink)++;
 	}
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 void drop_inode_ref(struct ino_tree_node *irec, int ino_offset)
 {
-	uint32_t	refs = 0;
-
-	ASSERT(irec->ino_un.ex_data != NULL);
-
-	pthread_mutex_lock(&irec->lock);
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		ASSERT(irec->ino_un.ex_data->counted_nlinks.un8[ino_offset] > 0);
-		refs = --irec->ino_un.ex_data->counted_nlinks.un8[ino_offset];
-		break;
-	case sizeof(uint16_t):
-		ASSERT(irec->ino_un.ex_data->counted_nlinks.un16[ino_offset] > 0);
-		refs = --irec->ino_un.ex_data->counted_nlinks.un16[ino_offset];
-		break;
-	case sizeof(uint32_t):
-		ASSERT(irec->ino_un.ex_data->counted_nlinks.un32[ino_offset] > 0);
-		refs = --irec->ino_un.ex_data->counted_nlinks.un32[ino_offset];
-		break;
-	default:
-		ASSERT(0);
+	uint8_t		*nlink;
+	uint32_t	refs;
+
+	ASSERT(irec->ex_data != NULL);
+
+	pthread_mutex_lock(irec_lock(irec));
+	nlink = &irec->ex_data->counted_nlinks[ino_offset];
+	if (*nlink == IREC_NLINK_WIDE) {
+		uint32_t	*wide = counted_nlink_wide(irec, ino_offset);
+
+		ASSERT(*wide > 0);
+		refs = --(*wide);
+	} else {
+		ASSERT(*nlink > 0);
+		refs = --(*nlink);
 	}
 
 	if (refs == 0)
-		irec->ino_un.ex_data->ino_reached &= ~IREC_MASK(ino_offset);
-	pthread_mutex_unlock(&irec->lock);
+		irec->ex_data->ino_reached &= ~IREC_MASK(ino_offset);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 uint32_t num_inode_references(struct ino_tree_node *irec, int ino_offset)
 {
-	ASSERT(irec->ino_un.ex_data != NULL);
+	uint8_t		nlink;
 
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		return irec->ino_un.ex_data->counted_nlinks.un8[ino_offset];
-	case sizeof(uint16_t):
-		return irec->ino_un.ex_data->counted_nlinks.un16[ino_offset];
-	case sizeof(uint32_t):
-		return irec->ino_un.ex_data->counted_nlinks.un32[ino_offset];
-	default:
-		ASSERT(0);
-	}
-	return 0;
+	ASSERT(irec->ex_data != NULL);
+
+	nlink = irec->ex_data->counted_nlinks[ino_offset];
+	if (nlink == IREC_NLINK_WIDE)
+		return irec->nlinks_wide[XFS_INODES_PER_CHUNK + ino_offset];
+	return nlink;
 }
 
 void set_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset,
 		uint32_t nlinks)
 {
-	pthread_mutex_lock(&irec->lock);
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		if (nlinks < 0xff) {
-			irec->disk_nlinks.un8[ino_offset] = nlinks;
-			break;
-		}
-		nlink_grow_8_to_16(irec);
-		/*FALLTHRU*/
-	case sizeof(uint16_t):
-		if (nlinks < 0xffff) {
-			irec->disk_nlinks.un16[ino_offset] = nlinks;
-			break;
-		}
-		nlink_grow_16_to_32(irec);
-		/*FALLTHRU*/
-	case sizeof(uint32_t):
-		irec->disk_nlinks.un32[ino_offset] = nlinks;
-		break;
-	default:
-		ASSERT(0);
+	pthread_mutex_lock(irec_lock(irec));
+	if (nlinks < IREC_NLINK_WIDE) {
+		irec->disk_nlinks[ino_offset] = nlinks;
+	} else {
+		irec_nlinks_wide(irec)[ino_offset] = nlinks;
+		irec->disk_nlinks[ino_offset] = IREC_NLINK_WIDE;
 	}
-	pthread_mutex_unlock(&irec->lock);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 uint32_t get_inode_disk_nlinks(struct ino_tree_node *irec, int ino_offset)
 {
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		return irec->disk_nlinks.un8[ino_offset];
-	case sizeof(uint16_t):
-		return irec->disk_nlinks.un16[ino_offset];
-	case sizeof(uint32_t):
-		return irec->disk_nlinks.un32[ino_offset];
-	default:
-		ASSERT(0);
-	}
-	return 0;
-}
-
-static uint8_t *
-alloc_ftypes_array(
-	struct xfs_mount *mp)
-{
-	uint8_t		*ptr;
-
-	if (!xfs_has_ftype(mp))
-		return NULL;
+	uint8_t		nlink = irec->disk_nlinks[ino_offset];
 
-	ptr = calloc(XFS_INODES_PER_CHUNK, sizeof(*ptr));
-	if (!ptr)
-		do_error(_("could not allocate ftypes array\n"));
-	return ptr;
+	if (nlink == IREC_NLINK_WIDE)
+		return irec->nlinks_wide[ino_offset];
+	return nlink;
 }
 
 /*
@@ -236,80 +244,46 @@ alloc_ftypes_array(
 static struct ino_tree_node *
 alloc_ino_node(
 	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
 	xfs_agino_t		starting_ino)
 {
 	struct ino_tree_node 	*irec;
 
-	irec = malloc(sizeof(*irec));
-	if (!irec)
-		do_error(_("inode map malloc failed\n"));
+	irec = irec_pool_get(&irec_pools[agno]);
 
-	irec->avl_node.avl_nextino = NULL;
-	irec->avl_node.avl_forw = NULL;
-	irec->avl_node.avl_back = NULL;
+	irec->next = NULL;
 
 	irec->ino_startnum = starting_ino;
+	irec->ino_flags = xfs_has_ftype(mp) ? IREC_HAS_FTYPES : 0;
 	irec->ino_confirmed = 0;
 	irec->ino_isa_dir = 0;
 	irec->ino_was_rl = 0;
 	irec->ino_is_rl = 0;
 	irec->ir_free = (xfs_inofree_t) - 1;
 	irec->ir_sparse = 0;
-	irec->ino_un.ex_data = NULL;
-	irec->nlink_size = sizeof(uint8_t);
-	irec->disk_nlinks.un8 = alloc_nlink_array(irec->nlink_size);
-	irec->ftypes = alloc_ftypes_array(mp);
-	pthread_mutex_init(&irec->lock, NULL);
+	irec->ex_data = NULL;
+	irec->parents.pmask = 0;
+	irec->parents.pentries = NULL;
+	irec->nlinks_wide = NULL;
+	memset(irec->disk_nlinks, 0, sizeof(irec->disk_nlinks));
+	memset(irec->ftypes, 0, sizeof(irec->ftypes));
 	return irec;
 }
 
-static void
-free_nlink_array(union ino_nlink nlinks, uint8_t nlink_size)
-{
-	switch (nlink_size) {
-	case sizeof(uint8_t):
-		free(nlinks.un8);
-		break;
-	case sizeof(uint16_t):
-		free(nlinks.un16);
-		break;
-	case sizeof(uint32_t):
-		free(nlinks.un32);
-		break;
-	default:
-		ASSERT(0);
-	}
-}
-
 static void
 free_ino_tree_node(
+	xfs_agnumber_t		agno,
 	struct ino_tree_node	*irec)
 {
-	irec->avl_node.avl_nextino = NULL;
-	irec->avl_node.avl_forw = NULL;
-	irec->avl_node.avl_back = NULL;
-
-	free_nlink_array(irec->disk_nlinks, irec->nlink_size);
-	if (irec->ino_un.ex_data != NULL)  {
-		if (full_ino_ex_data) {
-			free(irec->ino_un.ex_data->parents);
-			free_nlink_array(irec->ino_un.ex_data->counted_nlinks,
-					 irec->nlink_size);
-		}
-		free(irec->ino_un.ex_data);
-
-	}
+	irec->next = NULL;
 
-	free(irec->ftypes);
-	pthread_mutex_destroy(&irec->lock);
-	free(irec);
+	if (irec->ex_data != NULL)
+		irec_pool_put(&exdata_pool, irec->ex_data);
+	free(irec->parents.pentries);
+	free(irec->nlinks_wide);
+	irec_pool_put(&irec_pools[agno], irec);
 }
 
-/*
- * last referenced cache for uncertain inodes
- */
-static ino_tree_node_t **last_rec;
-
 /*
  * ok, the uncertain inodes are a set of trees just like the
  * good inodes but all starting inode records are (arbitrarily)
@@ -326,41 +300,35 @@ add_aginode_uncertain(
 	xfs_agino_t		ino,
 	int			free)
 {
+	struct uncertain_index	*ui;
 	ino_tree_node_t		*ino_rec;
 	xfs_agino_t		s_ino;
-	int			offset;
+	int			error;
 
 	ASSERT(agno < glob_agcount);
-	ASSERT(last_rec != NULL);
+	ASSERT(uncertain_inodes != NULL);
 
+	ui = &uncertain_inodes[agno];
 	s_ino = rounddown(ino, XFS_INODES_PER_CHUNK);
 
-	/*
-	 * check for a cache hit
-	 */
-	if (last_rec[agno] != NULL && last_rec[agno]->ino_startnum == s_ino)  {
-		offset = ino - s_ino;
-		if (free)
-			set_inode_free(last_rec[agno], offset);
-		else
-			set_inode_used(last_rec[agno], offset);
-
-		return;
-	}
+	pthread_mutex_lock(&ui->lock);
 
 	/*
-	 * check to see if record containing inode is already in the tree.
-	 * if not, add it
+	 * check for a cache hit, then see if the record containing the inode
+	 * is already in the index.  if not, add it
 	 */
-	ino_rec = (ino_tree_node_t *)
-		avl_findrange(inode_uncertain_tree_ptrs[agno], s_ino);
+	ino_rec = ui->last_rec;
+	if (ino_rec == NULL || ino_rec->ino_startnum != s_ino)
+		ino_rec = radix_tree_lookup(&ui->tree, uncertain_key(s_ino));
 	if (!ino_rec) {
-		ino_rec = alloc_ino_node(mp, s_ino);
+		ino_rec = alloc_ino_node(mp, agno, s_ino);
 
-		if (!avl_insert(inode_uncertain_tree_ptrs[agno],
-				&ino_rec->avl_node))
+		error = radix_tree_insert(&ui->tree, uncertain_key(s_ino),
+				ino_rec);
+		if (error)
 			do_error(
-	_("add_aginode_uncertain - duplicate inode range\n"));
+	_("add_aginode_uncertain - couldn't insert inode range, error %d\n"),
+					-error);
 	}
 
 	if (free)
@@ -371,7 +339,8 @@ add_aginode_uncertain(
 	/*
 	 * set cache entry
 	 */
-	last_rec[agno] = ino_rec;
+	ui->last_rec = ino_rec;
+	pthread_mutex_unlock(&ui->lock);
 }
 
 /*
@@ -386,47 +355,84 @@ add_inode_uncertain(xfs_mount_t *mp, xfs_ino_t ino, int free)
 }
 
 /*
- * pull the indicated inode record out of the uncertain inode tree
+ * pull the indicated inode record out of the uncertain inode index
  */
 void
 get_uncertain_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno,
 			ino_tree_node_t *ino_rec)
 {
-	ASSERT(inode_tree_ptrs != NULL);
-	ASSERT(agno < mp->m_sb.sb_agcount);
-	ASSERT(inode_tree_ptrs[agno] != NULL);
+	struct uncertain_index	*ui;
 
-	avl_delete(inode_uncertain_tree_ptrs[agno], &ino_rec->avl_node);
+	ASSERT(uncertain_inodes != NULL);
+	ASSERT(agno < mp->m_sb.sb_agcount);
 
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	ui = &uncertain_inodes[agno];
+	pthread_mutex_lock(&ui->lock);
+	radix_tree_delete(&ui->tree, uncertain_key(ino_rec->ino_startnum));
+	if (ui->last_rec == ino_rec)
+		ui->last_rec = NULL;
+	pthread_mutex_unlock(&ui->lock);
 }
 
 ino_tree_node_t *
 findfirst_uncertain_inode_rec(xfs_agnumber_t agno)
 {
-	return((ino_tree_node_t *)
-		inode_uncertain_tree_ptrs[agno]->avl_firstino);
+	struct uncertain_index	*ui = &uncertain_inodes[agno];
+	ino_tree_node_t		*ino_rec;
+	unsigned long		key;
+
+	rcu_read_lock();
+	ino_rec = radix_tree_lookup_first(&ui->tree, &key);
+	rcu_read_unlock();
+	return ino_rec;
+}
+
+/*
+ * Find up to @nr uncertain inode records, lowest first, so that they can
+ * be processed and removed in batches.
+ */
+unsigned int
+find_uncertain_inode_recs(
+	xfs_agnumber_t		agno,
+	ino_tree_node_t		**recs,
+	unsigned int		nr)
+{
+	struct uncertain_index	*ui = &uncertain_inodes[agno];
+	unsigned int		found;
+
+	rcu_read_lock();
+	found = radix_tree_gang_lookup(&ui->tree, (void **)recs, 0, nr);
+	rcu_read_unlock();
+	return found;
 }
 
 ino_tree_node_t *
 find_uncertain_inode_rec(xfs_agnumber_t agno, xfs_agino_t ino)
 {
-	return((ino_tree_node_t *)
-		avl_findrange(inode_uncertain_tree_ptrs[agno], ino));
+	struct uncertain_index	*ui = &uncertain_inodes[agno];
+	ino_tree_node_t		*ino_rec;
+
+	rcu_read_lock();
+	ino_rec = radix_tree_lookup(&ui->tree, uncertain_key(ino));
+	rcu_read_unlock();
+	return ino_rec;
 }
 
 void
 clear_uncertain_ino_cache(xfs_agnumber_t agno)
 {
-	last_rec[agno] = NULL;
+	struct uncertain_index	*ui = &uncertain_inodes[agno];
+
+	pthread_mutex_lock(&ui->lock);
+	ui->last_rec = NULL;
+	pthread_mutex_unlock(&ui->lock);
 }
 
 
 /*
- * Next comes the inode trees.  One per AG,  AVL trees of inode records, each
- * inode record tracking 64 inodes
+ * Next comes the inode trees.  One per AG, range maps of inode records, each
+ * inode record tracking 64 inodes.  The records are also linked in inode
+ * order so that walking an AG doesn't have to go back to the tree.
  */
 
 /*
@@ -451,11 +457,27 @@ add_inode(
 	xfs_agnumber_t		agno,
 	xfs_agino_t		agino)
 {
+	struct rangemap		*tree = &inode_trees[agno];
 	struct ino_tree_node	*irec;
+	struct ino_tree_node	*prev;
+	int			error;
 
-	irec = alloc_ino_node(mp, agino);
-	if (!avl_insert(inode_tree_ptrs[agno],	&irec->avl_node))
+	irec = alloc_ino_node(mp, agno, agino);
+	error = rangemap_insert(tree, agino, agino + XFS_INODES_PER_CHUNK,
+			irec);
+	if (error == -EEXIST) {
 		do_warn(_("add_inode - duplicate inode range\n"));
+		return irec;
+	}
+	if (error)
+		do_error(_("couldn't add inode record to tree, error %d\n"),
+				-error);
+
+	/* thread the record into the in-order list */
+	irec->next = rangemap_find_from(tree, agino + XFS_INODES_PER_CHUNK);
+	prev = rangemap_prev(tree, agino);
+	if (prev)
+		prev->next = irec;
 	return irec;
 }
 
@@ -465,25 +487,31 @@ add_inode(
 void
 get_inode_rec(struct xfs_mount *mp, xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 {
-	ASSERT(inode_tree_ptrs != NULL);
+	struct rangemap		*tree;
+	struct ino_tree_node	*prev;
+
+	ASSERT(inode_trees != NULL);
 	ASSERT(agno < mp->m_sb.sb_agcount);
-	ASSERT(inode_tree_ptrs[agno] != NULL);
 
-	avl_delete(inode_tree_ptrs[agno], &ino_rec->avl_node);
+	tree = &inode_trees[agno];
+	if (rangemap_delete(tree, ino_rec->ino_startnum) != ino_rec) {
+		ASSERT(0);
+		return;
+	}
 
-	ino_rec->avl_node.avl_nextino = NULL;
-	ino_rec->avl_node.avl_forw = NULL;
-	ino_rec->avl_node.avl_back = NULL;
+	prev = rangemap_prev(tree, ino_rec->ino_startnum);
+	if (prev)
+		prev->next = ino_rec->next;
+	ino_rec->next = NULL;
 }
 
 /*
  * free the designated inode record (return it to the free pool)
  */
-/* ARGSUSED */
 void
 free_inode_rec(xfs_agnumber_t agno, ino_tree_node_t *ino_rec)
 {
-	free_ino_tree_node(ino_rec);
+	free_ino_tree_node(agno, ino_rec);
 }
 
 void
@@ -491,14 +519,30 @@ find_inode_rec_range(struct xfs_mount *mp, xfs_agnumber_t agno,
 			xfs_agino_t start_ino, xfs_agino_t end_ino,
 			ino_tree_node_t **first, ino_tree_node_t **last)
 {
+	struct rangemap		*tree;
+	struct ino_tree_node	*irec;
+
 	*first = *last = NULL;
 
 	/*
 	 * Is the AG inside the file system ?
 	 */
-	if (agno < mp->m_sb.sb_agcount)
-		avl_findranges(inode_tree_ptrs[agno], start_ino,
-			end_ino, (avlnode_t **) first, (avlnode_t **) last);
+	if (agno >= mp->m_sb.sb_agcount)
+		return;
+
+	/* find the records overlapping [start_ino, end_ino) */
+	tree = &inode_trees[agno];
+	irec = rangemap_find_from(tree, start_ino);
+	if (!irec || end_ino <= irec->ino_startnum)
+		return;
+	*first = irec;
+
+	/* most ranges end in the first record or before the next one */
+	if (end_ino <= irec->ino_startnum + XFS_INODES_PER_CHUNK ||
+	    !irec->next || end_ino <= irec->next->ino_startnum)
+		*last = irec;
+	else
+		*last = rangemap_prev(tree, end_ino);
 }
 
 /*
@@ -544,48 +588,57 @@ set_inode_free_alloc(struct xfs_mount *mp, xfs_agnumber_t agno, xfs_agino_t ino)
 }
 
 static void
-print_inode_list_int(xfs_agnumber_t agno, int uncertain)
+print_inode_rec(
+	ino_tree_node_t		*ino_rec)
 {
-	ino_tree_node_t *ino_rec;
+	fprintf(stderr,
+	_("\tptr = %lx, start = 0x%x, free = 0x%llx, confirmed = 0x%llx\n"),
+		(unsigned long)ino_rec,
+		ino_rec->ino_startnum,
+		(unsigned long long)ino_rec->ir_free,
+		(unsigned long long)ino_rec->ino_confirmed);
+}
 
-	if (!uncertain)  {
-		fprintf(stderr, _("good inode list is --\n"));
-		ino_rec = findfirst_inode_rec(agno);
-	} else  {
-		fprintf(stderr, _("uncertain inode list is --\n"));
-		ino_rec = findfirst_uncertain_inode_rec(agno);
-	}
+void
+print_inode_list(xfs_agnumber_t agno)
+{
+	ino_tree_node_t *ino_rec;
 
+	fprintf(stderr, _("good inode list is --\n"));
+	ino_rec = findfirst_inode_rec(agno);
 	if (ino_rec == NULL)  {
 		fprintf(stderr, _("agno %d -- no inodes\n"), agno);
 		return;
 	}
 
 	printf(_("agno %d\n"), agno);
-
-	while(ino_rec != NULL)  {
-		fprintf(stderr,
-	_("\tptr = %lx, start = 0x%x, free = 0x%llx, confirmed = 0x%llx\n"),
-			(unsigned long)ino_rec,
-			ino_rec->ino_startnum,
-			(unsigned long long)ino_rec->ir_free,
-			(unsigned long long)ino_rec->ino_confirmed);
-		if (ino_rec->ino_startnum == 0)
-			ino_rec = ino_rec;
-		ino_rec = next_ino_rec(ino_rec);
-	}
-}
-
-void
-print_inode_list(xfs_agnumber_t agno)
-{
-	print_inode_list_int(agno, 0);
+	for (; ino_rec != NULL; ino_rec = next_ino_rec(ino_rec))
+		print_inode_rec(ino_rec);
 }
 
 void
 print_uncertain_inode_list(xfs_agnumber_t agno)
 {
-	print_inode_list_int(agno, 1);
+	struct uncertain_index	*ui = &uncertain_inodes[agno];
+	ino_tree_node_t		*recs[32];
+	unsigned long		next = 0;
+	unsigned int		nr, i;
+
+	fprintf(stderr, _("uncertain inode list is --\n"));
+	if (!findfirst_uncertain_inode_rec(agno)) {
+		fprintf(stderr, _("agno %d -- no inodes\n"), agno);
+		return;
+	}
+
+	printf(_("agno %d\n"), agno);
+	pthread_mutex_lock(&ui->lock);
+	while ((nr = radix_tree_gang_lookup(&ui->tree, (void **)recs, next,
+					ARRAY_SIZE(recs))) > 0) {
+		for (i = 0; i < nr; i++)
+			print_inode_rec(recs[i]);
+		next = uncertain_key(recs[nr - 1]->ino_startnum) + 1;
+	}
+	pthread_mutex_unlock(&ui->lock);
 }
 
 /*
@@ -594,6 +647,13 @@ print_uncertain_inode_list(xfs_agnumber_t agno)
  * is the Nth bit set in the mask is stored in the Nth location in
  * the array where N starts at 0.
  */
+static inline int
+parent_slot(
+	uint64_t		pmask,
+	int			offset)
+{
+	return __builtin_popcountll(pmask & (IREC_MASK(offset) - 1));
+}
 
 void
 set_inode_parent(
@@ -601,163 +661,55 @@ set_inode_parent(
 	int			offset,
 	xfs_ino_t		parent)
 {
-	parent_list_t		*ptbl;
-	int			i;
+	parent_list_t		*ptbl = &irec->parents;
 	int			cnt;
 	int			target;
-	uint64_t		bitmask;
-	parent_entry_t		*tmp;
-
-	pthread_mutex_lock(&irec->lock);
-	if (full_ino_ex_data)
-		ptbl = irec->ino_un.ex_data->parents;
-	else
-		ptbl = irec->ino_un.plist;
-
-	if (ptbl == NULL)  {
-		ptbl = (parent_list_t *)malloc(sizeof(parent_list_t));
-		if (!ptbl)
-			do_error(_("couldn't malloc parent list table\n"));
-
-		if (full_ino_ex_data)
-			irec->ino_un.ex_data->parents = ptbl;
-		else
-			irec->ino_un.plist = ptbl;
-
-		ptbl->pmask = 1ULL << offset;
-		ptbl->pentries = (xfs_ino_t*)memalign(sizeof(xfs_ino_t),
-							sizeof(xfs_ino_t));
-		if (!ptbl->pentries)
-			do_error(_("couldn't memalign pentries table\n"));
-#ifdef DEBUG
-		ptbl->cnt = 1;
-#endif
-		ptbl->pentries[0] = parent;
-
-		pthread_mutex_unlock(&irec->lock);
-		return;
-	}
 
-	if (ptbl->pmask & (1ULL << offset))  {
-		bitmask = 1ULL;
-		target = 0;
-
-		for (i = 0; i < offset; i++)  {
-			if (ptbl->pmask & bitmask)
-				target++;
-			bitmask <<= 1;
-		}
-#ifdef DEBUG
-		ASSERT(target < ptbl->cnt);
-#endif
+	pthread_mutex_lock(irec_lock(irec));
+	target = parent_slot(ptbl->pmask, offset);
+	if (ptbl->pmask & IREC_MASK(offset))  {
 		ptbl->pentries[target] = parent;
-
-		pthread_mutex_unlock(&irec->lock);
+		pthread_mutex_unlock(irec_lock(irec));
 		return;
 	}
 
-	bitmask = 1ULL;
-	cnt = target = 0;
-
-	for (i = 0; i < XFS_INODES_PER_CHUNK; i++)  {
-		if (ptbl->pmask & bitmask)  {
-			cnt++;
-			if (i < offset)
-				target++;
-		}
+	cnt = __builtin_popcountll(ptbl->pmask);
+	if (cnt % PLIST_CHUNK_SIZE == 0) {
+		parent_entry_t	*tmp;
 
-		bitmask <<= 1;
+		tmp = realloc(ptbl->pentries,
+				(cnt + PLIST_CHUNK_SIZE) * sizeof(parent_entry_t));
+		if (!tmp)
+			do_error(_("couldn't memalign pentries table\n"));
+		ptbl->pentries = tmp;
 	}
 
-#ifdef DEBUG
-	ASSERT(cnt == ptbl->cnt);
-#endif
-	ASSERT(cnt >= target);
-
-	tmp = (xfs_ino_t*)memalign(sizeof(xfs_ino_t), (cnt + 1) * sizeof(xfs_ino_t));
-	if (!tmp)
-		do_error(_("couldn't memalign pentries table\n"));
-
-	memmove(tmp, ptbl->pentries, target * sizeof(parent_entry_t));
-
 	if (cnt > target)
-		memmove(tmp + target + 1, ptbl->pentries + target,
+		memmove(ptbl->pentries + target + 1, ptbl->pentries + target,
 				(cnt - target) * sizeof(parent_entry_t));
-
-	free(ptbl->pentries);
-
-	ptbl->pentries = tmp;
-
-#ifdef DEBUG
-	ptbl->cnt++;
-#endif
 	ptbl->pentries[target] = parent;
-	ptbl->pmask |= (1ULL << offset);
-	pthread_mutex_unlock(&irec->lock);
+	ptbl->pmask |= IREC_MASK(offset);
+	pthread_mutex_unlock(irec_lock(irec));
 }
 
 xfs_ino_t
 get_inode_parent(ino_tree_node_t *irec, int offset)
 {
-	uint64_t	bitmask;
-	parent_list_t	*ptbl;
-	int		i;
-	int		target;
-
-	pthread_mutex_lock(&irec->lock);
-	if (full_ino_ex_data)
-		ptbl = irec->ino_un.ex_data->parents;
-	else
-		ptbl = irec->ino_un.plist;
-
-	if (ptbl->pmask & (1ULL << offset))  {
-		bitmask = 1ULL;
-		target = 0;
+	parent_list_t	*ptbl = &irec->parents;
+	xfs_ino_t	parent = 0;
 
-		for (i = 0; i < offset; i++)  {
-			if (ptbl->pmask & bitmask)
-				target++;
-			bitmask <<= 1;
-		}
-#ifdef DEBUG
-		ASSERT(target < ptbl->cnt);
-#endif
-		pthread_mutex_unlock(&irec->lock);
-		return(ptbl->pentries[target]);
-	}
-
-	pthread_mutex_unlock(&irec->lock);
-	return(0LL);
+	pthread_mutex_lock(irec_lock(irec));
+	if (ptbl->pmask & IREC_MASK(offset))
+		parent = ptbl->pentries[parent_slot(ptbl->pmask, offset)];
+	pthread_mutex_unlock(irec_lock(irec));
+	return parent;
 }
 
 void
 alloc_ex_data(ino_tree_node_t *irec)
 {
-	parent_list_t 	*ptbl;
-
-	ptbl = irec->ino_un.plist;
-	irec->ino_un.ex_data  = (ino_ex_data_t *)calloc(1, sizeof(ino_ex_data_t));
-	if (irec->ino_un.ex_data == NULL)
-		do_error(_("could not malloc inode extra data\n"));
-
-	irec->ino_un.ex_data->parents = ptbl;
-
-	switch (irec->nlink_size) {
-	case sizeof(uint8_t):
-		irec->ino_un.ex_data->counted_nlinks.un8 =
-			alloc_nlink_array(irec->nlink_size);
-		break;
-	case sizeof(uint16_t):
-		irec->ino_un.ex_data->counted_nlinks.un16 =
-			alloc_nlink_array(irec->nlink_size);
-		break;
-	case sizeof(uint32_t):
-		irec->ino_un.ex_data->counted_nlinks.un32 =
-			alloc_nlink_array(irec->nlink_size);
-		break;
-	default:
-		ASSERT(0);
-	}
+	irec->ex_data = irec_pool_get(&exdata_pool);
+	memset(irec->ex_data, 0, sizeof(ino_ex_data_t));
 }
 
 void
@@ -777,57 +729,33 @@ add_ino_ex_data(xfs_mount_t *mp)
 	full_ino_ex_data = 1;
 }
 
-static uintptr_t
-avl_ino_start(avlnode_t *node)
-{
-	return((uintptr_t) ((ino_tree_node_t *) node)->ino_startnum);
-}
-
-static uintptr_t
-avl_ino_end(avlnode_t *node)
-{
-	return((uintptr_t) (
-		((ino_tree_node_t *) node)->ino_startnum +
-		XFS_INODES_PER_CHUNK));
-}
-
-static avlops_t avl_ino_tree_ops = {
-	avl_ino_start,
-	avl_ino_end
-};
-
 void
 incore_ino_init(xfs_mount_t *mp)
 {
 	int i;
 	int agcount = mp->m_sb.sb_agcount;
 
-	if ((inode_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
+	if ((inode_trees = malloc(agcount * sizeof(struct rangemap))) == NULL)
 		do_error(_("couldn't malloc inode tree descriptor table\n"));
-	if ((inode_uncertain_tree_ptrs = malloc(agcount *
-					sizeof(avltree_desc_t *))) == NULL)
-		do_error(
-		_("couldn't malloc uncertain ino tree descriptor table\n"));
-
+	for (i = 0; i < agcount; i++)
+		rangemap_init(&inode_trees[i]);
+
+	irec_pools = malloc(agcount * sizeof(struct irec_pool));
+	if (!irec_pools)
+		do_error(_("couldn't malloc inode record pools\n"));
+	for (i = 0; i < agcount; i++)
+		irec_pool_init(&irec_pools[i], sizeof(ino_tree_node_t));
+	irec_pool_init(&exdata_pool, sizeof(ino_ex_data_t));
+	for (i = 0; i < IREC_LOCK_STRIPES; i++)
+		pthread_mutex_init(&irec_locks[i], NULL);
+
+	uncertain_inodes = calloc(agcount, sizeof(struct uncertain_index));
+	if (!uncertain_inodes)
+		do_error(_("couldn't malloc uncertain inode indexes\n"));
 	for (i = 0; i < agcount; i++)  {
-		if ((inode_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(_("couldn't malloc inode tree descriptor\n"));
-		if ((inode_uncertain_tree_ptrs[i] =
-				malloc(sizeof(avltree_desc_t))) == NULL)
-			do_error(
-			_("couldn't malloc uncertain ino tree descriptor\n"));
+		pthread_mutex_init(&uncertain_inodes[i].lock, NULL);
+		INIT_RADIX_TREE(&uncertain_inodes[i].tree, 0);
 	}
-	for (i = 0; i < agcount; i++)  {
-		avl_init_tree(inode_tree_ptrs[i], &avl_ino_tree_ops);
-		avl_init_tree(inode_uncertain_tree_ptrs[i], &avl_ino_tree_ops);
-	}
-
-	if ((last_rec = malloc(sizeof(ino_tree_node_t *) * agcount)) == NULL)
-		do_error(_("couldn't malloc uncertain inode cache area\n"));
-
-	memset(last_rec, 0, sizeof(ino_tree_node_t *) * agcount);
 
 	full_ino_ex_data = 0;
 }
@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include "globals.h"
+#include "err_protos.h"
+#include "incremental.h"
+
+/*
+ * Incremental no-modify checks.
+ *
+ * A nightly "xfs_repair -n" of a big filesystem that hardly changes spends
+ * most of its time rescanning AGs that were clean the night before.  With
+ * "-o incremental=FILE", a check that finds nothing wrong records a
+ * signature of every AG in FILE: a checksum of the AG header sectors and of
+ * the root blocks of the AG btrees, and the highest LSN stamped on them.
+ * The next check skips every AG whose signature hasn't changed.
+ *
+ * Any allocation or free in an AG rewrites its AGF or AGI, so unchanged
+ * headers mean that the space and inode maps of the AG are as they were.
+ * Changes that don't touch them, such as rewriting file data in place, go
+ * unnoticed; a full check catches those.
+ *
+ * The AGs we skip are simply left out of the incore state:
+ *
+ *  - phase 2 doesn't scan them, and takes their summary counters from the
+ *    last check so that the superblock counters can still be verified;
+ *  - their inodes are never processed, and directory entries in other AGs
+ *    that point into them are taken on trust;
+ *  - their reverse mappings aren't checked, and because other AGs can share
+ *    blocks with them, neither are the reference counts of any AG;
+ *  - phases 6 and 7 need every inode in the filesystem and are not run.
+ *
+ * AG 0 holds the root directory and the metadata inodes, so it is always
+ * checked.  A partial check that comes out clean carries the old signatures
+ * of the skipped AGs forward; a check that finds a problem leaves the file
+ * alone, so that the next check looks at the damaged AGs again.
+ *
+ * Like the checkpoint file, this is host byte order scratch state; it's
+ * only meant to be read by the same xfs_repair on the same kind of machine.
+ *
+ * The same state lets several hosts share out a check of one big
+ * filesystem on a shared LUN.  Each worker runs with "-o ag_range=A-B" and
+ * its own state file, and checks AG 0 plus its range, skipping the rest
+ * like unchanged AGs except that their counts aren't known, so the
+ * superblock counters are not checked.  Only the AGs a worker actually
+ * checked are marked valid in its file.  A coordinator then runs with
+ * "-o incremental_merge=FILE" for each worker's file: every AG that a
+ * worker found clean and that hasn't changed since is skipped, so the
+ * coordinator only checks AG 0, the AGs nobody covered, and the superblock
+ * counters against the workers' per-AG counts.
+ */
+
+#define INCR_MAGIC		"XFSRINCR"
+#define INCR_VERSION		1
+
+struct incr_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		agcount;
+	uuid_t			uuid;
+	uint64_t		dblocks;
+	uint32_t		agblocks;
+	uint32_t		pad;
+	char			progver[32];
+};
+
+#define INCR_AG_VALID		(1U << 0)	/* signature was computed */
+
+struct incr_ag_rec {
+	uint32_t		crc;
+	uint32_t		flags;
+	uint64_t		lsn;
+	struct incr_ag_counts	counts;
+};
+
+static char			*incr_path;
+static struct incr_ag_rec	*incr_recs;	/* state to save */
+static bool			*incr_skip;
+static xfs_agnumber_t		incr_nr_skipped;
+
+/* Worker mode: only check this range of AGs. */
+static xfs_agnumber_t		incr_first;
+static xfs_agnumber_t		incr_last = NULLAGNUMBER;
+static bool			incr_nocounts;	/* skipped AGs we know nothing of */
+
+/* Coordinator mode: state files written by the workers. */
+static char			**incr_merge;
+static unsigned int		incr_nr_merge;
+
+/* Only check AG 0 and AGs @first to @last. */
+void
+incremental_set_range(
+	xfs_agnumber_t		first,
+	xfs_agnumber_t		last)
+{
+	incr_first = first;
+	incr_last = last;
+}
+
+/* Also trust the AGs found clean in another check's state file. */
+void
+incremental_add_merge(
+	const char		*path)
+{
+	char			**p;
+
+	p = realloc(incr_merge, (incr_nr_merge + 1) * sizeof(char *));
+	if (!p)
+		do_error(_("couldn't allocate incremental state path\n"));
+	incr_merge = p;
+	incr_merge[incr_nr_merge] = strdup(path);
+	if (!incr_merge[incr_nr_merge])
+		do_error(_("couldn't allocate incremental state path\n"));
+	incr_nr_merge++;
+}
+
+/* Remember where the incremental state lives. */
+void
+incremental_setup(
+	const char		*path)
+{
+	incr_path = strdup(path);
+	if (!incr_path)
+		do_error(_("couldn't allocate incremental state path\n"));
+}
+
+/* Fold a btree root block and its LSN into the signature. */
+static int
+incr_sign_block(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno,
+	struct incr_ag_rec	*rec)
+{
+	struct xfs_btree_block	*block;
+	struct xfs_buf		*bp;
+	int			error;
+
+	if (agbno == 0 || agbno >= mp->m_sb.sb_agblocks)
+		return -EFSCORRUPTED;
+
+	error = -libxfs_buf_read_uncached(mp->m_ddev_targp,
+			XFS_AGB_TO_DADDR(mp, agno, agbno),
+			XFS_FSB_TO_BB(mp, 1), 0, &bp, NULL);
+	if (error)
+		return error;
+
+	rec->crc = crc32c(rec->crc, bp->b_addr, BBTOB(bp->b_length));
+	if (xfs_has_crc(mp)) {
+		block = bp->b_addr;
+		rec->lsn = max(rec->lsn, be64_to_cpu(block->bb_u.s.bb_lsn));
+	}
+	libxfs_buf_relse(bp);
+	return 0;
+}
+
+/* Compute the signature of the AG headers and btree roots. */
+static int
+incr_sign_ag(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	struct incr_ag_rec	*rec)
+{
+	struct xfs_agf		*agf;
+	struct xfs_agi		*agi;
+	struct xfs_buf		*bp;
+	xfs_agblock_t		roots[6];
+	unsigned int		nr = 0;
+	unsigned int		i;
+	int			error;
+
+	error = -libxfs_buf_read_uncached(mp->m_ddev_targp,
+			XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+			XFS_FSS_TO_BB(mp, 4), 0, &bp, NULL);
+	if (error)
+		return error;
+
+	rec->crc = crc32c(XFS_CRC_SEED, bp->b_addr, BBTOB(bp->b_length));
+	rec->lsn = 0;
+
+	agf = bp->b_addr + BBTOB(XFS_AGF_DADDR(mp));
+	agi = bp->b_addr + BBTOB(XFS_AGI_DADDR(mp));
+	if (agf->agf_magicnum != cpu_to_be32(XFS_AGF_MAGIC) ||
+	    agi->agi_magicnum != cpu_to_be32(XFS_AGI_MAGIC)) {
+		libxfs_buf_relse(bp);
+		return -EFSCORRUPTED;
+	}
+
+	if (xfs_has_crc(mp))
+		rec->lsn = max(be64_to_cpu(agf->agf_lsn),
+			       be64_to_cpu(agi->agi_lsn));
+
+	roots[nr++] = be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNO]);
+	roots[nr++] = be32_to_cpu(agf->agf_roots[XFS_BTNUM_CNT]);
+	if (xfs_has_rmapbt(mp))
+		roots[nr++] = be32_to_cpu(agf->agf_roots[XFS_BTNUM_RMAP]);
+	if (xfs_has_reflink(mp))
+		roots[nr++] = be32_to_cpu(agf->agf_refcount_root);
+	roots[nr++] = be32_to_cpu(agi->agi_root);
+	if (xfs_has_finobt(mp))
+		roots[nr++] = be32_to_cpu(agi->agi_free_root);
+	libxfs_buf_relse(bp);
+
+	for (i = 0; i < nr; i++) {
+		error = incr_sign_block(mp, agno, roots[i], rec);
+		if (error)
+			return error;
+	}
+
+	rec->flags |= INCR_AG_VALID;
+	return 0;
+}
+
+/* Read the state of the last clean check; returns NULL if there isn't any. */
+static struct incr_ag_rec *
+incr_read_file(
+	struct xfs_mount	*mp,
+	const char		*path)
+{
+	struct incr_header	hdr;
+	struct incr_ag_rec	*old;
+	size_t			len;
+	uint32_t		crc;
+	uint32_t		disk_crc;
+	FILE			*fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			do_warn(_("couldn't open incremental state %s: %s\n"),
+					path, strerror(errno));
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, INCR_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != INCR_VERSION ||
+	    hdr.agcount != mp->m_sb.sb_agcount ||
+	    hdr.agblocks != mp->m_sb.sb_agblocks ||
+	    hdr.dblocks != mp->m_sb.sb_dblocks ||
+	    platform_uuid_compare(&hdr.uuid, &mp->m_sb.sb_uuid) ||
+	    strncmp(hdr.progver, VERSION, sizeof(hdr.progver))) {
+		do_log(
+_("        - incremental state %s doesn't match this filesystem, ignoring it\n"),
+				path);
+		fclose(fp);
+		return NULL;
+	}
+
+	len = hdr.agcount * sizeof(struct incr_ag_rec);
+	old = malloc(len);
+	if (!old)
+		do_error(_("couldn't allocate incremental state\n"));
+	if (fread(old, len, 1, fp) != 1 ||
+	    fread(&disk_crc, sizeof(disk_crc), 1, fp) != 1)
+		goto bad;
+	crc = crc32c(XFS_CRC_SEED, &hdr, sizeof(hdr));
+	crc = crc32c(crc, old, len);
+	if (crc != disk_crc)
+		goto bad;
+
+	fclose(fp);
+	return old;
+bad:
+	do_warn(_("incremental state %s is corrupt, ignoring it\n"), path);
+	free(old);
+	fclose(fp);
+	return NULL;
+}
+
+/* Skip the AGs that @old found clean and that haven't changed since. */
+static void
+incr_apply(
+	struct xfs_mount	*mp,
+	struct incr_ag_rec	*old)
+{
+	xfs_agnumber_t		agno;
+
+	for (agno = 1; agno < mp->m_sb.sb_agcount; agno++) {
+		struct incr_ag_rec	*rec = &incr_recs[agno];
+
+		if (incr_skip[agno] ||
+		    !(rec->flags & INCR_AG_VALID) ||
+		    !(old[agno].flags & INCR_AG_VALID) ||
+		    rec->crc != old[agno].crc || rec->lsn != old[agno].lsn)
+			continue;
+
+		rec->counts = old[agno].counts;
+		incr_skip[agno] = true;
+		incr_nr_skipped++;
+	}
+}
+
+/*
+ * Sign every AG and decide which ones we can skip.  Must be called before
+ * phase 2 looks at the AGs.
+ */
+void
+incremental_load(
+	struct xfs_mount	*mp)
+{
+	struct incr_ag_rec	*old;
+	xfs_agnumber_t		agno;
+	unsigned int		i;
+	int			error;
+
+	if (!incr_path)
+		return;
+
+	incr_recs = calloc(mp->m_sb.sb_agcount, sizeof(struct incr_ag_rec));
+	incr_skip = calloc(mp->m_sb.sb_agcount, sizeof(bool));
+	if (!incr_recs || !incr_skip)
+		do_error(_("couldn't allocate incremental state\n"));
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		error = incr_sign_ag(mp, agno, &incr_recs[agno]);
+		if (error && error != -EFSCORRUPTED)
+			do_warn(_("couldn't sign AG %u headers: %s\n"), agno,
+					strerror(-error));
+	}
+
+	old = incr_read_file(mp, incr_path);
+	if (old) {
+		incr_apply(mp, old);
+		free(old);
+	}
+	for (i = 0; i < incr_nr_merge; i++) {
+		old = incr_read_file(mp, incr_merge[i]);
+		if (old) {
+			incr_apply(mp, old);
+			free(old);
+		}
+	}
+	if (incr_nr_skipped)
+		do_log(_("        - %u of %u AGs unchanged since the last check, skipping them\n"),
+				incr_nr_skipped, mp->m_sb.sb_agcount);
+
+	if (incr_last != NULLAGNUMBER) {
+		xfs_agnumber_t	nr_out = 0;
+
+		for (agno = 1; agno < mp->m_sb.sb_agcount; agno++) {
+			if (incr_skip[agno] ||
+			    (agno >= incr_first && agno <= incr_last))
+				continue;
+
+			/* not checked here, so don't record it as clean */
+			incr_recs[agno].flags &= ~INCR_AG_VALID;
+			incr_skip[agno] = true;
+			incr_nr_skipped++;
+			incr_nocounts = true;
+			nr_out++;
+		}
+		do_log(_("        - leaving %u AGs outside %u-%u to other checks\n"),
+				nr_out, incr_first, incr_last);
+	}
+
+	if (!incr_nr_skipped)
+		do_log(_("        - checking all AGs\n"));
+}
+
+/* Was this AG unchanged since the last clean check? */
+bool
+incremental_skip_ag(
+	xfs_agnumber_t		agno)
+{
+	return incr_skip && incr_skip[agno];
+}
+
+/* Are we leaving out any AGs? */
+bool
+incremental_partial(void)
+{
+	return incr_nr_skipped > 0;
+}
+
+/* Do we have summary counters for every AG we skipped? */
+bool
+incremental_have_counts(void)
+{
+	return !incr_nocounts;
+}
+
+/* Summary counters of a skipped AG, from the last check. */
+void
+incremental_get_counts(
+	xfs_agnumber_t		agno,
+	struct incr_ag_counts	*counts)
+{
+	*counts = incr_recs[agno].counts;
+}
+
+/* Remember the summary counters of an AG we checked. */
+void
+incremental_set_counts(
+	xfs_agnumber_t		agno,
+	const struct incr_ag_counts *counts)
+{
+	if (incr_recs)
+		incr_recs[agno].counts = *counts;
+}
+
+/* The check came out clean; write the new state over the old. */
+void
+incremental_save(
+	struct xfs_mount	*mp)
+{
+	struct incr_header	hdr = { 0 };
+	char			*tmp_path;
+	size_t			len;
+	uint32_t		crc;
+	FILE			*fp;
+	int			error = 0;
+
+	if (!incr_path)
+		return;
+
+	memcpy(hdr.magic, INCR_MAGIC, sizeof(hdr.magic));
+	hdr.version = INCR_VERSION;
+	hdr.agcount = mp->m_sb.sb_agcount;
+	platform_uuid_copy(&hdr.uuid, &mp->m_sb.sb_uuid);
+	hdr.dblocks = mp->m_sb.sb_dblocks;
+	hdr.agblocks = mp->m_sb.sb_agblocks;
+	strncpy(hdr.progver, VERSION, sizeof(hdr.progver) - 1);
+
+	len = hdr.agcount * sizeof(struct incr_ag_rec);
+	crc = crc32c(XFS_CRC_SEED, &hdr, sizeof(hdr));
+	crc = crc32c(crc, incr_recs, len);
+
+	if (asprintf(&tmp_path, "%s.tmp", incr_path) < 0) {
+		do_warn(_("couldn't write incremental state %s: %s\n"),
+				incr_path, strerror(ENOMEM));
+		return;
+	}
+	fp = fopen(tmp_path, "w");
+	if (!fp) {
+		error = errno;
+		goto out_warn;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(incr_recs, len, 1, fp) != 1 ||
+	    fwrite(&crc, sizeof(crc), 1, fp) != 1 ||
+	    fflush(fp) || fsync(fileno(fp)))
+		error = errno ? errno : EIO;
+	if (fclose(fp) && !error)
+		error = errno;
+	if (!error && rename(tmp_path, incr_path))
+		error = errno;
+	if (error) {
+		unlink(tmp_path);
+		goto out_warn;
+	}
+
+	do_log(_("        - saved incremental state to %s\n"), incr_path);
+	free(tmp_path);
+	return;
+
+out_warn:
+	do_warn(_("couldn't write incremental state %s: %s\n"), incr_path,
+			strerror(error));
+	free(tmp_path);
+}
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_REPAIR_INCREMENTAL_H__
+#define __XFS_REPAIR_INCREMENTAL_H__
+
+/* Summary counters of an AG, as phase 2 adds them up for the superblock. */
+struct incr_ag_counts {
+	uint64_t		fdblocks;
+	uint64_t		icount;
+	uint64_t		ifreecount;
+	uint64_t		usedblocks;
+};
+
+void incremental_setup(const char *path);
+void incremental_set_range(xfs_agnumber_t first, xfs_agnumber_t last);
+void incremental_add_merge(const char *path);
+void incremental_load(struct xfs_mount *mp);
+void incremental_save(struct xfs_mount *mp);
+
+bool incremental_skip_ag(xfs_agnumber_t agno);
+bool incremental_partial(void);
+bool incremental_have_counts(void);
+void incremental_get_counts(xfs_agnumber_t agno,
+		struct incr_ag_counts *counts);
+void incremental_set_counts(xfs_agnumber_t agno,
+		const struct incr_ag_counts *counts);
+
+#endif /* __XFS_REPAIR_INCREMENTAL_H__ */
@@ -10,10 +10,10 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "pthread.h"
-#include "avl.h"
 #include "bmap.h"
 #include "incore.h"
 #include "prefetch.h"
+#include "libfrog/crc32c.h"
 #include "libfrog/crc32cselftest.h"
 #include <sys/resource.h>
 
@@ -77,6 +77,7 @@ xfs_init(libxfs_init_t *args)
 	}
 
 	args->usebuflock = do_prefetch;
+	args->bcache_flags = bcache_flags;
 	args->setblksize = 0;
 	args->isdirect = LIBXFS_DIRECT;
 	if (no_modify)
@@ -98,6 +99,14 @@ _("Unmount or use the dangerous (-d) option to repair a read-only mounted filesy
 		do_error(_("couldn't initialize XFS library\n"));
 	}
 
+	/*
+	 * Verify blocks brought in by readahead on their own threads, so that
+	 * checking the crcs of big attr values and btree blocks overlaps with
+	 * the inode processing that will use them.
+	 */
+	if (!getenv("LIBXFS_VERIFY_THREADS"))
+		libxfs_buf_verify_offload(min(platform_nproc(), 4));
+
 	ts_create();
 	increase_rlimit();
 	pftrace_init();
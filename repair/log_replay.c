@@ -0,0 +1,1447 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include "libxlog.h"
+#include "globals.h"
+#include "err_protos.h"
+#include "log_replay.h"
+
+/*
+ * Log replay.
+ *
+ * A filesystem that wasn't unmounted cleanly has metadata changes in its log
+ * that haven't necessarily made it to their final place on disk.  Instead of
+ * making the user mount and unmount the filesystem first, or throw the
+ * changes away with -L, "-o replay_log" has phase 2 apply them much like the
+ * kernel does at mount time:
+ *
+ *  - the first pass over the log records which buffers were cancelled
+ *    (freed) and which quota types were turned off;
+ *  - the second pass applies the buffer, inode, dquot and inode chunk items
+ *    of every committed transaction, in the order the kernel uses within a
+ *    transaction, skipping changes that are older than what's on disk.
+ *
+ * Changes are made to buffers in the buffer cache.  The cache writes them
+ * back sorted by disk address when we flush it after the second pass, and
+ * only then is the log cleared.  If replay fails, the log is left alone for
+ * the kernel to replay.
+ *
+ * Intents (EFI, RUI, CUI and BUI items) logged without their done items
+ * describe deferred work that hadn't finished when the filesystem went down.
+ * The kernel finishes that work after replay; we don't, because the free
+ * space, reverse mapping and reference count btrees it would update are
+ * checked and rebuilt by phases 4 and 5 anyway.  An unfinished bmap intent
+ * can leave part of a file unmapped that the kernel would have remapped, so
+ * we say how many of them there were.
+ */
+
+#define REPLAY_HASH_SIZE	XLOG_BC_TABLE_SIZE
+
+/* A buffer that was freed at some point in the log. */
+struct replay_cancel {
+	struct replay_cancel	*next;
+	xfs_daddr_t		blkno;
+	unsigned int		len;
+	unsigned int		refcount;
+};
+
+/* An intent we haven't seen the done item for yet. */
+struct replay_intent {
+	struct replay_intent	*next;
+	uint64_t		id;
+	uint16_t		type;
+};
+
+/* An inode whose bmap btree blocks need a new owner, from swapext. */
+struct replay_owner {
+	struct replay_owner	*next;
+	xfs_ino_t		ino;
+	int			whichfork;
+};
+
+static struct replay_state {
+	struct xfs_mount	*mp;
+	bool			geometry_changed;
+	struct replay_cancel	*cancels[REPLAY_HASH_SIZE];
+	struct replay_intent	*intents[REPLAY_HASH_SIZE];
+	struct replay_owner	*owners;
+	unsigned int		qoff_types;	/* XFS_DQTYPE_* turned off */
+
+	uint64_t		trans;
+	uint64_t		bufs;
+	uint64_t		inodes;
+	uint64_t		dquots;
+	uint64_t		icreates;
+	uint64_t		skipped;	/* disk copy already newer */
+	uint64_t		cancelled;
+	uint64_t		unverified;
+} replay;
+
+/*
+ * Transactions that committed in different checkpoints can share a start
+ * LSN, so metadata is only known to be newer than a change when its LSN is
+ * strictly greater.
+ */
+static inline bool
+replay_lsn_newer(
+	xfs_lsn_t		disk_lsn,
+	xfs_lsn_t		lsn)
+{
+	return disk_lsn && disk_lsn != (xfs_lsn_t)-1 &&
+	       XFS_LSN_CMP(disk_lsn, lsn) > 0;
+}
+
+static struct replay_cancel **
+replay_cancel_bucket(
+	xfs_daddr_t		blkno)
+{
+	return &replay.cancels[blkno % REPLAY_HASH_SIZE];
+}
+
+/* Pass 1: count the cancel records of a buffer. */
+static void
+replay_cancel_add(
+	xfs_daddr_t		blkno,
+	unsigned int		len)
+{
+	struct replay_cancel	**bucket = replay_cancel_bucket(blkno);
+	struct replay_cancel	*bc;
+
+	for (bc = *bucket; bc; bc = bc->next) {
+		if (bc->blkno == blkno && bc->len == len) {
+			bc->refcount++;
+			return;
+		}
+	}
+
+	bc = malloc(sizeof(*bc));
+	if (!bc)
+		do_error(_("couldn't allocate log replay cancel record\n"));
+	bc->blkno = blkno;
+	bc->len = len;
+	bc->refcount = 1;
+	bc->next = *bucket;
+	*bucket = bc;
+}
+
+/*
+ * Pass 2: changes to a buffer that has a cancel record further on in the log
+ * must not be replayed, because the blocks may have been reused for
+ * something else afterwards.  Once we've passed its last cancel record, the
+ * buffer is in use again and later changes are replayed.
+ */
+static bool
+replay_cancelled(
+	xfs_daddr_t		blkno,
+	unsigned int		len)
+{
+	struct replay_cancel	*bc;
+
+	for (bc = *replay_cancel_bucket(blkno); bc; bc = bc->next)
+		if (bc->blkno == blkno && bc->len == len)
+			return true;
+	return false;
+}
+
+static void
+replay_cancel_put(
+	xfs_daddr_t		blkno,
+	unsigned int		len)
+{
+	struct replay_cancel	**pp = replay_cancel_bucket(blkno);
+	struct replay_cancel	*bc;
+
+	for (; (bc = *pp) != NULL; pp = &bc->next) {
+		if (bc->blkno == blkno && bc->len == len) {
+			if (--bc->refcount == 0) {
+				*pp = bc->next;
+				free(bc);
+			}
+			return;
+		}
+	}
+}
+
+static void
+replay_intent_add(
+	uint16_t		type,
+	uint64_t		id)
+{
+	struct replay_intent	**bucket = &replay.intents[id % REPLAY_HASH_SIZE];
+	struct replay_intent	*ri;
+
+	ri = malloc(sizeof(*ri));
+	if (!ri)
+		do_error(_("couldn't allocate log replay intent record\n"));
+	ri->id = id;
+	ri->type = type;
+	ri->next = *bucket;
+	*bucket = ri;
+}
+
+/* The done item of an intent logged before the tail has nothing to match. */
+static void
+replay_intent_done(
+	uint16_t		type,
+	uint64_t		id)
+{
+	struct replay_intent	**pp = &replay.intents[id % REPLAY_HASH_SIZE];
+	struct replay_intent	*ri;
+
+	for (; (ri = *pp) != NULL; pp = &ri->next) {
+		if (ri->id == id && ri->type == type) {
+			*pp = ri->next;
+			free(ri);
+			return;
+		}
+	}
+}
+
+/* Where the LSN of the last write lives in a v5 metadata buffer, if any. */
+static __be64 *
+replay_buf_lsnp(
+	struct xfs_buf		*bp)
+{
+	char			*p = bp->b_addr;
+	struct xfs_da_blkinfo	*info = bp->b_addr;
+
+	switch (be32_to_cpu(*(__be32 *)p)) {
+	case XFS_ABTB_CRC_MAGIC:
+	case XFS_ABTC_CRC_MAGIC:
+	case XFS_IBT_CRC_MAGIC:
+	case XFS_FIBT_CRC_MAGIC:
+	case XFS_RMAP_CRC_MAGIC:
+	case XFS_REFC_CRC_MAGIC:
+		return &((struct xfs_btree_block *)p)->bb_u.s.bb_lsn;
+	case XFS_BMAP_CRC_MAGIC:
+		return &((struct xfs_btree_block *)p)->bb_u.l.bb_lsn;
+	case XFS_AGF_MAGIC:
+		return &((struct xfs_agf *)p)->agf_lsn;
+	case XFS_AGI_MAGIC:
+		return &((struct xfs_agi *)p)->agi_lsn;
+	case XFS_AGFL_MAGIC:
+		return (__be64 *)(p + offsetof(struct xfs_agfl, agfl_lsn));
+	case XFS_SB_MAGIC:
+		return &((struct xfs_dsb *)p)->sb_lsn;
+	case XFS_SYMLINK_MAGIC:
+		return &((struct xfs_dsymlink_hdr *)p)->sl_lsn;
+	case XFS_DIR3_BLOCK_MAGIC:
+	case XFS_DIR3_DATA_MAGIC:
+	case XFS_DIR3_FREE_MAGIC:
+		return &((struct xfs_dir3_blk_hdr *)p)->lsn;
+	case XFS_ATTR3_RMT_MAGIC:
+		return &((struct xfs_attr3_rmt_hdr *)p)->rm_lsn;
+	}
+
+	switch (be16_to_cpu(info->magic)) {
+	case XFS_DIR3_LEAF1_MAGIC:
+	case XFS_DIR3_LEAFN_MAGIC:
+	case XFS_DA3_NODE_MAGIC:
+	case XFS_ATTR3_LEAF_MAGIC:
+		return &((struct xfs_da3_blkinfo *)p)->lsn;
+	}
+	return NULL;
+}
+
+/*
+ * Inodes and dquots carry their own LSNs, so their buffers don't have one;
+ * don't go looking for a magic number in them either.
+ */
+static bool
+replay_buf_has_lsn(
+	struct xfs_buf_log_format *buf_f)
+{
+	if (!xfs_has_crc(replay.mp))
+		return false;
+	if (buf_f->blf_flags & (XFS_BLF_INODE_BUF | XFS_BLF_UDQUOT_BUF |
+				XFS_BLF_PDQUOT_BUF | XFS_BLF_GDQUOT_BUF))
+		return false;
+	return xfs_blft_from_flags(buf_f) != XFS_BLFT_DINO_BUF;
+}
+
+static const struct xfs_buf_ops *
+replay_buf_ops(
+	struct xfs_buf		*bp,
+	struct xfs_buf_log_format *buf_f)
+{
+	struct xfs_mount	*mp = replay.mp;
+	unsigned int		len = BBTOB(bp->b_length);
+
+	switch (xfs_blft_from_flags(buf_f)) {
+	case XFS_BLFT_BTREE_BUF:
+		switch (be32_to_cpu(*(__be32 *)bp->b_addr)) {
+		case XFS_ABTB_MAGIC:
+		case XFS_ABTB_CRC_MAGIC:
+			return &xfs_bnobt_buf_ops;
+		case XFS_ABTC_MAGIC:
+		case XFS_ABTC_CRC_MAGIC:
+			return &xfs_cntbt_buf_ops;
+		case XFS_IBT_MAGIC:
+		case XFS_IBT_CRC_MAGIC:
+			return &xfs_inobt_buf_ops;
+		case XFS_FIBT_MAGIC:
+		case XFS_FIBT_CRC_MAGIC:
+			return &xfs_finobt_buf_ops;
+		case XFS_BMAP_MAGIC:
+		case XFS_BMAP_CRC_MAGIC:
+			return &xfs_bmbt_buf_ops;
+		case XFS_RMAP_CRC_MAGIC:
+			return &xfs_rmapbt_buf_ops;
+		case XFS_REFC_CRC_MAGIC:
+			return &xfs_refcountbt_buf_ops;
+		}
+		return NULL;
+	case XFS_BLFT_AGF_BUF:
+		return &xfs_agf_buf_ops;
+	case XFS_BLFT_AGFL_BUF:
+		return &xfs_agfl_buf_ops;
+	case XFS_BLFT_AGI_BUF:
+		return &xfs_agi_buf_ops;
+	case XFS_BLFT_SB_BUF:
+		return &xfs_sb_buf_ops;
+	case XFS_BLFT_UDQUOT_BUF:
+	case XFS_BLFT_PDQUOT_BUF:
+	case XFS_BLFT_GDQUOT_BUF:
+		return &xfs_dquot_buf_ops;
+	case XFS_BLFT_SYMLINK_BUF:
+		return &xfs_symlink_buf_ops;
+	case XFS_BLFT_ATTR_RMT_BUF:
+		return &xfs_attr3_rmt_buf_ops;
+	case XFS_BLFT_RTBITMAP_BUF:
+	case XFS_BLFT_RTSUMMARY_BUF:
+		return &xfs_rtbuf_ops;
+	}
+
+	/*
+	 * A directory or attribute block made of discontiguous extents is
+	 * logged one extent at a time.  A piece of a block can't be verified
+	 * or checksummed on its own, so leave those for phase 6.
+	 */
+	switch (xfs_blft_from_flags(buf_f)) {
+	case XFS_BLFT_DIR_BLOCK_BUF:
+		if (len == mp->m_dir_geo->blksize)
+			return &xfs_dir3_block_buf_ops;
+		break;
+	case XFS_BLFT_DIR_DATA_BUF:
+		if (len == mp->m_dir_geo->blksize)
+			return &xfs_dir3_data_buf_ops;
+		break;
+	case XFS_BLFT_DIR_FREE_BUF:
+		if (len == mp->m_dir_geo->blksize)
+			return &xfs_dir3_free_buf_ops;
+		break;
+	case XFS_BLFT_DIR_LEAF1_BUF:
+		if (len == mp->m_dir_geo->blksize)
+			return &xfs_dir3_leaf1_buf_ops;
+		break;
+	case XFS_BLFT_DIR_LEAFN_BUF:
+		if (len == mp->m_dir_geo->blksize)
+			return &xfs_dir3_leafn_buf_ops;
+		break;
+	case XFS_BLFT_DA_NODE_BUF:
+		if (len == mp->m_dir_geo->blksize ||
+		    len == mp->m_attr_geo->blksize)
+			return &xfs_da3_node_buf_ops;
+		break;
+	case XFS_BLFT_ATTR_LEAF_BUF:
+		if (len == mp->m_attr_geo->blksize)
+			return &xfs_attr3_leaf_buf_ops;
+		break;
+	}
+	return NULL;
+}
+
+/*
+ * Attach the verifier for the type of buffer the log says this is, and run
+ * its write side now, which also updates the checksum.  A buffer that fails
+ * is written back as it is rather than not at all, with no verifier so that
+ * the write can't refuse it; the rest of repair will find the problem.
+ */
+static void
+replay_buf_verify(
+	struct xfs_buf		*bp,
+	struct xfs_buf_log_format *buf_f)
+{
+	const struct xfs_buf_ops *ops = replay_buf_ops(bp, buf_f);
+
+	bp->b_ops = ops;
+	if (!ops)
+		return;
+
+	bp->b_error = 0;
+	ops->verify_write(bp);
+	if (bp->b_error) {
+		if (verbose)
+			do_warn(
+	_("replayed %s buffer at daddr 0x%llx fails verification\n"),
+				ops->name,
+				(unsigned long long)xfs_buf_daddr(bp));
+		bp->b_error = 0;
+		bp->b_ops = NULL;
+		replay.unverified++;
+	}
+}
+
+/* Copy the logged regions of an ordinary buffer into place. */
+static int
+replay_reg_buf(
+	struct xlog_recover_item	*item,
+	struct xfs_buf			*bp,
+	struct xfs_buf_log_format	*buf_f)
+{
+	int				i = 1;	/* 0 is the format */
+	int				bit = 0;
+	int				nbits;
+
+	for (;;) {
+		bit = libxfs_next_bit(buf_f->blf_data_map,
+				buf_f->blf_map_size, bit);
+		if (bit == -1)
+			break;
+		nbits = libxfs_contig_bits(buf_f->blf_data_map,
+				buf_f->blf_map_size, bit);
+		if (i >= item->ri_cnt)
+			return -EFSCORRUPTED;
+
+		/*
+		 * A contiguous dirty range can be logged in more than one
+		 * region when it crosses a page boundary in the kernel's
+		 * buffer, so only copy what this region holds.
+		 */
+		if (item->ri_buf[i].i_len < (nbits << XFS_BLF_SHIFT))
+			nbits = item->ri_buf[i].i_len >> XFS_BLF_SHIFT;
+		if (nbits == 0 ||
+		    (bit + nbits) << XFS_BLF_SHIFT > BBTOB(bp->b_length))
+			return -EFSCORRUPTED;
+
+		memcpy((char *)bp->b_addr + (bit << XFS_BLF_SHIFT),
+				item->ri_buf[i].i_addr, nbits << XFS_BLF_SHIFT);
+		i++;
+		bit += nbits;
+	}
+	return 0;
+}
+
+/*
+ * Inode buffers are only logged to change the unlinked list pointers; the
+ * inodes themselves are logged as inode items.  Copy just the pointers out
+ * of the logged regions and fix up the inode checksums.
+ */
+static int
+replay_inode_buf(
+	struct xlog_recover_item	*item,
+	struct xfs_buf			*bp,
+	struct xfs_buf_log_format	*buf_f)
+{
+	struct xfs_mount		*mp = replay.mp;
+	int				inodes_per_buf;
+	int				item_index = 0;
+	int				bit = 0;
+	int				nbits = 0;
+	int				reg_buf_offset = 0;
+	int				reg_buf_bytes = 0;
+	int				next_unlinked_offset;
+	int				i;
+	__be32				*logged_nextp;
+
+	inodes_per_buf = BBTOB(bp->b_length) >> mp->m_sb.sb_inodelog;
+	for (i = 0; i < inodes_per_buf; i++) {
+		next_unlinked_offset = (i * mp->m_sb.sb_inodesize) +
+			offsetof(struct xfs_dinode, di_next_unlinked);
+
+		/* Find the logged region at or after this pointer. */
+		while (next_unlinked_offset >=
+		       reg_buf_offset + reg_buf_bytes) {
+			bit += nbits;
+			bit = libxfs_next_bit(buf_f->blf_data_map,
+					buf_f->blf_map_size, bit);
+			if (bit == -1)
+				return 0;
+			nbits = libxfs_contig_bits(buf_f->blf_data_map,
+					buf_f->blf_map_size, bit);
+			reg_buf_offset = bit << XFS_BLF_SHIFT;
+			reg_buf_bytes = nbits << XFS_BLF_SHIFT;
+			item_index++;
+		}
+
+		if (next_unlinked_offset < reg_buf_offset)
+			continue;
+
+		if (item_index >= item->ri_cnt ||
+		    reg_buf_offset + reg_buf_bytes > BBTOB(bp->b_length) ||
+		    next_unlinked_offset - reg_buf_offset + sizeof(__be32) >
+				item->ri_buf[item_index].i_len)
+			return -EFSCORRUPTED;
+
+		logged_nextp = (__be32 *)((char *)
+				item->ri_buf[item_index].i_addr +
+				next_unlinked_offset - reg_buf_offset);
+		if (*logged_nextp == 0) {
+			do_warn(
+	_("bad inode buffer log record, unlinked pointer of inode %d in buffer 0x%llx is zero\n"),
+				i, (unsigned long long)xfs_buf_daddr(bp));
+			return -EFSCORRUPTED;
+		}
+
+		*(__be32 *)((char *)bp->b_addr + next_unlinked_offset) =
+				*logged_nextp;
+		libxfs_dinode_calc_crc(mp, (struct xfs_dinode *)
+				((char *)bp->b_addr +
+				 i * mp->m_sb.sb_inodesize));
+	}
+	return 0;
+}
+
+/* Dquot buffers of quota types that are off are left alone. */
+static bool
+replay_dquot_buf_wanted(
+	struct xfs_buf_log_format *buf_f)
+{
+	unsigned int		type = 0;
+
+	if (buf_f->blf_flags & XFS_BLF_UDQUOT_BUF)
+		type |= XFS_DQTYPE_USER;
+	if (buf_f->blf_flags & XFS_BLF_PDQUOT_BUF)
+		type |= XFS_DQTYPE_PROJ;
+	if (buf_f->blf_flags & XFS_BLF_GDQUOT_BUF)
+		type |= XFS_DQTYPE_GROUP;
+	if (!type)
+		return true;
+	if (!(replay.mp->m_sb.sb_qflags & XFS_ALL_QUOTA_ACCT))
+		return false;
+	return !(replay.qoff_types & type);
+}
+
+static int
+replay_buf_item(
+	struct xlog_recover_item	*item,
+	xfs_lsn_t			lsn)
+{
+	struct xfs_mount		*mp = replay.mp;
+	struct xfs_buf_log_format	*buf_f = item->ri_buf[0].i_addr;
+	struct xfs_buf			*bp;
+	__be64				*lsnp = NULL;
+	int				error;
+
+	if (item->ri_buf[0].i_len <
+			offsetof(struct xfs_buf_log_format, blf_data_map) ||
+	    buf_f->blf_map_size > XFS_BLF_DATAMAP_SIZE ||
+	    item->ri_buf[0].i_len <
+			offsetof(struct xfs_buf_log_format, blf_data_map) +
+			buf_f->blf_map_size * sizeof(unsigned int) ||
+	    buf_f->blf_len == 0)
+		return -EFSCORRUPTED;
+
+	if (buf_f->blf_flags & XFS_BLF_CANCEL) {
+		replay_cancel_put(buf_f->blf_blkno, buf_f->blf_len);
+		return 0;
+	}
+	if (replay_cancelled(buf_f->blf_blkno, buf_f->blf_len)) {
+		replay.cancelled++;
+		return 0;
+	}
+	if (!replay_dquot_buf_wanted(buf_f))
+		return 0;
+
+	error = libxfs_buf_read(mp->m_ddev_targp, buf_f->blf_blkno,
+			buf_f->blf_len, 0, &bp, NULL);
+	if (error)
+		return error;
+
+	/* Leave the buffer alone if it was written after this change. */
+	if (replay_buf_has_lsn(buf_f))
+		lsnp = replay_buf_lsnp(bp);
+	if (lsnp && replay_lsn_newer(be64_to_cpu(*lsnp), lsn)) {
+		replay.skipped++;
+		libxfs_buf_relse(bp);
+		return 0;
+	}
+
+	if (buf_f->blf_flags & XFS_BLF_INODE_BUF)
+		error = replay_inode_buf(item, bp, buf_f);
+	else
+		error = replay_reg_buf(item, bp, buf_f);
+	if (error) {
+		libxfs_buf_relse(bp);
+		return error;
+	}
+
+	/* Stamp the LSN the kernel's writeback would have. */
+	if (replay_buf_has_lsn(buf_f)) {
+		lsnp = replay_buf_lsnp(bp);
+		if (lsnp)
+			*lsnp = cpu_to_be64(lsn);
+	}
+	replay_buf_verify(bp, buf_f);
+	libxfs_buf_mark_dirty(bp);
+	libxfs_buf_relse(bp);
+	replay.bufs++;
+	return 0;
+}
+
+/* Old 32-bit kernels logged the inode format without padding. */
+static int
+replay_inode_format(
+	struct xlog_recover_item	*item,
+	struct xfs_inode_log_format	*in_f)
+{
+	struct xfs_inode_log_format_32	*in_f32 = item->ri_buf[0].i_addr;
+
+	if (item->ri_buf[0].i_len == sizeof(struct xfs_inode_log_format)) {
+		memcpy(in_f, item->ri_buf[0].i_addr, sizeof(*in_f));
+		return 0;
+	}
+	if (item->ri_buf[0].i_len != sizeof(struct xfs_inode_log_format_32))
+		return -EFSCORRUPTED;
+
+	in_f->ilf_type = in_f32->ilf_type;
+	in_f->ilf_size = in_f32->ilf_size;
+	in_f->ilf_fields = in_f32->ilf_fields;
+	in_f->ilf_asize = in_f32->ilf_asize;
+	in_f->ilf_dsize = in_f32->ilf_dsize;
+	in_f->ilf_ino = in_f32->ilf_ino;
+	memcpy(&in_f->ilf_u, &in_f32->ilf_u, sizeof(in_f->ilf_u));
+	in_f->ilf_blkno = in_f32->ilf_blkno;
+	in_f->ilf_len = in_f32->ilf_len;
+	in_f->ilf_boffset = in_f32->ilf_boffset;
+	return 0;
+}
+
+static inline xfs_timestamp_t
+replay_log_dinode_ts(
+	struct xfs_log_dinode		*from,
+	xfs_log_timestamp_t		its)
+{
+	struct xfs_legacy_timestamp	*lts;
+	struct xfs_log_legacy_timestamp	*lits;
+	xfs_timestamp_t			ts;
+
+	if (from->di_version >= 3 && (from->di_flags2 & XFS_DIFLAG2_BIGTIME))
+		return cpu_to_be64(its);
+
+	lts = (struct xfs_legacy_timestamp *)&ts;
+	lits = (struct xfs_log_legacy_timestamp *)&its;
+	lts->t_sec = cpu_to_be32(lits->t_sec);
+	lts->t_nsec = cpu_to_be32(lits->t_nsec);
+	return ts;
+}
+
+/*
+ * The inode core is logged in host byte order.  The unlinked pointer is
+ * logged through the inode buffer instead, so leave the disk copy alone.
+ */
+static void
+replay_log_dinode_to_disk(
+	struct xfs_log_dinode	*from,
+	struct xfs_dinode	*to,
+	xfs_lsn_t		lsn)
+{
+	to->di_magic = cpu_to_be16(from->di_magic);
+	to->di_mode = cpu_to_be16(from->di_mode);
+	to->di_version = from->di_version;
+	to->di_format = from->di_format;
+	to->di_onlink = 0;
+	to->di_uid = cpu_to_be32(from->di_uid);
+	to->di_gid = cpu_to_be32(from->di_gid);
+	to->di_nlink = cpu_to_be32(from->di_nlink);
+	to->di_projid_lo = cpu_to_be16(from->di_projid_lo);
+	to->di_projid_hi = cpu_to_be16(from->di_projid_hi);
+	memcpy(to->di_pad, from->di_pad, sizeof(to->di_pad));
+
+	to->di_atime = replay_log_dinode_ts(from, from->di_atime);
+	to->di_mtime = replay_log_dinode_ts(from, from->di_mtime);
+	to->di_ctime = replay_log_dinode_ts(from, from->di_ctime);
+
+	to->di_size = cpu_to_be64(from->di_size);
+	to->di_nblocks = cpu_to_be64(from->di_nblocks);
+	to->di_extsize = cpu_to_be32(from->di_extsize);
+	to->di_nextents = cpu_to_be32(from->di_nextents);
+	to->di_anextents = cpu_to_be16(from->di_anextents);
+	to->di_forkoff = from->di_forkoff;
+	to->di_aformat = from->di_aformat;
+	to->di_dmevmask = cpu_to_be32(from->di_dmevmask);
+	to->di_dmstate = cpu_to_be16(from->di_dmstate);
+	to->di_flags = cpu_to_be16(from->di_flags);
+	to->di_gen = cpu_to_be32(from->di_gen);
+
+	if (from->di_version == 3) {
+		to->di_changecount = cpu_to_be64(from->di_changecount);
+		to->di_crtime = replay_log_dinode_ts(from, from->di_crtime);
+		to->di_flags2 = cpu_to_be64(from->di_flags2);
+		to->di_cowextsize = cpu_to_be32(from->di_cowextsize);
+		to->di_ino = cpu_to_be64(from->di_ino);
+		to->di_lsn = cpu_to_be64(lsn);
+		memcpy(to->di_pad2, from->di_pad2, sizeof(to->di_pad2));
+		platform_uuid_copy(&to->di_uuid, &from->di_uuid);
+		to->di_flushiter = 0;
+	} else {
+		to->di_flushiter = cpu_to_be16(from->di_flushiter);
+	}
+}
+
+/* Convert a logged incore bmbt root back to its on-disk form. */
+static int
+replay_bmbt_root(
+	char			*src,
+	int			len,
+	char			*dst,
+	int			dlen)
+{
+	struct xfs_mount	*mp = replay.mp;
+	struct xfs_btree_block	*rblock = (struct xfs_btree_block *)src;
+	unsigned int		numrecs;
+
+	if (len < XFS_BMBT_BLOCK_LEN(mp))
+		return -EFSCORRUPTED;
+	numrecs = be16_to_cpu(rblock->bb_numrecs);
+	if (numrecs > libxfs_bmbt_maxrecs(mp, len, 0) ||
+	    numrecs > libxfs_bmdr_maxrecs(dlen, 0))
+		return -EFSCORRUPTED;
+
+	libxfs_bmbt_to_bmdr(mp, rblock, len, (struct xfs_bmdr_block *)dst,
+			dlen);
+	return 0;
+}
+
+/* Copy a logged data or attr fork into the disk inode. */
+static int
+replay_inode_fork(
+	struct xfs_dinode	*dip,
+	unsigned int		fields,
+	struct xfs_log_iovec	*reg,
+	int			whichfork)
+{
+	struct xfs_mount	*mp = replay.mp;
+	char			*dest;
+	int			size;
+
+	if (whichfork == XFS_DATA_FORK) {
+		dest = XFS_DFORK_DPTR(dip);
+		size = XFS_DFORK_DSIZE(dip, mp);
+		fields &= XFS_ILOG_DFORK;
+	} else {
+		if (!dip->di_forkoff)
+			return -EFSCORRUPTED;
+		dest = XFS_DFORK_APTR(dip);
+		size = XFS_DFORK_ASIZE(dip, mp);
+		fields &= XFS_ILOG_AFORK;
+	}
+
+	switch (fields) {
+	case XFS_ILOG_DDATA:
+	case XFS_ILOG_DEXT:
+	case XFS_ILOG_ADATA:
+	case XFS_ILOG_AEXT:
+		if (reg->i_len > size)
+			return -EFSCORRUPTED;
+		memcpy(dest, reg->i_addr, reg->i_len);
+		return 0;
+	case XFS_ILOG_DBROOT:
+	case XFS_ILOG_ABROOT:
+		return replay_bmbt_root(reg->i_addr, reg->i_len, dest, size);
+	}
+	return -EFSCORRUPTED;
+}
+
+/* Remember a swapext owner change; it's done once the log is replayed. */
+static void
+replay_owner_add(
+	xfs_ino_t		ino,
+	int			whichfork)
+{
+	struct replay_owner	*ro;
+
+	ro = malloc(sizeof(*ro));
+	if (!ro)
+		do_error(_("couldn't allocate log replay owner record\n"));
+	ro->ino = ino;
+	ro->whichfork = whichfork;
+	ro->next = replay.owners;
+	replay.owners = ro;
+}
+
+static int
+replay_inode_item(
+	struct xlog_recover_item	*item,
+	xfs_lsn_t			lsn)
+{
+	struct xfs_mount		*mp = replay.mp;
+	struct xfs_inode_log_format	in_f;
+	struct xfs_log_dinode		*ldip;
+	struct xfs_dinode		*dip;
+	struct xfs_buf			*bp;
+	int				attr_index;
+	int				error;
+
+	error = replay_inode_format(item, &in_f);
+	if (error)
+		return error;
+	if (in_f.ilf_size < 2 || in_f.ilf_size > 4 ||
+	    in_f.ilf_size != item->ri_cnt || in_f.ilf_len <= 0 ||
+	    in_f.ilf_boffset < 0)
+		return -EFSCORRUPTED;
+
+	if (replay_cancelled(in_f.ilf_blkno, in_f.ilf_len)) {
+		replay.cancelled++;
+		return 0;
+	}
+
+	ldip = item->ri_buf[1].i_addr;
+	if (item->ri_buf[1].i_len > xfs_log_dinode_size(mp) ||
+	    item->ri_buf[1].i_len <
+			offsetof(struct xfs_log_dinode, di_next_unlinked) ||
+	    (ldip->di_version >= 3 &&
+	     item->ri_buf[1].i_len < sizeof(struct xfs_log_dinode)) ||
+	    ldip->di_magic != XFS_DINODE_MAGIC) {
+		do_warn(_("bad inode log record for inode %llu\n"),
+			(unsigned long long)in_f.ilf_ino);
+		return -EFSCORRUPTED;
+	}
+
+	error = libxfs_buf_read(mp->m_ddev_targp, in_f.ilf_blkno,
+			in_f.ilf_len, 0, &bp, NULL);
+	if (error)
+		return error;
+
+	error = -EFSCORRUPTED;
+	if (in_f.ilf_boffset + mp->m_sb.sb_inodesize > BBTOB(bp->b_length))
+		goto out_release;
+	dip = (struct xfs_dinode *)((char *)bp->b_addr + in_f.ilf_boffset);
+	if (dip->di_magic != cpu_to_be16(XFS_DINODE_MAGIC)) {
+		do_warn(_("bad inode magic number for inode %llu at daddr 0x%llx\n"),
+			(unsigned long long)in_f.ilf_ino,
+			(unsigned long long)in_f.ilf_blkno);
+		goto out_release;
+	}
+
+	/* The owner change has to be redone even if the inode is newer. */
+	if (in_f.ilf_fields & XFS_ILOG_DOWNER)
+		replay_owner_add(in_f.ilf_ino, XFS_DATA_FORK);
+	if (in_f.ilf_fields & XFS_ILOG_AOWNER)
+		replay_owner_add(in_f.ilf_ino, XFS_ATTR_FORK);
+
+	error = 0;
+	if (dip->di_version >= 3 &&
+	    replay_lsn_newer(be64_to_cpu(dip->di_lsn), lsn)) {
+		replay.skipped++;
+		goto out_release;
+	}
+
+	/*
+	 * Before v3 inodes the flush counter tells whether the disk inode
+	 * is newer than the log copy; mind the wrap.
+	 */
+	if (!xfs_has_v3inodes(mp) &&
+	    ldip->di_flushiter < be16_to_cpu(dip->di_flushiter) &&
+	    !(be16_to_cpu(dip->di_flushiter) == DI_MAX_FLUSH &&
+	      ldip->di_flushiter < (DI_MAX_FLUSH >> 1))) {
+		replay.skipped++;
+		goto out_release;
+	}
+	ldip->di_flushiter = 0;
+
+	error = -EFSCORRUPTED;
+	if (S_ISREG(ldip->di_mode) &&
+	    ldip->di_format != XFS_DINODE_FMT_EXTENTS &&
+	    ldip->di_format != XFS_DINODE_FMT_BTREE)
+		goto out_bad;
+	if (S_ISDIR(ldip->di_mode) &&
+	    ldip->di_format != XFS_DINODE_FMT_EXTENTS &&
+	    ldip->di_format != XFS_DINODE_FMT_BTREE &&
+	    ldip->di_format != XFS_DINODE_FMT_LOCAL)
+		goto out_bad;
+	if ((uint64_t)ldip->di_nextents + ldip->di_anextents >
+			ldip->di_nblocks ||
+	    ldip->di_forkoff > mp->m_sb.sb_inodesize)
+		goto out_bad;
+
+	replay_log_dinode_to_disk(ldip, dip, lsn);
+
+	if (in_f.ilf_fields & XFS_ILOG_DEV)
+		xfs_dinode_put_rdev(dip, in_f.ilf_u.ilfu_rdev);
+
+	if (in_f.ilf_size > 2 && (in_f.ilf_fields & XFS_ILOG_DFORK)) {
+		error = replay_inode_fork(dip, in_f.ilf_fields,
+				&item->ri_buf[2], XFS_DATA_FORK);
+		if (error)
+			goto out_bad;
+	}
+	if (in_f.ilf_fields & XFS_ILOG_AFORK) {
+		attr_index = (in_f.ilf_fields & XFS_ILOG_DFORK) ? 3 : 2;
+		error = -EFSCORRUPTED;
+		if (attr_index >= in_f.ilf_size)
+			goto out_bad;
+		error = replay_inode_fork(dip, in_f.ilf_fields,
+				&item->ri_buf[attr_index], XFS_ATTR_FORK);
+		if (error)
+			goto out_bad;
+	}
+
+	libxfs_dinode_calc_crc(mp, dip);
+	libxfs_buf_mark_dirty(bp);
+	replay.inodes++;
+	error = 0;
+	goto out_release;
+
+out_bad:
+	do_warn(_("bad inode log record for inode %llu\n"),
+		(unsigned long long)in_f.ilf_ino);
+out_release:
+	libxfs_buf_relse(bp);
+	return error;
+}
+
+static int
+replay_dquot_item(
+	struct xlog_recover_item	*item,
+	xfs_lsn_t			lsn)
+{
+	struct xfs_mount		*mp = replay.mp;
+	struct xfs_dq_logformat		*dq_f = item->ri_buf[0].i_addr;
+	struct xfs_disk_dquot		*recddq;
+	struct xfs_disk_dquot		*ddq;
+	struct xfs_buf			*bp;
+	unsigned int			type;
+	int				error;
+
+	if (!(mp->m_sb.sb_qflags & XFS_ALL_QUOTA_ACCT))
+		return 0;
+
+	if (item->ri_cnt < 2 ||
+	    item->ri_buf[0].i_len < sizeof(struct xfs_dq_logformat) ||
+	    item->ri_buf[1].i_len < sizeof(struct xfs_disk_dquot) ||
+	    item->ri_buf[1].i_len > sizeof(struct xfs_dqblk))
+		return -EFSCORRUPTED;
+
+	recddq = item->ri_buf[1].i_addr;
+	type = recddq->d_type & XFS_DQTYPE_REC_MASK;
+	if (replay.qoff_types & type)
+		return 0;
+
+	if (libxfs_dquot_verify(mp, recddq, dq_f->qlf_id)) {
+		do_warn(_("bad dquot log record for id %u\n"), dq_f->qlf_id);
+		return -EFSCORRUPTED;
+	}
+
+	error = libxfs_buf_read(mp->m_ddev_targp, dq_f->qlf_blkno,
+			XFS_FSB_TO_BB(mp, dq_f->qlf_len), 0, &bp, NULL);
+	if (error)
+		return error;
+
+	if (dq_f->qlf_boffset + sizeof(struct xfs_dqblk) >
+			BBTOB(bp->b_length)) {
+		libxfs_buf_relse(bp);
+		return -EFSCORRUPTED;
+	}
+	ddq = (struct xfs_disk_dquot *)((char *)bp->b_addr +
+			dq_f->qlf_boffset);
+
+	if (xfs_has_crc(mp) &&
+	    replay_lsn_newer(be64_to_cpu(((struct xfs_dqblk *)ddq)->dd_lsn),
+			     lsn)) {
+		replay.skipped++;
+		libxfs_buf_relse(bp);
+		return 0;
+	}
+
+	memcpy(ddq, recddq, item->ri_buf[1].i_len);
+	if (xfs_has_crc(mp)) {
+		((struct xfs_dqblk *)ddq)->dd_lsn = cpu_to_be64(lsn);
+		xfs_update_cksum((char *)ddq, sizeof(struct xfs_dqblk),
+				 XFS_DQUOT_CRC_OFF);
+	}
+	libxfs_buf_mark_dirty(bp);
+	libxfs_buf_relse(bp);
+	replay.dquots++;
+	return 0;
+}
+
+/*
+ * v5 filesystems don't log the contents of new inode chunks, only that the
+ * chunk was created; initialise the inodes the same way the kernel did.
+ */
+static int
+replay_icreate_item(
+	struct xlog_recover_item	*item)
+{
+	struct xfs_mount		*mp = replay.mp;
+	struct xfs_ino_geometry		*igeo = M_IGEO(mp);
+	struct xfs_icreate_log		*icl = item->ri_buf[0].i_addr;
+	struct xfs_buf			*bp, *n;
+	xfs_agnumber_t			agno;
+	xfs_agblock_t			agbno;
+	unsigned int			count;
+	unsigned int			isize;
+	xfs_agblock_t			length;
+	int				bb_per_cluster;
+	int				cancel_count;
+	int				nbufs;
+	int				i;
+	int				error;
+	LIST_HEAD			(buffer_list);
+
+	if (item->ri_buf[0].i_len != sizeof(struct xfs_icreate_log) ||
+	    icl->icl_size != 1)
+		return -EFSCORRUPTED;
+
+	agno = be32_to_cpu(icl->icl_ag);
+	agbno = be32_to_cpu(icl->icl_agbno);
+	count = be32_to_cpu(icl->icl_count);
+	isize = be32_to_cpu(icl->icl_isize);
+	length = be32_to_cpu(icl->icl_length);
+	if (agno >= mp->m_sb.sb_agcount || !agbno ||
+	    agbno >= mp->m_sb.sb_agblocks ||
+	    isize != mp->m_sb.sb_inodesize || !count ||
+	    !length || length >= mp->m_sb.sb_agblocks ||
+	    (length != igeo->ialloc_blks && length != igeo->ialloc_min_blks) ||
+	    (count >> mp->m_sb.sb_inopblog) != length) {
+		do_warn(_("bad inode allocation log record\n"));
+		return -EFSCORRUPTED;
+	}
+
+	/*
+	 * If the chunk was freed again later in the log its buffers are
+	 * cancelled, and initialising it would clobber whatever reused the
+	 * space.
+	 */
+	bb_per_cluster = XFS_FSB_TO_BB(mp, igeo->blocks_per_cluster);
+	nbufs = length / igeo->blocks_per_cluster;
+	for (i = 0, cancel_count = 0; i < nbufs; i++) {
+		xfs_daddr_t	daddr;
+
+		daddr = XFS_AGB_TO_DADDR(mp, agno,
+				agbno + i * igeo->blocks_per_cluster);
+		if (replay_cancelled(daddr, bb_per_cluster))
+			cancel_count++;
+	}
+	if (cancel_count) {
+		if (cancel_count != nbufs)
+			do_warn(
+	_("inode chunk at AG %u block %u is partially cancelled, not initialising it\n"),
+				agno, agbno);
+		replay.cancelled++;
+		return 0;
+	}
+
+	error = libxfs_ialloc_inode_init(mp, NULL, &buffer_list, count, agno,
+			agbno, length, be32_to_cpu(icl->icl_gen));
+
+	/* Leave the buffers to the cache flush with everything else. */
+	list_for_each_entry_safe(bp, n, &buffer_list, b_list) {
+		list_del_init(&bp->b_list);
+		if (!error)
+			libxfs_buf_mark_dirty(bp);
+		libxfs_buf_relse(bp);
+	}
+	if (!error)
+		replay.icreates++;
+	return error;
+}
+
+static int
+replay_intent_item(
+	struct xlog_recover_item	*item)
+{
+	void				*p = item->ri_buf[0].i_addr;
+
+	/* The ids all sit after the type, size and count fields. */
+	if (item->ri_buf[0].i_len < 16)
+		return -EFSCORRUPTED;
+
+	switch (ITEM_TYPE(item)) {
+	case XFS_LI_EFI:
+		replay_intent_add(XFS_LI_EFI,
+				((struct xfs_efi_log_format *)p)->efi_id);
+		break;
+	case XFS_LI_EFD:
+		replay_intent_done(XFS_LI_EFI,
+				((struct xfs_efd_log_format *)p)->efd_efi_id);
+		break;
+	case XFS_LI_RUI:
+		replay_intent_add(XFS_LI_RUI,
+				((struct xfs_rui_log_format *)p)->rui_id);
+		break;
+	case XFS_LI_RUD:
+		replay_intent_done(XFS_LI_RUI,
+				((struct xfs_rud_log_format *)p)->rud_rui_id);
+		break;
+	case XFS_LI_CUI:
+		replay_intent_add(XFS_LI_CUI,
+				((struct xfs_cui_log_format *)p)->cui_id);
+		break;
+	case XFS_LI_CUD:
+		replay_intent_done(XFS_LI_CUI,
+				((struct xfs_cud_log_format *)p)->cud_cui_id);
+		break;
+	case XFS_LI_BUI:
+		replay_intent_add(XFS_LI_BUI,
+				((struct xfs_bui_log_format *)p)->bui_id);
+		break;
+	case XFS_LI_BUD:
+		replay_intent_done(XFS_LI_BUI,
+				((struct xfs_bud_log_format *)p)->bud_bui_id);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Within a transaction the kernel replays ordinary buffers and inode chunk
+ * creation first, then inodes, dquots and intents, then inode buffers, and
+ * buffer cancellations last.
+ */
+enum replay_stage {
+	REPLAY_BUFFERS,
+	REPLAY_ITEMS,
+	REPLAY_INODE_BUFFERS,
+	REPLAY_CANCELS,
+	REPLAY_NR_STAGES,
+};
+
+static enum replay_stage
+replay_item_stage(
+	struct xlog_recover_item	*item)
+{
+	struct xfs_buf_log_format	*buf_f = item->ri_buf[0].i_addr;
+
+	switch (ITEM_TYPE(item)) {
+	case XFS_LI_BUF:
+		if (buf_f->blf_flags & XFS_BLF_CANCEL)
+			return REPLAY_CANCELS;
+		if (buf_f->blf_flags & XFS_BLF_INODE_BUF)
+			return REPLAY_INODE_BUFFERS;
+		return REPLAY_BUFFERS;
+	case XFS_LI_ICREATE:
+		return REPLAY_BUFFERS;
+	}
+	return REPLAY_ITEMS;
+}
+
+static int
+replay_item(
+	struct xlog_recover_item	*item,
+	xfs_lsn_t			lsn)
+{
+	switch (ITEM_TYPE(item)) {
+	case XFS_LI_BUF:
+		return replay_buf_item(item, lsn);
+	case XFS_LI_INODE:
+		return replay_inode_item(item, lsn);
+	case XFS_LI_DQUOT:
+		return replay_dquot_item(item, lsn);
+	case XFS_LI_ICREATE:
+		return replay_icreate_item(item);
+	case XFS_LI_QUOTAOFF:
+		return 0;
+	}
+	return replay_intent_item(item);
+}
+
+/*
+ * The first pass gathers the buffer cancellations and quotaoff records, and
+ * checks that every item is one we know how to deal with, so that a log we
+ * can't replay is rejected before anything is changed.
+ */
+static int
+replay_trans_pass1(
+	struct xlog_recover		*trans)
+{
+	struct xlog_recover_item	*item;
+	struct xfs_buf_log_format	*buf_f;
+	struct xfs_qoff_logformat	*qoff_f;
+
+	list_for_each_entry(item, &trans->r_itemq, ri_list) {
+		if (!item->ri_cnt)
+			continue;
+		if (item->ri_cnt != item->ri_total ||
+		    item->ri_buf[0].i_len < sizeof(uint32_t))
+			return -EFSCORRUPTED;
+
+		switch (ITEM_TYPE(item)) {
+		case XFS_LI_BUF:
+			buf_f = item->ri_buf[0].i_addr;
+			if (item->ri_buf[0].i_len <
+			    offsetof(struct xfs_buf_log_format, blf_map_size))
+				return -EFSCORRUPTED;
+			if (buf_f->blf_flags & XFS_BLF_CANCEL)
+				replay_cancel_add(buf_f->blf_blkno,
+						buf_f->blf_len);
+			break;
+		case XFS_LI_QUOTAOFF:
+			qoff_f = item->ri_buf[0].i_addr;
+			if (item->ri_buf[0].i_len <
+			    sizeof(struct xfs_qoff_logformat))
+				return -EFSCORRUPTED;
+			if (qoff_f->qf_flags & XFS_UQUOTA_ACCT)
+				replay.qoff_types |= XFS_DQTYPE_USER;
+			if (qoff_f->qf_flags & XFS_PQUOTA_ACCT)
+				replay.qoff_types |= XFS_DQTYPE_PROJ;
+			if (qoff_f->qf_flags & XFS_GQUOTA_ACCT)
+				replay.qoff_types |= XFS_DQTYPE_GROUP;
+			break;
+		case XFS_LI_INODE:
+		case XFS_LI_DQUOT:
+		case XFS_LI_ICREATE:
+		case XFS_LI_EFI:
+		case XFS_LI_EFD:
+		case XFS_LI_RUI:
+		case XFS_LI_RUD:
+		case XFS_LI_CUI:
+		case XFS_LI_CUD:
+		case XFS_LI_BUI:
+		case XFS_LI_BUD:
+			break;
+		default:
+			do_warn(
+	_("unknown log item type 0x%x in transaction 0x%x\n"),
+				ITEM_TYPE(item), trans->r_log_tid);
+			return -EFSCORRUPTED;
+		}
+	}
+	return 0;
+}
+
+static int
+replay_trans_pass2(
+	struct xlog_recover		*trans)
+{
+	struct xlog_recover_item	*item;
+	enum replay_stage		stage;
+	int				error;
+
+	for (stage = 0; stage < REPLAY_NR_STAGES; stage++) {
+		list_for_each_entry(item, &trans->r_itemq, ri_list) {
+			if (!item->ri_cnt || replay_item_stage(item) != stage)
+				continue;
+			error = replay_item(item, trans->r_lsn);
+			if (error)
+				return error;
+		}
+	}
+	replay.trans++;
+	return 0;
+}
+
+/* Called by libxlog for every committed transaction. */
+int
+xlog_recover_do_trans(
+	struct xlog		*log,
+	struct xlog_recover	*trans,
+	int			pass)
+{
+	if (pass == XLOG_RECOVER_PASS1)
+		return replay_trans_pass1(trans);
+	return replay_trans_pass2(trans);
+}
+
+/* Point the bmap btree blocks moved by an extent swap at their new owner. */
+static void
+replay_owner_changes(void)
+{
+	struct xfs_mount	*mp = replay.mp;
+	struct replay_owner	*ro;
+	struct xfs_inode	*ip;
+	struct xfs_ifork	*ifp;
+	int			error;
+	LIST_HEAD		(buffer_list);
+
+	while ((ro = replay.owners) != NULL) {
+		replay.owners = ro->next;
+
+		error = libxfs_iget(mp, NULL, ro->ino, 0, &ip);
+		if (error)
+			goto next;
+		ifp = XFS_IFORK_PTR(ip, ro->whichfork);
+		if (VFS_I(ip)->i_mode && ifp &&
+		    ifp->if_format == XFS_DINODE_FMT_BTREE)
+			error = libxfs_bmbt_change_owner(NULL, ip,
+					ro->whichfork, ro->ino, &buffer_list);
+		libxfs_irele(ip);
+		if (!error)
+			error = libxfs_buf_delwri_submit(&buffer_list);
+		else
+			xfs_buf_delwri_cancel(&buffer_list);
+next:
+		if (error)
+			do_warn(
+	_("couldn't change the bmap btree owner of inode %llu: %s\n"),
+				(unsigned long long)ro->ino, strerror(-error));
+		free(ro);
+	}
+}
+
+static void
+replay_free_tables(void)
+{
+	struct replay_cancel	*bc;
+	struct replay_intent	*ri;
+	int			i;
+
+	for (i = 0; i < REPLAY_HASH_SIZE; i++) {
+		while ((bc = replay.cancels[i]) != NULL) {
+			replay.cancels[i] = bc->next;
+			free(bc);
+		}
+		while ((ri = replay.intents[i]) != NULL) {
+			replay.intents[i] = ri->next;
+			free(ri);
+		}
+	}
+}
+
+static void
+replay_report(void)
+{
+	struct replay_intent	*ri;
+	unsigned int		space_intents = 0;
+	unsigned int		bmap_intents = 0;
+	int			i;
+
+	do_log(
+_("        - replayed %llu transactions: %llu buffers, %llu inodes, %llu dquots, %llu inode chunks\n"),
+		(unsigned long long)replay.trans,
+		(unsigned long long)replay.bufs,
+		(unsigned long long)replay.inodes,
+		(unsigned long long)replay.dquots,
+		(unsigned long long)replay.icreates);
+	if (verbose)
+		do_log(
+_("        - skipped %llu changes already on disk and %llu to freed buffers\n"),
+			(unsigned long long)replay.skipped,
+			(unsigned long long)replay.cancelled);
+	if (replay.unverified)
+		do_warn(
+_("%llu replayed buffers fail verification and are left for repair to check\n"),
+			(unsigned long long)replay.unverified);
+
+	for (i = 0; i < REPLAY_HASH_SIZE; i++) {
+		for (ri = replay.intents[i]; ri; ri = ri->next) {
+			if (ri->type == XFS_LI_BUI)
+				bmap_intents++;
+			else
+				space_intents++;
+		}
+	}
+	if (space_intents)
+		do_warn(
+_("%u unfinished free space, reverse mapping or reference count updates were not replayed; those btrees will be rebuilt\n"),
+			space_intents);
+	if (bmap_intents)
+		do_warn(
+_("%u unfinished file mapping updates were not replayed; parts of some files may be unmapped\n"),
+			bmap_intents);
+}
+
+/*
+ * The log may have changed the superblock, typically its counters, quota
+ * state or feature bits such as the one for extended attributes, so make
+ * the incore copy match.  A changed geometry, from a growfs, means the one
+ * repair checked in phase 1 is wrong.
+ */
+static void
+replay_update_sb(
+	struct xfs_mount	*mp)
+{
+	struct xfs_sb		*old = &mp->m_sb;
+	struct xfs_sb		sb;
+	struct xfs_buf		*bp;
+
+	bp = libxfs_getsb(mp);
+	if (!bp)
+		do_error(_("couldn't read the superblock after replaying the log\n"));
+	libxfs_sb_from_disk(&sb, bp->b_addr);
+	libxfs_buf_relse(bp);
+
+	if (sb.sb_blocksize != old->sb_blocksize ||
+	    sb.sb_dblocks != old->sb_dblocks ||
+	    sb.sb_rblocks != old->sb_rblocks ||
+	    sb.sb_rextents != old->sb_rextents ||
+	    sb.sb_rextsize != old->sb_rextsize ||
+	    sb.sb_rbmblocks != old->sb_rbmblocks ||
+	    sb.sb_agblocks != old->sb_agblocks ||
+	    sb.sb_agcount != old->sb_agcount ||
+	    sb.sb_logstart != old->sb_logstart ||
+	    sb.sb_logblocks != old->sb_logblocks ||
+	    sb.sb_rootino != old->sb_rootino ||
+	    sb.sb_rbmino != old->sb_rbmino ||
+	    sb.sb_rsumino != old->sb_rsumino ||
+	    sb.sb_inodesize != old->sb_inodesize ||
+	    sb.sb_sectsize != old->sb_sectsize)
+		replay.geometry_changed = true;
+
+	memcpy(&mp->m_sb, &sb, sizeof(sb));
+	mp->m_features |= libxfs_sb_version_to_features(&sb);
+}
+
+/*
+ * Replay the log between the tail and the head into the filesystem.  The
+ * caller clears the log afterwards and then calls log_replay_done.
+ */
+void
+log_replay(
+	struct xfs_mount	*mp,
+	xfs_daddr_t		head_blk,
+	xfs_daddr_t		tail_blk)
+{
+	struct xlog		*log = mp->m_log;
+	int			error;
+
+	if (xfs_sb_is_v5(&mp->m_sb) &&
+	    xfs_sb_has_incompat_log_feature(&mp->m_sb,
+				XFS_SB_FEAT_INCOMPAT_LOG_UNKNOWN))
+		do_error(_(
+"ERROR: The log uses features (0x%x) that this xfs_repair can't replay.  Mount\n"
+"the filesystem to replay the log, or use the -L option to destroy the log and\n"
+"attempt a repair.\n"),
+			mp->m_sb.sb_features_log_incompat &
+				XFS_SB_FEAT_INCOMPAT_LOG_UNKNOWN);
+
+	memset(&replay, 0, sizeof(replay));
+	replay.mp = mp;
+	log->l_crc_fatal = true;
+
+	do_log(_("        - replaying log blocks %lld to %lld...\n"),
+		(long long)tail_blk, (long long)head_blk);
+
+	error = xlog_do_recovery_pass(log, head_blk, tail_blk,
+			XLOG_RECOVER_PASS1);
+	if (!error)
+		error = xlog_do_recovery_pass(log, head_blk, tail_blk,
+				XLOG_RECOVER_PASS2);
+	/* libxlog itself still returns some positive errnos */
+	if (error)
+		do_error(_(
+"ERROR: Replaying the log failed (%s).  The log has not been changed.\n"
+"Mount the filesystem to replay the log, or use the -L option to destroy the\n"
+"log and attempt a repair.\n"),
+			strerror(abs(error)));
+
+	/*
+	 * Pick up the superblock before anything is written: the first write
+	 * makes repair set the needsrepair flag from the incore copy.  Then
+	 * write everything back in disk order and forget the unverified.
+	 */
+	replay_update_sb(mp);
+	libxfs_bcache_flush();
+	libxfs_bcache_purge();
+
+	if (!replay.geometry_changed)
+		replay_owner_changes();
+	replay_report();
+	replay_free_tables();
+}
+
+/*
+ * Replay has generally failed if it finds geometry it doesn't agree with,
+ * but the replayed changes are on disk by now; tell the user to start over.
+ */
+void
+log_replay_done(
+	struct xfs_mount	*mp)
+{
+	if (replay.geometry_changed)
+		do_error(
+_("Replaying the log changed the filesystem geometry.  Run xfs_repair again.\n"));
+}
@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_REPAIR_LOG_REPLAY_H__
+#define __XFS_REPAIR_LOG_REPLAY_H__
+
+void log_replay(struct xfs_mount *mp, xfs_daddr_t head_blk,
+		xfs_daddr_t tail_blk);
+void log_replay_done(struct xfs_mount *mp);
+
+#endif /* __XFS_REPAIR_LOG_REPLAY_H__ */
@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include "libfrog/platform.h"
+#include "globals.h"
+#include "incore.h"
+#include "protos.h"
+#include "err_protos.h"
+#include "slab.h"
+#include "rmap.h"
+#include "prefetch.h"
+#include "memplan.h"
+
+/*
+ * Memory footprint planner.
+ *
+ * Before committing to a repair run that could take hours, it is useful to
+ * know whether it will fit in memory at all, and what -m and -o bhash values
+ * to give it.  We read only the AG headers (and optionally a few btree blocks
+ * per AG), estimate how many records of each kind repair will have to track,
+ * and turn that into a rough per-phase picture of repair's own allocations.
+ *
+ * Everything here is an estimate from metadata that repair has not checked
+ * yet, so a badly damaged filesystem can be far off.  The planner never
+ * modifies anything.
+ */
+
+/* Blocks read per btree level when sampling */
+#define MEMPLAN_SAMPLE_BLOCKS	8
+
+/* Same fixed overhead guess that the cache sizing code in main uses */
+#define MEMPLAN_BASE_KB		50000ULL
+
+enum memplan_btree {
+	MEMPLAN_BNOBT,
+	MEMPLAN_INOBT,
+	MEMPLAN_RMAPBT,
+	MEMPLAN_REFCBT,
+};
+
+struct memplan_counts {
+	uint64_t		inodes;
+	uint64_t		chunks;
+	uint64_t		free_exts;
+	uint64_t		rmaps;
+	uint64_t		refcounts;
+	unsigned int		bad_ags;
+	unsigned int		sampled;
+};
+
+static unsigned int
+memplan_maxrecs(
+	struct xfs_mount	*mp,
+	enum memplan_btree	which,
+	bool			leaf)
+{
+	switch (which) {
+	case MEMPLAN_BNOBT:
+		return mp->m_alloc_mxr[!leaf];
+	case MEMPLAN_INOBT:
+		return M_IGEO(mp)->inobt_mxr[!leaf];
+	case MEMPLAN_RMAPBT:
+		return mp->m_rmap_mxr[!leaf];
+	case MEMPLAN_REFCBT:
+		return mp->m_refc_mxr[!leaf];
+	}
+	return 0;
+}
+
+static const struct xfs_buf_ops *
+memplan_buf_ops(
+	enum memplan_btree	which)
+{
+	switch (which) {
+	case MEMPLAN_BNOBT:
+		return &xfs_bnobt_buf_ops;
+	case MEMPLAN_INOBT:
+		return &xfs_inobt_buf_ops;
+	case MEMPLAN_RMAPBT:
+		return &xfs_rmapbt_buf_ops;
+	case MEMPLAN_REFCBT:
+		return &xfs_refcountbt_buf_ops;
+	}
+	return NULL;
+}
+
+/* Leftmost child of a node block. */
+static xfs_agblock_t
+memplan_first_child(
+	struct xfs_mount	*mp,
+	enum memplan_btree	which,
+	struct xfs_btree_block	*block)
+{
+	unsigned int		mxr = memplan_maxrecs(mp, which, false);
+	__be32			*pp = NULL;
+
+	switch (which) {
+	case MEMPLAN_BNOBT:
+		pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mxr);
+		break;
+	case MEMPLAN_INOBT:
+		pp = XFS_INOBT_PTR_ADDR(mp, block, 1, mxr);
+		break;
+	case MEMPLAN_RMAPBT:
+		pp = XFS_RMAP_PTR_ADDR(block, 1, mxr);
+		break;
+	case MEMPLAN_REFCBT:
+		pp = XFS_REFCOUNT_PTR_ADDR(block, 1, mxr);
+		break;
+	}
+	return be32_to_cpu(*pp);
+}
+
+/*
+ * Estimate the number of records in an AG btree.  We walk down the left edge
+ * of the tree and read the first few blocks of each level; the record count
+ * of a level is the number of blocks in it (the record count of the level
+ * above) times the average fill of the blocks we read.  A level that we read
+ * all the way to its right edge is counted exactly.  Returns false if any
+ * block looks wrong, in which case the caller falls back to the header
+ * counters.
+ */
+static bool
+memplan_sample_btree(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	enum memplan_btree	which,
+	xfs_agblock_t		root,
+	unsigned int		levels,
+	uint64_t		*nrecs)
+{
+	struct xfs_buf		*bp;
+	struct xfs_btree_block	*block;
+	xfs_agblock_t		bno, child = root;
+	uint64_t		est = 1;
+	int			level;
+	int			error;
+
+	if (levels == 0 || levels > mp->m_agbtree_maxlevels)
+		return false;
+
+	for (level = levels - 1; level >= 0; level--) {
+		uint64_t	recs = 0;
+		unsigned int	nr = 0;
+
+		bno = child;
+		while (nr < MEMPLAN_SAMPLE_BLOCKS && bno != NULLAGBLOCK) {
+			unsigned int	numrecs;
+
+			if (!libxfs_verify_agbno(mp, agno, bno))
+				return false;
+			error = -libxfs_buf_read(mp->m_ddev_targp,
+					XFS_AGB_TO_DADDR(mp, agno, bno),
+					XFS_FSB_TO_BB(mp, 1), 0, &bp,
+					memplan_buf_ops(which));
+			if (error)
+				return false;
+
+			/* Only an empty tree may have a block with no records */
+			block = XFS_BUF_TO_BLOCK(bp);
+			numrecs = be16_to_cpu(block->bb_numrecs);
+			if (be16_to_cpu(block->bb_level) != level ||
+			    (numrecs == 0 && levels > 1) ||
+			    numrecs > memplan_maxrecs(mp, which, level == 0)) {
+				libxfs_buf_relse(bp);
+				return false;
+			}
+			if (nr == 0 && level > 0)
+				child = memplan_first_child(mp, which, block);
+			bno = be32_to_cpu(block->bb_u.s.bb_rightsib);
+			libxfs_buf_relse(bp);
+
+			recs += numrecs;
+			nr++;
+		}
+
+		if (bno == NULLAGBLOCK)
+			est = recs;
+		else
+			est = est * recs / nr;
+	}
+
+	*nrecs = est;
+	return true;
+}
+
+/* Guess the leaf records of a btree from its block count. */
+static inline uint64_t
+memplan_blocks_to_recs(
+	struct xfs_mount	*mp,
+	enum memplan_btree	which,
+	uint64_t		blocks)
+{
+	return blocks * memplan_maxrecs(mp, which, true) * 3 / 4;
+}
+
+static void
+memplan_scan_ag(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	bool			sample,
+	struct memplan_counts	*mc)
+{
+	struct xfs_buf		*agfbp, *agibp;
+	struct xfs_agf		*agf;
+	struct xfs_agi		*agi;
+	uint64_t		inodes, exts, rmaps = 0, refcs = 0;
+	uint64_t		bnoblks, used;
+	int			error;
+
+	error = -libxfs_buf_read(mp->m_ddev_targp,
+			XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), 0, &agfbp, &xfs_agf_buf_ops);
+	if (error)
+		goto out_bad;
+	error = -libxfs_buf_read(mp->m_ddev_targp,
+			XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), 0, &agibp, &xfs_agi_buf_ops);
+	if (error) {
+		libxfs_buf_relse(agfbp);
+		goto out_bad;
+	}
+	agf = agfbp->b_addr;
+	agi = agibp->b_addr;
+
+	/* Inode count and free space come straight from the headers. */
+	inodes = be32_to_cpu(agi->agi_count);
+	used = mp->m_sb.sb_agblocks - be32_to_cpu(agf->agf_freeblks);
+
+	/*
+	 * btreeblks covers both free space btrees (plus the rmapbt) minus
+	 * their roots, so half of what's left over is the bnobt.
+	 */
+	bnoblks = be32_to_cpu(agf->agf_btreeblks);
+	if (xfs_has_rmapbt(mp) && be32_to_cpu(agf->agf_rmap_blocks) > 0)
+		bnoblks -= min(bnoblks,
+			(uint64_t)be32_to_cpu(agf->agf_rmap_blocks) - 1);
+	bnoblks = bnoblks / 2 + 1;
+	exts = memplan_blocks_to_recs(mp, MEMPLAN_BNOBT, bnoblks);
+	if (!xfs_has_lazysbcount(mp) ||
+	    be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNOi]) == 1)
+		exts = memplan_maxrecs(mp, MEMPLAN_BNOBT, true) / 2;
+	exts = min(exts, (uint64_t)be32_to_cpu(agf->agf_freeblks));
+
+	/*
+	 * Without an rmapbt we still gather reverse mappings for reflink, so
+	 * guess at a couple of mappings per inode plus one per 16 used blocks.
+	 */
+	if (xfs_has_rmapbt(mp))
+		rmaps = memplan_blocks_to_recs(mp, MEMPLAN_RMAPBT,
+				be32_to_cpu(agf->agf_rmap_blocks));
+	else if (xfs_has_reflink(mp))
+		rmaps = inodes * 2 + used / 16;
+	if (xfs_has_reflink(mp))
+		refcs = memplan_blocks_to_recs(mp, MEMPLAN_REFCBT,
+				be32_to_cpu(agf->agf_refcount_blocks));
+
+	if (sample) {
+		uint64_t	n;
+
+		memplan_sample_btree(mp, agno, MEMPLAN_BNOBT,
+				be32_to_cpu(agf->agf_roots[XFS_BTNUM_BNOi]),
+				be32_to_cpu(agf->agf_levels[XFS_BTNUM_BNOi]),
+				&exts);
+		if (memplan_sample_btree(mp, agno, MEMPLAN_INOBT,
+				be32_to_cpu(agi->agi_root),
+				be32_to_cpu(agi->agi_level), &n))
+			mc->chunks += n;
+		else
+			mc->chunks += howmany(inodes, XFS_INODES_PER_CHUNK);
+		if (xfs_has_rmapbt(mp))
+			memplan_sample_btree(mp, agno, MEMPLAN_RMAPBT,
+				be32_to_cpu(agf->agf_roots[XFS_BTNUM_RMAPi]),
+				be32_to_cpu(agf->agf_levels[XFS_BTNUM_RMAPi]),
+				&rmaps);
+		if (xfs_has_reflink(mp))
+			memplan_sample_btree(mp, agno, MEMPLAN_REFCBT,
+				be32_to_cpu(agf->agf_refcount_root),
+				be32_to_cpu(agf->agf_refcount_level),
+				&refcs);
+		mc->sampled++;
+	} else {
+		mc->chunks += howmany(inodes, XFS_INODES_PER_CHUNK);
+	}
+
+	mc->inodes += inodes;
+	mc->free_exts += exts;
+	mc->rmaps += rmaps;
+	mc->refcounts += refcs;
+
+	libxfs_buf_relse(agibp);
+	libxfs_buf_relse(agfbp);
+	return;
+
+out_bad:
+	/* Spread the superblock counters evenly over unreadable AGs. */
+	inodes = mp->m_sb.sb_icount / mp->m_sb.sb_agcount;
+	mc->inodes += inodes;
+	mc->chunks += howmany(inodes, XFS_INODES_PER_CHUNK);
+	mc->free_exts += mp->m_sb.sb_fdblocks / mp->m_sb.sb_agcount / 8;
+	if (rmap_needs_work(mp))
+		mc->rmaps += inodes * 2;
+	mc->bad_ags++;
+}
+
+static inline unsigned long long
+memplan_mb(
+	unsigned long long	kb)
+{
+	return howmany(kb, 1024);
+}
+
+/*
+ * Print an estimate of repair's peak memory use for this filesystem and the
+ * options that would let it run without thrashing the buffer cache.
+ * @max_mem_kb is the budget main() worked out from -m or physical memory.
+ */
+void
+memory_plan(
+	struct xfs_mount	*mp,
+	bool			sample,
+	unsigned long		max_mem_kb)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	struct memplan_counts	mc = { 0 };
+	unsigned long long	bmap_kb, irec_kb, exdata_kb, rmap_kb, refc_kb;
+	unsigned long long	fsp_kb, cache_kb, peak_kb;
+	unsigned long long	p23_kb, p4_kb, p5_kb, p67_kb;
+	unsigned long long	irec_bytes, exdata_bytes;
+	unsigned int		cluster_kb;
+	unsigned long		bhash;
+	xfs_agnumber_t		agno;
+
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		memplan_scan_ag(mp, agno, sample, &mc);
+
+	/* Phase 2 onwards: block usage map, one byte per two blocks. */
+	bmap_kb = (mp->m_sb.sb_dblocks + mp->m_sb.sb_rextents) >> (10 + 1);
+
+	/*
+	 * Phase 3 onwards: inode records, which carry the on-disk nlinks and
+	 * ftypes, come from pools in cache line sized slots.
+	 */
+	irec_bytes = roundup(sizeof(ino_tree_node_t), IREC_ALIGN);
+	irec_kb = (mc.chunks * irec_bytes) >> 10;
+
+	/* Phases 6 and 7: extra data and counted nlinks for every chunk. */
+	exdata_bytes = roundup(sizeof(ino_ex_data_t), IREC_ALIGN);
+	exdata_kb = (mc.chunks * exdata_bytes) >> 10;
+
+	/*
+	 * Phase 4: the raw reverse mappings are merged into a second slab
+	 * before we build the refcount records from them.
+	 */
+	rmap_kb = (mc.rmaps * 2 * sizeof(struct xfs_rmap_irec)) >> 10;
+	refc_kb = (mc.refcounts * sizeof(struct xfs_refcount_irec)) >> 10;
+
+	/* Phase 5: one bno and one bcnt record per free extent. */
+	fsp_kb = (mc.free_exts * 2 * sizeof(extent_tree_node_t)) >> 10;
+
+	p23_kb = MEMPLAN_BASE_KB + bmap_kb + irec_kb;
+	p4_kb = p23_kb + rmap_kb + refc_kb;
+	p5_kb = p4_kb + fsp_kb;
+	p67_kb = MEMPLAN_BASE_KB + irec_kb + exdata_kb;
+	peak_kb = max(p5_kb, p67_kb);
+
+	/*
+	 * Enough buffer cache to keep every inode cluster resident, within
+	 * the same 1TB ceiling that the cache sizing code applies.
+	 */
+	cluster_kb = max(1U, igeo->inode_cluster_size >> 10);
+	cache_kb = (mc.chunks * XFS_INODES_PER_CHUNK *
+			mp->m_sb.sb_inodesize) >> 10;
+	cache_kb = min(cache_kb, 1ULL << 30);
+	bhash = cache_kb / (HASH_CACHE_RATIO * cluster_kb);
+	if (bhash < 512)
+		bhash = 512;
+
+	printf(_("Memory plan for %s:\n"), fs_name);
+	printf(_("        - %u AGs, %llu inodes in ~%llu chunks, %llu blocks of %u bytes\n"),
+			mp->m_sb.sb_agcount,
+			(unsigned long long)mc.inodes,
+			(unsigned long long)mc.chunks,
+			(unsigned long long)mp->m_sb.sb_dblocks,
+			mp->m_sb.sb_blocksize);
+	printf(_("        - ~%llu free space extents, ~%llu reverse mappings, ~%llu refcount records\n"),
+			(unsigned long long)mc.free_exts,
+			(unsigned long long)mc.rmaps,
+			(unsigned long long)mc.refcounts);
+	if (mc.sampled)
+		printf(_("        - btree record counts sampled in %u AGs\n"),
+				mc.sampled);
+	else
+		printf(_("        - btree record counts estimated from AG headers\n"));
+	if (mc.bad_ags)
+		printf(_("        - %u AG headers unreadable, used superblock counters\n"),
+				mc.bad_ags);
+
+	printf(_("Estimated repair memory, excluding buffer cache:\n"));
+	printf(_("        block usage map            %8llu MiB\n"),
+			memplan_mb(bmap_kb));
+	printf(_("        inode records              %8llu MiB\n"),
+			memplan_mb(irec_kb));
+	printf(_("        reverse mappings           %8llu MiB\n"),
+			memplan_mb(rmap_kb));
+	printf(_("        refcount records           %8llu MiB\n"),
+			memplan_mb(refc_kb));
+	printf(_("        free space extents         %8llu MiB\n"),
+			memplan_mb(fsp_kb));
+	printf(_("        directory link tracking    %8llu MiB\n"),
+			memplan_mb(exdata_kb));
+	printf(_("        fixed overhead             %8llu MiB\n"),
+			memplan_mb(MEMPLAN_BASE_KB));
+	printf(_("Estimated peak by phase:\n"));
+	printf(_("        phases 2-3                 %8llu MiB\n"),
+			memplan_mb(p23_kb));
+	printf(_("        phase 4                    %8llu MiB\n"),
+			memplan_mb(p4_kb));
+	printf(_("        phase 5                    %8llu MiB\n"),
+			memplan_mb(p5_kb));
+	printf(_("        phases 6-7                 %8llu MiB\n"),
+			memplan_mb(p67_kb));
+	printf(_("        inode cluster buffer cache %8llu MiB\n"),
+			memplan_mb(cache_kb));
+	printf(_("        memory available to repair %8llu MiB\n"),
+			memplan_mb(max_mem_kb));
+
+	printf(_("Suggested options:\n"));
+	printf(_("        -m %llu (or -o bhash=%lu)\n"),
+			memplan_mb(peak_kb + cache_kb), bhash);
+	if (ag_stride)
+		printf(_("        -o ag_stride=%d (%d threads)\n"),
+				ag_stride, thread_count);
+
+	if (max_mem_kb < peak_kb) {
+		printf(_("Repair is likely to need more memory than is available.\n"));
+		if (rmap_kb > peak_kb / 4)
+			printf(_("Consider -o slab_spill=<dir> to move reverse mappings to disk.\n"));
+		if (do_prefetch)
+			printf(_("Turning prefetching off (-P) reduces the memory footprint.\n"));
+	} else if (max_mem_kb < peak_kb + cache_kb) {
+		printf(_("Memory is sufficient, but the buffer cache will not hold every inode cluster.\n"));
+	}
+}
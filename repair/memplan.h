@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_REPAIR_MEMPLAN_H__
+#define __XFS_REPAIR_MEMPLAN_H__
+
+void memory_plan(struct xfs_mount *mp, bool sample, unsigned long max_mem_kb);
+
+#endif /* __XFS_REPAIR_MEMPLAN_H__ */
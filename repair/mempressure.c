@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include <pthread.h>
+#include <poll.h>
+#include "globals.h"
+#include "err_protos.h"
+#include "mempressure.h"
+
+/*
+ * Memory pressure monitoring.
+ *
+ * The buffer cache is sized from the memory we expect to have when repair
+ * starts, but in a container or on a busy machine that can turn out to be
+ * optimistic, and the first we'd hear of it is the OOM killer.  So we ask
+ * the kernel's pressure stall information for a trigger on our own memory
+ * cgroup (or the whole system, if that's all there is), and each time it
+ * fires we give back a slice of the buffer cache.  Dropping clean buffers
+ * costs some rereads later; being killed costs the whole repair.
+ */
+
+/* Fire when tasks stall on memory for 150ms of any one second... */
+#define PRESSURE_TRIGGER	"some 150000 1000000"
+
+/* ...and then give back this much of the cache. */
+#define PRESSURE_SHRINK_PCT	25
+
+static int		pressure_fd = -1;
+static int		pressure_pipe[2] = { -1, -1 };
+static pthread_t	pressure_thread;
+
+/* Open the pressure file of our cgroup v2 group, or of the whole system. */
+static int
+pressure_open(void)
+{
+	char		line[PATH_MAX];
+	char		path[PATH_MAX + 64];
+	FILE		*fp;
+	int		fd;
+
+	fp = fopen("/proc/self/cgroup", "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (strncmp(line, "0::", 3))
+				continue;
+			line[strcspn(line, "\n")] = 0;
+			snprintf(path, sizeof(path),
+					"/sys/fs/cgroup%s/memory.pressure",
+					line + 3);
+			fd = open(path, O_RDWR | O_NONBLOCK);
+			if (fd >= 0) {
+				fclose(fp);
+				return fd;
+			}
+		}
+		fclose(fp);
+	}
+
+	return open("/proc/pressure/memory", O_RDWR | O_NONBLOCK);
+}
+
+static void *
+pressure_worker(
+	void			*arg)
+{
+	struct pollfd		fds[2] = {
+		{ .fd = pressure_fd,		.events = POLLPRI },
+		{ .fd = pressure_pipe[0],	.events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		/* the cgroup went away */
+		if (fds[0].revents & POLLERR)
+			break;
+		if (!(fds[0].revents & POLLPRI))
+			continue;
+
+		libxfs_bcache_shrink(PRESSURE_SHRINK_PCT, libxfs_bhash_size);
+		if (verbose)
+			do_log(
+	_("        - memory pressure, block cache cut to %u entries\n"),
+				uatomic_read(&libxfs_bcache->c_maxcount));
+	}
+	return NULL;
+}
+
+/*
+ * Start watching for memory pressure.  Kernels without PSI, or that don't
+ * let us set a trigger, just don't get the monitor.
+ */
+void
+mempressure_start(void)
+{
+	const char		*trig = PRESSURE_TRIGGER;
+
+	pressure_fd = pressure_open();
+	if (pressure_fd < 0)
+		return;
+	if (write(pressure_fd, trig, strlen(trig) + 1) < 0)
+		goto out_fd;
+	if (pipe(pressure_pipe) < 0)
+		goto out_fd;
+	if (pthread_create(&pressure_thread, NULL, pressure_worker, NULL))
+		goto out_pipe;
+	return;
+
+out_pipe:
+	close(pressure_pipe[0]);
+	close(pressure_pipe[1]);
+	pressure_pipe[0] = pressure_pipe[1] = -1;
+out_fd:
+	close(pressure_fd);
+	pressure_fd = -1;
+}
+
+void
+mempressure_stop(void)
+{
+	if (pressure_pipe[1] < 0)
+		return;
+
+	if (write(pressure_pipe[1], "", 1) == 1)
+		pthread_join(pressure_thread, NULL);
+	close(pressure_pipe[0]);
+	close(pressure_pipe[1]);
+	close(pressure_fd);
+	pressure_pipe[0] = pressure_pipe[1] = -1;
+	pressure_fd = -1;
+}
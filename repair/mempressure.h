@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_REPAIR_MEMPRESSURE_H__
+#define __XFS_REPAIR_MEMPRESSURE_H__
+
+void mempressure_start(void);
+void mempressure_stop(void);
+
+#endif /* __XFS_REPAIR_MEMPRESSURE_H__ */
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "err_protos.h"
+#include "pftrace.h"
+
+/*
+ * Prefetch event tracing.
+ *
+ * When prefetch can't keep up, the processing threads end up reading inode
+ * clusters themselves, and it's hard to tell from the outside whether the
+ * queuing thread, the readers or the disk is to blame.  With "-o pf_trace"
+ * the prefetch code records what it is doing into a set of per-thread event
+ * rings that live in a shared mapping of the trace file.
+ *
+ * Each thread claims a ring the first time it records an event and from then
+ * on is the only writer, so recording an event is a clock read, a store into
+ * the ring and a release store of the head; no locks or atomics.  The rings
+ * wrap, keeping the most recent PFT_RING_EVENTS events of each thread.
+ * Because the file is mapped shared, the kernel writes it back by itself:
+ * it can be decoded while repair is running, or after it has been killed,
+ * with tools/xfs_pftrace.py.
+ */
+
+bool			pft_enabled;
+
+static struct pft_header	*pft_hdr;
+static size_t			pft_size;
+static uint64_t			pft_start_ns;
+static __thread struct pft_ring	*pft_ring;
+static __thread bool		pft_no_ring;
+
+#define PFT_RING_SIZE	(sizeof(struct pft_ring) + \
+			 PFT_RING_EVENTS * sizeof(struct pft_event))
+
+uint64_t
+pft_clock(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline struct pft_event *
+pft_ring_events(
+	struct pft_ring		*ring)
+{
+	return (struct pft_event *)(ring + 1);
+}
+
+void
+pft_setup(
+	const char		*path)
+{
+	struct timespec		ts;
+	int			fd;
+
+	pft_size = sizeof(struct pft_header) + PFT_MAX_RINGS * PFT_RING_SIZE;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		do_error(_("cannot create prefetch trace file %s: %s\n"),
+			path, strerror(errno));
+
+	/* The file is sparse; only the rings that get used take up space. */
+	if (ftruncate(fd, pft_size))
+		do_error(_("cannot size prefetch trace file %s: %s\n"),
+			path, strerror(errno));
+
+	pft_hdr = mmap(NULL, pft_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (pft_hdr == MAP_FAILED)
+		do_error(_("cannot map prefetch trace file %s: %s\n"),
+			path, strerror(errno));
+	close(fd);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pft_start_ns = pft_clock();
+
+	memcpy(pft_hdr->magic, PFT_MAGIC, sizeof(pft_hdr->magic));
+	pft_hdr->version = PFT_VERSION;
+	pft_hdr->event_size = sizeof(struct pft_event);
+	pft_hdr->ring_events = PFT_RING_EVENTS;
+	pft_hdr->nr_rings = PFT_MAX_RINGS;
+	pft_hdr->start_time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	pft_enabled = true;
+}
+
+/* Give the calling thread a ring of its own, if there are any left. */
+static struct pft_ring *
+pft_claim_ring(void)
+{
+	struct pft_ring		*ring;
+	uint32_t		slot;
+
+	slot = uatomic_add_return(&pft_hdr->rings_used, 1) - 1;
+	if (slot >= PFT_MAX_RINGS) {
+		pft_no_ring = true;
+		return NULL;
+	}
+
+	ring = (struct pft_ring *)((char *)(pft_hdr + 1) +
+			(size_t)slot * PFT_RING_SIZE);
+	ring->tid = syscall(SYS_gettid);
+	pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+	pft_ring = ring;
+	return ring;
+}
+
+void
+__pft_event(
+	enum pft_event_type	type,
+	uint32_t		agno,
+	uint64_t		daddr,
+	uint32_t		len,
+	uint32_t		arg,
+	uint16_t		flags)
+{
+	struct pft_ring		*ring = pft_ring;
+	struct pft_event	*ev;
+	uint64_t		head;
+
+	if (!ring) {
+		if (pft_no_ring)
+			return;
+		ring = pft_claim_ring();
+		if (!ring)
+			return;
+	}
+
+	head = ring->head;
+	ev = &pft_ring_events(ring)[head & (PFT_RING_EVENTS - 1)];
+	ev->ns = pft_clock() - pft_start_ns;
+	ev->type = type;
+	ev->flags = flags;
+	ev->agno = agno;
+	ev->daddr = daddr;
+	ev->len = len;
+	ev->arg = arg;
+
+	/* Publish the event to anyone decoding the file while we run. */
+	cmm_smp_wmb();
+	CMM_STORE_SHARED(ring->head, head + 1);
+}
+
+/* Mark the trace complete and push it out to the file. */
+void
+pft_finish(void)
+{
+	if (!pft_enabled)
+		return;
+
+	pft_enabled = false;
+	pft_hdr->finished = 1;
+	if (msync(pft_hdr, pft_size, MS_SYNC))
+		do_warn(_("cannot write prefetch trace file: %s\n"),
+			strerror(errno));
+	munmap(pft_hdr, pft_size);
+	pft_hdr = NULL;
+}
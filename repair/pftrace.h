@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_REPAIR_PFTRACE_H__
+#define __XFS_REPAIR_PFTRACE_H__
+
+/*
+ * Binary prefetch event tracing.  The layout of the trace file is shared
+ * with tools/xfs_pftrace.py, so bump PFT_VERSION if any of this changes.
+ */
+#define PFT_MAGIC		"XFSPFTR1"
+#define PFT_VERSION		1
+#define PFT_MAX_RINGS		256
+#define PFT_RING_EVENTS		8192	/* must be a power of two */
+
+enum pft_event_type {
+	PFT_QUEUE = 1,		/* buffer added to the I/O queue */
+	PFT_QUEUE_CACHED,	/* buffer already in the cache, not queued */
+	PFT_QUEUE_STALL,	/* queuing thread waited for readahead room */
+	PFT_IO_ISSUE,		/* prefetch read sent to the disk */
+	PFT_IO_DONE,		/* prefetch read finished */
+	PFT_PROC_WAIT,		/* processing waited for prefetch to start */
+	PFT_CACHE_MISS,		/* processing had to read an inode cluster */
+};
+
+/* Start of the trace file. */
+struct pft_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		event_size;
+	uint32_t		ring_events;
+	uint32_t		nr_rings;
+	uint32_t		rings_used;	/* may exceed nr_rings */
+	uint32_t		finished;
+	uint64_t		start_time;	/* CLOCK_REALTIME, in ns */
+	uint64_t		pad[3];
+};
+
+/* Each tracing thread gets a ring of events after its own header. */
+struct pft_ring {
+	uint64_t		head;		/* events ever written */
+	uint32_t		tid;
+	uint32_t		pad;
+	char			name[16];
+	uint64_t		pad2[4];
+};
+
+struct pft_event {
+	uint64_t		ns;		/* since start_time */
+	uint16_t		type;
+	uint16_t		flags;
+	uint32_t		agno;
+	uint64_t		daddr;
+	uint32_t		len;		/* bytes */
+	uint32_t		arg;		/* buffers or microseconds */
+};
+
+extern bool	pft_enabled;
+
+void pft_setup(const char *path);
+void pft_finish(void);
+void __pft_event(enum pft_event_type type, uint32_t agno, uint64_t daddr,
+		uint32_t len, uint32_t arg, uint16_t flags);
+uint64_t pft_clock(void);
+
+/* Tracing costs one predictable branch when it isn't turned on. */
+static inline void
+pft_event(
+	enum pft_event_type	type,
+	uint32_t		agno,
+	uint64_t		daddr,
+	uint32_t		len,
+	uint32_t		arg,
+	uint16_t		flags)
+{
+	if (pft_enabled)
+		__pft_event(type, agno, daddr, len, arg, flags);
+}
+
+/* Microseconds since @start, for the wait and latency events. */
+static inline uint32_t
+pft_usecs_since(
+	uint64_t		start)
+{
+	return min(UINT32_MAX, (pft_clock() - start) / 1000);
+}
+
+#endif /* __XFS_REPAIR_PFTRACE_H__ */
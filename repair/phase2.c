@@ -6,7 +6,6 @@
 
 #include "libxfs.h"
 #include "libxlog.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "protos.h"
@@ -14,12 +13,7 @@
 #include "incore.h"
 #include "progress.h"
 #include "scan.h"
-
-/* workaround craziness in the xlog routines */
-int xlog_recover_do_trans(struct xlog *log, struct xlog_recover *t, int p)
-{
-	return 0;
-}
+#include "log_replay.h"
 
 static void
 zero_log(
@@ -29,6 +23,7 @@ zero_log(
 	xfs_daddr_t		head_blk;
 	xfs_daddr_t		tail_blk;
 	struct xlog		*log = mp->m_log;
+	bool			replayed = false;
 
 	memset(log, 0, sizeof(struct xlog));
 	x.logBBsize = XFS_FSB_TO_BB(mp, mp->m_sb.sb_logblocks);
@@ -56,8 +51,8 @@ zero_log(
 	/*
 	 * Find the log head and tail and alert the user to the situation if the
 	 * log appears corrupted or contains data. In either case, we do not
-	 * proceed past this point unless the user explicitly requests to zap
-	 * the log.
+	 * proceed past this point unless the user explicitly requests to
+	 * replay or zap the log.
 	 */
 	error = xlog_find_tail(log, &head_blk, &tail_blk);
 	if (error) {
@@ -78,7 +73,10 @@ zero_log(
 				head_blk, tail_blk);
 		}
 		if (head_blk != tail_blk) {
-			if (!no_modify && zap_log) {
+			if (!no_modify && replay_log) {
+				log_replay(mp, head_blk, tail_blk);
+				replayed = true;
+			} else if (!no_modify && zap_log) {
 				do_warn(_(
 "ALERT: The filesystem has valuable metadata changes in a log which is being\n"
 "destroyed because the -L option was used.\n"));
@@ -91,8 +89,9 @@ zero_log(
 				do_warn(_(
 "ERROR: The filesystem has valuable metadata changes in a log which needs to\n"
 "be replayed.  Mount the filesystem to replay the log, and unmount it before\n"
-"re-running xfs_repair.  If you are unable to mount the filesystem, then use\n"
-"the -L option to destroy the log and attempt a repair.\n"
+"re-running xfs_repair, or use the -o replay_log option to have xfs_repair\n"
+"replay it.  If the log can't be replayed, then use the -L option to destroy\n"
+"the log and attempt a repair.\n"
 "Note that destroying the log may cause corruption -- please attempt a mount\n"
 "of the filesystem before doing this.\n"));
 				exit(2);
@@ -101,24 +100,29 @@ zero_log(
 	}
 
 	/*
-	 * Only clear the log when explicitly requested. Doing so is unnecessary
-	 * unless something is wrong. Further, this resets the current LSN of
-	 * the filesystem and creates more work for repair of v5 superblock
-	 * filesystems.
+	 * Only clear the log when explicitly requested or once it has been
+	 * replayed. Doing so is otherwise unnecessary unless something is
+	 * wrong. Further, zapping resets the current LSN of the filesystem and
+	 * creates more work for repair of v5 superblock filesystems, so a
+	 * replayed log is cleared in the cycle after the one it ended in.
 	 */
-	if (!no_modify && zap_log) {
+	if (!no_modify && (zap_log || replayed)) {
 		libxfs_log_clear(log->l_dev, NULL,
 			XFS_FSB_TO_DADDR(mp, mp->m_sb.sb_logstart),
 			(xfs_extlen_t)XFS_FSB_TO_BB(mp, mp->m_sb.sb_logblocks),
 			&mp->m_sb.sb_uuid,
 			xfs_has_logv2(mp) ? 2 : 1,
-			mp->m_sb.sb_logsunit, XLOG_FMT, XLOG_INIT_CYCLE, true);
+			mp->m_sb.sb_logsunit, XLOG_FMT,
+			replayed ? log->l_curr_cycle + 1 : XLOG_INIT_CYCLE,
+			true);
 
 		/* update the log data structure with new state */
 		error = xlog_find_tail(log, &head_blk, &tail_blk);
 		if (error || head_blk != tail_blk)
 			do_error(_("failed to clear log"));
 	}
+	if (replayed)
+		log_replay_done(mp);
 
 	/* And we are now magically complete! */
 	PROG_RPT_INC(prog_rpt_done[0], mp->m_sb.sb_logblocks);
@@ -231,13 +235,9 @@ upgrade_filesystem(
  */
 
 void
-phase2(
-	struct xfs_mount	*mp,
-	int			scan_threads)
+phase2_log(
+	struct xfs_mount	*mp)
 {
-	int			j;
-	ino_tree_node_t		*ino_rec;
-
 	/* now we can start using the buffer cache routines */
 	set_mp(mp);
 
@@ -257,6 +257,16 @@ phase2(
 	set_progress_msg(PROG_FMT_ZERO_LOG, (uint64_t)mp->m_sb.sb_logblocks);
 	zero_log(mp);
 	print_final_rpt();
+}
+
+/* Scan the AG headers and btrees; must come after phase2_log. */
+void
+phase2(
+	struct xfs_mount	*mp,
+	int			scan_threads)
+{
+	int			j;
+	ino_tree_node_t		*ino_rec;
 
 	do_log(_("        - scan filesystem freespace and inode maps...\n"));
 
@@ -7,7 +7,6 @@
 #include "libxfs.h"
 #include "threads.h"
 #include "prefetch.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -17,6 +16,7 @@
 #include "progress.h"
 #include "bmap.h"
 #include "threads.h"
+#include "incremental.h"
 
 static void
 process_agi_unlinked(
@@ -88,7 +88,9 @@ do_uncertain_aginodes(
 {
 	int			*count = arg;
 
-	*count = process_uncertain_aginodes(wq->wq_ctx, agno);
+	/* Inodes in AGs we aren't checking stay uncertain. */
+	if (!incremental_skip_ag(agno))
+		*count = process_uncertain_aginodes(wq->wq_ctx, agno);
 
 #ifdef XR_INODE_TRACE
 	fprintf(stderr,
@@ -162,8 +164,8 @@ phase3(
 
 		create_work_queue(&wq, mp, scan_threads);
 
-		for (i = 0; i < mp->m_sb.sb_agcount; i++)
-			queue_work(&wq, do_uncertain_aginodes, i, &counts[i]);
+		queue_work_per_ag(&wq, do_uncertain_aginodes,
+				mp->m_sb.sb_agcount, counts, sizeof(*counts));
 
 		destroy_work_queue(&wq);
 
@@ -7,7 +7,6 @@
 #include "libxfs.h"
 #include "threads.h"
 #include "prefetch.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -20,6 +19,7 @@
 #include "progress.h"
 #include "slab.h"
 #include "rmap.h"
+#include "incremental.h"
 
 bool collect_rmaps;
 
@@ -163,6 +163,9 @@ check_rmap_btrees(
 {
 	int		error;
 
+	if (incremental_skip_ag(agno))
+		return;
+
 	error = rmap_add_fixed_ag_rec(wq->wq_ctx, agno);
 	if (error)
 		do_error(
@@ -236,16 +239,25 @@ process_rmap_data(
 		return;
 
 	create_work_queue(&wq, mp, platform_nproc());
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		queue_work(&wq, check_rmap_btrees, i, NULL);
+	queue_work_per_ag(&wq, check_rmap_btrees, mp->m_sb.sb_agcount, NULL, 0);
 	destroy_work_queue(&wq);
 
 	if (!xfs_has_reflink(mp))
 		return;
 
+	/*
+	 * Blocks in the AGs we check can be shared with files in the AGs we
+	 * skipped, so we can't know their reference counts.
+	 */
+	if (incremental_partial()) {
+		do_log(
+_("        - skipping reference count checks of a partial check\n"));
+		return;
+	}
+
 	create_work_queue(&wq, mp, platform_nproc());
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		queue_work(&wq, compute_ag_refcounts, i, NULL);
+	queue_work_per_ag(&wq, compute_ag_refcounts, mp->m_sb.sb_agcount,
+			NULL, 0);
 	destroy_work_queue(&wq);
 
 	create_work_queue(&wq, mp, platform_nproc());
@@ -6,7 +6,6 @@
 
 #include "libxfs.h"
 #include "libfrog/bitmap.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -90,7 +89,7 @@ mk_incore_fstree(
 			if (in_extent)  {
 				/*
 				 * free extent ends here, add extent to the
-				 * 2 incore extent (avl-to-be-B+) trees
+				 * 2 incore extent lists
 				 */
 				in_extent = 0;
 #if defined(XR_BLD_FREE_TRACE) && defined(XR_BLD_ADD_EXTENT)
@@ -430,20 +429,165 @@ keep_fsinos(xfs_mount_t *mp)
 		set_inode_used(irec, i);
 }
 
-static void
-phase5_func(
-	struct xfs_mount	*mp,
-	struct xfs_perag	*pag,
-	struct bitmap		*lost_blocks)
-{
-	struct repair_ctx	sc = { .mp = mp, };
+/*
+ * Context for rebuilding one AG.  Once the blocks for the new btrees have been
+ * reserved, the free space, inode, rmap, and refcount btrees of an AG are
+ * loaded independently of each other, so each one is a separate work item.
+ * The bulk loader writes out a btree's blocks as soon as that btree is built,
+ * which overlaps with the construction of its siblings and of other AGs.
+ * Whichever builder finishes last writes the AG headers and cleans up.
+ */
+struct phase5_ag {
+	struct repair_ctx	sc;
+	struct xfs_perag	*pag;
+	struct bitmap		*lost_blocks;
+
+	/* Number of btree builders that haven't finished yet. */
+	unsigned int		builders;
+
 	struct bt_rebuild	btr_bno;
 	struct bt_rebuild	btr_cnt;
 	struct bt_rebuild	btr_ino;
 	struct bt_rebuild	btr_fino;
 	struct bt_rebuild	btr_rmap;
 	struct bt_rebuild	btr_refc;
-	xfs_agnumber_t		agno = pag->pag_agno;
+};
+
+/* Write the AG headers and tear down the rebuild context. */
+static void
+phase5_finish_ag(
+	struct phase5_ag	*actx)
+{
+	struct xfs_mount	*mp = actx->sc.mp;
+	xfs_agnumber_t		agno = actx->pag->pag_agno;
+
+#ifdef XR_BLD_FREE_TRACE
+	fprintf(stderr, "# of free blocks == %d/%d\n", actx->btr_bno.freeblks,
+			actx->btr_cnt.freeblks);
+#endif
+	ASSERT(actx->btr_bno.freeblks == actx->btr_cnt.freeblks);
+
+	if (xfs_has_rmapbt(mp))
+		sb_fdblocks_ag[agno] += actx->btr_rmap.newbt.afake.af_blocks - 1;
+
+	/*
+	 * set up agf and agfl
+	 */
+	build_agf_agfl(mp, agno, &actx->btr_bno, &actx->btr_cnt,
+			&actx->btr_rmap, &actx->btr_refc, actx->lost_blocks);
+
+	/* build the agi */
+	build_agi(mp, agno, &actx->btr_ino, &actx->btr_fino);
+
+	/*
+	 * tear down cursors
+	 */
+	finish_rebuild(mp, &actx->btr_bno, actx->lost_blocks);
+	finish_rebuild(mp, &actx->btr_cnt, actx->lost_blocks);
+	finish_rebuild(mp, &actx->btr_ino, actx->lost_blocks);
+	if (xfs_has_finobt(mp))
+		finish_rebuild(mp, &actx->btr_fino, actx->lost_blocks);
+	if (xfs_has_rmapbt(mp))
+		finish_rebuild(mp, &actx->btr_rmap, actx->lost_blocks);
+	if (xfs_has_reflink(mp))
+		finish_rebuild(mp, &actx->btr_refc, actx->lost_blocks);
+
+	/*
+	 * release the incore per-AG bno/bcnt trees so the extent nodes
+	 * can be recycled
+	 */
+	release_agbno_extent_tree(agno);
+	release_agbcnt_extent_tree(agno);
+	libxfs_perag_put(actx->pag);
+	free(actx);
+	PROG_RPT_INC(prog_rpt_done[agno], 1);
+}
+
+/* One of the AG's btrees is done; finish the AG if it was the last one. */
+static void
+phase5_builder_done(
+	struct phase5_ag	*actx)
+{
+	if (uatomic_sub_return(&actx->builders, 1) == 0)
+		phase5_finish_ag(actx);
+}
+
+static void
+phase5_build_freesp(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct phase5_ag	*actx = arg;
+	struct ag_usage_mark	mark;
+
+	ag_usage_begin(&mark);
+	build_freespace_btrees(&actx->sc, agno, &actx->btr_bno,
+			&actx->btr_cnt);
+	ag_usage_end(&mark, agno);
+	phase5_builder_done(actx);
+}
+
+static void
+phase5_build_inobt(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct phase5_ag	*actx = arg;
+	struct ag_usage_mark	mark;
+
+	ag_usage_begin(&mark);
+	build_inode_btrees(&actx->sc, agno, &actx->btr_ino, &actx->btr_fino);
+	ag_usage_end(&mark, agno);
+	phase5_builder_done(actx);
+}
+
+static void
+phase5_build_rmapbt(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct phase5_ag	*actx = arg;
+	struct ag_usage_mark	mark;
+
+	ag_usage_begin(&mark);
+	build_rmap_tree(&actx->sc, agno, &actx->btr_rmap);
+	ag_usage_end(&mark, agno);
+	phase5_builder_done(actx);
+}
+
+static void
+phase5_build_refcountbt(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct phase5_ag	*actx = arg;
+	struct ag_usage_mark	mark;
+
+	ag_usage_begin(&mark);
+	build_refcount_tree(&actx->sc, agno, &actx->btr_refc);
+	ag_usage_end(&mark, agno);
+	phase5_builder_done(actx);
+}
+
+/*
+ * Work out the new btree geometries for an AG and reserve their blocks, then
+ * hand the btrees off to be built.
+ */
+static void
+phase5_func(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct xfs_mount	*mp = wq->wq_ctx;
+	struct workqueue_work	work[4];
+	struct phase5_ag	*actx;
+	unsigned int		nr = 0;
+	unsigned int		i;
 	int			extra_blocks = 0;
 	uint			num_freeblocks;
 	xfs_agblock_t		num_extents;
@@ -451,6 +595,13 @@ phase5_func(
 	if (verbose)
 		do_log(_("        - agno = %d\n"), agno);
 
+	actx = calloc(1, sizeof(struct phase5_ag));
+	if (!actx)
+		do_error(_("cannot allocate AG %u rebuild context\n"), agno);
+	actx->sc.mp = mp;
+	actx->pag = libxfs_perag_get(mp, agno);
+	actx->lost_blocks = arg;
+
 	/*
 	 * build up incore bno and bcnt extent btrees
 	 */
@@ -474,12 +625,15 @@ _("unable to rebuild AG %u.  Not enough free space in on-disk AG.\n"),
 			agno);
 	}
 
-	init_ino_cursors(&sc, pag, num_freeblocks, &sb_icount_ag[agno],
-			&sb_ifree_ag[agno], &btr_ino, &btr_fino);
+	init_ino_cursors(&actx->sc, actx->pag, num_freeblocks,
+			&sb_icount_ag[agno], &sb_ifree_ag[agno],
+			&actx->btr_ino, &actx->btr_fino);
 
-	init_rmapbt_cursor(&sc, pag, num_freeblocks, &btr_rmap);
+	init_rmapbt_cursor(&actx->sc, actx->pag, num_freeblocks,
+			&actx->btr_rmap);
 
-	init_refc_cursor(&sc, pag, num_freeblocks, &btr_refc);
+	init_refc_cursor(&actx->sc, actx->pag, num_freeblocks,
+			&actx->btr_refc);
 
 	num_extents = count_bno_extents_blocks(agno, &num_freeblocks);
 	/*
@@ -507,8 +661,9 @@ _("unable to rebuild AG %u.  Not enough free space in on-disk AG.\n"),
 	/*
 	 * track blocks that we might really lose
 	 */
-	init_freespace_cursors(&sc, pag, num_freeblocks, &num_extents,
-			&extra_blocks, &btr_bno, &btr_cnt);
+	init_freespace_cursors(&actx->sc, actx->pag, num_freeblocks,
+			&num_extents, &extra_blocks, &actx->btr_bno,
+			&actx->btr_cnt);
 
 	/*
 	 * freespace btrees live in the "free space" but the filesystem treats
@@ -530,53 +685,26 @@ _("unable to rebuild AG %u.  Not enough free space in on-disk AG.\n"),
 	fprintf(stderr, "# of bcnt extents is %d\n", count_bcnt_extents(agno));
 #endif
 
-	build_freespace_btrees(&sc, agno, &btr_bno, &btr_cnt);
-
-#ifdef XR_BLD_FREE_TRACE
-	fprintf(stderr, "# of free blocks == %d/%d\n", btr_bno.freeblks,
-			btr_cnt.freeblks);
-#endif
-	ASSERT(btr_bno.freeblks == btr_cnt.freeblks);
-
-	if (xfs_has_rmapbt(mp)) {
-		build_rmap_tree(&sc, agno, &btr_rmap);
-		sb_fdblocks_ag[agno] += btr_rmap.newbt.afake.af_blocks - 1;
-	}
-
-	if (xfs_has_reflink(mp))
-		build_refcount_tree(&sc, agno, &btr_refc);
-
-	/*
-	 * set up agf and agfl
-	 */
-	build_agf_agfl(mp, agno, &btr_bno, &btr_cnt, &btr_rmap, &btr_refc,
-			lost_blocks);
-
-	build_inode_btrees(&sc, agno, &btr_ino, &btr_fino);
-
-	/* build the agi */
-	build_agi(mp, agno, &btr_ino, &btr_fino);
-
-	/*
-	 * tear down cursors
-	 */
-	finish_rebuild(mp, &btr_bno, lost_blocks);
-	finish_rebuild(mp, &btr_cnt, lost_blocks);
-	finish_rebuild(mp, &btr_ino, lost_blocks);
-	if (xfs_has_finobt(mp))
-		finish_rebuild(mp, &btr_fino, lost_blocks);
-	if (xfs_has_rmapbt(mp))
-		finish_rebuild(mp, &btr_rmap, lost_blocks);
-	if (xfs_has_reflink(mp))
-		finish_rebuild(mp, &btr_refc, lost_blocks);
-
 	/*
-	 * release the incore per-AG bno/bcnt trees so the extent nodes
-	 * can be recycled
+	 * All the space the new btrees need has been set aside, so nothing
+	 * they share changes from here on.  Build them all at once.
 	 */
-	release_agbno_extent_tree(agno);
-	release_agbcnt_extent_tree(agno);
-	PROG_RPT_INC(prog_rpt_done[agno], 1);
+	work[nr].function = phase5_build_freesp;
+	work[nr++].arg = actx;
+	work[nr].function = phase5_build_inobt;
+	work[nr++].arg = actx;
+	if (xfs_has_rmapbt(mp)) {
+		work[nr].function = phase5_build_rmapbt;
+		work[nr++].arg = actx;
+	}
+	if (xfs_has_reflink(mp)) {
+		work[nr].function = phase5_build_refcountbt;
+		work[nr++].arg = actx;
+	}
+	for (i = 0; i < nr; i++)
+		work[i].index = agno;
+	actx->builders = nr;
+	queue_work_batch(wq, work, nr);
 }
 
 /* Inject this unused space back into the filesystem. */
@@ -603,10 +731,12 @@ inject_lost_extent(
 }
 
 void
-phase5(xfs_mount_t *mp)
+phase5(
+	struct xfs_mount	*mp,
+	int			scan_threads)
 {
+	struct workqueue	wq;
 	struct bitmap		*lost_blocks = NULL;
-	struct xfs_perag	*pag;
 	xfs_agnumber_t		agno;
 	int			error;
 
@@ -653,8 +783,10 @@ phase5(xfs_mount_t *mp)
 	if (error)
 		do_error(_("cannot alloc lost block bitmap\n"));
 
-	for_each_perag(mp, agno, pag)
-		phase5_func(mp, pag, lost_blocks);
+	create_work_queue(&wq, mp, scan_threads);
+	queue_work_per_ag(&wq, phase5_func, mp->m_sb.sb_agcount, lost_blocks,
+			0);
+	destroy_work_queue(&wq);
 
 	print_final_rpt();
 
@@ -8,20 +8,24 @@
 #include "threads.h"
 #include "threads.h"
 #include "prefetch.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
 #include "dir2.h"
+#include "bmap.h"
+#include "da_util.h"
 #include "protos.h"
 #include "err_protos.h"
 #include "dinode.h"
 #include "progress.h"
 #include "versions.h"
+#include "slab.h"
 
 static struct cred		zerocr;
 static struct fsxattr 		zerofsx;
 static xfs_ino_t		orphanage_ino;
+static bool			orphanage_new;	/* made by mk_orphanage */
+static pthread_mutex_t		orphanage_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static struct xfs_name		xfs_name_dot = {(unsigned char *)".",
 						1,
@@ -39,6 +43,7 @@ typedef struct dotdot_update {
 } dotdot_update_t;
 
 static LIST_HEAD(dotdot_update_list);
+static pthread_mutex_t		dotdot_lock = PTHREAD_MUTEX_INITIALIZER;
 static int			dotdot_update;
 
 static void
@@ -58,7 +63,34 @@ add_dotdot_update(
 	dir->agno = agno;
 	dir->ino_offset = ino_offset;
 
+	/* directories in different AGs are checked concurrently */
+	pthread_mutex_lock(&dotdot_lock);
 	list_add(&dir->list, &dotdot_update_list);
+	pthread_mutex_unlock(&dotdot_lock);
+}
+
+/*
+ * The root directory scan picks the orphanage while other directories are
+ * being checked, and any of them may junk an entry pointing at it.
+ */
+static void
+orphanage_found(
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&orphanage_lock);
+	if (!orphanage_ino)
+		orphanage_ino = ino;
+	pthread_mutex_unlock(&orphanage_lock);
+}
+
+static void
+orphanage_junked(
+	xfs_ino_t		ino)
+{
+	pthread_mutex_lock(&orphanage_lock);
+	if (ino == orphanage_ino)
+		orphanage_ino = 0;
+	pthread_mutex_unlock(&orphanage_lock);
 }
 
 /*
@@ -67,7 +99,6 @@ add_dotdot_update(
  * duplicate checking and rebuilding step if required.
  */
 struct dir_hash_ent {
-	struct dir_hash_ent	*nextbyhash;	/* next in name bucket */
 	struct dir_hash_ent	*nextbyorder;	/* next in order added */
 	xfs_dahash_t		hashval;	/* hash value of name */
 	uint32_t		address;	/* offset of data entry */
@@ -78,18 +109,54 @@ struct dir_hash_ent {
 	unsigned char		namebuf[];
 };
 
+/*
+ * Names are looked up through an open addressed table with linear probing.
+ * Each slot carries the hash value so that a probe sequence only touches the
+ * entries themselves on a hash match.  Junked names are never indexed, and
+ * nothing is ever removed from the index, so we don't need tombstones.
+ *
+ * When the table fills up we double it, but rather than rehashing everything
+ * at once (which hurts with millions of entries) the old table is kept
+ * read-only and migrated a few slots at a time by every subsequent insert.
+ * Lookups probe both tables until the migration is done.
+ */
+struct dir_hash_slot {
+	xfs_dahash_t		hashval;
+	struct dir_hash_ent	*ent;		/* NULL if the slot is free */
+};
+
+struct dir_hash_index {
+	struct dir_hash_slot	*slots;
+	unsigned int		bits;		/* log2 of the number of slots */
+};
+
+/*
+ * Entries and their names are carved out of large chunks and only freed when
+ * the whole directory is done with.
+ */
+struct dir_hash_chunk {
+	struct dir_hash_chunk	*next;
+	size_t			used;
+	size_t			size;
+	char			buf[];
+};
+
 struct dir_hash_tab {
-	int			size;		/* size of hash tables */
+	struct dir_hash_index	cur;		/* name index */
+	struct dir_hash_index	old;		/* being migrated into cur */
+	unsigned int		old_next;	/* next old slot to migrate */
+	unsigned int		nr;		/* names in the index */
+	struct dir_hash_chunk	*chunks;	/* entry storage */
 	struct dir_hash_ent	*first;		/* ptr to first added entry */
 	struct dir_hash_ent	*last;		/* ptr to last added entry */
-	struct dir_hash_ent	**byhash;	/* ptr to name hash buckets */
 #define HT_UNSEEN		1
 	struct radix_tree_root	byaddr;
 };
 
-#define	DIR_HASH_TAB_SIZE(n)	\
-	(sizeof(struct dir_hash_tab) + (sizeof(struct dir_hash_ent *) * (n)))
-#define	DIR_HASH_FUNC(t,a)	((a) % (t)->size)
+#define DIR_HASH_MIN_BITS	4
+#define DIR_HASH_MAX_INIT_BITS	20	/* don't trust huge size estimates */
+#define DIR_HASH_MIGRATE_NR	16	/* old slots moved per insert */
+#define DIR_HASH_CHUNK_SIZE	(64 << 10)
 
 /*
  * Track the contents of the freespace table in a directory.
@@ -150,6 +217,188 @@ dir_read_buf(
 	return 0;
 }
 
+static inline unsigned int
+dir_hash_slot(
+	struct dir_hash_index	*idx,
+	xfs_dahash_t		hash)
+{
+	/* the top bits of a multiplicative hash are the well mixed ones */
+	return (uint32_t)(hash * 2654435761U) >> (32 - idx->bits);
+}
+
+static inline unsigned int
+dir_hash_mask(
+	struct dir_hash_index	*idx)
+{
+	return (1U << idx->bits) - 1;
+}
+
+static bool
+dir_hash_index_alloc(
+	struct dir_hash_index	*idx,
+	unsigned int		bits)
+{
+	idx->slots = calloc(1U << bits, sizeof(struct dir_hash_slot));
+	if (!idx->slots)
+		return false;
+	idx->bits = bits;
+	return true;
+}
+
+static struct dir_hash_ent *
+dir_hash_index_find(
+	struct dir_hash_index	*idx,
+	xfs_dahash_t		hash,
+	unsigned char		*name,
+	int			namelen)
+{
+	unsigned int		mask = dir_hash_mask(idx);
+	unsigned int		i = dir_hash_slot(idx, hash);
+	struct dir_hash_slot	*slot;
+
+	for (slot = &idx->slots[i]; slot->ent; slot = &idx->slots[i]) {
+		if (slot->hashval == hash && slot->ent->name.len == namelen &&
+		    memcmp(slot->ent->name.name, name, namelen) == 0)
+			return slot->ent;
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void
+dir_hash_index_insert(
+	struct dir_hash_index	*idx,
+	xfs_dahash_t		hash,
+	struct dir_hash_ent	*ent)
+{
+	unsigned int		mask = dir_hash_mask(idx);
+	unsigned int		i = dir_hash_slot(idx, hash);
+
+	while (idx->slots[i].ent)
+		i = (i + 1) & mask;
+	idx->slots[i].hashval = hash;
+	idx->slots[i].ent = ent;
+}
+
+/* Move up to @nr slots of the old index into the current one. */
+static void
+dir_hash_migrate(
+	struct dir_hash_tab	*hashtab,
+	unsigned int		nr)
+{
+	unsigned int		end = 1U << hashtab->old.bits;
+	struct dir_hash_slot	*slot;
+
+	if (!hashtab->old.slots)
+		return;
+
+	while (nr-- > 0 && hashtab->old_next < end) {
+		slot = &hashtab->old.slots[hashtab->old_next++];
+		if (slot->ent)
+			dir_hash_index_insert(&hashtab->cur, slot->hashval,
+					slot->ent);
+	}
+
+	if (hashtab->old_next == end) {
+		free(hashtab->old.slots);
+		hashtab->old.slots = NULL;
+	}
+}
+
+/*
+ * Make room for one more name.  We double the index once it is three quarters
+ * full; if we can't get the memory we keep going with longer probe sequences
+ * until the table is completely full.
+ */
+static void
+dir_hash_grow(
+	struct dir_hash_tab	*hashtab)
+{
+	struct dir_hash_index	next;
+	unsigned int		nr_slots = 1U << hashtab->cur.bits;
+
+	dir_hash_migrate(hashtab, DIR_HASH_MIGRATE_NR);
+
+	if (hashtab->nr + 1 <= nr_slots - nr_slots / 4)
+		return;
+
+	/*
+	 * The old index is always drained long before the current one fills
+	 * up, but finish it off just in case so only two are ever live.
+	 */
+	dir_hash_migrate(hashtab, UINT_MAX);
+
+	if (hashtab->cur.bits >= 31 ||
+	    !dir_hash_index_alloc(&next, hashtab->cur.bits + 1)) {
+		if (hashtab->nr + 1 < nr_slots)
+			return;
+		do_error(_("malloc failed in dir_hash_add (%zu bytes)\n"),
+			(size_t)nr_slots * 2 * sizeof(struct dir_hash_slot));
+	}
+
+	hashtab->old = hashtab->cur;
+	hashtab->old_next = 0;
+	hashtab->cur = next;
+	dir_hash_migrate(hashtab, DIR_HASH_MIGRATE_NR);
+}
+
+static struct dir_hash_ent *
+dir_hash_find(
+	struct dir_hash_tab	*hashtab,
+	xfs_dahash_t		hash,
+	unsigned char		*name,
+	int			namelen)
+{
+	struct dir_hash_ent	*p;
+
+	p = dir_hash_index_find(&hashtab->cur, hash, name, namelen);
+	if (!p && hashtab->old.slots)
+		p = dir_hash_index_find(&hashtab->old, hash, name, namelen);
+	return p;
+}
+
+/* Carve a zeroed entry with room for the name out of the entry storage. */
+static struct dir_hash_ent *
+dir_hash_alloc_ent(
+	struct dir_hash_tab	*hashtab,
+	int			namelen)
+{
+	struct dir_hash_chunk	*chunk = hashtab->chunks;
+	size_t			len;
+	void			*p;
+
+	len = roundup(sizeof(struct dir_hash_ent) + namelen + 1,
+			sizeof(void *));
+	if (!chunk || chunk->size - chunk->used < len) {
+		chunk = malloc(DIR_HASH_CHUNK_SIZE);
+		if (!chunk)
+			do_error(
+		_("malloc failed in dir_hash_add (%u bytes)\n"),
+				DIR_HASH_CHUNK_SIZE);
+		chunk->next = hashtab->chunks;
+		chunk->used = 0;
+		chunk->size = DIR_HASH_CHUNK_SIZE -
+				offsetof(struct dir_hash_chunk, buf);
+		hashtab->chunks = chunk;
+	}
+
+	p = chunk->buf + chunk->used;
+	chunk->used += len;
+	memset(p, 0, len);
+	return p;
+}
+
+/* Give back the most recently allocated entry. */
+static void
+dir_hash_free_ent(
+	struct dir_hash_tab	*hashtab,
+	struct dir_hash_ent	*p)
+{
+	struct dir_hash_chunk	*chunk = hashtab->chunks;
+
+	chunk->used = (char *)p - chunk->buf;
+}
+
 /*
  * Returns 0 if the name already exists (ie. a duplicate)
  */
@@ -164,7 +413,6 @@ dir_hash_add(
 	uint8_t			ftype)
 {
 	xfs_dahash_t		hash = 0;
-	int			byhash = 0;
 	struct dir_hash_ent	*p;
 	int			dup;
 	short			junk;
@@ -180,35 +428,26 @@ dir_hash_add(
 
 	if (!junk) {
 		hash = libxfs_dir2_hashname(mp, &xname);
-		byhash = DIR_HASH_FUNC(hashtab, hash);
 
 		/*
-		 * search hash bucket for existing name.
+		 * search the name index for an existing name.
 		 */
-		for (p = hashtab->byhash[byhash]; p; p = p->nextbyhash) {
-			if (p->hashval == hash && p->name.len == namelen) {
-				if (memcmp(p->name.name, name, namelen) == 0) {
-					dup = 1;
-					junk = 1;
-					break;
-				}
-			}
+		if (dir_hash_find(hashtab, hash, name, namelen)) {
+			dup = 1;
+			junk = 1;
 		}
 	}
 
 	/*
-	 * Allocate enough space for the hash entry and the name in a single
-	 * allocation so we can store our own copy of the name for later use.
+	 * Allocate space for the hash entry and the name together so we can
+	 * store our own copy of the name for later use.
 	 */
-	p = calloc(1, sizeof(*p) + namelen + 1);
-	if (!p)
-		do_error(_("malloc failed in dir_hash_add (%zu bytes)\n"),
-			sizeof(*p));
+	p = dir_hash_alloc_ent(hashtab, namelen);
 
 	error = radix_tree_insert(&hashtab->byaddr, addr, p);
 	if (error == EEXIST) {
 		do_warn(_("duplicate addrs %u in directory!\n"), addr);
-		free(p);
+		dir_hash_free_ent(hashtab, p);
 		return 0;
 	}
 	radix_tree_tag_set(&hashtab->byaddr, addr, HT_UNSEEN);
@@ -222,8 +461,9 @@ dir_hash_add(
 
 	if (!(p->junkit = junk)) {
 		p->hashval = hash;
-		p->nextbyhash = hashtab->byhash[byhash];
-		hashtab->byhash[byhash] = p;
+		dir_hash_grow(hashtab);
+		dir_hash_index_insert(&hashtab->cur, hash, p);
+		hashtab->nr++;
 	}
 	p->address = addr;
 	p->inum = inum;
@@ -289,17 +529,18 @@ static void
 dir_hash_done(
 	struct dir_hash_tab	*hashtab)
 {
-	int			i;
-	struct dir_hash_ent	*n;
+	struct dir_hash_chunk	*chunk;
 	struct dir_hash_ent	*p;
 
-	for (i = 0; i < hashtab->size; i++) {
-		for (p = hashtab->byhash[i]; p; p = n) {
-			n = p->nextbyhash;
-			radix_tree_delete(&hashtab->byaddr, p->address);
-			free(p);
-		}
+	for (p = hashtab->first; p; p = p->nextbyorder)
+		radix_tree_delete(&hashtab->byaddr, p->address);
+
+	while ((chunk = hashtab->chunks) != NULL) {
+		hashtab->chunks = chunk->next;
+		free(chunk);
 	}
+	free(hashtab->old.slots);
+	free(hashtab->cur.slots);
 	free(hashtab);
 }
 
@@ -309,35 +550,32 @@ dir_hash_done(
  * segment of the directory in bytes, so we don't really know exactly how many
  * entries are in it. Hence assume an entry size of around 64 bytes - that's a
  * name length of 40+ bytes so should cover a most situations with really large
- * directories.
+ * directories.  The index grows as needed if we guessed too small.
  */
 static struct dir_hash_tab *
 dir_hash_init(
 	xfs_fsize_t		size)
 {
-	struct dir_hash_tab	*hashtab = NULL;
-	int			hsize;
+	struct dir_hash_tab	*hashtab;
+	unsigned int		bits = DIR_HASH_MIN_BITS;
 
-	hsize = size / 64;
-	if (hsize < 16)
-		hsize = 16;
+	/* aim for an index that ends up no more than half full */
+	while (bits < DIR_HASH_MAX_INIT_BITS && (size / 64) * 2 > (1U << bits))
+		bits++;
+
+	hashtab = calloc(1, sizeof(struct dir_hash_tab));
+	if (!hashtab)
+		do_error(_("calloc failed in dir_hash_init\n"));
 
 	/*
-	 * Try to allocate as large a hash table as possible. Failure to
-	 * allocate isn't fatal, it will just result in slower performance as we
-	 * reduce the size of the table.
+	 * Try to allocate as large an index as possible. Failure to allocate
+	 * isn't fatal, the index will just be grown later.
 	 */
-	while (hsize >= 16) {
-		hashtab = calloc(DIR_HASH_TAB_SIZE(hsize), 1);
-		if (hashtab)
-			break;
-		hsize /= 2;
+	while (!dir_hash_index_alloc(&hashtab->cur, bits)) {
+		if (bits == DIR_HASH_MIN_BITS)
+			do_error(_("calloc failed in dir_hash_init\n"));
+		bits--;
 	}
-	if (!hashtab)
-		do_error(_("calloc failed in dir_hash_init\n"));
-	hashtab->size = hsize;
-	hashtab->byhash = (struct dir_hash_ent **)((char *)hashtab +
-		sizeof(struct dir_hash_tab));
 	INIT_RADIX_TREE(&hashtab->byaddr, 0);
 	return hashtab;
 }
@@ -1003,6 +1241,7 @@ mk_orphanage(xfs_mount_t *mp)
 	}
 	libxfs_irele(ip);
 	libxfs_irele(pip);
+	orphanage_new = true;
 
 	return(ino);
 }
@@ -1171,6 +1410,165 @@ mv_orphanage(
 	libxfs_irele(orphanage_ip);
 }
 
+/*
+ * Disconnected inodes that aren't directories are queued here and linked
+ * into the orphanage once the scan is done.  Doing them one at a time costs
+ * an iget of the orphanage, a transaction and an insert at a random spot in
+ * its hash order for each one, which runs to hours when a badly damaged
+ * filesystem has millions of orphans.  Sorted by name hash, the inserts all
+ * land at the end of the orphanage's leaf blocks.
+ */
+struct orphan {
+	xfs_dahash_t		hash;
+	xfs_ino_t		ino;
+};
+
+static struct xfs_slab		*orphans;
+
+/* Orphans linked into the orphanage per transaction. */
+#define ORPHAN_BATCH		128
+
+/* Longest name we give an orphan, "<ino>.<n>". */
+#define ORPHAN_NAMELEN		32
+
+static int
+orphan_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct orphan	*oa = a;
+	const struct orphan	*ob = b;
+
+	if (oa->hash != ob->hash)
+		return oa->hash < ob->hash ? -1 : 1;
+	if (oa->ino != ob->ino)
+		return oa->ino < ob->ino ? -1 : 1;
+	return 0;
+}
+
+static void
+queue_orphan(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino)
+{
+	struct orphan		o = { .ino = ino };
+	unsigned char		fname[ORPHAN_NAMELEN + 1];
+	struct xfs_name		xname = { .name = fname };
+
+	/* if we can't queue it, move it now */
+	if (!orphans && init_slab(&orphans, sizeof(struct orphan))) {
+		mv_orphanage(mp, ino, 0);
+		return;
+	}
+
+	xname.len = snprintf((char *)fname, sizeof(fname), "%llu",
+				(unsigned long long)ino);
+	o.hash = libxfs_dir2_hashname(mp, &xname);
+	if (slab_add(orphans, &o))
+		mv_orphanage(mp, ino, 0);
+}
+
+/*
+ * Link the queued orphans into the orphanage, ORPHAN_BATCH to a
+ * transaction.  Everything in an orphanage we made ourselves is named after
+ * its own inode number, so the names can't collide and we can skip the
+ * lookups.
+ */
+static void
+mv_orphans(
+	struct xfs_mount	*mp)
+{
+	struct xfs_inode	*ips[ORPHAN_BATCH];
+	struct xfs_slab_cursor	*cur;
+	struct xfs_inode	*orphanage_ip;
+	struct xfs_trans	*tp;
+	struct orphan		*o;
+	unsigned char		fname[ORPHAN_NAMELEN + 1];
+	struct xfs_name		xname = { .name = fname };
+	xfs_ino_t		entry_ino_num;
+	size_t			left;
+	int			nres;
+	int			incr;
+	int			nr;
+	int			i;
+	int			err;
+
+	if (!orphans)
+		return;
+	left = slab_count(orphans);
+	if (!left)
+		goto out_slab;
+
+	qsort_slab(orphans, orphan_cmp);
+	err = init_slab_cursor(orphans, NULL, &cur);
+	if (err)
+		do_error(_("couldn't walk the list of orphans (%d)\n"), err);
+
+	err = -libxfs_iget(mp, NULL, orphanage_ino, 0, &orphanage_ip);
+	if (err)
+		do_error(_("%d - couldn't iget orphanage inode\n"), err);
+
+	/* see mv_orphanage for why this is the remove reservation */
+	nres = XFS_DIRENTER_SPACE_RES(mp, ORPHAN_NAMELEN);
+	while (left > 0) {
+		nr = min(left, (size_t)ORPHAN_BATCH);
+		err = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_remove,
+					  nr * nres, 0, 0, &tp);
+		if (err == ENOSPC && nr > 1) {
+			nr = 1;
+			err = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_remove,
+						  nres, 0, 0, &tp);
+		}
+		if (err)
+			res_failed(err);
+
+		libxfs_trans_ijoin(tp, orphanage_ip, 0);
+		for (i = 0; i < nr; i++) {
+			o = pop_slab_cursor(cur);
+
+			xname.len = snprintf((char *)fname, sizeof(fname),
+					"%llu", (unsigned long long)o->ino);
+			incr = 0;
+			while (!orphanage_new &&
+			       libxfs_dir_lookup(tp, orphanage_ip, &xname,
+						 &entry_ino_num, NULL) == 0)
+				xname.len = snprintf((char *)fname,
+						sizeof(fname), "%llu.%d",
+						(unsigned long long)o->ino,
+						++incr);
+
+			err = -libxfs_iget(mp, NULL, o->ino, 0, &ips[i]);
+			if (err)
+				do_error(
+	_("%d - couldn't iget disconnected inode\n"), err);
+			xname.type = libxfs_mode_to_ftype(VFS_I(ips[i])->i_mode);
+			libxfs_trans_ijoin(tp, ips[i], 0);
+
+			err = -libxfs_dir_createname(tp, orphanage_ip, &xname,
+					o->ino, nres);
+			if (err)
+				do_error(
+	_("name create failed in %s (%d)\n"), ORPHANAGE, err);
+
+			set_nlink(VFS_I(ips[i]), 1);
+			libxfs_trans_log_inode(tp, ips[i], XFS_ILOG_CORE);
+		}
+
+		err = -libxfs_trans_commit(tp);
+		if (err)
+			do_error(
+	_("orphanage name create failed (%d)\n"), err);
+		for (i = 0; i < nr; i++)
+			libxfs_irele(ips[i]);
+		left -= nr;
+	}
+
+	libxfs_irele(orphanage_ip);
+	free_slab_cursor(&cur);
+out_slab:
+	free_slab(&orphans);
+}
+
 static int
 entry_junked(
 	const char 	*msg,
@@ -1234,6 +1632,24 @@ dir_binval(
  * lost+found on the next run
  */
 
+/* Names re-added to a directory per transaction when rebuilding it. */
+#define DIR_REBUILD_BATCH	64
+
+static int
+dir_hash_ent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct dir_hash_ent *pa = *(struct dir_hash_ent * const *)a;
+	const struct dir_hash_ent *pb = *(struct dir_hash_ent * const *)b;
+
+	if (pa->hashval != pb->hashval)
+		return pa->hashval < pb->hashval ? -1 : 1;
+	if (pa->address != pb->address)
+		return pa->address < pb->address ? -1 : 1;
+	return 0;
+}
+
 static void
 longform_dir2_rebuild(
 	struct xfs_mount	*mp,
@@ -1249,6 +1665,10 @@ longform_dir2_rebuild(
 	xfs_fileoff_t		lastblock;
 	struct xfs_inode	pip;
 	struct dir_hash_ent	*p;
+	struct dir_hash_ent	**ents = NULL;
+	size_t			nr = 0;
+	size_t			i, j;
+	size_t			batch;
 	int			done = 0;
 
 	/*
@@ -1319,29 +1739,59 @@ longform_dir2_rebuild(
 	if (ino == mp->m_sb.sb_rootino)
 		need_root_dotdot = 0;
 
-	/* go through the hash list and re-add the inodes */
+	/*
+	 * Re-add the names in hash order, a batch to a transaction.  Each
+	 * insert then goes at the end of the last leaf block, so the leaves
+	 * fill up front to back and only ever split at the end, instead of
+	 * all over the tree.
+	 */
+	for (p = hashtab->first; p; p = p->nextbyorder)
+		nr++;
+	if (!nr)
+		return;
+	ents = malloc(nr * sizeof(*ents));
+	if (!ents)
+		do_error(_("malloc failed in %s (%zu bytes)\n"), __func__,
+				nr * sizeof(*ents));
 
+	nr = 0;
 	for (p = hashtab->first; p; p = p->nextbyorder) {
-
 		if (p->name.name[0] == '/' || (p->name.name[0] == '.' &&
 				(p->name.len == 1 || (p->name.len == 2 &&
 						p->name.name[1] == '.'))))
 			continue;
+		ents[nr++] = p;
+	}
+	qsort(ents, nr, sizeof(*ents), dir_hash_ent_cmp);
 
-		nres = XFS_CREATE_SPACE_RES(mp, p->name.len);
+	for (i = 0; i < nr; i += batch) {
+		batch = min(nr - i, (size_t)DIR_REBUILD_BATCH);
+		nres = 0;
+		for (j = i; j < i + batch; j++)
+			nres += XFS_DIRENTER_SPACE_RES(mp, ents[j]->name.len);
 		error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_create,
 					    nres, 0, 0, &tp);
+		if (error == ENOSPC && batch > 1) {
+			batch = 1;
+			nres = XFS_DIRENTER_SPACE_RES(mp, ents[i]->name.len);
+			error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_create,
+						    nres, 0, 0, &tp);
+		}
 		if (error)
 			res_failed(error);
 
 		libxfs_trans_ijoin(tp, ip, 0);
 
-		error = -libxfs_dir_createname(tp, ip, &p->name, p->inum,
-						nres);
-		if (error) {
-			do_warn(
+		for (j = i; j < i + batch; j++) {
+			p = ents[j];
+			error = -libxfs_dir_createname(tp, ip, &p->name,
+					p->inum,
+					XFS_DIRENTER_SPACE_RES(mp, p->name.len));
+			if (error) {
+				do_warn(
 _("name create failed in ino %" PRIu64 " (%d)\n"), ino, error);
-			goto out_bmap_cancel;
+				goto out_bmap_cancel;
+			}
 		}
 
 		error = -libxfs_trans_commit(tp);
@@ -1350,10 +1800,12 @@ _("name create failed in ino %" PRIu64 " (%d)\n"), ino, error);
 _("name create failed (%d) during rebuild\n"), error);
 	}
 
+	free(ents);
 	return;
 
 out_bmap_cancel:
 	libxfs_trans_cancel(tp);
+	free(ents);
 	return;
 }
 
@@ -1688,8 +2140,7 @@ longform_dir2_entry_check_data(
 			 * if this is a dup, it will be picked up below,
 			 * otherwise, mark it as the orphanage for later.
 			 */
-			if (!orphanage_ino)
-				orphanage_ino = inum;
+			orphanage_found(inum);
 		}
 
 		/*
@@ -1704,8 +2155,7 @@ longform_dir2_entry_check_data(
 				dep->name[0] = '/';
 				libxfs_dir2_data_log_entry(&da, bp, dep);
 			}
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			orphanage_junked(inum);
 			continue;
 		}
 
@@ -1845,8 +2295,7 @@ _("entry \"%s\" in dir inode %" PRIu64 " inconsistent with .. value (%" PRIu64 "
 				fname, ip->i_ino, parent, inum);
 		}
 		if (junkit)  {
-			if (inum == orphanage_ino)
-				orphanage_ino = 0;
+			orphanage_junked(inum);
 			nbad++;
 			if (!no_modify)  {
 				dir_hash_junkit(hashtab, addr);
@@ -2202,6 +2651,33 @@ longform_dir2_check_node(
  * destroy the entry and create a new one with recovered name/inode pairs.
  * (ie. get libxfs to do all the grunt work)
  */
+/*
+ * Queue up the next window of a directory's data blocks from its incore
+ * extent list, so that they are read in disk order while we check the ones
+ * before them.
+ */
+static void
+longform_dir2_readahead(
+	struct xfs_inode	*ip,
+	struct da_ra		*ra)
+{
+	struct xfs_bmbt_irec	got;
+	struct xfs_iext_cursor	icur;
+	bool			done = false;
+
+	while (ra->next < ra->end) {
+		if (!libxfs_iext_lookup_extent(ip, &ip->i_df, ra->next, &icur,
+				&got)) {
+			done = true;
+			break;
+		}
+		if (!da_ra_extent(ra, got.br_startoff, got.br_startblock,
+				got.br_blockcount))
+			break;
+	}
+	da_ra_submit(ra, done, &xfs_dir3_data_buf_ops);
+}
+
 static void
 longform_dir2_entry_check(
 	struct xfs_mount	*mp,
@@ -2223,6 +2699,7 @@ longform_dir2_entry_check(
 	int			seeval;
 	int			fixit = 0;
 	struct xfs_da_args	args;
+	struct da_ra		ra;
 
 	*need_dot = 1;
 	freetab = malloc(FREETAB_SIZE(ip->i_disk_size / mp->m_dir_geo->blksize));
@@ -2244,6 +2721,7 @@ longform_dir2_entry_check(
 	args.geo = mp->m_dir_geo;
 	libxfs_dir2_isblock(&args, &isblock);
 	libxfs_dir2_isleaf(&args, &isleaf);
+	da_ra_init(&ra, mp, mp->m_dir_geo->leafblk);
 
 	/* check directory "data" blocks (ie. name/inode pairs) */
 	for (da_bno = 0, next_da_bno = 0;
@@ -2266,10 +2744,13 @@ longform_dir2_entry_check(
 			break;
 		}
 
-		if (isblock)
+		if (isblock) {
 			ops = &xfs_dir3_block_buf_ops;
-		else
+		} else {
 			ops = &xfs_dir3_data_buf_ops;
+			if (da_ra_due(&ra, da_bno))
+				longform_dir2_readahead(ip, &ra);
+		}
 
 		error = dir_read_buf(ip, da_bno, &bp, ops, &fixit);
 		if (error) {
@@ -2372,8 +2853,7 @@ shortform_dir2_junk(
 	int			next_len;
 	int			next_elen;
 
-	if (lino == orphanage_ino)
-		orphanage_ino = 0;
+	orphanage_junked(lino);
 
 	next_elen = libxfs_dir2_sf_entsize(mp, sfp, sfep->namelen);
 	next_sfep = libxfs_dir2_sf_nextentry(mp, sfp, sfep);
@@ -2602,8 +3082,7 @@ shortform_dir2_entry_check(
 			 * if this is a dup, it will be picked up below,
 			 * otherwise, mark it as the orphanage for later.
 			 */
-			if (!orphanage_ino)
-				orphanage_ino = lino;
+			orphanage_found(lino);
 		}
 		/*
 		 * check for duplicate names in directory.
@@ -3067,7 +3546,10 @@ check_for_orphaned_inodes(
 			if (!orphanage_ino)
 				orphanage_ino = mk_orphanage(mp);
 			do_warn(_("moving to %s\n"), ORPHANAGE);
-			mv_orphanage(mp, ino, inode_isadir(irec, i));
+			if (inode_isadir(irec, i))
+				mv_orphanage(mp, ino, 1);
+			else
+				queue_orphan(mp, ino);
 		} else  {
 			do_warn(_("would move to %s\n"), ORPHANAGE);
 		}
@@ -3116,8 +3598,15 @@ traverse_function(
 	 * per AG. This means we don't overwhelm the machine with hundreds of
 	 * threads when we start acting on lots of AGs at once. We just want
 	 * enough that we can keep multiple CPUs busy across multiple AGs.
+	 *
+	 * Without an AG stride we only walk one AG at a time, so let that
+	 * AG's directories use every CPU rather than checking them serially.
+	 * That's only safe if buffers are locked, which they aren't without
+	 * prefetch.
 	 */
-	workqueue_create_bound(&lwq, mp, ag_stride, 1000);
+	workqueue_create_bound(&lwq, mp,
+			ag_stride ? ag_stride :
+			(use_xfs_buf_lock ? platform_nproc() : 0), 1000);
 
 	for (irec = findfirst_inode_rec(agno); irec; irec = next_ino_rec(irec)) {
 		if (irec->ino_isa_dir == 0)
@@ -3178,6 +3667,7 @@ phase6(xfs_mount_t *mp)
 	memset(&zerocr, 0, sizeof(struct cred));
 	memset(&zerofsx, 0, sizeof(struct fsxattr));
 	orphanage_ino = 0;
+	orphanage_new = false;
 
 	do_log(_("Phase 6 - check inode connectivity...\n"));
 
@@ -3275,4 +3765,5 @@ _("        - resetting contents of realtime bitmap and summary inodes\n"));
 			irec = next_ino_rec(irec);
 		}
 	}
+	mv_orphans(mp);
 }
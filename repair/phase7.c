@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -17,21 +16,20 @@
 #include "threads.h"
 #include "quotacheck.h"
 
-static void
+/*
+ * Compare an inode's link count with the number of references we found and
+ * reset it in @tp if they differ.  Returns the inode if it was joined to the
+ * transaction; the caller must release it once the transaction is done.
+ */
+static struct xfs_inode *
 update_inode_nlinks(
-	xfs_mount_t 		*mp,
+	struct xfs_mount	*mp,
+	struct xfs_trans	*tp,
 	xfs_ino_t		ino,
 	uint32_t		nlinks)
 {
-	xfs_trans_t		*tp;
-	xfs_inode_t		*ip;
+	struct xfs_inode	*ip;
 	int			error;
-	int			dirty;
-	int			nres;
-
-	nres = no_modify ? 0 : 10;
-	error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_remove, nres, 0, 0, &tp);
-	ASSERT(error == 0);
 
 	error = -libxfs_iget(mp, tp, ino, 0, &ip);
 	if (error)  {
@@ -43,47 +41,109 @@ update_inode_nlinks(
 			do_warn(
 	_("couldn't map inode %" PRIu64 ", err = %d, can't compare link counts\n"),
 				ino, error);
-			return;
+			return NULL;
 		}
 	}
 
-	dirty = 0;
-
 	/* compare and set links if they differ.  */
-	if (VFS_I(ip)->i_nlink != nlinks) {
-		if (!no_modify) {
-			do_warn(
-	_("resetting inode %" PRIu64 " nlinks from %u to %u\n"),
-				ino, VFS_I(ip)->i_nlink, nlinks);
-			set_nlink(VFS_I(ip), nlinks);
-			dirty = 1;
-		} else {
-			do_warn(
+	if (VFS_I(ip)->i_nlink == nlinks) {
+		libxfs_irele(ip);
+		return NULL;
+	}
+
+	if (no_modify) {
+		do_warn(
 	_("would have reset inode %" PRIu64 " nlinks from %u to %u\n"),
-				ino, VFS_I(ip)->i_nlink, nlinks);
+			ino, VFS_I(ip)->i_nlink, nlinks);
+		libxfs_irele(ip);
+		return NULL;
+	}
+
+	do_warn(
+	_("resetting inode %" PRIu64 " nlinks from %u to %u\n"),
+		ino, VFS_I(ip)->i_nlink, nlinks);
+	set_nlink(VFS_I(ip), nlinks);
+	libxfs_trans_ijoin(tp, ip, 0);
+	libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
+	return ip;
+}
+
+/*
+ * Fix the link counts of every inode in a chunk that needs it.  The inodes of
+ * a chunk share their cluster buffers, so rather than paying for a
+ * transaction per inode, log all of them in a single transaction.
+ */
+static void
+update_chunk_nlinks(
+	struct xfs_mount	*mp,
+	xfs_agnumber_t		agno,
+	struct ino_tree_node	*irec)
+{
+	struct xfs_inode	*ips[XFS_INODES_PER_CHUNK];
+	struct xfs_trans	*tp = NULL;
+	xfs_ino_t		ino;
+	uint32_t		nrefs;
+	int			nr_ips = 0;
+	int			error;
+	int			j;
+
+	ino = XFS_AGINO_TO_INO(mp, agno, irec->ino_startnum);
+
+	for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
+		struct xfs_inode	*ip;
+
+		ASSERT(is_inode_confirmed(irec, j));
+
+		if (is_inode_free(irec, j))
+			continue;
+
+		ASSERT(no_modify || is_inode_reached(irec, j));
+
+		nrefs = num_inode_references(irec, j);
+		ASSERT(no_modify || nrefs > 0);
+
+		if (get_inode_disk_nlinks(irec, j) == nrefs)
+			continue;
+
+		if (!tp) {
+			error = -libxfs_trans_alloc(mp, &M_RES(mp)->tr_remove,
+					no_modify ? 0 : 10, 0, 0, &tp);
+			if (error)
+				do_error(
+	_("couldn't allocate transaction to reset link counts, err = %d\n"),
+					error);
 		}
+
+		ip = update_inode_nlinks(mp, tp, ino + j, nrefs);
+		if (ip)
+			ips[nr_ips++] = ip;
 	}
 
-	if (!dirty)  {
+	if (!tp)
+		return;
+
+	if (!nr_ips) {
 		libxfs_trans_cancel(tp);
-	} else  {
-		libxfs_trans_ijoin(tp, ip, 0);
-		libxfs_trans_log_inode(tp, ip, XFS_ILOG_CORE);
-		/*
-		 * no need to do a bmap finish since
-		 * we're not allocating anything
-		 */
-		ASSERT(error == 0);
-		error = -libxfs_trans_commit(tp);
-
-		ASSERT(error == 0);
+		return;
 	}
-	libxfs_irele(ip);
+
+	/*
+	 * no need to do a bmap finish since
+	 * we're not allocating anything
+	 */
+	error = -libxfs_trans_commit(tp);
+	if (error)
+		do_error(
+	_("couldn't commit link count changes for inode chunk %" PRIu64 ", err = %d\n"),
+			ino, error);
+
+	while (nr_ips > 0)
+		libxfs_irele(ips[--nr_ips]);
 }
 
 /*
- * for each ag, look at each inode 1 at a time. If the number of
- * links is bad, reset it, log the inode core, commit the transaction
+ * for each ag, look at each inode chunk. If the number of links of any inode
+ * is bad, reset it, log the inode cores, commit the transaction
  */
 static void
 do_link_updates(
@@ -93,29 +153,17 @@ do_link_updates(
 {
 	struct xfs_mount	*mp = wq->wq_ctx;
 	ino_tree_node_t		*irec;
+	xfs_ino_t		ino;
 	int			j;
-	uint32_t		nrefs;
 
 	for (irec = findfirst_inode_rec(agno); irec;
 	     irec = next_ino_rec(irec)) {
-		xfs_ino_t	ino;
+		update_chunk_nlinks(mp, agno, irec);
 
 		ino = XFS_AGINO_TO_INO(mp, agno, irec->ino_startnum);
-
 		for (j = 0; j < XFS_INODES_PER_CHUNK; j++)  {
-			ASSERT(is_inode_confirmed(irec, j));
-
-			if (is_inode_free(irec, j))
-				continue;
-
-			ASSERT(no_modify || is_inode_reached(irec, j));
-
-			nrefs = num_inode_references(irec, j);
-			ASSERT(no_modify || nrefs > 0);
-
-			if (get_inode_disk_nlinks(irec, j) != nrefs)
-				update_inode_nlinks(wq->wq_ctx, ino + j, nrefs);
-			quotacheck_adjust(mp, ino + j);
+			if (!is_inode_free(irec, j))
+				quotacheck_adjust(mp, ino + j);
 		}
 	}
 
@@ -128,7 +176,6 @@ phase7(
 	int			scan_threads)
 {
 	struct workqueue	wq;
-	int			agno;
 	int			ret;
 
 	if (!no_modify)
@@ -138,13 +185,12 @@ phase7(
 
 	set_progress_msg(PROGRESS_FMT_CORR_LINK, (uint64_t) glob_agcount);
 
-	ret = quotacheck_setup(mp);
+	ret = quotacheck_setup(mp, scan_threads);
 	if (ret)
 		do_error(_("unable to set up quotacheck, err=%d\n"), ret);
 	create_work_queue(&wq, mp, scan_threads);
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		queue_work(&wq, do_link_updates, agno, NULL);
+	queue_work_per_ag(&wq, do_link_updates, mp->m_sb.sb_agcount, NULL, 0);
 
 	destroy_work_queue(&wq);
 
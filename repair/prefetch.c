@@ -2,7 +2,7 @@
 
 #include "libxfs.h"
 #include <pthread.h>
-#include "avl.h"
+#include "libfrog/ioring.h"
 #include "btree.h"
 #include "globals.h"
 #include "agheader.h"
@@ -16,8 +16,10 @@
 #include "threads.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "pftrace.h"
 
 int do_prefetch = 1;
+unsigned int pf_ioring_depth;	/* zero means use the I/O threads */
 
 /*
  * Performs prefetching by priming the libxfs cache by using a dedicate thread
@@ -78,6 +80,200 @@ typedef enum pf_which {
 	PF_META_ONLY
 } pf_which_t;
 
+/*
+ * Prefetch self tuning.
+ *
+ * What works well on a disk array full of seeking spindles is terrible on a
+ * flash device and vice versa, so instead of fixed settings we measure how
+ * long every prefetch read takes and adapt two things as we go:
+ *
+ * The batch gap is how much unwanted data we're willing to read to join two
+ * nearby reads into one.  We fit read time against read size to get a fixed
+ * cost per read and a cost per byte; reading through a gap pays off as long
+ * as it's smaller than the number of bytes that cost as much as one read.
+ *
+ * The window is how many reads each AG may have in flight.  Every so often
+ * we compare the throughput of the device (while it had reads to do) with
+ * the last interval and keep stepping the window in the same direction if
+ * that helped, or turn around if it didn't.  If the buffer cache can't grow
+ * any more and is nearly full, prefetching harder only evicts buffers that
+ * haven't been used yet, so we back off.
+ */
+#define PF_TUNE_MIN_SAMPLES	16	/* before we trust the size/time fit */
+#define PF_TUNE_DECAY_SAMPLES	256	/* halve the history this often */
+#define PF_TUNE_INTERVAL	32	/* reads per window adjustment */
+
+static struct pf_tune {
+	pthread_mutex_t		lock;
+
+	/* exponentially decayed least squares sums of read size vs. time */
+	double			n, sx, sy, sxx, sxy;
+
+	/* throughput while the device was busy */
+	unsigned int		inflight;
+	uint64_t		busy_start;
+	uint64_t		busy_ns;
+	uint64_t		bytes;
+	unsigned int		nr_reads;
+	double			last_rate;
+
+	unsigned int		window;
+	unsigned int		max_window;
+	int			direction;
+} pf_tune = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.direction		= -1,
+};
+
+static inline uint64_t
+pf_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+pf_tune_init(
+	unsigned int		max_window)
+{
+	pthread_mutex_lock(&pf_tune.lock);
+	if (pf_tune.max_window != max_window) {
+		pf_tune.max_window = max_window;
+		pf_tune.window = max_window;
+	}
+	pthread_mutex_unlock(&pf_tune.lock);
+}
+
+static inline unsigned int
+pf_tune_window(void)
+{
+	return uatomic_read(&pf_tune.window);
+}
+
+/* A prefetch read is about to be issued; returns the start time. */
+static uint64_t
+pf_tune_start(void)
+{
+	uint64_t		now = pf_now();
+
+	pthread_mutex_lock(&pf_tune.lock);
+	if (pf_tune.inflight++ == 0)
+		pf_tune.busy_start = now;
+	pthread_mutex_unlock(&pf_tune.lock);
+	return now;
+}
+
+static bool
+pf_cache_pressure(void)
+{
+	struct cache		*cache = libxfs_bcache;
+
+	return cache_overflowed(cache) &&
+	       cache_node_count(cache) >=
+			uatomic_read(&cache->c_maxcount) / 8 * 7;
+}
+
+static void
+pf_tune_gap(void)
+{
+	struct pf_tune		*pt = &pf_tune;
+	double			var, a, b, gap;
+
+	var = pt->n * pt->sxx - pt->sx * pt->sx;
+	if (pt->n < PF_TUNE_MIN_SAMPLES || var <= 0)
+		return;
+	b = (pt->n * pt->sxy - pt->sx * pt->sy) / var;
+	a = (pt->sy - b * pt->sx) / pt->n;
+	if (a <= 0 || b <= 0)
+		return;
+
+	gap = a / b;
+	if (gap < mp->m_sb.sb_blocksize)
+		gap = mp->m_sb.sb_blocksize;
+	if (gap > pf_max_bytes)
+		gap = pf_max_bytes;
+	uatomic_set(&pf_batch_bytes, (int)gap);
+	uatomic_set(&pf_batch_fsbs, (int)gap >> (mp->m_sb.sb_blocklog + 1));
+}
+
+static void
+pf_tune_window_step(void)
+{
+	struct pf_tune		*pt = &pf_tune;
+	unsigned int		window = pt->window;
+	unsigned int		step;
+	double			rate;
+
+	if (!pt->busy_ns)
+		return;
+	rate = (double)pt->bytes / pt->busy_ns;
+
+	if (pf_cache_pressure()) {
+		window = max(window / 2, 1U);
+		pt->direction = -1;
+	} else {
+		if (rate < pt->last_rate * 1.05)
+			pt->direction = -pt->direction;
+		step = max(window / 4, 1U);
+		if (pt->direction > 0)
+			window = min(window + step, pt->max_window);
+		else
+			window = window > step ? window - step : 1;
+	}
+
+	if (window != pt->window)
+		pftrace("prefetch window %u -> %u (%.1f MB/s), gap %d",
+			pt->window, window, rate * 1000, pf_batch_bytes);
+	uatomic_set(&pt->window, window);
+	pt->last_rate = rate;
+	pt->bytes = 0;
+	pt->busy_ns = 0;
+	pt->nr_reads = 0;
+}
+
+/* A prefetch read of @len bytes issued at @start has finished. */
+static void
+pf_tune_done(
+	uint64_t		start,
+	size_t			len)
+{
+	struct pf_tune		*pt = &pf_tune;
+	uint64_t		now = pf_now();
+	double			x = len;
+	double			y = now - start;
+
+	pthread_mutex_lock(&pt->lock);
+	if (--pt->inflight == 0)
+		pt->busy_ns += now - pt->busy_start;
+
+	pt->n += 1;
+	pt->sx += x;
+	pt->sy += y;
+	pt->sxx += x * x;
+	pt->sxy += x * y;
+	if (pt->n >= PF_TUNE_DECAY_SAMPLES) {
+		pt->n /= 2;
+		pt->sx /= 2;
+		pt->sy /= 2;
+		pt->sxx /= 2;
+		pt->sxy /= 2;
+	}
+	pf_tune_gap();
+
+	pt->bytes += len;
+	if (++pt->nr_reads >= PF_TUNE_INTERVAL && !pt->inflight)
+		pf_tune_window_step();
+	else if (pt->nr_reads >= PF_TUNE_INTERVAL * 4) {
+		/* never idle; account the busy time so far and carry on */
+		pt->busy_ns += now - pt->busy_start;
+		pt->busy_start = now;
+		pf_tune_window_step();
+	}
+	pthread_mutex_unlock(&pt->lock);
+}
+
 
 static inline void
 pf_start_processing(
@@ -127,6 +323,8 @@ pf_queue_io(
 		return;
 
 	if (bp->b_flags & LIBXFS_B_UPTODATE) {
+		pft_event(PFT_QUEUE_CACHED, args->agno, map[0].bm_bn,
+				BBTOB(bp->b_length), 0, flag);
 		if (B_IS_INODE(flag))
 			pf_read_inode_dirs(args, bp);
 		libxfs_buf_set_priority(bp, libxfs_buf_priority(bp) +
@@ -151,6 +349,9 @@ pf_queue_io(
 		libxfs_buf_set_priority(bp, B_DIR_META_2);
 	}
 
+	pft_event(PFT_QUEUE, args->agno, map[0].bm_bn, BBTOB(bp->b_length),
+			args->inode_bufs_queued, flag);
+
 	pftrace("getbuf %c %p (%llu) in AG %d (fsbno = %lu) added to queue"
 		"(inode_bufs_queued = %d, last_bno = %lu)", B_IS_INODE(flag) ?
 		'I' : 'M', bp, (long long)xfs_buf_daddr(bp), args->agno, fsbno,
@@ -464,6 +665,37 @@ pf_read_inode_dirs(
 		libxfs_buf_set_priority(bp, B_DIR_INODE);
 }
 
+/*
+ * The contents of @bp have just been read in as part of an I/O of @num
+ * buffers; mark it up to date and pick up anything it points to.
+ */
+static void
+pf_read_done(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	struct xfs_buf		*bp,
+	unsigned int		num)
+{
+	bp->b_flags |= (LIBXFS_B_UPTODATE | LIBXFS_B_UNCHECKED);
+	if (B_IS_INODE(libxfs_buf_priority(bp)))
+		pf_read_inode_dirs(args, bp);
+	else if (which == PF_META_ONLY)
+		libxfs_buf_set_priority(bp, B_DIR_META_H);
+	else if (which == PF_PRIMARY && num == 1)
+		libxfs_buf_set_priority(bp, B_DIR_META_S);
+}
+
+static void
+pf_putbuf(
+	prefetch_args_t		*args,
+	struct xfs_buf		*bp)
+{
+	pftrace("putbuf %c %p (%llu) in AG %d",
+		B_IS_INODE(libxfs_buf_priority(bp)) ? 'I' : 'M',
+		bp, (long long)xfs_buf_daddr(bp), args->agno);
+	libxfs_buf_relse(bp);
+}
+
 /*
  * pf_batch_read must be called with the lock locked.
  */
@@ -481,6 +713,7 @@ pf_batch_read(
 	int			inode_bufs;
 	unsigned long		fsbno = 0;
 	unsigned long		max_fsbno;
+	uint64_t		start;
 	char			*pbuf;
 
 	for (;;) {
@@ -540,7 +773,8 @@ pf_batch_read(
 			for (i = 1; i < num; i++) {
 				next_off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i])) +
 						BBTOB(bplist[i]->b_length);
-				if (next_off - last_off > pf_batch_bytes)
+				if (next_off - last_off >
+						uatomic_read(&pf_batch_bytes))
 					break;
 				last_off = next_off;
 			}
@@ -560,7 +794,7 @@ pf_batch_read(
 			}
 			args->inode_bufs_queued -= inode_bufs;
 			if (inode_bufs && (first_off >> mp->m_sb.sb_blocklog) >
-					pf_batch_fsbs)
+					uatomic_read(&pf_batch_fsbs))
 				args->last_bno_read = (first_off >> mp->m_sb.sb_blocklog);
 		}
 #ifdef XR_PF_TRACE
@@ -575,7 +809,15 @@ pf_batch_read(
 		/*
 		 * now read the data and put into the xfs_but_t's
 		 */
+		pft_event(PFT_IO_ISSUE, args->agno, xfs_buf_daddr(bplist[0]),
+				last_off - first_off, num, which);
+		start = pf_tune_start();
 		len = pread(mp_fd, buf, (int)(last_off - first_off), first_off);
+		pf_tune_done(start, last_off - first_off);
+		pft_event(PFT_IO_DONE, args->agno, xfs_buf_daddr(bplist[0]),
+				len > 0 ? len : 0, pft_usecs_since(start), which);
+		if (len > 0)
+			libxfs_io_account(false, len);
 
 		/*
 		 * Check the last buffer on the list to see if we need to
@@ -602,27 +844,12 @@ pf_batch_read(
 				if (len < size)
 					break;
 				memcpy(bplist[i]->b_addr, pbuf, size);
-				bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
-						       LIBXFS_B_UNCHECKED);
 				len -= size;
-				if (B_IS_INODE(libxfs_buf_priority(bplist[i])))
-					pf_read_inode_dirs(args, bplist[i]);
-				else if (which == PF_META_ONLY)
-					libxfs_buf_set_priority(bplist[i],
-								B_DIR_META_H);
-				else if (which == PF_PRIMARY && num == 1)
-					libxfs_buf_set_priority(bplist[i],
-								B_DIR_META_S);
+				pf_read_done(args, which, bplist[i], num);
 			}
 		}
-		for (i = 0; i < num; i++) {
-			pftrace("putbuf %c %p (%llu) in AG %d",
-				B_IS_INODE(libxfs_buf_priority(bplist[i])) ?
-								      'I' : 'M',
-				bplist[i], (long long)xfs_buf_daddr(bplist[i]),
-				args->agno);
-			libxfs_buf_relse(bplist[i]);
-		}
+		for (i = 0; i < num; i++)
+			pf_putbuf(args, bplist[i]);
 		pthread_mutex_lock(&args->lock);
 		if (which != PF_SECONDARY) {
 			pftrace("inode_bufs_queued for AG %d = %d", args->agno,
@@ -668,10 +895,19 @@ pf_io_worker(
 		while (!args->can_start_reading && !args->queuing_done)
 			pthread_cond_wait(&args->start_reading, &args->lock);
 
+		/* Only as many threads as the window allows may read. */
+		if (args->nr_readers >= pf_tune_window()) {
+			pthread_cond_wait(&args->start_reading, &args->lock);
+			continue;
+		}
+
 		pftrace("starting prefetch I/O for AG %d", args->agno);
 
+		args->nr_readers++;
 		pf_batch_read(args, PF_PRIMARY, buf);
 		pf_batch_read(args, PF_SECONDARY, buf);
+		args->nr_readers--;
+		pthread_cond_broadcast(&args->start_reading);
 
 		pftrace("ran out of bufs to prefetch for AG %d", args->agno);
 
@@ -688,6 +924,383 @@ pf_io_worker(
 	return NULL;
 }
 
+#ifdef HAVE_IO_URING
+/*
+ * io_uring prefetch engine.
+ *
+ * The I/O threads can only keep as many reads in flight as there are
+ * threads, which on flash leaves most of the device's queue depth unused.
+ * Instead, a single thread per AG can keep up to pf_ioring_depth reads in
+ * flight through an io_uring.  Each read covers a run of nearby buffers and
+ * lands directly in the buffer memory, so there's no bounce buffer to copy
+ * out of; the gaps between buffers are read into a scratch buffer.
+ * Completions are processed as they arrive, which feeds directory blocks
+ * back to the I/O queue via pf_queue_io.
+ *
+ * Discontiguous buffers are rare, so we read them synchronously.
+ */
+#define PF_IORING_MAX_BUFS	16
+
+struct pf_ioring_req {
+	struct xfs_buf		*bplist[PF_IORING_MAX_BUFS];
+	struct iovec		iov[PF_IORING_MAX_BUFS * 2];
+	unsigned int		num;
+	unsigned int		nr_iov;
+	unsigned int		len;
+	uint64_t		start;
+	pf_which_t		which;
+	bool			busy;
+};
+
+/*
+ * Pull a run of nearby buffers off the I/O queue.  Must be called with the
+ * lock held.  Returns false if there was nothing to read.
+ */
+static bool
+pf_ioring_gather(
+	prefetch_args_t		*args,
+	pf_which_t		which,
+	struct pf_ioring_req	*req,
+	void			*gapbuf)
+{
+	struct xfs_buf		*bp;
+	unsigned long		fsbno = 0;
+	unsigned long		max_fsbno;
+	xfs_daddr_t		next_daddr = 0;
+	unsigned int		inode_bufs = 0;
+	unsigned int		gap;
+	unsigned int		i;
+
+	if (which == PF_SECONDARY) {
+		bp = btree_find(args->io_queue, 0, &fsbno);
+		max_fsbno = min(fsbno + pf_max_fsbs, args->last_bno_read);
+	} else {
+		bp = btree_find(args->io_queue, args->last_bno_read, &fsbno);
+		max_fsbno = fsbno + pf_max_fsbs;
+	}
+
+	req->num = 0;
+	req->nr_iov = 0;
+	req->len = 0;
+	req->which = which;
+	while (bp && req->num < PF_IORING_MAX_BUFS && fsbno < max_fsbno) {
+		if (which == PF_META_ONLY &&
+		    B_IS_INODE(libxfs_buf_priority(bp))) {
+			if (req->num)
+				break;
+			bp = btree_lookup_next(args->io_queue, &fsbno);
+			continue;
+		}
+
+		/* Discontiguous buffers are always read on their own. */
+		if (bp->b_flags & LIBXFS_B_DISCONTIG) {
+			if (!req->num)
+				req->bplist[req->num++] = bp;
+			break;
+		}
+
+		/* Read through small gaps rather than issue another read. */
+		if (req->num && xfs_buf_daddr(bp) != next_daddr) {
+			if (xfs_buf_daddr(bp) < next_daddr)
+				break;
+			gap = BBTOB(xfs_buf_daddr(bp) - next_daddr);
+			if (gap > uatomic_read(&pf_batch_bytes))
+				break;
+			req->iov[req->nr_iov].iov_base = gapbuf;
+			req->iov[req->nr_iov].iov_len = gap;
+			req->nr_iov++;
+			req->len += gap;
+		}
+
+		req->iov[req->nr_iov].iov_base = bp->b_addr;
+		req->iov[req->nr_iov].iov_len = BBTOB(bp->b_length);
+		req->nr_iov++;
+		req->len += BBTOB(bp->b_length);
+		req->bplist[req->num++] = bp;
+		next_daddr = xfs_buf_daddr(bp) + bp->b_length;
+		bp = btree_lookup_next(args->io_queue, &fsbno);
+	}
+	if (!req->num)
+		return false;
+
+	for (i = 0; i < req->num; i++) {
+		bp = req->bplist[i];
+		if (btree_delete(args->io_queue,
+				XFS_DADDR_TO_FSB(mp, xfs_buf_daddr(bp))) == NULL)
+			do_error(_("prefetch corruption\n"));
+		if (B_IS_INODE(libxfs_buf_priority(bp)))
+			inode_bufs++;
+	}
+
+	if (which == PF_PRIMARY) {
+		fsbno = XFS_DADDR_TO_FSB(mp, xfs_buf_daddr(req->bplist[0]));
+		args->inode_bufs_queued -= inode_bufs;
+		if (inode_bufs && fsbno > uatomic_read(&pf_batch_fsbs))
+			args->last_bno_read = fsbno;
+	}
+
+	pftrace("reading bbs %llu to %llu (%d bufs) from %s queue in AG %d (last_bno = %lu, inode_bufs = %d)",
+		(long long)xfs_buf_daddr(req->bplist[0]),
+		(long long)xfs_buf_daddr(req->bplist[req->num - 1]),
+		req->num, (which != PF_SECONDARY) ? "pri" : "sec",
+		args->agno, args->last_bno_read, args->inode_bufs_queued);
+	return true;
+}
+
+/*
+ * Pick the next I/O to issue.  If the processing threads are about to run
+ * out of inode buffers, favour the metadata they might be waiting for, just
+ * like pf_batch_read does.
+ */
+static bool
+pf_ioring_next(
+	prefetch_args_t		*args,
+	struct pf_ioring_req	*req,
+	void			*gapbuf)
+{
+	if (!args->queuing_done && args->inode_bufs_queued < IO_THRESHOLD) {
+		if (pf_ioring_gather(args, PF_META_ONLY, req, gapbuf) ||
+		    pf_ioring_gather(args, PF_SECONDARY, req, gapbuf))
+			return true;
+	}
+	return pf_ioring_gather(args, PF_PRIMARY, req, gapbuf) ||
+	       pf_ioring_gather(args, PF_SECONDARY, req, gapbuf);
+}
+
+/* Process a finished read.  Must be called without the lock held. */
+static void
+pf_ioring_done(
+	prefetch_args_t		*args,
+	struct pf_ioring_req	*req,
+	int			res)
+{
+	unsigned int		i;
+
+	if (req->nr_iov)
+		pf_tune_done(req->start, req->len);
+	pft_event(PFT_IO_DONE, args->agno, xfs_buf_daddr(req->bplist[0]),
+			res > 0 ? res : 0, pft_usecs_since(req->start),
+			req->which);
+
+	/* Prefetch errors don't matter; the buffer will be reread later. */
+	if (res == req->len) {
+		for (i = 0; i < req->num; i++)
+			pf_read_done(args, req->which, req->bplist[i],
+					req->num);
+	}
+	for (i = 0; i < req->num; i++)
+		pf_putbuf(args, req->bplist[i]);
+}
+
+/*
+ * Read everything that the queuing thread gives us through the ring.  If the
+ * ring stops working we return early and the caller finishes the AG with
+ * synchronous reads.
+ */
+static void
+pf_ioring_read(
+	prefetch_args_t		*args)
+{
+	struct ioring		*ring = args->ioring;
+	struct pf_ioring_req	*reqs;
+	struct pf_ioring_req	*req;
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	unsigned int		*free_reqs;
+	void			*gapbuf;
+	unsigned int		nr_free = pf_ioring_depth;
+	unsigned int		inflight = 0;
+	unsigned int		queued;
+	unsigned int		i;
+	int			error;
+
+	reqs = calloc(pf_ioring_depth, sizeof(struct pf_ioring_req));
+	free_reqs = calloc(pf_ioring_depth, sizeof(unsigned int));
+	gapbuf = memalign(libxfs_device_alignment(), pf_max_bytes);
+	if (!reqs || !free_reqs || !gapbuf)
+		goto out_free;
+	for (i = 0; i < pf_ioring_depth; i++)
+		free_reqs[i] = i;
+
+	pthread_mutex_lock(&args->lock);
+	for (;;) {
+		if (!inflight) {
+			pftrace("waiting to start prefetch I/O for AG %d",
+				args->agno);
+			while (!args->can_start_reading && !args->queuing_done)
+				pthread_cond_wait(&args->start_reading,
+						&args->lock);
+		}
+
+		/* Fill up the ring with as much I/O as the window allows. */
+		queued = 0;
+		while (nr_free && inflight + queued < pf_tune_window()) {
+			req = &reqs[free_reqs[nr_free - 1]];
+			if (!pf_ioring_next(args, req, gapbuf))
+				break;
+			nr_free--;
+			req->busy = true;
+
+			if (req->bplist[0]->b_flags & LIBXFS_B_DISCONTIG) {
+				pthread_mutex_unlock(&args->lock);
+				libxfs_readbufr_map(mp->m_ddev_targp,
+						req->bplist[0], 0);
+				req->bplist[0]->b_flags |= LIBXFS_B_UNCHECKED;
+				libxfs_buf_relse(req->bplist[0]);
+				pthread_mutex_lock(&args->lock);
+				req->busy = false;
+				free_reqs[nr_free++] = req - reqs;
+				continue;
+			}
+
+			sqe = ioring_get_sqe(ring);
+			ASSERT(sqe != NULL);
+			pft_event(PFT_IO_ISSUE, args->agno,
+					xfs_buf_daddr(req->bplist[0]),
+					req->len, req->num, req->which);
+			req->start = pf_tune_start();
+			if (req->nr_iov == 1)
+				ioring_prep_rw(sqe, IORING_OP_READ, mp_fd,
+						req->iov[0].iov_base,
+						req->iov[0].iov_len,
+						LIBXFS_BBTOOFF64(xfs_buf_daddr(
+							req->bplist[0])),
+						req - reqs);
+			else
+				ioring_prep_rw(sqe, IORING_OP_READV, mp_fd,
+						req->iov, req->nr_iov,
+						LIBXFS_BBTOOFF64(xfs_buf_daddr(
+							req->bplist[0])),
+						req - reqs);
+			queued++;
+		}
+
+		if (!inflight && !queued) {
+			if (args->queuing_done && btree_is_empty(args->io_queue))
+				break;
+			pftrace("ran out of bufs to prefetch for AG %d",
+				args->agno);
+			if (!args->queuing_done)
+				args->can_start_reading = 0;
+			continue;
+		}
+		pthread_mutex_unlock(&args->lock);
+
+		error = ioring_submit(ring, 1);
+		if (error < 0)
+			goto out_dead;
+		inflight += queued;
+
+		while ((cqe = ioring_peek_cqe(ring)) != NULL) {
+			req = &reqs[cqe->user_data];
+			pf_ioring_done(args, req, cqe->res);
+			ioring_cqe_seen(ring);
+			inflight--;
+			req->busy = false;
+			free_reqs[nr_free++] = req - reqs;
+		}
+
+		pthread_mutex_lock(&args->lock);
+	}
+	pthread_mutex_unlock(&args->lock);
+	goto out_free;
+
+out_dead:
+	/*
+	 * The ring is unusable.  Reap whatever the kernel has, drop the reads
+	 * that never made it, and let the caller read the rest of the AG.
+	 */
+	do_warn(_("prefetch io_uring submission failed: %s\n"),
+		strerror(-error));
+	inflight += queued;
+
+	/* The kernel never took these, so nothing can land in them. */
+	for (i = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	     i != *ring->sq_tail; i++) {
+		sqe = &ring->sqes[ring->sq_array[i & ring->sq_mask]];
+		req = &reqs[sqe->user_data];
+		pf_ioring_done(args, req, -EIO);
+		inflight--;
+		req->busy = false;
+	}
+
+	while (inflight && ioring_wait_cqe(ring, &cqe) == 0) {
+		req = &reqs[cqe->user_data];
+		pf_ioring_done(args, req, cqe->res);
+		ioring_cqe_seen(ring);
+		inflight--;
+		req->busy = false;
+	}
+
+	/* Anything left we couldn't wait for; give up on it too. */
+	for (i = 0; i < pf_ioring_depth; i++)
+		if (reqs[i].busy)
+			pf_ioring_done(args, &reqs[i], -EIO);
+out_free:
+	free(gapbuf);
+	free(free_reqs);
+	free(reqs);
+}
+
+/* Set up a ring for prefetching this AG, if the user asked for one. */
+static void
+pf_ioring_init(
+	prefetch_args_t		*args)
+{
+	static bool		warned;
+	struct ioring		*ring;
+	int			error;
+
+	if (!pf_ioring_depth)
+		return;
+
+	ring = malloc(sizeof(struct ioring));
+	if (!ring)
+		return;
+	error = ioring_init(ring, pf_ioring_depth, 0);
+	if (error) {
+		if (!warned) {
+			warned = true;
+			do_warn(
+	_("cannot set up io_uring for prefetch (%s), using I/O threads\n"),
+				strerror(-error));
+		}
+		free(ring);
+		return;
+	}
+	args->ioring = ring;
+}
+
+static void
+pf_ioring_free(
+	prefetch_args_t		*args)
+{
+	if (!args->ioring)
+		return;
+	ioring_free(args->ioring);
+	free(args->ioring);
+	args->ioring = NULL;
+}
+#else
+static inline void pf_ioring_read(prefetch_args_t *args) { }
+static inline void pf_ioring_init(prefetch_args_t *args) { }
+static inline void pf_ioring_free(prefetch_args_t *args) { }
+#endif /* HAVE_IO_URING */
+
+static void *
+pf_ioring_worker(
+	void			*param)
+{
+	prefetch_args_t		*args = param;
+
+	rcu_register_thread();
+	pf_ioring_read(args);
+	rcu_unregister_thread();
+
+	/* Anything left over means the ring died; finish things off. */
+	return pf_io_worker(args);
+}
+
 static int
 pf_create_prefetch_thread(
 	prefetch_args_t		*args);
@@ -732,9 +1345,17 @@ pf_queuing_worker(
 
 	cluster_mask = (1ULL << igeo->inodes_per_cluster) - 1;
 
+	pf_ioring_init(args);
+	pf_tune_init(args->ioring ? pf_ioring_depth : PF_THREAD_COUNT);
 	for (i = 0; i < PF_THREAD_COUNT; i++) {
+		/* one thread drives the whole ring */
+		if (args->ioring && i > 0) {
+			args->io_threads[i] = 0;
+			continue;
+		}
 		err = pthread_create(&args->io_threads[i], NULL,
-				pf_io_worker, args);
+				args->ioring ? pf_ioring_worker : pf_io_worker,
+				args);
 		if (err != 0) {
 			do_warn(_("failed to create prefetch thread: %s\n"),
 				strerror(err));
@@ -742,6 +1363,7 @@ pf_queuing_worker(
 				args->agno, strerror(err));
 			args->io_threads[i] = 0;
 			if (i == 0) {
+				pf_ioring_free(args);
 				pf_skip_prefetch_thread(args);
 				goto out;
 			}
@@ -783,9 +1405,14 @@ pf_queuing_worker(
 			 * Start processing as well, in case everything so
 			 * far was already prefetched and the queue is empty.
 			 */
+			uint64_t	start = pft_enabled ? pft_clock() : 0;
+
 			pf_start_io_workers(args);
 			pf_start_processing(args);
 			sem_wait(&args->ra_count);
+			if (start)
+				pft_event(PFT_QUEUE_STALL, args->agno, 0, 0,
+						pft_usecs_since(start), 0);
 		}
 
 		num_inos = 0;
@@ -829,6 +1456,7 @@ pf_queuing_worker(
 	for (i = 0; i < PF_THREAD_COUNT; i++)
 		if (args->io_threads[i])
 			pthread_join(args->io_threads[i], NULL);
+	pf_ioring_free(args);
 
 	pftrace("prefetch for AG %d finished", args->agno);
 
@@ -976,10 +1604,14 @@ prefetch_ag_range(
 	pf_args[start_ag & 1] = start_inode_prefetch(start_ag, dirs_only, NULL);
 	for (i = start_ag; i < end_ag; i++) {
 		/* Don't prefetch end_ag */
+		struct ag_usage_mark	mark;
+
 		if (i + 1 < end_ag)
 			pf_args[(~i) & 1] = start_inode_prefetch(i + 1,
 						dirs_only, pf_args[i & 1]);
+		ag_usage_begin(&mark);
 		func(work, i, pf_args[i & 1]);
+		ag_usage_end(&mark, i);
 	}
 }
 
@@ -1030,8 +1662,7 @@ do_inode_prefetch(
 	if (check_cache && !libxfs_bcache_overflowed()) {
 		queue.wq_ctx = mp;
 		create_work_queue(&queue, mp, platform_nproc());
-		for (i = 0; i < mp->m_sb.sb_agcount; i++)
-			queue_work(&queue, func, i, NULL);
+		queue_work_per_ag(&queue, func, mp->m_sb.sb_agcount, NULL, 0);
 		destroy_work_queue(&queue);
 		return;
 	}
@@ -1081,11 +1712,16 @@ void
 wait_for_inode_prefetch(
 	prefetch_args_t		*args)
 {
+	uint64_t		start;
+	uint64_t		trace_start;
+
 	if (args == NULL)
 		return;
 
 	pthread_mutex_lock(&args->lock);
 
+	start = ag_usage_clock();
+	trace_start = pft_enabled ? pft_clock() : 0;
 	while (!args->can_start_processing) {
 		pftrace("waiting to start processing AG %d", args->agno);
 
@@ -1094,6 +1730,11 @@ wait_for_inode_prefetch(
 	pftrace("can start processing AG %d", args->agno);
 
 	pthread_mutex_unlock(&args->lock);
+	if (start)
+		ag_usage_add_stall(args->agno, ag_usage_clock() - start);
+	if (trace_start)
+		pft_event(PFT_PROC_WAIT, args->agno, 0, 0,
+				pft_usecs_since(trace_start), 0);
 }
 
 void
@@ -7,8 +7,10 @@
 #include "incore.h"
 
 struct workqueue;
+struct ioring;
 
 extern int 	do_prefetch;
+extern unsigned int	pf_ioring_depth;
 
 #define PF_THREAD_COUNT	4
 
@@ -26,8 +28,10 @@ typedef struct prefetch_args {
 	volatile int		prefetch_done;
 	volatile int		queuing_done;
 	volatile int		inode_bufs_queued;
+	int			nr_readers;
 	volatile xfs_fsblock_t	last_bno_read;
 	sem_t			ra_count;
+	struct ioring		*ioring;
 	struct prefetch_args	*next_args;
 } prefetch_args_t;
 
@@ -5,12 +5,30 @@
 #include "progress.h"
 #include "err_protos.h"
 #include <signal.h>
+#include <sys/resource.h>
 
 #define ONEMINUTE  60
 #define ONEHOUR   (60*ONEMINUTE)
 #define ONEDAY    (24*ONEHOUR)
 #define ONEWEEK   (7*ONEDAY)
 
+static inline uint64_t
+ts_to_ns(
+	const struct timespec	*ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline uint64_t
+clock_ns(
+	clockid_t		clock)
+{
+	struct timespec		ts;
+
+	clock_gettime(clock, &ts);
+	return ts_to_ns(&ts);
+}
+
 static
 char *rpt_types[] = {
 #define TYPE_INODE 	0
@@ -92,22 +110,115 @@ typedef struct msg_block_s {
 	uint64_t	*total;
 	int		count;
 	int		interval;
+
+	/* when the current step started, and the I/O done by then */
+	uint64_t	start_ns;
+	uint64_t	start_bytes;
 } msg_block_t;
 static msg_block_t 	global_msgs;
 
+/*
+ * Throughput of the current progress step.  The rates are an exponentially
+ * weighted moving average of the rate over each reporting tick, so that the
+ * estimated completion time follows the repair speeding up or slowing down
+ * (say, when a phase runs out of cached metadata) without jumping around.
+ */
+struct progress_rate {
+	progress_rpt_t	*format;	/* step being measured */
+	uint64_t	last_ns;
+	uint64_t	last_done;
+	uint64_t	last_bytes;
+	bool		primed;
+	double		items;		/* smoothed items per second */
+	double		bytes;		/* smoothed bytes per second */
+};
+
+/* Weight of the newest sample in the smoothed rates. */
+#define PROG_RATE_WEIGHT	0.25
+
+/* Seconds between updates of the status file. */
+#define PROG_STATUS_INTERVAL	5
+
+/* Log progress to the console, or only keep the status file up to date? */
+static bool		progress_log;
+static char		*status_path;
+
+/* Resource usage of the whole process, sampled at the phase boundaries. */
+struct phase_usage {
+	uint64_t		wall_ns;
+	uint64_t		cpu_ns;
+	struct libxfs_io_stats	io;
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+};
+
+/* What the phase (or one AG of it) cost, for the machine readable report. */
+struct ag_usage {
+	uint64_t		wall_ns;
+	uint64_t		cpu_ns;
+	uint64_t		read_bytes;
+	uint64_t		write_bytes;
+	uint64_t		stall_ns;
+};
+
 typedef struct phase_times_s {
 	time_t		start;
 	time_t		end;
 	time_t		duration;
 	uint64_t	item_counts[4];
+
+	/* only sampled if a report file was asked for */
+	bool			started;
+	bool			ended;
+	struct phase_usage	start_usage;
+	struct phase_usage	end_usage;
+	uint64_t		stall_ns;
+	long			maxrss_kb;
+	unsigned long long	arena_bytes;
+	unsigned int		cache_max;
+	struct ag_usage		*ags;
 } phase_times_t;
 static phase_times_t phase_times[8];
 
+static char		*report_path;
+static bool		report_csv;
+static xfs_agnumber_t	report_agcount;
+
 static void *progress_rpt_thread(void *);
 static int current_phase;
 static int running;
 static uint64_t prog_rpt_total;
 
+/* Total bytes read and written so far. */
+static uint64_t
+progress_io_bytes(void)
+{
+	struct libxfs_io_stats	io;
+
+	libxfs_io_stats(&io, false);
+	return io.read_bytes + io.write_bytes;
+}
+
+/*
+ * Ask for the progress of the repair to be written to @path every few
+ * seconds, so that whoever started us can tell how far along we are.
+ */
+void
+progress_status_setup(
+	const char		*path)
+{
+	status_path = strdup(path);
+	if (!status_path)
+		do_error(_("cannot allocate status file name\n"));
+}
+
+/* Do we need the progress report thread at all? */
+bool
+progress_rpt_wanted(void)
+{
+	return (ag_stride && report_interval) || status_path;
+}
+
 void
 init_progress_rpt (void)
 {
@@ -122,6 +233,17 @@ init_progress_rpt (void)
 	}
 	bzero(prog_rpt_done, sizeof(uint64_t)*glob_agcount);
 
+	/*
+	 * The console reports need ag_stride, but the status file is updated
+	 * every few seconds regardless.  Tick at the status file rate and only
+	 * log every so many ticks in that case.
+	 */
+	progress_log = ag_stride && report_interval;
+	global_msgs.interval = report_interval;
+	if (status_path && (!progress_log ||
+			    report_interval > PROG_STATUS_INTERVAL))
+		global_msgs.interval = PROG_STATUS_INTERVAL;
+
 	/*
 	 *  Setup comm block, start the thread
 	 */
@@ -130,9 +252,10 @@ init_progress_rpt (void)
 	/* Make sure the format is set to the first phase and not NULL */
 	global_msgs.format = &progress_rpt_reports[PROG_FMT_ZERO_LOG];
 	global_msgs.count = glob_agcount;
-	global_msgs.interval = report_interval;
 	global_msgs.done   = prog_rpt_done;
 	global_msgs.total  = &prog_rpt_total;
+	global_msgs.start_ns = clock_ns(CLOCK_MONOTONIC);
+	global_msgs.start_bytes = progress_io_bytes();
 
 	if (pthread_create (&report_thread, NULL,
 		progress_rpt_thread, (void *)&global_msgs))
@@ -141,6 +264,74 @@ init_progress_rpt (void)
 	return;
 }
 
+/* Sum up the work done in the current step. */
+static uint64_t
+progress_sum(
+	msg_block_t		*msgp)
+{
+	uint64_t		sum = 0;
+	int			i;
+
+	for (i = 0; i < msgp->count; i++)
+		sum += msgp->done[i];
+	return sum;
+}
+
+/* Write the status file, replacing the old one atomically. */
+static void
+progress_status_write(
+	msg_block_t		*msgp,
+	const char		*state,
+	uint64_t		sum,
+	time_t			now,
+	const struct progress_rate *rate)
+{
+	char			*tmp;
+	FILE			*fp;
+	time_t			elapsed = now - phase_times[current_phase].start;
+	bool			have_total = msgp->format->format == FMT1;
+
+	if (asprintf(&tmp, "%s.tmp", status_path) < 0)
+		return;
+
+	fp = fopen(tmp, "w");
+	if (!fp)
+		goto out;
+
+	fprintf(fp, "{\n  \"state\": \"%s\",\n  \"updated\": %lld,\n"
+			"  \"phase\": %d,\n  \"step\": \"%s\",\n"
+			"  \"unit\": \"%s\",\n  \"done\": %" PRIu64 ",\n",
+			state, (long long)now, current_phase,
+			msgp->format->msg, *msgp->format->type, sum);
+	if (have_total)
+		fprintf(fp, "  \"total\": %" PRIu64 ",\n  \"percent\": %" PRIu64
+				",\n", *msgp->total,
+				*msgp->total ? sum * 100 / *msgp->total : 0);
+	else
+		fprintf(fp, "  \"total\": null,\n  \"percent\": null,\n");
+	fprintf(fp, "  \"elapsed_seconds\": %lld,\n",
+			(long long)(elapsed > 0 ? elapsed : 0));
+	if (rate->primed) {
+		fprintf(fp, "  \"items_per_second\": %.1f,\n"
+				"  \"bytes_per_second\": %.0f,\n",
+				rate->items, rate->bytes);
+		if (have_total && rate->items > 0 && *msgp->total >= sum)
+			fprintf(fp, "  \"eta_seconds\": %.0f\n}\n",
+				(*msgp->total - sum) / rate->items);
+		else
+			fprintf(fp, "  \"eta_seconds\": null\n}\n");
+	} else {
+		fprintf(fp, "  \"items_per_second\": null,\n"
+				"  \"bytes_per_second\": null,\n"
+				"  \"eta_seconds\": null\n}\n");
+	}
+
+	if (fclose(fp) || rename(tmp, status_path))
+		unlink(tmp);
+out:
+	free(tmp);
+}
+
 void
 stop_progress_rpt(void)
 {
@@ -153,15 +344,65 @@ stop_progress_rpt(void)
 	running = 0;
 	pthread_kill (report_thread, SIGHUP);
 	pthread_join (report_thread, NULL);
+
+	if (status_path) {
+		struct progress_rate	rate = { NULL };
+
+		progress_status_write(&global_msgs, "finished",
+				progress_sum(&global_msgs), time(NULL), &rate);
+	}
 	free(prog_rpt_done);
+	prog_rpt_done = NULL;
 	return;
 }
 
+/*
+ * Fold the work done since the last tick into the smoothed rates.  A new
+ * step is measured from when set_progress_msg switched to it.
+ */
+static void
+progress_rate_update(
+	struct progress_rate	*rate,
+	msg_block_t		*msgp,
+	uint64_t		sum)
+{
+	uint64_t		now_ns = clock_ns(CLOCK_MONOTONIC);
+	uint64_t		bytes = progress_io_bytes();
+	double			secs;
+	double			items_rate;
+	double			bytes_rate;
+
+	if (rate->format != msgp->format || sum < rate->last_done) {
+		rate->format = msgp->format;
+		rate->last_ns = msgp->start_ns;
+		rate->last_done = 0;
+		rate->last_bytes = msgp->start_bytes;
+		rate->primed = false;
+	}
+
+	if (now_ns <= rate->last_ns)
+		return;
+
+	secs = (now_ns - rate->last_ns) / 1e9;
+	items_rate = (sum - rate->last_done) / secs;
+	bytes_rate = (bytes - rate->last_bytes) / secs;
+	if (rate->primed) {
+		rate->items += PROG_RATE_WEIGHT * (items_rate - rate->items);
+		rate->bytes += PROG_RATE_WEIGHT * (bytes_rate - rate->bytes);
+	} else {
+		rate->items = items_rate;
+		rate->bytes = bytes_rate;
+		rate->primed = true;
+	}
+	rate->last_ns = now_ns;
+	rate->last_done = sum;
+	rate->last_bytes = bytes;
+}
+
 static void *
 progress_rpt_thread (void *p)
 {
 
-	int i;
 	int caught;
 	sigset_t sigs_to_catch;
 	struct tm *tmp;
@@ -169,10 +410,12 @@ progress_rpt_thread (void *p)
 	timer_t timerid;
 	struct itimerspec timespec;
 	char *msgbuf;
-	uint64_t *donep;
 	uint64_t sum;
 	msg_block_t *msgp = (msg_block_t *)p;
 	uint64_t percent;
+	struct progress_rate rate = { NULL };
+	unsigned int ticks = 0;
+	unsigned int log_ticks = 1;
 
 	/* It's possible to get here very early w/ no progress msg set */
 	if (!msgp->format)
@@ -184,6 +427,10 @@ progress_rpt_thread (void *p)
 	running = 1;
 	rcu_register_thread();
 
+	/* Only log every so often if we're ticking for the status file. */
+	if (progress_log && report_interval > msgp->interval)
+		log_ticks = report_interval / msgp->interval;
+
 	/*
 	 * Specify a repeating timer that fires each MSG_INTERVAL seconds.
 	 */
@@ -233,11 +480,14 @@ progress_rpt_thread (void *p)
 		 *  Sum the work
 		 */
 
-		sum = 0;
-		donep = msgp->done;
-		for (i = 0; i < msgp->count; i++) {
-			sum += *donep++;
-		}
+		sum = progress_sum(msgp);
+		progress_rate_update(&rate, msgp, sum);
+		if (status_path)
+			progress_status_write(msgp, "running", sum, now, &rate);
+
+		if (!progress_log || ++ticks < log_ticks)
+			goto next;
+		ticks = 0;
 
 		percent = 0;
 		switch(msgp->format->format) {
@@ -258,11 +508,28 @@ progress_rpt_thread (void *p)
 		}
 
 		do_log(_("%s"), msgbuf);
+		if (rate.primed)
+			do_log(
+	_("\t- %02d:%02d:%02d: Phase %d: %.1f %s per second, %.1f MiB/s of I/O\n"),
+				tmp->tm_hour, tmp->tm_min, tmp->tm_sec,
+				current_phase, rate.items,
+				*msgp->format->type, rate.bytes / 1048576);
 		elapsed = now - phase_times[current_phase].start;
 		if ((msgp->format->format == FMT1) && sum && elapsed &&
 			((current_phase == 3) ||
 			 (current_phase == 4) ||
 			 (current_phase == 7))) {
+			time_t	remaining;
+
+			/*
+			 * Project the completion time from the smoothed rate
+			 * if we have one, else from the average so far.
+			 */
+			if (rate.primed && rate.items > 0)
+				remaining = (*msgp->total - sum) / rate.items;
+			else
+				remaining = (*msgp->total - sum) * elapsed / sum;
+
 			/* for inode phase report % complete */
 			do_log(
 				_("\t- %02d:%02d:%02d: Phase %d: elapsed time %s - processed %d %s per minute\n"),
@@ -273,9 +540,9 @@ progress_rpt_thread (void *p)
 	_("\t- %02d:%02d:%02d: Phase %d: %" PRIu64 "%% done - estimated remaining time %s\n"),
 				tmp->tm_hour, tmp->tm_min, tmp->tm_sec,
 				current_phase, percent,
-				duration((int) ((*msgp->total - sum) * (elapsed)/sum), msgbuf));
+				duration((int)remaining, msgbuf));
 		}
-
+next:
 		if (pthread_mutex_unlock(&msgp->mutex) != 0) {
 			do_error(
 			_("progress_rpt: error unlock msg mutex\n"));
@@ -295,7 +562,7 @@ int
 set_progress_msg(int report, uint64_t total)
 {
 
-	if (!ag_stride)
+	if (!prog_rpt_done)
 		return (0);
 
 	if (pthread_mutex_lock(&global_msgs.mutex))
@@ -303,6 +570,8 @@ set_progress_msg(int report, uint64_t total)
 
 	prog_rpt_total = total;
 	global_msgs.format = &progress_rpt_reports[report];
+	global_msgs.start_ns = clock_ns(CLOCK_MONOTONIC);
+	global_msgs.start_bytes = progress_io_bytes();
 
 	/* reset all the accumulative totals */
 	if (prog_rpt_done)
@@ -325,7 +594,7 @@ print_final_rpt(void)
 	msg_block_t 	*msgp = &global_msgs;
 	char		msgbuf[DURATION_BUF_SIZE];
 
-	if (!ag_stride)
+	if (!prog_rpt_done)
 		return 0;
 
 	if (pthread_mutex_lock(&global_msgs.mutex))
@@ -346,7 +615,7 @@ print_final_rpt(void)
 		sum += *donep++;
 	}
 
-	if (report_interval) {
+	if (progress_log) {
 		switch(msgp->format->format) {
 		case FMT1:
 			sprintf (msgbuf, _(*msgp->format->fmt),
@@ -370,6 +639,48 @@ print_final_rpt(void)
 	return(sum);
 }
 
+static void
+sample_usage(
+	struct phase_usage	*usage)
+{
+	struct rusage		ru;
+
+	usage->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	getrusage(RUSAGE_SELF, &ru);
+	usage->cpu_ns = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+				1000000000ULL +
+			(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+	libxfs_io_stats(&usage->io, false);
+	if (libxfs_bcache)
+		cache_hit_stats(libxfs_bcache, &usage->cache_hits,
+				&usage->cache_misses);
+	else
+		usage->cache_hits = usage->cache_misses = 0;
+}
+
+static void
+sample_phase_start(
+	int			phase)
+{
+	phase_times[phase].started = true;
+	sample_usage(&phase_times[phase].start_usage);
+}
+
+static void
+sample_phase_end(
+	int			phase)
+{
+	phase_times_t		*pt = &phase_times[phase];
+	struct rusage		ru;
+
+	pt->ended = true;
+	sample_usage(&pt->end_usage);
+	getrusage(RUSAGE_SELF, &ru);
+	pt->maxrss_kb = ru.ru_maxrss;
+	pt->arena_bytes = libxfs_buf_arena_usage();
+	pt->cache_max = libxfs_bcache ? libxfs_bcache->c_max : 0;
+}
+
 static void
 timediff(int phase)
 {
@@ -389,8 +700,11 @@ timestamp(int end, int phase, char *buf)
 	time_t    now;
 	struct tm *tmp;
 
-	if (verbose > 1)
+	if (verbose > 1) {
 		cache_report(stderr, "libxfs_bcache", libxfs_bcache);
+		libxfs_bcache_stats_report(stderr);
+		libxfs_buf_arena_report(stderr);
+	}
 
 	now = time(NULL);
 
@@ -402,14 +716,24 @@ timestamp(int end, int phase, char *buf)
 		phase_times[0].end = now;
 		timediff(0);
 
+		if (report_path) {
+			sample_phase_end(phase);
+			if (phase)
+				sample_phase_end(0);
+		}
+
 		if (phase < 7) {
 			phase_times[phase+1].start = now;
 			current_phase = phase + 1;
+			if (report_path)
+				sample_phase_start(phase + 1);
 		}
 	}
 	else {
 		phase_times[phase].start = now;
 		current_phase = phase;
+		if (report_path)
+			sample_phase_start(phase);
 	}
 
 	if (buf) {
@@ -538,3 +862,311 @@ summary_report(void)
 	}
 	do_log(_("\nTotal run time: %s\n"), duration(phase_times[0].duration, msgbuf));
 }
+
+/*
+ * Machine readable per-phase and per-AG resource usage report.
+ *
+ * The phase numbers are sampled at the phase boundaries from process wide
+ * counters.  The AG numbers are charged by whichever thread processes the AG
+ * (see ag_usage_begin/end), so they only cover the I/O done by that thread;
+ * reads issued by the prefetch threads show up in the phase totals and as
+ * prefetch stall time in the AG that had to wait for them.
+ */
+void
+phase_report_setup(
+	const char		*path,
+	bool			csv)
+{
+	report_path = strdup(path);
+	if (!report_path)
+		do_error(_("cannot allocate report file name\n"));
+	report_csv = csv;
+}
+
+void
+phase_report_init(
+	xfs_agnumber_t		agcount)
+{
+	int			i;
+
+	if (!report_path)
+		return;
+
+	/* phase 1 only looks at the superblock */
+	for (i = 2; i < 8; i++) {
+		phase_times[i].ags = calloc(agcount, sizeof(struct ag_usage));
+		if (!phase_times[i].ags)
+			do_error(_("cannot allocate per-AG report counters\n"));
+	}
+	report_agcount = agcount;
+}
+
+bool
+phase_report_enabled(void)
+{
+	return report_agcount != 0;
+}
+
+void
+ag_usage_begin(
+	struct ag_usage_mark	*mark)
+{
+	if (!report_agcount)
+		return;
+
+	mark->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	mark->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	libxfs_io_stats(&mark->io, true);
+}
+
+void
+ag_usage_end(
+	struct ag_usage_mark	*mark,
+	xfs_agnumber_t		agno)
+{
+	struct libxfs_io_stats	io;
+	struct ag_usage		*agu;
+
+	if (!report_agcount || agno >= report_agcount)
+		return;
+
+	agu = &phase_times[current_phase].ags[agno];
+	libxfs_io_stats(&io, true);
+	uatomic_add(&agu->wall_ns, clock_ns(CLOCK_MONOTONIC) - mark->wall_ns);
+	uatomic_add(&agu->cpu_ns,
+			clock_ns(CLOCK_THREAD_CPUTIME_ID) - mark->cpu_ns);
+	uatomic_add(&agu->read_bytes, io.read_bytes - mark->io.read_bytes);
+	uatomic_add(&agu->write_bytes, io.write_bytes - mark->io.write_bytes);
+}
+
+/* Account time spent waiting for the prefetcher to release an AG. */
+void
+ag_usage_add_stall(
+	xfs_agnumber_t		agno,
+	uint64_t		ns)
+{
+	if (!report_agcount || agno >= report_agcount)
+		return;
+
+	uatomic_add(&phase_times[current_phase].ags[agno].stall_ns, ns);
+	uatomic_add(&phase_times[current_phase].stall_ns, ns);
+}
+
+uint64_t
+ag_usage_clock(void)
+{
+	if (!report_agcount)
+		return 0;
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+static inline double
+ns_to_sec(
+	uint64_t		ns)
+{
+	return (double)ns / 1000000000.0;
+}
+
+static const char *
+phase_state(
+	int			i)
+{
+	if (!phase_times[i].started || !phase_times[i].ended)
+		return "skipped";
+	if ((no_modify && i == 5) || (bad_ino_btree && (i == 6 || i == 7)))
+		return "skipped";
+	return "done";
+}
+
+static void
+report_phase_json(
+	FILE			*fp,
+	int			i)
+{
+	phase_times_t		*pt = &phase_times[i];
+	struct phase_usage	*s = &pt->start_usage;
+	struct phase_usage	*e = &pt->end_usage;
+	unsigned long long	hits, misses;
+	xfs_agnumber_t		agno;
+
+	fprintf(fp, "    {\n      \"phase\": %d,\n      \"state\": \"%s\"", i,
+			phase_state(i));
+	if (strcmp(phase_state(i), "done")) {
+		fprintf(fp, "\n    }");
+		return;
+	}
+	hits = e->cache_hits - s->cache_hits;
+	misses = e->cache_misses - s->cache_misses;
+	fprintf(fp, ",\n"
+"      \"wall_seconds\": %.6f,\n"
+"      \"cpu_seconds\": %.6f,\n"
+"      \"reads\": %" PRIu64 ",\n"
+"      \"read_bytes\": %" PRIu64 ",\n"
+"      \"writes\": %" PRIu64 ",\n"
+"      \"write_bytes\": %" PRIu64 ",\n"
+"      \"cache_hits\": %llu,\n"
+"      \"cache_misses\": %llu,\n"
+"      \"cache_hit_ratio\": %.4f,\n"
+"      \"prefetch_stall_seconds\": %.6f,\n"
+"      \"max_rss_kb\": %ld,\n"
+"      \"buf_arena_bytes\": %llu,\n"
+"      \"cache_max_entries\": %u",
+		ns_to_sec(e->wall_ns - s->wall_ns),
+		ns_to_sec(e->cpu_ns - s->cpu_ns),
+		e->io.reads - s->io.reads,
+		e->io.read_bytes - s->io.read_bytes,
+		e->io.writes - s->io.writes,
+		e->io.write_bytes - s->io.write_bytes,
+		hits, misses,
+		hits + misses ? (double)hits / (hits + misses) : 0.0,
+		ns_to_sec(pt->stall_ns),
+		pt->maxrss_kb, pt->arena_bytes, pt->cache_max);
+
+	if (!pt->ags) {
+		fprintf(fp, "\n    }");
+		return;
+	}
+
+	fprintf(fp, ",\n      \"ags\": [");
+	for (agno = 0; agno < report_agcount; agno++) {
+		struct ag_usage	*agu = &pt->ags[agno];
+
+		fprintf(fp, "%s\n        { \"agno\": %u, "
+"\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, "
+"\"read_bytes\": %" PRIu64 ", \"write_bytes\": %" PRIu64 ", "
+"\"prefetch_stall_seconds\": %.6f }",
+			agno ? "," : "", agno,
+			ns_to_sec(agu->wall_ns), ns_to_sec(agu->cpu_ns),
+			agu->read_bytes, agu->write_bytes,
+			ns_to_sec(agu->stall_ns));
+	}
+	fprintf(fp, "\n      ]\n    }");
+}
+
+/* Buffer cache traffic by metadata type and AG, over the whole run. */
+static void
+report_bcache_json(
+	FILE			*fp)
+{
+	struct libxfs_bcache_type_stats	*st;
+	unsigned int		i, nr;
+	xfs_agnumber_t		agno;
+
+	nr = libxfs_bcache_type_stats(NULL, 0);
+	st = calloc(nr, sizeof(*st));
+	if (!st)
+		nr = 0;
+	else
+		nr = min(nr, libxfs_bcache_type_stats(st, nr));
+
+	fprintf(fp, ",\n  \"buffer_types\": [");
+	for (i = 0; i < nr; i++)
+		fprintf(fp, "%s\n    { \"type\": \"%s\", \"hits\": %" PRIu64
+", \"misses\": %" PRIu64 ", \"evictions\": %" PRIu64
+", \"readahead\": %" PRIu64 ", \"readahead_wasted\": %" PRIu64 " }",
+			i ? "," : "", st[i].name, st[i].hits, st[i].misses,
+			st[i].evictions, st[i].ra_reads, st[i].ra_wasted);
+	fprintf(fp, "\n  ],\n  \"ag_reads\": [");
+	for (agno = 0; agno < report_agcount; agno++)
+		fprintf(fp, "%s%" PRIu64, agno ? ", " : "",
+				libxfs_bcache_ag_reads(agno));
+	fprintf(fp, "]");
+	free(st);
+}
+
+static void
+report_json(
+	FILE			*fp)
+{
+	int			i;
+
+	fprintf(fp, "{\n  \"program\": \"%s\",\n  \"version\": \"%s\",\n"
+			"  \"agcount\": %u,\n  \"phases\": [\n",
+			progname, VERSION, report_agcount);
+	for (i = 1; i < 8; i++) {
+		report_phase_json(fp, i);
+		fprintf(fp, "%s\n", i < 7 ? "," : "");
+	}
+	fprintf(fp, "  ],\n  \"total\":\n");
+	report_phase_json(fp, 0);
+	report_bcache_json(fp);
+	fprintf(fp, "\n}\n");
+}
+
+static void
+report_phase_csv(
+	FILE			*fp,
+	int			i)
+{
+	phase_times_t		*pt = &phase_times[i];
+	struct phase_usage	*s = &pt->start_usage;
+	struct phase_usage	*e = &pt->end_usage;
+	xfs_agnumber_t		agno;
+
+	if (strcmp(phase_state(i), "done")) {
+		fprintf(fp, "%d,,skipped,,,,,,,,,,,,\n", i);
+		return;
+	}
+	fprintf(fp, "%d,,done,%.6f,%.6f,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+			",%" PRIu64 ",%llu,%llu,%.6f,%ld,%llu,%u\n", i,
+		ns_to_sec(e->wall_ns - s->wall_ns),
+		ns_to_sec(e->cpu_ns - s->cpu_ns),
+		e->io.reads - s->io.reads,
+		e->io.read_bytes - s->io.read_bytes,
+		e->io.writes - s->io.writes,
+		e->io.write_bytes - s->io.write_bytes,
+		e->cache_hits - s->cache_hits,
+		e->cache_misses - s->cache_misses,
+		ns_to_sec(pt->stall_ns),
+		pt->maxrss_kb, pt->arena_bytes, pt->cache_max);
+
+	if (!pt->ags)
+		return;
+	for (agno = 0; agno < report_agcount; agno++) {
+		struct ag_usage	*agu = &pt->ags[agno];
+
+		fprintf(fp, "%d,%u,done,%.6f,%.6f,,%" PRIu64 ",,%" PRIu64
+				",,,%.6f,,,\n", i, agno,
+			ns_to_sec(agu->wall_ns), ns_to_sec(agu->cpu_ns),
+			agu->read_bytes, agu->write_bytes,
+			ns_to_sec(agu->stall_ns));
+	}
+}
+
+static void
+report_csv_file(
+	FILE			*fp)
+{
+	int			i;
+
+	fprintf(fp, "phase,agno,state,wall_seconds,cpu_seconds,reads,"
+"read_bytes,writes,write_bytes,cache_hits,cache_misses,"
+"prefetch_stall_seconds,max_rss_kb,buf_arena_bytes,cache_max_entries\n");
+	for (i = 1; i < 8; i++)
+		report_phase_csv(fp, i);
+	report_phase_csv(fp, 0);
+}
+
+/* Write out the report file, if one was asked for. */
+void
+phase_report_write(void)
+{
+	FILE			*fp;
+
+	if (!report_path)
+		return;
+
+	fp = fopen(report_path, "w");
+	if (!fp) {
+		do_warn(_("cannot create report file %s: %s\n"),
+				report_path, strerror(errno));
+		return;
+	}
+	if (report_csv)
+		report_csv_file(fp);
+	else
+		report_json(fp);
+	if (fclose(fp))
+		do_warn(_("error writing report file %s: %s\n"),
+				report_path, strerror(errno));
+}
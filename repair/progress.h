@@ -32,6 +32,8 @@
 
 #define	DURATION_BUF_SIZE	512
 
+extern void progress_status_setup(const char *path);
+extern bool progress_rpt_wanted(void);
 extern void init_progress_rpt(void);
 extern void stop_progress_rpt(void);
 extern void summary_report(void);
@@ -41,6 +43,26 @@ extern char *timestamp(int end, int phase, char *buf);
 extern char *duration(int val, char *buf);
 extern int do_parallel;
 
-#define	PROG_RPT_INC(a,b) if (ag_stride && prog_rpt_done) (a) += (b)
+/*
+ * Per-phase, per-AG resource usage report.  Wrap the processing of an AG in
+ * ag_usage_begin/end to charge its time and I/O to the AG in the current
+ * phase; all of these do nothing unless a report file was asked for.
+ */
+struct ag_usage_mark {
+	uint64_t		wall_ns;
+	uint64_t		cpu_ns;
+	struct libxfs_io_stats	io;
+};
+
+void phase_report_setup(const char *path, bool csv);
+void phase_report_init(xfs_agnumber_t agcount);
+bool phase_report_enabled(void);
+void phase_report_write(void);
+void ag_usage_begin(struct ag_usage_mark *mark);
+void ag_usage_end(struct ag_usage_mark *mark, xfs_agnumber_t agno);
+void ag_usage_add_stall(xfs_agnumber_t agno, uint64_t ns);
+uint64_t ag_usage_clock(void);
+
+#define	PROG_RPT_INC(a,b) if (prog_rpt_done) (a) += (b)
 
 #endif	/* _XFS_REPAIR_PROGRESS_RPT_H_ */
@@ -33,10 +33,11 @@ char	*err_string(int err_code);
 void	thread_init(void);
 
 void	phase1(struct xfs_mount *);
+void	phase2_log(struct xfs_mount *);
 void	phase2(struct xfs_mount *, int);
 void	phase3(struct xfs_mount *, int);
 void	phase4(struct xfs_mount *);
-void	phase5(struct xfs_mount *);
+void	phase5(struct xfs_mount *, int);
 void	phase6(struct xfs_mount *);
 void	phase7(struct xfs_mount *, int);
 
@@ -7,7 +7,7 @@
 #include "globals.h"
 #include "versions.h"
 #include "err_protos.h"
-#include "libfrog/avl64.h"
+#include "libfrog/ptvar.h"
 #include "quotacheck.h"
 
 /* Allow the xfs_repair caller to skip quotacheck entirely. */
@@ -34,20 +34,38 @@ quotacheck_results(void)
 	return chkd_flags;
 }
 
-/* Global incore dquot tree */
+/*
+ * Incore dquot usage records live in open-addressed hash tables keyed by
+ * quota id.  Each phase 7 worker thread accumulates into its own table, so
+ * the inode walk never contends on a lock; the per-thread tables are merged
+ * into a single table when we compare against the on-disk dquots.
+ */
+struct qc_rec {
+	xfs_dqid_t		id;
+	uint32_t		flags;
+	uint64_t		bcount;
+	uint64_t		rtbcount;
+	uint64_t		icount;
+};
+
+struct qc_hash {
+	struct qc_rec		*recs;
+	size_t			nr;
+	unsigned int		shift;
+};
+
+/* Global incore dquot accounting */
 struct qc_dquots {
-	pthread_mutex_t		lock;
-	struct avl64tree_desc	tree;
+	/* Per-thread struct qc_hash */
+	struct ptvar		*shards;
+
+	/* All the shards, merged when we're ready to verify. */
+	struct qc_hash		merged;
 
 	/* One of XFS_DQTYPE_USER/PROJ/GROUP */
 	xfs_dqtype_t		type;
 };
 
-#define qc_dquots_foreach(dquots, pos, n) \
-	for (pos = (dquots)->tree.avl_firstino, n = pos ? pos->avl_nextino : NULL; \
-			pos != NULL; \
-			pos = n, n = pos ? pos->avl_nextino : NULL)
-
 static struct qc_dquots *user_dquots;
 static struct qc_dquots *group_dquots;
 static struct qc_dquots *proj_dquots;
@@ -55,16 +73,14 @@ static struct qc_dquots *proj_dquots;
 /* This record was found in the on-disk dquot information. */
 #define QC_REC_ONDISK		(1U << 31)
 
-struct qc_rec {
-	struct avl64node	node;
-	pthread_mutex_t		lock;
+/* This hash table slot is in use. */
+#define QC_REC_USED		(1U << 30)
 
-	xfs_dqid_t		id;
-	uint32_t		flags;
-	uint64_t		bcount;
-	uint64_t		rtbcount;
-	uint64_t		icount;
-};
+/* Initial size of a hash table, in log2 of slots. */
+#define QC_HASH_MIN_SHIFT	8
+
+/* Number of dquot clusters to read ahead of the one we're checking. */
+#define QC_READAHEAD_CLUSTERS	16
 
 static const char *
 qflags_typestr(
@@ -79,59 +95,101 @@ qflags_typestr(
 	return NULL;
 }
 
-/* Operations for the avl64 tree. */
+static inline size_t
+qc_hash_slot(
+	const struct qc_hash	*hash,
+	xfs_dqid_t		id)
+{
+	return ((uint64_t)id * 0x9E3779B97F4A7C15ULL) >> (64 - hash->shift);
+}
 
-static uint64_t
-qc_avl_start(
-	struct avl64node	*node)
+/* Find the slot for a quota id, or the empty slot where it would go. */
+static struct qc_rec *
+qc_hash_lookup(
+	const struct qc_hash	*hash,
+	xfs_dqid_t		id)
 {
+	size_t			mask = (1ULL << hash->shift) - 1;
+	size_t			slot = qc_hash_slot(hash, id);
 	struct qc_rec		*qrec;
 
-	qrec = container_of(node, struct qc_rec, node);
-	return qrec->id;
+	for (;;) {
+		qrec = &hash->recs[slot];
+		if (!(qrec->flags & QC_REC_USED) || qrec->id == id)
+			return qrec;
+		slot = (slot + 1) & mask;
+	}
 }
 
-static uint64_t
-qc_avl_end(
-	struct avl64node	*node)
+/* Resize a hash table to 2^shift slots and rehash everything in it. */
+static int
+qc_hash_resize(
+	struct qc_hash		*hash,
+	unsigned int		shift)
 {
-	return qc_avl_start(node) + 1;
-}
+	struct qc_hash		old = *hash;
+	size_t			i;
 
-static struct avl64ops qc_cache_ops = {
-	.avl_start		= qc_avl_start,
-	.avl_end		= qc_avl_end,
-};
+	hash->recs = calloc(1ULL << shift, sizeof(struct qc_rec));
+	if (!hash->recs) {
+		*hash = old;
+		return ENOMEM;
+	}
+	hash->shift = shift;
+
+	if (!old.recs)
+		return 0;
+	for (i = 0; i < (1ULL << old.shift); i++) {
+		if (old.recs[i].flags & QC_REC_USED)
+			*qc_hash_lookup(hash, old.recs[i].id) = old.recs[i];
+	}
+	free(old.recs);
+	return 0;
+}
 
-/* Find a qc_rec in the incore cache, or allocate one if need be. */
+/* Find a qc_rec in a hash table, or insert one if need be. */
 static struct qc_rec *
-qc_rec_get(
-	struct qc_dquots	*dquots,
-	xfs_dqid_t		id,
-	bool			can_alloc)
+qc_hash_get(
+	struct qc_hash		*hash,
+	xfs_dqid_t		id)
 {
 	struct qc_rec		*qrec;
-	struct avl64node	*node;
-
-	pthread_mutex_lock(&dquots->lock);
-	node = avl64_find(&dquots->tree, id);
-	if (!node && can_alloc) {
-		qrec = calloc(sizeof(struct qc_rec), 1);
-		if (qrec) {
-			qrec->id = id;
-			node = avl64_insert(&dquots->tree, &qrec->node);
-			if (!node)
-				free(qrec);
-			else
-				pthread_mutex_init(&qrec->lock, NULL);
-		}
+
+	/* Keep the load factor under 3/4 so that probe chains stay short. */
+	if (!hash->recs || (hash->nr + 1) * 4 > (3ULL << hash->shift)) {
+		unsigned int	shift;
+
+		shift = hash->recs ? hash->shift + 1 : QC_HASH_MIN_SHIFT;
+		if (qc_hash_resize(hash, shift))
+			return NULL;
 	}
-	pthread_mutex_unlock(&dquots->lock);
 
-	return node ? container_of(node, struct qc_rec, node) : NULL;
+	qrec = qc_hash_lookup(hash, id);
+	if (!(qrec->flags & QC_REC_USED)) {
+		qrec->id = id;
+		qrec->flags = QC_REC_USED;
+		hash->nr++;
+	}
+	return qrec;
 }
 
-/* Bump up an incore dquot's counters. */
+/* Find a qc_rec in a hash table without inserting anything. */
+static struct qc_rec *
+qc_hash_find(
+	const struct qc_hash	*hash,
+	xfs_dqid_t		id)
+{
+	struct qc_rec		*qrec;
+
+	if (!hash->recs)
+		return NULL;
+	qrec = qc_hash_lookup(hash, id);
+	if (!(qrec->flags & QC_REC_USED))
+		return NULL;
+	return qrec;
+}
+
+/* Bump up an incore dquot's counters in this thread's shard. */
 static void
 qc_adjust(
 	struct qc_dquots	*dquots,
@@ -139,19 +197,22 @@ qc_adjust(
 	uint64_t		bcount,
 	uint64_t		rtbcount)
 {
-	struct qc_rec		*qrec = qc_rec_get(dquots, id, true);
+	struct qc_hash		*hash;
+	struct qc_rec		*qrec = NULL;
+	int			error;
 
+	hash = ptvar_get(dquots->shards, &error);
+	if (hash)
+		qrec = qc_hash_get(hash, id);
 	if (!qrec) {
 		do_warn(_("Ran out of memory while running quotacheck!\n"));
 		chkd_flags = 0;
 		return;
 	}
 
-	pthread_mutex_lock(&qrec->lock);
 	qrec->bcount += bcount;
 	qrec->rtbcount += rtbcount;
 	qrec->icount++;
-	pthread_mutex_unlock(&qrec->lock);
 }
 
 /* Count the realtime blocks allocated to a file. */
@@ -283,7 +344,7 @@ qc_check_dquot(
 	};
 	xfs_dqid_t		id = be32_to_cpu(ddq->d_id);
 
-	qrec = qc_rec_get(dquots, id, false);
+	qrec = qc_hash_find(&dquots->merged, id);
 	if (!qrec)
 		qrec = &empty;
 
@@ -335,10 +396,7 @@ qc_check_dquot(
 		chkd_flags = 0;
 	}
 
-	/*
-	 * Mark that we found the record on disk.  Skip locking here because
-	 * we're checking the dquots serially.
-	 */
+	/* Mark that we found the record on disk. */
 	qrec->flags |= QC_REC_ONDISK;
 }
 
@@ -354,18 +412,38 @@ qc_walk_dquot_extent(
 	struct xfs_dqblk	*dqb;
 	xfs_filblks_t		dqchunklen;
 	xfs_filblks_t		bno;
+	xfs_filblks_t		ra;
 	unsigned int		dqperchunk;
 	int			error = 0;
 
 	dqchunklen = XFS_FSB_TO_BB(mp, XFS_DQUOT_CLUSTER_SIZE_FSB);
 	dqperchunk = libxfs_calc_dquots_per_chunk(dqchunklen);
 
+	/*
+	 * Keep a window of dquot clusters in flight ahead of the one we're
+	 * checking so that the comparison doesn't wait on each read.
+	 */
+	for (ra = 0;
+	     ra < map->br_blockcount &&
+	     ra < QC_READAHEAD_CLUSTERS * XFS_DQUOT_CLUSTER_SIZE_FSB;
+	     ra += XFS_DQUOT_CLUSTER_SIZE_FSB)
+		libxfs_buf_readahead(mp->m_dev,
+				XFS_FSB_TO_DADDR(mp, map->br_startblock + ra),
+				dqchunklen, &xfs_dquot_buf_ops);
+
 	for (bno = 0;
 	     bno < map->br_blockcount;
 	     bno += XFS_DQUOT_CLUSTER_SIZE_FSB) {
 		unsigned int	dqnr;
 		uint64_t	dqid;
 
+		if (ra < map->br_blockcount) {
+			libxfs_buf_readahead(mp->m_dev,
+				XFS_FSB_TO_DADDR(mp, map->br_startblock + ra),
+				dqchunklen, &xfs_dquot_buf_ops);
+			ra += XFS_DQUOT_CLUSTER_SIZE_FSB;
+		}
+
 		error = -libxfs_buf_read(mp->m_dev,
 				XFS_FSB_TO_DADDR(mp, map->br_startblock + bno),
 				dqchunklen, 0, &bp, &xfs_dquot_buf_ops);
@@ -391,6 +469,98 @@ _("cannot read %s inode %"PRIu64", block %"PRIu64", disk block %"PRIu64", err=%d
 	return error;
 }
 
+/* Add one thread's usage counts to the merged table. */
+static int
+qc_merge_shard(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*foreach_arg)
+{
+	struct qc_hash		*shard = data;
+	struct qc_hash		*merged = foreach_arg;
+	size_t			i;
+
+	if (!shard->recs)
+		return 0;
+
+	for (i = 0; i < (1ULL << shard->shift); i++) {
+		struct qc_rec	*src = &shard->recs[i];
+		struct qc_rec	*qrec;
+
+		if (!(src->flags & QC_REC_USED))
+			continue;
+
+		qrec = qc_hash_get(merged, src->id);
+		if (!qrec)
+			return ENOMEM;
+		qrec->bcount += src->bcount;
+		qrec->rtbcount += src->rtbcount;
+		qrec->icount += src->icount;
+	}
+
+	free(shard->recs);
+	shard->recs = NULL;
+	shard->nr = 0;
+	return 0;
+}
+
+static int
+qc_rec_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct qc_rec	*ra = a;
+	const struct qc_rec	*rb = b;
+
+	if (ra->id < rb->id)
+		return -1;
+	return ra->id > rb->id;
+}
+
+/*
+ * We constructed incore dquots to account for every file we saw on disk, and
+ * then walked all on-disk dquots to compare.  Complain about incore dquots
+ * that weren't touched during the comparison, because that means something is
+ * missing from the dquot file.  This consumes the merged table, so report the
+ * stragglers in id order to keep the output stable.
+ */
+static void
+qc_report_missing(
+	struct qc_dquots	*dquots)
+{
+	struct qc_hash		*merged = &dquots->merged;
+	size_t			nr = 0;
+	size_t			i;
+
+	if (!merged->recs)
+		return;
+
+	for (i = 0; i < (1ULL << merged->shift); i++) {
+		struct qc_rec	*qrec = &merged->recs[i];
+
+		if ((qrec->flags & QC_REC_USED) &&
+		    !(qrec->flags & QC_REC_ONDISK))
+			merged->recs[nr++] = *qrec;
+	}
+	if (!nr)
+		goto out;
+
+	qsort(merged->recs, nr, sizeof(struct qc_rec), qc_rec_cmp);
+	for (i = 0; i < nr; i++) {
+		struct qc_rec	*qrec = &merged->recs[i];
+
+		do_warn(
+_("%s record for id %u not found on disk (bcount %"PRIu64" rtbcount %"PRIu64" icount %"PRIu64")\n"),
+			qflags_typestr(dquots->type), qrec->id,
+			qrec->bcount, qrec->rtbcount, qrec->icount);
+	}
+	chkd_flags = 0;
+out:
+	free(merged->recs);
+	merged->recs = NULL;
+	merged->nr = 0;
+}
+
 /* Check the incore quota counts with what's on disk. */
 void
 quotacheck_verify(
@@ -402,7 +572,6 @@ quotacheck_verify(
 	struct xfs_inode	*ip;
 	struct xfs_ifork	*ifp;
 	struct qc_dquots	*dquots = NULL;
-	struct avl64node	*node, *n;
 	xfs_ino_t		ino = NULLFSINO;
 	int			error;
 
@@ -429,6 +598,14 @@ quotacheck_verify(
 	if (!dquots || !chkd_flags)
 		return;
 
+	/* Fold every thread's usage counts into a single table. */
+	error = ptvar_foreach(dquots->shards, qc_merge_shard, &dquots->merged);
+	if (error) {
+		do_warn(_("Ran out of memory while running quotacheck!\n"));
+		chkd_flags = 0;
+		return;
+	}
+
 	error = -libxfs_iget(mp, NULL, ino, 0, &ip);
 	if (error) {
 		do_warn(
@@ -457,24 +634,7 @@ quotacheck_verify(
 		}
 	}
 
-	/*
-	 * We constructed incore dquots to account for every file we saw on
-	 * disk, and then walked all on-disk dquots to compare.  Complain about
-	 * incore dquots that weren't touched during the comparison, because
-	 * that means something is missing from the dquot file.
-	 */
-	qc_dquots_foreach(dquots, node, n) {
-		struct qc_rec	*qrec;
-
-		qrec = container_of(node, struct qc_rec, node);
-		if (!(qrec->flags & QC_REC_ONDISK)) {
-			do_warn(
-_("%s record for id %u not found on disk (bcount %"PRIu64" rtbcount %"PRIu64" icount %"PRIu64")\n"),
-				qflags_typestr(type), qrec->id,
-				qrec->bcount, qrec->rtbcount, qrec->icount);
-			chkd_flags = 0;
-		}
-	}
+	qc_report_missing(dquots);
 err:
 	libxfs_irele(ip);
 }
@@ -522,10 +682,11 @@ qc_has_quotafile(
 	return true;
 }
 
-/* Initialize an incore dquot tree. */
+/* Initialize incore dquot accounting with one shard per thread. */
 static struct qc_dquots *
 qc_dquots_init(
-	xfs_dqtype_t		type)
+	xfs_dqtype_t		type,
+	unsigned int		nr_threads)
 {
 	struct qc_dquots	*dquots;
 
@@ -533,19 +694,28 @@ qc_dquots_init(
 	if (!dquots)
 		return NULL;
 
+	if (ptvar_alloc(nr_threads, sizeof(struct qc_hash), &dquots->shards)) {
+		free(dquots);
+		return NULL;
+	}
 	dquots->type = type;
-	pthread_mutex_init(&dquots->lock, NULL);
-	avl64_init_tree(&dquots->tree, &qc_cache_ops);
 	return dquots;
 }
 
 /* Set up incore context for quota checks. */
 int
 quotacheck_setup(
-	struct xfs_mount	*mp)
+	struct xfs_mount	*mp,
+	unsigned int		nr_threads)
 {
 	chkd_flags = 0;
 
+	/*
+	 * Every phase 7 worker gets its own shard; with no workers the caller
+	 * does the work itself.
+	 */
+	nr_threads = max(nr_threads, 1U);
+
 	/*
 	 * If the superblock said quotas are disabled or was missing pointers
 	 * to any quota inodes, don't bother checking.
@@ -554,21 +724,21 @@ quotacheck_setup(
 		return 0;
 
 	if (qc_has_quotafile(mp, XFS_DQTYPE_USER)) {
-		user_dquots = qc_dquots_init(XFS_DQTYPE_USER);
+		user_dquots = qc_dquots_init(XFS_DQTYPE_USER, nr_threads);
 		if (!user_dquots)
 			goto err;
 		chkd_flags |= XFS_UQUOTA_CHKD;
 	}
 
 	if (qc_has_quotafile(mp, XFS_DQTYPE_GROUP)) {
-		group_dquots = qc_dquots_init(XFS_DQTYPE_GROUP);
+		group_dquots = qc_dquots_init(XFS_DQTYPE_GROUP, nr_threads);
 		if (!group_dquots)
 			goto err;
 		chkd_flags |= XFS_GQUOTA_CHKD;
 	}
 
 	if (qc_has_quotafile(mp, XFS_DQTYPE_PROJ)) {
-		proj_dquots = qc_dquots_init(XFS_DQTYPE_PROJ);
+		proj_dquots = qc_dquots_init(XFS_DQTYPE_PROJ, nr_threads);
 		if (!proj_dquots)
 			goto err;
 		chkd_flags |= XFS_PQUOTA_CHKD;
@@ -581,23 +751,31 @@ err:
 	return ENOMEM;
 }
 
+static int
+qc_free_shard(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*foreach_arg)
+{
+	struct qc_hash		*shard = data;
+
+	free(shard->recs);
+	return 0;
+}
+
 /* Purge all quotacheck records in a given cache. */
 static void
 qc_purge(
 	struct qc_dquots	**dquotsp)
 {
 	struct qc_dquots	*dquots = *dquotsp;
-	struct qc_rec		*qrec;
-	struct avl64node	*node;
-	struct avl64node	*n;
 
 	if (!dquots)
 		return;
 
-	qc_dquots_foreach(dquots, node, n) {
-		qrec = container_of(node, struct qc_rec, node);
-		free(qrec);
-	}
+	ptvar_foreach(dquots->shards, qc_free_shard, NULL);
+	ptvar_free(dquots->shards);
+	free(dquots->merged.recs);
 	free(dquots);
 	*dquotsp = NULL;
 }
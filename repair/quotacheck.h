@@ -10,7 +10,7 @@ void quotacheck_skip(void);
 void quotacheck_adjust(struct xfs_mount *mp, xfs_ino_t ino);
 void quotacheck_verify(struct xfs_mount *mp, xfs_dqtype_t type);
 uint16_t quotacheck_results(void);
-int quotacheck_setup(struct xfs_mount *mp);
+int quotacheck_setup(struct xfs_mount *mp, unsigned int nr_threads);
 void quotacheck_teardown(void);
 
 #endif /* __XFS_REPAIR_QUOTACHECK_H__ */
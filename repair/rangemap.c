@@ -0,0 +1,509 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "libxfs.h"
+#include "rangemap.h"
+
+/*
+ * Range Map
+ *
+ * A B+tree of ranges.  The leaves hold the ranges in order, with their
+ * starts, ends and values in separate arrays so that a search only reads
+ * the starts, and are linked so that the neighbours of any range are close
+ * at hand.  Interior nodes hold, for each child but the first, a key that
+ * is no bigger than any start in that child and bigger than every start in
+ * the children before it.  Nodes and leaves are 512 bytes on cache line
+ * boundaries, so a lookup in a map of millions of ranges touches a handful
+ * of cache lines instead of chasing a pointer per level of a binary tree.
+ *
+ * Nothing is ever rebalanced on delete: empty leaves and nodes are taken
+ * out and the rest are left as they are.  That keeps the separator rule
+ * intact, and the maps repair builds hardly ever shrink.
+ */
+
+#define RANGEMAP_ALIGN		64
+#define RANGEMAP_LEAF_NR	20
+#define RANGEMAP_NODE_NR	30
+#define RANGEMAP_MAX_HEIGHT	16
+
+struct rangemap_leaf {
+	unsigned int		nr;
+	struct rangemap_leaf	*prev;
+	struct rangemap_leaf	*next;
+	uint64_t		start[RANGEMAP_LEAF_NR];
+	uint64_t		end[RANGEMAP_LEAF_NR];
+	void			*value[RANGEMAP_LEAF_NR];
+} __attribute__((aligned(RANGEMAP_ALIGN)));
+
+struct rangemap_node {
+	unsigned int		nr;		/* keys; there are nr + 1 children */
+	uint64_t		key[RANGEMAP_NODE_NR];
+	void			*child[RANGEMAP_NODE_NR + 1];
+} __attribute__((aligned(RANGEMAP_ALIGN)));
+
+/* The path from the root to a leaf, for inserts and deletes. */
+struct rangemap_path {
+	struct rangemap_node	*node[RANGEMAP_MAX_HEIGHT + 1];
+	unsigned int		slot[RANGEMAP_MAX_HEIGHT + 1];
+};
+
+static void *
+rangemap_alloc(
+	size_t			size)
+{
+	void			*p = memalign(RANGEMAP_ALIGN, size);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+/* How many of the sorted @keys are no bigger than @key?  No branches. */
+static inline unsigned int
+rangemap_count_le(
+	const uint64_t		*keys,
+	unsigned int		nr,
+	uint64_t		key)
+{
+	unsigned int		i, idx = 0;
+
+	for (i = 0; i < nr; i++)
+		idx += keys[i] <= key;
+	return idx;
+}
+
+/*
+ * Find the leaf that @key belongs in and the number of ranges in it that
+ * start at or before @key.  If @path is given, record how we got there.
+ */
+static struct rangemap_leaf *
+rangemap_seek(
+	struct rangemap		*map,
+	uint64_t		key,
+	struct rangemap_path	*path,
+	unsigned int		*idx)
+{
+	struct rangemap_node	*node;
+	void			*p = map->root;
+	unsigned int		level, slot;
+
+	for (level = map->height; level > 0; level--) {
+		node = p;
+		slot = rangemap_count_le(node->key, node->nr, key);
+		if (path) {
+			path->node[level] = node;
+			path->slot[level] = slot;
+		}
+		p = node->child[slot];
+	}
+
+	*idx = rangemap_count_le(((struct rangemap_leaf *)p)->start,
+			((struct rangemap_leaf *)p)->nr, key);
+	return p;
+}
+
+/*
+ * Step back from position @idx in @leaf to the range before it.  Leaves
+ * other than the root are never empty, so a previous leaf has a last range.
+ */
+static inline bool
+rangemap_step_back(
+	struct rangemap_leaf	**leafp,
+	unsigned int		*idx)
+{
+	if (*idx > 0) {
+		(*idx)--;
+		return true;
+	}
+	if (!(*leafp)->prev)
+		return false;
+	*leafp = (*leafp)->prev;
+	*idx = (*leafp)->nr - 1;
+	return true;
+}
+
+/* Make sure that position @idx in @leaf is a range, moving on if need be. */
+static inline bool
+rangemap_settle(
+	struct rangemap_leaf	**leafp,
+	unsigned int		*idx)
+{
+	if (*idx < (*leafp)->nr)
+		return true;
+	if (!(*leafp)->next)
+		return false;
+	*leafp = (*leafp)->next;
+	*idx = 0;
+	return true;
+}
+
+void
+rangemap_init(
+	struct rangemap		*map)
+{
+	map->root = NULL;
+	map->height = 0;
+	map->first = NULL;
+}
+
+static void
+rangemap_free_nodes(
+	void			*p,
+	unsigned int		level)
+{
+	struct rangemap_node	*node = p;
+	unsigned int		i;
+
+	if (level > 0)
+		for (i = 0; i <= node->nr; i++)
+			rangemap_free_nodes(node->child[i], level - 1);
+	free(p);
+}
+
+void
+rangemap_destroy(
+	struct rangemap		*map)
+{
+	if (map->root)
+		rangemap_free_nodes(map->root, map->height);
+	rangemap_init(map);
+}
+
+/*
+ * Where to split a full leaf or node when something is about to go in at
+ * @pos.  Ranges are usually added in ascending order, so if the new one goes
+ * on the end then leave this one full and start the next one with just the
+ * new range; otherwise split in the middle.
+ */
+static inline unsigned int
+rangemap_split_point(
+	unsigned int		pos,
+	unsigned int		nr)
+{
+	return pos == nr ? nr : (nr + 1) / 2;
+}
+
+/* Add @child to the right of slot @level's path entry, splitting upwards. */
+static int
+rangemap_insert_child(
+	struct rangemap		*map,
+	struct rangemap_path	*path,
+	uint64_t		key,
+	void			*child)
+{
+	uint64_t		keys[RANGEMAP_NODE_NR + 1];
+	void			*children[RANGEMAP_NODE_NR + 2];
+	struct rangemap_node	*node, *right;
+	unsigned int		level, pos, mid, nr;
+
+	for (level = 1; level <= map->height; level++) {
+		node = path->node[level];
+		pos = path->slot[level];
+
+		if (node->nr < RANGEMAP_NODE_NR) {
+			memmove(&node->key[pos + 1], &node->key[pos],
+					(node->nr - pos) * sizeof(uint64_t));
+			memmove(&node->child[pos + 2], &node->child[pos + 1],
+					(node->nr - pos) * sizeof(void *));
+			node->key[pos] = key;
+			node->child[pos + 1] = child;
+			node->nr++;
+			return 0;
+		}
+
+		right = rangemap_alloc(sizeof(*right));
+		if (!right)
+			return -ENOMEM;
+
+		/* lay out the overfull node, then split it around the middle */
+		memcpy(keys, node->key, pos * sizeof(uint64_t));
+		keys[pos] = key;
+		memcpy(&keys[pos + 1], &node->key[pos],
+				(RANGEMAP_NODE_NR - pos) * sizeof(uint64_t));
+		memcpy(children, node->child, (pos + 1) * sizeof(void *));
+		children[pos + 1] = child;
+		memcpy(&children[pos + 2], &node->child[pos + 1],
+				(RANGEMAP_NODE_NR - pos) * sizeof(void *));
+
+		mid = rangemap_split_point(pos, RANGEMAP_NODE_NR);
+		nr = RANGEMAP_NODE_NR - mid;
+		memcpy(node->key, keys, mid * sizeof(uint64_t));
+		memcpy(node->child, children, (mid + 1) * sizeof(void *));
+		node->nr = mid;
+		memcpy(right->key, &keys[mid + 1], nr * sizeof(uint64_t));
+		memcpy(right->child, &children[mid + 1],
+				(nr + 1) * sizeof(void *));
+		right->nr = nr;
+
+		key = keys[mid];
+		child = right;
+	}
+
+	if (map->height == RANGEMAP_MAX_HEIGHT)
+		return -EFBIG;
+	node = rangemap_alloc(sizeof(*node));
+	if (!node)
+		return -ENOMEM;
+	node->nr = 1;
+	node->key[0] = key;
+	node->child[0] = map->root;
+	node->child[1] = child;
+	map->root = node;
+	map->height++;
+	return 0;
+}
+
+/*
+ * Map [@start, @end) to @value.  Returns -EEXIST if that overlaps a range
+ * that's already there, or -ENOMEM if we run out of memory part way through
+ * an insert, after which the map can only be destroyed.
+ */
+int
+rangemap_insert(
+	struct rangemap		*map,
+	uint64_t		start,
+	uint64_t		end,
+	void			*value)
+{
+	struct rangemap_path	path;
+	struct rangemap_leaf	*leaf, *right, *n;
+	unsigned int		idx, half, i;
+
+	ASSERT(start < end);
+
+	if (!map->root) {
+		leaf = rangemap_alloc(sizeof(*leaf));
+		if (!leaf)
+			return -ENOMEM;
+		map->root = map->first = leaf;
+	}
+
+	leaf = rangemap_seek(map, start, &path, &idx);
+
+	/* the range before us must end by our start... */
+	n = leaf;
+	i = idx;
+	if (rangemap_step_back(&n, &i) && n->end[i] > start)
+		return -EEXIST;
+	/* ...and the one after us must start at or after our end */
+	n = leaf;
+	i = idx;
+	if (rangemap_settle(&n, &i) && n->start[i] < end)
+		return -EEXIST;
+
+	if (leaf->nr == RANGEMAP_LEAF_NR) {
+		right = rangemap_alloc(sizeof(*right));
+		if (!right)
+			return -ENOMEM;
+
+		half = rangemap_split_point(idx, RANGEMAP_LEAF_NR);
+		right->nr = RANGEMAP_LEAF_NR - half;
+		memcpy(right->start, &leaf->start[half],
+				right->nr * sizeof(uint64_t));
+		memcpy(right->end, &leaf->end[half],
+				right->nr * sizeof(uint64_t));
+		memcpy(right->value, &leaf->value[half],
+				right->nr * sizeof(void *));
+		leaf->nr = half;
+
+		right->prev = leaf;
+		right->next = leaf->next;
+		if (leaf->next)
+			leaf->next->prev = right;
+		leaf->next = right;
+
+		if (rangemap_insert_child(map, &path,
+				right->nr ? right->start[0] : start, right))
+			return -ENOMEM;
+
+		if (idx > half || !right->nr) {
+			leaf = right;
+			idx -= half;
+		}
+	}
+
+	memmove(&leaf->start[idx + 1], &leaf->start[idx],
+			(leaf->nr - idx) * sizeof(uint64_t));
+	memmove(&leaf->end[idx + 1], &leaf->end[idx],
+			(leaf->nr - idx) * sizeof(uint64_t));
+	memmove(&leaf->value[idx + 1], &leaf->value[idx],
+			(leaf->nr - idx) * sizeof(void *));
+	leaf->start[idx] = start;
+	leaf->end[idx] = end;
+	leaf->value[idx] = value;
+	leaf->nr++;
+	return 0;
+}
+
+/* Take an emptied leaf out of the tree, and any nodes that empties. */
+static void
+rangemap_remove_leaf(
+	struct rangemap		*map,
+	struct rangemap_path	*path,
+	struct rangemap_leaf	*leaf)
+{
+	struct rangemap_node	*node;
+	unsigned int		level, slot;
+	void			*child = leaf;
+
+	if (leaf->prev)
+		leaf->prev->next = leaf->next;
+	else
+		map->first = leaf->next;
+	if (leaf->next)
+		leaf->next->prev = leaf->prev;
+
+	for (level = 1; level <= map->height; level++) {
+		free(child);
+		node = path->node[level];
+		slot = path->slot[level];
+		if (node->nr > 0) {
+			/* drop the key on the left of the child, if any */
+			if (slot > 0)
+				slot--;
+			memmove(&node->key[slot], &node->key[slot + 1],
+					(node->nr - slot - 1) *
+					sizeof(uint64_t));
+			slot = path->slot[level];
+			memmove(&node->child[slot], &node->child[slot + 1],
+					(node->nr - slot) * sizeof(void *));
+			node->nr--;
+			break;
+		}
+		/* that was the only child, so this node goes too */
+		child = node;
+	}
+
+	/* a root with one child is just a longer path to it */
+	while (map->height > 0) {
+		node = map->root;
+		if (node->nr > 0)
+			break;
+		map->root = node->child[0];
+		map->height--;
+		free(node);
+	}
+}
+
+/* Remove the range starting at @start and return its value. */
+void *
+rangemap_delete(
+	struct rangemap		*map,
+	uint64_t		start)
+{
+	struct rangemap_path	path;
+	struct rangemap_leaf	*leaf;
+	unsigned int		idx;
+	void			*value;
+
+	if (!map->root)
+		return NULL;
+
+	leaf = rangemap_seek(map, start, &path, &idx);
+	if (idx == 0 || leaf->start[idx - 1] != start)
+		return NULL;
+	idx--;
+	value = leaf->value[idx];
+
+	memmove(&leaf->start[idx], &leaf->start[idx + 1],
+			(leaf->nr - idx - 1) * sizeof(uint64_t));
+	memmove(&leaf->end[idx], &leaf->end[idx + 1],
+			(leaf->nr - idx - 1) * sizeof(uint64_t));
+	memmove(&leaf->value[idx], &leaf->value[idx + 1],
+			(leaf->nr - idx - 1) * sizeof(void *));
+	leaf->nr--;
+
+	if (leaf->nr == 0 && map->height > 0)
+		rangemap_remove_leaf(map, &path, leaf);
+	return value;
+}
+
+/* Find the range containing @key. */
+void *
+rangemap_find(
+	struct rangemap		*map,
+	uint64_t		key)
+{
+	struct rangemap_leaf	*leaf;
+	unsigned int		idx;
+
+	if (!map->root)
+		return NULL;
+	leaf = rangemap_seek(map, key, NULL, &idx);
+	if (!rangemap_step_back(&leaf, &idx) || leaf->end[idx] <= key)
+		return NULL;
+	return leaf->value[idx];
+}
+
+/* Find the range containing @key, or failing that the first one after it. */
+void *
+rangemap_find_from(
+	struct rangemap		*map,
+	uint64_t		key)
+{
+	struct rangemap_leaf	*leaf, *l;
+	unsigned int		idx, i;
+
+	if (!map->root)
+		return NULL;
+	leaf = rangemap_seek(map, key, NULL, &idx);
+	l = leaf;
+	i = idx;
+	if (rangemap_step_back(&l, &i) && l->end[i] > key)
+		return l->value[i];
+	if (!rangemap_settle(&leaf, &idx))
+		return NULL;
+	return leaf->value[idx];
+}
+
+/* Find the last range that starts before @key. */
+void *
+rangemap_prev(
+	struct rangemap		*map,
+	uint64_t		key)
+{
+	struct rangemap_leaf	*leaf;
+	unsigned int		idx;
+
+	if (!map->root || key == 0)
+		return NULL;
+	leaf = rangemap_seek(map, key - 1, NULL, &idx);
+	if (!rangemap_step_back(&leaf, &idx))
+		return NULL;
+	return leaf->value[idx];
+}
+
+void *
+rangemap_first(
+	struct rangemap		*map)
+{
+	if (!map->first || !map->first->nr)
+		return NULL;
+	return map->first->value[0];
+}
+
+/*
+ * Call @fn on each range in order.  Stops at and returns the first nonzero
+ * return value.
+ */
+int
+rangemap_walk(
+	struct rangemap		*map,
+	rangemap_walk_fn	fn,
+	void			*arg)
+{
+	struct rangemap_leaf	*leaf;
+	unsigned int		i;
+	int			ret;
+
+	for (leaf = map->first; leaf; leaf = leaf->next) {
+		for (i = 0; i < leaf->nr; i++) {
+			ret = fn(leaf->start[i], leaf->end[i], leaf->value[i],
+					arg);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef __XFS_REPAIR_RANGEMAP_H__
+#define __XFS_REPAIR_RANGEMAP_H__
+
+/*
+ * Ordered map of non-overlapping ranges [start, end) to pointers.  Lookups
+ * don't modify the map, so any number of threads can look things up at once,
+ * but inserts and deletes must exclude everything else.
+ */
+struct rangemap {
+	void			*root;
+	unsigned int		height;		/* 0 if the root is a leaf */
+	struct rangemap_leaf	*first;
+};
+
+typedef int (*rangemap_walk_fn)(uint64_t start, uint64_t end, void *value,
+		void *arg);
+
+void rangemap_init(struct rangemap *map);
+void rangemap_destroy(struct rangemap *map);
+int rangemap_insert(struct rangemap *map, uint64_t start, uint64_t end,
+		void *value);
+void *rangemap_delete(struct rangemap *map, uint64_t start);
+void *rangemap_find(struct rangemap *map, uint64_t key);
+void *rangemap_find_from(struct rangemap *map, uint64_t key);
+void *rangemap_prev(struct rangemap *map, uint64_t key);
+void *rangemap_first(struct rangemap *map);
+int rangemap_walk(struct rangemap *map, rangemap_walk_fn fn, void *arg);
+
+#endif /* __XFS_REPAIR_RANGEMAP_H__ */
@@ -12,6 +12,8 @@
 #include "dinode.h"
 #include "slab.h"
 #include "rmap.h"
+#include "threads.h"
+#include "checkpoint.h"
 #include "libfrog/bitmap.h"
 
 #undef RMAP_DEBUG
@@ -111,6 +113,107 @@ rmaps_free(
 	ag_rmaps = NULL;
 }
 
+static void
+rmap_save_slab(
+	struct repair_ckpt	*ck,
+	struct xfs_slab		*slab,
+	size_t			item_size)
+{
+	struct xfs_slab_cursor	*cur;
+	uint64_t		nr = slab_count(slab);
+	void			*item;
+	int			error;
+
+	ckpt_write(ck, &nr, sizeof(nr));
+	error = init_slab_cursor(slab, NULL, &cur);
+	if (error) {
+		ckpt_set_error(ck, error);
+		return;
+	}
+	while ((item = pop_slab_cursor(cur)) != NULL)
+		ckpt_write(ck, item, item_size);
+	free_slab_cursor(&cur);
+}
+
+static void
+rmap_load_slab(
+	struct repair_ckpt	*ck,
+	struct xfs_slab		*slab,
+	size_t			item_size)
+{
+	char			item[sizeof(struct xfs_rmap_irec)];
+	uint64_t		nr;
+	int			error;
+
+	ASSERT(item_size <= sizeof(item));
+	ckpt_read(ck, &nr, sizeof(nr));
+	while (nr-- > 0) {
+		ckpt_read(ck, item, item_size);
+		error = slab_add(slab, item);
+		if (error)
+			do_error(
+_("Insufficient memory while loading reverse mappings from checkpoint.\n"));
+	}
+}
+
+/*
+ * Save the reverse mapping and refcount observations to a checkpoint.  The
+ * slabs are written in their current order, so a slab that was sorted comes
+ * back sorted.
+ */
+void
+rmaps_save_checkpoint(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	xfs_agnumber_t		agno;
+
+	if (!rmap_needs_work(mp))
+		return;
+
+	ckpt_write(ck, &collect_rmaps, sizeof(collect_rmaps));
+	ckpt_write(ck, &rmapbt_suspect, sizeof(rmapbt_suspect));
+	ckpt_write(ck, &refcbt_suspect, sizeof(refcbt_suspect));
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		struct xfs_ag_rmap	*ar = &ag_rmaps[agno];
+
+		ckpt_write(ck, &ar->ar_flcount, sizeof(ar->ar_flcount));
+		ckpt_write(ck, &ar->ar_last_rmap, sizeof(ar->ar_last_rmap));
+		rmap_save_slab(ck, ar->ar_rmaps, sizeof(struct xfs_rmap_irec));
+		rmap_save_slab(ck, ar->ar_raw_rmaps,
+				sizeof(struct xfs_rmap_irec));
+		rmap_save_slab(ck, ar->ar_refcount_items,
+				sizeof(struct xfs_refcount_irec));
+	}
+}
+
+/* Load what rmaps_save_checkpoint wrote into freshly initialized slabs. */
+void
+rmaps_load_checkpoint(
+	struct xfs_mount	*mp,
+	struct repair_ckpt	*ck)
+{
+	xfs_agnumber_t		agno;
+
+	if (!rmap_needs_work(mp))
+		return;
+
+	ckpt_read(ck, &collect_rmaps, sizeof(collect_rmaps));
+	ckpt_read(ck, &rmapbt_suspect, sizeof(rmapbt_suspect));
+	ckpt_read(ck, &refcbt_suspect, sizeof(refcbt_suspect));
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
+		struct xfs_ag_rmap	*ar = &ag_rmaps[agno];
+
+		ckpt_read(ck, &ar->ar_flcount, sizeof(ar->ar_flcount));
+		ckpt_read(ck, &ar->ar_last_rmap, sizeof(ar->ar_last_rmap));
+		rmap_load_slab(ck, ar->ar_rmaps, sizeof(struct xfs_rmap_irec));
+		rmap_load_slab(ck, ar->ar_raw_rmaps,
+				sizeof(struct xfs_rmap_irec));
+		rmap_load_slab(ck, ar->ar_refcount_items,
+				sizeof(struct xfs_refcount_irec));
+	}
+}
+
 /*
  * Decide if two reverse-mapping records can be merged.
  */
@@ -273,6 +376,134 @@ rmap_add_ag_rec(
 	return __rmap_add_raw_rec(mp, agno, agbno, len, owner, false, false);
 }
 
+/* Merge adjacent raw rmaps from @cur and add them to @rmaps. */
+static int
+rmap_fold_cursor(
+	struct xfs_slab_cursor	*cur,
+	struct xfs_slab		*rmaps)
+{
+	struct xfs_rmap_irec	*prev, *rec;
+	int			error;
+
+	prev = pop_slab_cursor(cur);
+	rec = pop_slab_cursor(cur);
+	while (prev && rec) {
+		if (rmaps_are_mergeable(prev, rec)) {
+			prev->rm_blockcount += rec->rm_blockcount;
+			rec = pop_slab_cursor(cur);
+			continue;
+		}
+		error = slab_add(rmaps, prev);
+		if (error)
+			return error;
+		prev = rec;
+		rec = pop_slab_cursor(cur);
+	}
+	if (prev)
+		return slab_add(rmaps, prev);
+	return 0;
+}
+
+/*
+ * Fold raw rmaps with this many records or more on several threads.  Each
+ * thread merges a different range of the sorted records into its own slab.
+ */
+#define RMAP_FOLD_PARALLEL_MIN	(1U << 20)
+
+struct rmap_fold_part {
+	struct xfs_slab_cursor	*cur;
+	struct xfs_slab		*rmaps;
+	int			error;
+};
+
+static void
+rmap_fold_part_work(
+	struct workqueue	*wq,
+	xfs_agnumber_t		idx,
+	void			*arg)
+{
+	struct rmap_fold_part	*part = arg;
+
+	part->error = rmap_fold_cursor(part->cur, part->rmaps);
+}
+
+static int
+rmap_fold_parallel(
+	struct xfs_slab		*raw,
+	struct xfs_slab		*rmaps)
+{
+	struct workqueue	wq;
+	struct xfs_slab_cursor	**curs;
+	struct rmap_fold_part	*parts;
+	struct xfs_rmap_irec	*last = NULL, *first;
+	struct xfs_slab_cursor	*fcur;
+	unsigned int		nr;
+	unsigned int		i;
+	int			error;
+
+	nr = min((size_t)platform_nproc(),
+			slab_count(raw) / (RMAP_FOLD_PARALLEL_MIN / 4));
+	curs = calloc(nr, sizeof(struct xfs_slab_cursor *));
+	parts = calloc(nr, sizeof(struct rmap_fold_part));
+	if (!curs || !parts) {
+		error = -ENOMEM;
+		goto out_free;
+	}
+
+	error = init_slab_cursors_split(raw, rmap_compare, nr, curs, &nr);
+	if (error)
+		goto out_free;
+	for (i = 0; i < nr; i++) {
+		parts[i].cur = curs[i];
+		error = init_slab(&parts[i].rmaps,
+				sizeof(struct xfs_rmap_irec));
+		if (error)
+			goto out_parts;
+	}
+
+	create_work_queue(&wq, NULL, nr);
+	for (i = 0; i < nr; i++)
+		queue_work(&wq, rmap_fold_part_work, i, &parts[i]);
+	destroy_work_queue(&wq);
+
+	/*
+	 * The last record of a range might be mergeable with the first record
+	 * of the next range.  If so, fold it into that first record, which
+	 * keeps the ranges in order, and stitch the ranges together.
+	 */
+	for (i = 0; i < nr; i++) {
+		if (parts[i].error) {
+			error = parts[i].error;
+			goto out_parts;
+		}
+		if (last) {
+			error = init_slab_cursor(parts[i].rmaps, NULL, &fcur);
+			if (error)
+				goto out_parts;
+			first = peek_slab_cursor(fcur);
+			if (first && rmaps_are_mergeable(last, first)) {
+				first->rm_startblock = last->rm_startblock;
+				first->rm_offset = last->rm_offset;
+				first->rm_blockcount += last->rm_blockcount;
+				slab_remove_last(rmaps);
+			}
+			free_slab_cursor(&fcur);
+		}
+		slab_concat(rmaps, parts[i].rmaps);
+		last = slab_last(rmaps);
+	}
+
+out_parts:
+	for (i = 0; i < nr; i++) {
+		free_slab(&parts[i].rmaps);
+		free_slab_cursor(&curs[i]);
+	}
+out_free:
+	free(parts);
+	free(curs);
+	return error;
+}
+
 /*
  * Merge adjacent raw rmaps and add them to the main rmap list.
  */
@@ -282,7 +513,6 @@ rmap_fold_raw_recs(
 	xfs_agnumber_t		agno)
 {
 	struct xfs_slab_cursor	*cur = NULL;
-	struct xfs_rmap_irec	*prev, *rec;
 	size_t			old_sz;
 	int			error = 0;
 
@@ -290,30 +520,19 @@ rmap_fold_raw_recs(
 	if (slab_count(ag_rmaps[agno].ar_raw_rmaps) == 0)
 		goto no_raw;
 	qsort_slab(ag_rmaps[agno].ar_raw_rmaps, rmap_compare);
-	error = init_slab_cursor(ag_rmaps[agno].ar_raw_rmaps, rmap_compare,
-			&cur);
-	if (error)
-		goto err;
-
-	prev = pop_slab_cursor(cur);
-	rec = pop_slab_cursor(cur);
-	while (prev && rec) {
-		if (rmaps_are_mergeable(prev, rec)) {
-			prev->rm_blockcount += rec->rm_blockcount;
-			rec = pop_slab_cursor(cur);
-			continue;
-		}
-		error = slab_add(ag_rmaps[agno].ar_rmaps, prev);
-		if (error)
-			goto err;
-		prev = rec;
-		rec = pop_slab_cursor(cur);
-	}
-	if (prev) {
-		error = slab_add(ag_rmaps[agno].ar_rmaps, prev);
+	if (slab_count(ag_rmaps[agno].ar_raw_rmaps) >= RMAP_FOLD_PARALLEL_MIN &&
+	    platform_nproc() > 1) {
+		error = rmap_fold_parallel(ag_rmaps[agno].ar_raw_rmaps,
+				ag_rmaps[agno].ar_rmaps);
+	} else {
+		error = init_slab_cursor(ag_rmaps[agno].ar_raw_rmaps,
+				rmap_compare, &cur);
 		if (error)
 			goto err;
+		error = rmap_fold_cursor(cur, ag_rmaps[agno].ar_rmaps);
 	}
+	if (error)
+		goto err;
 	free_slab(&ag_rmaps[agno].ar_raw_rmaps);
 	error = init_slab(&ag_rmaps[agno].ar_raw_rmaps,
 			sizeof(struct xfs_rmap_irec));
@@ -13,6 +13,12 @@ extern bool rmap_needs_work(struct xfs_mount *);
 extern void rmaps_init(struct xfs_mount *);
 extern void rmaps_free(struct xfs_mount *);
 
+struct repair_ckpt;
+extern void rmaps_save_checkpoint(struct xfs_mount *mp,
+		struct repair_ckpt *ck);
+extern void rmaps_load_checkpoint(struct xfs_mount *mp,
+		struct repair_ckpt *ck);
+
 extern int rmap_add_rec(struct xfs_mount *, xfs_ino_t, int, struct xfs_bmbt_irec *);
 extern int rmap_finish_collecting_fork_recs(struct xfs_mount *mp,
 		xfs_agnumber_t agno);
@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -39,9 +38,35 @@ rtinit(xfs_mount_t *mp)
 	_("couldn't allocate memory for incore realtime summary info.\n"));
 }
 
+/* Set @len bits of an in-memory rt bitmap, starting at @bit. */
+static void
+rtword_set_range(
+	xfs_rtword_t	*words,
+	xfs_rtblock_t	bit,
+	xfs_rtblock_t	len)
+{
+	const unsigned int nbword = sizeof(xfs_rtword_t) * NBBY;
+	xfs_rtblock_t	end = bit + len;
+	xfs_rtword_t	mask;
+
+	while (bit < end) {
+		unsigned int	lo = bit % nbword;
+		unsigned int	n = min(end - bit, (xfs_rtblock_t)(nbword - lo));
+
+		mask = n == nbword ? ~(xfs_rtword_t)0 :
+				(((xfs_rtword_t)1 << n) - 1) << lo;
+		words[bit / nbword] |= mask;
+		bit += n;
+	}
+}
+
 /*
  * generate the real-time bitmap and summary info based on the
  * incore realtime extent map.
+ *
+ * Walk the map a run of free or used extents at a time; every free run
+ * sets its bits in the bitmap and adds one to the summary for the bitmap
+ * block it starts in.
  */
 int
 generate_rtinfo(xfs_mount_t	*mp,
@@ -49,65 +74,28 @@ generate_rtinfo(xfs_mount_t	*mp,
 		xfs_suminfo_t	*sumcompute)
 {
 	xfs_rtblock_t	extno;
-	xfs_rtblock_t	start_ext;
+	xfs_rtblock_t	next;
+	xfs_rtblock_t	len;
 	int		bitsperblock;
-	int		bmbno;
-	xfs_rtword_t	freebit;
-	xfs_rtword_t	bits;
-	int		start_bmbno;
-	int		i;
-	int		offs;
 	int		log;
-	int		len;
-	int		in_extent;
+	int		offs;
+	bool		free;
 
 	ASSERT(mp->m_rbmip == NULL);
 
 	bitsperblock = mp->m_sb.sb_blocksize * NBBY;
-	extno = start_ext = 0;
-	bmbno = in_extent = start_bmbno = 0;
-
-	/*
-	 * slower but simple, don't play around with trying to set
-	 * things one word at a time, just set bit as required.
-	 * Have to * track start and end (size) of each range of
-	 * free extents to set the summary info properly.
-	 */
-	while (extno < mp->m_sb.sb_rextents)  {
-		freebit = 1;
-		*words = 0;
-		bits = 0;
-		for (i = 0; i < sizeof(xfs_rtword_t) * NBBY &&
-				extno < mp->m_sb.sb_rextents; i++, extno++)  {
-			if (get_rtbmap(extno) == XR_E_FREE)  {
-				sb_frextents++;
-				bits |= freebit;
 
-				if (in_extent == 0) {
-					start_ext = extno;
-					start_bmbno = bmbno;
-					in_extent = 1;
-				}
-			} else if (in_extent == 1) {
-				len = (int) (extno - start_ext);
-				log = XFS_RTBLOCKLOG(len);
-				offs = XFS_SUMOFFS(mp, log, start_bmbno);
-				sumcompute[offs]++;
-				in_extent = 0;
-			}
+	for (extno = 0; extno < mp->m_sb.sb_rextents; extno = next) {
+		next = get_rtbmap_run(extno, mp->m_sb.sb_rextents, &free);
+		if (!free)
+			continue;
 
-			freebit <<= 1;
-		}
-		*words = bits;
-		words++;
+		len = next - extno;
+		sb_frextents += len;
+		rtword_set_range(words, extno, len);
 
-		if (extno % bitsperblock == 0)
-			bmbno++;
-	}
-	if (in_extent == 1) {
-		len = (int) (extno - start_ext);
 		log = XFS_RTBLOCKLOG(len);
-		offs = XFS_SUMOFFS(mp, log, start_bmbno);
+		offs = XFS_SUMOFFS(mp, log, extno / bitsperblock);
 		sumcompute[offs]++;
 	}
 
@@ -146,6 +134,30 @@ check_summary(xfs_mount_t *mp)
 	return(error);
 }
 
+/*
+ * Find the first bit at or after @bit, and before @end, whose value differs
+ * from @bit's, looking at a whole word at a time.
+ */
+static int
+rtword_run_end(
+	xfs_rtword_t	*words,
+	int		bit,
+	int		end)
+{
+	const int	nbword = sizeof(xfs_rtword_t) * NBBY;
+	xfs_rtword_t	want = xfs_isset(words, bit) ? ~(xfs_rtword_t)0 : 0;
+	xfs_rtword_t	mask = ~(xfs_rtword_t)0 << (bit % nbword);
+	xfs_rtword_t	diff;
+	int		i;
+
+	for (i = bit / nbword; i * nbword < end; i++, mask = ~(xfs_rtword_t)0) {
+		diff = (words[i] ^ want) & mask;
+		if (diff)
+			return min(i * nbword + __builtin_ctz(diff), end);
+	}
+	return end;
+}
+
 /*
  * examine the real-time bitmap file and compute summary
  * info off it.  Should probably be changed to compute
@@ -168,7 +180,9 @@ process_rtbitmap(
 	xfs_rtblock_t		extno;
 	int			i;
 	int			len;
+	int			limit;
 	int			log;
+	int			next;
 	int			offs;
 	int			prevbit;
 	int			start_bmbno;
@@ -203,12 +217,14 @@ process_rtbitmap(
 			continue;
 		}
 		words = (xfs_rtword_t *)bp->b_un.b_addr;
-		for (bit = 0;
-		     bit < bitsperblock && extno < mp->m_sb.sb_rextents;
-		     bit++, extno++) {
+		limit = min((xfs_rtblock_t)bitsperblock,
+				mp->m_sb.sb_rextents - extno);
+		for (bit = 0; bit < limit; bit = next) {
+			next = rtword_run_end(words, bit, limit);
 			if (xfs_isset(words, bit)) {
-				set_rtbmap(extno, XR_E_FREE);
-				sb_frextents++;
+				set_rtbmap_ext(extno + bit, next - bit,
+						XR_E_FREE);
+				sb_frextents += next - bit;
 				if (prevbit == 0) {
 					start_bmbno = bmbno;
 					start_bit = bit;
@@ -223,6 +239,7 @@ process_rtbitmap(
 				prevbit = 0;
 			}
 		}
+		extno += limit;
 		libxfs_buf_relse(bp);
 		if (extno == mp->m_sb.sb_rextents)
 			break;
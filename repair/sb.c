@@ -12,6 +12,7 @@
 #include "protos.h"
 #include "err_protos.h"
 #include "xfs_multidisk.h"
+#include "threads.h"
 
 #define BSIZE	(1024 * 1024)
 
@@ -172,41 +173,217 @@ __find_secondary_sb(
 	return retval;
 }
 
+/*
+ * Brute force search for a secondary superblock.
+ *
+ * Reading the whole device a megabyte at a time takes forever on a big
+ * LUN, so the device is cut into large chunks that worker threads read
+ * with big (direct, if the device is open that way) reads and scan for
+ * anything that looks like a superblock.  Chunks are handed out in rounds
+ * from the front of the device, and after each round we try the candidates
+ * in disk order, so we still pick the first good secondary and stop
+ * reading as soon as we have one.
+ */
+#define SB_SCAN_CHUNK	(8ULL * 1024 * 1024)
+#define SB_SCAN_ROUND	4		/* chunks per thread per round */
+
+struct sb_scan_chunk {
+	uint64_t		*cands;		/* candidate byte offsets */
+	unsigned int		nr;
+	unsigned int		max;
+	bool			eof;
+};
+
+struct sb_scan {
+	uint64_t		start;		/* offset of this round */
+	struct sb_scan_chunk	*chunks;
+};
+
+static void
+scan_sb_chunk(
+	struct workqueue	*wq,
+	xfs_agnumber_t		idx,
+	void			*arg)
+{
+	struct sb_scan		*scan = arg;
+	struct sb_scan_chunk	*chunk = &scan->chunks[idx];
+	uint64_t		off = scan->start + idx * SB_SCAN_CHUNK;
+	xfs_sb_t		bufsb;
+	ssize_t			bsize;
+	char			*buf;
+	int			i;
+
+	buf = memalign(libxfs_device_alignment(), SB_SCAN_CHUNK);
+	if (!buf) {
+		do_error(
+	_("error finding secondary superblock -- failed to memalign buffer\n"));
+		return;
+	}
+
+	bsize = pread(x.dfd, buf, SB_SCAN_CHUNK, off);
+	if (bsize < (ssize_t)SB_SCAN_CHUNK)
+		chunk->eof = true;
+
+	/*
+	 * check the buffer 512 bytes at a time since
+	 * we don't know how big the sectors really are.
+	 */
+	for (i = 0; i + BBSIZE <= bsize; i += BBSIZE) {
+		struct xfs_dsb	*dsb = (struct xfs_dsb *)(buf + i);
+
+		if (dsb->sb_magicnum != cpu_to_be32(XFS_SB_MAGIC))
+			continue;
+		libxfs_sb_from_disk(&bufsb, dsb);
+		if (verify_sb(buf + i, &bufsb, 0) != XR_OK)
+			continue;
+
+		if (chunk->nr == chunk->max) {
+			unsigned int	max = max(chunk->max * 2, 8U);
+			uint64_t	*cands;
+
+			cands = realloc(chunk->cands, max * sizeof(uint64_t));
+			if (!cands)
+				do_error(
+	_("couldn't allocate secondary superblock candidates\n"));
+			chunk->cands = cands;
+			chunk->max = max;
+		}
+		chunk->cands[chunk->nr++] = off + i;
+	}
+
+	free(buf);
+}
+
+/* Try a candidate from the brute force scan.  Returns 1 if it checks out. */
 static int
-guess_default_geometry(
-	uint64_t		*agsize,
-	uint64_t		*agcount,
+try_secondary_sb(
+	xfs_sb_t		*rsb,
+	uint64_t		off,
+	char			*buf)
+{
+	xfs_sb_t		bufsb;
+	int			dirty = 0;
+
+	if (pread(x.dfd, buf, BBSIZE, off) != BBSIZE)
+		return 0;
+	libxfs_sb_from_disk(&bufsb, (struct xfs_dsb *)buf);
+	if (verify_sb(buf, &bufsb, 0) != XR_OK)
+		return 0;
+
+	do_warn(_("found candidate secondary superblock...\n"));
+
+	/*
+	 * found one.  now verify it by looking
+	 * for other secondaries.
+	 */
+	memmove(rsb, &bufsb, sizeof(xfs_sb_t));
+	rsb->sb_inprogress = 0;
+	copied_sunit = 1;
+
+	if (verify_set_primary_sb(rsb, 0, &dirty) == XR_OK) {
+		do_warn(_("verified secondary superblock...\n"));
+		return 1;
+	}
+	do_warn(_("unable to verify superblock, continuing...\n"));
+	return 0;
+}
+
+static int
+scan_secondary_sb(
+	xfs_sb_t		*rsb,
+	uint64_t		start)
+{
+	struct sb_scan		scan = { .start = start };
+	struct workqueue	wq;
+	uint64_t		end = x.dsize << BBSHIFT;
+	unsigned int		nr_threads;
+	unsigned int		nr_chunks;
+	unsigned int		i, j;
+	char			*buf;
+	bool			eof = false;
+	int			retval = 0;
+
+	nr_threads = min(max(platform_nproc(), 4), 16);
+	nr_chunks = nr_threads * SB_SCAN_ROUND;
+	scan.chunks = calloc(nr_chunks, sizeof(struct sb_scan_chunk));
+	buf = memalign(libxfs_device_alignment(), BBSIZE);
+	if (!scan.chunks || !buf) {
+		do_error(
+	_("error finding secondary superblock -- failed to allocate buffers\n"));
+		exit(1);
+	}
+
+	while (!retval && !eof && (!end || scan.start < end)) {
+		create_work_queue(&wq, NULL, nr_threads);
+		for (i = 0; i < nr_chunks; i++) {
+			if (end && scan.start + i * SB_SCAN_CHUNK >= end)
+				break;
+			scan.chunks[i].nr = 0;
+			scan.chunks[i].eof = false;
+			queue_work(&wq, scan_sb_chunk, i, &scan);
+		}
+		destroy_work_queue(&wq);
+
+		for (j = 0; !retval && !eof && j < i; j++) {
+			struct sb_scan_chunk	*chunk = &scan.chunks[j];
+			unsigned int		k;
+
+			do_warn(".");
+			for (k = 0; !retval && k < chunk->nr; k++)
+				retval = try_secondary_sb(rsb,
+						chunk->cands[k], buf);
+			eof = chunk->eof;
+		}
+		scan.start += (uint64_t)nr_chunks * SB_SCAN_CHUNK;
+	}
+
+	for (i = 0; i < nr_chunks; i++)
+		free(scan.chunks[i].cands);
+	free(scan.chunks);
+	free(buf);
+	return retval;
+}
+
+/* Does the device look like a RAID volume to mkfs? */
+static int
+guess_multidisk(
 	libxfs_init_t		*x)
 {
 	struct fs_topology	ft;
-	int			blocklog;
-	uint64_t		dblocks;
-	int			multidisk;
 
 	memset(&ft, 0, sizeof(ft));
 	get_topology(x, &ft, 1);
+	return ft.dswidth | ft.dsunit;
+}
+
+/*
+ * Guess the AG size in bytes that mkfs would have picked for the whole
+ * device, using the default block size (2^12).
+ */
+static uint64_t
+guess_default_agbytes(
+	libxfs_init_t		*x,
+	int			multidisk)
+{
+	int			blocklog = 12;
+	uint64_t		dblocks;
+	uint64_t		agsize;
+	uint64_t		agcount;
 
-	/*
-	 * get geometry from get_topology result.
-	 * Use default block size (2^12)
-	 */
-	blocklog = 12;
-	multidisk = ft.dswidth | ft.dsunit;
 	dblocks = x->dsize >> (blocklog - BBSHIFT);
 	calc_default_ag_geometry(blocklog, dblocks, multidisk,
-				 agsize, agcount);
+				 &agsize, &agcount);
 
-	return blocklog;
+	return agsize << blocklog;
 }
 
 int
 find_secondary_sb(xfs_sb_t *rsb)
 {
 	int		retval = 0;
-	uint64_t	agcount;
-	uint64_t	agsize;
+	int		multidisk;
 	uint64_t	skip;
-	int		blocklog;
+	uint64_t	alt_skip;
 
 	/*
 	 * Attempt to find secondary sb with a coarse approach,
@@ -221,16 +398,25 @@ find_secondary_sb(xfs_sb_t *rsb)
 			retval = __find_secondary_sb(rsb, skip, skip);
 	}
 
-        /* If that failed, retry coarse approach, using default geometry */
-        if (!retval) {
-                blocklog = guess_default_geometry(&agsize, &agcount, &x);
-                skip = agsize << blocklog;
-                retval = __find_secondary_sb(rsb, skip, skip);
-        }
+	/* If that failed, retry coarse approach, using default geometry */
+	if (!retval) {
+		multidisk = guess_multidisk(&x);
+		skip = guess_default_agbytes(&x, multidisk);
+		retval = __find_secondary_sb(rsb, skip, skip);
+
+		/*
+		 * The fs may have been made on a device with a different
+		 * topology, so try the AG size that mkfs would have picked
+		 * for the other kind of device too.
+		 */
+		alt_skip = guess_default_agbytes(&x, !multidisk);
+		if (!retval && alt_skip != skip)
+			retval = __find_secondary_sb(rsb, alt_skip, alt_skip);
+	}
 
-        /* If that failed, fall back to the brute force method */
-        if (!retval)
-                retval = __find_secondary_sb(rsb, XFS_AG_MIN_BYTES, BSIZE);
+	/* If that failed, fall back to the brute force method */
+	if (!retval)
+		retval = scan_secondary_sb(rsb, XFS_AG_MIN_BYTES);
 
 	return retval;
 }
@@ -5,7 +5,6 @@
  */
 
 #include "libxfs.h"
-#include "avl.h"
 #include "globals.h"
 #include "agheader.h"
 #include "incore.h"
@@ -19,6 +18,7 @@
 #include "threads.h"
 #include "slab.h"
 #include "rmap.h"
+#include "incremental.h"
 
 static xfs_mount_t	*mp = NULL;
 
@@ -79,6 +79,30 @@ salvage_buffer(
 	return 0;
 }
 
+/*
+ * Start reading the children of an interior short-format btree node so that
+ * they are already in the cache when we descend into them one by one.
+ */
+static void
+scan_sbtree_readahead(
+	xfs_agnumber_t		agno,
+	__be32			*pp,
+	int			numrecs,
+	const struct xfs_buf_ops *ops)
+{
+	int			i;
+
+	for (i = 0; i < numrecs; i++) {
+		xfs_agblock_t	agbno = be32_to_cpu(pp[i]);
+
+		if (!libxfs_verify_agbno(mp, agno, agbno))
+			break;
+		libxfs_buf_readahead(mp->m_dev,
+				XFS_AGB_TO_DADDR(mp, agno, agbno),
+				XFS_FSB_TO_BB(mp, 1), ops);
+	}
+}
+
 static void
 scan_sbtree(
 	xfs_agblock_t	root,
@@ -485,6 +509,14 @@ _("inode %" PRIu64 " bad # of bmap records (%u, min - %u, max - %u)\n"),
 
 	last_key = NULLFILEOFF;
 
+	for (i = 0; i < numrecs; i++) {
+		if (!libxfs_verify_fsbno(mp, be64_to_cpu(pp[i])))
+			break;
+		libxfs_buf_readahead(mp->m_dev,
+				XFS_FSB_TO_DADDR(mp, be64_to_cpu(pp[i])),
+				XFS_FSB_TO_BB(mp, 1), &xfs_bmbt_buf_ops);
+	}
+
 	for (i = 0, err = 0; i < numrecs; i++)  {
 		/*
 		 * XXX - if we were going to fix up the interior btree nodes,
@@ -776,6 +808,8 @@ _("%s freespace btree block claimed (state %d), agno %d, bno %d, suspect %d\n"),
 		suspect = 0;
 	}
 
+	scan_sbtree_readahead(agno, pp, numrecs, ops);
+
 	for (i = 0; i < numrecs; i++)  {
 		xfs_agblock_t		agbno = be32_to_cpu(pp[i]);
 
@@ -1223,6 +1257,8 @@ advance:
 				i, agno, bno, name);
 	}
 
+	scan_sbtree_readahead(agno, pp, numrecs, ops);
+
 	for (i = 0; i < numrecs; i++)  {
 		xfs_agblock_t		agbno = be32_to_cpu(pp[i]);
 
@@ -1473,6 +1509,8 @@ _("extent (%u/%u) len %u claimed, state is %d\n"),
 		suspect = 0;
 	}
 
+	scan_sbtree_readahead(agno, pp, numrecs, ops);
+
 	for (i = 0; i < numrecs; i++)  {
 		xfs_agblock_t		agbno = be32_to_cpu(pp[i]);
 
@@ -2161,6 +2199,8 @@ _("%sbt btree block claimed (state %d), agno %d, bno %d, suspect %d\n"),
 		else suspect++;
 	}
 
+	scan_sbtree_readahead(agno, pp, numrecs, ops);
+
 	for (i = 0; i < numrecs; i++)  {
 		xfs_agblock_t	agbno = be32_to_cpu(pp[i]);
 
@@ -2445,6 +2485,33 @@ validate_agi(
 	}
 }
 
+/*
+ * Start reading the roots of all the AG btrees before we walk the first one.
+ * Each walk reads ahead the children of every node it visits, so the later
+ * trees only wait for their roots if we don't get them going here.
+ */
+static void
+scan_ag_readahead_roots(
+	struct xfs_agf		*agf,
+	struct xfs_agi		*agi,
+	xfs_agnumber_t		agno)
+{
+	scan_sbtree_readahead(agno, &agf->agf_roots[XFS_BTNUM_BNO], 1,
+			&xfs_bnobt_buf_ops);
+	scan_sbtree_readahead(agno, &agf->agf_roots[XFS_BTNUM_CNT], 1,
+			&xfs_cntbt_buf_ops);
+	if (xfs_has_rmapbt(mp))
+		scan_sbtree_readahead(agno, &agf->agf_roots[XFS_BTNUM_RMAP], 1,
+				&xfs_rmapbt_buf_ops);
+	if (xfs_has_reflink(mp))
+		scan_sbtree_readahead(agno, &agf->agf_refcount_root, 1,
+				&xfs_refcountbt_buf_ops);
+	scan_sbtree_readahead(agno, &agi->agi_root, 1, &xfs_inobt_buf_ops);
+	if (xfs_has_finobt(mp))
+		scan_sbtree_readahead(agno, &agi->agi_free_root, 1,
+				&xfs_finobt_buf_ops);
+}
+
 /*
  * Scan an AG for obvious corruption.
  */
@@ -2468,6 +2535,11 @@ scan_ag(
 	char		*objname = NULL;
 	int		error;
 
+	if (incremental_skip_ag(agno)) {
+		PROG_RPT_INC(prog_rpt_done[agno], 1);
+		return;
+	}
+
 	sb = (struct xfs_sb *)calloc(BBTOB(XFS_FSS_TO_BB(mp, 1)), 1);
 	if (!sb) {
 		do_error(_("can't allocate memory for superblock\n"));
@@ -2551,6 +2623,7 @@ scan_ag(
 		goto out_free_agibuf;
 	}
 
+	scan_ag_readahead_roots(agf, agi, agno);
 	scan_freelist(agf, agcnts);
 
 	validate_agf(agf, agno, agcnts);
@@ -2639,13 +2712,29 @@ scan_ags(
 
 	create_work_queue(&wq, mp, scan_threads);
 
-	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		queue_work(&wq, scan_ag, i, &agcnts[i]);
+	queue_work_per_ag(&wq, scan_ag, mp->m_sb.sb_agcount, agcnts,
+			sizeof(*agcnts));
 
 	destroy_work_queue(&wq);
 
 	/* tally up the counts */
 	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
+		struct incr_ag_counts	counts;
+
+		if (incremental_skip_ag(i)) {
+			incremental_get_counts(i, &counts);
+			agcnts[i].fdblocks = counts.fdblocks;
+			agcnts[i].agicount = counts.icount;
+			agcnts[i].ifreecount = counts.ifreecount;
+			agcnts[i].usedblocks = counts.usedblocks;
+		} else {
+			counts.fdblocks = agcnts[i].fdblocks;
+			counts.icount = agcnts[i].agicount;
+			counts.ifreecount = agcnts[i].ifreecount;
+			counts.usedblocks = agcnts[i].usedblocks;
+			incremental_set_counts(i, &counts);
+		}
+
 		fdblocks += agcnts[i].fdblocks;
 		icount += agcnts[i].agicount;
 		ifreecount += agcnts[i].ifreecount;
@@ -2654,6 +2743,13 @@ scan_ags(
 
 	free(agcnts);
 
+	/* AGs left to other checks don't count, so the sums mean nothing. */
+	if (!incremental_have_counts()) {
+		do_log(
+	_("        - not checking superblock counters of a partial check\n"));
+		return;
+	}
+
 	/*
 	 * Validate that our manual counts match the superblock.
 	 */
@@ -4,6 +4,8 @@
  * Author: Darrick J. Wong <darrick.wong@oracle.com>
  */
 #include "libxfs.h"
+#include <sys/mman.h>
+#include "err_protos.h"
 #include "slab.h"
 
 #undef SLAB_DEBUG
@@ -28,6 +30,15 @@
  * A bag is a collection of pointers.  The bag can be added to or removed from
  * arbitrarily, and the bag items can be iterated.  Bags are used to process
  * rmaps into refcount btree entries.
+ *
+ * Reverse mappings of a big reflinked filesystem can need more memory than
+ * the machine has.  If the user gives us a spill directory, then once the
+ * slabs use more than the spill threshold, new slabs are carved out of a
+ * shared mapping of an unlinked temporary file instead of being malloc'd.
+ * The kernel can then write them out and reclaim the memory whenever it
+ * likes.  Since every slab is sorted separately and the cursor merges the
+ * sorted slabs, sorting and walking a spilled slab only ever touches the
+ * file sequentially.
  */
 
 /*
@@ -44,6 +55,9 @@ struct xfs_slab_hdr {
 	size_t			sh_nr;
 	size_t			sh_inuse;	/* items in use */
 	struct xfs_slab_hdr	*sh_next;	/* next slab hdr */
+	size_t			sh_maplen;	/* mapping length if spilled */
+	off_t			sh_mapoff;	/* file offset if spilled */
+	bool			sh_huge;	/* on huge pages */
 						/* objects follow */
 };
 
@@ -53,18 +67,52 @@ struct xfs_slab {
 	size_t			s_nr_items;	/* # of items */
 	struct xfs_slab_hdr	*s_first;	/* first slab header */
 	struct xfs_slab_hdr	*s_last;	/* last sh_next pointer */
+	size_t			s_run_nr;	/* items per sorted run */
+	int			s_spill_fd;	/* spill file, or -1 */
+	off_t			s_spill_size;	/* size of spill file */
 };
 
+static char		*slab_spill_dir;
+static size_t		slab_spill_threshold;
+static size_t		slab_incore_bytes;	/* malloc'd slab memory */
+
+/*
+ * Huge pages -- at hundreds of gigabytes of slabs, block maps and inode
+ * records, walking them misses the TLB all the time.  If asked to, we put
+ * every allocation of at least a huge page on its own mapping, backed either
+ * by explicit hugetlbfs pages (2M, or 1G for allocations that big) or, if
+ * none are reserved, by transparent huge pages.  Nothing is touched here, so
+ * the pages are faulted in on the node of the AG worker that first fills
+ * them, just like malloc'd memory would be.
+ */
+#define SLAB_GIANT_PAGE_SIZE	(1UL << 30)
+
+#ifndef MAP_HUGE_SHIFT
+# define MAP_HUGE_SHIFT		26
+#endif
+#ifndef MAP_HUGE_2MB
+# define MAP_HUGE_2MB		(21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+# define MAP_HUGE_1GB		(30 << MAP_HUGE_SHIFT)
+#endif
+
+static enum slab_hugepages	slab_hugepages;
+static size_t		slab_hugetlb_bytes;	/* ever mapped, hugetlbfs */
+static size_t		slab_thp_bytes;		/* ever mapped, THP */
+
 /*
- * Slab cursors -- each slab_hdr_cursor tracks a slab_hdr; the slab_cursor
- * tracks the slab_hdr_cursors.  If a compare_fn is specified, the cursor
- * returns objects in increasing order (if you've previously sorted the
- * slabs with qsort_slab()).  If compare_fn == NULL, it returns slab items
- * in order.
+ * Slab cursors -- qsort_slab() sorts each slab_hdr in one or more runs, and
+ * each slab_hdr_cursor tracks one run; the slab_cursor tracks the
+ * slab_hdr_cursors.  If a compare_fn is specified, the cursor returns
+ * objects in increasing order (if you've previously sorted the slabs with
+ * qsort_slab()) by keeping the runs in a binary min-heap.  If compare_fn ==
+ * NULL, it returns slab items in order.
  */
 struct xfs_slab_hdr_cursor {
 	struct xfs_slab_hdr	*hdr;		/* a slab header */
 	size_t			loc;		/* where we are in the slab */
+	size_t			end;		/* end of this run */
 };
 
 typedef int (*xfs_slab_compare_fn)(const void *, const void *);
@@ -74,6 +122,8 @@ struct xfs_slab_cursor {
 	struct xfs_slab			*slab;		/* pointer to the slab */
 	struct xfs_slab_hdr_cursor	*last_hcur;	/* last header we took from */
 	xfs_slab_compare_fn		compare_fn;	/* compare items */
+	size_t				heap_nr;	/* runs left in heap */
+	struct xfs_slab_hdr_cursor	**heap;		/* runs by next item */
 	struct xfs_slab_hdr_cursor	hcur[0];	/* per-slab cursors */
 };
 
@@ -104,11 +154,341 @@ init_slab(
 		return -ENOMEM;
 	ptr->s_item_sz = item_size;
 	ptr->s_last = NULL;
+	ptr->s_spill_fd = -1;
 	*slab = ptr;
 
 	return 0;
 }
 
+static int
+slab_open_spill(void)
+{
+	char		*path;
+	int		fd;
+
+#ifdef O_TMPFILE
+	fd = open(slab_spill_dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+	if (fd >= 0)
+		return fd;
+#endif
+	if (asprintf(&path, "%s/xfs_repair.slab.XXXXXX", slab_spill_dir) < 0)
+		return -1;
+	fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+/*
+ * Allow slabs to spill into temporary files in @dir once more than
+ * @threshold bytes of slab memory have been allocated.
+ */
+int
+slab_set_spill(
+	const char	*dir,
+	size_t		threshold)
+{
+	int		fd;
+	int		error;
+
+	free(slab_spill_dir);
+	slab_spill_dir = NULL;
+	if (!dir)
+		return 0;
+
+	slab_spill_dir = strdup(dir);
+	if (!slab_spill_dir)
+		return -ENOMEM;
+	slab_spill_threshold = threshold;
+
+	/* make sure we can actually create spill files */
+	fd = slab_open_spill();
+	if (fd < 0) {
+		error = -errno;
+		free(slab_spill_dir);
+		slab_spill_dir = NULL;
+		return error;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Are we allowed to spill things to disk? */
+bool
+slab_spilling(void)
+{
+	return slab_spill_dir != NULL;
+}
+
+/* Back big allocations with huge pages from now on. */
+void
+slab_set_hugepages(
+	enum slab_hugepages	mode)
+{
+	slab_hugepages = mode;
+}
+
+static inline bool
+slab_huge_giant(
+	size_t			len)
+{
+	return slab_hugepages == SLAB_HUGE_1G && len >= SLAB_GIANT_PAGE_SIZE;
+}
+
+/* Length of the mapping behind a huge allocation of @len bytes. */
+static inline size_t
+slab_huge_len(
+	size_t			len)
+{
+	if (slab_huge_giant(len))
+		return roundup(len, SLAB_GIANT_PAGE_SIZE);
+	return roundup(len, SLAB_HUGE_PAGE_SIZE);
+}
+
+/*
+ * Map @len bytes on huge pages.  Returns NULL if huge pages are turned off,
+ * @len is less than a huge page, or we can't get the mapping, in which case
+ * the caller should fall back to malloc.
+ */
+void *
+slab_alloc_huge(
+	size_t			len)
+{
+	size_t			maplen;
+	char			*p, *aligned;
+	int			flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	if (slab_hugepages == SLAB_HUGE_OFF || len < SLAB_HUGE_PAGE_SIZE)
+		return NULL;
+	maplen = slab_huge_len(len);
+
+	if (slab_hugepages != SLAB_HUGE_THP) {
+		p = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+				flags | MAP_HUGETLB | (slab_huge_giant(len) ?
+					MAP_HUGE_1GB : MAP_HUGE_2MB), -1, 0);
+		if (p != MAP_FAILED) {
+			uatomic_add(&slab_hugetlb_bytes, maplen);
+			goto out;
+		}
+	}
+
+	/* no reserved huge pages; align a mapping and ask for THP */
+	p = mmap(NULL, maplen + SLAB_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	aligned = (char *)roundup((uintptr_t)p, SLAB_HUGE_PAGE_SIZE);
+	if (aligned > p)
+		munmap(p, aligned - p);
+	if (aligned + maplen < p + maplen + SLAB_HUGE_PAGE_SIZE)
+		munmap(aligned + maplen,
+			p + SLAB_HUGE_PAGE_SIZE - aligned);
+	p = aligned;
+	madvise(p, maplen, MADV_HUGEPAGE);
+	uatomic_add(&slab_thp_bytes, maplen);
+out:
+	uatomic_add(&slab_incore_bytes, maplen);
+	return p;
+}
+
+void
+slab_free_huge(
+	void			*p,
+	size_t			len)
+{
+	size_t			maplen = slab_huge_len(len);
+
+	munmap(p, maplen);
+	uatomic_sub(&slab_incore_bytes, maplen);
+}
+
+/* Say how much memory we put on huge pages. */
+void
+slab_report_hugepages(void)
+{
+	if (slab_hugepages == SLAB_HUGE_OFF)
+		return;
+
+	do_log(
+_("        - huge pages: %zu MiB hugetlbfs, %zu MiB transparent\n"),
+			uatomic_read(&slab_hugetlb_bytes) >> 20,
+			uatomic_read(&slab_thp_bytes) >> 20);
+}
+
+/* Allocate a slab header and its items out of the spill file. */
+static struct xfs_slab_hdr *
+slab_spill_hdr(
+	struct xfs_slab		*slab,
+	size_t			len)
+{
+	struct xfs_slab_hdr	*hdr;
+	size_t			maplen;
+
+	if (slab->s_spill_fd < 0) {
+		slab->s_spill_fd = slab_open_spill();
+		if (slab->s_spill_fd < 0)
+			return NULL;
+	}
+
+	/*
+	 * Allocate the blocks up front.  A sparse file would let us map it
+	 * and then SIGBUS when a store can't get a block on a full disk.
+	 */
+	maplen = roundup(len, getpagesize());
+	if (posix_fallocate(slab->s_spill_fd, slab->s_spill_size, maplen))
+		return NULL;
+	hdr = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+			slab->s_spill_fd, slab->s_spill_size);
+	if (hdr == MAP_FAILED)
+		return NULL;
+	madvise(hdr, maplen, MADV_SEQUENTIAL);
+
+	hdr->sh_maplen = maplen;
+	hdr->sh_mapoff = slab->s_spill_size;
+	slab->s_spill_size += maplen;
+	return hdr;
+}
+
+/*
+ * A spilled slab header has filled up; start writing it back so that the
+ * kernel can reclaim the memory without having to wait for I/O.
+ */
+static void
+slab_spill_full(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr)
+{
+	/* this header was moved here from another slab's spill file */
+	if (hdr->sh_mapoff < 0)
+		return;
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(slab->s_spill_fd, hdr->sh_mapoff, hdr->sh_maplen,
+			SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+static struct xfs_slab_hdr *
+slab_alloc_hdr(
+	struct xfs_slab		*slab,
+	size_t			n)
+{
+	struct xfs_slab_hdr	*hdr = NULL;
+	size_t			len;
+
+	len = sizeof(struct xfs_slab_hdr) + (n * slab->s_item_sz);
+	if (slab_spill_dir &&
+	    uatomic_read(&slab_incore_bytes) + len > slab_spill_threshold)
+		hdr = slab_spill_hdr(slab, len);
+
+	/* fall back to memory if we can't spill */
+	if (!hdr) {
+		hdr = slab_alloc_huge(len);
+		if (hdr) {
+			hdr->sh_huge = true;
+		} else {
+			hdr = malloc(len);
+			if (!hdr)
+				return NULL;
+			hdr->sh_huge = false;
+			uatomic_add(&slab_incore_bytes, len);
+		}
+		hdr->sh_maplen = 0;
+	} else {
+		hdr->sh_huge = false;
+	}
+
+	hdr->sh_nr = n;
+	hdr->sh_inuse = 0;
+	hdr->sh_next = NULL;
+	return hdr;
+}
+
+static void
+slab_free_hdr(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr)
+{
+	size_t			len;
+
+	if (hdr->sh_maplen) {
+		munmap(hdr, hdr->sh_maplen);
+		return;
+	}
+	len = sizeof(struct xfs_slab_hdr) + (hdr->sh_nr * slab->s_item_sz);
+	if (hdr->sh_huge) {
+		slab_free_huge(hdr, len);
+		return;
+	}
+	uatomic_sub(&slab_incore_bytes, len);
+	free(hdr);
+}
+
+/*
+ * Allocate a big flat array for some other part of repair out of the same
+ * memory budget as the slabs.  Once we're over the spill threshold it goes
+ * in a spill file of its own instead of memory.  *where says which, so
+ * that slab_free_array can undo it.
+ */
+void *
+slab_alloc_array(
+	size_t			len,
+	enum slab_mem		*where)
+{
+	void			*p;
+	int			fd;
+
+	*where = SLAB_MEM_HEAP;
+	if (slab_spill_dir &&
+	    uatomic_read(&slab_incore_bytes) + len > slab_spill_threshold) {
+		fd = slab_open_spill();
+		if (fd >= 0) {
+			p = MAP_FAILED;
+			if (!ftruncate(fd, roundup(len, getpagesize())))
+				p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+						MAP_SHARED, fd, 0);
+			close(fd);
+			if (p != MAP_FAILED) {
+				*where = SLAB_MEM_SPILL;
+				return p;
+			}
+		}
+	}
+
+	p = slab_alloc_huge(len);
+	if (p) {
+		*where = SLAB_MEM_HUGE;
+		return p;
+	}
+
+	p = malloc(len);
+	if (p)
+		uatomic_add(&slab_incore_bytes, len);
+	return p;
+}
+
+void
+slab_free_array(
+	void			*p,
+	size_t			len,
+	enum slab_mem		where)
+{
+	if (!p)
+		return;
+	switch (where) {
+	case SLAB_MEM_SPILL:
+		munmap(p, len);
+		return;
+	case SLAB_MEM_HUGE:
+		slab_free_huge(p, len);
+		return;
+	case SLAB_MEM_HEAP:
+		break;
+	}
+	uatomic_sub(&slab_incore_bytes, len);
+	free(p);
+}
+
 /*
  * Frees a slab.
  */
@@ -126,9 +506,11 @@ free_slab(
 	hdr = ptr->s_first;
 	while (hdr) {
 		nhdr = hdr->sh_next;
-		free(hdr);
+		slab_free_hdr(ptr, hdr);
 		hdr = nhdr;
 	}
+	if (ptr->s_spill_fd >= 0)
+		close(ptr->s_spill_fd);
 	free(ptr);
 	*slab = NULL;
 }
@@ -165,12 +547,11 @@ slab_add(
 		n = (hdr ? hdr->sh_nr * 2 : MIN_SLAB_NR);
 		if (n * slab->s_item_sz > MAX_SLAB_SIZE)
 			n = MAX_SLAB_SIZE / slab->s_item_sz;
-		hdr = malloc(sizeof(struct xfs_slab_hdr) + (n * slab->s_item_sz));
+		if (hdr && hdr->sh_maplen)
+			slab_spill_full(slab, hdr);
+		hdr = slab_alloc_hdr(slab, n);
 		if (!hdr)
 			return -ENOMEM;
-		hdr->sh_nr = n;
-		hdr->sh_inuse = 0;
-		hdr->sh_next = NULL;
 		if (slab->s_last)
 			slab->s_last->sh_next = hdr;
 		if (!slab->s_first)
@@ -188,9 +569,16 @@ slab_add(
 
 #include "threads.h"
 
+/*
+ * Sort runs of at most this many items, so that even a slab with a single
+ * huge header can be sorted by all the CPUs.
+ */
+#define SLAB_SORT_RUN_NR	(1U << 16)
+
 struct qsort_slab {
 	struct xfs_slab		*slab;
-	struct xfs_slab_hdr	*hdr;
+	void			*base;
+	size_t			nr;
 	int			(*compare_fn)(const void *, const void *);
 };
 
@@ -202,8 +590,7 @@ qsort_slab_helper(
 {
 	struct qsort_slab	*qs = arg;
 
-	qsort(slab_ptr(qs->slab, qs->hdr, 0), qs->hdr->sh_inuse,
-			qs->slab->s_item_sz, qs->compare_fn);
+	qsort(qs->base, qs->nr, qs->slab->s_item_sz, qs->compare_fn);
 	free(qs);
 }
 
@@ -219,71 +606,289 @@ qsort_slab(
 	struct workqueue	wq;
 	struct xfs_slab_hdr	*hdr;
 	struct qsort_slab	*qs;
+	size_t			i;
 
 	/*
-	 * If we don't have that many slabs, we're probably better
+	 * If we don't have that many items, we're probably better
 	 * off skipping all the thread overhead.
 	 */
-	if (slab->s_nr_slabs <= 4) {
+	if (slab->s_nr_items <= SLAB_SORT_RUN_NR * 4) {
+		slab->s_run_nr = 0;
 		hdr = slab->s_first;
 		while (hdr) {
-			qsort(slab_ptr(slab, hdr, 0), hdr->sh_inuse,
-					slab->s_item_sz, compare_fn);
+			if (hdr->sh_inuse)
+				qsort(slab_ptr(slab, hdr, 0), hdr->sh_inuse,
+						slab->s_item_sz, compare_fn);
 			hdr = hdr->sh_next;
 		}
 		return;
 	}
 
+	/* The cursor merges the sorted runs for us. */
+	slab->s_run_nr = SLAB_SORT_RUN_NR;
 	create_work_queue(&wq, NULL, platform_nproc());
 	hdr = slab->s_first;
 	while (hdr) {
-		qs = malloc(sizeof(struct qsort_slab));
-		qs->slab = slab;
-		qs->hdr = hdr;
-		qs->compare_fn = compare_fn;
-		queue_work(&wq, qsort_slab_helper, 0, qs);
+		for (i = 0; i < hdr->sh_inuse; i += SLAB_SORT_RUN_NR) {
+			size_t	nr = min((size_t)SLAB_SORT_RUN_NR,
+					 hdr->sh_inuse - i);
+
+			qs = malloc(sizeof(struct qsort_slab));
+			if (!qs) {
+				qsort(slab_ptr(slab, hdr, i), nr,
+						slab->s_item_sz, compare_fn);
+				continue;
+			}
+			qs->slab = slab;
+			qs->base = slab_ptr(slab, hdr, i);
+			qs->nr = nr;
+			qs->compare_fn = compare_fn;
+			queue_work(&wq, qsort_slab_helper, 0, qs);
+		}
 		hdr = hdr->sh_next;
 	}
 	destroy_work_queue(&wq);
 }
 
+/* Number of sorted runs in a slab header. */
+static inline size_t
+slab_hdr_runs(
+	struct xfs_slab		*slab,
+	struct xfs_slab_hdr	*hdr)
+{
+	if (!slab->s_run_nr)
+		return 1;
+	return max((size_t)1, howmany(hdr->sh_inuse, slab->s_run_nr));
+}
+
+static inline void *
+slab_hcur_ptr(
+	struct xfs_slab_cursor		*cur,
+	struct xfs_slab_hdr_cursor	*hcur)
+{
+	return slab_ptr(cur->slab, hcur->hdr, hcur->loc);
+}
+
+static inline bool
+slab_heap_less(
+	struct xfs_slab_cursor		*cur,
+	size_t				a,
+	size_t				b)
+{
+	return cur->compare_fn(slab_hcur_ptr(cur, cur->heap[a]),
+			       slab_hcur_ptr(cur, cur->heap[b])) < 0;
+}
+
+static void
+slab_heap_sift_down(
+	struct xfs_slab_cursor		*cur,
+	size_t				i)
+{
+	struct xfs_slab_hdr_cursor	*tmp;
+	size_t				child;
+
+	while ((child = 2 * i + 1) < cur->heap_nr) {
+		if (child + 1 < cur->heap_nr &&
+		    slab_heap_less(cur, child + 1, child))
+			child++;
+		if (!slab_heap_less(cur, child, i))
+			break;
+		tmp = cur->heap[i];
+		cur->heap[i] = cur->heap[child];
+		cur->heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Find the first item in [lo, hi) of a sorted run that isn't less than key. */
+static size_t
+slab_lower_bound(
+	struct xfs_slab_cursor		*cur,
+	struct xfs_slab_hdr		*hdr,
+	size_t				lo,
+	size_t				hi,
+	const void			*key)
+{
+	size_t				mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cur->compare_fn(slab_ptr(cur->slab, hdr, mid), key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 /*
- * init_slab_cursor() -- Create a slab cursor to iterate the slab items.
- *
- * @slab: The slab.
- * @compare_fn: If specified, use this function to return items in ascending order.
- * @cur: The new cursor.
+ * Create a cursor that only returns the items that sort between @lo
+ * (inclusive) and @hi (exclusive).  Either bound may be NULL.
  */
-int
-init_slab_cursor(
+static int
+__init_slab_cursor(
 	struct xfs_slab		*slab,
 	int (*compare_fn)(const void *, const void *),
+	const void		*lo,
+	const void		*hi,
 	struct xfs_slab_cursor	**cur)
 {
 	struct xfs_slab_cursor	*c;
 	struct xfs_slab_hdr_cursor	*hcur;
 	struct xfs_slab_hdr	*hdr;
+	size_t			nr = 0;
+	size_t			i;
+
+	for (hdr = slab->s_first; hdr; hdr = hdr->sh_next)
+		nr += slab_hdr_runs(slab, hdr);
 
 	c = malloc(sizeof(struct xfs_slab_cursor) +
-		   (sizeof(struct xfs_slab_hdr_cursor) * slab->s_nr_slabs));
+		   (sizeof(struct xfs_slab_hdr_cursor) * nr) +
+		   (sizeof(struct xfs_slab_hdr_cursor *) * nr));
 	if (!c)
 		return -ENOMEM;
-	c->nr = slab->s_nr_slabs;
+	c->nr = nr;
 	c->slab = slab;
 	c->compare_fn = compare_fn;
 	c->last_hcur = NULL;
-	hcur = (struct xfs_slab_hdr_cursor *)(c + 1);
-	hdr = slab->s_first;
-	while (hdr) {
-		hcur->hdr = hdr;
-		hcur->loc = 0;
-		hcur++;
-		hdr = hdr->sh_next;
+	c->heap = (struct xfs_slab_hdr_cursor **)&c->hcur[nr];
+	c->heap_nr = 0;
+	hcur = c->hcur;
+	for (hdr = slab->s_first; hdr; hdr = hdr->sh_next) {
+		for (i = 0; i < slab_hdr_runs(slab, hdr); i++, hcur++) {
+			hcur->hdr = hdr;
+			if (slab->s_run_nr) {
+				hcur->loc = i * slab->s_run_nr;
+				hcur->end = min(hcur->loc + slab->s_run_nr,
+						hdr->sh_inuse);
+			} else {
+				hcur->loc = 0;
+				hcur->end = hdr->sh_inuse;
+			}
+			if (lo)
+				hcur->loc = slab_lower_bound(c, hdr, hcur->loc,
+						hcur->end, lo);
+			if (hi)
+				hcur->end = slab_lower_bound(c, hdr, hcur->loc,
+						hcur->end, hi);
+			if (compare_fn && hcur->loc < hcur->end)
+				c->heap[c->heap_nr++] = hcur;
+		}
+	}
+
+	if (compare_fn) {
+		for (i = c->heap_nr / 2; i > 0; i--)
+			slab_heap_sift_down(c, i - 1);
 	}
 	*cur = c;
 	return 0;
 }
 
+/*
+ * init_slab_cursor() -- Create a slab cursor to iterate the slab items.
+ *
+ * @slab: The slab.
+ * @compare_fn: If specified, use this function to return items in ascending order.
+ * @cur: The new cursor.
+ */
+int
+init_slab_cursor(
+	struct xfs_slab		*slab,
+	int (*compare_fn)(const void *, const void *),
+	struct xfs_slab_cursor	**cur)
+{
+	return __init_slab_cursor(slab, compare_fn, NULL, NULL, cur);
+}
+
+static int
+slab_sample_cmp(
+	const void		*a,
+	const void		*b,
+	void			*priv)
+{
+	xfs_slab_compare_fn	compare_fn = priv;
+
+	return compare_fn(*(void * const *)a, *(void * const *)b);
+}
+
+/*
+ * Split a sorted slab into @nr cursors covering disjoint, ascending ranges
+ * of items, so that several threads can merge the slab at the same time.
+ * Equal items always end up in the same range.  The range boundaries are
+ * picked from a sample of every sorted run so that the ranges come out
+ * roughly the same size.  Returns the number of cursors created, which can
+ * be fewer than asked for.
+ */
+int
+init_slab_cursors_split(
+	struct xfs_slab		*slab,
+	int (*compare_fn)(const void *, const void *),
+	unsigned int		nr,
+	struct xfs_slab_cursor	**curs,
+	unsigned int		*nr_curs)
+{
+	struct xfs_slab_cursor	*all;
+	struct xfs_slab_hdr_cursor	*hcur;
+	void			**samples;
+	void			*lo = NULL, *hi;
+	size_t			nr_samples = 0;
+	size_t			per_run;
+	size_t			i, j;
+	unsigned int		made = 0;
+	int			error;
+
+	error = init_slab_cursor(slab, compare_fn, &all);
+	if (error)
+		return error;
+
+	per_run = max((size_t)1, (nr * 8) / max((size_t)1, all->nr));
+	samples = calloc(all->nr * per_run, sizeof(void *));
+	if (!samples) {
+		free_slab_cursor(&all);
+		return -ENOMEM;
+	}
+	for (i = 0, hcur = all->hcur; i < all->nr; i++, hcur++) {
+		size_t		len = hcur->end - hcur->loc;
+
+		if (!len)
+			continue;
+		for (j = 0; j < per_run; j++)
+			samples[nr_samples++] = slab_ptr(slab, hcur->hdr,
+					hcur->loc + (len * j) / per_run);
+	}
+	qsort_r(samples, nr_samples, sizeof(void *), slab_sample_cmp,
+			compare_fn);
+	if (!nr_samples)
+		nr = 1;
+
+	for (i = 1; i <= nr; i++) {
+		if (i == nr) {
+			hi = NULL;
+		} else {
+			hi = samples[(nr_samples * i) / nr];
+			/* don't make empty ranges */
+			if (lo && compare_fn(lo, hi) >= 0)
+				continue;
+		}
+		error = __init_slab_cursor(slab, compare_fn, lo, hi,
+				&curs[made]);
+		if (error)
+			break;
+		made++;
+		lo = hi;
+	}
+
+	free(samples);
+	free_slab_cursor(&all);
+	if (error) {
+		while (made > 0)
+			free_slab_cursor(&curs[--made]);
+		return error;
+	}
+	*nr_curs = made;
+	return 0;
+}
+
 /*
  * Free the slab cursor.
  */
@@ -306,39 +911,27 @@ peek_slab_cursor(
 	struct xfs_slab_cursor	*cur)
 {
 	struct xfs_slab_hdr_cursor	*hcur;
-	void			*p = NULL;
-	void			*q;
-	size_t			i;
-
-	cur->last_hcur = NULL;
 
 	/* no compare function; inorder traversal */
 	if (!cur->compare_fn) {
-		if (!cur->last_hcur)
-			cur->last_hcur = &cur->hcur[0];
-		hcur = cur->last_hcur;
-		while (hcur < &cur->hcur[cur->nr] &&
-			hcur->loc >= hcur->hdr->sh_inuse)
+		hcur = cur->last_hcur ? cur->last_hcur : &cur->hcur[0];
+		while (hcur < &cur->hcur[cur->nr] && hcur->loc >= hcur->end)
 			hcur++;
-		if (hcur == &cur->hcur[cur->nr])
+		if (hcur == &cur->hcur[cur->nr]) {
+			cur->last_hcur = NULL;
 			return NULL;
-		p = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
+		}
 		cur->last_hcur = hcur;
-		return p;
+		return slab_hcur_ptr(cur, hcur);
 	}
 
 	/* otherwise return things in increasing order */
-	for (i = 0, hcur = &cur->hcur[i]; i < cur->nr; i++, hcur++) {
-		if (hcur->loc >= hcur->hdr->sh_inuse)
-			continue;
-		q = slab_ptr(cur->slab, hcur->hdr, hcur->loc);
-		if (!p || cur->compare_fn(p, q) > 0) {
-			p = q;
-			cur->last_hcur = hcur;
-		}
+	if (!cur->heap_nr) {
+		cur->last_hcur = NULL;
+		return NULL;
 	}
-
-	return p;
+	cur->last_hcur = cur->heap[0];
+	return slab_hcur_ptr(cur, cur->heap[0]);
 }
 
 /*
@@ -350,6 +943,13 @@ advance_slab_cursor(
 {
 	ASSERT(cur->last_hcur);
 	cur->last_hcur->loc++;
+	if (!cur->compare_fn)
+		return;
+
+	ASSERT(cur->last_hcur == cur->heap[0]);
+	if (cur->last_hcur->loc >= cur->last_hcur->end)
+		cur->heap[0] = cur->heap[--cur->heap_nr];
+	slab_heap_sift_down(cur, 0);
 }
 
 /*
@@ -367,6 +967,72 @@ pop_slab_cursor(
 	return p;
 }
 
+/*
+ * Move all the items in @src to the end of @dest, leaving @src empty.  The
+ * slabs must hold items of the same size.
+ */
+void
+slab_concat(
+	struct xfs_slab		*dest,
+	struct xfs_slab		*src)
+{
+	struct xfs_slab_hdr	*hdr;
+
+	ASSERT(dest->s_item_sz == src->s_item_sz);
+	if (!src->s_first)
+		return;
+
+	/* writeback hints use the spill file of the slab they came from */
+	for (hdr = src->s_first; hdr; hdr = hdr->sh_next)
+		if (hdr->sh_maplen)
+			hdr->sh_mapoff = -1;
+
+	/* src's headers were sorted whole, which is fine for any run size */
+	if (dest->s_last)
+		dest->s_last->sh_next = src->s_first;
+	else
+		dest->s_first = src->s_first;
+	dest->s_last = src->s_last;
+	dest->s_nr_slabs += src->s_nr_slabs;
+	dest->s_nr_items += src->s_nr_items;
+
+	src->s_first = src->s_last = NULL;
+	src->s_nr_slabs = 0;
+	src->s_nr_items = 0;
+}
+
+/* Return the last item added to the slab, or NULL if it's empty. */
+void *
+slab_last(
+	struct xfs_slab		*slab)
+{
+	struct xfs_slab_hdr	*hdr;
+	struct xfs_slab_hdr	*last = NULL;
+
+	for (hdr = slab->s_first; hdr; hdr = hdr->sh_next)
+		if (hdr->sh_inuse)
+			last = hdr;
+	if (!last)
+		return NULL;
+	return slab_ptr(slab, last, last->sh_inuse - 1);
+}
+
+/* Remove the last item added to the slab. */
+void
+slab_remove_last(
+	struct xfs_slab		*slab)
+{
+	struct xfs_slab_hdr	*hdr;
+	struct xfs_slab_hdr	*last = NULL;
+
+	for (hdr = slab->s_first; hdr; hdr = hdr->sh_next)
+		if (hdr->sh_inuse)
+			last = hdr;
+	ASSERT(last != NULL);
+	last->sh_inuse--;
+	slab->s_nr_items--;
+}
+
 /*
  * Return the number of items in the slab.
  */
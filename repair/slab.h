@@ -9,15 +9,46 @@
 struct xfs_slab;
 struct xfs_slab_cursor;
 
+/* Where slab_alloc_array put an array. */
+enum slab_mem {
+	SLAB_MEM_HEAP,		/* malloc */
+	SLAB_MEM_SPILL,		/* spill file */
+	SLAB_MEM_HUGE,		/* huge page mapping */
+};
+
+enum slab_hugepages {
+	SLAB_HUGE_OFF,
+	SLAB_HUGE_THP,		/* transparent huge pages only */
+	SLAB_HUGE_2M,		/* hugetlbfs 2M pages, else THP */
+	SLAB_HUGE_1G,		/* hugetlbfs 1G pages for 1G arrays, else 2M */
+};
+
+#define SLAB_HUGE_PAGE_SIZE	(2UL << 20)
+
 extern int init_slab(struct xfs_slab **, size_t);
 extern void free_slab(struct xfs_slab **);
+extern int slab_set_spill(const char *dir, size_t threshold);
+extern bool slab_spilling(void);
+extern void *slab_alloc_array(size_t len, enum slab_mem *where);
+extern void slab_free_array(void *p, size_t len, enum slab_mem where);
+
+extern void slab_set_hugepages(enum slab_hugepages mode);
+extern void *slab_alloc_huge(size_t len);
+extern void slab_free_huge(void *p, size_t len);
+extern void slab_report_hugepages(void);
 
 extern int slab_add(struct xfs_slab *, void *);
 extern void qsort_slab(struct xfs_slab *, int (*)(const void *, const void *));
 extern size_t slab_count(struct xfs_slab *);
+extern void slab_concat(struct xfs_slab *, struct xfs_slab *);
+extern void *slab_last(struct xfs_slab *);
+extern void slab_remove_last(struct xfs_slab *);
 
 extern int init_slab_cursor(struct xfs_slab *,
 	int (*)(const void *, const void *), struct xfs_slab_cursor **);
+extern int init_slab_cursors_split(struct xfs_slab *,
+	int (*)(const void *, const void *), unsigned int,
+	struct xfs_slab_cursor **, unsigned int *);
 extern void free_slab_cursor(struct xfs_slab_cursor **);
 
 extern void *peek_slab_cursor(struct xfs_slab_cursor *);
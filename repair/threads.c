@@ -7,6 +7,7 @@
 #include "err_protos.h"
 #include "protos.h"
 #include "globals.h"
+#include "progress.h"
 
 void
 thread_init(void)
@@ -31,7 +32,7 @@ create_work_queue(
 {
 	int			err;
 
-	err = -workqueue_create(wq, mp, nworkers);
+	err = -workqueue_create_affine(wq, mp, nworkers, 0, worker_affinity);
 	if (err)
 		do_error(_("cannot create worker threads, error = [%d] %s\n"),
 				err, strerror(err));
@@ -52,6 +53,101 @@ queue_work(
 				err, strerror(err));
 }
 
+void
+queue_work_batch(
+	struct workqueue	*wq,
+	struct workqueue_work	*work,
+	unsigned int		nr)
+{
+	int			err;
+
+	err = -workqueue_add_batch(wq, work, nr);
+	if (err)
+		do_error(_("cannot allocate worker item, error = [%d] %s\n"),
+				err, strerror(err));
+}
+
+/* Charge the work done on an AG to that AG in the usage report. */
+struct ag_usage_work {
+	workqueue_func_t	*func;
+	void			*arg;
+};
+
+static void
+ag_usage_work_fn(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct ag_usage_work	*uw = arg;
+	struct ag_usage_mark	mark;
+
+	ag_usage_begin(&mark);
+	uw->func(wq, agno, uw->arg);
+	ag_usage_end(&mark, agno);
+	free(uw);
+}
+
+/*
+ * Queue @func once for each AG.  If @args is not NULL, AG i is passed the
+ * i'th element of the array of @argsize byte elements at @args; an @argsize of
+ * zero passes @args itself to every AG.
+ *
+ * If the workers are spread over NUMA nodes, each AG always goes to the same
+ * node, so that the incore records that the first pass over an AG allocates
+ * (and the kernel places on the local node) stay local in later phases.
+ */
+void
+queue_work_per_ag(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agcount,
+	void			*args,
+	size_t			argsize)
+{
+	struct workqueue_work	*work;
+	xfs_agnumber_t		agno;
+	unsigned int		node;
+
+	work = malloc(agcount * sizeof(struct workqueue_work));
+	if (!work)
+		do_error(_("cannot allocate worker items\n"));
+
+	for (node = 0; node < wq->nr_nodes; node++) {
+		unsigned int	nr = 0;
+		int		err;
+
+		for (agno = node; agno < agcount; agno += wq->nr_nodes) {
+			work[nr].function = func;
+			work[nr].index = agno;
+			work[nr].arg = args ? (char *)args + agno * argsize :
+					      NULL;
+			if (phase_report_enabled()) {
+				struct ag_usage_work	*uw;
+
+				uw = malloc(sizeof(struct ag_usage_work));
+				if (!uw)
+					do_error(
+				_("cannot allocate worker items\n"));
+				uw->func = func;
+				uw->arg = work[nr].arg;
+				work[nr].function = ag_usage_work_fn;
+				work[nr].arg = uw;
+			}
+			nr++;
+		}
+		if (!nr)
+			continue;
+
+		err = -workqueue_add_batch_node(wq, node, work, nr);
+		if (err)
+			do_error(
+	_("cannot allocate worker item, error = [%d] %s\n"),
+					err, strerror(err));
+	}
+	free(work);
+}
+
 void
 destroy_work_queue(
 	struct workqueue	*wq)
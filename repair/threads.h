@@ -20,6 +20,20 @@ queue_work(
 	xfs_agnumber_t 		agno,
 	void			*arg);
 
+void
+queue_work_batch(
+	struct workqueue	*wq,
+	struct workqueue_work	*work,
+	unsigned int		nr);
+
+void
+queue_work_per_ag(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agcount,
+	void			*args,
+	size_t			argsize);
+
 void
 destroy_work_queue(
 	struct workqueue	*wq);
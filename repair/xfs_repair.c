@@ -8,7 +8,6 @@
 #include "libxlog.h"
 #include <sys/resource.h>
 #include "xfs_multidisk.h"
-#include "avl.h"
 #include "libfrog/avl64.h"
 #include "globals.h"
 #include "versions.h"
@@ -26,6 +25,11 @@
 #include "libfrog/platform.h"
 #include "bulkload.h"
 #include "quotacheck.h"
+#include "memplan.h"
+#include "mempressure.h"
+#include "checkpoint.h"
+#include "pftrace.h"
+#include "incremental.h"
 
 /*
  * option tables for getsubopt calls
@@ -44,6 +48,21 @@ enum o_opt_nums {
 	BLOAD_LEAF_SLACK,
 	BLOAD_NODE_SLACK,
 	NOQUOTA,
+	BCACHE_POLICY,
+	AFFINITY,
+	PREFETCH_IORING,
+	SLAB_SPILL,
+	MEMORY_PLAN,
+	CHECKPOINT,
+	REPORT_FILE,
+	REPORT_FORMAT,
+	STATUS_FILE,
+	PF_TRACE,
+	INCREMENTAL,
+	AG_RANGE,
+	INCREMENTAL_MERGE,
+	REPLAY_LOG,
+	HUGEPAGES,
 	O_MAX_OPTS,
 };
 
@@ -57,6 +76,21 @@ static char *o_opts[] = {
 	[BLOAD_LEAF_SLACK]	= "debug_bload_leaf_slack",
 	[BLOAD_NODE_SLACK]	= "debug_bload_node_slack",
 	[NOQUOTA]		= "noquota",
+	[BCACHE_POLICY]		= "bcache_policy",
+	[AFFINITY]		= "affinity",
+	[PREFETCH_IORING]	= "prefetch_ioring",
+	[SLAB_SPILL]		= "slab_spill",
+	[MEMORY_PLAN]		= "memory_plan",
+	[CHECKPOINT]		= "checkpoint",
+	[REPORT_FILE]		= "report",
+	[REPORT_FORMAT]		= "report_format",
+	[STATUS_FILE]		= "status",
+	[PF_TRACE]		= "pf_trace",
+	[INCREMENTAL]		= "incremental",
+	[AG_RANGE]		= "ag_range",
+	[INCREMENTAL_MERGE]	= "incremental_merge",
+	[REPLAY_LOG]		= "replay_log",
+	[HUGEPAGES]		= "hugepages",
 	[O_MAX_OPTS]		= NULL,
 };
 
@@ -81,6 +115,15 @@ static char *c_opts[] = {
 static int	bhash_option_used;
 static long	max_mem_specified;	/* in megabytes */
 static int	phase2_threads = 32;
+static char	*slab_spill_dir;
+static bool	memplan;
+static bool	memplan_sample;
+static bool	checkpoint_used;
+static char	*report_file;
+static char	*pf_trace_file;
+static char	*incremental_file;
+static bool	incremental_extras;
+static bool	report_csv;
 static bool	report_corrected;
 
 static void
@@ -204,6 +247,7 @@ process_args(int argc, char **argv)
 	dangerously = 0;
 	isa_file = 0;
 	zap_log = 0;
+	replay_log = 0;
 	dumpcore = 0;
 	full_ino_ex_data = 0;
 	force_geo = 0;
@@ -287,6 +331,134 @@ process_args(int argc, char **argv)
 				case NOQUOTA:
 					quotacheck_skip();
 					break;
+				case BCACHE_POLICY:
+					if (!val)
+						do_abort(
+		_("-o bcache_policy requires a parameter\n"));
+					if (!strcmp(val, "clock"))
+						bcache_flags |= CACHE_SCAN_RESISTANT;
+					else if (!strcmp(val, "lru"))
+						bcache_flags &= ~CACHE_SCAN_RESISTANT;
+					else
+						do_abort(
+		_("-o bcache_policy must be \"lru\" or \"clock\"\n"));
+					break;
+				case AFFINITY:
+					if (!val)
+						do_abort(
+		_("-o affinity requires a parameter\n"));
+					if (!strcmp(val, "none"))
+						worker_affinity = WQ_AFFINITY_NONE;
+					else if (!strcmp(val, "node"))
+						worker_affinity = WQ_AFFINITY_NODE;
+					else if (!strcmp(val, "cpu"))
+						worker_affinity = WQ_AFFINITY_CPU;
+					else
+						do_abort(
+		_("-o affinity must be \"none\", \"node\" or \"cpu\"\n"));
+					break;
+				case PREFETCH_IORING:
+					if (!val)
+						do_abort(
+		_("-o prefetch_ioring requires a parameter\n"));
+					pf_ioring_depth = strtoul(val, NULL, 0);
+					break;
+				case SLAB_SPILL:
+					if (!val)
+						do_abort(
+		_("-o slab_spill requires a parameter\n"));
+					slab_spill_dir = val;
+					break;
+				case MEMORY_PLAN:
+					if (val && strcmp(val, "sample"))
+						do_abort(
+		_("-o memory_plan only takes \"sample\" as a parameter\n"));
+					memplan = true;
+					memplan_sample = val != NULL;
+					no_modify = 1;
+					break;
+				case CHECKPOINT:
+					if (!val)
+						do_abort(
+		_("-o checkpoint requires a parameter\n"));
+					checkpoint_setup(val);
+					checkpoint_used = true;
+					break;
+				case REPORT_FILE:
+					if (!val)
+						do_abort(
+		_("-o report requires a parameter\n"));
+					report_file = val;
+					break;
+				case REPORT_FORMAT:
+					if (!val)
+						do_abort(
+		_("-o report_format requires a parameter\n"));
+					if (!strcmp(val, "csv"))
+						report_csv = true;
+					else if (!strcmp(val, "json"))
+						report_csv = false;
+					else
+						do_abort(
+		_("-o report_format must be \"json\" or \"csv\"\n"));
+					break;
+				case STATUS_FILE:
+					if (!val)
+						do_abort(
+		_("-o status requires a parameter\n"));
+					progress_status_setup(val);
+					break;
+				case PF_TRACE:
+					if (!val)
+						do_abort(
+		_("-o pf_trace requires a parameter\n"));
+					pf_trace_file = val;
+					break;
+				case HUGEPAGES:
+					if (!val || !strcmp(val, "thp"))
+						slab_set_hugepages(
+								SLAB_HUGE_THP);
+					else if (!strcmp(val, "2m"))
+						slab_set_hugepages(
+								SLAB_HUGE_2M);
+					else if (!strcmp(val, "1g"))
+						slab_set_hugepages(
+								SLAB_HUGE_1G);
+					else
+						do_abort(
+		_("-o hugepages must be thp, 2m or 1g\n"));
+					break;
+				case INCREMENTAL:
+					if (!val)
+						do_abort(
+		_("-o incremental requires a parameter\n"));
+					incremental_file = val;
+					break;
+				case AG_RANGE: {
+					unsigned int	first, last;
+					char		c;
+
+					if (!val)
+						do_abort(
+		_("-o ag_range requires a parameter\n"));
+					if (sscanf(val, "%u-%u%c", &first, &last,
+							&c) != 2 || first > last)
+						do_abort(
+		_("-o ag_range must be FIRST-LAST\n"));
+					incremental_set_range(first, last);
+					incremental_extras = true;
+					break;
+				}
+				case INCREMENTAL_MERGE:
+					if (!val)
+						do_abort(
+		_("-o incremental_merge requires a parameter\n"));
+					incremental_add_merge(val);
+					incremental_extras = true;
+					break;
+				case REPLAY_LOG:
+					replay_log = 1;
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -385,6 +557,32 @@ process_args(int argc, char **argv)
 	if (report_corrected && no_modify)
 		usage();
 
+	if (checkpoint_used &&
+	    (convert_lazy_count || add_inobtcount || add_bigtime))
+		do_abort(_("-o checkpoint cannot be used with -c\n"));
+
+	if (report_file)
+		phase_report_setup(report_file, report_csv);
+	if (pf_trace_file)
+		pft_setup(pf_trace_file);
+	if (incremental_file) {
+		if (!no_modify)
+			do_abort(_("-o incremental requires -n\n"));
+		if (checkpoint_used)
+			do_abort(
+	_("-o incremental and -o checkpoint can't be used together\n"));
+		incremental_setup(incremental_file);
+	}
+	if (incremental_extras && !incremental_file)
+		do_abort(
+	_("-o ag_range and -o incremental_merge require -o incremental\n"));
+	if (replay_log) {
+		if (no_modify)
+			do_abort(_("-o replay_log can't be used with -n\n"));
+		if (zap_log)
+			do_abort(_("-o replay_log can't be used with -L\n"));
+	}
+
 	p = getenv("XFS_REPAIR_FAIL_AFTER_PHASE");
 	if (p)
 		fail_after_phase = (int)strtol(p, NULL, 0);
@@ -875,6 +1073,18 @@ unlock:
 	pthread_mutex_unlock(&wb_mutex);
 }
 
+/*
+ * Memory we may use, in kilobytes: whatever -m said, or 3/4 of what the
+ * system, our memory cgroup and our NUMA policy will let us have.
+ */
+static unsigned long
+repair_max_mem(void)
+{
+	if (max_mem_specified)
+		return max_mem_specified * 1024;
+	return platform_memlimit() * 3 / 4;
+}
+
 static inline void
 phase_end(int phase)
 {
@@ -898,6 +1108,7 @@ main(int argc, char **argv)
 	int		rval;
 	struct xfs_ino_geometry	*igeo;
 	int		error;
+	int		resume_phase;
 
 	progname = basename(argv[0]);
 	setlocale(LC_ALL, "");
@@ -1046,13 +1257,14 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (ag_stride && report_interval) {
+	if (progress_rpt_wanted()) {
 		init_progress_rpt();
 		if (msgbuf) {
 			do_log(_("        - reporting progress in intervals of %s\n"),
 			duration(report_interval, msgbuf));
 		}
 	}
+	phase_report_init(glob_agcount);
 
 	/*
 	 * Adjust libxfs cache sizes based on system memory,
@@ -1080,8 +1292,7 @@ main(int argc, char **argv)
 		mem_used = (mp->m_sb.sb_icount >> (10 - 2)) +
 					(mp->m_sb.sb_dblocks >> (10 + 1)) +
 					50000;	/* rough estimate of 50MB overhead */
-		max_mem = max_mem_specified ? max_mem_specified * 1024 :
-					      platform_physmem() * 3 / 4;
+		max_mem = repair_max_mem();
 
 		if (getrlimit(RLIMIT_AS, &rlim) != -1 &&
 					rlim.rlim_cur != RLIM_INFINITY) {
@@ -1092,6 +1303,11 @@ main(int argc, char **argv)
 		} else
 			max_mem = min(max_mem, (LONG_MAX >> 10) + 1);
 
+		if (verbose > 1 && !max_mem_specified &&
+		    platform_memlimit() < platform_physmem())
+			do_log(
+	_("        - memory limited to %luMB by cgroup or NUMA policy\n"),
+				platform_memlimit() / 1024);
 		if (verbose > 1)
 			do_log(
 	_("        - max_mem = %lu, icount = %" PRIu64 ", imem = %" PRIu64 ", dblock = %" PRIu64 ", dmem = %" PRIu64 "\n"),
@@ -1130,15 +1346,31 @@ main(int argc, char **argv)
 				(igeo->inode_cluster_size >> 10));
 		if (libxfs_bhash_size < 512)
 			libxfs_bhash_size = 512;
+		libxfs_buf_arena_set_limit((unsigned long long)max_mem << 10);
 
 		if (verbose)
 			do_log(_("        - block cache size set to %d entries\n"),
 				libxfs_bhash_size * HASH_CACHE_RATIO);
 
-		libxfs_bcache = cache_init(0, libxfs_bhash_size,
+		libxfs_bcache = cache_init(bcache_flags, libxfs_bhash_size,
 						&libxfs_bcache_operations);
 	}
 
+	if (memplan) {
+		unsigned long	max_mem;
+		struct rlimit	rlim;
+
+		max_mem = repair_max_mem();
+		if (getrlimit(RLIMIT_AS, &rlim) != -1 &&
+					rlim.rlim_cur != RLIM_INFINITY)
+			max_mem = min(max_mem, rlim.rlim_cur / 1280);
+		memory_plan(mp, memplan_sample, max_mem);
+		exit(0);
+	}
+
+	/* give back buffer cache rather than get OOM killed */
+	mempressure_start();
+
 	/*
 	 * calculate what mkfs would do to this filesystem
 	 */
@@ -1150,6 +1382,16 @@ main(int argc, char **argv)
 	init_bmaps(mp);
 	incore_ino_init(mp);
 	incore_ext_init(mp);
+	if (slab_spill_dir) {
+		unsigned long long	spill_mem;
+
+		/* spill once the slabs use a quarter of our memory */
+		spill_mem = repair_max_mem();
+		error = slab_set_spill(slab_spill_dir, spill_mem * 1024 / 4);
+		if (error)
+			do_error(_("cannot spill slabs to %s: %s\n"),
+					slab_spill_dir, strerror(-error));
+	}
 	rmaps_init(mp);
 
 	/* initialize random globals now that we know the fs geometry */
@@ -1161,23 +1403,43 @@ main(int argc, char **argv)
 		return(1);
 	}
 
+	/*
+	 * Always look at the log, even when resuming from a checkpoint, so
+	 * that we know where it is for the final max LSN check.
+	 */
+	phase2_log(mp);
+	resume_phase = checkpoint_resume(mp);
+	if (resume_phase)
+		timestamp(PHASE_START, resume_phase + 1, NULL);
+	incremental_load(mp);
+
 	/* make sure the per-ag freespace maps are ok so we can mount the fs */
-	phase2(mp, phase2_threads);
-	phase_end(2);
+	if (resume_phase < 2) {
+		phase2(mp, phase2_threads);
+		phase_end(2);
+	}
 
 	if (do_prefetch)
 		init_prefetch(mp);
 
-	phase3(mp, phase2_threads);
-	phase_end(3);
+	if (resume_phase < 3) {
+		phase3(mp, phase2_threads);
+		checkpoint_save(mp, 3);
+		phase_end(3);
+	}
 
-	phase4(mp);
-	phase_end(4);
+	if (resume_phase < 4) {
+		phase4(mp);
+		checkpoint_save(mp, 4);
+		phase_end(4);
+	}
 
 	if (no_modify)
 		printf(_("No modify flag set, skipping phase 5\n"));
 	else {
-		phase5(mp);
+		/* rebuilding the AG btrees makes the checkpoint useless */
+		checkpoint_discard();
+		phase5(mp, phase2_threads);
 	}
 	phase_end(5);
 
@@ -1187,7 +1449,10 @@ main(int argc, char **argv)
 	rmaps_free(mp);
 	free_bmaps(mp);
 
-	if (!bad_ino_btree)  {
+	if (incremental_partial()) {
+		do_log(
+_("Not all AGs were checked, skipping phases 6 and 7\n"));
+	} else if (!bad_ino_btree)  {
 		phase6(mp);
 		phase_end(6);
 
@@ -1252,7 +1517,7 @@ _("Warning:  project quota information would be cleared.\n"
 		}
 	}
 
-	if (ag_stride && report_interval)
+	if (progress_rpt_wanted())
 		stop_progress_rpt();
 
 	if (no_modify)  {
@@ -1264,8 +1529,14 @@ _("Warning:  project quota information would be cleared.\n"
 
 		do_log(
 	_("No modify flag set, skipping filesystem flush and exiting.\n"));
-		if (verbose)
+		checkpoint_discard();
+		if (!fs_is_dirty)
+			incremental_save(mp);
+		if (verbose) {
 			summary_report();
+			slab_report_hugepages();
+		}
+		phase_report_write();
 		if (fs_is_dirty)
 			return(1);
 
@@ -1317,6 +1588,7 @@ _("Note - stripe unit (%d) and width (%d) were copied from a backup superblock.\
 	 * verifiers are run (where we discover the max metadata LSN), reformat
 	 * the log if necessary and unmount.
 	 */
+	mempressure_stop();
 	libxfs_bcache_flush();
 	format_log_max_lsn(mp);
 
@@ -1332,8 +1604,11 @@ _("Note - stripe unit (%d) and width (%d) were copied from a backup superblock.\
 
 	libxfs_destroy(&x);
 
-	if (verbose)
+	if (verbose) {
 		summary_report();
+		slab_report_hugepages();
+	}
+	phase_report_write();
 	do_log(_("done\n"));
 
 	if (dangerously && !no_modify)
@@ -1341,6 +1616,7 @@ _("Note - stripe unit (%d) and width (%d) were copied from a backup superblock.\
 _("Repair of readonly mount complete.  Immediate reboot encouraged.\n"));
 
 	pftrace_done();
+	pft_finish();
 
 	free(msgbuf);
 
@@ -6,17 +6,25 @@
 
 #include "libxfs.h"
 #include "libfrog/fsgeom.h"
+#include "libfrog/aioq.h"
 
 int rtcp(char *, char *, int);
 int xfsrtextsize(char *path);
 
+/* Copy this much at a time unless told otherwise, in whole rt extents. */
+#define RTCP_IOSIZE	(1024 * 1024)
+#define RTCP_DEPTH	4
+
 static int pflag;
+static long long bufsize;	/* -b */
+static int depth = RTCP_DEPTH;	/* -q */
 char *progname;
 
 static void
 usage(void)
 {
-	fprintf(stderr, _("%s [-e extsize] [-p] [-V] source target\n"), progname);
+	fprintf(stderr, _("%s [-b bufsize] [-e extsize] [-p] [-q depth] [-V] "
+			"source target\n"), progname);
 	exit(2);
 }
 
@@ -32,8 +40,18 @@ main(int argc, char **argv)
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
 
-	while ((c = getopt(argc, argv, "pe:V")) != EOF) {
+	while ((c = getopt(argc, argv, "b:pe:q:V")) != EOF) {
 		switch (c) {
+		case 'b':
+			bufsize = strtoll(optarg, NULL, 0);
+			if (bufsize <= 0 || bufsize > INT_MAX)
+				errflg++;
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (depth <= 0 || depth > 1024)
+				errflg++;
+			break;
 		case 'e':
 			extsize = atoi(optarg);
 			break;
@@ -97,12 +115,128 @@ main(int argc, char **argv)
 	exit(r?2:0);
 }
 
+struct rtcp_copy {
+	struct aioq_bufpool	*bp;
+	struct aioq_req		*reqs;	/* one per buffer */
+	int			fromfd;
+	int			tofd;
+	int			iosz;
+	int			miniosz;
+	off_t			next;
+	bool			eof;
+	int			error;
+};
+
+static void
+rtcp_write_done(
+	struct aioq		*q,
+	struct aioq_req		*req,
+	ssize_t			res)
+{
+	struct rtcp_copy	*rc = req->priv;
+
+	if (res != req->len && !rc->error)
+		rc->error = res < 0 ? -res : EIO;
+	aioq_buf_put(rc->bp, req->buf);
+}
+
+/*
+ * A short read means we've hit the end of the source; pad it with zeroes
+ * out to a whole direct I/O and write it back out at the same offset.
+ */
+static void
+rtcp_read_done(
+	struct aioq		*q,
+	struct aioq_req		*req,
+	ssize_t			res)
+{
+	struct rtcp_copy	*rc = req->priv;
+	size_t			len;
+
+	if (res < 0 && !rc->error)
+		rc->error = -res;
+	if (res < rc->iosz)
+		rc->eof = true;
+	if (res <= 0 || rc->error) {
+		aioq_buf_put(rc->bp, req->buf);
+		return;
+	}
+
+	len = roundup(res, rc->miniosz);
+	memset((char *)req->buf + res, 0, len - res);
+	aioq_prep(req, AIOQ_WRITE, rc->tofd, req->buf, len, req->off,
+			rtcp_write_done, rc);
+	aioq_queue(q, req);
+}
+
+/*
+ * Copy with one read or write in flight per buffer.  Each buffer is read and
+ * then written back out at the same offset, so the buffers can finish in any
+ * order.  Returns 0, -1 if the copy failed, or 1 if we couldn't set up the
+ * I/O queue and the caller has to copy.
+ */
+static int
+rtcp_aioq(
+	int			fromfd,
+	int			tofd,
+	struct aioq_bufpool	*bp,
+	int			iosz,
+	int			miniosz)
+{
+	struct rtcp_copy	rc = {
+		.bp		= bp,
+		.fromfd		= fromfd,
+		.tofd		= tofd,
+		.iosz		= iosz,
+		.miniosz	= miniosz,
+	};
+	struct aioq		q;
+	struct aioq_req		*req;
+	char			*buf;
+	int			error;
+
+	if (aioq_init(&q, bp->nr, 0))
+		return 1;
+	/* fixed buffers only save the kernel some work, so don't insist */
+	aioq_register_bufpool(&q, bp);
+
+	rc.reqs = calloc(bp->nr, sizeof(*rc.reqs));
+	if (!rc.reqs) {
+		rc.error = ENOMEM;
+		goto out;
+	}
+
+	do {
+		while (!rc.eof && !rc.error &&
+		       (buf = aioq_buf_get(bp)) != NULL) {
+			req = &rc.reqs[(buf - bp->mem) / bp->size];
+			aioq_prep(req, AIOQ_READ, fromfd, buf, iosz, rc.next,
+					rtcp_read_done, &rc);
+			aioq_queue(&q, req);
+			rc.next += iosz;
+		}
+		error = -aioq_reap(&q, 1);
+		if (error && !rc.error)
+			rc.error = error;
+	} while (!error && aioq_busy(&q));
+out:
+	aioq_free(&q);
+	free(rc.reqs);
+	if (rc.error) {
+		fprintf(stderr, _("%s: copy failed: %s\n"),
+			progname, strerror(rc.error));
+		return -1;
+	}
+	return 0;
+}
+
 int
 rtcp( char *source, char *target, int fextsize)
 {
 	int		fromfd, tofd, readct, writect, iosz, reopen;
-	int		remove = 0, rtextsize;
+	int		remove = 0, rtextsize, ret;
 	char		*sp, *fbuf, *ptr;
+	struct aioq_bufpool bp;
 	char		tbuf[ PATH_MAX ];
 	struct stat	s1, s2;
 	struct fsxattr	fsxattr;
@@ -315,8 +449,33 @@ rtcp( char *source, char *target, int fextsize)
 		}
 	}
 
-	iosz =  dioattr.d_miniosz;
-	fbuf = memalign( dioattr.d_mem, iosz);
+	/*
+	 * Copy in chunks of whole realtime extents, as big as direct I/O to
+	 * the target will allow.
+	 */
+	iosz = bufsize ? bufsize : RTCP_IOSIZE;
+	iosz = roundup(iosz, rtextsize);
+	if (iosz > dioattr.d_maxiosz) {
+		iosz = (dioattr.d_maxiosz / rtextsize) * rtextsize;
+		if (!iosz)
+			iosz = (dioattr.d_maxiosz / dioattr.d_miniosz) *
+					dioattr.d_miniosz;
+	}
+
+	if (aioq_bufpool_init(&bp, depth, iosz, dioattr.d_mem)) {
+		fprintf(stderr, _("%s: couldn't allocate %d buffers of %d "
+				"bytes\n"), progname, depth, iosz);
+		close(fromfd);
+		close(tofd);
+		return -1;
+	}
+
+	ret = rtcp_aioq(fromfd, tofd, &bp, iosz, dioattr.d_miniosz);
+	if (ret <= 0)
+		goto out_bufs;
+
+	ret = 0;
+	fbuf = aioq_buf_get(&bp);
 	memset(fbuf, 0, iosz);
 
 	/*
@@ -348,19 +507,18 @@ rtcp( char *source, char *target, int fextsize)
 		if ( writect != readct ) {
 			fprintf(stderr, _("%s: write error: %s\n"),
 				progname, strerror(errno));
-			close(fromfd);
-			close(tofd);
-			free( fbuf );
-			return( -1 );
+			ret = -1;
+			break;
 		}
 
 		memset( fbuf, 0, iosz);
 	}
 
+out_bufs:
+	aioq_bufpool_free(&bp);
 	close(fromfd);
 	close(tofd);
-	free( fbuf );
-	return( 0 );
+	return ret;
 }
 
 /*
@@ -21,6 +21,11 @@
  * counter, each thread gets its own thread-specific counter variable.
  * Changing the value is fast, though retrieving the value is expensive
  * and approximate.
+ *
+ * Each counter lives in its own cacheline and is only ever written by the
+ * thread that owns it, so updates are plain relaxed loads and stores.  That
+ * lets ptcounter_value sum the counters without locking out the threads
+ * that are busy adding to them.
  */
 struct ptcounter {
 	struct ptvar	*var;
@@ -68,7 +73,8 @@ ptcounter_add(
 	p = ptvar_get(ptc->var, &ret);
 	if (ret)
 		return -ret;
-	*p += nr;
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + nr,
+			__ATOMIC_RELAXED);
 	return 0;
 }
 
@@ -81,7 +87,7 @@ ptcounter_val_helper(
 	uint64_t		*sum = foreach_arg;
 	uint64_t		*count = data;
 
-	*sum += *count;
+	*sum += __atomic_load_n(count, __ATOMIC_RELAXED);
 	return 0;
 }
 
@@ -92,5 +98,5 @@ ptcounter_value(
 	uint64_t		*sum)
 {
 	*sum = 0;
-	return -ptvar_foreach(ptc->var, ptcounter_val_helper, sum);
+	return -ptvar_foreach_lockless(ptc->var, ptcounter_val_helper, sum);
 }
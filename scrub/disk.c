@@ -16,6 +16,9 @@
 #ifdef HAVE_HDIO_GETGEO
 # include <linux/hdreg.h>
 #endif
+#ifdef HAVE_NVME_IO_CMD
+# include <linux/nvme_ioctl.h>
+#endif
 #include "platform_defs.h"
 #include "libfrog/util.h"
 #include "libfrog/paths.h"
@@ -36,6 +39,10 @@
  * abstract the process of performing read verification of disk blocks.
  */
 
+#define BTOLBAT(d, bytes)	((uint64_t)(bytes) >> (d)->d_lbalog)
+#define LBASIZE(d)		(1ULL << (d)->d_lbalog)
+#define BTOLBA(d, bytes)	(((uint64_t)(bytes) + LBASIZE(d) - 1) >> (d)->d_lbalog)
+
 /* Figure out how many disk heads are available. */
 static unsigned int
 __disk_heads(
@@ -113,7 +120,7 @@ disk_scsi_verify(
 
 	assert(!debug_tweak_on("XFS_SCRUB_NO_SCSI_VERIFY"));
 
-	llba = startblock + (disk->d_start >> BBSHIFT);
+	llba = startblock + BTOLBAT(disk, disk->d_start);
 
 	/* Borrowed from sg_verify */
 	cdb[0] = VERIFY16_CMD;
@@ -165,26 +172,95 @@ disk_scsi_verify(
 		return -1;
 	}
 
-	return blockcount << BBSHIFT;
+	return blockcount << disk->d_lbalog;
 }
 #else
-# define disk_scsi_verify(...)		(ENOTTY)
+# define disk_scsi_verify(...)		(errno = ENOTTY, -1)
 #endif /* HAVE_SG_IO */
 
-/* Test the availability of the kernel scrub ioctl. */
+/* Test the availability of SCSI VERIFY. */
 static bool
 disk_can_scsi_verify(
 	struct disk		*disk)
 {
-	int			error;
-
 	if (debug_tweak_on("XFS_SCRUB_NO_SCSI_VERIFY"))
 		return false;
 
-	error = disk_scsi_verify(disk, 0, 1);
-	return error == 0;
+	return disk_scsi_verify(disk, 0, 1) > 0;
 }
 
+/*
+ * Execute an NVMe Verify to verify disk contents.  As with SCSI VERIFY,
+ * the controller reads and checks the blocks without sending any data
+ * back, so the scan costs no memory or PCIe bandwidth.  Passthrough
+ * commands address the whole namespace, so we add the partition offset.
+ * The NLB field is a 16-bit count, which RVP_IO_MAX_SIZE respects.
+ */
+#ifdef HAVE_NVME_IO_CMD
+# define NVME_CMD_VERIFY	0x0C
+
+static int
+disk_nvme_verify(
+	struct disk		*disk,
+	uint64_t		startblock, /* lba */
+	uint64_t		blockcount) /* lba */
+{
+	struct nvme_passthru_cmd cmd;
+	uint64_t		llba;
+	int			ret;
+
+	assert(!debug_tweak_on("XFS_SCRUB_NO_NVME_VERIFY"));
+	assert(blockcount > 0 && blockcount <= 65536);
+
+	llba = startblock + BTOLBAT(disk, disk->d_start);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = NVME_CMD_VERIFY;
+	cmd.nsid = disk->d_nsid;
+	cmd.cdw10 = llba & 0xFFFFFFFF;
+	cmd.cdw11 = llba >> 32;
+	cmd.cdw12 = blockcount - 1;	/* 0's based */
+	cmd.timeout_ms = 30000;
+
+	ret = ioctl(disk->d_fd, NVME_IOCTL_IO_CMD, &cmd);
+	if (ret < 0)
+		return ret;
+
+	dbg_printf("NVME VERIFY fd %d nsid %u lba %"PRIu64" len %"PRIu64" "
+			"status 0x%x\n", disk->d_fd, disk->d_nsid, startblock,
+			blockcount, ret);
+
+	/* A positive return is the NVMe status of a failed command. */
+	if (ret > 0) {
+		errno = EIO;
+		return -1;
+	}
+
+	return blockcount << disk->d_lbalog;
+}
+
+/* Test the availability of NVMe Verify. */
+static bool
+disk_can_nvme_verify(
+	struct disk		*disk)
+{
+	int			nsid;
+
+	if (debug_tweak_on("XFS_SCRUB_NO_NVME_VERIFY"))
+		return false;
+
+	nsid = ioctl(disk->d_fd, NVME_IOCTL_ID);
+	if (nsid <= 0)
+		return false;
+	disk->d_nsid = nsid;
+
+	return disk_nvme_verify(disk, 0, 1) > 0;
+}
+#else
+# define disk_nvme_verify(...)		(errno = ENOTTY, -1)
+# define disk_can_nvme_verify(...)	(false)
+#endif /* HAVE_NVME_IO_CMD */
+
 /* Open a disk device and discover its geometry. */
 struct disk *
 disk_open(
@@ -248,9 +324,13 @@ disk_open(
 		disk->d_start = 0;
 	}
 
-	/* Can we issue SCSI VERIFY? */
-	if (!suspicious_disk && disk_can_scsi_verify(disk))
-		disk->d_flags |= DISK_FLAG_SCSI_VERIFY;
+	/* Can we have the device verify the blocks for us? */
+	if (!suspicious_disk) {
+		if (disk_can_nvme_verify(disk))
+			disk->d_flags |= DISK_FLAG_NVME_VERIFY;
+		else if (disk_can_scsi_verify(disk))
+			disk->d_flags |= DISK_FLAG_SCSI_VERIFY;
+	}
 
 	return disk;
 out_close:
@@ -274,10 +354,6 @@ disk_close(
 	return error;
 }
 
-#define BTOLBAT(d, bytes)	((uint64_t)(bytes) >> (d)->d_lbalog)
-#define LBASIZE(d)		(1ULL << (d)->d_lbalog)
-#define BTOLBA(d, bytes)	(((uint64_t)(bytes) + LBASIZE(d) - 1) >> (d)->d_lbalog)
-
 /* Simulate disk errors. */
 static int
 disk_simulate_read_error(
@@ -357,10 +433,28 @@ disk_read_verify(
 			return length;
 	}
 
-	/* Convert to logical block size. */
-	if (disk->d_flags & DISK_FLAG_SCSI_VERIFY)
-		return disk_scsi_verify(disk, BTOLBAT(disk, start),
-				BTOLBA(disk, length));
+	/*
+	 * Let the device verify the blocks if it can.  Media errors come
+	 * back as EIO; if the command itself is refused, stop trying and
+	 * read the data instead.
+	 */
+	if (disk->d_flags & DISK_FLAGS_DEVICE_VERIFY) {
+		ssize_t		ret;
+
+		/* Convert to logical block size. */
+		if (disk->d_flags & DISK_FLAG_NVME_VERIFY)
+			ret = disk_nvme_verify(disk, BTOLBAT(disk, start),
+					BTOLBA(disk, length));
+		else
+			ret = disk_scsi_verify(disk, BTOLBAT(disk, start),
+					BTOLBA(disk, length));
+		if (ret >= 0 || errno == EIO)
+			return ret;
+
+		dbg_printf("fd %d: device verify failed, errno %d; reading.\n",
+				disk->d_fd, errno);
+		disk->d_flags &= ~DISK_FLAGS_DEVICE_VERIFY;
+	}
 
 	return pread(disk->d_fd, buf, length, start);
 }
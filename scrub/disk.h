@@ -7,12 +7,16 @@
 #define XFS_SCRUB_DISK_H_
 
 #define DISK_FLAG_SCSI_VERIFY	0x1
+#define DISK_FLAG_NVME_VERIFY	0x2
+#define DISK_FLAGS_DEVICE_VERIFY	(DISK_FLAG_SCSI_VERIFY | \
+					 DISK_FLAG_NVME_VERIFY)
 struct disk {
 	struct stat	d_sb;
 	int		d_fd;
 	unsigned int	d_lbalog;
 	unsigned int	d_lbasize;	/* bytes */
 	unsigned int	d_flags;
+	unsigned int	d_nsid;		/* NVMe namespace */
 	unsigned int	d_blksize;	/* bytes */
 	uint64_t	d_size;		/* bytes */
 	uint64_t	d_start;	/* bytes */
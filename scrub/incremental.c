@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "xfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/statvfs.h>
+#include "platform_defs.h"
+#include "xfs_arch.h"
+#include "libfrog/paths.h"
+#include "libfrog/fsgeom.h"
+#include "libfrog/bitmap.h"
+#include "xfs_scrub.h"
+#include "common.h"
+#include "disk.h"
+#include "incremental.h"
+
+/*
+ * Incremental Scrubbing
+ *
+ * After a clean run we write down when it started and what each AG looked
+ * like, so that the next run can skip whatever hasn't changed since:
+ *
+ * - An AG whose headers carry no newer LSN, and whose in-core free block
+ *   and inode counts haven't moved, doesn't need its metadata checked in
+ *   phase 2.  The counters catch most of the changes that are still
+ *   sitting in the log and haven't made it to the on-disk headers yet.
+ *
+ * - An inode whose ctime is older than the start of the last clean run
+ *   doesn't need to be checked in phase 3.
+ *
+ * - The data blocks of an inode whose ctime is older than the start of
+ *   the last clean run that verified file data don't need to be read in
+ *   phase 6.
+ *
+ * Each watermark only moves forward when the phase that depends on it ran
+ * to completion, and nothing is written unless the whole run was clean.
+ */
+
+#define INCR_MAGIC		"xfs_scrub-state 1"
+
+/* Offsets of the LSNs in the AG headers; see xfs_format.h. */
+#define INCR_AGF_LSN_OFF	208
+#define INCR_AGI_LSN_OFF	320
+#define INCR_AGFL_LSN_OFF	24
+
+/* Render the fs handle as a hex string that identifies this filesystem. */
+static void
+incr_fsid(
+	struct scrub_ctx	*ctx,
+	char			*buf,
+	size_t			buflen)
+{
+	unsigned char		*p = ctx->fshandle;
+	size_t			i;
+
+	buf[0] = 0;
+	for (i = 0; i < ctx->fshandle_len && (i + 1) * 2 < buflen; i++)
+		sprintf(buf + i * 2, "%02x", p[i]);
+}
+
+/* Read the state file, if it exists and it's for this filesystem. */
+int
+incr_load(
+	struct scrub_ctx	*ctx)
+{
+	struct incr_state	*incr;
+	char			fsid[256];
+	char			want_fsid[256];
+	char			magic[64];
+	FILE			*fp;
+	long long		meta_since;
+	long long		data_since;
+	unsigned long long	lsn;
+	unsigned int		agcount;
+	unsigned int		agno;
+	unsigned int		nr = 0;
+	int			ret;
+
+	incr = calloc(1, sizeof(struct incr_state));
+	if (!incr)
+		return errno;
+	incr->start = time(NULL);
+	incr->old_ags = calloc(ctx->mnt.fsgeom.agcount, sizeof(struct incr_ag));
+	incr->new_ags = calloc(ctx->mnt.fsgeom.agcount, sizeof(struct incr_ag));
+	if (!incr->old_ags || !incr->new_ags) {
+		ret = errno;
+		goto out_free;
+	}
+	ret = -bitmap_alloc(&incr->data_changed);
+	if (ret)
+		goto out_free;
+	ctx->incr = incr;
+
+	fp = fopen(ctx->incr_path, "r");
+	if (!fp) {
+		if (errno == ENOENT) {
+			str_info(ctx, ctx->incr_path,
+_("No scrub state found; checking everything."));
+			return 0;
+		}
+		str_errno(ctx, ctx->incr_path);
+		return 0;
+	}
+
+	incr_fsid(ctx, want_fsid, sizeof(want_fsid));
+	if (!fgets(magic, sizeof(magic), fp) ||
+	    strncmp(magic, INCR_MAGIC "\n", sizeof(magic)) ||
+	    fscanf(fp, "fsid %255s\n", fsid) != 1 ||
+	    fscanf(fp, "agcount %u\n", &agcount) != 1 ||
+	    fscanf(fp, "meta_since %lld\n", &meta_since) != 1 ||
+	    fscanf(fp, "data_since %lld\n", &data_since) != 1)
+		goto bad;
+	if (strcmp(fsid, want_fsid) || agcount != ctx->mnt.fsgeom.agcount) {
+		str_info(ctx, ctx->incr_path,
+_("Scrub state is for another filesystem; checking everything."));
+		goto out_close;
+	}
+
+	while ((ret = fscanf(fp, "ag %u %llu", &agno, &lsn)) == 2) {
+		struct incr_ag	*ag;
+
+		if (agno >= agcount)
+			goto bad;
+		ag = &incr->old_ags[agno];
+		ag->lsn = lsn;
+		if (fscanf(fp, "%u %u %u\n", &ag->freeblks, &ag->icount,
+					&ag->ifree) != 3)
+			goto bad;
+		nr++;
+	}
+	if (ret != EOF || nr != agcount)
+		goto bad;
+
+	incr->meta_since = meta_since;
+	incr->data_since = data_since;
+	incr->valid = true;
+	goto out_close;
+
+bad:
+	str_info(ctx, ctx->incr_path,
+_("Could not parse scrub state; checking everything."));
+out_close:
+	fclose(fp);
+	return 0;
+
+out_free:
+	free(incr->new_ags);
+	free(incr->old_ags);
+	free(incr);
+	return ret;
+}
+
+/* Record what we saw in a clean run for next time. */
+int
+incr_save(
+	struct scrub_ctx	*ctx)
+{
+	struct incr_state	*incr = ctx->incr;
+	struct incr_ag		*ags;
+	char			fsid[256];
+	char			*tmp;
+	FILE			*fp;
+	time_t			meta_since;
+	time_t			data_since;
+	xfs_agnumber_t		agno;
+	int			ret = 0;
+
+	if (!incr)
+		return 0;
+
+	/* Keep the old watermarks for whatever we didn't get to. */
+	meta_since = incr->valid ? incr->meta_since : 0;
+	data_since = incr->valid ? incr->data_since : 0;
+	if (incr->inodes_done)
+		meta_since = incr->start;
+	if (incr->data_done)
+		data_since = incr->start;
+	ags = incr->ags_done ? incr->new_ags : incr->old_ags;
+
+	if (asprintf(&tmp, "%s.tmp", ctx->incr_path) < 0)
+		return errno;
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		ret = errno;
+		goto out_tmp;
+	}
+
+	incr_fsid(ctx, fsid, sizeof(fsid));
+	fprintf(fp, INCR_MAGIC "\n");
+	fprintf(fp, "fsid %s\n", fsid);
+	fprintf(fp, "agcount %u\n", ctx->mnt.fsgeom.agcount);
+	fprintf(fp, "meta_since %lld\n", (long long)meta_since);
+	fprintf(fp, "data_since %lld\n", (long long)data_since);
+	for (agno = 0; agno < ctx->mnt.fsgeom.agcount; agno++)
+		fprintf(fp, "ag %u %llu %u %u %u\n", agno,
+				(unsigned long long)ags[agno].lsn,
+				ags[agno].freeblks, ags[agno].icount,
+				ags[agno].ifree);
+
+	if (fflush(fp) || fsync(fileno(fp)))
+		ret = errno;
+	if (fclose(fp) && !ret)
+		ret = errno;
+	if (!ret && rename(tmp, ctx->incr_path))
+		ret = errno;
+	if (ret)
+		unlink(tmp);
+out_tmp:
+	free(tmp);
+	return ret;
+}
+
+void
+incr_free(
+	struct scrub_ctx	*ctx)
+{
+	struct incr_state	*incr = ctx->incr;
+
+	if (!incr)
+		return;
+	bitmap_free(&incr->data_changed);
+	free(incr->new_ags);
+	free(incr->old_ags);
+	free(incr);
+	ctx->incr = NULL;
+}
+
+/*
+ * Find the newest LSN in the AGF, AGI, and AGFL of an AG.  Only v5
+ * filesystems stamp an LSN into their headers; for the others (or if we
+ * can't read the headers) we return zero, which never matches.
+ */
+static uint64_t
+incr_ag_lsn(
+	struct scrub_ctx	*ctx,
+	xfs_agnumber_t		agno)
+{
+	struct xfs_fsop_geom	*geo = &ctx->mnt.fsgeom;
+	char			*buf;
+	uint64_t		lsn = 0;
+	size_t			len = 4 * geo->sectsize;
+	off_t			pos;
+	ssize_t			ret;
+
+	if (!(geo->flags & XFS_FSOP_GEOM_FLAGS_V5SB))
+		return 0;
+	if (posix_memalign((void **)&buf, page_size, len))
+		return 0;
+
+	pos = (off_t)agno * geo->agblocks * geo->blocksize;
+	ret = pread(ctx->datadev->d_fd, buf, len, pos);
+	if (ret == len &&
+	    !memcmp(buf + geo->sectsize, "XAGF", 4) &&
+	    !memcmp(buf + 2 * geo->sectsize, "XAGI", 4) &&
+	    !memcmp(buf + 3 * geo->sectsize, "XAFL", 4)) {
+		__be64	*p;
+
+		p = (__be64 *)(buf + geo->sectsize + INCR_AGF_LSN_OFF);
+		lsn = max(lsn, be64_to_cpu(*p));
+		p = (__be64 *)(buf + 2 * geo->sectsize + INCR_AGI_LSN_OFF);
+		lsn = max(lsn, be64_to_cpu(*p));
+		p = (__be64 *)(buf + 3 * geo->sectsize + INCR_AGFL_LSN_OFF);
+		lsn = max(lsn, be64_to_cpu(*p));
+	}
+
+	free(buf);
+	return lsn;
+}
+
+/*
+ * Record what an AG looks like now and decide if we can skip checking its
+ * metadata.
+ */
+bool
+incr_ag_unchanged(
+	struct scrub_ctx	*ctx,
+	xfs_agnumber_t		agno)
+{
+	struct incr_state	*incr = ctx->incr;
+	struct xfs_ag_geometry	ageo = { 0 };
+	struct incr_ag		*old, *new;
+
+	if (!incr)
+		return false;
+
+	new = &incr->new_ags[agno];
+	if (xfrog_ag_geometry(ctx->mnt.fd, agno, &ageo))
+		return false;
+	new->lsn = incr_ag_lsn(ctx, agno);
+	new->freeblks = ageo.ag_freeblks;
+	new->icount = ageo.ag_icount;
+	new->ifree = ageo.ag_ifree;
+
+	/* Don't skip anything the kernel already thinks is broken. */
+	if (!incr->valid || ageo.ag_sick || new->lsn == 0)
+		return false;
+
+	old = &incr->old_ags[agno];
+	return new->lsn == old->lsn && new->freeblks == old->freeblks &&
+	       new->icount == old->icount && new->ifree == old->ifree;
+}
+
+/*
+ * Decide if we can skip checking an inode, and remember if its data blocks
+ * need to be verified.
+ */
+bool
+incr_inode_unchanged(
+	struct scrub_ctx	*ctx,
+	struct xfs_bulkstat	*bs)
+{
+	struct incr_state	*incr = ctx->incr;
+	int			ret;
+
+	if (!incr)
+		return false;
+
+	if (!incr->valid || bs->bs_ctime >= incr->data_since) {
+		ret = -bitmap_set(incr->data_changed, bs->bs_ino, 1);
+		if (ret) {
+			str_liberror(ctx, ret, _("setting changed inode bitmap"));
+			incr->valid = false;
+			return false;
+		}
+	}
+
+	if (!incr->valid || bs->bs_sick)
+		return false;
+	return bs->bs_ctime < incr->meta_since;
+}
+
+/* Decide if we can skip verifying the data blocks of an inode. */
+bool
+incr_data_unchanged(
+	struct scrub_ctx	*ctx,
+	uint64_t		ino)
+{
+	struct incr_state	*incr = ctx->incr;
+
+	if (!incr || !incr->valid || !incr->inodes_done)
+		return false;
+	return !bitmap_test(incr->data_changed, ino, 1);
+}
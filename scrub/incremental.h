@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef XFS_SCRUB_INCREMENTAL_H_
+#define XFS_SCRUB_INCREMENTAL_H_
+
+/* What an AG looked like the last time we checked it. */
+struct incr_ag {
+	uint64_t		lsn;		/* newest AG header LSN */
+	uint32_t		freeblks;
+	uint32_t		icount;
+	uint32_t		ifree;
+};
+
+struct incr_state {
+	/* From the last clean run, if we trust the state file. */
+	bool			valid;
+	time_t			meta_since;	/* inodes checked */
+	time_t			data_since;	/* file data verified */
+	struct incr_ag		*old_ags;
+
+	/* What this run has seen. */
+	time_t			start;
+	struct incr_ag		*new_ags;
+	bool			ags_done;
+	bool			inodes_done;
+	bool			data_done;
+
+	/* Inodes whose data blocks must be verified in phase 6. */
+	struct bitmap		*data_changed;
+};
+
+int incr_load(struct scrub_ctx *ctx);
+int incr_save(struct scrub_ctx *ctx);
+void incr_free(struct scrub_ctx *ctx);
+
+bool incr_ag_unchanged(struct scrub_ctx *ctx, xfs_agnumber_t agno);
+bool incr_inode_unchanged(struct scrub_ctx *ctx, struct xfs_bulkstat *bs);
+bool incr_data_unchanged(struct scrub_ctx *ctx, uint64_t ino);
+
+#endif /* XFS_SCRUB_INCREMENTAL_H_ */
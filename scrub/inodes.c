@@ -28,12 +28,17 @@
  * are broken, but if we ask for n inodes starting at x, it'll skip the bad
  * ones and fill from beyond the range (x + n).
  *
- * Therefore, we ask INUMBERS to return one inobt chunk's worth of inode
- * bitmap information.  Then we try to BULKSTAT only the inodes that were
- * present in that chunk, and compare what we got against what INUMBERS said
- * was there.  If there's a mismatch, we know that we have an inode that fails
- * the verifiers but we can inject the bulkstat information to force the scrub
- * code to deal with the broken inodes.
+ * Therefore, we ask INUMBERS to return a batch of inobt chunks' worth of
+ * inode bitmap information.  Then we try to BULKSTAT only the inodes that
+ * were present in those chunks, and compare what we got against what
+ * INUMBERS said was there.  If there's a mismatch, we know that we have an
+ * inode that fails the verifiers but we can inject the bulkstat information
+ * to force the scrub code to deal with the broken inodes.
+ *
+ * The batches start at one chunk and grow until each BULKSTAT call returns
+ * about SCAN_BATCH_INODES inodes, so sparse AGs get more chunks per batch
+ * than dense ones.  A helper thread fetches the next batch while we run the
+ * iteration function over the current one.
  *
  * If the iteration function returns ESTALE, that means that the inode has
  * been deleted and possibly recreated since the BULKSTAT call.  We wil
@@ -41,38 +46,41 @@
  * the staleness as an error.
  */
 
+/* Aim for this many inodes in each BULKSTAT call. */
+#define SCAN_BATCH_INODES	1024
+
+/* Never ask INUMBERS for more than this many chunks at once. */
+#define SCAN_MAX_CHUNKS		64
+
+/* One batch of inode chunks and their bulkstat information. */
+struct scan_batch {
+	struct xfs_inumbers_req	*ireq;
+	struct xfs_bulkstat_req	*breq;
+
+	/* Where to start the next batch. */
+	uint64_t		next_ino;
+
+	/* Chunks and inodes in this batch. */
+	unsigned int		nr_chunks;
+	unsigned int		nr_inodes;
+	int			error;
+};
+
 /*
- * Run bulkstat on an entire inode allocation group, then check that we got
- * exactly the inodes we expected.  If not, load them one at a time (or fake
- * it) into the bulkstat data.
+ * Check that bulkstat gave us exactly the inodes that INUMBERS said were in
+ * this chunk.  If not, load them one at a time (or fake it) into the
+ * bulkstat data.
  */
 static void
 bulkstat_for_inumbers(
 	struct scrub_ctx	*ctx,
-	const char		*descr,
 	const struct xfs_inumbers *inumbers,
-	struct xfs_bulkstat_req	*breq)
+	struct xfs_bulkstat	*bstat)
 {
-	struct xfs_bulkstat	*bstat = breq->bulkstat;
 	struct xfs_bulkstat	*bs;
 	int			i;
 	int			error;
 
-	/* First we try regular bulkstat, for speed. */
-	breq->hdr.ino = inumbers->xi_startino;
-	breq->hdr.icount = inumbers->xi_alloccount;
-	error = -xfrog_bulkstat(&ctx->mnt, breq);
-	if (error) {
-		char	errbuf[DESCR_BUFSZ];
-
-		str_info(ctx, descr, "%s",
-			 strerror_r(error, errbuf, DESCR_BUFSZ));
-	}
-
-	/*
-	 * Check each of the stats we got back to make sure we got the inodes
-	 * we asked for.
-	 */
 	for (i = 0, bs = bstat; i < LIBFROG_BULKSTAT_CHUNKSIZE; i++) {
 		if (!(inumbers->xi_allocmask & (1ULL << i)))
 			continue;
@@ -93,6 +101,229 @@ bulkstat_for_inumbers(
 	}
 }
 
+/*
+ * Find up to @nr_chunks inode chunks starting at @startino, then run
+ * bulkstat on all of their inodes at once.
+ */
+static void
+scan_fetch_batch(
+	struct scrub_ctx	*ctx,
+	const char		*descr,
+	struct scan_batch	*batch,
+	uint64_t		startino,
+	unsigned int		nr_chunks)
+{
+	struct xfs_inumbers_req	*ireq = batch->ireq;
+	struct xfs_bulkstat_req	*breq = batch->breq;
+	struct xfs_bulkstat	*bs;
+	unsigned int		i;
+	int			error;
+
+	batch->nr_chunks = 0;
+	batch->nr_inodes = 0;
+
+	ireq->hdr.ino = startino;
+	ireq->hdr.icount = nr_chunks;
+	batch->error = -xfrog_inumbers(&ctx->mnt, ireq);
+	if (batch->error)
+		return;
+	batch->next_ino = ireq->hdr.ino;
+
+	/* Only take as many chunks as the bulkstat buffer can hold. */
+	for (i = 0; i < ireq->hdr.ocount; i++) {
+		struct xfs_inumbers	*inumbers = &ireq->inumbers[i];
+
+		if (batch->nr_inodes + inumbers->xi_alloccount >
+				SCAN_BATCH_INODES) {
+			batch->next_ino = inumbers->xi_startino;
+			break;
+		}
+		batch->nr_inodes += inumbers->xi_alloccount;
+	}
+	batch->nr_chunks = i;
+	if (batch->nr_inodes == 0)
+		return;
+
+	/* First we try regular bulkstat, for speed. */
+	breq->hdr.ino = ireq->inumbers[0].xi_startino;
+	breq->hdr.icount = batch->nr_inodes;
+	error = -xfrog_bulkstat(&ctx->mnt, breq);
+	if (error) {
+		char	errbuf[DESCR_BUFSZ];
+
+		str_info(ctx, descr, "%s",
+			 strerror_r(error, errbuf, DESCR_BUFSZ));
+		breq->hdr.ocount = 0;
+	}
+	for (i = breq->hdr.ocount; i < batch->nr_inodes; i++)
+		breq->bulkstat[i].bs_ino = 0;
+
+	/*
+	 * Check each of the stats we got back to make sure we got the inodes
+	 * we asked for.
+	 */
+	for (i = 0, bs = breq->bulkstat; i < batch->nr_chunks; i++) {
+		bulkstat_for_inumbers(ctx, &ireq->inumbers[i], bs);
+		bs += ireq->inumbers[i].xi_alloccount;
+	}
+}
+
+/*
+ * Decide how many chunks to ask for next time, based on how many inodes
+ * there were in each chunk of this batch.  Grow slowly so that we don't
+ * overshoot small AGs or scans that get cancelled.
+ */
+static unsigned int
+scan_next_nr_chunks(
+	const struct scan_batch	*batch,
+	unsigned int		nr_chunks)
+{
+	unsigned int		want = SCAN_MAX_CHUNKS;
+
+	if (batch->nr_inodes)
+		want = SCAN_BATCH_INODES * batch->nr_chunks /
+				batch->nr_inodes;
+	want = min(want, nr_chunks * 2);
+	want = min(want, SCAN_MAX_CHUNKS);
+	return max(want, 1U);
+}
+
+/* Fetches the next batch while the scanner works on the current one. */
+struct scan_prefetch {
+	struct scrub_ctx	*ctx;
+	const char		*descr;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+
+	/* Batch to fill, or NULL if the thread is idle. */
+	struct scan_batch	*batch;
+	uint64_t		startino;
+	unsigned int		nr_chunks;
+
+	bool			running;
+	bool			stop;
+};
+
+static void *
+scan_prefetch_thread(
+	void			*arg)
+{
+	struct scan_prefetch	*pf = arg;
+
+	pthread_mutex_lock(&pf->lock);
+	while (!pf->stop) {
+		if (!pf->batch) {
+			pthread_cond_wait(&pf->wait, &pf->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pf->lock);
+
+		scan_fetch_batch(pf->ctx, pf->descr, pf->batch, pf->startino,
+				pf->nr_chunks);
+
+		pthread_mutex_lock(&pf->lock);
+		pf->batch = NULL;
+		pthread_cond_broadcast(&pf->wait);
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return NULL;
+}
+
+/* Start the prefetch thread.  If we can't, batches are fetched inline. */
+static void
+scan_prefetch_init(
+	struct scan_prefetch	*pf,
+	struct scrub_ctx	*ctx,
+	const char		*descr)
+{
+	memset(pf, 0, sizeof(*pf));
+	pf->ctx = ctx;
+	pf->descr = descr;
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->wait, NULL);
+	pf->running = pthread_create(&pf->thread, NULL, scan_prefetch_thread,
+			pf) == 0;
+}
+
+/* Start fetching a batch. */
+static void
+scan_prefetch_start(
+	struct scan_prefetch	*pf,
+	struct scan_batch	*batch,
+	uint64_t		startino,
+	unsigned int		nr_chunks)
+{
+	if (!pf->running) {
+		scan_fetch_batch(pf->ctx, pf->descr, batch, startino,
+				nr_chunks);
+		return;
+	}
+
+	pthread_mutex_lock(&pf->lock);
+	pf->batch = batch;
+	pf->startino = startino;
+	pf->nr_chunks = nr_chunks;
+	pthread_cond_broadcast(&pf->wait);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/* Wait for the batch being fetched, if any. */
+static void
+scan_prefetch_wait(
+	struct scan_prefetch	*pf)
+{
+	pthread_mutex_lock(&pf->lock);
+	while (pf->batch)
+		pthread_cond_wait(&pf->wait, &pf->lock);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+static void
+scan_prefetch_destroy(
+	struct scan_prefetch	*pf)
+{
+	if (pf->running) {
+		scan_prefetch_wait(pf);
+		pthread_mutex_lock(&pf->lock);
+		pf->stop = true;
+		pthread_cond_broadcast(&pf->wait);
+		pthread_mutex_unlock(&pf->lock);
+		pthread_join(pf->thread, NULL);
+	}
+	pthread_cond_destroy(&pf->wait);
+	pthread_mutex_destroy(&pf->lock);
+}
+
+static int
+scan_batch_alloc(
+	struct scan_batch	*batch,
+	xfs_agnumber_t		agno)
+{
+	int			error;
+
+	error = -xfrog_bulkstat_alloc_req(SCAN_BATCH_INODES, 0, &batch->breq);
+	if (error)
+		return error;
+
+	error = -xfrog_inumbers_alloc_req(SCAN_MAX_CHUNKS, 0, &batch->ireq);
+	if (error) {
+		free(batch->breq);
+		batch->breq = NULL;
+		return error;
+	}
+	xfrog_inumbers_set_ag(batch->ireq, agno);
+	return 0;
+}
+
+static void
+scan_batch_free(
+	struct scan_batch	*batch)
+{
+	free(batch->ireq);
+	free(batch->breq);
+}
+
 /* BULKSTAT wrapper routines. */
 struct scan_inodes {
 	scrub_inode_iter_fn	fn;
@@ -113,13 +344,19 @@ scan_ag_inodes(
 {
 	struct xfs_handle	handle = { };
 	char			descr[DESCR_BUFSZ];
-	struct xfs_inumbers_req	*ireq;
-	struct xfs_bulkstat_req	*breq;
+	struct scan_batch	batches[2] = { };
+	struct scan_prefetch	pf;
 	struct scan_inodes	*si = arg;
 	struct scrub_ctx	*ctx = (struct scrub_ctx *)wq->wq_ctx;
+	struct scan_batch	*cur = &batches[0];
+	struct scan_batch	*next = &batches[1];
+	struct scan_batch	*swap;
 	struct xfs_bulkstat	*bs;
 	struct xfs_inumbers	*inumbers;
 	uint64_t		nextino = cvt_agino_to_ino(&ctx->mnt, agno, 0);
+	uint64_t		restartino;
+	unsigned int		nr_chunks = 1;
+	unsigned int		chunk;
 	int			i;
 	int			error;
 	int			stale_count = 0;
@@ -134,89 +371,98 @@ scan_ag_inodes(
 			sizeof(handle.ha_fid.fid_len);
 	handle.ha_fid.fid_pad = 0;
 
-	error = -xfrog_bulkstat_alloc_req(LIBFROG_BULKSTAT_CHUNKSIZE, 0, &breq);
+	error = scan_batch_alloc(&batches[0], agno);
+	if (!error)
+		error = scan_batch_alloc(&batches[1], agno);
 	if (error) {
 		str_liberror(ctx, error, descr);
+		scan_batch_free(&batches[0]);
 		si->aborted = true;
 		return;
 	}
 
-	error = -xfrog_inumbers_alloc_req(1, 0, &ireq);
-	if (error) {
-		str_liberror(ctx, error, descr);
-		free(breq);
-		si->aborted = true;
-		return;
-	}
-	inumbers = &ireq->inumbers[0];
-	xfrog_inumbers_set_ag(ireq, agno);
-
-	/* Find the inode chunk & alloc mask */
-	error = -xfrog_inumbers(&ctx->mnt, ireq);
-	while (!error && !si->aborted && ireq->hdr.ocount > 0) {
-		/*
-		 * Make sure that we always make forward progress while we
-		 * scan the inode btree.
-		 */
-		if (nextino > inumbers->xi_startino) {
-			str_corrupt(ctx, descr,
+	scan_prefetch_init(&pf, ctx, descr);
+
+	/* Find the inode chunks & alloc masks */
+	scan_fetch_batch(ctx, descr, cur, 0, nr_chunks);
+	while (!(error = cur->error) && !si->aborted && cur->nr_chunks > 0) {
+		/* Fetch the next batch while we work on this one. */
+		nr_chunks = scan_next_nr_chunks(cur, nr_chunks);
+		scan_prefetch_start(&pf, next, cur->next_ino, nr_chunks);
+
+		for (chunk = 0, bs = cur->breq->bulkstat;
+		     chunk < cur->nr_chunks;
+		     bs += inumbers->xi_alloccount, chunk++) {
+			inumbers = &cur->ireq->inumbers[chunk];
+
+			/*
+			 * Make sure that we always make forward progress
+			 * while we scan the inode btree.
+			 */
+			if (nextino > inumbers->xi_startino) {
+				str_corrupt(ctx, descr,
 	_("AG %u inode btree is corrupt near agino %lu, got %lu"), agno,
-				cvt_ino_to_agino(&ctx->mnt, nextino),
-				cvt_ino_to_agino(&ctx->mnt,
-						ireq->inumbers[0].xi_startino));
-			si->aborted = true;
-			break;
-		}
-		nextino = ireq->hdr.ino;
-
-		/*
-		 * We can have totally empty inode chunks on filesystems where
-		 * there are more than 64 inodes per block.  Skip these.
-		 */
-		if (inumbers->xi_alloccount == 0)
-			goto igrp_retry;
-
-		bulkstat_for_inumbers(ctx, descr, inumbers, breq);
-
-		/* Iterate all the inodes. */
-		for (i = 0, bs = breq->bulkstat;
-		     !si->aborted && i < inumbers->xi_alloccount;
-		     i++, bs++) {
-			handle.ha_fid.fid_ino = bs->bs_ino;
-			handle.ha_fid.fid_gen = bs->bs_gen;
-			error = si->fn(ctx, &handle, bs, si->arg);
-			switch (error) {
-			case 0:
-				break;
-			case ESTALE: {
-				char	idescr[DESCR_BUFSZ];
-
-				stale_count++;
-				if (stale_count < 30) {
-					ireq->hdr.ino = inumbers->xi_startino;
-					goto igrp_retry;
-				}
-				scrub_render_ino_descr(ctx, idescr, DESCR_BUFSZ,
-						bs->bs_ino, bs->bs_gen, NULL);
-				str_info(ctx, idescr,
-_("Changed too many times during scan; giving up."));
-				break;
-			}
-			case ECANCELED:
-				error = 0;
-				fallthrough;
-			default:
-				goto err;
-			}
-			if (scrub_excessive_errors(ctx)) {
+					cvt_ino_to_agino(&ctx->mnt, nextino),
+					cvt_ino_to_agino(&ctx->mnt,
+						inumbers->xi_startino));
 				si->aborted = true;
 				goto out;
 			}
+			nextino = inumbers->xi_startino +
+					LIBFROG_BULKSTAT_CHUNKSIZE;
+
+			/* Iterate all the inodes. */
+			for (i = 0; !si->aborted && i < inumbers->xi_alloccount;
+			     i++) {
+				handle.ha_fid.fid_ino = bs[i].bs_ino;
+				handle.ha_fid.fid_gen = bs[i].bs_gen;
+				error = si->fn(ctx, &handle, &bs[i], si->arg);
+				switch (error) {
+				case 0:
+					break;
+				case ESTALE: {
+					char	idescr[DESCR_BUFSZ];
+
+					stale_count++;
+					if (stale_count < 30) {
+						restartino =
+							inumbers->xi_startino;
+						goto igrp_retry;
+					}
+					scrub_render_ino_descr(ctx, idescr,
+							DESCR_BUFSZ,
+							bs[i].bs_ino,
+							bs[i].bs_gen, NULL);
+					str_info(ctx, idescr,
+_("Changed too many times during scan; giving up."));
+					break;
+				}
+				case ECANCELED:
+					error = 0;
+					fallthrough;
+				default:
+					goto err;
+				}
+				if (scrub_excessive_errors(ctx)) {
+					si->aborted = true;
+					goto out;
+				}
+			}
+
+			stale_count = 0;
 		}
 
-		stale_count = 0;
+		scan_prefetch_wait(&pf);
+		swap = cur;
+		cur = next;
+		next = swap;
+		continue;
+
 igrp_retry:
-		error = -xfrog_inumbers(&ctx->mnt, ireq);
+		/* Throw away the next batch and refetch this chunk. */
+		scan_prefetch_wait(&pf);
+		nextino = restartino;
+		scan_fetch_batch(ctx, descr, cur, restartino, nr_chunks);
 	}
 
 err:
@@ -225,8 +471,9 @@ err:
 		si->aborted = true;
 	}
 out:
-	free(ireq);
-	free(breq);
+	scan_prefetch_destroy(&pf);
+	scan_batch_free(&batches[1]);
+	scan_batch_free(&batches[0]);
 }
 
 /*
@@ -243,6 +490,7 @@ scrub_scan_all_inodes(
 		.fn		= fn,
 		.arg		= arg,
 	};
+	struct workqueue_work	*work;
 	xfs_agnumber_t		agno;
 	struct workqueue	wq;
 	int			ret;
@@ -254,13 +502,22 @@ scrub_scan_all_inodes(
 		return -1;
 	}
 
-	for (agno = 0; agno < ctx->mnt.fsgeom.agcount; agno++) {
-		ret = -workqueue_add(&wq, scan_ag_inodes, agno, &si);
+	work = calloc(ctx->mnt.fsgeom.agcount, sizeof(struct workqueue_work));
+	if (!work) {
+		si.aborted = true;
+		str_errno(ctx, _("allocating bulkstat work"));
+	} else {
+		for (agno = 0; agno < ctx->mnt.fsgeom.agcount; agno++) {
+			work[agno].function = scan_ag_inodes;
+			work[agno].index = agno;
+			work[agno].arg = &si;
+		}
+		ret = -workqueue_add_batch(&wq, work, ctx->mnt.fsgeom.agcount);
 		if (ret) {
 			si.aborted = true;
 			str_liberror(ctx, ret, _("queueing bulkstat work"));
-			break;
 		}
+		free(work);
 	}
 
 	ret = -workqueue_terminate(&wq);
@@ -268,6 +525,8 @@ scrub_scan_all_inodes(
 		si.aborted = true;
 		str_liberror(ctx, ret, _("finishing bulkstat work"));
 	}
+	dbg_printf("bulkstat: %llu steals, %llu lock contentions\n",
+			wq.nr_steals, wq.nr_contended);
 	workqueue_destroy(&wq);
 
 	return si.aborted ? -1 : 0;
@@ -15,6 +15,7 @@
 #include <pthread.h>
 #include "libfrog/util.h"
 #include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
 #include "input.h"
 #include "libfrog/paths.h"
 #include "handle.h"
@@ -27,6 +28,7 @@
 #include "scrub.h"
 #include "repair.h"
 #include "libfrog/fsgeom.h"
+#include "incremental.h"
 
 /* Phase 1: Find filesystem geometry (and clean up after) */
 
@@ -51,6 +53,9 @@ scrub_cleanup(
 	int			error;
 
 	action_lists_free(&ctx->action_lists);
+	incr_free(ctx);
+	if (ctx->block_counts)
+		ptvar_free(ctx->block_counts);
 	if (ctx->fshandle)
 		free_handle(ctx->fshandle, ctx->fshandle_len);
 	if (ctx->rtdev)
@@ -199,6 +204,15 @@ _("Unable to find realtime device path."));
 		}
 	}
 
+	/* Find out what changed since the last clean run. */
+	if (ctx->incr_path) {
+		error = incr_load(ctx);
+		if (error) {
+			str_liberror(ctx, error, _("loading scrub state"));
+			return error;
+		}
+	}
+
 	/*
 	 * Everything's set up, which means any failures recorded after
 	 * this point are most probably corruption errors (as opposed to
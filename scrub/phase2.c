@@ -10,10 +10,13 @@
 #include "list.h"
 #include "libfrog/paths.h"
 #include "libfrog/workqueue.h"
+#include "libfrog/fsgeom.h"
+#include "libfrog/scrub.h"
 #include "xfs_scrub.h"
 #include "common.h"
 #include "scrub.h"
 #include "repair.h"
+#include "incremental.h"
 
 /* Phase 2: Check internal metadata. */
 
@@ -36,6 +39,10 @@ scan_ag_metadata(
 	if (*aborted)
 		return;
 
+	/* Nothing changed in this AG since the last clean run. */
+	if (incr_ag_unchanged(ctx, agno))
+		return;
+
 	action_list_init(&alist);
 	action_list_init(&immediate_alist);
 	snprintf(descr, DESCR_BUFSZ, _("AG %u"), agno);
@@ -92,11 +99,11 @@ err:
 	*aborted = true;
 }
 
-/* Scrub whole-FS metadata btrees. */
+/* Scrub one type of whole-FS metadata. */
 static void
 scan_fs_metadata(
 	struct workqueue		*wq,
-	xfs_agnumber_t			agno,
+	xfs_agnumber_t			type,
 	void				*arg)
 {
 	struct scrub_ctx		*ctx = (struct scrub_ctx *)wq->wq_ctx;
@@ -108,13 +115,70 @@ scan_fs_metadata(
 		return;
 
 	action_list_init(&alist);
-	ret = scrub_fs_metadata(ctx, &alist);
+	ret = scrub_fs_metadata(ctx, type, &alist);
 	if (ret) {
 		*aborted = true;
 		return;
 	}
 
-	action_list_defer(ctx, agno, &alist);
+	action_list_defer(ctx, 0, &alist);
+}
+
+struct ag_cost {
+	xfs_agnumber_t			agno;
+	uint64_t			cost;
+};
+
+static int
+ag_cost_cmp(
+	const void			*a,
+	const void			*b)
+{
+	const struct ag_cost		*ca = a;
+	const struct ag_cost		*cb = b;
+
+	if (ca->cost != cb->cost)
+		return ca->cost > cb->cost ? -1 : 1;
+	return ca->agno < cb->agno ? -1 : ca->agno > cb->agno;
+}
+
+/*
+ * Decide what order to check the AGs in.  The kernel holds an AG's header
+ * buffers locked for as long as it checks any of that AG's btrees, so the
+ * btrees of one AG can only be checked one after the other; what we can
+ * do is start the AGs with the most to check first, so that a big AG
+ * doesn't get left until the end with everyone else idle.  Used space and
+ * allocated inodes are what the btrees grow with.  If the kernel can't
+ * tell us those, go in AG order.
+ */
+static struct ag_cost *
+order_ag_metadata(
+	struct scrub_ctx		*ctx)
+{
+	struct xfs_fsop_geom		*fsgeom = &ctx->mnt.fsgeom;
+	struct xfs_ag_geometry		ageo;
+	struct ag_cost			*order;
+	uint64_t			agblocks;
+	xfs_agnumber_t			agno;
+
+	order = calloc(fsgeom->agcount, sizeof(struct ag_cost));
+	if (!order)
+		return NULL;
+
+	for (agno = 0; agno < fsgeom->agcount; agno++) {
+		order[agno].agno = agno;
+		if (xfrog_ag_geometry(ctx->mnt.fd, agno, &ageo))
+			continue;
+		agblocks = fsgeom->datablocks -
+				(uint64_t)agno * fsgeom->agblocks;
+		if (agblocks > fsgeom->agblocks)
+			agblocks = fsgeom->agblocks;
+		if (agblocks > ageo.ag_freeblks)
+			order[agno].cost = agblocks - ageo.ag_freeblks;
+		order[agno].cost += ageo.ag_icount;
+	}
+	qsort(order, fsgeom->agcount, sizeof(struct ag_cost), ag_cost_cmp);
+	return order;
 }
 
 /* Scan all filesystem metadata. */
@@ -124,7 +188,10 @@ phase2_func(
 {
 	struct action_list	alist;
 	struct workqueue	wq;
+	const struct xfrog_scrub_descr *sc;
+	struct ag_cost		*order;
 	xfs_agnumber_t		agno;
+	unsigned int		type;
 	bool			aborted = false;
 	int			ret, ret2;
 
@@ -148,22 +215,38 @@ phase2_func(
 	if (ret)
 		goto out;
 
-	for (agno = 0; !aborted && agno < ctx->mnt.fsgeom.agcount; agno++) {
-		ret = -workqueue_add(&wq, scan_ag_metadata, agno, &aborted);
+	/*
+	 * The whole-FS metadata (realtime bitmap and summary, quota files)
+	 * are all separate objects that don't depend on the AGs, so start
+	 * each of them straight away.
+	 */
+	sc = xfrog_scrubbers;
+	for (type = 0; type < XFS_SCRUB_TYPE_NR; type++, sc++) {
+		if (sc->type != XFROG_SCRUB_TYPE_FS ||
+		    (sc->flags & XFROG_SCRUB_DESCR_SUMMARY))
+			continue;
+		ret = -workqueue_add(&wq, scan_fs_metadata, type, &aborted);
 		if (ret) {
-			str_liberror(ctx, ret, _("queueing per-AG scrub work"));
+			str_liberror(ctx, ret, _("queueing per-FS scrub work"));
 			goto out;
 		}
 	}
 
-	if (aborted)
-		goto out;
-
-	ret = -workqueue_add(&wq, scan_fs_metadata, 0, &aborted);
-	if (ret) {
-		str_liberror(ctx, ret, _("queueing per-FS scrub work"));
+	order = order_ag_metadata(ctx);
+	if (!order) {
+		ret = ENOMEM;
+		str_liberror(ctx, ret, _("ordering per-AG scrub work"));
 		goto out;
 	}
+	for (agno = 0; !aborted && agno < ctx->mnt.fsgeom.agcount; agno++) {
+		ret = -workqueue_add(&wq, scan_ag_metadata, order[agno].agno,
+				&aborted);
+		if (ret) {
+			str_liberror(ctx, ret, _("queueing per-AG scrub work"));
+			break;
+		}
+	}
+	free(order);
 
 out:
 	ret2 = -workqueue_terminate(&wq);
@@ -176,6 +259,8 @@ out:
 
 	if (!ret && aborted)
 		ret = ECANCELED;
+	if (!ret && ctx->incr)
+		ctx->incr->ags_done = true;
 	return ret;
 }
 
@@ -17,6 +17,7 @@
 #include "progress.h"
 #include "scrub.h"
 #include "repair.h"
+#include "incremental.h"
 
 /* Phase 3: Scan all inodes. */
 
@@ -71,6 +72,12 @@ scrub_inode(
 	int			fd = -1;
 	int			error;
 
+	/* Nothing changed in this inode since the last clean run. */
+	if (incr_inode_unchanged(ctx, bstat)) {
+		progress_add(1);
+		return 0;
+	}
+
 	action_list_init(&alist);
 	agno = cvt_ino_to_agno(&ctx->mnt, bstat->bs_ino);
 	background_sleep();
@@ -189,6 +196,8 @@ phase3_func(
 	}
 
 	ctx->inodes_checked = val;
+	if (ctx->incr)
+		ctx->incr->inodes_done = true;
 free:
 	ptcounter_free(ictx.icount);
 	return err;
@@ -20,22 +20,43 @@
 
 /* Phase 4: Repair filesystem. */
 
-/* Fix all the problems in our per-AG list. */
+/*
+ * Inode repairs don't depend on each other, so a stage's file metadata
+ * repairs are farmed out in batches of this many, rather than one list per
+ * AG, to keep all the threads busy when the damage is in a few AGs.
+ */
+#define REPAIR_FILE_BATCH	64
+
+struct repair_batch {
+	struct action_list		alist;
+	xfs_agnumber_t			agno;
+};
+
+struct repair_work {
+	struct repair_batch		*batches;
+	bool				*aborted;
+};
+
+/* Fix all the problems in one batch of repairs. */
 static void
-repair_ag(
+repair_batch(
 	struct workqueue		*wq,
-	xfs_agnumber_t			agno,
+	xfs_agnumber_t			index,
 	void				*priv)
 {
 	struct scrub_ctx		*ctx = (struct scrub_ctx *)wq->wq_ctx;
-	bool				*aborted = priv;
+	struct repair_work		*rw = priv;
+	bool				*aborted = rw->aborted;
 	struct action_list		*alist;
 	size_t				unfixed;
 	size_t				new_unfixed;
 	unsigned int			flags = 0;
 	int				ret;
 
-	alist = &ctx->action_lists[agno];
+	if (*aborted)
+		return;
+
+	alist = &rw->batches[index].alist;
 	unfixed = action_list_length(alist);
 
 	/* Repair anything broken until we fail to make progress. */
@@ -60,27 +81,64 @@ repair_ag(
 		*aborted = true;
 }
 
-/* Process all the action items. */
+/*
+ * Pull this stage's items off the per-AG lists into batches, repair the
+ * batches in parallel, and put back whatever couldn't be fixed.
+ */
 static int
-repair_everything(
-	struct scrub_ctx		*ctx)
+repair_stage(
+	struct scrub_ctx		*ctx,
+	enum repair_stage		stage,
+	bool				*aborted)
 {
+	struct repair_work		rw = { .aborted = aborted };
+	struct repair_batch		*batch;
 	struct workqueue		wq;
+	size_t				max = 0;
+	size_t				moved;
+	unsigned int			nr = 0, size = 0;
+	unsigned int			i;
 	xfs_agnumber_t			agno;
-	bool				aborted = false;
-	int				ret;
+	int				ret = 0;
+
+	if (stage == REPAIR_STAGE_FILE)
+		max = REPAIR_FILE_BATCH;
+
+	for (agno = 0; agno < ctx->mnt.fsgeom.agcount; agno++) {
+		do {
+			if (nr == size) {
+				size = size ? size * 2 : 64;
+				batch = realloc(rw.batches,
+						size * sizeof(*batch));
+				if (!batch) {
+					ret = ENOMEM;
+					str_liberror(ctx, ret,
+						_("allocating repair batches"));
+					goto out;
+				}
+				rw.batches = batch;
+			}
+			batch = &rw.batches[nr];
+			action_list_init(&batch->alist);
+			batch->agno = agno;
+			moved = action_list_take_stage(
+					&ctx->action_lists[agno], stage,
+					&batch->alist, max);
+			if (moved)
+				nr++;
+		} while (moved && max);
+	}
+	if (nr == 0)
+		goto out;
 
 	ret = -workqueue_create(&wq, (struct xfs_mount *)ctx,
 			scrub_nproc_workqueue(ctx));
 	if (ret) {
 		str_liberror(ctx, ret, _("creating repair workqueue"));
-		return ret;
+		goto out;
 	}
-	for (agno = 0; !aborted && agno < ctx->mnt.fsgeom.agcount; agno++) {
-		if (action_list_length(&ctx->action_lists[agno]) == 0)
-			continue;
-
-		ret = -workqueue_add(&wq, repair_ag, agno, &aborted);
+	for (i = 0; !*aborted && i < nr; i++) {
+		ret = -workqueue_add(&wq, repair_batch, i, &rw);
 		if (ret) {
 			str_liberror(ctx, ret, _("queueing repair work"));
 			break;
@@ -92,6 +150,33 @@ repair_everything(
 		str_liberror(ctx, ret, _("finishing repair work"));
 	workqueue_destroy(&wq);
 
+out:
+	for (i = 0; i < nr; i++)
+		action_list_splice(&ctx->action_lists[rw.batches[i].agno],
+				&rw.batches[i].alist);
+	free(rw.batches);
+	return ret;
+}
+
+/* Process all the action items. */
+static int
+repair_everything(
+	struct scrub_ctx		*ctx)
+{
+	enum repair_stage		stage;
+	bool				aborted = false;
+	int				ret;
+
+	/*
+	 * Each stage finishes before the next one starts; within a stage,
+	 * lists that don't depend on each other are repaired in parallel.
+	 */
+	for (stage = 0; !aborted && stage < REPAIR_STAGE_NR; stage++) {
+		ret = repair_stage(ctx, stage, &aborted);
+		if (ret)
+			return ret;
+	}
+
 	if (aborted)
 		return ECANCELED;
 
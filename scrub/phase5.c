@@ -23,6 +23,8 @@
 #include "scrub.h"
 #include "descr.h"
 #include "unicrash.h"
+#include "libfrog/fsgeom.h"
+#include "libfrog/bulkstat.h"
 
 /* Phase 5: Check directory connectivity. */
 
@@ -248,6 +250,28 @@ render_ino_from_handle(
 			bstat->bs_gen, NULL);
 }
 
+/*
+ * Checking names is mostly waiting for open_by_handle, getdents, and
+ * attr_list syscalls, so the bulkstat scan hands every inode with names to
+ * a second pool of threads instead of checking them itself.  That way the
+ * next directories from each bulkstat batch are opened and read while we
+ * work through the current one, even if there are only a few AGs.  We
+ * queue at most one inode chunk per thread ahead of the workers.
+ */
+struct names_scan {
+	struct workqueue	wq;
+	bool			aborted;
+};
+
+struct names_item {
+	struct names_scan	*ns;
+	struct xfs_handle	handle;
+	struct xfs_bulkstat	bstat;
+};
+
+/* Give up on an inode that keeps getting freed and reallocated. */
+#define NAMES_MAX_STALE		30
+
 /*
  * Verify the connectivity of the directory tree.
  * We know that the kernel's open-by-handle function will try to reconnect
@@ -256,14 +280,12 @@ render_ino_from_handle(
  * Check for potential Unicode collisions in names.
  */
 static int
-check_inode_names(
+__check_inode_names(
 	struct scrub_ctx	*ctx,
 	struct xfs_handle	*handle,
-	struct xfs_bulkstat	*bstat,
-	void			*arg)
+	struct xfs_bulkstat	*bstat)
 {
 	DEFINE_DESCR(dsc, ctx, render_ino_from_handle);
-	bool			*aborted = arg;
 	int			fd = -1;
 	int			error = 0;
 	int			err2;
@@ -300,7 +322,6 @@ check_inode_names(
 	}
 
 out:
-	progress_add(1);
 	if (fd >= 0) {
 		err2 = close(fd);
 		if (err2)
@@ -309,14 +330,105 @@ out:
 			error = err2;
 	}
 
-	if (error)
-		*aborted = true;
-	if (!error && *aborted)
-		error = ECANCELED;
-
 	return error;
 }
 
+/*
+ * Check the names of one inode.  If the handle has gone stale, the inode
+ * was freed and maybe reallocated since bulkstat saw it, so look it up
+ * again and check whatever is there now.
+ */
+static void
+check_inode_names_work(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct names_item	*item = arg;
+	struct names_scan	*ns = item->ns;
+	struct scrub_ctx	*ctx = (struct scrub_ctx *)wq->wq_ctx;
+	uint64_t		ino = item->bstat.bs_ino;
+	int			stale_count = 0;
+	int			error;
+
+	while (!ns->aborted) {
+		error = __check_inode_names(ctx, &item->handle, &item->bstat);
+		if (error != ESTALE)
+			break;
+
+		if (++stale_count >= NAMES_MAX_STALE) {
+			char	idescr[DESCR_BUFSZ];
+
+			scrub_render_ino_descr(ctx, idescr, DESCR_BUFSZ,
+					ino, item->bstat.bs_gen, NULL);
+			str_info(ctx, idescr,
+_("Changed too many times during scan; giving up."));
+			error = 0;
+			break;
+		}
+
+		/* If the inode is gone, there's nothing left to check. */
+		error = -xfrog_bulkstat_single(&ctx->mnt, ino, 0, &item->bstat);
+		if (error || item->bstat.bs_ino != ino) {
+			error = 0;
+			break;
+		}
+		item->handle.ha_fid.fid_gen = item->bstat.bs_gen;
+	}
+
+	if (error || scrub_excessive_errors(ctx))
+		ns->aborted = true;
+	progress_add(1);
+	free(item);
+}
+
+/*
+ * Hand every inode that has names to check to the name checking threads.
+ * Inodes without any names are done already.
+ */
+static int
+check_inode_names(
+	struct scrub_ctx	*ctx,
+	struct xfs_handle	*handle,
+	struct xfs_bulkstat	*bstat,
+	void			*arg)
+{
+	struct names_scan	*ns = arg;
+	struct names_item	*item;
+	int			ret;
+
+	if (ns->aborted)
+		return ECANCELED;
+
+	if (!S_ISDIR(bstat->bs_mode) &&
+	    !(bstat->bs_xflags & FS_XFLAG_HASATTR)) {
+		progress_add(1);
+		return 0;
+	}
+
+	item = malloc(sizeof(struct names_item));
+	if (!item) {
+		ret = errno;
+		str_liberror(ctx, ret, _("allocating name check work"));
+		goto out_abort;
+	}
+	item->ns = ns;
+	item->handle = *handle;
+	item->bstat = *bstat;
+
+	ret = -workqueue_add(&ns->wq, check_inode_names_work, 0, item);
+	if (ret) {
+		free(item);
+		str_liberror(ctx, ret, _("queueing name check work"));
+		goto out_abort;
+	}
+	return 0;
+
+out_abort:
+	ns->aborted = true;
+	return ret;
+}
+
 #ifndef FS_IOC_GETFSLABEL
 # define FSLABEL_MAX		256
 # define FS_IOC_GETFSLABEL	_IOR(0x94, 49, char[FSLABEL_MAX])
@@ -385,8 +497,8 @@ int
 phase5_func(
 	struct scrub_ctx	*ctx)
 {
-	bool			aborted = false;
-	int			ret;
+	struct names_scan	ns = { };
+	int			ret, ret2;
 
 	if (ctx->corruptions_found || ctx->unfixable_errors) {
 		str_info(ctx, ctx->mntpoint,
@@ -398,10 +510,26 @@ _("Filesystem has errors, skipping connectivity checks."));
 	if (ret)
 		return ret;
 
-	ret = scrub_scan_all_inodes(ctx, check_inode_names, &aborted);
+	ret = -workqueue_create_bound(&ns.wq, (struct xfs_mount *)ctx,
+			scrub_nproc_workqueue(ctx),
+			scrub_nproc(ctx) * LIBFROG_BULKSTAT_CHUNKSIZE);
+	if (ret) {
+		str_liberror(ctx, ret, _("creating name check workqueue"));
+		return ret;
+	}
+
+	ret = scrub_scan_all_inodes(ctx, check_inode_names, &ns);
+
+	ret2 = -workqueue_terminate(&ns.wq);
+	if (ret2) {
+		str_liberror(ctx, ret2, _("finishing name check work"));
+		ns.aborted = true;
+	}
+	workqueue_destroy(&ns.wq);
+
 	if (ret)
 		return ret;
-	if (aborted)
+	if (ns.aborted)
 		return ECANCELED;
 
 	scrub_report_preen_triggers(ctx);
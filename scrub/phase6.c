@@ -11,6 +11,7 @@
 #include "handle.h"
 #include "libfrog/paths.h"
 #include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
 #include "xfs_scrub.h"
 #include "common.h"
 #include "libfrog/bitmap.h"
@@ -19,6 +20,7 @@
 #include "fscounters.h"
 #include "inodes.h"
 #include "read_verify.h"
+#include "incremental.h"
 #include "spacemap.h"
 #include "vfs.h"
 
@@ -510,6 +512,13 @@ check_rmap(
 	struct read_verify_pool		*rvp;
 	int				ret;
 
+	/* Count block usage for phase 7 while we're here. */
+	if (ctx->block_counts) {
+		ret = phase7_count_blocks(ctx, map, ctx->block_counts);
+		if (ret)
+			return ret;
+	}
+
 	rvp = dev_to_pool(ctx, vs, map->fmr_device);
 
 	dbg_printf("rmap dev %d:%d phys %"PRIu64" owner %"PRId64
@@ -536,6 +545,10 @@ check_rmap(
 
 	/* XXX: Filter out directory data blocks. */
 
+	/* The file hasn't changed since we last verified its data. */
+	if (incr_data_unchanged(ctx, map->fmr_owner))
+		return 0;
+
 	/* Schedule the read verify command for (eventual) running. */
 	ret = read_verify_schedule_io(rvp, map->fmr_physical, map->fmr_length,
 			vs);
@@ -656,7 +669,19 @@ phase6_func(
 			goto out_logpool;
 		}
 	}
+	/*
+	 * Phase 7 walks the space map to total up the block usage, so count
+	 * it here and save it the trouble.  That's only an optimization, so
+	 * carry on without it if we can't set it up.
+	 */
+	if (phase7_alloc_block_counts(ctx, &ctx->block_counts))
+		ctx->block_counts = NULL;
+
 	ret = scrub_scan_all_spacemaps(ctx, check_rmap, &vs);
+	if ((ret || scrub_excessive_errors(ctx)) && ctx->block_counts) {
+		ptvar_free(ctx->block_counts);
+		ctx->block_counts = NULL;
+	}
 	if (ret)
 		goto out_rtpool;
 
@@ -678,8 +703,11 @@ phase6_func(
 	 */
 	if (ret || ret2 || ret3)
 		goto out_rbad;
-	if (bitmap_empty(vs.d_bad) && bitmap_empty(vs.r_bad))
+	if (bitmap_empty(vs.d_bad) && bitmap_empty(vs.r_bad)) {
+		if (ctx->incr)
+			ctx->incr->data_done = true;
 		goto out_rbad;
+	}
 
 	/* Scan the whole dir tree to see what matches the bad extents. */
 	ret = report_all_media_errors(ctx, &vs);
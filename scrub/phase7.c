@@ -27,9 +27,22 @@ struct summary_counts {
 	unsigned long long	agbytes;	/* freespace bytes */
 };
 
-/* Record block usage. */
-static int
-count_block_summary(
+/* Set up per-thread block usage counters for an fsmap scan. */
+int
+phase7_alloc_block_counts(
+	struct scrub_ctx	*ctx,
+	struct ptvar		**ptvp)
+{
+	return -ptvar_alloc(scrub_nproc(ctx), sizeof(struct summary_counts),
+			ptvp);
+}
+
+/*
+ * Record block usage.  Phase 6 calls this for every record of its media
+ * scan so that we don't have to walk the space map a second time.
+ */
+int
+phase7_count_blocks(
 	struct scrub_ctx	*ctx,
 	struct fsmap		*fsmap,
 	void			*arg)
@@ -133,17 +146,26 @@ phase7_func(
 		return error;
 	}
 
-	error = -ptvar_alloc(scrub_nproc(ctx), sizeof(struct summary_counts),
-			&ptvar);
-	if (error) {
-		str_liberror(ctx, error, _("setting up block counter"));
-		return error;
-	}
+	/*
+	 * Use fsmap to count blocks, unless the phase 6 media scan already
+	 * did that for us.  We flushed the fs since then, but anything that
+	 * got written in the meantime is well within our error margin.
+	 */
+	if (ctx->block_counts) {
+		ptvar = ctx->block_counts;
+		ctx->block_counts = NULL;
+	} else {
+		error = phase7_alloc_block_counts(ctx, &ptvar);
+		if (error) {
+			str_liberror(ctx, error, _("setting up block counter"));
+			return error;
+		}
 
-	/* Use fsmap to count blocks. */
-	error = scrub_scan_all_spacemaps(ctx, count_block_summary, ptvar);
-	if (error)
-		goto out_free;
+		error = scrub_scan_all_spacemaps(ctx, phase7_count_blocks,
+				ptvar);
+		if (error)
+			goto out_free;
+	}
 	error = -ptvar_foreach(ptvar, add_summaries, &totalcount);
 	if (error) {
 		str_liberror(ctx, error, _("counting blocks"));
@@ -15,6 +15,7 @@
 #include "common.h"
 #include "counter.h"
 #include "progress.h"
+#include "telemetry.h"
 
 /*
  * Progress Tracking
@@ -26,6 +27,8 @@
  * the work to be done and periodic updates when work items finish.  In
  * return, the progress tracker will print a pretty progress bar and
  * twiddle to a tty, or a raw numeric output compatible with fsck -C.
+ * If we're recording telemetry, we count the work items even if nobody
+ * is watching the progress.
  */
 struct progress_tracker {
 	FILE			*fp;
@@ -54,7 +57,7 @@ void
 progress_add(
 	uint64_t		x)
 {
-	if (pt.fp)
+	if (pt.ptc)
 		ptcounter_add(pt.ptc, x);
 }
 
@@ -144,12 +147,21 @@ progress_report_thread(void *arg)
 	return NULL;
 }
 
-/* End a phase of progress reporting. */
-void
+/*
+ * End a phase of progress reporting.  Returns the number of work items that
+ * were done.
+ */
+uint64_t
 progress_end_phase(void)
 {
+	uint64_t		done = 0;
+
+	if (!pt.ptc)
+		return 0;
+	if (ptcounter_value(pt.ptc, &done))
+		done = 0;
 	if (!pt.fp)
-		return;
+		goto out_ptc;
 
 	pthread_mutex_lock(&pt.lock);
 	pt.terminate = true;
@@ -158,14 +170,14 @@ progress_end_phase(void)
 	pthread_join(pt.thread, NULL);
 
 	progress_report(pt.max);
+	fprintf(pt.fp, CLEAR_EOL);
+	fflush(pt.fp);
+	pt.fp = NULL;
+out_ptc:
 	ptcounter_free(pt.ptc);
 	pt.max = 0;
 	pt.ptc = NULL;
-	if (pt.fp) {
-		fprintf(pt.fp, CLEAR_EOL);
-		fflush(pt.fp);
-	}
-	pt.fp = NULL;
+	return done;
 }
 
 /*
@@ -183,13 +195,12 @@ progress_init_phase(
 {
 	int			ret;
 
-	assert(pt.fp == NULL);
-	if (fp == NULL || max == 0) {
+	assert(pt.fp == NULL && pt.ptc == NULL);
+	if ((fp == NULL && !telemetry_on) || max == 0) {
 		pt.fp = NULL;
 		return 0;
 	}
-	pt.fp = fp;
-	pt.isatty = isatty(fileno(fp));
+	pt.isatty = fp && isatty(fileno(fp));
 	pt.tag = ctx->mntpoint;
 	pt.max = max;
 	pt.phase = phase;
@@ -203,9 +214,13 @@ progress_init_phase(
 		goto out_max;
 	}
 
+	if (!fp)
+		return 0;
+	pt.fp = fp;
 	ret = pthread_create(&pt.thread, NULL, progress_report_thread, NULL);
 	if (ret) {
 		str_liberror(ctx, ret, _("creating progress reporting thread"));
+		pt.fp = NULL;
 		goto out_ptcounter;
 	}
 
@@ -13,7 +13,7 @@
 int progress_init_phase(struct scrub_ctx *ctx, FILE *progress_fp,
 			 unsigned int phase, uint64_t max, int rshift,
 			 unsigned int nr_threads);
-void progress_end_phase(void);
+uint64_t progress_end_phase(void);
 void progress_add(uint64_t x);
 
 #endif /* XFS_SCRUB_PROGRESS_H_ */
@@ -7,8 +7,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/statvfs.h>
+#include <pthread.h>
+#include <time.h>
 #include "libfrog/ptvar.h"
 #include "libfrog/workqueue.h"
+#include "libfrog/ioring.h"
 #include "libfrog/paths.h"
 #include "xfs_scrub.h"
 #include "common.h"
@@ -16,6 +19,7 @@
 #include "disk.h"
 #include "read_verify.h"
 #include "progress.h"
+#include "telemetry.h"
 
 /*
  * Read Verify Pool
@@ -25,11 +29,26 @@
  * pool worker.  Adjacent (or nearly adjacent) requests can be combined
  * to reduce overhead when free space fragmentation is high.  The thread
  * pool takes care of issuing multiple IOs to the device, if possible.
+ *
+ * If we can use io_uring, a single thread per pool keeps up to
+ * verify_qdepth reads in flight instead, which keeps a wide device busy
+ * without needing a thread for each IO.  The data is never looked at, so
+ * every read lands in the same buffer.  A read that fails or comes up
+ * short is redone with blocking reads to narrow down the bad blocks.
+ *
+ * Reads can also be held to a budget of bytes and IOs per second on each
+ * disk.  Every read costs the larger of its share of the two limits, and
+ * we hand out start times spaced apart by that cost, with up to
+ * RVP_THROTTLE_BURST of unused time banked.  If a latency target is set,
+ * the budget shrinks while reads take longer than that and slowly grows
+ * back when they don't, so that a scrub backs off when something else
+ * starts using the disk.
  */
 
 /*
  * Perform all IO in 32M chunks.  This cannot exceed 65536 sectors
- * because that's the biggest SCSI VERIFY(16) we dare to send.
+ * because that's the biggest SCSI VERIFY(16) we dare to send, and the
+ * most blocks that a single NVMe Verify can cover.
  */
 #define RVP_IO_MAX_SIZE		(33554432)
 
@@ -46,6 +65,13 @@ rvp_io_max_size(void)
 	return bg_mode > 0 ? RVP_BACKGROUND_IO_MAX_SIZE : RVP_IO_MAX_SIZE;
 }
 
+/* Unused verification budget that we let build up, in nanoseconds. */
+#define RVP_THROTTLE_BURST	(NSEC_PER_SEC / 10)
+
+/* Budget scaling, in 1/RVP_THROTTLE_SCALE of the configured budget. */
+#define RVP_THROTTLE_SCALE	(1024)
+#define RVP_THROTTLE_MIN_SCALE	(RVP_THROTTLE_SCALE / 64)
+
 /* Tolerate 64k holes in adjacent read verify requests. */
 #define RVP_IO_BATCH_LOCALITY	(65536)
 
@@ -54,6 +80,18 @@ struct read_verify {
 	struct disk		*io_disk;
 	uint64_t		io_start;	/* bytes */
 	uint64_t		io_length;	/* bytes */
+
+	/* io_uring engine */
+	struct read_verify	*io_next;	/* next queued request */
+	unsigned int		io_pending;	/* reads in flight */
+};
+
+/* One read in flight on the io_uring engine. */
+struct read_verify_slot {
+	struct read_verify	*rv;
+	uint64_t		start;		/* bytes */
+	uint64_t		length;		/* bytes */
+	uint64_t		issued;		/* ns */
 };
 
 struct read_verify_pool {
@@ -71,8 +109,34 @@ struct read_verify_pool {
 	 * return it to the caller.
 	 */
 	int			runtime_error;
+
+	/* blocking reads in flight, for telemetry */
+	unsigned int		nr_inflight;
+
+	/* io_uring engine, used instead of the thread pool if use_ring */
+	bool			use_ring;
+	struct ioring		ring;
+	pthread_t		ring_thread;
+	pthread_mutex_t		ring_lock;
+	pthread_cond_t		ring_wake;	/* new request or ring_stop */
+	struct read_verify	*ring_head;	/* queued requests */
+	struct read_verify	*ring_tail;
+	bool			ring_stop;
+	unsigned int		qdepth;
+	struct read_verify_slot	*slots;
+	unsigned int		*free_slots;	/* stack of unused slots */
+	unsigned int		nr_free_slots;
+
+	/* Verification budget */
+	pthread_mutex_t		throttle_lock;
+	uint64_t		throttle_next;	/* start of the next read, ns */
+	uint64_t		throttle_lat;	/* average read latency, ns */
+	unsigned int		throttle_scale;
 };
 
+static int read_verify_ring_init(struct read_verify_pool *rvp);
+static void read_verify_ring_stop(struct read_verify_pool *rvp);
+
 /*
  * Create a thread pool to run read verifiers.
  *
@@ -119,10 +183,16 @@ read_verify_pool_alloc(
 	rvp->ctx = ctx;
 	rvp->disk = disk;
 	rvp->ioerr_fn = ioerr_fn;
+	rvp->throttle_scale = RVP_THROTTLE_SCALE;
+	pthread_mutex_init(&rvp->throttle_lock, NULL);
 	ret = -ptvar_alloc(submitter_threads, sizeof(struct read_verify),
 			&rvp->rvstate);
 	if (ret)
 		goto out_counter;
+	if (read_verify_ring_init(rvp) == 0) {
+		*prvp = rvp;
+		return 0;
+	}
 	ret = -workqueue_create(&rvp->wq, (struct xfs_mount *)rvp,
 			verifier_threads == 1 ? 0 : verifier_threads);
 	if (ret)
@@ -133,6 +203,7 @@ read_verify_pool_alloc(
 out_rvstate:
 	ptvar_free(rvp->rvstate);
 out_counter:
+	pthread_mutex_destroy(&rvp->throttle_lock);
 	ptcounter_free(rvp->verified_bytes);
 out_buf:
 	free(rvp->readbuf);
@@ -148,7 +219,10 @@ read_verify_pool_abort(
 {
 	if (!rvp->runtime_error)
 		rvp->runtime_error = ECANCELED;
-	workqueue_terminate(&rvp->wq);
+	if (rvp->use_ring)
+		read_verify_ring_stop(rvp);
+	else
+		workqueue_terminate(&rvp->wq);
 }
 
 /* Finish up any read verification work. */
@@ -156,6 +230,10 @@ int
 read_verify_pool_flush(
 	struct read_verify_pool		*rvp)
 {
+	if (rvp->use_ring) {
+		read_verify_ring_stop(rvp);
+		return 0;
+	}
 	return -workqueue_terminate(&rvp->wq);
 }
 
@@ -164,34 +242,131 @@ void
 read_verify_pool_destroy(
 	struct read_verify_pool		*rvp)
 {
-	workqueue_destroy(&rvp->wq);
+	if (rvp->use_ring) {
+		ioring_free(&rvp->ring);
+		pthread_cond_destroy(&rvp->ring_wake);
+		pthread_mutex_destroy(&rvp->ring_lock);
+		free(rvp->slots);
+		free(rvp->free_slots);
+	} else {
+		workqueue_destroy(&rvp->wq);
+	}
+	pthread_mutex_destroy(&rvp->throttle_lock);
 	ptvar_free(rvp->rvstate);
 	ptcounter_free(rvp->verified_bytes);
 	free(rvp->readbuf);
 	free(rvp);
 }
 
+static inline uint64_t
+read_verify_now(void)
+{
+	struct timespec			ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
 /*
- * Issue a read-verify IO in big batches.
+ * Take @len bytes out of the budget and return the time at which we may
+ * start reading them, or zero if there's no budget.
  */
+static uint64_t
+read_verify_throttle_reserve(
+	struct read_verify_pool		*rvp,
+	uint64_t			len)
+{
+	uint64_t			cost = 0;
+	uint64_t			start;
+	uint64_t			now;
+
+	if (!verify_bw_limit && !verify_iops_limit)
+		return 0;
+
+	if (verify_bw_limit)
+		cost = len * NSEC_PER_SEC / verify_bw_limit;
+	if (verify_iops_limit)
+		cost = max(cost, NSEC_PER_SEC / verify_iops_limit);
+
+	now = read_verify_now();
+	pthread_mutex_lock(&rvp->throttle_lock);
+	cost = cost * RVP_THROTTLE_SCALE / rvp->throttle_scale;
+	if (rvp->throttle_next + RVP_THROTTLE_BURST < now)
+		rvp->throttle_next = now - RVP_THROTTLE_BURST;
+	start = rvp->throttle_next;
+	rvp->throttle_next += cost;
+	pthread_mutex_unlock(&rvp->throttle_lock);
+	return start;
+}
+
+/* Wait until the budget lets us read @len bytes. */
 static void
-read_verify(
-	struct workqueue		*wq,
-	xfs_agnumber_t			agno,
-	void				*arg)
+read_verify_throttle(
+	struct read_verify_pool		*rvp,
+	uint64_t			len)
+{
+	struct timespec			ts;
+	uint64_t			start;
+	uint64_t			now;
+
+	start = read_verify_throttle_reserve(rvp, len);
+	if (!start)
+		return;
+	now = read_verify_now();
+	if (start <= now)
+		return;
+	ts.tv_sec = (start - now) / NSEC_PER_SEC;
+	ts.tv_nsec = (start - now) % NSEC_PER_SEC;
+	nanosleep(&ts, NULL);
+}
+
+/* Adjust the budget to how long a read took to complete. */
+static void
+read_verify_throttle_done(
+	struct read_verify_pool		*rvp,
+	uint64_t			issued)
+{
+	uint64_t			lat;
+	unsigned int			scale;
+
+	if (!verify_latency_target)
+		return;
+
+	lat = read_verify_now() - issued;
+	pthread_mutex_lock(&rvp->throttle_lock);
+	if (rvp->throttle_lat)
+		rvp->throttle_lat = (rvp->throttle_lat * 7 + lat) / 8;
+	else
+		rvp->throttle_lat = lat;
+
+	scale = rvp->throttle_scale;
+	if (rvp->throttle_lat > verify_latency_target * NSEC_PER_USEC)
+		scale = max(scale * 3 / 4, RVP_THROTTLE_MIN_SCALE);
+	else
+		scale = min(scale + scale / 64 + 1, RVP_THROTTLE_SCALE);
+	if (scale != rvp->throttle_scale)
+		dbg_printf("THROTTLE %d lat %"PRIu64" scale %u\n",
+				rvp->disk->d_fd, rvp->throttle_lat, scale);
+	rvp->throttle_scale = scale;
+	pthread_mutex_unlock(&rvp->throttle_lock);
+}
+
+/*
+ * Verify the range of @rv with blocking reads in big batches, stepping
+ * through single blocks to find the bad ones if a read fails.  Returns the
+ * number of bytes that read back fine.
+ */
+static unsigned long long
+read_verify_range(
+	struct read_verify_pool		*rvp,
+	struct read_verify		*rv)
 {
-	struct read_verify		*rv = arg;
-	struct read_verify_pool		*rvp;
 	unsigned long long		verified = 0;
+	uint64_t			issued;
 	ssize_t				io_max_size;
 	ssize_t				sz;
 	ssize_t				len;
 	int				read_error;
-	int				ret;
-
-	rvp = (struct read_verify_pool *)wq->wq_ctx;
-	if (rvp->runtime_error)
-		return;
 
 	io_max_size = rvp_io_max_size();
 
@@ -200,8 +375,15 @@ read_verify(
 		len = min(rv->io_length, io_max_size);
 		dbg_printf("diskverify %d %"PRIu64" %zu\n", rvp->disk->d_fd,
 				rv->io_start, len);
+		read_verify_throttle(rvp, len);
+		telemetry_io_issue(__atomic_add_fetch(&rvp->nr_inflight, 1,
+					__ATOMIC_RELAXED));
+		issued = read_verify_now();
 		sz = disk_read_verify(rvp->disk, rvp->readbuf, rv->io_start,
 				len);
+		telemetry_io_done(read_verify_now() - issued, max(sz, 0));
+		__atomic_sub_fetch(&rvp->nr_inflight, 1, __ATOMIC_RELAXED);
+		read_verify_throttle_done(rvp, issued);
 		if (sz == len && io_max_size < rvp->miniosz) {
 			/*
 			 * If the verify request was 100% successful and less
@@ -218,7 +400,7 @@ read_verify(
 			/* Runtime error, bail out... */
 			if (read_error != EIO && read_error != EILSEQ) {
 				rvp->runtime_error = read_error;
-				return;
+				return verified;
 			}
 
 			/*
@@ -272,12 +454,315 @@ read_verify(
 		background_sleep();
 	}
 
+	return verified;
+}
+
+/*
+ * Issue a read-verify IO in big batches.
+ */
+static void
+read_verify(
+	struct workqueue		*wq,
+	xfs_agnumber_t			agno,
+	void				*arg)
+{
+	struct read_verify		*rv = arg;
+	struct read_verify_pool		*rvp;
+	unsigned long long		verified;
+	int				ret;
+
+	rvp = (struct read_verify_pool *)wq->wq_ctx;
+	if (rvp->runtime_error) {
+		free(rv);
+		return;
+	}
+
+	verified = read_verify_range(rvp, rv);
 	free(rv);
 	ret = ptcounter_add(rvp->verified_bytes, verified);
 	if (ret)
 		rvp->runtime_error = ret;
 }
 
+#ifdef HAVE_IO_URING
+/* Take the next queued request, maybe waiting for one to show up. */
+static struct read_verify *
+read_verify_ring_next(
+	struct read_verify_pool		*rvp,
+	bool				wait)
+{
+	struct read_verify		*rv;
+
+	pthread_mutex_lock(&rvp->ring_lock);
+	while (wait && !rvp->ring_head && !rvp->ring_stop)
+		pthread_cond_wait(&rvp->ring_wake, &rvp->ring_lock);
+	rv = rvp->ring_head;
+	if (rv) {
+		rvp->ring_head = rv->io_next;
+		if (!rvp->ring_head)
+			rvp->ring_tail = NULL;
+	}
+	pthread_mutex_unlock(&rvp->ring_lock);
+	return rv;
+}
+
+/* Retire a read, returning the number of bytes that read back fine. */
+static unsigned long long
+read_verify_ring_done(
+	struct read_verify_pool		*rvp,
+	struct read_verify_slot		*slot,
+	int				res)
+{
+	struct read_verify		*rv = slot->rv;
+	unsigned long long		verified = 0;
+
+	telemetry_io_done(read_verify_now() - slot->issued, max(res, 0));
+	read_verify_throttle_done(rvp, slot->issued);
+	if (res >= 0 && res == slot->length) {
+		progress_add(res);
+		verified = res;
+	} else if (!rvp->runtime_error) {
+		struct read_verify	piece = {
+			.io_end_arg	= rv->io_end_arg,
+			.io_disk	= rv->io_disk,
+			.io_start	= slot->start,
+			.io_length	= slot->length,
+		};
+
+		dbg_printf("RING %s %d @ %"PRIu64" %"PRIu64" res %d\n",
+				res < 0 ? "IOERR" : "SHORT", rvp->disk->d_fd,
+				slot->start, slot->length, res);
+		verified = read_verify_range(rvp, &piece);
+	}
+
+	if (--rv->io_pending == 0 && rv->io_length == 0)
+		free(rv);
+	return verified;
+}
+
+/* user_data of the timeout that holds back reads that are over budget */
+#define RVP_RING_TIMER		(~0ULL)
+
+/*
+ * Keep the ring full of reads of up to rvp_io_max_size() carved off the
+ * queued requests until we're told to stop and the queue is empty, or
+ * until something goes wrong.  If the next read is over budget, we queue
+ * a timeout instead of sleeping so that we keep reaping completions (and
+ * timing them correctly) in the meantime.
+ */
+static void *
+read_verify_ring_thread(
+	void				*arg)
+{
+	struct read_verify_pool		*rvp = arg;
+	struct read_verify		*rv = NULL;
+	struct read_verify_slot		*slot;
+	struct io_uring_sqe		*sqe;
+	struct io_uring_cqe		*cqe;
+	struct __kernel_timespec	timer_ts;
+	unsigned long long		verified = 0;
+	uint64_t			io_max_size = rvp_io_max_size();
+	uint64_t			hold_until = 0;
+	uint64_t			now;
+	uint64_t			len;
+	bool				timer_armed = false;
+	unsigned int			inflight = 0;
+	unsigned int			i;
+	int				res;
+	int				ret;
+
+	for (;;) {
+		while (inflight < rvp->qdepth && !rvp->runtime_error) {
+			if (!rv) {
+				rv = read_verify_ring_next(rvp,
+						inflight == 0 && !timer_armed);
+				if (!rv)
+					break;
+			}
+
+			len = min(rv->io_length, io_max_size);
+			if (!hold_until)
+				hold_until = read_verify_throttle_reserve(rvp,
+						len);
+			now = read_verify_now();
+			if (hold_until > now) {
+				if (timer_armed)
+					break;
+				sqe = ioring_get_sqe(&rvp->ring);
+				if (!sqe)
+					break;
+				timer_ts.tv_sec = (hold_until - now) /
+						NSEC_PER_SEC;
+				timer_ts.tv_nsec = (hold_until - now) %
+						NSEC_PER_SEC;
+				ioring_prep_rw(sqe, IORING_OP_TIMEOUT, -1,
+						&timer_ts, 1, 0,
+						RVP_RING_TIMER);
+				timer_armed = true;
+				break;
+			}
+
+			sqe = ioring_get_sqe(&rvp->ring);
+			if (!sqe)
+				break;
+			hold_until = 0;
+
+			i = rvp->free_slots[--rvp->nr_free_slots];
+			slot = &rvp->slots[i];
+			slot->rv = rv;
+			slot->start = rv->io_start;
+			slot->length = len;
+			slot->issued = now;
+			ioring_prep_rw(sqe, IORING_OP_READ, rvp->disk->d_fd,
+					rvp->readbuf, slot->length,
+					slot->start, i);
+			rv->io_start += slot->length;
+			rv->io_length -= slot->length;
+			rv->io_pending++;
+			inflight++;
+			telemetry_io_issue(inflight);
+			if (rv->io_length == 0)
+				rv = NULL;
+		}
+		if (inflight == 0 && !timer_armed)
+			break;
+
+		ret = ioring_submit(&rvp->ring, 1);
+		if (ret < 0) {
+			rvp->runtime_error = -ret;
+			break;
+		}
+
+		while ((cqe = ioring_peek_cqe(&rvp->ring)) != NULL) {
+			if (cqe->user_data == RVP_RING_TIMER) {
+				ioring_cqe_seen(&rvp->ring);
+				timer_armed = false;
+				continue;
+			}
+
+			i = cqe->user_data;
+			res = cqe->res;
+			ioring_cqe_seen(&rvp->ring);
+
+			verified += read_verify_ring_done(rvp, &rvp->slots[i],
+					res);
+			rvp->free_slots[rvp->nr_free_slots++] = i;
+			inflight--;
+		}
+	}
+
+	/* Throw away whatever we didn't get to after a runtime error. */
+	if (rv && rv->io_pending == 0)
+		free(rv);
+	while ((rv = read_verify_ring_next(rvp, false)) != NULL)
+		free(rv);
+
+	ret = ptcounter_add(rvp->verified_bytes, verified);
+	if (ret && !rvp->runtime_error)
+		rvp->runtime_error = ret;
+	return NULL;
+}
+
+/*
+ * Set up the io_uring engine.  Background mode throttles its IO and the
+ * simulated disk errors happen in disk_read_verify, so both of them stay
+ * with the thread pool, as do SCSI VERIFY and NVMe Verify.
+ */
+static int
+read_verify_ring_init(
+	struct read_verify_pool		*rvp)
+{
+	unsigned int			i;
+	int				ret;
+
+	if (verify_qdepth < 2 || bg_mode > 0 ||
+	    (rvp->disk->d_flags & DISK_FLAGS_DEVICE_VERIFY) ||
+	    debug_tweak_on("XFS_SCRUB_DISK_ERROR_INTERVAL") ||
+	    debug_tweak_on("XFS_SCRUB_DISK_VERIFY_SKIP"))
+		return EOPNOTSUPP;
+
+	rvp->qdepth = verify_qdepth;
+	rvp->slots = calloc(rvp->qdepth, sizeof(struct read_verify_slot));
+	rvp->free_slots = calloc(rvp->qdepth, sizeof(unsigned int));
+	if (!rvp->slots || !rvp->free_slots) {
+		ret = ENOMEM;
+		goto out_slots;
+	}
+	for (i = 0; i < rvp->qdepth; i++)
+		rvp->free_slots[i] = i;
+	rvp->nr_free_slots = rvp->qdepth;
+
+	/* One extra entry for the budget timeout. */
+	ret = -ioring_init(&rvp->ring, rvp->qdepth + 1, 0);
+	if (ret)
+		goto out_slots;
+
+	pthread_mutex_init(&rvp->ring_lock, NULL);
+	pthread_cond_init(&rvp->ring_wake, NULL);
+	ret = -pthread_create(&rvp->ring_thread, NULL,
+			read_verify_ring_thread, rvp);
+	if (ret)
+		goto out_ring;
+
+	rvp->use_ring = true;
+	return 0;
+
+out_ring:
+	pthread_cond_destroy(&rvp->ring_wake);
+	pthread_mutex_destroy(&rvp->ring_lock);
+	ioring_free(&rvp->ring);
+out_slots:
+	free(rvp->slots);
+	free(rvp->free_slots);
+	rvp->slots = NULL;
+	rvp->free_slots = NULL;
+	return ret;
+}
+
+/* Let the engine run out of requests, then wait for it to exit. */
+static void
+read_verify_ring_stop(
+	struct read_verify_pool		*rvp)
+{
+	pthread_mutex_lock(&rvp->ring_lock);
+	if (rvp->ring_stop) {
+		pthread_mutex_unlock(&rvp->ring_lock);
+		return;
+	}
+	rvp->ring_stop = true;
+	pthread_cond_signal(&rvp->ring_wake);
+	pthread_mutex_unlock(&rvp->ring_lock);
+
+	pthread_join(rvp->ring_thread, NULL);
+}
+
+/* Hand a request to the engine. */
+static void
+read_verify_ring_queue(
+	struct read_verify_pool		*rvp,
+	struct read_verify		*rv)
+{
+	rv->io_next = NULL;
+	rv->io_pending = 0;
+
+	pthread_mutex_lock(&rvp->ring_lock);
+	if (rvp->ring_tail)
+		rvp->ring_tail->io_next = rv;
+	else
+		rvp->ring_head = rv;
+	rvp->ring_tail = rv;
+	pthread_cond_signal(&rvp->ring_wake);
+	pthread_mutex_unlock(&rvp->ring_lock);
+}
+#else
+static inline int
+read_verify_ring_init(struct read_verify_pool *rvp) { return EOPNOTSUPP; }
+static inline void
+read_verify_ring_stop(struct read_verify_pool *rvp) { }
+static inline void
+read_verify_ring_queue(struct read_verify_pool *rvp, struct read_verify *rv) { }
+#endif /* HAVE_IO_URING */
+
 /* Queue a read verify request. */
 static int
 read_verify_queue(
@@ -303,6 +788,12 @@ read_verify_queue(
 
 	memcpy(tmp, rv, sizeof(*tmp));
 
+	if (rvp->use_ring) {
+		read_verify_ring_queue(rvp, tmp);
+		rv->io_length = 0;
+		return 0;
+	}
+
 	ret = -workqueue_add(&rvp->wq, read_verify, 0, tmp);
 	if (ret) {
 		free(tmp);
@@ -91,6 +91,37 @@ xfs_action_item_priority(
 	abort();
 }
 
+/* Which phase 4 stage repairs this item? */
+static enum repair_stage
+xfs_action_item_stage(
+	struct action_item	*aitem)
+{
+	switch (aitem->type) {
+	case XFS_SCRUB_TYPE_SB:
+	case XFS_SCRUB_TYPE_AGF:
+	case XFS_SCRUB_TYPE_AGFL:
+	case XFS_SCRUB_TYPE_AGI:
+	case XFS_SCRUB_TYPE_BNOBT:
+	case XFS_SCRUB_TYPE_CNTBT:
+	case XFS_SCRUB_TYPE_INOBT:
+	case XFS_SCRUB_TYPE_FINOBT:
+	case XFS_SCRUB_TYPE_REFCNTBT:
+	case XFS_SCRUB_TYPE_RMAPBT:
+		return REPAIR_STAGE_AG;
+	case XFS_SCRUB_TYPE_INODE:
+	case XFS_SCRUB_TYPE_BMBTD:
+	case XFS_SCRUB_TYPE_BMBTA:
+	case XFS_SCRUB_TYPE_BMBTC:
+	case XFS_SCRUB_TYPE_DIR:
+	case XFS_SCRUB_TYPE_XATTR:
+	case XFS_SCRUB_TYPE_SYMLINK:
+	case XFS_SCRUB_TYPE_PARENT:
+		return REPAIR_STAGE_FILE;
+	default:
+		return REPAIR_STAGE_FS;
+	}
+}
+
 /* Make sure that btrees get repaired before headers. */
 static int
 xfs_action_item_compare(
@@ -222,6 +253,34 @@ action_list_splice(
 	dest->sorted = false;
 }
 
+/*
+ * Move up to @max (or all, if zero) of the items that are repaired in
+ * @stage from @src to @dest.  Returns the number moved.
+ */
+size_t
+action_list_take_stage(
+	struct action_list		*src,
+	enum repair_stage		stage,
+	struct action_list		*dest,
+	size_t				max)
+{
+	struct action_item		*aitem;
+	struct action_item		*n;
+	size_t				moved = 0;
+
+	list_for_each_entry_safe(aitem, n, &src->list, list) {
+		if (xfs_action_item_stage(aitem) != stage)
+			continue;
+		list_move_tail(&aitem->list, &dest->list);
+		src->nr--;
+		dest->nr++;
+		dest->sorted = false;
+		if (++moved == max)
+			break;
+	}
+	return moved;
+}
+
 /* Repair everything on this list. */
 int
 action_list_process(
@@ -272,7 +331,10 @@ action_list_defer(
 {
 	ASSERT(agno < ctx->mnt.fsgeom.agcount);
 
+	/* several workers can defer to the same AG's list at once */
+	pthread_mutex_lock(&ctx->lock);
 	action_list_splice(&ctx->action_lists[agno], alist);
+	pthread_mutex_unlock(&ctx->lock);
 }
 
 /* Run actions now and defer unfinished items for later. */
@@ -12,6 +12,18 @@ struct action_list {
 	bool			sorted;
 };
 
+/*
+ * Phase 4 repairs things in stages, each of which can depend on everything
+ * in the stages before it being fixed.  Within a stage, the items of one
+ * list are repaired in xfs_action_item_priority order.
+ */
+enum repair_stage {
+	REPAIR_STAGE_AG,	/* AG headers, then AG btrees; AG by AG */
+	REPAIR_STAGE_FILE,	/* file metadata; needs every AG's rmapbt */
+	REPAIR_STAGE_FS,	/* whole-fs metadata; needs all the files */
+	REPAIR_STAGE_NR,
+};
+
 int action_lists_alloc(size_t nr, struct action_list **listsp);
 void action_lists_free(struct action_list **listsp);
 
@@ -19,6 +31,8 @@ void action_list_init(struct action_list *alist);
 size_t action_list_length(struct action_list *alist);
 void action_list_add(struct action_list *dest, struct action_item *item);
 void action_list_splice(struct action_list *dest, struct action_list *src);
+size_t action_list_take_stage(struct action_list *src,
+		enum repair_stage stage, struct action_list *dest, size_t max);
 
 void action_list_find_mustfix(struct action_list *actions,
 		struct action_list *immediate_alist,
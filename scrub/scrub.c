@@ -401,13 +401,20 @@ scrub_ag_metadata(
 	return scrub_all_types(ctx, XFROG_SCRUB_TYPE_PERAG, agno, alist);
 }
 
-/* Scrub whole-FS metadata btrees. */
+/*
+ * Scrub one type of whole-FS metadata.  Each of these is a separate object
+ * in the kernel, so phase 2 checks them all in parallel.
+ */
 int
 scrub_fs_metadata(
 	struct scrub_ctx		*ctx,
+	unsigned int			type,
 	struct action_list		*alist)
 {
-	return scrub_all_types(ctx, XFROG_SCRUB_TYPE_FS, 0, alist);
+	assert(xfrog_scrubbers[type].type == XFROG_SCRUB_TYPE_FS);
+	assert(!(xfrog_scrubbers[type].flags & XFROG_SCRUB_DESCR_SUMMARY));
+
+	return scrub_meta_type(ctx, type, 0, alist);
 }
 
 /* Scrub FS summary metadata. */
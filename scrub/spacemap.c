@@ -28,8 +28,14 @@
  *
  * This comes into play if we want to have per-workitem memory.  Maybe.
  * XXX: do we really need all that ?
+ *
+ * Each scan starts out asking GETFSMAP for a small batch of records so
+ * that the iterator function (and whatever IO it schedules) gets going
+ * right away, and doubles the batch size every time the kernel fills the
+ * buffer, so that big AGs don't cost us one syscall per few records.
  */
 
+#define FSMAP_NR_START	256
 #define FSMAP_NR	65536
 
 /*
@@ -44,16 +50,18 @@ scrub_iterate_fsmap(
 	void			*arg)
 {
 	struct fsmap_head	*head;
+	struct fsmap_head	*new_head;
 	struct fsmap		*p;
+	unsigned int		nr = FSMAP_NR_START;
 	int			i;
 	int			error;
 
-	head = calloc(1, fsmap_sizeof(FSMAP_NR));
+	head = calloc(1, fsmap_sizeof(nr));
 	if (!head)
 		return errno;
 
 	memcpy(head->fmh_keys, keys, sizeof(struct fsmap) * 2);
-	head->fmh_count = FSMAP_NR;
+	head->fmh_count = nr;
 
 	while ((error = ioctl(ctx->mnt.fd, FS_IOC_GETFSMAP, head)) == 0) {
 		for (i = 0, p = head->fmh_recs;
@@ -72,6 +80,16 @@ scrub_iterate_fsmap(
 		if (p->fmr_flags & FMR_OF_LAST)
 			break;
 		fsmap_advance(head);
+
+		/* There's more where that came from, so ask for more. */
+		if (head->fmh_entries == nr && nr < FSMAP_NR) {
+			new_head = realloc(head, fsmap_sizeof(nr * 2));
+			if (new_head) {
+				head = new_head;
+				nr *= 2;
+				head->fmh_count = nr;
+			}
+		}
 	}
 	if (error)
 		error = errno;
@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#include "xfs.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/statvfs.h>
+#include "platform_defs.h"
+#include "libfrog/paths.h"
+#include "xfs_scrub.h"
+#include "common.h"
+#include "telemetry.h"
+
+/*
+ * Telemetry
+ *
+ * If asked, we write a JSON document describing the run to a file when we
+ * exit, so that scrub runs across a fleet can be collected and graphed.  It
+ * records how long each phase took, how much work it got through, and how
+ * much I/O it did; the latency histogram and queue depth of the media
+ * verification reads issued during each phase; and the outcome of the run.
+ *
+ * The I/O statistics are bumped with atomic operations from the read
+ * verification threads and are reset at the start of each phase.
+ */
+
+/* Latency buckets are powers of two, in microseconds. */
+#define TELEMETRY_LAT_BUCKETS	25
+
+struct telemetry_io {
+	unsigned long long	ios;
+	unsigned long long	bytes;
+	unsigned long long	lat_total_ns;
+	unsigned long long	lat_max_ns;
+	unsigned long long	depth_total;
+	unsigned long long	depth_samples;
+	unsigned int		depth_max;
+	unsigned long long	lat_hist[TELEMETRY_LAT_BUCKETS];
+};
+
+struct telemetry_entry {
+	struct telemetry_phase	tp;
+	struct telemetry_io	io;
+};
+
+#define TELEMETRY_MAX_PHASES	16
+
+bool				telemetry_on;
+
+static FILE			*telemetry_fp;
+static time_t			telemetry_start;
+static struct telemetry_io	telemetry_cur;
+static struct telemetry_entry	telemetry_phases[TELEMETRY_MAX_PHASES];
+static unsigned int		telemetry_nr_phases;
+
+/* Open the telemetry file now so that we find out about problems early. */
+int
+telemetry_init(
+	const char		*path)
+{
+	telemetry_fp = fopen(path, "w");
+	if (!telemetry_fp)
+		return errno;
+	telemetry_start = time(NULL);
+	telemetry_on = true;
+	return 0;
+}
+
+void
+telemetry_phase_start(void)
+{
+	if (telemetry_on)
+		memset(&telemetry_cur, 0, sizeof(telemetry_cur));
+}
+
+void
+telemetry_phase_end(
+	const struct telemetry_phase	*tp)
+{
+	struct telemetry_entry		*te;
+
+	if (!telemetry_on || telemetry_nr_phases == TELEMETRY_MAX_PHASES)
+		return;
+
+	te = &telemetry_phases[telemetry_nr_phases++];
+	te->tp = *tp;
+	te->io = telemetry_cur;
+}
+
+void
+__telemetry_io_issue(
+	unsigned int		depth)
+{
+	unsigned int		old;
+
+	__atomic_add_fetch(&telemetry_cur.depth_total, depth, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&telemetry_cur.depth_samples, 1, __ATOMIC_RELAXED);
+	old = __atomic_load_n(&telemetry_cur.depth_max, __ATOMIC_RELAXED);
+	while (depth > old &&
+	       !__atomic_compare_exchange_n(&telemetry_cur.depth_max, &old,
+			depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void
+__telemetry_io_done(
+	uint64_t		lat_ns,
+	unsigned long long	bytes)
+{
+	unsigned long long	old;
+	uint64_t		lat_us = lat_ns / NSEC_PER_USEC;
+	unsigned int		bucket = 0;
+
+	while (lat_us && bucket < TELEMETRY_LAT_BUCKETS - 1) {
+		lat_us >>= 1;
+		bucket++;
+	}
+
+	__atomic_add_fetch(&telemetry_cur.ios, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&telemetry_cur.bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&telemetry_cur.lat_total_ns, lat_ns,
+			__ATOMIC_RELAXED);
+	__atomic_add_fetch(&telemetry_cur.lat_hist[bucket], 1,
+			__ATOMIC_RELAXED);
+	old = __atomic_load_n(&telemetry_cur.lat_max_ns, __ATOMIC_RELAXED);
+	while (lat_ns > old &&
+	       !__atomic_compare_exchange_n(&telemetry_cur.lat_max_ns, &old,
+			lat_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Write a string with the JSON escapes. */
+static void
+telemetry_string(
+	FILE			*fp,
+	const char		*str)
+{
+	const unsigned char	*p;
+
+	fputc('"', fp);
+	for (p = (const unsigned char *)str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+static void
+telemetry_write_io(
+	FILE			*fp,
+	const struct telemetry_io *io)
+{
+	unsigned int		i, last = 0;
+
+	for (i = 0; i < TELEMETRY_LAT_BUCKETS; i++)
+		if (io->lat_hist[i])
+			last = i;
+
+	fprintf(fp, ",\n      \"verify_io\": {\n");
+	fprintf(fp, "        \"ios\": %llu,\n", io->ios);
+	fprintf(fp, "        \"bytes\": %llu,\n", io->bytes);
+	fprintf(fp, "        \"latency_avg_us\": %.1f,\n",
+			(double)io->lat_total_ns / io->ios / NSEC_PER_USEC);
+	fprintf(fp, "        \"latency_max_us\": %.1f,\n",
+			(double)io->lat_max_ns / NSEC_PER_USEC);
+	fprintf(fp, "        \"queue_depth_avg\": %.2f,\n",
+			io->depth_samples ?
+			(double)io->depth_total / io->depth_samples : 0.0);
+	fprintf(fp, "        \"queue_depth_max\": %u,\n", io->depth_max);
+
+	/* Each bucket counts the reads that took less than "lt_us". */
+	fprintf(fp, "        \"latency_histogram\": [");
+	for (i = 0; i <= last; i++)
+		fprintf(fp, "%s\n          { \"lt_us\": %llu, \"count\": %llu }",
+				i ? "," : "", 1ULL << i, io->lat_hist[i]);
+	fprintf(fp, "\n        ]\n      }");
+}
+
+static void
+telemetry_write_phase(
+	FILE			*fp,
+	const struct telemetry_entry *te)
+{
+	const struct telemetry_phase *tp = &te->tp;
+
+	fprintf(fp, "    {\n");
+	fprintf(fp, "      \"phase\": %u,\n", tp->phase);
+	fprintf(fp, "      \"description\": ");
+	telemetry_string(fp, tp->descr ? tp->descr : "");
+	fprintf(fp, ",\n");
+	fprintf(fp, "      \"runtime\": %.3f,\n", tp->runtime);
+	fprintf(fp, "      \"user\": %.3f,\n", tp->user);
+	fprintf(fp, "      \"system\": %.3f,\n", tp->sys);
+	fprintf(fp, "      \"items\": %"PRIu64",\n", tp->items);
+	fprintf(fp, "      \"items_per_sec\": %.1f,\n",
+			tp->runtime > 0 ? tp->items / tp->runtime : 0.0);
+	fprintf(fp, "      \"bytes_read\": %llu,\n", tp->bytes_read);
+	fprintf(fp, "      \"bytes_written\": %llu", tp->bytes_written);
+	if (te->io.ios)
+		telemetry_write_io(fp, &te->io);
+	fprintf(fp, "\n    }");
+}
+
+/* Write out everything we recorded and the outcome of the run. */
+int
+telemetry_finish(
+	struct scrub_ctx	*ctx,
+	int			ret)
+{
+	FILE			*fp = telemetry_fp;
+	unsigned int		i;
+
+	if (!fp)
+		return 0;
+	telemetry_on = false;
+	telemetry_fp = NULL;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"version\": 1,\n");
+	fprintf(fp, "  \"mountpoint\": ");
+	telemetry_string(fp, ctx->mntpoint);
+	fprintf(fp, ",\n");
+	fprintf(fp, "  \"start\": %lld,\n", (long long)telemetry_start);
+	fprintf(fp, "  \"runtime\": %lld,\n",
+			(long long)(time(NULL) - telemetry_start));
+	fprintf(fp, "  \"phases\": [");
+	for (i = 0; i < telemetry_nr_phases; i++) {
+		fprintf(fp, "%s\n", i ? "," : "");
+		telemetry_write_phase(fp, &telemetry_phases[i]);
+	}
+	fprintf(fp, "\n  ],\n");
+	fprintf(fp, "  \"result\": {\n");
+	fprintf(fp, "    \"corruptions\": %llu,\n", ctx->corruptions_found);
+	fprintf(fp, "    \"unfixable_errors\": %llu,\n", ctx->unfixable_errors);
+	fprintf(fp, "    \"runtime_errors\": %llu,\n", ctx->runtime_errors);
+	fprintf(fp, "    \"warnings\": %llu,\n", ctx->warnings_found);
+	fprintf(fp, "    \"repairs\": %llu,\n", ctx->repairs);
+	fprintf(fp, "    \"preens\": %llu,\n", ctx->preens);
+	fprintf(fp, "    \"exit_code\": %d\n", ret);
+	fprintf(fp, "  }\n");
+	fprintf(fp, "}\n");
+
+	if (fclose(fp))
+		return errno;
+	return 0;
+}
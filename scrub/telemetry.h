@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Copyright (C) 2026 agent <agent@local>
+ */
+#ifndef XFS_SCRUB_TELEMETRY_H_
+#define XFS_SCRUB_TELEMETRY_H_
+
+/* What one phase did. */
+struct telemetry_phase {
+	unsigned int		phase;
+	const char		*descr;
+	double			runtime;	/* seconds */
+	double			user;
+	double			sys;
+	uint64_t		items;		/* progress units done */
+	unsigned long long	bytes_read;
+	unsigned long long	bytes_written;
+};
+
+extern bool telemetry_on;
+
+int telemetry_init(const char *path);
+void telemetry_phase_start(void);
+void telemetry_phase_end(const struct telemetry_phase *tp);
+void __telemetry_io_issue(unsigned int depth);
+void __telemetry_io_done(uint64_t lat_ns, unsigned long long bytes);
+int telemetry_finish(struct scrub_ctx *ctx, int ret);
+
+/* A media verification read was sent with this many reads in flight. */
+static inline void
+telemetry_io_issue(
+	unsigned int		depth)
+{
+	if (telemetry_on)
+		__telemetry_io_issue(depth);
+}
+
+/* A media verification read finished after this many nanoseconds. */
+static inline void
+telemetry_io_done(
+	uint64_t		lat_ns,
+	unsigned long long	bytes)
+{
+	if (telemetry_on)
+		__telemetry_io_done(lat_ns, bytes);
+}
+
+#endif /* XFS_SCRUB_TELEMETRY_H_ */
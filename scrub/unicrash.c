@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <sys/statvfs.h>
 #include <strings.h>
+#include <pthread.h>
 #include <unicode/ustring.h>
 #include <unicode/unorm2.h>
 #include <unicode/uspoof.h>
@@ -53,6 +54,13 @@
  * due to invisible control characters.
  *
  * In other words, skel = remove_invisible(nfd(remap_confusables(nfd(name)))).
+ *
+ * Most names are plain printable ASCII, which NFKC leaves alone, so we skip
+ * the UTF-8 conversion and normalization for those.  ASCII still has its
+ * share of confusables ("rn" and "m", "l" and "1"), so we always ask ICU for
+ * the skeleton, but each thread remembers the results for the names it has
+ * seen recently, because the same names ("index.html", ".git", "Makefile")
+ * turn up in directory after directory.
  */
 
 struct name_entry {
@@ -144,6 +152,211 @@ is_utf8_locale(void)
 	return answer;
 }
 
+/* Adapt the dirhash function from libxfs, avoid linking with libxfs. */
+
+#define rol32(x, y)		(((x) << (y)) | ((x) >> (32 - (y))))
+
+/*
+ * Implement a simple hash on a character string.
+ * Rotate the hash value by 7 bits, then XOR each character in.
+ * This is implemented with some source-level loop unrolling.
+ */
+static xfs_dahash_t
+unicrash_hash(
+	const uint8_t		*name,
+	size_t			namelen)
+{
+	xfs_dahash_t		hash;
+
+	/*
+	 * Do four characters at a time as long as we can.
+	 */
+	for (hash = 0; namelen >= 4; namelen -= 4, name += 4)
+		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
+		       (name[3] << 0) ^ rol32(hash, 7 * 4);
+
+	/*
+	 * Now do the rest of the characters.
+	 */
+	switch (namelen) {
+	case 3:
+		return (name[0] << 14) ^ (name[1] << 7) ^ (name[2] << 0) ^
+		       rol32(hash, 7 * 3);
+	case 2:
+		return (name[0] << 7) ^ (name[1] << 0) ^ rol32(hash, 7 * 2);
+	case 1:
+		return (name[0] << 0) ^ rol32(hash, 7 * 1);
+	default: /* case 0: */
+		return hash;
+	}
+}
+
+/*
+ * Per-thread memo of the normalized forms and skeletons of recently seen
+ * names.  It's direct-mapped by a hash of the raw name and only holds short
+ * names, which are the ones that repeat.
+ */
+#define UNICRASH_MEMO_SLOTS	1024
+#define UNICRASH_MEMO_MAXNAME	48
+
+struct unicrash_memo_slot {
+	UChar			*normstr;
+	UChar			*skelstr;
+	uint32_t		normstrlen;
+	uint32_t		skelstrlen;
+	uint32_t		namelen;
+	char			name[UNICRASH_MEMO_MAXNAME];
+};
+
+struct unicrash_memo {
+	struct unicrash_memo_slot slots[UNICRASH_MEMO_SLOTS];
+};
+
+static pthread_key_t	unicrash_memo_key;
+static pthread_once_t	unicrash_memo_once = PTHREAD_ONCE_INIT;
+
+static void
+unicrash_memo_destroy(
+	void			*priv)
+{
+	struct unicrash_memo	*memo = priv;
+	unsigned int		i;
+
+	for (i = 0; i < UNICRASH_MEMO_SLOTS; i++) {
+		free(memo->slots[i].normstr);
+		free(memo->slots[i].skelstr);
+	}
+	free(memo);
+}
+
+static void
+unicrash_memo_key_init(void)
+{
+	pthread_key_create(&unicrash_memo_key, unicrash_memo_destroy);
+}
+
+/* Find the memo slot for a name, or NULL if we can't memoize it. */
+static struct unicrash_memo_slot *
+unicrash_memo_slot(
+	const char		*name,
+	size_t			namelen)
+{
+	struct unicrash_memo	*memo;
+
+	if (namelen > UNICRASH_MEMO_MAXNAME)
+		return NULL;
+
+	pthread_once(&unicrash_memo_once, unicrash_memo_key_init);
+	memo = pthread_getspecific(unicrash_memo_key);
+	if (!memo) {
+		memo = calloc(1, sizeof(struct unicrash_memo));
+		if (!memo)
+			return NULL;
+		if (pthread_setspecific(unicrash_memo_key, memo)) {
+			free(memo);
+			return NULL;
+		}
+	}
+
+	return &memo->slots[unicrash_hash((const uint8_t *)name, namelen) %
+			    UNICRASH_MEMO_SLOTS];
+}
+
+/* Duplicate a Unicode string. */
+static UChar *
+unicrash_ustrdup(
+	const UChar		*str,
+	size_t			len)
+{
+	UChar			*p;
+
+	p = malloc((len + 1) * sizeof(UChar));
+	if (!p)
+		return NULL;
+	memcpy(p, str, len * sizeof(UChar));
+	p[len] = 0;
+	return p;
+}
+
+/* Fill out the entry from the memo if we've seen this name before. */
+static bool
+unicrash_memo_lookup(
+	struct unicrash_memo_slot *slot,
+	struct name_entry	*entry)
+{
+	if (!slot || !slot->skelstr || slot->namelen != entry->namelen ||
+	    memcmp(slot->name, entry->name, entry->namelen))
+		return false;
+
+	entry->normstr = unicrash_ustrdup(slot->normstr, slot->normstrlen);
+	entry->skelstr = unicrash_ustrdup(slot->skelstr, slot->skelstrlen);
+	if (!entry->normstr || !entry->skelstr) {
+		free(entry->normstr);
+		free(entry->skelstr);
+		entry->normstr = entry->skelstr = NULL;
+		return false;
+	}
+	entry->normstrlen = slot->normstrlen;
+	entry->skelstrlen = slot->skelstrlen;
+	return true;
+}
+
+/* Remember the normalized form and skeleton of this name. */
+static void
+unicrash_memo_store(
+	struct unicrash_memo_slot *slot,
+	struct name_entry	*entry)
+{
+	UChar			*normstr;
+	UChar			*skelstr;
+
+	if (!slot)
+		return;
+
+	normstr = unicrash_ustrdup(entry->normstr, entry->normstrlen);
+	skelstr = unicrash_ustrdup(entry->skelstr, entry->skelstrlen);
+	if (!normstr || !skelstr) {
+		free(normstr);
+		free(skelstr);
+		return;
+	}
+
+	free(slot->normstr);
+	free(slot->skelstr);
+	slot->normstr = normstr;
+	slot->normstrlen = entry->normstrlen;
+	slot->skelstr = skelstr;
+	slot->skelstrlen = entry->skelstrlen;
+	slot->namelen = entry->namelen;
+	memcpy(slot->name, entry->name, entry->namelen);
+}
+
+/*
+ * If the name is all printable ASCII, NFKC won't change it, so widen it
+ * straight into a Unicode string.  Returns NULL if the name has anything
+ * else in it, or if we're out of memory.
+ */
+static UChar *
+name_entry_widen_ascii(
+	struct name_entry	*entry)
+{
+	UChar			*unistr;
+	size_t			i;
+
+	for (i = 0; i < entry->namelen; i++)
+		if ((uint8_t)entry->name[i] < 0x20 ||
+		    (uint8_t)entry->name[i] > 0x7E)
+			return NULL;
+
+	unistr = malloc((entry->namelen + 1) * sizeof(UChar));
+	if (!unistr)
+		return NULL;
+	for (i = 0; i < entry->namelen; i++)
+		unistr[i] = entry->name[i];
+	unistr[entry->namelen] = 0;
+	return unistr;
+}
+
 /*
  * Generate normalized form and skeleton of the name.  If this fails, just
  * forget everything and return false; this is an advisory checker.
@@ -153,6 +366,7 @@ name_entry_compute_checknames(
 	struct unicrash		*uc,
 	struct name_entry	*entry)
 {
+	struct unicrash_memo_slot *slot;
 	UChar			*normstr;
 	UChar			*unistr;
 	UChar			*skelstr;
@@ -164,6 +378,21 @@ name_entry_compute_checknames(
 
 	UErrorCode		uerr = U_ZERO_ERROR;
 
+	slot = unicrash_memo_slot(entry->name, entry->namelen);
+	if (unicrash_memo_lookup(slot, entry))
+		return true;
+
+	/* Plain ASCII is already normalized. */
+	unistr = name_entry_widen_ascii(entry);
+	if (unistr) {
+		unistrlen = entry->namelen;
+		normstrlen = unistrlen;
+		normstr = unicrash_ustrdup(unistr, unistrlen);
+		if (!normstr)
+			goto out_unistr;
+		goto skeleton;
+	}
+
 	/* Convert bytestr to unistr for normalization */
 	u_strFromUTF8(NULL, 0, &unistrlen, entry->name, entry->namelen, &uerr);
 	if (uerr != U_BUFFER_OVERFLOW_ERROR)
@@ -191,6 +420,7 @@ name_entry_compute_checknames(
 	if (U_FAILURE(uerr))
 		goto out_normstr;
 
+skeleton:
 	/* Compute skeleton. */
 	skelstrlen = uspoof_getSkeleton(uc->spoof, 0, unistr, unistrlen, NULL,
 			0, &uerr);
@@ -221,6 +451,7 @@ name_entry_compute_checknames(
 	entry->normstr = normstr;
 	entry->normstrlen = normstrlen;
 	free(unistr);
+	unicrash_memo_store(slot, entry);
 	return true;
 
 out_skelstr:
@@ -275,47 +506,13 @@ name_entry_free(
 	free(entry);
 }
 
-/* Adapt the dirhash function from libxfs, avoid linking with libxfs. */
-
-#define rol32(x, y)		(((x) << (y)) | ((x) >> (32 - (y))))
-
-/*
- * Implement a simple hash on a character string.
- * Rotate the hash value by 7 bits, then XOR each character in.
- * This is implemented with some source-level loop unrolling.
- */
+/* Hash the skeleton so that confusable names land in the same bucket. */
 static xfs_dahash_t
 name_entry_hash(
 	struct name_entry	*entry)
 {
-	uint8_t			*name;
-	size_t			namelen;
-	xfs_dahash_t		hash;
-
-	name = (uint8_t *)entry->skelstr;
-	namelen = entry->skelstrlen * sizeof(UChar);
-
-	/*
-	 * Do four characters at a time as long as we can.
-	 */
-	for (hash = 0; namelen >= 4; namelen -= 4, name += 4)
-		hash = (name[0] << 21) ^ (name[1] << 14) ^ (name[2] << 7) ^
-		       (name[3] << 0) ^ rol32(hash, 7 * 4);
-
-	/*
-	 * Now do the rest of the characters.
-	 */
-	switch (namelen) {
-	case 3:
-		return (name[0] << 14) ^ (name[1] << 7) ^ (name[2] << 0) ^
-		       rol32(hash, 7 * 3);
-	case 2:
-		return (name[0] << 7) ^ (name[1] << 0) ^ rol32(hash, 7 * 2);
-	case 1:
-		return (name[0] << 0) ^ rol32(hash, 7 * 1);
-	default: /* case 0: */
-		return hash;
-	}
+	return unicrash_hash((const uint8_t *)entry->skelstr,
+			entry->skelstrlen * sizeof(UChar));
 }
 
 /*
@@ -751,5 +948,14 @@ unicrash_load(void)
 void
 unicrash_unload(void)
 {
+	struct unicrash_memo	*memo;
+
+	/* Worker threads free their memos on exit; do the main thread's. */
+	pthread_once(&unicrash_memo_once, unicrash_memo_key_init);
+	memo = pthread_getspecific(unicrash_memo_key);
+	if (memo) {
+		pthread_setspecific(unicrash_memo_key, NULL);
+		unicrash_memo_destroy(memo);
+	}
 	u_cleanup();
 }
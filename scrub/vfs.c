@@ -11,6 +11,8 @@
 #include "handle.h"
 #include "libfrog/paths.h"
 #include "libfrog/workqueue.h"
+#include "libfrog/fsgeom.h"
+#include "libfrog/trim.h"
 #include "xfs_scrub.h"
 #include "common.h"
 #include "vfs.h"
@@ -22,8 +24,24 @@
 /*
  * Helper functions to assist in traversing a directory tree using regular
  * VFS calls.
+ *
+ * Each directory is a work item, and every subdirectory that we find is
+ * queued as another work item.  The workqueue keeps the items that a worker
+ * queues on that worker's own deque, so an idle worker steals pending
+ * subdirectories from a busy one.  That covers deep and narrow trees; for
+ * wide directories, we split anything bigger than SCAN_DIR_RANGE_BYTES into
+ * ranges of readdir cookies that are scanned as separate work items.
  */
 
+/*
+ * Split directories with more than this many bytes of entries.  XFS readdir
+ * cookies are the byte offset of the entry in the directory data segment
+ * divided by XFS_DIR2_DATA_ALIGN, and the data segment is what st_size
+ * covers, so we can compute the ranges without reading the directory.
+ */
+#define SCAN_DIR_RANGE_BYTES	(1ULL << 20)
+#define SCAN_DIR_COOKIE_SHIFT	(3)	/* XFS_DIR2_DATA_ALIGN_LOG */
+
 /* Scan a filesystem tree. */
 struct scan_fs_tree {
 	unsigned int		nr_dirs;
@@ -41,6 +59,11 @@ struct scan_fs_tree_dir {
 	char			*path;
 	struct scan_fs_tree	*sft;
 	bool			rootdir;
+
+	/* Scan only the entries in this range of readdir cookies. */
+	bool			ranged;
+	long			start_pos;
+	long			end_pos;
 };
 
 static void scan_fs_dir(struct workqueue *wq, xfs_agnumber_t agno, void *arg);
@@ -71,14 +94,21 @@ dec_nr_dirs(
 	pthread_mutex_unlock(&sft->lock);
 }
 
-/* Queue a directory for scanning. */
+/*
+ * Queue a directory for scanning.  If @ranged, only scan the entries whose
+ * readdir cookies are at least @start_pos and less than @end_pos, and don't
+ * call dir_fn.
+ */
 static int
-queue_subdir(
+queue_dir_work(
 	struct scrub_ctx	*ctx,
 	struct scan_fs_tree	*sft,
 	struct workqueue	*wq,
 	const char		*path,
-	bool			is_rootdir)
+	bool			is_rootdir,
+	bool			ranged,
+	long			start_pos,
+	long			end_pos)
 {
 	struct scan_fs_tree_dir	*new_sftd;
 	int			error;
@@ -95,6 +125,9 @@ queue_subdir(
 
 	new_sftd->sft = sft;
 	new_sftd->rootdir = is_rootdir;
+	new_sftd->ranged = ranged;
+	new_sftd->start_pos = start_pos;
+	new_sftd->end_pos = end_pos;
 
 	inc_nr_dirs(sft);
 	error = -workqueue_add(wq, scan_fs_dir, 0, new_sftd);
@@ -112,6 +145,85 @@ out_sftd:
 	return error;
 }
 
+/* Queue a whole directory for scanning. */
+static inline int
+queue_subdir(
+	struct scrub_ctx	*ctx,
+	struct scan_fs_tree	*sft,
+	struct workqueue	*wq,
+	const char		*path,
+	bool			is_rootdir)
+{
+	return queue_dir_work(ctx, sft, wq, path, is_rootdir, false, 0,
+			LONG_MAX);
+}
+
+/*
+ * If a directory is big enough, queue all but the first cookie range as
+ * separate work items and return the end of the first range.
+ */
+static long
+split_dir(
+	struct scrub_ctx	*ctx,
+	struct scan_fs_tree_dir	*sftd,
+	struct workqueue	*wq,
+	int			dir_fd)
+{
+	struct stat		sb;
+	long			range = SCAN_DIR_RANGE_BYTES >>
+					SCAN_DIR_COOKIE_SHIFT;
+	long			pos;
+	int			error;
+
+	if (fstat(dir_fd, &sb) || sb.st_size <= SCAN_DIR_RANGE_BYTES)
+		return LONG_MAX;
+
+	for (pos = range; pos < (sb.st_size >> SCAN_DIR_COOKIE_SHIFT);
+	     pos += range) {
+		long		end = pos + range;
+
+		/* The last range picks up whatever got added since. */
+		if (end >= (sb.st_size >> SCAN_DIR_COOKIE_SHIFT))
+			end = LONG_MAX;
+		error = queue_dir_work(ctx, sftd->sft, wq, sftd->path, false,
+				true, pos, end);
+		if (error) {
+			str_liberror(ctx, error,
+_("queueing directory range scan"));
+			sftd->sft->aborted = true;
+			break;
+		}
+	}
+
+	return range;
+}
+
+/*
+ * Decide if the first entry that readdir returned after we seeked to the
+ * start of a range actually starts before @end_pos.  The cookie of the next
+ * entry tells us that if it isn't past the end of the range.  Otherwise,
+ * seek to the end of the range: if readdir hands back the same entry, it
+ * belongs to the next range.  Either way, the caller is done after this
+ * entry.
+ */
+static bool
+first_dirent_in_range(
+	DIR			*dir,
+	struct dirent		*dirent,
+	long			end_pos)
+{
+	struct dirent		*next;
+
+	if (dirent->d_off <= end_pos)
+		return true;
+
+	seekdir(dir, end_pos);
+	next = readdir(dir);
+	return next == NULL || next->d_ino != dirent->d_ino ||
+	       next->d_off != dirent->d_off ||
+	       strcmp(next->d_name, dirent->d_name) != 0;
+}
+
 /* Scan a directory sub tree. */
 static void
 scan_fs_dir(
@@ -124,8 +236,10 @@ scan_fs_dir(
 	struct scan_fs_tree	*sft = sftd->sft;
 	DIR			*dir;
 	struct dirent		*dirent;
+	struct dirent		first;
 	char			newpath[PATH_MAX];
 	struct stat		sb;
+	long			pos = -1;
 	int			dir_fd;
 	int			error;
 
@@ -138,13 +252,16 @@ scan_fs_dir(
 	}
 
 	/* Caller-specific directory checks. */
-	error = sft->dir_fn(ctx, sftd->path, dir_fd, sft->arg);
-	if (error) {
-		sft->aborted = true;
-		error = close(dir_fd);
-		if (error)
-			str_errno(ctx, sftd->path);
-		goto out;
+	if (!sftd->ranged) {
+		error = sft->dir_fn(ctx, sftd->path, dir_fd, sft->arg);
+		if (error) {
+			sft->aborted = true;
+			error = close(dir_fd);
+			if (error)
+				str_errno(ctx, sftd->path);
+			goto out;
+		}
+		sftd->end_pos = split_dir(ctx, sftd, wq, dir_fd);
 	}
 
 	/* Iterate the directory entries. */
@@ -155,10 +272,33 @@ scan_fs_dir(
 		close(dir_fd);
 		goto out;
 	}
-	rewinddir(dir);
+	if (sftd->start_pos)
+		seekdir(dir, sftd->start_pos);
+	else
+		rewinddir(dir);
 	for (dirent = readdir(dir);
 	     !sft->aborted && dirent != NULL;
 	     dirent = readdir(dir)) {
+		/*
+		 * Each entry starts where the previous one said the next one
+		 * would; anything that starts past the end of our range
+		 * belongs to another work item.
+		 */
+		if (sftd->end_pos != LONG_MAX) {
+			if (pos >= sftd->end_pos)
+				break;
+			if (pos < 0 && dirent->d_off > sftd->end_pos) {
+				memcpy(&first, dirent,
+					offsetof(struct dirent, d_name) +
+					strlen(dirent->d_name) + 1);
+				dirent = &first;
+				if (!first_dirent_in_range(dir, dirent,
+							sftd->end_pos))
+					break;
+			}
+			pos = dirent->d_off;
+		}
+
 		snprintf(newpath, PATH_MAX, "%s/%s", sftd->path,
 				dirent->d_name);
 
@@ -273,6 +413,8 @@ scan_fs_tree(
 		str_liberror(ctx, ret, _("finishing directory scan work"));
 		goto out_wq;
 	}
+	dbg_printf("directory scan: %llu steals, %llu lock contentions\n",
+			wq.nr_steals, wq.nr_contended);
 
 	if (!ret && sft.aborted)
 		ret = -1;
@@ -286,25 +428,25 @@ out_mutex:
 	return ret;
 }
 
-#ifndef FITRIM
-struct fstrim_range {
-	__u64 start;
-	__u64 len;
-	__u64 minlen;
-};
-#define FITRIM		_IOWR('X', 121, struct fstrim_range)	/* Trim */
-#endif
-
-/* Call FITRIM to trim all the unused space in a filesystem. */
+/*
+ * Call FITRIM to trim all the unused space in a filesystem, one AG per
+ * thread.
+ */
 void
 fstrim(
 	struct scrub_ctx	*ctx)
 {
-	struct fstrim_range	range = {0};
+	struct xfrog_trim	trim = {
+		.len		= ULLONG_MAX,
+		.minlen		= fstrim_minlen,
+		.rate		= fstrim_rate,
+		.nr_threads	= scrub_nproc_workqueue(ctx),
+	};
 	int			error;
 
-	range.len = ULLONG_MAX;
-	error = ioctl(ctx->mnt.fd, FITRIM, &range);
-	if (error && errno != EOPNOTSUPP && errno != ENOTTY)
+	error = -xfrog_trim(&ctx->mnt, &trim);
+	if (error && error != EOPNOTSUPP && error != ENOTTY) {
+		errno = error;
 		perror(_("fstrim"));
+	}
 }
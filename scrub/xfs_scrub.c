@@ -18,6 +18,8 @@
 #include "descr.h"
 #include "unicrash.h"
 #include "progress.h"
+#include "incremental.h"
+#include "telemetry.h"
 
 /*
  * XFS Online Metadata Scrub (and Repair)
@@ -109,6 +111,7 @@
  * XFS_SCRUB_FORCE_ERROR	-- pretend all metadata is corrupt
  * XFS_SCRUB_FORCE_REPAIR	-- repair all metadata even if it's ok
  * XFS_SCRUB_NO_KERNEL		-- pretend there is no kernel ioctl
+ * XFS_SCRUB_NO_NVME_VERIFY	-- disable NVMe Verify (if present)
  * XFS_SCRUB_NO_SCSI_VERIFY	-- disable SCSI VERIFY (if present)
  * XFS_SCRUB_PHASE		-- run only this scrub phase
  * XFS_SCRUB_THREADS		-- start exactly this number of threads
@@ -135,6 +138,17 @@ unsigned int			bg_mode;
 /* Number of threads we're allowed to use. */
 unsigned int			force_nr_threads;
 
+/* Number of media verification reads to keep in flight on each disk. */
+unsigned int			verify_qdepth = 32;
+
+/*
+ * Media verification budget for each disk, in bytes and reads per second,
+ * and the read latency (in microseconds) above which we cut the budget.
+ */
+unsigned long long		verify_bw_limit;
+unsigned int			verify_iops_limit;
+unsigned int			verify_latency_target;
+
 /* Verbosity; higher values print more information. */
 bool				verbose;
 
@@ -147,6 +161,10 @@ long				page_size;
 /* Should we FSTRIM after a successful run? */
 bool				want_fstrim = true;
 
+/* Smallest free extent to trim, and the most bytes to discard per second. */
+unsigned long long		fstrim_minlen;
+unsigned long long		fstrim_rate;
+
 /* If stdout/stderr are ttys, we can use richer terminal control. */
 bool				stderr_isatty;
 bool				stdout_isatty;
@@ -171,11 +189,18 @@ usage(void)
 	fprintf(stderr, _("Options:\n"));
 	fprintf(stderr, _("  -a count     Stop after this many errors are found.\n"));
 	fprintf(stderr, _("  -b           Background mode.\n"));
+	fprintf(stderr, _("  -B rate      Media verification bytes per second per disk.\n"));
 	fprintf(stderr, _("  -C fd        Print progress information to this fd.\n"));
+	fprintf(stderr, _("  -D min,rate  FITRIM free extents this long, at this many bytes/s.\n"));
 	fprintf(stderr, _("  -e behavior  What to do if errors are found.\n"));
+	fprintf(stderr, _("  -i file      Only check what changed since the run recorded in file.\n"));
+	fprintf(stderr, _("  -I iops      Media verification reads per second per disk.\n"));
+	fprintf(stderr, _("  -j file      Write statistics about the run to file as JSON.\n"));
 	fprintf(stderr, _("  -k           Do not FITRIM the free space.\n"));
+	fprintf(stderr, _("  -L usec      Cut the media verification budget above this latency.\n"));
 	fprintf(stderr, _("  -m path      Path to /etc/mtab.\n"));
 	fprintf(stderr, _("  -n           Dry run.  Do not modify anything.\n"));
+	fprintf(stderr, _("  -Q depth     Media verification reads in flight per disk.\n"));
 	fprintf(stderr, _("  -T           Display timing/usage information.\n"));
 	fprintf(stderr, _("  -v           Verbose output.\n"));
 	fprintf(stderr, _("  -V           Print version.\n"));
@@ -275,6 +300,7 @@ phase_start(
 	}
 
 	pi->descr = descr;
+	telemetry_phase_start();
 	if ((verbose || display_rusage) && descr) {
 		fprintf(stdout, _("Phase %u: %s\n"), phase, descr);
 		fflush(stdout);
@@ -286,7 +312,8 @@ phase_start(
 static int
 phase_end(
 	struct phase_rusage	*pi,
-	unsigned int		phase)
+	unsigned int		phase,
+	uint64_t		items)
 {
 	struct rusage		ruse_now;
 #ifdef HAVE_MALLINFO
@@ -302,7 +329,7 @@ phase_end(
 	char			*iu, *ou, *tu, *dinu, *doutu, *dtotu;
 	int			error;
 
-	if (!display_rusage)
+	if (!display_rusage && !telemetry_on)
 		return 0;
 
 	error = gettimeofday(&time_now, NULL);
@@ -318,6 +345,31 @@ phase_end(
 		return error;
 	}
 
+	in =  ((unsigned long long)ruse_now.ru_inblock -
+			pi->ruse.ru_inblock) << BBSHIFT;
+	out = ((unsigned long long)ruse_now.ru_oublock -
+			pi->ruse.ru_oublock) << BBSHIFT;
+
+	if (phase) {
+		struct telemetry_phase	tp = {
+			.phase		= phase,
+			.descr		= pi->descr,
+			.runtime	= dt,
+			.user		= timeval_subtract(&ruse_now.ru_utime,
+						&pi->ruse.ru_utime),
+			.sys		= timeval_subtract(&ruse_now.ru_stime,
+						&pi->ruse.ru_stime),
+			.items		= items,
+			.bytes_read	= in,
+			.bytes_written	= out,
+		};
+
+		telemetry_phase_end(&tp);
+	}
+
+	if (!display_rusage)
+		return 0;
+
 	if (phase)
 		snprintf(phasebuf, DESCR_BUFSZ, _("Phase %u: "), phase);
 	else
@@ -345,10 +397,6 @@ phase_end(
 		timeval_subtract(&ruse_now.ru_stime, &pi->ruse.ru_stime));
 
 	/* I/O usage */
-	in =  ((unsigned long long)ruse_now.ru_inblock -
-			pi->ruse.ru_inblock) << BBSHIFT;
-	out = ((unsigned long long)ruse_now.ru_oublock -
-			pi->ruse.ru_oublock) << BBSHIFT;
 	io = in + out;
 	if (io) {
 		i = auto_space_units(in, &iu);
@@ -419,6 +467,7 @@ run_scrub_phases(
 	struct phase_rusage	pi;
 	struct phase_ops	*sp;
 	uint64_t		max_work;
+	uint64_t		items;
 	unsigned int		debug_phase = 0;
 	unsigned int		phase;
 	int			rshift;
@@ -486,9 +535,9 @@ _("Scrub aborted after phase %d."),
 					phase);
 			break;
 		}
-		progress_end_phase();
+		items = progress_end_phase();
 		descr_end_phase();
-		ret = phase_end(&pi, phase);
+		ret = phase_end(&pi, phase, items);
 		if (ret)
 			break;
 
@@ -597,6 +646,7 @@ main(
 	struct scrub_ctx	ctx = {0};
 	struct phase_rusage	all_pi;
 	char			*mtab = NULL;
+	char			*telemetry_path = NULL;
 	FILE			*progress_fp = NULL;
 	struct fs_path		*fsp;
 	int			vflag = 0;
@@ -621,7 +671,7 @@ main(
 	pthread_mutex_init(&ctx.lock, NULL);
 	ctx.mode = SCRUB_MODE_REPAIR;
 	ctx.error_action = ERRORS_CONTINUE;
-	while ((c = getopt(argc, argv, "a:bC:de:km:nTvxV")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bB:C:dD:e:i:I:j:kL:m:nQ:TvxV")) != EOF) {
 		switch (c) {
 		case 'a':
 			ctx.max_errors = cvt_u64(optarg, 10);
@@ -634,6 +684,18 @@ main(
 			force_nr_threads = 1;
 			bg_mode++;
 			break;
+		case 'B': {
+			long long	rate = cvtnum(0, 0, optarg);
+
+			if (rate <= 0) {
+				fprintf(stderr,
+	_("Bad media verification rate \"%s\".\n"),
+						optarg);
+				usage();
+			}
+			verify_bw_limit = rate;
+			break;
+		}
 		case 'C':
 			errno = 0;
 			fd = cvt_u32(optarg, 10);
@@ -650,6 +712,32 @@ main(
 		case 'd':
 			debug++;
 			break;
+		case 'D': {
+			char		*rate = strchr(optarg, ',');
+			long long	val;
+
+			if (rate)
+				*rate++ = 0;
+			val = cvtnum(0, 0, optarg);
+			if (val < 0) {
+				fprintf(stderr,
+	_("Bad FITRIM minimum length \"%s\".\n"),
+						optarg);
+				usage();
+			}
+			fstrim_minlen = val;
+			if (rate) {
+				val = cvtnum(0, 0, rate);
+				if (val <= 0) {
+					fprintf(stderr,
+	_("Bad FITRIM rate \"%s\".\n"),
+							rate);
+					usage();
+				}
+				fstrim_rate = val;
+			}
+			break;
+		}
 		case 'e':
 			if (!strcmp("continue", optarg))
 				ctx.error_action = ERRORS_CONTINUE;
@@ -662,15 +750,42 @@ main(
 				usage();
 			}
 			break;
+		case 'i':
+			ctx.incr_path = optarg;
+			break;
+		case 'j':
+			telemetry_path = optarg;
+			break;
+		case 'I':
+			verify_iops_limit = cvt_u32(optarg, 10);
+			if (errno) {
+				perror(optarg);
+				usage();
+			}
+			break;
 		case 'k':
 			want_fstrim = false;
 			break;
+		case 'L':
+			verify_latency_target = cvt_u32(optarg, 10);
+			if (errno) {
+				perror(optarg);
+				usage();
+			}
+			break;
 		case 'm':
 			mtab = optarg;
 			break;
 		case 'n':
 			ctx.mode = SCRUB_MODE_DRY_RUN;
 			break;
+		case 'Q':
+			verify_qdepth = cvt_u32(optarg, 10);
+			if (errno) {
+				perror(optarg);
+				usage();
+			}
+			break;
 		case 'T':
 			display_rusage = true;
 			break;
@@ -700,6 +815,13 @@ main(
 		return SCRUB_RET_SUCCESS;
 	}
 
+	if (verify_latency_target && !verify_bw_limit && !verify_iops_limit) {
+		fprintf(stderr,
+	_("%s: -L needs a media verification budget from -B or -I.\n"),
+				progname);
+		usage();
+	}
+
 	/* Override thread count if debugger */
 	if (debug_tweak_on("XFS_SCRUB_THREADS")) {
 		unsigned int	x;
@@ -727,6 +849,15 @@ main(
 	if (getenv("SERVICE_MODE"))
 		is_service = true;
 
+	if (telemetry_path) {
+		error = telemetry_init(telemetry_path);
+		if (error) {
+			fprintf(stderr, _("%s: %s: %s\n"), progname,
+					telemetry_path, strerror(error));
+			return SCRUB_RET_SYNTAX;
+		}
+	}
+
 	/* Initialize overall phase stats. */
 	error = phase_start(&all_pi, 0, NULL);
 	if (error)
@@ -755,7 +886,7 @@ main(
 			mtab = _PATH_MOUNTED;
 	}
 
-	fs_table_initialise(0, NULL, 0, NULL);
+	fs_table_initialise_path(ctx.mntpoint);
 	fsp = fs_table_lookup_mount(ctx.mntpoint);
 	if (!fsp) {
 		fprintf(stderr, _("%s: Not a XFS mount point.\n"),
@@ -791,6 +922,14 @@ main(
 	if (debug_tweak_on("XFS_SCRUB_FORCE_ERROR"))
 		str_info(&ctx, ctx.mntpoint, _("Injecting error."));
 
+	/* Remember what we checked if we didn't find any problems. */
+	if (!error && !ctx.corruptions_found && !ctx.unfixable_errors &&
+	    !ctx.runtime_errors) {
+		error = incr_save(&ctx);
+		if (error)
+			str_liberror(&ctx, error, _("saving scrub state"));
+	}
+
 	/* Clean up scan data. */
 	error = scrub_cleanup(&ctx);
 	if (error && ctx.runtime_errors == 0)
@@ -809,7 +948,11 @@ out:
 		ret |= SCRUB_RET_UNOPTIMIZED;
 	if (ctx.runtime_errors)
 		ret |= SCRUB_RET_OPERROR;
-	phase_end(&all_pi, 0);
+	phase_end(&all_pi, 0, 0);
+	error = telemetry_finish(&ctx, ret);
+	if (error)
+		fprintf(stderr, _("%s: writing statistics to %s: %s\n"),
+				progname, telemetry_path, strerror(error));
 	if (progress_fp)
 		fclose(progress_fp);
 	unicrash_unload();
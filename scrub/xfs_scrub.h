@@ -13,11 +13,17 @@ extern char *progname;
 #define _PATH_PROC_MOUNTS	"/proc/mounts"
 
 extern unsigned int		force_nr_threads;
+extern unsigned int		verify_qdepth;
+extern unsigned long long	verify_bw_limit;
+extern unsigned int		verify_iops_limit;
+extern unsigned int		verify_latency_target;
 extern unsigned int		bg_mode;
 extern unsigned int		debug;
 extern bool			verbose;
 extern long			page_size;
 extern bool			want_fstrim;
+extern unsigned long long	fstrim_minlen;
+extern unsigned long long	fstrim_rate;
 extern bool			stderr_isatty;
 extern bool			stdout_isatty;
 extern bool			is_service;
@@ -68,6 +74,13 @@ struct scrub_ctx {
 	/* Data block read verification buffer */
 	void			*readbuf;
 
+	/* Incremental scrub state file and what we know about the fs */
+	const char		*incr_path;
+	struct incr_state	*incr;
+
+	/* Per-thread block usage counts gathered by the phase 6 fsmap scan */
+	struct ptvar		*block_counts;
+
 	/* Mutable scrub state; use lock. */
 	pthread_mutex_t		lock;
 	struct action_list	*action_lists;
@@ -96,6 +109,12 @@ int phase5_func(struct scrub_ctx *ctx);
 int phase6_func(struct scrub_ctx *ctx);
 int phase7_func(struct scrub_ctx *ctx);
 
+/* Block usage counting, shared by the phase 6 and phase 7 fsmap scans */
+struct fsmap;
+int phase7_alloc_block_counts(struct scrub_ctx *ctx, struct ptvar **ptvp);
+int phase7_count_blocks(struct scrub_ctx *ctx, struct fsmap *fsmap,
+		void *arg);
+
 /* Progress estimator functions */
 unsigned int scrub_estimate_ag_work(struct scrub_ctx *ctx);
 int phase2_estimate(struct scrub_ctx *ctx, uint64_t *items,
@@ -63,6 +63,7 @@ _("%s: Not on a mounted XFS filesystem.\n"),
 		return -1;
 	}
 
+	fs_table_initialise_path(path);
 	fsp = fs_table_lookup(path, FS_MOUNT_POINT);
 	if (!fsp) {
 		fprintf(stderr, _("%s: cannot find mount point."),
@@ -15,6 +15,9 @@
 #include "libfrog/paths.h"
 #include "space.h"
 #include "input.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/ptvar.h"
+#include "libfrog/platform.h"
 
 struct histent
 {
@@ -37,6 +40,44 @@ static int		gflag;
 static bool		rtflag;
 static long long	totblocks;
 static long long	totexts;
+static int		nr_threads;
+
+/*
+ * AGs are scanned in parallel.  Each thread counts into its own tally so
+ * that the hot path takes no locks, and the tallies are added up at the end.
+ */
+struct freesp_bucket {
+	long long	count;
+	long long	blocks;
+};
+
+struct freesp_tally {
+	long long		exts;
+	long long		blocks;
+	struct freesp_bucket	bucket[];
+};
+
+static struct ptvar	*tallies;
+
+/* -w keeps a tally for each AG so that only the ones that change are redone */
+static struct freesp_tally	*agtallies;
+static size_t			tally_size;
+static long			watch_interval;
+
+static inline struct freesp_tally *
+agtally(
+	xfs_agnumber_t		agno)
+{
+	return (struct freesp_tally *)((char *)agtallies + agno * tally_size);
+}
+
+/* Per-AG totals for -g, printed in AG order once everything is done. */
+struct freesp_agsum {
+	unsigned long long	exts;
+	unsigned long long	blocks;
+};
+
+static struct freesp_agsum	*agsums;
 
 static cmdinfo_t freesp_cmd;
 
@@ -58,25 +99,60 @@ addhistent(
 		seen1 = 1;
 }
 
+/* Find the first bucket that len fits in; the buckets are sorted. */
+static long
+findhist(
+	off64_t		len)
+{
+	long		lo = 0, hi = histcount;
+
+	while (lo < hi) {
+		long	mid = lo + (hi - lo) / 2;
+
+		if (hist[mid].high >= len)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
 static void
 addtohist(
-	xfs_agnumber_t	agno,
-	xfs_agblock_t	agbno,
-	off64_t		len)
+	struct freesp_tally	*tally,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		agbno,
+	off64_t			len)
 {
-	long		i;
+	long			i;
 
 	if (dumpflag)
 		printf("%8d %8d %8"PRId64"\n", agno, agbno, len);
-	totexts++;
-	totblocks += len;
+	tally->exts++;
+	tally->blocks += len;
+	i = findhist(len);
+	if (i < histcount) {
+		tally->bucket[i].count++;
+		tally->bucket[i].blocks += len;
+	}
+}
+
+static int
+sumtally(
+	struct ptvar		*ptv,
+	void			*data,
+	void			*foreach_arg)
+{
+	struct freesp_tally	*tally = data;
+	long			i;
+
+	totexts += tally->exts;
+	totblocks += tally->blocks;
 	for (i = 0; i < histcount; i++) {
-		if (hist[i].high >= len) {
-			hist[i].count++;
-			hist[i].blocks += len;
-			break;
-		}
+		hist[i].count += tally->bucket[i].count;
+		hist[i].blocks += tally->bucket[i].blocks;
 	}
+	return 0;
 }
 
 static int
@@ -141,12 +217,13 @@ inaglist(
 	return 0;
 }
 
-#define NR_EXTENTS 128
+#define NR_EXTENTS 2048
 
 static void
 scan_ag(
 	xfs_agnumber_t		agno)
 {
+	struct freesp_tally	*tally;
 	struct fsmap_head	*fsmap;
 	struct fsmap		*extent;
 	struct fsmap		*l, *h;
@@ -159,6 +236,19 @@ scan_ag(
 	int			ret;
 	int			i;
 
+	if (agtallies) {
+		tally = agtally(agno);
+		memset(tally, 0, tally_size);
+	} else {
+		tally = ptvar_get(tallies, &ret);
+		if (ret) {
+			fprintf(stderr, _("%s: cannot find histogram: %s\n"),
+				progname, strerror(-ret));
+			exitcode = 1;
+			return;
+		}
+	}
+
 	fsmap = malloc(fsmap_sizeof(NR_EXTENTS));
 	if (!fsmap) {
 		fprintf(stderr, _("%s: fsmap malloc failed.\n"), progname);
@@ -208,7 +298,7 @@ scan_ag(
 			freeblks += aglen;
 			freeexts++;
 
-			addtohist(agno, agbno, aglen);
+			addtohist(tally, agno, agbno, aglen);
 		}
 
 		p = &fsmap->fmh_recs[fsmap->fmh_entries - 1];
@@ -221,13 +311,194 @@ scan_ag(
 		if (agno == NULLAGNUMBER)
 			printf(_("     rtdev %10llu %10llu\n"), freeexts,
 					freeblks);
-		else
-			printf(_("%10u %10llu %10llu\n"), agno, freeexts,
-					freeblks);
+		else {
+			agsums[agno].exts = freeexts;
+			agsums[agno].blocks = freeblks;
+		}
 	}
 	free(fsmap);
 }
 
+static void
+scan_ag_work(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	scan_ag(agno);
+}
+
+/*
+ * Scan every AG we were asked for (or, if which is set, only those it
+ * marks), nr_threads at a time.
+ */
+static void
+scan_ags(
+	struct xfs_fsop_geom	*fsgeom,
+	const bool		*which)
+{
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	int			nr = 0;
+	int			ret;
+
+#define WANT_AG(agno)	(which ? which[(agno)] : inaglist(agno))
+	for (agno = 0; agno < fsgeom->agcount; agno++)
+		if (WANT_AG(agno))
+			nr++;
+
+	/* -d prints every extent as it goes, so keep those in AG order */
+	if (dumpflag || nr_threads <= 1 || nr <= 1) {
+		for (agno = 0; agno < fsgeom->agcount; agno++)
+			if (WANT_AG(agno))
+				scan_ag(agno);
+		return;
+	}
+
+	ret = -workqueue_create(&wq, NULL, min(nr_threads, nr));
+	if (ret) {
+		fprintf(stderr, _("%s: cannot create AG threads: %s\n"),
+			progname, strerror(ret));
+		exitcode = 1;
+		return;
+	}
+	for (agno = 0; agno < fsgeom->agcount; agno++) {
+		if (!WANT_AG(agno))
+			continue;
+		ret = -workqueue_add(&wq, scan_ag_work, agno, NULL);
+		if (ret) {
+			fprintf(stderr, _("%s: cannot queue AG %u: %s\n"),
+				progname, agno, strerror(ret));
+			exitcode = 1;
+			break;
+		}
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret) {
+		fprintf(stderr, _("%s: cannot finish AG threads: %s\n"),
+			progname, strerror(ret));
+		exitcode = 1;
+	}
+	workqueue_destroy(&wq);
+#undef WANT_AG
+}
+
+/* Print what changed since the last round, one line plus changed buckets. */
+static void
+watch_report(
+	unsigned int		rescanned,
+	unsigned int		nr_ags,
+	long long		prev_exts,
+	long long		prev_blocks,
+	struct freesp_bucket	*prev)
+{
+	char			ts[32];
+	time_t			now = time(NULL);
+	long			i;
+
+	strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	printf(_("%s ags %u/%u extents %lld (%+lld) blocks %lld (%+lld) "
+		 "avg %.1f\n"), ts, rescanned, nr_ags, totexts, totexts - prev_exts,
+		totblocks, totblocks - prev_blocks,
+		totexts ? (double)totblocks / totexts : 0.0);
+	for (i = 0; i < histcount; i++) {
+		if (hist[i].count == prev[i].count &&
+		    hist[i].blocks == prev[i].blocks)
+			continue;
+		printf(_("  %7lld %7lld extents %+lld blocks %+lld\n"),
+			hist[i].low, hist[i].high,
+			hist[i].count - prev[i].count,
+			hist[i].blocks - prev[i].blocks);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Watch free space fragmentation.  The AG geometry ioctl tells us cheaply
+ * how many blocks are free in each AG; only the AGs where that changed
+ * since last time get their free space rescanned, and everyone else's
+ * histogram is reused.  Runs until interrupted.
+ */
+static void
+freesp_watch(
+	struct xfs_fsop_geom	*fsgeom)
+{
+	struct xfs_ag_geometry	ageo;
+	struct freesp_bucket	*prev;
+	uint32_t		*freeblks;
+	bool			*stale;
+	long long		prev_exts = 0, prev_blocks = 0;
+	xfs_agnumber_t		agno;
+	unsigned int		nr_ags = 0, rescanned;
+	long			i;
+	int			ret;
+
+	agtallies = calloc(fsgeom->agcount, tally_size);
+	freeblks = calloc(fsgeom->agcount, sizeof(*freeblks));
+	stale = calloc(fsgeom->agcount, sizeof(*stale));
+	prev = calloc(max(histcount, 1), sizeof(*prev));
+	if (!agtallies || !freeblks || !stale || !prev) {
+		perror("calloc");
+		exitcode = 1;
+		goto out;
+	}
+	for (agno = 0; agno < fsgeom->agcount; agno++) {
+		if (inaglist(agno)) {
+			stale[agno] = true;
+			nr_ags++;
+		}
+	}
+
+	while (true) {
+		/* sample counters first so a change during the scan is seen */
+		rescanned = 0;
+		for (agno = 0; agno < fsgeom->agcount; agno++) {
+			if (!inaglist(agno))
+				continue;
+			ret = -xfrog_ag_geometry(file->xfd.fd, agno, &ageo);
+			if (ret) {
+				fprintf(stderr, _("%s: AG %u geometry: %s\n"),
+					progname, agno, strerror(ret));
+				exitcode = 1;
+				goto out;
+			}
+			if (ageo.ag_freeblks != freeblks[agno])
+				stale[agno] = true;
+			freeblks[agno] = ageo.ag_freeblks;
+			if (stale[agno])
+				rescanned++;
+		}
+
+		scan_ags(fsgeom, stale);
+		if (exitcode)
+			goto out;
+		memset(stale, 0, fsgeom->agcount * sizeof(*stale));
+
+		totexts = totblocks = 0;
+		for (i = 0; i < histcount; i++)
+			hist[i].count = hist[i].blocks = 0;
+		for (agno = 0; agno < fsgeom->agcount; agno++)
+			if (inaglist(agno))
+				sumtally(NULL, agtally(agno), NULL);
+
+		watch_report(rescanned, nr_ags, prev_exts, prev_blocks, prev);
+		prev_exts = totexts;
+		prev_blocks = totblocks;
+		for (i = 0; i < histcount; i++) {
+			prev[i].count = hist[i].count;
+			prev[i].blocks = hist[i].blocks;
+		}
+
+		sleep(watch_interval);
+	}
+out:
+	free(prev);
+	free(stale);
+	free(freeblks);
+	free(agtallies);
+	agtallies = NULL;
+}
+
 static void
 aglistadd(
 	char		*a)
@@ -255,13 +526,15 @@ init(
 	int			speced = 0;	/* only one of -b -e -h or -m */
 
 	agcount = dumpflag = equalsize = multsize = optind = gflag = 0;
+	nr_threads = platform_nproc();
+	watch_interval = 0;
 	histcount = seen1 = summaryflag = 0;
 	totblocks = totexts = 0;
 	aglist = NULL;
 	hist = NULL;
 	rtflag = false;
 
-	while ((c = getopt(argc, argv, "a:bde:gh:m:rs")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bde:gh:j:m:rsw:")) != EOF) {
 		switch (c) {
 		case 'a':
 			aglistadd(optarg);
@@ -297,6 +570,11 @@ init(
 			addhistent(x);
 			speced = 1;
 			break;
+		case 'j':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno || nr_threads <= 0)
+				return command_usage(&freesp_cmd);
+			break;
 		case 'm':
 			if (speced)
 				goto many_spec;
@@ -311,12 +589,21 @@ init(
 		case 's':
 			summaryflag = 1;
 			break;
+		case 'w':
+			watch_interval = cvt_s64(optarg, 0);
+			if (errno || watch_interval <= 0)
+				return command_usage(&freesp_cmd);
+			break;
 		default:
 			return command_usage(&freesp_cmd);
 		}
 	}
 	if (optind != argc)
 		return 0;
+	if (watch_interval && (dumpflag || gflag || rtflag)) {
+		fprintf(stderr, _("-w cannot be used with -d, -g, or -r.\n"));
+		return 0;
+	}
 	if (!speced)
 		multsize = 2;
 	histinit(fsgeom->agblocks);
@@ -335,17 +622,47 @@ freesp_f(
 {
 	struct xfs_fsop_geom	*fsgeom = &file->xfd.fsgeom;
 	xfs_agnumber_t		agno;
+	int			ret;
 
 	if (!init(argc, argv))
 		return 0;
+
+	tally_size = sizeof(struct freesp_tally) +
+			histcount * sizeof(struct freesp_bucket);
+	if (watch_interval) {
+		freesp_watch(fsgeom);
+		goto out;
+	}
+
+	ret = -ptvar_alloc(max(nr_threads, 1), tally_size, &tallies);
+	if (ret) {
+		fprintf(stderr, _("%s: cannot allocate histograms: %s\n"),
+			progname, strerror(ret));
+		exitcode = 1;
+		goto out;
+	}
+	if (gflag && !rtflag) {
+		agsums = calloc(fsgeom->agcount, sizeof(*agsums));
+		if (!agsums) {
+			perror("calloc");
+			exitcode = 1;
+			goto out;
+		}
+	}
+
 	if (gflag)
 		printf(_("        AG    extents     blocks\n"));
 	if (rtflag)
 		scan_ag(NULLAGNUMBER);
-	for (agno = 0; !rtflag && agno < fsgeom->agcount; agno++) {
+	else
+		scan_ags(fsgeom, NULL);
+	for (agno = 0; agsums && agno < fsgeom->agcount; agno++) {
 		if (inaglist(agno))
-			scan_ag(agno);
+			printf(_("%10u %10llu %10llu\n"), agno,
+					agsums[agno].exts, agsums[agno].blocks);
 	}
+	ptvar_foreach(tallies, sumtally, NULL);
+
 	if (histcount && !gflag)
 		printhist();
 	if (summaryflag) {
@@ -354,6 +671,12 @@ freesp_f(
 		printf(_("average free extent size %g\n"),
 			(double)totblocks / (double)totexts);
 	}
+out:
+	if (tallies)
+		ptvar_free(tallies);
+	tallies = NULL;
+	free(agsums);
+	agsums = NULL;
 	if (aglist)
 		free(aglist);
 	if (hist)
@@ -375,9 +698,12 @@ freesp_help(void)
 " -g       -- Print only a per-AG summary.\n"
 " -h hbsz  -- Use custom histogram bin size of h1.\n"
 "             Multiple specifications are allowed.\n"
+" -j nr    -- Scan this many AGs at once.\n"
 " -m bmult -- Use histogram bin size multiplier of bmult.\n"
 " -r       -- Display realtime device free space information.\n"
 " -s       -- Emit freespace summary information.\n"
+" -w secs  -- Every secs seconds, rescan the AGs whose free block count\n"
+"             changed and print how the free space histogram moved.\n"
 "\n"
 "Only one of -b, -e, -h, or -m may be specified.\n"
 "\n"));
@@ -392,7 +718,7 @@ freesp_init(void)
 	freesp_cmd.cfunc = freesp_f;
 	freesp_cmd.argmin = 0;
 	freesp_cmd.argmax = -1;
-	freesp_cmd.args = "[-dgrs] [-a agno]... [ -b | -e bsize | -h h1... | -m bmult ]";
+	freesp_cmd.args = "[-dgrs] [-a agno]... [-j nr] [-w secs] [ -b | -e bsize | -h h1... | -m bmult ]";
 	freesp_cmd.flags = CMD_FLAG_ONESHOT;
 	freesp_cmd.oneline = _("Examine filesystem free space");
 	freesp_cmd.help = freesp_help;
@@ -12,12 +12,22 @@
 #include "libfrog/paths.h"
 #include "libfrog/fsgeom.h"
 #include "libfrog/bulkstat.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/platform.h"
 #include "space.h"
 
 static cmdinfo_t health_cmd;
 static unsigned long long reported;
 static bool comprehensive;
 static bool quiet;
+static bool resolve_paths;
+static unsigned int nr_threads;
+
+/* Unhealthy inodes found by the bulkstat sweep, for -p to find names for. */
+static pthread_mutex_t sick_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *sick_inos;
+static size_t nr_sick_inos;
+static size_t max_sick_inos;
 
 static bool has_realtime(const struct xfs_fsop_geom *g)
 {
@@ -175,7 +185,7 @@ report_sick(
 		bad = sick & f->mask;
 		if (!bad && !(checked & f->mask))
 			continue;
-		reported++;
+		__atomic_add_fetch(&reported, 1, __ATOMIC_RELAXED);
 		if (!bad && quiet)
 			continue;
 		printf("%s %s: %s\n", descr, _(f->descr),
@@ -255,6 +265,32 @@ report_file_health(
 	return report_inode_health(statb.st_ino, path);
 }
 
+/* Remember an unhealthy inode so that -p can look up its paths later. */
+static int
+remember_sick_inode(
+	uint64_t		ino)
+{
+	uint64_t		*p;
+	int			ret = 0;
+
+	pthread_mutex_lock(&sick_lock);
+	if (nr_sick_inos == max_sick_inos) {
+		size_t		newmax = max(max_sick_inos * 2, 64);
+
+		p = realloc(sick_inos, newmax * sizeof(*sick_inos));
+		if (!p) {
+			ret = ENOMEM;
+			goto out;
+		}
+		sick_inos = p;
+		max_sick_inos = newmax;
+	}
+	sick_inos[nr_sick_inos++] = ino;
+out:
+	pthread_mutex_unlock(&sick_lock);
+	return ret;
+}
+
 #define BULKSTAT_NR		(128)
 
 /*
@@ -266,6 +302,8 @@ report_bulkstat_health(
 	xfs_agnumber_t		agno)
 {
 	struct xfs_bulkstat_req	*breq;
+	struct xfs_fd		xfd = file->xfd;	/* per thread */
+	struct xfs_bulkstat	*bs;
 	char			descr[256];
 	uint32_t		i;
 	int			error;
@@ -281,17 +319,22 @@ report_bulkstat_health(
 		xfrog_bulkstat_set_ag(breq, agno);
 
 	do {
-		error = -xfrog_bulkstat(&file->xfd, breq);
+		error = -xfrog_bulkstat(&xfd, breq);
 		if (error)
 			break;
 		for (i = 0; i < breq->hdr.ocount; i++) {
+			bs = &breq->bulkstat[i];
 			snprintf(descr, sizeof(descr) - 1, _("inode %"PRIu64),
-					breq->bulkstat[i].bs_ino);
-			report_sick(descr, inode_flags,
-					breq->bulkstat[i].bs_sick,
-					breq->bulkstat[i].bs_checked);
+					bs->bs_ino);
+			report_sick(descr, inode_flags, bs->bs_sick,
+					bs->bs_checked);
+			if (resolve_paths && bs->bs_sick) {
+				error = remember_sick_inode(bs->bs_ino);
+				if (error)
+					break;
+			}
 		}
-	} while (breq->hdr.ocount > 0);
+	} while (!error && breq->hdr.ocount > 0);
 
 	if (error)
 		xfrog_perror(error, "bulkstat");
@@ -300,7 +343,181 @@ report_bulkstat_health(
 	return error;
 }
 
-#define OPT_STRING ("a:cfi:q")
+struct health_ag {
+	struct xfs_ag_geometry	ageo;
+	int			error;
+};
+
+/* Query one AG's health and, for -c, sweep its inodes too. */
+static void
+health_ag_work(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct health_ag	*ags = wq->wq_ctx;
+	struct health_ag	*ag = &ags[agno];
+
+	if (arg) {
+		ag->error = report_bulkstat_health(agno);
+		return;
+	}
+	ag->error = -xfrog_ag_geometry(file->xfd.fd, agno, &ag->ageo);
+}
+
+/*
+ * Run health_ag_work on every AG, nr_threads at a time.  The AG geometry
+ * pass only gathers the AG health so that it can still be printed in AG
+ * order; the inode sweep prints as it goes.
+ */
+static int
+health_scan_ags(
+	struct health_ag	*ags,
+	bool			sweep)
+{
+	struct workqueue	wq;
+	xfs_agnumber_t		agno;
+	xfs_agnumber_t		agcount = file->xfd.fsgeom.agcount;
+	int			ret;
+
+	ret = -workqueue_create(&wq, ags, min(nr_threads, agcount));
+	if (ret) {
+		xfrog_perror(ret, "creating health workqueue");
+		return 1;
+	}
+	for (agno = 0; agno < agcount; agno++) {
+		ret = -workqueue_add(&wq, health_ag_work, agno,
+				sweep ? ags : NULL);
+		if (ret) {
+			xfrog_perror(ret, "queueing AG health");
+			break;
+		}
+	}
+	if (!ret) {
+		ret = -workqueue_terminate(&wq);
+		if (ret)
+			xfrog_perror(ret, "finishing AG health");
+	}
+	workqueue_destroy(&wq);
+	if (ret)
+		return 1;
+
+	for (agno = 0; agno < agcount; agno++) {
+		if (!ags[agno].error)
+			continue;
+		if (!sweep)
+			xfrog_perror(ags[agno].error, "ag_geometry");
+		return 1;
+	}
+	return 0;
+}
+
+/* Report on the health of every inode, an AG at a time on each thread. */
+static int
+report_all_inodes(void)
+{
+	struct health_ag	*ags;
+	int			ret;
+
+	if (nr_threads <= 1)
+		return report_bulkstat_health(NULLAGNUMBER);
+
+	ags = calloc(file->xfd.fsgeom.agcount, sizeof(*ags));
+	if (!ags) {
+		perror("calloc");
+		return 1;
+	}
+	ret = health_scan_ags(ags, true);
+	free(ags);
+	return ret;
+}
+
+/* Report on the health of every AG, and of every inode if @sweep. */
+static int
+report_all_ags(
+	bool			sweep)
+{
+	struct health_ag	*ags;
+	xfs_agnumber_t		agno;
+	char			descr[256];
+	int			ret;
+
+	if (nr_threads <= 1) {
+		for (agno = 0; agno < file->xfd.fsgeom.agcount; agno++) {
+			ret = report_ag_sick(agno);
+			if (ret)
+				return 1;
+		}
+		return sweep ? report_all_inodes() : 0;
+	}
+
+	ags = calloc(file->xfd.fsgeom.agcount, sizeof(*ags));
+	if (!ags) {
+		perror("calloc");
+		return 1;
+	}
+	ret = health_scan_ags(ags, false);
+	if (ret)
+		goto out;
+	for (agno = 0; agno < file->xfd.fsgeom.agcount; agno++) {
+		snprintf(descr, sizeof(descr) - 1, _("AG %u"), agno);
+		report_sick(descr, ag_flags, ags[agno].ageo.ag_sick,
+				ags[agno].ageo.ag_checked);
+	}
+	if (sweep)
+		ret = report_all_inodes();
+out:
+	free(ags);
+	return ret;
+}
+
+static int
+compare_ino(
+	const void		*a,
+	const void		*b)
+{
+	uint64_t		x = *(const uint64_t *)a;
+	uint64_t		y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int
+resolve_sick_path(
+	const char		*path,
+	const struct stat	*st,
+	int			flags,
+	struct FTW		*ftw)
+{
+	uint64_t		ino = st->st_ino;
+
+	if (flags == FTW_NS)
+		return 0;
+	if (bsearch(&ino, sick_inos, nr_sick_inos, sizeof(*sick_inos),
+			compare_ino))
+		printf(_("inode %"PRIu64" path: %s\n"), ino, path);
+	return 0;
+}
+
+/*
+ * Print the paths of the unhealthy inodes that the sweep found.  There's
+ * no way to ask for an inode's parents here, so walk the directory tree
+ * once and look up each inode in the sorted list of sick ones.  Healthy
+ * inodes never make it into the list, so a clean filesystem skips the
+ * walk entirely.
+ */
+static void
+report_sick_paths(void)
+{
+	if (!nr_sick_inos)
+		return;
+	qsort(sick_inos, nr_sick_inos, sizeof(*sick_inos), compare_ino);
+	if (nftw(file->fs_path.fs_dir, resolve_sick_path, 100,
+			FTW_PHYS | FTW_MOUNT) < 0)
+		perror(file->fs_path.fs_dir);
+}
+
+#define OPT_STRING ("a:cfi:j:pq")
 
 /* Report on health problems in XFS filesystem. */
 static int
@@ -315,6 +532,9 @@ health_f(
 	int			ret;
 
 	reported = 0;
+	resolve_paths = false;
+	nr_threads = platform_nproc();
+	nr_sick_inos = 0;
 
 	if (file->xfd.fsgeom.version != XFS_FSOP_GEOM_VERSION_V5) {
 		perror("health");
@@ -350,6 +570,14 @@ health_f(
 				return 1;
 			}
 			break;
+		case 'j':
+			nr_threads = cvt_u32(optarg, 0);
+			if (errno || nr_threads == 0)
+				return command_usage(&health_cmd);
+			break;
+		case 'p':
+			resolve_paths = true;
+			break;
 		case 'q':
 			quiet = true;
 			break;
@@ -370,23 +598,23 @@ health_f(
 			if (!ret && comprehensive)
 				ret = report_bulkstat_health(agno);
 			if (ret)
-				return 1;
+				goto fail;
 			break;
 		case 'f':
 			report_sick(_("filesystem"), fs_flags,
 					file->xfd.fsgeom.sick,
 					file->xfd.fsgeom.checked);
 			if (comprehensive) {
-				ret = report_bulkstat_health(NULLAGNUMBER);
+				ret = report_all_inodes();
 				if (ret)
-					return 1;
+					goto fail;
 			}
 			break;
 		case 'i':
 			x = strtoll(optarg, NULL, 10);
 			ret = report_inode_health(x, NULL);
 			if (ret)
-				return 1;
+				goto fail;
 			break;
 		default:
 			break;
@@ -396,7 +624,7 @@ health_f(
 	for (c = optind; c < argc; c++) {
 		ret = report_file_health(argv[c]);
 		if (ret)
-			return 1;
+			goto fail;
 	}
 
 	/* No arguments gets us a summary of fs state. */
@@ -404,18 +632,14 @@ health_f(
 		report_sick(_("filesystem"), fs_flags, file->xfd.fsgeom.sick,
 				file->xfd.fsgeom.checked);
 
-		for (agno = 0; agno < file->xfd.fsgeom.agcount; agno++) {
-			ret = report_ag_sick(agno);
-			if (ret)
-				return 1;
-		}
-		if (comprehensive) {
-			ret = report_bulkstat_health(NULLAGNUMBER);
-			if (ret)
-				return 1;
-		}
+		ret = report_all_ags(comprehensive);
+		if (ret)
+			goto fail;
 	}
 
+	if (resolve_paths)
+		report_sick_paths();
+
 	if (!reported) {
 		fprintf(stderr,
 _("Health status has not been collected for this filesystem.\n"));
@@ -423,7 +647,15 @@ _("Health status has not been collected for this filesystem.\n"));
 _("Please run xfs_scrub(8) to remedy this situation.\n"));
 	}
 
+	free(sick_inos);
+	sick_inos = NULL;
+	max_sick_inos = 0;
 	return 0;
+fail:
+	free(sick_inos);
+	sick_inos = NULL;
+	max_sick_inos = 0;
+	return 1;
 }
 
 static void
@@ -437,6 +669,8 @@ health_help(void)
 " -c       -- Report on the health of all inodes.\n"
 " -f       -- Report health of the overall filesystem.\n"
 " -i inum  -- Report health of a given inode number.\n"
+" -j nr    -- Check up to nr AGs in parallel (default: one per CPU).\n"
+" -p       -- With -c, print the paths of unhealthy inodes.\n"
 " -q       -- Only report unhealthy metadata.\n"
 " paths    -- Report health of the given file path.\n"
 "\n"));
@@ -448,7 +682,7 @@ static cmdinfo_t health_cmd = {
 	.cfunc = health_f,
 	.argmin = 0,
 	.argmax = -1,
-	.args = "[-a agno] [-c] [-f] [-i inum] [-q] [paths]",
+	.args = "[-a agno] [-c] [-f] [-i inum] [-j nr] [-p] [-q] [paths]",
 	.flags = CMD_FLAG_ONESHOT,
 	.help = health_help,
 };
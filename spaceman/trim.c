@@ -6,6 +6,7 @@
 
 #include "libxfs.h"
 #include "libfrog/fsgeom.h"
+#include "libfrog/trim.h"
 #include "command.h"
 #include "init.h"
 #include "libfrog/paths.h"
@@ -22,19 +23,22 @@ trim_f(
 	int			argc,
 	char			**argv)
 {
-	struct fstrim_range	trim = {0};
+	struct xfrog_trim	trim = {
+		.nr_threads	= platform_nproc(),
+	};
 	struct xfs_fd		*xfd = &file->xfd;
 	struct xfs_fsop_geom	*fsgeom = &xfd->fsgeom;
 	xfs_agnumber_t		agno = 0;
 	off64_t			offset = 0;
 	ssize_t			length = 0;
 	ssize_t			minlen = 0;
+	ssize_t			rate = 0;
 	int			aflag = 0;
 	int			fflag = 0;
 	int			ret;
 	int			c;
 
-	while ((c = getopt(argc, argv, "a:fm:")) != EOF) {
+	while ((c = getopt(argc, argv, "a:fm:r:t:")) != EOF) {
 		switch (c) {
 		case 'a':
 			aflag = 1;
@@ -51,6 +55,21 @@ trim_f(
 			minlen = cvtnum(fsgeom->blocksize, fsgeom->sectsize,
 					optarg);
 			break;
+		case 'r':
+			rate = cvtnum(fsgeom->blocksize, fsgeom->sectsize,
+					optarg);
+			if (rate <= 0) {
+				printf(_("bad rate value %s\n"), optarg);
+				return command_usage(&trim_cmd);
+			}
+			break;
+		case 't':
+			trim.nr_threads = cvt_u32(optarg, 10);
+			if (errno) {
+				printf(_("bad thread count %s\n"), optarg);
+				return command_usage(&trim_cmd);
+			}
+			break;
 		default:
 			return command_usage(&trim_cmd);
 		}
@@ -66,7 +85,7 @@ trim_f(
 				argv[optind]);
 		length = cvtnum(fsgeom->blocksize, fsgeom->sectsize,
 				argv[optind + 1]);
-	} else if (agno) {
+	} else if (aflag) {
 		offset = cvt_agbno_to_b(xfd, agno, 0);
 		length = cvt_off_fsb_to_b(xfd, fsgeom->agblocks);
 	} else {
@@ -77,11 +96,12 @@ trim_f(
 	trim.start = offset;
 	trim.len = length;
 	trim.minlen = minlen;
+	trim.rate = rate;
 
-	ret = ioctl(file->xfd.fd, FITRIM, (unsigned long)&trim);
-	if (ret < 0) {
+	ret = -xfrog_trim(xfd, &trim);
+	if (ret) {
 		fprintf(stderr, "%s: ioctl(FITRIM) [\"%s\"]: %s\n",
-			progname, file->name, strerror(errno));
+			progname, file->name, strerror(ret));
 		exitcode = 1;
 	}
 	return 0;
@@ -98,6 +118,8 @@ trim_help(void)
 " -f            -- trim all the freespace in the entire filesystem\n"
 " offset length -- trim the freespace in the range {offset, length}\n"
 " -m minlen     -- skip freespace extents smaller than minlen\n"
+" -r rate       -- discard at most rate bytes per second\n"
+" -t nthreads   -- trim this many AGs at once\n"
 "\n"
 "One of -a, -f, or the offset/length pair are required.\n"
 "\n"));
@@ -111,8 +133,9 @@ trim_init(void)
 	trim_cmd.altname = "tr";
 	trim_cmd.cfunc = trim_f;
 	trim_cmd.argmin = 1;
-	trim_cmd.argmax = 4;
-	trim_cmd.args = "[-m minlen] ( -a agno | -f | offset length )";
+	trim_cmd.argmax = 8;
+	trim_cmd.args =
+		"[-m minlen] [-r rate] [-t nthreads] ( -a agno | -f | offset length )";
 	trim_cmd.flags = CMD_FLAG_ONESHOT;
 	trim_cmd.oneline = _("Discard filesystem free space");
 	trim_cmd.help = trim_help;
@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-2.0+
+# Copyright (C) 2026 agent <agent@local>
+
+# Decode the prefetch trace written by "xfs_repair -o pf_trace=FILE".
+#
+# The trace is a header followed by one ring of events per thread; see
+# repair/pftrace.h for the layout.  The file can be decoded while repair is
+# still running, in which case the newest events of a busy thread may be
+# missing.
+#
+# Rough guide to using this script:
+#
+# # xfs_repair -o pf_trace=/tmp/pf.trace /dev/sdX
+# # xfs_pftrace.py /tmp/pf.trace
+#   AG   queued  cached      ios       MiB   avg lat   max lat  misses ...
+#    0    15360       0      412     240.0    1.2 ms   15.4 ms       3 ...
+#
+# With -e, every event is printed in time order instead.  A prefetch that
+# keeps up shows few cache misses and little processing wait; lots of both
+# with short I/O latencies means the queuing thread isn't getting ahead,
+# whereas long latencies point at the disk.
+
+import sys
+import struct
+import argparse
+
+PFT_MAGIC = b'XFSPFTR1'
+PFT_VERSION = 1
+
+HEADER = struct.Struct('=8sIIIIIIQ24x')
+RING = struct.Struct('=QI4x16s32x')
+EVENT = struct.Struct('=QHHIQII')
+
+EVENT_NAMES = {
+	1: 'queue',
+	2: 'queue_cached',
+	3: 'queue_stall',
+	4: 'io_issue',
+	5: 'io_done',
+	6: 'proc_wait',
+	7: 'cache_miss',
+}
+
+WHICH_NAMES = {0: 'pri', 1: 'sec', 2: 'meta'}
+
+class AGStats:
+	def __init__(self):
+		self.queued = 0
+		self.cached = 0
+		self.ios = 0
+		self.io_bytes = 0
+		self.io_usecs = 0
+		self.io_max = 0
+		self.misses = 0
+		self.proc_wait = 0
+		self.stall = 0
+
+def read_trace(fname):
+	with open(fname, 'rb') as f:
+		data = f.read()
+
+	if len(data) < HEADER.size:
+		raise ValueError('%s: file too short' % fname)
+	(magic, version, event_size, ring_events, nr_rings, rings_used,
+			finished, start_time) = HEADER.unpack_from(data, 0)
+	if magic != PFT_MAGIC:
+		raise ValueError('%s: not a prefetch trace' % fname)
+	if version != PFT_VERSION or event_size != EVENT.size:
+		raise ValueError('%s: unknown trace version %d' % (fname, version))
+
+	hdr = {
+		'ring_events': ring_events,
+		'rings_used': rings_used,
+		'nr_rings': nr_rings,
+		'finished': finished,
+		'start_time': start_time,
+	}
+
+	ring_size = RING.size + ring_events * EVENT.size
+	rings = []
+	for slot in range(min(rings_used, nr_rings)):
+		off = HEADER.size + slot * ring_size
+		if off + ring_size > len(data):
+			break
+		head, tid, name = RING.unpack_from(data, off)
+		name = name.split(b'\0', 1)[0].decode(errors = 'replace')
+		first = max(0, head - ring_events)
+		events = []
+		for i in range(first, head):
+			ev = EVENT.unpack_from(data, off + RING.size +
+					(i % ring_events) * EVENT.size)
+			events.append(ev + (tid,))
+		rings.append((tid, name, head, events))
+	return (hdr, rings)
+
+def print_events(rings, agno):
+	events = []
+	for (tid, name, head, evs) in rings:
+		events.extend(evs)
+	events.sort(key = lambda e: e[0])
+	for (ns, etype, flags, ag, daddr, length, arg, tid) in events:
+		if agno is not None and ag != agno:
+			continue
+		name = EVENT_NAMES.get(etype, 'type%d' % etype)
+		line = '%12.6f %7d %-12s AG %3d' % (ns / 1e9, tid, name, ag)
+		if etype in (1, 2, 7):
+			line += ' daddr 0x%x len %d' % (daddr, length)
+			if etype == 1:
+				line += ' queued %d' % arg
+		elif etype == 4:
+			line += ' daddr 0x%x len %d bufs %d %s' % (daddr,
+					length, arg, WHICH_NAMES.get(flags, '?'))
+		elif etype == 5:
+			line += ' daddr 0x%x len %d %d us %s' % (daddr,
+					length, arg, WHICH_NAMES.get(flags, '?'))
+		else:
+			line += ' %d us' % arg
+		print(line)
+
+def print_summary(hdr, rings):
+	ags = {}
+	for (tid, name, head, evs) in rings:
+		for (ns, etype, flags, ag, daddr, length, arg, t) in evs:
+			st = ags.setdefault(ag, AGStats())
+			if etype == 1:
+				st.queued += 1
+			elif etype == 2:
+				st.cached += 1
+			elif etype == 3:
+				st.stall += arg
+			elif etype == 5:
+				st.ios += 1
+				st.io_bytes += length
+				st.io_usecs += arg
+				st.io_max = max(st.io_max, arg)
+			elif etype == 6:
+				st.proc_wait += arg
+			elif etype == 7:
+				st.misses += 1
+
+	print('%4s %8s %7s %8s %9s %9s %9s %7s %10s %10s' % ('AG',
+		'queued', 'cached', 'ios', 'MiB', 'avg lat', 'max lat',
+		'misses', 'proc wait', 'q stall'))
+	for ag in sorted(ags):
+		st = ags[ag]
+		avg = st.io_usecs / st.ios if st.ios else 0
+		print('%4d %8d %7d %8d %9.1f %6.1f ms %6.1f ms %7d %8.1f s %8.1f s' % (
+			ag, st.queued, st.cached, st.ios,
+			st.io_bytes / 1048576, avg / 1000, st.io_max / 1000,
+			st.misses, st.proc_wait / 1e6, st.stall / 1e6))
+
+	wrapped = [r for r in rings if r[2] > hdr['ring_events']]
+	if wrapped:
+		print('%d of %d threads wrapped their rings; only the last %d events of each were kept.' %
+			(len(wrapped), len(rings), hdr['ring_events']))
+	if hdr['rings_used'] > hdr['nr_rings']:
+		print('%d threads were not traced for lack of rings.' %
+			(hdr['rings_used'] - hdr['nr_rings']))
+	if not hdr['finished']:
+		print('Trace is incomplete; repair is still running or was killed.')
+
+def main():
+	parser = argparse.ArgumentParser(
+			description = 'Decode an xfs_repair prefetch trace.')
+	parser.add_argument('-e', '--events', action = 'store_true',
+			help = 'Print every event instead of a summary.')
+	parser.add_argument('-a', '--agno', type = int,
+			help = 'Only print events for this AG.')
+	parser.add_argument('trace', help = 'Trace file to decode.')
+	args = parser.parse_args()
+
+	try:
+		(hdr, rings) = read_trace(args.trace)
+	except (OSError, ValueError) as e:
+		print(e, file = sys.stderr)
+		return 1
+
+	if args.events:
+		print_events(rings, args.agno)
+	else:
+		print_summary(hdr, rings)
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main())
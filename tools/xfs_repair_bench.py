@@ -0,0 +1,447 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-2.0+
+# Copyright (C) 2026 agent <agent@local>
+
+# Time xfs_repair against a corpus of metadumps, to catch releases that make
+# repair slower or hungrier.
+#
+# "generate" builds synthetic filesystems in sparse files, each stressing a
+# different part of repair, and saves their metadumps in a corpus directory.
+# Real metadumps can be dropped into the corpus as well; anything ending in
+# .md is used.  "run" restores each dump to a sparse file in a scratch
+# directory, runs "xfs_repair -n" and then a full repair on it, and saves the
+# per-phase report that "xfs_repair -o report=" writes (wall and CPU time,
+# I/O counts and bytes, peak RSS) for every run in one results file.
+# "compare" lines up two results files and flags what got worse.
+#
+# Rough guide to using this script:
+#
+# $ xfs_repair_bench.py generate /srv/corpus
+# $ xfs_repair_bench.py run /srv/corpus -s /scratch -o old.json
+#   (upgrade xfsprogs, or point --repair at a new build)
+# $ xfs_repair_bench.py run /srv/corpus -s /scratch -o new.json
+# $ xfs_repair_bench.py compare old.json new.json
+#   fs          mode   phase  metric              old         new  change
+#   many_files  check  total  wall_seconds     28.10 s     33.70 s  +19.9% *
+#   many_files  check  total  max_rss_kb    100000 KiB  100500 KiB   +0.5%
+#   ...
+#
+# Figures marked with a star grew by more than the threshold (5% unless -t
+# says otherwise), and then the exit status is 1.  With -p, every phase is
+# compared as well as the totals.
+#
+# Filesystems built from mkfs protofiles need no privileges.  The reflink and
+# free space fragmentation filesystems have to be mounted to build, so they
+# are only generated when run as root.  Timings from a run are medians over
+# --runs repeats; use --drop-caches (as root) to start each run cold.
+
+import os
+import sys
+import json
+import time
+import argparse
+import platform
+import statistics
+import subprocess
+import tempfile
+
+REPORT_FIELDS = ('wall_seconds', 'cpu_seconds', 'reads', 'read_bytes',
+		'writes', 'write_bytes', 'max_rss_kb')
+
+class Tools:
+	'''Where to find the programs we run.'''
+	def __init__(self, args):
+		self.mkfs = getattr(args, 'mkfs', None) or 'mkfs.xfs'
+		self.db = getattr(args, 'db', None) or 'xfs_db'
+		self.io = getattr(args, 'io', None) or 'xfs_io'
+		self.repair = getattr(args, 'repair', None) or 'xfs_repair'
+		self.mdrestore = (getattr(args, 'mdrestore', None) or
+				'xfs_mdrestore')
+
+def run_cmd(cmd, stdin = None, quiet = True):
+	out = subprocess.DEVNULL if quiet else None
+	subprocess.run(cmd, input = stdin, stdout = out, check = True,
+			universal_newlines = True)
+
+# Generators
+
+class Proto:
+	'''Build a mkfs protofile.'''
+	def __init__(self, datafile):
+		self.datafile = datafile
+		self.lines = ['/dev/null', '0 0', 'd--755 0 0']
+
+	def file(self, name):
+		self.lines.append('%s ---644 0 0 %s' % (name, self.datafile))
+
+	def dir(self, name):
+		self.lines.append('%s d--755 0 0' % name)
+
+	def end(self):
+		self.lines.append('$')
+
+	def write(self, path):
+		self.end()
+		with open(path, 'w') as f:
+			f.write('\n'.join(self.lines) + '\n')
+
+def proto_many_files(proto, scale):
+	'''Lots of small files in a modest number of directories.'''
+	nr_dirs = max(1, int(200 * scale))
+	for d in range(nr_dirs):
+		proto.dir('d%05d' % d)
+		for i in range(1000):
+			proto.file('f%05d' % i)
+		proto.end()
+
+def proto_huge_dir(proto, scale):
+	'''One directory with enough entries to need a node format btree.'''
+	proto.dir('big')
+	for i in range(int(500000 * scale)):
+		proto.file('entry_with_a_longish_name_%08d' % i)
+	proto.end()
+
+def proto_many_ags(proto, scale):
+	'''Files spread out over hundreds of AGs by the directory rotor.'''
+	for d in range(512):
+		proto.dir('ag%03d' % d)
+		for i in range(max(1, int(200 * scale))):
+			proto.file('f%04d' % i)
+		proto.end()
+
+def xfs_io_script(tools, path, commands):
+	'''Feed xfs_io a list of commands on stdin.'''
+	run_cmd([tools.io, '-f', path], stdin = '\n'.join(commands) + '\n')
+
+def mounted_reflink(tools, mnt, scale):
+	'''Shared extents, and lots of refcount records to go with them.'''
+	bs = 4096
+	nr_blocks = int(65536 * scale)
+	src = os.path.join(mnt, 'src')
+	xfs_io_script(tools, src,
+			['pwrite -S 0x58 -b 1m 0 %d' % (nr_blocks * bs)])
+	for c in range(16):
+		# share every other block, a different half for odd copies
+		cmds = ['reflink %s %d %d %d' % (src, b * bs, b * bs, bs)
+				for b in range(c % 2, nr_blocks, 2)]
+		xfs_io_script(tools, os.path.join(mnt, 'copy%02d' % c), cmds)
+
+def mounted_fragmented(tools, mnt, scale):
+	'''Free space chopped into single blocks, and files mapping the rest.'''
+	bs = 4096
+	nr_blocks = int(262144 * scale)
+	for f in range(4):
+		path = os.path.join(mnt, 'frag%d' % f)
+		cmds = ['falloc 0 %d' % (nr_blocks * bs)]
+		cmds += ['fpunch %d %d' % (b * bs, bs)
+				for b in range(f % 2, nr_blocks, 2)]
+		xfs_io_script(tools, path, cmds)
+
+# name: (mkfs options, protofile builder or None, mounted builder or None)
+SCENARIOS = {
+	'many_files':	(['-d', 'size=16g'], proto_many_files, None),
+	'huge_dir':	(['-d', 'size=16g', '-n', 'size=8k'], proto_huge_dir,
+			 None),
+	'many_ags':	(['-d', 'size=64g,agcount=512'], proto_many_ags, None),
+	'reflink':	(['-d', 'size=16g', '-m', 'reflink=1,rmapbt=1'], None,
+			 mounted_reflink),
+	'fragmented':	(['-d', 'size=8g', '-m', 'rmapbt=1'], None,
+			 mounted_fragmented),
+}
+
+def generate_one(tools, name, scenario, corpus, workdir, scale):
+	(mkfs_opts, proto_fn, mount_fn) = scenario
+	img = os.path.join(workdir, name + '.img')
+	dump = os.path.join(corpus, name + '.md')
+
+	# mkfs extends the (sparse) image to the size asked for
+	open(img, 'w').close()
+	cmd = [tools.mkfs, '-f', '-q'] + mkfs_opts
+	if proto_fn:
+		datafile = os.path.join(workdir, 'data')
+		with open(datafile, 'w') as f:
+			f.write('x')
+		proto = Proto(datafile)
+		proto_fn(proto, scale)
+		protofile = os.path.join(workdir, name + '.proto')
+		proto.write(protofile)
+		cmd += ['-p', protofile]
+	run_cmd(cmd + [img])
+
+	if mount_fn:
+		mnt = os.path.join(workdir, 'mnt')
+		os.makedirs(mnt, exist_ok = True)
+		run_cmd(['mount', '-o', 'loop', img, mnt])
+		try:
+			mount_fn(tools, mnt, scale)
+		finally:
+			run_cmd(['umount', mnt])
+
+	# synthetic names need no obfuscating, and it would slow the dump
+	run_cmd([tools.db, '-f', '-i', '-p', 'xfs_metadump', '-c',
+			'metadump -o ' + dump, img])
+	os.unlink(img)
+
+def cmd_generate(args):
+	tools = Tools(args)
+	names = args.scenario or sorted(SCENARIOS)
+	os.makedirs(args.corpus, exist_ok = True)
+	ret = 0
+	for name in names:
+		if name not in SCENARIOS:
+			print('%s: unknown scenario' % name, file = sys.stderr)
+			ret = 1
+			continue
+		if SCENARIOS[name][2] and os.geteuid() != 0:
+			print('%s: must be root to mount, skipping' % name)
+			continue
+		print('generating %s' % name)
+		with tempfile.TemporaryDirectory(dir = args.scratch) as workdir:
+			try:
+				generate_one(tools, name, SCENARIOS[name],
+						args.corpus, workdir, args.scale)
+			except (OSError, subprocess.CalledProcessError) as e:
+				print('%s: %s' % (name, e), file = sys.stderr)
+				ret = 1
+	return ret
+
+# Running
+
+def drop_caches():
+	os.sync()
+	with open('/proc/sys/vm/drop_caches', 'w') as f:
+		f.write('3\n')
+
+def repair_once(tools, img, report, no_modify, extra_opts):
+	'''Run repair and return its exit code, wall time and peak RSS.'''
+	cmd = [tools.repair, '-f', '-o', 'report=' + report]
+	if no_modify:
+		cmd.append('-n')
+	cmd += extra_opts + [img]
+
+	start = time.monotonic()
+	proc = subprocess.Popen(cmd, stdout = subprocess.DEVNULL,
+			stderr = subprocess.DEVNULL)
+	(pid, status, ru) = os.wait4(proc.pid, 0)
+	wall = time.monotonic() - start
+	proc.returncode = os.waitstatus_to_exitcode(status)
+
+	result = {
+		'exit': proc.returncode,
+		'wall_seconds': wall,
+		'max_rss_kb': ru.ru_maxrss,
+	}
+	try:
+		with open(report) as f:
+			result['report'] = json.load(f)
+	except (OSError, ValueError):
+		result['report'] = None
+	return result
+
+def run_dump(tools, args, dump):
+	name = os.path.basename(dump)[:-3]
+	img = os.path.join(args.scratch, name + '.img')
+	report = os.path.join(args.scratch, name + '.report.json')
+	results = []
+
+	for (mode, no_modify) in (('check', True), ('repair', False)):
+		runs = []
+		for i in range(args.runs):
+			# repair changes the image, so always start afresh
+			if os.path.exists(img):
+				os.unlink(img)
+			run_cmd([tools.mdrestore, dump, img])
+			if args.drop_caches:
+				drop_caches()
+			r = repair_once(tools, img, report, no_modify,
+					args.repair_opts)
+			print('%-14s %-6s run %d: exit %d, %.2f s, %d MiB' % (
+				name, mode, i + 1, r['exit'],
+				r['wall_seconds'], r['max_rss_kb'] // 1024))
+			runs.append(r)
+		results.append({'fs': name, 'mode': mode, 'runs': runs})
+
+	for path in (img, report):
+		if os.path.exists(path):
+			os.unlink(path)
+	return results
+
+def repair_version(tools):
+	try:
+		return subprocess.run([tools.repair, '-V'],
+				stdout = subprocess.PIPE,
+				universal_newlines = True).stdout.strip()
+	except OSError:
+		return None
+
+def cmd_run(args):
+	tools = Tools(args)
+	dumps = sorted(os.path.join(args.corpus, f)
+			for f in os.listdir(args.corpus) if f.endswith('.md'))
+	if not dumps:
+		print('%s: no metadumps found' % args.corpus, file = sys.stderr)
+		return 1
+	if args.drop_caches and os.geteuid() != 0:
+		print('must be root to drop caches', file = sys.stderr)
+		return 1
+
+	out = {
+		'repair': repair_version(tools),
+		'host': platform.node(),
+		'kernel': platform.release(),
+		'cpus': os.cpu_count(),
+		'date': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+		'repair_options': args.repair_opts,
+		'results': [],
+	}
+	os.makedirs(args.scratch, exist_ok = True)
+	for dump in dumps:
+		try:
+			out['results'] += run_dump(tools, args, dump)
+		except (OSError, subprocess.CalledProcessError) as e:
+			print('%s: %s' % (dump, e), file = sys.stderr)
+
+	with open(args.output, 'w') as f:
+		json.dump(out, f, indent = 1)
+		f.write('\n')
+	return 0
+
+# Comparing
+
+def summarize(entry):
+	'''Reduce an entry's runs to median figures per phase.'''
+	phases = {}
+	for r in entry['runs']:
+		rows = {'total': {
+			'wall_seconds': r['wall_seconds'],
+			'max_rss_kb': r['max_rss_kb'],
+		}}
+		rep = r['report']
+		if rep:
+			for p in rep['phases']:
+				if p['state'] == 'done':
+					rows['phase%d' % p['phase']] = p
+			rows['total'] = dict(rep['total'], **rows['total'])
+		for (phase, row) in rows.items():
+			acc = phases.setdefault(phase, {})
+			for field in REPORT_FIELDS:
+				if field in row:
+					acc.setdefault(field, []).append(row[field])
+	return {phase: {f: statistics.median(v) for (f, v) in acc.items()}
+			for (phase, acc) in phases.items()}
+
+def load_results(path):
+	with open(path) as f:
+		data = json.load(f)
+	return (data, {(e['fs'], e['mode']): summarize(e)
+			for e in data['results']})
+
+def change(old, new):
+	if not old:
+		return float('inf') if new else 0.0
+	return (new - old) * 100.0 / old
+
+def cmd_compare(args):
+	try:
+		(old_data, old) = load_results(args.old)
+		(new_data, new) = load_results(args.new)
+	except (OSError, ValueError, KeyError) as e:
+		print(e, file = sys.stderr)
+		return 1
+
+	print('old: %s' % old_data.get('repair'))
+	print('new: %s' % new_data.get('repair'))
+	if old_data.get('host') != new_data.get('host'):
+		print('warning: results are from different hosts')
+
+	# what to compare, how to print it, and the smallest change that counts
+	metrics = (
+		('wall_seconds', '%8.2f s', 0.05),
+		('max_rss_kb', '%7d KiB', 1024),
+		('read_bytes', '%8d B', 1 << 20),
+		('reads', '%10d', 100),
+	)
+	regressions = 0
+	print('%-14s %-6s %-7s %-12s %14s %14s %8s' % ('fs', 'mode', 'phase',
+		'metric', 'old', 'new', 'change'))
+	for key in sorted(set(old) & set(new)):
+		phases = sorted(set(old[key]) & set(new[key]),
+				key = lambda p: (p == 'total', p))
+		for phase in phases:
+			if phase != 'total' and not args.phases:
+				continue
+			for (field, fmt, floor) in metrics:
+				o = old[key][phase].get(field)
+				n = new[key][phase].get(field)
+				if o is None or n is None:
+					continue
+				pct = change(o, n)
+				worse = pct > args.threshold and n - o > floor
+				regressions += worse
+				print('%-14s %-6s %-7s %-12s %14s %14s %+7.1f%%%s' % (
+					key[0], key[1], phase, field,
+					fmt % o, fmt % n, pct,
+					' *' if worse else ''))
+	for key in sorted(set(old) ^ set(new)):
+		print('%s %s: only in %s' % (key[0], key[1],
+			'old' if key in old else 'new'))
+
+	if regressions:
+		print('%d figures got worse by more than %g%%.' % (regressions,
+			args.threshold))
+		return 1
+	return 0
+
+def main():
+	parser = argparse.ArgumentParser(
+			description = 'Regression benchmark for xfs_repair.')
+	sub = parser.add_subparsers(dest = 'command')
+	sub.required = True
+
+	p = sub.add_parser('generate',
+			help = 'Build synthetic filesystems and save their metadumps.')
+	p.add_argument('corpus', help = 'Directory to save metadumps in.')
+	p.add_argument('-S', '--scenario', action = 'append',
+			choices = sorted(SCENARIOS),
+			help = 'Only build this filesystem; may be repeated.')
+	p.add_argument('--scale', type = float, default = 1.0,
+			help = 'Multiply the number of files and blocks by this.')
+	p.add_argument('-s', '--scratch', default = None,
+			help = 'Where to build the filesystem images.')
+	p.add_argument('--mkfs', help = 'mkfs.xfs to run.')
+	p.add_argument('--db', help = 'xfs_db to run.')
+	p.add_argument('--io', help = 'xfs_io to run.')
+	p.set_defaults(func = cmd_generate)
+
+	p = sub.add_parser('run', help = 'Time repair on every metadump.')
+	p.add_argument('corpus', help = 'Directory of metadumps.')
+	p.add_argument('-o', '--output', required = True,
+			help = 'Results file to write.')
+	p.add_argument('-s', '--scratch', default = tempfile.gettempdir(),
+			help = 'Where to restore the metadumps.')
+	p.add_argument('-r', '--runs', type = int, default = 3,
+			help = 'Times to repeat each repair.')
+	p.add_argument('--drop-caches', action = 'store_true',
+			help = 'Drop the page cache before each repair.')
+	p.add_argument('-O', '--repair-opt', dest = 'repair_opts',
+			action = 'append', default = [],
+			help = 'Extra argument for xfs_repair; may be repeated.')
+	p.add_argument('--repair', help = 'xfs_repair to run.')
+	p.add_argument('--mdrestore', help = 'xfs_mdrestore to run.')
+	p.set_defaults(func = cmd_run)
+
+	p = sub.add_parser('compare', help = 'Compare two results files.')
+	p.add_argument('old', help = 'Results from before.')
+	p.add_argument('new', help = 'Results from after.')
+	p.add_argument('-t', '--threshold', type = float, default = 5.0,
+			help = 'Percentage by which a figure may grow unflagged.')
+	p.add_argument('-p', '--phases', action = 'store_true',
+			help = 'Compare each phase, not just the totals.')
+	p.set_defaults(func = cmd_compare)
+
+	args = parser.parse_args()
+	return args.func(args)
+
+if __name__ == '__main__':
+	sys.exit(main())